@@ -29,9 +29,9 @@
 #include <capnp/serialize.h>
 #include <capnp/serialize-packed.h>
 #include <kj/debug.h>
-#if HAVE_SNAPPY
-#include <capnp/serialize-snappy.h>
-#endif  // HAVE_SNAPPY
+#if CAPNP_HAS_ZLIB
+#include <capnp/serialize-compressed.h>
+#endif  // CAPNP_HAS_ZLIB
 #include <thread>
 
 namespace capnp {
@@ -100,32 +100,43 @@ struct Packed {
   }
 };
 
-#if HAVE_SNAPPY
-static byte snappyReadBuffer[SNAPPY_BUFFER_SIZE];
-static byte snappyWriteBuffer[SNAPPY_BUFFER_SIZE];
-static byte snappyCompressedBuffer[SNAPPY_COMPRESSED_BUFFER_SIZE];
+#if CAPNP_HAS_ZLIB
+inline MessageCompressor& deflateCompressor() {
+  // Compressors aren't thread-safe, and the async pipe benchmark receives on a separate thread.
+  static thread_local MessageCompressor compressor(nullptr, Z_BEST_SPEED);
+  return compressor;
+}
 
-struct SnappyCompressed {
-  typedef BufferedInputStreamWrapper BufferedInput;
-  typedef SnappyPackedMessageReader MessageReader;
+struct DeflateCompressed {
+  typedef kj::BufferedInputStreamWrapper BufferedInput;
+
+  class MessageReader: public CompressedMessageReader {
+  public:
+    MessageReader(kj::InputStream& input,
+                  ReaderOptions options = ReaderOptions(),
+                  kj::ArrayPtr<word> scratchSpace = nullptr)
+      : CompressedMessageReader(input, deflateCompressor(), options, scratchSpace) {}
+  };
 
-  class ArrayMessageReader: private ArrayInputStream, public SnappyPackedMessageReader {
+  class ArrayMessageReader: public CompressedMessageReader {
   public:
     ArrayMessageReader(kj::ArrayPtr<const byte> array,
                        ReaderOptions options = ReaderOptions(),
                        kj::ArrayPtr<word> scratchSpace = nullptr)
-      : ArrayInputStream(array),
-        SnappyPackedMessageReader(static_cast<ArrayInputStream&>(*this), options, scratchSpace,
-                                  kj::arrayPtr(snappyReadBuffer, SNAPPY_BUFFER_SIZE)) {}
+      : ArrayMessageReader(kj::ArrayInputStream(array), options, scratchSpace) {}
+
+  private:
+    ArrayMessageReader(kj::ArrayInputStream&& input, ReaderOptions options,
+                       kj::ArrayPtr<word> scratchSpace)
+      : CompressedMessageReader(input, deflateCompressor(), options, scratchSpace) {}
+    // CompressedMessageReader reads the whole frame up front, so the stream can be a temporary.
   };
 
-  static inline void write(OutputStream& output, MessageBuilder& builder) {
-    writeSnappyPackedMessage(output, builder,
-        kj::arrayPtr(snappyWriteBuffer, SNAPPY_BUFFER_SIZE),
-        kj::arrayPtr(snappyCompressedBuffer, SNAPPY_COMPRESSED_BUFFER_SIZE));
+  static inline void write(kj::OutputStream& output, MessageBuilder& builder) {
+    writeCompressedMessage(output, builder, deflateCompressor());
   }
 };
-#endif  // HAVE_SNAPPY
+#endif  // CAPNP_HAS_ZLIB
 
 // =======================================================================================
 
@@ -404,9 +415,9 @@ struct BenchmarkMethods {
 struct BenchmarkTypes {
   typedef capnp::Uncompressed Uncompressed;
   typedef capnp::Packed Packed;
-#if HAVE_SNAPPY
-  typedef capnp::SnappyCompressed SnappyCompressed;
-#endif  // HAVE_SNAPPY
+#if CAPNP_HAS_ZLIB
+  typedef capnp::DeflateCompressed DeflateCompressed;
+#endif  // CAPNP_HAS_ZLIB
 
   typedef capnp::UseScratch ReusableResources;
   typedef capnp::NoScratch SingleUseResources;
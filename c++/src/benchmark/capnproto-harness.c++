@@ -0,0 +1,220 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include "capnproto-carsales.h"
+#include "capnproto-catrank.h"
+#include "capnproto-eval.h"
+#include "harness.h"
+#include <capnp/any.h>
+#include <string.h>
+#include <memory>
+
+CAPNP_BENCHMARK_COUNT_ALLOCATIONS
+
+namespace capnp {
+namespace benchmark {
+namespace capnp {
+namespace {
+
+template <typename TestCase>
+harness::Op passByObject() {
+  // Like "object" mode in benchmarkMain(), with fresh message builders for every request.
+  return []() {
+    BenchmarkMethods<TestCase, NoScratch, Uncompressed>::passByObject(1, false);
+  };
+}
+
+template <typename TestCase, typename Compression>
+harness::Op passByBytes() {
+  // Like "bytes" mode in benchmarkMain(): the request and response are each written to a buffer
+  // and read back.  Each thread has its own buffers.
+  auto buffer = std::make_shared<std::vector<word>>(2 * SCRATCH_SIZE);
+
+  return [buffer]() {
+    auto requestBytes = kj::arrayPtr(buffer->data(), SCRATCH_SIZE).asBytes();
+    auto responseBytes = kj::arrayPtr(buffer->data() + SCRATCH_SIZE, SCRATCH_SIZE).asBytes();
+
+    MallocMessageBuilder requestBuilder;
+    typename TestCase::Expectation expected = TestCase::setupRequest(
+        requestBuilder.initRoot<typename TestCase::Request>());
+    kj::ArrayOutputStream requestOutput(requestBytes);
+    Compression::write(requestOutput, requestBuilder);
+    typename Compression::ArrayMessageReader requestReader(requestOutput.getArray());
+
+    MallocMessageBuilder responseBuilder;
+    TestCase::handleRequest(requestReader.template getRoot<typename TestCase::Request>(),
+                            responseBuilder.initRoot<typename TestCase::Response>());
+    kj::ArrayOutputStream responseOutput(responseBytes);
+    Compression::write(responseOutput, responseBuilder);
+    typename Compression::ArrayMessageReader responseReader(responseOutput.getArray());
+
+    if (!TestCase::checkResponse(
+        responseReader.template getRoot<typename TestCase::Response>(), expected)) {
+      throw std::logic_error("Incorrect response.");
+    }
+  };
+}
+
+std::shared_ptr<MallocMessageBuilder> makeParkingLot(uint carCount) {
+  auto message = std::make_shared<MallocMessageBuilder>();
+  for (auto car: message->initRoot<ParkingLot>().initCars(carCount)) {
+    randomCar(car);
+  }
+  return message;
+}
+
+harness::Op readFields() {
+  // Reads every primitive field of a struct and its sub-struct.
+  auto message = makeParkingLot(1);
+  auto car = message->getRoot<ParkingLot>().asReader().getCars()[0];
+  return [message, car]() {
+    auto engine = car.getEngine();
+    harness::doNotOptimize(
+        (uint)car.getColor() + car.getSeats() + car.getDoors() + car.getLength() +
+        car.getWidth() + car.getHeight() + car.getWeight() + car.getFuelCapacity() +
+        car.getFuelLevel() + car.getHasPowerWindows() + car.getHasPowerSteering() +
+        car.getHasCruiseControl() + car.getCupHolders() + car.getHasNavSystem() +
+        engine.getHorsepower() + engine.getCylinders() + engine.getCc() +
+        engine.getUsesGas() + engine.getUsesElectric());
+  };
+}
+
+harness::Op writeFields() {
+  // Writes every primitive field of a struct and its sub-struct.
+  auto message = makeParkingLot(1);
+  auto car = message->getRoot<ParkingLot>().getCars()[0];
+  return [message, car]() mutable {
+    car.setColor(Color::RED);
+    car.setSeats(5);
+    car.setDoors(4);
+    car.setLength(200);
+    car.setWidth(70);
+    car.setHeight(60);
+    car.setWeight(4000);
+    car.setFuelCapacity(15.5);
+    car.setFuelLevel(7.25);
+    car.setHasPowerWindows(true);
+    car.setHasPowerSteering(true);
+    car.setHasCruiseControl(false);
+    car.setCupHolders(8);
+    car.setHasNavSystem(true);
+    auto engine = car.getEngine();
+    engine.setHorsepower(300);
+    engine.setCylinders(6);
+    engine.setCc(3000);
+    engine.setUsesGas(true);
+    engine.setUsesElectric(false);
+    harness::doNotOptimize(car);
+  };
+}
+
+harness::Op iterateList() {
+  // Iterates over a list of 100 structs, reading a field of each one and of its nested list.
+  auto message = makeParkingLot(100);
+  auto cars = message->getRoot<ParkingLot>().asReader().getCars();
+  return [message, cars]() {
+    uint64_t total = 0;
+    for (auto car: cars) {
+      total += car.getWeight();
+      for (auto wheel: car.getWheels()) {
+        total += wheel.getDiameter();
+      }
+    }
+    harness::doNotOptimize(total);
+  };
+}
+
+harness::Op copyMessage() {
+  // Deep-copies a message of 100 structs into a new builder.
+  auto message = makeParkingLot(100);
+  return [message]() {
+    MallocMessageBuilder copy;
+    copy.setRoot(message->getRoot<ParkingLot>().asReader());
+    harness::doNotOptimize(copy);
+  };
+}
+
+harness::Op compareAnyStruct() {
+  // Structurally compares two separately-built, identical messages of 100 structs.
+  auto a = makeParkingLot(100);
+  auto b = std::make_shared<MallocMessageBuilder>();
+  b->setRoot(a->getRoot<ParkingLot>().asReader());
+  auto left = a->getRoot<AnyStruct>().asReader();
+  auto right = b->getRoot<AnyStruct>().asReader();
+  return [a, b, left, right]() {
+    harness::doNotOptimize(left.equals(right));
+  };
+}
+
+harness::Op compareCanonical() {
+  // The same comparison done the old way: canonicalize both sides, then memcmp.
+  auto a = makeParkingLot(100);
+  auto b = std::make_shared<MallocMessageBuilder>();
+  b->setRoot(a->getRoot<ParkingLot>().asReader());
+  auto left = a->getRoot<AnyStruct>().asReader();
+  auto right = b->getRoot<AnyStruct>().asReader();
+  return [a, b, left, right]() mutable {
+    auto l = left.canonicalize();
+    auto r = right.canonicalize();
+    harness::doNotOptimize(l.size() == r.size() &&
+        memcmp(l.begin(), r.begin(), l.asBytes().size()) == 0);
+  };
+}
+
+harness::Op hashAnyStruct() {
+  // Structurally hashes a message of 100 structs.
+  auto message = makeParkingLot(100);
+  auto root = message->getRoot<AnyStruct>().asReader();
+  return [message, root]() {
+    harness::doNotOptimize(root.hashCode());
+  };
+}
+
+}  // namespace
+}  // namespace capnp
+}  // namespace benchmark
+}  // namespace capnp
+
+int main(int argc, char* argv[]) {
+  using namespace capnp::benchmark::capnp;
+  capnp::benchmark::harness::Harness harness(argc, argv);
+
+  harness.add("layout/getters", readFields);
+  harness.add("layout/setters", writeFields);
+  harness.add("layout/list-iteration", iterateList);
+  harness.add("layout/copy-message", copyMessage);
+  harness.add("layout/any-equals", compareAnyStruct);
+  harness.add("layout/any-equals-canonical", compareCanonical);
+  harness.add("layout/any-hash", hashAnyStruct);
+
+  harness.add("carsales/object", passByObject<CarSalesTestCase>);
+  harness.add("carsales/bytes", passByBytes<CarSalesTestCase, Uncompressed>);
+  harness.add("carsales/packed", passByBytes<CarSalesTestCase, Packed>);
+  harness.add("catrank/object", passByObject<CatRankTestCase>);
+  harness.add("catrank/bytes", passByBytes<CatRankTestCase, Uncompressed>);
+  harness.add("catrank/packed", passByBytes<CatRankTestCase, Packed>);
+  harness.add("eval/object", passByObject<ExpressionTestCase>);
+  harness.add("eval/bytes", passByBytes<ExpressionTestCase, Uncompressed>);
+  harness.add("eval/packed", passByBytes<ExpressionTestCase, Packed>);
+
+  return harness.run();
+}
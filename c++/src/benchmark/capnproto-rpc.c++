@@ -0,0 +1,514 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// Benchmarks RPC over a two-party connection: call throughput at a given concurrency, latency of
+// pipelined call chains, promise resolution, and streaming throughput. It can also record the
+// client's side of the connection -- the raw stream of rpc.capnp messages -- and replay such a
+// capture against a fresh server as a load generator.
+
+#include "rpc-bench.capnp.h"
+#include <capnp/rpc-twoparty.h>
+#include <capnp/rpc.capnp.h>
+#include <capnp/serialize.h>
+#include <capnp/serialize-async.h>
+#include <kj/async-io.h>
+#include <kj/debug.h>
+#include <kj/io.h>
+#include <kj/main.h>
+#include <kj/vector.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <chrono>
+
+namespace capnp {
+namespace benchmark {
+namespace capnp {
+
+kj::TimePoint now() {
+  return kj::origin<kj::TimePoint>() + std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count() * kj::NANOSECONDS;
+}
+
+class BenchServiceImpl final: public BenchService::Server {
+protected:
+  kj::Promise<void> echo(EchoContext context) override {
+    context.getResults().setPayload(context.getParams().getPayload());
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> next(NextContext context) override {
+    context.getResults().setService(thisCap());
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> resolveLater(ResolveLaterContext context) override {
+    context.getResults().setService(kj::evalLater(kj::mvCapture(thisCap(),
+        [](BenchService::Client&& self) { return kj::mv(self); })));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> write(WriteContext context) override {
+    bytesWritten += context.getParams().getChunk().size();
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> sync(SyncContext context) override {
+    context.getResults().setBytesWritten(bytesWritten);
+    return kj::READY_NOW;
+  }
+
+private:
+  uint64_t bytesWritten = 0;
+};
+
+// =======================================================================================
+
+enum class Transport {
+  MEMORY,      // kj::newTwoWayPipe() to a server on the same event loop.
+  SOCKETPAIR,  // A socketpair to a server thread.
+  TCP          // A loopback TCP connection to a server thread.
+};
+
+class BenchServer {
+  // Hosts a BenchServiceImpl reachable over the given transport.
+
+public:
+  BenchServer(kj::AsyncIoContext& io, Transport transport)
+      : io(io), transport(transport), localServer(kj::heap<BenchServiceImpl>()) {
+    switch (transport) {
+      case Transport::MEMORY:
+        break;
+
+      case Transport::SOCKETPAIR:
+        thread = io.provider->newPipeThread(
+            [](kj::AsyncIoProvider& provider, kj::AsyncIoStream& stream,
+               kj::WaitScope& waitScope) {
+          TwoPartyVatNetwork network(stream, rpc::twoparty::Side::SERVER);
+          auto rpcSystem = makeRpcServer(network, kj::heap<BenchServiceImpl>());
+          network.onDisconnect().wait(waitScope);
+        });
+        break;
+
+      case Transport::TCP:
+        thread = io.provider->newPipeThread(
+            [](kj::AsyncIoProvider& provider, kj::AsyncIoStream& control,
+               kj::WaitScope& waitScope) {
+          auto listener = provider.getNetwork().parseAddress("127.0.0.1")
+              .wait(waitScope)->listen();
+          uint port = listener->getPort();
+          control.write(&port, sizeof(port)).wait(waitScope);
+
+          // Serve until the control pipe is closed.
+          TwoPartyServer server(kj::heap<BenchServiceImpl>());
+          char dummy;
+          control.tryRead(&dummy, 1, 1).ignoreResult()
+              .exclusiveJoin(server.listen(*listener))
+              .wait(waitScope);
+        });
+        KJ_ASSERT_NONNULL(thread).pipe->read(&port, sizeof(port)).wait(io.waitScope);
+        break;
+    }
+  }
+
+  kj::Own<kj::AsyncIoStream> connect() {
+    // Returns a new raw connection to the server. MEMORY and SOCKETPAIR support only one. The
+    // connection must be destroyed before the BenchServer.
+
+    switch (transport) {
+      case Transport::MEMORY: {
+        auto pipe = io.provider->newTwoWayPipe();
+        localServer.accept(kj::mv(pipe.ends[1]));
+        return kj::mv(pipe.ends[0]);
+      }
+
+      case Transport::SOCKETPAIR:
+        return kj::mv(KJ_ASSERT_NONNULL(thread).pipe);
+
+      case Transport::TCP:
+        return io.provider->getNetwork().parseAddress("127.0.0.1", port)
+            .wait(io.waitScope)->connect().wait(io.waitScope);
+    }
+    KJ_UNREACHABLE;
+  }
+
+private:
+  kj::AsyncIoContext& io;
+  Transport transport;
+  TwoPartyServer localServer;
+  kj::Maybe<kj::AsyncIoProvider::PipeThread> thread;
+  uint port = 0;
+};
+
+class RecordingStream final: public kj::AsyncIoStream {
+  // Passes everything through to `inner`, and also appends everything written to `file`.
+
+public:
+  RecordingStream(kj::Own<kj::AsyncIoStream> inner, kj::AutoCloseFd file)
+      : inner(kj::mv(inner)), file(kj::mv(file)), output(this->file.get()) {}
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    return inner->tryRead(buffer, minBytes, maxBytes);
+  }
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    output.write(buffer, size);
+    return inner->write(buffer, size);
+  }
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    output.write(pieces);
+    return inner->write(pieces);
+  }
+  void shutdownWrite() override { inner->shutdownWrite(); }
+  void abortRead() override { inner->abortRead(); }
+
+private:
+  kj::Own<kj::AsyncIoStream> inner;
+  kj::AutoCloseFd file;
+  kj::FdOutputStream output;
+};
+
+kj::AutoCloseFd openFile(kj::StringPtr path, int flags) {
+  int fd;
+  KJ_SYSCALL(fd = open(path.cStr(), flags | O_CLOEXEC, 0666), path);
+  return kj::AutoCloseFd(fd);
+}
+
+// =======================================================================================
+
+class RpcBenchmarkMain {
+public:
+  RpcBenchmarkMain(kj::ProcessContext& context): context(context) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "Cap'n Proto RPC benchmark",
+          "Measures RPC against a server in this process. <mode> is one of:\n"
+          "  calls: echo() calls, keeping --concurrency of them in flight.\n"
+          "  chain: chains of --depth pipelined next() calls ending in an echo().\n"
+          "  resolve: echo() calls pipelined on a promise the server resolves later.\n"
+          "  stream: streaming write() calls of --size bytes each, then a sync().\n"
+          "  replay: sends the capture <file>, made with --record, over --iterations new "
+          "connections.")
+        .addOptionWithArg({'t', "transport"}, KJ_BIND_METHOD(*this, setTransport), "<transport>",
+            "How to reach the server: \"memory\" (an in-process pipe, on the same event loop), "
+            "\"socketpair\" (a server thread; the default), or \"tcp\" (a server thread "
+            "listening on loopback).")
+        .addOptionWithArg({'n', "iterations"}, KJ_BIND_METHOD(*this, setIterations), "<count>",
+            "Number of calls, chains, chunks, or replays. Default: 100000.")
+        .addOptionWithArg({'c', "concurrency"}, KJ_BIND_METHOD(*this, setConcurrency), "<count>",
+            "Calls to keep in flight in `calls` mode. Default: 1.")
+        .addOptionWithArg({'d', "depth"}, KJ_BIND_METHOD(*this, setDepth), "<count>",
+            "Length of each chain in `chain` mode. Default: 8.")
+        .addOptionWithArg({'s', "size"}, KJ_BIND_METHOD(*this, setSize), "<bytes>",
+            "Payload size of echo() and write() calls. Default: 64.")
+        .addOptionWithArg({'r', "record"}, KJ_BIND_METHOD(*this, setRecord), "<file>",
+            "Write everything the client sends to <file>, for later use with `replay`.")
+        .expectArg("<mode>", KJ_BIND_METHOD(*this, setMode))
+        .expectOptionalArg("<file>", KJ_BIND_METHOD(*this, setReplayFile))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+  kj::MainBuilder::Validity setTransport(kj::StringPtr name) {
+    if (name == "memory") {
+      transport = Transport::MEMORY;
+    } else if (name == "socketpair") {
+      transport = Transport::SOCKETPAIR;
+    } else if (name == "tcp") {
+      transport = Transport::TCP;
+    } else {
+      return "unknown transport";
+    }
+    return true;
+  }
+
+  kj::MainBuilder::Validity setIterations(kj::StringPtr arg) {
+    return parseCount(arg, iterations);
+  }
+  kj::MainBuilder::Validity setConcurrency(kj::StringPtr arg) {
+    return parseCount(arg, concurrency);
+  }
+  kj::MainBuilder::Validity setDepth(kj::StringPtr arg) {
+    return parseCount(arg, depth);
+  }
+  kj::MainBuilder::Validity setSize(kj::StringPtr arg) {
+    char* end;
+    size = strtoull(arg.cStr(), &end, 0);
+    if (arg.size() == 0 || *end != '\0') return "not a number";
+    return true;
+  }
+
+  kj::MainBuilder::Validity setRecord(kj::StringPtr path) {
+    recordPath = path;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setMode(kj::StringPtr name) {
+    if (name == "calls" || name == "chain" || name == "resolve" || name == "stream" ||
+        name == "replay") {
+      mode = name;
+      return true;
+    } else {
+      return "unknown mode";
+    }
+  }
+
+  kj::MainBuilder::Validity setReplayFile(kj::StringPtr path) {
+    replayPath = path;
+    return true;
+  }
+
+  kj::MainBuilder::Validity run() {
+    if ((mode == "replay") != (replayPath != nullptr)) {
+      return "a <file> is required by, and only accepted by, `replay`";
+    }
+    if (mode == "replay" && recordPath != nullptr) {
+      return "can't --record a replay";
+    }
+
+    auto io = kj::setupAsyncIo();
+
+    if (mode == "replay") {
+      replay(io, KJ_ASSERT_NONNULL(replayPath));
+      return true;
+    }
+
+    BenchServer server(io, transport);
+    kj::Own<kj::AsyncIoStream> stream = server.connect();
+    KJ_IF_MAYBE(path, recordPath) {
+      stream = kj::heap<RecordingStream>(
+          kj::mv(stream), openFile(*path, O_WRONLY | O_CREAT | O_TRUNC));
+    }
+
+    TwoPartyClient client(*stream);
+    auto service = client.bootstrap().castAs<BenchService>();
+
+    // Make sure the connection is up before starting the clock.
+    service.syncRequest().send().wait(io.waitScope);
+
+    if (mode == "calls") {
+      benchCalls(io, service);
+    } else if (mode == "chain") {
+      benchChain(io, service);
+    } else if (mode == "resolve") {
+      benchResolve(io, service);
+    } else if (mode == "stream") {
+      benchStream(io, service);
+    }
+
+    return true;
+  }
+
+private:
+  kj::ProcessContext& context;
+  Transport transport = Transport::SOCKETPAIR;
+  uint64_t iterations = 100000;
+  uint64_t concurrency = 1;
+  uint64_t depth = 8;
+  size_t size = 64;
+  kj::Maybe<kj::StringPtr> recordPath;
+  kj::StringPtr mode;
+  kj::Maybe<kj::StringPtr> replayPath;
+
+  kj::MainBuilder::Validity parseCount(kj::StringPtr arg, uint64_t& result) {
+    char* end;
+    result = strtoull(arg.cStr(), &end, 0);
+    if (arg.size() == 0 || *end != '\0' || result == 0) return "expected a positive number";
+    return true;
+  }
+
+  void print(kj::StringPtr line) {
+    kj::FdOutputStream(STDOUT_FILENO).write({line.asBytes(), kj::StringPtr("\n").asBytes()});
+  }
+
+  void report(kj::StringPtr what, uint64_t count, kj::Duration elapsed,
+              const RpcLatencyHistogram& latencies) {
+    double seconds = double(elapsed / kj::NANOSECONDS) / 1e9;
+    auto us = [](kj::Duration d) { return double(d / kj::NANOSECONDS) / 1000; };
+    print(kj::str(
+        mode, ": ", count, ' ', what, " in ", seconds, " s = ", count / seconds, ' ', what,
+        "/s; latency us: p50=", us(latencies.getPercentile(50)),
+        " p90=", us(latencies.getPercentile(90)),
+        " p99=", us(latencies.getPercentile(99)),
+        " max=", us(latencies.getMax())));
+  }
+
+  kj::Promise<void> callLoop(BenchService::Client& service, uint64_t& remaining,
+                             RpcLatencyHistogram& latencies) {
+    if (remaining == 0) return kj::READY_NOW;
+    --remaining;
+
+    auto request = service.echoRequest();
+    request.initPayload(size);
+    auto start = now();
+    return request.send().then(
+        [this,&service,&remaining,&latencies,start](Response<BenchService::EchoResults>&&) {
+      latencies.record(now() - start);
+      return callLoop(service, remaining, latencies);
+    });
+  }
+
+  void benchCalls(kj::AsyncIoContext& io, BenchService::Client& service) {
+    RpcLatencyHistogram latencies;
+    uint64_t remaining = iterations;
+    auto start = now();
+
+    auto loops = kj::heapArrayBuilder<kj::Promise<void>>(concurrency);
+    for (uint64_t i = 0; i < concurrency; i++) {
+      loops.add(callLoop(service, remaining, latencies));
+    }
+    kj::joinPromises(loops.finish()).wait(io.waitScope);
+
+    report("calls", iterations, now() - start, latencies);
+  }
+
+  void benchChain(kj::AsyncIoContext& io, BenchService::Client& service) {
+    RpcLatencyHistogram latencies;
+    auto start = now();
+
+    for (uint64_t i = 0; i < iterations; i++) {
+      auto chainStart = now();
+
+      // Each next() is sent on the pipelined result of the last, so the whole chain goes out
+      // before any of it returns.
+      kj::Vector<RemotePromise<BenchService::NextResults>> hops(depth);
+      BenchService::Client target = service;
+      for (uint64_t j = 0; j < depth; j++) {
+        hops.add(target.nextRequest().send());
+        target = hops.back().getService();
+      }
+      auto request = target.echoRequest();
+      request.initPayload(size);
+      request.send().wait(io.waitScope);
+
+      latencies.record(now() - chainStart);
+    }
+
+    report("chains", iterations, now() - start, latencies);
+  }
+
+  void benchResolve(kj::AsyncIoContext& io, BenchService::Client& service) {
+    RpcLatencyHistogram latencies;
+    auto start = now();
+
+    for (uint64_t i = 0; i < iterations; i++) {
+      auto callStart = now();
+
+      auto promise = service.resolveLaterRequest().send();
+      auto request = promise.getService().echoRequest();
+      request.initPayload(size);
+      request.send().wait(io.waitScope);
+      promise.wait(io.waitScope).getService().whenResolved().wait(io.waitScope);
+
+      latencies.record(now() - callStart);
+    }
+
+    report("resolutions", iterations, now() - start, latencies);
+  }
+
+  void benchStream(kj::AsyncIoContext& io, BenchService::Client& service) {
+    RpcLatencyHistogram latencies;
+    auto start = now();
+
+    for (uint64_t i = 0; i < iterations; i++) {
+      auto request = service.writeRequest();
+      request.initChunk(size);
+      auto writeStart = now();
+      request.send().wait(io.waitScope);
+      latencies.record(now() - writeStart);
+    }
+
+    auto bytesWritten = service.syncRequest().send().wait(io.waitScope).getBytesWritten();
+    KJ_ASSERT(bytesWritten == iterations * size, bytesWritten);
+
+    auto elapsed = now() - start;
+    report("chunks", iterations, elapsed, latencies);
+    print(kj::str(
+        mode, ": ", bytesWritten / (double(elapsed / kj::NANOSECONDS) / 1e9) / (1 << 20),
+        " MiB/s"));
+  }
+
+  void replay(kj::AsyncIoContext& io, kj::StringPtr path) {
+    // Reads the capture, which is just the sequence of framed messages the client sent, and then
+    // sends it over new connections as fast as the server will take it. A pass is done when every
+    // Bootstrap and Call in it has been answered.
+
+    kj::Array<word> capture;
+    {
+      auto fd = openFile(path, O_RDONLY);
+      struct stat stats;
+      KJ_SYSCALL(fstat(fd, &stats), path);
+      KJ_REQUIRE(stats.st_size % sizeof(word) == 0, "capture is truncated", path);
+      capture = kj::heapArray<word>(stats.st_size / sizeof(word));
+      kj::FdInputStream(kj::mv(fd)).read(capture.begin(), stats.st_size);
+    }
+
+    uint64_t messageCount = 0;
+    uint64_t questionCount = 0;
+    for (kj::ArrayPtr<const word> rest = capture; rest.size() > 0;) {
+      FlatArrayMessageReader reader(rest);
+      auto message = reader.getRoot<rpc::Message>();
+      if (message.isBootstrap() || message.isCall()) ++questionCount;
+      ++messageCount;
+      rest = kj::arrayPtr(reader.getEnd(), rest.end());
+    }
+
+    RpcLatencyHistogram latencies;
+    auto start = now();
+
+    for (uint64_t i = 0; i < iterations; i++) {
+      auto passStart = now();
+      {
+        BenchServer server(io, transport);
+        auto stream = server.connect();
+
+        uint64_t returns = 0;
+        auto receiving = receiveReturns(*stream, questionCount, returns).eagerlyEvaluate(nullptr);
+        stream->write(capture.begin(), capture.asBytes().size()).wait(io.waitScope);
+        receiving.wait(io.waitScope);
+      }
+      latencies.record(now() - passStart);
+    }
+
+    auto elapsed = now() - start;
+    report("passes", iterations, elapsed, latencies);
+    print(kj::str(
+        mode, ": ", messageCount, " messages and ", questionCount, " questions per pass; ",
+        iterations * messageCount / (double(elapsed / kj::NANOSECONDS) / 1e9), " messages/s"));
+  }
+
+  kj::Promise<void> receiveReturns(kj::AsyncIoStream& stream, uint64_t expected,
+                                   uint64_t& received) {
+    if (received == expected) return kj::READY_NOW;
+
+    return readMessage(stream).then(
+        [this,&stream,expected,&received](kj::Own<MessageReader>&& reader) {
+      if (reader->getRoot<rpc::Message>().isReturn()) ++received;
+      return receiveReturns(stream, expected, received);
+    });
+  }
+};
+
+}  // namespace capnp
+}  // namespace benchmark
+}  // namespace capnp
+
+KJ_MAIN(capnp::benchmark::capnp::RpcBenchmarkMain);
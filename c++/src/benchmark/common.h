@@ -47,10 +47,10 @@ namespace benchmark {
 // Use a 128-bit Xorshift algorithm.
 static inline uint32_t nextFastRand() {
   // These values are arbitrary. Any seed other than all zeroes is OK.
-  static uint32_t x = 0x1d2acd47;
-  static uint32_t y = 0x58ca3e14;
-  static uint32_t z = 0xf563f232;
-  static uint32_t w = 0x0bc76199;
+  static thread_local uint32_t x = 0x1d2acd47;
+  static thread_local uint32_t y = 0x58ca3e14;
+  static thread_local uint32_t z = 0xf563f232;
+  static thread_local uint32_t w = 0x0bc76199;
 
   uint32_t tmp = x ^ (x << 11);
   x = y;
@@ -265,11 +265,11 @@ uint64_t doBenchmark3(const std::string& mode, const std::string& reuse,
   } else if (compression == "packed") {
     return doBenchmark2<BenchmarkTypes, TestCase, typename BenchmarkTypes::Packed>(
         mode, reuse, iters);
-#if HAVE_SNAPPY
-  } else if (compression == "snappy") {
-    return doBenchmark2<BenchmarkTypes, TestCase, typename BenchmarkTypes::SnappyCompressed>(
+#if CAPNP_HAS_ZLIB
+  } else if (compression == "deflate") {
+    return doBenchmark2<BenchmarkTypes, TestCase, typename BenchmarkTypes::DeflateCompressed>(
         mode, reuse, iters);
-#endif  // HAVE_SNAPPY
+#endif  // CAPNP_HAS_ZLIB
   } else {
     fprintf(stderr, "Unknown compression mode: %s\n", compression.c_str());
     exit(1);
@@ -0,0 +1,336 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#pragma once
+
+#if defined(__GNUC__) && !defined(CAPNP_HEADER_WARNINGS)
+#pragma GCC system_header
+#endif
+
+// A harness for in-process benchmarks that are meant to be tracked over time, as opposed to the
+// whole-program comparisons made by runner.c++.  Each benchmark is a function performing one
+// operation.  The harness runs it on 1, 2, 4, ... threads up to the number of cores, and reports
+// throughput, per-operation latency percentiles, and heap allocations per operation, either as a
+// table or as JSON for CI.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace capnp {
+namespace benchmark {
+namespace harness {
+
+struct AllocationStats {
+  uint64_t count;
+  uint64_t bytes;
+};
+
+inline AllocationStats& threadAllocations() {
+  // Allocations made by the calling thread so far, as counted by the hooks that
+  // CAPNP_BENCHMARK_COUNT_ALLOCATIONS installs.
+  static thread_local AllocationStats stats;
+  return stats;
+}
+
+extern const bool COUNTING_ALLOCATIONS;
+// Defined by CAPNP_BENCHMARK_COUNT_ALLOCATIONS.  False where the hooks aren't supported.
+
+#if __GLIBC__
+#define CAPNP_BENCHMARK_COUNT_ALLOCATIONS \
+  extern "C" { \
+  void* __libc_malloc(size_t size); \
+  void* __libc_calloc(size_t count, size_t size); \
+  void* __libc_realloc(void* ptr, size_t size); \
+  void* malloc(size_t size) { \
+    auto& stats = ::capnp::benchmark::harness::threadAllocations(); \
+    ++stats.count; \
+    stats.bytes += size; \
+    return __libc_malloc(size); \
+  } \
+  void* calloc(size_t count, size_t size) { \
+    auto& stats = ::capnp::benchmark::harness::threadAllocations(); \
+    ++stats.count; \
+    stats.bytes += count * size; \
+    return __libc_calloc(count, size); \
+  } \
+  void* realloc(void* ptr, size_t size) { \
+    auto& stats = ::capnp::benchmark::harness::threadAllocations(); \
+    ++stats.count; \
+    stats.bytes += size; \
+    return __libc_realloc(ptr, size); \
+  } \
+  } \
+  const bool capnp::benchmark::harness::COUNTING_ALLOCATIONS = true;
+// Interposes malloc(), calloc() and realloc() -- and with them the default operator new -- to
+// count allocations per thread.  Use once, at global scope, in the file containing main().
+#else
+#define CAPNP_BENCHMARK_COUNT_ALLOCATIONS \
+  const bool capnp::benchmark::harness::COUNTING_ALLOCATIONS = false;
+#endif
+
+template <typename T>
+inline void doNotOptimize(const T& value) {
+  // Keeps the compiler from discarding the computation of `value`.
+#if __GNUC__
+  asm volatile("" : : "g"(value) : "memory");
+#else
+  static volatile const void* sink;
+  sink = &value;
+#endif
+}
+
+typedef std::function<void()> Op;
+typedef std::function<Op()> OpFactory;
+// An OpFactory is called once on each benchmark thread, on that thread, to set up the thread's
+// state; the Op it returns performs one operation.
+
+struct Result {
+  std::string name;
+  unsigned threads;
+  uint64_t ops;
+  double seconds;
+  uint64_t batch;
+  // Ops are timed in batches of this size, so that the clock's own overhead doesn't dominate
+  // fast ops.  Percentiles are of per-batch averages.
+
+  double p50Ns;
+  double p99Ns;
+  double p999Ns;
+  double allocsPerOp;
+  double bytesAllocatedPerOp;
+
+  double opsPerSecond() const { return ops / seconds; }
+};
+
+class Harness {
+public:
+  Harness(int argc, char* argv[]);
+  // Options:
+  //   --threads=N   Scale up to N threads rather than the number of cores.
+  //   --seconds=S   Time each run for S seconds (default 0.5).
+  //   --filter=STR  Only run benchmarks whose name contains STR.
+  //   --json        Print results as JSON.
+
+  void add(std::string name, OpFactory factory);
+
+  int run();
+  // Runs every matching benchmark at every thread count and prints the results.  Returns an exit
+  // code for main().
+
+private:
+  struct Benchmark {
+    std::string name;
+    OpFactory factory;
+  };
+
+  unsigned maxThreads;
+  double secondsPerRun = 0.5;
+  std::string filter;
+  bool json = false;
+  std::vector<Benchmark> benchmarks;
+
+  Result runOne(const Benchmark& benchmark, unsigned threads);
+  static void printText(const std::vector<Result>& results);
+  static void printJson(const std::vector<Result>& results);
+};
+
+// =======================================================================================
+// inline implementation
+
+inline Harness::Harness(int argc, char* argv[])
+    : maxThreads(std::max(1u, std::thread::hardware_concurrency())) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.compare(0, 10, "--threads=") == 0) {
+      maxThreads = std::max(1, atoi(arg.c_str() + 10));
+    } else if (arg.compare(0, 10, "--seconds=") == 0) {
+      secondsPerRun = atof(arg.c_str() + 10);
+    } else if (arg.compare(0, 9, "--filter=") == 0) {
+      filter = arg.substr(9);
+    } else if (arg == "--json") {
+      json = true;
+    } else {
+      fprintf(stderr, "USAGE:  %s [--threads=N] [--seconds=S] [--filter=STR] [--json]\n",
+              argv[0]);
+      exit(1);
+    }
+  }
+}
+
+inline void Harness::add(std::string name, OpFactory factory) {
+  benchmarks.push_back(Benchmark { std::move(name), std::move(factory) });
+}
+
+inline int Harness::run() {
+  std::vector<unsigned> threadCounts;
+  for (unsigned n = 1; n < maxThreads; n *= 2) threadCounts.push_back(n);
+  threadCounts.push_back(maxThreads);
+
+  std::vector<Result> results;
+  for (auto& benchmark: benchmarks) {
+    if (benchmark.name.find(filter) == std::string::npos) continue;
+    for (unsigned threads: threadCounts) {
+      results.push_back(runOne(benchmark, threads));
+      if (!json) {
+        printText(std::vector<Result>(1, results.back()));
+      }
+    }
+  }
+
+  if (json) printJson(results);
+  return 0;
+}
+
+inline Result Harness::runOne(const Benchmark& benchmark, unsigned threads) {
+  typedef std::chrono::steady_clock Clock;
+
+  struct ThreadResult {
+    std::vector<double> samples;
+    uint64_t ops = 0;
+    uint64_t batch = 1;
+    double seconds = 0;
+    AllocationStats allocations = { 0, 0 };
+  };
+
+  std::vector<ThreadResult> threadResults(threads);
+  std::atomic<unsigned> ready(0);
+  std::atomic<bool> go(false);
+  auto duration = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(secondsPerRun));
+
+  auto body = [&](ThreadResult& out) {
+    Op op = benchmark.factory();
+
+    // Warm up, and find a batch size that takes at least a couple of microseconds.
+    for (;;) {
+      auto start = Clock::now();
+      for (uint64_t i = 0; i < out.batch; i++) op();
+      if (Clock::now() - start >= std::chrono::microseconds(2) || out.batch >= (1u << 20)) break;
+      out.batch *= 2;
+    }
+
+    ++ready;
+    while (!go.load()) std::this_thread::yield();
+
+    auto start = Clock::now();
+    auto deadline = start + duration;
+    Clock::time_point end;
+    do {
+      AllocationStats before = threadAllocations();
+      auto batchStart = Clock::now();
+      for (uint64_t i = 0; i < out.batch; i++) op();
+      end = Clock::now();
+      AllocationStats after = threadAllocations();
+
+      // Count only the ops' own allocations, not the growth of `samples`.
+      out.allocations.count += after.count - before.count;
+      out.allocations.bytes += after.bytes - before.bytes;
+      out.samples.push_back(
+          std::chrono::duration<double, std::nano>(end - batchStart).count() / out.batch);
+      out.ops += out.batch;
+    } while (end < deadline);
+
+    out.seconds = std::chrono::duration<double>(end - start).count();
+  };
+
+  std::vector<std::thread> workers;
+  for (auto& threadResult: threadResults) {
+    workers.emplace_back(body, std::ref(threadResult));
+  }
+  while (ready.load() < threads) std::this_thread::yield();
+  go.store(true);
+  for (auto& worker: workers) worker.join();
+
+  Result result;
+  result.name = benchmark.name;
+  result.threads = threads;
+  result.ops = 0;
+  result.seconds = 0;
+  result.batch = threadResults[0].batch;
+  uint64_t allocations = 0, allocatedBytes = 0;
+  std::vector<double> samples;
+  for (auto& threadResult: threadResults) {
+    result.ops += threadResult.ops;
+    result.seconds = std::max(result.seconds, threadResult.seconds);
+    result.batch = std::min(result.batch, threadResult.batch);
+    allocations += threadResult.allocations.count;
+    allocatedBytes += threadResult.allocations.bytes;
+    samples.insert(samples.end(), threadResult.samples.begin(), threadResult.samples.end());
+  }
+
+  auto percentile = [&](double p) {
+    auto nth = samples.begin() + std::min(samples.size() - 1, size_t(samples.size() * p));
+    std::nth_element(samples.begin(), nth, samples.end());
+    return *nth;
+  };
+  result.p50Ns = percentile(0.5);
+  result.p99Ns = percentile(0.99);
+  result.p999Ns = percentile(0.999);
+  result.allocsPerOp = double(allocations) / result.ops;
+  result.bytesAllocatedPerOp = double(allocatedBytes) / result.ops;
+  return result;
+}
+
+inline void Harness::printText(const std::vector<Result>& results) {
+  for (auto& r: results) {
+    printf("%-28s %3u threads %12.0f ops/s  p50 %9.1fns  p99 %9.1fns  p999 %9.1fns",
+           r.name.c_str(), r.threads, r.opsPerSecond(), r.p50Ns, r.p99Ns, r.p999Ns);
+    if (COUNTING_ALLOCATIONS) {
+      printf("  %7.2f allocs/op %9.0f B/op", r.allocsPerOp, r.bytesAllocatedPerOp);
+    }
+    printf("\n");
+  }
+  fflush(stdout);
+}
+
+inline void Harness::printJson(const std::vector<Result>& results) {
+  // Benchmark names are chosen by the program, so they need no escaping.
+  printf("{\"hardwareConcurrency\": %u, \"benchmarks\": [", std::thread::hardware_concurrency());
+  for (size_t i = 0; i < results.size(); i++) {
+    auto& r = results[i];
+    printf("%s\n  {\"name\": \"%s\", \"threads\": %u, \"ops\": %llu, \"seconds\": %.6f, "
+           "\"opsPerSecond\": %.1f, \"batch\": %llu, "
+           "\"p50Ns\": %.2f, \"p99Ns\": %.2f, \"p999Ns\": %.2f",
+           i == 0 ? "" : ",", r.name.c_str(), r.threads, (unsigned long long)r.ops, r.seconds,
+           r.opsPerSecond(), (unsigned long long)r.batch, r.p50Ns, r.p99Ns, r.p999Ns);
+    if (COUNTING_ALLOCATIONS) {
+      printf(", \"allocsPerOp\": %.3f, \"bytesAllocatedPerOp\": %.1f",
+             r.allocsPerOp, r.bytesAllocatedPerOp);
+    }
+    printf("}");
+  }
+  printf("\n]}\n");
+  fflush(stdout);
+}
+
+}  // namespace harness
+}  // namespace benchmark
+}  // namespace capnp
@@ -0,0 +1,401 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// Benchmarks for KJ's event loop and async I/O stack: promise resolution, timers, echo over
+// socketpairs and loopback TCP (with pumpTo() on the echoing side), HTTP with and without
+// keep-alive, and TLS handshakes.  Every benchmark thread gets its own event loop, with both the
+// client and the server on it, so results scale with cores the way a sharded server does.
+
+#include "harness.h"
+#include <kj/async-io.h>
+#include <kj/compat/http.h>
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include <memory>
+
+#if KJ_HAS_OPENSSL
+#include <kj/compat/tls.h>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/x509.h>
+#endif
+
+CAPNP_BENCHMARK_COUNT_ALLOCATIONS
+
+namespace capnp {
+namespace benchmark {
+namespace kjasync {
+
+using harness::Op;
+using harness::doNotOptimize;
+
+template <typename State>
+Op makeOp(std::shared_ptr<State> state, void (*op)(State&)) {
+  // The harness wants a copyable callable; the per-thread state lives behind a shared_ptr and is
+  // destroyed along with the Op, on the benchmark thread.
+  return [state, op]() { op(*state); };
+}
+
+// =======================================================================================
+// Event loop
+
+struct LoopState {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope;
+
+  LoopState(): waitScope(loop) {}
+};
+
+Op resolvedThen() {
+  return makeOp<LoopState>(std::make_shared<LoopState>(), [](LoopState& s) {
+    doNotOptimize(kj::Promise<int>(1).then([](int i) { return i + 1; }).wait(s.waitScope));
+  });
+}
+
+Op fulfillThen() {
+  return makeOp<LoopState>(std::make_shared<LoopState>(), [](LoopState& s) {
+    auto paf = kj::newPromiseAndFulfiller<int>();
+    auto promise = paf.promise.then([](int i) { return i + 1; });
+    paf.fulfiller->fulfill(1);
+    doNotOptimize(promise.wait(s.waitScope));
+  });
+}
+
+Op evalLaterChain() {
+  // One op is ten turns of the event loop.
+  return makeOp<LoopState>(std::make_shared<LoopState>(), [](LoopState& s) {
+    kj::Promise<int> promise = 0;
+    for (int i = 0; i < 10; i++) {
+      promise = promise.then([](int n) { return kj::evalLater([n]() { return n + 1; }); });
+    }
+    doNotOptimize(promise.wait(s.waitScope));
+  });
+}
+
+class LogErrors final: public kj::TaskSet::ErrorHandler {
+public:
+  void taskFailed(kj::Exception&& exception) override {
+    KJ_LOG(ERROR, "benchmark server task failed", exception);
+  }
+};
+
+LogErrors logErrors;
+
+struct IoState {
+  kj::AsyncIoContext io;
+
+  IoState(): io(kj::setupAsyncIo()) {}
+};
+
+Op timerAddCancel() {
+  return makeOp<IoState>(std::make_shared<IoState>(), [](IoState& s) {
+    // Schedules a timeout and cancels it, as happens for almost every request with a deadline.
+    auto promise = s.io.provider->getTimer().afterDelay(1 * kj::SECONDS);
+    doNotOptimize(promise);
+  });
+}
+
+// =======================================================================================
+// Echo
+
+kj::Promise<void> echo(kj::Own<kj::AsyncIoStream> stream) {
+  auto& ref = *stream;
+  return ref.pumpTo(ref).ignoreResult().attach(kj::mv(stream));
+}
+
+struct EchoState: public IoState {
+  kj::Own<kj::ConnectionReceiver> listener;
+  kj::Vector<kj::Own<kj::AsyncIoStream>> connections;
+  kj::Array<kj::byte> out;
+  kj::Array<kj::byte> in;
+  kj::TaskSet tasks;
+  // Declared last so that the server side is torn down before what it references.
+
+  EchoState(size_t messageSize)
+      : out(kj::heapArray<kj::byte>(messageSize)), in(kj::heapArray<kj::byte>(messageSize)),
+        tasks(logErrors) {
+    memset(out.begin(), 'x', out.size());
+  }
+
+  kj::Own<kj::AsyncIoStream> connectLoopback() {
+    // Starts listening on an ephemeral loopback port, if not already, and returns a new
+    // connection to it.  Accepted connections echo back everything they receive.
+
+    if (listener.get() == nullptr) {
+      listener = io.provider->getNetwork().parseAddress("127.0.0.1")
+          .wait(io.waitScope)->listen();
+      tasks.add(acceptLoop());
+    }
+
+    return io.provider->getNetwork().parseAddress("127.0.0.1", listener->getPort())
+        .wait(io.waitScope)->connect().wait(io.waitScope);
+  }
+
+  kj::Promise<void> acceptLoop() {
+    return listener->accept().then([this](kj::Own<kj::AsyncIoStream>&& stream) {
+      tasks.add(echo(kj::mv(stream)));
+      return acceptLoop();
+    });
+  }
+
+  void roundTrip() {
+    // Sends one message on every connection and waits for all of the echoes.
+
+    if (connections.size() == 1) {
+      auto& conn = *connections[0];
+      auto read = conn.read(in.begin(), in.size());
+      conn.write(out.begin(), out.size()).wait(io.waitScope);
+      read.wait(io.waitScope);
+      return;
+    }
+
+    auto inputs = kj::heapArray<kj::byte>(in.size() * connections.size());
+    auto promises = kj::heapArrayBuilder<kj::Promise<void>>(connections.size() * 2);
+    for (auto i: kj::indices(connections)) {
+      auto& conn = *connections[i];
+      promises.add(conn.write(out.begin(), out.size()));
+      promises.add(conn.read(inputs.begin() + i * in.size(), in.size()));
+    }
+    kj::joinPromises(promises.finish()).wait(io.waitScope);
+  }
+};
+
+Op socketpairEcho(size_t messageSize) {
+  auto state = std::make_shared<EchoState>(messageSize);
+  auto pipe = state->io.provider->newTwoWayPipe();
+  state->tasks.add(echo(kj::mv(pipe.ends[1])));
+  state->connections.add(kj::mv(pipe.ends[0]));
+  return makeOp<EchoState>(state, [](EchoState& s) { s.roundTrip(); });
+}
+
+Op tcpEcho(size_t messageSize, uint connectionCount) {
+  // One op is a round trip on each of `connectionCount` connections, all in flight at once.
+  auto state = std::make_shared<EchoState>(messageSize);
+  for (uint i = 0; i < connectionCount; i++) {
+    state->connections.add(state->connectLoopback());
+  }
+  return makeOp<EchoState>(state, [](EchoState& s) { s.roundTrip(); });
+}
+
+// =======================================================================================
+// HTTP
+
+class OkService final: public kj::HttpService {
+public:
+  OkService(kj::HttpHeaderTable& table): table(table) {}
+
+  kj::Promise<void> request(
+      kj::HttpMethod method, kj::StringPtr url, const kj::HttpHeaders& headers,
+      kj::AsyncInputStream& requestBody, Response& response) override {
+    kj::HttpHeaders responseHeaders(table);
+    responseHeaders.set(kj::HttpHeaderId::CONTENT_TYPE, "text/plain");
+    auto body = response.send(200, "OK", responseHeaders, strlen(BODY));
+    auto promise = body->write(BODY, strlen(BODY));
+    return promise.attach(kj::mv(body));
+  }
+
+private:
+  kj::HttpHeaderTable& table;
+
+  static constexpr const char* BODY = "Hello, World!\n";
+};
+
+constexpr const char* OkService::BODY;
+
+struct HttpState: public IoState {
+  kj::HttpHeaderTable table;
+  OkService service;
+  kj::HttpServer server;
+  kj::Own<kj::ConnectionReceiver> listener;
+  kj::Own<kj::NetworkAddress> address;
+  kj::Own<kj::AsyncIoStream> connection;
+  kj::Own<kj::HttpClient> client;
+  kj::TaskSet tasks;
+
+  HttpState(bool keepAlive)
+      : service(table), server(io.provider->getTimer(), table, service), tasks(logErrors) {
+    listener = io.provider->getNetwork().parseAddress("127.0.0.1")
+        .wait(io.waitScope)->listen();
+    tasks.add(server.listenHttp(*listener));
+    address = io.provider->getNetwork().parseAddress("127.0.0.1", listener->getPort())
+        .wait(io.waitScope);
+    if (keepAlive) {
+      connection = address->connect().wait(io.waitScope);
+      client = kj::newHttpClient(table, *connection);
+    }
+  }
+
+  void get(kj::HttpClient& client) {
+    kj::HttpHeaders headers(table);
+    headers.set(kj::HttpHeaderId::HOST, "localhost");
+    auto response = client.request(kj::HttpMethod::GET, "/", headers).response
+        .wait(io.waitScope);
+    KJ_ASSERT(response.statusCode == 200);
+    doNotOptimize(response.body->readAllText().wait(io.waitScope));
+  }
+};
+
+Op httpKeepAlive() {
+  return makeOp<HttpState>(std::make_shared<HttpState>(true), [](HttpState& s) {
+    s.get(*s.client);
+  });
+}
+
+Op httpNewConnection() {
+  return makeOp<HttpState>(std::make_shared<HttpState>(false), [](HttpState& s) {
+    auto connection = s.address->connect().wait(s.io.waitScope);
+    auto client = kj::newHttpClient(s.table, *connection);
+    s.get(*client);
+  });
+}
+
+#if KJ_HAS_OPENSSL
+// =======================================================================================
+// TLS
+
+kj::TlsKeypair makeKeypair() {
+  // A fresh self-signed P-256 certificate for "localhost", so the benchmark needs no files.
+
+  EVP_PKEY* pkey = nullptr;
+  auto* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  KJ_ASSERT(ctx != nullptr);
+  KJ_DEFER(EVP_PKEY_CTX_free(ctx));
+  KJ_ASSERT(EVP_PKEY_keygen_init(ctx) > 0);
+  KJ_ASSERT(EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) > 0);
+  KJ_ASSERT(EVP_PKEY_keygen(ctx, &pkey) > 0);
+  KJ_DEFER(EVP_PKEY_free(pkey));
+
+  X509* cert = X509_new();
+  KJ_ASSERT(cert != nullptr);
+  KJ_DEFER(X509_free(cert));
+  X509_set_version(cert, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_get_notBefore(cert), -3600);
+  X509_gmtime_adj(X509_get_notAfter(cert), 86400);
+  X509_set_pubkey(cert, pkey);
+  X509_NAME* name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+      reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  KJ_ASSERT(X509_sign(cert, pkey, EVP_sha256()) > 0);
+
+  auto keyDer = kj::heapArray<kj::byte>(i2d_PrivateKey(pkey, nullptr));
+  kj::byte* keyPos = keyDer.begin();
+  i2d_PrivateKey(pkey, &keyPos);
+  auto certDer = kj::heapArray<kj::byte>(i2d_X509(cert, nullptr));
+  kj::byte* certPos = certDer.begin();
+  i2d_X509(cert, &certPos);
+
+  return { kj::TlsPrivateKey(keyDer), kj::TlsCertificate(certDer) };
+}
+
+struct TlsState: public IoState {
+  kj::TlsKeypair keypair;
+  kj::TlsContext serverContext;
+  kj::TlsContext clientContext;
+
+  TlsState(bool resume)
+      : keypair(makeKeypair()),
+        serverContext(serverOptions(keypair, resume)),
+        clientContext(clientOptions(keypair, resume)) {}
+
+  static kj::TlsContext::Options serverOptions(const kj::TlsKeypair& keypair, bool resume) {
+    kj::TlsContext::Options options;
+    options.defaultKeypair = keypair;
+    if (!resume) {
+      options.sessionCacheSize = 0;
+      options.useSessionTickets = false;
+    }
+    return options;
+  }
+
+  static kj::TlsContext::Options clientOptions(const kj::TlsKeypair& keypair, bool resume) {
+    kj::TlsContext::Options options;
+    options.useSystemTrustStore = false;
+    options.trustedCertificates = kj::arrayPtr(&keypair.certificate, 1);
+    if (!resume) options.clientSessionCacheSize = 0;
+    return options;
+  }
+
+  void handshake() {
+    // Handshakes over a fresh socketpair, then has the server send one kj::byte so that the client
+    // also receives any TLS 1.3 session ticket.
+
+    auto pipe = io.provider->newTwoWayPipe();
+    auto server = serverContext.wrapServer(kj::mv(pipe.ends[1]))
+        .then([](kj::Own<kj::AsyncIoStream>&& stream) {
+      auto promise = stream->write("x", 1);
+      return promise.attach(kj::mv(stream));
+    });
+    auto client = clientContext.wrapClient(kj::mv(pipe.ends[0]), "localhost")
+        .then([](kj::Own<kj::AsyncIoStream>&& stream) {
+      auto buffer = kj::heapArray<kj::byte>(1);
+      auto promise = stream->read(buffer.begin(), 1);
+      return promise.attach(kj::mv(buffer), kj::mv(stream));
+    });
+    auto promises = kj::heapArrayBuilder<kj::Promise<void>>(2);
+    promises.add(kj::mv(server));
+    promises.add(kj::mv(client));
+    kj::joinPromises(promises.finish()).wait(io.waitScope);
+  }
+};
+
+Op tlsHandshake(bool resume) {
+  return makeOp<TlsState>(std::make_shared<TlsState>(resume), [](TlsState& s) {
+    s.handshake();
+  });
+}
+
+#endif  // KJ_HAS_OPENSSL
+
+}  // namespace kjasync
+}  // namespace benchmark
+}  // namespace capnp
+
+int main(int argc, char* argv[]) {
+  using namespace capnp::benchmark::kjasync;
+
+  // OpenSSL 3 probes the TLS BIO with controls that tls.c++ warns about on every handshake.
+  kj::_::Debug::setLogLevel(kj::LogSeverity::ERROR);
+
+  capnp::benchmark::harness::Harness harness(argc, argv);
+  harness.add("event-loop/then", resolvedThen);
+  harness.add("event-loop/fulfill", fulfillThen);
+  harness.add("event-loop/evalLater-x10", evalLaterChain);
+  harness.add("timer/add-cancel", timerAddCancel);
+
+  harness.add("socketpair/echo-64", []() { return socketpairEcho(64); });
+  harness.add("socketpair/echo-64KiB", []() { return socketpairEcho(65536); });
+  harness.add("tcp/echo-64", []() { return tcpEcho(64, 1); });
+  harness.add("tcp/echo-64-x16", []() { return tcpEcho(64, 16); });
+  harness.add("tcp/echo-64-x256", []() { return tcpEcho(64, 256); });
+  harness.add("tcp/echo-64KiB", []() { return tcpEcho(65536, 1); });
+
+  harness.add("http/keep-alive", httpKeepAlive);
+  harness.add("http/new-connection", httpNewConnection);
+
+#if KJ_HAS_OPENSSL
+  harness.add("tls/handshake-full", []() { return tlsHandshake(false); });
+  harness.add("tls/handshake-resumed", []() { return tlsHandshake(true); });
+#endif
+
+  return harness.run();
+}
@@ -158,9 +158,9 @@ struct BenchmarkMethods {
 struct BenchmarkTypes {
   typedef void Uncompressed;
   typedef void Packed;
-#if HAVE_SNAPPY
-  typedef void SnappyCompressed;
-#endif  // HAVE_SNAPPY
+#if CAPNP_HAS_ZLIB
+  typedef void DeflateCompressed;
+#endif  // CAPNP_HAS_ZLIB
 
   typedef ReusableObjects ReusableResources;
   typedef SingleUseObjects SingleUseResources;
@@ -23,10 +23,9 @@
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/io/coded_stream.h>
 #include <thread>
-#if HAVE_SNAPPY
-#include <snappy/snappy.h>
-#include <snappy/snappy-sinksource.h>
-#endif  // HAVE_SNAPPY
+#if CAPNP_HAS_ZLIB
+#include <zlib.h>
+#endif  // CAPNP_HAS_ZLIB
 
 namespace capnp {
 namespace benchmark {
@@ -118,16 +117,16 @@ struct Uncompressed {
 };
 
 // =======================================================================================
-// The Snappy interface is really obnoxious.  I gave up here and am just reading/writing flat
-// arrays in some static scratch space.  This probably gives protobufs an edge that it doesn't
-// deserve.
+// Like the Cap'n Proto side, compress each message on its own with DEFLATE at its fastest level.
+// Reading and writing flat arrays in some static scratch space is simplest here, and probably
+// gives protobufs an edge that it doesn't deserve.
 
-#if HAVE_SNAPPY
+#if CAPNP_HAS_ZLIB
 
-static char scratch[1 << 20];
-static char scratch2[1 << 20];
+static thread_local char scratch[1 << 20];
+static thread_local char scratch2[1 << 20];
 
-struct SnappyCompressed {
+struct DeflateCompressed {
   typedef int InputStream;
   typedef int OutputStream;
 
@@ -137,23 +136,29 @@ struct SnappyCompressed {
 
     message.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t*>(scratch));
 
-    size_t compressedSize = 0;
-    snappy::RawCompress(scratch, size, scratch2 + sizeof(uint32_t), &compressedSize);
-    uint32_t tag = compressedSize;
-    memcpy(scratch2, &tag, sizeof(tag));
-
-    writeAll(*output, scratch2, compressedSize + sizeof(tag));
-    return compressedSize + sizeof(tag);
+    uint32_t tags[2];
+    uLongf compressedSize = sizeof(scratch2) - sizeof(tags);
+    GOOGLE_CHECK_EQ(Z_OK, compress2(reinterpret_cast<Bytef*>(scratch2 + sizeof(tags)),
+                                    &compressedSize, reinterpret_cast<Bytef*>(scratch), size,
+                                    Z_BEST_SPEED));
+    tags[0] = compressedSize;
+    tags[1] = size;
+    memcpy(scratch2, tags, sizeof(tags));
+
+    writeAll(*output, scratch2, compressedSize + sizeof(tags));
+    return compressedSize + sizeof(tags);
   }
 
   static void read(int* input, google::protobuf::MessageLite* message) {
-    uint32_t size;
-    readAll(*input, &size, sizeof(size));
-    readAll(*input, scratch, size);
+    uint32_t tags[2];
+    readAll(*input, tags, sizeof(tags));
+    GOOGLE_CHECK_LE(tags[0], sizeof(scratch));
+    readAll(*input, scratch, tags[0]);
 
-    size_t uncompressedSize;
-    GOOGLE_CHECK(snappy::GetUncompressedLength(scratch, size, &uncompressedSize));
-    GOOGLE_CHECK(snappy::RawUncompress(scratch, size, scratch2));
+    uLongf uncompressedSize = sizeof(scratch2);
+    GOOGLE_CHECK_EQ(Z_OK, uncompress(reinterpret_cast<Bytef*>(scratch2), &uncompressedSize,
+                                     reinterpret_cast<Bytef*>(scratch), tags[0]));
+    GOOGLE_CHECK_EQ(uncompressedSize, tags[1]);
 
     GOOGLE_CHECK(message->ParsePartialFromArray(scratch2, uncompressedSize));
   }
@@ -161,7 +166,7 @@ struct SnappyCompressed {
   static void flush(OutputStream*) {}
 };
 
-#endif  // HAVE_SNAPPY
+#endif  // CAPNP_HAS_ZLIB
 
 // =======================================================================================
 
@@ -342,9 +347,9 @@ struct BenchmarkMethods {
 struct BenchmarkTypes {
   typedef protobuf::Uncompressed Uncompressed;
   typedef protobuf::Uncompressed Packed;
-#if HAVE_SNAPPY
-  typedef protobuf::SnappyCompressed SnappyCompressed;
-#endif  // HAVE_SNAPPY
+#if CAPNP_HAS_ZLIB
+  typedef protobuf::DeflateCompressed DeflateCompressed;
+#endif  // CAPNP_HAS_ZLIB
 
   typedef protobuf::ReusableMessages ReusableResources;
   typedef protobuf::SingleUseMessages SingleUseResources;
@@ -122,7 +122,7 @@ enum class Reuse {
 enum class Compression {
   NONE,
   PACKED,
-  SNAPPY
+  DEFLATE
 };
 
 TestResult runTest(Product product, TestCase testCase, Mode mode, Reuse reuse,
@@ -180,8 +180,8 @@ TestResult runTest(Product product, TestCase testCase, Mode mode, Reuse reuse,
     case Compression::PACKED:
       argv[3] = strdup("packed");
       break;
-    case Compression::SNAPPY:
-      argv[3] = strdup("snappy");
+    case Compression::DEFLATE:
+      argv[3] = strdup("deflate");
       break;
   }
 
@@ -382,8 +382,8 @@ int main(int argc, char* argv[]) {
       testCase = TestCase::EVAL;
     } else if (arg == "carsales") {
       testCase = TestCase::CARSALES;
-    } else if (arg == "snappy") {
-      compression = Compression::SNAPPY;
+    } else if (arg == "deflate") {
+      compression = Compression::DEFLATE;
     } else if (arg == "-c") {
       ++i;
       if (i == argc) {
@@ -453,8 +453,8 @@ int main(int argc, char* argv[]) {
       cout << "* de-zero packing for Cap'n Proto" << endl;
       cout << "* standard packing for Protobuf" << endl;
       break;
-    case Compression::SNAPPY:
-      cout << "* Snappy compression" << endl;
+    case Compression::DEFLATE:
+      cout << "* DEFLATE compression (of packed messages, for Cap'n Proto)" << endl;
       break;
   }
 
@@ -22,6 +22,7 @@
 #include "any.h"
 #include "message.h"
 #include <kj/compat/gtest.h>
+#include <kj/map.h>
 #include "test-util.h"
 
 namespace capnp {
@@ -375,6 +376,7 @@ KJ_TEST("Bit list with nonzero pad bits") {
 
   // Should be equal, despite nonzero padding.
   KJ_ASSERT(message1.getRoot<AnyList>() == message2.getRoot<AnyList>());
+  KJ_ASSERT(message1.getRoot<AnyList>().hashCode() == message2.getRoot<AnyList>().hashCode());
 }
 
 KJ_TEST("Pointer list unequal to struct list") {
@@ -434,6 +436,84 @@ KJ_TEST("Truncating non-null pointer fields does not preserve equality") {
             message1.getRoot<AnyPointer>().equals(message2.getRoot<AnyPointer>()));
 }
 
+KJ_TEST("hashCode() is consistent with equals() across layouts") {
+  AlignedData<4> segment1 = {{
+      // struct with two data words and one pointer
+      0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x01, 0x00,
+
+      // data words, the second all zero
+      0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+
+      // null pointer
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  }};
+  kj::ArrayPtr<const word> segments1[1] = {
+    kj::arrayPtr(segment1.words, 4)
+  };
+  SegmentArrayMessageReader message1(kj::arrayPtr(segments1, 1));
+
+  AlignedData<2> segment2 = {{
+      // struct with one data word and zero pointers
+      0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+
+      // data word
+      0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab,
+  }};
+  kj::ArrayPtr<const word> segments2[1] = {
+    kj::arrayPtr(segment2.words, 2)
+  };
+  SegmentArrayMessageReader message2(kj::arrayPtr(segments2, 1));
+
+  auto any1 = message1.getRoot<AnyStruct>();
+  auto any2 = message2.getRoot<AnyStruct>();
+  KJ_EXPECT(any1 == any2);
+  KJ_EXPECT(any1.hashCode() == any2.hashCode());
+  KJ_EXPECT(message1.getRoot<AnyPointer>().hashCode() ==
+            message2.getRoot<AnyPointer>().hashCode());
+
+  MallocMessageBuilder builderA;
+  auto rootA = builderA.getRoot<test::TestAllTypes>();
+  initTestMessage(rootA);
+
+  MallocMessageBuilder builderB;
+  auto rootB = builderB.getRoot<test::TestAllTypes>();
+  initTestMessage(rootB);
+
+  auto anyA = builderA.getRoot<AnyPointer>().asReader();
+  auto anyB = builderB.getRoot<AnyPointer>().asReader();
+  KJ_EXPECT(anyA.hashCode() == anyB.hashCode());
+
+  rootB.getStructList()[1].setTextField("my NEW structlist 2");
+  KJ_EXPECT(anyA.hashCode() != anyB.hashCode());
+
+  rootB.getStructList()[1].setTextField(rootA.getStructList()[1].getTextField());
+  rootB.getBoolList().set(2, !rootA.getBoolList()[2]);
+  KJ_EXPECT(anyA.hashCode() != anyB.hashCode());
+}
+
+KJ_TEST("AnyStruct::Reader as a hash table key") {
+  MallocMessageBuilder builderA;
+  initTestMessage(builderA.getRoot<test::TestAllTypes>());
+
+  MallocMessageBuilder builderB;
+  initTestMessage(builderB.getRoot<test::TestAllTypes>());
+
+  MallocMessageBuilder builderC;
+  builderC.getRoot<test::TestAllTypes>().setInt32Field(123);
+
+  kj::HashMap<AnyStruct::Reader, int> map;
+  map.insert(builderA.getRoot<AnyStruct>().asReader(), 1);
+  map.insert(builderC.getRoot<AnyStruct>().asReader(), 2);
+
+  // An identical message built separately finds the same entry.
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find(builderB.getRoot<AnyStruct>().asReader())) == 1);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find(builderC.getRoot<AnyStruct>().asReader())) == 2);
+
+  builderB.getRoot<test::TestAllTypes>().setInt32Field(456);
+  KJ_EXPECT(map.find(builderB.getRoot<AnyStruct>().asReader()) == nullptr);
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
@@ -22,6 +22,7 @@
 #include "any.h"
 
 #include <kj/debug.h>
+#include <kj/hash.h>
 
 #if !CAPNP_LITE
 #include "capability.h"
@@ -79,41 +80,66 @@ kj::Own<ClientHook> AnyPointer::Pipeline::asCap() {
 
 #endif  // !CAPNP_LITE
 
-Equality AnyStruct::Reader::equals(AnyStruct::Reader right) {
-  auto dataL = getDataSection();
-  size_t dataSizeL = dataL.size();
-  while(dataSizeL > 0 && dataL[dataSizeL - 1] == 0) {
-    -- dataSizeL;
-  }
+namespace {
 
-  auto dataR = right.getDataSection();
-  size_t dataSizeR = dataR.size();
-  while(dataSizeR > 0 && dataR[dataSizeR - 1] == 0) {
-    -- dataSizeR;
+inline size_t trimTrailingZeros(kj::ArrayPtr<const byte> data) {
+  size_t size = data.size();
+  while (size > 0 && data[size - 1] == 0) {
+    --size;
   }
+  return size;
+}
 
-  if(dataSizeL != dataSizeR) {
-    return Equality::NOT_EQUAL;
+inline size_t trimTrailingNulls(List<AnyPointer>::Reader ptrs) {
+  size_t size = ptrs.size();
+  while (size > 0 && ptrs[size - 1].isNull()) {
+    --size;
   }
+  return size;
+}
 
-  if(0 != memcmp(dataL.begin(), dataR.begin(), dataSizeL)) {
-    return Equality::NOT_EQUAL;
-  }
+}  // namespace
 
-  auto ptrsL = getPointerSection();
-  size_t ptrsSizeL = ptrsL.size();
-  while (ptrsSizeL > 0 && ptrsL[ptrsSizeL - 1].isNull()) {
-    -- ptrsSizeL;
+Equality AnyStruct::Reader::equals(AnyStruct::Reader right) const {
+  // The section accessors aren't const, so work on a copy.
+  Reader left = *this;
+
+  auto dataL = left.getDataSection();
+  auto dataR = right.getDataSection();
+  if (dataL.size() == dataR.size()) {
+    // Same data layout -- the usual case when both sides come from the same schema version, or
+    // both are canonical. A single memcmp over the whole section suffices; no need to scan for
+    // trailing zeros first. Readers of the same struct skip even that.
+    if (dataL.begin() != dataR.begin() &&
+        memcmp(dataL.begin(), dataR.begin(), dataL.size()) != 0) {
+      return Equality::NOT_EQUAL;
+    }
+  } else {
+    size_t dataSizeL = trimTrailingZeros(dataL);
+    size_t dataSizeR = trimTrailingZeros(dataR);
+
+    if(dataSizeL != dataSizeR) {
+      return Equality::NOT_EQUAL;
+    }
+
+    if(0 != memcmp(dataL.begin(), dataR.begin(), dataSizeL)) {
+      return Equality::NOT_EQUAL;
+    }
   }
 
+  auto ptrsL = left.getPointerSection();
   auto ptrsR = right.getPointerSection();
+  size_t ptrsSizeL = ptrsL.size();
   size_t ptrsSizeR = ptrsR.size();
-  while (ptrsSizeR > 0 && ptrsR[ptrsSizeR - 1].isNull()) {
-    -- ptrsSizeR;
-  }
-
-  if(ptrsSizeL != ptrsSizeR) {
-    return Equality::NOT_EQUAL;
+  if (ptrsSizeL != ptrsSizeR) {
+    // Trailing null pointers are insignificant. (With equal counts, they simply compare equal
+    // in the loop below.)
+    ptrsSizeL = trimTrailingNulls(ptrsL);
+    ptrsSizeR = trimTrailingNulls(ptrsR);
+
+    if(ptrsSizeL != ptrsSizeR) {
+      return Equality::NOT_EQUAL;
+    }
   }
 
   size_t i = 0;
@@ -138,6 +164,22 @@ Equality AnyStruct::Reader::equals(AnyStruct::Reader right) {
   return eqResult;
 }
 
+uint AnyStruct::Reader::hashCode() const {
+  // Hash exactly what equals() compares: the data section less trailing zeros, and the pointer
+  // section less trailing nulls.
+  Reader self = *this;
+
+  auto data = self.getDataSection();
+  auto ptrs = self.getPointerSection();
+  size_t ptrCount = trimTrailingNulls(ptrs);
+
+  uint result = kj::hashCode(data.slice(0, trimTrailingZeros(data)), ptrCount);
+  for (size_t i = 0; i < ptrCount; i++) {
+    result = result * 31 + ptrs[i].hashCode();
+  }
+  return result;
+}
+
 kj::StringPtr KJ_STRINGIFY(Equality res) {
   switch(res) {
     case Equality::NOT_EQUAL:
@@ -150,37 +192,47 @@ kj::StringPtr KJ_STRINGIFY(Equality res) {
   KJ_UNREACHABLE;
 }
 
-Equality AnyList::Reader::equals(AnyList::Reader right) {
-  if(size() != right.size()) {
+Equality AnyList::Reader::equals(AnyList::Reader right) const {
+  // The accessors aren't const, so work on a copy.
+  Reader left = *this;
+
+  if(left.size() != right.size()) {
     return Equality::NOT_EQUAL;
   }
 
-  if (getElementSize() != right.getElementSize()) {
+  if (left.getElementSize() != right.getElementSize()) {
     return Equality::NOT_EQUAL;
   }
 
   auto eqResult = Equality::EQUAL;
-  switch(getElementSize()) {
+  switch(left.getElementSize()) {
     case ElementSize::VOID:
     case ElementSize::BIT:
     case ElementSize::BYTE:
     case ElementSize::TWO_BYTES:
     case ElementSize::FOUR_BYTES:
     case ElementSize::EIGHT_BYTES: {
-      size_t cmpSize = getRawBytes().size();
+      auto bytesL = left.getRawBytes();
+      auto bytesR = right.getRawBytes();
+      if (bytesL.begin() == bytesR.begin()) {
+        // Two readers of the same list.
+        return Equality::EQUAL;
+      }
 
-      if (getElementSize() == ElementSize::BIT && size() % 8 != 0) {
+      size_t cmpSize = bytesL.size();
+
+      if (left.getElementSize() == ElementSize::BIT && left.size() % 8 != 0) {
         // The list does not end on a byte boundary. We need special handling for the final
         // byte because we only care about the bits that are actually elements of the list.
 
-        uint8_t mask = (1 << (size() % 8)) - 1; // lowest size() bits set
-        if ((getRawBytes()[cmpSize - 1] & mask) != (right.getRawBytes()[cmpSize - 1] & mask)) {
+        uint8_t mask = (1 << (left.size() % 8)) - 1; // lowest size() bits set
+        if ((bytesL[cmpSize - 1] & mask) != (bytesR[cmpSize - 1] & mask)) {
           return Equality::NOT_EQUAL;
         }
         cmpSize -= 1;
       }
 
-      if (memcmp(getRawBytes().begin(), right.getRawBytes().begin(), cmpSize) == 0) {
+      if (memcmp(bytesL.begin(), bytesR.begin(), cmpSize) == 0) {
         return Equality::EQUAL;
       } else {
         return Equality::NOT_EQUAL;
@@ -188,9 +240,9 @@ Equality AnyList::Reader::equals(AnyList::Reader right) {
     }
     case ElementSize::POINTER:
     case ElementSize::INLINE_COMPOSITE: {
-      auto llist = as<List<AnyStruct>>();
+      auto llist = left.as<List<AnyStruct>>();
       auto rlist = right.as<List<AnyStruct>>();
-      for(size_t i = 0; i < size(); i++) {
+      for(size_t i = 0; i < llist.size(); i++) {
         switch(llist[i].equals(rlist[i])) {
           case Equality::EQUAL:
             break;
@@ -209,7 +261,38 @@ Equality AnyList::Reader::equals(AnyList::Reader right) {
   KJ_UNREACHABLE;
 }
 
-Equality AnyPointer::Reader::equals(AnyPointer::Reader right) {
+uint AnyList::Reader::hashCode() const {
+  Reader self = *this;
+
+  uint result = kj::hashCode(static_cast<uint>(self.getElementSize()), self.size());
+  switch(self.getElementSize()) {
+    case ElementSize::VOID:
+    case ElementSize::BIT:
+    case ElementSize::BYTE:
+    case ElementSize::TWO_BYTES:
+    case ElementSize::FOUR_BYTES:
+    case ElementSize::EIGHT_BYTES: {
+      auto bytes = self.getRawBytes();
+      if (self.getElementSize() == ElementSize::BIT && self.size() % 8 != 0) {
+        // As in equals(), only the bits that are elements of the list count.
+        uint8_t mask = (1 << (self.size() % 8)) - 1;
+        return kj::hashCode(result, bytes.slice(0, bytes.size() - 1),
+                            static_cast<uint>(bytes[bytes.size() - 1] & mask));
+      }
+      return kj::hashCode(result, bytes);
+    }
+    case ElementSize::POINTER:
+    case ElementSize::INLINE_COMPOSITE: {
+      for (auto element: self.as<List<AnyStruct>>()) {
+        result = result * 31 + element.hashCode();
+      }
+      return result;
+    }
+  }
+  KJ_UNREACHABLE;
+}
+
+Equality AnyPointer::Reader::equals(AnyPointer::Reader right) const {
   if(getPointerType() != right.getPointerType()) {
     return Equality::NOT_EQUAL;
   }
@@ -227,7 +310,22 @@ Equality AnyPointer::Reader::equals(AnyPointer::Reader right) {
   KJ_UNREACHABLE;
 }
 
-bool AnyPointer::Reader::operator==(AnyPointer::Reader right) {
+uint AnyPointer::Reader::hashCode() const {
+  switch(getPointerType()) {
+    case PointerType::NULL_:
+      return 0;
+    case PointerType::STRUCT:
+      return kj::hashCode(static_cast<uint>(PointerType::STRUCT), getAs<AnyStruct>());
+    case PointerType::LIST:
+      return kj::hashCode(static_cast<uint>(PointerType::LIST), getAs<AnyList>());
+    case PointerType::CAPABILITY:
+      // equals() can't tell capabilities apart either.
+      return static_cast<uint>(PointerType::CAPABILITY);
+  }
+  KJ_UNREACHABLE;
+}
+
+bool AnyPointer::Reader::operator==(AnyPointer::Reader right) const {
   switch(equals(right)) {
     case Equality::EQUAL:
       return true;
@@ -240,7 +338,7 @@ bool AnyPointer::Reader::operator==(AnyPointer::Reader right) {
   KJ_UNREACHABLE;
 }
 
-bool AnyStruct::Reader::operator==(AnyStruct::Reader right) {
+bool AnyStruct::Reader::operator==(AnyStruct::Reader right) const {
   switch(equals(right)) {
     case Equality::EQUAL:
       return true;
@@ -253,7 +351,7 @@ bool AnyStruct::Reader::operator==(AnyStruct::Reader right) {
   KJ_UNREACHABLE;
 }
 
-bool AnyList::Reader::operator==(AnyList::Reader right) {
+bool AnyList::Reader::operator==(AnyList::Reader right) const {
   switch(equals(right)) {
     case Equality::EQUAL:
       return true;
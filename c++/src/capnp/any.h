@@ -104,12 +104,18 @@ struct AnyPointer {
     inline bool isList() const { return getPointerType() == PointerType::LIST; }
     inline bool isCapability() const { return getPointerType() == PointerType::CAPABILITY; }
 
-    Equality equals(AnyPointer::Reader right);
-    bool operator==(AnyPointer::Reader right);
-    inline bool operator!=(AnyPointer::Reader right) {
+    Equality equals(AnyPointer::Reader right) const;
+    bool operator==(AnyPointer::Reader right) const;
+    inline bool operator!=(AnyPointer::Reader right) const {
       return !(*this == right);
     }
 
+    uint hashCode() const;
+    // Structural hash consistent with `equals()`: readers that compare EQUAL hash identically,
+    // regardless of how each was laid out (e.g. trailing zero data words or null pointers, or a
+    // struct upgraded to a newer schema version). Capabilities hash by type only. Together with
+    // the const `operator==` this lets readers serve directly as keys in kj::HashMap/HashSet.
+
     template <typename T>
     inline ReaderFor<T> getAs() const;
     // Valid for T = any generated struct type, interface type, List<U>, Text, or Data.
@@ -477,12 +483,19 @@ public:
     return _reader.canonicalize();
   }
 
-  Equality equals(AnyStruct::Reader right);
-  bool operator==(AnyStruct::Reader right);
-  inline bool operator!=(AnyStruct::Reader right) {
+  void writeCanonical(kj::OutputStream& output, uint threadCount = 1) {
+    _reader.writeCanonical(output, threadCount);
+  }
+
+  Equality equals(AnyStruct::Reader right) const;
+  bool operator==(AnyStruct::Reader right) const;
+  inline bool operator!=(AnyStruct::Reader right) const {
     return !(*this == right);
   }
 
+  uint hashCode() const;
+  // Structural hash consistent with `equals()`; see AnyPointer::Reader::hashCode().
+
   template <typename T>
   ReaderFor<T> as() const {
     // T must be a struct type.
@@ -651,12 +664,15 @@ public:
 
   inline kj::ArrayPtr<const byte> getRawBytes() { return _reader.asRawBytes(); }
 
-  Equality equals(AnyList::Reader right);
-  bool operator==(AnyList::Reader right);
-  inline bool operator!=(AnyList::Reader right) {
+  Equality equals(AnyList::Reader right) const;
+  bool operator==(AnyList::Reader right) const;
+  inline bool operator!=(AnyList::Reader right) const {
     return !(*this == right);
   }
 
+  uint hashCode() const;
+  // Structural hash consistent with `equals()`; see AnyPointer::Reader::hashCode().
+
   inline MessageSize totalSize() const {
     return _reader.totalSize().asPublic();
   }
@@ -121,11 +121,26 @@ SegmentReader* ReaderArena::tryGetSegment(SegmentId id) {
 
   auto segment = kj::heap<SegmentReader>(
       this, id, newSegment.begin(), newSegmentSize, &readLimiter);
+  if (segment0.isTrusted()) {
+    // Validation covered every reachable segment, so a segment loaded now can only be one that
+    // the message never points into; it's still safe to trust.
+    segment->markTrusted();
+  }
   SegmentReader* result = segment;
   segments->insert(std::make_pair(id.value, mv(segment)));
   return result;
 }
 
+void ReaderArena::markTrusted() {
+  auto lock = moreSegments.lockExclusive();
+  segment0.markTrusted();
+  KJ_IF_MAYBE(s, *lock) {
+    for (auto& entry: **s) {
+      entry.second->markTrusted();
+    }
+  }
+}
+
 void ReaderArena::reportReadLimitReached() {
   KJ_FAIL_REQUIRE("Exceeded message traversal limit.  See capnp::ReaderOptions.") {
     return;
@@ -210,6 +225,21 @@ BuilderArena::AllocateResult BuilderArena::allocate(SegmentWordCount amount) {
       }
     }
 
+    KJ_IF_MAYBE(s, moreSegments) {
+      // After reclaimAll(), segments following `segmentWithSpace` are empty again, so use them
+      // before asking for more.
+      auto& builders = s->get()->builders;
+      for (uint i = segmentWithSpace->getSegmentId().value; i < builders.size(); i++) {
+        SegmentBuilder* candidate = builders[i].get();
+        if (!candidate->isWritable()) continue;
+        word* attempt = candidate->allocate(amount);
+        if (attempt != nullptr) {
+          segmentWithSpace = candidate;
+          return AllocateResult { candidate, attempt };
+        }
+      }
+    }
+
     // Need to allocate a new segment.
     SegmentBuilder* result = addSegmentInternal(message->allocateSegment(unbound(amount / WORDS)));
 
@@ -221,8 +251,86 @@ BuilderArena::AllocateResult BuilderArena::allocate(SegmentWordCount amount) {
   }
 }
 
-SegmentBuilder* BuilderArena::addExternalSegment(kj::ArrayPtr<const word> content) {
-  return addSegmentInternal(content);
+class BuilderArena::FreeSpace {
+public:
+  void add(SegmentBuilder* segment, word* ptr, uint words) {
+    regions[key(segment, words)].push_back(ptr);
+  }
+
+  word* take(SegmentBuilder* segment, uint words) {
+    auto iter = regions.find(key(segment, words));
+    if (iter == regions.end()) return nullptr;
+    word* result = iter->second.back();
+    iter->second.pop_back();
+    if (iter->second.empty()) regions.erase(iter);
+    return result;
+  }
+
+private:
+  std::unordered_map<uint64_t, std::vector<word*>> regions;
+  // Zeroed regions keyed by segment ID (high bits) and size in words (low bits).
+
+  static uint64_t key(SegmentBuilder* segment, uint words) {
+    return (uint64_t(segment->getSegmentId().value) << 32) | words;
+  }
+};
+
+void BuilderArena::reclaimAll() {
+  KJ_REQUIRE(segment0.getArena() != nullptr, "nothing allocated yet");
+
+  segment0.reset();
+  KJ_IF_MAYBE(s, moreSegments) {
+    for (auto& builder: s->get()->builders) {
+      if (builder->isWritable()) {
+        builder->reset();
+      } else {
+        builder->forgetExternal();
+      }
+    }
+  }
+  segmentWithSpace = &segment0;
+
+#if !CAPNP_LITE
+  localCapTable.clear();
+#endif
+
+  if (freeSpace.get() != nullptr) {
+    freeSpace = kj::heap<FreeSpace>();
+  }
+
+  // Re-reserve the root pointer.
+  KJ_ASSERT(segment0.allocate(POINTER_SIZE_IN_WORDS) == segment0.getPtrUnchecked(ZERO * WORDS));
+}
+
+void BuilderArena::setReuseFreedSpace(bool enable) {
+  if (!enable) {
+    freeSpace = nullptr;
+  } else if (freeSpace.get() == nullptr) {
+    freeSpace = kj::heap<FreeSpace>();
+  }
+}
+
+void BuilderArena::addFreeSpace(SegmentBuilder* segment, word* ptr, uint words) {
+  if (words == 0) return;
+
+  word* end = ptr + words;
+  if (segment->currentlyAllocated().end() == end) {
+    // The region is at the end of the segment, so just give it back to the segment.
+    segment->tryTruncate(end, ptr);
+  } else {
+    freeSpace->add(segment, ptr, words);
+  }
+}
+
+word* BuilderArena::tryReuseFreeSpace(SegmentBuilder* segment, uint words) {
+  return freeSpace->take(segment, words);
+}
+
+SegmentBuilder* BuilderArena::addExternalSegment(kj::ArrayPtr<const word> content,
+                                                 bool copyOnWrite) {
+  SegmentBuilder* result = addSegmentInternal(content);
+  result->copyOnWrite = copyOnWrite;
+  return result;
 }
 
 template <typename T>
@@ -150,9 +150,16 @@ public:
   inline void unread(WordCount64 amount);
   // Add back some words to the ReadLimiter.
 
+  inline void markTrusted() { trusted = true; }
+  inline bool isTrusted() { return trusted; }
+  // A trusted segment belongs to a message that has been fully validated (see
+  // MessageReader::validate()), so checkObject() and amplifiedRead() always succeed without doing
+  // any work.
+
 private:
   Arena* arena;
   SegmentId id;
+  bool trusted = false;  // fits in the padding after `id`
   kj::ArrayPtr<const word> ptr;  // size guaranteed to fit in SEGMENT_WORD_COUNT_BITS bits
   ReadLimiter* readLimiter;
 
@@ -190,6 +197,10 @@ public:
 
   inline bool isWritable() { return !readOnly; }
 
+  inline bool isCopyOnWrite() { return copyOnWrite; }
+  // A copy-on-write segment is a read-only segment whose objects are moved into writable space,
+  // one at a time, when a Builder is requested for them, instead of throwing.
+
   inline void tryTruncate(word* from, word* to);
   // If `from` points just past the current end of the segment, then move the end back to `to`.
   // Otherwise, do nothing.
@@ -199,16 +210,22 @@ public:
   // boundaries, then move the end up to `to` and return true. Otherwise, do nothing and return
   // false.
 
+  inline void forgetExternal();
+  // For a read-only segment, drop the reference to the external data so that the segment becomes
+  // empty. Used when compacting a message, after which nothing can point into the segment.
+
 private:
   word* pos;
   // Pointer to a pointer to the current end point of the segment, i.e. the location where the
   // next object should be allocated.
 
   bool readOnly;
+  bool copyOnWrite = false;
 
   void throwNotWritable();
 
   KJ_DISALLOW_COPY(SegmentBuilder);
+  friend class BuilderArena;
 };
 
 class Arena {
@@ -234,6 +251,9 @@ public:
   SegmentReader* tryGetSegment(SegmentId id) override;
   void reportReadLimitReached() override;
 
+  void markTrusted();
+  // Marks every segment, including ones not loaded yet, trusted.
+
 private:
   MessageReader* message;
   ReadLimiter readLimiter;
@@ -302,7 +322,7 @@ public:
   // the arena is guaranteed to succeed.  Therefore callers should try to allocate from a specific
   // segment first if there is one, then fall back to the arena.
 
-  SegmentBuilder* addExternalSegment(kj::ArrayPtr<const word> content);
+  SegmentBuilder* addExternalSegment(kj::ArrayPtr<const word> content, bool copyOnWrite = false);
   // Add a new segment to the arena which points to some existing memory region.  The segment is
   // assumed to be completley full; the arena will never allocate from it.  In fact, the segment
   // is considered read-only.  Any attempt to get a Builder pointing into this segment will throw
@@ -312,6 +332,26 @@ public:
   // large mmap'd file into a message as `Data` without forcing that data to actually be read in
   // from disk (until the message itself is written out).  `Orphanage` provides the public API for
   // this feature.
+  //
+  // If `copyOnWrite` is true, then asking for a Builder pointing into the segment does not throw;
+  // instead, the object is first copied into writable space (see SegmentBuilder::isCopyOnWrite()).
+
+  void reclaimAll();
+  // Zero and rewind every writable segment, empty every external segment, and drop all local
+  // capabilities, leaving just a null root pointer. The segments' memory is kept and reused for
+  // subsequent allocations. Every pointer into the message becomes invalid. Used by
+  // MessageBuilder::compact().
+
+  void setReuseFreedSpace(bool enable);
+  inline bool isReusingFreedSpace() { return freeSpace.get() != nullptr; }
+  // When enabled, objects zeroed because they were overwritten or discarded are remembered so
+  // that a later allocation of exactly the same size in the same segment can take their place.
+
+  void addFreeSpace(SegmentBuilder* segment, word* ptr, uint words);
+  // Record a zeroed region that nothing points to anymore. Only call if isReusingFreedSpace().
+
+  word* tryReuseFreeSpace(SegmentBuilder* segment, uint words);
+  // Take a previously-recorded region of exactly `words` words from `segment`, or return null.
 
   // implements Arena ------------------------------------------------
   SegmentReader* tryGetSegment(SegmentId id) override;
@@ -328,6 +368,8 @@ private:
     uint injectCap(kj::Own<ClientHook>&& cap) override;
     void dropCap(uint index) override;
 
+    inline void clear() { capTable.clear(); }
+
   private:
     kj::Vector<kj::Maybe<kj::Own<ClientHook>>> capTable;
 #endif // ! CAPNP_LITE
@@ -349,6 +391,10 @@ private:
   // segment.  This is not necessarily the last segment because addExternalSegment() may add a
   // segment that is already-full, in which case we don't update this pointer.
 
+  class FreeSpace;
+  kj::Own<FreeSpace> freeSpace;
+  // Null unless setReuseFreedSpace(true) was called.
+
   template <typename T>  // Can be `word` or `const word`.
   SegmentBuilder* addSegmentInternal(kj::ArrayPtr<T> content);
 };
@@ -393,6 +439,7 @@ inline const word* SegmentReader::checkOffset(const word* from, ptrdiff_t offset
 }
 
 inline bool SegmentReader::checkObject(const word* start, WordCountN<31> size) {
+  if (trusted) return true;
   auto startOffset = intervalLength(ptr.begin(), start, MAX_SEGMENT_WORDS);
 #ifdef KJ_DEBUG
   if (startOffset > bounded(ptr.size()) * WORDS) {
@@ -404,7 +451,7 @@ inline bool SegmentReader::checkObject(const word* start, WordCountN<31> size) {
 }
 
 inline bool SegmentReader::amplifiedRead(WordCount virtualAmount) {
-  return readLimiter->canRead(virtualAmount, arena);
+  return trusted || readLimiter->canRead(virtualAmount, arena);
 }
 
 inline Arena* SegmentReader::getArena() { return arena; }
@@ -479,6 +526,11 @@ inline void SegmentBuilder::tryTruncate(word* from, word* to) {
   if (pos == from) pos = to;
 }
 
+inline void SegmentBuilder::forgetExternal() {
+  ptr = kj::arrayPtr(ptr.begin(), ptr.begin());
+  pos = const_cast<word*>(ptr.begin());
+}
+
 inline bool SegmentBuilder::tryExtend(word* from, word* to) {
   // Careful about overflow.
   if (pos == from && to <= ptr.end() && to >= from) {
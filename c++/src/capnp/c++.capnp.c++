@@ -64,5 +64,64 @@ const ::capnp::_::RawSchema s_f264a779fef191ce = {
   0, 0, nullptr, nullptr, nullptr, { &s_f264a779fef191ce, nullptr, nullptr, 0, 0, nullptr }
 };
 #endif  // !CAPNP_LITE
+static const ::capnp::_::AlignedData<20> b_ce94085aa052a401 = {
+  {   0,   0,   0,   0,   5,   0,   6,   0,
+      1, 164,  82, 160,  90,   8, 148, 206,
+     16,   0,   0,   0,   5,   0,   0,   2,
+    129,  78,  48, 184, 123, 125, 248, 189,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     21,   0,   0,   0, 186,   0,   0,   0,
+     29,   0,   0,   0,   7,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     24,   0,   0,   0,   3,   0,   1,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     99,  97, 112, 110, 112,  47,  99,  43,
+     43,  46,  99,  97, 112, 110, 112,  58,
+    115, 116, 114, 101,  97, 109,   0,   0,
+      0,   0,   0,   0,   1,   0,   1,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0, }
+};
+::capnp::word const* const bp_ce94085aa052a401 = b_ce94085aa052a401.words;
+#if !CAPNP_LITE
+const ::capnp::_::RawSchema s_ce94085aa052a401 = {
+  0xce94085aa052a401, b_ce94085aa052a401.words, 20, nullptr, nullptr,
+  0, 0, nullptr, nullptr, nullptr, { &s_ce94085aa052a401, nullptr, nullptr, 0, 0, nullptr }
+};
+#endif  // !CAPNP_LITE
+static const ::capnp::_::AlignedData<21> b_9e8b7b9a5510e75a = {
+  {   0,   0,   0,   0,   5,   0,   6,   0,
+     90, 231,  16,  85, 154, 123, 139, 158,
+     16,   0,   0,   0,   5,   0,  17,   0,
+    129,  78,  48, 184, 123, 125, 248, 189,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     21,   0,   0,   0, 234,   0,   0,   0,
+     33,   0,   0,   0,   7,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     28,   0,   0,   0,   3,   0,   1,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     99,  97, 112, 110, 112,  47,  99,  43,
+     43,  46,  99,  97, 112, 110, 112,  58,
+     97, 108, 119,  97, 121, 115,  73, 110,
+    108, 105, 110, 101,   0,   0,   0,   0,
+      0,   0,   0,   0,   1,   0,   1,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0, }
+};
+::capnp::word const* const bp_9e8b7b9a5510e75a = b_9e8b7b9a5510e75a.words;
+#if !CAPNP_LITE
+const ::capnp::_::RawSchema s_9e8b7b9a5510e75a = {
+  0x9e8b7b9a5510e75a, b_9e8b7b9a5510e75a.words, 21, nullptr, nullptr,
+  0, 0, nullptr, nullptr, nullptr, { &s_9e8b7b9a5510e75a, nullptr, nullptr, 0, 0, nullptr }
+};
+#endif  // !CAPNP_LITE
 }  // namespace schemas
 }  // namespace capnp
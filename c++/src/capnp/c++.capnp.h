@@ -15,6 +15,8 @@ namespace schemas {
 
 CAPNP_DECLARE_SCHEMA(b9c6f99ebf805f2c);
 CAPNP_DECLARE_SCHEMA(f264a779fef191ce);
+CAPNP_DECLARE_SCHEMA(ce94085aa052a401);
+CAPNP_DECLARE_SCHEMA(9e8b7b9a5510e75a);
 
 }  // namespace schemas
 }  // namespace capnp
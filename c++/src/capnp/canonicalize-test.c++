@@ -22,6 +22,7 @@
 #include "message.h"
 #include "any.h"
 #include <kj/debug.h>
+#include <kj/io.h>
 #include <kj/test.h>
 #include "test-util.h"
 
@@ -387,6 +388,80 @@ KJ_TEST("bit list with nonzero padding") {
   ASSERT_EQ(canonicalWords.asBytes(), kj::arrayPtr(canonicalSegment.bytes, 3 * 8));
 }
 
+kj::Array<byte> writeCanonicalBytes(AnyStruct::Reader reader, uint threadCount) {
+  kj::VectorOutputStream output;
+  reader.writeCanonical(output, threadCount);
+  return kj::heapArray(output.getArray());
+}
+
+KJ_TEST("writeCanonical matches canonicalize") {
+  MallocMessageBuilder builder;
+  auto root = builder.initRoot<TestAllTypes>();
+  initTestMessage(root);
+
+  auto expected = canonicalize(root.asReader());
+  for (uint threadCount: {1, 2, 4}) {
+    KJ_EXPECT(writeCanonicalBytes(root.asReader(), threadCount) == expected.asBytes(),
+              threadCount);
+  }
+
+  MallocMessageBuilder emptyBuilder;
+  auto empty = emptyBuilder.initRoot<TestAllTypes>().asReader();
+  for (uint threadCount: {1, 4}) {
+    KJ_EXPECT(writeCanonicalBytes(empty, threadCount) == canonicalize(empty).asBytes(),
+              threadCount);
+  }
+}
+
+KJ_TEST("writeCanonical of a large multi-segment message in parallel") {
+  // Small fixed-size segments force plenty of far pointers.
+  MallocMessageBuilder builder(64, AllocationStrategy::FIXED_SIZE);
+  auto root = builder.initRoot<TestAllTypes>();
+  root.setInt32Field(123);
+
+  auto structs = root.initStructList(2000);
+  for (uint i = 0; i < structs.size(); i++) {
+    auto element = structs[i];
+    if (i % 5 == 0) continue;  // leave some elements empty, to exercise truncation
+    element.setUInt32Field(i);
+    element.setTextField(kj::str("element ", i));
+    auto bytes = element.initUInt8List(i % 13);
+    for (uint j = 0; j < bytes.size(); j++) bytes.set(j, i + j);
+    element.initBoolList(i % 11 + 1).set(0, i % 2 == 0);
+    if (i % 3 == 0) {
+      auto texts = element.initTextList(3);
+      texts.set(0, "foo");
+      texts.set(2, kj::str(i));
+      element.initStructField().setFloat64Field(i * 0.5);
+    }
+  }
+  root.initTextList(1000).set(999, "last");
+  KJ_ASSERT(builder.getSegmentsForOutput().size() > 1);
+
+  auto expected = canonicalize(root.asReader());
+  for (uint threadCount: {1, 3, 8}) {
+    KJ_EXPECT(writeCanonicalBytes(root.asReader(), threadCount) == expected.asBytes(),
+              threadCount);
+  }
+}
+
+KJ_TEST("writeCanonical rejects invalid messages") {
+  AlignedData<2> segment = {{
+    // Struct, one pointer field.
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,
+
+    // List pointer running off the end of the segment.
+    0x01, 0x00, 0x00, 0x00, 0x52, 0x00, 0x00, 0x00,
+  }};
+  kj::ArrayPtr<const word> segments[1] = {kj::arrayPtr(segment.words, 2)};
+  SegmentArrayMessageReader message(kj::arrayPtr(segments, 1));
+  auto root = message.getRoot<test::TestAnyPointer>();
+
+  for (uint threadCount: {1, 4}) {
+    KJ_EXPECT_THROW_MESSAGE("out-of-bounds", writeCanonicalBytes(root, threadCount));
+  }
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
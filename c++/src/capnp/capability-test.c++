@@ -517,6 +517,31 @@ TEST(Capability, DynamicServerInheritance) {
   EXPECT_EQ(2, callCount);
 }
 
+TEST(Capability, DynamicServerUnknownMethod) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  int callCount = 0;
+  Capability::Client client = DynamicCapability::Client(
+      kj::heap<TestExtendsDynamicImpl>(callCount));
+
+  auto checkUnimplemented = [&](uint64_t interfaceId, uint16_t methodId) {
+    auto request = client.typelessRequest(interfaceId, methodId, nullptr);
+    request.initAsAnyStruct(0, 0);
+    KJ_EXPECT(request.send().then([](auto&&) { return false; }, [](kj::Exception&& e) {
+      return e.getType() == kj::Exception::Type::UNIMPLEMENTED;
+    }).wait(waitScope));
+  };
+
+  // A method past the end of a superclass's list.
+  checkUnimplemented(typeId<test::TestInterface>(), 1000);
+
+  // An interface the server doesn't implement at all.
+  checkUnimplemented(typeId<test::TestPipeline>(), 0);
+
+  EXPECT_EQ(0, callCount);
+}
+
 class TestPipelineDynamicImpl final: public DynamicCapability::Server {
 public:
   TestPipelineDynamicImpl(int& callCount)
@@ -1031,6 +1056,82 @@ TEST(Capability, TransferCap) {
   }).wait(waitScope);
 }
 
+class ImmediateFooImpl final: public test::TestInterface::Server {
+public:
+  ImmediateFooImpl(int& callCount): callCount(callCount) {}
+
+  bool shouldDispatchImmediately(uint64_t interfaceId, uint16_t methodId) override {
+    return methodId == 0;  // foo() only
+  }
+
+protected:
+  kj::Promise<void> foo(FooContext context) override {
+    ++callCount;
+    context.getResults().setX("foo");
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> baz(BazContext context) override {
+    ++callCount;
+    return kj::READY_NOW;
+  }
+
+private:
+  int& callCount;
+};
+
+TEST(Capability, DispatchImmediately) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  int callCount = 0;
+  test::TestInterface::Client client(kj::heap<ImmediateFooImpl>(callCount));
+
+  auto promise1 = client.fooRequest().send();
+  EXPECT_EQ(1, callCount);
+
+  // baz() still waits for the event loop.
+  auto promise2 = client.bazRequest().send();
+  EXPECT_EQ(1, callCount);
+
+  EXPECT_EQ("foo", promise1.wait(waitScope).getX());
+  promise2.wait(waitScope);
+  EXPECT_EQ(2, callCount);
+}
+
+TEST(Capability, CallBatch) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  test::TestCallOrder::Client client(kj::heap<TestCallOrderImpl>());
+
+  CallBatch batch;
+  kj::Vector<kj::Promise<Response<test::TestCallOrder::GetCallSequenceResults>>> promises;
+  for (uint i = 0; i < 10; i++) {
+    auto request = client.getCallSequenceRequest();
+    request.setExpected(i);
+    promises.add(batch.add(kj::mv(request)));
+  }
+  EXPECT_EQ(10u, batch.size());
+
+  // Nothing is sent before send(), so this call comes first.
+  EXPECT_EQ(0u, client.getCallSequenceRequest().send().wait(waitScope).getN());
+
+  batch.send();
+  EXPECT_EQ(0u, batch.size());
+  for (uint i = 0; i < 10; i++) {
+    EXPECT_EQ(i + 1, promises[i].wait(waitScope).getN());
+  }
+
+  // A batch destroyed without sending rejects its promises.
+  kj::Maybe<kj::Promise<Response<test::TestCallOrder::GetCallSequenceResults>>> unsent;
+  {
+    CallBatch batch2;
+    unsent = batch2.add(client.getCallSequenceRequest());
+  }
+  KJ_EXPECT_THROW(FAILED, KJ_ASSERT_NONNULL(unsent).wait(waitScope));
+}
+
 }  // namespace
 }  // namespace _
 }  // namespace capnp
@@ -88,6 +88,10 @@ kj::Promise<void> Capability::Server::internalUnimplemented(
 
 ResponseHook::~ResponseHook() noexcept(false) {}
 
+kj::Promise<void> RequestHook::sendStreaming() {
+  return send().ignoreResult();
+}
+
 kj::Promise<void> ClientHook::whenResolved() {
   KJ_IF_MAYBE(promise, whenMoreResolved()) {
     return promise->then([](kj::Own<ClientHook>&& resolution) {
@@ -110,6 +114,8 @@ static inline uint firstSegmentSize(kj::Maybe<MessageSize> sizeHint) {
 
 class LocalResponse final: public ResponseHook, public kj::Refcounted {
 public:
+  KJ_POOLED_ALLOCATION(LocalResponse)
+
   LocalResponse(kj::Maybe<MessageSize> sizeHint)
       : message(firstSegmentSize(sizeHint)) {}
 
@@ -118,6 +124,8 @@ public:
 
 class LocalCallContext final: public CallContextHook, public kj::Refcounted {
 public:
+  KJ_POOLED_ALLOCATION(LocalCallContext)
+
   LocalCallContext(kj::Own<MallocMessageBuilder>&& request, kj::Own<ClientHook> clientRef,
                    kj::Own<kj::PromiseFulfiller<void>> cancelAllowedFulfiller)
       : request(kj::mv(request)), clientRef(kj::mv(clientRef)),
@@ -181,6 +189,8 @@ public:
 
 class LocalRequest final: public RequestHook {
 public:
+  KJ_POOLED_ALLOCATION(LocalRequest)
+
   inline LocalRequest(uint64_t interfaceId, uint16_t methodId,
                       kj::Maybe<MessageSize> sizeHint, kj::Own<ClientHook> client)
       : message(kj::heap<MallocMessageBuilder>(firstSegmentSize(sizeHint))),
@@ -420,6 +430,8 @@ kj::Own<ClientHook> QueuedPipeline::getPipelinedCap(kj::Array<PipelineOp>&& ops)
 
 class LocalPipeline final: public PipelineHook, public kj::Refcounted {
 public:
+  KJ_POOLED_ALLOCATION(LocalPipeline)
+
   inline LocalPipeline(kj::Own<CallContextHook>&& contextParam)
       : context(kj::mv(contextParam)),
         results(context->getResults(MessageSize { 0, 0 })) {}
@@ -465,18 +477,27 @@ public:
                               kj::Own<CallContextHook>&& context) override {
     auto contextPtr = context.get();
 
+    // Set this up before dispatching, in case the call is dispatched immediately and tail-calls
+    // right away.
+    auto tailPipelinePromise = context->onTailCall().then([](AnyPointer::Pipeline&& pipeline) {
+      return kj::mv(pipeline.hook);
+    });
+
     // We don't want to actually dispatch the call synchronously, because we don't want the callee
     // to have any side effects before the promise is returned to the caller.  This helps avoid
     // race conditions.
     //
-    // So, we do an evalLater() here.
+    // So, we do an evalLater() here, unless the server has said it doesn't need that.
     //
     // Note also that QueuedClient depends on this evalLater() to ensure that pipelined calls don't
     // complete before 'whenMoreResolved()' promises resolve.
-    auto promise = kj::evalLater([this,interfaceId,methodId,contextPtr]() {
+    auto dispatch = [this,interfaceId,methodId,contextPtr]() {
       return server->dispatchCall(interfaceId, methodId,
                                   CallContext<AnyPointer, AnyPointer>(*contextPtr));
-    }).attach(kj::addRef(*this));
+    };
+    auto promise = (server->shouldDispatchImmediately(interfaceId, methodId)
+        ? kj::evalNow(kj::mv(dispatch)) : kj::evalLater(kj::mv(dispatch)))
+        .attach(kj::addRef(*this));
 
     // We have to fork this promise for the pipeline to receive a copy of the answer.
     auto forked = promise.fork();
@@ -487,10 +508,6 @@ public:
           return kj::refcounted<LocalPipeline>(kj::mv(context));
         }));
 
-    auto tailPipelinePromise = context->onTailCall().then([](AnyPointer::Pipeline&& pipeline) {
-      return kj::mv(pipeline.hook);
-    });
-
     pipelinePromise = pipelinePromise.exclusiveJoin(kj::mv(tailPipelinePromise));
 
     auto completionPromise = forked.addBranch().attach(kj::mv(context));
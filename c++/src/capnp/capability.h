@@ -31,6 +31,7 @@
 
 #include <kj/async.h>
 #include <kj/vector.h>
+#include <kj/function.h>
 #include "raw-schema.h"
 #include "any.h"
 #include "pointer-helpers.h"
@@ -112,6 +113,17 @@ public:
   RemotePromise<Results> send() KJ_WARN_UNUSED_RESULT;
   // Send the call and return a promise for the results.
 
+  kj::Promise<void> sendStreaming() KJ_WARN_UNUSED_RESULT;
+  // Send the call as part of a stream of calls to the same capability, discarding the results.
+  // Use this for bulk transfers, e.g. uploading a file in chunks.
+  //
+  // The returned promise resolves once the capability's flow controller has room for another
+  // call -- often immediately -- rather than when this call returns, so a caller that waits
+  // on each promise before sending the next call keeps the pipe full without queuing unbounded
+  // data in memory. If a streaming call throws, subsequent sendStreaming() calls on the same
+  // capability reject with its exception. To learn whether the last calls succeeded, follow
+  // them with a regular call, which the server processes after them.
+
 private:
   kj::Own<RequestHook> hook;
 
@@ -122,6 +134,26 @@ private:
   friend class RequestHook;
 };
 
+template <typename Params>
+class StreamingRequest: public Params::Builder {
+  // A call to a method annotated `$Cxx.stream`.  Such a method has no results, so the generated
+  // `fooRequest()` returns a StreamingRequest, whose send() behaves like Request::sendStreaming().
+
+public:
+  inline StreamingRequest(typename Params::Builder builder, kj::Own<RequestHook>&& hook)
+      : Params::Builder(builder), hook(kj::mv(hook)) {}
+  inline StreamingRequest(decltype(nullptr)): Params::Builder(nullptr) {}
+
+  kj::Promise<void> send() KJ_WARN_UNUSED_RESULT;
+  // Send the call.  The returned promise resolves when the capability's flow controller has
+  // room for another call; see Request::sendStreaming().
+
+private:
+  kj::Own<RequestHook> hook;
+
+  friend class Capability::Client;
+};
+
 template <typename Results>
 class Response: public Results::Reader {
   // A completed call.  This class extends a Reader for the call's answer structure.  The Response
@@ -139,6 +171,34 @@ private:
   friend class ResponseHook;
 };
 
+class CallBatch {
+  // Collects calls and sends them all at once, in the order they were added.
+  //
+  // Calls sent during the same event loop turn are already written to a two-party connection
+  // together, so a loop calling send() is just as efficient when all the requests are ready at
+  // once.  CallBatch is for fanning out calls that are built up over time:  nothing is sent
+  // until send() is called, and then every call goes out back-to-back, in one flush.
+  //
+  // The promise returned by add() is a plain promise for the response, so calls in a batch
+  // can't be pipelined on.
+
+public:
+  CallBatch() = default;
+  KJ_DISALLOW_COPY(CallBatch);
+
+  template <typename Params, typename Results>
+  kj::Promise<Response<Results>> add(Request<Params, Results>&& request);
+  // Queue the call.  If the batch is destroyed without being sent, the returned promise rejects.
+
+  size_t size() const { return calls.size(); }
+
+  void send();
+  // Send every queued call.  The batch is then empty and may be reused.
+
+private:
+  kj::Vector<kj::Function<void()>> calls;
+};
+
 class Capability::Client {
   // Base type for capability clients.
 
@@ -211,6 +271,9 @@ protected:
   template <typename Params, typename Results>
   Request<Params, Results> newCall(uint64_t interfaceId, uint16_t methodId,
                                    kj::Maybe<MessageSize> sizeHint);
+  template <typename Params>
+  StreamingRequest<Params> newStreamingCall(uint64_t interfaceId, uint16_t methodId,
+                                            kj::Maybe<MessageSize> sizeHint);
 
 private:
   kj::Own<ClientHook> hook;
@@ -328,6 +391,19 @@ public:
   // is no longer needed.  `context` may be used to allocate the output struct and deal with
   // cancellation.
 
+  virtual bool shouldDispatchImmediately(uint64_t interfaceId, uint16_t methodId) {
+    return false;
+  }
+  // A call to a server in the same vat is normally dispatched on a later turn of the event loop,
+  // so that the method can have no side effects before the caller's `send()` returns.  Override
+  // this to return true for methods that don't need that protection; local calls to them are
+  // then dispatched synchronously from within `send()`, saving an event loop turn per call.
+  //
+  // Only do this for methods that neither call back into their caller nor depend on what the
+  // caller does after `send()`.  Immediately-dispatched calls that make further such calls
+  // recurse on the stack.  Calls the RPC system delivers on behalf of remote callers are then
+  // dispatched as soon as their message is read.
+
   // TODO(someday):  Method which can optionally be overridden to implement Join when the object is
   //   a proxy.
 
@@ -466,6 +542,11 @@ public:
   virtual RemotePromise<AnyPointer> send() = 0;
   // Send the call and return a promise for the result.
 
+  virtual kj::Promise<void> sendStreaming();
+  // Send a streaming call. See `Request::sendStreaming()`. The default implementation simply
+  // waits for each call to return, which is appropriate when there is no latency to hide (e.g.
+  // for local calls).
+
   virtual const void* getBrand() = 0;
   // Returns a void* that identifies who made this request.  This can be used by an RPC adapter to
   // discover when tail call is going to be sent over its own connection and therefore can be
@@ -737,6 +818,20 @@ private:
 // =======================================================================================
 // Inline implementation details
 
+template <typename Params, typename Results>
+kj::Promise<void> Request<Params, Results>::sendStreaming() {
+  auto promise = hook->sendStreaming();
+  hook = nullptr;  // prevent reuse
+  return promise;
+}
+
+template <typename Params>
+kj::Promise<void> StreamingRequest<Params>::send() {
+  auto promise = hook->sendStreaming();
+  hook = nullptr;  // prevent reuse
+  return promise;
+}
+
 template <typename Params, typename Results>
 RemotePromise<Results> Request<Params, Results>::send() {
   auto typelessPromise = hook->send();
@@ -757,6 +852,22 @@ RemotePromise<Results> Request<Params, Results>::send() {
   return RemotePromise<Results>(kj::mv(typedPromise), kj::mv(typedPipeline));
 }
 
+template <typename Params, typename Results>
+kj::Promise<Response<Results>> CallBatch::add(Request<Params, Results>&& request) {
+  auto paf = kj::newPromiseAndFulfiller<kj::Promise<Response<Results>>>();
+  calls.add([request = kj::mv(request), fulfiller = kj::mv(paf.fulfiller)]() mutable {
+    fulfiller->fulfill(kj::Promise<Response<Results>>(request.send()));
+  });
+  return kj::mv(paf.promise);
+}
+
+inline void CallBatch::send() {
+  auto toSend = kj::mv(calls);
+  for (auto& call: toSend) {
+    call();
+  }
+}
+
 inline Capability::Client::Client(kj::Own<ClientHook>&& hook): hook(kj::mv(hook)) {}
 template <typename T, typename>
 inline Capability::Client::Client(kj::Own<T>&& server)
@@ -787,6 +898,12 @@ inline Request<Params, Results> Capability::Client::newCall(
   auto typeless = hook->newCall(interfaceId, methodId, sizeHint);
   return Request<Params, Results>(typeless.template getAs<Params>(), kj::mv(typeless.hook));
 }
+template <typename Params>
+inline StreamingRequest<Params> Capability::Client::newStreamingCall(
+    uint64_t interfaceId, uint16_t methodId, kj::Maybe<MessageSize> sizeHint) {
+  auto typeless = hook->newCall(interfaceId, methodId, sizeHint);
+  return StreamingRequest<Params>(typeless.template getAs<Params>(), kj::mv(typeless.hook));
+}
 
 template <typename Params, typename Results>
 inline CallContext<Params, Results>::CallContext(CallContextHook& hook): hook(&hook) {}
@@ -25,6 +25,8 @@
 #include <kj/debug.h>
 #include <kj/string.h>
 #include <kj/test.h>
+#include <stdlib.h>
+#include <string.h>
 
 namespace capnp {
 namespace _ {  // private
@@ -108,7 +110,7 @@ const char ALL_TYPES_JSON[] =
     "    \"uInt16List\": [1234, 5678, 0, 65535],\n"
     "    \"uInt32List\": [12345678, 90123456, 0, 4294967295],\n"
     "    \"uInt64List\": [\"123456789012345\", \"678901234567890\", \"0\", \"18446744073709551615\"],\n"
-    "    \"float32List\": [0, 1234567, 9.9999999338158125e36, -9.9999999338158125e36, 9.99999991097579e-38, -9.99999991097579e-38],\n"
+    "    \"float32List\": [0, 1234567, 9.999999933815813e36, -9.999999933815813e36, 9.99999991097579e-38, -9.99999991097579e-38],\n"
     "    \"float64List\": [0, 123456789012345, 1e306, -1e306, 1e-306, -1e-306],\n"
     "    \"textList\": [\"quux\", \"corge\", \"grault\"],\n"
     "    \"dataList\": [[103, 97, 114, 112, 108, 121], [119, 97, 108, 100, 111], [102, 114, 101, 100]],\n"
@@ -333,6 +335,199 @@ KJ_TEST("decode test message") {
   KJ_EXPECT(root.toString().flatten() == decodedRoot.toString().flatten());
 }
 
+KJ_TEST("streaming encode and decode") {
+  MallocMessageBuilder message;
+  auto root = message.getRoot<TestAllTypes>();
+  initTestMessage(root);
+
+  JsonCodec json;
+  auto encoded = json.encode(root);
+
+  {
+    // A tiny buffer forces the writer to flush in the middle of tokens.
+    kj::VectorOutputStream output(16);
+    json.encode(root, output);
+    KJ_EXPECT(kj::heapString(output.getArray().asChars()) == encoded);
+  }
+
+  {
+    // Likewise, a tiny read buffer makes numbers, strings and keywords span refills.
+    kj::ArrayInputStream rawInput(encoded.asBytes());
+    byte buffer[3];
+    kj::BufferedInputStreamWrapper input(rawInput, buffer);
+
+    MallocMessageBuilder decodedMessage;
+    auto decodedRoot = decodedMessage.initRoot<TestAllTypes>();
+    json.decode(input, decodedRoot);
+    KJ_EXPECT(root.toString().flatten() == decodedRoot.toString().flatten());
+  }
+
+  {
+    kj::StringPtr text = "{\"textField\":\"abc\"} trailing";
+    kj::ArrayInputStream input(text.asBytes());
+    MallocMessageBuilder decodedMessage;
+    auto decodedRoot = decodedMessage.initRoot<TestAllTypes>();
+    KJ_EXPECT_THROW_MESSAGE("Input remains", json.decode(input, decodedRoot));
+  }
+}
+
+KJ_TEST("decode hex escapes") {
+  JsonCodec json;
+  MallocMessageBuilder message;
+  auto root = message.initRoot<TestAllTypes>();
+  json.decode("{\"textField\":\"a\\u000aB\\u004a\\u006C\"}", root);
+  KJ_EXPECT(root.getTextField().asReader() == "a\nBJl", root.getTextField());
+}
+
+KJ_TEST("streaming decode of large lists") {
+  constexpr uint COUNT = 10000;
+  kj::Vector<char> text;
+  text.addAll(kj::StringPtr("{\"int32List\":["));
+  for (uint i = 0; i < COUNT; i++) {
+    if (i > 0) text.add(',');
+    text.addAll(kj::str(i * 3));
+  }
+  text.addAll(kj::StringPtr("],\"structList\":[{\"int8Field\":1},{\"int8Field\":2}]}"));
+
+  kj::ArrayInputStream rawInput(text.asPtr().asBytes());
+  byte buffer[64];
+  kj::BufferedInputStreamWrapper input(rawInput, buffer);
+
+  JsonCodec json;
+  MallocMessageBuilder message;
+  auto root = message.initRoot<TestAllTypes>();
+  json.decode(input, root);
+
+  auto list = root.getInt32List();
+  KJ_ASSERT(list.size() == COUNT);
+  for (uint i = 0; i < COUNT; i++) {
+    KJ_ASSERT(list[i] == i * 3, i);
+  }
+  auto structList = root.getStructList();
+  KJ_ASSERT(structList.size() == 2);
+  KJ_EXPECT(structList[0].getInt8Field() == 1);
+  KJ_EXPECT(structList[1].getInt8Field() == 2);
+}
+
+class TestRandom {
+  // Small deterministic PRNG so the cross-checks below are reproducible.
+public:
+  uint next(uint bound) {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    return (state >> 33) % bound;
+  }
+
+private:
+  uint64_t state = 12345;
+};
+
+KJ_TEST("number parsing matches strtod") {
+  // Numbers that qualify for the exact fast path must parse to the same bits as strtod().
+  TestRandom random;
+  JsonCodec json;
+
+  for (uint i = 0; i < 20000; i++) {
+    kj::Vector<char> text;
+    if (random.next(2)) text.add('-');
+    uint intDigits = random.next(10);
+    if (intDigits == 0) {
+      text.add('0');
+    } else {
+      text.add('1' + random.next(9));
+      for (uint j = 1; j < intDigits * 2; j++) text.add('0' + random.next(10));
+    }
+    if (random.next(2)) {
+      text.add('.');
+      for (uint j = 0, n = random.next(20); j < n; j++) text.add('0' + random.next(10));
+    }
+    if (random.next(3) == 0) {
+      text.add(random.next(2) ? 'e' : 'E');
+      switch (random.next(3)) {
+        case 0: text.add('+'); break;
+        case 1: text.add('-'); break;
+      }
+      for (uint j = 0, n = 1 + random.next(2); j < n; j++) text.add('0' + random.next(10));
+    }
+    text.add('\0');
+
+    MallocMessageBuilder message;
+    auto root = message.initRoot<JsonValue>();
+    json.decodeRaw(kj::StringPtr(text.begin(), text.size() - 1), root);
+    double expected = strtod(text.begin(), nullptr);
+    double actual = root.getNumber();
+    KJ_ASSERT(memcmp(&expected, &actual, sizeof(double)) == 0, text.begin(), expected, actual);
+  }
+}
+
+KJ_TEST("string decoding round trip") {
+  // Exercises the vectorized scan for quotes and backslashes at every alignment, including with
+  // a read buffer small enough that strings span refills.
+  TestRandom random;
+  JsonCodec json;
+
+  for (uint i = 0; i < 2000; i++) {
+    kj::Vector<char> chars;
+    for (uint j = 0, n = random.next(100); j < n; j++) {
+      switch (random.next(8)) {
+        case 0: chars.add('"'); break;
+        case 1: chars.add('\\'); break;
+        case 2: chars.add(1 + random.next(31)); break;
+        case 3: chars.add(0x80 + random.next(128)); break;  // UTF-8 bytes are never escaped.
+        default: chars.add(' ' + random.next(95)); break;
+      }
+    }
+    chars.add('\0');
+    kj::StringPtr expected(chars.begin(), chars.size() - 1);
+
+    auto encoded = kj::str("{\"textField\":", json.encode(Text::Reader(expected)), "}");
+
+    MallocMessageBuilder message;
+    auto root = message.initRoot<TestAllTypes>();
+    json.decode(encoded, root);
+    KJ_ASSERT(root.getTextField().asReader() == expected);
+
+    kj::ArrayInputStream rawInput(encoded.asBytes());
+    byte buffer[7];
+    kj::BufferedInputStreamWrapper input(rawInput, buffer);
+    MallocMessageBuilder message2;
+    auto root2 = message2.initRoot<TestAllTypes>();
+    json.decode(input, root2);
+    KJ_ASSERT(root2.getTextField().asReader() == expected);
+  }
+}
+
+KJ_TEST("text is decoded in place") {
+  JsonCodec json;
+
+  // Strings which fit in the input buffer are unescaped straight into the message, including
+  // list elements.
+  MallocMessageBuilder message;
+  auto root = message.initRoot<TestAllTypes>();
+  json.decode(
+      "{\"textField\":\"caf\xc3\xa9 \\\"quoted\\\" \\/ \\u0041\\t\","
+      "\"textList\":[\"\",\"plain text with nothing to escape\",\"a\\\\b\"]}", root);
+  KJ_EXPECT(root.getTextField().asReader() == "caf\xc3\xa9 \"quoted\" / A\t",
+            root.getTextField());
+  auto list = root.getTextList().asReader();
+  KJ_ASSERT(list.size() == 3);
+  KJ_EXPECT(list[0] == "");
+  KJ_EXPECT(list[1] == "plain text with nothing to escape");
+  KJ_EXPECT(list[2] == "a\\b");
+
+  // Plain strings are written out verbatim.
+  KJ_EXPECT(json.encode(Text::Reader("caf\xc3\xa9 plain")) == "\"caf\xc3\xa9 plain\"");
+
+  // Malformed strings are still rejected.
+  MallocMessageBuilder message2;
+  auto root2 = message2.initRoot<TestAllTypes>();
+  KJ_EXPECT_THROW_MESSAGE("Invalid escape",
+      json.decode("{\"textField\":\"a\\qb\"}", root2));
+  KJ_EXPECT_THROW_MESSAGE("Invalid hex digit",
+      json.decode("{\"textField\":\"a\\u00g1\"}", root2));
+  KJ_EXPECT_THROW_MESSAGE("ends prematurely",
+      json.decode("{\"textField\":\"abc", root2));
+}
+
 KJ_TEST("basic json decoding") {
   // TODO(cleanup): this test is a mess!
   JsonCodec json;
@@ -681,6 +876,54 @@ KJ_TEST("register field handler") {
   KJ_EXPECT(json.encode(root) == "{\"corge\":Frob(123,\"efg\"),\"baz\":\"abcd\"}");
 }
 
+KJ_TEST("handlers registered after encoding take effect") {
+  // The encoder caches per-type plans that include the handlers; adding a handler must not leave
+  // a stale plan behind.
+  MallocMessageBuilder message;
+  auto root = message.getRoot<test::TestOldVersion>();
+  root.setOld1(123);
+  root.setOld2("foo");
+
+  JsonCodec json;
+  KJ_EXPECT(json.encode(root) == "{\"old1\":\"123\",\"old2\":\"foo\"}");
+
+  TestHandler handler;
+  json.addTypeHandler(handler);
+  KJ_EXPECT(json.encode(root) == "{\"old1\":\"123\",\"old2\":Frob(123,\"foo\")}");
+}
+
+class TestStructHandler: public JsonCodec::Handler<DynamicStruct> {
+public:
+  void encode(const JsonCodec& codec, DynamicStruct::Reader input,
+              JsonValue::Builder output) const override {
+    auto call = output.initCall();
+    call.setFunction("S");
+    call.initParams(1)[0].setNumber(input.get("int32Field").as<int32_t>());
+  }
+
+  void decode(const JsonCodec& codec, JsonValue::Reader input,
+              DynamicStruct::Builder output) const override {
+    KJ_UNIMPLEMENTED("TestStructHandler::decode");
+  }
+};
+
+KJ_TEST("struct type handler applies to struct fields and list elements") {
+  MallocMessageBuilder message;
+  auto root = message.getRoot<test::TestDefaults>();
+  root.initStructField().setInt32Field(7);
+  auto list = root.initStructList(2);
+  list[0].setInt32Field(1);
+  list[1].setInt32Field(2);
+
+  TestStructHandler handler;
+  JsonCodec json;
+  json.addTypeHandler(Schema::from<TestAllTypes>(), handler);
+
+  auto encoded = json.encode(root);
+  KJ_EXPECT(strstr(encoded.cStr(), "\"structField\":S(7)") != nullptr, encoded);
+  KJ_EXPECT(strstr(encoded.cStr(), "\"structList\":[S(1),S(2)]") != nullptr, encoded);
+}
+
 class TestCapabilityHandler: public JsonCodec::Handler<test::TestInterface> {
 public:
   void encode(const JsonCodec& codec, test::TestInterface::Client input,
@@ -27,12 +27,63 @@
 #include <capnp/orphan.h>
 #include <kj/debug.h>
 #include <kj/function.h>
+#include <kj/map.h>
+#include <kj/mutex.h>
 #include <kj/vector.h>
 
+#if __SSE2__
+#include <emmintrin.h>
+#elif __ARM_NEON && __aarch64__
+#include <arm_neon.h>
+#endif
+
 namespace capnp {
 
 namespace {
 
+const char* findEscapeSpecial(const char* pos, const char* end) {
+  // Returns a pointer to the first character in [pos, end) which JSON output must escape -- '"',
+  // '\\', '/' or a control character -- or `end`.
+
+#if __SSE2__
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i slash = _mm_set1_epi8('/');
+  const __m128i maxControl = _mm_set1_epi8(0x1f);
+  while (end - pos >= 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+    __m128i hits = _mm_or_si128(_mm_or_si128(
+        _mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)), _mm_or_si128(
+        _mm_cmpeq_epi8(chunk, slash),
+        _mm_cmpeq_epi8(_mm_max_epu8(chunk, maxControl), maxControl)));  // unsigned <= 0x1f
+    int mask = _mm_movemask_epi8(hits);
+    if (mask != 0) {
+      return pos + __builtin_ctz(mask);
+    }
+    pos += 16;
+  }
+#elif __ARM_NEON && __aarch64__
+  const uint8x16_t quote = vdupq_n_u8('"');
+  const uint8x16_t backslash = vdupq_n_u8('\\');
+  const uint8x16_t slash = vdupq_n_u8('/');
+  const uint8x16_t space = vdupq_n_u8(0x20);
+  while (end - pos >= 16) {
+    uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(pos));
+    uint8x16_t hits = vorrq_u8(vorrq_u8(vceqq_u8(chunk, quote), vceqq_u8(chunk, backslash)),
+                               vorrq_u8(vceqq_u8(chunk, slash), vcltq_u8(chunk, space)));
+    if (vmaxvq_u8(hits) != 0) break;  // Find the exact position below.
+    pos += 16;
+  }
+#endif
+
+  while (pos < end) {
+    uint8_t c = *pos;
+    if (c == '"' || c == '\\' || c == '/' || c < 0x20) break;
+    ++pos;
+  }
+  return pos;
+}
+
 struct TypeHash {
   size_t operator()(const Type& type) const {
     return type.hashCode();
@@ -45,6 +96,58 @@ struct FieldHash {
   }
 };
 
+class JsonWriter {
+  // Writes text directly into a BufferedOutputStream's buffer, handing each buffer back to the
+  // stream as it fills up.
+
+public:
+  explicit JsonWriter(kj::BufferedOutputStream& stream): stream(stream) {
+    reset();
+  }
+  KJ_DISALLOW_COPY(JsonWriter);
+
+  inline void write(char c) {
+    if (pos == end) {
+      flush();
+      if (pos == end) {
+        stream.write(&c, 1);
+        return;
+      }
+    }
+    *pos++ = c;
+  }
+
+  void write(kj::ArrayPtr<const char> text) {
+    if (text.size() > size_t(end - pos)) {
+      flush();
+      if (text.size() > size_t(end - pos)) {
+        stream.write(text.begin(), text.size());
+        reset();
+        return;
+      }
+    }
+    memcpy(pos, text.begin(), text.size());
+    pos += text.size();
+  }
+
+  void flush() {
+    stream.write(begin, pos - begin);
+    reset();
+  }
+
+private:
+  kj::BufferedOutputStream& stream;
+  char* begin;
+  char* pos;
+  char* end;
+
+  void reset() {
+    auto buffer = stream.getWriteBuffer();
+    begin = pos = reinterpret_cast<char*>(buffer.begin());
+    end = begin + buffer.size();
+  }
+};
+
 }  // namespace
 
 struct JsonCodec::Impl {
@@ -54,6 +157,107 @@ struct JsonCodec::Impl {
   std::unordered_map<Type, HandlerBase*, TypeHash> typeHandlers;
   std::unordered_map<StructSchema::Field, HandlerBase*, FieldHash> fieldHandlers;
 
+  struct StructPlan {
+    // Everything the streaming encoder and decoder need to know about one struct type, worked
+    // out once: table-driven field access (see StructAccessPlan), each field's name already
+    // quoted and escaped, the handler that applies to each field, and the plans of nested struct
+    // types. Encoding a struct then does no schema reads or handler lookups.
+
+    struct Field {
+      const StructAccessPlan::Field* access;
+
+      kj::String name;
+      // The field name as JSON, quoted and followed by ':'.
+
+      const HandlerBase* handler;
+      // The field's handler if one is registered, else the handler for the field's type, if any.
+
+      const StructPlan* structPlan;
+      const HandlerBase* elementHandler;
+      // For struct and group fields, the plan for the field's type. For lists of structs, the
+      // plan and handler (if any) for the element type. Otherwise null.
+    };
+
+    StructAccessPlan access;
+    kj::Array<Field> fields;  // parallel to access.getFields()
+    kj::Array<const Field*> nonUnionFields;
+    kj::HashMap<kj::StringPtr, const Field*> fieldsByName;
+
+    explicit StructPlan(StructSchema schema): access(schema) {}
+  };
+
+  typedef std::unordered_map<Type, kj::Own<StructPlan>, TypeHash> StructPlanMap;
+  kj::MutexGuarded<StructPlanMap> structPlans;
+  // Built on first use. Plans capture handlers, so the cache is cleared when one is added.
+
+  class Decoder;
+
+  const HandlerBase* findTypeHandler(Type type) const {
+    auto iter = typeHandlers.find(type);
+    return iter == typeHandlers.end() ? nullptr : iter->second;
+  }
+
+  const StructPlan& getStructPlan(StructSchema schema) const {
+    {
+      auto lock = structPlans.lockShared();
+      auto iter = lock->find(schema);
+      if (iter != lock->end()) return *iter->second;
+    }
+
+    auto lock = structPlans.lockExclusive();
+    return getStructPlan(*lock, schema);
+  }
+
+  const StructPlan& getStructPlan(StructPlanMap& plans, StructSchema schema) const {
+    auto iter = plans.find(schema);
+    if (iter != plans.end()) return *iter->second;
+
+    // Register the plan before filling it in, so that recursive types find it.
+    auto ownPlan = kj::heap<StructPlan>(schema);
+    auto& plan = *ownPlan;
+    plans.emplace(schema, kj::mv(ownPlan));
+
+    auto accessFields = plan.access.getFields();
+    auto fields = kj::heapArrayBuilder<StructPlan::Field>(accessFields.size());
+    for (auto& access: accessFields) {
+      auto schemaField = access.getField();
+      auto type = access.getType();
+
+      const HandlerBase* handler = findTypeHandler(type);
+      auto fieldHandler = fieldHandlers.find(schemaField);
+      if (fieldHandler != fieldHandlers.end()) handler = fieldHandler->second;
+
+      const StructPlan* structPlan = nullptr;
+      const HandlerBase* elementHandler = nullptr;
+      if (type.which() == schema::Type::STRUCT) {
+        structPlan = &getStructPlan(plans, type.asStruct());
+      } else if (type.which() == schema::Type::LIST) {
+        auto elementType = type.asList().getElementType();
+        if (elementType.which() == schema::Type::STRUCT) {
+          structPlan = &getStructPlan(plans, elementType.asStruct());
+          elementHandler = findTypeHandler(elementType);
+        }
+      }
+
+      fields.add(StructPlan::Field {
+        &access, kj::str(encodeString(schemaField.getProto().getName()), ':'),
+        handler, structPlan, elementHandler
+      });
+    }
+    plan.fields = fields.finish();
+
+    plan.nonUnionFields = KJ_MAP(access, plan.access.getNonUnionFields()) {
+      return kj::implicitCast<const StructPlan::Field*>(
+          &plan.fields[access - accessFields.begin()]);
+    };
+
+    for (auto& field: plan.fields) {
+      plan.fieldsByName.insert(field.access->getField().getProto().getName(), &field);
+    }
+
+    return plan;
+  }
+
   kj::StringTree encodeRaw(JsonValue::Reader value, uint indent, bool& multiline,
                            bool hasPrefix) const {
     switch (value.which()) {
@@ -183,6 +387,324 @@ struct JsonCodec::Impl {
 
     return kj::strTree(prefix, kj::StringTree(kj::mv(elements), delim), suffix);
   }
+
+  // -----------------------------------------------------------------
+  // Streaming (compact) encoding
+  //
+  // These produce the same text as the JsonValue-based path with prettyPrint disabled, but write
+  // it out as they go.
+
+  void writeRaw(JsonValue::Reader value, JsonWriter& out) const {
+    switch (value.which()) {
+      case JsonValue::NULL_:
+        out.write(kj::StringPtr("null"));
+        return;
+      case JsonValue::BOOLEAN:
+        writeBool(value.getBoolean(), out);
+        return;
+      case JsonValue::NUMBER:
+        writeNumber(value.getNumber(), out);
+        return;
+
+      case JsonValue::STRING:
+        writeString(value.getString(), out);
+        return;
+
+      case JsonValue::ARRAY: {
+        out.write('[');
+        bool first = true;
+        for (auto element: value.getArray()) {
+          if (!first) out.write(',');
+          first = false;
+          writeRaw(element, out);
+        }
+        out.write(']');
+        return;
+      }
+
+      case JsonValue::OBJECT: {
+        out.write('{');
+        bool first = true;
+        for (auto field: value.getObject()) {
+          if (!first) out.write(',');
+          first = false;
+          writeString(field.getName(), out);
+          out.write(':');
+          writeRaw(field.getValue(), out);
+        }
+        out.write('}');
+        return;
+      }
+
+      case JsonValue::CALL: {
+        auto call = value.getCall();
+        out.write(call.getFunction());
+        out.write('(');
+        bool first = true;
+        for (auto param: call.getParams()) {
+          if (!first) out.write(',');
+          first = false;
+          writeRaw(param, out);
+        }
+        out.write(')');
+        return;
+      }
+    }
+
+    KJ_FAIL_ASSERT("unknown JsonValue type", static_cast<uint>(value.which()));
+  }
+
+  void writeBool(bool value, JsonWriter& out) const {
+    out.write(value ? kj::StringPtr("true") : kj::StringPtr("false"));
+  }
+
+  void writeNumber(double value, JsonWriter& out) const {
+    // All numbers go through double, as they do when stored in a JsonValue.
+    auto chars = kj::toCharSequence(value);
+    out.write(kj::arrayPtr(chars.begin(), chars.size()));
+  }
+
+  void writeByte(byte value, JsonWriter& out) const {
+    // Same digits as writeNumber() would produce, without formatting a double.
+    char digits[3];
+    char* p = digits + sizeof(digits);
+    do {
+      *--p = '0' + value % 10;
+      value /= 10;
+    } while (value > 0);
+    out.write(kj::arrayPtr(p, digits + sizeof(digits)));
+  }
+
+  template <typename T>
+  void writeQuotedInteger(T value, JsonWriter& out) const {
+    auto chars = kj::toCharSequence(value);
+    out.write('"');
+    out.write(kj::arrayPtr(chars.begin(), chars.size()));
+    out.write('"');
+  }
+
+  void writeString(kj::StringPtr chars, JsonWriter& out) const {
+    // Same escaping as encodeString().  Runs of characters that need no escaping are found with
+    // findEscapeSpecial() and written in one piece, so a string with nothing to escape is a single
+    // copy into the output buffer.
+
+    static const char HEXDIGITS[] = "0123456789abcdef";
+
+    out.write('"');
+    const char* p = chars.begin();
+    for (;;) {
+      const char* runEnd = findEscapeSpecial(p, chars.end());
+      out.write(kj::arrayPtr(p, runEnd));
+      if (runEnd == chars.end()) break;
+
+      p = runEnd;
+      uint8_t c = *p++;
+      switch (c) {
+        case '\"': out.write(kj::StringPtr("\\\"")); break;
+        case '\\': out.write(kj::StringPtr("\\\\")); break;
+        case '/' : out.write(kj::StringPtr("\\/" )); break;
+        case '\b': out.write(kj::StringPtr("\\b")); break;
+        case '\f': out.write(kj::StringPtr("\\f")); break;
+        case '\n': out.write(kj::StringPtr("\\n")); break;
+        case '\r': out.write(kj::StringPtr("\\r")); break;
+        case '\t': out.write(kj::StringPtr("\\t")); break;
+        default: {
+          char hex[6] = { '\\', 'u', '0', '0', HEXDIGITS[c / 16], HEXDIGITS[c % 16] };
+          out.write(kj::arrayPtr(hex, sizeof(hex)));
+          break;
+        }
+      }
+    }
+    out.write('"');
+  }
+
+  void writeWithHandler(const JsonCodec& codec, const HandlerBase& handler,
+                        DynamicValue::Reader input, JsonWriter& out) const {
+    // Handlers produce a JsonValue, so build one for just this value.
+    MallocMessageBuilder message;
+    auto json = message.getRoot<JsonValue>();
+    handler.encodeBase(codec, input, json);
+    writeRaw(json, out);
+  }
+
+  void write(const JsonCodec& codec, DynamicValue::Reader input, Type type,
+             JsonWriter& out) const {
+    // Mirrors JsonCodec::encode(DynamicValue::Reader, Type, JsonValue::Builder).
+
+    auto iter = typeHandlers.find(type);
+    if (iter != typeHandlers.end()) {
+      writeWithHandler(codec, *iter->second, input, out);
+      return;
+    }
+
+    switch (type.which()) {
+      case schema::Type::VOID:
+        out.write(kj::StringPtr("null"));
+        break;
+      case schema::Type::BOOL:
+        writeBool(input.as<bool>(), out);
+        break;
+      case schema::Type::INT8:
+      case schema::Type::INT16:
+      case schema::Type::INT32:
+      case schema::Type::UINT8:
+      case schema::Type::UINT16:
+      case schema::Type::UINT32:
+        writeNumber(input.as<double>(), out);
+        break;
+      case schema::Type::FLOAT32:
+      case schema::Type::FLOAT64:
+        {
+          double value = input.as<double>();
+          // Inf, -inf and NaN are not allowed in the JSON spec. Storing into string.
+          if (kj::inf() == value) {
+            out.write(kj::StringPtr("\"Infinity\""));
+          } else if (-kj::inf() == value) {
+            out.write(kj::StringPtr("\"-Infinity\""));
+          } else if (kj::isNaN(value)) {
+            out.write(kj::StringPtr("\"NaN\""));
+          } else {
+            writeNumber(value, out);
+          }
+        }
+        break;
+      case schema::Type::INT64:
+        writeQuotedInteger(input.as<int64_t>(), out);
+        break;
+      case schema::Type::UINT64:
+        writeQuotedInteger(input.as<uint64_t>(), out);
+        break;
+      case schema::Type::TEXT:
+        writeString(input.as<Text>(), out);
+        break;
+      case schema::Type::DATA: {
+        auto bytes = input.as<Data>();
+        out.write('[');
+        for (auto i: kj::indices(bytes)) {
+          if (i > 0) out.write(',');
+          writeByte(bytes[i], out);
+        }
+        out.write(']');
+        break;
+      }
+      case schema::Type::LIST: {
+        auto list = input.as<DynamicList>();
+        auto elementType = type.asList().getElementType();
+        if (elementType.which() == schema::Type::STRUCT) {
+          writeStructList(codec, list, getStructPlan(elementType.asStruct()),
+                          findTypeHandler(elementType), out);
+          break;
+        }
+        out.write('[');
+        for (auto i: kj::indices(list)) {
+          if (i > 0) out.write(',');
+          write(codec, list[i], elementType, out);
+        }
+        out.write(']');
+        break;
+      }
+      case schema::Type::ENUM: {
+        auto e = input.as<DynamicEnum>();
+        KJ_IF_MAYBE(symbol, e.getEnumerant()) {
+          writeString(symbol->getProto().getName(), out);
+        } else {
+          writeNumber(e.getRaw(), out);
+        }
+        break;
+      }
+      case schema::Type::STRUCT:
+        writeStruct(codec, input.as<DynamicStruct>(), getStructPlan(type.asStruct()), out);
+        break;
+      case schema::Type::INTERFACE:
+        KJ_FAIL_REQUIRE("don't know how to JSON-encode capabilities; "
+                        "please register a JsonCodec::Handler for this");
+      case schema::Type::ANY_POINTER:
+        KJ_FAIL_REQUIRE("don't know how to JSON-encode AnyPointer; "
+                        "please register a JsonCodec::Handler for this");
+    }
+  }
+
+  void writeStruct(const JsonCodec& codec, DynamicStruct::Reader value, const StructPlan& plan,
+                   JsonWriter& out) const {
+    // Same output as the STRUCT case of JsonCodec::encode(), driven by the plan.
+
+    auto accessFields = plan.access.getFields();
+
+    // We try to write the union field, if any, in proper order with the rest.
+    const StructPlan::Field* unionField = nullptr;
+    bool unionFieldIsNull = false;
+
+    KJ_IF_MAYBE(access, value.which(plan.access)) {
+      // Even if the union field is null, if it is not the default field of the union then we
+      // have to print it anyway.
+      unionFieldIsNull = !value.has(*access);
+      if (access->getField().getProto().getDiscriminantValue() != 0 || !unionFieldIsNull) {
+        unionField = &plan.fields[access - accessFields.begin()];
+      }
+    }
+
+    bool first = true;
+    auto writeField = [&](const StructPlan::Field& field, bool isNull) {
+      if (!first) out.write(',');
+      first = false;
+      out.write(field.name);
+      if (isNull) {
+        out.write(kj::StringPtr("null"));
+      } else {
+        writeFieldValue(codec, field, value.get(*field.access), out);
+      }
+    };
+
+    out.write('{');
+    for (auto field: plan.nonUnionFields) {
+      if (unionField != nullptr && unionField < field) {
+        writeField(*unionField, unionFieldIsNull);
+        unionField = nullptr;
+      }
+      if (value.has(*field->access)) {
+        writeField(*field, false);
+      }
+    }
+    if (unionField != nullptr) {
+      // Union field not printed yet; must be last.
+      writeField(*unionField, unionFieldIsNull);
+    }
+    out.write('}');
+  }
+
+  void writeStructList(const JsonCodec& codec, DynamicList::Reader list, const StructPlan& plan,
+                       const HandlerBase* handler, JsonWriter& out) const {
+    out.write('[');
+    for (auto i: kj::indices(list)) {
+      if (i > 0) out.write(',');
+      if (handler != nullptr) {
+        writeWithHandler(codec, *handler, list[i], out);
+      } else {
+        writeStruct(codec, list[i].as<DynamicStruct>(), plan, out);
+      }
+    }
+    out.write(']');
+  }
+
+  void writeFieldValue(const JsonCodec& codec, const StructPlan::Field& field,
+                       DynamicValue::Reader input, JsonWriter& out) const {
+    if (field.handler != nullptr) {
+      writeWithHandler(codec, *field.handler, input, out);
+      return;
+    }
+
+    if (field.structPlan != nullptr) {
+      if (field.access->getType().which() == schema::Type::STRUCT) {
+        writeStruct(codec, input.as<DynamicStruct>(), *field.structPlan, out);
+      } else {
+        writeStructList(codec, input.as<DynamicList>(), *field.structPlan,
+                        field.elementHandler, out);
+      }
+      return;
+    }
+
+    write(codec, input, field.access->getType(), out);
+  }
 };
 
 JsonCodec::JsonCodec()
@@ -196,17 +718,40 @@ void JsonCodec::setMaxNestingDepth(size_t maxNestingDepth) {
 }
 
 kj::String JsonCodec::encode(DynamicValue::Reader value, Type type) const {
+  if (!impl->prettyPrint) {
+    // Skip the intermediate JsonValue.
+    kj::VectorOutputStream output;
+    encode(value, type, output);
+    return kj::heapString(output.getArray().asChars());
+  }
+
   MallocMessageBuilder message;
   auto json = message.getRoot<JsonValue>();
   encode(value, type, json);
   return encodeRaw(json);
 }
 
+void JsonCodec::encode(DynamicValue::Reader value, Type type,
+                       kj::BufferedOutputStream& output) const {
+  if (impl->prettyPrint) {
+    // Pretty-printing decides where to break lines by looking at the sizes of whole subtrees, so
+    // it can't be done as we go.
+    MallocMessageBuilder message;
+    auto json = message.getRoot<JsonValue>();
+    encode(value, type, json);
+    auto text = encodeRaw(json);
+    output.write(text.begin(), text.size());
+    return;
+  }
+
+  JsonWriter writer(output);
+  impl->write(*this, value, type, writer);
+  writer.flush();
+}
+
 void JsonCodec::decode(kj::ArrayPtr<const char> input, DynamicStruct::Builder output) const {
-  MallocMessageBuilder message;
-  auto json = message.getRoot<JsonValue>();
-  decodeRaw(input, json);
-  decode(json, output);
+  kj::ArrayInputStream stream(input.asBytes());
+  decode(stream, output);
 }
 
 Orphan<DynamicValue> JsonCodec::decode(
@@ -572,35 +1117,67 @@ Orphan<DynamicValue> JsonCodec::decode(
 
 namespace {
 
+const char* findStringSpecial(const char* pos, const char* end) {
+  // Returns a pointer to the first '"', '\\' or NUL in [pos, end), or `end`.  These are the only
+  // characters that stop a run of string contents, so typical strings are scanned 16 bytes at a
+  // time.
+
+#if __SSE2__
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i zero = _mm_setzero_si128();
+  while (end - pos >= 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+    __m128i hits = _mm_or_si128(_mm_or_si128(
+        _mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+        _mm_cmpeq_epi8(chunk, zero));
+    int mask = _mm_movemask_epi8(hits);
+    if (mask != 0) {
+      return pos + __builtin_ctz(mask);
+    }
+    pos += 16;
+  }
+#elif __ARM_NEON && __aarch64__
+  const uint8x16_t quote = vdupq_n_u8('"');
+  const uint8x16_t backslash = vdupq_n_u8('\\');
+  while (end - pos >= 16) {
+    uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(pos));
+    uint8x16_t hits = vorrq_u8(vorrq_u8(vceqq_u8(chunk, quote), vceqq_u8(chunk, backslash)),
+                               vceqzq_u8(chunk));
+    if (vmaxvq_u8(hits) != 0) break;  // Find the exact position below.
+    pos += 16;
+  }
+#endif
+
+  while (pos < end && *pos != '"' && *pos != '\\' && *pos != '\0') {
+    ++pos;
+  }
+  return pos;
+}
+
 class Input {
+  // Reads characters from a BufferedInputStream, a buffer at a time.  Call finish() when done to
+  // tell the stream how much was consumed.
+
 public:
-  Input(kj::ArrayPtr<const char> input) : wrapped(input) {}
+  explicit Input(kj::BufferedInputStream& stream)
+      : stream(stream), bufferStart(nullptr), pos(nullptr), end(nullptr) {
+    refill();
+  }
+  KJ_DISALLOW_COPY(Input);
 
   bool exhausted() {
-    return wrapped.size() == 0 || wrapped.front() == '\0';
+    return (pos == end && !refill()) || *pos == '\0';
   }
 
   char nextChar() {
     KJ_REQUIRE(!exhausted(), "JSON message ends prematurely.");
-    return wrapped.front();
-  }
-
-  void advance(size_t numBytes = 1) {
-    KJ_REQUIRE(numBytes <= wrapped.size(), "JSON message ends prematurely.");
-    wrapped = kj::arrayPtr(wrapped.begin() + numBytes, wrapped.end());
+    return *pos;
   }
 
-  void advanceTo(const char *newPos) {
-    KJ_REQUIRE(wrapped.begin() <= newPos && newPos < wrapped.end(),
-        "JSON message ends prematurely.");
-    wrapped = kj::arrayPtr(newPos, wrapped.end());
-  }
-
-  kj::ArrayPtr<const char> consume(size_t numBytes = 1) {
-    auto originalPos = wrapped.begin();
-    advance(numBytes);
-
-    return kj::arrayPtr(originalPos, wrapped.begin());
+  void advance() {
+    KJ_REQUIRE(pos < end || refill(), "JSON message ends prematurely.");
+    ++pos;
   }
 
   void consume(char expected) {
@@ -610,13 +1187,10 @@ public:
     advance();
   }
 
-  void consume(kj::ArrayPtr<const char> expected) {
-    KJ_REQUIRE(wrapped.size() >= expected.size());
-
-    auto prefix = wrapped.slice(0, expected.size());
-    KJ_REQUIRE(prefix == expected, "Unexpected input in JSON message.");
-
-    advance(expected.size());
+  void consume(kj::StringPtr expected) {
+    for (char c: expected) {
+      consume(c);
+    }
   }
 
   bool tryConsume(char expected) {
@@ -627,28 +1201,40 @@ public:
   }
 
   template <typename Predicate>
-  void consumeOne(Predicate&& predicate) {
+  void consumeOne(Predicate&& predicate, kj::Vector<char>& output) {
     char current = nextChar();
     KJ_REQUIRE(predicate(current), "Unexpected input in JSON message.");
 
+    output.add(current);
     advance();
   }
 
-  template <typename Predicate>
-  kj::ArrayPtr<const char> consumeWhile(Predicate&& predicate) {
-    auto originalPos = wrapped.begin();
-    while (!exhausted() && predicate(nextChar())) { advance(); }
+  void consumeStringContents(kj::Vector<char>& output) {
+    // Appends characters to `output` up to the next '"' or '\\'.
 
-    return kj::arrayPtr(originalPos, wrapped.begin());
+    while (!exhausted()) {
+      const char* runEnd = findStringSpecial(pos, end);
+      output.addAll(pos, runEnd);
+      pos = runEnd;
+      if (pos < end) break;
+    }
   }
 
-  template <typename F>  // Function<void(Input&)>
-  kj::ArrayPtr<const char> consumeCustom(F&& f) {
-    // Allows consuming in a custom manner without exposing the wrapped ArrayPtr.
-    auto originalPos = wrapped.begin();
-    f(*this);
+  template <typename Predicate>
+  void consumeWhile(Predicate&& predicate) {
+    while (!exhausted() && predicate(*pos)) { ++pos; }
+  }
 
-    return kj::arrayPtr(originalPos, wrapped.begin());
+  template <typename Predicate>
+  void consumeWhile(Predicate&& predicate, kj::Vector<char>& output) {
+    // Like consumeWhile() but appends the consumed characters to `output`, a buffer at a time.
+
+    while (!exhausted()) {
+      const char* runStart = pos;
+      while (pos < end && *pos != '\0' && predicate(*pos)) { ++pos; }
+      output.addAll(runStart, pos);
+      if (pos < end) break;
+    }
   }
 
   void consumeWhitespace() {
@@ -662,16 +1248,313 @@ public:
     });
   }
 
+  void finish() {
+    stream.skip(pos - bufferStart);
+    bufferStart = end = pos;
+  }
 
-private:
-  kj::ArrayPtr<const char> wrapped;
+  kj::ArrayPtr<const char> getBuffered() {
+    // Returns the characters available without reading more from the stream, refilling first if
+    // none are.  Consume them with skip().
+
+    if (pos == end) refill();
+    return kj::arrayPtr(pos, end);
+  }
 
+  void skip(size_t n) {
+    KJ_DASSERT(n <= size_t(end - pos));
+    pos += n;
+  }
+
+private:
+  kj::BufferedInputStream& stream;
+  const char* bufferStart;
+  const char* pos;
+  const char* end;
+
+  bool refill() {
+    // Move on to the next buffer.  Returns false at EOF.
+
+    stream.skip(end - bufferStart);
+    auto buffer = stream.tryGetReadBuffer();
+    bufferStart = pos = reinterpret_cast<const char*>(buffer.begin());
+    end = pos + buffer.size();
+    return pos < end;
+  }
 };  // class Input
 
-class Parser {
+class Lexer {
+  // Tokenization shared between Parser, which builds a JsonValue, and Decoder, which writes
+  // straight into Cap'n Proto objects.
+
+public:
+  Lexer(size_t maxNestingDepth, Input& input)
+      : maxNestingDepth(maxNestingDepth), input(input), nestingDepth(0) {}
+
+  bool inputExhausted() { return input.exhausted(); }
+
+protected:
+  const size_t maxNestingDepth;
+  Input& input;
+  size_t nestingDepth;
+
+  void enterNesting() {
+    KJ_REQUIRE(++nestingDepth <= maxNestingDepth, "JSON message nested too deeply.");
+  }
+
+  double consumeNumber() {
+    scratch.clear();
+    if (input.tryConsume('-')) {
+      scratch.add('-');
+    }
+    if (input.tryConsume('0')) {
+      scratch.add('0');
+    } else {
+      input.consumeOne([](char c) { return '1' <= c && c <= '9'; }, scratch);
+      input.consumeWhile([](char c) { return '0' <= c && c <= '9'; }, scratch);
+    }
+
+    if (input.tryConsume('.')) {
+      scratch.add('.');
+      input.consumeWhile([](char c) { return '0' <= c && c <= '9'; }, scratch);
+    }
+
+    if (input.tryConsume('e') || input.tryConsume('E')) {
+      scratch.add('e');
+      if (input.tryConsume('+')) {
+        scratch.add('+');
+      } else if (input.tryConsume('-')) {
+        scratch.add('-');
+      }
+      input.consumeWhile([](char c) { return '0' <= c && c <= '9'; }, scratch);
+    }
+
+    KJ_IF_MAYBE(value, kj::tryParseDoubleExactly(scratch.asPtr())) {
+      return *value;
+    }
+
+    scratch.add('\0');
+
+    char *endPtr;
+    errno = 0;
+    double value = strtod(scratch.begin(), &endPtr);
+
+    KJ_ASSERT(endPtr != scratch.begin(), "strtod should not fail! Is consumeNumber wrong?");
+    KJ_REQUIRE((value != HUGE_VAL && value != -HUGE_VAL) || errno != ERANGE,
+        "Overflow in JSON number.");
+    KJ_REQUIRE(value != 0.0 || errno != ERANGE,
+        "Underflow in JSON number.");
+
+    return value;
+  }
+
+  kj::StringPtr consumeQuotedString() {
+    // Returns the decoded string, which is valid until the next call.
+
+    input.consume('"');
+    scratch.clear();
+
+    do {
+      input.consumeStringContents(scratch);
+
+      if (input.nextChar() == '\\') {  // handle escapes.
+        input.advance();
+        switch(input.nextChar()) {
+          case 'u' :
+            input.consume('u');
+            unescapeAndAppend();
+            break;
+          default: {
+            char c = input.nextChar();
+            KJ_REQUIRE(unescapeSimple(c), "Invalid escape in JSON string.");
+            scratch.add(c);
+            input.advance();
+            break;
+          }
+        }
+      }
+
+    } while(input.nextChar() != '"');
+
+    input.consume('"');
+    scratch.add('\0');
+
+    return kj::StringPtr(scratch.begin(), scratch.size() - 1);
+  }
+
+  void skipValue() {
+    // Consume one value of any type, checking its syntax.
+
+    input.consumeWhitespace();
+    KJ_DEFER(input.consumeWhitespace());
+
+    switch (input.nextChar()) {
+      case 'n': input.consume(kj::StringPtr("null"));  break;
+      case 'f': input.consume(kj::StringPtr("false")); break;
+      case 't': input.consume(kj::StringPtr("true"));  break;
+      case '"': consumeQuotedString(); break;
+      case '[': {
+        input.consume('[');
+        enterNesting();
+        KJ_DEFER(--nestingDepth);
+        bool expectComma = false;
+        while (input.consumeWhitespace(), input.nextChar() != ']') {
+          if (expectComma) {
+            input.consume(',');
+          }
+          skipValue();
+          expectComma = true;
+        }
+        input.consume(']');
+        break;
+      }
+      case '{': {
+        input.consume('{');
+        enterNesting();
+        KJ_DEFER(--nestingDepth);
+        bool expectComma = false;
+        while (input.consumeWhitespace(), input.nextChar() != '}') {
+          if (expectComma) {
+            input.consume(',');
+            input.consumeWhitespace();
+          }
+          consumeQuotedString();
+          input.consumeWhitespace();
+          input.consume(':');
+          skipValue();
+          expectComma = true;
+        }
+        input.consume('}');
+        break;
+      }
+      case '-': case '0': case '1': case '2': case '3':
+      case '4': case '5': case '6': case '7': case '8':
+      case '9': consumeNumber(); break;
+      default: KJ_FAIL_REQUIRE("Unexpected input in JSON message.");
+    }
+  }
+
+  kj::Maybe<size_t> measureBufferedString() {
+    // If the quoted string at the current position is entirely in the input's current buffer,
+    // returns its length once unescaped, without consuming anything.  Returns null if the
+    // string runs past the buffer, or is malformed, in which case consumeQuotedString() should
+    // be used instead (and will report the error, if any).
+
+    auto buffer = input.getBuffered();
+    const char* pos = buffer.begin();
+    const char* end = buffer.end();
+    KJ_ASSERT(pos < end && *pos == '"');
+    ++pos;
+
+    size_t size = 0;
+    for (;;) {
+      const char* runEnd = findStringSpecial(pos, end);
+      size += runEnd - pos;
+      pos = runEnd;
+      if (pos == end || *pos == '\0') return nullptr;
+      if (*pos == '"') return size;
+
+      // Backslash.
+      if (end - pos < 2) return nullptr;
+      if (pos[1] == 'u') {
+        if (end - pos < 6) return nullptr;
+        pos += 6;
+      } else {
+        pos += 2;
+      }
+      ++size;
+    }
+  }
+
+  void consumeBufferedString(kj::ArrayPtr<char> output) {
+    // Consumes the quoted string just measured by measureBufferedString(), unescaping it into
+    // `output`, whose size must be the measured size.  Runs without escapes are copied in one
+    // piece.
+
+    auto buffer = input.getBuffered();
+    const char* pos = buffer.begin() + 1;
+    const char* end = buffer.end();
+    char* out = output.begin();
+
+    for (;;) {
+      const char* runEnd = findStringSpecial(pos, end);
+      memcpy(out, pos, runEnd - pos);
+      out += runEnd - pos;
+      pos = runEnd;
+      if (*pos == '"') break;
+
+      char c = pos[1];
+      if (c == 'u') {
+        *out++ = decodeUnicodeEscape(pos + 2);
+        pos += 6;
+      } else {
+        KJ_REQUIRE(unescapeSimple(c), "Invalid escape in JSON string.");
+        *out++ = c;
+        pos += 2;
+      }
+    }
+
+    KJ_ASSERT(out == output.end());
+    input.skip(pos + 1 - buffer.begin());
+  }
+
+private:
+  kj::Vector<char> scratch;
+
+  static bool unescapeSimple(char& c) {
+    // Replaces the character following a backslash with the character it stands for, for all
+    // escapes but \u.  Returns false if it isn't a valid escape.
+
+    switch (c) {
+      case '"' : case '\\': case '/': return true;
+      case 'b' : c = '\b'; return true;
+      case 'f' : c = '\f'; return true;
+      case 'n' : c = '\n'; return true;
+      case 'r' : c = '\r'; return true;
+      case 't' : c = '\t'; return true;
+      default: return false;
+    }
+  }
+
+  static char decodeUnicodeEscape(const char* hex) {
+    // Decodes the four hex digits following \u.
+
+    int codePoint = 0;
+    for (uint i = 0; i < 4; i++) {
+      char c = hex[i];
+      codePoint <<= 4;
+
+      if ('0' <= c && c <= '9') {
+        codePoint |= c - '0';
+      } else if ('a' <= c && c <= 'f') {
+        codePoint |= c - 'a' + 10;
+      } else if ('A' <= c && c <= 'F') {
+        codePoint |= c - 'A' + 10;
+      } else {
+        KJ_FAIL_REQUIRE("Invalid hex digit in unicode escape.", c);
+      }
+    }
+
+    // TODO(soon): Support at least basic multi-lingual plane, ie ignore surrogates.
+    KJ_REQUIRE(codePoint < 128, "non-ASCII unicode escapes are not supported (yet!)");
+    return 0x7f & static_cast<char>(codePoint);
+  }
+
+  // TODO(someday): This "interface" is ugly, and won't work if/when surrogates are handled.
+  void unescapeAndAppend() {
+    char hex[4];
+    for (char& c: hex) {
+      c = input.nextChar();
+      input.advance();
+    }
+
+    scratch.add(decodeUnicodeEscape(hex));
+  }
+};  // class Lexer
+
+class Parser: public Lexer {
 public:
-  Parser(size_t maxNestingDepth, kj::ArrayPtr<const char> input) :
-    maxNestingDepth(maxNestingDepth), input(input), nestingDepth(0) {}
+  using Lexer::Lexer;
 
   void parseValue(JsonValue::Builder& output) {
     input.consumeWhitespace();
@@ -694,19 +1577,7 @@ public:
   }
 
   void parseNumber(JsonValue::Builder& output) {
-    auto numberStr = consumeNumber();
-    char *endPtr;
-
-    errno = 0;
-    double value = strtod(numberStr.begin(), &endPtr);
-
-    KJ_ASSERT(endPtr != numberStr.begin(), "strtod should not fail! Is consumeNumber wrong?");
-    KJ_REQUIRE((value != HUGE_VAL && value != -HUGE_VAL) || errno != ERANGE,
-        "Overflow in JSON number.");
-    KJ_REQUIRE(value != 0.0 || errno != ERANGE,
-        "Underflow in JSON number.");
-
-    output.setNumber(value);
+    output.setNumber(consumeNumber());
   }
 
   void parseString(JsonValue::Builder& output) {
@@ -722,7 +1593,7 @@ public:
     bool expectComma = false;
 
     input.consume('[');
-    KJ_REQUIRE(++nestingDepth <= maxNestingDepth, "JSON message nested too deeply.");
+    enterNesting();
     KJ_DEFER(--nestingDepth);
 
     while (input.consumeWhitespace(), input.nextChar() != ']') {
@@ -757,7 +1628,7 @@ public:
     bool expectComma = false;
 
     input.consume('{');
-    KJ_REQUIRE(++nestingDepth <= maxNestingDepth, "JSON message nested too deeply.");
+    enterNesting();
     KJ_DEFER(--nestingDepth);
 
     while (input.consumeWhitespace(), input.nextChar() != '}') {
@@ -793,120 +1664,274 @@ public:
 
     input.consume('}');
   }
+};  // class Parser
 
-  bool inputExhausted() { return input.exhausted(); }
+}  // namespace
 
-private:
-  kj::String consumeQuotedString() {
-    input.consume('"');
-    // TODO(perf): Avoid copy / alloc if no escapes encoutered.
-    // TODO(perf): Get statistics on string size and preallocate?
-    kj::Vector<char> decoded;
+class JsonCodec::Impl::Decoder: public Lexer {
+  // Decodes JSON text directly into Cap'n Proto objects, without building a JsonValue first.
+  // Follows the same rules as JsonCodec::decode(JsonValue::Reader, ...).
 
-    do {
-      auto stringValue = input.consumeWhile([](const char chr) {
-          return chr != '"' && chr != '\\';
-      });
+public:
+  Decoder(const Impl& impl, Input& input)
+      : Lexer(impl.maxNestingDepth, input), impl(impl) {}
 
-      decoded.addAll(stringValue);
+  void decodeObject(DynamicStruct::Builder output, const StructPlan& plan) {
+    bool expectComma = false;
 
-      if (input.nextChar() == '\\') {  // handle escapes.
-        input.advance();
-        switch(input.nextChar()) {
-          case '"' : decoded.add('"' ); input.advance(); break;
-          case '\\': decoded.add('\\'); input.advance(); break;
-          case '/' : decoded.add('/' ); input.advance(); break;
-          case 'b' : decoded.add('\b'); input.advance(); break;
-          case 'f' : decoded.add('\f'); input.advance(); break;
-          case 'n' : decoded.add('\n'); input.advance(); break;
-          case 'r' : decoded.add('\r'); input.advance(); break;
-          case 't' : decoded.add('\t'); input.advance(); break;
-          case 'u' :
-            input.consume('u');
-            unescapeAndAppend(input.consume(size_t(4)), decoded);
-            break;
-          default: KJ_FAIL_REQUIRE("Invalid escape in JSON string."); break;
-        }
+    input.consume('{');
+    enterNesting();
+    KJ_DEFER(--nestingDepth);
+
+    while (input.consumeWhitespace(), input.nextChar() != '}') {
+      if (expectComma) {
+        input.consumeWhitespace();
+        input.consume(',');
+        input.consumeWhitespace();
       }
 
-    } while(input.nextChar() != '"');
+      KJ_IF_MAYBE(field, plan.fieldsByName.find(consumeQuotedString())) {
+        input.consumeWhitespace();
+        input.consume(':');
+        decodeValue((*field)->access->getType(), StructTarget { output, *(*field)->access },
+                    (*field)->structPlan);
+      } else {
+        // Unknown json fields are ignored to allow schema evolution
+        input.consumeWhitespace();
+        input.consume(':');
+        skipValue();
+      }
 
-    input.consume('"');
-    decoded.add('\0');
+      expectComma = true;
+    }
 
-    // TODO(perf): This copy can be eliminated, but I can't find the kj::wayToDoIt();
-    return kj::String(decoded.releaseAsArray());
+    input.consume('}');
   }
 
-  kj::String consumeNumber() {
-    auto numArrayPtr = input.consumeCustom([](Input& input) {
-      input.tryConsume('-');
-      if (!input.tryConsume('0')) {
-        input.consumeOne([](char c) { return '1' <= c && c <= '9'; });
-        input.consumeWhile([](char c) { return '0' <= c && c <= '9'; });
-      }
+private:
+  const Impl& impl;
 
-      if (input.tryConsume('.')) {
-        input.consumeWhile([](char c) { return '0' <= c && c <= '9'; });
-      }
+  struct StructTarget {
+    DynamicStruct::Builder builder;
+    const StructAccessPlan::Field& field;
 
-      if (input.tryConsume('e') || input.tryConsume('E')) {
-        input.tryConsume('+') || input.tryConsume('-');
-        input.consumeWhile([](char c) { return '0' <= c && c <= '9'; });
-      }
-    });
-
-    KJ_REQUIRE(numArrayPtr.size() > 0, "Expected number in JSON input.");
+    void set(const DynamicValue::Reader& value) { builder.set(field, value); }
+    DynamicStruct::Builder initStruct() {
+      return builder.init(field.getField()).as<DynamicStruct>();
+    }
+    void adopt(Orphan<DynamicValue>&& orphan) { builder.adopt(field.getField(), kj::mv(orphan)); }
+    Orphanage getOrphanage() { return Orphanage::getForMessageContaining(builder); }
+  };
 
-    kj::Vector<char> number;
-    number.addAll(numArrayPtr);
-    number.add('\0');
+  struct ListTarget {
+    DynamicList::Builder builder;
+    uint index;
 
-    return kj::String(number.releaseAsArray());
-  }
+    void set(const DynamicValue::Reader& value) { builder.set(index, value); }
+    DynamicStruct::Builder initStruct() { return builder[index].as<DynamicStruct>(); }
+    void adopt(Orphan<DynamicValue>&& orphan) { builder.adopt(index, kj::mv(orphan)); }
+    Orphanage getOrphanage() { return Orphanage::getForMessageContaining(builder); }
+  };
 
-  // TODO(someday): This "interface" is ugly, and won't work if/when surrogates are handled.
-  void unescapeAndAppend(kj::ArrayPtr<const char> hex, kj::Vector<char>& target) {
-    KJ_REQUIRE(hex.size() == 4);
-    int codePoint = 0;
+  template <typename Target>
+  void decodeValue(Type type, Target&& target, const StructPlan* structPlan = nullptr) {
+    // This code relies on conversions in DynamicValue::Reader::as<T>.
+    //
+    // `structPlan`, if known, is the plan for `type` if it is a struct, or for its elements if it
+    // is a list of structs.
 
-    for (int i = 0; i < 4; ++i) {
-      char c = hex[i];
-      codePoint <<= 4;
+    input.consumeWhitespace();
+    KJ_DEFER(input.consumeWhitespace());
 
-      if ('0' <= c && c <= '9') {
-        codePoint |= c - '0';
-      } else if ('a' <= c && c <= 'f') {
-        codePoint |= c - 'a';
-      } else if ('A' <= c && c <= 'F') {
-        codePoint |= c - 'A';
-      } else {
-        KJ_FAIL_REQUIRE("Invalid hex digit in unicode escape.", c);
+    char c = input.nextChar();
+    bool isNumber = c == '-' || ('0' <= c && c <= '9');
+
+    switch (type.which()) {
+      case schema::Type::VOID:
+        skipValue();
+        return;
+      case schema::Type::BOOL:
+        if (c == 't') {
+          input.consume(kj::StringPtr("true"));
+          target.set(true);
+        } else if (c == 'f') {
+          input.consume(kj::StringPtr("false"));
+          target.set(false);
+        } else {
+          KJ_FAIL_REQUIRE("Expected boolean value");
+        }
+        return;
+      case schema::Type::INT8:
+      case schema::Type::INT16:
+      case schema::Type::INT32:
+      case schema::Type::INT64:
+        // Relies on range check in DynamicValue::Reader::as<IntType>
+        if (isNumber) {
+          target.set(consumeNumber());
+        } else if (c == '"') {
+          target.set(consumeQuotedString().parseAs<int64_t>());
+        } else {
+          KJ_FAIL_REQUIRE("Expected integer value");
+        }
+        return;
+      case schema::Type::UINT8:
+      case schema::Type::UINT16:
+      case schema::Type::UINT32:
+      case schema::Type::UINT64:
+        // Relies on range check in DynamicValue::Reader::as<IntType>
+        if (isNumber) {
+          target.set(consumeNumber());
+        } else if (c == '"') {
+          target.set(consumeQuotedString().parseAs<uint64_t>());
+        } else {
+          KJ_FAIL_REQUIRE("Expected integer value");
+        }
+        return;
+      case schema::Type::FLOAT32:
+      case schema::Type::FLOAT64:
+        if (c == 'n') {
+          input.consume(kj::StringPtr("null"));
+          target.set(kj::nan());
+        } else if (isNumber) {
+          target.set(consumeNumber());
+        } else if (c == '"') {
+          target.set(consumeQuotedString().parseAs<double>());
+        } else {
+          KJ_FAIL_REQUIRE("Expected float value");
+        }
+        return;
+      case schema::Type::TEXT:
+        KJ_REQUIRE(c == '"', "Expected text value");
+        KJ_IF_MAYBE(size, measureBufferedString()) {
+          // Unescape straight into the message rather than via the scratch buffer.
+          auto orphan = target.getOrphanage().template newOrphan<Text>(*size);
+          auto text = orphan.get();
+          consumeBufferedString(kj::arrayPtr(text.begin(), text.size()));
+          target.adopt(kj::mv(orphan));
+        } else {
+          target.set(Text::Reader(consumeQuotedString()));
+        }
+        return;
+      case schema::Type::DATA: {
+        KJ_REQUIRE(c == '[', "Expected data value");
+        kj::Vector<byte> data;
+        consumeArray([&]() {
+          input.consumeWhitespace();
+          char d = input.nextChar();
+          KJ_REQUIRE(d == '-' || ('0' <= d && d <= '9'),
+                     "Number in byte array is not an integer in [0, 255]");
+          auto x = consumeNumber();
+          input.consumeWhitespace();
+          KJ_REQUIRE(byte(x) == x, "Number in byte array is not an integer in [0, 255]");
+          data.add(byte(x));
+        });
+        target.set(Data::Reader(data.asPtr()));
+        return;
       }
+      case schema::Type::LIST:
+        if (c == 'n') {
+          input.consume(kj::StringPtr("null"));
+        } else {
+          KJ_REQUIRE(c == '[', "Expected list value");
+          target.adopt(decodeArray(type.asList(), target.getOrphanage(), structPlan));
+        }
+        return;
+      case schema::Type::ENUM:
+        KJ_REQUIRE(c == '"', "Expected enum value");
+        target.set(Text::Reader(consumeQuotedString()));
+        return;
+      case schema::Type::STRUCT:
+        if (c == 'n') {
+          input.consume(kj::StringPtr("null"));
+        } else {
+          KJ_REQUIRE(c == '{', "Expected object value");
+          decodeObject(target.initStruct(), structPlan == nullptr
+              ? impl.getStructPlan(type.asStruct()) : *structPlan);
+        }
+        return;
+      case schema::Type::INTERFACE:
+        KJ_FAIL_REQUIRE("don't know how to JSON-decode capabilities; "
+                        "JsonCodec::Handler not implemented yet :(");
+      case schema::Type::ANY_POINTER:
+        KJ_FAIL_REQUIRE("don't know how to JSON-decode AnyPointer; "
+                        "JsonCodec::Handler not implemented yet :(");
     }
+  }
 
-    // TODO(soon): Support at least basic multi-lingual plane, ie ignore surrogates.
-    KJ_REQUIRE(codePoint < 128, "non-ASCII unicode escapes are not supported (yet!)");
-    target.add(0x7f & static_cast<char>(codePoint));
+  Orphan<DynamicList> decodeArray(ListSchema schema, Orphanage orphanage,
+                                  const StructPlan* elementPlan) {
+    // We don't know the array's length until we reach its end, so decode into an orphan list
+    // that we grow by doubling, then truncate to the final size.  When the list is the last thing
+    // in its segment -- typical, since we're building it right now -- growth happens in place.
+    //
+    // TODO(perf): When growth can't happen in place, the old copy is left as a hole in the
+    //   message, as with the orphans in Parser.
+
+    uint capacity = 0;
+    uint size = 0;
+    auto orphan = orphanage.newOrphan(schema, capacity);
+    auto list = orphan.get();
+    auto elementType = schema.getElementType();
+    if (elementPlan == nullptr && elementType.which() == schema::Type::STRUCT) {
+      elementPlan = &impl.getStructPlan(elementType.asStruct());
+    }
+
+    consumeArray([&]() {
+      if (size == capacity) {
+        capacity = kj::max(capacity * 2, 4u);
+        orphan.truncate(capacity);
+        list = orphan.get();
+      }
+      decodeValue(elementType, ListTarget { list, size++ }, elementPlan);
+    });
+
+    orphan.truncate(size);
+    return orphan;
   }
 
-  const size_t maxNestingDepth;
-  Input input;
-  size_t nestingDepth;
+  template <typename Func>
+  void consumeArray(Func&& decodeElement) {
+    bool expectComma = false;
 
+    input.consume('[');
+    enterNesting();
+    KJ_DEFER(--nestingDepth);
 
-};  // class Parser
+    while (input.consumeWhitespace(), input.nextChar() != ']') {
+      if (expectComma) {
+        input.consume(',');
+      }
+      decodeElement();
+      expectComma = true;
+    }
 
-}  // namespace
+    input.consume(']');
+  }
+};  // class Decoder
 
 
 void JsonCodec::decodeRaw(kj::ArrayPtr<const char> input, JsonValue::Builder output) const {
-  Parser parser(impl->maxNestingDepth, input);
+  kj::ArrayInputStream stream(input.asBytes());
+  Input in(stream);
+  Parser parser(impl->maxNestingDepth, in);
   parser.parseValue(output);
 
   KJ_REQUIRE(parser.inputExhausted(), "Input remains after parsing JSON.");
 }
 
+void JsonCodec::decode(kj::BufferedInputStream& input, DynamicStruct::Builder output) const {
+  Input in(input);
+  Impl::Decoder decoder(*impl, in);
+
+  in.consumeWhitespace();
+  KJ_REQUIRE(in.nextChar() == '{', "Top level json value must be object");
+  decoder.decodeObject(output, impl->getStructPlan(output.getSchema()));
+  in.consumeWhitespace();
+
+  KJ_REQUIRE(decoder.inputExhausted(), "Input remains after parsing JSON.");
+  in.finish();
+}
+
 // -----------------------------------------------------------------------------
 
 Orphan<DynamicValue> JsonCodec::HandlerBase::decodeBase(
@@ -920,12 +1945,14 @@ void JsonCodec::HandlerBase::decodeStructBase(
 
 void JsonCodec::addTypeHandlerImpl(Type type, HandlerBase& handler) {
   impl->typeHandlers[type] = &handler;
+  impl->structPlans.lockExclusive()->clear();
 }
 
 void JsonCodec::addFieldHandlerImpl(StructSchema::Field field, Type type, HandlerBase& handler) {
   KJ_REQUIRE(type == field.getType(),
       "handler type did not match field type for addFieldHandler()");
   impl->fieldHandlers[field] = &handler;
+  impl->structPlans.lockExclusive()->clear();
 }
 
 } // namespace capnp
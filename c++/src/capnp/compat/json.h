@@ -24,6 +24,7 @@
 #include <capnp/schema.h>
 #include <capnp/dynamic.h>
 #include <capnp/compat/json.capnp.h>
+#include <kj/io.h>
 
 namespace capnp {
 
@@ -91,6 +92,25 @@ public:
   // (Remember that any Cap'n Proto struct reader type can be implicitly cast to
   // DynamicStruct::Reader.)
 
+  // ---------------------------------------------------------------------------
+  // streaming API
+  //
+  // These write or read text incrementally without first building a complete JsonValue tree,
+  // so memory use does not grow with the size of the document. Handlers still see a JsonValue,
+  // but only for the value they handle.
+
+  template <typename T>
+  void encode(T&& value, kj::BufferedOutputStream& output) const;
+  void encode(DynamicValue::Reader value, Type type, kj::BufferedOutputStream& output) const;
+  // Encode JSON text directly to `output`. The text is identical to what the kj::String-returning
+  // `encode()` produces. With pretty printing enabled, the value is still converted to a
+  // JsonValue first, since choosing line breaks requires looking at whole subtrees.
+
+  void decode(kj::BufferedInputStream& input, DynamicStruct::Builder output) const;
+  // Like decode(kj::ArrayPtr<const char>, DynamicStruct::Builder), but reads the text from
+  // `input` as it parses. Lists are built by growing an orphan, so they need not fit in one read
+  // buffer either.
+
   template <typename T>
   Orphan<T> decode(kj::ArrayPtr<const char> input, Orphanage orphanage) const;
   // Decode JSON text to any Cap'n Proto object (pointer value), allocated using the given
@@ -233,6 +253,13 @@ kj::String JsonCodec::encode(T&& value) const {
   return encode(DynamicValue::Reader(ReaderFor<Base>(kj::fwd<T>(value))), type);
 }
 
+template <typename T>
+inline void JsonCodec::encode(T&& value, kj::BufferedOutputStream& output) const {
+  Type type = Type::from(value);
+  typedef FromAny<kj::Decay<T>> Base;
+  encode(DynamicValue::Reader(ReaderFor<Base>(kj::fwd<T>(value))), type, output);
+}
+
 template <typename T>
 inline Orphan<T> JsonCodec::decode(kj::ArrayPtr<const char> input, Orphanage orphanage) const {
   return decode(input, Type::from<T>(), orphanage).template releaseAs<T>();
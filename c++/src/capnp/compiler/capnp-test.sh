@@ -74,6 +74,15 @@ $CAPNP convert binary:json --short $SCHEMA TestAllTypes < $TESTDATA/binary | cmp
 $CAPNP convert json:binary $SCHEMA TestAllTypes < $TESTDATA/pretty.json | cmp $TESTDATA/binary - || fail json to binary
 $CAPNP convert json:binary $SCHEMA TestAllTypes < $TESTDATA/short.json | cmp $TESTDATA/binary - || fail short json to binary
 
+cat $TESTDATA/segmented $TESTDATA/binary $TESTDATA/segmented > /tmp/capnp-test-stream.$$
+$CAPNP convert binary:text $SCHEMA TestAllTypes < /tmp/capnp-test-stream.$$ > /tmp/capnp-test-serial.$$ || fail serial stream
+$CAPNP convert -j3 binary:text $SCHEMA TestAllTypes < /tmp/capnp-test-stream.$$ | cmp /tmp/capnp-test-serial.$$ - || fail parallel binary to text
+$CAPNP convert -j3 text:binary $SCHEMA TestAllTypes < /tmp/capnp-test-serial.$$ | $CAPNP convert binary:text $SCHEMA TestAllTypes | cmp /tmp/capnp-test-serial.$$ - || fail parallel text to binary
+$CAPNP convert binary:json $SCHEMA TestAllTypes < $TESTDATA/segmented > /tmp/capnp-test-serial.$$ || fail serial json
+$CAPNP convert -j2 packed:json $SCHEMA TestAllTypes < $TESTDATA/segmented-packed | cmp /tmp/capnp-test-serial.$$ - || fail parallel packed to json
+$CAPNP convert -j2 json:binary $SCHEMA TestAllTypes < $TESTDATA/pretty.json | cmp $TESTDATA/binary - || fail parallel json to binary
+rm -f /tmp/capnp-test-stream.$$ /tmp/capnp-test-serial.$$
+
 # ========================================================================================
 # DEPRECATED encode/decode
 
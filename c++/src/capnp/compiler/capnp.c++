@@ -30,8 +30,13 @@
 #include <kj/io.h>
 #include <kj/miniposix.h>
 #include <kj/debug.h>
+#include <kj/mutex.h>
+#include <kj/thread.h>
+#include <kj/time.h>
 #include "../message.h"
 #include <iostream>
+#include <thread>
+#include <atomic>
 #include <kj/main.h>
 #include <kj/parse/char.h>
 #include <sys/stat.h>
@@ -152,6 +157,13 @@ public:
                "Do not print warning messages about the input being in the wrong format.  "
                "Use this if you find the warnings are wrong (but also let us know so "
                "we can improve them).")
+           .addOptionWithArg({'j', "jobs"}, KJ_BIND_METHOD(*this, setJobs), "<n>",
+               "Convert up to <n> messages at once, on <n> threads.  One more thread reads "
+               "and splits the input, and output is still written in input order.  Only "
+               "applies to streams of binary, packed, text, or JSON messages.  Defaults to 1.")
+           .addOption({"progress"}, KJ_BIND_METHOD(*this, setProgress),
+               "Periodically print the number of messages and bytes converted so far, and "
+               "the throughput, to stderr.")
            .expectArg("<from>:<to>", KJ_BIND_METHOD(*this, setConversion))
            .expectOptionalArg("<schema-file>", KJ_BIND_METHOD(*this, addSource))
            .expectOptionalArg("<type>", KJ_BIND_METHOD(*this, setRootType))
@@ -302,7 +314,10 @@ public:
                              "For example, the following command:\n"
                              "    capnp compile --src-prefix=foo/bar -oc++:corge foo/bar/baz/qux.capnp\n"
                              "would generate the files corge/baz/qux.capnp.{h,c++}.")
-           .expectOneOrMoreArgs("<source>", KJ_BIND_METHOD(*this, addSource))
+           .addOptionWithArg({'j', "jobs"}, KJ_BIND_METHOD(*this, setJobs), "<n>",
+                             "Parse up to <n> source files at once.  Defaults to the number of "
+                             "CPUs.  Compilation itself is still done on one thread.")
+           .expectOneOrMoreArgs("<source>", KJ_BIND_METHOD(*this, addCompileSource))
            .callAfterParsing(KJ_BIND_METHOD(*this, generateOutput));
   }
 
@@ -324,6 +339,49 @@ public:
   }
 
   kj::MainBuilder::Validity addSource(kj::StringPtr file) {
+    KJ_IF_MAYBE(module, loadSource(file)) {
+      compileSource(*module);
+      return true;
+    } else {
+      return "no such file";
+    }
+  }
+
+  kj::MainBuilder::Validity addCompileSource(kj::StringPtr file) {
+    // Like addSource(), but the file isn't compiled until compilePendingSources(), so that all
+    // the files named on the command line can be parsed in parallel first.
+
+    KJ_IF_MAYBE(module, loadSource(file)) {
+      pendingSources.add(module);
+      return true;
+    } else {
+      return "no such file";
+    }
+  }
+
+  kj::MainBuilder::Validity setJobs(kj::StringPtr arg) {
+    char* end;
+    jobs = strtoul(arg.cStr(), &end, 0);
+    if (arg.size() == 0 || *end != '\0' || jobs == 0) {
+      return "not a positive integer";
+    }
+    return true;
+  }
+
+  void compilePendingSources() {
+    uint threadCount = jobs;
+    if (threadCount == 0) {
+      threadCount = kj::max(std::thread::hardware_concurrency(), 1u);
+    }
+    loader.preparse(pendingSources, threadCount);
+
+    for (auto module: pendingSources) {
+      compileSource(*module);
+    }
+    pendingSources.clear();
+  }
+
+  kj::Maybe<Module&> loadSource(kj::StringPtr file) {
     if (!compilerConstructed) {
       compiler = compilerSpace.construct(annotationFlag);
       compilerConstructed = true;
@@ -349,15 +407,13 @@ public:
     }
 
     auto dirPathPair = interpretSourceFile(file);
-    KJ_IF_MAYBE(module, loader.loadModule(dirPathPair.dir, dirPathPair.path)) {
-      uint64_t id = compiler->add(*module);
-      compiler->eagerlyCompile(id, compileEagerness);
-      sourceFiles.add(SourceFile { id, module->getSourceName(), &*module });
-    } else {
-      return "no such file";
-    }
+    return loader.loadModule(dirPathPair.dir, dirPathPair.path);
+  }
 
-    return true;
+  void compileSource(Module& module) {
+    uint64_t id = compiler->add(module);
+    compiler->eagerlyCompile(id, compileEagerness);
+    sourceFiles.add(SourceFile { id, module.getSourceName(), &module });
   }
 
 public:
@@ -438,6 +494,8 @@ public:
   }
 
   kj::MainBuilder::Validity generateOutput() {
+    compilePendingSources();
+
     if (hadErrors()) {
       // Skip output if we had any errors.
       return true;
@@ -722,10 +780,15 @@ public:
       if (result.getError() != nullptr) return result;
     }
 
+    ProgressReporter progress;
+
     kj::FdInputStream rawInput(STDIN_FILENO);
-    kj::BufferedInputStreamWrapper input(rawInput);
+    CountingInputStream countingInput(rawInput, progress.inputBytes);
+    kj::BufferedInputStreamWrapper input(countingInput);
 
-    kj::FdOutputStream output(STDOUT_FILENO);
+    kj::FdOutputStream rawOutput(STDOUT_FILENO);
+    CountingOutputStream countingOutput(rawOutput, progress.outputBytes);
+    kj::BufferedOutputStreamWrapper output(countingOutput);
 
     if (!quiet) {
       auto result = checkPlausibility(convertFrom, input.getReadBuffer());
@@ -734,10 +797,19 @@ public:
       }
     }
 
-    while (input.tryGetReadBuffer().size() > 0) {
-      readOneAndConvert(input, output);
+    bool isStream = convertFrom == Format::BINARY || convertFrom == Format::PACKED ||
+                    convertFrom == Format::TEXT || convertFrom == Format::JSON;
+    if (jobs > 1 && isStream) {
+      convertParallel(input, output, showProgress ? &progress : nullptr);
+    } else {
+      while (input.tryGetReadBuffer().size() > 0) {
+        readOneAndConvert(input, output);
+        if (showProgress) progress.messageDone();
+      }
     }
 
+    output.flush();
+    if (showProgress) progress.finish();
     context.exit();
     KJ_CLANG_KNOWS_THIS_IS_UNREACHABLE_BUT_GCC_DOESNT;
   }
@@ -935,23 +1007,36 @@ private:
     }
   }
 
+  static void reportConversionError(kj::ProcessContext& context, const kj::Exception& e) {
+    context.error(kj::str(
+        "*** ERROR CONVERTING PREVIOUS MESSAGE ***\n"
+        "The following error occurred while converting the message above.\n"
+        "This probably means the input data is invalid/corrupted.\n",
+        "Exception description: ", e.getDescription(), "\n"
+        "Code location: ", e.getFile(), ":", e.getLine(), "\n"
+        "*** END ERROR ***"));
+  }
+
   class ParseErrorCatcher: public kj::ExceptionCallback {
   public:
-    ParseErrorCatcher(kj::ProcessContext& context): context(context) {}
+    ParseErrorCatcher(kj::ProcessContext& context,
+                      kj::Maybe<kj::BufferedOutputStreamWrapper&> output = nullptr)
+        : context(context), output(output) {}
     ~ParseErrorCatcher() noexcept(false) {
       if (!unwindDetector.isUnwinding()) {
         KJ_IF_MAYBE(e, exception) {
-          context.error(kj::str(
-              "*** ERROR CONVERTING PREVIOUS MESSAGE ***\n"
-              "The following error occurred while converting the message above.\n"
-              "This probably means the input data is invalid/corrupted.\n",
-              "Exception description: ", e->getDescription(), "\n"
-              "Code location: ", e->getFile(), ":", e->getLine(), "\n"
-              "*** END ERROR ***"));
+          // Make sure the message the error refers to is printed before the error.
+          KJ_IF_MAYBE(o, output) o->flush();
+          reportConversionError(context, *e);
         }
       }
     }
 
+    kj::Maybe<kj::Exception> releaseException() {
+      // Takes the captured exception, if any, so that the destructor won't report it.
+      return kj::mv(exception);
+    }
+
     void onRecoverableException(kj::Exception&& e) {
       // Only capture the first exception, on the assumption that later exceptions are probably
       // just cascading problems.
@@ -962,18 +1047,24 @@ private:
 
   private:
     kj::ProcessContext& context;
+    kj::Maybe<kj::BufferedOutputStreamWrapper&> output;
     kj::Maybe<kj::Exception> exception;
     kj::UnwindDetector unwindDetector;
   };
 
-  void readOneAndConvert(kj::BufferedInputStreamWrapper& input, kj::OutputStream& output) {
+  static ReaderOptions conversionReaderOptions() {
     // Since this is a debug tool, lift the usual security limits.  Worse case is the process
     // crashes or has to be killed.
     ReaderOptions options;
     options.nestingLimit = kj::maxValue;
     options.traversalLimitInWords = kj::maxValue;
+    return options;
+  }
 
-    ParseErrorCatcher parseErrorCatcher(context);
+  void readOneAndConvert(kj::BufferedInputStreamWrapper& input,
+                         kj::BufferedOutputStreamWrapper& output) {
+    ReaderOptions options = conversionReaderOptions();
+    ParseErrorCatcher parseErrorCatcher(context, output);
 
     switch (convertFrom) {
       case Format::BINARY: {
@@ -1016,29 +1107,33 @@ private:
         SegmentArrayMessageReader message(segments, options);
         return writeConversion(message.getRoot<AnyStruct>(), output);
       }
-      case Format::TEXT: {
-        auto text = readOneText(input);
-        MallocMessageBuilder message;
-        TextCodec codec;
-        codec.setPrettyPrint(pretty);
-        auto root = message.initRoot<DynamicStruct>(rootType);
-        codec.decode(text, root);
-        return writeConversion(root.asReader(), output);
-      }
-      case Format::JSON: {
-        auto text = readOneJson(input);
-        MallocMessageBuilder message;
-        JsonCodec codec;
-        codec.setPrettyPrint(pretty);
-        auto root = message.initRoot<DynamicStruct>(rootType);
-        codec.decode(text, root);
-        return writeConversion(root.asReader(), output);
-      }
+      case Format::TEXT:
+        return convertText(readOneText(input), output);
+      case Format::JSON:
+        return convertJson(readOneJson(input), output);
     }
 
     KJ_UNREACHABLE;
   }
 
+  void convertText(kj::StringPtr text, kj::OutputStream& output) {
+    MallocMessageBuilder message;
+    TextCodec codec;
+    codec.setPrettyPrint(pretty);
+    auto root = message.initRoot<DynamicStruct>(rootType);
+    codec.decode(text, root);
+    writeConversion(root.asReader(), output);
+  }
+
+  void convertJson(kj::StringPtr text, kj::OutputStream& output) {
+    MallocMessageBuilder message;
+    JsonCodec codec;
+    codec.setPrettyPrint(pretty);
+    auto root = message.initRoot<DynamicStruct>(rootType);
+    codec.decode(text, root);
+    writeConversion(root.asReader(), output);
+  }
+
   void writeConversion(AnyStruct::Reader reader, kj::OutputStream& output) {
     switch (convertTo) {
       case Format::BINARY: {
@@ -1097,6 +1192,299 @@ private:
     KJ_UNREACHABLE;
   }
 
+  // -------------------------------------------------------------------
+  // progress reporting
+
+  class ProgressReporter {
+    // Counts messages and bytes for `--progress` and prints the totals to stderr at most once a
+    // second.  The byte counts are updated by the stream wrappers below, possibly on another
+    // thread; messages are counted by whichever thread writes the output.
+
+  public:
+    ProgressReporter(): start(kj::systemCalendarClock().now()), lastReport(start) {}
+
+    std::atomic<uint64_t> inputBytes { 0 };
+    std::atomic<uint64_t> outputBytes { 0 };
+
+    void messageDone() {
+      ++messageCount;
+      auto now = kj::systemCalendarClock().now();
+      if (now - lastReport >= kj::SECONDS) {
+        lastReport = now;
+        print(now, false);
+      }
+    }
+
+    void finish() {
+      print(kj::systemCalendarClock().now(), true);
+    }
+
+  private:
+    kj::Date start;
+    kj::Date lastReport;
+    uint64_t messageCount = 0;
+
+    static kj::String mebibytes(double bytes) {
+      uint64_t tenths = bytes * 10 / (1 << 20);
+      return kj::str(tenths / 10, '.', tenths % 10);
+    }
+
+    void print(kj::Date now, bool last) {
+      uint64_t in = inputBytes.load(std::memory_order_relaxed);
+      uint64_t out = outputBytes.load(std::memory_order_relaxed);
+      double seconds = kj::max((now - start) / kj::MILLISECONDS, 1) / 1000.0;
+      auto line = kj::str(
+          "\r", messageCount, " messages, ", mebibytes(in), " MiB in, ", mebibytes(out),
+          " MiB out, ", mebibytes(in / seconds), " MiB/s in, ", mebibytes(out / seconds),
+          " MiB/s out", last ? "\n" : "");
+      kj::FdOutputStream(STDERR_FILENO).write(line.begin(), line.size());
+    }
+  };
+
+  class CountingInputStream final: public kj::InputStream {
+  public:
+    CountingInputStream(kj::InputStream& inner, std::atomic<uint64_t>& count)
+        : inner(inner), count(count) {}
+
+    size_t tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+      size_t n = inner.tryRead(buffer, minBytes, maxBytes);
+      count.fetch_add(n, std::memory_order_relaxed);
+      return n;
+    }
+
+  private:
+    kj::InputStream& inner;
+    std::atomic<uint64_t>& count;
+  };
+
+  class CountingOutputStream final: public kj::OutputStream {
+  public:
+    CountingOutputStream(kj::OutputStream& inner, std::atomic<uint64_t>& count)
+        : inner(inner), count(count) {}
+
+    void write(const void* buffer, size_t size) override {
+      inner.write(buffer, size);
+      count.fetch_add(size, std::memory_order_relaxed);
+    }
+
+  private:
+    kj::OutputStream& inner;
+    std::atomic<uint64_t>& count;
+  };
+
+  // -------------------------------------------------------------------
+  // parallel conversion
+
+  struct ConversionJob {
+    kj::Array<word> words;
+    // For binary and packed input: the unpacked message, including its segment table.
+
+    kj::String text;
+    // For text and JSON input: the message text.
+
+    kj::Own<kj::VectorOutputStream> output;
+    // The converted message, or null if conversion failed outright.
+
+    kj::Maybe<kj::Exception> error;
+    // An error reading or converting the message.  If `output` is non-null, the error was
+    // recoverable, and is reported after writing the output, as in the serial case.
+
+    bool done = false;
+  };
+
+  struct ConversionPipeline {
+    // State shared by the reader thread, the worker threads and the writer (the calling thread).
+    // `jobs` is a ring buffer indexed by sequence number: the reader fills in job `readCount`,
+    // workers claim job `claimCount` and convert it without holding the lock, and the writer
+    // writes job `writeCount` once it is done.
+
+    kj::Array<ConversionJob> jobs;
+    uint64_t readCount = 0;
+    uint64_t claimCount = 0;
+    uint64_t writeCount = 0;
+    bool eof = false;
+    bool aborted = false;
+  };
+
+  static kj::Array<word> readRawMessage(kj::InputStream& input) {
+    // Reads one message in writeMessage() framing without parsing it, returning it framing and
+    // all, so that a FlatArrayMessageReader can read it later on another thread.
+
+    _::WireValue<uint32_t> firstWord[2];
+    input.read(firstWord, sizeof(firstWord));
+
+    uint segmentCount = firstWord[0].get() + 1;
+    KJ_REQUIRE(segmentCount > 0 && segmentCount < 512, "Message has too many segments.");
+
+    size_t tableWords = segmentCount / 2 + 1;
+    auto table = kj::heapArray<_::WireValue<uint32_t>>(tableWords * 2);
+    table[0] = firstWord[0];
+    table[1] = firstWord[1];
+    input.read(table.begin() + 2, table.asBytes().size() - sizeof(firstWord));
+
+    uint64_t totalWords = tableWords;
+    for (uint i = 0; i < segmentCount; i++) {
+      totalWords += table[i + 1].get();
+    }
+
+    auto result = kj::heapArray<word>(totalWords);
+    memcpy(result.asBytes().begin(), table.begin(), table.asBytes().size());
+    input.read(result.begin() + tableWords, (totalWords - tableWords) * sizeof(word));
+    return result;
+  }
+
+  void readJob(kj::BufferedInputStreamWrapper& input, ConversionJob& job) {
+    switch (convertFrom) {
+      case Format::BINARY:
+        job.words = readRawMessage(input);
+        return;
+      case Format::PACKED: {
+        capnp::_::PackedInputStream unpacker(input);
+        job.words = readRawMessage(unpacker);
+        return;
+      }
+      case Format::TEXT:
+        job.text = readOneText(input);
+        return;
+      case Format::JSON:
+        job.text = readOneJson(input);
+        return;
+      default:
+        KJ_UNREACHABLE;
+    }
+  }
+
+  void convertJob(ConversionJob& job) {
+    auto output = kj::heap<kj::VectorOutputStream>();
+    ParseErrorCatcher parseErrorCatcher(context);
+
+    KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() {
+      switch (convertFrom) {
+        case Format::BINARY:
+        case Format::PACKED: {
+          FlatArrayMessageReader message(job.words, conversionReaderOptions());
+          writeConversion(message.getRoot<AnyStruct>(), *output);
+          return;
+        }
+        case Format::TEXT:
+          return convertText(job.text, *output);
+        case Format::JSON:
+          return convertJson(job.text, *output);
+        default:
+          KJ_UNREACHABLE;
+      }
+    })) {
+      job.error = kj::mv(*e);
+    } else {
+      job.error = parseErrorCatcher.releaseException();
+      job.output = kj::mv(output);
+    }
+
+    job.words = nullptr;
+    job.text = nullptr;
+  }
+
+  void convertParallel(kj::BufferedInputStreamWrapper& input,
+                       kj::BufferedOutputStreamWrapper& output,
+                       kj::Maybe<ProgressReporter&> progress) {
+    // Converts the input with one thread reading and splitting messages, `jobs` threads
+    // converting them, and this thread writing the results in order.  At most a few messages per
+    // worker are in memory at once.
+
+    kj::MutexGuarded<ConversionPipeline> pipeline;
+    size_t windowSize = jobs * 8;
+    pipeline.getWithoutLock().jobs = kj::heapArray<ConversionJob>(windowSize);
+
+    kj::Vector<kj::Own<kj::Thread>> threads(jobs + 1);
+    // Destroying the vector joins all threads, which by then have seen `eof` or `aborted`.
+
+    threads.add(kj::heap<kj::Thread>([&]() {
+      for (;;) {
+        ConversionJob job;
+        bool eof = false;
+        KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() {
+          if (input.tryGetReadBuffer().size() == 0) {
+            eof = true;
+          } else {
+            readJob(input, job);
+          }
+        })) {
+          // The input can't be split any further.  Pass the error along to be reported in order.
+          job.error = kj::mv(*e);
+          job.done = true;
+        }
+
+        bool stop = pipeline.when([&](const ConversionPipeline& p) {
+          return p.aborted || eof || p.readCount - p.writeCount < p.jobs.size();
+        }, [&](ConversionPipeline& p) {
+          if (p.aborted) return true;
+          if (eof) {
+            p.eof = true;
+            return true;
+          }
+          bool failed = job.done;
+          p.jobs[p.readCount++ % p.jobs.size()] = kj::mv(job);
+          if (failed) p.eof = true;
+          return failed;
+        });
+        if (stop) break;
+      }
+    }));
+
+    for (uint i = 0; i < jobs; i++) {
+      threads.add(kj::heap<kj::Thread>([&]() {
+        for (;;) {
+          ConversionJob* job = nullptr;
+          pipeline.when([](const ConversionPipeline& p) {
+            return p.aborted || p.eof || p.claimCount < p.readCount;
+          }, [&](ConversionPipeline& p) {
+            if (!p.aborted && p.claimCount < p.readCount) {
+              job = &p.jobs[p.claimCount++ % p.jobs.size()];
+            }
+          });
+          if (job == nullptr) break;
+
+          // The claimed job belongs to this thread until it is marked done.
+          if (!job->done) convertJob(*job);
+          auto lock = pipeline.lockExclusive();
+          job->done = true;
+        }
+      }));
+    }
+
+    for (;;) {
+      ConversionJob* job = nullptr;
+      pipeline.when([](const ConversionPipeline& p) {
+        return p.writeCount < p.readCount ? p.jobs[p.writeCount % p.jobs.size()].done : p.eof;
+      }, [&](ConversionPipeline& p) {
+        if (p.writeCount < p.readCount) {
+          job = &p.jobs[p.writeCount % p.jobs.size()];
+        }
+      });
+      if (job == nullptr) break;
+
+      // The job at the head of the window belongs to this thread until `writeCount` moves past
+      // it; the reader won't reuse its slot before then.
+      if (job->output.get() != nullptr) {
+        auto bytes = job->output->getArray();
+        output.write(bytes.begin(), bytes.size());
+      }
+      KJ_IF_MAYBE(e, job->error) {
+        output.flush();
+        reportConversionError(context, *e);
+        if (job->output.get() == nullptr) {
+          // Like an uncaught exception in the serial case, this ends the conversion.
+          pipeline.lockExclusive()->aborted = true;
+          context.exit();
+        }
+      }
+      KJ_IF_MAYBE(p, progress) p->messageDone();
+
+      *job = ConversionJob();
+      ++pipeline.lockExclusive()->writeCount;
+    }
+  }
+
 public:
 
   // =====================================================================================
@@ -1126,6 +1514,10 @@ public:
     quiet = true;
     return true;
   }
+  kj::MainBuilder::Validity setProgress() {
+    showProgress = true;
+    return true;
+  }
   kj::MainBuilder::Validity setSegmentSize(kj::StringPtr size) {
     if (flat) return "cannot be used with --flat";
     char* end;
@@ -1788,6 +2180,7 @@ private:
   bool packed = false;
   bool pretty = true;
   bool quiet = false;
+  bool showProgress = false;
   uint segmentSize = 0;
   StructSchema rootType;
   // For the "decode" and "encode" commands.
@@ -1800,6 +2193,13 @@ private:
 
   kj::Vector<SourceFile> sourceFiles;
 
+  kj::Vector<Module*> pendingSources;
+  // Sources given to `compile` which haven't been passed to the compiler yet.
+
+  uint jobs = 0;
+  // For `compile`, the number of threads to parse with; 0 means one per CPU.  For `convert`, the
+  // number of threads to convert messages with; 0 or 1 means convert on the main thread.
+
   struct OutputDirective {
     kj::ArrayPtr<const char> name;
     kj::Maybe<kj::Path> dir;
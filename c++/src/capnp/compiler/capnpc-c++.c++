@@ -61,6 +61,8 @@ namespace {
 
 static constexpr uint64_t NAMESPACE_ANNOTATION_ID = 0xb9c6f99ebf805f2cull;
 static constexpr uint64_t NAME_ANNOTATION_ID = 0xf264a779fef191ceull;
+static constexpr uint64_t STREAM_ANNOTATION_ID = 0xce94085aa052a401ull;
+static constexpr uint64_t ALWAYS_INLINE_ANNOTATION_ID = 0x9e8b7b9a5510e75aull;
 
 bool hasDiscriminantValue(const schema::Field::Reader& reader) {
   return reader.getDiscriminantValue() != schema::Field::NO_DISCRIMINANT;
@@ -519,6 +521,80 @@ private:
     return nullptr;
   }
 
+  bool wantsAlwaysInline(Schema schema) {
+    // `$Cxx.alwaysInline` covers the annotated struct, everything nested inside it (including its
+    // groups), or a whole file.
+    auto node = schema.getProto();
+    for (;;) {
+      if (annotationValue(node, ALWAYS_INLINE_ANNOTATION_ID) != nullptr) return true;
+      if (node.getScopeId() == 0) return false;
+      node = schemaLoader.get(node.getScopeId()).getProto();
+    }
+  }
+
+  template <typename... Params>
+  kj::StringTree accessorDecl(bool alwaysInline, Params&&... params) {
+    // Declares a trivial accessor, forced inline under `$Cxx.alwaysInline`.  KJ_ALWAYS_INLINE
+    // only belongs on the declaration; the definition is emitted as plain `inline`.
+    if (alwaysInline) {
+      return kj::strTree("  KJ_ALWAYS_INLINE(", kj::fwd<Params>(params)..., ");\n");
+    } else {
+      return kj::strTree("  inline ", kj::fwd<Params>(params)..., ";\n");
+    }
+  }
+
+  kj::Maybe<uint64_t> fixedPointeeWords(StructSchema schema, kj::Vector<uint64_t>& stack) {
+    // Returns the number of words occupied by everything `schema`'s pointers can point at, or
+    // null if that isn't bounded (text, data, lists, AnyPointer, or a recursive struct).  Each
+    // pointer is assumed to be initialized at most once.
+
+    uint64_t id = schema.getProto().getId();
+    for (auto seen: stack) {
+      if (seen == id) return nullptr;
+    }
+    stack.add(id);
+    KJ_DEFER(stack.removeLast());
+
+    uint64_t total = 0;
+    for (auto field: schema.getFields()) {
+      auto proto = field.getProto();
+      if (proto.isGroup()) {
+        // Groups share their parent's sections; only their pointees add to the total.
+        KJ_IF_MAYBE(words, fixedPointeeWords(field.getType().asStruct(), stack)) {
+          total += *words;
+        } else {
+          return nullptr;
+        }
+        continue;
+      }
+
+      auto type = field.getType();
+      switch (type.which()) {
+        case schema::Type::TEXT:
+        case schema::Type::DATA:
+        case schema::Type::LIST:
+        case schema::Type::ANY_POINTER:
+          return nullptr;
+        case schema::Type::INTERFACE:
+          // A capability pointer indexes the cap table; it has no content in the message.
+          break;
+        case schema::Type::STRUCT: {
+          auto child = type.asStruct();
+          auto childNode = child.getProto().getStruct();
+          KJ_IF_MAYBE(words, fixedPointeeWords(child, stack)) {
+            total += childNode.getDataWordCount() + childNode.getPointerCount() + *words;
+          } else {
+            return nullptr;
+          }
+          break;
+        }
+        default:
+          break;
+      }
+    }
+    return total;
+  }
+
   template <typename P>
   kj::StringPtr protoName(P proto) {
     KJ_IF_MAYBE(name, annotationValue(proto, NAME_ANNOTATION_ID)) {
@@ -1074,7 +1150,8 @@ private:
   DiscriminantChecks makeDiscriminantChecks(kj::StringPtr scope,
                                             kj::StringPtr memberName,
                                             StructSchema containingStruct,
-                                            const TemplateContext& templateContext) {
+                                            const TemplateContext& templateContext,
+                                            bool alwaysInline) {
     auto discrimOffset = containingStruct.getProto().getStruct().getDiscriminantOffset();
 
     kj::String titleCase = toTitleCase(memberName);
@@ -1093,8 +1170,8 @@ private:
             "  _builder.setDataField<", scope, "Which>(\n"
             "      ::capnp::bounded<", discrimOffset, ">() * ::capnp::ELEMENTS, ",
                       scope, upperCase, ");\n"),
-        kj::strTree("  inline bool is", titleCase, "() const;\n"),
-        kj::strTree("  inline bool is", titleCase, "();\n"),
+        accessorDecl(alwaysInline, "bool is", titleCase, "() const"),
+        accessorDecl(alwaysInline, "bool is", titleCase, "()"),
         kj::strTree(
             templateContext.allDecls(),
             "inline bool ", scope, "Reader::is", titleCase, "() const {\n"
@@ -1127,7 +1204,7 @@ private:
   };
 
   FieldText makeFieldText(kj::StringPtr scope, StructSchema::Field field,
-                          const TemplateContext& templateContext) {
+                          const TemplateContext& templateContext, bool alwaysInline) {
     auto proto = field.getProto();
     auto typeSchema = field.getType();
     auto baseName = protoName(proto);
@@ -1136,7 +1213,7 @@ private:
     DiscriminantChecks unionDiscrim;
     if (hasDiscriminantValue(proto)) {
       unionDiscrim = makeDiscriminantChecks(scope, baseName, field.getContainingStruct(),
-                                            templateContext);
+                                            templateContext, alwaysInline);
     }
 
     switch (proto.which()) {
@@ -1336,13 +1413,13 @@ private:
       return FieldText {
         kj::strTree(
             kj::mv(unionDiscrim.readerIsDecl),
-            "  inline ", type, " get", titleCase, "() const;\n"
+            accessorDecl(alwaysInline, type, " get", titleCase, "() const"),
             "\n"),
 
         kj::strTree(
             kj::mv(unionDiscrim.builderIsDecl),
-            "  inline ", type, " get", titleCase, "();\n"
-            "  inline void set", titleCase, "(", type, " value", setterDefault, ");\n"
+            accessorDecl(alwaysInline, type, " get", titleCase, "()"),
+            accessorDecl(alwaysInline, "void set", titleCase, "(", type, " value", setterDefault, ")"),
             "\n"),
 
         kj::strTree(),
@@ -1817,7 +1894,7 @@ private:
 
   kj::StringTree makeReaderDef(kj::StringPtr fullName, kj::StringPtr unqualifiedParentType,
                                const TemplateContext& templateContext, bool isUnion,
-                               kj::Array<kj::StringTree>&& methodDecls) {
+                               bool alwaysInline, kj::Array<kj::StringTree>&& methodDecls) {
     return kj::strTree(
         templateContext.allDecls(),
         "class ", fullName, "::Reader {\n"
@@ -1838,7 +1915,7 @@ private:
         "#endif  // !CAPNP_LITE\n"
         "\n",
         makeAsGenericDef(AsGenericRole::READER, templateContext, unqualifiedParentType),
-        isUnion ? kj::strTree("  inline Which which() const;\n") : kj::strTree(),
+        isUnion ? accessorDecl(alwaysInline, "Which which() const") : kj::strTree(),
         kj::mv(methodDecls),
         "private:\n"
         "  ::capnp::_::StructReader _reader;\n"
@@ -1856,7 +1933,7 @@ private:
 
   kj::StringTree makeBuilderDef(kj::StringPtr fullName, kj::StringPtr unqualifiedParentType,
                                 const TemplateContext& templateContext, bool isUnion,
-                                kj::Array<kj::StringTree>&& methodDecls) {
+                                bool alwaysInline, kj::Array<kj::StringTree>&& methodDecls) {
     return kj::strTree(
         templateContext.allDecls(),
         "class ", fullName, "::Builder {\n"
@@ -1876,7 +1953,7 @@ private:
         "#endif  // !CAPNP_LITE\n"
         "\n",
         makeAsGenericDef(AsGenericRole::BUILDER, templateContext, unqualifiedParentType),
-        isUnion ? kj::strTree("  inline Which which();\n") : kj::strTree(),
+        isUnion ? accessorDecl(alwaysInline, "Which which()") : kj::strTree(),
         kj::mv(methodDecls),
         "private:\n"
         "  ::capnp::_::StructBuilder _builder;\n"
@@ -1968,8 +2045,9 @@ private:
     }
     auto fullName = kj::str(scope, name, templateContext.args());
     auto subScope = kj::str(fullName, "::");
+    bool alwaysInline = wantsAlwaysInline(schema);
     auto fieldTexts = KJ_MAP(f, schema.getFields()) {
-      return makeFieldText(subScope, f, templateContext);
+      return makeFieldText(subScope, f, templateContext, alwaysInline);
     };
 
     auto structNode = proto.getStruct();
@@ -1987,7 +2065,22 @@ private:
     kj::StringTree defineText = kj::strTree(
         "// ", fullName, "\n",
         templates, "constexpr uint16_t ", fullName, "::_capnpPrivate::dataWordSize;\n",
-        templates, "constexpr uint16_t ", fullName, "::_capnpPrivate::pointerCount;\n"
+        templates, "constexpr uint16_t ", fullName, "::_capnpPrivate::pointerCount;\n");
+
+    if (alwaysInline && !structNode.getIsGroup() && !proto.getIsGeneric()) {
+      kj::Vector<uint64_t> stack;
+      KJ_IF_MAYBE(pointeeWords, fixedPointeeWords(schema, stack)) {
+        // Root pointer, then the struct itself, then whatever it points at.
+        uint64_t words = 1 + structNode.getDataWordCount() + structNode.getPointerCount() +
+                         *pointeeWords;
+        declareText = kj::strTree(kj::mv(declareText),
+            "    static constexpr uint32_t fixedMessageWords = ", words, ";\n");
+        defineText = kj::strTree(kj::mv(defineText),
+            templates, "constexpr uint32_t ", fullName, "::_capnpPrivate::fixedMessageWords;\n");
+      }
+    }
+
+    defineText = kj::strTree(kj::mv(defineText),
         "#if !CAPNP_LITE\n",
         templates, "constexpr ::capnp::Kind ", fullName, "::_capnpPrivate::kind;\n",
         templates, "constexpr ::capnp::_::RawSchema const* ", fullName, "::_capnpPrivate::schema;\n");
@@ -2053,9 +2146,9 @@ private:
 
       kj::strTree(
           makeReaderDef(fullName, name, templateContext, structNode.getDiscriminantCount() != 0,
-                        KJ_MAP(f, fieldTexts) { return kj::mv(f.readerMethodDecls); }),
+                        alwaysInline, KJ_MAP(f, fieldTexts) { return kj::mv(f.readerMethodDecls); }),
           makeBuilderDef(fullName, name, templateContext, structNode.getDiscriminantCount() != 0,
-                         KJ_MAP(f, fieldTexts) { return kj::mv(f.builderMethodDecls); }),
+                         alwaysInline, KJ_MAP(f, fieldTexts) { return kj::mv(f.builderMethodDecls); }),
           makePipelineDef(fullName, name, templateContext, structNode.getDiscriminantCount() != 0,
                           KJ_MAP(f, fieldTexts) { return kj::mv(f.pipelineMethodDecls); })),
 
@@ -2172,14 +2265,29 @@ private:
     // the `CAPNP_AUTO_IF_MSVC()` hackery in the return type declarations below. We're depending on
     // the fact that that this function has an inline implementation for the deduction to work.
 
+    // A `$Cxx.stream` method's request type only knows its params, and is sent with
+    // sendStreaming().
+    bool isStreaming = annotationValue(proto, STREAM_ANNOTATION_ID) != nullptr;
+    if (isStreaming) {
+      KJ_REQUIRE(resultSchema.getFields().size() == 0,
+                 "$Cxx.stream method must not have results",
+                 interfaceProto.getDisplayName(), name);
+    }
+    auto requestType = isStreaming
+        ? kj::strTree("::capnp::StreamingRequest<", paramType, ">")
+        : kj::strTree("::capnp::Request<", paramType, ", ", resultType, ">");
+    auto newCallName = isStreaming
+        ? kj::strTree("newStreamingCall<", paramType, ">")
+        : kj::strTree("newCall<", paramType, ", ", resultType, ">");
+
     auto requestMethodImpl = kj::strTree(
         templateContext.allDecls(),
         implicitParamsTemplateDecl,
         templateContext.isGeneric() ? "CAPNP_AUTO_IF_MSVC(" : "",
-        "::capnp::Request<", paramType, ", ", resultType, ">",
+        requestType.flatten(),
         templateContext.isGeneric() ? ")\n" : "\n",
         interfaceName, "::Client::", name, "Request(::kj::Maybe< ::capnp::MessageSize> sizeHint) {\n"
-        "  return newCall<", paramType, ", ", resultType, ">(\n"
+        "  return ", kj::mv(newCallName), "(\n"
         "      0x", interfaceIdHex, "ull, ", methodId, ", sizeHint);\n"
         "}\n");
 
@@ -2187,7 +2295,7 @@ private:
       kj::strTree(
           implicitParamsTemplateDecl.size() == 0 ? "" : "  ", implicitParamsTemplateDecl,
           templateContext.isGeneric() ? "  CAPNP_AUTO_IF_MSVC(" : "  ",
-          "::capnp::Request<", paramType, ", ", resultType, ">",
+          kj::mv(requestType),
           templateContext.isGeneric() ? ")" : "",
           " ", name, "Request(\n"
           "      ::kj::Maybe< ::capnp::MessageSize> sizeHint = nullptr);\n"),
@@ -28,6 +28,58 @@ namespace compiler {
 
 namespace p = kj::parse;
 
+typedef p::Span<uint32_t> Location;
+
+struct Lexer::RawToken {
+  // Building each token directly as an Orphan<Token> would put it in the message twice: once
+  // where the orphan was allocated, and again when the enclosing list adopts it, since adoption
+  // copies the struct into the list and leaves the orphan's space unused.  Instead the token
+  // parsers produce these plain values, and each token is written out exactly once, after the
+  // size of its list is known.
+
+  Token::Which type;
+  uint32_t startByte;
+  uint32_t endByte;
+
+  kj::String text;                        // IDENTIFIER, STRING_LITERAL, OPERATOR
+  kj::Array<byte> data;                   // BINARY_LITERAL
+  uint64_t integer = 0;                   // INTEGER_LITERAL
+  double number = 0;                      // FLOAT_LITERAL
+  kj::Array<kj::Array<RawToken>> items;   // PARENTHESIZED_LIST, BRACKETED_LIST
+
+  RawToken(Token::Which type, const Location& loc)
+      : type(type), startByte(loc.begin()), endByte(loc.end()) {}
+
+  void writeTo(Token::Builder builder) const {
+    builder.setStartByte(startByte);
+    builder.setEndByte(endByte);
+
+    switch (type) {
+      case Token::IDENTIFIER: builder.setIdentifier(text); break;
+      case Token::STRING_LITERAL: builder.setStringLiteral(text); break;
+      case Token::BINARY_LITERAL: builder.setBinaryLiteral(data); break;
+      case Token::INTEGER_LITERAL: builder.setIntegerLiteral(integer); break;
+      case Token::FLOAT_LITERAL: builder.setFloatLiteral(number); break;
+      case Token::OPERATOR: builder.setOperator(text); break;
+      case Token::PARENTHESIZED_LIST: writeItems(builder.initParenthesizedList(items.size())); break;
+      case Token::BRACKETED_LIST: writeItems(builder.initBracketedList(items.size())); break;
+    }
+  }
+
+  static void writeAll(List<Token>::Builder builder, kj::ArrayPtr<const RawToken> tokens) {
+    for (uint i = 0; i < tokens.size(); i++) {
+      tokens[i].writeTo(builder[i]);
+    }
+  }
+
+private:
+  void writeItems(List<List<Token>>::Builder builder) const {
+    for (uint i = 0; i < items.size(); i++) {
+      writeAll(builder.init(i, items[i].size()), items[i]);
+    }
+  }
+};
+
 bool lex(kj::ArrayPtr<const char> input, LexedStatements::Builder result,
          ErrorReporter& errorReporter) {
   Lexer lexer(Orphanage::getForMessageContaining(result), errorReporter);
@@ -54,16 +106,13 @@ bool lex(kj::ArrayPtr<const char> input, LexedTokens::Builder result,
          ErrorReporter& errorReporter) {
   Lexer lexer(Orphanage::getForMessageContaining(result), errorReporter);
 
-  auto parser = p::sequence(lexer.getParsers().tokenSequence, p::endOfInput);
+  auto parser = p::sequence(lexer.rawTokenSequence, p::endOfInput);
 
   Lexer::ParserInput parserInput(input.begin(), input.end());
-  kj::Maybe<kj::Array<Orphan<Token>>> parseOutput = parser(parserInput);
+  kj::Maybe<kj::Array<Lexer::RawToken>> parseOutput = parser(parserInput);
 
   KJ_IF_MAYBE(output, parseOutput) {
-    auto l = result.initTokens(output->size());
-    for (uint i = 0; i < output->size(); i++) {
-      l.adoptWithCaveats(i, kj::mv((*output)[i]));
-    }
+    Lexer::RawToken::writeAll(result.initTokens(output->size()), *output);
     return true;
   } else {
     uint32_t best = parserInput.getBest();
@@ -74,26 +123,6 @@ bool lex(kj::ArrayPtr<const char> input, LexedTokens::Builder result,
 
 namespace {
 
-typedef p::Span<uint32_t> Location;
-
-Token::Builder initTok(Orphan<Token>& t, const Location& loc) {
-  auto builder = t.get();
-  builder.setStartByte(loc.begin());
-  builder.setEndByte(loc.end());
-  return builder;
-}
-
-void buildTokenSequenceList(List<List<Token>>::Builder builder,
-                            kj::Array<kj::Array<Orphan<Token>>>&& items) {
-  for (uint i = 0; i < items.size(); i++) {
-    auto& item = items[i];
-    auto itemBuilder = builder.init(i, item.size());
-    for (uint j = 0; j < item.size(); j++) {
-      itemBuilder.adoptWithCaveats(j, kj::mv(item[j]));
-    }
-  }
-}
-
 void attachDocComment(Statement::Builder statement, kj::Array<kj::String>&& comment) {
   size_t size = 0;
   for (auto& line: comment) {
@@ -147,13 +176,13 @@ Lexer::Lexer(Orphanage orphanageParam, ErrorReporter& errorReporter)
     : orphanage(orphanageParam) {
 
   // Note that because passing an lvalue to a parser constructor uses it by-referencee, it's safe
-  // for us to use parsers.tokenSequence even though we haven't yet constructed it.
-  auto& tokenSequence = parsers.tokenSequence;
+  // for us to use rawTokenSequence even though we haven't yet constructed it.
+  auto& tokenSequence = rawTokenSequence;
 
   auto& commaDelimitedList = arena.copy(p::transform(
       p::sequence(tokenSequence, p::many(p::sequence(p::exactChar<','>(), tokenSequence))),
-      [](kj::Array<Orphan<Token>>&& first, kj::Array<kj::Array<Orphan<Token>>>&& rest)
-          -> kj::Array<kj::Array<Orphan<Token>>> {
+      [](kj::Array<RawToken>&& first, kj::Array<kj::Array<RawToken>>&& rest)
+          -> kj::Array<kj::Array<RawToken>> {
         if (first == nullptr && rest == nullptr) {
           // Completely empty list.
           return nullptr;
@@ -164,7 +193,7 @@ Lexer::Lexer(Orphanage orphanageParam, ErrorReporter& errorReporter)
             // nullptr
             restSize--;
           }
-          auto result = kj::heapArrayBuilder<kj::Array<Orphan<Token>>>(1 + restSize); // first+rest
+          auto result = kj::heapArrayBuilder<kj::Array<RawToken>>(1 + restSize); // first+rest
           result.add(kj::mv(first));
           for (uint i = 0; i < restSize ; i++) {
             result.add(kj::mv(rest[i]));
@@ -175,68 +204,66 @@ Lexer::Lexer(Orphanage orphanageParam, ErrorReporter& errorReporter)
 
   auto& token = arena.copy(p::oneOf(
       p::transformWithLocation(p::identifier,
-          [this](Location loc, kj::String name) -> Orphan<Token> {
-            auto t = orphanage.newOrphan<Token>();
-            initTok(t, loc).setIdentifier(name);
+          [](Location loc, kj::String name) -> RawToken {
+            RawToken t(Token::IDENTIFIER, loc);
+            t.text = kj::mv(name);
             return t;
           }),
       p::transformWithLocation(p::doubleQuotedString,
-          [this](Location loc, kj::String text) -> Orphan<Token> {
-            auto t = orphanage.newOrphan<Token>();
-            initTok(t, loc).setStringLiteral(text);
+          [](Location loc, kj::String text) -> RawToken {
+            RawToken t(Token::STRING_LITERAL, loc);
+            t.text = kj::mv(text);
             return t;
           }),
       p::transformWithLocation(p::doubleQuotedHexBinary,
-          [this](Location loc, kj::Array<byte> data) -> Orphan<Token> {
-            auto t = orphanage.newOrphan<Token>();
-            initTok(t, loc).setBinaryLiteral(data);
+          [](Location loc, kj::Array<byte> data) -> RawToken {
+            RawToken t(Token::BINARY_LITERAL, loc);
+            t.data = kj::mv(data);
             return t;
           }),
       p::transformWithLocation(p::integer,
-          [this](Location loc, uint64_t i) -> Orphan<Token> {
-            auto t = orphanage.newOrphan<Token>();
-            initTok(t, loc).setIntegerLiteral(i);
+          [](Location loc, uint64_t i) -> RawToken {
+            RawToken t(Token::INTEGER_LITERAL, loc);
+            t.integer = i;
             return t;
           }),
       p::transformWithLocation(p::number,
-          [this](Location loc, double x) -> Orphan<Token> {
-            auto t = orphanage.newOrphan<Token>();
-            initTok(t, loc).setFloatLiteral(x);
+          [](Location loc, double x) -> RawToken {
+            RawToken t(Token::FLOAT_LITERAL, loc);
+            t.number = x;
             return t;
           }),
       p::transformWithLocation(
           p::charsToString(p::oneOrMore(p::anyOfChars("!$%&*+-./:<=>?@^|~"))),
-          [this](Location loc, kj::String text) -> Orphan<Token> {
-            auto t = orphanage.newOrphan<Token>();
-            initTok(t, loc).setOperator(text);
+          [](Location loc, kj::String text) -> RawToken {
+            RawToken t(Token::OPERATOR, loc);
+            t.text = kj::mv(text);
             return t;
           }),
       p::transformWithLocation(
           sequence(p::exactChar<'('>(), commaDelimitedList, p::exactChar<')'>()),
-          [this](Location loc, kj::Array<kj::Array<Orphan<Token>>>&& items) -> Orphan<Token> {
-            auto t = orphanage.newOrphan<Token>();
-            buildTokenSequenceList(
-                initTok(t, loc).initParenthesizedList(items.size()), kj::mv(items));
+          [](Location loc, kj::Array<kj::Array<RawToken>>&& items) -> RawToken {
+            RawToken t(Token::PARENTHESIZED_LIST, loc);
+            t.items = kj::mv(items);
             return t;
           }),
       p::transformWithLocation(
           sequence(p::exactChar<'['>(), commaDelimitedList, p::exactChar<']'>()),
-          [this](Location loc, kj::Array<kj::Array<Orphan<Token>>>&& items) -> Orphan<Token> {
-            auto t = orphanage.newOrphan<Token>();
-            buildTokenSequenceList(
-                initTok(t, loc).initBracketedList(items.size()), kj::mv(items));
+          [](Location loc, kj::Array<kj::Array<RawToken>>&& items) -> RawToken {
+            RawToken t(Token::BRACKETED_LIST, loc);
+            t.items = kj::mv(items);
             return t;
           }),
       p::transformOrReject(p::transformWithLocation(
           p::oneOf(sequence(p::exactChar<'\xff'>(), p::exactChar<'\xfe'>()),
                    sequence(p::exactChar<'\xfe'>(), p::exactChar<'\xff'>()),
                    sequence(p::exactChar<'\x00'>())),
-          [&errorReporter](Location loc) -> kj::Maybe<Orphan<Token>> {
+          [&errorReporter](Location loc) -> kj::Maybe<RawToken> {
             errorReporter.addError(loc.begin(), loc.end(),
                 "Non-UTF-8 input detected. Cap'n Proto schema files must be UTF-8 text.");
             return nullptr;
-          }), [](kj::Maybe<Orphan<Token>> param) { return param; })));
-  parsers.tokenSequence = arena.copy(p::sequence(
+          }), [](kj::Maybe<RawToken> param) { return param; })));
+  rawTokenSequence = arena.copy(p::sequence(
       commentsAndWhitespace, p::many(p::sequence(token, commentsAndWhitespace))));
 
   auto& statementSequence = parsers.statementSequence;
@@ -275,12 +302,9 @@ Lexer::Lexer(Orphanage orphanageParam, ErrorReporter& errorReporter)
       ));
 
   auto& statement = arena.copy(p::transformWithLocation(p::sequence(tokenSequence, statementEnd),
-      [](Location loc, kj::Array<Orphan<Token>>&& tokens, Orphan<Statement>&& statement) {
+      [](Location loc, kj::Array<RawToken>&& tokens, Orphan<Statement>&& statement) {
         auto builder = statement.get();
-        auto tokensBuilder = builder.initTokens(tokens.size());
-        for (uint i = 0; i < tokens.size(); i++) {
-          tokensBuilder.adoptWithCaveats(i, kj::mv(tokens[i]));
-        }
+        RawToken::writeAll(builder.initTokens(tokens.size()), tokens);
         builder.setStartByte(loc.begin());
         builder.setEndByte(loc.end());
         return kj::mv(statement);
@@ -289,7 +313,21 @@ Lexer::Lexer(Orphanage orphanageParam, ErrorReporter& errorReporter)
   parsers.statementSequence = arena.copy(sequence(
       commentsAndWhitespace, many(sequence(statement, commentsAndWhitespace))));
 
-  parsers.token = token;
+  // The public token parsers hand out orphans, for embedding in other parsers.
+  parsers.token = arena.copy(p::transform(token,
+      [this](RawToken&& token) -> Orphan<Token> {
+        auto result = orphanage.newOrphan<Token>();
+        token.writeTo(result.get());
+        return result;
+      }));
+  parsers.tokenSequence = arena.copy(p::transform(tokenSequence,
+      [this](kj::Array<RawToken>&& tokens) -> kj::Array<Orphan<Token>> {
+        return KJ_MAP(token, tokens) {
+          auto result = orphanage.newOrphan<Token>();
+          token.writeTo(result.get());
+          return result;
+        };
+      }));
   parsers.statement = statement;
   parsers.emptySpace = commentsAndWhitespace;
 }
@@ -90,9 +90,17 @@ public:
   const Parsers& getParsers() { return parsers; }
 
 private:
+  struct RawToken;
+  // A token as the inner parsers produce it, before it is written into the message.  See
+  // lexer.c++.
+
   Orphanage orphanage;
   kj::Arena arena;
+  Parser<kj::Array<RawToken>> rawTokenSequence;
   Parsers parsers;
+
+  friend bool lex(kj::ArrayPtr<const char> input, LexedTokens::Builder result,
+                  ErrorReporter& errorReporter);
 };
 
 }  // namespace compiler
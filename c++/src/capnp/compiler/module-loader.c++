@@ -26,8 +26,10 @@
 #include <kj/mutex.h>
 #include <kj/debug.h>
 #include <kj/io.h>
+#include <kj/thread.h>
 #include <capnp/message.h>
 #include <unordered_map>
+#include <atomic>
 
 namespace capnp {
 namespace compiler {
@@ -160,7 +162,38 @@ public:
     return sourceNameStr;
   }
 
+  void preparse() {
+    // Called from a preparse() worker thread.  Touches nothing but this module's own file and
+    // `preparsed`, since the loader and its error reporter are not thread-safe.
+
+    auto result = kj::heap<Preparsed>();
+    result->content = file->mmap(0, file->stat().size).releaseAsChars();
+
+    MallocMessageBuilder lexedBuilder;
+    auto statements = lexedBuilder.initRoot<LexedStatements>();
+    lex(result->content, statements, *result);
+    parseFile(statements.getStatements(), result->parsed.initRoot<ParsedFile>(), *result);
+
+    preparsed = kj::mv(result);
+  }
+
+  bool isPreparsed() { return preparsed != nullptr; }
+
   Orphan<ParsedFile> loadContent(Orphanage orphanage) override {
+    KJ_IF_MAYBE(p, preparsed) {
+      auto result = kj::mv(*p);
+      preparsed = nullptr;
+
+      lineBreaks = nullptr;  // In case loadContent() is called multiple times.
+      lineBreaks = lineBreaksSpace.construct(result->content);
+
+      for (auto& error: result->errors) {
+        addError(error.startByte, error.endByte, error.message);
+      }
+
+      return orphanage.newOrphanCopy(result->parsed.getRoot<ParsedFile>().asReader());
+    }
+
     kj::Array<const char> content = file->mmap(0, file->stat().size).releaseAsChars();
 
     lineBreaks = nullptr;  // In case loadContent() is called multiple times.
@@ -212,6 +245,32 @@ private:
 
   kj::SpaceFor<LineBreakTable> lineBreaksSpace;
   kj::Maybe<kj::Own<LineBreakTable>> lineBreaks;
+
+  struct Preparsed final: public ErrorReporter {
+    // Result of preparse(), waiting for loadContent().  Errors can't be reported while parsing
+    // because line numbers and the global error reporter belong to the main thread, so they are
+    // buffered here.
+
+    struct Error {
+      uint32_t startByte;
+      uint32_t endByte;
+      kj::String message;
+    };
+
+    kj::Array<const char> content;
+    MallocMessageBuilder parsed;
+    kj::Vector<Error> errors;
+
+    void addError(uint32_t startByte, uint32_t endByte, kj::StringPtr message) override {
+      errors.add(Error { startByte, endByte, kj::heapString(message) });
+    }
+
+    bool hadErrors() override {
+      return errors.size() > 0;
+    }
+  };
+
+  kj::Maybe<kj::Own<Preparsed>> preparsed;
 };
 
 // =======================================================================================
@@ -278,6 +337,41 @@ void ModuleLoader::addImportPath(const kj::ReadableDirectory& dir) {
   impl->addImportPath(dir);
 }
 
+void ModuleLoader::preparse(kj::ArrayPtr<Module* const> modules, uint threadCount) {
+  kj::Vector<ModuleImpl*> pending(modules.size());
+  for (auto module: modules) {
+    auto impl = static_cast<ModuleImpl*>(module);
+    if (!impl->isPreparsed()) {
+      pending.add(impl);
+    }
+  }
+
+  if (threadCount > pending.size()) threadCount = pending.size();
+  if (threadCount <= 1) {
+    // Nothing to gain over parsing on demand.
+    return;
+  }
+
+  // Each thread claims the next unparsed module until none are left.  A module that fails to
+  // parse with an exception is simply left unparsed; loadContent() will parse it again and report
+  // the exception normally.
+  std::atomic<size_t> next(0);
+  {
+    auto threads = kj::heapArrayBuilder<kj::Own<kj::Thread>>(threadCount);
+    for (uint i = 0; i < threadCount; i++) {
+      threads.add(kj::heap<kj::Thread>([&]() {
+        for (;;) {
+          size_t index = next.fetch_add(1, std::memory_order_relaxed);
+          if (index >= pending.size()) break;
+          auto module = pending[index];
+          kj::runCatchingExceptions([&]() { module->preparse(); });
+        }
+      }));
+    }
+    // Destroying the array joins all threads.
+  }
+}
+
 kj::Maybe<Module&> ModuleLoader::loadModule(const kj::ReadableDirectory& dir, kj::PathPtr path) {
   return impl->loadModule(dir, path);
 }
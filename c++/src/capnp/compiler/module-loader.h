@@ -51,6 +51,13 @@ public:
   // Tries to load a module with the given path inside the given directory. Returns nullptr if the
   // file doesn't exist.
 
+  void preparse(kj::ArrayPtr<Module* const> modules, uint threadCount);
+  // Lex and parse the given modules (which must have been returned by this loader's
+  // loadModule()) on up to `threadCount` threads, so that the compiler's later calls to
+  // loadContent() only need to copy the result.  Errors are held back and reported by
+  // loadContent(), so they come out in the same order as without preparsing.  Modules which
+  // have already been preparsed are skipped.
+
 private:
   class Impl;
   kj::Own<Impl> impl;
@@ -23,6 +23,7 @@
 
 #include "dynamic.h"
 #include <kj/debug.h>
+#include <kj/map.h>
 
 namespace capnp {
 
@@ -52,9 +53,58 @@ Request<DynamicStruct, DynamicStruct> DynamicCapability::Client::newRequest(
   return newRequest(schema.getMethodByName(methodName), sizeHint);
 }
 
+struct DynamicCapability::Server::DispatchTable {
+  struct Entry {
+    InterfaceSchema::Method method;
+    StructSchema paramType;
+    StructSchema resultType;
+  };
+
+  kj::HashMap<uint64_t, kj::Array<Entry>> interfaces;
+
+  static constexpr uint MAX_INTERFACES = 64;
+
+  void add(InterfaceSchema interface) {
+    // Visits superclasses depth-first in declaration order, so that when a diamond makes the
+    // same interface reachable twice, the first path wins -- matching findSuperclass().
+    uint64_t id = interface.getProto().getId();
+    if (interfaces.find(id) != nullptr) return;
+
+    if (interfaces.size() >= MAX_INTERFACES) {
+      // Absurdly large (or, in a dynamically-loaded schema, hostile) inheritance graph. Calls to
+      // the rest go through findSuperclass(), which reports the problem.
+      return;
+    }
+
+    interfaces.insert(id, KJ_MAP(method, interface.getMethods()) {
+      return Entry { method, method.getParamType(), method.getResultType() };
+    });
+
+    for (auto superclass: interface.getSuperclasses()) {
+      add(superclass);
+    }
+  }
+};
+
+DynamicCapability::Server::Server(InterfaceSchema schema)
+    : schema(schema), dispatchTable(kj::heap<DispatchTable>()) {
+  dispatchTable->add(schema);
+}
+
+DynamicCapability::Server::~Server() noexcept(false) {}
+
 kj::Promise<void> DynamicCapability::Server::dispatchCall(
     uint64_t interfaceId, uint16_t methodId,
     CallContext<AnyPointer, AnyPointer> context) {
+  KJ_IF_MAYBE(methods, dispatchTable->interfaces.find(interfaceId)) {
+    if (methodId < methods->size()) {
+      auto& entry = (*methods)[methodId];
+      return call(entry.method, CallContext<DynamicStruct, DynamicStruct>(*context.hook,
+          entry.paramType, entry.resultType));
+    }
+  }
+
+  // Not in the table. Fall back to a schema lookup so the error names the right interface.
   KJ_IF_MAYBE(interface, schema.findSuperclass(interfaceId)) {
     auto methods = interface->getMethods();
     if (methodId < methods.size()) {
@@ -463,6 +463,71 @@ TEST(DynamicApi, SetDataFromText) {
   EXPECT_EQ(data("foo"), root.get("dataField").as<Data>());
 }
 
+TEST(DynamicApi, AccessPlan) {
+  MallocMessageBuilder builder;
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  auto src = builder.getRoot<DynamicStruct>(Schema::from<TestAllTypes>()).asReader();
+
+  StructAccessPlan plan(Schema::from<TestAllTypes>());
+  EXPECT_EQ(Schema::from<TestAllTypes>().getFields().size(), plan.getFields().size());
+  EXPECT_TRUE(src.which(plan) == nullptr);
+
+  MallocMessageBuilder builder2;
+  auto dst = builder2.initRoot<DynamicStruct>(Schema::from<TestAllTypes>());
+  for (auto field: plan.getNonUnionFields()) {
+    EXPECT_EQ(kj::str(src.get(field->getField())), kj::str(src.get(*field)));
+    if (src.has(*field)) {
+      dst.set(*field, src.get(*field));
+    }
+  }
+  checkTestMessage(dst.asReader().as<TestAllTypes>());
+
+  for (auto& field: plan.getFields()) {
+    EXPECT_EQ(kj::str(dst.get(field.getField())), kj::str(dst.get(field)));
+  }
+}
+
+TEST(DynamicApi, AccessPlanDefaults) {
+  StructAccessPlan plan(Schema::from<TestDefaults>());
+
+  MallocMessageBuilder builder;
+  auto root = builder.initRoot<DynamicStruct>(Schema::from<TestDefaults>());
+  for (auto& field: plan.getFields()) {
+    EXPECT_EQ(kj::str(root.asReader().get(field.getField())), kj::str(root.asReader().get(field)));
+  }
+
+  checkTestMessage(root.asReader().as<TestDefaults>());
+  for (auto& field: plan.getFields()) {
+    EXPECT_EQ(kj::str(root.get(field.getField())), kj::str(root.get(field)));
+  }
+  checkTestMessage(root.asReader().as<TestDefaults>());
+}
+
+TEST(DynamicApi, AccessPlanUnion) {
+  auto schema = Schema::from<test::TestUnnamedUnion>();
+  StructAccessPlan plan(schema);
+  EXPECT_EQ(3u, plan.getNonUnionFields().size());
+
+  MallocMessageBuilder builder;
+  auto root = builder.initRoot<DynamicStruct>(schema);
+
+  auto& foo = plan[schema.getFieldByName("foo")];
+  auto& bar = plan[schema.getFieldByName("bar")];
+  EXPECT_EQ(&foo, &KJ_ASSERT_NONNULL(root.which(plan)));
+
+  root.set(bar, 321);
+  EXPECT_EQ(&bar, &KJ_ASSERT_NONNULL(root.which(plan)));
+  EXPECT_EQ(321u, root.get(bar).as<uint32_t>());
+  EXPECT_FALSE(root.has(foo));
+  EXPECT_ANY_THROW(root.asReader().get(foo));
+
+  root.set(foo, 123);
+  EXPECT_EQ(test::TestUnnamedUnion::FOO, root.asReader().as<test::TestUnnamedUnion>().which());
+  EXPECT_EQ(123u, root.asReader().get(foo).as<uint16_t>());
+
+  EXPECT_ANY_THROW(root.get(StructAccessPlan(Schema::from<TestAllTypes>()).getFields()[0]));
+}
+
 TEST(DynamicApi, BuilderAssign) {
   MallocMessageBuilder builder;
   auto root = builder.initRoot<DynamicStruct>(Schema::from<TestAllTypes>());
@@ -482,6 +547,53 @@ TEST(DynamicApi, BuilderAssign) {
   listValue.set(0, 123);
 }
 
+TEST(DynamicApi, IsValidUtf8) {
+  MallocMessageBuilder builder;
+  auto root = builder.initRoot<TestAllTypes>();
+  initTestMessage(root);
+
+  auto check = [&]() {
+    return isValidUtf8(toDynamic(root.asReader()));
+  };
+  auto breakText = [](Text::Builder text) {
+    text[text.size() - 1] = '\xff';
+  };
+
+  EXPECT_TRUE(check());
+
+  breakText(root.getTextField());
+  EXPECT_FALSE(check());
+  root.setTextField(u8"fooЖ");
+  EXPECT_TRUE(check());
+
+  breakText(root.getTextList()[1]);
+  EXPECT_FALSE(check());
+  root.getTextList().set(1, "plugh");
+  EXPECT_TRUE(check());
+
+  breakText(root.getStructField().getTextField());
+  EXPECT_FALSE(check());
+  root.getStructField().setTextField("nested");
+  EXPECT_TRUE(check());
+
+  breakText(root.getStructList()[2].getTextField());
+  EXPECT_FALSE(check());
+  root.getStructList()[2].setTextField("x structlist 3");
+  EXPECT_TRUE(check());
+
+  // Data is not text.
+  root.setDataField(data("\xff\xfe"));
+  EXPECT_TRUE(check());
+
+  // Only the active union member is examined.
+  MallocMessageBuilder unionBuilder;
+  auto unionRoot = unionBuilder.initRoot<TestUnion>();
+  breakText(unionRoot.getUnion0().initU0f0sp(3));
+  EXPECT_FALSE(isValidUtf8(toDynamic(unionRoot.asReader())));
+  unionRoot.getUnion0().setU0f1s8(1);
+  EXPECT_TRUE(isValidUtf8(toDynamic(unionRoot.asReader())));
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
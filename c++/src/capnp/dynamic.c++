@@ -21,6 +21,7 @@
 
 #include "dynamic.h"
 #include <kj/debug.h>
+#include <kj/encoding.h>
 
 namespace capnp {
 
@@ -491,6 +492,403 @@ kj::Maybe<StructSchema::Field> DynamicStruct::Builder::which() {
   return schema.getFieldByDiscriminant(discrim);
 }
 
+// -------------------------------------------------------------------
+// StructAccessPlan
+
+StructAccessPlan::StructAccessPlan(StructSchema schema): schema(schema) {
+  auto structProto = schema.getProto().getStruct();
+  discriminantOffset = structProto.getDiscriminantOffset();
+  hasUnion = structProto.getDiscriminantCount() > 0;
+
+  auto schemaFields = schema.getFields();
+  fields = kj::heapArray<Field>(schemaFields.size());
+
+  uint maxDiscriminant = 0;
+  uint nonUnionCount = 0;
+  for (auto schemaField: schemaFields) {
+    auto proto = schemaField.getProto();
+    Field& field = fields[schemaField.getIndex()];
+
+    field.field = schemaField;
+    field.type = schemaField.getType();
+    field.which = field.type.which();
+    field.isGroup = proto.isGroup();
+    field.inUnion = hasDiscriminantValue(proto);
+    field.discriminantValue = proto.getDiscriminantValue();
+    field.discriminantOffset = discriminantOffset;
+    field.offset = 0;
+    field.defaultBits = 0;
+    field.defaultPointer = nullptr;
+    field.defaultSize = 0;
+    field.structSize = _::StructSize(ZERO * WORDS, ZERO * POINTERS);
+    field.elementSize = ElementSize::VOID;
+
+    if (field.inUnion) {
+      maxDiscriminant = kj::max(maxDiscriminant, field.discriminantValue + 1u);
+    } else {
+      ++nonUnionCount;
+    }
+
+    if (field.isGroup) continue;
+
+    auto slot = proto.getSlot();
+    auto dval = slot.getDefaultValue();
+    field.offset = slot.getOffset();
+
+    switch (field.which) {
+      case schema::Type::VOID:
+        break;
+
+#define HANDLE_TYPE(discrim, titleCase, type) \
+      case schema::Type::discrim: \
+        field.defaultBits = bitCast<_::Mask<type>>(dval.get##titleCase()); \
+        break;
+
+      HANDLE_TYPE(BOOL, Bool, bool)
+      HANDLE_TYPE(INT8, Int8, int8_t)
+      HANDLE_TYPE(INT16, Int16, int16_t)
+      HANDLE_TYPE(INT32, Int32, int32_t)
+      HANDLE_TYPE(INT64, Int64, int64_t)
+      HANDLE_TYPE(UINT8, Uint8, uint8_t)
+      HANDLE_TYPE(UINT16, Uint16, uint16_t)
+      HANDLE_TYPE(UINT32, Uint32, uint32_t)
+      HANDLE_TYPE(UINT64, Uint64, uint64_t)
+      HANDLE_TYPE(FLOAT32, Float32, float)
+      HANDLE_TYPE(FLOAT64, Float64, double)
+      HANDLE_TYPE(ENUM, Enum, uint16_t)
+
+#undef HANDLE_TYPE
+
+      case schema::Type::TEXT:
+        if (!dval.isAnyPointer()) {
+          auto text = dval.getText();
+          field.defaultPointer = reinterpret_cast<const word*>(text.begin());
+          field.defaultSize = text.size();
+        }
+        break;
+
+      case schema::Type::DATA:
+        if (!dval.isAnyPointer()) {
+          auto data = dval.getData();
+          field.defaultPointer = reinterpret_cast<const word*>(data.begin());
+          field.defaultSize = data.size();
+        }
+        break;
+
+      case schema::Type::LIST: {
+        auto listType = field.type.asList();
+        if (listType.whichElementType() == schema::Type::STRUCT) {
+          field.structSize = structSizeFromSchema(listType.getStructElementType());
+          field.elementSize = ElementSize::INLINE_COMPOSITE;
+        } else {
+          field.elementSize = elementSizeFor(listType.whichElementType());
+        }
+        if (!dval.isAnyPointer()) {
+          field.defaultPointer = dval.getList().getAs<_::UncheckedMessage>();
+        }
+        break;
+      }
+
+      case schema::Type::STRUCT:
+        field.structSize = structSizeFromSchema(field.type.asStruct());
+        if (!dval.isAnyPointer()) {
+          field.defaultPointer = dval.getStruct().getAs<_::UncheckedMessage>();
+        }
+        break;
+
+      case schema::Type::ANY_POINTER:
+      case schema::Type::INTERFACE:
+        break;
+    }
+  }
+
+  nonUnionFields = kj::heapArray<const Field*>(nonUnionCount);
+  fieldsByDiscriminant = kj::heapArray<const Field*>(maxDiscriminant);
+  for (auto& slot: fieldsByDiscriminant) slot = nullptr;
+
+  uint nonUnionIndex = 0;
+  for (auto& field: fields) {
+    if (field.inUnion) {
+      fieldsByDiscriminant[field.discriminantValue] = &field;
+    } else {
+      nonUnionFields[nonUnionIndex++] = &field;
+    }
+  }
+}
+
+kj::Maybe<const StructAccessPlan::Field&> StructAccessPlan::getFieldByDiscriminant(
+    uint16_t discriminant) const {
+  if (discriminant < fieldsByDiscriminant.size()) {
+    const Field* field = fieldsByDiscriminant[discriminant];
+    if (field != nullptr) return *field;
+  }
+  return nullptr;
+}
+
+DynamicValue::Reader DynamicStruct::Reader::get(const StructAccessPlan::Field& field) const {
+  KJ_REQUIRE(field.field.getContainingStruct() == schema, "`field` is not a field of this struct.");
+  KJ_REQUIRE(!field.inUnion ||
+      reader.getDataField<uint16_t>(assumeDataOffset(field.discriminantOffset)) ==
+          field.discriminantValue,
+      "Tried to get() a union member which is not currently initialized.",
+      field.field.getProto().getName(), schema.getProto().getDisplayName());
+
+  if (field.isGroup) {
+    return DynamicStruct::Reader(field.type.asStruct(), reader);
+  }
+
+  switch (field.which) {
+    case schema::Type::VOID:
+      return reader.getDataField<Void>(assumeDataOffset(field.offset));
+
+#define HANDLE_TYPE(discrim, type) \
+    case schema::Type::discrim: \
+      return reader.getDataField<type>(assumeDataOffset(field.offset), \
+                                       static_cast<_::Mask<type>>(field.defaultBits));
+
+    HANDLE_TYPE(BOOL, bool)
+    HANDLE_TYPE(INT8, int8_t)
+    HANDLE_TYPE(INT16, int16_t)
+    HANDLE_TYPE(INT32, int32_t)
+    HANDLE_TYPE(INT64, int64_t)
+    HANDLE_TYPE(UINT8, uint8_t)
+    HANDLE_TYPE(UINT16, uint16_t)
+    HANDLE_TYPE(UINT32, uint32_t)
+    HANDLE_TYPE(UINT64, uint64_t)
+    HANDLE_TYPE(FLOAT32, float)
+    HANDLE_TYPE(FLOAT64, double)
+
+#undef HANDLE_TYPE
+
+    case schema::Type::ENUM:
+      return DynamicEnum(field.type.asEnum(),
+          reader.getDataField<uint16_t>(assumeDataOffset(field.offset),
+                                        static_cast<uint16_t>(field.defaultBits)));
+
+    case schema::Type::TEXT:
+      return reader.getPointerField(assumePointerOffset(field.offset))
+                   .getBlob<Text>(field.defaultPointer,
+                       assumeMax<MAX_TEXT_SIZE>(field.defaultSize) * BYTES);
+
+    case schema::Type::DATA:
+      return reader.getPointerField(assumePointerOffset(field.offset))
+                   .getBlob<Data>(field.defaultPointer,
+                       assumeBits<BLOB_SIZE_BITS>(field.defaultSize) * BYTES);
+
+    case schema::Type::LIST:
+      return DynamicList::Reader(field.type.asList(),
+          reader.getPointerField(assumePointerOffset(field.offset))
+                .getList(field.elementSize, field.defaultPointer));
+
+    case schema::Type::STRUCT:
+      return DynamicStruct::Reader(field.type.asStruct(),
+          reader.getPointerField(assumePointerOffset(field.offset))
+                .getStruct(field.defaultPointer));
+
+    case schema::Type::ANY_POINTER:
+      return AnyPointer::Reader(reader.getPointerField(assumePointerOffset(field.offset)));
+
+    case schema::Type::INTERFACE:
+      return DynamicCapability::Client(field.type.asInterface(),
+          reader.getPointerField(assumePointerOffset(field.offset)).getCapability());
+  }
+
+  KJ_UNREACHABLE;
+}
+
+bool DynamicStruct::Reader::has(const StructAccessPlan::Field& field) const {
+  KJ_REQUIRE(field.field.getContainingStruct() == schema, "`field` is not a field of this struct.");
+
+  if (field.inUnion &&
+      reader.getDataField<uint16_t>(assumeDataOffset(field.discriminantOffset)) !=
+          field.discriminantValue) {
+    // Field is not active in the union.
+    return false;
+  }
+
+  if (field.isGroup) return true;
+
+  switch (field.which) {
+    case schema::Type::TEXT:
+    case schema::Type::DATA:
+    case schema::Type::LIST:
+    case schema::Type::STRUCT:
+    case schema::Type::ANY_POINTER:
+    case schema::Type::INTERFACE:
+      return !reader.getPointerField(assumePointerOffset(field.offset)).isNull();
+
+    default:
+      // Primitive types are always present.
+      return true;
+  }
+}
+
+kj::Maybe<const StructAccessPlan::Field&> DynamicStruct::Reader::which(
+    const StructAccessPlan& plan) const {
+  KJ_REQUIRE(plan.schema == schema, "`plan` is not a plan for this struct.");
+  if (!plan.hasUnion) return nullptr;
+  return plan.getFieldByDiscriminant(
+      reader.getDataField<uint16_t>(assumeDataOffset(plan.discriminantOffset)));
+}
+
+DynamicValue::Builder DynamicStruct::Builder::get(const StructAccessPlan::Field& field) {
+  KJ_REQUIRE(field.field.getContainingStruct() == schema, "`field` is not a field of this struct.");
+  KJ_REQUIRE(!field.inUnion ||
+      builder.getDataField<uint16_t>(assumeDataOffset(field.discriminantOffset)) ==
+          field.discriminantValue,
+      "Tried to get() a union member which is not currently initialized.",
+      field.field.getProto().getName(), schema.getProto().getDisplayName());
+
+  if (field.isGroup) {
+    return DynamicStruct::Builder(field.type.asStruct(), builder);
+  }
+
+  switch (field.which) {
+    case schema::Type::VOID:
+      return builder.getDataField<Void>(assumeDataOffset(field.offset));
+
+#define HANDLE_TYPE(discrim, type) \
+    case schema::Type::discrim: \
+      return builder.getDataField<type>(assumeDataOffset(field.offset), \
+                                        static_cast<_::Mask<type>>(field.defaultBits));
+
+    HANDLE_TYPE(BOOL, bool)
+    HANDLE_TYPE(INT8, int8_t)
+    HANDLE_TYPE(INT16, int16_t)
+    HANDLE_TYPE(INT32, int32_t)
+    HANDLE_TYPE(INT64, int64_t)
+    HANDLE_TYPE(UINT8, uint8_t)
+    HANDLE_TYPE(UINT16, uint16_t)
+    HANDLE_TYPE(UINT32, uint32_t)
+    HANDLE_TYPE(UINT64, uint64_t)
+    HANDLE_TYPE(FLOAT32, float)
+    HANDLE_TYPE(FLOAT64, double)
+
+#undef HANDLE_TYPE
+
+    case schema::Type::ENUM:
+      return DynamicEnum(field.type.asEnum(),
+          builder.getDataField<uint16_t>(assumeDataOffset(field.offset),
+                                         static_cast<uint16_t>(field.defaultBits)));
+
+    case schema::Type::TEXT:
+      return builder.getPointerField(assumePointerOffset(field.offset))
+                    .getBlob<Text>(field.defaultPointer,
+                        assumeMax<MAX_TEXT_SIZE>(field.defaultSize) * BYTES);
+
+    case schema::Type::DATA:
+      return builder.getPointerField(assumePointerOffset(field.offset))
+                    .getBlob<Data>(field.defaultPointer,
+                        assumeBits<BLOB_SIZE_BITS>(field.defaultSize) * BYTES);
+
+    case schema::Type::LIST:
+      if (field.elementSize == ElementSize::INLINE_COMPOSITE) {
+        return DynamicList::Builder(field.type.asList(),
+            builder.getPointerField(assumePointerOffset(field.offset))
+                   .getStructList(field.structSize, field.defaultPointer));
+      } else {
+        return DynamicList::Builder(field.type.asList(),
+            builder.getPointerField(assumePointerOffset(field.offset))
+                   .getList(field.elementSize, field.defaultPointer));
+      }
+
+    case schema::Type::STRUCT:
+      return DynamicStruct::Builder(field.type.asStruct(),
+          builder.getPointerField(assumePointerOffset(field.offset))
+                 .getStruct(field.structSize, field.defaultPointer));
+
+    case schema::Type::ANY_POINTER:
+      return AnyPointer::Builder(builder.getPointerField(assumePointerOffset(field.offset)));
+
+    case schema::Type::INTERFACE:
+      return DynamicCapability::Client(field.type.asInterface(),
+          builder.getPointerField(assumePointerOffset(field.offset)).getCapability());
+  }
+
+  KJ_UNREACHABLE;
+}
+
+kj::Maybe<const StructAccessPlan::Field&> DynamicStruct::Builder::which(
+    const StructAccessPlan& plan) {
+  KJ_REQUIRE(plan.schema == schema, "`plan` is not a plan for this struct.");
+  if (!plan.hasUnion) return nullptr;
+  return plan.getFieldByDiscriminant(
+      builder.getDataField<uint16_t>(assumeDataOffset(plan.discriminantOffset)));
+}
+
+void DynamicStruct::Builder::set(const StructAccessPlan::Field& field,
+                                 const DynamicValue::Reader& value) {
+  KJ_REQUIRE(field.field.getContainingStruct() == schema, "`field` is not a field of this struct.");
+
+  if (field.isGroup) {
+    set(field.field, value);
+    return;
+  }
+
+  switch (field.which) {
+#define HANDLE_TYPE(discrim, type) \
+    case schema::Type::discrim: \
+      if (field.inUnion) { \
+        builder.setDataField<uint16_t>(assumeDataOffset(field.discriminantOffset), \
+                                       field.discriminantValue); \
+      } \
+      builder.setDataField<type>(assumeDataOffset(field.offset), value.as<type>(), \
+                                 static_cast<_::Mask<type>>(field.defaultBits)); \
+      return;
+
+    HANDLE_TYPE(BOOL, bool)
+    HANDLE_TYPE(INT8, int8_t)
+    HANDLE_TYPE(INT16, int16_t)
+    HANDLE_TYPE(INT32, int32_t)
+    HANDLE_TYPE(INT64, int64_t)
+    HANDLE_TYPE(UINT8, uint8_t)
+    HANDLE_TYPE(UINT16, uint16_t)
+    HANDLE_TYPE(UINT32, uint32_t)
+    HANDLE_TYPE(UINT64, uint64_t)
+    HANDLE_TYPE(FLOAT32, float)
+    HANDLE_TYPE(FLOAT64, double)
+
+#undef HANDLE_TYPE
+
+    case schema::Type::ENUM:
+      if (value.getType() == DynamicValue::ENUM) {
+        DynamicEnum enumValue = value.as<DynamicEnum>();
+        KJ_REQUIRE(enumValue.getSchema() == field.type.asEnum(), "Value type mismatch.") {
+          return;
+        }
+        if (field.inUnion) {
+          builder.setDataField<uint16_t>(assumeDataOffset(field.discriminantOffset),
+                                         field.discriminantValue);
+        }
+        builder.setDataField<uint16_t>(assumeDataOffset(field.offset), enumValue.getRaw(),
+                                       static_cast<uint16_t>(field.defaultBits));
+        return;
+      }
+      // Text and numeric values need conversion.
+      break;
+
+    case schema::Type::TEXT:
+    case schema::Type::DATA: {
+      if (field.inUnion) {
+        builder.setDataField<uint16_t>(assumeDataOffset(field.discriminantOffset),
+                                       field.discriminantValue);
+      }
+      auto pointer = builder.getPointerField(assumePointerOffset(field.offset));
+      if (field.which == schema::Type::TEXT) {
+        pointer.setBlob<Text>(value.as<Text>());
+      } else {
+        pointer.setBlob<Data>(value.as<Data>());
+      }
+      return;
+    }
+
+    default:
+      break;
+  }
+
+  set(field.field, value);
+}
+
 void DynamicStruct::Builder::set(StructSchema::Field field, const DynamicValue::Reader& value) {
   KJ_REQUIRE(field.getContainingStruct() == schema, "`field` is not a field of this struct.");
   setInUnion(field);
@@ -2002,6 +2400,15 @@ DynamicList::Builder Orphan<DynamicList>::get() {
   }
 }
 
+void Orphan<DynamicList>::truncate(uint size) {
+  if (schema.whichElementType() == schema::Type::STRUCT) {
+    builder.truncate(bounded(size) * ELEMENTS,
+                     structSizeFromSchema(schema.getStructElementType()));
+  } else {
+    builder.truncate(bounded(size) * ELEMENTS, elementSizeFor(schema.whichElementType()));
+  }
+}
+
 DynamicList::Reader Orphan<DynamicList>::getReader() const {
   return DynamicList::Reader(
       schema, builder.asListReader(elementSizeFor(schema.whichElementType())));
@@ -2134,4 +2541,63 @@ Orphan<DynamicValue> Orphanage::newOrphanCopy<DynamicValue::Reader>(
   KJ_UNREACHABLE;
 }
 
+// =======================================================================================
+
+namespace {
+
+bool isValidUtf8(const DynamicList::Reader& list);
+
+bool isValidUtf8(const DynamicValue::Reader& value) {
+  switch (value.getType()) {
+    case DynamicValue::TEXT:
+      return kj::isValidUtf8(value.as<Text>());
+    case DynamicValue::LIST:
+      return isValidUtf8(value.as<DynamicList>());
+    case DynamicValue::STRUCT:
+      return capnp::isValidUtf8(value.as<DynamicStruct>());
+    default:
+      return true;
+  }
+}
+
+bool isValidUtf8(const DynamicList::Reader& list) {
+  switch (list.getSchema().whichElementType()) {
+    case schema::Type::TEXT:
+    case schema::Type::LIST:
+    case schema::Type::STRUCT:
+      for (auto element: list) {
+        if (!isValidUtf8(element)) return false;
+      }
+      return true;
+    default:
+      return true;
+  }
+}
+
+bool isValidUtf8(const DynamicStruct::Reader& value, StructSchema::Field field) {
+  switch (field.getType().which()) {
+    case schema::Type::TEXT:
+    case schema::Type::LIST:
+    case schema::Type::STRUCT:
+      // Null pointers read back as their default values, which could recurse forever (a struct
+      // type may well contain itself). Groups are not pointers and always need looking into.
+      if (!field.getProto().isGroup() && !value.has(field)) return true;
+      return isValidUtf8(value.get(field));
+    default:
+      return true;
+  }
+}
+
+}  // namespace
+
+bool isValidUtf8(DynamicStruct::Reader value) {
+  for (auto field: value.getSchema().getNonUnionFields()) {
+    if (!isValidUtf8(value, field)) return false;
+  }
+  KJ_IF_MAYBE(field, value.which()) {
+    if (!isValidUtf8(value, *field)) return false;
+  }
+  return true;
+}
+
 }  // namespace capnp
@@ -169,6 +169,95 @@ private:
 
 // -------------------------------------------------------------------
 
+class StructAccessPlan {
+  // Everything DynamicStruct needs to know to access the fields of one struct type, decoded from
+  // the schema up front.  Accessing a field by StructSchema::Field means reading the field's
+  // schema node -- its kind, type, brand, offset, default value, and discriminant -- on every
+  // call, which makes generic code (JSON, text format, etc.) several times slower than generated
+  // code.  Accessing it by StructAccessPlan::Field is a single table lookup followed by the same
+  // data access generated code would do.
+  //
+  // Plans are fairly expensive to build, so build them once per type and reuse them.
+  // SchemaLoader::getAccessPlan() caches them for you.
+
+public:
+  explicit StructAccessPlan(StructSchema schema);
+  KJ_DISALLOW_COPY(StructAccessPlan);
+
+  class Field;
+
+  inline StructSchema getSchema() const { return schema; }
+
+  inline kj::ArrayPtr<const Field> getFields() const { return fields; }
+  // All fields, in the same order as StructSchema::getFields().
+
+  inline kj::ArrayPtr<const Field* const> getNonUnionFields() const { return nonUnionFields; }
+  // Fields which are not members of the struct's unnamed union, like
+  // StructSchema::getNonUnionFields().
+
+  inline const Field& operator[](StructSchema::Field field) const;
+  // Get the plan for one of the schema's fields.
+
+  kj::Maybe<const Field&> getFieldByDiscriminant(uint16_t discriminant) const;
+  // Like StructSchema::getFieldByDiscriminant().
+
+private:
+  StructSchema schema;
+  uint32_t discriminantOffset;
+  bool hasUnion;
+  kj::Array<Field> fields;
+  kj::Array<const Field*> nonUnionFields;
+  kj::Array<const Field*> fieldsByDiscriminant;
+
+  friend class DynamicStruct::Reader;
+  friend class DynamicStruct::Builder;
+};
+
+class StructAccessPlan::Field {
+public:
+  Field() = default;
+
+  inline StructSchema::Field getField() const { return field; }
+  inline Type getType() const { return type; }
+  // Same as getField().getType(), without resolving the brand again.
+
+private:
+  StructSchema::Field field;
+  Type type;
+  schema::Type::Which which;
+  bool isGroup;
+  bool inUnion;
+  uint16_t discriminantValue;
+  uint32_t discriminantOffset;
+  uint32_t offset;
+
+  uint64_t defaultBits;
+  // For primitive fields, the default value's bits, which the encoding XORs with the stored value.
+
+  const word* defaultPointer;
+  uint32_t defaultSize;
+  // For pointer fields: the default value. For text and data this is the blob and its size in
+  // bytes, for structs and lists an unchecked message, or null if the default is null.
+
+  _::StructSize structSize;
+  // For struct fields, and list-of-struct fields, the size of the struct.
+
+  ElementSize elementSize;
+  // For list fields.
+
+  friend class StructAccessPlan;
+  friend class DynamicStruct::Reader;
+  friend class DynamicStruct::Builder;
+};
+
+inline const StructAccessPlan::Field& StructAccessPlan::operator[](
+    StructSchema::Field field) const {
+  KJ_IREQUIRE(field.getContainingStruct() == schema, "`field` is not a field of this struct.");
+  return fields[field.getIndex()];
+}
+
+// -------------------------------------------------------------------
+
 class DynamicStruct::Reader {
 public:
   typedef DynamicStruct Reads;
@@ -209,6 +298,12 @@ public:
   bool has(kj::StringPtr name) const;
   // Shortcuts to access fields by name.  These throw exceptions if no such field exists.
 
+  DynamicValue::Reader get(const StructAccessPlan::Field& field) const;
+  bool has(const StructAccessPlan::Field& field) const;
+  kj::Maybe<const StructAccessPlan::Field&> which(const StructAccessPlan& plan) const;
+  // Like the methods above, but using a precompiled plan for this struct's type (see
+  // StructAccessPlan).  Much faster when accessing many fields.
+
 private:
   StructSchema schema;
   _::StructReader reader;
@@ -302,6 +397,14 @@ public:
   void clear(kj::StringPtr name);
   // Shortcuts to access fields by name.  These throw exceptions if no such field exists.
 
+  DynamicValue::Builder get(const StructAccessPlan::Field& field);
+  inline bool has(const StructAccessPlan::Field& field) { return asReader().has(field); }
+  kj::Maybe<const StructAccessPlan::Field&> which(const StructAccessPlan& plan);
+  void set(const StructAccessPlan::Field& field, const DynamicValue::Reader& value);
+  // Like the methods above, but using a precompiled plan for this struct's type (see
+  // StructAccessPlan).  set() is table-driven for primitive, enum and blob fields; other fields
+  // take the same path as set(StructSchema::Field) since copying the value dominates.
+
   Reader asReader() const;
 
 private:
@@ -513,7 +616,8 @@ class DynamicCapability::Server: public Capability::Server {
 public:
   typedef DynamicCapability Serves;
 
-  Server(InterfaceSchema schema): schema(schema) {}
+  Server(InterfaceSchema schema);
+  ~Server() noexcept(false);
 
   virtual kj::Promise<void> call(InterfaceSchema::Method method,
                                  CallContext<DynamicStruct, DynamicStruct> context) = 0;
@@ -525,6 +629,12 @@ public:
 
 private:
   InterfaceSchema schema;
+
+  struct DispatchTable;
+  kj::Own<DispatchTable> dispatchTable;
+  // Every method of `schema` and its transitive superclasses, indexed by interface ID and then
+  // method ID, with param and result types already resolved. Built once by the constructor so
+  // that dispatchCall() does no schema lookups.
 };
 
 template <>
@@ -812,6 +922,13 @@ kj::StringTree KJ_STRINGIFY(const DynamicStruct::Builder& value);
 kj::StringTree KJ_STRINGIFY(const DynamicList::Reader& value);
 kj::StringTree KJ_STRINGIFY(const DynamicList::Builder& value);
 
+bool isValidUtf8(DynamicStruct::Reader value);
+// Returns true if every Text value reachable from `value` -- in fields, groups, the active member
+// of each union, nested structs, and lists -- is well-formed UTF-8 according to kj::isValidUtf8().
+// Cap'n Proto does not check the encoding of Text when reading a message, so an application that
+// must reject malformed text can check a whole message once, right after reading it, instead of at
+// each point where a Text field is used. Data and AnyPointer contents are not examined.
+
 // -------------------------------------------------------------------
 // Orphan <-> Dynamic glue
 
@@ -874,7 +991,9 @@ public:
   // the original Orphan<DynamicStruct> is no longer valid after this call; ownership is
   // transferred to the returned Orphan<T>.
 
-  // TODO(someday): Support truncate().
+  void truncate(uint size);
+  // Resize the list to the given size.  If the list is the last object in its segment, it is
+  // resized in place.  Otherwise, growing copies it, leaving a hole.  See Orphan<T>::truncate().
 
   inline bool operator==(decltype(nullptr)) const { return builder == nullptr; }
   inline bool operator!=(decltype(nullptr)) const { return builder != nullptr; }
@@ -1955,6 +1955,107 @@ TEST(Encoding, ListSize) {
   EXPECT_EQ(structSize.wordCount - shallowSize, listSizes.wordCount);
 }
 
+TEST(Encoding, BulkListAccess) {
+  MallocMessageBuilder builder;
+  auto root = builder.initRoot<TestAllTypes>();
+
+  auto ints = root.initInt32List(1000);
+  for (uint i = 0; i < ints.size(); i++) {
+    ints.set(i, i % 2 == 0 ? int32_t(i) : -int32_t(i));
+  }
+  auto reader = root.asReader().getInt32List();
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && !CAPNP_DISABLE_ENDIAN_DETECTION
+  KJ_IF_MAYBE(array, reader.asArrayPtr()) {
+    EXPECT_EQ(1000u, array->size());
+    EXPECT_EQ(-999, (*array)[999]);
+  } else {
+    ADD_FAILURE() << "Expected the list to be usable in place.";
+  }
+#endif
+
+  int32_t buffer[10];
+  reader.copyTo(buffer, 500);
+  for (uint i = 0; i < 10; i++) {
+    EXPECT_EQ(reader[500 + i], buffer[i]);
+  }
+
+  uint indices[3] = { 999, 0, 7 };
+  int32_t gathered[3];
+  reader.gather(indices, gathered);
+  EXPECT_EQ(-999, gathered[0]);
+  EXPECT_EQ(0, gathered[1]);
+  EXPECT_EQ(-7, gathered[2]);
+
+  EXPECT_EQ(-500, reader.sum());
+  EXPECT_EQ(-999, KJ_ASSERT_NONNULL(reader.min()));
+  EXPECT_EQ(998, KJ_ASSERT_NONNULL(reader.max()));
+
+  EXPECT_ANY_THROW(reader.copyTo(buffer, 995));
+  indices[1] = 1000;
+  EXPECT_ANY_THROW(reader.gather(indices, gathered));
+
+  EXPECT_TRUE(root.asReader().getUInt8List().min() == nullptr);
+  EXPECT_EQ(0u, root.asReader().getUInt8List().sum());
+
+  // Sums wrap.
+  root.setUInt8List({200, 100});
+  EXPECT_EQ(44u, root.asReader().getUInt8List().sum());
+}
+
+TEST(Encoding, BulkBoolList) {
+  MallocMessageBuilder builder;
+  auto root = builder.initRoot<TestAllTypes>();
+
+  auto bools = root.initBoolList(101);
+  for (uint i = 0; i < bools.size(); i++) {
+    bools.set(i, i % 3 == 0 || i % 7 == 0);
+  }
+  auto reader = root.asReader().getBoolList();
+
+  EXPECT_TRUE(reader.asArrayPtr() == nullptr);
+
+  // Start at an odd bit so that the head, SIMD body, and tail are all exercised.
+  bool buffer[90];
+  reader.copyTo(buffer, 5);
+  for (uint i = 0; i < kj::size(buffer); i++) {
+    EXPECT_EQ(reader[5 + i], buffer[i]);
+    EXPECT_LE(static_cast<byte>(buffer[i]), 1u);
+  }
+
+  uint indices[2] = { 100, 1 };
+  bool gathered[2];
+  reader.gather(indices, gathered);
+  EXPECT_FALSE(gathered[0]);
+  EXPECT_FALSE(gathered[1]);
+}
+
+TEST(Encoding, BulkListFromStructList) {
+  // A struct list read as a primitive list has a stride larger than the element, so bulk access
+  // must fall back to per-element loads.
+
+  MallocMessageBuilder builder;
+  auto root = builder.initRoot<test::TestAnyPointer>();
+
+  auto structs = root.getAnyPointerField().initAs<List<test::TestLists::Struct32c>>(300);
+  for (uint i = 0; i < structs.size(); i++) {
+    structs[i].setF(i * 3);
+  }
+
+  auto reader = root.asReader().getAnyPointerField().getAs<List<uint32_t>>();
+  EXPECT_TRUE(reader.asArrayPtr() == nullptr);
+
+  uint32_t buffer[20];
+  reader.copyTo(buffer, 280);
+  for (uint i = 0; i < 20; i++) {
+    EXPECT_EQ((280 + i) * 3, buffer[i]);
+  }
+
+  EXPECT_EQ(3u * 299 * 300 / 2, reader.sum());
+  EXPECT_EQ(0u, KJ_ASSERT_NONNULL(reader.min()));
+  EXPECT_EQ(897u, KJ_ASSERT_NONNULL(reader.max()));
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
@@ -24,6 +24,7 @@
 #include "ez-rpc.h"
 #include "test-util.h"
 #include <kj/compat/gtest.h>
+#include <kj/mutex.h>
 
 namespace capnp {
 namespace _ {
@@ -46,6 +47,57 @@ TEST(EzRpc, Basic) {
   EXPECT_EQ(1, callCount);
 }
 
+TEST(EzRpc, Compression) {
+  int callCount = 0;
+  EzRpcServer server(kj::heap<TestInterfaceImpl>(callCount), "localhost");
+  server.setCompression(MessageCompression::PACKED, 0);
+
+  EzRpcClient client("localhost", server.getPort().wait(server.getWaitScope()));
+  client.setCompression(MessageCompression::PACKED, 0);
+
+  auto cap = client.getMain<test::TestInterface>();
+  auto request = cap.fooRequest();
+  request.setI(123);
+  request.setJ(true);
+  EXPECT_EQ("foo", request.send().wait(server.getWaitScope()).getX());
+  EXPECT_EQ(1, callCount);
+}
+
+TEST(EzRpc, MultiThreaded) {
+  kj::MutexGuarded<kj::Vector<kj::Own<int>>> callCounts;
+  int total = 0;
+
+  {
+    EzRpcServer server([&]() -> Capability::Client {
+      // One counter per thread, since each thread gets its own TestInterfaceImpl.
+      auto lock = callCounts.lockExclusive();
+      lock->add(kj::heap<int>(0));
+      return kj::heap<TestInterfaceImpl>(*lock->back());
+    }, "localhost", 0, 4);
+
+    uint port = server.getPort().wait(server.getWaitScope());
+    kj::Vector<kj::Own<EzRpcClient>> clients;
+    kj::Vector<kj::Promise<void>> calls;
+    for (uint i = 0; i < 20; i++) {
+      auto client = kj::heap<EzRpcClient>("localhost", port);
+      auto request = client->getMain<test::TestInterface>().fooRequest();
+      request.setI(123);
+      request.setJ(true);
+      calls.add(request.send().then([](Response<test::TestInterface::FooResults>&& response) {
+        EXPECT_EQ("foo", response.getX());
+      }));
+      clients.add(kj::mv(client));
+    }
+    kj::joinPromises(calls.releaseAsArray()).wait(server.getWaitScope());
+  }
+
+  // The server has joined its threads, so the counters are safe to read.
+  auto lock = callCounts.lockExclusive();
+  EXPECT_EQ(4u, lock->size());
+  for (auto& count: *lock) total += *count;
+  EXPECT_EQ(20, total);
+}
+
 TEST(EzRpc, DeprecatedNames) {
   EzRpcServer server("localhost");
   int callCount = 0;
@@ -25,6 +25,8 @@
 #include <kj/async-io.h>
 #include <kj/debug.h>
 #include <kj/threadlocal.h>
+#include <kj/thread.h>
+#include <kj/mutex.h>
 #include <map>
 
 namespace capnp {
@@ -121,6 +123,10 @@ struct EzRpcClient::Impl {
   kj::Maybe<kj::Own<ClientContext>> clientContext;
   // Filled in before `setupPromise` resolves.
 
+  MessageCompression compression = MessageCompression::NONE;
+  size_t compressionThreshold = 0;
+  // Applied to the network once `clientContext` is filled in.
+
   Impl(kj::StringPtr serverAddress, uint defaultPort,
        ReaderOptions readerOpts)
       : context(EzRpcContext::getThreadLocal()),
@@ -131,6 +137,8 @@ struct EzRpcClient::Impl {
             }).then([this, readerOpts](kj::Own<kj::AsyncIoStream>&& stream) {
               clientContext = kj::heap<ClientContext>(kj::mv(stream),
                                                       readerOpts);
+              KJ_ASSERT_NONNULL(clientContext)->network.setOutgoingCompression(
+                  compression, compressionThreshold);
             }).fork()) {}
 
   Impl(const struct sockaddr* serverAddress, uint addrSize,
@@ -142,6 +150,8 @@ struct EzRpcClient::Impl {
             .then([this, readerOpts](kj::Own<kj::AsyncIoStream>&& stream) {
               clientContext = kj::heap<ClientContext>(kj::mv(stream),
                                                       readerOpts);
+              KJ_ASSERT_NONNULL(clientContext)->network.setOutgoingCompression(
+                  compression, compressionThreshold);
             }).fork()) {}
 
   Impl(int socketFd, ReaderOptions readerOpts)
@@ -184,6 +194,14 @@ Capability::Client EzRpcClient::importCap(kj::StringPtr name) {
   }
 }
 
+void EzRpcClient::setCompression(MessageCompression compression, size_t threshold) {
+  impl->compression = compression;
+  impl->compressionThreshold = threshold;
+  KJ_IF_MAYBE(client, impl->clientContext) {
+    client->get()->network.setOutgoingCompression(compression, threshold);
+  }
+}
+
 kj::WaitScope& EzRpcClient::getWaitScope() {
   return impl->context->getWaitScope();
 }
@@ -237,6 +255,28 @@ struct EzRpcServer::Impl final: public SturdyRefRestorer<AnyPointer>,
 
   kj::TaskSet tasks;
 
+  struct Compression {
+    MessageCompression compression = MessageCompression::NONE;
+    size_t threshold = 0;
+  };
+  kj::MutexGuarded<Compression> compression;
+  // Read as each connection is accepted, which may happen on a worker thread.
+
+  kj::Function<Capability::Client()> mainInterfaceFactory;
+  uint workerCount = 0;
+  // Set by the multi-threaded constructor.  Each worker thread calls the factory once.
+
+  struct Worker {
+    struct State {
+      bool started = false;
+      kj::Maybe<kj::Own<kj::CrossThreadPromiseFulfiller<void>>> stopper;
+      // Fulfilling this makes the worker's event loop return.
+    };
+    kj::MutexGuarded<State> state;
+    kj::Maybe<kj::Own<kj::Thread>> thread;
+  };
+  kj::Vector<kj::Own<Worker>> workers;
+
   struct ServerContext {
     kj::Own<kj::AsyncIoStream> stream;
     TwoPartyVatNetwork network;
@@ -250,6 +290,12 @@ struct EzRpcServer::Impl final: public SturdyRefRestorer<AnyPointer>,
           network(*this->stream, rpc::twoparty::Side::SERVER, readerOpts),
           rpcSystem(makeRpcServer(network, restorer)) {}
 #pragma GCC diagnostic pop
+
+    ServerContext(kj::Own<kj::AsyncIoStream>&& stream, Capability::Client bootstrap,
+                  ReaderOptions readerOpts)
+        : stream(kj::mv(stream)),
+          network(*this->stream, rpc::twoparty::Side::SERVER, readerOpts),
+          rpcSystem(makeRpcServer(network, kj::mv(bootstrap))) {}
   };
 
   Impl(Capability::Client mainInterface, kj::StringPtr bindAddress, uint defaultPort,
@@ -265,10 +311,31 @@ struct EzRpcServer::Impl final: public SturdyRefRestorer<AnyPointer>,
                              kj::Own<kj::NetworkAddress>&& addr) {
       auto listener = addr->listen();
       portFulfiller->fulfill(listener->getPort());
+      startWorkers(*listener, readerOpts);
       acceptLoop(kj::mv(listener), readerOpts);
     })));
   }
 
+  Impl(kj::Function<Capability::Client()> mainInterfaceFactory, kj::StringPtr bindAddress,
+       uint defaultPort, uint threadCount, ReaderOptions readerOpts)
+      : Impl(mainInterfaceFactory(), bindAddress, defaultPort, readerOpts) {
+    // The listener is created asynchronously, so these are in place before startWorkers() runs.
+    KJ_REQUIRE(threadCount > 0, "EzRpcServer needs at least one thread");
+    this->mainInterfaceFactory = kj::mv(mainInterfaceFactory);
+    workerCount = threadCount - 1;
+  }
+
+  ~Impl() noexcept(false) {
+    // The workers accept from our listener, so stop them before it's destroyed.  Destroying each
+    // kj::Thread joins it, rethrowing anything the worker threw.
+    for (auto& worker: workers) {
+      KJ_IF_MAYBE(stopper, worker->state.lockExclusive()->stopper) {
+        (*stopper)->fulfill();
+      }
+    }
+    workers.clear();
+  }
+
   Impl(Capability::Client mainInterface, struct sockaddr* bindAddress, uint addrSize,
        ReaderOptions readerOpts)
       : mainInterface(kj::mv(mainInterface)),
@@ -296,6 +363,7 @@ struct EzRpcServer::Impl final: public SturdyRefRestorer<AnyPointer>,
       acceptLoop(kj::mv(listener), readerOpts);
 
       auto server = kj::heap<ServerContext>(kj::mv(connection), *this, readerOpts);
+      applyCompression(server->network);
 
       // Arrange to destroy the server context when all references are gone, or when the
       // EzRpcServer is destroyed (which will destroy the TaskSet).
@@ -303,6 +371,68 @@ struct EzRpcServer::Impl final: public SturdyRefRestorer<AnyPointer>,
     })));
   }
 
+  void applyCompression(TwoPartyVatNetwork& network) {
+    auto lock = compression.lockShared();
+    network.setOutgoingCompression(lock->compression, lock->threshold);
+  }
+
+  void startWorkers(kj::ConnectionReceiver& listener, ReaderOptions readerOpts) {
+    if (workerCount == 0) return;
+
+    int fd = KJ_REQUIRE_NONNULL(listener.getFd(),
+        "multi-threaded EzRpcServer needs a listener backed by a file descriptor");
+
+    for (uint i = 0; i < workerCount; i++) {
+      auto worker = kj::heap<Worker>();
+      auto& ref = *worker;
+      ref.thread = kj::heap<kj::Thread>([this, &ref, fd, readerOpts]() {
+        runWorker(ref, fd, readerOpts);
+      });
+      workers.add(kj::mv(worker));
+
+      // Wait until the worker can be stopped, so that the destructor never has to guess.
+      ref.state.when([](const Worker::State& state) { return state.started; },
+                     [](Worker::State&) {});
+    }
+  }
+
+  void runWorker(Worker& worker, int fd, ReaderOptions readerOpts) {
+    // Runs on the worker thread: a separate event loop accepting from the same listening socket,
+    // so the kernel spreads connections across the threads.  Each connection then stays on the
+    // thread that accepted it.
+    KJ_DEFER(worker.state.lockExclusive()->started = true);
+
+    auto context = EzRpcContext::getThreadLocal();
+    Capability::Client mainInterface = mainInterfaceFactory();
+    kj::TaskSet workerTasks(*this);
+
+    auto stop = kj::newCrossThreadPromiseAndFulfiller<void>();
+    {
+      auto lock = worker.state.lockExclusive();
+      lock->stopper = kj::mv(stop.fulfiller);
+      lock->started = true;
+    }
+
+    workerAcceptLoop(workerTasks, mainInterface,
+        context->getLowLevelIoProvider().wrapListenSocketFd(fd, DUMMY_FILTER), readerOpts);
+    stop.promise.wait(context->getWaitScope());
+  }
+
+  void workerAcceptLoop(kj::TaskSet& workerTasks, Capability::Client mainInterface,
+                        kj::Own<kj::ConnectionReceiver>&& listener, ReaderOptions readerOpts) {
+    auto ptr = listener.get();
+    workerTasks.add(ptr->accept().then(kj::mvCapture(kj::mv(listener),
+        [this, &workerTasks, mainInterface, readerOpts](
+            kj::Own<kj::ConnectionReceiver>&& listener,
+            kj::Own<kj::AsyncIoStream>&& connection) mutable {
+      workerAcceptLoop(workerTasks, mainInterface, kj::mv(listener), readerOpts);
+
+      auto server = kj::heap<ServerContext>(kj::mv(connection), kj::mv(mainInterface), readerOpts);
+      applyCompression(server->network);
+      workerTasks.add(server->network.onDisconnect().attach(kj::mv(server)));
+    })));
+  }
+
   Capability::Client restore(AnyPointer::Reader objectId) override {
     if (objectId.isNull()) {
       return mainInterface;
@@ -335,6 +465,12 @@ EzRpcServer::EzRpcServer(Capability::Client mainInterface, int socketFd, uint po
                          ReaderOptions readerOpts)
     : impl(kj::heap<Impl>(kj::mv(mainInterface), socketFd, port, readerOpts)) {}
 
+EzRpcServer::EzRpcServer(kj::Function<Capability::Client()> mainInterfaceFactory,
+                         kj::StringPtr bindAddress, uint defaultPort, uint threadCount,
+                         ReaderOptions readerOpts)
+    : impl(kj::heap<Impl>(kj::mv(mainInterfaceFactory), bindAddress, defaultPort, threadCount,
+                          readerOpts)) {}
+
 EzRpcServer::EzRpcServer(kj::StringPtr bindAddress, uint defaultPort,
                          ReaderOptions readerOpts)
     : EzRpcServer(nullptr, bindAddress, defaultPort, readerOpts) {}
@@ -357,6 +493,12 @@ kj::Promise<uint> EzRpcServer::getPort() {
   return impl->portPromise.addBranch();
 }
 
+void EzRpcServer::setCompression(MessageCompression compression, size_t threshold) {
+  auto lock = impl->compression.lockExclusive();
+  lock->compression = compression;
+  lock->threshold = threshold;
+}
+
 kj::WaitScope& EzRpcServer::getWaitScope() {
   return impl->context->getWaitScope();
 }
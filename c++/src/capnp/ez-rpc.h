@@ -27,6 +27,7 @@
 
 #include "rpc.h"
 #include "message.h"
+#include "serialize-async.h"
 
 struct sockaddr;
 
@@ -141,6 +142,10 @@ public:
   // Named interfaces are deprecated. The new preferred usage pattern is for the server to export
   // a "main" interface which itself has methods for getting any other interfaces.
 
+  void setCompression(MessageCompression compression, size_t threshold = 1024);
+  // Compress messages of at least `threshold` bytes sent to the server.  See
+  // `TwoPartyVatNetwork::setOutgoingCompression()`.
+
   kj::WaitScope& getWaitScope();
   // Get the `WaitScope` for the client's `EventLoop`, which allows you to synchronously wait on
   // promises.
@@ -195,6 +200,20 @@ public:
   // called).  `port` is returned by `getPort()` -- it serves no other purpose.
   // `readerOpts` acts as in the other two above constructors.
 
+  EzRpcServer(kj::Function<Capability::Client()> mainInterfaceFactory, kj::StringPtr bindAddress,
+              uint defaultPort, uint threadCount, ReaderOptions readerOpts = ReaderOptions());
+  // Like the first constructor, but serves connections on `threadCount` threads: the calling
+  // thread plus `threadCount - 1` worker threads, each running its own `EventLoop` and accepting
+  // from the same listening socket.  A connection is handled entirely by the thread that accepted
+  // it, so this scales well for services that keep no state shared between connections.
+  //
+  // Capabilities can't be shared between threads, so `mainInterfaceFactory` is called once on
+  // each thread (including this one, before the constructor returns) to create that thread's main
+  // interface.  It is called concurrently from the worker threads and must be thread-safe.
+  // Capabilities registered with `exportCap()` are only served by the calling thread; connections
+  // accepted by a worker thread can only use the main interface.  The worker threads are stopped
+  // and joined when the `EzRpcServer` is destroyed.
+
   explicit EzRpcServer(kj::StringPtr bindAddress, uint defaultPort = 0,
                        ReaderOptions readerOpts = ReaderOptions())
       CAPNP_DEPRECATED("Please specify a main interface for your server.");
@@ -218,6 +237,10 @@ public:
   // the server is actually listening.  If the address was not an IP address (e.g. it was a Unix
   // domain socket) then getPort() resolves to zero.
 
+  void setCompression(MessageCompression compression, size_t threshold = 1024);
+  // Compress messages of at least `threshold` bytes sent to clients.  Applies to connections
+  // accepted after the call.  See `TwoPartyVatNetwork::setOutgoingCompression()`.
+
   kj::WaitScope& getWaitScope();
   // Get the `WaitScope` for the client's `EventLoop`, which allows you to synchronously wait on
   // promises.
@@ -23,6 +23,11 @@
 #include "layout.h"
 #include <kj/debug.h>
 #include "arena.h"
+#include <kj/io.h>
+#include <kj/map.h>
+#include <kj/mutex.h>
+#include <kj/thread.h>
+#include <kj/vector.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -30,6 +35,12 @@
 #include "capability.h"
 #endif  // !CAPNP_LITE
 
+#if __SSE2__
+#include <emmintrin.h>
+#elif __ARM_NEON
+#include <arm_neon.h>
+#endif
+
 namespace capnp {
 namespace _ {  // private
 
@@ -324,6 +335,48 @@ struct SegmentAnd {
   T value;
 };
 
+struct LinkTarget {
+  // An object that OrphanBuilder::reference() may link to rather than copy, found by following a
+  // pointer in the source message (and any far pointers).
+
+  SegmentReader* segment;
+  uint64_t tag;      // WirePointer describing the object.  Its offset is unused.
+  const word* ptr;   // Start of the object, including the tag of an INLINE_COMPOSITE list.
+  const word* end;   // End of the object.
+
+  inline const WirePointer* tagAsPtr() const {
+    return reinterpret_cast<const WirePointer*>(&tag);
+  }
+};
+
+struct LinkDecision {
+  // What OrphanBuilder::reference() does with a pointer whose parent could not be linked.  Such
+  // pointers with no recorded decision are linked.
+
+  bool split;
+  // If true, the target is copied shallowly and its own pointers considered in turn.  Otherwise it
+  // is deep-copied by copyPointer().
+
+  LinkTarget target;  // Only valid if `split`.
+};
+
+struct LinkExtent {
+  // The range of a source segment occupied by objects that can be linked.
+
+  const word* begin;
+  const word* end;
+};
+
+struct LinkState {
+  BuilderArena* arena;
+  CapTableBuilder* capTable;
+  CapTableReader* srcCapTable;
+
+  kj::HashMap<const WirePointer*, LinkDecision> decisions;
+  kj::HashMap<SegmentReader*, LinkExtent> extents;
+  kj::HashMap<SegmentReader*, SegmentBuilder*> externalSegments;
+};
+
 }  // namespace
 
 struct WireHelpers {
@@ -386,6 +439,22 @@ struct WireHelpers {
     memset(ptr, 0, sizeof(*ptr));
   }
 
+  static KJ_ALWAYS_INLINE(void freeMemory(
+      SegmentBuilder* segment, word* ptr, WordCountN<29> count)) {
+    // Zero an object that has become unreachable and, if the arena recycles freed space, let it
+    // know the space is available.
+    zeroMemory(ptr, count);
+    BuilderArena* arena = segment->getArena();
+    if (KJ_UNLIKELY(arena->isReusingFreedSpace())) {
+      arena->addFreeSpace(segment, ptr, unbound(count / WORDS));
+    }
+  }
+
+  static KJ_ALWAYS_INLINE(void freeMemory(
+      SegmentBuilder* segment, WirePointer* ptr, WirePointerCountN<29> count)) {
+    freeMemory(segment, reinterpret_cast<word*>(ptr), count * WORDS_PER_POINTER);
+  }
+
   template <typename T>
   static inline void zeroMemory(kj::ArrayPtr<T> array) {
     if (array.size() != 0u) memset(array.begin(), 0, array.size() * sizeof(array[0]));
@@ -457,7 +526,8 @@ struct WireHelpers {
     //   target offset will be set to zero.
 
     if (orphanArena == nullptr) {
-      if (!ref->isNull()) zeroObject(segment, capTable, ref);
+      bool replacing = !ref->isNull();
+      if (replacing) zeroObject(segment, capTable, ref);
 
       if (amount == ZERO * WORDS && kind == WirePointer::STRUCT) {
         // Note that the check for kind == WirePointer::STRUCT will hopefully cause this whole
@@ -466,6 +536,16 @@ struct WireHelpers {
         return reinterpret_cast<word*>(ref);
       }
 
+      if (replacing && KJ_UNLIKELY(segment->getArena()->isReusingFreedSpace())) {
+        // Overwriting an object often replaces it with one of the same size, e.g. when setting a
+        // struct or same-length text field again, so try to take back space freed earlier.
+        word* ptr = segment->getArena()->tryReuseFreeSpace(segment, unbound(amount / WORDS));
+        if (ptr != nullptr) {
+          ref->setKindAndTarget(kind, ptr, segment);
+          return ptr;
+        }
+      }
+
       word* ptr = segment->allocate(amount);
 
       if (ptr == nullptr) {
@@ -542,6 +622,28 @@ struct WireHelpers {
     return result;
   }
 
+  static KJ_ALWAYS_INLINE(word* followFarsForWrite(
+      WirePointer*& ref, word* refTarget, SegmentBuilder*& segment,
+      CapTableBuilder* capTable, BuilderArena* orphanArena)) {
+    // Like followFars(), but if the target is in a copy-on-write segment, first moves it into
+    // writable space using relocateCopyOnWrite() rather than throwing.  `ref` and `segment` must
+    // initially be the pointer being followed and the segment containing it, so that the pointer
+    // can be updated.
+
+    WirePointer* tag = ref;
+    SegmentBuilder* tagSegment = segment;
+    word* ptr = followFarsNoWritableCheck(tag, refTarget, tagSegment);
+
+    if (KJ_UNLIKELY(tagSegment->isCopyOnWrite())) {
+      return relocateCopyOnWrite(ref, segment, capTable, tag, ptr, tagSegment, orphanArena);
+    }
+
+    tagSegment->checkWritable();
+    ref = tag;
+    segment = tagSegment;
+    return ptr;
+  }
+
   static KJ_ALWAYS_INLINE(kj::Maybe<const word&> followFars(
       const WirePointer*& ref, const word* refTarget, SegmentReader*& segment))
       KJ_WARN_UNUSED_RESULT {
@@ -613,14 +715,15 @@ struct WireHelpers {
           WirePointer* pad = reinterpret_cast<WirePointer*>(ref->farTarget(segment));
 
           if (ref->isDoubleFar()) {
+            SegmentBuilder* padSegment = segment;
             segment = segment->getArena()->getSegment(pad->farRef.segmentId.get());
             if (segment->isWritable()) {
               zeroObject(segment, capTable, pad + 1, pad->farTarget(segment));
             }
-            zeroMemory(pad, G(2) * POINTERS);
+            freeMemory(padSegment, pad, G(2) * POINTERS);
           } else {
             zeroObject(segment, capTable, pad);
-            zeroMemory(pad);
+            freeMemory(segment, pad, ONE * POINTERS);
           }
         }
         break;
@@ -651,7 +754,7 @@ struct WireHelpers {
         for (auto i: kj::zeroTo(tag->structRef.ptrCount.get())) {
           zeroObject(segment, capTable, pointerSection + i);
         }
-        zeroMemory(ptr, tag->structRef.wordSize());
+        freeMemory(segment, ptr, tag->structRef.wordSize());
         break;
       }
       case WirePointer::LIST: {
@@ -664,7 +767,7 @@ struct WireHelpers {
           case ElementSize::TWO_BYTES:
           case ElementSize::FOUR_BYTES:
           case ElementSize::EIGHT_BYTES: {
-            zeroMemory(ptr, roundBitsUpToWords(
+            freeMemory(segment, ptr, roundBitsUpToWords(
                 upgradeBound<uint64_t>(tag->listRef.elementCount()) *
                 dataBitsPerElement(tag->listRef.elementSize())));
             break;
@@ -675,7 +778,7 @@ struct WireHelpers {
             for (auto i: kj::zeroTo(count)) {
               zeroObject(segment, capTable, typedPtr + i);
             }
-            zeroMemory(typedPtr, count);
+            freeMemory(segment, typedPtr, count);
             break;
           }
           case ElementSize::INLINE_COMPOSITE: {
@@ -700,7 +803,7 @@ struct WireHelpers {
             }
 
             auto wordsPerElement = elementTag->structRef.wordSize() / ELEMENTS;
-            zeroMemory(ptr, assertMaxBits<SEGMENT_WORD_COUNT_BITS>(POINTER_SIZE_IN_WORDS +
+            freeMemory(segment, ptr, assertMaxBits<SEGMENT_WORD_COUNT_BITS>(POINTER_SIZE_IN_WORDS +
                 upgradeBound<uint64_t>(count) * wordsPerElement, []() {
                   KJ_FAIL_ASSERT("encountered list pointer in builder which is too large to "
                       "possibly fit in a segment. Bug in builder code?");
@@ -743,6 +846,104 @@ struct WireHelpers {
     zeroMemory(ref);
   }
 
+  static word* relocateCopyOnWrite(
+      WirePointer*& ref, SegmentBuilder*& segment, CapTableBuilder* capTable,
+      const WirePointer* srcTag, word* src, SegmentBuilder* srcSegment,
+      BuilderArena* orphanArena) {
+    // Copy the object at `src`, which lives in the copy-on-write segment `srcSegment`, into
+    // writable space, and point `ref` at the copy.  Only the object itself is copied:  its
+    // pointers are transferred, so its children stay where they are until they are modified, too.
+    // `ref`, `segment`, and `orphanArena` are as for allocate(), except that `ref` may be non-null
+    // (its far pointer landing pads, if any, are zeroed, but the old object is left alone).  Not
+    // always-inline because this is rarely used.
+
+    word tagCopy;
+    WirePointer& tag = *reinterpret_cast<WirePointer*>(&tagCopy);
+    copyMemory(&tag, srcTag);  // `srcTag` might be a landing pad that we're about to zero.
+
+    zeroPointerAndFars(segment, ref);
+
+    switch (tag.kind()) {
+      case WirePointer::STRUCT: {
+        auto dataSize = tag.structRef.dataSize.get();
+        auto pointerCount = tag.structRef.ptrCount.get();
+
+        word* ptr = allocate(ref, segment, capTable, tag.structRef.wordSize(),
+                             WirePointer::STRUCT, orphanArena);
+        copyMemory(&ref->upper32Bits, &tag.upper32Bits);
+
+        copyMemory(ptr, src, dataSize);
+        WirePointer* dstPointers = reinterpret_cast<WirePointer*>(ptr + dataSize);
+        WirePointer* srcPointers = reinterpret_cast<WirePointer*>(src + dataSize);
+        for (auto i: kj::zeroTo(pointerCount)) {
+          transferPointer(segment, dstPointers + i, srcSegment, srcPointers + i);
+        }
+        return ptr;
+      }
+
+      case WirePointer::LIST: {
+        ElementSize elementSize = tag.listRef.elementSize();
+
+        if (elementSize == ElementSize::INLINE_COMPOSITE) {
+          auto wordCount = tag.listRef.inlineCompositeWordCount();
+          auto totalSize = assertMaxBits<SEGMENT_WORD_COUNT_BITS>(
+              wordCount + POINTER_SIZE_IN_WORDS, []() {
+                KJ_FAIL_ASSERT("list in copy-on-write segment is larger than a segment");
+              });
+          word* ptr = allocate(ref, segment, capTable, totalSize, WirePointer::LIST, orphanArena);
+          copyMemory(&ref->upper32Bits, &tag.upper32Bits);
+
+          const WirePointer* elementTag = reinterpret_cast<const WirePointer*>(src);
+          copyMemory(reinterpret_cast<WirePointer*>(ptr), elementTag);
+
+          auto dataSize = elementTag->structRef.dataSize.get();
+          auto pointerCount = elementTag->structRef.ptrCount.get();
+          word* dstElement = ptr + POINTER_SIZE_IN_WORDS;
+          word* srcElement = src + POINTER_SIZE_IN_WORDS;
+          for (auto i KJ_UNUSED: kj::zeroTo(elementTag->inlineCompositeListElementCount())) {
+            copyMemory(dstElement, srcElement, dataSize);
+            dstElement += dataSize;
+            srcElement += dataSize;
+
+            for (auto j KJ_UNUSED: kj::zeroTo(pointerCount)) {
+              transferPointer(segment, reinterpret_cast<WirePointer*>(dstElement),
+                              srcSegment, reinterpret_cast<WirePointer*>(srcElement));
+              dstElement += POINTER_SIZE_IN_WORDS;
+              srcElement += POINTER_SIZE_IN_WORDS;
+            }
+          }
+          return ptr;
+        } else if (elementSize == ElementSize::POINTER) {
+          auto count = tag.listRef.elementCount() * (ONE * POINTERS / ELEMENTS);
+          word* ptr = allocate(ref, segment, capTable, count * WORDS_PER_POINTER,
+                               WirePointer::LIST, orphanArena);
+          copyMemory(&ref->upper32Bits, &tag.upper32Bits);
+
+          WirePointer* dstPointers = reinterpret_cast<WirePointer*>(ptr);
+          WirePointer* srcPointers = reinterpret_cast<WirePointer*>(src);
+          for (auto i: kj::zeroTo(count)) {
+            transferPointer(segment, dstPointers + i, srcSegment, srcPointers + i);
+          }
+          return ptr;
+        } else {
+          auto wordCount = roundBitsUpToWords(
+              upgradeBound<uint64_t>(tag.listRef.elementCount()) *
+              dataBitsPerElement(elementSize));
+          word* ptr = allocate(ref, segment, capTable, wordCount, WirePointer::LIST, orphanArena);
+          copyMemory(&ref->upper32Bits, &tag.upper32Bits);
+
+          copyMemory(ptr, src, wordCount);
+          return ptr;
+        }
+      }
+
+      case WirePointer::FAR:
+      case WirePointer::OTHER:
+        break;
+    }
+
+    KJ_FAIL_ASSERT("copy-on-write segment contains a non-object pointer target");
+  }
 
   // -----------------------------------------------------------------
 
@@ -1109,7 +1310,7 @@ struct WireHelpers {
 
     WirePointer* oldRef = ref;
     SegmentBuilder* oldSegment = segment;
-    word* oldPtr = followFars(oldRef, refTarget, oldSegment);
+    word* oldPtr = followFarsForWrite(oldRef, refTarget, oldSegment, capTable, orphanArena);
 
     KJ_REQUIRE(oldRef->kind() == WirePointer::STRUCT,
         "Message contains non-struct pointer where struct pointer was expected.") {
@@ -1251,7 +1452,7 @@ struct WireHelpers {
 
     WirePointer* ref = origRef;
     SegmentBuilder* segment = origSegment;
-    word* ptr = followFars(ref, origRefTarget, segment);
+    word* ptr = followFarsForWrite(ref, origRefTarget, segment, capTable, orphanArena);
 
     KJ_REQUIRE(ref->kind() == WirePointer::LIST,
         "Called getWritableListPointer() but existing pointer is not a list.") {
@@ -1371,7 +1572,7 @@ struct WireHelpers {
 
     WirePointer* ref = origRef;
     SegmentBuilder* segment = origSegment;
-    word* ptr = followFars(ref, origRefTarget, segment);
+    word* ptr = followFarsForWrite(ref, origRefTarget, segment, capTable, orphanArena);
 
     KJ_REQUIRE(ref->kind() == WirePointer::LIST,
         "Called getWritableListPointerAnySize() but existing pointer is not a list.") {
@@ -1427,7 +1628,7 @@ struct WireHelpers {
 
     WirePointer* oldRef = origRef;
     SegmentBuilder* oldSegment = origSegment;
-    word* oldPtr = followFars(oldRef, origRefTarget, oldSegment);
+    word* oldPtr = followFarsForWrite(oldRef, origRefTarget, oldSegment, capTable, orphanArena);
 
     KJ_REQUIRE(oldRef->kind() == WirePointer::LIST,
                "Called getList{Field,Element}() but existing pointer is not a list.") {
@@ -1639,7 +1840,7 @@ struct WireHelpers {
         return builder;
       }
     } else {
-      word* ptr = followFars(ref, refTarget, segment);
+      word* ptr = followFarsForWrite(ref, refTarget, segment, capTable, nullptr);
       byte* bptr = reinterpret_cast<byte*>(ptr);
 
       KJ_REQUIRE(ref->kind() == WirePointer::LIST,
@@ -1711,7 +1912,7 @@ struct WireHelpers {
         return builder;
       }
     } else {
-      word* ptr = followFars(ref, refTarget, segment);
+      word* ptr = followFarsForWrite(ref, refTarget, segment, capTable, nullptr);
 
       KJ_REQUIRE(ref->kind() == WirePointer::LIST,
           "Called getData{Field,Element}() but existing pointer is not a list.") {
@@ -2066,6 +2267,322 @@ struct WireHelpers {
     KJ_UNREACHABLE;
   }
 
+  // -----------------------------------------------------------------
+  // Linking (see OrphanBuilder::reference())
+  //
+  // Rather than copying an object, the builder can point straight at it, by adding the source
+  // segment containing it to the arena as a copy-on-write external segment.  This works as long
+  // as the object's whole subtree can be used in place:  every pointer in it must be a valid near
+  // pointer, since that means the same thing in the new message regardless of where the segment
+  // ends up, and there must be no capabilities, since their indexes refer to the source's table.
+  // An object that doesn't qualify is "split":  the object itself is copied, and each of its
+  // pointers considered in turn.  Pointers that can be neither linked nor split -- capabilities and
+  // invalid pointers -- are left to copyPointer(), which copies or rejects them as usual.
+  //
+  // The first pass decides what to do with each pointer and finds the range of each source
+  // segment occupied by linkable objects; only that range is added to the arena.  The second pass
+  // builds the result.
+
+  static bool resolveLinkTarget(const WirePointer* ref, SegmentReader* segment, int nestingLimit,
+                                LinkTarget& target) {
+    // Find the object that `ref` points to and check it the way copyPointer() would.  Returns
+    // false if the pointer must be left to copyPointer().
+
+    const word* ptr;
+    KJ_IF_MAYBE(p, followFars(ref, ref->target(segment), segment)) {
+      ptr = p;
+    } else {
+      return false;
+    }
+
+    if (nestingLimit <= 0) return false;
+
+    const word* end;
+    switch (ref->kind()) {
+      case WirePointer::STRUCT:
+        if (!boundsCheck(segment, ptr, ref->structRef.wordSize())) return false;
+        end = ptr + ref->structRef.wordSize();
+        break;
+
+      case WirePointer::LIST: {
+        ElementSize elementSize = ref->listRef.elementSize();
+
+        if (elementSize == ElementSize::INLINE_COMPOSITE) {
+          auto wordCount = ref->listRef.inlineCompositeWordCount();
+          const WirePointer* tag = reinterpret_cast<const WirePointer*>(ptr);
+
+          if (!boundsCheck(segment, ptr, wordCount + POINTER_SIZE_IN_WORDS) ||
+              tag->kind() != WirePointer::STRUCT) {
+            return false;
+          }
+
+          auto elementCount = tag->inlineCompositeListElementCount();
+          auto wordsPerElement = tag->structRef.wordSize() / ELEMENTS;
+          if (wordsPerElement * upgradeBound<uint64_t>(elementCount) > wordCount) return false;
+          if (wordsPerElement * (ONE * ELEMENTS) == ZERO * WORDS &&
+              !amplifiedRead(segment, elementCount * (ONE * WORDS / ELEMENTS))) {
+            return false;
+          }
+
+          end = ptr + POINTER_SIZE_IN_WORDS + wordCount;
+        } else {
+          auto dataSize = dataBitsPerElement(elementSize) * ELEMENTS;
+          auto pointerCount = pointersPerElement(elementSize) * ELEMENTS;
+          auto step = (dataSize + pointerCount * BITS_PER_POINTER) / ELEMENTS;
+          auto elementCount = ref->listRef.elementCount();
+          auto wordCount = roundBitsUpToWords(upgradeBound<uint64_t>(elementCount) * step);
+
+          if (!boundsCheck(segment, ptr, wordCount)) return false;
+          if (elementSize == ElementSize::VOID &&
+              !amplifiedRead(segment, elementCount * (ONE * WORDS / ELEMENTS))) {
+            return false;
+          }
+
+          end = ptr + wordCount;
+        }
+        break;
+      }
+
+      case WirePointer::FAR:
+      case WirePointer::OTHER:
+        return false;
+    }
+
+    target.segment = segment;
+    copyMemory(reinterpret_cast<WirePointer*>(&target.tag), ref);
+    target.ptr = ptr;
+    target.end = end;
+    return true;
+  }
+
+  template <typename Func>
+  static void forEachLinkPointer(const LinkTarget& target, Func&& func) {
+    // Call `func(const WirePointer*)` for each pointer in `target`.
+
+    const WirePointer* tag = target.tagAsPtr();
+    switch (tag->kind()) {
+      case WirePointer::STRUCT: {
+        const WirePointer* pointers =
+            reinterpret_cast<const WirePointer*>(target.ptr + tag->structRef.dataSize.get());
+        for (auto i: kj::zeroTo(tag->structRef.ptrCount.get())) {
+          func(pointers + i);
+        }
+        break;
+      }
+
+      case WirePointer::LIST:
+        if (tag->listRef.elementSize() == ElementSize::POINTER) {
+          const WirePointer* pointers = reinterpret_cast<const WirePointer*>(target.ptr);
+          for (auto i: kj::zeroTo(tag->listRef.elementCount() * (ONE * POINTERS / ELEMENTS))) {
+            func(pointers + i);
+          }
+        } else if (tag->listRef.elementSize() == ElementSize::INLINE_COMPOSITE) {
+          const WirePointer* elementTag = reinterpret_cast<const WirePointer*>(target.ptr);
+          auto dataSize = elementTag->structRef.dataSize.get();
+          auto pointerCount = elementTag->structRef.ptrCount.get();
+
+          if (pointerCount > ZERO * POINTERS) {
+            const word* pos = target.ptr + POINTER_SIZE_IN_WORDS;
+            for (auto i KJ_UNUSED: kj::zeroTo(elementTag->inlineCompositeListElementCount())) {
+              pos += dataSize;
+
+              for (auto j KJ_UNUSED: kj::zeroTo(pointerCount)) {
+                func(reinterpret_cast<const WirePointer*>(pos));
+                pos += POINTER_SIZE_IN_WORDS;
+              }
+            }
+          }
+        }
+        break;
+
+      case WirePointer::FAR:
+      case WirePointer::OTHER:
+        KJ_UNREACHABLE;
+    }
+  }
+
+  static bool analyzeLinkTarget(LinkState& state, const LinkTarget& target, int nestingLimit) {
+    // First pass:  returns true if `target` and everything it points to can be linked.  Otherwise,
+    // records in `state.decisions` what to do with those of its pointers that can't simply be
+    // linked.  `nestingLimit` applies to `target`'s children.
+
+    bool linkable = true;
+
+    forEachLinkPointer(target, [&](const WirePointer* ref) {
+      if (ref->isNull()) return;
+
+      LinkTarget child;
+      if (!resolveLinkTarget(ref, target.segment, nestingLimit, child)) {
+        decideLink(state, ref, LinkDecision { false, child });
+        linkable = false;
+      } else if (!analyzeLinkTarget(state, child, nestingLimit - 1)) {
+        decideLink(state, ref, LinkDecision { true, child });
+        linkable = false;
+      } else if (ref->kind() == WirePointer::FAR) {
+        // The child can be linked, but not by this pointer, which uses the source message's
+        // segment IDs.
+        linkable = false;
+      }
+    });
+
+    if (linkable) {
+      auto& extent = state.extents.findOrCreate(target.segment, [&]() {
+        return kj::HashMap<SegmentReader*, LinkExtent>::Entry {
+            target.segment, LinkExtent { target.ptr, target.end } };
+      });
+      extent.begin = kj::min(extent.begin, target.ptr);
+      extent.end = kj::max(extent.end, target.end);
+    }
+
+    return linkable;
+  }
+
+  static void decideLink(LinkState& state, const WirePointer* ref, LinkDecision decision) {
+    // A message may legally reach the same pointer more than once, in which case the decision is
+    // the same each time.
+    state.decisions.findOrCreate(ref, [&]() {
+      return kj::HashMap<const WirePointer*, LinkDecision>::Entry { ref, decision };
+    });
+  }
+
+  static void addLinkSegments(LinkState& state) {
+    for (auto& entry: state.extents) {
+      // Readers treat an empty segment as nonexistent, so a segment containing only zero-sized
+      // objects is left out and those objects are copied instead (which costs nothing).
+      if (entry.value.begin == entry.value.end) continue;
+
+      state.externalSegments.insert(entry.key, state.arena->addExternalSegment(
+          kj::arrayPtr(entry.value.begin, entry.value.end), true));
+    }
+  }
+
+  static void linkPointer(LinkState& state, SegmentBuilder* segment, WirePointer* dst,
+                          SegmentReader* srcSegment, const WirePointer* src, int nestingLimit) {
+    // Second pass:  make `dst`, which must be null, a link or copy of `src`, as decided by
+    // analyzeLinkTarget().
+
+    if (src->isNull()) return;
+
+    KJ_IF_MAYBE(decision, state.decisions.find(src)) {
+      if (decision->split) {
+        splitLinkTarget(state, segment, dst, decision->target, nestingLimit - 1, nullptr);
+      } else {
+        copyPointer(segment, state.capTable, dst, srcSegment, state.srcCapTable, src,
+                    nestingLimit);
+      }
+    } else {
+      // Already validated by the first pass.
+      const WirePointer* tag = src;
+      SegmentReader* tagSegment = srcSegment;
+      const word* ptr = &KJ_ASSERT_NONNULL(followFars(tag, tag->target(tagSegment), tagSegment));
+
+      KJ_IF_MAYBE(external, state.externalSegments.find(tagSegment)) {
+        transferPointer(segment, dst, *external, tag, const_cast<word*>(ptr));
+      } else {
+        // A zero-sized object alone in its segment; see addLinkSegments().
+        copyPointer(segment, state.capTable, dst, srcSegment, state.srcCapTable, src,
+                    nestingLimit);
+      }
+    }
+  }
+
+  static SegmentAnd<word*> splitLinkTarget(
+      LinkState& state, SegmentBuilder* segment, WirePointer* dst, const LinkTarget& target,
+      int nestingLimit, BuilderArena* orphanArena) {
+    // Copy `target` itself, then link or copy each of its pointers.  `nestingLimit` applies to
+    // `target`'s children.
+
+    const WirePointer* tag = target.tagAsPtr();
+    auto size = intervalLength(target.ptr, target.end, MAX_SEGMENT_WORDS);
+
+    word* ptr = allocate(dst, segment, state.capTable, size, tag->kind(), orphanArena);
+    copyMemory(&dst->upper32Bits, &tag->upper32Bits);
+    copyMemory(ptr, target.ptr, size);
+
+    forEachLinkPointer(target, [&](const WirePointer* src) {
+      WirePointer* slot = reinterpret_cast<WirePointer*>(
+          ptr + intervalLength(target.ptr, reinterpret_cast<const word*>(src), MAX_SEGMENT_WORDS));
+      zeroMemory(slot);
+      linkPointer(state, segment, slot, target.segment, src, nestingLimit);
+    });
+
+    return { segment, ptr };
+  }
+
+  static OrphanBuilder reference(BuilderArena* arena, CapTableBuilder* capTable,
+                                 CapTableReader* srcCapTable, const LinkTarget& root,
+                                 int nestingLimit) {
+    LinkState state { arena, capTable, srcCapTable, {}, {}, {} };
+    bool linkable = analyzeLinkTarget(state, root, nestingLimit);
+    addLinkSegments(state);
+
+    OrphanBuilder result;
+    result.capTable = capTable;
+    if (linkable) {
+      result.tagAsPtr()->setKindForOrphan(root.tagAsPtr()->kind());
+      copyMemory(&result.tagAsPtr()->upper32Bits, &root.tagAsPtr()->upper32Bits);
+      result.segment = KJ_ASSERT_NONNULL(state.externalSegments.find(root.segment));
+      result.location = const_cast<word*>(root.ptr);
+    } else {
+      auto allocation = splitLinkTarget(
+          state, nullptr, result.tagAsPtr(), root, nestingLimit, arena);
+      result.segment = allocation.segment;
+      result.location = allocation.value;
+    }
+    return result;
+  }
+
+  static OrphanBuilder reference(BuilderArena* arena, CapTableBuilder* capTable,
+                                 StructReader value) {
+    if (value.segment == nullptr || value.segment->getArena() == arena ||
+        value.dataSize % BITS_PER_WORD != ZERO * BITS ||
+        (value.dataSize == ZERO * BITS && value.pointerCount == ZERO * POINTERS)) {
+      // Unchecked messages, objects already in this message, empty structs, and structs narrower
+      // than a word (which can only be elements of primitive lists) are simply copied.
+      return OrphanBuilder::copy(arena, capTable, value);
+    }
+
+    LinkTarget root;
+    root.segment = value.segment;
+    WirePointer* tag = reinterpret_cast<WirePointer*>(&root.tag);
+    tag->setKindWithZeroOffset(WirePointer::STRUCT);
+    tag->structRef.set(roundBitsUpToWords(value.dataSize), value.pointerCount);
+    root.ptr = reinterpret_cast<const word*>(value.data);
+    root.end = reinterpret_cast<const word*>(value.pointers + value.pointerCount);
+
+    return reference(arena, capTable, value.capTable, root, value.nestingLimit);
+  }
+
+  static OrphanBuilder reference(BuilderArena* arena, CapTableBuilder* capTable,
+                                 ListReader value) {
+    if (value.segment == nullptr || value.segment->getArena() == arena ||
+        (value.elementSize != ElementSize::INLINE_COMPOSITE &&
+         upgradeBound<uint64_t>(value.elementCount) * value.step == ZERO * BITS)) {
+      // Unchecked messages, objects already in this message, and empty lists are simply copied.
+      return OrphanBuilder::copy(arena, capTable, value);
+    }
+
+    LinkTarget root;
+    root.segment = value.segment;
+    WirePointer* tag = reinterpret_cast<WirePointer*>(&root.tag);
+    tag->setKindWithZeroOffset(WirePointer::LIST);
+    root.ptr = reinterpret_cast<const word*>(value.ptr);
+
+    auto wordCount = assertMaxBits<SEGMENT_WORD_COUNT_BITS>(roundBitsUpToWords(
+        upgradeBound<uint64_t>(value.elementCount) * value.step), []() {
+          KJ_FAIL_ASSERT("list reader is larger than a segment");
+        });
+    if (value.elementSize == ElementSize::INLINE_COMPOSITE) {
+      tag->listRef.setInlineComposite(wordCount);
+      root.ptr -= POINTER_SIZE_IN_WORDS;  // Include the list's tag.
+    } else {
+      tag->listRef.set(value.elementSize, value.elementCount);
+    }
+    root.end = reinterpret_cast<const word*>(value.ptr) + wordCount;
+
+    return reference(arena, capTable, value.capTable, root, value.nestingLimit);
+  }
+
   static void adopt(SegmentBuilder* segment, CapTableBuilder* capTable,
                     WirePointer* ref, OrphanBuilder&& value) {
     KJ_REQUIRE(value.segment == nullptr || value.segment->getArena() == segment->getArena(),
@@ -2592,7 +3109,7 @@ PointerType PointerBuilder::getPointerType() const {
   } else {
     WirePointer* ptr = pointer;
     SegmentBuilder* sgmt = segment;
-    WireHelpers::followFars(ptr, ptr->target(), sgmt);
+    WireHelpers::followFarsNoWritableCheck(ptr, ptr->target(), sgmt);
     switch(ptr->kind()) {
       case WirePointer::FAR:
         KJ_FAIL_ASSERT("far pointer not followed?");
@@ -2984,91 +3501,989 @@ bool StructReader::isCanonical(const word **readHead,
 }
 
 // =======================================================================================
-// ListBuilder
+// Streaming canonicalization
+//
+// StructReader::writeCanonical() produces exactly the bytes that canonicalize() would, but emits
+// them as it walks the message instead of copying into a flat builder.  The canonical layout
+// places each object's children, in pointer order, immediately after the object, so writing a
+// pointer requires knowing the canonical size of every subtree before it.  We therefore make two
+// passes:  the first computes the canonical size of every subtree (validating the message as
+// copyPointer() would), the second writes the output.
+//
+// Sizes are recorded in a flat array of uint32_t "slots" ordered so that the second pass can
+// consume it front-to-back:  for each object, in preorder, one slot for each of its non-null
+// pointers, holding the size of that pointer's subtree in words (or CANONICAL_NULL if the target
+// is invalid, in which case the pointer is written as null and not followed).  This takes one
+// word-half per object rather than a copy of the whole message.
 
-Text::Builder ListBuilder::asText() {
-  KJ_REQUIRE(structDataSize == G(8) * BITS && structPointerCount == ZERO * POINTERS,
-             "Expected Text, got list of non-bytes.") {
-    return Text::Builder();
-  }
+namespace {
 
-  size_t size = unbound(elementCount / ELEMENTS);
+constexpr uint32_t CANONICAL_NULL = 0xffffffffu;
+// Slot value indicating that a non-null pointer's target was invalid and will be written as null.
 
-  KJ_REQUIRE(size > 0, "Message contains text that is not NUL-terminated.") {
-    return Text::Builder();
-  }
+constexpr uint64_t MAX_CANONICAL_WORDS = kj::maxValueForBits<SEGMENT_WORD_COUNT_BITS>();
+// A canonical message is always a single segment.
 
-  char* cptr = reinterpret_cast<char*>(ptr);
-  --size;  // NUL terminator
+const byte CANONICAL_TRUE_BIT = 1;
+// Data section of a one-bit struct whose bit is set.  (The source byte may contain other list
+// elements' bits.)
 
-  KJ_REQUIRE(cptr[size] == '\0', "Message contains text that is not NUL-terminated.") {
-    return Text::Builder();
-  }
+struct CanonicalNode {
+  // An object reached while writing a message in canonical form, with its data and pointer
+  // sections already truncated the same way setStructPointer() and setListPointer() truncate them.
 
-  return Text::Builder(cptr, size);
-}
+  enum Kind: uint8_t { STRUCT, DATA_LIST, POINTER_LIST, STRUCT_LIST };
 
-Data::Builder ListBuilder::asData() {
-  KJ_REQUIRE(structDataSize == G(8) * BITS && structPointerCount == ZERO * POINTERS,
-             "Expected Text, got list of non-bytes.") {
-    return Data::Builder();
-  }
+  Kind kind;
+  ElementSize elementSize;      // DATA_LIST only.
+  SegmentReader* segment;
+  int nestingLimit;             // Limit to check when following this object's pointers.
 
-  return Data::Builder(reinterpret_cast<byte*>(ptr), unbound(elementCount / ELEMENTS));
-}
+  const byte* data;             // STRUCT: data section.  Lists: first element.
+  const WirePointer* pointers;  // STRUCT only.
 
-StructBuilder ListBuilder::getStructElement(ElementCount index) {
-  auto indexBit = upgradeBound<uint64_t>(index) * step;
-  byte* structData = ptr + indexBit / BITS_PER_BYTE;
-  KJ_DASSERT(indexBit % BITS_PER_BYTE == ZERO * BITS);
-  return StructBuilder(segment, capTable, structData,
-      reinterpret_cast<WirePointer*>(structData + structDataSize / BITS_PER_BYTE),
-      structDataSize, structPointerCount);
-}
+  uint32_t elementCount;        // Lists only.
+  uint32_t dataBytes;           // STRUCT only:  canonical (truncated) data section size.
+  uint32_t dataWords;           // STRUCT_LIST only:  canonical data words per element.
+  uint32_t ptrCount;            // STRUCT, STRUCT_LIST:  canonical pointers (per element).
+  uint32_t srcDataWords;        // STRUCT_LIST only:  data words per element in the source.
+  uint32_t srcPtrCount;         // STRUCT_LIST only:  pointers per element in the source.
+  uint64_t dataBits;            // DATA_LIST only:  total size of the list body in bits.
 
-ListReader ListBuilder::asReader() const {
-  return ListReader(segment, capTable, ptr, elementCount, step, structDataSize, structPointerCount,
-                    elementSize, kj::maxValue);
-}
+  uint64_t bodyWords() const {
+    switch (kind) {
+      case STRUCT: return (dataBytes + 7) / 8 + ptrCount;
+      case DATA_LIST: return (dataBits + 63) / 64;
+      case POINTER_LIST: return elementCount;
+      case STRUCT_LIST: return 1 + uint64_t(elementCount) * (dataWords + ptrCount);
+    }
+    KJ_UNREACHABLE;
+  }
 
-BuilderArena* ListBuilder::getArena() {
-  return segment->getArena();
-}
+  uint64_t childCount() const {
+    switch (kind) {
+      case STRUCT: return ptrCount;
+      case DATA_LIST: return 0;
+      case POINTER_LIST: return elementCount;
+      case STRUCT_LIST: return uint64_t(elementCount) * ptrCount;
+    }
+    KJ_UNREACHABLE;
+  }
 
-CapTableBuilder* ListBuilder::getCapTable() {
-  return capTable;
-}
+  const WirePointer* child(uint64_t i) const {
+    switch (kind) {
+      case STRUCT: return pointers + i;
+      case DATA_LIST: break;
+      case POINTER_LIST: return reinterpret_cast<const WirePointer*>(data) + i;
+      case STRUCT_LIST: {
+        auto element = reinterpret_cast<const word*>(data) +
+            (i / ptrCount) * (srcDataWords + srcPtrCount) + srcDataWords;
+        return reinterpret_cast<const WirePointer*>(element) + i % ptrCount;
+      }
+    }
+    KJ_UNREACHABLE;
+  }
 
-ListBuilder ListBuilder::imbue(CapTableBuilder* capTable) {
-  auto result = *this;
-  result.capTable = capTable;
-  return result;
-}
+  void initStruct(SegmentReader* segmentParam, const byte* dataParam,
+                  const WirePointer* pointersParam, uint64_t dataSizeBits, uint pointerCount,
+                  int nestingLimitParam) {
+    kind = STRUCT;
+    segment = segmentParam;
+    nestingLimit = nestingLimitParam;
+    pointers = pointersParam;
 
-// =======================================================================================
-// ListReader
+    if (dataSizeBits == 1) {
+      // Handle the truncation case where it's a false in a 1-bit struct.
+      bool bit = *dataParam & 1;
+      data = &CANONICAL_TRUE_BIT;
+      dataBytes = bit;
+    } else {
+      const byte* end = dataParam + dataSizeBits / 8;
+      while (end > dataParam && end[-1] == 0) --end;
+      data = dataParam;
+      dataBytes = end - dataParam;
+    }
 
-Text::Reader ListReader::asText() {
-  KJ_REQUIRE(structDataSize == G(8) * BITS && structPointerCount == ZERO * POINTERS,
-             "Expected Text, got list of non-bytes.") {
-    return Text::Reader();
+    const WirePointer* ptrEnd = pointersParam + pointerCount;
+    while (ptrEnd > pointersParam && ptrEnd[-1].isNull()) --ptrEnd;
+    ptrCount = ptrEnd - pointersParam;
+  }
+
+  void initStructList(SegmentReader* segmentParam, const word* elements, uint count,
+                      uint elementDataWords, uint elementPtrCount, int nestingLimitParam) {
+    kind = STRUCT_LIST;
+    segment = segmentParam;
+    nestingLimit = nestingLimitParam;
+    data = reinterpret_cast<const byte*>(elements);
+    elementCount = count;
+    srcDataWords = elementDataWords;
+    srcPtrCount = elementPtrCount;
+
+    // The list's element size is the largest truncated size of any element.
+    dataWords = 0;
+    ptrCount = 0;
+    const word* element = elements;
+    for (uint i = 0; i < count; i++) {
+      const byte* dataBegin = reinterpret_cast<const byte*>(element);
+      const byte* dataEnd = dataBegin + elementDataWords * sizeof(word);
+      while (dataEnd > dataBegin && dataEnd[-1] == 0) --dataEnd;
+      dataWords = kj::max(dataWords, uint32_t((dataEnd - dataBegin + 7) / 8));
+
+      auto ptrBegin = reinterpret_cast<const WirePointer*>(element + elementDataWords);
+      auto ptrEnd = ptrBegin + elementPtrCount;
+      while (ptrEnd > ptrBegin && ptrEnd[-1].isNull()) --ptrEnd;
+      ptrCount = kj::max(ptrCount, uint32_t(ptrEnd - ptrBegin));
+
+      element += elementDataWords + elementPtrCount;
+    }
   }
 
-  size_t size = unbound(elementCount / ELEMENTS);
+  void writePointer(WirePointer& ref, int64_t offset) const {
+    // Fill in `ref` to point at this object, `offset` words after the end of `ref`.
 
-  KJ_REQUIRE(size > 0, "Message contains text that is not NUL-terminated.") {
-    return Text::Reader();
+    switch (kind) {
+      case STRUCT:
+        if (dataBytes == 0 && ptrCount == 0) {
+          ref.setKindAndTargetForEmptyStruct();
+        } else {
+          ref.offsetAndKind.set((static_cast<uint32_t>(offset) << 2) | WirePointer::STRUCT);
+          ref.structRef.set(assumeBits<STRUCT_DATA_WORD_COUNT_BITS>((dataBytes + 7) / 8) * WORDS,
+                            assumeBits<STRUCT_POINTER_COUNT_BITS>(ptrCount) * POINTERS);
+        }
+        return;
+      case DATA_LIST:
+      case POINTER_LIST:
+        ref.offsetAndKind.set((static_cast<uint32_t>(offset) << 2) | WirePointer::LIST);
+        ref.listRef.set(kind == DATA_LIST ? elementSize : ElementSize::POINTER,
+                        assumeBits<LIST_ELEMENT_COUNT_BITS>(elementCount) * ELEMENTS);
+        return;
+      case STRUCT_LIST:
+        ref.offsetAndKind.set((static_cast<uint32_t>(offset) << 2) | WirePointer::LIST);
+        ref.listRef.setInlineComposite(
+            assumeBits<SEGMENT_WORD_COUNT_BITS>(bodyWords() - 1) * WORDS);
+        return;
+    }
+    KJ_UNREACHABLE;
   }
+};
 
-  const char* cptr = reinterpret_cast<const char*>(ptr);
-  --size;  // NUL terminator
-
-  KJ_REQUIRE(cptr[size] == '\0', "Message contains text that is not NUL-terminated.") {
-    return Text::Reader();
-  }
+template <bool checked>
+bool resolveCanonical(SegmentReader* segment, const WirePointer* ref, int nestingLimit,
+                      CanonicalNode& node) {
+  // Find the target of `ref` and fill in `node` to describe it.  Returns false if the pointer
+  // should be written as null.  When `checked` is true, this validates the target exactly the way
+  // copyPointer() does; this is done on the first pass only, so that the second pass neither
+  // repeats the work nor counts the same data against the read limit again.
 
-  return Text::Reader(cptr, size);
-}
+  if (ref->isNull()) return false;
+
+  const word* ptr;
+  if (checked) {
+    KJ_IF_MAYBE(p, WireHelpers::followFars(ref, ref->target(segment), segment)) {
+      ptr = p;
+    } else {
+      return false;
+    }
+  } else if (segment != nullptr && ref->kind() == WirePointer::FAR) {
+    segment = segment->getArena()->tryGetSegment(ref->farRef.segmentId.get());
+    auto pad = reinterpret_cast<const WirePointer*>(ref->farTarget(segment));
+    if (!ref->isDoubleFar()) {
+      ref = pad;
+      ptr = pad->target(segment);
+    } else {
+      ref = pad + 1;
+      segment = segment->getArena()->tryGetSegment(pad->farRef.segmentId.get());
+      ptr = pad->farTarget(segment);
+    }
+  } else {
+    ptr = ref->target(segment);
+  }
+
+  switch (ref->kind()) {
+    case WirePointer::STRUCT:
+      if (checked) {
+        KJ_REQUIRE(nestingLimit > 0,
+              "Message is too deeply-nested or contains cycles.  See capnp::ReaderOptions.") {
+          return false;
+        }
+
+        KJ_REQUIRE(WireHelpers::boundsCheck(segment, ptr, ref->structRef.wordSize()),
+                   "Message contained out-of-bounds struct pointer.") {
+          return false;
+        }
+      }
+
+      node.initStruct(segment, reinterpret_cast<const byte*>(ptr),
+          reinterpret_cast<const WirePointer*>(ptr + ref->structRef.dataSize.get()),
+          unbound(ref->structRef.dataSize.get() / WORDS) * uint64_t(64),
+          unbound(ref->structRef.ptrCount.get() / POINTERS),
+          nestingLimit - 1);
+      return true;
+
+    case WirePointer::LIST: {
+      ElementSize elementSize = ref->listRef.elementSize();
+
+      if (checked) {
+        KJ_REQUIRE(nestingLimit > 0,
+              "Message is too deeply-nested or contains cycles.  See capnp::ReaderOptions.") {
+          return false;
+        }
+      }
+
+      if (elementSize == ElementSize::INLINE_COMPOSITE) {
+        auto wordCount = ref->listRef.inlineCompositeWordCount();
+        const WirePointer* tag = reinterpret_cast<const WirePointer*>(ptr);
+
+        if (checked) {
+          KJ_REQUIRE(WireHelpers::boundsCheck(segment, ptr, wordCount + POINTER_SIZE_IN_WORDS),
+                     "Message contains out-of-bounds list pointer.") {
+            return false;
+          }
+
+          KJ_REQUIRE(tag->kind() == WirePointer::STRUCT,
+                     "INLINE_COMPOSITE lists of non-STRUCT type are not supported.") {
+            return false;
+          }
+        }
+
+        auto elementCount = tag->inlineCompositeListElementCount();
+        auto wordsPerElement = tag->structRef.wordSize() / ELEMENTS;
+
+        if (checked) {
+          KJ_REQUIRE(wordsPerElement * upgradeBound<uint64_t>(elementCount) <= wordCount,
+                     "INLINE_COMPOSITE list's elements overrun its word count.") {
+            return false;
+          }
+
+          if (wordsPerElement * (ONE * ELEMENTS) == ZERO * WORDS) {
+            // Watch out for lists of zero-sized structs, which can claim to be arbitrarily large
+            // without having sent actual data.
+            KJ_REQUIRE(WireHelpers::amplifiedRead(segment,
+                                                  elementCount * (ONE * WORDS / ELEMENTS)),
+                       "Message contains amplified list pointer.") {
+              return false;
+            }
+          }
+        }
+
+        node.initStructList(segment, ptr + POINTER_SIZE_IN_WORDS,
+            unbound(elementCount / ELEMENTS),
+            unbound(tag->structRef.dataSize.get() / WORDS),
+            unbound(tag->structRef.ptrCount.get() / POINTERS),
+            nestingLimit - 1);
+        return true;
+      } else {
+        auto dataSize = dataBitsPerElement(elementSize) * ELEMENTS;
+        auto pointerCount = pointersPerElement(elementSize) * ELEMENTS;
+        auto step = (dataSize + pointerCount * BITS_PER_POINTER) / ELEMENTS;
+        auto elementCount = ref->listRef.elementCount();
+
+        if (checked) {
+          auto wordCount = WireHelpers::roundBitsUpToWords(
+              upgradeBound<uint64_t>(elementCount) * step);
+
+          KJ_REQUIRE(WireHelpers::boundsCheck(segment, ptr, wordCount),
+                     "Message contains out-of-bounds list pointer.") {
+            return false;
+          }
+
+          if (elementSize == ElementSize::VOID) {
+            // Watch out for lists of void, which can claim to be arbitrarily large without having
+            // sent actual data.
+            KJ_REQUIRE(WireHelpers::amplifiedRead(segment,
+                                                  elementCount * (ONE * WORDS / ELEMENTS)),
+                       "Message contains amplified list pointer.") {
+              return false;
+            }
+          }
+        }
+
+        node.kind = elementSize == ElementSize::POINTER ?
+            CanonicalNode::POINTER_LIST : CanonicalNode::DATA_LIST;
+        node.elementSize = elementSize;
+        node.segment = segment;
+        node.nestingLimit = nestingLimit - 1;
+        node.data = reinterpret_cast<const byte*>(ptr);
+        node.elementCount = unbound(elementCount / ELEMENTS);
+        node.dataBits = unbound(upgradeBound<uint64_t>(elementCount) * step / BITS);
+        return true;
+      }
+    }
+
+    case WirePointer::FAR:
+      if (checked) {
+        KJ_FAIL_REQUIRE("Unexpected FAR pointer.") {
+          return false;
+        }
+      }
+      return false;
+
+    case WirePointer::OTHER:
+      if (checked) {
+        KJ_REQUIRE(ref->isCapability(), "Unknown pointer type.") {
+          return false;
+        }
+        KJ_FAIL_REQUIRE("Cannot create a canonical message with a capability") {
+          return false;
+        }
+      }
+      return false;
+  }
+
+  KJ_UNREACHABLE;
+}
+
+uint64_t sizeCanonicalChildren(const CanonicalNode& node, uint64_t begin, uint64_t end,
+                               kj::Vector<uint32_t>& slots);
+
+uint64_t sizeCanonicalSubtree(const CanonicalNode& node, kj::Vector<uint32_t>& slots) {
+  uint64_t total = node.bodyWords() + sizeCanonicalChildren(node, 0, node.childCount(), slots);
+  KJ_REQUIRE(total <= MAX_CANONICAL_WORDS, "Message is too large to be written canonically.");
+  return total;
+}
+
+uint64_t sizeCanonicalChildren(const CanonicalNode& node, uint64_t begin, uint64_t end,
+                               kj::Vector<uint32_t>& slots) {
+  // Appends one slot for each non-null pointer among node's children [begin, end), followed by
+  // the slots of each of those children's subtrees.  Returns the canonical size of the subtrees.
+
+  size_t slot = slots.size();
+  for (uint64_t i = begin; i < end; i++) {
+    if (!node.child(i)->isNull()) slots.add(CANONICAL_NULL);
+  }
+
+  uint64_t total = 0;
+  for (uint64_t i = begin; i < end; i++) {
+    const WirePointer* child = node.child(i);
+    if (child->isNull()) continue;
+
+    CanonicalNode target;
+    if (resolveCanonical<true>(node.segment, child, node.nestingLimit, target)) {
+      uint64_t size = sizeCanonicalSubtree(target, slots);
+      slots[slot] = size;
+      total += size;
+    }
+    ++slot;
+  }
+  return total;
+}
+
+class CanonicalOutput {
+  // Buffers the canonical output into chunks.
+
+public:
+  void write(const void* data, size_t size) {
+    if (size > sizeof(buffer) - fill) {
+      flush();
+      if (size >= sizeof(buffer)) {
+        writeChunk(kj::arrayPtr(reinterpret_cast<const byte*>(data), size));
+        return;
+      }
+    }
+    memcpy(buffer + fill, data, size);
+    fill += size;
+  }
+
+  void writeZeros(size_t size) {
+    while (size > 0) {
+      if (fill == sizeof(buffer)) flush();
+      size_t n = kj::min(size, sizeof(buffer) - fill);
+      memset(buffer + fill, 0, n);
+      fill += n;
+      size -= n;
+    }
+  }
+
+  void flush() {
+    if (fill > 0) {
+      writeChunk(kj::arrayPtr(buffer, fill));
+      fill = 0;
+    }
+  }
+
+protected:
+  virtual void writeChunk(kj::ArrayPtr<const byte> chunk) = 0;
+
+private:
+  byte buffer[8192];
+  size_t fill = 0;
+};
+
+class CanonicalStreamOutput final: public CanonicalOutput {
+public:
+  explicit CanonicalStreamOutput(kj::OutputStream& output): output(output) {}
+
+protected:
+  void writeChunk(kj::ArrayPtr<const byte> chunk) override {
+    output.write(chunk.begin(), chunk.size());
+  }
+
+private:
+  kj::OutputStream& output;
+};
+
+void writeCanonicalPointer(CanonicalOutput& output, const CanonicalNode& target,
+                           int64_t offset) {
+  uint64_t raw = 0;
+  target.writePointer(*reinterpret_cast<WirePointer*>(&raw), offset);
+  output.write(&raw, sizeof(raw));
+}
+
+const uint32_t* writeCanonicalBody(const CanonicalNode& node, const uint32_t* slots,
+                                   CanonicalOutput& output) {
+  // Writes the object itself, consuming one slot for each non-null pointer it contains.  Returns
+  // the position after the consumed slots.
+
+  uint64_t body = node.bodyWords();
+  uint64_t before = 0;  // canonical size of the children already pointed at
+
+  auto writeChild = [&](const WirePointer* ref, uint64_t position) {
+    // `position` is the index of the pointer within the body.
+    if (!ref->isNull()) {
+      uint32_t size = *slots++;
+      CanonicalNode target;
+      if (size != CANONICAL_NULL &&
+          resolveCanonical<false>(node.segment, ref, node.nestingLimit, target)) {
+        writeCanonicalPointer(output, target, body - position - 1 + before);
+        before += size;
+        return;
+      }
+    }
+    output.writeZeros(sizeof(word));
+  };
+
+  switch (node.kind) {
+    case CanonicalNode::STRUCT: {
+      uint64_t dataWords = (node.dataBytes + 7) / 8;
+      output.write(node.data, node.dataBytes);
+      output.writeZeros(dataWords * sizeof(word) - node.dataBytes);
+      for (uint i = 0; i < node.ptrCount; i++) {
+        writeChild(node.pointers + i, dataWords + i);
+      }
+      break;
+    }
+
+    case CanonicalNode::DATA_LIST: {
+      uint64_t wholeBytes = node.dataBits / 8;
+      output.write(node.data, wholeBytes);
+      uint leftoverBits = node.dataBits % 8;
+      if (leftoverBits > 0) {
+        // We need to copy a partial byte.
+        byte partial = node.data[wholeBytes] & ((1 << leftoverBits) - 1);
+        output.write(&partial, 1);
+        ++wholeBytes;
+      }
+      output.writeZeros(body * sizeof(word) - wholeBytes);
+      break;
+    }
+
+    case CanonicalNode::POINTER_LIST: {
+      auto elements = reinterpret_cast<const WirePointer*>(node.data);
+      for (uint i = 0; i < node.elementCount; i++) {
+        writeChild(elements + i, i);
+      }
+      break;
+    }
+
+    case CanonicalNode::STRUCT_LIST: {
+      uint64_t raw = 0;
+      WirePointer& tag = *reinterpret_cast<WirePointer*>(&raw);
+      tag.setKindAndInlineCompositeListElementCount(WirePointer::STRUCT,
+          assumeBits<LIST_ELEMENT_COUNT_BITS>(node.elementCount) * ELEMENTS);
+      tag.structRef.set(assumeBits<STRUCT_DATA_WORD_COUNT_BITS>(node.dataWords) * WORDS,
+                        assumeBits<STRUCT_POINTER_COUNT_BITS>(node.ptrCount) * POINTERS);
+      output.write(&raw, sizeof(raw));
+
+      auto element = reinterpret_cast<const word*>(node.data);
+      uint64_t position = 1;
+      for (uint i = 0; i < node.elementCount; i++) {
+        output.write(element, node.dataWords * sizeof(word));
+        position += node.dataWords;
+        auto ptrs = reinterpret_cast<const WirePointer*>(element + node.srcDataWords);
+        for (uint j = 0; j < node.ptrCount; j++) {
+          writeChild(ptrs + j, position++);
+        }
+        element += node.srcDataWords + node.srcPtrCount;
+      }
+      break;
+    }
+  }
+
+  return slots;
+}
+
+void writeCanonicalChildren(const CanonicalNode& node, uint64_t begin, uint64_t end,
+                            const uint32_t* slots, const uint32_t*& cursor,
+                            CanonicalOutput& output);
+
+void writeCanonicalSubtree(const CanonicalNode& node, const uint32_t*& cursor,
+                           CanonicalOutput& output) {
+  const uint32_t* slots = cursor;
+  cursor = writeCanonicalBody(node, slots, output);
+  writeCanonicalChildren(node, 0, node.childCount(), slots, cursor, output);
+}
+
+void writeCanonicalChildren(const CanonicalNode& node, uint64_t begin, uint64_t end,
+                            const uint32_t* slots, const uint32_t*& cursor,
+                            CanonicalOutput& output) {
+  // Writes the subtrees of node's children [begin, end).  `slots` are the slots describing those
+  // children; `cursor` points at the slots of their descendants and is advanced past them.
+
+  for (uint64_t i = begin; i < end; i++) {
+    const WirePointer* child = node.child(i);
+    if (child->isNull()) continue;
+    if (*slots++ == CANONICAL_NULL) continue;
+
+    CanonicalNode target;
+    if (resolveCanonical<false>(node.segment, child, node.nestingLimit, target)) {
+      writeCanonicalSubtree(target, cursor, output);
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------------------
+// Parallel mode
+//
+// The top of the tree is split into "pieces", each of which is a contiguous run of the output:
+// either the body of an object near the root, or the subtrees of a range of some object's
+// children.  Ranges are sized in parallel, after which the bodies above them can be filled in.
+// Then all pieces are written in parallel.  Each piece is written straight through to the output
+// once every piece before it is done, and is buffered until then.
+
+struct CanonicalPiece {
+  CanonicalNode node;
+
+  bool isBody;
+  // If true, this piece is the body of `node`.  Otherwise, it's the subtrees of node's children
+  // [begin, end).
+
+  uint64_t begin = 0;
+  uint64_t end = 0;
+
+  kj::Vector<size_t> parts;
+  // For bodies:  The pieces containing each of node's non-null children, in order.  Each part is
+  // either a range or the body of an individually-planned child.  A child that is invalid is
+  // represented as CANONICAL_NO_PIECE.
+
+  kj::Vector<uint32_t> slots;
+  // For ranges:  As produced by sizeCanonicalChildren().
+  // For bodies:  One slot for each of node's non-null children.
+
+  size_t rangeSlotCount = 0;
+  // For ranges:  Number of slots at the start of `slots` describing the range's own children.
+};
+
+constexpr size_t CANONICAL_NO_PIECE = kj::maxValue;
+
+constexpr uint CANONICAL_PIECES_PER_THREAD = 8;
+// How finely to split the tree.  More pieces balance better when subtree sizes vary.
+
+constexpr uint CANONICAL_MAX_PLAN_DEPTH = 16;
+
+constexpr size_t CANONICAL_MAX_BUFFER_BYTES = 32u << 20;
+// Once pieces waiting for their turn have buffered this much, they block until it's their turn
+// to write.
+
+void runCanonicalJobs(uint threadCount, size_t jobCount, kj::Function<void(size_t)> job,
+                      kj::Function<void()> onFailure) {
+  // Runs job(0) through job(jobCount - 1) on `threadCount` threads (including this one), starting
+  // them in order.  If any job throws, no more jobs are started, `onFailure` is called, and the
+  // first exception is rethrown here once all threads have stopped.
+
+  struct State {
+    size_t next = 0;
+    kj::Maybe<kj::Exception> exception;
+  };
+  kj::MutexGuarded<State> state;
+
+  auto worker = [&]() {
+    for (;;) {
+      size_t index;
+      {
+        auto lock = state.lockExclusive();
+        if (lock->next == jobCount || lock->exception != nullptr) return;
+        index = lock->next++;
+      }
+
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() { job(index); })) {
+        {
+          auto lock = state.lockExclusive();
+          if (lock->exception == nullptr) lock->exception = kj::mv(*exception);
+        }
+        onFailure();
+        return;
+      }
+    }
+  };
+
+  {
+    kj::Vector<kj::Own<kj::Thread>> threads;
+    for (uint i = 1; i < kj::min(size_t(threadCount), jobCount); i++) {
+      threads.add(kj::heap<kj::Thread>([&]() { worker(); }));
+    }
+    worker();
+  }
+
+  KJ_IF_MAYBE(exception, state.getWithoutLock().exception) {
+    kj::throwFatalException(kj::mv(*exception));
+  }
+}
+
+class CanonicalParallelWriter {
+public:
+  CanonicalParallelWriter(CanonicalNode root, kj::OutputStream& output, uint threadCount)
+      : output(output), threadCount(threadCount) {
+    planPiece(root, threadCount * CANONICAL_PIECES_PER_THREAD, 0);
+  }
+
+  void write() {
+    // Size the ranges in parallel.
+    kj::Vector<CanonicalPiece*> ranges;
+    for (auto& piece: pieces) {
+      if (!piece->isBody) ranges.add(piece.get());
+    }
+    runCanonicalJobs(threadCount, ranges.size(), [&](size_t i) {
+      auto& range = *ranges[i];
+      sizeCanonicalChildren(range.node, range.begin, range.end, range.slots);
+      range.rangeSlotCount = 0;
+      for (uint64_t j = range.begin; j < range.end; j++) {
+        if (!range.node.child(j)->isNull()) ++range.rangeSlotCount;
+      }
+    }, []() {});
+
+    // Now we know the size of everything below the bodies.
+    uint64_t total = finishBody(*pieces[0]);
+    KJ_REQUIRE(total <= MAX_CANONICAL_WORDS, "Message is too large to be written canonically.");
+
+    {
+      // Root pointer.
+      uint64_t raw = 0;
+      pieces[0]->node.writePointer(*reinterpret_cast<WirePointer*>(&raw), 0);
+      output.write(&raw, sizeof(raw));
+    }
+
+    state.lockExclusive()->finished =
+        kj::heapArray<kj::Maybe<kj::Vector<kj::Array<byte>>>>(pieces.size());
+
+    runCanonicalJobs(threadCount, pieces.size(), [&](size_t i) {
+      auto& piece = *pieces[i];
+      PieceOutput pieceOutput(*this, i);
+      if (piece.isBody) {
+        writeCanonicalBody(piece.node, piece.slots.begin(), pieceOutput);
+      } else {
+        const uint32_t* cursor = piece.slots.begin() + piece.rangeSlotCount;
+        writeCanonicalChildren(piece.node, piece.begin, piece.end, piece.slots.begin(), cursor,
+                               pieceOutput);
+      }
+      pieceOutput.finish();
+    }, [this]() {
+      state.lockExclusive()->failed = true;
+    });
+  }
+
+private:
+  kj::OutputStream& output;
+  uint threadCount;
+  kj::Vector<kj::Own<CanonicalPiece>> pieces;
+
+  struct State {
+    size_t head = 0;
+    // Index of the piece currently allowed to write to `output`.  Only one thread writes at a
+    // time, so writes happen outside the lock.
+
+    size_t bufferedBytes = 0;
+    // Bytes held by pieces after the head.
+
+    kj::Array<kj::Maybe<kj::Vector<kj::Array<byte>>>> finished;
+    // Output of pieces after the head which completed before their turn.
+
+    bool failed = false;
+  };
+  kj::MutexGuarded<State> state;
+
+  size_t planPiece(const CanonicalNode& node, uint budget, uint depth) {
+    // Adds `node`'s body and its children's subtrees to `pieces`, split so that there's roughly
+    // `budget` ranges.  Returns the index of the body piece.
+
+    size_t index = pieces.size();
+    auto ownBody = kj::heap<CanonicalPiece>();
+    auto& body = *ownBody;
+    body.node = node;
+    body.isBody = true;
+    pieces.add(kj::mv(ownBody));
+
+    uint64_t count = node.childCount();
+    if (count == 0) {
+      // Leaf.
+    } else if (budget <= 1 || depth >= CANONICAL_MAX_PLAN_DEPTH) {
+      body.parts.add(addRange(node, 0, count));
+    } else if (count >= budget) {
+      for (uint64_t i = 0; i < budget; i++) {
+        uint64_t begin = count * i / budget;
+        uint64_t end = count * (i + 1) / budget;
+        if (begin < end) body.parts.add(addRange(node, begin, end));
+      }
+    } else {
+      for (uint64_t i = 0; i < count; i++) {
+        const WirePointer* child = node.child(i);
+        if (child->isNull()) continue;
+
+        CanonicalNode target;
+        if (resolveCanonical<true>(node.segment, child, node.nestingLimit, target)) {
+          body.parts.add(planPiece(target, budget / count, depth + 1));
+        } else {
+          body.parts.add(CANONICAL_NO_PIECE);
+        }
+      }
+    }
+
+    return index;
+  }
+
+  size_t addRange(const CanonicalNode& node, uint64_t begin, uint64_t end) {
+    auto range = kj::heap<CanonicalPiece>();
+    range->node = node;
+    range->isBody = false;
+    range->begin = begin;
+    range->end = end;
+    pieces.add(kj::mv(range));
+    return pieces.size() - 1;
+  }
+
+  uint64_t finishBody(CanonicalPiece& body) {
+    // Fills in the slots of a body piece and returns the canonical size of its subtree.
+
+    uint64_t total = body.node.bodyWords();
+    for (size_t part: body.parts) {
+      if (part == CANONICAL_NO_PIECE) {
+        body.slots.add(CANONICAL_NULL);
+        continue;
+      }
+
+      auto& piece = *pieces[part];
+      if (piece.isBody) {
+        uint64_t size = finishBody(piece);
+        KJ_REQUIRE(size <= MAX_CANONICAL_WORDS,
+                   "Message is too large to be written canonically.");
+        body.slots.add(size);
+        total += size;
+      } else {
+        for (uint32_t size: piece.slots.asPtr().slice(0, piece.rangeSlotCount)) {
+          body.slots.add(size);
+          if (size != CANONICAL_NULL) total += size;
+        }
+      }
+    }
+    return total;
+  }
+
+  class PieceOutput final: public CanonicalOutput {
+  public:
+    PieceOutput(CanonicalParallelWriter& writer, size_t index): writer(writer), index(index) {}
+
+    void finish() {
+      flush();
+
+      {
+        auto lock = writer.state.lockExclusive();
+        if (!isHead && lock->head != index) {
+          // Leave our output for whoever finishes the piece before us.
+          lock->finished[index] = kj::mv(pending);
+          return;
+        }
+        lock->bufferedBytes -= pendingBytes;
+      }
+      writePending();
+
+      // Write out any pieces after us that finished early, then pass the turn on to the first
+      // one still running.
+      for (size_t next = index + 1;; next++) {
+        kj::Vector<kj::Array<byte>> chunks;
+        {
+          auto lock = writer.state.lockExclusive();
+          lock->head = next;
+          if (next == lock->finished.size()) return;
+          KJ_IF_MAYBE(c, lock->finished[next]) {
+            chunks = kj::mv(*c);
+            for (auto& chunk: chunks) lock->bufferedBytes -= chunk.size();
+          } else {
+            return;
+          }
+        }
+        for (auto& chunk: chunks) {
+          writer.output.write(chunk.begin(), chunk.size());
+        }
+      }
+    }
+
+  protected:
+    void writeChunk(kj::ArrayPtr<const byte> chunk) override {
+      if (!isHead) {
+        bool mustWait = false;
+        {
+          auto lock = writer.state.lockExclusive();
+          if (lock->head == index) {
+            isHead = true;
+            lock->bufferedBytes -= pendingBytes;
+          } else {
+            pending.add(kj::heapArray(chunk));
+            pendingBytes += chunk.size();
+            lock->bufferedBytes += chunk.size();
+            mustWait = lock->bufferedBytes > CANONICAL_MAX_BUFFER_BYTES;
+          }
+        }
+
+        if (mustWait) {
+          // Too much is buffered.  Wait for our turn (the head piece never waits, so this will
+          // come).
+          bool failed = writer.state.when([this](const State& s) {
+            return s.head == index || s.failed;
+          }, [this](State& s) {
+            if (s.failed) return true;
+            isHead = true;
+            s.bufferedBytes -= pendingBytes;
+            return false;
+          });
+          KJ_REQUIRE(!failed, "canonical write failed in another thread") { return; }
+          writePending();
+          return;
+        }
+
+        if (!isHead) return;
+        writePending();
+      }
+
+      writer.output.write(chunk.begin(), chunk.size());
+    }
+
+  private:
+    CanonicalParallelWriter& writer;
+    size_t index;
+    bool isHead = false;
+    kj::Vector<kj::Array<byte>> pending;
+    size_t pendingBytes = 0;
+
+    void writePending() {
+      for (auto& chunk: pending) {
+        writer.output.write(chunk.begin(), chunk.size());
+      }
+      pending.clear();
+      pendingBytes = 0;
+    }
+  };
+};
+
+}  // namespace
+
+void StructReader::writeCanonical(kj::OutputStream& output, uint threadCount) {
+  // StructReaders should not have bitwidths other than 1, but let's be safe
+  KJ_REQUIRE((dataSize == ONE * BITS) || (dataSize % BITS_PER_BYTE == ZERO * BITS));
+
+  CanonicalNode root;
+  root.initStruct(segment, reinterpret_cast<const byte*>(data), pointers,
+                  unbound(dataSize / BITS), unbound(pointerCount / POINTERS), nestingLimit);
+
+  if (threadCount > 1) {
+    CanonicalParallelWriter(root, output, threadCount).write();
+    return;
+  }
+
+  kj::Vector<uint32_t> slots;
+  sizeCanonicalSubtree(root, slots);
+
+  CanonicalStreamOutput canonicalOutput(output);
+  writeCanonicalPointer(canonicalOutput, root, 0);
+  const uint32_t* cursor = slots.begin();
+  writeCanonicalSubtree(root, cursor, canonicalOutput);
+  canonicalOutput.flush();
+}
+
+// =======================================================================================
+// ListBuilder
+
+Text::Builder ListBuilder::asText() {
+  KJ_REQUIRE(structDataSize == G(8) * BITS && structPointerCount == ZERO * POINTERS,
+             "Expected Text, got list of non-bytes.") {
+    return Text::Builder();
+  }
+
+  size_t size = unbound(elementCount / ELEMENTS);
+
+  KJ_REQUIRE(size > 0, "Message contains text that is not NUL-terminated.") {
+    return Text::Builder();
+  }
+
+  char* cptr = reinterpret_cast<char*>(ptr);
+  --size;  // NUL terminator
+
+  KJ_REQUIRE(cptr[size] == '\0', "Message contains text that is not NUL-terminated.") {
+    return Text::Builder();
+  }
+
+  return Text::Builder(cptr, size);
+}
+
+Data::Builder ListBuilder::asData() {
+  KJ_REQUIRE(structDataSize == G(8) * BITS && structPointerCount == ZERO * POINTERS,
+             "Expected Text, got list of non-bytes.") {
+    return Data::Builder();
+  }
+
+  return Data::Builder(reinterpret_cast<byte*>(ptr), unbound(elementCount / ELEMENTS));
+}
+
+StructBuilder ListBuilder::getStructElement(ElementCount index) {
+  auto indexBit = upgradeBound<uint64_t>(index) * step;
+  byte* structData = ptr + indexBit / BITS_PER_BYTE;
+  KJ_DASSERT(indexBit % BITS_PER_BYTE == ZERO * BITS);
+  return StructBuilder(segment, capTable, structData,
+      reinterpret_cast<WirePointer*>(structData + structDataSize / BITS_PER_BYTE),
+      structDataSize, structPointerCount);
+}
+
+ListReader ListBuilder::asReader() const {
+  return ListReader(segment, capTable, ptr, elementCount, step, structDataSize, structPointerCount,
+                    elementSize, kj::maxValue);
+}
+
+BuilderArena* ListBuilder::getArena() {
+  return segment->getArena();
+}
+
+CapTableBuilder* ListBuilder::getCapTable() {
+  return capTable;
+}
+
+ListBuilder ListBuilder::imbue(CapTableBuilder* capTable) {
+  auto result = *this;
+  result.capTable = capTable;
+  return result;
+}
+
+// =======================================================================================
+// ListReader
+
+Text::Reader ListReader::asText() {
+  KJ_REQUIRE(structDataSize == G(8) * BITS && structPointerCount == ZERO * POINTERS,
+             "Expected Text, got list of non-bytes.") {
+    return Text::Reader();
+  }
+
+  size_t size = unbound(elementCount / ELEMENTS);
+
+  KJ_REQUIRE(size > 0, "Message contains text that is not NUL-terminated.") {
+    return Text::Reader();
+  }
+
+  const char* cptr = reinterpret_cast<const char*>(ptr);
+  --size;  // NUL terminator
+
+  KJ_REQUIRE(cptr[size] == '\0', "Message contains text that is not NUL-terminated.") {
+    return Text::Reader();
+  }
+
+  return Text::Reader(cptr, size);
+}
 
 Data::Reader ListReader::asData() {
   KJ_REQUIRE(structDataSize == G(8) * BITS && structPointerCount == ZERO * POINTERS,
@@ -3090,6 +4505,183 @@ kj::ArrayPtr<const byte> ListReader::asRawBytes() {
           upgradeBound<uint64_t>(elementCount) * (structDataSize / ELEMENTS)));
 }
 
+namespace {
+
+// Bulk copies out of primitive lists.
+//
+// When the list really is an array of the requested type and the CPU uses the wire byte order,
+// copying is a memcpy().  Otherwise each element is loaded through WireValue, which byte-swaps as
+// needed, at the list's actual step (a struct list read as a primitive list has elements a whole
+// struct apart).  Bit lists are expanded to one byte per element, 16 at a time with SSE2 or NEON.
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == CAPNP_WIRE_BYTE_ORDER && \
+    !CAPNP_DISABLE_ENDIAN_DETECTION
+#define CAPNP_LIST_NATIVE_BYTE_ORDER 1
+#else
+#define CAPNP_LIST_NATIVE_BYTE_ORDER 0
+#endif
+
+template <typename T>
+void copyElements(byte* output, const byte* data, size_t stepBytes, size_t start, size_t count) {
+  const byte* pos = data + start * stepBytes;
+
+  if (CAPNP_LIST_NATIVE_BYTE_ORDER && stepBytes == sizeof(T)) {
+    memcpy(output, pos, count * sizeof(T));
+    return;
+  }
+
+  T* out = reinterpret_cast<T*>(output);
+  for (size_t i = 0; i < count; i++) {
+    out[i] = reinterpret_cast<const WireValue<T>*>(pos)->get();
+    pos += stepBytes;
+  }
+}
+
+template <typename T>
+void gatherElements(byte* output, const byte* data, size_t stepBytes,
+                    kj::ArrayPtr<const uint> indices) {
+  T* out = reinterpret_cast<T*>(output);
+  for (size_t i = 0; i < indices.size(); i++) {
+    out[i] = reinterpret_cast<const WireValue<T>*>(data + indices[i] * stepBytes)->get();
+  }
+}
+
+inline size_t bytesPerDataElement(ElementSize size) {
+  // Size of one element as copied out by copyDataElementsTo():  BIT and VOID take a byte.
+  uint bits = unbound(dataBitsPerElement(size) * ELEMENTS / BITS);
+  return bits < 8 ? 1 : bits / 8;
+}
+
+inline byte getBit(const byte* bits, size_t index) {
+  return (bits[index / 8] >> (index % 8)) & 1;
+}
+
+void unpackBits(byte* output, const byte* bits, size_t start, size_t count) {
+  // Expand `count` bits, starting at bit `start`, to one byte (0 or 1) each.
+
+  size_t i = 0;
+  for (; i < count && (start + i) % 8 != 0; i++) {
+    output[i] = getBit(bits, start + i);
+  }
+
+  // Now `start + i` is at a byte boundary.
+#if __SSE2__
+  const __m128i select = _mm_set_epi8(-128, 64, 32, 16, 8, 4, 2, 1,
+                                      -128, 64, 32, 16, 8, 4, 2, 1);
+  const __m128i one = _mm_set1_epi8(1);
+  for (; i + 16 <= count; i += 16) {
+    uint16_t pair;
+    memcpy(&pair, bits + (start + i) / 8, sizeof(pair));
+
+    // Broadcast the first byte to lanes 0-7 and the second to lanes 8-15, then test one bit in
+    // each lane.
+    __m128i v = _mm_cvtsi32_si128(pair);
+    v = _mm_unpacklo_epi8(v, v);
+    v = _mm_unpacklo_epi16(v, v);
+    v = _mm_unpacklo_epi32(v, v);
+    v = _mm_cmpeq_epi8(_mm_and_si128(v, select), select);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), _mm_and_si128(v, one));
+  }
+#elif __ARM_NEON
+  static const uint8_t SELECT[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+  const uint8x16_t select = vld1q_u8(SELECT);
+  const uint8x16_t one = vdupq_n_u8(1);
+  for (; i + 16 <= count; i += 16) {
+    const byte* pair = bits + (start + i) / 8;
+    uint8x16_t v = vcombine_u8(vdup_n_u8(pair[0]), vdup_n_u8(pair[1]));
+    vst1q_u8(reinterpret_cast<uint8_t*>(output + i), vandq_u8(vtstq_u8(v, select), one));
+  }
+#endif
+
+  for (; i + 8 <= count; i += 8) {
+    byte b = bits[(start + i) / 8];
+    for (uint j = 0; j < 8; j++) {
+      output[i + j] = (b >> j) & 1;
+    }
+  }
+
+  for (; i < count; i++) {
+    output[i] = getBit(bits, start + i);
+  }
+}
+
+#undef CAPNP_LIST_NATIVE_BYTE_ORDER
+
+}  // namespace
+
+void ListReader::copyDataElementsTo(kj::ArrayPtr<byte> output, ElementCount start,
+                                    ElementSize expectedSize) const {
+  size_t bytesPerElement = bytesPerDataElement(expectedSize);
+  size_t first = unbound(start / ELEMENTS);
+  size_t count = output.size() / bytesPerElement;
+  size_t size = unbound(elementCount / ELEMENTS);
+
+  KJ_REQUIRE(output.size() % bytesPerElement == 0, "output is not an array of elements");
+  KJ_REQUIRE(first <= size && count <= size - first, "list range out of bounds") { return; }
+
+  size_t stepBits = unbound(step * ELEMENTS / BITS);
+  switch (expectedSize) {
+    case ElementSize::VOID: break;
+    case ElementSize::BIT:
+      KJ_REQUIRE(stepBits == 1, "not a bit list") { return; }
+      unpackBits(output.begin(), ptr, first, count);
+      break;
+    case ElementSize::BYTE:
+      copyElements<uint8_t>(output.begin(), ptr, stepBits / 8, first, count);
+      break;
+    case ElementSize::TWO_BYTES:
+      copyElements<uint16_t>(output.begin(), ptr, stepBits / 8, first, count);
+      break;
+    case ElementSize::FOUR_BYTES:
+      copyElements<uint32_t>(output.begin(), ptr, stepBits / 8, first, count);
+      break;
+    case ElementSize::EIGHT_BYTES:
+      copyElements<uint64_t>(output.begin(), ptr, stepBits / 8, first, count);
+      break;
+    case ElementSize::POINTER:
+    case ElementSize::INLINE_COMPOSITE:
+      KJ_FAIL_REQUIRE("not a primitive element size") { return; }
+  }
+}
+
+void ListReader::gatherDataElements(kj::ArrayPtr<const uint> indices, kj::ArrayPtr<byte> output,
+                                    ElementSize expectedSize) const {
+  size_t bytesPerElement = bytesPerDataElement(expectedSize);
+  uint size = unbound(elementCount / ELEMENTS);
+
+  KJ_REQUIRE(output.size() == indices.size() * bytesPerElement,
+             "output size doesn't match index count") { return; }
+  for (uint index: indices) {
+    KJ_REQUIRE(index < size, "list index out of bounds", index, size) { return; }
+  }
+
+  size_t stepBits = unbound(step * ELEMENTS / BITS);
+  switch (expectedSize) {
+    case ElementSize::VOID: break;
+    case ElementSize::BIT:
+      KJ_REQUIRE(stepBits == 1, "not a bit list") { return; }
+      for (size_t i = 0; i < indices.size(); i++) {
+        output[i] = getBit(ptr, indices[i]);
+      }
+      break;
+    case ElementSize::BYTE:
+      gatherElements<uint8_t>(output.begin(), ptr, stepBits / 8, indices);
+      break;
+    case ElementSize::TWO_BYTES:
+      gatherElements<uint16_t>(output.begin(), ptr, stepBits / 8, indices);
+      break;
+    case ElementSize::FOUR_BYTES:
+      gatherElements<uint32_t>(output.begin(), ptr, stepBits / 8, indices);
+      break;
+    case ElementSize::EIGHT_BYTES:
+      gatherElements<uint64_t>(output.begin(), ptr, stepBits / 8, indices);
+      break;
+    case ElementSize::POINTER:
+    case ElementSize::INLINE_COMPOSITE:
+      KJ_FAIL_REQUIRE("not a primitive element size") { return; }
+  }
+}
+
 StructReader ListReader::getStructElement(ElementCount index) const {
   KJ_REQUIRE(nestingLimit > 0,
              "Message is too deeply-nested or contains cycles.  See capnp::ReaderOptions.") {
@@ -3396,6 +4988,16 @@ OrphanBuilder OrphanBuilder::copy(
 }
 #endif  // !CAPNP_LITE
 
+OrphanBuilder OrphanBuilder::reference(
+    BuilderArena* arena, CapTableBuilder* capTable, StructReader linkFrom) {
+  return WireHelpers::reference(arena, capTable, linkFrom);
+}
+
+OrphanBuilder OrphanBuilder::reference(
+    BuilderArena* arena, CapTableBuilder* capTable, ListReader linkFrom) {
+  return WireHelpers::reference(arena, capTable, linkFrom);
+}
+
 OrphanBuilder OrphanBuilder::concat(
     BuilderArena* arena, CapTableBuilder* capTable,
     ElementSize elementSize, StructSize structSize,
@@ -3511,6 +5113,7 @@ OrphanBuilder OrphanBuilder::referenceExternalData(BuilderArena* arena, Data::Re
 
 StructBuilder OrphanBuilder::asStruct(StructSize size) {
   KJ_DASSERT(tagAsPtr()->isNull() == (location == nullptr));
+  relocateIfCopyOnWrite();
 
   StructBuilder result = WireHelpers::getWritableStructPointer(
       tagAsPtr(), location, segment, capTable, size, nullptr, segment->getArena());
@@ -3523,6 +5126,7 @@ StructBuilder OrphanBuilder::asStruct(StructSize size) {
 
 ListBuilder OrphanBuilder::asList(ElementSize elementSize) {
   KJ_DASSERT(tagAsPtr()->isNull() == (location == nullptr));
+  relocateIfCopyOnWrite();
 
   ListBuilder result = WireHelpers::getWritableListPointer(
       tagAsPtr(), location, segment, capTable, elementSize, nullptr, segment->getArena());
@@ -3537,6 +5141,7 @@ ListBuilder OrphanBuilder::asList(ElementSize elementSize) {
 
 ListBuilder OrphanBuilder::asStructList(StructSize elementSize) {
   KJ_DASSERT(tagAsPtr()->isNull() == (location == nullptr));
+  relocateIfCopyOnWrite();
 
   ListBuilder result = WireHelpers::getWritableStructListPointer(
       tagAsPtr(), location, segment, capTable, elementSize, nullptr, segment->getArena());
@@ -3549,6 +5154,7 @@ ListBuilder OrphanBuilder::asStructList(StructSize elementSize) {
 
 ListBuilder OrphanBuilder::asListAnySize() {
   KJ_DASSERT(tagAsPtr()->isNull() == (location == nullptr));
+  relocateIfCopyOnWrite();
 
   ListBuilder result = WireHelpers::getWritableListPointerAnySize(
       tagAsPtr(), location, segment, capTable, nullptr, segment->getArena());
@@ -3562,7 +5168,8 @@ ListBuilder OrphanBuilder::asListAnySize() {
 Text::Builder OrphanBuilder::asText() {
   KJ_DASSERT(tagAsPtr()->isNull() == (location == nullptr));
 
-  // Never relocates.
+  // Never relocates, except out of a copy-on-write segment.
+  relocateIfCopyOnWrite();
   return WireHelpers::getWritableTextPointer(
       tagAsPtr(), location, segment, capTable, nullptr, ZERO * BYTES);
 }
@@ -3570,11 +5177,20 @@ Text::Builder OrphanBuilder::asText() {
 Data::Builder OrphanBuilder::asData() {
   KJ_DASSERT(tagAsPtr()->isNull() == (location == nullptr));
 
-  // Never relocates.
+  // Never relocates, except out of a copy-on-write segment.
+  relocateIfCopyOnWrite();
   return WireHelpers::getWritableDataPointer(
       tagAsPtr(), location, segment, capTable, nullptr, ZERO * BYTES);
 }
 
+void OrphanBuilder::relocateIfCopyOnWrite() {
+  if (location != nullptr && segment->isCopyOnWrite()) {
+    WirePointer* ref = tagAsPtr();
+    location = WireHelpers::followFarsForWrite(
+        ref, location, segment, capTable, segment->getArena());
+  }
+}
+
 StructReader OrphanBuilder::asStructReader(StructSize size) const {
   KJ_DASSERT(tagAsPtr()->isNull() == (location == nullptr));
   return WireHelpers::readStructPointer(
@@ -3614,6 +5230,8 @@ bool OrphanBuilder::truncate(ElementCount uncheckedSize, bool isText) {
   ListElementCount size = assertMaxBits<LIST_ELEMENT_COUNT_BITS>(uncheckedSize,
       []() { KJ_FAIL_REQUIRE("requested list size is too large"); });
 
+  relocateIfCopyOnWrite();
+
   WirePointer* ref = tagAsPtr();
   SegmentBuilder* segment = this->segment;
 
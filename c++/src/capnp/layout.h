@@ -57,6 +57,10 @@
 // and blow away NaN payloads, because no one uses them anyway.
 #endif
 
+namespace kj {
+class OutputStream;
+}
+
 namespace capnp {
 
 #if !CAPNP_LITE
@@ -602,6 +606,10 @@ public:
 
   kj::Array<word> canonicalize();
 
+  void writeCanonical(kj::OutputStream& output, uint threadCount = 1);
+  // Writes exactly the bytes canonicalize() would return, without building the canonical copy
+  // in memory.  With threadCount > 1, the message is sized and written on that many threads.
+
   template <typename T>
   KJ_ALWAYS_INLINE(bool hasDataField(StructDataOffset offset) const);
   // Return true if the field is set to something other than its default value.
@@ -786,6 +794,23 @@ public:
   KJ_ALWAYS_INLINE(T getDataElement(ElementCount index) const);
   // Get the element of the given type at the given index.
 
+  template <typename T>
+  inline kj::Maybe<kj::ArrayPtr<const T>> asDataArray() const;
+  // If the elements can be used in place as an array of T -- they are exactly sizeof(T) bytes
+  // apart (i.e. this isn't a struct list read as a primitive list), suitably aligned, and the CPU
+  // uses the wire byte order -- return them.  Otherwise return null.  Never succeeds for bools.
+
+  void copyDataElementsTo(kj::ArrayPtr<byte> output, ElementCount start,
+                          ElementSize expectedSize) const;
+  // Fill `output` with consecutive elements beginning at `start`, as an array of values of the type
+  // that `expectedSize` describes, in the CPU's byte order.  For BIT, each element becomes one
+  // byte, 0 or 1 (i.e. a bool), and for VOID, one unspecified byte.  Throws if the range is out of
+  // bounds.
+
+  void gatherDataElements(kj::ArrayPtr<const uint> indices, kj::ArrayPtr<byte> output,
+                          ElementSize expectedSize) const;
+  // Like copyDataElementsTo(), but copies the elements at the given indexes, which are checked.
+
   KJ_ALWAYS_INLINE(PointerReader getPointerElement(ElementCount index) const);
 
   StructReader getStructElement(ElementCount index) const;
@@ -881,6 +906,13 @@ public:
 
   static OrphanBuilder referenceExternalData(BuilderArena* arena, Data::Reader data);
 
+  static OrphanBuilder reference(BuilderArena* arena, CapTableBuilder* capTable,
+                                 StructReader linkFrom);
+  static OrphanBuilder reference(BuilderArena* arena, CapTableBuilder* capTable,
+                                 ListReader linkFrom);
+  // Like copy(), but wherever possible links to `linkFrom`'s memory, adding its segments to the
+  // arena as copy-on-write external segments.  See Orphanage::newOrphanReference().
+
   OrphanBuilder& operator=(const OrphanBuilder& other) = delete;
   inline OrphanBuilder& operator=(OrphanBuilder&& other);
 
@@ -960,6 +992,10 @@ private:
   // Erase the target object, zeroing it out and possibly reclaiming the memory.  Called when
   // the OrphanBuilder is being destroyed or overwritten and it is non-null.
 
+  void relocateIfCopyOnWrite();
+  // If the object is in a copy-on-write segment, move it into writable space.  Called before
+  // returning a Builder for the object.
+
   friend struct WireHelpers;
 };
 
@@ -1233,6 +1269,21 @@ inline Void ListReader::getDataElement<Void>(ElementCount index) const {
   return VOID;
 }
 
+template <typename T>
+inline kj::Maybe<kj::ArrayPtr<const T>> ListReader::asDataArray() const {
+  if (elementCount == ZERO * ELEMENTS) return kj::ArrayPtr<const T>();
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == CAPNP_WIRE_BYTE_ORDER && \
+    !CAPNP_DISABLE_ENDIAN_DETECTION
+  if (!kj::isSameType<T, bool>() && unbound(step * ELEMENTS / BITS) == sizeof(T) * 8 &&
+      reinterpret_cast<uintptr_t>(ptr) % alignof(T) == 0) {
+    return kj::arrayPtr(reinterpret_cast<const T*>(ptr), unbound(elementCount / ELEMENTS));
+  }
+#endif
+
+  return nullptr;
+}
+
 inline PointerReader ListReader::getPointerElement(ElementCount index) const {
   return PointerReader(segment, capTable, reinterpret_cast<const WirePointer*>(
       ptr + upgradeBound<uint64_t>(index) * step / BITS_PER_BYTE), nestingLimit);
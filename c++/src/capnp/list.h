@@ -98,6 +98,12 @@ private:
       : container(container), index(index) {}
 };
 
+template <typename T> struct ListSumAccumulator_ { typedef uint64_t Type; };
+template <> struct ListSumAccumulator_<float> { typedef float Type; };
+template <> struct ListSumAccumulator_<double> { typedef double Type; };
+// Integer sums are accumulated as uint64_t so that overflow wraps (mod 2^bits, once truncated
+// back to T) rather than being undefined.
+
 }  // namespace _ (private)
 
 template <typename T>
@@ -127,6 +133,63 @@ struct List<T, Kind::PRIMITIVE> {
       return reader.totalSize().asPublic();
     }
 
+    // Bulk access ---------------------------------------------------
+    //
+    // Element-at-a-time access through operator[] goes through bounds checks and (on big-endian
+    // CPUs) byte swapping for every element.  Code that scans whole columns should use these
+    // instead.
+
+    inline kj::Maybe<kj::ArrayPtr<const T>> asArrayPtr() const {
+      // Returns the list contents in place, if they can be used directly as an array of T: the CPU
+      // is little-endian, the list is really a List(T) (not, say, a struct list being read as one),
+      // and it is suitably aligned.  Always null for List(Bool), which is a bit array.
+      return reader.template asDataArray<T>();
+    }
+
+    inline void copyTo(kj::ArrayPtr<T> output, uint start = 0) const {
+      // Copy elements [start, start + output.size()) to `output`, which must be in bounds.  This
+      // is a memcpy() when possible; List(Bool) is unpacked with SIMD where available.
+      reader.copyDataElementsTo(output.asBytes(), bounded(start) * ELEMENTS,
+                                _::elementSizeForType<T>());
+    }
+
+    inline void gather(kj::ArrayPtr<const uint> indices, kj::ArrayPtr<T> output) const {
+      // Set output[i] to the element at indices[i].  All indices are bounds-checked first.
+      KJ_IREQUIRE(indices.size() == output.size());
+      reader.gatherDataElements(indices, output.asBytes(), _::elementSizeForType<T>());
+    }
+
+    T sum() const {
+      // Sum of all elements.  Integers wrap on overflow.  Floating-point elements are not added
+      // strictly left-to-right (that would defeat vectorization), so the rounding may differ
+      // slightly from a naive loop.
+      typedef typename _::ListSumAccumulator_<T>::Type Acc;
+      Acc acc[4] = { 0, 0, 0, 0 };
+      forEachChunk([&](kj::ArrayPtr<const T> chunk) {
+        size_t i = 0;
+        for (; i + 4 <= chunk.size(); i += 4) {
+          acc[0] += static_cast<Acc>(chunk[i]);
+          acc[1] += static_cast<Acc>(chunk[i + 1]);
+          acc[2] += static_cast<Acc>(chunk[i + 2]);
+          acc[3] += static_cast<Acc>(chunk[i + 3]);
+        }
+        for (; i < chunk.size(); i++) {
+          acc[0] += static_cast<Acc>(chunk[i]);
+        }
+      });
+      return static_cast<T>((acc[0] + acc[1]) + (acc[2] + acc[3]));
+    }
+
+    kj::Maybe<T> min() const {
+      // Smallest element, or null if the list is empty.  Unspecified if there are NaNs.
+      return reduce([](T a, T b) { return b < a ? b : a; });
+    }
+
+    kj::Maybe<T> max() const {
+      // Largest element, or null if the list is empty.  Unspecified if there are NaNs.
+      return reduce([](T a, T b) { return a < b ? b : a; });
+    }
+
   private:
     _::ListReader reader;
     template <typename U, Kind K>
@@ -136,6 +199,33 @@ struct List<T, Kind::PRIMITIVE> {
     friend class Orphanage;
     template <typename U, Kind K>
     friend struct ToDynamic_;
+
+    template <typename Func>
+    void forEachChunk(Func&& func) const {
+      // Call func() on successive arrays which together hold the whole list: the list itself if
+      // asArrayPtr() works, otherwise a stack buffer that copyTo() refills.
+      KJ_IF_MAYBE(array, asArrayPtr()) {
+        func(*array);
+      } else {
+        T buffer[256];
+        uint n = size();
+        for (uint i = 0; i < n; i += kj::size(buffer)) {
+          auto chunk = kj::arrayPtr(buffer, kj::min(n - i, uint(kj::size(buffer))));
+          copyTo(chunk, i);
+          func(chunk.asConst());
+        }
+      }
+    }
+
+    template <typename Func>
+    kj::Maybe<T> reduce(Func&& func) const {
+      if (size() == 0) return nullptr;
+      T acc = (*this)[0];
+      forEachChunk([&](kj::ArrayPtr<const T> chunk) {
+        for (T value: chunk) acc = func(acc, value);
+      });
+      return acc;
+    }
   };
 
   class Builder {
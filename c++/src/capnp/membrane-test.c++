@@ -372,6 +372,75 @@ KJ_TEST("revoke membrane") {
       thing.passThroughRequest().send().wait(env.io.waitScope));
 }
 
+class CountingPolicy final: public MembranePolicy, public kj::Refcounted {
+  // Intercepts Thing.intercept() like MembranePolicyImpl, counts the decisions it makes, and lets
+  // the membrane cache pass-through decisions.
+
+public:
+  uint inboundCount = 0;
+
+  kj::Maybe<Capability::Client> inboundCall(uint64_t interfaceId, uint16_t methodId,
+                                            Capability::Client target) override {
+    ++inboundCount;
+    if (interfaceId == capnp::typeId<Thing>() && methodId == 1) {
+      return Capability::Client(kj::heap<ThingImpl>("inbound"));
+    } else {
+      return nullptr;
+    }
+  }
+
+  kj::Maybe<Capability::Client> outboundCall(uint64_t interfaceId, uint16_t methodId,
+                                             Capability::Client target) override {
+    return nullptr;
+  }
+
+  bool cachePassThrough(uint64_t interfaceId, uint16_t methodId) override {
+    return true;
+  }
+
+  kj::Own<MembranePolicy> addRef() override {
+    return kj::addRef(*this);
+  }
+};
+
+KJ_TEST("membrane caches pass-through decisions") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  auto policy = kj::refcounted<CountingPolicy>();
+  test::TestMembrane::Client membraned = membrane(kj::heap<TestMembraneImpl>(), policy->addRef());
+
+  auto thing = membraned.makeThingRequest().send().wait(waitScope).getThing();
+  KJ_EXPECT(policy->inboundCount == 1);
+
+  for (uint i = 0; i < 3; i++) {
+    KJ_EXPECT(thing.passThroughRequest().send().wait(waitScope).getText() == "inside");
+  }
+  KJ_EXPECT(policy->inboundCount == 2);
+
+  // Redirects aren't cached.
+  for (uint i = 0; i < 3; i++) {
+    KJ_EXPECT(thing.interceptRequest().send().wait(waitScope).getText() == "inbound");
+  }
+  KJ_EXPECT(policy->inboundCount == 5);
+}
+
+KJ_TEST("membrane reuses wrappers") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  auto policy = kj::refcounted<MembranePolicyImpl>();
+
+  Thing::Client inner = kj::heap<ThingImpl>("inside");
+  auto hook1 = ClientHook::from(membrane(inner, policy->addRef()));
+  auto hook2 = ClientHook::from(membrane(inner, policy->addRef()));
+  KJ_EXPECT(hook1.get() == hook2.get());
+
+  // Once all references are gone, the next crossing makes a new wrapper, which still works.
+  hook1 = nullptr;
+  hook2 = nullptr;
+  Thing::Client wrapped = membrane(inner, policy->addRef());
+  KJ_EXPECT(wrapped.passThroughRequest().send().wait(waitScope).getText() == "inside");
+}
+
 }  // namespace
 }  // namespace _
 }  // namespace capnp
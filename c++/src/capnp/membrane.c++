@@ -21,9 +21,31 @@
 
 #include "membrane.h"
 #include <kj/debug.h>
+#include <kj/map.h>
 
 namespace capnp {
 
+namespace _ {  // private
+
+class MembraneWrapperCache {
+public:
+  kj::HashMap<ClientHook*, ClientHook*> exported;
+  kj::HashMap<ClientHook*, ClientHook*> imported;
+  // Map each capability to the live MembraneHook wrapping it, for exportInternal() and
+  // importExternal() respectively.  A MembraneHook removes its entry when it is destroyed or
+  // revoked.
+
+  static kj::HashMap<ClientHook*, ClientHook*>& get(MembranePolicy& policy, bool reverse) {
+    if (policy.wrapperCache == nullptr) {
+      policy.wrapperCache = kj::heap<MembraneWrapperCache>();
+    }
+    auto& cache = *KJ_ASSERT_NONNULL(policy.wrapperCache);
+    return reverse ? cache.imported : cache.exported;
+  }
+};
+
+}  // namespace _ (private)
+
 namespace {
 
 static const char DUMMY = 0;
@@ -313,11 +335,33 @@ public:
       : inner(kj::mv(inner)), policy(kj::mv(policyParam)), reverse(reverse) {
     KJ_IF_MAYBE(r, policy->onRevoked()) {
       revocationTask = r->eagerlyEvaluate([this](kj::Exception&& exception) {
+        uncache();
+        passThroughMethods.clear();
         this->inner = newBrokenCap(kj::mv(exception));
       });
     }
   }
 
+  ~MembraneHook() noexcept(false) {
+    uncache();
+  }
+
+  static kj::Own<ClientHook> getOrCreate(
+      kj::Own<ClientHook>&& inner, MembranePolicy& policy, bool reverse) {
+    // Get the wrapper for `inner`, reusing the existing one if there is one.
+
+    auto& cache = _::MembraneWrapperCache::get(policy, reverse);
+    KJ_IF_MAYBE(existing, cache.find(inner.get())) {
+      return (*existing)->addRef();
+    }
+
+    ClientHook* key = inner.get();
+    auto hook = kj::refcounted<MembraneHook>(kj::mv(inner), policy.addRef(), reverse);
+    hook->cachedAs = key;
+    cache.insert(key, hook.get());
+    return kj::mv(hook);
+  }
+
   static kj::Own<ClientHook> wrap(ClientHook& cap, MembranePolicy& policy, bool reverse) {
     if (cap.getBrand() == MEMBRANE_BRAND) {
       auto& otherMembrane = kj::downcast<MembraneHook>(cap);
@@ -364,10 +408,7 @@ public:
       return r->get()->newCall(interfaceId, methodId, sizeHint);
     }
 
-    auto redirect = reverse
-        ? policy->outboundCall(interfaceId, methodId, Capability::Client(inner->addRef()))
-        : policy->inboundCall(interfaceId, methodId, Capability::Client(inner->addRef()));
-    KJ_IF_MAYBE(r, redirect) {
+    KJ_IF_MAYBE(r, getRedirect(interfaceId, methodId)) {
       // The policy says that *if* this capability points into the membrane, then we want to
       // redirect the call. However, if this capability is a promise, then it could resolve to
       // something outside the membrane later. We have to wait before we actually redirect,
@@ -392,10 +433,7 @@ public:
       return r->get()->call(interfaceId, methodId, kj::mv(context));
     }
 
-    auto redirect = reverse
-        ? policy->outboundCall(interfaceId, methodId, Capability::Client(inner->addRef()))
-        : policy->inboundCall(interfaceId, methodId, Capability::Client(inner->addRef()));
-    KJ_IF_MAYBE(r, redirect) {
+    KJ_IF_MAYBE(r, getRedirect(interfaceId, methodId)) {
       // The policy says that *if* this capability points into the membrane, then we want to
       // redirect the call. However, if this capability is a promise, then it could resolve to
       // something outside the membrane later. We have to wait before we actually redirect,
@@ -475,6 +513,40 @@ private:
   bool reverse;
   kj::Maybe<kj::Own<ClientHook>> resolved;
   kj::Promise<void> revocationTask = nullptr;
+
+  ClientHook* cachedAs = nullptr;
+  // Key of our entry in the policy's wrapper cache, if we have one.
+
+  struct Method {
+    uint64_t interfaceId;
+    uint16_t methodId;
+  };
+  kj::Vector<Method> passThroughMethods;
+  // Methods for which the policy has said calls pass through, and that it may cache.  Usually
+  // there are only a few, so a linear search is fastest.
+
+  kj::Maybe<Capability::Client> getRedirect(uint64_t interfaceId, uint16_t methodId) {
+    for (auto& method: passThroughMethods) {
+      if (method.interfaceId == interfaceId && method.methodId == methodId) {
+        return nullptr;
+      }
+    }
+
+    auto redirect = reverse
+        ? policy->outboundCall(interfaceId, methodId, Capability::Client(inner->addRef()))
+        : policy->inboundCall(interfaceId, methodId, Capability::Client(inner->addRef()));
+    if (redirect == nullptr && policy->cachePassThrough(interfaceId, methodId)) {
+      passThroughMethods.add(Method { interfaceId, methodId });
+    }
+    return redirect;
+  }
+
+  void uncache() {
+    if (cachedAs != nullptr) {
+      _::MembraneWrapperCache::get(*policy, reverse).erase(cachedAs);
+      cachedAs = nullptr;
+    }
+  }
 };
 
 kj::Own<ClientHook> membrane(kj::Own<ClientHook> inner, MembranePolicy& policy, bool reverse) {
@@ -483,14 +555,17 @@ kj::Own<ClientHook> membrane(kj::Own<ClientHook> inner, MembranePolicy& policy,
 
 }  // namespace
 
+MembranePolicy::MembranePolicy() {}
+MembranePolicy::~MembranePolicy() noexcept(false) {}
+
 Capability::Client MembranePolicy::importExternal(Capability::Client external) {
-  return Capability::Client(kj::refcounted<MembraneHook>(
-      ClientHook::from(kj::mv(external)), addRef(), true));
+  return Capability::Client(MembraneHook::getOrCreate(
+      ClientHook::from(kj::mv(external)), *this, true));
 }
 
 Capability::Client MembranePolicy::exportInternal(Capability::Client internal) {
-  return Capability::Client(kj::refcounted<MembraneHook>(
-      ClientHook::from(kj::mv(internal)), addRef(), false));
+  return Capability::Client(MembraneHook::getOrCreate(
+      ClientHook::from(kj::mv(internal)), *this, false));
 }
 
 Capability::Client MembranePolicy::importInternal(
@@ -51,11 +51,16 @@
 
 namespace capnp {
 
+namespace _ { class MembraneWrapperCache; }  // private
+
 class MembranePolicy {
   // Applications may implement this interface to define a membrane policy, which allows some
   // calls crossing the membrane to be blocked or redirected.
 
 public:
+  MembranePolicy();
+  virtual ~MembranePolicy() noexcept(false);
+
   virtual kj::Maybe<Capability::Client> inboundCall(
       uint64_t interfaceId, uint16_t methodId, Capability::Client target) = 0;
   // Given an inbound call (a call originating "outside" the membrane destined for an object
@@ -93,6 +98,15 @@ public:
   //   will enter and then exit the membrane, but calls on the eventual resolution will not cross
   //   the membrane at all, so it is important that these two cases behave the same.
 
+  virtual bool cachePassThrough(uint64_t interfaceId, uint16_t methodId) { return false; }
+  // Return true if, once `inboundCall()` or `outboundCall()` has returned null for this method
+  // on some capability, it will keep doing so for that capability.  The membrane then remembers
+  // the decision and passes later calls to that method on that capability straight through,
+  // without calling the policy.  Decisions to redirect or throw are never cached.
+  //
+  // When `onRevoked()` rejects, all remembered decisions are forgotten, so the policy is again
+  // consulted for every call as described there.
+
   virtual kj::Own<MembranePolicy> addRef() = 0;
   // Return a new owned pointer to the same policy.
   //
@@ -163,6 +177,13 @@ public:
   // capability passed into the membrane and then back out.
   //
   // The default implementation simply returns `external`.
+
+private:
+  kj::Maybe<kj::Own<_::MembraneWrapperCache>> wrapperCache;
+  // Wrappers created by the default importExternal() and exportInternal(), so that a capability
+  // that crosses the membrane over and over gets the same wrapper each time.
+
+  friend class _::MembraneWrapperCache;
 };
 
 Capability::Client membrane(Capability::Client inner, kj::Own<MembranePolicy> policy);
@@ -0,0 +1,198 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include "message-archive.h"
+#include <kj/debug.h>
+#include <kj/filesystem.h>
+#include <kj/io.h>
+#include "test-util.h"
+#include <kj/compat/gtest.h>
+
+namespace capnp {
+namespace _ {  // private
+namespace {
+
+kj::Array<word> toWords(kj::ArrayPtr<const byte> bytes) {
+  KJ_ASSERT(bytes.size() % sizeof(word) == 0);
+  auto result = kj::heapArray<word>(bytes.size() / sizeof(word));
+  memcpy(result.asBytes().begin(), bytes.begin(), bytes.size());
+  return result;
+}
+
+kj::Array<word> writeTestArchive(uint count, MessageArchiveWriter::Options options) {
+  // Message i has `i` in its uInt32Field.  Every third message is split into many small segments.
+  kj::VectorOutputStream output;
+  MessageArchiveWriter writer(output, options);
+  for (uint i = 0; i < count; i++) {
+    MallocMessageBuilder builder(i % 3 == 0 ? 16 : 1024, AllocationStrategy::FIXED_SIZE);
+    auto root = builder.initRoot<TestAllTypes>();
+    initTestMessage(root);
+    root.setUInt32Field(i);
+    EXPECT_EQ(i, writer.size());
+    writer.add(builder);
+  }
+  writer.finish();
+  return toWords(output.getArray());
+}
+
+TEST(MessageArchive, RoundTrip) {
+  MessageArchiveWriter::Options options;
+  options.blockWords = 256;
+  auto words = writeTestArchive(100, options);
+
+  MessageArchive archive(words);
+  EXPECT_EQ(100, archive.size());
+  EXPECT_GT(archive.getBlockCount(), 1);
+
+  for (uint i: {0u, 99u, 37u, 1u, 64u}) {
+    auto reader = archive.getMessage(i);
+    auto root = reader->getRoot<TestAllTypes>();
+    EXPECT_EQ(i, root.getUInt32Field());
+    EXPECT_EQ("foo", root.getTextField());
+  }
+
+  uint64_t expected = 0;
+  archive.forEach([&](uint64_t index, MessageReader& reader) {
+    EXPECT_EQ(expected, index);
+    EXPECT_EQ(index, reader.getRoot<TestAllTypes>().getUInt32Field());
+    ++expected;
+  });
+  EXPECT_EQ(100, expected);
+
+  expected = 40;
+  archive.forEach([&](uint64_t index, MessageReader& reader) {
+    EXPECT_EQ(expected++, index);
+    EXPECT_EQ(index, reader.getRoot<TestAllTypes>().getUInt32Field());
+  }, 40, 60);
+  EXPECT_EQ(60, expected);
+
+  KJ_EXPECT_THROW_MESSAGE("out of range", archive.getMessage(100));
+}
+
+TEST(MessageArchive, Empty) {
+  auto words = writeTestArchive(0, MessageArchiveWriter::Options());
+  MessageArchive archive(words);
+  EXPECT_EQ(0, archive.size());
+  EXPECT_EQ(0, archive.getBlockCount());
+  archive.parallelForEach(4, [](uint64_t, MessageReader&) { ADD_FAILURE(); });
+}
+
+TEST(MessageArchive, ParallelForEach) {
+  MessageArchiveWriter::Options options;
+  options.blockWords = 128;
+  auto words = writeTestArchive(200, options);
+  MessageArchive archive(words);
+
+  for (uint threadCount: {1u, 4u, 64u}) {
+    auto seen = kj::heapArray<uint>(200);
+    for (auto& s: seen) s = 0;
+    archive.parallelForEach(threadCount, [&](uint64_t index, MessageReader& reader) {
+      KJ_ASSERT(reader.getRoot<TestAllTypes>().getUInt32Field() == index);
+      __atomic_add_fetch(&seen[index], 1, __ATOMIC_RELAXED);
+    });
+    for (auto s: seen) EXPECT_EQ(1, s);
+  }
+
+  KJ_EXPECT_THROW_MESSAGE("boom", archive.parallelForEach(4,
+      [&](uint64_t index, MessageReader& reader) {
+    if (index == 150) KJ_FAIL_ASSERT("boom");
+  }));
+}
+
+TEST(MessageArchive, MappedFile) {
+  auto file = kj::newInMemoryFile(kj::nullClock());
+  {
+    MessageArchiveWriter::Options options;
+    options.blockWords = 512;
+    auto words = writeTestArchive(50, options);
+    file->write(0, words.asBytes());
+  }
+
+  MessageArchive archive(*file);
+  EXPECT_EQ(50, archive.size());
+  auto reader = archive.getMessage(42);
+  EXPECT_EQ(42, reader->getRoot<TestAllTypes>().getUInt32Field());
+  EXPECT_EQ("foo", reader->getRoot<TestAllTypes>().getTextField());
+}
+
+class XorCodec final: public ArchiveCodec {
+  // Not compression at all -- drops trailing zero bytes and scrambles the rest, which is enough to
+  // tell whether blocks went through the codec.
+
+public:
+  uint32_t getId() const override { return 0x524f58; }
+
+  kj::Array<byte> compress(kj::ArrayPtr<const byte> input) const override {
+    size_t size = input.size();
+    while (size > 0 && input[size - 1] == 0) --size;
+    auto result = kj::heapArray<byte>(size);
+    for (auto i: kj::indices(result)) result[i] = input[i] ^ 0x5a;
+    return result;
+  }
+
+  void decompress(kj::ArrayPtr<const byte> input, kj::ArrayPtr<byte> output) const override {
+    KJ_REQUIRE(input.size() <= output.size(), "corrupt block");
+    for (auto i: kj::indices(input)) output[i] = input[i] ^ 0x5a;
+    memset(output.begin() + input.size(), 0, output.size() - input.size());
+  }
+};
+
+TEST(MessageArchive, Codec) {
+  XorCodec codec;
+  MessageArchiveWriter::Options options;
+  options.blockWords = 256;
+  options.codec = codec;
+  auto words = writeTestArchive(30, options);
+
+  MessageArchive archive(words, codec);
+  EXPECT_EQ(30, archive.size());
+  archive.forEach([&](uint64_t index, MessageReader& reader) {
+    EXPECT_EQ(index, reader.getRoot<TestAllTypes>().getUInt32Field());
+  });
+  EXPECT_EQ(7, archive.getMessage(7)->getRoot<TestAllTypes>().getUInt32Field());
+
+  MessageArchive noCodec(words);
+  KJ_EXPECT_THROW_MESSAGE("no codec was given", noCodec.getMessage(0));
+}
+
+TEST(MessageArchive, Corrupt) {
+  auto words = writeTestArchive(10, MessageArchiveWriter::Options());
+
+  KJ_EXPECT_THROW_MESSAGE("too small", MessageArchive(words.slice(0, 2)));
+  KJ_EXPECT_THROW_MESSAGE("truncated", MessageArchive(words.slice(0, words.size() - 1)));
+
+  // Point the block table past the end of the file.
+  auto copy = toWords(words.asBytes());
+  reinterpret_cast<WireValue<uint64_t>*>(copy.end() - 2)->set(copy.size());
+  KJ_EXPECT_THROW_MESSAGE("index is corrupt", MessageArchive(copy.asPtr()));
+
+  // Point the only block past the end of the data.
+  copy = toWords(words.asBytes());
+  uint64_t tableOffset = reinterpret_cast<WireValue<uint64_t>*>(copy.end() - 2)->get();
+  reinterpret_cast<WireValue<uint64_t>*>(copy.begin() + tableOffset)->set(copy.size());
+  MessageArchive archive(copy.asPtr());
+  KJ_EXPECT_THROW_MESSAGE("out of bounds", archive.getMessage(0));
+}
+
+}  // namespace
+}  // namespace _ (private)
+}  // namespace capnp
@@ -0,0 +1,375 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "message-archive.h"
+#include "endian.h"
+#include <kj/debug.h>
+#include <string.h>
+
+#if !CAPNP_LITE
+#include <kj/thread.h>
+#endif
+
+namespace capnp {
+
+namespace {
+
+constexpr uint64_t ARCHIVE_MAGIC = 0x314352414e504143ull;  // "CAPNARC1" in little-endian.
+
+struct WireBlockEntry {
+  _::WireValue<uint64_t> offsetWords;
+  _::WireValue<uint64_t> storedBytes;
+  _::WireValue<uint64_t> uncompressedWords;
+  _::WireValue<uint32_t> codec;
+  _::WireValue<uint32_t> messageCount;
+};
+static_assert(sizeof(WireBlockEntry) == 4 * sizeof(word), "unexpected block entry size");
+
+struct WireMessageEntry {
+  _::WireValue<uint32_t> block;
+  _::WireValue<uint32_t> offsetWords;
+};
+static_assert(sizeof(WireMessageEntry) == sizeof(word), "unexpected message entry size");
+
+struct WireFooter {
+  _::WireValue<uint64_t> blockCount;
+  _::WireValue<uint64_t> messageCount;
+  _::WireValue<uint64_t> tableOffsetWords;
+  _::WireValue<uint64_t> magic;
+};
+static_assert(sizeof(WireFooter) == 4 * sizeof(word), "unexpected footer size");
+
+inline size_t wordsForBytes(uint64_t bytes) {
+  return (bytes + sizeof(word) - 1) / sizeof(word);
+}
+
+}  // namespace
+
+// =======================================================================================
+
+MessageArchiveWriter::MessageArchiveWriter(kj::OutputStream& output, Options options)
+    : output(output), options(options) {
+  KJ_REQUIRE(options.blockWords > 0 && options.blockWords <= (1u << 30),
+             "blockWords out of range", options.blockWords);
+  KJ_IF_MAYBE(c, options.codec) {
+    KJ_REQUIRE(c->getId() != 0, "archive codec ID must not be zero");
+  }
+
+  _::WireValue<uint64_t> magic;
+  magic.set(ARCHIVE_MAGIC);
+  write(kj::arrayPtr(&magic, 1).asBytes());
+}
+
+MessageArchiveWriter::MessageArchiveWriter(kj::OutputStream& output)
+    : MessageArchiveWriter(output, Options()) {}
+
+MessageArchiveWriter::~MessageArchiveWriter() noexcept(false) {}
+
+void MessageArchiveWriter::write(kj::ArrayPtr<const byte> bytes) {
+  KJ_DASSERT(bytes.size() % sizeof(word) == 0);
+  output.write(bytes.begin(), bytes.size());
+  positionWords += bytes.size() / sizeof(word);
+}
+
+void MessageArchiveWriter::add(MessageBuilder& builder) {
+  add(builder.getSegmentsForOutput());
+}
+
+void MessageArchiveWriter::add(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
+  KJ_REQUIRE(!finished, "can't add to a finished archive");
+  KJ_REQUIRE(segments.size() > 0, "Tried to serialize uninitialized message.");
+  KJ_REQUIRE(blockTable.size() < kj::maxValueForBits<32>(), "too many blocks in archive");
+
+  // Lay the message out exactly as messageToFlatArray() would, directly in the block buffer.
+  size_t start = blockSize;
+  size_t tableWords = segments.size() / 2 + 1;
+  word* pos = growBlock(computeSerializedSizeInWords(segments));
+
+  auto table = reinterpret_cast<_::WireValue<uint32_t>*>(pos);
+  table[0].set(segments.size() - 1);
+  for (uint i = 0; i < segments.size(); i++) {
+    table[i + 1].set(segments[i].size());
+  }
+  if (segments.size() % 2 == 0) {
+    table[segments.size() + 1].set(0);
+  }
+
+  // The block is just storage until the message is read back, so the segments' bytes are copied
+  // into it directly (`word` itself can't be copied).
+  word* dst = pos + tableWords;
+  for (auto& segment: segments) {
+    memcpy(static_cast<void*>(dst), segment.begin(), segment.size() * sizeof(word));
+    dst += segment.size();
+  }
+
+  messageTable.add(MessageEntry { static_cast<uint32_t>(blockTable.size()),
+                                  static_cast<uint32_t>(start) });
+
+  if (blockSize >= options.blockWords) flushBlock();
+}
+
+word* MessageArchiveWriter::growBlock(size_t words) {
+  size_t newSize = blockSize + words;
+  if (newSize > block.size()) {
+    auto newBlock = kj::heapArray<word>(kj::max(newSize, kj::max(block.size() * 2,
+                                                                 options.blockWords)));
+    memcpy(newBlock.asBytes().begin(), block.begin(), blockSize * sizeof(word));
+    block = kj::mv(newBlock);
+  }
+  word* result = block.begin() + blockSize;
+  blockSize = newSize;
+  return result;
+}
+
+void MessageArchiveWriter::flushBlock() {
+  if (blockSize == 0) return;
+
+  BlockEntry entry;
+  entry.offsetWords = positionWords;
+  entry.uncompressedWords = blockSize;
+  entry.messageCount = messageTable.size() - blockFirstMessage;
+  blockFirstMessage = messageTable.size();
+
+  auto bytes = block.slice(0, blockSize).asBytes();
+  bool stored = false;
+  KJ_IF_MAYBE(c, options.codec) {
+    auto compressed = c->compress(bytes);
+    if (compressed.size() < bytes.size()) {
+      entry.codec = c->getId();
+      entry.storedBytes = compressed.size();
+      output.write(compressed.begin(), compressed.size());
+
+      static const byte PADDING[sizeof(word)] = {};
+      size_t padding = wordsForBytes(compressed.size()) * sizeof(word) - compressed.size();
+      output.write(PADDING, padding);
+      positionWords += wordsForBytes(compressed.size());
+      stored = true;
+    }
+  }
+  if (!stored) {
+    entry.codec = 0;
+    entry.storedBytes = bytes.size();
+    write(bytes);
+  }
+
+  blockTable.add(entry);
+  blockSize = 0;
+}
+
+void MessageArchiveWriter::finish() {
+  KJ_REQUIRE(!finished, "archive already finished");
+  flushBlock();
+  finished = true;
+
+  uint64_t tableOffset = positionWords;
+
+  auto blockEntries = kj::heapArray<WireBlockEntry>(blockTable.size());
+  for (auto i: kj::indices(blockTable)) {
+    auto& entry = blockTable[i];
+    blockEntries[i].offsetWords.set(entry.offsetWords);
+    blockEntries[i].storedBytes.set(entry.storedBytes);
+    blockEntries[i].uncompressedWords.set(entry.uncompressedWords);
+    blockEntries[i].codec.set(entry.codec);
+    blockEntries[i].messageCount.set(entry.messageCount);
+  }
+  write(blockEntries.asBytes());
+
+  auto messageEntries = kj::heapArray<WireMessageEntry>(messageTable.size());
+  for (auto i: kj::indices(messageTable)) {
+    messageEntries[i].block.set(messageTable[i].block);
+    messageEntries[i].offsetWords.set(messageTable[i].offsetWords);
+  }
+  write(messageEntries.asBytes());
+
+  WireFooter footer;
+  footer.blockCount.set(blockTable.size());
+  footer.messageCount.set(messageTable.size());
+  footer.tableOffsetWords.set(tableOffset);
+  footer.magic.set(ARCHIVE_MAGIC);
+  write(kj::arrayPtr(&footer, 1).asBytes());
+}
+
+#if !CAPNP_LITE
+// =======================================================================================
+
+struct MessageArchive::BlockEntry: public WireBlockEntry {};
+struct MessageArchive::MessageEntry: public WireMessageEntry {};
+
+MessageArchive::MessageArchive(const kj::ReadableFile& file,
+                               kj::Maybe<const ArchiveCodec&> codec, ReaderOptions options)
+    : MappedMessageFile(file), codec(codec), options(options), content(words) {
+  init();
+}
+
+MessageArchive::MessageArchive(kj::ArrayPtr<const word> content,
+                               kj::Maybe<const ArchiveCodec&> codec, ReaderOptions options)
+    : codec(codec), options(options), content(content) {
+  init();
+}
+
+MessageArchive::~MessageArchive() noexcept(false) {}
+
+void MessageArchive::init() {
+  // Everything read from the index is checked here or where it's used, since the file may be
+  // corrupt or hostile.
+
+  constexpr size_t FOOTER_WORDS = sizeof(WireFooter) / sizeof(word);
+  KJ_REQUIRE(content.size() >= 1 + FOOTER_WORDS, "file is too small to be a message archive");
+
+  auto& magic = *reinterpret_cast<const _::WireValue<uint64_t>*>(content.begin());
+  auto& footer = *reinterpret_cast<const WireFooter*>(content.end() - FOOTER_WORDS);
+  KJ_REQUIRE(magic.get() == ARCHIVE_MAGIC && footer.magic.get() == ARCHIVE_MAGIC,
+             "not a message archive, or truncated");
+
+  uint64_t indexEnd = content.size() - FOOTER_WORDS;
+  uint64_t tableOffset = footer.tableOffsetWords.get();
+  blockCount = footer.blockCount.get();
+  messageCount = footer.messageCount.get();
+  KJ_REQUIRE(tableOffset >= 1 && tableOffset <= indexEnd &&
+             blockCount <= (indexEnd - tableOffset) / 4 &&
+             messageCount == indexEnd - tableOffset - blockCount * 4,
+             "message archive index is corrupt");
+
+  blocks = reinterpret_cast<const BlockEntry*>(content.begin() + tableOffset);
+  messages = reinterpret_cast<const MessageEntry*>(content.begin() + tableOffset + blockCount * 4);
+  dataEndWords = tableOffset;
+}
+
+kj::ArrayPtr<const word> MessageArchive::getBlock(
+    uint64_t index, kj::Array<word>& ownedSpace) const {
+  KJ_REQUIRE(index < blockCount, "message archive refers to a nonexistent block");
+  auto& block = blocks[index];
+
+  uint64_t offset = block.offsetWords.get();
+  uint64_t storedBytes = block.storedBytes.get();
+  uint64_t uncompressedWords = block.uncompressedWords.get();
+  KJ_REQUIRE(offset >= 1 && offset <= dataEndWords &&
+             storedBytes <= (dataEndWords - offset) * sizeof(word),
+             "message archive block is out of bounds");
+  auto stored = content.slice(offset, offset + wordsForBytes(storedBytes));
+
+  uint32_t codecId = block.codec.get();
+  if (codecId == 0) {
+    KJ_REQUIRE(storedBytes == uncompressedWords * sizeof(word),
+               "message archive block has inconsistent sizes");
+    return stored;
+  }
+
+  KJ_IF_MAYBE(c, codec) {
+    KJ_REQUIRE(c->getId() == codecId, "message archive block uses a different codec", codecId);
+    // Don't let a corrupt size make us allocate absurd amounts of memory.
+    KJ_REQUIRE(uncompressedWords <= options.traversalLimitInWords,
+               "compressed block exceeds the traversal limit", uncompressedWords);
+    ownedSpace = kj::heapArray<word>(uncompressedWords);
+    c->decompress(stored.asBytes().slice(0, storedBytes), ownedSpace.asBytes());
+    return ownedSpace;
+  } else {
+    KJ_FAIL_REQUIRE("message archive block is compressed, but no codec was given", codecId);
+  }
+}
+
+kj::Own<MessageReader> MessageArchive::getMessage(uint64_t index) const {
+  KJ_REQUIRE(index < messageCount, "message index out of range", index, messageCount);
+  auto& entry = messages[index];
+
+  kj::Array<word> ownedSpace;
+  auto block = getBlock(entry.block.get(), ownedSpace);
+  uint32_t offset = entry.offsetWords.get();
+  KJ_REQUIRE(offset < block.size(), "message archive entry is out of bounds");
+
+  return kj::heap<FlatArrayMessageReader>(block.slice(offset, block.size()), options)
+      .attach(kj::mv(ownedSpace));
+}
+
+void MessageArchive::scan(uint64_t begin, uint64_t end,
+                          const kj::ConstFunction<void(uint64_t, MessageReader&)>& func) const {
+  kj::Array<word> ownedSpace;
+  kj::ArrayPtr<const word> block;
+  uint64_t currentBlock = kj::maxValue;
+
+  for (uint64_t i = begin; i < end; i++) {
+    auto& entry = messages[i];
+    if (entry.block.get() != currentBlock) {
+      currentBlock = entry.block.get();
+      block = getBlock(currentBlock, ownedSpace);
+    }
+
+    uint32_t offset = entry.offsetWords.get();
+    KJ_REQUIRE(offset < block.size(), "message archive entry is out of bounds");
+    FlatArrayMessageReader reader(block.slice(offset, block.size()), options);
+    func(i, reader);
+  }
+}
+
+void MessageArchive::forEach(kj::ConstFunction<void(uint64_t, MessageReader&)> func,
+                             uint64_t begin, uint64_t end) const {
+  scan(begin, kj::min(end, messageCount), func);
+}
+
+void MessageArchive::parallelForEach(
+    uint threadCount, kj::ConstFunction<void(uint64_t, MessageReader&)> func) const {
+  KJ_REQUIRE(threadCount > 0);
+
+  // Split at block boundaries, so that each compressed block is decompressed by one thread, into
+  // ranges of roughly equal uncompressed size.  Messages are stored in block order, so each
+  // range of blocks is a range of messages.
+  uint64_t totalWords = 0;
+  for (uint64_t i = 0; i < blockCount; i++) totalWords += blocks[i].uncompressedWords.get();
+
+  kj::Vector<uint64_t> splits(threadCount + 1);
+  splits.add(0);
+  uint64_t wordsSoFar = 0;
+  uint64_t messagesSoFar = 0;
+  for (uint64_t i = 0; i < blockCount && splits.size() < threadCount; i++) {
+    wordsSoFar += blocks[i].uncompressedWords.get();
+    messagesSoFar += blocks[i].messageCount.get();
+    if (wordsSoFar * threadCount >= totalWords * splits.size()) {
+      splits.add(kj::min(messagesSoFar, messageCount));
+    }
+  }
+  splits.add(messageCount);
+
+  kj::Vector<kj::Own<kj::Thread>> threads(splits.size() - 2);
+  for (size_t i = 1; i + 1 < splits.size(); i++) {
+    uint64_t begin = splits[i];
+    uint64_t end = splits[i + 1];
+    threads.add(kj::heap<kj::Thread>([this,begin,end,&func]() {
+      scan(begin, end, func);
+    }));
+  }
+  kj::Maybe<kj::Exception> exception = kj::runCatchingExceptions([&]() {
+    scan(splits[0], splits[1], func);
+  });
+
+  // Join every thread before rethrowing, since they all use `func`.
+  for (auto& thread: threads) {
+    KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() { thread = nullptr; })) {
+      if (exception == nullptr) exception = kj::mv(*e);
+    }
+  }
+  KJ_IF_MAYBE(e, exception) {
+    kj::throwFatalException(kj::mv(*e));
+  }
+}
+
+#endif  // !CAPNP_LITE
+
+}  // namespace capnp
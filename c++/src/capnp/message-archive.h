@@ -0,0 +1,191 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#if defined(__GNUC__) && !defined(CAPNP_HEADER_WARNINGS)
+#pragma GCC system_header
+#endif
+
+#include "serialize.h"
+#include <kj/function.h>
+#include <kj/vector.h>
+
+namespace capnp {
+
+// A message archive is a file holding many messages with an index, so that any one of them can be
+// found without scanning the file, and so that the file can be split among threads for a
+// parallel scan.  Messages are grouped into blocks of roughly equal size, and each block may be
+// compressed.  Uncompressed blocks can be read in place from an mmap()ed file, since everything
+// in the file is word-aligned.
+//
+// The layout, in little-endian 64-bit words:
+//
+//     magic                  "CAPNARC1"
+//     block data...          each block is a run of messages as written by writeMessage(),
+//                            possibly compressed, zero-padded to a word boundary
+//     block table            per block: offset in words, stored size in bytes, uncompressed
+//                            size in words, then codec ID (32 bits) and message count (32 bits)
+//     message table          per message: block number (32 bits) and word offset within the
+//                            uncompressed block (32 bits)
+//     footer                 block count, message count, offset of the block table in words,
+//                            magic
+//
+// The index lives at the end so that the writer can stream; a reader finds it through the
+// footer.
+
+class ArchiveCodec {
+  // A compression scheme for archive blocks.  See `newDeflateArchiveCodec()` in
+  // serialize-compressed.h for one based on zlib.
+
+public:
+  virtual uint32_t getId() const = 0;
+  // Identifies the codec in the block table.  Must not be zero, which means "uncompressed".
+
+  virtual kj::Array<byte> compress(kj::ArrayPtr<const byte> input) const = 0;
+
+  virtual void decompress(kj::ArrayPtr<const byte> input, kj::ArrayPtr<byte> output) const = 0;
+  // Decompresses `input`, which must expand to exactly `output.size()` bytes; throws otherwise.
+  // Called concurrently from several threads by `MessageArchive::parallelForEach()`.
+};
+
+class MessageArchiveWriter {
+  // Writes a message archive to a stream.  Call `finish()` after adding the last message; an
+  // archive without its index is unreadable.
+
+public:
+  struct Options {
+    size_t blockWords = 1u << 16;
+    // A block is completed once it holds at least this many words (512 KiB by default).  Smaller
+    // blocks make random access to compressed blocks cheaper and parallel scans more even;
+    // larger blocks compress better.
+
+    kj::Maybe<const ArchiveCodec&> codec;
+    // Codec used to compress each block.  A block which doesn't get smaller is stored
+    // uncompressed.  Default: none.
+  };
+
+  explicit MessageArchiveWriter(kj::OutputStream& output, Options options);
+  explicit MessageArchiveWriter(kj::OutputStream& output);
+  KJ_DISALLOW_COPY(MessageArchiveWriter);
+  ~MessageArchiveWriter() noexcept(false);
+
+  void add(MessageBuilder& builder);
+  void add(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments);
+  // Appends a message.  Its index in the archive is `size()` before the call.
+
+  void finish();
+  // Writes the last block and the index.  No more messages may be added.
+
+  uint64_t size() const { return messageTable.size(); }
+
+private:
+  struct BlockEntry {
+    uint64_t offsetWords;
+    uint64_t storedBytes;
+    uint64_t uncompressedWords;
+    uint32_t codec;
+    uint32_t messageCount;
+  };
+  struct MessageEntry {
+    uint32_t block;
+    uint32_t offsetWords;
+  };
+
+  kj::OutputStream& output;
+  Options options;
+  uint64_t positionWords = 0;
+  kj::Array<word> block;
+  size_t blockSize = 0;
+  kj::Vector<BlockEntry> blockTable;
+  kj::Vector<MessageEntry> messageTable;
+  size_t blockFirstMessage = 0;
+  bool finished = false;
+
+  void write(kj::ArrayPtr<const byte> bytes);
+  word* growBlock(size_t words);
+  void flushBlock();
+};
+
+#if !CAPNP_LITE
+
+class MessageArchive: private _::MappedMessageFile {
+  // Reads a message archive.  Messages in uncompressed blocks are read in place, without copying;
+  // messages in compressed blocks are read from a decompressed copy of their block.
+  //
+  // A MessageArchive is immutable once constructed, so any number of threads may read from it at
+  // once.
+
+public:
+  explicit MessageArchive(const kj::ReadableFile& file,
+                          kj::Maybe<const ArchiveCodec&> codec = nullptr,
+                          ReaderOptions options = ReaderOptions());
+  // Maps `file` into memory.  `codec` is needed only if some blocks were compressed.
+
+  explicit MessageArchive(kj::ArrayPtr<const word> content,
+                          kj::Maybe<const ArchiveCodec&> codec = nullptr,
+                          ReaderOptions options = ReaderOptions());
+  // Reads an archive already in memory.  `content` must outlive the MessageArchive.
+
+  ~MessageArchive() noexcept(false);
+  KJ_DISALLOW_COPY(MessageArchive);
+
+  uint64_t size() const { return messageCount; }
+  uint64_t getBlockCount() const { return blockCount; }
+
+  kj::Own<MessageReader> getMessage(uint64_t index) const;
+  // Returns a reader for the given message.  If its block is compressed, the whole block is
+  // decompressed; to read many messages, use `forEach()`, which decompresses each block once.
+
+  void forEach(kj::ConstFunction<void(uint64_t index, MessageReader& reader)> func,
+               uint64_t begin = 0, uint64_t end = kj::maxValue) const;
+  // Calls `func` for each message with an index in [begin, end), in order.  The reader is only
+  // valid for the duration of the call.
+
+  void parallelForEach(uint threadCount,
+                       kj::ConstFunction<void(uint64_t index, MessageReader& reader)> func) const;
+  // Like `forEach()` over the whole archive, but splits the blocks into `threadCount` contiguous
+  // ranges of about the same size and scans each on its own thread.  `func` is called
+  // concurrently from those threads, in order within each range.  If any call throws, the
+  // exception is rethrown here after all threads have finished.
+
+private:
+  struct BlockEntry;
+  struct MessageEntry;
+
+  kj::Maybe<const ArchiveCodec&> codec;
+  ReaderOptions options;
+  kj::ArrayPtr<const word> content;
+  const BlockEntry* blocks = nullptr;
+  const MessageEntry* messages = nullptr;
+  uint64_t blockCount = 0;
+  uint64_t messageCount = 0;
+  uint64_t dataEndWords = 0;
+
+  void init();
+  kj::ArrayPtr<const word> getBlock(uint64_t block, kj::Array<word>& ownedSpace) const;
+  void scan(uint64_t begin, uint64_t end,
+            const kj::ConstFunction<void(uint64_t, MessageReader&)>& func) const;
+};
+
+#endif  // !CAPNP_LITE
+
+}  // namespace capnp
@@ -48,6 +48,177 @@ TEST(Message, MallocBuilderWithFirstSegment) {
   EXPECT_EQ(16u, segment.size());
 }
 
+TEST(Message, PooledBuilderReusesSegments) {
+  SegmentPool pool;
+
+  const word* firstSegment;
+  {
+    PooledMessageBuilder builder(pool);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    checkTestMessage(builder.getRoot<TestAllTypes>());
+    firstSegment = builder.getSegmentsForOutput()[0].begin();
+  }
+
+  EXPECT_EQ(1u, pool.getStats().misses);
+  EXPECT_LE(1u, pool.getCachedSegmentCount());
+
+  {
+    PooledMessageBuilder builder(pool);
+
+    // The used prefix must have been zeroed when the segment was returned.
+    auto segment = builder.allocateSegment(1);
+    EXPECT_EQ(firstSegment, segment.begin());
+    for (auto& w: segment) {
+      EXPECT_EQ(0u, *reinterpret_cast<uint64_t*>(&w));
+    }
+  }
+
+  {
+    PooledMessageBuilder builder(pool);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    checkTestMessage(builder.getRoot<TestAllTypes>());
+  }
+
+  EXPECT_LE(2u, pool.getStats().hits);
+}
+
+TEST(Message, PooledBuilderDiscardsWhenFull) {
+  SegmentPool::Options options;
+  options.maxCachedSegments = 1;
+  options.maxCachedSegmentWords = 128;
+  SegmentPool pool(options);
+
+  {
+    PooledMessageBuilder builder(pool, 16, AllocationStrategy::FIXED_SIZE);
+    builder.allocateSegment(1);
+    builder.allocateSegment(1);
+    builder.allocateSegment(256);
+  }
+
+  EXPECT_EQ(3u, pool.getStats().misses);
+  EXPECT_EQ(2u, pool.getStats().discards);
+  EXPECT_EQ(1u, pool.getCachedSegmentCount());
+}
+
+TEST(Message, PooledBuilderReserve) {
+  SegmentPool::Options options;
+  options.maxCachedSegments = 4;
+  options.maxCachedSegmentWords = 1024;
+  SegmentPool pool(options);
+
+  pool.reserve(2, 4096);  // too large to cache
+  EXPECT_EQ(0u, pool.getCachedSegmentCount());
+
+  pool.reserve(8, 512);   // only four fit
+  EXPECT_EQ(4u, pool.getCachedSegmentCount());
+
+  {
+    PooledMessageBuilder builder(pool, 512);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    checkTestMessage(builder.getRoot<TestAllTypes>());
+  }
+
+  EXPECT_EQ(0u, pool.getStats().misses);
+  EXPECT_LE(1u, pool.getStats().hits);
+}
+
+TEST(Message, ArenaBuilder) {
+  kj::Arena arena;
+
+  kj::StringPtr text;
+  {
+    ArenaMessageBuilder builder(arena);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    checkTestMessage(builder.getRoot<TestAllTypes>());
+
+    // Temporaries for the request can live in the same arena.
+    text = arena.copyString("request-scoped");
+
+    auto orphan = builder.getOrphanage().newOrphan<TestAllTypes>();
+    orphan.get().setInt32Field(123);
+    builder.getRoot<TestAllTypes>().adoptStructField(kj::mv(orphan));
+    EXPECT_EQ(123, builder.getRoot<TestAllTypes>().getStructField().getInt32Field());
+  }
+
+  EXPECT_EQ("request-scoped", text);
+}
+
+TEST(Message, ArenaBuilderSegmentsAreZeroed) {
+  byte scratch[1024];
+  memset(scratch, 0xab, sizeof(scratch));
+  kj::Arena arena(kj::arrayPtr(scratch, sizeof(scratch)));
+
+  ArenaMessageBuilder builder(arena, 16, AllocationStrategy::GROW_HEURISTICALLY);
+
+  auto segment = builder.allocateSegment(1);
+  EXPECT_EQ(16u, segment.size());
+  EXPECT_TRUE(segment.asBytes().begin() >= scratch &&
+              segment.asBytes().end() <= scratch + sizeof(scratch));
+  for (auto& w: segment) {
+    EXPECT_EQ(0u, *reinterpret_cast<uint64_t*>(&w));
+  }
+
+  EXPECT_EQ(16u, builder.allocateSegment(1).size());
+  EXPECT_EQ(32u, builder.allocateSegment(1).size());
+  EXPECT_EQ(100u, builder.allocateSegment(100).size());
+}
+
+TEST(Message, ValidatedReaderSkipsTraversalLimit) {
+  // Small first segment so that the message spans several segments, with far pointers.
+  MallocMessageBuilder builder(16, AllocationStrategy::FIXED_SIZE);
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  auto segments = builder.getSegmentsForOutput();
+  ASSERT_GT(segments.size(), 1u);
+
+  uint64_t size = builder.getRoot<TestAllTypes>().totalSize().wordCount;
+  ReaderOptions options;
+  options.traversalLimitInWords = size * 3;
+
+  {
+    // Without validation, repeated traversals exhaust the limit.
+    SegmentArrayMessageReader reader(segments, options);
+    EXPECT_ANY_THROW({
+      for (uint i = 0; i < 10; i++) {
+        checkTestMessage(reader.getRoot<TestAllTypes>());
+      }
+    });
+  }
+
+  {
+    SegmentArrayMessageReader reader(segments, options);
+    reader.validate();
+    for (uint i = 0; i < 10; i++) {
+      checkTestMessage(reader.getRoot<TestAllTypes>());
+    }
+  }
+}
+
+TEST(Message, ValidateRejectsBadMessages) {
+  {
+    // Struct pointer whose target runs past the end of the segment.
+    word segment[2];
+    memset(segment, 0, sizeof(segment));
+    // offset 0, data size 4 words, no pointers
+    *reinterpret_cast<uint64_t*>(segment) = 0x0000000400000000ull;
+    kj::ArrayPtr<const word> segments[1] = { kj::arrayPtr(segment, 2) };
+    SegmentArrayMessageReader reader(segments);
+    EXPECT_ANY_THROW(reader.validate());
+  }
+
+  {
+    // Nesting limit.
+    MallocMessageBuilder builder;
+    auto root = builder.initRoot<TestAllTypes>();
+    for (uint i = 0; i < 10; i++) {
+      root = root.initStructField();
+    }
+    ReaderOptions options;
+    options.nestingLimit = 5;
+    SegmentArrayMessageReader reader(builder.getSegmentsForOutput(), options);
+    EXPECT_ANY_THROW(reader.validate());
+  }
+}
+
 class TestInitMessageBuilder: public MessageBuilder {
 public:
   TestInitMessageBuilder(kj::ArrayPtr<SegmentInit> segments): MessageBuilder(segments) {}
@@ -168,6 +339,156 @@ TEST(Message, ReadWriteDataStruct) {
   checkTestMessageAllZero(defaultValue<TestAllTypes>());
 }
 
+TEST(Message, FirstSegmentWordsFor) {
+  EXPECT_EQ(SUGGESTED_FIRST_SEGMENT_WORDS, firstSegmentWordsFor<TestAllTypes>());
+  EXPECT_EQ(SUGGESTED_FIRST_SEGMENT_WORDS, firstSegmentWordsFor<test::TestAlwaysInlineVariable>());
+
+  constexpr uint words = firstSegmentWordsFor<test::TestAlwaysInline>();
+  MallocMessageBuilder builder(words);
+  auto root = builder.initRoot<test::TestAlwaysInline>();
+  EXPECT_EQ(1.5, root.getF64());
+  root.setU32(123);
+  root.setFlag(true);
+  root.initInner().setA(-1);
+  root.getPair().initLeft().setB(2);
+  root.getPair().initRight();
+
+  auto segments = builder.getSegmentsForOutput();
+  ASSERT_EQ(1u, segments.size());
+  EXPECT_EQ(words, segments[0].size());
+
+  auto reader = builder.getRoot<test::TestAlwaysInline>().asReader();
+  EXPECT_EQ(123u, reader.getU32());
+  EXPECT_TRUE(reader.isFlag());
+  EXPECT_TRUE(reader.getFlag());
+  EXPECT_EQ(-1, reader.getInner().getA());
+  EXPECT_EQ(2u, reader.getPair().getLeft().getB());
+}
+
+TEST(Message, SegmentSizePolicy) {
+  SegmentSizePolicy::Options options;
+  options.minSamples = 4;
+  SegmentSizePolicy policy(options);
+  EXPECT_EQ(SUGGESTED_FIRST_SEGMENT_WORDS, policy.firstSegmentWords());
+
+  auto build = [&](size_t bytes) {
+    MallocMessageBuilder builder(policy);
+    builder.getRoot<AnyPointer>().initAs<Data>(bytes);
+    return builder.getSegmentsForOutput().size();
+  };
+
+  // Small messages shrink the first segment to just fit them.  A 200-byte Data plus the root
+  // pointer is 26 words.
+  for (int i = 0; i < 4; i++) EXPECT_EQ(1u, build(200));
+  EXPECT_GE(policy.firstSegmentWords(), 26u);
+  EXPECT_LT(policy.firstSegmentWords(), 32u);
+  EXPECT_EQ(1u, build(200));
+
+  // Large messages grow it, after which they no longer need more than one segment.
+  SegmentSizePolicy largePolicy(options);
+  {
+    MallocMessageBuilder builder(largePolicy);
+    builder.getRoot<AnyPointer>().initAs<Data>(1 << 20);
+    EXPECT_GT(builder.getSegmentsForOutput().size(), 1u);
+  }
+  for (int i = 0; i < 3; i++) largePolicy.record((1 << 17) + 2, 2);
+  EXPECT_GE(largePolicy.firstSegmentWords(), (1u << 17) + 2);
+  {
+    MallocMessageBuilder builder(largePolicy);
+    builder.getRoot<AnyPointer>().initAs<Data>(1 << 20);
+    EXPECT_EQ(1u, builder.getSegmentsForOutput().size());
+  }
+
+  auto stats = largePolicy.getStats();
+  EXPECT_EQ(5u, stats.messages);
+  EXPECT_EQ(4u, stats.multiSegmentMessages);
+  EXPECT_EQ(largePolicy.firstSegmentWords(), stats.firstSegmentWords);
+
+  // The suggestion covers the configured percentile, and follows a change in the workload once
+  // old samples decay.
+  options.percentile = 0.5;
+  options.decayInterval = 64;
+  SegmentSizePolicy mixedPolicy(options);
+  for (int i = 0; i < 48; i++) mixedPolicy.record(100, 1);
+  for (int i = 0; i < 16; i++) mixedPolicy.record(10000, 1);
+  EXPECT_LT(mixedPolicy.firstSegmentWords(), 128u);
+  EXPECT_GE(mixedPolicy.getPercentile(0.5), 100u);
+  EXPECT_GE(mixedPolicy.getPercentile(0.9), 10000u);
+  for (int i = 0; i < 256; i++) mixedPolicy.record(10000, 1);
+  EXPECT_GE(mixedPolicy.firstSegmentWords(), 10000u);
+}
+
+size_t totalWords(MessageBuilder& builder) {
+  size_t result = 0;
+  for (auto segment: builder.getSegmentsForOutput()) result += segment.size();
+  return result;
+}
+
+TEST(Message, Compact) {
+  MallocMessageBuilder builder(64, AllocationStrategy::FIXED_SIZE);
+  auto root = builder.initRoot<TestAllTypes>();
+  initTestMessage(root);
+  size_t initialWords = totalWords(builder);
+
+  // Overwriting fields leaves the old space behind, spread over several segments.
+  for (uint i = 0; i < 100; i++) {
+    initTestMessage(builder.getRoot<TestAllTypes>());
+  }
+  size_t grownWords = totalWords(builder);
+  EXPECT_GT(grownWords, initialWords * 50);
+  EXPECT_GT(builder.getSegmentsForOutput().size(), 1u);
+
+  builder.compact();
+  checkTestMessage(builder.getRoot<TestAllTypes>());
+  EXPECT_LE(totalWords(builder), initialWords);
+
+  // The emptied segments are reused rather than new ones being allocated.
+  size_t segmentCount = builder.getSegmentsForOutput().size();
+  for (uint i = 0; i < 50; i++) {
+    initTestMessage(builder.getRoot<TestAllTypes>());
+  }
+  EXPECT_EQ(segmentCount, builder.getSegmentsForOutput().size());
+  checkTestMessage(builder.getRoot<TestAllTypes>());
+
+  builder.compact();
+  checkTestMessage(builder.getRoot<TestAllTypes>());
+  EXPECT_LE(totalWords(builder), initialWords);
+
+  // Compacting an unused builder is a no-op.
+  MallocMessageBuilder empty;
+  empty.compact();
+  EXPECT_EQ(0u, empty.getSegmentsForOutput().size());
+}
+
+TEST(Message, ReuseFreedSpace) {
+  MallocMessageBuilder builder;
+  builder.setReuseFreedSpace();
+  auto root = builder.initRoot<TestAllTypes>();
+  initTestMessage(root);
+  root.setTextField("foo");
+
+  size_t words = totalWords(builder);
+  for (uint i = 0; i < 1000; i++) {
+    root.setTextField(i % 2 == 0 ? "bar" : "baz");
+    root.initStructField().setInt32Field(i);
+    root.initInt32List(3).set(0, i);
+  }
+  EXPECT_EQ(words, totalWords(builder));
+  EXPECT_EQ("baz", root.getTextField());
+  EXPECT_EQ(999, root.getStructField().getInt32Field());
+  EXPECT_EQ(999, root.getInt32List()[0]);
+
+  // Without reuse, the same updates grow the message.
+  MallocMessageBuilder plain;
+  auto plainRoot = plain.initRoot<TestAllTypes>();
+  initTestMessage(plainRoot);
+  words = totalWords(plain);
+  for (uint i = 0; i < 1000; i++) {
+    plainRoot.initStructField().setInt32Field(i);
+  }
+  EXPECT_GT(totalWords(plain), words);
+}
+
 // TODO(test):  More tests.
 
 }  // namespace
@@ -83,6 +83,17 @@ bool MessageReader::isCanonical() {
   return rootIsCanonical && allWordsConsumed;
 }
 
+void MessageReader::validate() {
+  // targetSize() visits every object reachable from the root with full checking, throwing on the
+  // first problem.
+  getRootInternal().targetSize();
+
+#if !KJ_NO_EXCEPTIONS
+  // Without exceptions, failed checks are merely logged and the walk carries on, so we can't tell
+  // that the message was valid. Leave it untrusted.
+  arena()->markTrusted();
+#endif
+}
 
 AnyPointer::Reader MessageReader::getRootInternal() {
   if (!allocatedArena) {
@@ -163,6 +174,23 @@ Orphanage MessageBuilder::getOrphanage() {
   return Orphanage(arena(), arena()->getLocalCapTable());
 }
 
+void MessageBuilder::compact() {
+  if (!allocatedArena) return;
+
+  auto root = getRootInternal().asReader();
+  uint64_t words = root.targetSize().wordCount + 1;  // plus the root pointer
+  MallocMessageBuilder copy(kj::min(words, uint64_t(unbound(MAX_SEGMENT_WORDS / WORDS))));
+  copy.getRootInternal().set(root);
+
+  arena()->reclaimAll();
+  getRootInternal().set(copy.getRootInternal().asReader());
+}
+
+void MessageBuilder::setReuseFreedSpace(bool enable) {
+  getRootSegment();
+  arena()->setReuseFreedSpace(enable);
+}
+
 bool MessageBuilder::isCanonical() {
   _::SegmentReader *segment = getRootSegment();
 
@@ -199,6 +227,102 @@ kj::ArrayPtr<const word> SegmentArrayMessageReader::getSegment(uint id) {
 
 // -------------------------------------------------------------------
 
+constexpr uint SegmentSizePolicy::BUCKET_COUNT;
+
+SegmentSizePolicy::SegmentSizePolicy(): SegmentSizePolicy(Options()) {}
+
+SegmentSizePolicy::SegmentSizePolicy(Options options)
+    : options(options), suggestion(options.initialFirstSegmentWords) {
+  KJ_REQUIRE(options.percentile > 0 && options.percentile <= 1, "percentile out of range",
+             options.percentile);
+  KJ_REQUIRE(options.minFirstSegmentWords <= options.maxFirstSegmentWords &&
+             bounded(options.maxFirstSegmentWords) * WORDS <= MAX_SEGMENT_WORDS,
+             "bad first segment size bounds");
+  KJ_REQUIRE(options.decayInterval > 0, "decayInterval must be non-zero");
+}
+
+uint SegmentSizePolicy::bucketFor(size_t words) {
+  // Four buckets per power of two: the octave, then the two bits after the leading one.
+  uint64_t w = kj::max(words, size_t(1));
+  uint octave = 63 - __builtin_clzll(w);
+  if (octave < 2) return octave * 4;
+  uint bucket = octave * 4 + ((w >> (octave - 2)) & 3);
+  return kj::min(bucket, BUCKET_COUNT - 1);
+}
+
+uint SegmentSizePolicy::bucketLimit(uint bucket) {
+  // The largest size that falls into `bucket`.
+  uint octave = bucket / 4;
+  if (octave < 2) return (2u << octave) - 1;
+  uint64_t limit = (uint64_t(5 + bucket % 4) << (octave - 2)) - 1;
+  return kj::min(limit, uint64_t(kj::maxValue));
+}
+
+uint SegmentSizePolicy::firstSegmentWords() const {
+  return __atomic_load_n(&suggestion, __ATOMIC_RELAXED);
+}
+
+void SegmentSizePolicy::record(size_t words, uint segmentCount) {
+  __atomic_add_fetch(&messages, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&totalWords, words, __ATOMIC_RELAXED);
+  if (segmentCount > 1) __atomic_add_fetch(&multiSegmentMessages, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&buckets[bucketFor(words)], 1, __ATOMIC_RELAXED);
+
+  uint since = __atomic_add_fetch(&sinceDecay, 1, __ATOMIC_RELAXED);
+  if (since >= options.decayInterval) {
+    // Only the thread that hits the interval exactly decays, so concurrent recorders don't halve
+    // the histogram twice.
+    if (since == options.decayInterval) {
+      for (auto& bucket: buckets) {
+        __atomic_store_n(&bucket, __atomic_load_n(&bucket, __ATOMIC_RELAXED) / 2,
+                         __ATOMIC_RELAXED);
+      }
+      __atomic_store_n(&sinceDecay, 0, __ATOMIC_RELAXED);
+      update();
+    }
+  } else if (since % 16 == 0 ||
+             __atomic_load_n(&messages, __ATOMIC_RELAXED) == options.minSamples) {
+    // Recomputing scans the whole histogram, so don't do it for every message.
+    update();
+  }
+}
+
+uint SegmentSizePolicy::getPercentile(double fraction) const {
+  uint64_t counts[BUCKET_COUNT];
+  uint64_t total = 0;
+  for (uint i = 0; i < BUCKET_COUNT; i++) {
+    counts[i] = __atomic_load_n(&buckets[i], __ATOMIC_RELAXED);
+    total += counts[i];
+  }
+  if (total == 0) return 0;
+
+  double target = fraction * total;
+  uint64_t cumulative = 0;
+  for (uint i = 0; i < BUCKET_COUNT; i++) {
+    cumulative += counts[i];
+    if (cumulative > 0 && cumulative >= target) return bucketLimit(i);
+  }
+  return bucketLimit(BUCKET_COUNT - 1);
+}
+
+void SegmentSizePolicy::update() {
+  if (__atomic_load_n(&messages, __ATOMIC_RELAXED) < options.minSamples) return;
+  uint words = kj::max(options.minFirstSegmentWords,
+      kj::min(getPercentile(options.percentile), options.maxFirstSegmentWords));
+  __atomic_store_n(&suggestion, words, __ATOMIC_RELAXED);
+}
+
+SegmentSizePolicy::Stats SegmentSizePolicy::getStats() const {
+  Stats result;
+  result.messages = __atomic_load_n(&messages, __ATOMIC_RELAXED);
+  result.multiSegmentMessages = __atomic_load_n(&multiSegmentMessages, __ATOMIC_RELAXED);
+  result.totalWords = __atomic_load_n(&totalWords, __ATOMIC_RELAXED);
+  result.firstSegmentWords = firstSegmentWords();
+  return result;
+}
+
+// -------------------------------------------------------------------
+
 struct MallocMessageBuilder::MoreSegments {
   std::vector<void*> segments;
 };
@@ -219,7 +343,20 @@ MallocMessageBuilder::MallocMessageBuilder(
           "First segment must be zeroed.");
 }
 
+MallocMessageBuilder::MallocMessageBuilder(
+    SegmentSizePolicy& sizePolicy, AllocationStrategy allocationStrategy)
+    : MallocMessageBuilder(sizePolicy.firstSegmentWords(), allocationStrategy) {
+  this->sizePolicy = &sizePolicy;
+}
+
 MallocMessageBuilder::~MallocMessageBuilder() noexcept(false) {
+  if (sizePolicy != nullptr && returnedFirstSegment) {
+    auto segments = getSegmentsForOutput();
+    size_t words = 0;
+    for (auto segment: segments) words += segment.size();
+    sizePolicy->record(words, segments.size());
+  }
+
   if (returnedFirstSegment) {
     if (ownFirstSegment) {
       free(firstSegment);
@@ -295,6 +432,155 @@ kj::ArrayPtr<word> MallocMessageBuilder::allocateSegment(uint minimumSize) {
 
 // -------------------------------------------------------------------
 
+SegmentPool::SegmentPool(): SegmentPool(Options()) {}
+
+SegmentPool::SegmentPool(Options options)
+    : options(options), cached(kj::heapArray<kj::ArrayPtr<word>>(options.maxCachedSegments)) {}
+
+SegmentPool::~SegmentPool() noexcept(false) {
+  for (auto& segment: cached.slice(0, count)) {
+    free(segment.begin());
+  }
+}
+
+kj::ArrayPtr<word> SegmentPool::take(uint minimumSize, uint preferredSize) {
+  // Find the smallest cached segment that satisfies the request.  The cache is small, so a linear
+  // scan is cheaper than maintaining any sort of index.
+  uint size = kj::max(minimumSize, preferredSize);
+  kj::ArrayPtr<word>* best = nullptr;
+  for (auto& segment: cached.slice(0, count)) {
+    if (segment.size() >= size && (best == nullptr || segment.size() < best->size())) {
+      best = &segment;
+    }
+  }
+
+  if (best != nullptr) {
+    ++stats.hits;
+    kj::ArrayPtr<word> result = *best;
+    *best = cached[--count];
+    return result;
+  }
+
+  ++stats.misses;
+  void* result = calloc(size, sizeof(word));
+  if (result == nullptr) {
+    KJ_FAIL_SYSCALL("calloc(size, sizeof(word))", ENOMEM, size);
+  }
+  return kj::arrayPtr(reinterpret_cast<word*>(result), size);
+}
+
+void SegmentPool::give(kj::ArrayPtr<word> segment, size_t wordsUsed) {
+  if (count == cached.size() || segment.size() > options.maxCachedSegmentWords) {
+    ++stats.discards;
+    free(segment.begin());
+  } else {
+    memset(segment.asBytes().begin(), 0, kj::min(wordsUsed, segment.size()) * sizeof(word));
+    cached[count++] = segment;
+  }
+}
+
+void SegmentPool::reserve(uint segmentCount, uint segmentWords) {
+  if (segmentWords == 0 || segmentWords > options.maxCachedSegmentWords) return;
+
+  while (segmentCount-- > 0 && count < cached.size()) {
+    // calloc() may return fresh pages from mmap() that nobody has touched yet; zero them
+    // ourselves so that they're faulted in here.
+    void* segment = malloc(segmentWords * sizeof(word));
+    if (segment == nullptr) {
+      KJ_FAIL_SYSCALL("malloc(segmentWords * sizeof(word))", ENOMEM, segmentWords);
+    }
+    memset(segment, 0, segmentWords * sizeof(word));
+    cached[count++] = kj::arrayPtr(reinterpret_cast<word*>(segment), segmentWords);
+  }
+}
+
+PooledMessageBuilder::PooledMessageBuilder(
+    SegmentPool& pool, uint firstSegmentWords, AllocationStrategy allocationStrategy)
+    : pool(pool), nextSize(firstSegmentWords), allocationStrategy(allocationStrategy) {}
+
+PooledMessageBuilder::~PooledMessageBuilder() noexcept(false) {
+  if (firstSegment == nullptr) return;
+
+  // The arena allocates segment IDs in the same order in which we handed out segments, so each
+  // of our segments should line up with the corresponding output segment.  If somehow they don't,
+  // we conservatively treat the whole segment as used.
+  auto segments = getSegmentsForOutput();
+  auto wordsUsed = [&](uint index, kj::ArrayPtr<word> segment) -> size_t {
+    if (index < segments.size() && segments[index].begin() == segment.begin()) {
+      return segments[index].size();
+    } else {
+      return segment.size();
+    }
+  };
+
+  pool.give(firstSegment, wordsUsed(0, firstSegment));
+  for (auto i: kj::indices(moreSegments)) {
+    pool.give(moreSegments[i], wordsUsed(i + 1, moreSegments[i]));
+  }
+}
+
+kj::ArrayPtr<word> PooledMessageBuilder::allocateSegment(uint minimumSize) {
+  KJ_REQUIRE(bounded(minimumSize) * WORDS <= MAX_SEGMENT_WORDS,
+      "PooledMessageBuilder asked to allocate segment above maximum serializable size.");
+  KJ_ASSERT(bounded(nextSize) * WORDS <= MAX_SEGMENT_WORDS,
+      "PooledMessageBuilder nextSize out of bounds.");
+
+  kj::ArrayPtr<word> result = pool.take(minimumSize, nextSize);
+
+  // As with MallocMessageBuilder, the growth heuristic is based on the size we would have
+  // allocated, not on the (possibly larger) size of the cached segment that we actually got.
+  uint size = kj::max(minimumSize, nextSize);
+
+  if (firstSegment == nullptr) {
+    firstSegment = result;
+    if (allocationStrategy == AllocationStrategy::GROW_HEURISTICALLY) nextSize = size;
+  } else {
+    moreSegments.add(result);
+    if (allocationStrategy == AllocationStrategy::GROW_HEURISTICALLY) {
+      nextSize = (size <= unbound(MAX_SEGMENT_WORDS / WORDS) - nextSize)
+          ? nextSize + size : unbound(MAX_SEGMENT_WORDS / WORDS);
+    }
+  }
+
+  return result;
+}
+
+// -------------------------------------------------------------------
+
+ArenaMessageBuilder::ArenaMessageBuilder(
+    kj::Arena& arena, uint firstSegmentWords, AllocationStrategy allocationStrategy)
+    : arena(arena), nextSize(firstSegmentWords), allocationStrategy(allocationStrategy) {}
+
+ArenaMessageBuilder::~ArenaMessageBuilder() noexcept(false) {}
+
+kj::ArrayPtr<word> ArenaMessageBuilder::allocateSegment(uint minimumSize) {
+  KJ_REQUIRE(bounded(minimumSize) * WORDS <= MAX_SEGMENT_WORDS,
+      "ArenaMessageBuilder asked to allocate segment above maximum serializable size.");
+  KJ_ASSERT(bounded(nextSize) * WORDS <= MAX_SEGMENT_WORDS,
+      "ArenaMessageBuilder nextSize out of bounds.");
+
+  uint size = kj::max(minimumSize, nextSize);
+
+  // Arena memory is not zeroed, but segments must be.
+  kj::ArrayPtr<word> result = arena.allocateArray<word>(size);
+  memset(result.asBytes().begin(), 0, result.asBytes().size());
+
+  if (allocationStrategy == AllocationStrategy::GROW_HEURISTICALLY) {
+    if (!allocatedFirstSegment) {
+      // After the first segment, we want nextSize to equal the total size allocated so far.
+      nextSize = size;
+    } else {
+      nextSize = (size <= unbound(MAX_SEGMENT_WORDS / WORDS) - nextSize)
+          ? nextSize + size : unbound(MAX_SEGMENT_WORDS / WORDS);
+    }
+  }
+  allocatedFirstSegment = true;
+
+  return result;
+}
+
+// -------------------------------------------------------------------
+
 FlatMessageBuilder::FlatMessageBuilder(kj::ArrayPtr<word> array): array(array), allocated(false) {}
 FlatMessageBuilder::~FlatMessageBuilder() noexcept(false) {}
 
@@ -23,6 +23,8 @@
 #include <kj/memory.h>
 #include <kj/mutex.h>
 #include <kj/debug.h>
+#include <kj/vector.h>
+#include <kj/arena.h>
 #include "common.h"
 #include "layout.h"
 #include "any.h"
@@ -121,6 +123,19 @@ public:
   bool isCanonical();
   // Returns whether the message encoded in the reader is in canonical form.
 
+  void validate();
+  // Walks the entire message once, checking every pointer -- bounds, far pointers, list sizes, and
+  // nesting depth against `ReaderOptions::nestingLimit` -- and throws if anything is invalid.
+  // Once this returns, the message is trusted: readers obtained from it no longer bounds-check
+  // each object they dereference or charge it against the traversal limit, which makes
+  // traversing the same message many times considerably cheaper. Validation itself charges the
+  // whole message against the traversal limit once.
+  //
+  // Call this before sharing the reader with other threads. The underlying segments must not
+  // change afterwards (which they also must not for an unvalidated reader). Semantic checks that
+  // don't guard memory safety, such as a Text's NUL terminator or a pointer's kind, still happen
+  // on every access.
+
 private:
   ReaderOptions options;
 
@@ -226,6 +241,27 @@ public:
   bool isCanonical();
   // Check whether the message builder is in canonical form
 
+  void compact();
+  // Rewrite the message so that it holds only what is reachable from the root, packed from the
+  // start of the message's existing segments. Overwriting or discarding an object zeroes its
+  // space but doesn't otherwise reclaim it, so a long-lived message that is modified in place
+  // keeps growing; call this now and then to shrink it back down. The memory of segments that
+  // are no longer needed is kept for later allocations rather than returned.
+  //
+  // The live content is copied out to a temporary message and back, so this costs about as much
+  // as copying the message twice. All Builders, Readers, and Orphans previously obtained from
+  // this message are invalidated.
+
+  void setReuseFreedSpace(bool enable = true);
+  // When enabled, space zeroed because an object was overwritten or discarded is remembered, and
+  // a later replacement of some object with one of exactly the same size, in the same segment,
+  // takes over that space instead of growing the message. This suits messages whose fields are
+  // repeatedly set to similarly-sized values. It only matches exact sizes, so compact() is still
+  // needed to reclaim space in general.
+  //
+  // Builders obtained for an object before it was overwritten may afterwards see whatever took
+  // its place, rather than zeros.
+
 private:
   void* arenaSpace[22];
   // Space in which we can construct a BuilderArena.  We don't use BuilderArena directly here
@@ -304,6 +340,23 @@ static typename Type::Reader defaultValue();
 //
 // TODO(cleanup):  Find a better home for this function?
 
+template <typename T>
+kj::Array<word> canonicalize(T&& reader);
+// Copies the given struct into a new single-segment message in canonical form, and returns that
+// segment (starting with the root pointer).
+
+template <typename T>
+void writeCanonical(T&& reader, kj::OutputStream& output, uint threadCount = 1);
+// Writes the same bytes as `canonicalize(reader)` to `output`, without ever holding the whole
+// canonical message in memory.  This is the way to compute a content hash of a large message:
+// wrap the hash function in an OutputStream.  Memory use is a few bytes per object in the message
+// rather than a copy of it.
+//
+// With `threadCount` > 1, the top of the pointer tree is split into pieces which are sized and
+// encoded on that many threads; the output is identical.  Pieces that are ready before their
+// turn are buffered (up to a few tens of megabytes in total), so `output` is only ever written by
+// one thread at a time, but not always by the calling thread.
+
 // =======================================================================================
 
 class SegmentArrayMessageReader: public MessageReader {
@@ -345,6 +398,94 @@ enum class AllocationStrategy: uint8_t {
 constexpr uint SUGGESTED_FIRST_SEGMENT_WORDS = 1024;
 constexpr AllocationStrategy SUGGESTED_ALLOCATION_STRATEGY = AllocationStrategy::GROW_HEURISTICALLY;
 
+template <typename RootType>
+constexpr uint firstSegmentWordsFor();
+// Returns a `firstSegmentWords` for a MallocMessageBuilder whose root will be a `RootType`.  For
+// a struct generated under `$Cxx.alwaysInline` whose encoding has a fixed size, this is exactly
+// the size of a message built by initializing each field at most once, so the message fits one
+// right-sized allocation.  Otherwise it is SUGGESTED_FIRST_SEGMENT_WORDS.
+
+class SegmentSizePolicy {
+  // Learns how large messages of one kind turn out to be, and suggests a first segment size that
+  // fits most of them in a single segment.  Give a `MallocMessageBuilder` a policy instead of a
+  // fixed `firstSegmentWords`, and keep one policy per message type or call site: small messages
+  // then stop paying for 8 KiB segments, and large ones stop growing through a chain of segments
+  // (and far pointers between them).
+  //
+  // The policy keeps a histogram of recent message sizes, in buckets a quarter of an octave wide,
+  // and suggests the upper bound of the bucket holding the configured percentile.  Every
+  // `decayInterval` messages the counts are halved, so the suggestion follows shifts in the
+  // workload.
+  //
+  // A policy may be shared between threads.  Counters are updated with relaxed atomics and
+  // without locking, so a sample recorded while another thread is decaying the histogram may be
+  // lost; the statistics are approximate, which is fine for a size hint.
+
+public:
+  struct Options {
+    double percentile = 0.95;
+    // Fraction of messages which the suggested first segment should be big enough for.
+
+    uint initialFirstSegmentWords = SUGGESTED_FIRST_SEGMENT_WORDS;
+    // Suggested until `minSamples` messages have been recorded.
+
+    uint minSamples = 16;
+
+    uint minFirstSegmentWords = 8;
+    uint maxFirstSegmentWords = 1u << 20;
+    // Bounds on the suggestion.  The upper bound (8 MiB) keeps a few huge messages from making
+    // every message allocate a huge zeroed segment; bigger messages grow as usual.
+
+    uint decayInterval = 1024;
+    // Number of messages after which the histogram's counts are halved.
+  };
+
+  SegmentSizePolicy();
+  explicit SegmentSizePolicy(Options options);
+  KJ_DISALLOW_COPY(SegmentSizePolicy);
+
+  uint firstSegmentWords() const;
+  // The first segment size to use for the next message.
+
+  void record(size_t totalWords, uint segmentCount);
+  // Records the final size of a message.  `MallocMessageBuilder` calls this when destroyed.
+
+  uint getPercentile(double fraction) const;
+  // Returns the smallest bucket bound, in words, which is at least as large as `fraction` of the
+  // recorded messages, or zero if nothing has been recorded.
+
+  struct Stats {
+    uint64_t messages = 0;
+    // Total messages recorded (not decayed).
+
+    uint64_t multiSegmentMessages = 0;
+    // Messages which did not fit in their first segment.
+
+    uint64_t totalWords = 0;
+    // Sum of the recorded message sizes.
+
+    uint firstSegmentWords = 0;
+    // The current suggestion.
+  };
+
+  Stats getStats() const;
+
+private:
+  static constexpr uint BUCKET_COUNT = 32 * 4;
+
+  Options options;
+  uint suggestion;
+  uint64_t messages = 0;
+  uint64_t multiSegmentMessages = 0;
+  uint64_t totalWords = 0;
+  uint sinceDecay = 0;
+  uint buckets[BUCKET_COUNT] = {};
+
+  static uint bucketFor(size_t words);
+  static uint bucketLimit(uint bucket);
+  void update();
+};
+
 class MallocMessageBuilder: public MessageBuilder {
   // A simple MessageBuilder that uses malloc() (actually, calloc()) to allocate segments.  This
   // implementation should be reasonable for any case that doesn't require writing the message to
@@ -374,6 +515,11 @@ public:
   // firstSegment MUST be zero-initialized.  MallocMessageBuilder's destructor will write new zeros
   // over any space that was used so that it can be reused.
 
+  explicit MallocMessageBuilder(SegmentSizePolicy& sizePolicy,
+      AllocationStrategy allocationStrategy = SUGGESTED_ALLOCATION_STRATEGY);
+  // This version takes its first segment size from `sizePolicy`, and reports the message's final
+  // size back to it when destroyed.  The policy must outlive the builder.
+
   KJ_DISALLOW_COPY(MallocMessageBuilder);
   virtual ~MallocMessageBuilder() noexcept(false);
 
@@ -387,11 +533,130 @@ private:
   bool returnedFirstSegment;
 
   void* firstSegment;
+  SegmentSizePolicy* sizePolicy = nullptr;
 
   struct MoreSegments;
   kj::Maybe<kj::Own<MoreSegments>> moreSegments;
 };
 
+class SegmentPool {
+  // A cache of previously-used message segments, for use with `PooledMessageBuilder`.  When a
+  // pooled builder is destroyed, it zeros the prefix of each segment that was actually used and
+  // hands the segment back to the pool, so that the next builder can reuse it without a trip
+  // through calloc()/free().
+  //
+  // A SegmentPool is NOT thread-safe.  The intended usage is to create one pool per thread (e.g.
+  // alongside the thread's EventLoop) and use it for all messages built on that thread.  The pool
+  // must outlive every PooledMessageBuilder that uses it.
+  //
+  // On a NUMA machine, a pool belonging to a thread pinned to one node (see
+  // `kj::setCurrentThreadAffinity()`) should be filled with `reserve()` from that thread, so that
+  // its segments live in that node's memory.
+
+public:
+  struct Options {
+    uint maxCachedSegments = 16;
+    // Maximum number of free segments the pool will hold on to.  Segments returned while the pool
+    // is full are freed.
+
+    uint maxCachedSegmentWords = 64 * 1024;
+    // Segments larger than this are never cached, so that one unusually large message does not
+    // permanently pin a large amount of memory.
+  };
+
+  SegmentPool();
+  explicit SegmentPool(Options options);
+  KJ_DISALLOW_COPY(SegmentPool);
+  ~SegmentPool() noexcept(false);
+
+  kj::ArrayPtr<word> take(uint minimumSize, uint preferredSize);
+  // Returns a zeroed segment of at least `minimumSize` words.  A cached segment is used if one
+  // is available; otherwise a new segment of max(minimumSize, preferredSize) words is allocated.
+
+  void give(kj::ArrayPtr<word> segment, size_t wordsUsed);
+  // Returns a segment previously obtained from `take()`.  Only the first `wordsUsed` words are
+  // re-zeroed; the caller promises that the rest of the segment was never written.
+
+  void reserve(uint segmentCount, uint segmentWords);
+  // Allocates up to `segmentCount` segments of `segmentWords` words into the cache, stopping when
+  // it is full, and writes every page of them from the calling thread.  With the kernel's
+  // first-touch placement this puts the memory on the calling thread's NUMA node (rather than
+  // whichever thread happens to touch a page first), and it keeps the first messages from paying
+  // for page faults.  Segments larger than `maxCachedSegmentWords` are not reserved.
+
+  struct Stats {
+    uint64_t hits = 0;
+    // Number of `take()` calls satisfied from the cache.
+
+    uint64_t misses = 0;
+    // Number of `take()` calls that had to allocate a new segment.
+
+    uint64_t discards = 0;
+    // Number of segments freed by `give()` because they were too large or the pool was full.
+  };
+
+  const Stats& getStats() const { return stats; }
+  size_t getCachedSegmentCount() const { return count; }
+
+private:
+  Options options;
+  Stats stats;
+
+  kj::Array<kj::ArrayPtr<word>> cached;
+  size_t count = 0;
+};
+
+class PooledMessageBuilder: public MessageBuilder {
+  // Like `MallocMessageBuilder`, but obtains its segments from a `SegmentPool` and returns them
+  // there when destroyed.  This is useful when building large numbers of short-lived messages,
+  // e.g. RPC calls and returns, where allocating and zeroing fresh segments for every message
+  // would be a bottleneck.
+
+public:
+  explicit PooledMessageBuilder(SegmentPool& pool,
+      uint firstSegmentWords = SUGGESTED_FIRST_SEGMENT_WORDS,
+      AllocationStrategy allocationStrategy = SUGGESTED_ALLOCATION_STRATEGY);
+  KJ_DISALLOW_COPY(PooledMessageBuilder);
+  virtual ~PooledMessageBuilder() noexcept(false);
+
+  virtual kj::ArrayPtr<word> allocateSegment(uint minimumSize) override;
+
+private:
+  SegmentPool& pool;
+  uint nextSize;
+  AllocationStrategy allocationStrategy;
+
+  kj::ArrayPtr<word> firstSegment;
+  kj::Vector<kj::ArrayPtr<word>> moreSegments;
+};
+
+class ArenaMessageBuilder: public MessageBuilder {
+  // A MessageBuilder that carves its segments out of a `kj::Arena`.  Nothing is freed when the
+  // builder is destroyed; the segments go away with the arena.  This lets a request handler put
+  // the response message, its orphans, and any temporary strings (`Arena::copyString()`) all in
+  // one per-request arena and release everything at once when the request completes.
+  //
+  // The arena must outlive the builder and anything that still points into the message.  Since
+  // an arena never reuses memory, segments of a builder that is discarded early are not reclaimed
+  // until the arena is destroyed.  For other allocation schemes, subclass MessageBuilder directly
+  // and override `allocateSegment()`.
+
+public:
+  explicit ArenaMessageBuilder(kj::Arena& arena,
+      uint firstSegmentWords = SUGGESTED_FIRST_SEGMENT_WORDS,
+      AllocationStrategy allocationStrategy = SUGGESTED_ALLOCATION_STRATEGY);
+  KJ_DISALLOW_COPY(ArenaMessageBuilder);
+  virtual ~ArenaMessageBuilder() noexcept(false);
+
+  virtual kj::ArrayPtr<word> allocateSegment(uint minimumSize) override;
+
+private:
+  kj::Arena& arena;
+  uint nextSize;
+  AllocationStrategy allocationStrategy;
+  bool allocatedFirstSegment = false;
+};
+
 class FlatMessageBuilder: public MessageBuilder {
   // THIS IS NOT THE CLASS YOU'RE LOOKING FOR.
   //
@@ -492,6 +757,24 @@ typename kj::ArrayPtr<const word> writeDataStruct(BuilderType builder) {
                       reinterpret_cast<word*>(bytes.end()));
 }
 
+namespace _ {  // private
+
+template <typename T>
+constexpr uint fixedMessageWordsOrDefault(decltype(T::_capnpPrivate::fixedMessageWords)*) {
+  return T::_capnpPrivate::fixedMessageWords;
+}
+template <typename T>
+constexpr uint fixedMessageWordsOrDefault(...) {
+  return SUGGESTED_FIRST_SEGMENT_WORDS;
+}
+
+}  // namespace _ (private)
+
+template <typename RootType>
+constexpr uint firstSegmentWordsFor() {
+  return _::fixedMessageWordsOrDefault<RootType>(nullptr);
+}
+
 template <typename Type>
 static typename Type::Reader defaultValue() {
   return typename Type::Reader(_::StructReader());
@@ -502,4 +785,9 @@ kj::Array<word> canonicalize(T&& reader) {
     return _::PointerHelpers<FromReader<T>>::getInternalReader(reader).canonicalize();
 }
 
+template <typename T>
+void writeCanonical(T&& reader, kj::OutputStream& output, uint threadCount) {
+  _::PointerHelpers<FromReader<T>>::getInternalReader(reader).writeCanonical(output, threadCount);
+}
+
 }  // namespace capnp
@@ -20,6 +20,7 @@
 // THE SOFTWARE.
 
 #include "message.h"
+#include "serialize.h"
 #include <kj/debug.h>
 #include <kj/compat/gtest.h>
 #include "test-util.h"
@@ -1026,6 +1027,126 @@ TEST(Orphans, ReferenceExternalData_NoZeroImmediateAbandon) {
   }
 }
 
+bool isWithin(kj::ArrayPtr<const word> segment, kj::ArrayPtr<const word> memory) {
+  return segment.begin() >= memory.begin() && segment.end() <= memory.end();
+}
+
+TEST(Orphans, Reference) {
+  MallocMessageBuilder source;
+  initTestMessage(source.initRoot<TestAllTypes>());
+  kj::Array<word> flat = messageToFlatArray(source);
+  FlatArrayMessageReader reader(flat);
+
+  MallocMessageBuilder builder;
+  builder.adoptRoot(builder.getOrphanage().newOrphanReference(reader.getRoot<TestAllTypes>()));
+
+  // The whole message was linked rather than copied:  the builder's own segment holds only the
+  // root pointer and a far pointer landing pad.
+  {
+    auto segments = builder.getSegmentsForOutput();
+    ASSERT_EQ(2, segments.size());
+    EXPECT_LE(segments[0].size(), 3);
+    EXPECT_TRUE(isWithin(segments[1], flat));
+  }
+  checkTestMessage(builder.getRoot<AnyPointer>().asReader().getAs<TestAllTypes>());
+
+  // Modifying the root copies just the root struct.
+  auto root = builder.getRoot<TestAllTypes>();
+  root.setInt32Field(1234);
+  EXPECT_LT(builder.getSegmentsForOutput()[0].size(), flat.size() / 4);
+
+  // Modifying a child copies it as well.
+  root.getStructField().setTextField("changed");
+  root.getStructList()[1].setUInt8Field(99);
+
+  EXPECT_EQ(1234, root.getInt32Field());
+  EXPECT_EQ("changed", root.getStructField().getTextField());
+  EXPECT_EQ(99, root.getStructList()[1].getUInt8Field());
+  EXPECT_EQ("structlist 2", root.getStructList()[1].getTextField());
+  EXPECT_EQ("really nested",
+            root.getStructField().getStructField().getStructField().getTextField());
+
+  // The source is untouched.
+  checkTestMessage(reader.getRoot<TestAllTypes>());
+
+  // The output is a valid message.
+  kj::Array<word> output = messageToFlatArray(builder);
+  FlatArrayMessageReader outputReader(output);
+  auto outputRoot = outputReader.getRoot<TestAllTypes>();
+  EXPECT_EQ(1234, outputRoot.getInt32Field());
+  EXPECT_EQ("changed", outputRoot.getStructField().getTextField());
+  EXPECT_EQ(99, outputRoot.getStructList()[1].getUInt8Field());
+  EXPECT_EQ("foo", outputRoot.getTextField());
+}
+
+TEST(Orphans, ReferenceMultiSegment) {
+  // Every object in its own segment, so every pointer is a far pointer.  The objects are still
+  // linked, but the structs containing those far pointers have to be copied.
+  MallocMessageBuilder source(1, AllocationStrategy::FIXED_SIZE);
+  initTestMessage(source.initRoot<TestAllTypes>());
+  SegmentArrayMessageReader reader(source.getSegmentsForOutput());
+
+  MallocMessageBuilder builder;
+  builder.adoptRoot(builder.getOrphanage().newOrphanReference(reader.getRoot<TestAllTypes>()));
+  checkTestMessage(builder.getRoot<AnyPointer>().asReader().getAs<TestAllTypes>());
+
+  kj::Array<word> output = messageToFlatArray(builder);
+  FlatArrayMessageReader outputReader(output);
+  checkTestMessage(outputReader.getRoot<TestAllTypes>());
+
+  checkTestMessage(builder.getRoot<TestAllTypes>());
+  checkTestMessage(reader.getRoot<TestAllTypes>());
+}
+
+TEST(Orphans, ReferenceList) {
+  MallocMessageBuilder source;
+  initTestMessage(source.initRoot<TestAllTypes>());
+  kj::Array<word> flat = messageToFlatArray(source);
+  FlatArrayMessageReader reader(flat);
+
+  MallocMessageBuilder builder;
+  auto root = builder.initRoot<TestAllTypes>();
+  root.adoptStructList(builder.getOrphanage().newOrphanReference(
+      reader.getRoot<TestAllTypes>().getStructList()));
+  root.adoptInt16List(builder.getOrphanage().newOrphanReference(
+      reader.getRoot<TestAllTypes>().getInt16List()));
+
+  // Each call adds its own external segment.
+  {
+    auto segments = builder.getSegmentsForOutput();
+    ASSERT_EQ(3, segments.size());
+    EXPECT_TRUE(isWithin(segments[1], flat));
+    EXPECT_TRUE(isWithin(segments[2], flat));
+  }
+
+  auto structList = root.asReader().getStructList();
+  ASSERT_EQ(3, structList.size());
+  EXPECT_EQ("structlist 1", structList[0].getTextField());
+  EXPECT_EQ("structlist 2", structList[1].getTextField());
+  EXPECT_EQ("structlist 3", structList[2].getTextField());
+  checkList(root.asReader().getInt16List(), {11111, -11111});
+
+  root.getStructList()[2].setTextField("changed");
+  root.getInt16List().set(0, 4321);
+  EXPECT_EQ("changed", root.getStructList()[2].getTextField());
+  EXPECT_EQ("structlist 1", root.getStructList()[0].getTextField());
+  checkList(root.asReader().getInt16List(), {4321, -11111});
+
+  checkTestMessage(reader.getRoot<TestAllTypes>());
+}
+
+TEST(Orphans, ReferenceSameMessage) {
+  // Referencing an object in the same message just copies it.
+  MallocMessageBuilder builder;
+  auto root = builder.initRoot<TestAllTypes>();
+  initTestMessage(root.initStructField());
+
+  auto orphan = builder.getOrphanage().newOrphanReference(root.asReader().getStructField());
+  EXPECT_EQ(1, builder.getSegmentsForOutput().size());
+  orphan.get().setInt32Field(1);
+  checkTestMessage(root.asReader().getStructField());
+}
+
 TEST(Orphans, TruncateData) {
   MallocMessageBuilder message;
   auto orphan = message.getOrphanage().newOrphan<Data>(17);
@@ -152,6 +152,26 @@ public:
   // in which some new fields had been added to the struct, using `setWithCaveats()` would
   // truncate off those new fields.
 
+  template <typename Reader>
+  Orphan<FromReader<Reader>> newOrphanReference(Reader linkFrom) const;
+  // Like newOrphanCopy(), but for a struct or list from another message, avoids copying by
+  // pointing into that message's memory instead.  The segments of `linkFrom`'s message are added
+  // to this message as external segments, so a large unchanged subtree costs nothing to include.
+  // Objects that can't be used in place -- those containing capabilities, or far pointers to other
+  // segments of the source message -- are copied, though their children may still be linked.
+  //
+  // The result can be modified:  getting a Builder for an object in an external segment first
+  // copies that one object into this message's own space (its children stay linked until they
+  // are modified in turn), leaving the source untouched.  However:
+  // - The source message's memory must remain valid and unchanged until the `MessageBuilder` is
+  //   destroyed (even if the orphan is abandoned).
+  // - When the message is written out, each source segment contributes the whole range of words
+  //   spanned by the linked objects, including anything in between that isn't part of them, and
+  //   including the original versions of objects that have since been modified.  Thus, there must
+  //   be no secrets in these regions.
+  // - Each call adds its own external segments, even for memory already linked by an earlier
+  //   call, so prefer linking one common parent over many siblings.
+
   Orphan<Data> referenceExternalData(Data::Reader data) const;
   // Creates an Orphan<Data> that points at an existing region of memory (e.g. from another message)
   // without copying it.  There are some SEVERE restrictions on how this can be used:
@@ -430,6 +450,12 @@ Orphanage::newOrphanConcat(kj::ArrayPtr<const T> lists) const {
           _::minStructSizeForElement<Element>(), raw));
 }
 
+template <typename Reader>
+inline Orphan<FromReader<Reader>> Orphanage::newOrphanReference(Reader linkFrom) const {
+  return Orphan<FromReader<Reader>>(_::OrphanBuilder::reference(
+      arena, capTable, GetInnerReader<FromReader<Reader>>::apply(linkFrom)));
+}
+
 inline Orphan<Data> Orphanage::referenceExternalData(Data::Reader data) const {
   return Orphan<Data>(_::OrphanBuilder::referenceExternalData(arena, data));
 }
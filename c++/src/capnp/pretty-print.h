@@ -28,6 +28,8 @@
 #include "dynamic.h"
 #include <kj/string-tree.h>
 
+namespace kj { class OutputStream; }
+
 namespace capnp {
 
 kj::StringTree prettyPrint(DynamicStruct::Reader value);
@@ -41,4 +43,13 @@ kj::StringTree prettyPrint(DynamicList::Builder value);
 // If you don't want indentation, just use the value's KJ stringifier (e.g. pass it to kj::str(),
 // any of the KJ debug macros, etc.).
 
+void printTo(DynamicValue::Reader value, kj::OutputStream& output);
+// Write the same text as kj::str(value) to `output`, a few kilobytes at a time, without holding
+// the whole string in memory.
+
+void prettyPrintTo(DynamicValue::Reader value, kj::OutputStream& output);
+// Like prettyPrint(), but writes the result to `output`.  Structs and lists are still laid out in
+// memory first, since the indentation depends on the size of each subtree.  Other values are
+// written as by printTo().
+
 }  // namespace capnp
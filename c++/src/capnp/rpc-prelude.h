@@ -35,6 +35,10 @@ namespace capnp {
 
 class OutgoingRpcMessage;
 class IncomingRpcMessage;
+class RpcFlowController;
+class RpcObserver;
+struct RpcTableSizes;
+struct RpcMethodSizeHints;
 
 template <typename SturdyRefHostId>
 class RpcSystem;
@@ -59,6 +63,7 @@ public:
     virtual kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> receiveIncomingMessage() = 0;
     virtual kj::Promise<void> shutdown() = 0;
     virtual AnyStruct::Reader baseGetPeerVatId() = 0;
+    virtual kj::Own<RpcFlowController> newStream() = 0;
   };
   virtual kj::Maybe<kj::Own<Connection>> baseConnect(AnyStruct::Reader vatId) = 0;
   virtual kj::Promise<kj::Own<Connection>> baseAccept() = 0;
@@ -94,6 +99,10 @@ private:
   Capability::Client baseBootstrap(AnyStruct::Reader vatId);
   Capability::Client baseRestore(AnyStruct::Reader vatId, AnyPointer::Reader objectId);
   void baseSetFlowLimit(size_t words);
+  void baseSetObserver(kj::Maybe<RpcObserver&> observer);
+  RpcTableSizes baseGetTableSizes();
+  void baseSetSizeHintLearning(bool enable);
+  kj::Array<RpcMethodSizeHints> baseGetSizeHints();
 
   template <typename>
   friend class capnp::RpcSystem;
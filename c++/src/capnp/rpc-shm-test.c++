@@ -0,0 +1,135 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#if !_WIN32
+
+#define CAPNP_TESTING_CAPNP 1
+
+#include "rpc-shm.h"
+#include "test-util.h"
+#include <kj/debug.h>
+#include <kj/io.h>
+#include <kj/compat/gtest.h>
+#include <unistd.h>
+
+namespace capnp {
+namespace _ {
+namespace {
+
+Capability::Client bootstrap(RpcSystem<rpc::twoparty::VatId>& client) {
+  MallocMessageBuilder message(8);
+  auto vatId = message.initRoot<rpc::twoparty::VatId>();
+  vatId.setSide(rpc::twoparty::Side::SERVER);
+  return client.bootstrap(vatId);
+}
+
+TEST(SharedMemoryNetwork, Basic) {
+  auto ioContext = kj::setupAsyncIo();
+  auto& waitScope = ioContext.waitScope;
+  auto pipe = ioContext.provider->newCapabilityPipe();
+  int callCount = 0;
+
+  SharedMemoryVatNetwork::Options options;
+  options.ringSize = 4096;  // Small, so that the calls below fill it and big messages overflow it.
+
+  SharedMemoryVatNetwork serverNetwork(*pipe.ends[0], rpc::twoparty::Side::SERVER, options);
+  auto server = makeRpcServer(serverNetwork, kj::heap<TestInterfaceImpl>(callCount));
+
+  {
+    SharedMemoryVatNetwork clientNetwork(*pipe.ends[1], rpc::twoparty::Side::CLIENT, options);
+    auto client = makeRpcClient(clientNetwork);
+    auto cap = bootstrap(client).castAs<test::TestInterface>();
+
+    {
+      auto request = cap.fooRequest();
+      request.setI(123);
+      request.setJ(true);
+      EXPECT_EQ("foo", request.send().wait(waitScope).getX());
+    }
+
+    {
+      // Bigger than a quarter of the ring, so it goes over the stream.  It still has to be
+      // delivered in order with the calls around it.
+      auto request1 = cap.fooRequest();
+      request1.setI(123);
+      request1.setJ(true);
+      auto promise1 = request1.send();
+
+      auto request2 = cap.bazRequest();
+      initTestMessage(request2.initS());
+      EXPECT_GT(request2.totalSize().wordCount, 4096 / sizeof(word) / 4);
+      auto promise2 = request2.send();
+
+      auto request3 = cap.fooRequest();
+      request3.setI(123);
+      request3.setJ(true);
+      auto promise3 = request3.send();
+
+      EXPECT_EQ("foo", promise1.wait(waitScope).getX());
+      promise2.wait(waitScope);
+      EXPECT_EQ("foo", promise3.wait(waitScope).getX());
+    }
+
+    {
+      // Many more calls than fit in the ring at once.
+      kj::Vector<kj::Promise<void>> promises;
+      for (uint i = 0; i < 500; i++) {
+        auto request = cap.fooRequest();
+        request.setI(123);
+        request.setJ(true);
+        promises.add(request.send().then([](auto&& response) {
+          EXPECT_EQ("foo", response.getX());
+        }));
+      }
+      kj::joinPromises(promises.releaseAsArray()).wait(waitScope);
+    }
+
+    EXPECT_EQ(504, callCount);
+  }
+
+  // Closing the client's end disconnects the server.
+  pipe.ends[1] = nullptr;
+  serverNetwork.onDisconnect().wait(waitScope);
+}
+
+TEST(SharedMemoryNetwork, InvalidRing) {
+  // A peer that sends something other than a properly-sized, sealed ring gets disconnected.
+  auto ioContext = kj::setupAsyncIo();
+  auto& waitScope = ioContext.waitScope;
+  auto pipe = ioContext.provider->newCapabilityPipe();
+  int callCount = 0;
+
+  SharedMemoryVatNetwork network(*pipe.ends[0], rpc::twoparty::Side::SERVER);
+  auto server = makeRpcServer(network, kj::heap<TestInterfaceImpl>(callCount));
+
+  int fds[2];
+  KJ_SYSCALL(::pipe(fds));
+  kj::AutoCloseFd in(fds[0]), out(fds[1]);
+  pipe.ends[1]->sendFd(in).wait(waitScope);
+
+  network.onDisconnect().wait(waitScope);
+}
+
+}  // namespace
+}  // namespace _ (private)
+}  // namespace capnp
+
+#endif  // !_WIN32
@@ -0,0 +1,663 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#if !_WIN32
+
+#include "rpc-shm.h"
+#include "serialize.h"
+#include "serialize-async.h"
+#include "endian.h"
+#include <kj/debug.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#if __linux__
+#include <sys/syscall.h>
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#endif
+
+namespace capnp {
+
+namespace {
+
+// Layout of a ring's shared memory:  a RingHeader, then (at RING_DATA_OFFSET) the ring itself.
+// Positions count words and wrap around at 2^32; the ring's capacity is a power of two, so a
+// position's offset into the ring is just its low bits.
+//
+// The ring holds a sequence of records, each a RecordHeader word followed by `sizeInWords` words
+// of content.  A record never wraps around the end of the ring; if the next one doesn't fit
+// before the end, the writer pads the remainder with a PADDING record.
+//
+// Each side must distrust everything it reads from the peer's shared memory, because the peer
+// can change it at any time.  We keep our own copies of positions and sizes, validate whatever
+// we load, and copy messages out before parsing them.
+
+struct RingHeader {
+  uint32_t magic;
+  uint32_t capacity;  // in words
+
+  alignas(64) uint32_t writePos;
+  // Written by the writer (release) after adding records.
+
+  alignas(64) uint32_t readPos;
+  // Written by the reader (release) after consuming records.
+
+  alignas(64) uint32_t readerWaiting;
+  // Set by the reader before sleeping.  A writer that sees it set after publishing clears it and
+  // sends DATA_READY_FRAME.
+
+  uint32_t writerWaiting;
+  // Likewise, set by a writer that found the ring full; the reader answers with
+  // SPACE_FREED_FRAME.
+};
+
+constexpr uint32_t RING_MAGIC = 0x6d687363;  // "cshm"
+constexpr size_t RING_DATA_OFFSET = 4096;
+constexpr size_t MIN_RING_SIZE = 4096;
+constexpr size_t MAX_RING_SIZE = size_t(1) << 30;
+static_assert(sizeof(RingHeader) <= RING_DATA_OFFSET, "RingHeader too big");
+
+constexpr uint32_t RECORD_MESSAGE = 1;
+constexpr uint32_t RECORD_PADDING = 2;
+constexpr uint32_t RECORD_STREAMED = 3;
+// A RECORD_STREAMED record is a placeholder for a message that was too big for the ring and is
+// sent over the stream instead.
+
+struct RecordHeader {
+  uint32_t type;
+  uint32_t sizeInWords;
+};
+static_assert(sizeof(RecordHeader) == sizeof(word), "RecordHeader must be one word");
+
+void writeRecordHeader(word* slot, uint32_t type, uint32_t sizeInWords) {
+  // `word` has no copy assignment only so that message data isn't copied by accident. The ring is
+  // plain shared memory, so the header's bytes can be stored into it directly.
+  RecordHeader header { type, sizeInWords };
+  memcpy(static_cast<void*>(slot), &header, sizeof(header));
+}
+
+// Single-byte frames sent over the stream.
+const kj::byte DATA_READY_FRAME = 'D';
+const kj::byte SPACE_FREED_FRAME = 'F';
+const kj::byte STREAMED_MESSAGE_FRAME = 'M';  // followed by the message in standard framing
+
+kj::AutoCloseFd createSharedMemory() {
+#if __linux__ && defined(SYS_memfd_create)
+  int fd;
+  KJ_SYSCALL(fd = syscall(SYS_memfd_create, "capnp-rpc-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+  return kj::AutoCloseFd(fd);
+#else
+  static uint counter = 0;
+  auto name = kj::str("/capnp-rpc-shm-", getpid(), '-',
+                      __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED));
+  int fd;
+  KJ_SYSCALL(fd = shm_open(name.cStr(), O_RDWR | O_CREAT | O_EXCL, 0600), name);
+  kj::AutoCloseFd result(fd);
+  KJ_SYSCALL(shm_unlink(name.cStr()), name);
+  return result;
+#endif
+}
+
+}  // namespace
+
+class SharedMemoryVatNetwork::Ring {
+public:
+  Ring(kj::AutoCloseFd fdParam, size_t size): fd(kj::mv(fdParam)), size(size) {
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+      KJ_FAIL_SYSCALL("mmap", errno);
+    }
+    mapping = reinterpret_cast<kj::byte*>(ptr);
+  }
+
+  ~Ring() noexcept(false) {
+    KJ_SYSCALL(munmap(mapping, size)) { break; }
+  }
+
+  KJ_DISALLOW_COPY(Ring);
+
+  static kj::Own<Ring> create(size_t requestedSize) {
+    KJ_REQUIRE(requestedSize <= MAX_RING_SIZE, "shared-memory ring too big", requestedSize);
+    size_t ringSize = MIN_RING_SIZE;
+    while (ringSize < requestedSize) ringSize *= 2;
+
+    auto fd = createSharedMemory();
+    KJ_SYSCALL(ftruncate(fd, RING_DATA_OFFSET + ringSize));
+#if __linux__ && defined(F_ADD_SEALS)
+    // Promise the peer that the memory can't be truncated out from under it (which would make its
+    // accesses fault).
+    KJ_SYSCALL(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL));
+#endif
+
+    auto ring = kj::heap<Ring>(kj::mv(fd), RING_DATA_OFFSET + ringSize);
+    ring->capacity = ringSize / sizeof(word);
+    auto& header = ring->header();
+    header.magic = RING_MAGIC;
+    header.capacity = ring->capacity;
+    return ring;
+  }
+
+  static kj::Own<Ring> open(kj::AutoCloseFd fd) {
+    struct stat stats;
+    KJ_SYSCALL(fstat(fd, &stats));
+    size_t size = stats.st_size;
+    size_t ringSize = size - RING_DATA_OFFSET;
+    KJ_REQUIRE(size > RING_DATA_OFFSET && ringSize >= MIN_RING_SIZE &&
+               ringSize <= MAX_RING_SIZE && (ringSize & (ringSize - 1)) == 0,
+               "peer sent an invalid shared-memory ring", size);
+#if __linux__ && defined(F_GET_SEALS)
+    int seals;
+    KJ_SYSCALL(seals = fcntl(fd, F_GET_SEALS));
+    KJ_REQUIRE(seals & F_SEAL_SHRINK, "peer's shared-memory ring can be truncated");
+#endif
+
+    auto ring = kj::heap<Ring>(kj::mv(fd), size);
+    ring->capacity = ringSize / sizeof(word);
+    auto& header = ring->header();
+    KJ_REQUIRE(header.magic == RING_MAGIC && header.capacity == ring->capacity,
+               "peer sent an invalid shared-memory ring");
+    return ring;
+  }
+
+  int getFd() { return fd; }
+  RingHeader& header() { return *reinterpret_cast<RingHeader*>(mapping); }
+  word* data() { return reinterpret_cast<word*>(mapping + RING_DATA_OFFSET); }
+
+  uint32_t capacity = 0;
+  // In words.  Our own copy, since the one in the header could be changed by the peer.
+
+private:
+  kj::AutoCloseFd fd;
+  kj::byte* mapping;
+  size_t size;
+};
+
+// =======================================================================================
+
+class SharedMemoryVatNetwork::OutgoingMessageImpl final
+    : public OutgoingRpcMessage, public kj::Refcounted {
+public:
+  OutgoingMessageImpl(SharedMemoryVatNetwork& network, uint firstSegmentWordSize)
+      : network(network),
+        message(firstSegmentWordSize == 0 ? SUGGESTED_FIRST_SEGMENT_WORDS
+                                          : firstSegmentWordSize) {}
+
+  AnyPointer::Builder getBody() override {
+    return message.getRoot<AnyPointer>();
+  }
+
+  void send() override {
+    size_t size = sizeInWords();
+    KJ_REQUIRE(size < ReaderOptions().traversalLimitInWords, size,
+               "Trying to send Cap'n Proto message larger than the single-message size limit. The "
+               "other side probably won't accept it and would abort the connection, so I won't "
+               "send it.") {
+      return;
+    }
+
+    KJ_ASSERT(!network.shutDown, "already shut down");
+    network.send(kj::addRef(*this));
+  }
+
+  size_t sizeInWords() override {
+    size_t size = 0;
+    for (auto& segment: message.getSegmentsForOutput()) {
+      size += segment.size();
+    }
+    return size;
+  }
+
+  kj::ArrayPtr<const kj::ArrayPtr<const word>> getSegments() {
+    return message.getSegmentsForOutput();
+  }
+
+private:
+  SharedMemoryVatNetwork& network;
+  MallocMessageBuilder message;
+};
+
+class SharedMemoryVatNetwork::IncomingMessageImpl final: public IncomingRpcMessage {
+public:
+  IncomingMessageImpl(kj::Array<word> wordsParam, ReaderOptions options)
+      : words(kj::mv(wordsParam)), message(kj::heap<FlatArrayMessageReader>(words, options)) {}
+  IncomingMessageImpl(kj::Own<MessageReader> message): message(kj::mv(message)) {}
+
+  AnyPointer::Reader getBody() override {
+    return message->getRoot<AnyPointer>();
+  }
+
+  size_t sizeInWords() override {
+    size_t size = 0;
+    for (uint i = 0;; i++) {
+      auto segment = message->getSegment(i);
+      if (segment == nullptr) break;
+      size += segment.size();
+    }
+    return size;
+  }
+
+private:
+  kj::Array<word> words;
+  kj::Own<MessageReader> message;
+};
+
+// =======================================================================================
+
+SharedMemoryVatNetwork::SharedMemoryVatNetwork(
+    kj::AsyncCapabilityStream& stream, rpc::twoparty::Side side)
+    : SharedMemoryVatNetwork(stream, side, Options()) {}
+
+SharedMemoryVatNetwork::SharedMemoryVatNetwork(
+    kj::AsyncCapabilityStream& stream, rpc::twoparty::Side side, Options options)
+    : stream(stream), side(side), peerVatId(4), receiveOptions(options.receiveOptions),
+      outgoingRing(Ring::create(options.ringSize)), tasks(*this) {
+  peerVatId.initRoot<rpc::twoparty::VatId>().setSide(
+      side == rpc::twoparty::Side::CLIENT ? rpc::twoparty::Side::SERVER
+                                          : rpc::twoparty::Side::CLIENT);
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  disconnectPromise = paf.promise.fork();
+  disconnectFulfiller.fulfiller = kj::mv(paf.fulfiller);
+
+  // Each side's first transmission is its ring.  We can start writing messages into ours right
+  // away; the peer will find them once it has mapped it.
+  previousWrite = stream.sendFd(outgoingRing->getFd()).eagerlyEvaluate(nullptr);
+
+  tasks.add(stream.receiveFd().then([this](kj::AutoCloseFd&& fd) {
+    incomingRing = Ring::open(kj::mv(fd));
+    wakeReceiver();
+    return receiveLoop();
+  }));
+}
+
+SharedMemoryVatNetwork::~SharedMemoryVatNetwork() noexcept(false) {}
+
+void SharedMemoryVatNetwork::FulfillerDisposer::disposeImpl(void* pointer) const {
+  if (--refcount == 0) {
+    fulfiller->fulfill();
+  }
+}
+
+kj::Own<TwoPartyVatNetworkBase::Connection> SharedMemoryVatNetwork::asConnection() {
+  ++disconnectFulfiller.refcount;
+  return kj::Own<TwoPartyVatNetworkBase::Connection>(this, disconnectFulfiller);
+}
+
+kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> SharedMemoryVatNetwork::connect(
+    rpc::twoparty::VatId::Reader ref) {
+  if (ref.getSide() == side) {
+    return nullptr;
+  } else {
+    return asConnection();
+  }
+}
+
+kj::Promise<kj::Own<TwoPartyVatNetworkBase::Connection>> SharedMemoryVatNetwork::accept() {
+  if (side == rpc::twoparty::Side::SERVER && !accepted) {
+    accepted = true;
+    return asConnection();
+  } else {
+    // Create a promise that will never be fulfilled.
+    auto paf = kj::newPromiseAndFulfiller<kj::Own<TwoPartyVatNetworkBase::Connection>>();
+    acceptFulfiller = kj::mv(paf.fulfiller);
+    return kj::mv(paf.promise);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Sending
+
+void SharedMemoryVatNetwork::send(kj::Own<OutgoingMessageImpl> message) {
+  if (pendingSends.empty() && tryWriteToRing(*message)) {
+    return;
+  }
+  pendingSends.add(kj::mv(message));
+}
+
+bool SharedMemoryVatNetwork::tryWriteToRing(OutgoingMessageImpl& message) {
+  auto& ring = *outgoingRing;
+  auto segments = message.getSegments();
+  size_t size = computeSerializedSizeInWords(segments);
+
+  if (size + 1 > ring.capacity / 4) {
+    // Too big; leave a placeholder in the ring and send the message over the stream.
+    if (!reserve(1)) return false;
+    writeRecordHeader(ring.data() + (writePos & (ring.capacity - 1)), RECORD_STREAMED, 0);
+    writePos += 1;
+
+    auto ref = kj::addRef(message);
+    writeToStream([this, ref = kj::mv(ref)]() mutable {
+      auto segments = ref->getSegments();
+      return stream.write(&STREAMED_MESSAGE_FRAME, 1)
+          .then([this, segments]() { return writeMessage(stream, segments); })
+          .attach(kj::mv(ref));
+    });
+  } else {
+    if (!reserve(size + 1)) return false;
+    word* dst = ring.data() + (writePos & (ring.capacity - 1));
+    writeRecordHeader(dst++, RECORD_MESSAGE, size);
+
+    // Same layout as messageToFlatArray().
+    auto table = reinterpret_cast<_::WireValue<uint32_t>*>(dst);
+    table[0].set(segments.size() - 1);
+    for (uint i = 0; i < segments.size(); i++) {
+      table[i + 1].set(segments[i].size());
+    }
+    if (segments.size() % 2 == 0) {
+      table[segments.size() + 1].set(0);
+    }
+    dst += segments.size() / 2 + 1;
+    for (auto& segment: segments) {
+      memcpy(static_cast<void*>(dst), segment.begin(), segment.size() * sizeof(word));
+      dst += segment.size();
+    }
+
+    writePos += size + 1;
+  }
+
+  publishWrite();
+  return true;
+}
+
+bool SharedMemoryVatNetwork::reserve(size_t words) {
+  // Make sure there are `words` contiguous free words at writePos, inserting padding if needed.
+  // If there isn't enough space, asks the reader to tell us when there is, and returns false.
+
+  auto& ring = *outgoingRing;
+  auto& header = ring.header();
+  uint32_t contiguous = ring.capacity - (writePos & (ring.capacity - 1));
+  uint32_t needed = words <= contiguous ? words : contiguous + words;
+
+  bool announced = false;
+  for (;;) {
+    uint32_t used = writePos - __atomic_load_n(&header.readPos, __ATOMIC_SEQ_CST);
+    KJ_REQUIRE(used <= ring.capacity, "shared-memory RPC peer corrupted its read position");
+    if (ring.capacity - used >= needed) break;
+
+    if (announced) return false;
+
+    // Ask to be told when space is freed, then check again in case it was freed in the meantime.
+    __atomic_store_n(&header.writerWaiting, 1, __ATOMIC_SEQ_CST);
+    announced = true;
+  }
+
+  if (announced) {
+    // Didn't need to wait after all.
+    __atomic_store_n(&header.writerWaiting, 0, __ATOMIC_RELAXED);
+  }
+
+  if (words > contiguous) {
+    writeRecordHeader(ring.data() + (writePos & (ring.capacity - 1)),
+                      RECORD_PADDING, contiguous - 1);
+    writePos += contiguous;
+  }
+  return true;
+}
+
+void SharedMemoryVatNetwork::publishWrite() {
+  auto& header = outgoingRing->header();
+  __atomic_store_n(&header.writePos, writePos, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&header.readerWaiting, __ATOMIC_SEQ_CST) != 0 &&
+      __atomic_exchange_n(&header.readerWaiting, 0, __ATOMIC_SEQ_CST) != 0) {
+    writeFrame(DATA_READY_FRAME);
+  }
+}
+
+void SharedMemoryVatNetwork::sendPending() {
+  size_t sent = 0;
+  while (sent < pendingSends.size() && tryWriteToRing(*pendingSends[sent])) {
+    ++sent;
+  }
+
+  if (sent == pendingSends.size()) {
+    pendingSends.clear();
+    KJ_IF_MAYBE(f, drainFulfiller) {
+      f->get()->fulfill();
+      drainFulfiller = nullptr;
+    }
+  } else if (sent > 0) {
+    kj::Vector<kj::Own<OutgoingMessageImpl>> remaining(pendingSends.size() - sent);
+    for (auto i: kj::range(sent, pendingSends.size())) {
+      remaining.add(kj::mv(pendingSends[i]));
+    }
+    pendingSends = kj::mv(remaining);
+  }
+}
+
+void SharedMemoryVatNetwork::writeFrame(const kj::byte& frame) {
+  writeToStream([this, &frame]() { return stream.write(&frame, 1); });
+}
+
+void SharedMemoryVatNetwork::writeToStream(kj::Function<kj::Promise<void>()> func) {
+  // As in TwoPartyVatNetwork, write failures are not reported here; the read end will fail as
+  // well and it's cleaner to handle the failure there.
+  KJ_IF_MAYBE(p, previousWrite) {
+    previousWrite = p->then(kj::mv(func)).eagerlyEvaluate(nullptr);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Receiving
+
+kj::Maybe<kj::Own<IncomingRpcMessage>> SharedMemoryVatNetwork::tryReadFromRing(
+    Ring& ring, bool& wouldBlock) {
+  // Returns null if the ring is empty, or if the next message has not yet arrived over the stream
+  // (in which case `wouldBlock` is set).
+
+  auto& header = ring.header();
+  for (;;) {
+    uint32_t available = __atomic_load_n(&header.writePos, __ATOMIC_SEQ_CST) - readPos;
+    KJ_REQUIRE(available <= ring.capacity, "shared-memory RPC peer corrupted its write position");
+    if (available == 0) return nullptr;
+
+    uint32_t offset = readPos & (ring.capacity - 1);
+    RecordHeader record;
+    memcpy(&record, ring.data() + offset, sizeof(record));
+    KJ_REQUIRE(record.sizeInWords < available && record.sizeInWords < ring.capacity - offset,
+               "shared-memory RPC peer wrote a corrupt record");
+
+    switch (record.type) {
+      case RECORD_PADDING:
+        readPos += record.sizeInWords + 1;
+        publishRead(ring);
+        continue;
+
+      case RECORD_MESSAGE: {
+        auto words = kj::heapArray<word>(record.sizeInWords);
+        memcpy(words.asBytes().begin(), ring.data() + offset + 1, words.asBytes().size());
+        readPos += record.sizeInWords + 1;
+        publishRead(ring);
+        return kj::Own<IncomingRpcMessage>(
+            kj::heap<IncomingMessageImpl>(kj::mv(words), receiveOptions));
+      }
+
+      case RECORD_STREAMED: {
+        if (streamedMessagesConsumed == streamedMessages.size()) {
+          wouldBlock = true;
+          return nullptr;
+        }
+        auto message = kj::mv(streamedMessages[streamedMessagesConsumed++]);
+        if (streamedMessagesConsumed == streamedMessages.size()) {
+          streamedMessages.clear();
+          streamedMessagesConsumed = 0;
+        }
+        readPos += record.sizeInWords + 1;
+        publishRead(ring);
+        return kj::Own<IncomingRpcMessage>(kj::heap<IncomingMessageImpl>(kj::mv(message)));
+      }
+
+      default:
+        KJ_FAIL_REQUIRE("shared-memory RPC peer wrote an unknown record type", record.type) {
+          return nullptr;
+        }
+    }
+  }
+}
+
+void SharedMemoryVatNetwork::publishRead(Ring& ring) {
+  auto& header = ring.header();
+  __atomic_store_n(&header.readPos, readPos, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&header.writerWaiting, __ATOMIC_SEQ_CST) != 0 &&
+      __atomic_exchange_n(&header.writerWaiting, 0, __ATOMIC_SEQ_CST) != 0) {
+    writeFrame(SPACE_FREED_FRAME);
+  }
+}
+
+kj::Promise<void> SharedMemoryVatNetwork::receiveLoop() {
+  return stream.tryRead(&incomingFrame, 1, 1).then([this](size_t n) -> kj::Promise<void> {
+    if (n == 0) {
+      peerDisconnected = true;
+      wakeReceiver();
+      return kj::READY_NOW;
+    }
+
+    switch (incomingFrame) {
+      case DATA_READY_FRAME:
+        wakeReceiver();
+        break;
+
+      case SPACE_FREED_FRAME:
+        sendPending();
+        break;
+
+      case STREAMED_MESSAGE_FRAME:
+        return tryReadMessage(stream, receiveOptions)
+            .then([this](kj::Maybe<kj::Own<MessageReader>>&& message) -> kj::Promise<void> {
+          KJ_IF_MAYBE(m, message) {
+            streamedMessages.add(kj::mv(*m));
+            wakeReceiver();
+            return receiveLoop();
+          } else {
+            KJ_FAIL_REQUIRE("shared-memory RPC stream ended in the middle of a message") {
+              return kj::READY_NOW;
+            }
+          }
+        });
+
+      default:
+        KJ_FAIL_REQUIRE("invalid frame on shared-memory RPC stream", incomingFrame) {
+          return kj::READY_NOW;
+        }
+    }
+
+    return receiveLoop();
+  });
+}
+
+void SharedMemoryVatNetwork::wakeReceiver() {
+  KJ_IF_MAYBE(waiter, receiveWaiter) {
+    auto fulfiller = kj::mv(*waiter);
+    receiveWaiter = nullptr;
+    fulfiller->fulfill();
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Connection
+
+rpc::twoparty::VatId::Reader SharedMemoryVatNetwork::getPeerVatId() {
+  return peerVatId.getRoot<rpc::twoparty::VatId>();
+}
+
+kj::Own<RpcFlowController> SharedMemoryVatNetwork::newStream() {
+  // There's no network latency to adapt to.
+  return RpcFlowController::newFixedWindowController(RpcFlowController::DEFAULT_WINDOW_SIZE);
+}
+
+kj::Own<OutgoingRpcMessage> SharedMemoryVatNetwork::newOutgoingMessage(
+    uint firstSegmentWordSize) {
+  return kj::refcounted<OutgoingMessageImpl>(*this, firstSegmentWordSize);
+}
+
+kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>>
+    SharedMemoryVatNetwork::receiveIncomingMessage() {
+  KJ_IF_MAYBE(e, receiveError) {
+    return kj::cp(*e);
+  }
+
+  KJ_IF_MAYBE(ring, incomingRing) {
+    auto& header = ring->get()->header();
+    bool announced = false;
+    for (;;) {
+      bool wouldBlock = false;
+      KJ_IF_MAYBE(message, tryReadFromRing(**ring, wouldBlock)) {
+        if (announced) {
+          // Found more after all; no need for a wakeup.
+          __atomic_store_n(&header.readerWaiting, 0, __ATOMIC_RELAXED);
+        }
+        return kj::Maybe<kj::Own<IncomingRpcMessage>>(kj::mv(*message));
+      }
+      if (wouldBlock || peerDisconnected || announced) break;
+
+      // Ask the peer to wake us when it writes more, then check once more in case it just did.
+      __atomic_store_n(&header.readerWaiting, 1, __ATOMIC_SEQ_CST);
+      announced = true;
+    }
+  }
+
+  if (peerDisconnected) {
+    return kj::Maybe<kj::Own<IncomingRpcMessage>>(nullptr);
+  }
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  receiveWaiter = kj::mv(paf.fulfiller);
+  return paf.promise.then([this]() { return receiveIncomingMessage(); });
+}
+
+kj::Promise<void> SharedMemoryVatNetwork::shutdown() {
+  KJ_ASSERT(!shutDown, "already shut down");
+  shutDown = true;
+
+  kj::Promise<void> drained = kj::READY_NOW;
+  if (!pendingSends.empty()) {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    drainFulfiller = kj::mv(paf.fulfiller);
+    drained = kj::mv(paf.promise);
+  }
+
+  return drained.then([this]() {
+    auto promise = kj::mv(KJ_ASSERT_NONNULL(previousWrite));
+    previousWrite = nullptr;
+    return promise.then([this]() {
+      stream.shutdownWrite();
+    });
+  });
+}
+
+void SharedMemoryVatNetwork::taskFailed(kj::Exception&& exception) {
+  if (receiveError == nullptr) {
+    receiveError = kj::mv(exception);
+  }
+  wakeReceiver();
+}
+
+}  // namespace capnp
+
+#endif  // !_WIN32
@@ -0,0 +1,168 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#if defined(__GNUC__) && !defined(CAPNP_HEADER_WARNINGS)
+#pragma GCC system_header
+#endif
+
+#include "rpc-twoparty.h"
+
+namespace capnp {
+
+class SharedMemoryVatNetwork: public TwoPartyVatNetworkBase,
+                              private TwoPartyVatNetworkBase::Connection,
+                              private kj::TaskSet::ErrorHandler {
+  // A two-party `VatNetwork`, like `TwoPartyVatNetwork`, for two processes on the same host.
+  //
+  // Messages are passed through a ring buffer in shared memory, one per direction, each created
+  // by the side that writes to it and passed to the peer over `stream` (a Unix socket) at
+  // startup.  After that, the stream carries only wakeups -- sent only when the reading side has
+  // run out of messages and gone to sleep -- and messages too big for the ring.  So a busy
+  // connection makes few system calls, and message content is never copied through the kernel.
+  //
+  // The receiving side copies each message out of the ring before handing it to the RPC system.
+  // This way the peer cannot modify a message while it is being read, and an incoming message
+  // that the application holds on to does not keep ring space in use.
+  //
+  // Both sides must use SharedMemoryVatNetwork.  Not available on Windows.
+
+public:
+  struct Options {
+    size_t ringSize = 1 << 20;
+    // Size in bytes of the ring carrying this side's outgoing messages.  Rounded up to a power of
+    // two, at least 4096.  Messages bigger than a quarter of the ring are sent over the stream.
+
+    ReaderOptions receiveOptions;
+  };
+
+  SharedMemoryVatNetwork(kj::AsyncCapabilityStream& stream, rpc::twoparty::Side side);
+  SharedMemoryVatNetwork(kj::AsyncCapabilityStream& stream, rpc::twoparty::Side side,
+                         Options options);
+  ~SharedMemoryVatNetwork() noexcept(false);
+  KJ_DISALLOW_COPY(SharedMemoryVatNetwork);
+
+  kj::Promise<void> onDisconnect() { return disconnectPromise.addBranch(); }
+  // Returns a promise that resolves when the peer disconnects.
+
+  rpc::twoparty::Side getSide() { return side; }
+
+  // implements VatNetwork -----------------------------------------------------
+
+  kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> connect(
+      rpc::twoparty::VatId::Reader ref) override;
+  kj::Promise<kj::Own<TwoPartyVatNetworkBase::Connection>> accept() override;
+
+private:
+  class Ring;
+  class OutgoingMessageImpl;
+  class IncomingMessageImpl;
+
+  kj::AsyncCapabilityStream& stream;
+  rpc::twoparty::Side side;
+  MallocMessageBuilder peerVatId;
+  ReaderOptions receiveOptions;
+  bool accepted = false;
+
+  kj::Own<Ring> outgoingRing;
+  // Created by us; the peer maps it once we've sent it the file descriptor.
+
+  uint32_t writePos = 0;
+  // Our copy of the outgoing ring's write position.  Only we write it, so we never trust the copy
+  // in shared memory.
+
+  kj::Vector<kj::Own<OutgoingMessageImpl>> pendingSends;
+  // Messages waiting for space in the outgoing ring, in order.
+
+  kj::Maybe<kj::Promise<void>> previousWrite;
+  // Tail of the chain of writes to `stream`.  Null once shutdown() has flushed it.
+
+  bool shutDown = false;
+  // Set when shutdown() is called.
+
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> drainFulfiller;
+  // Fulfilled when `pendingSends` becomes empty, if shutdown() is waiting for that.
+
+  kj::Maybe<kj::Own<Ring>> incomingRing;
+  // The peer's ring, once we have received it.
+
+  uint32_t readPos = 0;
+  // As with writePos, but for the incoming ring.
+
+  kj::Vector<kj::Own<MessageReader>> streamedMessages;
+  size_t streamedMessagesConsumed = 0;
+  // Messages that arrived over the stream rather than in the ring.  The ring contains a
+  // placeholder record for each, so that these are delivered in order.
+
+  kj::byte incomingFrame = 0;
+  bool peerDisconnected = false;
+  kj::Maybe<kj::Exception> receiveError;
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> receiveWaiter;
+  // Fulfilled when receiveIncomingMessage() might be able to make progress.
+
+  kj::TaskSet tasks;
+
+  kj::Own<kj::PromiseFulfiller<kj::Own<TwoPartyVatNetworkBase::Connection>>> acceptFulfiller;
+  // As in TwoPartyVatNetwork: never fulfilled, because there is only one connection.
+
+  kj::ForkedPromise<void> disconnectPromise = nullptr;
+
+  class FulfillerDisposer: public kj::Disposer {
+    // Same trick as TwoPartyVatNetwork::FulfillerDisposer.
+
+  public:
+    mutable kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+    mutable uint refcount = 0;
+
+    void disposeImpl(void* pointer) const override;
+  };
+  FulfillerDisposer disconnectFulfiller;
+
+  kj::Own<TwoPartyVatNetworkBase::Connection> asConnection();
+
+  void send(kj::Own<OutgoingMessageImpl> message);
+  bool tryWriteToRing(OutgoingMessageImpl& message);
+  bool reserve(size_t words);
+  void publishWrite();
+  void sendPending();
+  void writeFrame(const kj::byte& frame);
+  void writeToStream(kj::Function<kj::Promise<void>()> func);
+
+  kj::Maybe<kj::Own<IncomingRpcMessage>> tryReadFromRing(Ring& ring, bool& wouldBlock);
+  void publishRead(Ring& ring);
+  kj::Promise<void> receiveLoop();
+  void wakeReceiver();
+
+  // implements Connection -----------------------------------------------------
+
+  rpc::twoparty::VatId::Reader getPeerVatId() override;
+  kj::Own<RpcFlowController> newStream() override;
+  kj::Own<OutgoingRpcMessage> newOutgoingMessage(uint firstSegmentWordSize) override;
+  kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> receiveIncomingMessage() override;
+  kj::Promise<void> shutdown() override;
+
+  // implements ErrorHandler ---------------------------------------------------
+
+  void taskFailed(kj::Exception&& exception) override;
+};
+
+}  // namespace capnp
@@ -30,6 +30,7 @@
 #include <kj/compat/gtest.h>
 #include <capnp/rpc.capnp.h>
 #include <map>
+#include <string.h>
 #include <queue>
 
 // TODO(cleanup): Auto-generate stringification functions for union discriminants.
@@ -246,6 +247,16 @@ public:
         return message.getRoot<AnyPointer>();
       }
 
+      size_t sizeInWords() override {
+        size_t size = 0;
+        for (uint i = 0;; i++) {
+          auto segment = message.getSegment(i);
+          if (segment == nullptr) break;
+          size += segment.size();
+        }
+        return size;
+      }
+
       kj::Array<word> data;
       FlatArrayMessageReader message;
     };
@@ -291,6 +302,14 @@ public:
         })));
       }
 
+      size_t sizeInWords() override {
+        size_t size = 0;
+        for (auto& segment: message.getSegmentsForOutput()) {
+          size += segment.size();
+        }
+        return size;
+      }
+
     private:
       ConnectionImpl& connection;
       MallocMessageBuilder message;
@@ -985,6 +1004,67 @@ TEST(Rpc, EmbargoNull) {
   getCallSequence(client, 0).wait(context.waitScope);
 }
 
+TEST(Rpc, EmbargoObserved) {
+  RpcHistogramObserver observer;  // Must outlive the RpcSystem.
+  TestContext context;
+  context.rpcClient.setObserver(observer);
+
+  auto client = context.connect(test::TestSturdyRefObjectId::Tag::TEST_MORE_STUFF)
+      .castAs<test::TestMoreStuff>();
+
+  auto cap = test::TestCallOrder::Client(kj::heap<TestCallOrderImpl>());
+
+  auto echoRequest = client.echoRequest();
+  echoRequest.setCap(cap);
+  auto echo = echoRequest.send();
+
+  auto pipeline = echo.getCap();
+  auto call0 = getCallSequence(pipeline, 0);
+
+  echo.wait(context.waitScope);
+
+  auto call1 = getCallSequence(pipeline, 1);
+
+  EXPECT_EQ(0, call0.wait(context.waitScope).getN());
+  EXPECT_EQ(1, call1.wait(context.waitScope).getN());
+
+  EXPECT_EQ(1u, observer.getEmbargoLatency().getCount());
+  EXPECT_EQ(0u, observer.getEmbargoesInFlight());
+  EXPECT_EQ(0u, observer.getEmbargoesSkipped());
+  EXPECT_TRUE(strstr(observer.dump().cStr(), "\nembargo count=1 in_flight=0 skipped=0 ") != nullptr);
+}
+
+TEST(Rpc, EmbargoSkippedWithoutCalls) {
+  // A promise that resolves to a local capability needs no embargo if no calls were sent through
+  // it, even if requests were created on it.
+
+  RpcHistogramObserver observer;  // Must outlive the RpcSystem.
+  TestContext context;
+  context.rpcClient.setObserver(observer);
+
+  auto client = context.connect(test::TestSturdyRefObjectId::Tag::TEST_MORE_STUFF)
+      .castAs<test::TestMoreStuff>();
+
+  auto cap = test::TestCallOrder::Client(kj::heap<TestCallOrderImpl>());
+
+  auto echoRequest = client.echoRequest();
+  echoRequest.setCap(cap);
+  auto echo = echoRequest.send();
+
+  auto pipeline = echo.getCap();
+  auto unsent = pipeline.getCallSequenceRequest();
+  unsent.setExpected(0);
+
+  echo.wait(context.waitScope);
+
+  EXPECT_EQ(0u, observer.getEmbargoLatency().getCount());
+  EXPECT_EQ(0u, observer.getEmbargoesInFlight());
+  EXPECT_EQ(1u, observer.getEmbargoesSkipped());
+
+  EXPECT_EQ(0, unsent.send().wait(context.waitScope).getN());
+  EXPECT_EQ(1, getCallSequence(pipeline, 1).wait(context.waitScope).getN());
+}
+
 TEST(Rpc, CallBrokenPromise) {
   // Tell the server to call back to a promise client, then resolve the promise to an error.
 
@@ -1258,6 +1338,349 @@ TEST(Rpc, RealmGatewayImportExport) {
   EXPECT_EQ("foo", response.getSturdyRef());
 }
 
+class TestBlockingBazServer final: public test::TestInterface::Server {
+  // Holds each baz() call open until the test releases it.
+
+public:
+  kj::Promise<void> baz(BazContext context) override {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    fulfillers.add(kj::mv(paf.fulfiller));
+    return kj::mv(paf.promise);
+  }
+
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> fulfillers;
+};
+
+TEST(Rpc, Streaming) {
+  auto serverImpl = kj::heap<TestBlockingBazServer>();
+  auto& server = *serverImpl;
+  test::TestInterface::Client bootstrap = kj::mv(serverImpl);
+  TestRealmGateway::Client gateway = kj::heap<TestGateway>();
+
+  MallocMessageBuilder hostIdBuilder;
+  auto hostId = hostIdBuilder.getRoot<test::TestSturdyRefHostId>();
+  hostId.setHost("server");
+
+  TestContext context(bootstrap, gateway);
+  auto client = context.rpcClient.bootstrap(hostId).castAs<test::TestInterface>();
+  client.whenResolved().wait(context.waitScope);
+
+  // Send 16KiB calls until the default 64KiB window fills up.
+  kj::Vector<kj::Promise<void>> sends;
+  for (;;) {
+    auto req = client.bazRequest();
+    req.initS().initDataField(16384);
+    sends.add(req.sendStreaming());
+    if (!sends.back().poll(context.waitScope)) break;
+    sends.back().wait(context.waitScope);
+    ASSERT_LT(sends.size(), 10u);
+  }
+  EXPECT_GE(sends.size(), 4u);
+
+  // The server sees all of the calls that were sent, including the one that's blocked.
+  for (uint i = 0; i < 16; i++) kj::evalLater([]() {}).wait(context.waitScope);
+  EXPECT_EQ(sends.size(), server.fulfillers.size());
+  EXPECT_FALSE(sends.back().poll(context.waitScope));
+
+  // Returning one call makes room for more.
+  server.fulfillers[0]->fulfill();
+  sends.back().wait(context.waitScope);
+
+  for (auto& fulfiller: server.fulfillers) {
+    fulfiller->fulfill();
+  }
+}
+
+class TestStreamingImpl final: public test::TestStreaming::Server {
+public:
+  kj::Promise<void> doStreamI(DoStreamIContext context) override {
+    total += context.getParams().getI();
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> finishStream(FinishStreamContext context) override {
+    context.getResults().setTotalI(total);
+    return kj::READY_NOW;
+  }
+
+  uint32_t total = 0;
+};
+
+TEST(Rpc, StreamAnnotation) {
+  test::TestStreaming::Client bootstrap = kj::heap<TestStreamingImpl>();
+  TestRealmGateway::Client gateway = kj::heap<TestGateway>();
+
+  MallocMessageBuilder hostIdBuilder;
+  auto hostId = hostIdBuilder.getRoot<test::TestSturdyRefHostId>();
+  hostId.setHost("server");
+
+  TestContext context(bootstrap, gateway);
+  auto client = context.rpcClient.bootstrap(hostId).castAs<test::TestStreaming>();
+  EXPECT_EQ(0u, client.finishStreamRequest().send().wait(context.waitScope).getTotalI());
+  for (uint i = 0; i < 16; i++) kj::evalLater([]() {}).wait(context.waitScope);
+
+  uint sentBefore = context.clientNetwork.getSentCount();
+
+  for (uint i = 1; i <= 100; i++) {
+    auto request = client.doStreamIRequest();
+    request.setI(i);
+    request.send().wait(context.waitScope);
+  }
+  EXPECT_EQ(5050u, client.finishStreamRequest().send().wait(context.waitScope).getTotalI());
+
+  // Besides finishStream() and its `Finish`, only the streaming calls themselves went out: the
+  // server answered them with `noFinishNeeded` and forgot them, so they needed no `Finish`.
+  for (uint i = 0; i < 16; i++) kj::evalLater([]() {}).wait(context.waitScope);
+  EXPECT_EQ(sentBefore + 102, context.clientNetwork.getSentCount());
+  EXPECT_EQ(0u, context.rpcClient.getTableSizes().questions);
+  EXPECT_EQ(0u, context.rpcServer.getTableSizes().answers);
+}
+
+class TestFlowMessage final: public OutgoingRpcMessage {
+public:
+  TestFlowMessage(size_t words, uint& sendCount): words(words), sendCount(sendCount) {}
+
+  AnyPointer::Builder getBody() override { return message.getRoot<AnyPointer>(); }
+  void send() override { ++sendCount; }
+  size_t sizeInWords() override { return words; }
+
+private:
+  MallocMessageBuilder message;
+  size_t words;
+  uint& sendCount;
+};
+
+TEST(Rpc, AdaptiveFlowControl) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  kj::TimePoint now = kj::origin<kj::TimePoint>();
+  auto flow = RpcFlowController::newAdaptiveWindowController([&]() { return now; });
+
+  uint sendCount = 0;
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> acks;
+  auto sendOne = [&]() {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    acks.add(kj::mv(paf.fulfiller));
+    return flow->send(kj::heap<TestFlowMessage>(1024, sendCount), kj::mv(paf.promise));
+  };
+
+  // With no measurements, the window is the minimum: 72KiB of 8KiB messages fills it.
+  for (uint i = 0; i < 8; i++) {
+    auto promise = sendOne();
+    EXPECT_TRUE(promise.poll(waitScope));
+  }
+  auto blocked = sendOne();
+  EXPECT_FALSE(blocked.poll(waitScope));
+  EXPECT_EQ(9u, sendCount);
+
+  // All 72KiB is acked after 10ms, so the path holds at least 72KiB and the window opens to
+  // twice that.
+  now += 10 * kj::MILLISECONDS;
+  for (auto& ack: acks) ack->fulfill();
+  acks.clear();
+  blocked.wait(waitScope);
+  flow->waitAllAcked().wait(waitScope);
+
+  for (uint i = 0; i < 16; i++) {
+    auto promise = sendOne();
+    EXPECT_TRUE(promise.poll(waitScope));
+  }
+  bool gotBlocked = false;
+  for (uint i = 0; i < 6 && !gotBlocked; i++) {
+    gotBlocked = !sendOne().poll(waitScope);
+  }
+  EXPECT_TRUE(gotBlocked);
+
+  for (auto& ack: acks) ack->fulfill();
+  flow->waitAllAcked().wait(waitScope);
+}
+
+TEST(Rpc, Observer) {
+  TestContext context;
+  RpcHistogramObserver clientObserver;
+  RpcHistogramObserver serverObserver;
+  context.rpcClient.setObserver(clientObserver);
+  context.rpcServer.setObserver(serverObserver);
+
+  auto client = context.connect(test::TestSturdyRefObjectId::Tag::TEST_INTERFACE)
+      .castAs<test::TestInterface>();
+
+  auto request = client.fooRequest();
+  request.setI(123);
+  request.setJ(true);
+  EXPECT_EQ("foo", request.send().wait(context.waitScope).getX());
+
+  // bar() is unimplemented, so it fails.
+  EXPECT_ANY_THROW(client.barRequest().send().wait(context.waitScope));
+
+  for (uint i = 0; i < 16; i++) kj::evalLater([]() {}).wait(context.waitScope);
+
+  uint64_t id = typeId<test::TestInterface>();
+
+  {
+    auto& stats = KJ_ASSERT_NONNULL(clientObserver.getMethodStats(id, 0));
+    EXPECT_EQ(1u, stats.outgoing.getCount());
+    EXPECT_EQ(0u, stats.outgoingErrors);
+    EXPECT_EQ(0u, stats.outgoingInFlight);
+    EXPECT_EQ(0u, stats.incoming.getCount());
+  }
+  {
+    auto& stats = KJ_ASSERT_NONNULL(clientObserver.getMethodStats(id, 1));
+    EXPECT_EQ(1u, stats.outgoing.getCount());
+    EXPECT_EQ(1u, stats.outgoingErrors);
+  }
+  {
+    auto& stats = KJ_ASSERT_NONNULL(serverObserver.getMethodStats(id, 0));
+    EXPECT_EQ(1u, stats.incoming.getCount());
+    EXPECT_EQ(0u, stats.incomingErrors);
+    EXPECT_EQ(0u, stats.incomingInFlight);
+  }
+  {
+    auto& stats = KJ_ASSERT_NONNULL(serverObserver.getMethodStats(id, 1));
+    EXPECT_EQ(1u, stats.incoming.getCount());
+    EXPECT_EQ(1u, stats.incomingErrors);
+  }
+  EXPECT_TRUE(clientObserver.getMethodStats(id, 2) == nullptr);
+
+  EXPECT_GT(clientObserver.getMessagesSent(), 0u);
+  EXPECT_EQ(clientObserver.getMessagesSent(), serverObserver.getMessagesReceived());
+  EXPECT_EQ(serverObserver.getMessagesSent(), clientObserver.getMessagesReceived());
+  EXPECT_EQ(clientObserver.getBytesSent(), serverObserver.getBytesReceived());
+  EXPECT_EQ(serverObserver.getBytesSent(), clientObserver.getBytesReceived());
+
+  EXPECT_TRUE(clientObserver.dump().startsWith("messages_sent "));
+
+  // The client holds one import (the restored capability), which the server exports.
+  EXPECT_EQ(1u, context.rpcClient.getTableSizes().imports);
+  EXPECT_EQ(1u, context.rpcServer.getTableSizes().exports);
+  EXPECT_GT(context.rpcServer.getTableSizes().bytes, 0u);
+
+  // Once removed, the observer hears nothing more.
+  context.rpcClient.setObserver(nullptr);
+  auto sent = clientObserver.getMessagesSent();
+  request = client.fooRequest();
+  request.setI(123);
+  request.setJ(true);
+  request.send().wait(context.waitScope);
+  EXPECT_EQ(sent, clientObserver.getMessagesSent());
+  EXPECT_EQ(1u, KJ_ASSERT_NONNULL(clientObserver.getMethodStats(id, 0)).outgoing.getCount());
+}
+
+TEST(Rpc, SizeHintLearning) {
+  TestContext context;
+
+  auto client = context.connect(test::TestSturdyRefObjectId::Tag::TEST_INTERFACE)
+      .castAs<test::TestInterface>();
+  uint64_t id = typeId<test::TestInterface>();
+
+  auto findHints = [&](RpcSystem<test::TestSturdyRefHostId>& rpcSystem)
+      -> kj::Maybe<RpcMethodSizeHints> {
+    for (auto& hints: rpcSystem.getSizeHints()) {
+      if (hints.interfaceId == id && hints.methodId == 0) return hints;
+    }
+    return nullptr;
+  };
+
+  for (uint i = 0; i < 20; i++) {
+    auto request = client.fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    EXPECT_EQ("foo", request.send().wait(context.waitScope).getX());
+  }
+
+  {
+    auto hints = KJ_ASSERT_NONNULL(findHints(context.rpcClient));
+    EXPECT_EQ(20u, hints.calls.messages);
+    EXPECT_EQ(0u, hints.calls.multiSegmentMessages);
+    EXPECT_GT(hints.calls.firstSegmentWords, 0u);
+    EXPECT_LT(hints.calls.firstSegmentWords, SUGGESTED_FIRST_SEGMENT_WORDS);
+    EXPECT_EQ(0u, hints.returns.messages);
+  }
+  {
+    auto hints = KJ_ASSERT_NONNULL(findHints(context.rpcServer));
+    EXPECT_EQ(20u, hints.returns.messages);
+    EXPECT_GT(hints.returns.firstSegmentWords, 0u);
+    EXPECT_EQ(0u, hints.calls.messages);
+  }
+
+  // With learning disabled, calls still work but nothing more is recorded.
+  context.rpcClient.setSizeHintLearning(false);
+  auto request = client.fooRequest();
+  request.setI(123);
+  request.setJ(true);
+  EXPECT_EQ("foo", request.send().wait(context.waitScope).getX());
+  EXPECT_EQ(20u, KJ_ASSERT_NONNULL(findHints(context.rpcClient)).calls.messages);
+  EXPECT_EQ(21u, KJ_ASSERT_NONNULL(findHints(context.rpcServer)).returns.messages);
+}
+
+TEST(Rpc, ManyOutstandingCalls) {
+  // Enough concurrent calls to spread the question and export tables over several slabs.
+
+  TestContext context;
+
+  auto client = context.connect(test::TestSturdyRefObjectId::Tag::TEST_MORE_STUFF)
+      .castAs<test::TestMoreStuff>();
+
+  auto before = context.rpcClient.getTableSizes();
+
+  constexpr uint COUNT = 600;
+  {
+    kj::Vector<RemotePromise<test::TestMoreStuff::EchoResults>> echoes;
+    for (uint i = 0; i < COUNT; i++) {
+      auto request = client.echoRequest();
+      request.setCap(kj::heap<TestCallOrderImpl>());
+      echoes.add(request.send());
+    }
+
+    auto sizes = context.rpcClient.getTableSizes();
+    EXPECT_EQ(before.questions + COUNT, sizes.questions);
+    EXPECT_EQ(before.exports + COUNT, sizes.exports);
+    EXPECT_GE(sizes.bytes, before.bytes + COUNT * 2 * sizeof(uint32_t));
+
+    for (auto& echo: echoes) {
+      auto cap = echo.wait(context.waitScope).getCap();
+      EXPECT_EQ(0, getCallSequence(cap, 0).wait(context.waitScope).getN());
+    }
+  }
+
+  // Give the server time to release the caps.
+  EXPECT_EQ(int(COUNT), client.getCallSequenceRequest().send().wait(context.waitScope).getN());
+
+  auto sizes = context.rpcClient.getTableSizes();
+  EXPECT_EQ(0u, sizes.questions);
+  EXPECT_EQ(before.exports, sizes.exports);
+}
+
+TEST(Rpc, LatencyHistogram) {
+  auto us = [](kj::Duration d) { return double(d / kj::NANOSECONDS) / 1000; };
+
+  RpcLatencyHistogram histogram;
+  EXPECT_EQ(0u, histogram.getCount());
+  EXPECT_EQ(0, us(histogram.getPercentile(50)));
+
+  for (uint i = 1; i <= 100; i++) {
+    histogram.record(i * kj::MICROSECONDS);
+  }
+
+  EXPECT_EQ(100u, histogram.getCount());
+  EXPECT_EQ(1, us(histogram.getMin()));
+  EXPECT_EQ(100, us(histogram.getMax()));
+  EXPECT_EQ(50.5, us(histogram.getMean()));
+
+  // Percentiles overestimate by at most the bucket resolution (1/16).
+  EXPECT_GE(us(histogram.getPercentile(50)), 50);
+  EXPECT_LE(us(histogram.getPercentile(50)), 50.0 * 17 / 16);
+  EXPECT_GE(us(histogram.getPercentile(99)), 99);
+  EXPECT_LE(us(histogram.getPercentile(99)), 100);
+  EXPECT_EQ(100, us(histogram.getPercentile(100)));
+
+  // Small values are exact.
+  RpcLatencyHistogram small;
+  small.record(3 * kj::NANOSECONDS);
+  EXPECT_EQ(3, small.getPercentile(50) / kj::NANOSECONDS);
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
@@ -131,6 +131,9 @@ TEST(TwoPartyNetwork, Basic) {
 
   EXPECT_EQ(0, callCount);
 
+  // The calls are queued until the event loop gets a chance to write them.
+  EXPECT_LT(0u, network.getOutgoingQueueBytes());
+
   auto response1 = promise1.wait(ioContext.waitScope);
 
   EXPECT_EQ("foo", response1.getX());
@@ -141,6 +144,35 @@ TEST(TwoPartyNetwork, Basic) {
 
   EXPECT_EQ(2, callCount);
   EXPECT_TRUE(barFailed);
+
+  // Finish messages for the calls above are still queued until the loop runs again.
+  ioContext.waitScope.poll();
+  EXPECT_EQ(0u, network.getOutgoingQueueBytes());
+}
+
+TEST(TwoPartyNetwork, PooledOutgoingMessages) {
+  auto ioContext = kj::setupAsyncIo();
+  int callCount = 0;
+  int handleCount = 0;
+
+  SegmentPool pool;
+  auto serverThread = runServer(*ioContext.provider, callCount, handleCount);
+  TwoPartyVatNetwork network(*serverThread.pipe, rpc::twoparty::Side::CLIENT);
+  network.setOutgoingSegmentPool(pool);
+  auto rpcClient = makeRpcClient(network);
+
+  auto client = getPersistentCap(rpcClient, rpc::twoparty::Side::SERVER,
+      test::TestSturdyRefObjectId::Tag::TEST_INTERFACE).castAs<test::TestInterface>();
+
+  for (int i = 0; i < 4; i++) {
+    auto request = client.fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    EXPECT_EQ("foo", request.send().wait(ioContext.waitScope).getX());
+  }
+
+  EXPECT_EQ(4, callCount);
+  EXPECT_LT(0u, pool.getStats().hits);
 }
 
 TEST(TwoPartyNetwork, Pipelining) {
@@ -278,6 +310,32 @@ TEST(TwoPartyNetwork, Release) {
   EXPECT_EQ(0, handleCount);
 }
 
+TEST(TwoPartyNetwork, Compression) {
+  auto ioContext = kj::setupAsyncIo();
+  int callCount = 0;
+  int handleCount = 0;
+
+  // Only the client compresses; the server decodes compressed messages without being told to.
+  auto serverThread = runServer(*ioContext.provider, callCount, handleCount);
+  TwoPartyVatNetwork network(*serverThread.pipe, rpc::twoparty::Side::CLIENT);
+  network.setOutgoingCompression(MessageCompression::PACKED, 0);
+  auto rpcClient = makeRpcClient(network);
+
+  auto client = getPersistentCap(rpcClient, rpc::twoparty::Side::SERVER,
+      test::TestSturdyRefObjectId::Tag::TEST_INTERFACE).castAs<test::TestInterface>();
+
+  auto request1 = client.fooRequest();
+  request1.setI(123);
+  request1.setJ(true);
+  EXPECT_EQ("foo", request1.send().wait(ioContext.waitScope).getX());
+
+  auto request2 = client.bazRequest();
+  initTestMessage(request2.initS());
+  request2.send().wait(ioContext.waitScope);
+
+  EXPECT_EQ(2, callCount);
+}
+
 TEST(TwoPartyNetwork, Abort) {
   // Verify that aborts are received.
 
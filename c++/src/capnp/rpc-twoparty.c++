@@ -21,14 +21,17 @@
 
 #include "rpc-twoparty.h"
 #include "serialize-async.h"
+#include <capnp/rpc.capnp.h>
 #include <kj/debug.h>
+#include <kj/one-of.h>
 
 namespace capnp {
 
 TwoPartyVatNetwork::TwoPartyVatNetwork(kj::AsyncIoStream& stream, rpc::twoparty::Side side,
                                        ReaderOptions receiveOptions)
     : stream(stream), side(side), peerVatId(4),
-      receiveOptions(receiveOptions), previousWrite(kj::READY_NOW) {
+      receiveOptions(receiveOptions), reader(stream, receiveOptions),
+      writeTasks(*this), writer(stream) {
   peerVatId.initRoot<rpc::twoparty::VatId>().setSide(
       side == rpc::twoparty::Side::CLIENT ? rpc::twoparty::Side::SERVER
                                           : rpc::twoparty::Side::CLIENT);
@@ -74,8 +77,7 @@ class TwoPartyVatNetwork::OutgoingMessageImpl final
     : public OutgoingRpcMessage, public kj::Refcounted {
 public:
   OutgoingMessageImpl(TwoPartyVatNetwork& network, uint firstSegmentWordSize)
-      : network(network),
-        message(firstSegmentWordSize == 0 ? SUGGESTED_FIRST_SEGMENT_WORDS : firstSegmentWordSize) {}
+      : network(network), message(initMessage(network, firstSegmentWordSize)) {}
 
   AnyPointer::Builder getBody() override {
     return message.getRoot<AnyPointer>();
@@ -93,22 +95,45 @@ public:
       return;
     }
 
-    network.previousWrite = KJ_ASSERT_NONNULL(network.previousWrite, "already shut down")
-        .then([&]() {
-      // Note that if the write fails, all further writes will be skipped due to the exception.
-      // We never actually handle this exception because we assume the read end will fail as well
-      // and it's cleaner to handle the failure there.
-      return writeMessage(network.stream, message);
-    }).attach(kj::addRef(*this))
-      // Note that it's important that the eagerlyEvaluate() come *after* the attach() because
-      // otherwise the message (and any capabilities in it) will not be released until a new
-      // message is written! (Kenton once spent all afternoon tracking this down...)
-      .eagerlyEvaluate(nullptr);
+    KJ_ASSERT(!network.shutDown, "already shut down");
+
+    // Note that if the write fails, all further writes will fail too.  We never actually handle
+    // this exception because we assume the read end will fail as well and it's cleaner to handle
+    // the failure there.
+    //
+    // The TaskSet drops each task as soon as it completes, so the message (and any capabilities
+    // in it) is released as soon as it has been written.
+    //
+    // An Abort is written ahead of anything still queued: the connection is going away, so there's
+    // no point making the peer wait for (or process) the rest first.  Other messages, even small
+    // control messages such as Finish or Release, must stay in order because they can refer to
+    // IDs introduced by earlier messages.
+    auto promise = message.getRoot<rpc::Message>().isAbort()
+        ? network.writer.writeUrgent(message) : network.writer.write(message);
+    network.writeTasks.add(promise.attach(kj::addRef(*this)));
+  }
+
+  size_t sizeInWords() override {
+    size_t size = 0;
+    for (auto& segment: message.getSegmentsForOutput()) {
+      size += segment.size();
+    }
+    return size;
   }
 
 private:
   TwoPartyVatNetwork& network;
-  MallocMessageBuilder message;
+  kj::OneOf<MallocMessageBuilder, PooledMessageBuilder> messageSpace;
+  MessageBuilder& message;
+
+  MessageBuilder& initMessage(TwoPartyVatNetwork& network, uint firstSegmentWordSize) {
+    if (firstSegmentWordSize == 0) firstSegmentWordSize = SUGGESTED_FIRST_SEGMENT_WORDS;
+    KJ_IF_MAYBE(pool, network.outgoingSegmentPool) {
+      return messageSpace.init<PooledMessageBuilder>(*pool, firstSegmentWordSize);
+    } else {
+      return messageSpace.init<MallocMessageBuilder>(firstSegmentWordSize);
+    }
+  }
 };
 
 class TwoPartyVatNetwork::IncomingMessageImpl final: public IncomingRpcMessage {
@@ -119,6 +144,16 @@ public:
     return message->getRoot<AnyPointer>();
   }
 
+  size_t sizeInWords() override {
+    size_t size = 0;
+    for (uint i = 0;; i++) {
+      auto segment = message->getSegment(i);
+      if (segment == nullptr) break;
+      size += segment.size();
+    }
+    return size;
+  }
+
 private:
   kj::Own<MessageReader> message;
 };
@@ -127,13 +162,19 @@ rpc::twoparty::VatId::Reader TwoPartyVatNetwork::getPeerVatId() {
   return peerVatId.getRoot<rpc::twoparty::VatId>();
 }
 
+kj::Own<RpcFlowController> TwoPartyVatNetwork::newStream() {
+  // A two-party connection is usually a real socket whose bandwidth-delay product is unknown up
+  // front, so let the window adapt to what the acks say.
+  return RpcFlowController::newAdaptiveWindowController();
+}
+
 kj::Own<OutgoingRpcMessage> TwoPartyVatNetwork::newOutgoingMessage(uint firstSegmentWordSize) {
   return kj::refcounted<OutgoingMessageImpl>(*this, firstSegmentWordSize);
 }
 
 kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> TwoPartyVatNetwork::receiveIncomingMessage() {
   return kj::evalLater([&]() {
-    return tryReadMessage(stream, receiveOptions)
+    return reader.tryReadMessage()
         .then([&](kj::Maybe<kj::Own<MessageReader>>&& message)
               -> kj::Maybe<kj::Own<IncomingRpcMessage>> {
       KJ_IF_MAYBE(m, message) {
@@ -146,11 +187,15 @@ kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> TwoPartyVatNetwork::receiveI
 }
 
 kj::Promise<void> TwoPartyVatNetwork::shutdown() {
-  kj::Promise<void> result = KJ_ASSERT_NONNULL(previousWrite, "already shut down").then([this]() {
+  KJ_ASSERT(!shutDown, "already shut down");
+  shutDown = true;
+  return writer.flush().then([this]() {
     stream.shutdownWrite();
   });
-  previousWrite = nullptr;
-  return kj::mv(result);
+}
+
+void TwoPartyVatNetwork::taskFailed(kj::Exception&& exception) {
+  // Write failures are reported through the read end; see OutgoingMessageImpl::send().
 }
 
 // =======================================================================================
@@ -27,6 +27,7 @@
 
 #include "rpc.h"
 #include "message.h"
+#include "serialize-async.h"
 #include <kj/async-io.h>
 #include <capnp/rpc-twoparty.capnp.h>
 
@@ -43,7 +44,8 @@ typedef VatNetwork<rpc::twoparty::VatId, rpc::twoparty::ProvisionId,
     TwoPartyVatNetworkBase;
 
 class TwoPartyVatNetwork: public TwoPartyVatNetworkBase,
-                          private TwoPartyVatNetworkBase::Connection {
+                          private TwoPartyVatNetworkBase::Connection,
+                          private kj::TaskSet::ErrorHandler {
   // A `VatNetwork` that consists of exactly two parties communicating over an arbitrary byte
   // stream.  This is used to implement the common case of a client/server network.
   //
@@ -60,6 +62,21 @@ public:
 
   rpc::twoparty::Side getSide() { return side; }
 
+  size_t getOutgoingQueueBytes() { return writer.getQueuedBytes(); }
+  // Bytes of outgoing messages that have been sent but not yet written to the stream.  An
+  // application streaming large amounts of data can use this for backpressure.
+
+  void setOutgoingCompression(MessageCompression compression, size_t threshold = 1024) {
+    writer.setCompression(compression, threshold);
+  }
+  // Compress outgoing messages of at least `threshold` bytes.  Incoming messages are decompressed
+  // automatically whatever this side's setting, so the peer needs no configuration -- but it must
+  // be running a version of Cap'n Proto that understands the chosen encoding.
+
+  void setOutgoingSegmentPool(SegmentPool& pool) { outgoingSegmentPool = pool; }
+  // Build outgoing messages with `PooledMessageBuilder`s backed by the given pool, rather than
+  // with `MallocMessageBuilder`s.  The pool must outlive the network and all messages it has sent.
+
   // implements VatNetwork -----------------------------------------------------
 
   kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> connect(
@@ -74,11 +91,25 @@ private:
   rpc::twoparty::Side side;
   MallocMessageBuilder peerVatId;
   ReaderOptions receiveOptions;
+
+  MessageStreamReader reader;
+  // Incoming message stream.  Reads in large chunks so that a burst of small messages costs one
+  // read rather than two or three per message.
+
+  kj::Maybe<SegmentPool&> outgoingSegmentPool;
   bool accepted = false;
 
-  kj::Maybe<kj::Promise<void>> previousWrite;
-  // Resolves when the previous write completes.  This effectively serves as the write queue.
-  // Becomes null when shutdown() is called.
+  kj::TaskSet writeTasks;
+  // Holds each outgoing message until the writer reports that it has been written.  Failures are
+  // ignored since the read end will fail as well and it's cleaner to handle the failure there.
+
+  MessageStreamWriter writer;
+  // Outgoing message queue.  Messages sent during the same event loop turn, or while a previous
+  // write is still in progress, are coalesced into a single write.  Declared after
+  // `writeTasks` so that it is destroyed first, before the messages it points into.
+
+  bool shutDown = false;
+  // Set when shutdown() is called.
 
   kj::Own<kj::PromiseFulfiller<kj::Own<TwoPartyVatNetworkBase::Connection>>> acceptFulfiller;
   // Fulfiller for the promise returned by acceptConnectionAsRefHost() on the client side, or the
@@ -107,9 +138,14 @@ private:
   // implements Connection -----------------------------------------------------
 
   rpc::twoparty::VatId::Reader getPeerVatId() override;
+  kj::Own<RpcFlowController> newStream() override;
   kj::Own<OutgoingRpcMessage> newOutgoingMessage(uint firstSegmentWordSize) override;
   kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> receiveIncomingMessage() override;
   kj::Promise<void> shutdown() override;
+
+  // implements ErrorHandler ---------------------------------------------------
+
+  void taskFailed(kj::Exception&& exception) override;
 };
 
 class TwoPartyServer: private kj::TaskSet::ErrorHandler {
@@ -126,6 +162,9 @@ public:
   // Listens for connections on the given listener. The returned promise never resolves unless an
   // exception is thrown while trying to accept. You may discard the returned promise to cancel
   // listening.
+  //
+  // To spread connections across cores, run one TwoPartyServer per event loop thread, each
+  // listening on its own receiver from `kj::NetworkAddress::listenReusePort()`.
 
 private:
   Capability::Client bootstrapInterface;
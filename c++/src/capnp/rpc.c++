@@ -26,10 +26,12 @@
 #include <kj/async.h>
 #include <kj/one-of.h>
 #include <kj/function.h>
+#include <kj/map.h>
 #include <functional>  // std::greater
+#include <algorithm>
+#include <chrono>
 #include <unordered_map>
 #include <map>
-#include <queue>
 #include <capnp/rpc.capnp.h>
 
 namespace capnp {
@@ -152,14 +154,20 @@ uint exceptionSizeHint(const kj::Exception& exception) {
 template <typename Id, typename T>
 class ExportTable {
   // Table mapping integers to T, where the integers are chosen locally.
+  //
+  // Entries live in fixed-size slabs, so growing the table never moves existing entries and never
+  // holds more than one partly-used slab.  Only the first slab starts small and doubles up to
+  // full size, so that a connection which makes a handful of calls doesn't pay for a whole slab
+  // in each table.  Freed IDs are reused lowest-first, which keeps the table -- and the peer's
+  // corresponding ImportTable -- dense.
 
 public:
   kj::Maybe<T&> find(Id id) {
-    if (id < slots.size() && slots[id] != nullptr) {
-      return slots[id];
-    } else {
-      return nullptr;
+    if (id < highWater) {
+      T& slot = at(id);
+      if (slot != nullptr) return slot;
     }
+    return nullptr;
   }
 
   T erase(Id id, T& entry) {
@@ -168,36 +176,77 @@ public:
     // `entry` is a reference to the entry being released -- we require this in order to prove
     // that the caller has already done a find() to check that this entry exists.  We can't check
     // ourselves because the caller may have nullified the entry in the meantime.
-    KJ_DREQUIRE(&entry == &slots[id]);
-    T toRelease = kj::mv(slots[id]);
-    slots[id] = T();
-    freeIds.push(id);
+    KJ_DREQUIRE(&entry == &at(id));
+    T toRelease = kj::mv(entry);
+    entry = T();
+    freeIds.add(id);
+    std::push_heap(freeIds.begin(), freeIds.end(), std::greater<Id>());
     return toRelease;
   }
 
   T& next(Id& id) {
     if (freeIds.empty()) {
-      id = slots.size();
-      return slots.add();
+      id = highWater;
+      if (slabs.empty() || (id % SLAB_SIZE == 0 && slabs.back().size() == SLAB_SIZE)) {
+        slabs.add(kj::heapArray<T>(slabs.empty() ? FIRST_SLAB_SIZE : SLAB_SIZE));
+      } else if (id == slabs.front().size()) {
+        // Only the first slab can be short.  Double it.
+        auto bigger = kj::heapArray<T>(id * 2 < SLAB_SIZE ? id * 2 : SLAB_SIZE);
+        for (auto i: kj::indices(slabs.front())) {
+          bigger[i] = kj::mv(slabs.front()[i]);
+        }
+        slabs.front() = kj::mv(bigger);
+      }
+      ++highWater;
+      return at(id);
     } else {
-      id = freeIds.top();
-      freeIds.pop();
-      return slots[id];
+      std::pop_heap(freeIds.begin(), freeIds.end(), std::greater<Id>());
+      id = freeIds.back();
+      freeIds.removeLast();
+      return at(id);
+    }
+  }
+
+  size_t size() {
+    // Number of entries in use.
+    return highWater - freeIds.size();
+  }
+
+  size_t memoryUsage() {
+    // Bytes used by the table, including free slots but not counting anything the entries own.
+    size_t result = sizeof(*this) + slabs.capacity() * sizeof(kj::Array<T>) +
+                    freeIds.capacity() * sizeof(Id);
+    for (auto& slab: slabs) {
+      result += slab.size() * sizeof(T);
     }
+    return result;
   }
 
   template <typename Func>
   void forEach(Func&& func) {
-    for (Id i = 0; i < slots.size(); i++) {
-      if (slots[i] != nullptr) {
-        func(i, slots[i]);
+    for (Id i = 0; i < highWater; i++) {
+      T& slot = at(i);
+      if (slot != nullptr) {
+        func(i, slot);
       }
     }
   }
 
 private:
-  kj::Vector<T> slots;
-  std::priority_queue<Id, std::vector<Id>, std::greater<Id>> freeIds;
+  static constexpr size_t SLAB_SIZE = 256;
+  static constexpr size_t FIRST_SLAB_SIZE = 4;
+
+  kj::Vector<kj::Array<T>> slabs;
+  // Every slab but the first holds exactly SLAB_SIZE entries; the first holds fewer only while
+  // it is the only slab.
+
+  Id highWater = 0;
+  // One past the highest ID ever allocated.
+
+  kj::Vector<Id> freeIds;
+  // Min-heap of IDs below `highWater` that are not in use.
+
+  inline T& at(Id id) { return slabs[id / SLAB_SIZE][id % SLAB_SIZE]; }
 };
 
 template <typename Id, typename T>
@@ -206,10 +255,12 @@ class ImportTable {
 
 public:
   T& operator[](Id id) {
+    // Note that creating an entry may move other entries in `high`, so references obtained
+    // earlier must not be held across this call.
     if (id < kj::size(low)) {
       return low[id];
     } else {
-      return high[id];
+      return high.findOrCreate(id, [&]() { return typename HighMap::Entry { id, T() }; });
     }
   }
 
@@ -217,12 +268,7 @@ public:
     if (id < kj::size(low)) {
       return low[id];
     } else {
-      auto iter = high.find(id);
-      if (iter == high.end()) {
-        return nullptr;
-      } else {
-        return iter->second;
-      }
+      return high.find(id);
     }
   }
 
@@ -234,29 +280,103 @@ public:
       low[id] = T();
       return toRelease;
     } else {
-      T toRelease = kj::mv(high[id]);
-      high.erase(id);
+      T toRelease;
+      KJ_IF_MAYBE(entry, high.find(id)) {
+        toRelease = kj::mv(*entry);
+        high.erase(id);
+      }
       return toRelease;
     }
   }
 
+  size_t memoryUsage() {
+    // Bytes used by the table, including free slots but not counting anything the entries own.
+    return sizeof(*this) + high.heapSize();
+  }
+
   template <typename Func>
   void forEach(Func&& func) {
     for (Id i: kj::indices(low)) {
       func(i, low[i]);
     }
     for (auto& entry: high) {
-      func(entry.first, entry.second);
+      func(entry.key, entry.value);
     }
   }
 
 private:
+  typedef kj::HashMap<Id, T> HighMap;
+
   T low[16];
-  std::unordered_map<Id, T> high;
+  HighMap high;
 };
 
 // =======================================================================================
 
+class RpcSizeHints final: public kj::Refcounted {
+  // Learned sizes of the Call and Return messages of each method, used to pick a first segment
+  // size when the application doesn't give a size hint. Shared by all of an RpcSystem's
+  // connections. See RpcSystem::setSizeHintLearning().
+
+public:
+  struct Method {
+    SegmentSizePolicy calls;
+    SegmentSizePolicy returns;
+
+    Method(): calls(policyOptions()), returns(policyOptions()) {}
+  };
+
+  bool enabled = true;
+
+  kj::Maybe<Method&> get(uint64_t interfaceId, uint16_t methodId) {
+    // Returns null if learning is disabled.
+    if (!enabled) return nullptr;
+    auto& slot = methods[std::make_pair(interfaceId, methodId)];
+    if (slot.get() == nullptr) slot = kj::heap<Method>();
+    return *slot;
+  }
+
+  kj::Array<RpcMethodSizeHints> getAll() {
+    auto result = kj::heapArrayBuilder<RpcMethodSizeHints>(methods.size());
+    for (auto& entry: methods) {
+      RpcMethodSizeHints hints;
+      hints.interfaceId = entry.first.first;
+      hints.methodId = entry.first.second;
+      hints.calls = entry.second->calls.getStats();
+      hints.returns = entry.second->returns.getStats();
+      result.add(hints);
+    }
+    return result.finish();
+  }
+
+  static void record(SegmentSizePolicy& policy, OutgoingRpcMessage& message,
+                     uint firstSegmentWords) {
+    size_t words = message.sizeInWords();
+    uint firstSegment = firstSegmentWords == 0 ? SUGGESTED_FIRST_SEGMENT_WORDS : firstSegmentWords;
+    policy.record(words, words > firstSegment ? 2 : 1);
+  }
+
+private:
+  std::map<std::pair<uint64_t, uint16_t>, kj::Own<Method>> methods;
+
+  static SegmentSizePolicy::Options policyOptions() {
+    SegmentSizePolicy::Options options;
+    options.initialFirstSegmentWords = 0;  // i.e. the VatNetwork's default
+    return options;
+  }
+};
+
+uint learnedFirstSegmentSize(kj::Maybe<MessageSize> sizeHint, uint additional,
+                             kj::Maybe<SegmentSizePolicy&> learned) {
+  // Like firstSegmentSize(), but falls back to the learned size of this kind of message.
+  if (sizeHint == nullptr) {
+    KJ_IF_MAYBE(l, learned) {
+      return l->firstSegmentWords();
+    }
+  }
+  return firstSegmentSize(sizeHint, additional);
+}
+
 class RpcConnectionState final: public kj::TaskSet::ErrorHandler, public kj::Refcounted {
 public:
   struct DisconnectInfo {
@@ -269,10 +389,12 @@ public:
                      kj::Maybe<SturdyRefRestorerBase&> restorer,
                      kj::Own<VatNetworkBase::Connection>&& connectionParam,
                      kj::Own<kj::PromiseFulfiller<DisconnectInfo>>&& disconnectFulfiller,
-                     size_t flowLimit)
+                     size_t flowLimit, kj::Maybe<RpcObserver&> observer,
+                     kj::Own<RpcSizeHints> sizeHints)
       : bootstrapFactory(bootstrapFactory), gateway(kj::mv(gateway)),
-        restorer(restorer), disconnectFulfiller(kj::mv(disconnectFulfiller)), flowLimit(flowLimit),
-        tasks(*this) {
+        restorer(restorer), disconnectFulfiller(kj::mv(disconnectFulfiller)),
+        exportsByCap(ExportsByCapCallbacks { &exports }), flowLimit(flowLimit),
+        observer(observer), sizeHints(kj::mv(sizeHints)), tasks(*this) {
     connection.init<Connected>(kj::mv(connectionParam));
     tasks.add(messageLoop());
   }
@@ -295,7 +417,7 @@ public:
     paf.promise = paf.promise.attach(kj::addRef(*questionRef));
 
     {
-      auto message = connection.get<Connected>()->newOutgoingMessage(
+      auto message = newOutgoingMessage(
           objectId.targetSize().wordCount + messageSizeHint<rpc::Bootstrap>());
 
       auto builder = message->getBody().initAs<rpc::Message>().initBootstrap();
@@ -353,6 +475,7 @@ public:
         }
       });
 
+      exportsByCap.clear();
       exports.forEach([&](ExportId id, Export& exp) {
         clientsToRelease.add(kj::mv(exp.clientHook));
         resolveOpsToRelease.add(kj::mv(exp.resolveOp));
@@ -379,7 +502,7 @@ public:
 
     // Send an abort message, but ignore failure.
     kj::runCatchingExceptions([&]() {
-      auto message = connection.get<Connected>()->newOutgoingMessage(
+      auto message = newOutgoingMessage(
           messageSizeHint<void>() + exceptionSizeHint(exception));
       fromException(exception, message->getBody().getAs<rpc::Message>().initAbort());
       message->send();
@@ -405,6 +528,23 @@ public:
     maybeUnblockFlow();
   }
 
+  void setObserver(kj::Maybe<RpcObserver&> newObserver) {
+    observer = newObserver;
+  }
+
+  void addTableSizes(RpcTableSizes& sizes) {
+    sizes.questions += questions.size();
+    sizes.exports += exports.size();
+    sizes.bytes += exports.memoryUsage() + questions.memoryUsage() + answers.memoryUsage() +
+        imports.memoryUsage() + embargoes.memoryUsage() + exportsByCap.heapSize();
+    answers.forEach([&](AnswerId id, Answer& answer) {
+      if (answer.active) ++sizes.answers;
+    });
+    imports.forEach([&](ImportId id, Import& import) {
+      if (import.importClient != nullptr) ++sizes.imports;
+    });
+  }
+
 private:
   class RpcClient;
   class ImportClient;
@@ -451,6 +591,17 @@ private:
     bool skipFinish = false;
     // If true, don't send a Finish message.
 
+    bool isStreaming = false;
+    // Was this sent with sendStreaming()?  If so, nobody will look at the results.
+
+    bool isObserved = false;
+    // If true, the `Call` was reported to the observer, and so should the `Return` be.
+
+    uint16_t methodId = 0;
+    uint64_t interfaceId = 0;
+    kj::TimePoint sendTime = kj::origin<kj::TimePoint>();
+    // Set only if `isObserved`.
+
     inline bool operator==(decltype(nullptr)) const {
       return !isAwaitingReturn && selfRef == nullptr;
     }
@@ -498,6 +649,30 @@ private:
     inline bool operator!=(decltype(nullptr)) const { return refcount != 0; }
   };
 
+  struct ExportsByCapCallbacks {
+    // Lets `exportsByCap` be keyed by ExportId, looking up each one's ClientHook in the export
+    // table rather than storing a copy of the pointer, which halves the size of its entries.  So,
+    // an export must be removed from the index before its `clientHook` is replaced.
+    //
+    // Searching by ClientHook* finds the export of that capability; searching by ExportId finds
+    // that specific export, even if another export of the same capability is indexed instead.
+
+    ExportTable<ExportId, Export>* exports;
+
+    inline ClientHook* hookFor(ExportId id) const {
+      KJ_IF_MAYBE(exp, exports->find(id)) {
+        return exp->clientHook.get();
+      } else {
+        return nullptr;
+      }
+    }
+
+    inline uint hashCode(ClientHook* hook) const { return kj::hashCode(hook); }
+    inline uint hashCode(ExportId id) const { return kj::hashCode(hookFor(id)); }
+    inline bool matches(ExportId key, ClientHook* hook) const { return hookFor(key) == hook; }
+    inline bool matches(ExportId key, ExportId other) const { return key == other; }
+  };
+
   struct Import {
     Import() = default;
     Import(const Import&) = delete;
@@ -525,6 +700,9 @@ private:
     kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> fulfiller;
     // Fulfill this when the Disembargo arrives.
 
+    kj::Maybe<kj::TimePoint> startTime;
+    // When the Disembargo was sent, if it was reported to the observer.
+
     inline bool operator==(decltype(nullptr)) const { return fulfiller == nullptr; }
     inline bool operator!=(decltype(nullptr)) const { return fulfiller != nullptr; }
   };
@@ -551,7 +729,7 @@ private:
   // The Four Tables!
   // The order of the tables is important for correct destruction.
 
-  std::unordered_map<ClientHook*, ExportId> exportsByCap;
+  kj::HashMap<ExportId, ExportId, ExportsByCapCallbacks> exportsByCap;
   // Maps already-exported ClientHook objects to their ID in the export table.
 
   ExportTable<EmbargoId, Embargo> embargoes;
@@ -565,8 +743,57 @@ private:
   // If non-null, we're currently blocking incoming messages waiting for callWordsInFlight to drop
   // below flowLimit. Fulfill this to un-block.
 
+  kj::Maybe<RpcObserver&> observer;
+  // See RpcSystem::setObserver().
+
+  kj::Own<RpcSizeHints> sizeHints;
+  // See RpcSystem::setSizeHintLearning().
+
   kj::TaskSet tasks;
 
+  // =====================================================================================
+  // Messages
+
+  class ObservedOutgoingMessage final: public OutgoingRpcMessage {
+    // Wraps an outgoing message to report it to the observer when sent.
+
+  public:
+    ObservedOutgoingMessage(RpcConnectionState& connectionState,
+                            kj::Own<OutgoingRpcMessage>&& inner)
+        : connectionState(kj::addRef(connectionState)), inner(kj::mv(inner)) {}
+
+    AnyPointer::Builder getBody() override {
+      return inner->getBody();
+    }
+
+    void send() override {
+      KJ_IF_MAYBE(o, connectionState->observer) {
+        o->messageSent(inner->sizeInWords());
+      }
+      inner->send();
+    }
+
+    size_t sizeInWords() override {
+      return inner->sizeInWords();
+    }
+
+  private:
+    kj::Own<RpcConnectionState> connectionState;
+    kj::Own<OutgoingRpcMessage> inner;
+  };
+
+  kj::Own<OutgoingRpcMessage> newOutgoingMessage(uint firstSegmentWordSize) {
+    // Like connection->newOutgoingMessage(), but reports the message to the observer, if any.
+    // The connection must not be disconnected.
+
+    auto message = connection.get<Connected>()->newOutgoingMessage(firstSegmentWordSize);
+    if (observer == nullptr) {
+      return kj::mv(message);
+    } else {
+      return kj::heap<ObservedOutgoingMessage>(*this, kj::mv(message));
+    }
+  }
+
   // =====================================================================================
   // ClientHook implementations
 
@@ -645,7 +872,7 @@ private:
 
       auto request = kj::heap<RpcRequest>(
           *connectionState, *connectionState->connection.get<Connected>(),
-          sizeHint, kj::addRef(*this));
+          interfaceId, methodId, sizeHint, kj::addRef(*this));
       auto callBuilder = request->getCall();
 
       callBuilder.setInterfaceId(interfaceId);
@@ -704,6 +931,15 @@ private:
     }
 
     kj::Own<RpcConnectionState> connectionState;
+
+    kj::Maybe<kj::Own<RpcFlowController>> flowController;
+    // Flow controller for streaming calls made through this client. Created by the connection's
+    // newStream() the first time sendStreaming() is used.
+
+    bool targeted = false;
+    // Set by writeTarget() implementations that address the peer directly (ImportClient and
+    // PipelineClient), i.e. once a message -- in practice, a call -- has been sent to this
+    // capability.  PromiseClient uses it to decide whether it needs an embargo.
   };
 
   class ImportClient final: public RpcClient {
@@ -726,7 +962,7 @@ private:
 
         // Send a message releasing our remote references.
         if (remoteRefcount > 0 && connectionState->connection.is<Connected>()) {
-          auto message = connectionState->connection.get<Connected>()->newOutgoingMessage(
+          auto message = connectionState->newOutgoingMessage(
               messageSizeHint<rpc::Release>());
           rpc::Release::Builder builder = message->getBody().initAs<rpc::Message>().initRelease();
           builder.setId(importId);
@@ -748,6 +984,7 @@ private:
 
     kj::Maybe<kj::Own<ClientHook>> writeTarget(
         rpc::MessageTarget::Builder target) override {
+      targeted = true;
       target.setImportedCap(importId);
       return nullptr;
     }
@@ -794,6 +1031,7 @@ private:
 
     kj::Maybe<kj::Own<ClientHook>> writeTarget(
         rpc::MessageTarget::Builder target) override {
+      targeted = true;
       auto builder = target.initPromisedAnswer();
       builder.setQuestionId(questionRef->getId());
       builder.adoptTransform(fromPipelineOps(Orphanage::getForMessageContaining(builder), ops));
@@ -897,7 +1135,8 @@ private:
             ->newCall(interfaceId, methodId, sizeHint);
       }
 
-      receivedCall = true;
+      // No need to set `receivedCall`: if the request is actually sent, it will be through
+      // `cap`, which will note it.
       return cap->newCall(interfaceId, methodId, sizeHint);
     }
 
@@ -923,7 +1162,6 @@ private:
         };
       }
 
-      receivedCall = true;
       return cap->call(interfaceId, methodId, kj::mv(context));
     }
 
@@ -951,18 +1189,37 @@ private:
     kj::Promise<void> resolveSelfPromise;
 
     bool receivedCall = false;
+    // Set when this promise was used in a way that could let calls reach the peer other than
+    // through `cap` (e.g. it was written into a message).  Calls sent through `cap` are tracked
+    // by `cap` itself; see callsSentToCap().
+
+    bool callsSentToCap() {
+      // Whether any call has been sent through `cap`.  Requests created from the promise but not
+      // yet sent don't count: one sent after the resolution would follow the Disembargo, so an
+      // embargo could not order it anyway.
+      if (cap->getBrand() == connectionState.get()) {
+        return kj::downcast<RpcClient>(*cap).targeted;
+      } else {
+        return true;
+      }
+    }
 
     void resolve(kj::Own<ClientHook> replacement, bool isError) {
       const void* replacementBrand = replacement->getBrand();
-      if (replacementBrand != connectionState.get() &&
+      bool isLocal = replacementBrand != connectionState.get() &&
           replacementBrand != &ClientHook::NULL_CAPABILITY_BRAND &&
-          receivedCall && !isError && connectionState->connection.is<Connected>()) {
+          !isError && connectionState->connection.is<Connected>();
+      if (isLocal && !receivedCall && !callsSentToCap()) {
+        KJ_IF_MAYBE(o, connectionState->observer) {
+          o->embargoSkipped();
+        }
+      } else if (isLocal) {
         // The new capability is hosted locally, not on the remote machine.  And, we had made calls
         // to the promise.  We need to make sure those calls echo back to us before we allow new
         // calls to go directly to the local capability, so we need to set a local embargo and send
         // a `Disembargo` to echo through the peer.
 
-        auto message = connectionState->connection.get<Connected>()->newOutgoingMessage(
+        auto message = connectionState->newOutgoingMessage(
             messageSizeHint<rpc::Disembargo>() + MESSAGE_TARGET_SIZE_HINT);
 
         auto disembargo = message->getBody().initAs<rpc::Message>().initDisembargo();
@@ -978,6 +1235,11 @@ private:
 
         disembargo.getContext().setSenderLoopback(embargoId);
 
+        KJ_IF_MAYBE(o, connectionState->observer) {
+          o->embargoStarted();
+          embargo.startTime = o->now();
+        }
+
         auto paf = kj::newPromiseAndFulfiller<void>();
         embargo.fulfiller = kj::mv(paf.fulfiller);
 
@@ -1065,20 +1327,19 @@ private:
     if (inner->getBrand() == this) {
       return kj::downcast<RpcClient>(*inner).writeDescriptor(descriptor);
     } else {
-      auto iter = exportsByCap.find(inner);
-      if (iter != exportsByCap.end()) {
+      KJ_IF_MAYBE(id, exportsByCap.find(inner)) {
         // We've already seen and exported this capability before.  Just up the refcount.
-        auto& exp = KJ_ASSERT_NONNULL(exports.find(iter->second));
+        auto& exp = KJ_ASSERT_NONNULL(exports.find(*id));
         ++exp.refcount;
-        descriptor.setSenderHosted(iter->second);
-        return iter->second;
+        descriptor.setSenderHosted(*id);
+        return *id;
       } else {
         // This is the first time we've seen this capability.
         ExportId exportId;
         auto& exp = exports.next(exportId);
-        exportsByCap[inner] = exportId;
         exp.refcount = 1;
         exp.clientHook = inner->addRef();
+        exportsByCap.insert(exportId, exportId);
 
         KJ_IF_MAYBE(wrapped, inner->whenMoreResolved()) {
           // This is a promise.  Arrange for the `Resolve` message to be sent later.
@@ -1171,7 +1432,7 @@ private:
       // export table is still live because when it is destroyed the asynchronous resolution task
       // (i.e. this code) is canceled.
       auto& exp = KJ_ASSERT_NONNULL(exports.find(exportId));
-      exportsByCap.erase(exp.clientHook);
+      exportsByCap.erase(exportId);
       exp.clientHook = kj::mv(resolution);
 
       if (exp.clientHook->getBrand() != this) {
@@ -1183,9 +1444,13 @@ private:
           // be able to just reuse the existing export table entry to represent the new promise --
           // unless it already has an entry.  Let's check.
 
-          auto insertResult = exportsByCap.insert(std::make_pair(exp.clientHook.get(), exportId));
+          bool inserted = false;
+          exportsByCap.findOrCreate(exp.clientHook.get(), [&]() {
+            inserted = true;
+            return decltype(exportsByCap)::Entry { exportId, exportId };
+          });
 
-          if (insertResult.second) {
+          if (inserted) {
             // The new promise was not already in the table, therefore the existing export table
             // entry has now been repurposed to represent it.  There is no need to send a resolve
             // message at all.  We do, however, have to start resolving the next promise.
@@ -1195,7 +1460,7 @@ private:
       }
 
       // OK, we have to send a `Resolve` message.
-      auto message = connection.get<Connected>()->newOutgoingMessage(
+      auto message = newOutgoingMessage(
           messageSizeHint<rpc::Resolve>() + sizeInWords<rpc::CapDescriptor>() + 16);
       auto resolve = message->getBody().initAs<rpc::Message>().initResolve();
       resolve.setPromiseId(exportId);
@@ -1205,7 +1470,7 @@ private:
       return kj::READY_NOW;
     }, [this,exportId](kj::Exception&& exception) {
       // send error resolution
-      auto message = connection.get<Connected>()->newOutgoingMessage(
+      auto message = newOutgoingMessage(
           messageSizeHint<rpc::Resolve>() + exceptionSizeHint(exception) + 8);
       auto resolve = message->getBody().initAs<rpc::Message>().initResolve();
       resolve.setPromiseId(exportId);
@@ -1335,7 +1600,7 @@ private:
 
         // Send the "Finish" message (if the connection is not already broken).
         if (connectionState->connection.is<Connected>() && !question.skipFinish) {
-          auto message = connectionState->connection.get<Connected>()->newOutgoingMessage(
+          auto message = connectionState->newOutgoingMessage(
               messageSizeHint<rpc::Finish>());
           auto builder = message->getBody().getAs<rpc::Message>().initFinish();
           builder.setQuestionId(id);
@@ -1384,12 +1649,15 @@ private:
   class RpcRequest final: public RequestHook {
   public:
     RpcRequest(RpcConnectionState& connectionState, VatNetworkBase::Connection& connection,
+               uint64_t interfaceId, uint16_t methodId,
                kj::Maybe<MessageSize> sizeHint, kj::Own<RpcClient>&& target)
         : connectionState(kj::addRef(connectionState)),
           target(kj::mv(target)),
-          message(connection.newOutgoingMessage(
-              firstSegmentSize(sizeHint, messageSizeHint<rpc::Call>() +
-                  sizeInWords<rpc::Payload>() + MESSAGE_TARGET_SIZE_HINT))),
+          learnedSize(connectionState.sizeHints->get(interfaceId, methodId)
+              .map([](RpcSizeHints::Method& m) -> SegmentSizePolicy& { return m.calls; })),
+          firstSegmentWords(learnedFirstSegmentSize(sizeHint, messageSizeHint<rpc::Call>() +
+              sizeInWords<rpc::Payload>() + MESSAGE_TARGET_SIZE_HINT, learnedSize)),
+          message(connectionState.newOutgoingMessage(firstSegmentWords)),
           callBuilder(message->getBody().getAs<rpc::Message>().initCall()),
           paramsBuilder(capTable.imbue(callBuilder.getParams().getContent())) {}
 
@@ -1431,6 +1699,10 @@ private:
               auto reader = response->getResults();
               return Response<AnyPointer>(reader, kj::mv(response));
             });
+        KJ_IF_MAYBE(tracer, kj::AsyncTracer::current()) {
+          appPromise = appPromise.attach(tracer->startSpan("rpc", kj::str("call ",
+              kj::hex(callBuilder.getInterfaceId()), ':', callBuilder.getMethodId())));
+        }
 
         return RemotePromise<AnyPointer>(
             kj::mv(appPromise),
@@ -1438,6 +1710,25 @@ private:
       }
     }
 
+    kj::Promise<void> sendStreaming() override {
+      if (!connectionState->connection.is<Connected>()) {
+        // Connection is broken.
+        return kj::cp(connectionState->connection.get<Disconnected>());
+      }
+
+      KJ_IF_MAYBE(redirect, target->writeTarget(callBuilder.getTarget())) {
+        // Whoops, this capability has been redirected while we were building the request!
+        // We'll have to make a new request and do a copy.  Ick.
+
+        auto replacement = redirect->get()->newCall(
+            callBuilder.getInterfaceId(), callBuilder.getMethodId(), paramsBuilder.targetSize());
+        replacement.set(paramsBuilder);
+        return replacement.sendStreaming();
+      } else {
+        return sendStreamingInternal();
+      }
+    }
+
     struct TailInfo {
       QuestionId questionId;
       kj::Promise<void> promise;
@@ -1485,6 +1776,8 @@ private:
     kj::Own<RpcConnectionState> connectionState;
 
     kj::Own<RpcClient> target;
+    kj::Maybe<SegmentSizePolicy&> learnedSize;
+    uint firstSegmentWords;
     kj::Own<OutgoingRpcMessage> message;
     BuilderCapabilityTable capTable;
     rpc::Call::Builder callBuilder;
@@ -1495,7 +1788,16 @@ private:
       kj::Promise<kj::Own<RpcResponse>> promise = nullptr;
     };
 
-    SendInternalResult sendInternal(bool isTailCall) {
+    struct SetupSendResult: public SendInternalResult {
+      QuestionId questionId;
+      Question& question;
+
+      SetupSendResult(SendInternalResult&& super, QuestionId questionId, Question& question)
+          : SendInternalResult(kj::mv(super)), questionId(questionId), question(question) {}
+      // TODO(cleanup): This constructor is implicit in C++17.
+    };
+
+    SetupSendResult setupSend(bool isTailCall) {
       // Build the cap table.
       auto exports = connectionState->writeDescriptors(
           capTable.getTable(), callBuilder.getParams());
@@ -1507,6 +1809,14 @@ private:
       question.paramExports = kj::mv(exports);
       question.isTailCall = isTailCall;
 
+      KJ_IF_MAYBE(o, connectionState->observer) {
+        question.isObserved = true;
+        question.interfaceId = callBuilder.getInterfaceId();
+        question.methodId = callBuilder.getMethodId();
+        question.sendTime = o->now();
+        o->outgoingCallStarted(question.interfaceId, question.methodId);
+      }
+
       // Make the QuentionRef and result promise.
       SendInternalResult result;
       auto paf = kj::newPromiseAndFulfiller<kj::Promise<kj::Own<RpcResponse>>>();
@@ -1515,11 +1825,22 @@ private:
       question.selfRef = *result.questionRef;
       result.promise = paf.promise.attach(kj::addRef(*result.questionRef));
 
-      // Finish and send.
+      // Finish building the message; the caller sends it.
       callBuilder.setQuestionId(questionId);
       if (isTailCall) {
         callBuilder.getSendResultsTo().setYourself();
       }
+
+      KJ_IF_MAYBE(l, learnedSize) {
+        RpcSizeHints::record(*l, *message, firstSegmentWords);
+      }
+
+      return SetupSendResult { kj::mv(result), questionId, question };
+    }
+
+    SendInternalResult sendInternal(bool isTailCall) {
+      auto setup = setupSend(isTailCall);
+
       KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
         KJ_CONTEXT("sending RPC call",
            callBuilder.getInterfaceId(), callBuilder.getMethodId());
@@ -1527,12 +1848,48 @@ private:
       })) {
         // We can't safely throw the exception from here since we've already modified the question
         // table state. We'll have to reject the promise instead.
-        question.isAwaitingReturn = false;
-        question.skipFinish = true;
-        result.questionRef->reject(kj::mv(*exception));
+        setup.question.isAwaitingReturn = false;
+        setup.question.skipFinish = true;
+        setup.questionRef->reject(kj::mv(*exception));
       }
 
       // Send and return.
+      return kj::mv(setup);
+    }
+
+    kj::Promise<void> sendStreamingInternal() {
+      // Nobody can pipeline on a streaming call, so tell the callee. If the results hold no
+      // capabilities, it can then forget the call as soon as it returns, and we skip `Finish`.
+      callBuilder.setNoPromisePipelining(true);
+
+      auto setup = setupSend(false);
+      setup.question.isStreaming = true;
+
+      // Streaming calls to the same capability share a flow controller, which paces them
+      // according to how quickly their returns come back.
+      RpcFlowController* flow;
+      KJ_IF_MAYBE(f, target->flowController) {
+        flow = f->get();
+      } else {
+        auto newFlow = connectionState->connection.get<Connected>()->newStream();
+        flow = newFlow;
+        target->flowController = kj::mv(newFlow);
+      }
+
+      kj::Promise<void> result = nullptr;
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        KJ_CONTEXT("sending RPC call",
+           callBuilder.getInterfaceId(), callBuilder.getMethodId());
+        result = flow->send(kj::mv(message), setup.promise.ignoreResult());
+      })) {
+        // We can't safely throw the exception from here since we've already modified the question
+        // table state. We'll have to reject the promise instead.
+        setup.question.isAwaitingReturn = false;
+        setup.question.skipFinish = true;
+        setup.questionRef->reject(kj::cp(*exception));
+        return kj::mv(*exception);
+      }
+
       return kj::mv(result);
     }
   };
@@ -1635,6 +1992,20 @@ private:
     virtual kj::Own<RpcResponse> addRef() = 0;
   };
 
+  class DiscardedRpcResponse final: public RpcResponse {
+    // Stands in for the results of a streaming call, which nobody reads.  There's only one,
+    // and it is never freed.
+
+  public:
+    AnyPointer::Reader getResults() override {
+      return AnyPointer::Reader();
+    }
+
+    kj::Own<RpcResponse> addRef() override {
+      return kj::Own<RpcResponse>(this, kj::NullDisposer::instance);
+    }
+  };
+
   class RpcResponseImpl final: public RpcResponse, public kj::Refcounted {
   public:
     RpcResponseImpl(RpcConnectionState& connectionState,
@@ -1676,15 +2047,22 @@ private:
   public:
     RpcServerResponseImpl(RpcConnectionState& connectionState,
                           kj::Own<OutgoingRpcMessage>&& message,
-                          rpc::Payload::Builder payload)
+                          rpc::Payload::Builder payload,
+                          kj::Maybe<SegmentSizePolicy&> learnedSize, uint firstSegmentWords)
         : connectionState(connectionState),
           message(kj::mv(message)),
-          payload(payload) {}
+          payload(payload),
+          learnedSize(learnedSize),
+          firstSegmentWords(firstSegmentWords) {}
 
     AnyPointer::Builder getResultsBuilder() override {
       return capTable.imbue(payload.getContent());
     }
 
+    bool hasCaps() {
+      return capTable.getTable().size() > 0;
+    }
+
     kj::Maybe<kj::Array<ExportId>> send() {
       // Send the response and return the export list.  Returns nullptr if there were no caps.
       // (Could return a non-null empty array if there were caps but none of them were exports.)
@@ -1704,6 +2082,10 @@ private:
         }
       }
 
+      KJ_IF_MAYBE(l, learnedSize) {
+        RpcSizeHints::record(*l, *message, firstSegmentWords);
+      }
+
       message->send();
       if (capTable.size() == 0) {
         return nullptr;
@@ -1717,6 +2099,8 @@ private:
     kj::Own<OutgoingRpcMessage> message;
     BuilderCapabilityTable capTable;
     rpc::Payload::Builder payload;
+    kj::Maybe<SegmentSizePolicy&> learnedSize;
+    uint firstSegmentWords;
   };
 
   class LocallyRedirectedRpcResponse final
@@ -1748,7 +2132,8 @@ private:
                    kj::Own<IncomingRpcMessage>&& request,
                    kj::Array<kj::Maybe<kj::Own<ClientHook>>> capTableArray,
                    const AnyPointer::Reader& params,
-                   bool redirectResults, kj::Own<kj::PromiseFulfiller<void>>&& cancelFulfiller,
+                   bool redirectResults, bool noPromisePipelining,
+                   kj::Own<kj::PromiseFulfiller<void>>&& cancelFulfiller,
                    uint64_t interfaceId, uint16_t methodId)
         : connectionState(kj::addRef(connectionState)),
           answerId(answerId),
@@ -1760,8 +2145,14 @@ private:
           params(paramsCapTable.imbue(params)),
           returnMessage(nullptr),
           redirectResults(redirectResults),
+          noPromisePipelining(noPromisePipelining),
           cancelFulfiller(kj::mv(cancelFulfiller)) {
       connectionState.callWordsInFlight += requestSize;
+
+      KJ_IF_MAYBE(o, connectionState.observer) {
+        receiveTime = o->now();
+        o->incomingCallStarted(interfaceId, methodId);
+      }
     }
 
     ~RpcCallContext() noexcept(false) {
@@ -1770,7 +2161,7 @@ private:
         unwindDetector.catchExceptionsIfUnwinding([&]() {
           // Don't send anything if the connection is broken.
           if (connectionState->connection.is<Connected>()) {
-            auto message = connectionState->connection.get<Connected>()->newOutgoingMessage(
+            auto message = connectionState->newOutgoingMessage(
                 messageSizeHint<rpc::Return>() + sizeInWords<rpc::Payload>());
             auto builder = message->getBody().initAs<rpc::Message>().initReturn();
 
@@ -1788,6 +2179,7 @@ private:
             message->send();
           }
 
+          observeReturn(!redirectResults);
           cleanupAnswerTable(nullptr, true);
         });
       }
@@ -1814,22 +2206,43 @@ private:
           return;
         }
 
-        if (response == nullptr) getResults(MessageSize{0, 0});  // force initialization of response
-
-        returnMessage.setAnswerId(answerId);
-        returnMessage.setReleaseParamCaps(false);
-
         kj::Maybe<kj::Array<ExportId>> exports;
         KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
           // Debug info incase send() fails due to overside message.
           KJ_CONTEXT("returning from RPC call", interfaceId, methodId);
-          exports = kj::downcast<RpcServerResponseImpl>(*KJ_ASSERT_NONNULL(response)).send();
+          KJ_IF_MAYBE(r, response) {
+            auto& serverResponse = kj::downcast<RpcServerResponseImpl>(**r);
+            returnMessage.setAnswerId(answerId);
+            returnMessage.setReleaseParamCaps(false);
+            if (noPromisePipelining && !serverResponse.hasCaps()) {
+              returnMessage.setNoFinishNeeded(true);
+              noFinishNeeded = true;
+            }
+            exports = serverResponse.send();
+          } else {
+            // The method never asked for its results, so they're empty. Send a bare `Return`
+            // rather than building a response we'd throw away.
+            auto message = connectionState->newOutgoingMessage(
+                messageSizeHint<rpc::Return>() + sizeInWords<rpc::Payload>());
+            auto builder = message->getBody().initAs<rpc::Message>().initReturn();
+            builder.setAnswerId(answerId);
+            builder.setReleaseParamCaps(false);
+            builder.initResults();
+            if (noPromisePipelining) {
+              builder.setNoFinishNeeded(true);
+              noFinishNeeded = true;
+            }
+            message->send();
+          }
         })) {
+          noFinishNeeded = false;
           responseSent = false;
           sendErrorReturn(kj::mv(*exception));
           return;
         }
 
+        observeReturn(false);
+
         KJ_IF_MAYBE(e, exports) {
           // Caps were returned, so we can't free the pipeline yet.
           cleanupAnswerTable(kj::mv(*e), false);
@@ -1843,7 +2256,7 @@ private:
       KJ_ASSERT(!redirectResults);
       if (isFirstResponder()) {
         if (connectionState->connection.is<Connected>()) {
-          auto message = connectionState->connection.get<Connected>()->newOutgoingMessage(
+          auto message = connectionState->newOutgoingMessage(
               messageSizeHint<rpc::Return>() + exceptionSizeHint(exception));
           auto builder = message->getBody().initAs<rpc::Message>().initReturn();
 
@@ -1854,6 +2267,8 @@ private:
           message->send();
         }
 
+        observeReturn(true);
+
         // Do not allow releasing the pipeline because we want pipelined calls to propagate the
         // exception rather than fail with a "no such field" exception.
         cleanupAnswerTable(nullptr, false);
@@ -1895,12 +2310,15 @@ private:
         if (redirectResults || !connectionState->connection.is<Connected>()) {
           response = kj::refcounted<LocallyRedirectedRpcResponse>(sizeHint);
         } else {
-          auto message = connectionState->connection.get<Connected>()->newOutgoingMessage(
-              firstSegmentSize(sizeHint, messageSizeHint<rpc::Return>() +
-                               sizeInWords<rpc::Payload>()));
+          auto learnedSize = connectionState->sizeHints->get(interfaceId, methodId)
+              .map([](RpcSizeHints::Method& m) -> SegmentSizePolicy& { return m.returns; });
+          uint firstSegmentWords = learnedFirstSegmentSize(sizeHint,
+              messageSizeHint<rpc::Return>() + sizeInWords<rpc::Payload>(), learnedSize);
+          auto message = connectionState->newOutgoingMessage(firstSegmentWords);
           returnMessage = message->getBody().initAs<rpc::Message>().initReturn();
           response = kj::heap<RpcServerResponseImpl>(
-              *connectionState, kj::mv(message), returnMessage.getResults());
+              *connectionState, kj::mv(message), returnMessage.getResults(),
+              learnedSize, firstSegmentWords);
         }
 
         auto results = response->getResultsBuilder();
@@ -1926,7 +2344,7 @@ private:
         KJ_IF_MAYBE(tailInfo, kj::downcast<RpcRequest>(*request).tailSend()) {
           if (isFirstResponder()) {
             if (connectionState->connection.is<Connected>()) {
-              auto message = connectionState->connection.get<Connected>()->newOutgoingMessage(
+              auto message = connectionState->newOutgoingMessage(
                   messageSizeHint<rpc::Return>());
               auto builder = message->getBody().initAs<rpc::Message>().initReturn();
 
@@ -1937,6 +2355,8 @@ private:
               message->send();
             }
 
+            observeReturn(false);
+
             // There are no caps in our return message, but of course the tail results could have
             // caps, so we must continue to honor pipeline calls (and just bounce them back).
             cleanupAnswerTable(nullptr, false);
@@ -1983,7 +2403,10 @@ private:
 
     uint64_t interfaceId;
     uint16_t methodId;
-    // For debugging.
+    // For debugging and instrumentation.
+
+    kj::Maybe<kj::TimePoint> receiveTime;
+    // Set if the call was reported to the observer; the return will be reported too.
 
     // Request ---------------------------------------------
 
@@ -1997,6 +2420,10 @@ private:
     kj::Maybe<kj::Own<RpcServerResponse>> response;
     rpc::Return::Builder returnMessage;
     bool redirectResults = false;
+    bool noPromisePipelining = false;
+    bool noFinishNeeded = false;
+    // If the caller set `Call.noPromisePipelining` and the results hold no capabilities, the
+    // `Return` says no `Finish` is needed and the answer is removed from the table right away.
     bool responseSent = false;
     kj::Maybe<kj::Own<kj::PromiseFulfiller<AnyPointer::Pipeline>>> tailCallPipelineFulfiller;
 
@@ -2028,14 +2455,24 @@ private:
       }
     }
 
+    void observeReturn(bool isError) {
+      KJ_IF_MAYBE(t, receiveTime) {
+        KJ_IF_MAYBE(o, connectionState->observer) {
+          o->incomingCallReturned(interfaceId, methodId, o->now() - *t, isError);
+        }
+        receiveTime = nullptr;
+      }
+    }
+
     void cleanupAnswerTable(kj::Array<ExportId> resultExports, bool shouldFreePipeline) {
       // We need to remove the `callContext` pointer -- which points back to us -- from the
       // answer table.  Or we might even be responsible for removing the entire answer table
       // entry.
 
-      if (cancellationFlags & CANCEL_REQUESTED) {
-        // Already received `Finish` so it's our job to erase the table entry. We shouldn't have
-        // sent results if canceled, so we shouldn't have an export list to deal with.
+      if ((cancellationFlags & CANCEL_REQUESTED) || noFinishNeeded) {
+        // Already received `Finish`, or told the caller not to send one, so it's our job to erase
+        // the table entry. We shouldn't have sent results if canceled, nor any caps if no `Finish`
+        // is coming, so we shouldn't have an export list to deal with.
         KJ_ASSERT(resultExports.size() == 0);
         connectionState->answers.erase(answerId);
       } else {
@@ -2102,6 +2539,10 @@ private:
   }
 
   void handleMessage(kj::Own<IncomingRpcMessage> message) {
+    KJ_IF_MAYBE(o, observer) {
+      o->messageReceived(message->sizeInWords());
+    }
+
     auto reader = message->getBody().getAs<rpc::Message>();
 
     switch (reader.which()) {
@@ -2143,7 +2584,7 @@ private:
 
       default: {
         if (connection.is<Connected>()) {
-          auto message = connection.get<Connected>()->newOutgoingMessage(
+          auto message = newOutgoingMessage(
               firstSegmentSize(reader.totalSize(), messageSizeHint<void>()));
           message->getBody().initAs<rpc::Message>().setUnimplemented(reader);
           message->send();
@@ -2231,7 +2672,7 @@ private:
     }
 
     VatNetworkBase::Connection& conn = *connection.get<Connected>();
-    auto response = conn.newOutgoingMessage(
+    auto response = newOutgoingMessage(
         messageSizeHint<rpc::Return>() + sizeInWords<rpc::CapDescriptor>() + 32);
 
     rpc::Return::Builder ret = response->getBody().getAs<rpc::Message>().initReturn();
@@ -2311,10 +2752,11 @@ private:
     auto cancelPaf = kj::newPromiseAndFulfiller<void>();
 
     AnswerId answerId = call.getQuestionId();
+    bool noPromisePipelining = call.getNoPromisePipelining();
 
     auto context = kj::refcounted<RpcCallContext>(
         *this, answerId, kj::mv(message), kj::mv(capTableArray), payload.getContent(),
-        redirectResults, kj::mv(cancelPaf.fulfiller),
+        redirectResults, noPromisePipelining, kj::mv(cancelPaf.fulfiller),
         call.getInterfaceId(), call.getMethodId());
 
     // No more using `call` after this point, as it now belongs to the context.
@@ -2332,6 +2774,10 @@ private:
 
     auto promiseAndPipeline = startCall(
         call.getInterfaceId(), call.getMethodId(), kj::mv(capability), context->addRef());
+    KJ_IF_MAYBE(tracer, kj::AsyncTracer::current()) {
+      promiseAndPipeline.promise = promiseAndPipeline.promise.attach(tracer->startSpan("rpc",
+          kj::str("serve ", kj::hex(call.getInterfaceId()), ':', call.getMethodId())));
+    }
 
     // Things may have changed -- in particular if startCall() immediately called
     // context->directTailCall().
@@ -2339,7 +2785,9 @@ private:
     {
       auto& answer = answers[answerId];
 
-      answer.pipeline = kj::mv(promiseAndPipeline.pipeline);
+      if (!noPromisePipelining) {
+        answer.pipeline = kj::mv(promiseAndPipeline.pipeline);
+      }
 
       if (redirectResults) {
         auto resultsPromise = promiseAndPipeline.promise.then(
@@ -2485,12 +2933,24 @@ private:
       KJ_REQUIRE(question->isAwaitingReturn, "Duplicate Return.") { return; }
       question->isAwaitingReturn = false;
 
+      if (question->isObserved) {
+        KJ_IF_MAYBE(o, observer) {
+          o->outgoingCallReturned(question->interfaceId, question->methodId,
+              o->now() - question->sendTime,
+              ret.isException() || ret.isCanceled());
+        }
+      }
+
       if (ret.getReleaseParamCaps()) {
         exportsToRelease = kj::mv(question->paramExports);
       } else {
         question->paramExports = nullptr;
       }
 
+      if (ret.getNoFinishNeeded()) {
+        question->skipFinish = true;
+      }
+
       KJ_IF_MAYBE(questionRef, question->selfRef) {
         switch (ret.which()) {
           case rpc::Return::RESULTS: {
@@ -2500,6 +2960,12 @@ private:
             }
 
             auto payload = ret.getResults();
+            if (question->isStreaming && payload.getCapTable().size() == 0) {
+              // The results will be discarded, so don't bother wrapping them in a response.
+              static DiscardedRpcResponse discarded;
+              questionRef->fulfill(discarded.addRef());
+              break;
+            }
             auto capTableArray = receiveCaps(payload.getCapTable());
             questionRef->fulfill(kj::refcounted<RpcResponseImpl>(
                 *this, kj::addRef(*questionRef), kj::mv(message),
@@ -2575,7 +3041,12 @@ private:
     kj::Maybe<kj::Own<PipelineHook>> pipelineToRelease;
 
     KJ_IF_MAYBE(answer, answers.find(finish.getQuestionId())) {
-      KJ_REQUIRE(answer->active, "'Finish' for invalid question ID.") { return; }
+      if (!answer->active) {
+        // We probably sent a `Return` with `noFinishNeeded` and the caller sent `Finish` anyway,
+        // either because it predates that flag or because it canceled the call before the
+        // `Return` arrived.
+        return;
+      }
 
       if (finish.getReleaseResultCaps()) {
         exportsToRelease = kj::mv(answer->resultExports);
@@ -2593,7 +3064,7 @@ private:
         answerToRelease = answers.erase(finish.getQuestionId());
       }
     } else {
-      KJ_REQUIRE(answer->active, "'Finish' for invalid question ID.") { return; }
+      // As above, this answer was presumably already removed after a `noFinishNeeded` return.
     }
   }
 
@@ -2652,10 +3123,12 @@ private:
         return;
       }
 
-      exp->refcount -= refcount;
-      if (exp->refcount == 0) {
-        exportsByCap.erase(exp->clientHook);
+      if (exp->refcount == refcount) {
+        // Unindex the export while it's still live: `exportsByCap` looks up its key through it.
+        exportsByCap.erase(id);
         exports.erase(id, *exp);
+      } else {
+        exp->refcount -= refcount;
       }
     } else {
       KJ_FAIL_REQUIRE("Tried to release invalid export ID.") {
@@ -2709,7 +3182,7 @@ private:
 
           RpcClient& downcasted = kj::downcast<RpcClient>(*target);
 
-          auto message = connection.get<Connected>()->newOutgoingMessage(
+          auto message = newOutgoingMessage(
               messageSizeHint<rpc::Disembargo>() + MESSAGE_TARGET_SIZE_HINT);
           auto builder = message->getBody().initAs<rpc::Message>().initDisembargo();
 
@@ -2738,6 +3211,11 @@ private:
 
       case rpc::Disembargo::Context::RECEIVER_LOOPBACK: {
         KJ_IF_MAYBE(embargo, embargoes.find(context.getReceiverLoopback())) {
+          KJ_IF_MAYBE(startTime, embargo->startTime) {
+            KJ_IF_MAYBE(o, observer) {
+              o->embargoLifted(o->now() - *startTime);
+            }
+          }
           KJ_ASSERT_NONNULL(embargo->fulfiller)->fulfill();
           embargoes.erase(context.getReceiverLoopback(), *embargo);
         } else {
@@ -2819,6 +3297,30 @@ public:
     }
   }
 
+  void setObserver(kj::Maybe<RpcObserver&> newObserver) {
+    observer = newObserver;
+
+    for (auto& conn: connections) {
+      conn.second->setObserver(newObserver);
+    }
+  }
+
+  RpcTableSizes getTableSizes() {
+    RpcTableSizes result;
+    for (auto& conn: connections) {
+      conn.second->addTableSizes(result);
+    }
+    return result;
+  }
+
+  void setSizeHintLearning(bool enable) {
+    sizeHints->enabled = enable;
+  }
+
+  kj::Array<RpcMethodSizeHints> getSizeHints() {
+    return sizeHints->getAll();
+  }
+
 private:
   VatNetworkBase& network;
   kj::Maybe<Capability::Client> bootstrapInterface;
@@ -2826,6 +3328,8 @@ private:
   kj::Maybe<RealmGateway<>::Client> gateway;
   kj::Maybe<SturdyRefRestorerBase&> restorer;
   size_t flowLimit = kj::maxValue;
+  kj::Maybe<RpcObserver&> observer;
+  kj::Own<RpcSizeHints> sizeHints = kj::refcounted<RpcSizeHints>();
   kj::TaskSet tasks;
 
   typedef std::unordered_map<VatNetworkBase::Connection*, kj::Own<RpcConnectionState>>
@@ -2846,7 +3350,7 @@ private:
       }));
       auto newState = kj::refcounted<RpcConnectionState>(
           bootstrapFactory, gateway, restorer, kj::mv(connection),
-          kj::mv(onDisconnect.fulfiller), flowLimit);
+          kj::mv(onDisconnect.fulfiller), flowLimit, observer, kj::addRef(*sizeHints));
       RpcConnectionState& result = *newState;
       connections.insert(std::make_pair(connectionPtr, kj::mv(newState)));
       return result;
@@ -2913,5 +3417,444 @@ void RpcSystemBase::baseSetFlowLimit(size_t words) {
   return impl->setFlowLimit(words);
 }
 
+void RpcSystemBase::baseSetObserver(kj::Maybe<RpcObserver&> observer) {
+  impl->setObserver(observer);
+}
+
+RpcTableSizes RpcSystemBase::baseGetTableSizes() {
+  return impl->getTableSizes();
+}
+
+void RpcSystemBase::baseSetSizeHintLearning(bool enable) {
+  impl->setSizeHintLearning(enable);
+}
+
+kj::Array<RpcMethodSizeHints> RpcSystemBase::baseGetSizeHints() {
+  return impl->getSizeHints();
+}
+
 }  // namespace _ (private)
+
+// =======================================================================================
+
+namespace {
+
+class WindowFlowController final: public RpcFlowController, private kj::TaskSet::ErrorHandler {
+public:
+  WindowFlowController(RpcFlowController::WindowGetter& windowGetter)
+      : windowGetter(windowGetter), tasks(*this) {
+    state.init<Running>();
+  }
+
+  kj::Promise<void> send(kj::Own<OutgoingRpcMessage> message, kj::Promise<void> ack) override {
+    auto size = message->sizeInWords() * sizeof(capnp::word);
+    maxMessageSize = kj::max(size, maxMessageSize);
+
+    // We are REQUIRED to send the message NOW to maintain correct ordering.
+    message->send();
+
+    inFlight += size;
+    tasks.add(ack.then([this, size]() {
+      inFlight -= size;
+      if (state.is<Running>()) {
+        auto& blockedSends = state.get<Running>();
+        if (isReady()) {
+          // Release all fulfillers.
+          for (auto& fulfiller: blockedSends) {
+            fulfiller->fulfill();
+          }
+          blockedSends.clear();
+        }
+
+        if (inFlight == 0) {
+          KJ_IF_MAYBE(f, emptyFulfiller) {
+            f->get()->fulfill();
+            emptyFulfiller = nullptr;
+          }
+        }
+      }
+    }));
+
+    if (state.is<kj::Exception>()) {
+      return kj::cp(state.get<kj::Exception>());
+    } else if (isReady()) {
+      return kj::READY_NOW;
+    } else {
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      state.get<Running>().add(kj::mv(paf.fulfiller));
+      return kj::mv(paf.promise);
+    }
+  }
+
+  kj::Promise<void> waitAllAcked() override {
+    if (state.is<kj::Exception>()) {
+      return kj::cp(state.get<kj::Exception>());
+    } else if (inFlight == 0) {
+      return kj::READY_NOW;
+    } else {
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      emptyFulfiller = kj::mv(paf.fulfiller);
+      return kj::mv(paf.promise);
+    }
+  }
+
+private:
+  RpcFlowController::WindowGetter& windowGetter;
+  size_t inFlight = 0;
+  size_t maxMessageSize = 0;
+
+  typedef kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> Running;
+  kj::OneOf<Running, kj::Exception> state;
+
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> emptyFulfiller;
+
+  kj::TaskSet tasks;
+
+  void taskFailed(kj::Exception&& exception) override {
+    if (state.is<Running>()) {
+      // Fail out all pending sends.
+      for (auto& fulfiller: state.get<Running>()) {
+        fulfiller->reject(kj::cp(exception));
+      }
+      // Fail out all future sends.
+      state.init<kj::Exception>(kj::mv(exception));
+    }
+    KJ_IF_MAYBE(f, emptyFulfiller) {
+      f->get()->reject(kj::cp(state.get<kj::Exception>()));
+      emptyFulfiller = nullptr;
+    }
+  }
+
+  bool isReady() {
+    // We extend the window by maxMessageSize to avoid a pathological situation when a message
+    // is larger than the window size. Otherwise, after sending that message, we would end up
+    // not sending any others until the ack was received, wasting a round trip's worth of
+    // bandwidth.
+    return inFlight <= maxMessageSize  // avoid getWindow() call if unnecessary
+        || inFlight < windowGetter.getWindow() + maxMessageSize;
+  }
+};
+
+class FixedWindowFlowController final
+    : public RpcFlowController, public RpcFlowController::WindowGetter {
+public:
+  FixedWindowFlowController(size_t windowSize): windowSize(windowSize), inner(*this) {}
+
+  kj::Promise<void> send(kj::Own<OutgoingRpcMessage> message, kj::Promise<void> ack) override {
+    return inner.send(kj::mv(message), kj::mv(ack));
+  }
+
+  kj::Promise<void> waitAllAcked() override {
+    return inner.waitAllAcked();
+  }
+
+  size_t getWindow() override { return windowSize; }
+
+private:
+  size_t windowSize;
+  WindowFlowController inner;
+};
+
+constexpr uint RATE_WINDOW_RTTS = 10;
+// Delivery rate samples older than this many round trips are forgotten, so that the adaptive
+// window shrinks again if the path slows down.
+
+class AdaptiveWindowFlowController final
+    : public RpcFlowController, public RpcFlowController::WindowGetter {
+  // Estimates the bandwidth-delay product from ack timing, in the manner of BBR: each ack yields
+  // a round trip sample (time since its message was sent) and a delivery rate sample (bytes
+  // acked since its message was sent, divided by that time). The product of the least round
+  // trip and the greatest recent delivery rate is what the path can hold.
+
+public:
+  AdaptiveWindowFlowController(kj::Function<kj::TimePoint()> clock,
+                               size_t minWindow, size_t maxWindow)
+      : clock(kj::mv(clock)), minWindow(minWindow), maxWindow(kj::max(minWindow, maxWindow)),
+        window(minWindow), inner(*this) {}
+
+  kj::Promise<void> send(kj::Own<OutgoingRpcMessage> message, kj::Promise<void> ack) override {
+    size_t size = message->sizeInWords() * sizeof(capnp::word);
+    auto sentAt = clock();
+    uint64_t deliveredAtSend = delivered;
+    return inner.send(kj::mv(message), ack.then([this, size, sentAt, deliveredAtSend]() {
+      onAck(size, sentAt, deliveredAtSend);
+    }));
+  }
+
+  kj::Promise<void> waitAllAcked() override {
+    return inner.waitAllAcked();
+  }
+
+  size_t getWindow() override { return window; }
+
+private:
+  kj::Function<kj::TimePoint()> clock;
+  size_t minWindow;
+  size_t maxWindow;
+  size_t window;
+
+  uint64_t delivered = 0;
+  // Total bytes acked so far.
+
+  kj::Maybe<kj::Duration> minRtt;
+
+  double maxRate = 0;  // bytes per nanosecond
+  kj::TimePoint maxRateTime = kj::origin<kj::TimePoint>();
+
+  WindowFlowController inner;
+
+  void onAck(size_t size, kj::TimePoint sentAt, uint64_t deliveredAtSend) {
+    delivered += size;
+
+    auto now = clock();
+    auto rtt = now - sentAt;
+    if (rtt <= 0 * kj::NANOSECONDS) {
+      // Clock too coarse to tell; no information.
+      return;
+    }
+
+    KJ_IF_MAYBE(m, minRtt) {
+      if (rtt < *m) *m = rtt;
+    } else {
+      minRtt = rtt;
+    }
+    auto baseRtt = KJ_ASSERT_NONNULL(minRtt);
+
+    double rate = double(delivered - deliveredAtSend) / (rtt / kj::NANOSECONDS);
+    if (rate >= maxRate || now - maxRateTime > RATE_WINDOW_RTTS * baseRtt) {
+      maxRate = rate;
+      maxRateTime = now;
+    }
+
+    double bdp = maxRate * (baseRtt / kj::NANOSECONDS);
+    window = kj::max(minWindow, size_t(kj::min(2 * bdp, double(maxWindow))));
+  }
+};
+
+kj::TimePoint systemMonotonicTime() {
+  return kj::origin<kj::TimePoint>() + std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count() * kj::NANOSECONDS;
+}
+
+}  // namespace
+
+constexpr size_t RpcFlowController::DEFAULT_WINDOW_SIZE;
+constexpr size_t RpcFlowController::MAX_ADAPTIVE_WINDOW_SIZE;
+
+kj::Own<RpcFlowController> RpcFlowController::newFixedWindowController(size_t windowSize) {
+  return kj::heap<FixedWindowFlowController>(windowSize);
+}
+
+kj::Own<RpcFlowController> RpcFlowController::newVariableWindowController(WindowGetter& getter) {
+  return kj::heap<WindowFlowController>(getter);
+}
+
+kj::Own<RpcFlowController> RpcFlowController::newAdaptiveWindowController(
+    size_t minWindow, size_t maxWindow) {
+  return newAdaptiveWindowController(systemMonotonicTime, minWindow, maxWindow);
+}
+
+kj::Own<RpcFlowController> RpcFlowController::newAdaptiveWindowController(
+    kj::Function<kj::TimePoint()> clock, size_t minWindow, size_t maxWindow) {
+  return kj::heap<AdaptiveWindowFlowController>(kj::mv(clock), minWindow, maxWindow);
+}
+
+// =======================================================================================
+
+void RpcObserver::messageSent(size_t sizeInWords) {}
+void RpcObserver::messageReceived(size_t sizeInWords) {}
+void RpcObserver::outgoingCallStarted(uint64_t interfaceId, uint16_t methodId) {}
+void RpcObserver::outgoingCallReturned(uint64_t interfaceId, uint16_t methodId,
+                                       kj::Duration latency, bool isError) {}
+void RpcObserver::incomingCallStarted(uint64_t interfaceId, uint16_t methodId) {}
+void RpcObserver::incomingCallReturned(uint64_t interfaceId, uint16_t methodId,
+                                       kj::Duration latency, bool isError) {}
+void RpcObserver::embargoStarted() {}
+void RpcObserver::embargoLifted(kj::Duration latency) {}
+void RpcObserver::embargoSkipped() {}
+
+kj::TimePoint RpcObserver::now() {
+  return systemMonotonicTime();
+}
+
+constexpr uint RpcLatencyHistogram::SUB_BUCKET_BITS;
+constexpr uint RpcLatencyHistogram::SUB_BUCKETS;
+constexpr uint RpcLatencyHistogram::BUCKET_COUNT;
+
+RpcLatencyHistogram::RpcLatencyHistogram() {
+  memset(counts, 0, sizeof(counts));
+}
+
+uint RpcLatencyHistogram::bucketFor(uint64_t ns) {
+  // Values below SUB_BUCKETS get a bucket each. Above that, a value whose highest set bit is
+  // bit `e` lands in row `e - SUB_BUCKET_BITS + 1`, in the column given by the SUB_BUCKET_BITS
+  // bits just below bit `e`.
+  if (ns < SUB_BUCKETS) return ns;
+  uint e = 63 - __builtin_clzll(ns);
+  uint row = e - SUB_BUCKET_BITS + 1;
+  return row * SUB_BUCKETS + ((ns >> (e - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+}
+
+uint64_t RpcLatencyHistogram::bucketUpperBound(uint bucket) {
+  // Inverse of bucketFor(): the largest value that maps to `bucket`.
+  uint row = bucket / SUB_BUCKETS;
+  uint64_t column = bucket % SUB_BUCKETS;
+  if (row == 0) return column;
+  uint shift = row - 1;
+  uint64_t lowest = (SUB_BUCKETS + column) << shift;
+  return lowest + ((uint64_t(1) << shift) - 1);
+}
+
+void RpcLatencyHistogram::record(kj::Duration value) {
+  int64_t signedNs = value / kj::NANOSECONDS;
+  uint64_t ns = signedNs < 0 ? 0 : signedNs;
+
+  ++counts[bucketFor(ns)];
+  ++count;
+  sumNs += ns;
+  minNs = kj::min(minNs, ns);
+  maxNs = kj::max(maxNs, ns);
+}
+
+kj::Duration RpcLatencyHistogram::getMin() const {
+  return count == 0 ? 0 * kj::NANOSECONDS : int64_t(minNs) * kj::NANOSECONDS;
+}
+
+kj::Duration RpcLatencyHistogram::getMax() const {
+  return int64_t(maxNs) * kj::NANOSECONDS;
+}
+
+kj::Duration RpcLatencyHistogram::getMean() const {
+  return count == 0 ? 0 * kj::NANOSECONDS : int64_t(sumNs / count) * kj::NANOSECONDS;
+}
+
+kj::Duration RpcLatencyHistogram::getPercentile(double percentile) const {
+  if (count == 0) return 0 * kj::NANOSECONDS;
+
+  // Rank of the value we want, counting from 1.
+  uint64_t rank = kj::max(uint64_t(1), uint64_t(percentile / 100 * count + 0.5));
+  rank = kj::min(rank, count);
+
+  uint64_t seen = 0;
+  for (uint i = 0; i < BUCKET_COUNT; i++) {
+    seen += counts[i];
+    if (seen >= rank) {
+      // Never report more than the true maximum.
+      return int64_t(kj::min(bucketUpperBound(i), maxNs)) * kj::NANOSECONDS;
+    }
+  }
+
+  KJ_UNREACHABLE;
+}
+
+struct RpcHistogramObserver::Methods {
+  std::map<std::pair<uint64_t, uint16_t>, MethodStats> map;
+};
+
+RpcHistogramObserver::RpcHistogramObserver(): methods(kj::heap<Methods>()) {}
+RpcHistogramObserver::~RpcHistogramObserver() noexcept(false) {}
+
+RpcHistogramObserver::MethodStats& RpcHistogramObserver::getStats(
+    uint64_t interfaceId, uint16_t methodId) {
+  return methods->map[std::make_pair(interfaceId, methodId)];
+}
+
+kj::Maybe<const RpcHistogramObserver::MethodStats&> RpcHistogramObserver::getMethodStats(
+    uint64_t interfaceId, uint16_t methodId) const {
+  auto iter = methods->map.find(std::make_pair(interfaceId, methodId));
+  if (iter == methods->map.end()) {
+    return nullptr;
+  } else {
+    return iter->second;
+  }
+}
+
+void RpcHistogramObserver::messageSent(size_t sizeInWords) {
+  ++messagesSent;
+  wordsSent += sizeInWords;
+}
+
+void RpcHistogramObserver::messageReceived(size_t sizeInWords) {
+  ++messagesReceived;
+  wordsReceived += sizeInWords;
+}
+
+void RpcHistogramObserver::outgoingCallStarted(uint64_t interfaceId, uint16_t methodId) {
+  ++getStats(interfaceId, methodId).outgoingInFlight;
+}
+
+void RpcHistogramObserver::outgoingCallReturned(uint64_t interfaceId, uint16_t methodId,
+                                                kj::Duration latency, bool isError) {
+  auto& stats = getStats(interfaceId, methodId);
+  if (stats.outgoingInFlight > 0) --stats.outgoingInFlight;
+  stats.outgoing.record(latency);
+  if (isError) ++stats.outgoingErrors;
+}
+
+void RpcHistogramObserver::incomingCallStarted(uint64_t interfaceId, uint16_t methodId) {
+  ++getStats(interfaceId, methodId).incomingInFlight;
+}
+
+void RpcHistogramObserver::incomingCallReturned(uint64_t interfaceId, uint16_t methodId,
+                                                kj::Duration latency, bool isError) {
+  auto& stats = getStats(interfaceId, methodId);
+  if (stats.incomingInFlight > 0) --stats.incomingInFlight;
+  stats.incoming.record(latency);
+  if (isError) ++stats.incomingErrors;
+}
+
+void RpcHistogramObserver::embargoStarted() {
+  ++embargoesInFlight;
+}
+
+void RpcHistogramObserver::embargoLifted(kj::Duration latency) {
+  if (embargoesInFlight > 0) --embargoesInFlight;
+  embargoes.record(latency);
+}
+
+void RpcHistogramObserver::embargoSkipped() {
+  ++embargoesSkipped;
+}
+
+kj::String RpcHistogramObserver::dump() const {
+  kj::Vector<kj::String> lines;
+  lines.add(kj::str("messages_sent ", messagesSent, '\n'));
+  lines.add(kj::str("messages_received ", messagesReceived, '\n'));
+  lines.add(kj::str("bytes_sent ", getBytesSent(), '\n'));
+  lines.add(kj::str("bytes_received ", getBytesReceived(), '\n'));
+
+  auto dumpHistogram = [&](kj::StringPtr direction, uint64_t interfaceId, uint16_t methodId,
+                           const RpcLatencyHistogram& histogram, uint64_t errors,
+                           uint64_t inFlight) {
+    if (histogram.getCount() == 0 && inFlight == 0) return;
+    lines.add(kj::str(
+        "call ", direction, " 0x", kj::hex(interfaceId), ' ', methodId,
+        " count=", histogram.getCount(), " errors=", errors, " in_flight=", inFlight,
+        " p50_ns=", histogram.getPercentile(50) / kj::NANOSECONDS,
+        " p90_ns=", histogram.getPercentile(90) / kj::NANOSECONDS,
+        " p99_ns=", histogram.getPercentile(99) / kj::NANOSECONDS,
+        " max_ns=", histogram.getMax() / kj::NANOSECONDS, '\n'));
+  };
+
+  for (auto& entry: methods->map) {
+    auto& stats = entry.second;
+    dumpHistogram("outgoing", entry.first.first, entry.first.second,
+                  stats.outgoing, stats.outgoingErrors, stats.outgoingInFlight);
+    dumpHistogram("incoming", entry.first.first, entry.first.second,
+                  stats.incoming, stats.incomingErrors, stats.incomingInFlight);
+  }
+
+  if (embargoes.getCount() > 0 || embargoesInFlight > 0 || embargoesSkipped > 0) {
+    lines.add(kj::str(
+        "embargo count=", embargoes.getCount(), " in_flight=", embargoesInFlight,
+        " skipped=", embargoesSkipped,
+        " p50_ns=", embargoes.getPercentile(50) / kj::NANOSECONDS,
+        " p90_ns=", embargoes.getPercentile(90) / kj::NANOSECONDS,
+        " p99_ns=", embargoes.getPercentile(99) / kj::NANOSECONDS,
+        " max_ns=", embargoes.getMax() / kj::NANOSECONDS, '\n'));
+  }
+
+  return kj::strArray(lines, "");
+}
+
 }  // namespace capnp
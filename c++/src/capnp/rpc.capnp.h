@@ -761,6 +761,8 @@ public:
 
   inline bool getAllowThirdPartyTailCall() const;
 
+  inline bool getNoPromisePipelining() const;
+
 private:
   ::capnp::_::StructReader _reader;
   template <typename, ::capnp::Kind>
@@ -818,6 +820,9 @@ public:
   inline bool getAllowThirdPartyTailCall();
   inline void setAllowThirdPartyTailCall(bool value);
 
+  inline bool getNoPromisePipelining();
+  inline void setNoPromisePipelining(bool value);
+
 private:
   ::capnp::_::StructBuilder _builder;
   template <typename, ::capnp::Kind>
@@ -986,6 +991,8 @@ public:
   inline bool hasAcceptFromThirdParty() const;
   inline ::capnp::AnyPointer::Reader getAcceptFromThirdParty() const;
 
+  inline bool getNoFinishNeeded() const;
+
 private:
   ::capnp::_::StructReader _reader;
   template <typename, ::capnp::Kind>
@@ -1054,6 +1061,9 @@ public:
   inline ::capnp::AnyPointer::Builder getAcceptFromThirdParty();
   inline ::capnp::AnyPointer::Builder initAcceptFromThirdParty();
 
+  inline bool getNoFinishNeeded();
+  inline void setNoFinishNeeded(bool value);
+
 private:
   ::capnp::_::StructBuilder _builder;
   template <typename, ::capnp::Kind>
@@ -3386,6 +3396,20 @@ inline void Call::Builder::setAllowThirdPartyTailCall(bool value) {
       ::capnp::bounded<128>() * ::capnp::ELEMENTS, value);
 }
 
+inline bool Call::Reader::getNoPromisePipelining() const {
+  return _reader.getDataField<bool>(
+      ::capnp::bounded<129>() * ::capnp::ELEMENTS);
+}
+
+inline bool Call::Builder::getNoPromisePipelining() {
+  return _builder.getDataField<bool>(
+      ::capnp::bounded<129>() * ::capnp::ELEMENTS);
+}
+inline void Call::Builder::setNoPromisePipelining(bool value) {
+  _builder.setDataField<bool>(
+      ::capnp::bounded<129>() * ::capnp::ELEMENTS, value);
+}
+
 inline  ::capnp::rpc::Call::SendResultsTo::Which Call::SendResultsTo::Reader::which() const {
   return _reader.getDataField<Which>(
       ::capnp::bounded<3>() * ::capnp::ELEMENTS);
@@ -3744,6 +3768,20 @@ inline ::capnp::AnyPointer::Builder Return::Builder::initAcceptFromThirdParty()
   return result;
 }
 
+inline bool Return::Reader::getNoFinishNeeded() const {
+  return _reader.getDataField<bool>(
+      ::capnp::bounded<33>() * ::capnp::ELEMENTS);
+}
+
+inline bool Return::Builder::getNoFinishNeeded() {
+  return _builder.getDataField<bool>(
+      ::capnp::bounded<33>() * ::capnp::ELEMENTS);
+}
+inline void Return::Builder::setNoFinishNeeded(bool value) {
+  _builder.setDataField<bool>(
+      ::capnp::bounded<33>() * ::capnp::ELEMENTS, value);
+}
+
 inline  ::uint32_t Finish::Reader::getQuestionId() const {
   return _reader.getDataField< ::uint32_t>(
       ::capnp::bounded<0>() * ::capnp::ELEMENTS);
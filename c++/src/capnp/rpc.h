@@ -27,6 +27,9 @@
 
 #include "capability.h"
 #include "rpc-prelude.h"
+#include "message.h"
+#include <kj/function.h>
+#include <kj/time.h>
 
 namespace capnp {
 
@@ -141,6 +144,28 @@ public:
   // order to prevent a grain from inundating the system with in-flight calls. In practice, the
   // main time this happens is when a grain is pushing a large file download and doesn't implement
   // proper cooperative flow control.
+
+  void setObserver(kj::Maybe<RpcObserver&> observer);
+  // Installs an observer which will be notified of calls and messages on all of this RpcSystem's
+  // connections, or removes the current one if null. The observer must outlive the RpcSystem or
+  // be removed first. With no observer installed (the default), instrumentation costs only a
+  // null check at each point where a callback would be made.
+
+  RpcTableSizes getTableSizes();
+  // Counts the entries currently in the four tables (see rpc.capnp), and the memory they use,
+  // summed over all connections. This walks the tables, so it's meant for occasional scraping,
+  // not for every call.
+
+  void setSizeHintLearning(bool enable);
+  // Generated code passes no size hint to newCall() or initResults() unless the application
+  // gives one, which would leave every Call and Return message starting at the VatNetwork's
+  // default segment size. Instead, the RpcSystem learns, per method, how large these messages
+  // usually turn out to be (see SegmentSizePolicy) and uses that as the first segment size when no
+  // hint is given. This is on by default; disabling it goes back to the default segment size
+  // but keeps what was learned so far.
+
+  kj::Array<RpcMethodSizeHints> getSizeHints();
+  // Returns what has been learned for every method seen so far.
 };
 
 template <typename VatId, typename ProvisionId, typename RecipientId,
@@ -294,6 +319,183 @@ private:
   Capability::Client baseRestore(AnyPointer::Reader ref) override final;
 };
 
+// =======================================================================================
+// Instrumentation
+
+struct RpcTableSizes {
+  // Returned by RpcSystem::getTableSizes().
+
+  size_t questions = 0;
+  size_t answers = 0;
+  size_t exports = 0;
+  size_t imports = 0;
+
+  size_t bytes = 0;
+  // Memory used by the tables themselves, including free slots. Doesn't count what the entries
+  // refer to, such as capabilities, call contexts, and messages.
+};
+
+struct RpcMethodSizeHints {
+  // One element of RpcSystem::getSizeHints().
+
+  uint64_t interfaceId;
+  uint16_t methodId;
+
+  SegmentSizePolicy::Stats calls;
+  // Sizes of the Call messages we have sent for this method. `calls.firstSegmentWords` is the size
+  // the next call will start with when the caller gives no hint, or zero for the default.
+
+  SegmentSizePolicy::Stats returns;
+  // Likewise, for the Return messages we have sent answering calls to this method.
+};
+
+class RpcObserver {
+  // Receives callbacks describing the activity of an RpcSystem. Install one with
+  // RpcSystem::setObserver().
+  //
+  // Callbacks are made synchronously, on the RpcSystem's thread, in the middle of processing
+  // messages, so they must be cheap and must not call back into the RpcSystem. The default
+  // implementations do nothing, so subclasses need only override what they care about.
+  //
+  // "Outgoing" calls are those this vat made to its peers; "incoming" calls are those the peers
+  // made to this vat. Call latencies are measured with now(), from when the Call message is sent
+  // (outgoing) or received (incoming) to when the Return is received (outgoing) or sent
+  // (incoming). Calls which never return -- e.g. because the connection was lost -- are not
+  // reported as returned.
+
+public:
+  virtual void messageSent(size_t sizeInWords);
+  virtual void messageReceived(size_t sizeInWords);
+
+  virtual void outgoingCallStarted(uint64_t interfaceId, uint16_t methodId);
+  virtual void outgoingCallReturned(uint64_t interfaceId, uint16_t methodId,
+                                    kj::Duration latency, bool isError);
+
+  virtual void incomingCallStarted(uint64_t interfaceId, uint16_t methodId);
+  virtual void incomingCallReturned(uint64_t interfaceId, uint16_t methodId,
+                                    kj::Duration latency, bool isError);
+  // `isError` is true if the call failed or was canceled.
+
+  virtual void embargoStarted();
+  virtual void embargoLifted(kj::Duration latency);
+  // An embargo is set when a promise which calls were sent through resolves to a capability
+  // hosted in this vat: new calls wait until a Disembargo has echoed through the peer, so that
+  // they can't overtake the earlier ones. `latency` is that round trip.
+
+  virtual void embargoSkipped();
+  // A promise resolved to a capability hosted in this vat without needing an embargo, because no
+  // calls had been sent through it.
+
+  virtual kj::TimePoint now();
+  // The clock used to measure call latencies. The default reads the system's monotonic clock.
+  // Overriding this lets tests use a fake clock, or lets apps reuse a clock they already have.
+};
+
+class RpcLatencyHistogram {
+  // A histogram of durations in the style of an HDR histogram: bucket boundaries grow
+  // exponentially, with each power of two split into 16 linear sub-buckets, so any value from a
+  // nanosecond to centuries is recorded in constant time and space with at most 1/16 (6.25%)
+  // relative error.
+
+public:
+  RpcLatencyHistogram();
+
+  void record(kj::Duration value);
+
+  uint64_t getCount() const { return count; }
+  kj::Duration getMin() const;
+  kj::Duration getMax() const;
+  kj::Duration getMean() const;
+  // All zero when empty.
+
+  kj::Duration getPercentile(double percentile) const;
+  // Returns the upper bound of the bucket containing the value at `percentile` (in [0, 100]),
+  // i.e. an overestimate by at most the bucket resolution. Returns zero when empty.
+
+private:
+  static constexpr uint SUB_BUCKET_BITS = 4;
+  static constexpr uint SUB_BUCKETS = 1u << SUB_BUCKET_BITS;
+  static constexpr uint BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  uint64_t counts[BUCKET_COUNT];
+  uint64_t count = 0;
+  uint64_t sumNs = 0;
+  uint64_t minNs = kj::maxValue;
+  uint64_t maxNs = 0;
+
+  static uint bucketFor(uint64_t ns);
+  static uint64_t bucketUpperBound(uint bucket);
+};
+
+class RpcHistogramObserver final: public RpcObserver {
+  // An RpcObserver which keeps byte and message counters and a latency histogram per method, in
+  // each direction. Scrape it with the getters or dump().
+
+public:
+  RpcHistogramObserver();
+  ~RpcHistogramObserver() noexcept(false);
+  KJ_DISALLOW_COPY(RpcHistogramObserver);
+
+  struct MethodStats {
+    RpcLatencyHistogram outgoing;
+    RpcLatencyHistogram incoming;
+    uint64_t outgoingErrors = 0;
+    uint64_t incomingErrors = 0;
+    uint64_t outgoingInFlight = 0;
+    uint64_t incomingInFlight = 0;
+  };
+
+  kj::Maybe<const MethodStats&> getMethodStats(uint64_t interfaceId, uint16_t methodId) const;
+  // Null if no calls to the method have been observed.
+
+  uint64_t getMessagesSent() const { return messagesSent; }
+  uint64_t getMessagesReceived() const { return messagesReceived; }
+  uint64_t getBytesSent() const { return wordsSent * sizeof(word); }
+  uint64_t getBytesReceived() const { return wordsReceived * sizeof(word); }
+
+  const RpcLatencyHistogram& getEmbargoLatency() const { return embargoes; }
+  uint64_t getEmbargoesInFlight() const { return embargoesInFlight; }
+  uint64_t getEmbargoesSkipped() const { return embargoesSkipped; }
+
+  kj::String dump() const;
+  // Returns a plain-text report, one line per counter or per method and direction, e.g.:
+  //
+  //     messages_sent 12
+  //     call outgoing 0x9a2c22c32f3e8b41 0 count=10 errors=0 in_flight=1 p50_ns=31744 ...
+  //     embargo count=2 in_flight=0 skipped=5 p50_ns=63488 ...
+  //
+  // Percentiles are rounded up to the histogram's resolution.
+
+  // implements RpcObserver ------------------------------------------
+
+  void messageSent(size_t sizeInWords) override;
+  void messageReceived(size_t sizeInWords) override;
+  void outgoingCallStarted(uint64_t interfaceId, uint16_t methodId) override;
+  void outgoingCallReturned(uint64_t interfaceId, uint16_t methodId,
+                            kj::Duration latency, bool isError) override;
+  void incomingCallStarted(uint64_t interfaceId, uint16_t methodId) override;
+  void incomingCallReturned(uint64_t interfaceId, uint16_t methodId,
+                            kj::Duration latency, bool isError) override;
+  void embargoStarted() override;
+  void embargoLifted(kj::Duration latency) override;
+  void embargoSkipped() override;
+
+private:
+  uint64_t messagesSent = 0;
+  uint64_t messagesReceived = 0;
+  uint64_t wordsSent = 0;
+  uint64_t wordsReceived = 0;
+
+  RpcLatencyHistogram embargoes;
+  uint64_t embargoesInFlight = 0;
+  uint64_t embargoesSkipped = 0;
+
+  struct Methods;
+  kj::Own<Methods> methods;
+
+  MethodStats& getStats(uint64_t interfaceId, uint16_t methodId);
+};
+
 // =======================================================================================
 // VatNetwork
 
@@ -308,6 +510,11 @@ public:
   virtual void send() = 0;
   // Send the message, or at least put it in a queue to be sent later.  Note that the builder
   // returned by `getBody()` remains valid at least until the `OutgoingRpcMessage` is destroyed.
+
+  virtual size_t sizeInWords() = 0;
+  // Get the total size of the message, for flow control purposes. Although the caller could
+  // also call getBody().targetSize(), doing that would walk the message tree, whereas typical
+  // implementations can compute the size more cheaply by summing segment sizes.
 };
 
 class IncomingRpcMessage {
@@ -317,6 +524,63 @@ public:
   virtual AnyPointer::Reader getBody() = 0;
   // Get the message body, to be interpreted by the caller.  (The standard RPC implementation
   // interprets it as a Message as defined in rpc.capnp.)
+
+  virtual size_t sizeInWords() = 0;
+  // Get the total size of the message, for instrumentation. Like
+  // OutgoingRpcMessage::sizeInWords(), this should be cheap, e.g. a sum of segment sizes.
+};
+
+class RpcFlowController {
+  // Tracks a particular RPC stream in order to implement a flow control algorithm.
+  //
+  // The RPC system keeps one of these per capability, created by the connection's `newStream()`,
+  // and sends every call made with `Request::sendStreaming()` through it. This bounds how much
+  // data a client can have in flight to one capability, so that a bulk upload is paced to the
+  // speed of the network and the server instead of piling up in memory.
+
+public:
+  virtual kj::Promise<void> send(kj::Own<OutgoingRpcMessage> message, kj::Promise<void> ack) = 0;
+  // Like calling message->send(), but the returned promise resolves when it's a good time to give
+  // the flow controller another message. `ack` resolves when the peer has finished with the
+  // message (the call has returned). If `ack` rejects, the exception is reported by subsequent
+  // calls to send() and by waitAllAcked().
+
+  virtual kj::Promise<void> waitAllAcked() = 0;
+  // Wait for all `ack`s previously passed to send() to finish. Rejects if any of them rejected.
+
+  static constexpr size_t DEFAULT_WINDOW_SIZE = 65536;
+  // Window size used by the default implementation of Connection::newStream(), and the minimum
+  // window of the adaptive controller.
+
+  static constexpr size_t MAX_ADAPTIVE_WINDOW_SIZE = 8u << 20;
+  // Largest window the adaptive controller will open, bounding the memory a single stream may
+  // tie up regardless of what it measures.
+
+  static kj::Own<RpcFlowController> newFixedWindowController(size_t windowSize);
+  // Constructs a flow controller that allows at most `windowSize` bytes in flight at once
+  // (plus one message, so that messages larger than the window don't stall).
+
+  class WindowGetter {
+  public:
+    virtual size_t getWindow() = 0;
+  };
+
+  static kj::Own<RpcFlowController> newVariableWindowController(WindowGetter& getter);
+  // Like newFixedWindowController(), but the window size is queried from `getter` each time it
+  // is needed.
+
+  static kj::Own<RpcFlowController> newAdaptiveWindowController(
+      size_t minWindow = DEFAULT_WINDOW_SIZE, size_t maxWindow = MAX_ADAPTIVE_WINDOW_SIZE);
+  static kj::Own<RpcFlowController> newAdaptiveWindowController(
+      kj::Function<kj::TimePoint()> clock,
+      size_t minWindow = DEFAULT_WINDOW_SIZE, size_t maxWindow = MAX_ADAPTIVE_WINDOW_SIZE);
+  // Constructs a flow controller whose window tracks the stream's bandwidth-delay product, as
+  // estimated by timing acknowledgements: the round trip time is the least time observed between
+  // sending a message and receiving its ack, and the bandwidth is the highest recent rate at
+  // which acks have been arriving. The window is kept at twice the product -- enough to keep the
+  // pipe full while leaving room to discover more bandwidth -- clamped to [minWindow, maxWindow].
+  //
+  // `clock` returns the current time from any monotonic clock; by default, the system's.
 };
 
 template <typename VatId, typename ProvisionId, typename RecipientId,
@@ -385,6 +649,15 @@ public:
     // Waits until all outgoing messages have been sent, then shuts down the outgoing stream. The
     // returned promise resolves after shutdown is complete.
 
+    virtual kj::Own<RpcFlowController> newStream() override {
+      return RpcFlowController::newFixedWindowController(RpcFlowController::DEFAULT_WINDOW_SIZE);
+    }
+    // Construct a flow controller for a new stream on this connection. The RPC system calls this
+    // the first time `Request::sendStreaming()` is used on a capability.
+    //
+    // The default implementation returns a controller with a fixed 64k window. Connections over
+    // a real network should override this, typically with newAdaptiveWindowController().
+
   private:
     AnyStruct::Reader baseGetPeerVatId() override;
   };
@@ -504,6 +777,26 @@ inline void RpcSystem<VatId>::setFlowLimit(size_t words) {
   baseSetFlowLimit(words);
 }
 
+template <typename VatId>
+inline void RpcSystem<VatId>::setObserver(kj::Maybe<RpcObserver&> observer) {
+  baseSetObserver(observer);
+}
+
+template <typename VatId>
+inline RpcTableSizes RpcSystem<VatId>::getTableSizes() {
+  return baseGetTableSizes();
+}
+
+template <typename VatId>
+inline void RpcSystem<VatId>::setSizeHintLearning(bool enable) {
+  baseSetSizeHintLearning(enable);
+}
+
+template <typename VatId>
+inline kj::Array<RpcMethodSizeHints> RpcSystem<VatId>::getSizeHints() {
+  return baseGetSizeHints();
+}
+
 template <typename VatId, typename ProvisionId, typename RecipientId,
           typename ThirdPartyCapId, typename JoinResult>
 RpcSystem<VatId> makeRpcServer(
@@ -25,6 +25,8 @@
 #include <kj/compat/gtest.h>
 #include "test-util.h"
 #include <kj/debug.h>
+#include <kj/thread.h>
+#include "serialize.h"
 
 namespace capnp {
 namespace _ {  // private
@@ -271,6 +273,38 @@ TEST(SchemaLoader, EnumerateNoPlaceholders) {
   }
 }
 
+TEST(SchemaLoader, CompiledInDependencies) {
+  SchemaLoader loader;
+  loader.loadCompiledTypeAndDependencies<TestAllTypes>();
+  loader.loadCompiledTypeAndDependencies<test::TestGroups>();
+
+  // References between compiled-in types resolve to the loaded schemas, not placeholders.
+  StructSchema schema = loader.get(typeId<TestAllTypes>()).asStruct();
+  EXPECT_TRUE(schema.getFieldByName("structField").getType().asStruct() == schema);
+  EnumSchema enumSchema = schema.getFieldByName("enumField").getType().asEnum();
+  EXPECT_TRUE(enumSchema == loader.get(typeId<TestEnum>()));
+  EXPECT_EQ(Schema::from<TestEnum>().getProto().getDisplayName(),
+            enumSchema.getProto().getDisplayName());
+
+  StructSchema groups = loader.get(typeId<test::TestGroups>()).asStruct();
+  StructSchema group = groups.getFieldByName("groups").getType().asStruct();
+  EXPECT_EQ(Schema::from<test::TestGroups>().getFieldByName("groups").getType().asStruct()
+                .getProto().getDisplayName(),
+            group.getProto().getDisplayName());
+
+  // Nodes loaded at runtime are still checked against them.
+  MallocMessageBuilder builder;
+  builder.setRoot(Schema::from<TestAllTypes>().getProto());
+  auto root = builder.getRoot<schema::Node>();
+  root.setId(0x9e5b1d0c7a3f2e41ull);
+  for (auto field: root.getStruct().getFields()) {
+    if (field.getName().asReader() == "enumField") {
+      field.getSlot().getType().initStruct().setTypeId(typeId<TestEnum>());
+    }
+  }
+  EXPECT_NONFATAL_FAILURE(loader.load(root.asReader()));
+}
+
 class FakeLoaderCallback: public SchemaLoader::LazyLoadCallback {
 public:
   FakeLoaderCallback(const schema::Node::Reader node): node(node), loaded(false) {}
@@ -294,6 +328,20 @@ private:
   mutable bool loaded = false;
 };
 
+TEST(SchemaLoader, AccessPlan) {
+  SchemaLoader loader;
+  loader.loadCompiledTypeAndDependencies<TestAllTypes>();
+
+  auto schema = loader.get(typeId<TestAllTypes>()).asStruct();
+  auto& plan = loader.getAccessPlan(schema);
+  EXPECT_TRUE(plan.getSchema() == schema);
+  EXPECT_EQ(&plan, &loader.getAccessPlan(schema));
+
+  // Compiled-in schemas can be cached too.
+  auto& nativePlan = loader.getAccessPlan(Schema::from<TestAllTypes>());
+  EXPECT_EQ(&nativePlan, &loader.getAccessPlan(Schema::from<TestAllTypes>()));
+}
+
 TEST(SchemaLoader, LazyLoad) {
   FakeLoaderCallback callback(Schema::from<TestAllTypes>().getProto());
   SchemaLoader loader(callback);
@@ -330,6 +378,51 @@ TEST(SchemaLoader, LazyLoadGetDependency) {
   EXPECT_EQ(dep, loader.get(typeId<TestAllTypes>()));
 }
 
+kj::Array<word> makeSchemaBundle() {
+  SchemaLoader source;
+  source.loadCompiledTypeAndDependencies<TestDefaults>();
+  auto schemas = source.getAllLoaded();
+
+  MallocMessageBuilder message;
+  auto nodes = message.initRoot<schema::CodeGeneratorRequest>().initNodes(schemas.size());
+  for (auto i: kj::indices(schemas)) {
+    nodes.setWithCaveats(i, schemas[i].getProto());
+  }
+  return messageToFlatArray(message);
+}
+
+TEST(SchemaLoader, SchemaBundle) {
+  auto data = makeSchemaBundle();
+  SchemaBundle bundle(data);
+  EXPECT_TRUE(bundle.find(typeId<TestAllTypes>()) != nullptr);
+  EXPECT_TRUE(bundle.find(1234) == nullptr);
+
+  SchemaLoader loader(bundle);
+  EXPECT_EQ(0u, loader.getAllLoaded().size());
+  EXPECT_TRUE(loader.tryGet(1234) == nullptr);
+
+  // Only the requested node is loaded up front...
+  StructSchema schema = loader.get(typeId<TestDefaults>()).asStruct();
+  EXPECT_EQ(Schema::from<TestDefaults>().getProto().getDisplayName(),
+            schema.getProto().getDisplayName());
+  EXPECT_EQ(1u, loader.getAllLoaded().size());
+
+  // ...and dependencies follow when they're used.
+  auto structType = schema.getFieldByName("structField").getType().asStruct();
+  EXPECT_EQ(Schema::from<TestAllTypes>().getProto().getDisplayName(),
+            structType.getProto().getDisplayName());
+  EXPECT_EQ(Schema::from<TestAllTypes>().getFields().size(), structType.getFields().size());
+  EXPECT_EQ(structType, loader.get(typeId<TestAllTypes>()));
+}
+
+TEST(SchemaLoader, SchemaBundleOwned) {
+  auto words = makeSchemaBundle();
+  SchemaBundle bundle(kj::heapArray<const byte>(words.asBytes()));
+  SchemaLoader loader(bundle);
+  EXPECT_EQ(Schema::from<TestAllTypes>().getProto().getDisplayName(),
+            loader.get(typeId<TestAllTypes>()).getProto().getDisplayName());
+}
+
 TEST(SchemaLoader, Generics) {
   SchemaLoader loader;
 
@@ -389,6 +482,68 @@ TEST(SchemaLoader, Generics) {
   }
 }
 
+TEST(SchemaLoader, BrandedLookupsAreCached) {
+  SchemaLoader loader;
+
+  loader.load(Schema::from<TestAllTypes>().getProto());
+  loader.load(Schema::from<test::TestAnyPointer>().getProto());
+  loader.load(Schema::from<test::TestGenerics<>::Inner>().getProto());
+  loader.load(Schema::from<test::TestGenerics<>::Inner2<>>().getProto());
+  loader.load(Schema::from<test::TestGenerics<>::Interface<>>().getProto());
+  loader.load(Schema::from<test::TestGenerics<>::Interface<>::CallResults>().getProto());
+  loader.load(Schema::from<test::TestGenerics<>>().getProto());
+  StructSchema schema = loader.load(Schema::from<test::TestUseGenerics>().getProto()).asStruct();
+
+  auto basic = schema.getFieldByName("basic");
+  auto basicType = basic.getProto().getSlot().getType();
+  auto rev = basic.getType().asStruct().getFieldByName("rev");
+
+  Type first = loader.getType(basicType, schema);
+  EXPECT_TRUE(first == basic.getType());
+  EXPECT_TRUE(loader.getType(basicType, schema) == first);
+
+  // An equal brand in a different message finds the same schema.
+  MallocMessageBuilder builder;
+  builder.setRoot(basicType);
+  EXPECT_TRUE(loader.getType(builder.getRoot<schema::Type>().asReader(), schema) == first);
+
+  // A different brand doesn't.
+  Type other = loader.getType(rev.getProto().getSlot().getType(), basic.getType().asStruct());
+  EXPECT_TRUE(other == rev.getType());
+  EXPECT_TRUE(other != first);
+}
+
+TEST(SchemaLoader, ConcurrentLookups) {
+  SchemaLoader loader;
+  loader.loadCompiledTypeAndDependencies<test::TestUseGenerics>();
+  StructSchema schema = loader.get(typeId<test::TestUseGenerics>()).asStruct();
+  auto basic = schema.getFieldByName("basic");
+  auto basicType = basic.getProto().getSlot().getType();
+  Type expectedBasic = basic.getType();
+
+  // Readers look up loaded schemas and brands while the main thread keeps loading more.
+  {
+    auto threads = kj::heapArrayBuilder<kj::Own<kj::Thread>>(4);
+    for (uint i = 0; i < 4; i++) {
+      threads.add(kj::heap<kj::Thread>([&]() {
+        for (uint j = 0; j < 2000; j++) {
+          KJ_ASSERT(loader.get(typeId<test::TestUseGenerics>()) == schema);
+          KJ_ASSERT(loader.getType(basicType, schema) == expectedBasic);
+          KJ_ASSERT(&loader.getAccessPlan(schema) == &loader.getAccessPlan(schema));
+        }
+      }));
+    }
+
+    loader.loadCompiledTypeAndDependencies<TestAllTypes>();
+    loader.loadCompiledTypeAndDependencies<TestDefaults>();
+    loader.loadCompiledTypeAndDependencies<test::TestLists>();
+  }
+
+  EXPECT_EQ(typeId<TestAllTypes>(), loader.get(typeId<TestAllTypes>()).getProto().getId());
+  EXPECT_EQ(typeId<test::TestLists>(),
+            loader.get(typeId<test::TestLists>()).getProto().getId());
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
@@ -21,20 +21,20 @@
 
 #define CAPNP_PRIVATE
 #include "schema-loader.h"
+#include "dynamic.h"
 #include <unordered_map>
+#include <kj/map.h>
 #include <unordered_set>
 #include <map>
 #include "message.h"
+#include "serialize.h"
 #include "arena.h"
 #include <kj/debug.h>
 #include <kj/exception.h>
 #include <kj/arena.h>
 #include <kj/vector.h>
 #include <algorithm>
-
-#if _MSC_VER
 #include <atomic>
-#endif
 
 namespace capnp {
 
@@ -68,15 +68,195 @@ struct SchemaBindingsPair {
   inline bool operator==(const SchemaBindingsPair& other) const {
     return schema == other.schema && scopeBindings == other.scopeBindings;
   }
+  inline uint hashCode() const {
+    return kj::hashCode(schema, scopeBindings);
+  }
 };
 
-struct SchemaBindingsPairHash {
-  size_t operator()(SchemaBindingsPair pair) const {
-    return 31 * reinterpret_cast<uintptr_t>(pair.schema) +
-                reinterpret_cast<uintptr_t>(pair.scopeBindings);
+template <typename T>
+class ReadMostlyIndex {
+  // A hash index of pointers which can be searched without locking while another thread inserts.
+  // Inserts must be serialized by the caller (we use the loader's exclusive lock). Entries are
+  // never removed or replaced and must not change once inserted, so a reader finds either a
+  // complete entry or nothing -- in which case it falls back to the locked path.
+  //
+  // Tables that have been outgrown are kept until the index is destroyed, since a reader may
+  // still be probing one.
+
+public:
+  template <typename Predicate>
+  T* find(uint64_t hash, Predicate&& predicate) const {
+    const Table* table = current.load(std::memory_order_acquire);
+    if (table == nullptr) return nullptr;
+
+    for (size_t i = bucket(hash, *table);; i = (i + 1) & table->mask) {
+      auto& slot = table->slots[i];
+      T* value = slot.value.load(std::memory_order_acquire);
+      if (value == nullptr) return nullptr;
+      if (slot.hash == hash && predicate(*value)) return value;
+    }
+  }
+
+  void insert(uint64_t hash, T* value) {
+    Table* table = current.load(std::memory_order_relaxed);
+    if (table == nullptr || (count + 1) * 2 > table->slots.size()) {
+      // Grow into a new table, then publish it.
+      auto newTable = kj::heap<Table>(table == nullptr ? 64 : table->slots.size() * 2);
+      if (table != nullptr) {
+        for (auto& slot: table->slots) {
+          T* old = slot.value.load(std::memory_order_relaxed);
+          if (old != nullptr) newTable->add(slot.hash, old);
+        }
+      }
+      table = newTable.get();
+      tables.add(kj::mv(newTable));
+      current.store(table, std::memory_order_release);
+    }
+
+    table->add(hash, value);
+    ++count;
+  }
+
+private:
+  struct Slot {
+    std::atomic<T*> value;
+    uint64_t hash;  // Written before `value` is published.
+  };
+
+  struct Table {
+    kj::Array<Slot> slots;
+    size_t mask;
+
+    explicit Table(size_t size): slots(kj::heapArray<Slot>(size)), mask(size - 1) {
+      for (auto& slot: slots) {
+        slot.value.store(nullptr, std::memory_order_relaxed);
+        slot.hash = 0;
+      }
+    }
+
+    void add(uint64_t hash, T* value) {
+      for (size_t i = bucket(hash, *this);; i = (i + 1) & mask) {
+        auto& slot = slots[i];
+        if (slot.value.load(std::memory_order_relaxed) == nullptr) {
+          slot.hash = hash;
+          slot.value.store(value, std::memory_order_release);
+          return;
+        }
+      }
+    }
+  };
+
+  std::atomic<Table*> current { nullptr };
+  kj::Vector<kj::Own<Table>> tables;
+  size_t count = 0;
+
+  static size_t bucket(uint64_t hash, const Table& table) {
+    hash *= 0x9e3779b97f4a7c15ull;
+    return (hash ^ (hash >> 32)) & table.mask;
   }
 };
 
+uint64_t hashPointers(const void* a, const void* b = nullptr) {
+  return reinterpret_cast<uintptr_t>(a) * 0x100000001b3ull ^ reinterpret_cast<uintptr_t>(b);
+}
+
+template <typename Func>
+void forEachTypeToken(schema::Type::Reader type, Func& func);
+
+template <typename Func>
+void forEachBrandToken(schema::Brand::Reader brand, Func& func) {
+  // Feeds `func` a sequence of integers which identifies everything in `brand` that
+  // SchemaLoader::Impl::makeBranded() looks at. Two brands give the same sequence only if they
+  // produce the same branded schema.
+
+  auto scopes = brand.getScopes();
+  func(scopes.size());
+  for (auto scope: scopes) {
+    func(scope.getScopeId());
+    func(scope.which());
+    if (scope.isBind()) {
+      auto bindings = scope.getBind();
+      func(bindings.size());
+      for (auto binding: bindings) {
+        func(binding.which());
+        if (binding.isType()) forEachTypeToken(binding.getType(), func);
+      }
+    }
+  }
+}
+
+template <typename Func>
+void forEachTypeToken(schema::Type::Reader type, Func& func) {
+  func(type.which());
+  switch (type.which()) {
+    case schema::Type::STRUCT:
+      func(type.getStruct().getTypeId());
+      forEachBrandToken(type.getStruct().getBrand(), func);
+      break;
+    case schema::Type::ENUM:
+      func(type.getEnum().getTypeId());
+      forEachBrandToken(type.getEnum().getBrand(), func);
+      break;
+    case schema::Type::INTERFACE:
+      func(type.getInterface().getTypeId());
+      forEachBrandToken(type.getInterface().getBrand(), func);
+      break;
+    case schema::Type::LIST:
+      forEachTypeToken(type.getList().getElementType(), func);
+      break;
+    case schema::Type::ANY_POINTER: {
+      auto anyPointer = type.getAnyPointer();
+      func(anyPointer.which());
+      switch (anyPointer.which()) {
+        case schema::Type::AnyPointer::UNCONSTRAINED:
+          break;
+        case schema::Type::AnyPointer::PARAMETER:
+          func(anyPointer.getParameter().getScopeId());
+          func(anyPointer.getParameter().getParameterIndex());
+          break;
+        case schema::Type::AnyPointer::IMPLICIT_METHOD_PARAMETER:
+          func(anyPointer.getImplicitMethodParameter().getParameterIndex());
+          break;
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+struct BrandTokenHasher {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  void operator()(uint64_t token) { hash = (hash ^ token) * 0x100000001b3ull; }
+};
+
+struct BrandTokenMatcher {
+  kj::ArrayPtr<const uint64_t> expected;
+  size_t pos = 0;
+  bool ok = true;
+
+  void operator()(uint64_t token) {
+    if (ok && pos < expected.size() && expected[pos] == token) {
+      ++pos;
+    } else {
+      ok = false;
+    }
+  }
+};
+
+inline bool isInitialized(const _::RawSchema* schema) {
+#if __GNUC__
+  return __atomic_load_n(&schema->lazyInitializer, __ATOMIC_ACQUIRE) == nullptr;
+#elif _MSC_VER
+  bool result = *static_cast<_::RawSchema::Initializer const* const volatile*>(
+      &schema->lazyInitializer) == nullptr;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return result;
+#else
+#error "Platform not supported"
+#endif
+}
+
 }  // namespace
 
 bool hasDiscriminantValue(const schema::Field::Reader& reader) {
@@ -125,6 +305,12 @@ public:
                           bool isPlaceholder);
   // Create a dummy empty schema of the given kind for the given id and load it.
 
+  const _::RawSchema* findCompiledIn(uint64_t id, schema::Node::Which kind) const;
+  // Returns the schema for `id` if it was loaded from compiled-in code and has the given kind, or
+  // null otherwise.  Compiled-in schemas are trusted, so a reference to one needs no placeholder
+  // and no compatibility check; makeBrandedDependencies() uses this instead of loadEmpty() where
+  // it can.
+
   const _::RawBrandedSchema* makeBranded(
       const _::RawSchema* schema, schema::Brand::Reader proto,
       kj::Maybe<kj::ArrayPtr<const _::RawBrandedSchema::Scope>> clientBrand);
@@ -147,6 +333,27 @@ public:
   // so that allocating a struct that contains a group then getting the group node and setting
   // its fields can't possibly write outside of the allocated space.
 
+  // The find*() methods below may be called without holding the lock; they only find things
+  // which have been fully constructed, and return null otherwise. The add*() methods require the
+  // exclusive lock.
+
+  _::RawSchema* findLoaded(uint64_t typeId) const;
+  // Finds a schema which is loaded and initialized (not a placeholder).
+
+  const _::RawBrandedSchema* findBranded(
+      const _::RawSchema* schema, schema::Brand::Reader proto,
+      kj::ArrayPtr<const _::RawBrandedSchema::Scope> clientBrand) const;
+  void addBranded(const _::RawSchema* schema, schema::Brand::Reader proto,
+                  kj::ArrayPtr<const _::RawBrandedSchema::Scope> clientBrand,
+                  const _::RawBrandedSchema* result);
+  // Cache of makeBranded() results.
+
+  const StructAccessPlan* findAccessPlan(
+      const _::RawBrandedSchema* schema, const word* encodedNode) const;
+  const StructAccessPlan& addAccessPlan(
+      const _::RawBrandedSchema* schema, const word* encodedNode,
+      kj::Own<StructAccessPlan> plan);
+
   kj::Arena arena;
 
 private:
@@ -154,8 +361,8 @@ private:
   // Records raw segments of memory in the arena against which we my want to de-dupe later
   // additions. Specifically, RawBrandedSchema binding tables are de-duped.
 
-  std::unordered_map<uint64_t, _::RawSchema*> schemas;
-  std::unordered_map<SchemaBindingsPair, _::RawBrandedSchema*, SchemaBindingsPairHash> brands;
+  kj::HashMap<uint64_t, _::RawSchema*> schemas;
+  kj::HashMap<SchemaBindingsPair, _::RawBrandedSchema*> brands;
   std::unordered_map<const _::RawSchema*, _::RawBrandedSchema*> unboundBrands;
 
   struct RequiredSize {
@@ -167,6 +374,33 @@ private:
   InitializerImpl initializer;
   BrandedInitializerImpl brandedInitializer;
 
+  ReadMostlyIndex<_::RawSchema> schemaIndex;
+  // The entries of `schemas` which are fully constructed, keyed by ID. Schemas are added once
+  // load() or loadNative() has finished filling them in.
+
+  struct BrandCacheEntry {
+    const _::RawSchema* schema;
+    const _::RawBrandedSchema::Scope* clientScopes;
+    size_t clientScopeCount;
+    kj::ArrayPtr<const uint64_t> tokens;  // from forEachBrandToken()
+    const _::RawBrandedSchema* result;
+  };
+  ReadMostlyIndex<const BrandCacheEntry> brandCache;
+
+  struct AccessPlanEntry {
+    const _::RawBrandedSchema* schema;
+
+    const word* encodedNode;
+    // The node the plan was built from. If load() replaces it, a new plan is built; the old one
+    // stays, since it may still be in use.
+
+    kj::Own<StructAccessPlan> plan;
+  };
+  ReadMostlyIndex<const AccessPlanEntry> accessPlans;
+
+  static uint64_t brandHash(const _::RawSchema* schema, schema::Brand::Reader proto,
+                            kj::ArrayPtr<const _::RawBrandedSchema::Scope> clientBrand);
+
   kj::ArrayPtr<word> makeUncheckedNode(schema::Node::Reader node);
   // Construct a copy of the given schema node, allocated as a single-segment ("unchecked") node
   // within the loader's arena.
@@ -1263,12 +1497,20 @@ _::RawSchema* SchemaLoader::Impl::load(const schema::Node::Reader& reader, bool
   }
 
   // Check if we already have a schema for this ID.
-  _::RawSchema*& slot = schemas[validatedReader.getId()];
+  //
+  // Note that we copy out the pointer rather than holding a reference into the map, because
+  // loading dependencies below can insert into the map and move its entries.
+  _::RawSchema* slot = nullptr;
+  KJ_IF_MAYBE(existing, schemas.find(validatedReader.getId())) {
+    slot = *existing;
+  }
+  bool isNew = slot == nullptr;
   bool shouldReplace;
   bool shouldClearInitializer;
   if (slot == nullptr) {
     // Nope, allocate a new RawSchema.
     slot = &arena.allocate<_::RawSchema>();
+    schemas.insert(validatedReader.getId(), slot);
     memset(&slot->defaultBrand, 0, sizeof(slot->defaultBrand));
     slot->id = validatedReader.getId();
     slot->canCastTo = nullptr;
@@ -1325,15 +1567,22 @@ _::RawSchema* SchemaLoader::Impl::load(const schema::Node::Reader& reader, bool
 #endif
   }
 
+  if (isNew) schemaIndex.insert(slot->id, slot);
+
   return slot;
 }
 
 _::RawSchema* SchemaLoader::Impl::loadNative(const _::RawSchema* nativeSchema) {
-  _::RawSchema*& slot = schemas[nativeSchema->id];
+  _::RawSchema* slot = nullptr;
+  KJ_IF_MAYBE(existing, schemas.find(nativeSchema->id)) {
+    slot = *existing;
+  }
+  bool isNew = slot == nullptr;
   bool shouldReplace;
   bool shouldClearInitializer;
   if (slot == nullptr) {
     slot = &arena.allocate<_::RawSchema>();
+    schemas.insert(nativeSchema->id, slot);
     memset(&slot->defaultBrand, 0, sizeof(slot->defaultBrand));
     slot->defaultBrand.generic = slot;
     slot->lazyInitializer = nullptr;
@@ -1359,8 +1608,6 @@ _::RawSchema* SchemaLoader::Impl::loadNative(const _::RawSchema* nativeSchema) {
 
   // Since we recurse below, the slot in the hash map could move around.  Copy out the pointer
   // for subsequent use.
-  // TODO(cleanup): Above comment is actually not true of unordered_map. Leaving here to explain
-  //   code pattern below.
   _::RawSchema* result = slot;
 
   if (shouldReplace) {
@@ -1425,6 +1672,8 @@ _::RawSchema* SchemaLoader::Impl::loadNative(const _::RawSchema* nativeSchema) {
 #endif
   }
 
+  if (isNew) schemaIndex.insert(result->id, result);
+
   return result;
 }
 
@@ -1451,6 +1700,18 @@ _::RawSchema* SchemaLoader::Impl::loadEmpty(
   return load(node, isPlaceholder);
 }
 
+const _::RawSchema* SchemaLoader::Impl::findCompiledIn(
+    uint64_t id, schema::Node::Which kind) const {
+  KJ_IF_MAYBE(slot, schemas.find(id)) {
+    const _::RawSchema* schema = *slot;
+    if (schema->canCastTo != nullptr &&
+        readMessageUnchecked<schema::Node>(schema->encodedNode).which() == kind) {
+      return schema;
+    }
+  }
+  return nullptr;
+}
+
 const _::RawBrandedSchema* SchemaLoader::Impl::makeBranded(
     const _::RawSchema* schema, schema::Brand::Reader proto,
     kj::Maybe<kj::ArrayPtr<const _::RawBrandedSchema::Scope>> clientBrand) {
@@ -1539,7 +1800,9 @@ const _::RawBrandedSchema* SchemaLoader::Impl::makeBranded(
     return &schema->defaultBrand;
   }
 
-  auto& slot = brands[SchemaBindingsPair { schema, bindings.begin() }];
+  auto& slot = brands.findOrCreate(SchemaBindingsPair { schema, bindings.begin() }, [&]() {
+    return decltype(brands)::Entry { SchemaBindingsPair { schema, bindings.begin() }, nullptr };
+  });
 
   if (slot == nullptr) {
     auto& brand = arena.allocate<_::RawBrandedSchema>();
@@ -1596,9 +1859,12 @@ SchemaLoader::Impl::makeBrandedDependencies(
                 field.getSlot().getType(), scopeName, bindings))
             break;
           case schema::Field::GROUP: {
-            const _::RawSchema* group = loadEmpty(
-                field.getGroup().getTypeId(),
-                "(unknown group type)", schema::Node::STRUCT, true);
+            const _::RawSchema* group = findCompiledIn(
+                field.getGroup().getTypeId(), schema::Node::STRUCT);
+            if (group == nullptr) {
+              group = loadEmpty(field.getGroup().getTypeId(),
+                  "(unknown group type)", schema::Node::STRUCT, true);
+            }
             KJ_IF_MAYBE(b, bindings) {
               ADD_ENTRY(FIELD, i, makeBranded(group, *b));
             } else {
@@ -1749,9 +2015,12 @@ void SchemaLoader::Impl::makeDep(_::RawBrandedSchema::Binding& result,
     uint64_t typeId, schema::Type::Which whichType, schema::Node::Which expectedKind,
     schema::Brand::Reader brand, kj::StringPtr scopeName,
     kj::Maybe<kj::ArrayPtr<const _::RawBrandedSchema::Scope>> brandBindings) {
-  const _::RawSchema* schema = loadEmpty(typeId,
-      kj::str("(unknown type; seen as dependency of ", scopeName, ")"),
-      expectedKind, true);
+  const _::RawSchema* schema = findCompiledIn(typeId, expectedKind);
+  if (schema == nullptr) {
+    schema = loadEmpty(typeId,
+        kj::str("(unknown type; seen as dependency of ", scopeName, ")"),
+        expectedKind, true);
+  }
   result.which = static_cast<uint8_t>(whichType);
   result.schema = makeBranded(schema, brand, brandBindings);
 }
@@ -1803,14 +2072,86 @@ kj::ArrayPtr<const T> SchemaLoader::Impl::copyDeduped(kj::ArrayPtr<T> values) {
 }
 
 SchemaLoader::Impl::TryGetResult SchemaLoader::Impl::tryGet(uint64_t typeId) const {
-  auto iter = schemas.find(typeId);
-  if (iter == schemas.end()) {
-    return {nullptr, initializer.getCallback()};
+  KJ_IF_MAYBE(schema, schemas.find(typeId)) {
+    return {*schema, initializer.getCallback()};
   } else {
-    return {iter->second, initializer.getCallback()};
+    return {nullptr, initializer.getCallback()};
   }
 }
 
+_::RawSchema* SchemaLoader::Impl::findLoaded(uint64_t typeId) const {
+  _::RawSchema* schema = schemaIndex.find(typeId, [&](const _::RawSchema& candidate) {
+    return candidate.id == typeId;
+  });
+  return schema != nullptr && isInitialized(schema) ? schema : nullptr;
+}
+
+uint64_t SchemaLoader::Impl::brandHash(
+    const _::RawSchema* schema, schema::Brand::Reader proto,
+    kj::ArrayPtr<const _::RawBrandedSchema::Scope> clientBrand) {
+  BrandTokenHasher hasher;
+  forEachBrandToken(proto, hasher);
+  return hasher.hash ^ hashPointers(schema, clientBrand.begin()) ^ clientBrand.size();
+}
+
+const _::RawBrandedSchema* SchemaLoader::Impl::findBranded(
+    const _::RawSchema* schema, schema::Brand::Reader proto,
+    kj::ArrayPtr<const _::RawBrandedSchema::Scope> clientBrand) const {
+  auto entry = brandCache.find(brandHash(schema, proto, clientBrand),
+      [&](const BrandCacheEntry& candidate) {
+    if (candidate.schema != schema ||
+        candidate.clientScopes != clientBrand.begin() ||
+        candidate.clientScopeCount != clientBrand.size()) {
+      return false;
+    }
+    BrandTokenMatcher matcher { candidate.tokens };
+    forEachBrandToken(proto, matcher);
+    return matcher.ok && matcher.pos == candidate.tokens.size();
+  });
+  return entry == nullptr ? nullptr : entry->result;
+}
+
+void SchemaLoader::Impl::addBranded(
+    const _::RawSchema* schema, schema::Brand::Reader proto,
+    kj::ArrayPtr<const _::RawBrandedSchema::Scope> clientBrand,
+    const _::RawBrandedSchema* result) {
+  if (findBranded(schema, proto, clientBrand) != nullptr) return;
+
+  kj::Vector<uint64_t> tokens;
+  auto collect = [&](uint64_t token) { tokens.add(token); };
+  forEachBrandToken(proto, collect);
+
+  auto ownTokens = arena.allocateArray<uint64_t>(tokens.size());
+  std::copy(tokens.begin(), tokens.end(), ownTokens.begin());
+
+  auto& entry = arena.allocate<BrandCacheEntry>();
+  entry.schema = schema;
+  entry.clientScopes = clientBrand.begin();
+  entry.clientScopeCount = clientBrand.size();
+  entry.tokens = ownTokens;
+  entry.result = result;
+  brandCache.insert(brandHash(schema, proto, clientBrand), &entry);
+}
+
+const StructAccessPlan* SchemaLoader::Impl::findAccessPlan(
+    const _::RawBrandedSchema* schema, const word* encodedNode) const {
+  auto entry = accessPlans.find(hashPointers(schema), [&](const AccessPlanEntry& candidate) {
+    return candidate.schema == schema && candidate.encodedNode == encodedNode;
+  });
+  return entry == nullptr ? nullptr : entry->plan.get();
+}
+
+const StructAccessPlan& SchemaLoader::Impl::addAccessPlan(
+    const _::RawBrandedSchema* schema, const word* encodedNode,
+    kj::Own<StructAccessPlan> plan) {
+  auto& entry = arena.allocate<AccessPlanEntry>();
+  entry.schema = schema;
+  entry.encodedNode = encodedNode;
+  entry.plan = kj::mv(plan);
+  accessPlans.insert(hashPointers(schema), &entry);
+  return *entry.plan;
+}
+
 const _::RawBrandedSchema* SchemaLoader::Impl::getUnbound(const _::RawSchema* schema) {
   if (!readMessageUnchecked<schema::Node>(schema->encodedNode).getIsGeneric()) {
     // Not a generic type, so just return the default brand.
@@ -1833,14 +2174,14 @@ const _::RawBrandedSchema* SchemaLoader::Impl::getUnbound(const _::RawSchema* sc
 kj::Array<Schema> SchemaLoader::Impl::getAllLoaded() const {
   size_t count = 0;
   for (auto& schema: schemas) {
-    if (schema.second->lazyInitializer == nullptr) ++count;
+    if (schema.value->lazyInitializer == nullptr) ++count;
   }
 
   kj::Array<Schema> result = kj::heapArray<Schema>(count);
   size_t i = 0;
   for (auto& schema: schemas) {
-    if (schema.second->lazyInitializer == nullptr) {
-      result[i++] = Schema(&schema.second->defaultBrand);
+    if (schema.value->lazyInitializer == nullptr) {
+      result[i++] = Schema(&schema.value->defaultBrand);
     }
   }
   return result;
@@ -1851,9 +2192,8 @@ void SchemaLoader::Impl::requireStructSize(uint64_t id, uint dataWordCount, uint
   slot.dataWordCount = kj::max(slot.dataWordCount, dataWordCount);
   slot.pointerCount = kj::max(slot.pointerCount, pointerCount);
 
-  auto iter = schemas.find(id);
-  if (iter != schemas.end()) {
-    applyStructSizeRequirement(iter->second, dataWordCount, pointerCount);
+  KJ_IF_MAYBE(schema, schemas.find(id)) {
+    applyStructSizeRequirement(*schema, dataWordCount, pointerCount);
   }
 }
 
@@ -1958,10 +2298,8 @@ void SchemaLoader::BrandedInitializerImpl::init(const _::RawBrandedSchema* schem
   }
 
   // Get the mutable version.
-  auto iter = lock->get()->brands.find(SchemaBindingsPair { schema->generic, schema->scopes });
-  KJ_ASSERT(iter != lock->get()->brands.end());
-
-  _::RawBrandedSchema* mutableSchema = iter->second;
+  _::RawBrandedSchema* mutableSchema = KJ_ASSERT_NONNULL(
+      lock->get()->brands.find(SchemaBindingsPair { schema->generic, schema->scopes }));
   KJ_ASSERT(mutableSchema == schema);
 
   // Construct its dependency map.
@@ -1999,6 +2337,22 @@ Schema SchemaLoader::get(uint64_t id, schema::Brand::Reader brand, Schema scope)
 
 kj::Maybe<Schema> SchemaLoader::tryGet(
     uint64_t id, schema::Brand::Reader brand, Schema scope) const {
+  auto clientBrand = kj::arrayPtr(scope.raw->scopes, scope.raw->scopeCount);
+
+  {
+    // Most lookups are for schemas -- and brands -- which are already loaded, and can be found
+    // without taking the lock.
+    auto& unlocked = *impl.getWithoutLock();
+    if (_::RawSchema* schema = unlocked.findLoaded(id)) {
+      if (brand.getScopes().size() == 0) {
+        return Schema(&schema->defaultBrand);
+      } else if (auto branded = unlocked.findBranded(schema, brand, clientBrand)) {
+        branded->ensureInitialized();
+        return Schema(branded);
+      }
+    }
+  }
+
   auto getResult = impl.lockShared()->get()->tryGet(id);
   if (getResult.schema == nullptr || getResult.schema->lazyInitializer != nullptr) {
     // This schema couldn't be found or has yet to be lazily loaded. If we have a lazy loader
@@ -2010,8 +2364,12 @@ kj::Maybe<Schema> SchemaLoader::tryGet(
   }
   if (getResult.schema != nullptr && getResult.schema->lazyInitializer == nullptr) {
     if (brand.getScopes().size() > 0) {
-      auto brandedSchema = impl.lockExclusive()->get()->makeBranded(
-          getResult.schema, brand, kj::arrayPtr(scope.raw->scopes, scope.raw->scopeCount));
+      const _::RawBrandedSchema* brandedSchema;
+      {
+        auto locked = impl.lockExclusive();
+        brandedSchema = locked->get()->makeBranded(getResult.schema, brand, clientBrand);
+        locked->get()->addBranded(getResult.schema, brand, clientBrand, brandedSchema);
+      }
       brandedSchema->ensureInitialized();
       return Schema(brandedSchema);
     } else {
@@ -2024,6 +2382,10 @@ kj::Maybe<Schema> SchemaLoader::tryGet(
 
 Schema SchemaLoader::getUnbound(uint64_t id) const {
   auto schema = get(id);
+  if (!schema.getProto().getIsGeneric()) {
+    // Not a generic type, so the unbound schema is the default brand, which get() returned.
+    return schema;
+  }
   return Schema(impl.lockExclusive()->get()->getUnbound(schema.raw->generic));
 }
 
@@ -2105,8 +2467,86 @@ kj::Array<Schema> SchemaLoader::getAllLoaded() const {
   return impl.lockShared()->get()->getAllLoaded();
 }
 
+const StructAccessPlan& SchemaLoader::getAccessPlan(StructSchema schema) const {
+  const _::RawBrandedSchema* raw = schema.raw;
+  const word* encodedNode = raw->generic->encodedNode;
+
+  if (auto plan = impl.getWithoutLock()->findAccessPlan(raw, encodedNode)) {
+    return *plan;
+  }
+
+  // Build the plan without holding the lock, since resolving field types may call back into the
+  // loader to initialize lazily-loaded dependencies.
+  auto plan = kj::heap<StructAccessPlan>(schema);
+
+  auto locked = impl.lockExclusive();
+  auto& loaderImpl = *locked->get();
+  if (auto existing = loaderImpl.findAccessPlan(raw, encodedNode)) {
+    // Another thread beat us to it.
+    return *existing;
+  }
+  return loaderImpl.addAccessPlan(raw, encodedNode, kj::mv(plan));
+}
+
 void SchemaLoader::loadNative(const _::RawSchema* nativeSchema) {
   impl.lockExclusive()->get()->loadNative(nativeSchema);
 }
 
+// =======================================================================================
+
+SchemaBundle::SchemaBundle(kj::ArrayPtr<const word> data)
+    : SchemaBundle(data, ReaderOptions()) {}
+
+SchemaBundle::SchemaBundle(kj::ArrayPtr<const word> data, const ReaderOptions& options)
+    : message(kj::heap<FlatArrayMessageReader>(data, options)) {
+  init();
+}
+
+SchemaBundle::SchemaBundle(kj::Array<const byte> data)
+    : SchemaBundle(kj::mv(data), ReaderOptions()) {}
+
+SchemaBundle::SchemaBundle(kj::Array<const byte> data, const ReaderOptions& options)
+    : ownedData(kj::mv(data)) {
+  KJ_REQUIRE(reinterpret_cast<uintptr_t>(ownedData.begin()) % sizeof(word) == 0,
+             "schema bundle data must be word-aligned");
+  message = kj::heap<FlatArrayMessageReader>(kj::arrayPtr(
+      reinterpret_cast<const word*>(ownedData.begin()), ownedData.size() / sizeof(word)),
+      options);
+  init();
+}
+
+SchemaBundle::~SchemaBundle() noexcept(false) {}
+
+void SchemaBundle::init() {
+  // Read the node list once here; every call to getNodes() would count its full size against
+  // the message's traversal limit.
+  nodes = message->getRoot<schema::CodeGeneratorRequest>().getNodes();
+
+  auto builder = kj::heapArrayBuilder<IndexEntry>(nodes.size());
+  for (uint i = 0; i < nodes.size(); i++) {
+    builder.add(IndexEntry { nodes[i].getId(), i });
+  }
+  index = builder.finish();
+
+  // Stable, so that if an ID appears more than once the first occurrence wins.
+  std::stable_sort(index.begin(), index.end());
+  auto end = std::unique(index.begin(), index.end(),
+      [](const IndexEntry& a, const IndexEntry& b) { return a.id == b.id; });
+  if (end != index.end()) {
+    index = kj::heapArray<IndexEntry>(index.begin(), end);
+  }
+}
+
+kj::Maybe<schema::Node::Reader> SchemaBundle::find(uint64_t id) const {
+  auto iter = std::lower_bound(index.begin(), index.end(), IndexEntry { id, 0 });
+  if (iter == index.end() || iter->id != id) return nullptr;
+  return nodes[iter->position];
+}
+
+void SchemaBundle::load(const SchemaLoader& loader, uint64_t id) const {
+  KJ_IF_MAYBE(node, find(id)) {
+    loader.loadOnce(*node);
+  }
+}
+
 }  // namespace capnp
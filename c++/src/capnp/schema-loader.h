@@ -31,6 +31,8 @@
 
 namespace capnp {
 
+class StructAccessPlan;
+
 class SchemaLoader {
   // Class which can be used to construct Schema objects from schema::Nodes as defined in
   // schema.capnp.
@@ -151,6 +153,14 @@ public:
   // loadCompiledTypeAndDependencies<T>() in order to get a flat list of all of T's transitive
   // dependencies.
 
+  const StructAccessPlan& getAccessPlan(StructSchema schema) const;
+  // Get the StructAccessPlan (see dynamic.h) for the given struct type, building it on first use.
+  // The plan is owned by the loader.  `schema` need not come from this loader, but must outlive it
+  // (compiled-in schemas always do).
+  //
+  // If load() later replaces the schema with a newer version, the next call builds a new plan.
+  // Plans returned earlier stay valid, but describe the old version.
+
 private:
   class Validator;
   class CompatibilityChecker;
@@ -162,6 +172,63 @@ private:
   void loadNative(const _::RawSchema* nativeSchema);
 };
 
+class MessageReader;
+struct ReaderOptions;
+
+class SchemaBundle final: public SchemaLoader::LazyLoadCallback {
+  // A set of compiled schema nodes stored as a serialized schema::CodeGeneratorRequest (e.g. the
+  // output of `capnp compile -o-`), typically mmap()ed straight from a file.  Used as the lazy
+  // load callback for a SchemaLoader, it hands over each node only when the loader first asks for
+  // it, so nodes that are never used are never validated or copied.
+  //
+  //     auto file = fs.getRoot().openFile(path);
+  //     SchemaBundle bundle(file->mmap(0, file->stat().size));
+  //     SchemaLoader loader(bundle);
+  //     Schema schema = loader.get(id);  // loads `id` and, later, what it turns out to need
+  //
+  // Constructing the bundle only reads the node IDs to build a sorted index.  The bundle must
+  // outlive any SchemaLoader using it.  It is immutable after construction, so it may be shared
+  // by loaders on multiple threads.
+
+public:
+  explicit SchemaBundle(kj::ArrayPtr<const word> data);
+  SchemaBundle(kj::ArrayPtr<const word> data, const ReaderOptions& options);
+  // Read a bundle from `data`, a message in standard serialization format.  `data` must remain
+  // valid for the lifetime of the bundle.
+
+  explicit SchemaBundle(kj::Array<const byte> data);
+  SchemaBundle(kj::Array<const byte> data, const ReaderOptions& options);
+  // Like above, but takes ownership of `data` (such as a kj::ReadableFile::mmap() result), which
+  // must be word-aligned.
+
+  ~SchemaBundle() noexcept(false);
+  KJ_DISALLOW_COPY(SchemaBundle);
+
+  size_t size() const { return index.size(); }
+  // Number of distinct nodes in the bundle.
+
+  kj::Maybe<schema::Node::Reader> find(uint64_t id) const;
+  // Look up a node by ID without loading it anywhere.
+
+  void load(const SchemaLoader& loader, uint64_t id) const override;
+
+private:
+  struct IndexEntry {
+    uint64_t id;
+    uint position;
+
+    inline bool operator<(const IndexEntry& other) const { return id < other.id; }
+  };
+
+  kj::Array<const byte> ownedData;
+  kj::Own<MessageReader> message;
+  List<schema::Node>::Reader nodes;
+  kj::Array<IndexEntry> index;
+  // Sorted by ID.
+
+  void init();
+};
+
 template <typename T>
 inline void SchemaLoader::loadCompiledTypeAndDependencies() {
   loadNative(&_::rawSchema<T>());
@@ -233,7 +233,9 @@ ParsedSchema SchemaParser::parseDiskFile(
         auto parsed = cwd.evalNative(path);
         kj::Own<const kj::ReadableDirectory> dir;
         KJ_IF_MAYBE(d, root.tryOpenSubdir(parsed)) {
-          dir = kj::mv(*d);
+          // Every import is looked up in each import directory in turn, so most lookups miss.
+          // The caching wrapper answers those from the directory's listing.
+          dir = kj::newCachingDirectory(kj::mv(*d), kj::systemCalendarClock());
         } else {
           // Ignore paths that don't exist.
           dir = kj::newInMemoryDirectory(kj::nullClock());
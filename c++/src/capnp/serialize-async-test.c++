@@ -23,6 +23,7 @@
 #include "serialize.h"
 #include <kj/debug.h>
 #include <kj/thread.h>
+#include <kj/vector.h>
 #include <stdlib.h>
 #include <kj/miniposix.h>
 #include "test-util.h"
@@ -339,6 +340,348 @@ TEST(SerializeAsyncTest, WriteAsyncEvenSegmentCount) {
   writeMessage(*output, message).wait(ioContext.waitScope);
 }
 
+class RecordingOutputStream final: public kj::AsyncOutputStream {
+  // Records everything written to it, and how many write() calls were made.  Writes only complete
+  // once the event loop runs, like a real stream would.
+
+public:
+  kj::Vector<byte> data;
+  uint writeCount = 0;
+
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    ++writeCount;
+    data.addAll(kj::arrayPtr(reinterpret_cast<const byte*>(buffer), size));
+    return kj::evalLater([]() {});
+  }
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    ++writeCount;
+    for (auto& piece: pieces) {
+      data.addAll(piece);
+    }
+    return kj::evalLater([]() {});
+  }
+};
+
+TEST(SerializeAsyncTest, MessageStreamWriterCoalesces) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  RecordingOutputStream output;
+  MessageStreamWriter writer(output);
+
+  kj::Vector<kj::Own<MallocMessageBuilder>> messages;
+  kj::Vector<kj::Promise<void>> promises;
+  for (uint i = 0; i < 5; i++) {
+    auto message = kj::heap<MallocMessageBuilder>();
+    message->initRoot<TestAllTypes>().setUInt32Field(i);
+    promises.add(writer.write(*message));
+    messages.add(kj::mv(message));
+  }
+
+  EXPECT_EQ(0u, output.writeCount);
+  EXPECT_LT(0u, writer.getQueuedBytes());
+
+  kj::joinPromises(promises.releaseAsArray()).wait(waitScope);
+  EXPECT_EQ(1u, output.writeCount);
+  EXPECT_EQ(0u, writer.getQueuedBytes());
+
+  // The coalesced output must be exactly the concatenation of the individual messages.
+  auto words = kj::heapArray<word>(output.data.size() / sizeof(word));
+  memcpy(words.asBytes().begin(), output.data.begin(), output.data.size());
+  kj::ArrayPtr<const word> remaining = words;
+  for (uint i = 0; i < 5; i++) {
+    FlatArrayMessageReader reader(remaining);
+    EXPECT_EQ(i, reader.getRoot<TestAllTypes>().getUInt32Field());
+    remaining = kj::arrayPtr(reader.getEnd(), remaining.end());
+  }
+  EXPECT_EQ(0u, remaining.size());
+}
+
+TEST(SerializeAsyncTest, MessageStreamWriterQueuesBehindWrite) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  RecordingOutputStream output;
+  MessageStreamWriter::Options options;
+  options.maxBatchBytes = 1;
+  MessageStreamWriter writer(output, options);
+
+  TestMessageBuilder message1(1), message2(1), message3(1);
+  message1.initRoot<TestAllTypes>().setUInt32Field(1);
+  message2.initRoot<TestAllTypes>().setUInt32Field(2);
+  message3.initRoot<TestAllTypes>().setUInt32Field(3);
+
+  // With a tiny batch limit, every message gets its own batch, and each batch waits for the
+  // previous one.
+  auto promise1 = writer.write(message1);
+  auto promise2 = writer.write(message2);
+  auto promise3 = writer.write(message3);
+  writer.flush().wait(waitScope);
+  EXPECT_EQ(3u, output.writeCount);
+
+  promise1.wait(waitScope);
+  promise2.wait(waitScope);
+  promise3.wait(waitScope);
+
+  writer.flush().wait(waitScope);
+}
+
+TEST(SerializeAsyncTest, MessageStreamWriterUrgent) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  RecordingOutputStream output;
+  MessageStreamWriter::Options options;
+  options.maxBatchBytes = 1;
+  MessageStreamWriter writer(output, options);
+
+  TestMessageBuilder message1(1), message2(1), message3(1), message4(1), message5(1);
+  message1.initRoot<TestAllTypes>().setUInt32Field(1);
+  message2.initRoot<TestAllTypes>().setUInt32Field(2);
+  message3.initRoot<TestAllTypes>().setUInt32Field(3);
+  message4.initRoot<TestAllTypes>().setUInt32Field(4);
+  message5.initRoot<TestAllTypes>().setUInt32Field(5);
+
+  // Nothing has started writing yet, so the urgent messages overtake all of the others, but stay
+  // in order among themselves.
+  auto promise1 = writer.write(message1);
+  auto promise2 = writer.write(message2);
+  auto promise3 = writer.write(message3);
+  auto promise4 = writer.writeUrgent(message4);
+  auto promise5 = writer.writeUrgent(message5);
+  writer.flush().wait(waitScope);
+  promise4.wait(waitScope);
+  promise5.wait(waitScope);
+  promise1.wait(waitScope);
+
+  auto words = kj::heapArray<word>(output.data.size() / sizeof(word));
+  memcpy(words.asBytes().begin(), output.data.begin(), output.data.size());
+  kj::ArrayPtr<const word> remaining = words;
+  for (uint expected: {4, 5, 1, 2, 3}) {
+    FlatArrayMessageReader reader(remaining);
+    EXPECT_EQ(expected, reader.getRoot<TestAllTypes>().getUInt32Field());
+    remaining = kj::arrayPtr(reader.getEnd(), remaining.end());
+  }
+  EXPECT_EQ(0u, remaining.size());
+
+  // With nothing queued, an urgent message is just a message.
+  writer.writeUrgent(message1).wait(waitScope);
+  EXPECT_EQ(0u, writer.getQueuedBytes());
+}
+
+class MemoryAsyncInputStream final: public kj::AsyncInputStream {
+  // Reads from a byte array, returning at most `maxChunk` bytes per read (unless more are needed to
+  // satisfy `minBytes`), and counts the number of reads.
+
+public:
+  MemoryAsyncInputStream(kj::ArrayPtr<const byte> data, size_t maxChunk = kj::maxValue)
+      : data(data), maxChunk(maxChunk) {}
+
+  uint readCount = 0;
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    ++readCount;
+    size_t n = kj::min(data.size(), kj::max(minBytes, kj::min(maxBytes, maxChunk)));
+    memcpy(buffer, data.begin(), n);
+    data = data.slice(n, data.size());
+    return n;
+  }
+
+private:
+  kj::ArrayPtr<const byte> data;
+  size_t maxChunk;
+};
+
+kj::Array<word> flatten(kj::ArrayPtr<kj::Own<MallocMessageBuilder>> messages) {
+  kj::Vector<byte> bytes;
+  for (auto& message: messages) {
+    bytes.addAll(messageToFlatArray(*message).asBytes());
+  }
+  auto result = kj::heapArray<word>(bytes.size() / sizeof(word));
+  memcpy(result.asBytes().begin(), bytes.begin(), bytes.size());
+  return result;
+}
+
+TEST(SerializeAsyncTest, MessageStreamReaderSingleRead) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  kj::Vector<kj::Own<MallocMessageBuilder>> messages;
+  for (uint i = 0; i < 10; i++) {
+    auto message = kj::heap<MallocMessageBuilder>();
+    message->initRoot<TestAllTypes>().setUInt32Field(i);
+    messages.add(kj::mv(message));
+  }
+  auto data = flatten(messages);
+
+  MemoryAsyncInputStream input(data.asBytes());
+  MessageStreamReader reader(input);
+
+  kj::Vector<kj::Own<MessageReader>> received;
+  for (uint i = 0; i < 10; i++) {
+    received.add(reader.readMessage().wait(waitScope));
+  }
+  EXPECT_EQ(1u, input.readCount);
+
+  EXPECT_TRUE(reader.tryReadMessage().wait(waitScope) == nullptr);
+
+  for (uint i = 0; i < 10; i++) {
+    EXPECT_EQ(i, received[i]->getRoot<TestAllTypes>().getUInt32Field());
+  }
+}
+
+TEST(SerializeAsyncTest, MessageStreamReaderSmallBuffer) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  // Mix small messages with multi-segment messages bigger than the buffer, and deliver the data a
+  // few bytes at a time so that messages and even words get split across reads.
+  kj::Vector<kj::Own<MallocMessageBuilder>> messages;
+  for (uint i = 0; i < 20; i++) {
+    if (i % 5 == 2) {
+      auto message = kj::heap<TestMessageBuilder>(7);
+      auto root = message->initRoot<TestAllTypes>();
+      root.setUInt32Field(i);
+      root.initDataField(4096);
+      for (auto element: root.initStructList(4)) {
+        initTestMessage(element);
+      }
+      messages.add(kj::mv(message));
+    } else {
+      auto message = kj::heap<MallocMessageBuilder>();
+      message->initRoot<TestAllTypes>().setUInt32Field(i);
+      messages.add(kj::mv(message));
+    }
+  }
+  auto data = flatten(messages);
+
+  MemoryAsyncInputStream input(data.asBytes(), 61);
+  MessageStreamReader::Options options;
+  options.bufferWords = 256;
+  MessageStreamReader reader(input, ReaderOptions(), options);
+
+  // Keep every reader around so that we'd notice if a buffer were reused while still referenced.
+  kj::Vector<kj::Own<MessageReader>> received;
+  for (uint i = 0; i < 20; i++) {
+    received.add(reader.readMessage().wait(waitScope));
+  }
+  EXPECT_TRUE(reader.tryReadMessage().wait(waitScope) == nullptr);
+
+  for (uint i = 0; i < 20; i++) {
+    auto root = received[i]->getRoot<TestAllTypes>();
+    EXPECT_EQ(i, root.getUInt32Field());
+    if (i % 5 == 2) {
+      EXPECT_EQ(4096u, root.getDataField().size());
+      for (auto element: root.getStructList()) {
+        checkTestMessage(element);
+      }
+    }
+  }
+}
+
+TEST(SerializeAsyncTest, MessageStreamReaderPrematureEof) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  kj::Vector<kj::Own<MallocMessageBuilder>> messages;
+  for (uint i = 0; i < 2; i++) {
+    auto message = kj::heap<MallocMessageBuilder>();
+    initTestMessage(message->initRoot<TestAllTypes>());
+    messages.add(kj::mv(message));
+  }
+  auto data = flatten(messages);
+
+  MemoryAsyncInputStream input(data.asBytes().slice(0, data.asBytes().size() - 12));
+  MessageStreamReader reader(input);
+
+  checkTestMessage(reader.readMessage().wait(waitScope)->getRoot<TestAllTypes>());
+  KJ_EXPECT_THROW_MESSAGE("Premature EOF", reader.tryReadMessage().wait(waitScope));
+}
+
+TEST(SerializeAsyncTest, MessageStreamCompression) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  RecordingOutputStream output;
+  MessageStreamWriter::Options options;
+  options.compression = MessageCompression::PACKED;
+  options.compressionThreshold = 256;
+  MessageStreamWriter writer(output, options);
+
+  // 0: below the threshold.  1: mostly zeros, across several segments.  2: doesn't get smaller
+  // when packed.  3: packs, but is still bigger than the reader's buffer.
+  kj::Vector<kj::Own<MallocMessageBuilder>> messages;
+  for (uint i = 0; i < 4; i++) {
+    auto message = kj::heap<TestMessageBuilder>(i == 1 ? 7 : 1);
+    auto root = message->initRoot<TestAllTypes>();
+    root.setUInt32Field(i);
+    if (i == 1) {
+      root.initDataField(4096);
+      for (auto element: root.initStructList(4)) {
+        initTestMessage(element);
+      }
+    } else if (i == 2) {
+      auto data = root.initDataField(1024);
+      memset(data.begin(), 0x5a, data.size());
+    } else if (i == 3) {
+      auto data = root.initDataField(8192);
+      for (uint j = 0; j < data.size(); j++) data[j] = j % 2;
+    }
+    messages.add(kj::mv(message));
+  }
+
+  size_t unpackedBytes = 0;
+  for (auto& message: messages) {
+    unpackedBytes += computeSerializedSizeInWords(*message) * sizeof(word);
+    writer.write(*message).wait(waitScope);
+  }
+  EXPECT_LT(output.data.size(), unpackedBytes);
+
+  MemoryAsyncInputStream input(output.data.asPtr(), 61);
+  MessageStreamReader::Options readerOptions;
+  readerOptions.bufferWords = 512;
+  MessageStreamReader reader(input, ReaderOptions(), readerOptions);
+
+  for (uint i = 0; i < 4; i++) {
+    auto received = reader.readMessage().wait(waitScope);
+    auto root = received->getRoot<TestAllTypes>();
+    EXPECT_EQ(i, root.getUInt32Field());
+    if (i == 1) {
+      EXPECT_EQ(4096u, root.getDataField().size());
+      for (auto element: root.getStructList()) {
+        checkTestMessage(element);
+      }
+    } else if (i == 3) {
+      auto data = root.getDataField();
+      ASSERT_EQ(8192u, data.size());
+      for (uint j = 0; j < data.size(); j++) {
+        if (data[j] != j % 2) {
+          KJ_FAIL_EXPECT("wrong data", j);
+          break;
+        }
+      }
+    }
+  }
+  EXPECT_TRUE(reader.tryReadMessage().wait(waitScope) == nullptr);
+}
+
+TEST(SerializeAsyncTest, MessageStreamReaderBadPackedSize) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  // A packed frame claiming one empty segment, but 1000 bytes of packed data.
+  _::WireValue<uint32_t> table[4];
+  table[0].set(0x80000000u);
+  table[1].set(0);
+  table[2].set(1000);
+  table[3].set(0);
+
+  MemoryAsyncInputStream input(kj::arrayPtr(table, 4).asBytes());
+  MessageStreamReader reader(input);
+  KJ_EXPECT_THROW_MESSAGE("bigger than its contents", reader.readMessage().wait(waitScope));
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
@@ -20,7 +20,10 @@
 // THE SOFTWARE.
 
 #include "serialize-async.h"
+#include "serialize.h"
+#include "serialize-packed.h"
 #include <kj/debug.h>
+#include <kj/vector.h>
 
 namespace capnp {
 
@@ -176,6 +179,227 @@ kj::Promise<kj::Maybe<kj::Own<MessageReader>>> tryReadMessage(
 
 namespace {
 
+constexpr uint32_t PACKED_FRAME_FLAG = 0x80000000u;
+// Set in the first word of a frame written with MessageCompression::PACKED.  A packed frame's
+// segment table is followed by one more entry giving the size of the packed data in bytes, then
+// padding to a word boundary, then the packed segments, also padded to a word boundary.  The
+// segment sizes in the table are the unpacked sizes.
+
+const byte ZERO_PADDING[sizeof(word)] = {0};
+
+size_t tableWords(uint segmentCount, bool packed) {
+  // Size of the (padded) frame header for the given segment count.
+  return (segmentCount + packed + 2) / 2;
+}
+
+kj::Own<MessageReader> readPackedFrame(kj::ArrayPtr<const word> frame, ReaderOptions options) {
+  // Unpack a complete packed frame into a new, standard-format message.
+
+  auto table = reinterpret_cast<const _::WireValue<uint32_t>*>(frame.begin());
+  uint segmentCount = (table[0].get() & ~PACKED_FRAME_FLAG) + 1;
+  size_t headerWords = tableWords(segmentCount, true);
+  size_t outHeaderWords = tableWords(segmentCount, false);
+
+  size_t totalWords = outHeaderWords;
+  for (uint i = 0; i < segmentCount; i++) {
+    totalWords += table[i + 1].get();
+  }
+
+  auto words = kj::heapArray<word>(totalWords);
+  auto outTable = reinterpret_cast<_::WireValue<uint32_t>*>(words.begin());
+  outTable[0].set(segmentCount - 1);
+  for (uint i = 0; i < segmentCount; i++) {
+    outTable[i + 1].set(table[i + 1].get());
+  }
+  if (segmentCount % 2 == 0) {
+    outTable[segmentCount + 1].set(0);
+  }
+
+  // Unpack each segment with its own read, matching how they were written.
+  auto packedBytes = frame.slice(headerWords, frame.size()).asBytes()
+      .slice(0, table[segmentCount + 1].get());
+  kj::ArrayInputStream packedInput(packedBytes);
+  _::PackedInputStream unpacker(packedInput);
+  byte* pos = words.slice(outHeaderWords, words.size()).asBytes().begin();
+  for (uint i = 0; i < segmentCount; i++) {
+    size_t bytes = table[i + 1].get() * sizeof(word);
+    if (bytes > 0) {
+      unpacker.read(pos, bytes);
+      pos += bytes;
+    }
+  }
+  KJ_REQUIRE(packedInput.tryGetReadBuffer().size() == 0,
+             "Packed message has data after its last segment.");
+
+  auto reader = kj::heap<FlatArrayMessageReader>(words, options);
+  return reader.attach(kj::mv(words));
+}
+
+}  // namespace
+
+struct MessageStreamReader::Buffer: public kj::Refcounted {
+  kj::Array<word> words;
+
+  explicit Buffer(size_t size): words(kj::heapArray<word>(size)) {}
+};
+
+MessageStreamReader::MessageStreamReader(kj::AsyncInputStream& input, ReaderOptions readerOptions)
+    : MessageStreamReader(input, readerOptions, Options()) {}
+MessageStreamReader::MessageStreamReader(
+    kj::AsyncInputStream& input, ReaderOptions readerOptions, Options options)
+    : input(input), readerOptions(readerOptions), options(options),
+      // The buffer must at least be able to hold the largest segment table we accept.
+      buffer(kj::refcounted<Buffer>(kj::max(options.bufferWords, size_t(512)))) {}
+MessageStreamReader::~MessageStreamReader() noexcept(false) {}
+
+kj::Promise<kj::Own<MessageReader>> MessageStreamReader::readMessage() {
+  return tryReadMessage().then([](kj::Maybe<kj::Own<MessageReader>>&& maybeResult) {
+    KJ_IF_MAYBE(result, maybeResult) {
+      return kj::mv(*result);
+    }
+    KJ_FAIL_REQUIRE("Premature EOF.");
+  });
+}
+
+kj::Maybe<kj::Own<MessageReader>> MessageStreamReader::tryParse(size_t& expectedWords) {
+  auto available = buffer->words.slice(readPos, endPos / sizeof(word));
+
+  if (available.size() == 0) {
+    // All messages are at least one word.
+    expectedWords = 1;
+    return nullptr;
+  }
+
+  auto table = reinterpret_cast<const _::WireValue<uint32_t>*>(available.begin());
+  bool packed = table[0].get() & PACKED_FRAME_FLAG;
+
+  // Reject messages with too many segments for security reasons.
+  uint segmentCount = (table[0].get() & ~PACKED_FRAME_FLAG) + 1;
+  KJ_REQUIRE(segmentCount > 0 && segmentCount < 512, "Message has too many segments.");
+
+  size_t headerWords = tableWords(segmentCount, packed);
+  if (available.size() < headerWords) {
+    // Wait for the rest of the segment table.
+    expectedWords = headerWords;
+    return nullptr;
+  }
+
+  size_t segmentWords = 0;
+  for (uint i = 0; i < segmentCount; i++) {
+    segmentWords += table[i + 1].get();
+  }
+
+  // Don't accept a message which the receiver couldn't possibly traverse without hitting the
+  // traversal limit.  Without this check, a malicious peer could transmit a very large segment
+  // size to make the receiver allocate excessive space and possibly crash.
+  KJ_REQUIRE(segmentWords <= readerOptions.traversalLimitInWords,
+             "Message is too large.  To increase the limit on the receiving end, see "
+             "capnp::ReaderOptions.");
+
+  if (packed) {
+    // Packing adds at most a tag byte and a run-length byte to each word, so anything bigger than
+    // that is bogus.
+    size_t packedBytes = table[segmentCount + 1].get();
+    KJ_REQUIRE(packedBytes <= segmentWords * (sizeof(word) + 2),
+               "Packed message is bigger than its contents could be.");
+    expectedWords = headerWords + (packedBytes + sizeof(word) - 1) / sizeof(word);
+  } else {
+    expectedWords = headerWords + segmentWords;
+  }
+
+  if (expectedWords > available.size()) {
+    return nullptr;
+  }
+
+  auto message = available.slice(0, expectedWords);
+  readPos += expectedWords;
+  if (packed) {
+    return readPackedFrame(message, readerOptions);
+  }
+  return kj::Own<MessageReader>(kj::heap<FlatArrayMessageReader>(message, readerOptions)
+      .attach(kj::addRef(*buffer)));
+}
+
+void MessageStreamReader::makeSpace(size_t words) {
+  // Make sure there's room for at least `words` words of data starting at `readPos`, moving the
+  // unconsumed data to the front of a buffer if necessary.
+
+  if (readPos + words <= buffer->words.size()) return;
+
+  auto leftover = buffer->words.asBytes().slice(readPos * sizeof(word), endPos);
+  if (buffer->isShared()) {
+    // Some returned message still points into this buffer, so start a new one.
+    auto newBuffer = kj::refcounted<Buffer>(buffer->words.size());
+    memcpy(newBuffer->words.asBytes().begin(), leftover.begin(), leftover.size());
+    buffer = kj::mv(newBuffer);
+  } else {
+    memmove(buffer->words.asBytes().begin(), leftover.begin(), leftover.size());
+  }
+  readPos = 0;
+  endPos = leftover.size();
+}
+
+kj::Promise<kj::Maybe<kj::Own<MessageReader>>> MessageStreamReader::tryReadMessage() {
+  size_t expectedWords;
+  KJ_IF_MAYBE(message, tryParse(expectedWords)) {
+    return kj::Maybe<kj::Own<MessageReader>>(kj::mv(*message));
+  }
+
+  if (expectedWords > buffer->words.size()) {
+    // The segment table is complete (it always fits in the buffer), so this is the real size.
+    return readLarge(expectedWords).then([](kj::Own<MessageReader>&& message) {
+      return kj::Maybe<kj::Own<MessageReader>>(kj::mv(message));
+    });
+  }
+
+  makeSpace(expectedWords);
+
+  byte* begin = buffer->words.asBytes().begin();
+  size_t minBytes = (readPos + expectedWords) * sizeof(word) - endPos;
+  size_t maxBytes = buffer->words.size() * sizeof(word) - endPos;
+  return input.tryRead(begin + endPos, minBytes, maxBytes)
+      .then([this,minBytes](size_t n) -> kj::Promise<kj::Maybe<kj::Own<MessageReader>>> {
+    endPos += n;
+    if (n < minBytes) {
+      // EOF.  This is only clean if it falls between messages.
+      KJ_REQUIRE(endPos == readPos * sizeof(word), "Premature EOF.") { break; }
+      return kj::Maybe<kj::Own<MessageReader>>(nullptr);
+    }
+    return tryReadMessage();
+  });
+}
+
+kj::Promise<kj::Own<MessageReader>> MessageStreamReader::readLarge(size_t totalWords) {
+  // Read a message too big for the buffer into its own array, starting with whatever prefix of it
+  // is already buffered.
+
+  auto space = kj::heapArray<word>(totalWords);
+  auto prefix = buffer->words.asBytes().slice(readPos * sizeof(word), endPos);
+  memcpy(space.asBytes().begin(), prefix.begin(), prefix.size());
+  readPos = 0;
+  endPos = 0;
+  if (buffer->isShared()) {
+    // Returned messages still point into the old buffer, so we can't rewind it.
+    buffer = kj::refcounted<Buffer>(buffer->words.size());
+  }
+
+  byte* rest = space.asBytes().begin() + prefix.size();
+  size_t restBytes = space.asBytes().size() - prefix.size();
+  return input.read(rest, restBytes)
+      .then(kj::mvCapture(space, [this](kj::Array<word>&& space) {
+    if (reinterpret_cast<const _::WireValue<uint32_t>*>(space.begin())->get() &
+        PACKED_FRAME_FLAG) {
+      return readPackedFrame(space, readerOptions);
+    }
+    auto reader = kj::heap<FlatArrayMessageReader>(space, readerOptions);
+    return kj::Own<MessageReader>(reader.attach(kj::mv(space)));
+  }));
+}
+
+// =======================================================================================
+
+namespace {
+
 struct WriteArrays {
   // Holds arrays that must remain valid until a write completes.
 
@@ -217,4 +441,199 @@ kj::Promise<void> writeMessage(kj::AsyncOutputStream& output,
   return promise.then(kj::mvCapture(arrays, [](WriteArrays&&) {}));
 }
 
+// =======================================================================================
+
+struct MessageStreamWriter::Batch {
+  kj::Vector<kj::Array<_::WireValue<uint32_t>>> tables;
+  kj::Vector<kj::Own<kj::VectorOutputStream>> packedMessages;
+  kj::Vector<kj::ArrayPtr<const byte>> pieces;
+  kj::Vector<kj::ArrayPtr<const byte>> urgentPieces;
+  // Urgent messages are written before the rest.
+
+  size_t bytes = 0;
+  Batch* next = nullptr;
+  // The batch after this one, while this one hasn't started writing.
+
+  kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+  kj::ForkedPromise<void> done = nullptr;
+
+  Batch() {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    fulfiller = kj::mv(paf.fulfiller);
+    done = paf.promise.fork();
+  }
+};
+
+MessageStreamWriter::MessageStreamWriter(kj::AsyncOutputStream& output)
+    : MessageStreamWriter(output, Options()) {}
+MessageStreamWriter::MessageStreamWriter(kj::AsyncOutputStream& output, Options options)
+    : output(output), options(options) {}
+MessageStreamWriter::~MessageStreamWriter() noexcept(false) {}
+
+kj::Promise<void> MessageStreamWriter::write(
+    kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
+  KJ_REQUIRE(segments.size() > 0, "Tried to serialize uninitialized message.");
+
+  KJ_IF_MAYBE(e, failure) {
+    return kj::cp(*e);
+  }
+
+  Batch& batch = getBatch();
+  return addMessage(batch, batch.pieces, segments);
+}
+
+kj::Promise<void> MessageStreamWriter::writeUrgent(
+    kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
+  KJ_REQUIRE(segments.size() > 0, "Tried to serialize uninitialized message.");
+
+  KJ_IF_MAYBE(e, failure) {
+    return kj::cp(*e);
+  }
+
+  Batch& batch = firstUnstarted == nullptr ? getBatch() : *firstUnstarted;
+  return addMessage(batch, batch.urgentPieces, segments);
+}
+
+kj::Promise<void> MessageStreamWriter::addMessage(
+    Batch& batch, kj::Vector<kj::ArrayPtr<const byte>>& pieces,
+    kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
+  size_t segmentBytes = 0;
+  for (auto& segment: segments) {
+    segmentBytes += segment.asBytes().size();
+  }
+
+  kj::Maybe<kj::Own<kj::VectorOutputStream>> packedMessage;
+  if (options.compression == MessageCompression::PACKED &&
+      segmentBytes >= options.compressionThreshold) {
+    auto packedOutput = kj::heap<kj::VectorOutputStream>(segmentBytes / 2 + 64);
+    {
+      _::PackedOutputStream packer(*packedOutput);
+      for (auto& segment: segments) {
+        if (segment.size() > 0) {
+          packer.write(segment.begin(), segment.asBytes().size());
+        }
+      }
+    }
+    if (packedOutput->getArray().size() < segmentBytes) {
+      packedMessage = kj::mv(packedOutput);
+    }
+  }
+  bool packed = packedMessage != nullptr;
+
+  auto table = kj::heapArray<_::WireValue<uint32_t>>(tableWords(segments.size(), packed) * 2);
+
+  // We write the segment count - 1 because this makes the first word zero for single-segment
+  // messages, improving compression.
+  table[0].set((segments.size() - 1) | (packed ? PACKED_FRAME_FLAG : 0));
+  for (uint i = 0; i < segments.size(); i++) {
+    table[i + 1].set(segments[i].size());
+  }
+  for (size_t i = segments.size() + 1; i < table.size(); i++) {
+    // Set padding.  (For a packed message, the first of these is the packed size, set below.)
+    table[i].set(0);
+  }
+
+  size_t bytes = table.asBytes().size();
+  pieces.add(table.asBytes());
+  KJ_IF_MAYBE(p, packedMessage) {
+    auto data = p->get()->getArray();
+    table[segments.size() + 1].set(data.size());
+    pieces.add(data);
+    bytes += data.size();
+    size_t padding = (sizeof(word) - data.size() % sizeof(word)) % sizeof(word);
+    if (padding > 0) {
+      pieces.add(kj::arrayPtr(ZERO_PADDING, padding));
+      bytes += padding;
+    }
+    batch.packedMessages.add(kj::mv(*p));
+  } else {
+    for (auto& segment: segments) {
+      pieces.add(segment.asBytes());
+    }
+    bytes += segmentBytes;
+  }
+  batch.tables.add(kj::mv(table));
+
+  batch.bytes += bytes;
+  queuedBytes += bytes;
+
+  return batch.done.addBranch();
+}
+
+kj::Promise<void> MessageStreamWriter::flush() {
+  KJ_IF_MAYBE(e, failure) {
+    return kj::cp(*e);
+  }
+
+  if (last == nullptr) {
+    return kj::READY_NOW;
+  } else {
+    return last->done.addBranch();
+  }
+}
+
+MessageStreamWriter::Batch& MessageStreamWriter::getBatch() {
+  if (current != nullptr && current->bytes < options.maxBatchBytes) {
+    return *current;
+  }
+
+  // Start a new batch.  Its step in writeChain can't run until the previous step is done, so the
+  // batch keeps accumulating messages until then.  Even if nothing is in flight, the step won't
+  // run until the event loop gets around to it, which gives everything else queued during this
+  // turn a chance to join the batch.
+  auto batch = kj::heap<Batch>();
+  if (firstUnstarted == nullptr) {
+    firstUnstarted = batch;
+  } else {
+    // `last` hasn't started either, since batches start in order.
+    last->next = batch;
+  }
+  current = batch;
+  last = batch;
+
+  writeChain = writeChain.then(kj::mvCapture(batch, [this](kj::Own<Batch>&& batch) {
+    return writeBatch(kj::mv(batch));
+  })).eagerlyEvaluate(nullptr);
+
+  return *current;
+}
+
+kj::Promise<void> MessageStreamWriter::writeBatch(kj::Own<Batch>&& batch) {
+  // Stop adding messages to this batch.
+  if (current == batch.get()) current = nullptr;
+  KJ_ASSERT(firstUnstarted == batch.get());
+  firstUnstarted = batch->next;
+
+  Batch& b = *batch;
+  if (b.urgentPieces.size() > 0) {
+    auto pieces = kj::heapArrayBuilder<kj::ArrayPtr<const byte>>(
+        b.urgentPieces.size() + b.pieces.size());
+    pieces.addAll(b.urgentPieces);
+    pieces.addAll(b.pieces);
+    b.pieces = kj::Vector<kj::ArrayPtr<const byte>>(pieces.finish());
+  }
+  auto finish = [this,&b]() {
+    queuedBytes -= b.bytes;
+    if (last == &b) last = nullptr;
+  };
+
+  KJ_IF_MAYBE(e, failure) {
+    finish();
+    b.fulfiller->reject(kj::cp(*e));
+    return kj::READY_NOW;
+  }
+
+  // Note that writeChain never rejects: failures (including ones thrown synchronously by
+  // write()) are recorded in `failure` and reported to each batch's waiters instead.
+  return kj::evalNow([&]() { return output.write(b.pieces.asPtr()); })
+      .then([&b,finish]() mutable {
+    finish();
+    b.fulfiller->fulfill();
+  }, [this,&b,finish](kj::Exception&& e) mutable {
+    finish();
+    failure = kj::cp(e);
+    b.fulfiller->reject(kj::mv(e));
+  }).attach(kj::mv(batch));
+}
+
 }  // namespace capnp
@@ -51,6 +51,163 @@ kj::Promise<void> writeMessage(kj::AsyncOutputStream& output, MessageBuilder& bu
     KJ_WARN_UNUSED_RESULT;
 // Write asynchronously.  The parameters must remain valid until the returned promise resolves.
 
+class MessageStreamReader {
+  // Reads a sequence of messages from an AsyncInputStream through a buffer.
+  //
+  // The free function `readMessage()` reads the first word, the rest of the segment table, and the
+  // segment bodies separately, costing two or three reads (syscalls) per message.
+  // MessageStreamReader instead reads the stream in large chunks and parses as many complete
+  // messages out of each chunk as are present.  The MessageReaders it returns point directly into
+  // the buffer; only a message that spans the end of the buffer is moved, and a message too large
+  // to fit in the buffer at all is read into its own allocation.
+  //
+  // Each returned MessageReader holds a reference to the buffer it points into, so it may outlive
+  // the MessageStreamReader.  However, keeping a small message around also keeps its whole buffer
+  // around; callers that retain messages for a long time may want to copy them out.
+  //
+  // Messages sent with any `MessageCompression` mode are accepted.  Compressed messages are
+  // decompressed into their own allocation.
+
+public:
+  struct Options {
+    size_t bufferWords = 8192;
+    // Size of each read buffer.  Messages larger than this are read into a separate allocation.
+  };
+
+  explicit MessageStreamReader(kj::AsyncInputStream& input,
+                               ReaderOptions readerOptions = ReaderOptions());
+  MessageStreamReader(kj::AsyncInputStream& input, ReaderOptions readerOptions, Options options);
+  KJ_DISALLOW_COPY(MessageStreamReader);
+  ~MessageStreamReader() noexcept(false);
+
+  kj::Promise<kj::Own<MessageReader>> readMessage();
+  kj::Promise<kj::Maybe<kj::Own<MessageReader>>> tryReadMessage();
+  // Read the next message.  If a complete message is already buffered, the returned promise is
+  // already resolved and no read is performed.  tryReadMessage() returns null on a clean EOF
+  // (one that falls between messages).
+  //
+  // Only one read may be outstanding at a time.
+
+private:
+  struct Buffer;
+
+  kj::AsyncInputStream& input;
+  ReaderOptions readerOptions;
+  Options options;
+
+  kj::Own<Buffer> buffer;
+  size_t readPos = 0;
+  // Offset, in words, of the first byte not yet consumed by a returned message.
+
+  size_t endPos = 0;
+  // Offset, in bytes, of the end of valid data in `buffer`.  May not be word-aligned.
+
+  kj::Maybe<kj::Own<MessageReader>> tryParse(size_t& expectedWords);
+  kj::Promise<kj::Own<MessageReader>> readLarge(size_t totalWords);
+  void makeSpace(size_t words);
+};
+
+enum class MessageCompression {
+  // How MessageStreamWriter encodes each message on the wire.  MessageStreamReader accepts every
+  // mode, so only the sending side needs to choose one.  However, older versions of
+  // MessageStreamReader and the free function `readMessage()` understand only NONE; they reject
+  // any other encoding as a message with too many segments.
+
+  NONE,
+  // Standard serialization, as written by `writeMessage()`.
+
+  PACKED
+  // Each message is sent in packed encoding (see serialize-packed.h) with its own frame header
+  // recording the packed size, so that the receiver can still find message boundaries without
+  // unpacking.  A message is sent packed only if it is at least `compressionThreshold` bytes and
+  // packing actually makes it smaller.
+};
+
+class MessageStreamWriter {
+  // Writes messages to an AsyncOutputStream, coalescing messages that are queued in quick
+  // succession into a single gathered write.
+  //
+  // Calling the free function `writeMessage()` repeatedly issues one write (one syscall) per
+  // message, and a caller that wants to write a message before the previous one has completed must
+  // serialize the writes itself.  MessageStreamWriter instead collects messages into a batch.  The
+  // batch is "corked" until the current event loop turn ends or a previous batch finishes writing,
+  // whichever is later, and is then written with a single `write(pieces)` call.  A batch is also
+  // closed early once it reaches `Options::maxBatchBytes`, so that one huge burst doesn't turn into
+  // one huge write; messages queued after that point go into the next batch.
+
+public:
+  struct Options {
+    size_t maxBatchBytes = 256 * 1024;
+    // Once a batch contains at least this many bytes, further messages are placed in a new batch.
+
+    MessageCompression compression = MessageCompression::NONE;
+    size_t compressionThreshold = 1024;
+    // Messages smaller than `compressionThreshold` bytes are always sent uncompressed, since
+    // compressing them saves little and costs a copy.
+  };
+
+  explicit MessageStreamWriter(kj::AsyncOutputStream& output);
+  MessageStreamWriter(kj::AsyncOutputStream& output, Options options);
+  KJ_DISALLOW_COPY(MessageStreamWriter);
+  ~MessageStreamWriter() noexcept(false);
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments)
+      KJ_WARN_UNUSED_RESULT;
+  kj::Promise<void> write(MessageBuilder& builder) KJ_WARN_UNUSED_RESULT;
+  // Queues a message to be written.  The returned promise resolves once the batch containing the
+  // message has been written.  The segments must remain valid until then.  Dropping the promise
+  // does NOT cancel the write.
+  //
+  // If any write fails, the message's batch and all subsequent batches fail with the same
+  // exception.
+
+  kj::Promise<void> writeUrgent(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments)
+      KJ_WARN_UNUSED_RESULT;
+  kj::Promise<void> writeUrgent(MessageBuilder& builder) KJ_WARN_UNUSED_RESULT;
+  // Like write(), but the message goes ahead of all queued messages that haven't started writing
+  // yet (behind any earlier urgent ones).  Only use this for messages whose meaning doesn't
+  // depend on the messages they may overtake.
+
+  kj::Promise<void> flush() KJ_WARN_UNUSED_RESULT;
+  // Returns a promise that resolves once every message queued so far has been written.
+
+  size_t getQueuedBytes() const { return queuedBytes; }
+  // Number of bytes queued or being written but not yet known to have been written.
+
+  void setCompression(MessageCompression compression, size_t threshold = 1024) {
+    options.compression = compression;
+    options.compressionThreshold = threshold;
+  }
+  // Change compression options.  Affects messages queued after the call.
+
+private:
+  struct Batch;
+
+  kj::AsyncOutputStream& output;
+  Options options;
+
+  Batch* current = nullptr;
+  // Batch currently accepting new messages, if any.
+
+  Batch* last = nullptr;
+  // Most recently created batch, if it hasn't finished yet.
+
+  Batch* firstUnstarted = nullptr;
+  // Oldest batch that hasn't started writing yet, if any.  This is where urgent messages go.
+
+  size_t queuedBytes = 0;
+  kj::Maybe<kj::Exception> failure;
+
+  kj::Promise<void> writeChain = kj::READY_NOW;
+  // Each batch, when created, appends a step to this chain which takes ownership of the batch and
+  // writes it, so that batches are written in order and never overlap.
+
+  Batch& getBatch();
+  kj::Promise<void> addMessage(Batch& batch, kj::Vector<kj::ArrayPtr<const byte>>& pieces,
+                               kj::ArrayPtr<const kj::ArrayPtr<const word>> segments);
+  kj::Promise<void> writeBatch(kj::Own<Batch>&& batch);
+};
+
 // =======================================================================================
 // inline implementation details
 
@@ -58,4 +215,12 @@ inline kj::Promise<void> writeMessage(kj::AsyncOutputStream& output, MessageBuil
   return writeMessage(output, builder.getSegmentsForOutput());
 }
 
+inline kj::Promise<void> MessageStreamWriter::write(MessageBuilder& builder) {
+  return write(builder.getSegmentsForOutput());
+}
+
+inline kj::Promise<void> MessageStreamWriter::writeUrgent(MessageBuilder& builder) {
+  return writeUrgent(builder.getSegmentsForOutput());
+}
+
 }  // namespace capnp
@@ -0,0 +1,243 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#if CAPNP_HAS_ZLIB
+
+#include "serialize-compressed.h"
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include "test-util.h"
+#include <kj/compat/gtest.h>
+
+namespace capnp {
+namespace _ {  // private
+namespace {
+
+class VectorAsyncOutputStream final: public kj::AsyncOutputStream {
+public:
+  kj::Vector<byte> data;
+
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    data.addAll(kj::arrayPtr(reinterpret_cast<const byte*>(buffer), size));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    for (auto& piece: pieces) {
+      data.addAll(piece);
+    }
+    return kj::READY_NOW;
+  }
+};
+
+class ChunkedAsyncInputStream final: public kj::AsyncInputStream {
+  // Reads from a byte array, returning at most `maxChunk` bytes per read unless more are needed to
+  // satisfy `minBytes`.
+
+public:
+  ChunkedAsyncInputStream(kj::ArrayPtr<const byte> data, size_t maxChunk)
+      : data(data), maxChunk(maxChunk) {}
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    size_t n = kj::min(data.size(), kj::max(minBytes, kj::min(maxBytes, maxChunk)));
+    memcpy(buffer, data.begin(), n);
+    data = data.slice(n, data.size());
+    return n;
+  }
+
+private:
+  kj::ArrayPtr<const byte> data;
+  size_t maxChunk;
+};
+
+TEST(SerializeCompressed, RoundTrip) {
+  MallocMessageBuilder builder;
+  initTestMessage(builder.initRoot<TestAllTypes>());
+
+  MessageCompressor compressor;
+  kj::VectorOutputStream output;
+  for (uint i = 0; i < 3; i++) {
+    MallocMessageBuilder small;
+    small.initRoot<TestAllTypes>().setUInt32Field(i);
+    writeCompressedMessage(output, small, compressor);
+    writeCompressedMessage(output, builder, compressor);
+  }
+
+  MessageCompressor decompressor;
+  kj::ArrayInputStream input(output.getArray());
+  for (uint i = 0; i < 3; i++) {
+    {
+      CompressedMessageReader reader(input, decompressor);
+      EXPECT_EQ(i, reader.getRoot<TestAllTypes>().getUInt32Field());
+    }
+    {
+      CompressedMessageReader reader(input, decompressor);
+      checkTestMessage(reader.getRoot<TestAllTypes>());
+    }
+  }
+  EXPECT_EQ(0u, input.tryGetReadBuffer().size());
+}
+
+TEST(SerializeCompressed, SmallerThanPacked) {
+  MallocMessageBuilder builder;
+  auto list = builder.initRoot<TestAllTypes>().initStructList(100);
+  for (auto element: list) {
+    element.setTextField("the same text in every element");
+    element.setUInt32Field(12345);
+  }
+
+  MessageCompressor compressor;
+  kj::VectorOutputStream compressed;
+  writeCompressedMessage(compressed, builder, compressor);
+  kj::VectorOutputStream packed;
+  writePackedMessage(packed, builder);
+  EXPECT_LT(compressed.getArray().size() * 4, packed.getArray().size());
+}
+
+TEST(SerializeCompressed, Dictionary) {
+  MallocMessageBuilder sample;
+  initTestMessage(sample.initRoot<TestAllTypes>());
+  kj::VectorOutputStream samplePacked;
+  writePackedMessage(samplePacked, sample);
+
+  MallocMessageBuilder builder;
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  builder.getRoot<TestAllTypes>().setInt64Field(12345);
+
+  MessageCompressor plain;
+  size_t plainSize = plain.compress(builder.getSegmentsForOutput()).size();
+
+  MessageCompressor withDictionary(samplePacked.getArray());
+  auto frame = kj::heapArray(withDictionary.compress(builder.getSegmentsForOutput()));
+
+  // The message is nearly identical to the dictionary, so it should compress to a small
+  // fraction of its standalone size.
+  EXPECT_LT(frame.size() * 4, plainSize);
+
+  {
+    MessageCompressor decompressor(samplePacked.getArray());
+    kj::ArrayInputStream input(frame);
+    CompressedMessageReader reader(input, decompressor);
+    EXPECT_EQ(12345, reader.getRoot<TestAllTypes>().getInt64Field());
+    EXPECT_EQ("foo", reader.getRoot<TestAllTypes>().getTextField());
+  }
+
+  {
+    // The wrong dictionary is detected as corruption.
+    MessageCompressor decompressor;
+    kj::ArrayInputStream input(frame);
+    EXPECT_ANY_THROW(CompressedMessageReader(input, decompressor));
+  }
+}
+
+TEST(SerializeCompressed, Async) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  MallocMessageBuilder builder;
+  initTestMessage(builder.initRoot<TestAllTypes>());
+
+  MessageCompressor compressor(nullptr, Z_BEST_SPEED);
+  VectorAsyncOutputStream output;
+  for (uint i = 0; i < 3; i++) {
+    writeCompressedMessage(output, builder, compressor).wait(waitScope);
+  }
+
+  MessageCompressor decompressor;
+  ChunkedAsyncInputStream input(output.data, 7);
+  for (uint i = 0; i < 3; i++) {
+    auto reader = readCompressedMessage(input, decompressor).wait(waitScope);
+    checkTestMessage(reader->getRoot<TestAllTypes>());
+  }
+  EXPECT_TRUE(tryReadCompressedMessage(input, decompressor).wait(waitScope) == nullptr);
+}
+
+TEST(SerializeCompressed, Truncated) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  MallocMessageBuilder builder;
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  MessageCompressor compressor;
+  auto frame = kj::heapArray(compressor.compress(builder.getSegmentsForOutput()));
+
+  {
+    ChunkedAsyncInputStream input(frame.slice(0, 5), 100);
+    EXPECT_ANY_THROW(tryReadCompressedMessage(input, compressor).wait(waitScope));
+  }
+  {
+    ChunkedAsyncInputStream input(frame.slice(0, frame.size() - 1), 100);
+    EXPECT_ANY_THROW(readCompressedMessage(input, compressor).wait(waitScope));
+  }
+  {
+    // Claim a larger packed size than the frame really decompresses to.
+    auto header = reinterpret_cast<WireValue<uint32_t>*>(frame.begin());
+    header[1].set(header[1].get() + 8);
+    kj::ArrayInputStream input(frame);
+    EXPECT_ANY_THROW(CompressedMessageReader(input, compressor));
+  }
+}
+
+TEST(SerializeCompressed, DeflateArchiveCodec) {
+  auto codec = newDeflateArchiveCodec();
+  MessageArchiveWriter::Options options;
+  options.blockWords = 1024;
+  options.codec = *codec;
+
+  kj::VectorOutputStream output;
+  MessageArchiveWriter writer(output, options);
+  for (uint i = 0; i < 100; i++) {
+    MallocMessageBuilder builder;
+    auto root = builder.initRoot<TestAllTypes>();
+    initTestMessage(root);
+    root.setUInt32Field(i);
+    writer.add(builder);
+  }
+  writer.finish();
+
+  auto bytes = output.getArray();
+  auto words = kj::heapArray<word>(bytes.size() / sizeof(word));
+  memcpy(words.asBytes().begin(), bytes.begin(), words.asBytes().size());
+
+  // Repetitive test messages should compress well.
+  MallocMessageBuilder one;
+  initTestMessage(one.initRoot<TestAllTypes>());
+  EXPECT_LT(words.size(), computeSerializedSizeInWords(one) * 100 / 4);
+
+  MessageArchive archive(words, *codec);
+  EXPECT_EQ(100, archive.size());
+  archive.parallelForEach(3, [&](uint64_t index, MessageReader& reader) {
+    auto root = reader.getRoot<TestAllTypes>();
+    KJ_ASSERT(root.getUInt32Field() == index);
+    KJ_ASSERT(root.getTextField() == "foo");
+  });
+
+  // Corrupt a compressed block.
+  memset(words.slice(3, 4).asBytes().begin(), 0, sizeof(word));
+  KJ_EXPECT_THROW_MESSAGE("corrupt", MessageArchive(words, *codec).getMessage(0));
+}
+
+}  // namespace
+}  // namespace _ (private)
+}  // namespace capnp
+
+#endif  // CAPNP_HAS_ZLIB
@@ -0,0 +1,320 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#if CAPNP_HAS_ZLIB
+
+#include "serialize-compressed.h"
+#include <kj/debug.h>
+
+namespace capnp {
+
+namespace {
+
+class DeflaterDisposer final: public kj::Disposer {
+public:
+  static const DeflaterDisposer instance;
+
+protected:
+  void disposeImpl(void* pointer) const override {
+    auto ctx = reinterpret_cast<z_stream*>(pointer);
+    deflateEnd(ctx);
+    delete ctx;
+  }
+};
+const DeflaterDisposer DeflaterDisposer::instance = DeflaterDisposer();
+
+class InflaterDisposer final: public kj::Disposer {
+public:
+  static const InflaterDisposer instance;
+
+protected:
+  void disposeImpl(void* pointer) const override {
+    auto ctx = reinterpret_cast<z_stream*>(pointer);
+    inflateEnd(ctx);
+    delete ctx;
+  }
+};
+const InflaterDisposer InflaterDisposer::instance = InflaterDisposer();
+
+// Frames are raw DEFLATE streams, without zlib's or gzip's header and checksum: the frame header
+// already gives the sizes, and Cap'n Proto validates the decompressed message anyway.
+constexpr int RAW_DEFLATE_WINDOW_BITS = -15;
+
+size_t readFrameHeader(const byte* header, size_t& packedSize, ReaderOptions options) {
+  // Returns the compressed size and sets `packedSize`.
+  auto words = reinterpret_cast<const _::WireValue<uint32_t>*>(header);
+  size_t compressedSize = words[0].get();
+  packedSize = words[1].get();
+
+  // Packing expands a message by at most two bytes per word, and DEFLATE expands incompressible
+  // data by a few bytes per 16KiB block.
+  KJ_REQUIRE(packedSize / (sizeof(word) + 2) <= options.traversalLimitInWords,
+             "Compressed message exceeds traversal limit.");
+  KJ_REQUIRE(compressedSize <= packedSize + packedSize / 16 + 64,
+             "Compressed message is bigger than its contents could be.");
+  return compressedSize;
+}
+
+}  // namespace
+
+MessageCompressor::MessageCompressor(kj::ArrayPtr<const byte> dictionary, int compressionLevel)
+    : dictionary(kj::heapArray(dictionary)), compressionLevel(compressionLevel) {
+  KJ_REQUIRE(dictionary.size() <= (1u << 15), "DEFLATE dictionary can be at most 32KiB.");
+}
+
+MessageCompressor::~MessageCompressor() noexcept(false) {}
+
+kj::ArrayPtr<const byte> MessageCompressor::compress(
+    kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
+  size_t maxPackedSize = computeSerializedSizeInWords(segments) * (sizeof(word) + 2);
+  if (packBuffer.size() < maxPackedSize) {
+    packBuffer = kj::heapArray<byte>(maxPackedSize);
+  }
+  kj::ArrayOutputStream packer(packBuffer);
+  writePackedMessage(packer, segments);
+  auto packed = packer.getArray();
+
+  z_stream* ctx;
+  KJ_IF_MAYBE(d, deflater) {
+    ctx = *d;
+    KJ_ASSERT(deflateReset(ctx) == Z_OK);
+  } else {
+    ctx = new z_stream;
+    memset(ctx, 0, sizeof(*ctx));
+    int initResult =
+        deflateInit2(ctx, compressionLevel, Z_DEFLATED, RAW_DEFLATE_WINDOW_BITS,
+                     8,  // memLevel = 8 (the default)
+                     Z_DEFAULT_STRATEGY);
+    if (initResult != Z_OK) {
+      delete ctx;
+      KJ_FAIL_ASSERT("deflateInit2() failed", initResult);
+    }
+    deflater = kj::Own<z_stream>(ctx, DeflaterDisposer::instance);
+  }
+  if (dictionary.size() > 0) {
+    KJ_ASSERT(deflateSetDictionary(ctx, dictionary.begin(), dictionary.size()) == Z_OK);
+  }
+
+  size_t maxFrameSize = FRAME_HEADER_SIZE + deflateBound(ctx, packed.size());
+  if (frameBuffer.size() < maxFrameSize) {
+    frameBuffer = kj::heapArray<byte>(maxFrameSize);
+  }
+
+  ctx->next_in = packed.begin();
+  ctx->avail_in = packed.size();
+  ctx->next_out = frameBuffer.begin() + FRAME_HEADER_SIZE;
+  ctx->avail_out = frameBuffer.size() - FRAME_HEADER_SIZE;
+  int result = deflate(ctx, Z_FINISH);
+  KJ_ASSERT(result == Z_STREAM_END, "deflate() failed", result);
+
+  size_t compressedSize = ctx->total_out;
+  auto header = reinterpret_cast<_::WireValue<uint32_t>*>(frameBuffer.begin());
+  header[0].set(compressedSize);
+  header[1].set(packed.size());
+
+  return frameBuffer.slice(0, FRAME_HEADER_SIZE + compressedSize);
+}
+
+kj::Array<byte> MessageCompressor::decompress(
+    kj::ArrayPtr<const byte> compressed, size_t packedSize) {
+  z_stream* ctx;
+  KJ_IF_MAYBE(i, inflater) {
+    ctx = *i;
+    KJ_ASSERT(inflateReset(ctx) == Z_OK);
+  } else {
+    ctx = new z_stream;
+    memset(ctx, 0, sizeof(*ctx));
+    int initResult = inflateInit2(ctx, RAW_DEFLATE_WINDOW_BITS);
+    if (initResult != Z_OK) {
+      delete ctx;
+      KJ_FAIL_ASSERT("inflateInit2() failed", initResult);
+    }
+    inflater = kj::Own<z_stream>(ctx, InflaterDisposer::instance);
+  }
+  if (dictionary.size() > 0) {
+    // A raw inflater takes its dictionary up front rather than when the stream asks for it.
+    KJ_ASSERT(inflateSetDictionary(ctx, dictionary.begin(), dictionary.size()) == Z_OK);
+  }
+
+  auto packed = kj::heapArray<byte>(packedSize);
+  ctx->next_in = const_cast<byte*>(compressed.begin());
+  ctx->avail_in = compressed.size();
+  ctx->next_out = packed.begin();
+  ctx->avail_out = packed.size();
+  int result = inflate(ctx, Z_FINISH);
+  KJ_REQUIRE(result == Z_STREAM_END && ctx->avail_in == 0 && ctx->avail_out == 0,
+             "Compressed message is corrupt or doesn't match its frame header.",
+             result, ctx->msg == nullptr ? "" : ctx->msg);
+
+  return packed;
+}
+
+// =======================================================================================
+
+namespace _ {  // private
+
+InflatedMessage::InflatedMessage(kj::InputStream& input, MessageCompressor& compressor,
+                                 ReaderOptions options) {
+  byte header[MessageCompressor::FRAME_HEADER_SIZE];
+  input.read(header, sizeof(header));
+
+  size_t packedSize;
+  auto compressed = kj::heapArray<byte>(readFrameHeader(header, packedSize, options));
+  input.read(compressed.begin(), compressed.size());
+
+  packed = compressor.decompress(compressed, packedSize);
+}
+
+}  // namespace _ (private)
+
+CompressedMessageReader::CompressedMessageReader(
+    kj::InputStream& input, MessageCompressor& compressor,
+    ReaderOptions options, kj::ArrayPtr<word> scratchSpace)
+    : InflatedMessage(input, compressor, options),
+      ArrayInputStream(packed),
+      PackedMessageReader(static_cast<kj::ArrayInputStream&>(*this), options, scratchSpace) {}
+
+CompressedMessageReader::~CompressedMessageReader() noexcept(false) {}
+
+void writeCompressedMessage(kj::OutputStream& output,
+                            kj::ArrayPtr<const kj::ArrayPtr<const word>> segments,
+                            MessageCompressor& compressor) {
+  auto frame = compressor.compress(segments);
+  output.write(frame.begin(), frame.size());
+}
+
+// =======================================================================================
+
+kj::Promise<kj::Own<MessageReader>> readCompressedMessage(
+    kj::AsyncInputStream& input, MessageCompressor& compressor,
+    ReaderOptions options, kj::ArrayPtr<word> scratchSpace) {
+  return tryReadCompressedMessage(input, compressor, options, scratchSpace)
+      .then([](kj::Maybe<kj::Own<MessageReader>>&& maybeReader) -> kj::Own<MessageReader> {
+    KJ_IF_MAYBE(reader, maybeReader) {
+      return kj::mv(*reader);
+    }
+    KJ_FAIL_REQUIRE("Premature EOF.");
+  });
+}
+
+kj::Promise<kj::Maybe<kj::Own<MessageReader>>> tryReadCompressedMessage(
+    kj::AsyncInputStream& input, MessageCompressor& compressor,
+    ReaderOptions options, kj::ArrayPtr<word> scratchSpace) {
+  auto header = kj::heapArray<byte>(MessageCompressor::FRAME_HEADER_SIZE);
+  auto headerPtr = header.begin();
+  return input.tryRead(headerPtr, header.size(), header.size())
+      .then(kj::mvCapture(header, [&input, &compressor, options, scratchSpace](
+          kj::Array<byte>&& header, size_t n) -> kj::Promise<kj::Maybe<kj::Own<MessageReader>>> {
+    if (n == 0) {
+      return kj::Maybe<kj::Own<MessageReader>>(nullptr);
+    } else if (n < header.size()) {
+      KJ_FAIL_REQUIRE("Premature EOF.") {
+        return kj::Maybe<kj::Own<MessageReader>>(nullptr);
+      }
+    }
+
+    // Read the rest of the frame behind the header, then let CompressedMessageReader parse it.
+    size_t packedSize;
+    size_t compressedSize = readFrameHeader(header.begin(), packedSize, options);
+    auto frame = kj::heapArray<byte>(header.size() + compressedSize);
+    memcpy(frame.begin(), header.begin(), header.size());
+    auto body = frame.slice(header.size(), frame.size());
+    return input.read(body.begin(), body.size())
+        .then(kj::mvCapture(frame, [&compressor, options, scratchSpace](
+            kj::Array<byte>&& frame) -> kj::Maybe<kj::Own<MessageReader>> {
+      kj::ArrayInputStream frameInput(frame);
+      return kj::Own<MessageReader>(
+          kj::heap<CompressedMessageReader>(frameInput, compressor, options, scratchSpace));
+    }));
+  }));
+}
+
+kj::Promise<void> writeCompressedMessage(kj::AsyncOutputStream& output,
+                                         kj::ArrayPtr<const kj::ArrayPtr<const word>> segments,
+                                         MessageCompressor& compressor) {
+  // The compressor's buffer is reused by the next message, so the write needs its own copy.
+  auto frame = kj::heapArray(compressor.compress(segments));
+  auto promise = output.write(frame.begin(), frame.size());
+  return promise.attach(kj::mv(frame));
+}
+
+// =======================================================================================
+
+namespace {
+
+class DeflateArchiveCodec final: public ArchiveCodec {
+public:
+  explicit DeflateArchiveCodec(int compressionLevel): compressionLevel(compressionLevel) {}
+
+  uint32_t getId() const override {
+    return 0x4c464544;  // "DEFL" in little-endian.
+  }
+
+  kj::Array<byte> compress(kj::ArrayPtr<const byte> input) const override {
+    z_stream ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    int initResult = deflateInit2(&ctx, compressionLevel, Z_DEFLATED, RAW_DEFLATE_WINDOW_BITS,
+                                  8,  // memLevel = 8 (the default)
+                                  Z_DEFAULT_STRATEGY);
+    KJ_ASSERT(initResult == Z_OK, "deflateInit2() failed", initResult);
+    KJ_DEFER(deflateEnd(&ctx));
+
+    auto result = kj::heapArray<byte>(deflateBound(&ctx, input.size()));
+    ctx.next_in = const_cast<byte*>(input.begin());
+    ctx.avail_in = input.size();
+    ctx.next_out = result.begin();
+    ctx.avail_out = result.size();
+    int deflateResult = deflate(&ctx, Z_FINISH);
+    KJ_ASSERT(deflateResult == Z_STREAM_END, "deflate() failed", deflateResult);
+
+    return kj::heapArray(result.slice(0, ctx.total_out));
+  }
+
+  void decompress(kj::ArrayPtr<const byte> input, kj::ArrayPtr<byte> output) const override {
+    z_stream ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    int initResult = inflateInit2(&ctx, RAW_DEFLATE_WINDOW_BITS);
+    KJ_ASSERT(initResult == Z_OK, "inflateInit2() failed", initResult);
+    KJ_DEFER(inflateEnd(&ctx));
+
+    ctx.next_in = const_cast<byte*>(input.begin());
+    ctx.avail_in = input.size();
+    ctx.next_out = output.begin();
+    ctx.avail_out = output.size();
+    int result = inflate(&ctx, Z_FINISH);
+    KJ_REQUIRE(result == Z_STREAM_END && ctx.avail_out == 0 && ctx.avail_in == 0,
+               "Compressed archive block is corrupt.", result);
+  }
+
+private:
+  int compressionLevel;
+};
+
+}  // namespace
+
+kj::Own<ArchiveCodec> newDeflateArchiveCodec(int compressionLevel) {
+  return kj::heap<DeflateArchiveCodec>(compressionLevel);
+}
+
+}  // namespace capnp
+
+#endif  // CAPNP_HAS_ZLIB
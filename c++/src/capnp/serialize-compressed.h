@@ -0,0 +1,149 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#pragma once
+
+#if defined(__GNUC__) && !defined(CAPNP_HEADER_WARNINGS)
+#pragma GCC system_header
+#endif
+
+#include "serialize-packed.h"
+#include "message-archive.h"
+#include <kj/async-io.h>
+#include <zlib.h>
+
+namespace capnp {
+
+class MessageCompressor {
+  // Packs messages and then compresses them with DEFLATE, for links where bandwidth matters more
+  // than CPU time.  Each message is written as a self-contained frame: two little-endian 32-bit
+  // words giving the compressed size and the packed size, followed by the compressed packed
+  // message.  Packing first removes most of the zeros that DEFLATE would otherwise spend its
+  // window on, and is cheap enough that compressing packed data is faster than compressing the
+  // raw message.
+  //
+  // Small messages compress poorly on their own because DEFLATE has nothing to refer back to.
+  // A preset dictionary fixes that: pass a few typical messages, packed and concatenated (with
+  // the most common content last), and each frame may refer back into them.  The reader must use
+  // the same dictionary as the writer; frames don't record which one was used.
+  //
+  // The compressor keeps its zlib state between messages, which saves allocating and
+  // initializing a few hundred kilobytes per message.  It is not thread-safe.  One compressor may
+  // serve both directions of a stream.
+
+public:
+  explicit MessageCompressor(kj::ArrayPtr<const byte> dictionary = nullptr,
+                             int compressionLevel = Z_DEFAULT_COMPRESSION);
+  // `compressionLevel` is as for zlib's deflateInit2().  Z_BEST_SPEED is often the right choice
+  // for messages compressed on the fly.
+
+  ~MessageCompressor() noexcept(false);
+  KJ_DISALLOW_COPY(MessageCompressor);
+
+  kj::ArrayPtr<const byte> compress(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments);
+  // Packs and compresses a message into a complete frame.  The result points into a buffer owned
+  // by the compressor and remains valid until the next call to compress().
+
+  kj::Array<byte> decompress(kj::ArrayPtr<const byte> compressed, size_t packedSize);
+  // Decompresses the body of one frame back into the packed message, which must be exactly
+  // `packedSize` bytes.
+
+  static constexpr size_t FRAME_HEADER_SIZE = 2 * sizeof(uint32_t);
+
+private:
+  kj::Array<byte> dictionary;
+  int compressionLevel;
+  kj::Maybe<kj::Own<z_stream>> deflater;
+  kj::Maybe<kj::Own<z_stream>> inflater;
+  kj::Array<byte> packBuffer;
+  kj::Array<byte> frameBuffer;
+  // Grown as needed and reused across messages.
+};
+
+namespace _ {  // private
+
+class InflatedMessage {
+protected:
+  InflatedMessage(kj::InputStream& input, MessageCompressor& compressor, ReaderOptions options);
+
+  kj::Array<byte> packed;
+};
+
+}  // namespace _ (private)
+
+class CompressedMessageReader: private _::InflatedMessage, private kj::ArrayInputStream,
+                               public PackedMessageReader {
+  // Reads one frame written by `writeCompressedMessage()`.  The whole frame is read and
+  // decompressed up front; after construction the reader no longer touches `input`.
+
+public:
+  CompressedMessageReader(kj::InputStream& input, MessageCompressor& compressor,
+                          ReaderOptions options = ReaderOptions(),
+                          kj::ArrayPtr<word> scratchSpace = nullptr);
+  KJ_DISALLOW_COPY(CompressedMessageReader);
+  ~CompressedMessageReader() noexcept(false);
+};
+
+void writeCompressedMessage(kj::OutputStream& output, MessageBuilder& builder,
+                            MessageCompressor& compressor);
+void writeCompressedMessage(kj::OutputStream& output,
+                            kj::ArrayPtr<const kj::ArrayPtr<const word>> segments,
+                            MessageCompressor& compressor);
+// Write a compressed message to a stream.  The frame is written with a single write() call, so a
+// BufferedOutputStream in front of `output` is only useful for batching several messages.
+
+kj::Promise<kj::Own<MessageReader>> readCompressedMessage(
+    kj::AsyncInputStream& input, MessageCompressor& compressor,
+    ReaderOptions options = ReaderOptions(), kj::ArrayPtr<word> scratchSpace = nullptr);
+kj::Promise<kj::Maybe<kj::Own<MessageReader>>> tryReadCompressedMessage(
+    kj::AsyncInputStream& input, MessageCompressor& compressor,
+    ReaderOptions options = ReaderOptions(), kj::ArrayPtr<word> scratchSpace = nullptr);
+// Read a compressed message asynchronously.  tryReadCompressedMessage() returns null on a clean
+// EOF.  `input` and `compressor` must remain valid until the returned promise resolves;
+// `scratchSpace`, if provided, until the returned MessageReader is destroyed.
+
+kj::Promise<void> writeCompressedMessage(kj::AsyncOutputStream& output, MessageBuilder& builder,
+                                         MessageCompressor& compressor) KJ_WARN_UNUSED_RESULT;
+kj::Promise<void> writeCompressedMessage(kj::AsyncOutputStream& output,
+                                         kj::ArrayPtr<const kj::ArrayPtr<const word>> segments,
+                                         MessageCompressor& compressor) KJ_WARN_UNUSED_RESULT;
+// Write a compressed message asynchronously.  The message is compressed before this returns, so
+// only `output` must remain valid until the returned promise resolves.
+
+kj::Own<ArchiveCodec> newDeflateArchiveCodec(int compressionLevel = Z_DEFAULT_COMPRESSION);
+// Returns an ArchiveCodec (see message-archive.h) which compresses each block with raw DEFLATE.
+// The codec holds no state between calls, so it may be shared between threads.
+
+// =======================================================================================
+// inline stuff
+
+inline void writeCompressedMessage(kj::OutputStream& output, MessageBuilder& builder,
+                                   MessageCompressor& compressor) {
+  writeCompressedMessage(output, builder.getSegmentsForOutput(), compressor);
+}
+
+inline kj::Promise<void> writeCompressedMessage(
+    kj::AsyncOutputStream& output, MessageBuilder& builder, MessageCompressor& compressor) {
+  return writeCompressedMessage(output, builder.getSegmentsForOutput(), compressor);
+}
+
+}  // namespace capnp
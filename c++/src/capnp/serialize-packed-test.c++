@@ -21,6 +21,7 @@
 
 #include "serialize-packed.h"
 #include <kj/debug.h>
+#include <kj/vector.h>
 #include <kj/compat/gtest.h>
 #include <string>
 #include <stdlib.h>
@@ -252,6 +253,85 @@ private:
   uint desiredSegmentCount;
 };
 
+kj::Array<byte> referencePack(kj::ArrayPtr<const byte> unpacked) {
+  // A deliberately naive byte-by-byte implementation of the packing algorithm, used to cross-check
+  // the optimized implementation in serialize-packed.c++.
+
+  KJ_ASSERT(unpacked.size() % sizeof(word) == 0);
+  size_t wordCount = unpacked.size() / sizeof(word);
+  auto wordAt = [&](size_t i) { return unpacked.slice(i * sizeof(word), (i + 1) * sizeof(word)); };
+  auto zeroCount = [&](size_t i) {
+    uint count = 0;
+    for (byte b: wordAt(i)) count += b == 0;
+    return count;
+  };
+
+  kj::Vector<byte> result;
+  for (size_t i = 0; i < wordCount;) {
+    auto current = wordAt(i++);
+    uint8_t tag = 0;
+    for (uint j = 0; j < sizeof(word); j++) {
+      if (current[j] != 0) tag |= 1u << j;
+    }
+    result.add(tag);
+    for (byte b: current) {
+      if (b != 0) result.add(b);
+    }
+
+    if (tag == 0) {
+      uint run = 0;
+      while (run < 255 && i < wordCount && zeroCount(i) == sizeof(word)) {
+        ++run;
+        ++i;
+      }
+      result.add(run);
+    } else if (tag == 0xff) {
+      size_t runStart = i;
+      while (i - runStart < 255 && i < wordCount && zeroCount(i) < 2) {
+        ++i;
+      }
+      result.add(i - runStart);
+      result.addAll(unpacked.slice(runStart * sizeof(word), i * sizeof(word)));
+    }
+  }
+
+  return result.releaseAsArray();
+}
+
+TEST(Packed, MatchesReferenceImplementation) {
+  // Random words with varying densities of zero bytes, so that we hit every tag value as well as
+  // runs of zero and uncompressed words of various lengths.
+  uint seed = 12345;
+  auto nextRandom = [&]() {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+  };
+
+  for (uint density: {0u, 1u, 2u, 4u, 6u, 7u, 8u}) {
+    for (uint wordCount: {1u, 2u, 7u, 64u, 300u, 1000u}) {
+      auto words = kj::heapArray<word>(wordCount);
+      auto bytes = words.asBytes();
+      for (auto& b: bytes) {
+        // `density` out of 8 bytes are non-zero, on average.
+        b = nextRandom() % 8 < density ? (nextRandom() % 255) + 1 : 0;
+      }
+
+      auto packed = referencePack(bytes);
+      expectPacksTo(bytes, packed);
+    }
+  }
+
+  // All 256 tag values, in sequence.
+  auto words = kj::heapArray<word>(256);
+  auto bytes = words.asBytes();
+  for (uint tag = 0; tag < 256; tag++) {
+    for (uint j = 0; j < sizeof(word); j++) {
+      bytes[tag * sizeof(word) + j] = (tag & (1u << j)) ? 0x80 + j : 0;
+    }
+  }
+  expectPacksTo(bytes, referencePack(bytes));
+}
+
 TEST(Packed, RoundTrip) {
   TestMessageBuilder builder(1);
   initTestMessage(builder.initRoot<TestAllTypes>());
@@ -24,10 +24,89 @@
 #include "layout.h"
 #include <vector>
 
+#if __SSSE3__
+#include <tmmintrin.h>
+#elif __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#if __BMI2__
+#include <immintrin.h>
+#endif
+
 namespace capnp {
 
 namespace _ {  // private
 
+namespace {
+
+// Word-at-a-time helpers.
+//
+// The naive way to compute a tag byte is to compare each of the eight bytes of a word against
+// zero.  Instead, we load the whole word into a register and compute a mask of its non-zero bytes
+// with a few arithmetic operations, then gather the high bit of each byte into the tag with a
+// single multiply.  The gathering trick assumes that byte i of the word is bits 8i..8i+7 of the
+// integer, i.e. that we are on a little-endian machine; otherwise we fall back to the byte loop.
+//
+// When the target supports byte shuffles (SSSE3 or NEON), unpacking also happens a word at a time:
+// we compute, for each output byte, the index of the input byte it comes from (or an out-of-range
+// index if the output byte is zero) and then perform a single shuffle.  Likewise, with BMI2,
+// packing uses PEXT to squeeze out the zero bytes.  Which implementation is used is decided at
+// compile time based on the target's instruction set; all produce bit-identical output.
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CAPNP_PACKED_WORD_AT_A_TIME 1
+
+inline uint64_t loadWord(const uint8_t* ptr) {
+  uint64_t result;
+  memcpy(&result, ptr, sizeof(result));
+  return result;
+}
+
+inline uint64_t nonzeroByteMask(uint64_t value) {
+  // Returns a word in which the high bit of each byte is set iff the corresponding byte of
+  // `value` is non-zero, and all other bits are clear.  Adding 0x7f to the low seven bits of a
+  // byte never carries into the next byte.
+  return (((value & 0x7f7f7f7f7f7f7f7full) + 0x7f7f7f7f7f7f7f7full) | value)
+      & 0x8080808080808080ull;
+}
+
+inline uint8_t tagForMask(uint64_t mask) {
+  // Gathers the high bit of each byte of `mask` into a single byte.
+  return ((mask >> 7) * 0x0102040810204080ull) >> 56;
+}
+
+#if __SSSE3__ || __ARM_NEON
+inline uint64_t unpackShuffleIndices(uint8_t tag) {
+  // For each byte whose tag bit is set, computes the number of set tag bits below it, which is
+  // the position of that byte within the packed data.  Bytes whose tag bit is clear get 0x80,
+  // which both PSHUFB and VTBL treat as "produce zero".
+  uint64_t bits = (tag * 0x0101010101010101ull) & 0x8040201008040201ull;
+  bits = nonzeroByteMask(bits) >> 7;
+  uint64_t exclusivePrefix = bits * 0x0101010101010101ull - bits;
+  return exclusivePrefix | ((bits ^ 0x0101010101010101ull) << 7);
+}
+
+inline void unpackWord(uint8_t tag, const uint8_t* in, uint8_t* out) {
+  // Expands the packed bytes at `in` into a full word at `out`.  Always reads eight bytes from
+  // `in`, even if fewer are significant, so the caller must ensure they are readable.
+#if __SSSE3__
+  __m128i src = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in));
+  __m128i indices = _mm_set_epi64x(0, unpackShuffleIndices(tag));
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(src, indices));
+#else
+  uint8x8_t src = vld1_u8(in);
+  uint8x8_t indices = vcreate_u8(unpackShuffleIndices(tag));
+  vst1_u8(out, vtbl1_u8(src, indices));
+#endif
+}
+#define CAPNP_PACKED_SHUFFLE 1
+#endif  // __SSSE3__ || __ARM_NEON
+
+#endif  // little-endian
+
+}  // namespace
+
 PackedInputStream::PackedInputStream(kj::BufferedInputStream& inner): inner(inner) {}
 PackedInputStream::~PackedInputStream() noexcept(false) {}
 
@@ -100,6 +179,12 @@ size_t PackedInputStream::tryRead(void* dst, size_t minBytes, size_t maxBytes) {
     } else {
       tag = *in++;
 
+#if CAPNP_PACKED_SHUFFLE
+      // We have at least nine bytes left in the buffer, so it's safe to read a whole word.
+      unpackWord(tag, in, out);
+      in += kj::popCount(tag);
+      out += sizeof(word);
+#else
 #define HANDLE_BYTE(n) \
       { \
          bool isNonzero = (tag & (1u << n)) != 0; \
@@ -116,6 +201,7 @@ size_t PackedInputStream::tryRead(void* dst, size_t minBytes, size_t maxBytes) {
       HANDLE_BYTE(6);
       HANDLE_BYTE(7);
 #undef HANDLE_BYTE
+#endif
     }
 
     if (tag == 0) {
@@ -327,6 +413,35 @@ void PackedOutputStream::write(const void* src, size_t size) {
 
     uint8_t* tagPos = out++;
 
+#if CAPNP_PACKED_WORD_AT_A_TIME
+    uint64_t inWord = loadWord(in);
+    uint64_t mask = nonzeroByteMask(inWord);
+    uint8_t tag = tagForMask(mask);
+
+#if __BMI2__
+    // Squeeze out the zero bytes.  We always store a full word; we have at least nine bytes of
+    // space after the tag, and the garbage past the packed bytes will be overwritten.
+    uint64_t packedWord = _pext_u64(inWord, (mask >> 7) * 0xff);
+    memcpy(out, &packedWord, sizeof(packedWord));
+    out += kj::popCount(tag);
+    in += sizeof(word);
+#else
+#define HANDLE_BYTE(n) \
+    *out = *in; \
+    out += (tag >> n) & 1; /* out only advances if the byte was non-zero */ \
+    ++in
+
+    HANDLE_BYTE(0);
+    HANDLE_BYTE(1);
+    HANDLE_BYTE(2);
+    HANDLE_BYTE(3);
+    HANDLE_BYTE(4);
+    HANDLE_BYTE(5);
+    HANDLE_BYTE(6);
+    HANDLE_BYTE(7);
+#undef HANDLE_BYTE
+#endif  // __BMI2__, else
+#else
 #define HANDLE_BYTE(n) \
     uint8_t bit##n = *in != 0; \
     *out = *in; \
@@ -345,6 +460,7 @@ void PackedOutputStream::write(const void* src, size_t size) {
 
     uint8_t tag = (bit0 << 0) | (bit1 << 1) | (bit2 << 2) | (bit3 << 3)
                 | (bit4 << 4) | (bit5 << 5) | (bit6 << 6) | (bit7 << 7);
+#endif  // CAPNP_PACKED_WORD_AT_A_TIME, else
     *tagPos = tag;
 
     if (tag == 0) {
@@ -389,6 +505,10 @@ void PackedOutputStream::write(const void* src, size_t size) {
 
       while (in < limit) {
         // Check eight input bytes for zeros.
+#if CAPNP_PACKED_WORD_AT_A_TIME
+        uint c = 8 - kj::popCount(tagForMask(nonzeroByteMask(loadWord(in))));
+        in += sizeof(word);
+#else
         uint c = *in++ == 0;
         c += *in++ == 0;
         c += *in++ == 0;
@@ -397,6 +517,7 @@ void PackedOutputStream::write(const void* src, size_t size) {
         c += *in++ == 0;
         c += *in++ == 0;
         c += *in++ == 0;
+#endif
 
         if (c >= 2) {
           // Un-read the word with multiple zeros, since we'll want to compress that one.
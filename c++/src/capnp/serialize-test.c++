@@ -23,6 +23,9 @@
 #include <kj/debug.h>
 #include <kj/compat/gtest.h>
 #include <kj/miniposix.h>
+#if !CAPNP_LITE
+#include <kj/filesystem.h>
+#endif
 #include <string>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -370,6 +373,43 @@ TEST(Serialize, WriteMessageEvenSegmentCount) {
   EXPECT_TRUE(output.dataEquals(serialized.asPtr()));
 }
 
+TEST(Serialize, CompactMessage) {
+  TestMessageBuilder builder(10);
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  ASSERT_EQ(10u, builder.getSegmentsForOutput().size());
+
+  auto size = builder.getRoot<AnyPointer>().asReader().targetSize();
+  kj::Array<word> compacted = KJ_ASSERT_NONNULL(compactMessage(builder));
+  EXPECT_EQ(size.wordCount + 1, compacted.size());
+
+  kj::ArrayPtr<const word> segments[1] = { compacted };
+  SegmentArrayMessageReader reader(segments);
+  checkTestMessage(reader.getRoot<TestAllTypes>());
+
+  CompactionOptions options;
+  options.minSegments = 11;
+  EXPECT_TRUE(compactMessage(builder, options) == nullptr);
+  options.minSegments = 2;
+  options.maxWords = 16;
+  EXPECT_TRUE(compactMessage(builder, options) == nullptr);
+
+  TestMessageBuilder singleSegment(1);
+  initTestMessage(singleSegment.initRoot<TestAllTypes>());
+  EXPECT_TRUE(compactMessage(singleSegment) == nullptr);
+}
+
+TEST(Serialize, WriteCompactedMessage) {
+  TestMessageBuilder builder(7);
+  initTestMessage(builder.initRoot<TestAllTypes>());
+
+  TestOutputStream output;
+  writeCompactedMessage(output, builder);
+
+  kj::Array<word> compacted = KJ_ASSERT_NONNULL(compactMessage(builder));
+  kj::ArrayPtr<const word> segments[1] = { compacted };
+  EXPECT_TRUE(output.dataEquals(messageToFlatArray(segments)));
+}
+
 #if _WIN32
 int mkstemp(char *tpl) {
   char* end = tpl + strlen(tpl);
@@ -434,6 +474,78 @@ TEST(Serialize, FileDescriptors) {
   }
 }
 
+#if !CAPNP_LITE
+TEST(Serialize, MappedFile) {
+  auto file = kj::newInMemoryFile(kj::nullClock());
+
+  {
+    TestMessageBuilder builder(7);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    auto words = messageToFlatArray(builder);
+    file->write(0, words.asBytes());
+  }
+
+  MappedFileMessageReader reader(*file);
+  checkTestMessage(reader.getRoot<TestAllTypes>());
+}
+
+TEST(Serialize, MappedFileStream) {
+#if _WIN32 || __ANDROID__
+  char filename[] = "capnproto-serialize-test-XXXXXX";
+#else
+  char filename[] = "/tmp/capnproto-serialize-test-XXXXXX";
+#endif
+  kj::AutoCloseFd tmpfile(mkstemp(filename));
+  ASSERT_GE(tmpfile.get(), 0);
+
+#if !_WIN32
+  EXPECT_EQ(0, unlink(filename));
+#endif
+
+  {
+    TestMessageBuilder builder(7);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    writeMessageToFd(tmpfile.get(), builder);
+  }
+
+  for (uint i = 0; i < 3; i++) {
+    TestMessageBuilder builder(1);
+    builder.initRoot<TestAllTypes>().setUInt32Field(i);
+    writeMessageToFd(tmpfile.get(), builder);
+  }
+
+  auto file = kj::newDiskReadableFile(kj::mv(tmpfile));
+
+  {
+    MappedFileMessageReader reader(*file);
+    checkTestMessage(reader.getRoot<TestAllTypes>());
+  }
+
+  MappedFileMessageStream stream(*file);
+  uint count = 0;
+  stream.forEach([&](MessageReader& message) {
+    auto root = message.getRoot<TestAllTypes>();
+    if (count == 0) {
+      checkTestMessage(root);
+    } else {
+      EXPECT_EQ(count - 1, root.getUInt32Field());
+    }
+    ++count;
+  });
+  EXPECT_EQ(4u, count);
+  EXPECT_TRUE(stream.atEnd());
+}
+
+TEST(Serialize, MappedFileEmpty) {
+  auto file = kj::newInMemoryFile(kj::nullClock());
+  MappedFileMessageStream stream(*file);
+  EXPECT_TRUE(stream.atEnd());
+  stream.forEach([](MessageReader&) {
+    ADD_FAILURE() << "Empty file should contain no messages.";
+  });
+}
+#endif  // !CAPNP_LITE
+
 TEST(Serialize, RejectTooManySegments) {
   kj::Array<word> data = kj::heapArray<word>(8192);
   WireValue<uint32_t>* table = reinterpret_cast<WireValue<uint32_t>*>(data.begin());
@@ -22,6 +22,7 @@
 #include "serialize-text.h"
 #include <kj/compat/gtest.h>
 #include <kj/string.h>
+#include <kj/io.h>
 #include <capnp/pretty-print.h>
 #include <capnp/message.h>
 #include "test-util.h"
@@ -66,6 +67,27 @@ KJ_TEST("TestAllTypes") {
   }
 }
 
+KJ_TEST("encode to stream") {
+  MallocMessageBuilder builder;
+  auto root = builder.initRoot<TestAllTypes>();
+  initTestMessage(root);
+  // Make the output bigger than the printer's internal buffer so that it is flushed more than
+  // once.
+  auto list = root.initStructList(1000);
+  for (auto i: kj::indices(list)) {
+    initTestMessage(list[i]);
+  }
+
+  for (bool pretty: {false, true}) {
+    TextCodec codec;
+    codec.setPrettyPrint(pretty);
+
+    kj::VectorOutputStream output;
+    codec.encode(root.asReader(), output);
+    KJ_EXPECT(kj::heapString(output.getArray().asChars()) == codec.encode(root.asReader()));
+  }
+}
+
 KJ_TEST("TestDefaults") {
   MallocMessageBuilder builder;
   initTestMessage(builder.initRoot<TestDefaults>());
@@ -111,6 +111,14 @@ kj::String TextCodec::encode(DynamicValue::Reader value) const {
   }
 }
 
+void TextCodec::encode(DynamicValue::Reader value, kj::OutputStream& output) const {
+  if (prettyPrint) {
+    capnp::prettyPrintTo(value, output);
+  } else {
+    capnp::printTo(value, output);
+  }
+}
+
 void TextCodec::decode(kj::StringPtr input, DynamicStruct::Builder output) const {
   lexAndParseExpression(input, [&output](compiler::Expression::Reader expression) {
     KJ_REQUIRE(expression.isTuple(), "Input does not contain a struct.");
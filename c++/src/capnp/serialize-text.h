@@ -30,6 +30,8 @@
 #include "orphan.h"
 #include "schema.h"
 
+namespace kj { class OutputStream; }
+
 namespace capnp {
 
 class TextCodec {
@@ -60,6 +62,10 @@ public:
   kj::String encode(DynamicValue::Reader value) const;
   // Encode any Cap'n Proto value.
 
+  void encode(DynamicValue::Reader value, kj::OutputStream& output) const;
+  // Encode any Cap'n Proto value, writing the text to `output` as it is produced rather than
+  // returning it as one string.
+
   template <typename T>
   Orphan<T> decode(kj::StringPtr input, Orphanage orphanage) const;
   // Decode a text message into a Cap'n Proto object of type T, allocated in the given
@@ -24,6 +24,10 @@
 #include <kj/debug.h>
 #include <exception>
 
+#if !CAPNP_LITE
+#include <kj/filesystem.h>
+#endif
+
 namespace capnp {
 
 FlatArrayMessageReader::FlatArrayMessageReader(
@@ -269,6 +273,31 @@ void readMessageCopy(kj::InputStream& input, MessageBuilder& target,
 
 // -------------------------------------------------------------------
 
+kj::Maybe<kj::Array<word>> compactMessage(MessageBuilder& builder, CompactionOptions options) {
+  KJ_REQUIRE(bounded(options.maxWords) * WORDS <= MAX_SEGMENT_WORDS,
+             "CompactionOptions::maxWords exceeds the maximum segment size");
+
+  auto segments = builder.getSegmentsForOutput();
+  if (segments.size() < options.minSegments) return nullptr;
+
+  size_t totalWords = 0;
+  for (auto segment: segments) totalWords += segment.size();
+  if (totalWords > options.maxWords) return nullptr;
+
+  auto root = builder.getRoot<AnyPointer>().asReader();
+  auto size = root.targetSize();
+  if (size.capCount > 0) return nullptr;
+
+  // Copying allocates each object once, in order, so the copy exactly fills a segment of the
+  // message's target size plus the root pointer.
+  auto result = kj::heapArray<word>(size.wordCount + 1);
+  memset(result.asBytes().begin(), 0, result.asBytes().size());
+  FlatMessageBuilder flat(result);
+  flat.setRoot(root);
+  flat.requireFilled();
+  return kj::mv(result);
+}
+
 void writeMessage(kj::OutputStream& output, kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
   KJ_REQUIRE(segments.size() > 0, "Tried to serialize uninitialized message.");
 
@@ -300,6 +329,16 @@ void writeMessage(kj::OutputStream& output, kj::ArrayPtr<const kj::ArrayPtr<cons
 
 StreamFdMessageReader::~StreamFdMessageReader() noexcept(false) {}
 
+void writeCompactedMessage(kj::OutputStream& output, MessageBuilder& builder,
+                           CompactionOptions options) {
+  KJ_IF_MAYBE(segment, compactMessage(builder, options)) {
+    kj::ArrayPtr<const word> segments[1] = { *segment };
+    writeMessage(output, segments);
+  } else {
+    writeMessage(output, builder);
+  }
+}
+
 void writeMessageToFd(int fd, kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
   kj::FdOutputStream stream(fd);
   writeMessage(stream, segments);
@@ -311,4 +350,41 @@ void readMessageCopyFromFd(int fd, MessageBuilder& target,
   readMessageCopy(stream, target, options, scratchSpace);
 }
 
+#if !CAPNP_LITE
+// =======================================================================================
+
+namespace _ {  // private
+
+MappedMessageFile::MappedMessageFile(const kj::ReadableFile& file) {
+  uint64_t size = file.stat().size;
+  KJ_REQUIRE(size % sizeof(word) == 0,
+      "Message file size is not a multiple of the word size; file is probably truncated.", size) {
+    size -= size % sizeof(word);
+    break;
+  }
+
+  if (size > 0) {
+    mapping = file.mmap(0, size);
+    KJ_REQUIRE(reinterpret_cast<uintptr_t>(mapping.begin()) % sizeof(word) == 0,
+               "mmap() returned misaligned memory.");
+    words = kj::arrayPtr(reinterpret_cast<const word*>(mapping.begin()), size / sizeof(word));
+  }
+}
+
+}  // namespace _ (private)
+
+MappedFileMessageReader::MappedFileMessageReader(
+    const kj::ReadableFile& file, ReaderOptions options)
+    : MappedMessageFile(file), FlatArrayMessageReader(words, options) {}
+
+MappedFileMessageReader::~MappedFileMessageReader() noexcept(false) {}
+
+MappedFileMessageStream::MappedFileMessageStream(
+    const kj::ReadableFile& file, ReaderOptions options)
+    : MappedMessageFile(file), options(options), remaining(words) {}
+
+MappedFileMessageStream::~MappedFileMessageStream() noexcept(false) {}
+
+#endif  // !CAPNP_LITE
+
 }  // namespace capnp
@@ -47,6 +47,10 @@
 #include "message.h"
 #include <kj/io.h>
 
+namespace kj {
+  class ReadableFile;
+}
+
 namespace capnp {
 
 class FlatArrayMessageReader: public MessageReader {
@@ -107,6 +111,24 @@ size_t computeSerializedSizeInWords(MessageBuilder& builder);
 size_t computeSerializedSizeInWords(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments);
 // Version of computeSerializedSizeInWords that takes a raw segment array.
 
+struct CompactionOptions {
+  uint minSegments = 2;
+  // Only messages with at least this many segments are compacted.
+
+  size_t maxWords = 1u << 24;
+  // Messages larger than this (128 MiB by default) are left alone, since compaction copies the
+  // whole message. Must not exceed the maximum segment size.
+};
+
+kj::Maybe<kj::Array<word>> compactMessage(
+    MessageBuilder& builder, CompactionOptions options = CompactionOptions());
+// If the message has been split across several segments, copies it into a single segment in
+// which every pointer is a near pointer, so that whoever reads it doesn't have to follow far
+// pointers. Space the builder had allocated but no longer uses (e.g. abandoned orphans) is left
+// out. Returns the new segment, or null if the message didn't meet the thresholds in `options`.
+//
+// Messages containing capabilities are never compacted, since the copy would renumber them.
+
 size_t expectedSizeInWordsFromPrefix(kj::ArrayPtr<const word> messagePrefix);
 // Given a prefix of a serialized message, try to determine the expected total size of the message,
 // in words. The returned size is based on the information known so far; it may be an underestimate
@@ -167,6 +189,11 @@ void writeMessage(kj::OutputStream& output, MessageBuilder& builder);
 void writeMessage(kj::OutputStream& output, kj::ArrayPtr<const kj::ArrayPtr<const word>> segments);
 // Write the segment array to the given output stream.
 
+void writeCompactedMessage(kj::OutputStream& output, MessageBuilder& builder,
+                           CompactionOptions options = CompactionOptions());
+// Like writeMessage(), but first compacts the message into a single segment as described under
+// `compactMessage()`, if it meets the thresholds in `options`.
+
 // =======================================================================================
 // Specializations for reading from / writing to file descriptors.
 
@@ -212,6 +239,65 @@ void writeMessageToFd(int fd, kj::ArrayPtr<const kj::ArrayPtr<const word>> segme
 // you catch this exception at the call site.  If throwing an exception is not acceptable, you
 // can implement your own OutputStream with arbitrary error handling and then use writeMessage().
 
+#if !CAPNP_LITE
+// =======================================================================================
+// Reading from mmap()ed files.
+
+namespace _ {  // private
+
+class MappedMessageFile {
+protected:
+  MappedMessageFile() = default;
+  explicit MappedMessageFile(const kj::ReadableFile& file);
+
+  kj::Array<const byte> mapping;
+  kj::ArrayPtr<const word> words;
+};
+
+}  // namespace _ (private)
+
+class MappedFileMessageReader: private _::MappedMessageFile, public FlatArrayMessageReader {
+  // A MessageReader that maps a file into memory using `kj::ReadableFile::mmap()` and reads the
+  // message directly out of the mapping.  Unlike `StreamFdMessageReader`, no segment data is
+  // copied; segments are simply views into the mapped pages.
+  //
+  // The file is expected to contain a message in the format written by `writeMessage()`.  If the
+  // file contains several concatenated messages, only the first is read; use
+  // `MappedFileMessageStream` to iterate over all of them.
+
+public:
+  explicit MappedFileMessageReader(const kj::ReadableFile& file,
+                                   ReaderOptions options = ReaderOptions());
+  ~MappedFileMessageReader() noexcept(false);
+};
+
+class MappedFileMessageStream: private _::MappedMessageFile {
+  // Maps a file containing any number of concatenated messages (e.g. a log written by calling
+  // `writeMessage()` repeatedly) and iterates over them in-place.
+
+public:
+  explicit MappedFileMessageStream(const kj::ReadableFile& file,
+                                   ReaderOptions options = ReaderOptions());
+  ~MappedFileMessageStream() noexcept(false);
+
+  template <typename Func>
+  void forEach(Func&& func);
+  // Calls `func(MessageReader&)` for each remaining message in the file, in order.  The reader
+  // passed to `func` is only valid for the duration of the call.
+
+  bool atEnd() const { return remaining.size() == 0; }
+  // Returns true if all messages have been consumed.
+
+  kj::ArrayPtr<const word> getRemaining() const { return remaining; }
+  // Returns the part of the mapping that has not yet been consumed.
+
+private:
+  ReaderOptions options;
+  kj::ArrayPtr<const word> remaining;
+};
+
+#endif  // !CAPNP_LITE
+
 // =======================================================================================
 // inline stuff
 
@@ -231,4 +317,16 @@ inline void writeMessageToFd(int fd, MessageBuilder& builder) {
   writeMessageToFd(fd, builder.getSegmentsForOutput());
 }
 
+#if !CAPNP_LITE
+template <typename Func>
+void MappedFileMessageStream::forEach(Func&& func) {
+  while (remaining.size() > 0) {
+    FlatArrayMessageReader reader(remaining, options);
+    auto rest = kj::arrayPtr(reader.getEnd(), remaining.end());
+    func(static_cast<MessageReader&>(reader));
+    remaining = rest;
+  }
+}
+#endif  // !CAPNP_LITE
+
 }  // namespace capnp
@@ -20,7 +20,9 @@
 // THE SOFTWARE.
 
 #include "dynamic.h"
+#include "pretty-print.h"
 #include <kj/debug.h>
+#include <kj/io.h>
 #include <kj/vector.h>
 #include <kj/encoding.h>
 
@@ -227,8 +229,200 @@ static kj::StringTree print(const DynamicValue::Reader& value,
   KJ_UNREACHABLE;
 }
 
+// -----------------------------------------------------------------------------
+// Flat (non-indented) printing
+//
+// Produces exactly the same text as print() with indentation disabled, but appends it to a single
+// buffer instead of building a StringTree out of one small string per value.
+
+class FlatPrinter {
+public:
+  explicit FlatPrinter(kj::OutputStream* stream = nullptr): stream(stream) {}
+  KJ_DISALLOW_COPY(FlatPrinter);
+
+  void print(const DynamicValue::Reader& value, schema::Type::Which which) {
+    switch (value.getType()) {
+      case DynamicValue::UNKNOWN:
+        write("?");
+        return;
+      case DynamicValue::VOID:
+        write("void");
+        return;
+      case DynamicValue::BOOL:
+        write(value.as<bool>() ? "true" : "false");
+        return;
+      case DynamicValue::INT:
+        writeNumber(value.as<int64_t>());
+        return;
+      case DynamicValue::UINT:
+        writeNumber(value.as<uint64_t>());
+        return;
+      case DynamicValue::FLOAT:
+        if (which == schema::Type::FLOAT32) {
+          writeNumber(value.as<float>());
+        } else {
+          writeNumber(value.as<double>());
+        }
+        return;
+      case DynamicValue::TEXT:
+        writeQuoted(value.as<Text>().asBytes());
+        return;
+      case DynamicValue::DATA:
+        writeQuoted(value.as<Data>());
+        return;
+      case DynamicValue::LIST: {
+        auto listValue = value.as<DynamicList>();
+        auto elementWhich = listValue.getSchema().whichElementType();
+        buffer.add('[');
+        for (uint i = 0; i < listValue.size(); i++) {
+          if (i > 0) write(", ");
+          print(listValue[i], elementWhich);
+        }
+        buffer.add(']');
+        maybeFlush();
+        return;
+      }
+      case DynamicValue::ENUM: {
+        auto enumValue = value.as<DynamicEnum>();
+        KJ_IF_MAYBE(enumerant, enumValue.getEnumerant()) {
+          write(enumerant->getProto().getName());
+        } else {
+          // Unknown enum value; output raw number.
+          buffer.add('(');
+          writeNumber(enumValue.getRaw());
+          buffer.add(')');
+        }
+        return;
+      }
+      case DynamicValue::STRUCT:
+        printStruct(value.as<DynamicStruct>());
+        return;
+      case DynamicValue::CAPABILITY:
+        write("<external capability>");
+        return;
+      case DynamicValue::ANY_POINTER:
+        write("<opaque pointer>");
+        return;
+    }
+
+    KJ_UNREACHABLE;
+  }
+
+  kj::String finish() {
+    buffer.add('\0');
+    return kj::String(buffer.releaseAsArray());
+  }
+
+  void flush() {
+    stream->write(buffer.begin(), buffer.size());
+    buffer.clear();
+  }
+
+private:
+  kj::OutputStream* stream;
+  kj::Vector<char> buffer;
+
+  static constexpr size_t FLUSH_THRESHOLD = 8192;
+
+  void maybeFlush() {
+    if (stream != nullptr && buffer.size() >= FLUSH_THRESHOLD) {
+      flush();
+    }
+  }
+
+  void write(kj::StringPtr text) {
+    buffer.addAll(text);
+  }
+
+  template <typename T>
+  void writeNumber(T value) {
+    auto chars = kj::toCharSequence(value);
+    buffer.addAll(chars.begin(), chars.end());
+  }
+
+  void writeQuoted(kj::ArrayPtr<const byte> bytes) {
+    // Same escaping as kj::encodeCEscape().
+
+    static const char DIGITS[] = "01234567";
+
+    buffer.reserve(buffer.size() + bytes.size() + 2);
+    buffer.add('"');
+    for (byte b: bytes) {
+      switch (b) {
+        case '\a': write("\\a"); break;
+        case '\b': write("\\b"); break;
+        case '\f': write("\\f"); break;
+        case '\n': write("\\n"); break;
+        case '\r': write("\\r"); break;
+        case '\t': write("\\t"); break;
+        case '\v': write("\\v"); break;
+        case '\'': write("\\\'"); break;
+        case '\"': write("\\\""); break;
+        case '\\': write("\\\\"); break;
+        default:
+          if (b < 0x20 || b == 0x7f) {
+            buffer.add('\\');
+            buffer.add(DIGITS[b / 64]);
+            buffer.add(DIGITS[(b / 8) % 8]);
+            buffer.add(DIGITS[b % 8]);
+          } else {
+            buffer.add(b);
+          }
+          break;
+      }
+    }
+    buffer.add('"');
+    maybeFlush();
+  }
+
+  void printField(const DynamicStruct::Reader& structValue, StructSchema::Field field,
+                  bool& first) {
+    if (!first) write(", ");
+    first = false;
+    write(field.getProto().getName());
+    write(" = ");
+    print(structValue.get(field), whichFieldType(field));
+  }
+
+  void printStruct(const DynamicStruct::Reader& structValue) {
+    // Same field order as print(): the union member, if printed at all, goes where it falls by
+    // field index.
+
+    auto which = structValue.which();
+    KJ_IF_MAYBE(field, which) {
+      // Even if the union field has its default value, if it is not the default field of the
+      // union then we have to print it anyway.
+      if (field->getProto().getDiscriminantValue() == 0 && !structValue.has(*field)) {
+        which = nullptr;
+      }
+    }
+
+    bool first = true;
+    buffer.add('(');
+    for (auto field: structValue.getSchema().getNonUnionFields()) {
+      KJ_IF_MAYBE(unionField, which) {
+        if (unionField->getIndex() < field.getIndex()) {
+          printField(structValue, *unionField, first);
+          which = nullptr;
+        }
+      }
+      if (structValue.has(field)) {
+        printField(structValue, field, first);
+      }
+    }
+    KJ_IF_MAYBE(unionField, which) {
+      // Union value is last.
+      printField(structValue, *unionField, first);
+    }
+    buffer.add(')');
+    maybeFlush();
+  }
+};
+
 kj::StringTree stringify(DynamicValue::Reader value) {
-  return print(value, schema::Type::STRUCT, Indent(false), BARE);
+  FlatPrinter printer;
+  printer.print(value, schema::Type::STRUCT);
+  return kj::StringTree(printer.finish());
 }
 
 }  // namespace
@@ -244,6 +438,31 @@ kj::StringTree prettyPrint(DynamicList::Reader value) {
 kj::StringTree prettyPrint(DynamicStruct::Builder value) { return prettyPrint(value.asReader()); }
 kj::StringTree prettyPrint(DynamicList::Builder value) { return prettyPrint(value.asReader()); }
 
+void printTo(DynamicValue::Reader value, kj::OutputStream& output) {
+  FlatPrinter printer(&output);
+  printer.print(value, schema::Type::STRUCT);
+  printer.flush();
+}
+
+void prettyPrintTo(DynamicValue::Reader value, kj::OutputStream& output) {
+  kj::StringTree text;
+  switch (value.getType()) {
+    case DynamicValue::STRUCT:
+      text = prettyPrint(value.as<DynamicStruct>());
+      break;
+    case DynamicValue::LIST:
+      text = prettyPrint(value.as<DynamicList>());
+      break;
+    default:
+      printTo(value, output);
+      return;
+  }
+
+  text.visit([&](kj::ArrayPtr<const char> piece) {
+    output.write(piece.begin(), piece.size());
+  });
+}
+
 kj::StringTree KJ_STRINGIFY(const DynamicValue::Reader& value) { return stringify(value); }
 kj::StringTree KJ_STRINGIFY(const DynamicValue::Builder& value) { return stringify(value.asReader()); }
 kj::StringTree KJ_STRINGIFY(DynamicEnum value) { return stringify(value); }
@@ -21,8 +21,11 @@
 
 #include "arena.h"
 #include "debug.h"
+#include "thread.h"
+#include "vector.h"
 #include <kj/compat/gtest.h>
 #include <stdint.h>
+#include <atomic>
 
 namespace kj {
 namespace {
@@ -304,5 +307,91 @@ TEST(Arena, Strings) {
   EXPECT_EQ(quux.end() + 1, corge.begin());
 }
 
+TEST(Arena, Reset) {
+  TestObject::count = 0;
+  TestObject::throwAt = -1;
+
+  Arena arena(64);
+
+  arena.allocate<TestObject>();
+  arena.allocateArray<TestObject>(4);
+  EXPECT_EQ(5, TestObject::count);
+
+  // Fill a few chunks, each larger than the last.
+  for (uint i = 0; i < 100; i++) arena.allocate<uint64_t>(i);
+
+  arena.reset();
+  EXPECT_EQ(0, TestObject::count);
+
+  // Allocation starts over at the beginning of the kept chunk, so a second round of the same
+  // requests lands at the same address.
+  uint64_t* first = &arena.allocate<uint64_t>(1);
+  arena.reset();
+  EXPECT_EQ(first, &arena.allocate<uint64_t>(2));
+
+  arena.allocate<TestObject>();
+  EXPECT_EQ(1, TestObject::count);
+  arena.reset();
+  EXPECT_EQ(0, TestObject::count);
+}
+
+TEST(Arena, ResetScratch) {
+  alignas(8) byte scratch[256];
+  Arena arena(arrayPtr(scratch, sizeof(scratch)));
+
+  StringPtr foo = arena.copyString("foo");
+  EXPECT_TRUE(foo.begin() >= reinterpret_cast<char*>(scratch) &&
+              foo.end() < reinterpret_cast<char*>(scratch + sizeof(scratch)));
+
+  arena.reset();
+  EXPECT_EQ(foo.begin(), arena.copyString("bar").begin());
+}
+
+struct ConcurrentTestObject {
+  ConcurrentTestObject(uint value): value(value) { ++liveCount; }
+  ~ConcurrentTestObject() { --liveCount; }
+
+  uint value;
+  static std::atomic<int> liveCount;
+};
+std::atomic<int> ConcurrentTestObject::liveCount(0);
+
+TEST(Arena, Concurrent) {
+  constexpr uint THREADS = 8;
+  constexpr uint PER_THREAD = 10000;
+
+  {
+    ConcurrentArena arena(1024);
+    uint64_t* values[THREADS];
+    ConcurrentTestObject* objects[THREADS];
+
+    {
+      kj::Vector<kj::Own<Thread>> threads;
+      for (uint t = 0; t < THREADS; t++) {
+        threads.add(kj::heap<Thread>([&arena, &values, &objects, t]() {
+          values[t] = arena.allocateArray<uint64_t>(PER_THREAD).begin();
+          for (uint i = 0; i < PER_THREAD; i++) {
+            // A mix of small allocations, which go through the lanes, and the big array above,
+            // which gets a chunk of its own.
+            values[t][i] = arena.allocate<uint64_t>(t * PER_THREAD + i);
+            if (i % 100 == 0) arena.copyString("some text");
+          }
+          objects[t] = &arena.allocate<ConcurrentTestObject>(t);
+        }));
+      }
+    }
+
+    EXPECT_EQ(int(THREADS), ConcurrentTestObject::liveCount.load());
+    for (uint t = 0; t < THREADS; t++) {
+      EXPECT_EQ(t, objects[t]->value);
+      for (uint i = 0; i < PER_THREAD; i++) {
+        EXPECT_EQ(t * PER_THREAD + i, values[t][i]);
+      }
+    }
+  }
+
+  EXPECT_EQ(0, ConcurrentTestObject::liveCount.load());
+}
+
 }  // namespace
 }  // namespace kj
@@ -21,7 +21,11 @@
 
 #include "arena.h"
 #include "debug.h"
+#include "threadlocal.h"
 #include <stdint.h>
+#if KJ_USE_PTHREAD_TLS
+#include <pthread.h>
+#endif
 
 namespace kj {
 
@@ -38,6 +42,7 @@ Arena::Arena(ArrayPtr<byte> scratch)
     // Don't place the chunk in the chunk list because it's not ours to delete.  Just make it the
     // current chunk so that we'll allocate from it until it is empty.
     currentChunk = chunk;
+    scratchChunk = chunk;
   }
 }
 
@@ -50,17 +55,52 @@ Arena::~Arena() noexcept(false) {
 }
 
 void Arena::cleanup() {
+  runDestructors();
+
+  while (chunkList != nullptr) {
+    void* ptr = chunkList;
+    chunkList = chunkList->next;
+    operator delete(ptr);
+  }
+}
+
+void Arena::runDestructors() {
   while (objectList != nullptr) {
     void* ptr = objectList + 1;
     auto destructor = objectList->destructor;
     objectList = objectList->next;
     destructor(ptr);
   }
+}
+
+void Arena::reset() {
+  {
+    // As in the destructor, make sure every destructor runs even if one throws.
+    KJ_ON_SCOPE_FAILURE(runDestructors());
+    runDestructors();
+  }
+
+  ChunkHeader* largest = nullptr;
+  for (ChunkHeader* chunk = chunkList; chunk != nullptr; chunk = chunk->next) {
+    if (largest == nullptr || chunk->end - reinterpret_cast<byte*>(chunk) >
+                              largest->end - reinterpret_cast<byte*>(largest)) {
+      largest = chunk;
+    }
+  }
 
   while (chunkList != nullptr) {
-    void* ptr = chunkList;
+    ChunkHeader* chunk = chunkList;
     chunkList = chunkList->next;
-    operator delete(ptr);
+    if (chunk != largest) operator delete(chunk);
+  }
+
+  currentChunk = largest == nullptr ? scratchChunk : largest;
+  if (currentChunk != nullptr) {
+    currentChunk->pos = reinterpret_cast<byte*>(currentChunk + 1);
+  }
+  if (largest != nullptr) {
+    largest->next = nullptr;
+    chunkList = largest;
   }
 }
 
@@ -164,4 +204,123 @@ void Arena::setDestructor(void* ptr, void (*destructor)(void*)) {
   objectList = header;
 }
 
+// =======================================================================================
+
+namespace {
+
+#if !KJ_USE_PTHREAD_TLS
+thread_local char threadIdentity;
+// Only the address is used.
+#endif
+
+uint currentThreadHash(uint bits) {
+#if KJ_USE_PTHREAD_TLS
+  uint64_t id = reinterpret_cast<uintptr_t>(pthread_self());
+#else
+  uint64_t id = reinterpret_cast<uintptr_t>(&threadIdentity);
+#endif
+  // Thread identities are addresses that tend to share their low bits, so mix before taking the
+  // top bits (Fibonacci hashing).
+  return (id * 0x9E3779B97F4A7C15ull) >> (64 - bits);
+}
+
+}  // namespace
+
+ConcurrentArena::ConcurrentArena(size_t chunkSize)
+    : chunkSize(kj::max(chunkSize, sizeof(ChunkHeader) * 4)) {}
+
+ConcurrentArena::~ConcurrentArena() noexcept(false) {
+  KJ_DEFER({
+    while (chunkList != nullptr) {
+      void* ptr = chunkList;
+      chunkList = chunkList->next;
+      operator delete(ptr);
+    }
+  });
+
+  // As in Arena, keep running destructors if one throws.
+  auto runDestructors = [this]() {
+    while (objectList != nullptr) {
+      void* ptr = objectList + 1;
+      auto destructor = objectList->destructor;
+      objectList = objectList->next;
+      destructor(ptr);
+    }
+  };
+  KJ_ON_SCOPE_FAILURE(runDestructors());
+  runDestructors();
+}
+
+void* ConcurrentArena::allocateBytes(size_t amount, uint alignment, bool hasDisposer) {
+  if (hasDisposer) {
+    alignment = kj::max(alignment, alignof(ObjectHeader));
+    amount += alignTo(sizeof(ObjectHeader), alignment);
+  }
+
+  Lane& lane = lanes[currentThreadHash(LANE_BITS)];
+  byte* result = nullptr;
+
+  ChunkHeader* chunk = __atomic_load_n(&lane.current, __ATOMIC_ACQUIRE);
+  if (chunk != nullptr) {
+    byte* pos = __atomic_load_n(&chunk->pos, __ATOMIC_RELAXED);
+    for (;;) {
+      byte* alignedPos = alignTo(pos, alignment);
+      // Careful about overflow here.
+      if (amount + (alignedPos - pos) > size_t(chunk->end - pos)) break;
+      if (__atomic_compare_exchange_n(&chunk->pos, &pos, alignedPos + amount, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        result = alignedPos;
+        break;
+      }
+    }
+  }
+
+  if (result == nullptr) {
+    // Start a new chunk.  Nobody else can see it yet, so we allocate from it directly.
+    uint chunkAlignment = kj::max(alignment, alignof(ChunkHeader));
+    size_t headerSize = alignTo(sizeof(ChunkHeader), chunkAlignment);
+    size_t size = kj::max(chunkSize, headerSize + amount);
+
+    byte* bytes = reinterpret_cast<byte*>(operator new(size));
+    ChunkHeader* newChunk = reinterpret_cast<ChunkHeader*>(bytes);
+    result = alignTo(bytes + sizeof(ChunkHeader), chunkAlignment);
+    newChunk->pos = result + amount;
+    newChunk->end = bytes + size;
+
+    newChunk->next = __atomic_load_n(&chunkList, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&chunkList, &newChunk->next, newChunk, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+
+    if (size == chunkSize) {
+      // Make it the lane's current chunk, unless another thread in the lane beat us to it, in
+      // which case it's just as good to leave theirs.  Oversized chunks are full anyway.
+      __atomic_compare_exchange_n(&lane.current, &chunk, newChunk, false,
+                                  __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+  }
+
+  if (hasDisposer) {
+    // Reserve space for the ObjectHeader, but don't add it to the object list yet.
+    result = alignTo(result + sizeof(ObjectHeader), alignment);
+  }
+
+  KJ_DASSERT(reinterpret_cast<uintptr_t>(result) % alignment == 0);
+  return result;
+}
+
+StringPtr ConcurrentArena::copyString(StringPtr content) {
+  char* data = reinterpret_cast<char*>(allocateBytes(content.size() + 1, 1, false));
+  memcpy(data, content.cStr(), content.size() + 1);
+  return StringPtr(data, content.size());
+}
+
+void ConcurrentArena::setDestructor(void* ptr, void (*destructor)(void*)) {
+  ObjectHeader* header = reinterpret_cast<ObjectHeader*>(ptr) - 1;
+  KJ_DASSERT(reinterpret_cast<uintptr_t>(header) % alignof(ObjectHeader) == 0);
+  header->destructor = destructor;
+  header->next = __atomic_load_n(&objectList, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&objectList, &header->next, header, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+}
+
 }  // namespace kj
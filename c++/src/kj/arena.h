@@ -38,7 +38,7 @@ class Arena {
   // Allocating from the same Arena in multiple threads concurrently is NOT safe, because making
   // it safe would require atomic operations that would slow down allocation even when
   // single-threaded.  If you need to use arena allocation in a multithreaded context, consider
-  // allocating thread-local arenas.
+  // allocating thread-local arenas, or use `ConcurrentArena`.
 
 public:
   explicit Arena(size_t chunkSizeHint = 1024);
@@ -81,6 +81,17 @@ public:
   StringPtr copyString(StringPtr content);
   // Make a copy of the given string inside the arena, and return a pointer to the copy.
 
+  void reset();
+  // Run the destructors of everything allocated with `allocate()` / `allocateArray()` (as the
+  // destructor would) and make all of the arena's memory available again, so that one arena can
+  // serve request after request.  The largest chunk is kept and allocated from first; the others
+  // are freed, so an arena's footprint settles at what its largest request needed.  If the arena
+  // was given scratch space and never needed a heap chunk, the scratch space is reused.
+  //
+  // Anything obtained from the arena before the reset -- including `allocateOwn()` results --
+  // must no longer be in use.  If a destructor throws, the remaining destructors still run but the
+  // chunks are left as they were.
+
 private:
   struct ChunkHeader {
     ChunkHeader* next;
@@ -97,12 +108,16 @@ private:
   ObjectHeader* objectList = nullptr;
 
   ChunkHeader* currentChunk = nullptr;
+  ChunkHeader* scratchChunk = nullptr;
 
   void cleanup();
   // Run all destructors, leaving the above pointers null.  If a destructor throws, the State is
   // left in a consistent state, such that if cleanup() is called again, it will pick up where
   // it left off.
 
+  void runDestructors();
+  // The first half of cleanup().
+
   void* allocateBytes(size_t amount, uint alignment, bool hasDisposer);
   // Allocate the given number of bytes.  `hasDisposer` must be true if `setDisposer()` may be
   // called on this pointer later.
@@ -130,6 +145,73 @@ private:
   }
 };
 
+class ConcurrentArena {
+  // Like `Arena`, but any number of threads may allocate from it at once -- e.g. the workers of a
+  // parallel parse sharing one arena for their results.  Destroying the arena (which runs the
+  // destructors and frees everything) must of course happen only once all threads are done.
+  //
+  // Allocation is a compare-and-swap on the end pointer of a chunk.  To keep threads from
+  // fighting over one cache line, the arena has several "lanes", each with its own current chunk,
+  // and a thread always allocates from the lane its identity hashes to.  Threads that land in the
+  // same lane just share it.  Chunks are all the same size (except that an allocation too large
+  // for one gets a chunk of its own), so a lane's unused tail costs at most one chunk.
+
+public:
+  explicit ConcurrentArena(size_t chunkSize = 16384);
+  KJ_DISALLOW_COPY(ConcurrentArena);
+  ~ConcurrentArena() noexcept(false);
+
+  template <typename T, typename... Params>
+  T& allocate(Params&&... params);
+  template <typename T>
+  ArrayPtr<T> allocateArray(size_t size);
+  // Same as for `Arena`.  Destructors are run in reverse order of registration.
+
+  template <typename T>
+  inline T& copy(T&& value) { return allocate<Decay<T>>(kj::fwd<T>(value)); }
+
+  StringPtr copyString(StringPtr content);
+
+private:
+  struct ChunkHeader {
+    ChunkHeader* next;
+    byte* pos;  // first unallocated byte in this chunk; advanced atomically
+    byte* end;
+  };
+  struct ObjectHeader {
+    void (*destructor)(void*);
+    ObjectHeader* next;
+  };
+  struct Lane {
+    ChunkHeader* current = nullptr;
+    byte padding[64 - sizeof(ChunkHeader*)];
+    // Keep each lane on its own cache line (assuming 64-byte lines).
+  };
+
+  static constexpr uint LANE_BITS = 4;
+
+  size_t chunkSize;
+  Lane lanes[1u << LANE_BITS];
+  ChunkHeader* chunkList = nullptr;    // every chunk, pushed atomically
+  ObjectHeader* objectList = nullptr;  // pushed atomically
+
+  void* allocateBytes(size_t amount, uint alignment, bool hasDisposer);
+  void setDestructor(void* ptr, void (*destructor)(void*));
+
+  template <typename T>
+  static void destroyObject(void* pointer) {
+    dtor(*reinterpret_cast<T*>(pointer));
+  }
+  template <typename T>
+  static void destroyArray(void* pointer) {
+    size_t elementCount = *reinterpret_cast<size_t*>(pointer);
+    constexpr size_t prefixSize = kj::max(alignof(T), sizeof(size_t));
+    DestructorOnlyArrayDisposer::instance.disposeImpl(
+        reinterpret_cast<byte*>(pointer) + prefixSize,
+        sizeof(T), elementCount, elementCount, &destroyObject<T>);
+  }
+};
+
 // =======================================================================================
 // Inline implementation details
 
@@ -207,4 +289,51 @@ ArrayBuilder<T> Arena::allocateOwnArrayBuilder(size_t capacity) {
       capacity, DestructorOnlyArrayDisposer::instance);
 }
 
+template <typename T, typename... Params>
+T& ConcurrentArena::allocate(Params&&... params) {
+  T& result = *reinterpret_cast<T*>(allocateBytes(
+      sizeof(T), alignof(T), !__has_trivial_destructor(T)));
+  if (!__has_trivial_constructor(T) || sizeof...(Params) > 0) {
+    ctor(result, kj::fwd<Params>(params)...);
+  }
+  if (!__has_trivial_destructor(T)) {
+    setDestructor(&result, &destroyObject<T>);
+  }
+  return result;
+}
+
+template <typename T>
+ArrayPtr<T> ConcurrentArena::allocateArray(size_t size) {
+  if (__has_trivial_destructor(T)) {
+    ArrayPtr<T> result =
+        arrayPtr(reinterpret_cast<T*>(allocateBytes(
+            sizeof(T) * size, alignof(T), false)), size);
+    if (!__has_trivial_constructor(T)) {
+      for (size_t i = 0; i < size; i++) {
+        ctor(result[i]);
+      }
+    }
+    return result;
+  } else {
+    // Allocate with a prefix in which we store the count of constructed elements, as Arena does.
+    constexpr size_t prefixSize = kj::max(alignof(T), sizeof(size_t));
+    void* base = allocateBytes(sizeof(T) * size + prefixSize, alignof(T), true);
+    size_t& tag = *reinterpret_cast<size_t*>(base);
+    ArrayPtr<T> result =
+        arrayPtr(reinterpret_cast<T*>(reinterpret_cast<byte*>(base) + prefixSize), size);
+    tag = 0;
+    setDestructor(base, &destroyArray<T>);
+
+    if (__has_trivial_constructor(T)) {
+      tag = size;
+    } else {
+      for (size_t i = 0; i < size; i++) {
+        ctor(result[i]);
+        tag = i + 1;
+      }
+    }
+    return result;
+  }
+}
+
 }  // namespace kj
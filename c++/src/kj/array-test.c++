@@ -20,6 +20,7 @@
 // THE SOFTWARE.
 
 #include "array.h"
+#include "vector.h"
 #include "debug.h"
 #include <string>
 #include <list>
@@ -378,6 +379,64 @@ TEST(Array, ReleaseAsBytesOrChars) {
   }
 }
 
+KJ_TEST("SmallVector stays inline until it grows") {
+  SmallVector<String, 2> vec;
+  KJ_EXPECT(vec.isInline());
+  KJ_EXPECT(vec.capacity() == 2);
+
+  vec.add(kj::str("foo"));
+  vec.add(kj::str("bar"));
+  KJ_EXPECT(vec.isInline());
+  KJ_EXPECT(vec == ArrayPtr<const StringPtr>({"foo", "bar"}));
+
+  // Moving inline elements moves them one by one.
+  SmallVector<String, 2> moved = kj::mv(vec);
+  KJ_EXPECT(moved.isInline());
+  KJ_EXPECT(moved == ArrayPtr<const StringPtr>({"foo", "bar"}));
+  KJ_EXPECT(vec.size() == 0);
+  KJ_EXPECT(vec.isInline());
+
+  // Spill to the heap.
+  moved.add(kj::str("baz"));
+  KJ_EXPECT(!moved.isInline());
+  KJ_EXPECT(moved.capacity() == 4);
+  KJ_EXPECT(moved == ArrayPtr<const StringPtr>({"foo", "bar", "baz"}));
+
+  // Moving heap storage steals the buffer and leaves the source inline and empty.
+  const String* heapBegin = moved.begin();
+  vec = kj::mv(moved);
+  KJ_EXPECT(vec.begin() == heapBegin);
+  KJ_EXPECT(moved.size() == 0);
+  KJ_EXPECT(moved.isInline());
+  moved.add(kj::str("qux"));
+  KJ_EXPECT(moved == ArrayPtr<const StringPtr>({"qux"}));
+
+  vec.clear();
+  KJ_EXPECT(vec.size() == 0);
+  vec = nullptr;
+  KJ_EXPECT(vec.isInline());
+}
+
+KJ_TEST("SmallVector releaseAsArray") {
+  SmallVector<String, 4> vec;
+  vec.add(kj::str("foo"));
+  vec.add(kj::str("bar"));
+
+  Array<String> array = vec.releaseAsArray();
+  KJ_EXPECT(array == ArrayPtr<const StringPtr>({"foo", "bar"}));
+  KJ_EXPECT(vec.size() == 0);
+  KJ_EXPECT(vec.isInline());
+
+  SmallVector<int, 2> big(16);
+  KJ_EXPECT(!big.isInline());
+  for (int i = 0; i < 16; i++) big.add(i);
+  KJ_EXPECT(big.releaseAsArray().size() == 16);
+
+  SmallVector<int, 2> adopted(kj::heapArray<int>({1, 2, 3}));
+  KJ_EXPECT(!adopted.isInline());
+  KJ_EXPECT(adopted.size() == 3);
+}
+
 #if __cplusplus > 201402L
 KJ_TEST("kj::arr()") {
   kj::Array<kj::String> array = kj::arr(kj::str("foo"), kj::str(123));
@@ -41,6 +41,8 @@ namespace _ {  // private
 template <typename T>
 class ExceptionOr;
 
+class PromiseArena;
+
 class ExceptionOrValue {
 public:
   ExceptionOrValue(bool, Exception&& exception): exception(kj::mv(exception)) {}
@@ -118,12 +120,27 @@ protected:
   // caller.  This is the only way that an event can delete itself as a result of firing, as
   // doing so from within fire() will throw an exception.
 
+  void setPriority(EventPriority newPriority) { priority = static_cast<byte>(newPriority); }
+  // Arm this event at the given priority from now on, rather than at the priority of whatever
+  // event is firing when it is armed.
+
 private:
   friend class kj::EventLoop;
+  friend class kj::AsyncTracer;
   EventLoop& loop;
   Event* next;
   Event** prev;
   bool firing = false;
+
+  static constexpr byte INHERIT_PRIORITY = 0xff;
+  byte priority = INHERIT_PRIORITY;
+  byte queue = 0;
+  // The EventLoop queue this event is in, while armed.
+
+  uint32_t traceParent = 0;
+  // AsyncTracer ID of the event that armed this one, or 0.
+
+  EventLoop::EventQueue& queueForArm();
 };
 
 class PromiseNode {
@@ -157,6 +174,10 @@ public:
   // If this node wraps some other PromiseNode, get the wrapped node.  Used for debug tracing.
   // Default implementation returns nullptr.
 
+  PromiseArena* arena = nullptr;
+  // If non-null, this node was allocated by appendPromise() and owns the arena it lives in, which
+  // its disposer frees after destroying it.  Only the outermost node of an arena owns it.
+
 protected:
   class OnReadyEvent {
     // Helper class for implementing onReady().
@@ -175,6 +196,84 @@ protected:
 
 // -------------------------------------------------------------------
 
+class PromiseArena {
+  // A block of memory holding a chain of promise nodes, so that a chain of .then()s costs one
+  // heap allocation rather than one or two per call.
+  //
+  // Each appended node wraps (owns) the previous outermost node, and is placed just below it, so
+  // the block fills from the end toward the beginning.  Ownership of the arena moves to each new
+  // outermost node.  Every other node in the arena is owned, transitively, by that one, so by the
+  // time its disposer frees the arena they have all been destroyed.
+
+public:
+  static constexpr size_t SIZE = 1024;
+
+  template <typename T>
+  static constexpr bool fits() {
+    // Larger nodes (e.g. with big lambda captures) would waste most of the block.
+    return sizeof(T) <= SIZE / 4 && alignof(T) <= alignof(void*) * 2;
+  }
+
+  template <typename T>
+  byte* tryAllocate() {
+    // Returns space for a T below `limit`, or nullptr if there isn't enough left.
+    size_t space = limit - bytes;
+    if (space < sizeof(T)) return nullptr;
+    size_t offset = space - sizeof(T);
+    offset -= offset % alignof(T);  // `bytes` is at least as aligned as T.
+    limit = bytes + offset;
+    return limit;
+  }
+
+private:
+  alignas(alignof(void*) * 2) byte bytes[SIZE];
+  byte* limit = bytes + SIZE;
+};
+
+template <typename T>
+class PromiseArenaDisposer final: public Disposer {
+public:
+  void disposeImpl(void* pointer) const override {
+    T* node = reinterpret_cast<T*>(pointer);
+    PromiseArena* arena = node->arena;
+    node->~T();
+    delete arena;
+  }
+
+  static const PromiseArenaDisposer instance;
+};
+
+template <typename T>
+const PromiseArenaDisposer<T> PromiseArenaDisposer<T>::instance = PromiseArenaDisposer<T>();
+
+template <typename T, typename... Params>
+Own<PromiseNode> appendPromise(Own<PromiseNode>&& next, Params&&... params) {
+  // Like heap<T>(kj::mv(next), params...), but places the new node in `next`'s arena when there
+  // is room, or else starts a new arena for the rest of the chain.
+
+  if (!PromiseArena::fits<T>()) {
+    return heap<T>(kj::mv(next), kj::fwd<Params>(params)...);
+  }
+
+  PromiseArena* arena = next->arena;
+  byte* pos = nullptr;
+  if (arena != nullptr) {
+    pos = arena->tryAllocate<T>();
+    if (pos != nullptr) next->arena = nullptr;
+  }
+  if (pos == nullptr) {
+    arena = new PromiseArena;
+    pos = arena->tryAllocate<T>();
+  }
+
+  T* node = reinterpret_cast<T*>(pos);
+  ctor(*node, kj::mv(next), kj::fwd<Params>(params)...);
+  node->arena = arena;
+  return Own<PromiseNode>(node, PromiseArenaDisposer<T>::instance);
+}
+
+// -------------------------------------------------------------------
+
 class ImmediatePromiseNodeBase: public PromiseNode {
 public:
   ImmediatePromiseNodeBase();
@@ -572,7 +671,7 @@ private:
 
 template <typename T>
 Own<PromiseNode> maybeChain(Own<PromiseNode>&& node, Promise<T>*) {
-  return heap<ChainPromiseNode>(kj::mv(node));
+  return appendPromise<ChainPromiseNode>(kj::mv(node));
 }
 
 template <typename T>
@@ -693,6 +792,23 @@ private:
 
 // -------------------------------------------------------------------
 
+class PriorityPromiseNode final: public PromiseNode, private Event {
+public:
+  PriorityPromiseNode(Own<PromiseNode>&& dependency, EventPriority priority);
+
+  void onReady(Event* event) noexcept override;
+  void get(ExceptionOrValue& output) noexcept override;
+  PromiseNode* getInnerForTrace() override;
+
+private:
+  Own<PromiseNode> dependency;
+  OnReadyEvent onReadyEvent;
+
+  Maybe<Own<Event>> fire() override;
+};
+
+// -------------------------------------------------------------------
+
 class EagerPromiseNodeBase: public PromiseNode, protected Event {
   // A PromiseNode that eagerly evaluates its dependency even if its dependent does not eagerly
   // evaluate it.
@@ -730,7 +846,7 @@ template <typename T>
 Own<PromiseNode> spark(Own<PromiseNode>&& node) {
   // Forces evaluation of the given node to begin as soon as possible, even if no one is waiting
   // on it.
-  return heap<EagerPromiseNode<T>>(kj::mv(node));
+  return appendPromise<EagerPromiseNode<T>>(kj::mv(node));
 }
 
 // -------------------------------------------------------------------
@@ -789,6 +905,224 @@ private:
   }
 };
 
+// -------------------------------------------------------------------
+
+class XThreadEvent: public AtomicRefcounted {
+  // State shared between the thread that called `Executor::executeAsync()` (the "requester") and
+  // the thread that runs the function (the "target").  See async.c++ for the protocol.
+
+public:
+  XThreadEvent(ExceptionOrValue& result, const Executor& target);
+  explicit XThreadEvent(ExceptionOrValue& result);
+  // The second form is for ThreadPool tasks, which have no target loop.
+  ~XThreadEvent() noexcept(false);
+  KJ_DISALLOW_COPY(XThreadEvent);
+
+  struct Link {
+    // Entry in an executor's queue.  Each event is queued at most once per link.
+
+    Link* next = nullptr;
+    Own<XThreadEvent> ref;
+    // Keeps the event alive while it is queued.
+  };
+
+  enum Kind: uint {
+    REQUEST,  // requester -> target: please run the function
+    CANCEL,   // requester -> target: the result is no longer wanted
+    REPLY     // target -> requester: the result is ready
+  };
+
+protected:
+  virtual Own<PromiseNode> execute() = 0;
+  // Called on the target thread to call the function.  Destroys the function afterwards.  Returns
+  // null if the result was stored directly, as ThreadPool tasks do.
+
+  virtual void destroyFunc() = 0;
+  // Called on the target thread if the call is canceled before it starts.
+
+  virtual void getResult(ExceptionOrValue& output) = 0;
+  // Called on the requester thread to move the result out.
+
+  template <typename T>
+  static Own<PromiseNode> getNode(Promise<T>&& promise) { return kj::mv(promise.node); }
+
+  static Own<PromiseNode> newPromiseNode(Own<XThreadEvent>&& event);
+  // The requester's end, for events that aren't sent through an executor.
+
+  bool startFulfilling();
+  // For cross-thread fulfillers: claims the right to store the result.  Returns false if the
+  // result was already stored or is no longer wanted.
+
+  void finishFulfilling() { sendReply(); }
+  // Call after startFulfilling() returned true and the result was stored.
+
+  bool isWaiting() const;
+
+private:
+  void sendReply();
+  // Called on the target thread (or on any thread, if the target loop is gone) once the result
+  // has been stored.  Sends it to the requester unless the call was canceled.
+
+  ExceptionOrValue& result;
+  Own<const Executor> target;
+  // Null for ThreadPool tasks.
+  Own<const Executor> requester;
+
+#if _MSC_VER
+  volatile long state;
+#else
+  volatile uint state;
+#endif
+  // One of the states defined in async.c++.  Accessed atomically.
+
+  Link links[3];
+  // Indexed by Kind.
+
+  XThreadPromiseNode* promiseNode = nullptr;
+  // The requester's end.  Only accessed on the requester thread; null once it is destroyed.
+
+  XThreadExecution* execution = nullptr;
+  // The target's end while the function's promise is running.  Only accessed on the target thread.
+
+  friend class kj::Executor;
+  friend class kj::ThreadPool;
+  template <typename U>
+  friend PromiseCrossThreadFulfillerPair<U> kj::newCrossThreadPromiseAndFulfiller();
+  friend class XThreadPromiseNode;
+  friend class XThreadExecution;
+};
+
+template <typename T, typename Func>
+class XThreadEventImpl final: public XThreadEvent {
+public:
+  template <typename F>
+  XThreadEventImpl(F&& func, const Executor& target)
+      : XThreadEvent(result, target), func(kj::fwd<F>(func)) {}
+
+protected:
+  Own<PromiseNode> execute() override {
+    Promise<T> promise = nullptr;
+    KJ_IF_MAYBE(f, func) {
+      KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() {
+        promise = MaybeVoidCaller<Void, FixVoid<ReturnType<Func, void>>>::apply(*f, Void());
+      })) {
+        promise = kj::mv(*e);
+      }
+    }
+    func = nullptr;
+    return getNode(kj::mv(promise));
+  }
+
+  void destroyFunc() override {
+    func = nullptr;
+  }
+
+  void getResult(ExceptionOrValue& output) override {
+    output.as<FixVoid<T>>() = kj::mv(result);
+  }
+
+private:
+  ExceptionOr<FixVoid<T>> result;
+  Maybe<Func> func;
+};
+
+template <typename T>
+class XThreadPaf final: public XThreadEvent, public CrossThreadPromiseFulfiller<T> {
+  // Both the event shared between the two threads and the fulfiller.  The fulfiller handed out
+  // is a separate reference (see XThreadFulfiller) so that dropping it breaks the promise.
+
+public:
+  XThreadPaf(): XThreadEvent(result) {}
+
+  void fulfill(FixVoid<T>&& value) const override {
+    auto& self = const_cast<XThreadPaf&>(*this);
+    if (self.startFulfilling()) {
+      self.result.value = kj::mv(value);
+      self.finishFulfilling();
+    }
+  }
+
+  void reject(Exception&& exception) const override {
+    auto& self = const_cast<XThreadPaf&>(*this);
+    if (self.startFulfilling()) {
+      self.result.addException(kj::mv(exception));
+      self.finishFulfilling();
+    }
+  }
+
+  bool isWaiting() const override {
+    return XThreadEvent::isWaiting();
+  }
+
+protected:
+  Own<PromiseNode> execute() override {
+    // Never sent to an executor as a request.
+    KJ_UNREACHABLE;
+  }
+
+  void destroyFunc() override {}
+
+  void getResult(ExceptionOrValue& output) override {
+    output.as<FixVoid<T>>() = kj::mv(result);
+  }
+
+private:
+  ExceptionOr<FixVoid<T>> result;
+};
+
+template <typename T>
+class XThreadFulfiller final: public CrossThreadPromiseFulfiller<T> {
+public:
+  explicit XThreadFulfiller(Own<XThreadPaf<T>>&& paf): paf(kj::mv(paf)) {}
+
+  ~XThreadFulfiller() noexcept(false) {
+    if (paf->isWaiting()) {
+      paf->reject(Exception(Exception::Type::FAILED, __FILE__, __LINE__,
+          kj::heapString("CrossThreadPromiseFulfiller was destroyed without fulfilling the "
+                         "promise.")));
+    }
+  }
+
+  void fulfill(FixVoid<T>&& value) const override { paf->fulfill(kj::mv(value)); }
+  void reject(Exception&& exception) const override { paf->reject(kj::mv(exception)); }
+  bool isWaiting() const override { return paf->isWaiting(); }
+
+private:
+  Own<XThreadPaf<T>> paf;
+};
+
+template <typename T, typename Func>
+class ThreadPoolTask final: public XThreadEvent {
+public:
+  template <typename F>
+  explicit ThreadPoolTask(F&& func): XThreadEvent(result), func(kj::fwd<F>(func)) {}
+
+protected:
+  Own<PromiseNode> execute() override {
+    KJ_IF_MAYBE(f, func) {
+      KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() {
+        result.value = MaybeVoidCaller<Void, FixVoid<T>>::apply(*f, Void());
+      })) {
+        result.addException(kj::mv(*e));
+      }
+    }
+    func = nullptr;
+    return Own<PromiseNode>();
+  }
+
+  void destroyFunc() override {
+    func = nullptr;
+  }
+
+  void getResult(ExceptionOrValue& output) override {
+    output.as<FixVoid<T>>() = kj::mv(result);
+  }
+
+private:
+  ExceptionOr<FixVoid<T>> result;
+  Maybe<Func> func;
+};
+
 }  // namespace _ (private)
 
 // =======================================================================================
@@ -807,7 +1141,7 @@ PromiseForResult<Func, T> Promise<T>::then(Func&& func, ErrorFunc&& errorHandler
   typedef _::FixVoid<_::ReturnType<Func, T>> ResultT;
 
   Own<_::PromiseNode> intermediate =
-      heap<_::TransformPromiseNode<ResultT, _::FixVoid<T>, Func, ErrorFunc>>(
+      _::appendPromise<_::TransformPromiseNode<ResultT, _::FixVoid<T>, Func, ErrorFunc>>(
           kj::mv(node), kj::fwd<Func>(func), kj::fwd<ErrorFunc>(errorHandler));
   return PromiseForResult<Func, T>(false,
       _::maybeChain(kj::mv(intermediate), implicitCast<ResultT*>(nullptr)));
@@ -919,10 +1253,15 @@ Promise<T> Promise<T>::exclusiveJoin(Promise<T>&& other) {
 template <typename T>
 template <typename... Attachments>
 Promise<T> Promise<T>::attach(Attachments&&... attachments) {
-  return Promise(false, kj::heap<_::AttachmentPromiseNode<Tuple<Attachments...>>>(
+  return Promise(false, _::appendPromise<_::AttachmentPromiseNode<Tuple<Attachments...>>>(
       kj::mv(node), kj::tuple(kj::fwd<Attachments>(attachments)...)));
 }
 
+template <typename T>
+Promise<T> Promise<T>::withPriority(EventPriority priority) {
+  return Promise(false, _::appendPromise<_::PriorityPromiseNode>(kj::mv(node), priority));
+}
+
 template <typename T>
 template <typename ErrorFunc>
 Promise<T> Promise<T>::eagerlyEvaluate(ErrorFunc&& errorHandler) {
@@ -1102,6 +1441,34 @@ Promise<T> newAdaptedPromise(Params&&... adapterConstructorParams) {
       kj::fwd<Params>(adapterConstructorParams)...));
 }
 
+template <typename Func>
+PromiseForResult<Func, void> Executor::executeAsync(Func&& func) const {
+  typedef _::JoinPromises<_::ReturnType<Func, void>> T;
+  return PromiseForResult<Func, void>(false, send(
+      kj::atomicRefcounted<_::XThreadEventImpl<T, Decay<Func>>>(kj::fwd<Func>(func), *this)));
+}
+
+template <typename Func>
+Promise<_::ReturnType<Func, void>> ThreadPool::run(Func&& func) const {
+  typedef _::ReturnType<Func, void> T;
+  static_assert(isSameType<_::JoinPromises<T>, T>(),
+      "ThreadPool::run() can't wait for a promise; workers have no event loop.");
+  return Promise<T>(false, send(
+      kj::atomicRefcounted<_::ThreadPoolTask<T, Decay<Func>>>(kj::fwd<Func>(func))));
+}
+
+template <typename T>
+PromiseCrossThreadFulfillerPair<T> newCrossThreadPromiseAndFulfiller() {
+  static_assert(isSameType<_::JoinPromises<T>, T>(),
+      "newCrossThreadPromiseAndFulfiller() can't chain promises across threads.");
+  auto paf = kj::atomicRefcounted<_::XThreadPaf<T>>();
+  Own<CrossThreadPromiseFulfiller<T>> fulfiller =
+      kj::heap<_::XThreadFulfiller<T>>(kj::atomicAddRef(*paf));
+  return PromiseCrossThreadFulfillerPair<T> {
+    Promise<T>(false, _::XThreadEvent::newPromiseNode(kj::mv(paf))), kj::mv(fulfiller)
+  };
+}
+
 template <typename T>
 PromiseFulfillerPair<T> newPromiseAndFulfiller() {
   auto wrapper = _::WeakFulfiller<T>::make();
@@ -1114,4 +1481,202 @@ PromiseFulfillerPair<T> newPromiseAndFulfiller() {
   return PromiseFulfillerPair<T> { kj::mv(promise), kj::mv(wrapper) };
 }
 
+#if KJ_HAS_COROUTINE
+// =======================================================================================
+// Coroutines
+//
+// A function returning kj::Promise<T> may be a coroutine:
+//
+//     kj::Promise<size_t> readAll(kj::AsyncInputStream& in, kj::ArrayPtr<byte> buffer) {
+//       size_t total = 0;
+//       while (total < buffer.size()) {
+//         size_t n = co_await in.tryRead(buffer.begin() + total, 1, buffer.size() - total);
+//         if (n == 0) break;
+//         total += n;
+//       }
+//       co_return total;
+//     }
+//
+// The body runs synchronously up to its first `co_await`. Only Promises can be awaited. An
+// awaited promise that breaks throws its exception inside the coroutine, and an exception leaving
+// the coroutine breaks the returned promise. Destroying the returned promise before it completes
+// destroys the suspended coroutine, canceling whatever it was awaiting, just as for .then().
+
+namespace _ {  // private
+
+class CoroutineBase: public PromiseNode {
+  // The coroutine's promise_type, which lives in the coroutine frame.  It is the PromiseNode of
+  // the returned Promise and holds the Event that resumes the coroutine when an awaited promise is
+  // ready, so a coroutine costs one allocation (the frame) however many times it awaits.
+
+public:
+  CoroutineBase(stdcoro::coroutine_handle<> coroutine, ExceptionOrValue& resultRef)
+      : coroutine(coroutine), resultRef(resultRef), resumeEvent(*this) {}
+  KJ_DISALLOW_COPY(CoroutineBase);
+
+  stdcoro::suspend_never initial_suspend() { return {}; }
+
+  stdcoro::suspend_always final_suspend() noexcept {
+    // Stay suspended, so that the frame holding the result lives until the Promise is destroyed.
+    onReadyEvent.arm();
+    return {};
+  }
+
+  void unhandled_exception() {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([]() { throw; })) {
+      resultRef.addException(kj::mv(*exception));
+    }
+  }
+
+  template <typename U>
+  class Awaiter;
+
+  template <typename U>
+  Awaiter<U> await_transform(Promise<U>&& promise) {
+    return Awaiter<U>(*this, kj::mv(promise.node));
+  }
+  template <typename U>
+  Awaiter<U> await_transform(Promise<U>& promise) {
+    // Like .then(), awaiting consumes the promise.
+    return Awaiter<U>(*this, kj::mv(promise.node));
+  }
+
+  void onReady(Event* event) noexcept override {
+    onReadyEvent.init(event);
+  }
+
+  void destroy() {
+    coroutine.destroy();
+  }
+
+private:
+  stdcoro::coroutine_handle<> coroutine;
+  ExceptionOrValue& resultRef;
+  OnReadyEvent onReadyEvent;
+
+  PromiseNode* awaiting = nullptr;
+  // The node of the promise currently being awaited, for tracing.
+
+  class ResumeEvent final: public Event {
+    // Armed when the awaited promise is ready.
+
+  public:
+    explicit ResumeEvent(CoroutineBase& owner): owner(owner) {}
+
+    PromiseNode* getInnerForTrace() override {
+      return owner.awaiting;
+    }
+
+  private:
+    CoroutineBase& owner;
+
+    Maybe<Own<Event>> fire() override {
+      owner.coroutine.resume();
+      return nullptr;
+    }
+  };
+
+  ResumeEvent resumeEvent;
+};
+
+template <typename U>
+class CoroutineBase::Awaiter {
+public:
+  Awaiter(CoroutineBase& coroutine, Own<PromiseNode>&& node)
+      : coroutine(coroutine), node(kj::mv(node)) {}
+  KJ_DISALLOW_COPY(Awaiter);
+
+  bool await_ready() const { return false; }
+
+  void await_suspend(stdcoro::coroutine_handle<>) {
+    node->setSelfPointer(&node);
+    node->onReady(&coroutine.resumeEvent);
+    coroutine.awaiting = node.get();
+  }
+
+  U await_resume() {
+    // Same as Promise<U>::wait().
+    coroutine.awaiting = nullptr;
+    ExceptionOr<FixVoid<U>> result;
+    node->get(result);
+    node = nullptr;
+
+    KJ_IF_MAYBE(value, result.value) {
+      KJ_IF_MAYBE(exception, result.exception) {
+        throwRecoverableException(kj::mv(*exception));
+      }
+      return returnMaybeVoid(kj::mv(*value));
+    } else KJ_IF_MAYBE(exception, result.exception) {
+      throwFatalException(kj::mv(*exception));
+    } else {
+      // Result contained neither a value nor an exception?
+      KJ_UNREACHABLE;
+    }
+  }
+
+private:
+  CoroutineBase& coroutine;
+  Own<PromiseNode> node;
+};
+
+template <typename T>
+class CoroutineReturn {
+public:
+  void return_value(T value) { result.value = kj::mv(value); }
+
+protected:
+  ExceptionOr<T> result;
+};
+
+template <>
+class CoroutineReturn<void> {
+public:
+  void return_void() { result.value = Void(); }
+
+protected:
+  ExceptionOr<Void> result;
+};
+
+template <typename T>
+class CoroutineDisposer final: public Disposer {
+public:
+  void disposeImpl(void* pointer) const override {
+    reinterpret_cast<Coroutine<T>*>(pointer)->destroy();
+  }
+
+  static const CoroutineDisposer instance;
+};
+
+template <typename T>
+const CoroutineDisposer<T> CoroutineDisposer<T>::instance = CoroutineDisposer<T>();
+
+template <typename T>
+class Coroutine final: public CoroutineBase, public CoroutineReturn<T> {
+public:
+  Coroutine()
+      : CoroutineBase(stdcoro::coroutine_handle<Coroutine>::from_promise(*this), this->result) {}
+
+  Promise<T> get_return_object() {
+    return Promise<T>(false, Own<PromiseNode>(this, CoroutineDisposer<T>::instance));
+  }
+
+  void get(ExceptionOrValue& output) noexcept override {
+    output.as<FixVoid<T>>() = kj::mv(this->result);
+  }
+};
+
+}  // namespace _ (private)
+#endif  // KJ_HAS_COROUTINE
+
 }  // namespace kj
+
+#if KJ_HAS_COROUTINE
+namespace KJ_COROUTINE_STD_NAMESPACE {
+
+template <typename T, typename... Params>
+struct coroutine_traits<kj::Promise<T>, Params...> {
+  using promise_type = kj::_::Coroutine<T>;
+};
+
+}  // namespace KJ_COROUTINE_STD_NAMESPACE
+#endif
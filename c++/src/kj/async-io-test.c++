@@ -28,6 +28,7 @@
 #include "async-io.h"
 #include "async-io-internal.h"
 #include "debug.h"
+#include "filesystem.h"
 #include <kj/compat/gtest.h>
 #include <sys/types.h>
 #if _WIN32
@@ -36,8 +37,10 @@
 #define inet_pton InetPtonA
 #define inet_ntop InetNtopA
 #else
+#include "async-unix.h"
 #include <netdb.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -85,6 +88,41 @@ TEST(AsyncIo, SimpleNetwork) {
   EXPECT_EQ("foo", result);
 }
 
+#if __linux__
+TEST(AsyncIo, ReusePortListeners) {
+  auto ioContext = setupAsyncIo();
+  auto& w = ioContext.waitScope;
+  auto& network = ioContext.provider->getNetwork();
+
+  // Two receivers (normally one per thread) share one port.
+  auto listener1 = network.parseAddress("127.0.0.1").wait(w)->listenReusePort(2);
+  uint port = listener1->getPort();
+  auto listener2 = network.parseAddress("127.0.0.1", port).wait(w)->listenReusePort(2);
+  EXPECT_EQ(port, listener2->getPort());
+
+  int optval = 0;
+  uint length = sizeof(optval);
+  listener2->getsockopt(SOL_SOCKET, SO_REUSEPORT, &optval, &length);
+  EXPECT_NE(0, optval);
+
+  // Every connection is accepted by one of them.
+  auto address = network.parseAddress("127.0.0.1", port).wait(w);
+  constexpr uint COUNT = 8;
+  Own<AsyncIoStream> clients[COUNT];
+  for (auto& client: clients) {
+    client = address->connect().wait(w);
+  }
+  for (uint i = 0; i < COUNT; i++) {
+    auto server = listener1->accept().exclusiveJoin(listener2->accept()).wait(w);
+    server->write("x", 1).wait(w);
+  }
+  for (auto& client: clients) {
+    char c;
+    EXPECT_EQ(1u, client->tryRead(&c, 1, 1).wait(w));
+  }
+}
+#endif
+
 String tryParse(WaitScope& waitScope, Network& network, StringPtr text, uint portHint = 0) {
   return network.parseAddress(text, portHint).wait(waitScope)->toString();
 }
@@ -194,7 +232,207 @@ TEST(AsyncIo, TwoWayPipe) {
   EXPECT_EQ("bar", result2);
 }
 
+TEST(AsyncIo, IdleOperationsWait) {
+  // Accepts, reads, and writes on non-blocking fds that aren't ready must wait. With io_uring,
+  // they must not be resubmitted over and over while the kernel reports EAGAIN, which would keep
+  // poll() below from ever returning.
+
+  auto ioContext = setupAsyncIo();
+  auto& waitScope = ioContext.waitScope;
+  auto& network = ioContext.provider->getNetwork();
+
+  auto listener = network.parseAddress("localhost", 0).wait(waitScope)->listen();
+  auto acceptPromise = listener->accept();
+  KJ_EXPECT(!acceptPromise.poll(waitScope));
+
+  auto client = network.parseAddress("localhost", listener->getPort()).wait(waitScope)
+      ->connect().wait(waitScope);
+  auto server = acceptPromise.wait(waitScope);
+
+  char buffer[4];
+  auto readPromise = server->tryRead(buffer, 3, 4);
+  KJ_EXPECT(!readPromise.poll(waitScope));
+  client->write("foo", 3).wait(waitScope);
+  KJ_EXPECT(readPromise.wait(waitScope) == 3);
+  KJ_EXPECT(memcmp(buffer, "foo", 3) == 0);
+
+  // Fill up the socket buffers, until a write has to wait for the other end to read.
+  auto chunk = heapArray<byte>(65536);
+  memset(chunk.begin(), 'x', chunk.size());
+  size_t written = 0;
+  Promise<void> writePromise = nullptr;
+  for (;;) {
+    writePromise = client->write(chunk.begin(), chunk.size());
+    if (!writePromise.poll(waitScope)) break;
+    writePromise.wait(waitScope);
+    written += chunk.size();
+  }
+
+  auto sink = heapArray<byte>(65536);
+  size_t received = 0;
+  while (received < written + chunk.size()) {
+    received += server->tryRead(sink.begin(), 1, sink.size()).wait(waitScope);
+  }
+  writePromise.wait(waitScope);
+  KJ_EXPECT(received == written + chunk.size());
+
+#if KJ_USE_IO_URING
+  KJ_IF_MAYBE(ring, ioContext.unixEventPort.getIoUring()) {
+    // The same for the ring's own operations, on the listener's non-blocking fd.
+    int listenFd = KJ_ASSERT_NONNULL(listener->getFd());
+    struct sockaddr_storage addr;
+    uint addrlen = sizeof(addr);
+    auto ringAccept = ring->accept(listenFd, reinterpret_cast<struct sockaddr*>(&addr), &addrlen);
+    KJ_EXPECT(!ringAccept.poll(waitScope));
+
+    auto client2 = network.parseAddress("localhost", listener->getPort()).wait(waitScope)
+        ->connect().wait(waitScope);
+    int fd = ringAccept.wait(waitScope);
+    KJ_ASSERT(fd >= 0, fd);
+    KJ_DEFER(close(fd));
+    KJ_EXPECT(addr.ss_family == AF_INET || addr.ss_family == AF_INET6);
+  }
+#endif
+}
+
+Array<byte> makeTestPattern(size_t size) {
+  auto result = heapArray<byte>(size);
+  for (size_t i = 0; i < size; i++) {
+    result[i] = i * 7 + i / 256;
+  }
+  return result;
+}
+
+void checkFilePump(const ReadableFile& file, ArrayPtr<const byte> expected) {
+  auto ioContext = setupAsyncIo();
+  auto pipe = ioContext.provider->newTwoWayPipe();
+
+  // Pump a range from the middle of the file, then the rest until EOF.
+  AsyncFileInputStream input(file, 1000, 200000);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(input.tryGetLength()) == 200000);
+
+  auto pumpPromise = input.pumpTo(*pipe.ends[0]).then([&](uint64_t n) {
+    KJ_EXPECT(n == 200000);
+    KJ_EXPECT(input.getOffset() == 201000);
+    KJ_EXPECT(KJ_ASSERT_NONNULL(input.tryGetLength()) == 0);
+
+    auto rest = heap<AsyncFileInputStream>(file, 201000);
+    KJ_EXPECT(KJ_ASSERT_NONNULL(rest->tryGetLength()) == expected.size() - 201000);
+    auto promise = rest->pumpTo(*pipe.ends[0]);
+    return promise.attach(kj::mv(rest)).then([&](uint64_t n) {
+      KJ_EXPECT(n == expected.size() - 201000);
+      pipe.ends[0]->shutdownWrite();
+    });
+  }).eagerlyEvaluate(nullptr);
+
+  auto received = pipe.ends[1]->readAllBytes().wait(ioContext.waitScope);
+  pumpPromise.wait(ioContext.waitScope);
+  KJ_EXPECT(received == expected.slice(1000, expected.size()));
+}
+
+TEST(AsyncIo, FilePump) {
+  auto content = makeTestPattern(300000);
+
+  // An in-memory file has no fd, so this exercises the regular pump.
+  auto file = newInMemoryFile(nullClock());
+  file->write(0, content);
+  checkFilePump(*file, content);
+}
+
+void checkAsyncFile(Own<const File> file) {
+  auto ioContext = setupAsyncIo();
+  auto& rawFile = *file;
+  auto asyncFile = ioContext.lowLevelProvider->wrapFile(kj::mv(file));
+  auto content = makeTestPattern(300000);
+
+  // Write in two pieces through a stream, then make it durable.
+  auto output = asyncFile->newOutputStream();
+  ArrayPtr<const byte> pieces[2] = { content.slice(0, 100000), content.slice(100000, 300000) };
+  output->write(pieces).wait(ioContext.waitScope);
+  asyncFile->datasync().wait(ioContext.waitScope);
+  KJ_EXPECT(rawFile.readAllBytes() == content);
+
+  // Positioned writes and reads.
+  auto patch = makeTestPattern(10);
+  asyncFile->write(5000, patch).wait(ioContext.waitScope);
+  memcpy(content.begin() + 5000, patch.begin(), patch.size());
+  byte buffer[20];
+  KJ_EXPECT(asyncFile->read(4995, buffer).wait(ioContext.waitScope) == sizeof(buffer));
+  KJ_EXPECT(arrayPtr(buffer, sizeof(buffer)) == content.slice(4995, 5015));
+
+  // A read that hits EOF comes up short.
+  KJ_EXPECT(asyncFile->read(299990, buffer).wait(ioContext.waitScope) == 10);
+  KJ_EXPECT(arrayPtr(buffer, 10) == content.slice(299990, 300000));
+
+  // Pump a stream over the file to a socket.
+  auto pipe = ioContext.provider->newTwoWayPipe();
+  auto input = asyncFile->newInputStream(1000);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(input->tryGetLength()) == content.size() - 1000);
+  auto pumpPromise = input->pumpTo(*pipe.ends[0]).then([&](uint64_t n) {
+    KJ_EXPECT(n == content.size() - 1000);
+    pipe.ends[0]->shutdownWrite();
+  }).eagerlyEvaluate(nullptr);
+
+  auto received = pipe.ends[1]->readAllBytes().wait(ioContext.waitScope);
+  pumpPromise.wait(ioContext.waitScope);
+  KJ_EXPECT(received == content.slice(1000, content.size()));
+}
+
+TEST(AsyncIo, AsyncFile) {
+  // An in-memory file has no fd, so this runs on the thread pool.
+  checkAsyncFile(newInMemoryFile(nullClock()));
+}
+
 #if !_WIN32
+TEST(AsyncIo, AsyncDiskFile) {
+  // A disk file goes through io_uring when the kernel has it.
+  char path[] = "/tmp/kj-async-io-test.XXXXXX";
+  int fd;
+  KJ_SYSCALL(fd = mkstemp(path));
+  unlink(path);
+  checkAsyncFile(newDiskFile(AutoCloseFd(fd)));
+}
+#endif
+
+#if !_WIN32
+TEST(AsyncIo, FilePumpSendfile) {
+  auto content = makeTestPattern(300000);
+
+  // A disk file can be sent with sendfile().
+  char path[] = "/tmp/kj-async-io-test.XXXXXX";
+  int fd;
+  KJ_SYSCALL(fd = mkstemp(path));
+  unlink(path);
+  auto file = newDiskFile(AutoCloseFd(fd));
+  file->write(0, content);
+  checkFilePump(*file, content);
+}
+
+TEST(AsyncIo, SocketToSocketPump) {
+  auto ioContext = setupAsyncIo();
+  auto pipe1 = ioContext.provider->newTwoWayPipe();
+  auto pipe2 = ioContext.provider->newTwoWayPipe();
+
+  auto content = makeTestPattern(300000);
+
+  auto writePromise = pipe1.ends[0]->write(content.begin(), content.size()).then([&]() {
+    pipe1.ends[0]->shutdownWrite();
+  }).eagerlyEvaluate(nullptr);
+
+  auto pumpPromise = pipe1.ends[1]->pumpTo(*pipe2.ends[0], 250000).then([&](uint64_t n) {
+    KJ_EXPECT(n == 250000);
+    return pipe1.ends[1]->pumpTo(*pipe2.ends[0]);
+  }).then([&](uint64_t n) {
+    KJ_EXPECT(n == 50000);
+    pipe2.ends[0]->shutdownWrite();
+  }).eagerlyEvaluate(nullptr);
+
+  auto received = pipe2.ends[1]->readAllBytes().wait(ioContext.waitScope);
+  writePromise.wait(ioContext.waitScope);
+  pumpPromise.wait(ioContext.waitScope);
+  KJ_EXPECT(received == content);
+}
+
 TEST(AsyncIo, CapabilityPipe) {
   auto ioContext = setupAsyncIo();
 
@@ -441,6 +679,62 @@ TEST(AsyncIo, Udp) {
   }
 }
 
+TEST(AsyncIo, UdpBatch) {
+  auto ioContext = setupAsyncIo();
+
+  auto addr = ioContext.provider->getNetwork().parseAddress("127.0.0.1").wait(ioContext.waitScope);
+
+  auto port1 = addr->bindDatagramPort();
+  auto port2 = addr->bindDatagramPort();
+
+  auto addr1 = ioContext.provider->getNetwork().parseAddress("127.0.0.1", port1->getPort())
+      .wait(ioContext.waitScope);
+  auto addr2 = ioContext.provider->getNetwork().parseAddress("127.0.0.1", port2->getPort())
+      .wait(ioContext.waitScope);
+
+  DatagramReceiver::Capacity capacity;
+  capacity.content = 4;
+  capacity.batch = 4;
+  auto receiver = port2->makeReceiver(capacity);
+
+  ArrayPtr<const byte> datagrams[] = {
+    "foo"_kj.asBytes(), "bar"_kj.asBytes(), "bazqux"_kj.asBytes(),
+    "corge"_kj.asBytes(), "x"_kj.asBytes()
+  };
+  port1->sendBatch(datagrams, *addr2).wait(ioContext.waitScope);
+
+  kj::Vector<kj::String> received;
+  bool truncated[5] = {false, false, false, false, false};
+  uint syscalls = 0;
+  while (received.size() < 5) {
+    receiver->receive().wait(ioContext.waitScope);
+    ++syscalls;
+    do {
+      EXPECT_EQ(addr1->toString(), receiver->getSource().toString());
+      auto content = receiver->getContent();
+      truncated[received.size()] = content.isTruncated;
+      received.add(kj::heapString(content.value.asChars()));
+    } while (received.size() < 5 && receiver->tryReceiveBuffered());
+  }
+
+  EXPECT_EQ("foo", received[0]);
+  EXPECT_EQ("bar", received[1]);
+  EXPECT_EQ("bazq", received[2]);
+  EXPECT_EQ("corg", received[3]);
+  EXPECT_EQ("x", received[4]);
+  EXPECT_FALSE(truncated[0]);
+  EXPECT_FALSE(truncated[1]);
+  EXPECT_TRUE(truncated[2]);
+  EXPECT_TRUE(truncated[3]);
+  EXPECT_FALSE(truncated[4]);
+  EXPECT_FALSE(receiver->tryReceiveBuffered());
+
+#if __linux__
+  // Loopback delivery is synchronous, so the first recvmmsg() sees a full batch.
+  EXPECT_EQ(2, syscalls);
+#endif
+}
+
 #endif  // !_WIN32
 
 #ifdef __linux__  // Abstract unix sockets are only supported on Linux
@@ -614,5 +908,29 @@ KJ_TEST("Network::restrictPeers()") {
   KJ_EXPECT(conn->readAllText().wait(w) == "");
 }
 
+KJ_TEST("Network DNS lookups share results") {
+  auto ioContext = setupAsyncIo();
+  auto& w = ioContext.waitScope;
+  auto& network = ioContext.provider->getNetwork();
+
+  // Concurrent lookups of one name share a getaddrinfo() call, and later ones are served from the
+  // cache, but each still gets its own port hint.
+  auto promise1 = network.parseAddress("localhost", 80);
+  auto promise2 = network.parseAddress("localhost", 443);
+  auto addr1 = promise1.wait(w)->toString();
+  auto addr2 = promise2.wait(w)->toString();
+  KJ_EXPECT(addr1.endsWith(":80"), addr1);
+  KJ_EXPECT(addr2.endsWith(":443"), addr2);
+
+  auto addr3 = network.parseAddress("localhost", 8080).wait(w)->toString();
+  KJ_EXPECT(addr3.endsWith(":8080"), addr3);
+
+  // A restricted network shares the cache, but still applies its own filter.
+  auto restrictedNetwork = network.restrictPeers({"public"});
+  auto restricted = restrictedNetwork->parseAddress("localhost", 80).wait(w);
+  KJ_EXPECT(restricted->toString().endsWith(":80"));
+  KJ_EXPECT_THROW_MESSAGE("restrictPeers", restricted->connect().wait(w));
+}
+
 }  // namespace
 }  // namespace kj
@@ -28,7 +28,9 @@
 #include "debug.h"
 #include "thread.h"
 #include "io.h"
+#include "filesystem.h"
 #include "miniposix.h"
+#include "map.h"
 #include <unistd.h>
 #include <sys/uio.h>
 #include <errno.h>
@@ -46,6 +48,10 @@
 #include <poll.h>
 #include <limits.h>
 #include <sys/ioctl.h>
+#if __linux__
+#include <linux/filter.h>
+#include <sys/sendfile.h>
+#endif
 
 namespace kj {
 
@@ -122,19 +128,45 @@ private:
 
 // =======================================================================================
 
+#if __linux__
+constexpr size_t MAX_SENDFILE_CHUNK = 1u << 30;
+constexpr size_t SPLICE_CHUNK = 65536;
+// The default pipe capacity, so that each splice() into the pipe can be drained in full.
+#endif
+
 class AsyncStreamFd: public OwnedFileDescriptor, public AsyncCapabilityStream {
 public:
   AsyncStreamFd(UnixEventPort& eventPort, int fd, uint flags)
       : OwnedFileDescriptor(fd, flags),
-        eventPort(eventPort),
-        observer(eventPort, fd, UnixEventPort::FdObserver::OBSERVE_READ_WRITE) {}
+        eventPort(eventPort) {
+#if KJ_USE_IO_URING
+    ioUring = eventPort.getIoUring();
+    if (ioUring != nullptr) {
+      // Reads and writes don't need readiness notifications, so we only register with epoll if
+      // something else (like fd passing) turns out to need them.
+      return;
+    }
+#endif
+    observer.emplace(eventPort, fd, UnixEventPort::FdObserver::OBSERVE_READ_WRITE);
+  }
   virtual ~AsyncStreamFd() noexcept(false) {}
 
   Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+#if KJ_USE_IO_URING
+    KJ_IF_MAYBE(ring, ioUring) {
+      return tryReadRing(*ring, reinterpret_cast<byte*>(buffer), minBytes, maxBytes, 0);
+    }
+#endif
     return tryReadInternal(buffer, minBytes, maxBytes, 0);
   }
 
   Promise<void> write(const void* buffer, size_t size) override {
+#if KJ_USE_IO_URING
+    if (ioUring != nullptr) {
+      return writePieces(arrayPtr(reinterpret_cast<const byte*>(buffer), size), nullptr);
+    }
+#endif
+
     ssize_t writeResult;
     KJ_NONBLOCKING_SYSCALL(writeResult = ::write(fd, buffer, size)) {
       // Error.
@@ -162,19 +194,35 @@ public:
     buffer = reinterpret_cast<const byte*>(buffer) + n;
     size -= n;
 
-    return observer.whenBecomesWritable().then([=]() {
+    return getObserver().whenBecomesWritable().then([=]() {
       return write(buffer, size);
     });
   }
 
   Promise<void> write(ArrayPtr<const ArrayPtr<const byte>> pieces) override {
     if (pieces.size() == 0) {
-      return writeInternal(nullptr, nullptr);
+      return writePieces(nullptr, nullptr);
     } else {
-      return writeInternal(pieces[0], pieces.slice(1, pieces.size()));
+      return writePieces(pieces[0], pieces.slice(1, pieces.size()));
     }
   }
 
+  Maybe<Promise<uint64_t>> tryPumpFrom(AsyncInputStream& input, uint64_t amount) override {
+#if __linux__
+    // Files and other sockets can be pumped to us entirely within the kernel.
+    KJ_IF_MAYBE(fileStream, kj::dynamicDowncastIfAvailable<AsyncFileInputStream>(input)) {
+      KJ_IF_MAYBE(fileFd, fileStream->getFile().getFd()) {
+        return pumpFromFile(*fileStream, *fileFd, kj::min(amount, fileStream->getLimit()), 0);
+      }
+    } else KJ_IF_MAYBE(streamFd, kj::dynamicDowncastIfAvailable<AsyncStreamFd>(input)) {
+      auto pump = kj::heap<SplicePump>(*streamFd, *this, takeSplicePipe(), amount);
+      auto promise = pump->pump();
+      return promise.attach(kj::mv(pump));
+    }
+#endif
+    return nullptr;
+  }
+
   void shutdownWrite() override {
     // There's no legitimate way to get an AsyncStreamFd that isn't a socket through the
     // UnixAsyncIoProvider interface.
@@ -251,7 +299,7 @@ public:
     ssize_t n;
     KJ_NONBLOCKING_SYSCALL(n = sendmsg(fd, &msg, 0));
     if (n < 0) {
-      return observer.whenBecomesWritable().then([this,fdToSend]() {
+      return getObserver().whenBecomesWritable().then([this,fdToSend]() {
         return sendFd(fdToSend);
       });
     } else {
@@ -276,7 +324,7 @@ public:
 
     if (pollResult == 0) {
       // Not ready yet. We can safely use the edge-triggered observer.
-      return observer.whenBecomesWritable();
+      return getObserver().whenBecomesWritable();
     } else {
       // Ready now.
       return kj::READY_NOW;
@@ -285,7 +333,52 @@ public:
 
 private:
   UnixEventPort& eventPort;
-  UnixEventPort::FdObserver observer;
+  Maybe<UnixEventPort::FdObserver> observer;
+  // Created up-front unless we're using io_uring, in which case it's created on first use.
+
+#if KJ_USE_IO_URING
+  Maybe<UnixEventPort::IoUring&> ioUring;
+#endif
+
+#if __linux__
+  struct SplicePipe {
+    AutoCloseFd in;
+    AutoCloseFd out;
+  };
+  Maybe<SplicePipe> splicePipe;
+  // An empty pipe left over from a previous splice() pump into this stream, so that a relay
+  // which pumps many bodies through one connection doesn't need a new pipe for each.
+
+  SplicePipe takeSplicePipe() {
+    KJ_IF_MAYBE(p, splicePipe) {
+      auto result = kj::mv(*p);
+      splicePipe = nullptr;
+      return result;
+    }
+
+    int fds[2];
+    KJ_SYSCALL(pipe2(fds, O_NONBLOCK | O_CLOEXEC));
+    return { AutoCloseFd(fds[0]), AutoCloseFd(fds[1]) };
+  }
+#endif
+
+  UnixEventPort::FdObserver& getObserver() {
+    KJ_IF_MAYBE(o, observer) {
+      return *o;
+    } else {
+      return observer.emplace(eventPort, fd, UnixEventPort::FdObserver::OBSERVE_READ_WRITE);
+    }
+  }
+
+  Promise<void> writePieces(ArrayPtr<const byte> firstPiece,
+                            ArrayPtr<const ArrayPtr<const byte>> morePieces) {
+#if KJ_USE_IO_URING
+    KJ_IF_MAYBE(ring, ioUring) {
+      return writeRing(*ring, firstPiece, morePieces);
+    }
+#endif
+    return writeInternal(firstPiece, morePieces);
+  }
 
   Promise<size_t> tryReadInternal(void* buffer, size_t minBytes, size_t maxBytes,
                                   size_t alreadyRead) {
@@ -310,7 +403,7 @@ private:
 
     if (n < 0) {
       // Read would block.
-      return observer.whenBecomesReadable().then([=]() {
+      return getObserver().whenBecomesReadable().then([=]() {
         return tryReadInternal(buffer, minBytes, maxBytes, alreadyRead);
       });
     } else if (n == 0) {
@@ -327,7 +420,7 @@ private:
       maxBytes -= n;
       alreadyRead += n;
 
-      KJ_IF_MAYBE(atEnd, observer.atEndHint()) {
+      KJ_IF_MAYBE(atEnd, getObserver().atEndHint()) {
         if (*atEnd) {
           // We've already received an indication that the next read() will return EOF, so there's
           // nothing to wait for.
@@ -340,7 +433,7 @@ private:
           // that even if it was received since then, whenBecomesReadable() will catch that. So,
           // let's go ahead and skip calling read() here and instead go straight to waiting for
           // more input.
-          return observer.whenBecomesReadable().then([=]() {
+          return getObserver().whenBecomesReadable().then([=]() {
             return tryReadInternal(buffer, minBytes, maxBytes, alreadyRead);
           });
         }
@@ -401,7 +494,7 @@ private:
           return writeInternal(firstPiece, morePieces);
         }
 
-        return observer.whenBecomesWritable().then([=]() {
+        return getObserver().whenBecomesWritable().then([=]() {
           return writeInternal(firstPiece, morePieces);
         });
       } else if (morePieces.size() == 0) {
@@ -418,6 +511,187 @@ private:
     }
   }
 
+#if __linux__
+  Promise<uint64_t> pumpFromFile(AsyncFileInputStream& input, int fileFd,
+                                 uint64_t amount, uint64_t doneSoFar) {
+    while (doneSoFar < amount) {
+      off_t pos = input.getOffset();
+      ssize_t n;
+      KJ_SYSCALL_HANDLE_ERRORS(
+          n = ::sendfile(fd, fileFd, &pos, kj::min(amount - doneSoFar, MAX_SENDFILE_CHUNK))) {
+        case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+        case EWOULDBLOCK:
+#endif
+          return getObserver().whenBecomesWritable()
+              .then([this,&input,fileFd,amount,doneSoFar]() {
+            return pumpFromFile(input, fileFd, amount, doneSoFar);
+          });
+        case EINVAL:
+        case ENOSYS:
+          // This kind of file can't be sent with sendfile(). Fall back to copying.
+          return copyFrom(input, amount, doneSoFar);
+        default:
+          KJ_FAIL_SYSCALL("sendfile", error) { return doneSoFar; }
+      }
+
+      if (n == 0) break;  // EOF
+      input.skip(n);
+      doneSoFar += n;
+    }
+    return doneSoFar;
+  }
+
+  Promise<uint64_t> copyFrom(AsyncInputStream& input, uint64_t amount, uint64_t doneSoFar) {
+    // Naive read/write pump, for when the kernel turns out not to support our fast path.
+
+    if (doneSoFar >= amount) return doneSoFar;
+
+    auto buffer = kj::heapArray<byte>(kj::min(amount - doneSoFar, SPLICE_CHUNK));
+    auto ptr = buffer.asPtr();
+    return input.tryRead(ptr.begin(), 1, ptr.size())
+        .then([this,&input,amount,doneSoFar,ptr](size_t n) -> Promise<uint64_t> {
+      if (n == 0) return doneSoFar;
+      return write(ptr.begin(), n).then([this,&input,amount,doneSoFar,n]() {
+        return copyFrom(input, amount, doneSoFar + n);
+      });
+    }).attach(kj::mv(buffer));
+  }
+
+  class SplicePump {
+    // Moves data from one socket to another via a pipe, using splice(), so that it never enters
+    // user space.
+
+  public:
+    SplicePump(AsyncStreamFd& input, AsyncStreamFd& output, SplicePipe pipe, uint64_t amount)
+        : input(input), output(output), pipe(kj::mv(pipe)), amount(amount) {}
+    ~SplicePump() noexcept(false) {
+      if (inPipe == 0) {
+        // Nothing stranded in the pipe, so the output can reuse it for its next pump.
+        output.splicePipe = kj::mv(pipe);
+      }
+    }
+    KJ_DISALLOW_COPY(SplicePump);
+
+    Promise<uint64_t> pump() {
+      for (;;) {
+        // Drain the pipe first.
+        while (inPipe > 0) {
+          ssize_t n;
+          KJ_NONBLOCKING_SYSCALL(n = splice(pipe.in, nullptr, output.fd, nullptr, inPipe,
+                                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) {
+            goto error;
+          }
+          if (n < 0) {
+            return output.getObserver().whenBecomesWritable().then([this]() { return pump(); });
+          }
+          inPipe -= n;
+          doneSoFar += n;
+        }
+
+        if (doneSoFar >= amount) return doneSoFar;
+
+        ssize_t n;
+        KJ_SYSCALL_HANDLE_ERRORS(n = splice(input.fd, nullptr, pipe.out, nullptr,
+                                            kj::min(amount - doneSoFar, SPLICE_CHUNK),
+                                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) {
+          case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+          case EWOULDBLOCK:
+#endif
+            return input.getObserver().whenBecomesReadable().then([this]() { return pump(); });
+          case EINVAL:
+          case ENOSYS:
+            // One of the sockets doesn't support splice(). Fall back to copying.
+            return output.copyFrom(input, amount, doneSoFar);
+          default:
+            KJ_FAIL_SYSCALL("splice", error) { goto error; }
+        }
+
+        if (n == 0) return doneSoFar;  // EOF
+        inPipe = n;
+      }
+
+    error:
+      return doneSoFar;
+    }
+
+  private:
+    AsyncStreamFd& input;
+    AsyncStreamFd& output;
+    SplicePipe pipe;
+    uint64_t amount;
+    uint64_t doneSoFar = 0;
+    size_t inPipe = 0;
+  };
+#endif  // __linux__
+
+#if KJ_USE_IO_URING
+  Promise<size_t> tryReadRing(UnixEventPort::IoUring& ring, byte* buffer,
+                              size_t minBytes, size_t maxBytes, size_t alreadyRead) {
+    // Like tryReadInternal(), but the kernel waits for readability on our behalf.
+
+    return ring.read(fd, arrayPtr(buffer, maxBytes))
+        .then([this,&ring,buffer,minBytes,maxBytes,alreadyRead](int n) -> Promise<size_t> {
+      if (n < 0) {
+        if (n == -EAGAIN || n == -EINTR) {
+          // Someone else drained the fd between the readiness report and our read. The next
+          // read waits for readiness again.
+          return tryReadRing(ring, buffer, minBytes, maxBytes, alreadyRead);
+        }
+        KJ_FAIL_SYSCALL("read", -n) { break; }
+        return alreadyRead;
+      } else if (n == 0) {
+        // EOF -OR- maxBytes == 0.
+        return alreadyRead;
+      } else if (implicitCast<size_t>(n) >= minBytes) {
+        return alreadyRead + n;
+      } else {
+        return tryReadRing(ring, buffer + n, minBytes - n, maxBytes - n, alreadyRead + n);
+      }
+    });
+  }
+
+  Promise<void> writeRing(UnixEventPort::IoUring& ring, ArrayPtr<const byte> firstPiece,
+                          ArrayPtr<const ArrayPtr<const byte>> morePieces) {
+    // Like writeInternal(), but the kernel waits for buffer space on our behalf.
+
+    const size_t iovmax = kj::miniposix::iovMax(1 + morePieces.size());
+    KJ_STACK_ARRAY(ArrayPtr<const byte>, pieces, kj::min(1 + morePieces.size(), iovmax), 16, 128);
+    pieces[0] = firstPiece;
+    for (uint i = 1; i < pieces.size(); i++) {
+      pieces[i] = morePieces[i - 1];
+    }
+
+    return ring.write(fd, pieces)
+        .then([this,&ring,firstPiece,morePieces](int result) mutable -> Promise<void> {
+      if (result < 0) {
+        if (result == -EAGAIN || result == -EINTR) {
+          // As in tryReadRing(), someone else filled the buffer first.
+          return writeRing(ring, firstPiece, morePieces);
+        }
+        KJ_FAIL_SYSCALL("writev", -result) { break; }
+        return kj::READY_NOW;
+      }
+
+      // Discard all data that was written, then issue a new write for what's left (if any).
+      size_t n = result;
+      for (;;) {
+        if (n < firstPiece.size()) {
+          return writeRing(ring, firstPiece.slice(n, firstPiece.size()), morePieces);
+        } else if (morePieces.size() == 0) {
+          KJ_DASSERT(n == firstPiece.size(), n);
+          return kj::READY_NOW;
+        } else {
+          n -= firstPiece.size();
+          firstPiece = morePieces[0];
+          morePieces = morePieces.slice(1, morePieces.size());
+        }
+      }
+    });
+  }
+#endif  // KJ_USE_IO_URING
+
   template <typename T>
   kj::Promise<kj::Maybe<T>> tryReceiveFdImpl() {
     struct msghdr msg;
@@ -448,7 +722,7 @@ private:
     ssize_t n;
     KJ_NONBLOCKING_SYSCALL(n = recvmsg(fd, &msg, recvmsgFlags));
     if (n < 0) {
-      return observer.whenBecomesReadable().then([this]() {
+      return getObserver().whenBecomesReadable().then([this]() {
         return tryReceiveFdImpl<T>();
       });
     } else if (n == 0) {
@@ -486,6 +760,8 @@ private:
 
 // =======================================================================================
 
+class HostResolver;
+
 class SocketAddress {
 public:
   SocketAddress(const void* sockaddr, uint len): addrlen(len) {
@@ -591,12 +867,15 @@ public:
   }
 
   static Promise<Array<SocketAddress>> lookupHost(
-      LowLevelAsyncIoProvider& lowLevel, kj::String host, kj::String service, uint portHint,
+      HostResolver& resolver, kj::String host, kj::String service, uint portHint,
       _::NetworkFilter& filter);
   // Perform a DNS lookup.
 
+  static Array<SocketAddress> resolveBlocking(StringPtr host, StringPtr service);
+  // Calls getaddrinfo(), returning distinct addresses. If `service` is empty, ports are zero.
+
   static Promise<Array<SocketAddress>> parse(
-      LowLevelAsyncIoProvider& lowLevel, StringPtr str, uint portHint, _::NetworkFilter& filter) {
+      HostResolver& resolver, StringPtr str, uint portHint, _::NetworkFilter& filter) {
     // TODO(someday):  Allow commas in `str`.
 
     SocketAddress result;
@@ -690,7 +969,7 @@ public:
       port = strtoul(portText->cStr(), &endptr, 0);
       if (portText->size() == 0 || *endptr != '\0') {
         // Not a number.  Maybe it's a service name.  Fall back to DNS.
-        return lookupHost(lowLevel, kj::heapString(addrPart), kj::heapString(*portText), portHint,
+        return lookupHost(resolver, kj::heapString(addrPart), kj::heapString(*portText), portHint,
                           filter);
       }
       KJ_REQUIRE(port < 65536, "Port number too large.");
@@ -753,7 +1032,7 @@ public:
       }
       case 0:
         // It's apparently not a simple address...  fall back to DNS.
-        return lookupHost(lowLevel, kj::heapString(addrPart), nullptr, port, filter);
+        return lookupHost(resolver, kj::heapString(addrPart), nullptr, port, filter);
       default:
         KJ_FAIL_SYSCALL("inet_pton", errno, af, addrPart);
     }
@@ -789,155 +1068,212 @@ private:
     struct sockaddr_storage storage;
   } addr;
 
-  struct LookupParams;
-  class LookupReader;
+  void setPort(uint port) {
+    switch (addr.generic.sa_family) {
+      case AF_INET: addr.inet4.sin_port = htons(port); break;
+      case AF_INET6: addr.inet6.sin6_port = htons(port); break;
+      default: break;
+    }
+  }
 };
 
-class SocketAddress::LookupReader {
-  // Reads SocketAddresses off of a pipe coming from another thread that is performing
-  // getaddrinfo.
+class HostResolver {
+  // Resolves host names for a SocketNetwork and the networks derived from it with restrictPeers().
+  //
+  // getaddrinfo() is the only cross-platform DNS API and it is blocking, so lookups run on a small
+  // thread pool shared by the whole process rather than each on a new thread. Results are cached
+  // for CACHE_TTL, and concurrent lookups of the same name share one getaddrinfo() call.
+  // getaddrinfo() doesn't tell us the records' actual TTLs, so CACHE_TTL is kept short. Failed
+  // lookups are not cached.
+  //
+  // Results are delivered through the calling thread's Executor, so the event loop's EventPort
+  // must implement wake(), as UnixEventPort does.
 
 public:
-  LookupReader(kj::Own<Thread>&& thread, kj::Own<AsyncInputStream>&& input,
-               _::NetworkFilter& filter)
-      : thread(kj::mv(thread)), input(kj::mv(input)), filter(filter) {}
-
-  ~LookupReader() {
-    if (thread) thread->detach();
-  }
-
-  Promise<Array<SocketAddress>> read() {
-    return input->tryRead(&current, sizeof(current), sizeof(current)).then(
-        [this](size_t n) -> Promise<Array<SocketAddress>> {
-      if (n < sizeof(current)) {
-        thread = nullptr;
-        // getaddrinfo()'s docs seem to say it will never return an empty list, but let's check
-        // anyway.
-        KJ_REQUIRE(addresses.size() > 0, "DNS lookup returned no permitted addresses.") { break; }
-        return addresses.releaseAsArray();
-      } else {
-        // getaddrinfo() can return multiple copies of the same address for several reasons.
-        // A major one is that we don't give it a socket type (SOCK_STREAM vs. SOCK_DGRAM), so
-        // it may return two copies of the same address, one for each type, unless it explicitly
-        // knows that the service name given is specific to one type.  But we can't tell it a type,
-        // because we don't actually know which one the user wants, and if we specify SOCK_STREAM
-        // while the user specified a UDP service name then they'll get a resolution error which
-        // is lame.  (At least, I think that's how it works.)
-        //
-        // So we instead resort to de-duping results.
-        if (alreadySeen.insert(current).second) {
-          if (current.parseAllowedBy(filter)) {
-            addresses.add(current);
-          }
-        }
-        return read();
-      }
-    });
-  }
+  explicit HostResolver(Timer& timer): timer(timer) {}
+  KJ_DISALLOW_COPY(HostResolver);
+
+  Promise<Array<SocketAddress>> resolve(kj::String host, kj::String service);
+  // Returns the distinct addresses for `host` and `service`, before any NetworkFilter is applied.
+  // If `service` is empty, ports are zero.
 
 private:
-  kj::Own<Thread> thread;
-  kj::Own<AsyncInputStream> input;
-  _::NetworkFilter& filter;
-  SocketAddress current;
-  kj::Vector<SocketAddress> addresses;
-  std::set<SocketAddress> alreadySeen;
-};
+  struct Entry: public Refcounted {
+    Maybe<Array<SocketAddress>> addresses;
+    Maybe<Exception> error;
+    // Both null while the lookup is in flight.
+
+    TimePoint expires = kj::origin<TimePoint>();
+    ForkedPromise<void> done = nullptr;
+
+    Own<Entry> addRef() { return kj::addRef(*this); }
+  };
+
+  struct LookupParams {
+    kj::String host;
+    kj::String service;
+  };
+
+  static constexpr Duration CACHE_TTL = 30 * SECONDS;
+  static constexpr size_t MAX_ENTRIES = 1024;
+
+  Timer& timer;
+  HashMap<String, Own<Entry>> entries;
+  // Keyed by host and service, separated by NUL.
 
-struct SocketAddress::LookupParams {
-  kj::String host;
-  kj::String service;
+  static const ThreadPool& getThreadPool();
+  void evict(TimePoint now);
 };
 
-Promise<Array<SocketAddress>> SocketAddress::lookupHost(
-    LowLevelAsyncIoProvider& lowLevel, kj::String host, kj::String service, uint portHint,
-    _::NetworkFilter& filter) {
-  // This shitty function spawns a thread to run getaddrinfo().  Unfortunately, getaddrinfo() is
-  // the only cross-platform DNS API and it is blocking.
-  //
-  // TODO(perf):  Use a thread pool?  Maybe kj::Thread should use a thread pool automatically?
-  //   Maybe use the various platform-specific asynchronous DNS libraries?  Please do not implement
-  //   a custom DNS resolver...
+constexpr Duration HostResolver::CACHE_TTL;
+constexpr size_t HostResolver::MAX_ENTRIES;
 
-  int fds[2];
-#if __linux__ && !__BIONIC__
-  KJ_SYSCALL(pipe2(fds, O_NONBLOCK | O_CLOEXEC));
-#else
-  KJ_SYSCALL(pipe(fds));
-#endif
+const ThreadPool& HostResolver::getThreadPool() {
+  // Deliberately never destroyed: a worker may be stuck in getaddrinfo() for a long time, and the
+  // process shouldn't have to wait for it in order to exit.
+  static const ThreadPool* pool = new ThreadPool(4);
+  return *pool;
+}
 
-  auto input = lowLevel.wrapInputFd(fds[0], NEW_FD_FLAGS);
-
-  int outFd = fds[1];
-
-  LookupParams params = { kj::mv(host), kj::mv(service) };
-
-  auto thread = heap<Thread>(kj::mvCapture(params, [outFd,portHint](LookupParams&& params) {
-    FdOutputStream output((AutoCloseFd(outFd)));
-
-    struct addrinfo* list;
-    int status = getaddrinfo(
-        params.host == "*" ? nullptr : params.host.cStr(),
-        params.service == nullptr ? nullptr : params.service.cStr(),
-        nullptr, &list);
-    if (status == 0) {
-      KJ_DEFER(freeaddrinfo(list));
-
-      struct addrinfo* cur = list;
-      while (cur != nullptr) {
-        if (params.service == nullptr) {
-          switch (cur->ai_addr->sa_family) {
-            case AF_INET:
-              ((struct sockaddr_in*)cur->ai_addr)->sin_port = htons(portHint);
-              break;
-            case AF_INET6:
-              ((struct sockaddr_in6*)cur->ai_addr)->sin6_port = htons(portHint);
-              break;
-            default:
-              break;
-          }
-        }
+Promise<Array<SocketAddress>> HostResolver::resolve(kj::String host, kj::String service) {
+  auto key = kj::str(host, '\0', service);
+  auto now = timer.now();
 
-        SocketAddress addr;
-        memset(&addr, 0, sizeof(addr));  // mollify valgrind
-        if (params.host == "*") {
-          // Set up a wildcard SocketAddress.  Only use the port number returned by getaddrinfo().
-          addr.wildcard = true;
-          addr.addrlen = sizeof(addr.addr.inet6);
-          addr.addr.inet6.sin6_family = AF_INET6;
-          switch (cur->ai_addr->sa_family) {
-            case AF_INET:
-              addr.addr.inet6.sin6_port = ((struct sockaddr_in*)cur->ai_addr)->sin_port;
-              break;
-            case AF_INET6:
-              addr.addr.inet6.sin6_port = ((struct sockaddr_in6*)cur->ai_addr)->sin6_port;
-              break;
-            default:
-              addr.addr.inet6.sin6_port = portHint;
-              break;
-          }
-        } else {
-          addr.addrlen = cur->ai_addrlen;
-          memcpy(&addr.addr.generic, cur->ai_addr, cur->ai_addrlen);
-        }
-        KJ_ASSERT_CAN_MEMCPY(SocketAddress);
-        output.write(&addr, sizeof(addr));
-        cur = cur->ai_next;
-      }
-    } else if (status == EAI_SYSTEM) {
-      KJ_FAIL_SYSCALL("getaddrinfo", errno, params.host, params.service) {
-        return;
+  Entry* entry = nullptr;
+  KJ_IF_MAYBE(existing, entries.find(key)) {
+    auto& e = **existing;
+    KJ_IF_MAYBE(addresses, e.addresses) {
+      if (now < e.expires) {
+        return kj::heapArray<SocketAddress>(*addresses);
       }
+    } else if (e.error == nullptr) {
+      // Someone else is already looking this up.
+      entry = &e;
+    }
+  }
+
+  if (entry == nullptr) {
+    auto newEntry = kj::refcounted<Entry>();
+    entry = newEntry.get();
+
+    // The entry owns `done`, so the continuation may refer to it. It mustn't refer to `this`,
+    // though, since callers waiting on the entry may outlive the resolver.
+    Timer& timer = this->timer;
+    LookupParams params = { kj::mv(host), kj::mv(service) };
+    entry->done = getThreadPool().run(kj::mvCapture(params, [](LookupParams&& params) {
+      return SocketAddress::resolveBlocking(params.host, params.service);
+    })).then([entry,&timer](Array<SocketAddress> addresses) {
+      entry->addresses = kj::mv(addresses);
+      entry->expires = timer.now() + CACHE_TTL;
+    }, [entry](Exception&& exception) {
+      entry->error = kj::mv(exception);
+    }).fork();
+
+    KJ_IF_MAYBE(existing, entries.find(key)) {
+      *existing = kj::mv(newEntry);
     } else {
-      KJ_FAIL_REQUIRE("DNS lookup failed.",
-                      params.host, params.service, gai_strerror(status)) {
-        return;
-      }
+      if (entries.size() >= MAX_ENTRIES) evict(now);
+      entries.insert(kj::mv(key), kj::mv(newEntry));
+    }
+  }
+
+  return entry->done.addBranch().then(kj::mvCapture(entry->addRef(),
+      [](Own<Entry>&& entry) -> Array<SocketAddress> {
+    KJ_IF_MAYBE(e, entry->error) {
+      kj::throwFatalException(kj::cp(*e));
     }
+    return kj::heapArray<SocketAddress>(KJ_ASSERT_NONNULL(entry->addresses));
   }));
+}
+
+void HostResolver::evict(TimePoint now) {
+  kj::Vector<String> stale;
+  for (auto& e: entries) {
+    if (e.value->error != nullptr || (e.value->addresses != nullptr && e.value->expires <= now)) {
+      stale.add(kj::heapString(e.key));
+    }
+  }
+  for (auto& key: stale) {
+    entries.erase(key);
+  }
+
+  if (entries.size() >= MAX_ENTRIES) {
+    // Mostly fresh entries; start over. Lookups in flight continue for those waiting on them.
+    entries.clear();
+  }
+}
+
+Array<SocketAddress> SocketAddress::resolveBlocking(StringPtr host, StringPtr service) {
+  struct addrinfo* list;
+  int status = getaddrinfo(
+      host == "*" ? nullptr : host.cStr(),
+      service == nullptr ? nullptr : service.cStr(),
+      nullptr, &list);
+  if (status == EAI_SYSTEM) {
+    KJ_FAIL_SYSCALL("getaddrinfo", errno, host, service);
+  } else if (status != 0) {
+    KJ_FAIL_REQUIRE("DNS lookup failed.", host, service, gai_strerror(status));
+  }
+  KJ_DEFER(freeaddrinfo(list));
+
+  kj::Vector<SocketAddress> addresses;
+  std::set<SocketAddress> alreadySeen;
+  for (struct addrinfo* cur = list; cur != nullptr; cur = cur->ai_next) {
+    SocketAddress addr;
+    if (host == "*") {
+      // Set up a wildcard SocketAddress.  Only use the port number returned by getaddrinfo().
+      addr.wildcard = true;
+      addr.addrlen = sizeof(addr.addr.inet6);
+      addr.addr.inet6.sin6_family = AF_INET6;
+      switch (cur->ai_addr->sa_family) {
+        case AF_INET:
+          addr.addr.inet6.sin6_port = ((struct sockaddr_in*)cur->ai_addr)->sin_port;
+          break;
+        case AF_INET6:
+          addr.addr.inet6.sin6_port = ((struct sockaddr_in6*)cur->ai_addr)->sin6_port;
+          break;
+        default:
+          break;
+      }
+    } else {
+      addr.addrlen = cur->ai_addrlen;
+      memcpy(&addr.addr.generic, cur->ai_addr, cur->ai_addrlen);
+    }
 
-  auto reader = heap<LookupReader>(kj::mv(thread), kj::mv(input), filter);
-  return reader->read().attach(kj::mv(reader));
+    // getaddrinfo() can return multiple copies of the same address for several reasons.
+    // A major one is that we don't give it a socket type (SOCK_STREAM vs. SOCK_DGRAM), so
+    // it may return two copies of the same address, one for each type, unless it explicitly
+    // knows that the service name given is specific to one type.  But we can't tell it a type,
+    // because we don't actually know which one the user wants, and if we specify SOCK_STREAM
+    // while the user specified a UDP service name then they'll get a resolution error which
+    // is lame.  (At least, I think that's how it works.)
+    //
+    // So we instead resort to de-duping results.
+    if (alreadySeen.insert(addr).second) {
+      addresses.add(addr);
+    }
+  }
+
+  return addresses.releaseAsArray();
+}
+
+Promise<Array<SocketAddress>> SocketAddress::lookupHost(
+    HostResolver& resolver, kj::String host, kj::String service, uint portHint,
+    _::NetworkFilter& filter) {
+  bool usePortHint = service == nullptr;
+  return resolver.resolve(kj::mv(host), kj::mv(service))
+      .then([usePortHint,portHint,&filter](Array<SocketAddress> addresses) {
+    kj::Vector<SocketAddress> result(addresses.size());
+    for (auto& addr: addresses) {
+      if (usePortHint && !addr.wildcard) addr.setPort(portHint);
+      if (addr.parseAllowedBy(filter)) result.add(addr);
+    }
+
+    // getaddrinfo()'s docs seem to say it will never return an empty list, but let's check
+    // anyway.
+    KJ_REQUIRE(result.size() > 0, "DNS lookup returned no permitted addresses.") { break; }
+    return result.releaseAsArray();
+  });
 }
 
 // =======================================================================================
@@ -950,6 +1286,12 @@ public:
         observer(eventPort, fd, UnixEventPort::FdObserver::OBSERVE_READ) {}
 
   Promise<Own<AsyncIoStream>> accept() override {
+#if KJ_USE_IO_URING
+    KJ_IF_MAYBE(ring, eventPort.getIoUring()) {
+      return acceptRing(*ring);
+    }
+#endif
+
     int newFd;
 
     struct sockaddr_storage addr;
@@ -1008,6 +1350,51 @@ public:
     }
   }
 
+#if KJ_USE_IO_URING
+  Promise<Own<AsyncIoStream>> acceptRing(UnixEventPort::IoUring& ring) {
+    struct PeerAddress {
+      struct sockaddr_storage addr;
+      uint addrlen = sizeof(addr);
+    };
+    auto peer = heap<PeerAddress>();
+    auto promise = ring.accept(fd, reinterpret_cast<struct sockaddr*>(&peer->addr),
+                               &peer->addrlen);
+    auto& peerRef = *peer;
+    return promise.then([this,&ring,&peerRef](int newFd) -> Promise<Own<AsyncIoStream>> {
+      if (newFd >= 0) {
+        if (!filter.shouldAllow(reinterpret_cast<struct sockaddr*>(&peerRef.addr),
+                                peerRef.addrlen)) {
+          // Drop disallowed address.
+          close(newFd);
+          return acceptRing(ring);
+        } else {
+          return Own<AsyncIoStream>(heap<AsyncStreamFd>(eventPort, newFd, NEW_FD_FLAGS));
+        }
+      }
+
+      switch (-newFd) {
+        case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+        case EWOULDBLOCK:
+#endif
+        case EINTR:
+        case ENETDOWN:
+        case EPROTO:
+        case EHOSTDOWN:
+        case EHOSTUNREACH:
+        case ENETUNREACH:
+        case ECONNABORTED:
+        case ETIMEDOUT:
+          // See accept() for why these are ignored.
+          return acceptRing(ring);
+
+        default:
+          KJ_FAIL_SYSCALL("accept", -newFd);
+      }
+    }).attach(kj::mv(peer));
+  }
+#endif  // KJ_USE_IO_URING
+
   uint getPort() override {
     return SocketAddress::getLocalAddress(fd).getPort();
   }
@@ -1021,6 +1408,10 @@ public:
     KJ_SYSCALL(::setsockopt(fd, level, option, value, length));
   }
 
+  Maybe<int> getFd() const override {
+    return fd;
+  }
+
 public:
   UnixEventPort& eventPort;
   LowLevelAsyncIoProvider::NetworkFilter& filter;
@@ -1038,6 +1429,8 @@ public:
   Promise<size_t> send(const void* buffer, size_t size, NetworkAddress& destination) override;
   Promise<size_t> send(
       ArrayPtr<const ArrayPtr<const byte>> pieces, NetworkAddress& destination) override;
+  Promise<void> sendBatch(
+      ArrayPtr<const ArrayPtr<const byte>> datagrams, NetworkAddress& destination) override;
 
   class ReceiverImpl;
 
@@ -1063,10 +1456,90 @@ public:
   UnixEventPort::FdObserver observer;
 };
 
+#if KJ_USE_IO_URING
+class RingAsyncFile final: public AsyncFile {
+  // An AsyncFile whose operations are submitted through the event port's io_uring. Regular files
+  // ignore O_NONBLOCK, so this is the only way to wait on the disk without tying up a thread.
+
+public:
+  RingAsyncFile(UnixEventPort::IoUring& ring, Own<const ReadableFile> file, const File* writable,
+                int fd)
+      : ring(ring), file(kj::mv(file)), writable(writable), fd(fd) {}
+
+  Promise<size_t> read(uint64_t offset, ArrayPtr<byte> buffer) override {
+    return readInternal(offset, buffer, 0);
+  }
+
+  void readahead(uint64_t offset, uint64_t size) override {
+    // Purely a hint, so errors are ignored.
+    ring.fadvise(fd, offset, size, POSIX_FADV_WILLNEED).ignoreResult()
+        .detach([](Exception&&) {});
+  }
+
+  const ReadableFile& getFile() override { return *file; }
+
+  Promise<void> write(uint64_t offset, ArrayPtr<const byte> data) override {
+    KJ_IREQUIRE(writable != nullptr);
+    return writeInternal(offset, data);
+  }
+
+  Promise<void> datasync() override {
+    KJ_IREQUIRE(writable != nullptr);
+    return ring.fsync(fd, true).then([](int result) {
+      if (result < 0) {
+        KJ_FAIL_SYSCALL("fdatasync", -result) { break; }
+      }
+    });
+  }
+
+private:
+  UnixEventPort::IoUring& ring;
+  Own<const ReadableFile> file;
+  const File* writable;
+  int fd;
+
+  Promise<size_t> readInternal(uint64_t offset, ArrayPtr<byte> buffer, size_t alreadyRead) {
+    // The kernel reads at most about 2GiB at once, which looks like a short read.
+    return ring.read(fd, buffer, offset)
+        .then([this,offset,buffer,alreadyRead](int n) mutable -> Promise<size_t> {
+      if (n < 0) {
+        if (n == -EINTR || n == -EAGAIN) {
+          return readInternal(offset, buffer, alreadyRead);
+        }
+        KJ_FAIL_SYSCALL("pread", -n) { break; }
+        return alreadyRead;
+      } else if (n == 0 || implicitCast<size_t>(n) == buffer.size()) {
+        return alreadyRead + n;
+      } else {
+        // Short read, but not at EOF (or not obviously). Keep going, as pread() callers would.
+        return readInternal(offset + n, buffer.slice(n, buffer.size()), alreadyRead + n);
+      }
+    });
+  }
+
+  Promise<void> writeInternal(uint64_t offset, ArrayPtr<const byte> data) {
+    if (data.size() == 0) return kj::READY_NOW;
+
+    return ring.write(fd, arrayPtr(&data, 1), offset)
+        .then([this,offset,data](int n) -> Promise<void> {
+      if (n < 0) {
+        if (n == -EINTR || n == -EAGAIN) {
+          return writeInternal(offset, data);
+        }
+        KJ_FAIL_SYSCALL("pwrite", -n) { break; }
+        return kj::READY_NOW;
+      }
+      KJ_ASSERT(n > 0, "pwrite() returned zero");
+      return writeInternal(offset + n, data.slice(n, data.size()));
+    });
+  }
+};
+#endif  // KJ_USE_IO_URING
+
 class LowLevelAsyncIoProviderImpl final: public LowLevelAsyncIoProvider {
 public:
-  LowLevelAsyncIoProviderImpl()
-      : eventLoop(eventPort), waitScope(eventLoop) {}
+  explicit LowLevelAsyncIoProviderImpl(TimerStrategy timerStrategy = TimerStrategy::ORDERED_SET)
+      : eventPort(timerStrategy), eventLoop(eventPort), waitScope(eventLoop) {}
 
   inline WaitScope& getWaitScope() { return waitScope; }
 
@@ -1088,6 +1561,20 @@ public:
     // especially setting nonblocking mode and taking ownership.
     auto result = heap<AsyncStreamFd>(eventPort, fd, flags);
 
+#if KJ_USE_IO_URING
+    KJ_IF_MAYBE(ring, eventPort.getIoUring()) {
+      return ring->connect(fd, addr, addrlen)
+          .then(kj::mvCapture(result, [](Own<AsyncIoStream>&& stream, int err) {
+        // The kernel waits for the handshake and reports its outcome. EISCONN can show up if
+        // the connection completed between an internal retry and the final check.
+        if (err < 0 && err != -EISCONN) {
+          KJ_FAIL_SYSCALL("connect()", -err) { break; }
+        }
+        return kj::mv(stream);
+      }));
+    }
+#endif
+
     // Unfortunately connect() doesn't fit the mold of KJ_NONBLOCKING_SYSCALL, since it indicates
     // non-blocking using EINPROGRESS.
     for (;;) {
@@ -1128,6 +1615,30 @@ public:
 
   Timer& getTimer() override { return eventPort.getTimer(); }
 
+  Own<AsyncReadableFile> wrapReadableFile(Own<const ReadableFile> file) override {
+#if KJ_USE_IO_URING
+    KJ_IF_MAYBE(ring, eventPort.getIoUring()) {
+      KJ_IF_MAYBE(fd, file->getFd()) {
+        int fdValue = *fd;
+        return heap<RingAsyncFile>(*ring, kj::mv(file), nullptr, fdValue);
+      }
+    }
+#endif
+    return LowLevelAsyncIoProvider::wrapReadableFile(kj::mv(file));
+  }
+  Own<AsyncFile> wrapFile(Own<const File> file) override {
+#if KJ_USE_IO_URING
+    KJ_IF_MAYBE(ring, eventPort.getIoUring()) {
+      KJ_IF_MAYBE(fd, file->getFd()) {
+        int fdValue = *fd;
+        const File* writable = file.get();
+        return heap<RingAsyncFile>(*ring, kj::mv(file), writable, fdValue);
+      }
+    }
+#endif
+    return LowLevelAsyncIoProvider::wrapFile(kj::mv(file));
+  }
+
   UnixEventPort& getEventPort() { return eventPort; }
 
 private:
@@ -1152,6 +1663,14 @@ public:
   }
 
   Own<ConnectionReceiver> listen() override {
+    return listenImpl(false, 0);
+  }
+
+  Own<ConnectionReceiver> listenReusePort(uint steeringGroupSize) override {
+    return listenImpl(true, steeringGroupSize);
+  }
+
+  Own<ConnectionReceiver> listenImpl(bool reusePort, uint steeringGroupSize) {
     if (addrs.size() > 1) {
       KJ_LOG(WARNING, "Bind address resolved to multiple addresses.  Only the first address will "
           "be used.  If this is incorrect, specify the address numerically.  This may be fixed "
@@ -1168,10 +1687,38 @@ public:
       int optval = 1;
       KJ_SYSCALL(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)));
 
+      if (reusePort) {
+#ifdef SO_REUSEPORT
+        KJ_SYSCALL(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)));
+#else
+        KJ_UNIMPLEMENTED("SO_REUSEPORT is not supported on this platform.");
+#endif
+      }
       addrs[0].bind(fd);
 
       // TODO(someday):  Let queue size be specified explicitly in string addresses.
       KJ_SYSCALL(::listen(fd, SOMAXCONN));
+
+      if (steeringGroupSize > 0) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+        // Return the current CPU modulo the group size as the index of the socket to deliver to.
+        // The program applies to the whole group, so attaching it again from each member
+        // replaces it with an identical copy. This must happen after listen(): a socket that
+        // gets a program before it has joined the group ends up in a group of its own.
+        struct sock_filter code[] = {
+          { BPF_LD | BPF_W | BPF_ABS, 0, 0, uint32_t(SKF_AD_OFF + SKF_AD_CPU) },
+          { BPF_ALU | BPF_MOD | BPF_K, 0, 0, steeringGroupSize },
+          { BPF_RET | BPF_A, 0, 0, 0 },
+        };
+        struct sock_fprog program;
+        program.len = kj::size(code);
+        program.filter = code;
+        KJ_SYSCALL(setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                              &program, sizeof(program)));
+#else
+        KJ_UNIMPLEMENTED("SO_REUSEPORT steering programs are not supported on this platform.");
+#endif
+      }
     }
 
     return lowLevel.wrapListenSocketFd(fd, filter, NEW_FD_FLAGS);
@@ -1251,15 +1798,17 @@ private:
 
 class SocketNetwork final: public Network {
 public:
-  explicit SocketNetwork(LowLevelAsyncIoProvider& lowLevel): lowLevel(lowLevel) {}
+  explicit SocketNetwork(LowLevelAsyncIoProvider& lowLevel)
+      : lowLevel(lowLevel), ownResolver(kj::heap<HostResolver>(lowLevel.getTimer())),
+        resolver(*ownResolver) {}
   explicit SocketNetwork(SocketNetwork& parent,
                          kj::ArrayPtr<const kj::StringPtr> allow,
                          kj::ArrayPtr<const kj::StringPtr> deny)
-      : lowLevel(parent.lowLevel), filter(allow, deny, parent.filter) {}
+      : lowLevel(parent.lowLevel), resolver(parent.resolver), filter(allow, deny, parent.filter) {}
 
   Promise<Own<NetworkAddress>> parseAddress(StringPtr addr, uint portHint = 0) override {
     return evalLater(mvCapture(heapString(addr), [this,portHint](String&& addr) {
-      return SocketAddress::parse(lowLevel, addr, portHint, filter);
+      return SocketAddress::parse(resolver, addr, portHint, filter);
     })).then([this](Array<SocketAddress> addresses) -> Own<NetworkAddress> {
       return heap<NetworkAddressImpl>(lowLevel, filter, kj::mv(addresses));
     });
@@ -1280,6 +1829,9 @@ public:
 
 private:
   LowLevelAsyncIoProvider& lowLevel;
+  Own<HostResolver> ownResolver;
+  HostResolver& resolver;
+  // Shared with networks derived through restrictPeers(), which filter the results themselves.
   _::NetworkFilter filter;
 };
 
@@ -1357,47 +1909,121 @@ Promise<size_t> DatagramPortImpl::send(
   }
 }
 
+Promise<void> DatagramPortImpl::sendBatch(
+    ArrayPtr<const ArrayPtr<const byte>> datagrams, NetworkAddress& destination) {
+#if __linux__
+  auto& addr = downcast<NetworkAddressImpl>(destination).chooseOneAddress();
+
+  while (datagrams.size() > 0) {
+    // The kernel caps each sendmmsg() call at UIO_MAXIOV messages.
+    size_t count = kj::min(datagrams.size(), kj::miniposix::iovMax(datagrams.size()));
+    KJ_STACK_ARRAY(struct mmsghdr, msgs, count, 16, 64);
+    KJ_STACK_ARRAY(struct iovec, iov, count, 16, 64);
+    memset(msgs.begin(), 0, msgs.size() * sizeof(msgs[0]));
+
+    for (size_t i: kj::indices(msgs)) {
+      iov[i].iov_base = const_cast<void*>(implicitCast<const void*>(datagrams[i].begin()));
+      iov[i].iov_len = datagrams[i].size();
+      msgs[i].msg_hdr.msg_name = const_cast<void*>(implicitCast<const void*>(addr.getRaw()));
+      msgs[i].msg_hdr.msg_namelen = addr.getRawSize();
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int n;
+    KJ_NONBLOCKING_SYSCALL(n = sendmmsg(fd, msgs.begin(), msgs.size(), 0));
+    if (n < 0) {
+      // Write buffer full.
+      return observer.whenBecomesWritable().then([this, datagrams, &destination]() {
+        return sendBatch(datagrams, destination);
+      });
+    }
+
+    datagrams = datagrams.slice(n, datagrams.size());
+  }
+
+  return READY_NOW;
+#else
+  return DatagramPort::sendBatch(datagrams, destination);
+#endif
+}
+
 class DatagramPortImpl::ReceiverImpl final: public DatagramReceiver {
 public:
   explicit ReceiverImpl(DatagramPortImpl& port, Capacity capacity)
       : port(port),
-        contentBuffer(heapArray<byte>(capacity.content)),
-        ancillaryBuffer(capacity.ancillary > 0 ? heapArray<byte>(capacity.ancillary)
-                                               : Array<byte>(nullptr)) {}
+        contentCapacity(capacity.content),
+        ancillaryCapacity(capacity.ancillary),
+        contentBuffer(heapArray<byte>(contentCapacity * batchSize(capacity))),
+        ancillaryBuffer(ancillaryCapacity > 0
+            ? heapArray<byte>(ancillaryCapacity * batchSize(capacity))
+            : Array<byte>(nullptr)),
+        addrs(heapArray<struct sockaddr_storage>(batchSize(capacity))),
+        iovs(heapArray<struct iovec>(addrs.size())),
+        msgs(heapArray<MultiMsgHdr>(addrs.size())) {}
 
   Promise<void> receive() override {
-    struct msghdr msg;
-    memset(&msg, 0, sizeof(msg));
-
-    struct sockaddr_storage addr;
-    memset(&addr, 0, sizeof(addr));
-    msg.msg_name = &addr;
-    msg.msg_namelen = sizeof(addr);
-
-    struct iovec iov;
-    iov.iov_base = contentBuffer.begin();
-    iov.iov_len = contentBuffer.size();
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = ancillaryBuffer.begin();
-    msg.msg_controllen = ancillaryBuffer.size();
+    if (tryReceiveBuffered()) return READY_NOW;
+
+    for (size_t i: kj::indices(msgs)) {
+      auto& msg = msgs[i].msg_hdr;
+      memset(&msg, 0, sizeof(msg));
+      memset(&addrs[i], 0, sizeof(addrs[i]));
+      msg.msg_name = &addrs[i];
+      msg.msg_namelen = sizeof(addrs[i]);
+
+      iovs[i].iov_base = contentBuffer.begin() + i * contentCapacity;
+      iovs[i].iov_len = contentCapacity;
+      msg.msg_iov = &iovs[i];
+      msg.msg_iovlen = 1;
+      if (ancillaryCapacity > 0) {
+        msg.msg_control = ancillaryBuffer.begin() + i * ancillaryCapacity;
+        msg.msg_controllen = ancillaryCapacity;
+      }
+      msgs[i].msg_len = 0;
+    }
 
-    ssize_t n;
-    KJ_NONBLOCKING_SYSCALL(n = recvmsg(port.fd, &msg, 0));
+    int n;
+#if __linux__
+    KJ_NONBLOCKING_SYSCALL(n = recvmmsg(port.fd, msgs.begin(), msgs.size(), 0, nullptr));
+#else
+    {
+      ssize_t size;
+      KJ_NONBLOCKING_SYSCALL(size = recvmsg(port.fd, &msgs[0].msg_hdr, 0));
+      if (size >= 0) msgs[0].msg_len = size;
+      n = size < 0 ? -1 : 1;
+    }
+#endif
 
     if (n < 0) {
       // No data available. Wait.
       return port.observer.whenBecomesReadable().then([this]() {
         return receive();
       });
+    }
+
+    receivedCount = n;
+    nextIndex = 0;
+    if (tryReceiveBuffered()) {
+      return READY_NOW;
     } else {
+      // Every datagram came from a disallowed source.
+      return receive();
+    }
+  }
+
+  bool tryReceiveBuffered() override {
+    while (nextIndex < receivedCount) {
+      size_t i = nextIndex++;
+      auto& msg = msgs[i].msg_hdr;
+
       if (!port.filter.shouldAllow(reinterpret_cast<const struct sockaddr*>(msg.msg_name),
                                    msg.msg_namelen)) {
         // Ignore message from disallowed source.
-        return receive();
+        continue;
       }
 
-      receivedSize = n;
+      content = contentBuffer.slice(i * contentCapacity, i * contentCapacity + msgs[i].msg_len);
       contentTruncated = msg.msg_flags & MSG_TRUNC;
 
       source.emplace(port.lowLevel, port.filter, msg.msg_name, msg.msg_namelen);
@@ -1405,6 +2031,7 @@ public:
       ancillaryList.resize(0);
       ancillaryTruncated = msg.msg_flags & MSG_CTRUNC;
 
+      const byte* ancillaryEnd = ancillaryBuffer.begin() + (i + 1) * ancillaryCapacity;
       for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
         // On some platforms (OSX), a cmsghdr's length may cross the end of the ancillary buffer
@@ -1412,7 +2039,7 @@ public:
         // truncated to fit within the buffer.
 
         const byte* pos = reinterpret_cast<const byte*>(cmsg);
-        size_t available = ancillaryBuffer.end() - pos;
+        size_t available = ancillaryEnd - pos;
         if (available < CMSG_SPACE(0)) {
           // The buffer ends in the middle of the header. We can't use this message.
           // (On Linux, this never happens, because the message is not included if there isn't
@@ -1432,12 +2059,14 @@ public:
             cmsg->cmsg_level, cmsg->cmsg_type, arrayPtr(begin, end)));
       }
 
-      return READY_NOW;
+      return true;
     }
+
+    return false;
   }
 
   MaybeTruncated<ArrayPtr<const byte>> getContent() override {
-    return { contentBuffer.slice(0, receivedSize), contentTruncated };
+    return { content, contentTruncated };
   }
 
   MaybeTruncated<ArrayPtr<const AncillaryMessage>> getAncillary() override {
@@ -1449,11 +2078,41 @@ public:
   }
 
 private:
+#if __linux__
+  typedef struct mmsghdr MultiMsgHdr;
+#else
+  struct MultiMsgHdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+  };
+#endif
+
+  static uint batchSize(const Capacity& capacity) {
+#if __linux__
+    return kj::max(capacity.batch, 1u);
+#else
+    // Without recvmmsg() we read one datagram per call, so don't waste space on more.
+    return 1;
+#endif
+  }
+
   DatagramPortImpl& port;
+  size_t contentCapacity;
+  size_t ancillaryCapacity;
   Array<byte> contentBuffer;
   Array<byte> ancillaryBuffer;
+  Array<struct sockaddr_storage> addrs;
+  Array<struct iovec> iovs;
+  Array<MultiMsgHdr> msgs;
+  // One slot per datagram in a batch. Slot i owns the i'th `contentCapacity`-sized chunk of
+  // `contentBuffer` and the i'th `ancillaryCapacity`-sized chunk of `ancillaryBuffer`.
+
+  size_t receivedCount = 0;
+  size_t nextIndex = 0;
+  // Slots [nextIndex, receivedCount) hold datagrams read but not yet handed out.
+
   Vector<AncillaryMessage> ancillaryList;
-  size_t receivedSize = 0;
+  ArrayPtr<const byte> content;
   bool contentTruncated = false;
   bool ancillaryTruncated = false;
 
@@ -1562,8 +2221,8 @@ Own<AsyncIoProvider> newAsyncIoProvider(LowLevelAsyncIoProvider& lowLevel) {
   return kj::heap<AsyncIoProviderImpl>(lowLevel);
 }
 
-AsyncIoContext setupAsyncIo() {
-  auto lowLevel = heap<LowLevelAsyncIoProviderImpl>();
+AsyncIoContext setupAsyncIo(TimerStrategy timerStrategy) {
+  auto lowLevel = heap<LowLevelAsyncIoProviderImpl>(timerStrategy);
   auto ioProvider = kj::heap<AsyncIoProviderImpl>(*lowLevel);
   auto& waitScope = lowLevel->getWaitScope();
   auto& eventPort = lowLevel->getEventPort();
@@ -891,6 +891,23 @@ public:
   }
 
   Promise<Own<AsyncIoStream>> accept() override {
+    // Keep ACCEPT_POOL_SIZE AcceptEx() calls posted at all times, so that when connections arrive
+    // in a burst the kernel completes them back to back, rather than each waiting for the
+    // application to come back around and post the next one. The pool is a ring: posted calls
+    // complete in the order they were posted, so we hand them out in that order too.
+    if (acceptPool.empty()) {
+      for (uint i = 0; i < ACCEPT_POOL_SIZE; i++) {
+        acceptPool.add(postAccept());
+      }
+    }
+
+    auto result = kj::mv(acceptPool[nextAccept]);
+    acceptPool[nextAccept] = postAccept();
+    nextAccept = (nextAccept + 1) % acceptPool.size();
+    return kj::mv(result);
+  }
+
+  Promise<Own<AsyncIoStream>> postAccept() {
     SOCKET newFd = address.socket(SOCK_STREAM);
     KJ_ASSERT(newFd != INVALID_SOCKET);
     auto result = heap<AsyncStreamFd>(eventPort, newFd, NEW_FD_FLAGS);
@@ -953,14 +970,20 @@ public:
   Own<Win32EventPort::IoObserver> observer;
   LPFN_ACCEPTEX acceptEx = nullptr;
   SocketAddress address;
+
+  static constexpr uint ACCEPT_POOL_SIZE = 8;
+  Vector<Promise<Own<AsyncIoStream>>> acceptPool;
+  uint nextAccept = 0;
+  // Posted but not yet claimed AcceptEx() calls, filled on the first accept(). Declared after
+  // `observer` so that they are canceled before it goes away.
 };
 
 // TODO(someday): DatagramPortImpl
 
 class LowLevelAsyncIoProviderImpl final: public LowLevelAsyncIoProvider {
 public:
-  LowLevelAsyncIoProviderImpl()
-      : eventLoop(eventPort), waitScope(eventLoop) {}
+  explicit LowLevelAsyncIoProviderImpl(TimerStrategy timerStrategy = TimerStrategy::ORDERED_SET)
+      : eventPort(timerStrategy), eventLoop(eventPort), waitScope(eventLoop) {}
 
   inline WaitScope& getWaitScope() { return waitScope; }
 
@@ -1214,10 +1237,10 @@ Own<AsyncIoProvider> newAsyncIoProvider(LowLevelAsyncIoProvider& lowLevel) {
   return kj::heap<AsyncIoProviderImpl>(lowLevel);
 }
 
-AsyncIoContext setupAsyncIo() {
+AsyncIoContext setupAsyncIo(TimerStrategy timerStrategy) {
   _::initWinsockOnce();
 
-  auto lowLevel = heap<LowLevelAsyncIoProviderImpl>();
+  auto lowLevel = heap<LowLevelAsyncIoProviderImpl>(timerStrategy);
   auto ioProvider = kj::heap<AsyncIoProviderImpl>(*lowLevel);
   auto& waitScope = lowLevel->getWaitScope();
   auto& eventPort = lowLevel->getEventPort();
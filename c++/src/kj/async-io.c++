@@ -30,6 +30,7 @@
 #include "debug.h"
 #include "vector.h"
 #include "io.h"
+#include "filesystem.h"
 
 #if _WIN32
 #include <winsock2.h>
@@ -43,6 +44,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/un.h>
+#include <fcntl.h>
 #endif
 
 namespace kj {
@@ -223,18 +225,38 @@ void AsyncIoStream::getsockname(struct sockaddr* addr, uint* length) {
 void AsyncIoStream::getpeername(struct sockaddr* addr, uint* length) {
   KJ_UNIMPLEMENTED("Not a socket.");
 }
+Maybe<StringPtr> AsyncIoStream::getNegotiatedProtocol() {
+  return nullptr;
+}
 void ConnectionReceiver::getsockopt(int level, int option, void* value, uint* length) {
   KJ_UNIMPLEMENTED("Not a socket.");
 }
 void ConnectionReceiver::setsockopt(int level, int option, const void* value, uint length) {
   KJ_UNIMPLEMENTED("Not a socket.");
 }
+Maybe<int> ConnectionReceiver::getFd() const {
+  return nullptr;
+}
+bool DatagramReceiver::tryReceiveBuffered() {
+  return false;
+}
+Promise<void> DatagramPort::sendBatch(ArrayPtr<const ArrayPtr<const byte>> datagrams,
+                                      NetworkAddress& destination) {
+  if (datagrams.size() == 0) return READY_NOW;
+  return send(datagrams[0].begin(), datagrams[0].size(), destination)
+      .then([this, datagrams, &destination](size_t) {
+    return sendBatch(datagrams.slice(1, datagrams.size()), destination);
+  });
+}
 void DatagramPort::getsockopt(int level, int option, void* value, uint* length) {
   KJ_UNIMPLEMENTED("Not a socket.");
 }
 void DatagramPort::setsockopt(int level, int option, const void* value, uint length) {
   KJ_UNIMPLEMENTED("Not a socket.");
 }
+Own<ConnectionReceiver> NetworkAddress::listenReusePort(uint steeringGroupSize) {
+  KJ_UNIMPLEMENTED("SO_REUSEPORT listeners not implemented.");
+}
 Own<DatagramPort> NetworkAddress::bindDatagramPort() {
   KJ_UNIMPLEMENTED("Datagram sockets not implemented.");
 }
@@ -299,9 +321,238 @@ LowLevelAsyncIoProvider::NetworkFilter& LowLevelAsyncIoProvider::NetworkFilter::
   return result;
 }
 
+// =======================================================================================
+// Asynchronous files
+
+AsyncReadableFile::~AsyncReadableFile() noexcept(false) {}
+
+namespace {
+
+static constexpr uint64_t FILE_STREAM_READAHEAD = 256 * 1024;
+// How far ahead of its position an AsyncReadableFile::newInputStream() stream asks the OS to read.
+
+class AsyncFileReadStream final: public AsyncInputStream {
+public:
+  AsyncFileReadStream(AsyncReadableFile& file, uint64_t offset, uint64_t limit)
+      : file(file), offset(offset), limit(limit), hinted(offset) {}
+
+  Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    // AsyncReadableFile::read() only returns less than requested at EOF, so `minBytes` is
+    // satisfied automatically.
+    size_t n = kj::min(maxBytes, limit);
+    if (n == 0) return size_t(0);
+
+    // Top up the readahead window once less than half of it is left beyond this read.
+    uint64_t end = offset + n;
+    if (hinted < end + FILE_STREAM_READAHEAD / 2) {
+      uint64_t hintEnd = end + kj::min(FILE_STREAM_READAHEAD, limit - n);
+      if (hintEnd > hinted) {
+        uint64_t hintStart = kj::max(hinted, offset);
+        file.readahead(hintStart, hintEnd - hintStart);
+        hinted = hintEnd;
+      }
+    }
+
+    return file.read(offset, arrayPtr(reinterpret_cast<byte*>(buffer), n))
+        .then([this](size_t actual) {
+      offset += actual;
+      limit -= actual;
+      return actual;
+    });
+  }
+
+  Maybe<uint64_t> tryGetLength() override {
+    uint64_t size = file.getFile().stat().size;
+    return size <= offset ? uint64_t(0) : kj::min(size - offset, limit);
+  }
+
+private:
+  AsyncReadableFile& file;
+  uint64_t offset;
+  uint64_t limit;
+  uint64_t hinted;
+  // End of the range most recently passed to readahead().
+};
+
+class AsyncFileWriteStream final: public AsyncOutputStream {
+public:
+  AsyncFileWriteStream(AsyncFile& file, uint64_t offset): file(file), offset(offset) {}
+
+  Promise<void> write(const void* buffer, size_t size) override {
+    uint64_t at = offset;
+    offset += size;
+    return file.write(at, arrayPtr(reinterpret_cast<const byte*>(buffer), size));
+  }
+
+  Promise<void> write(ArrayPtr<const ArrayPtr<const byte>> pieces) override {
+    // The pieces land in disjoint ranges, so they can all be in flight at once.
+    auto promises = heapArrayBuilder<Promise<void>>(pieces.size());
+    for (auto piece: pieces) {
+      promises.add(file.write(offset, piece));
+      offset += piece.size();
+    }
+    return joinPromises(promises.finish());
+  }
+
+private:
+  AsyncFile& file;
+  uint64_t offset;
+};
+
+class ThreadPoolAsyncFile final: public AsyncFile {
+  // Serves both newThreadPoolAsyncFile() overloads. When made from a ReadableFile it is only ever
+  // handed out as an AsyncReadableFile, so `writable` is null.
+
+public:
+  ThreadPoolAsyncFile(Own<const ReadableFile> file, const File* writable, const ThreadPool& pool)
+      : shared(atomicRefcounted<Shared>(kj::mv(file), writable)), pool(pool) {}
+
+  Promise<size_t> read(uint64_t offset, ArrayPtr<byte> buffer) override {
+    return pool.run(ReadTask { atomicAddRef(*shared), offset, buffer.size() })
+        .then([buffer](Array<byte> data) mutable {
+      memcpy(buffer.begin(), data.begin(), data.size());
+      return data.size();
+    });
+  }
+
+  void readahead(uint64_t offset, uint64_t size) override {
+#if !_WIN32
+    if (shared->file->getFd() != nullptr) {
+      pool.run(ReadaheadTask { atomicAddRef(*shared), offset, size })
+          .detach([](Exception&&) {});
+    }
+#endif
+  }
+
+  const ReadableFile& getFile() override { return *shared->file; }
+
+  Promise<void> write(uint64_t offset, ArrayPtr<const byte> data) override {
+    KJ_IREQUIRE(shared->writable != nullptr);
+    return pool.run(WriteTask { atomicAddRef(*shared), offset, heapArray(data) });
+  }
+
+  Promise<void> datasync() override {
+    KJ_IREQUIRE(shared->writable != nullptr);
+    return pool.run(SyncTask { atomicAddRef(*shared) });
+  }
+
+private:
+  struct Shared: public AtomicRefcounted {
+    // Tasks keep their own reference, since a task that has started runs to completion even if
+    // this object is destroyed in the meantime.
+
+    Own<const ReadableFile> file;
+    const File* writable;
+
+    Shared(Own<const ReadableFile> file, const File* writable)
+        : file(kj::mv(file)), writable(writable) {}
+  };
+
+  // Tasks run on the pool. Each owns its data, so that a canceled operation never touches the
+  // caller's buffer from a worker.
+
+  struct ReadTask {
+    Own<const Shared> shared;
+    uint64_t offset;
+    size_t size;
+
+    Array<byte> operator()() {
+      auto data = heapArray<byte>(size);
+      size_t n = shared->file->read(offset, data);
+      return n == size ? kj::mv(data) : heapArray(data.slice(0, n));
+    }
+  };
+
+  struct ReadaheadTask {
+    Own<const Shared> shared;
+    uint64_t offset;
+    uint64_t size;
+
+    void operator()() {
+#if !_WIN32
+      KJ_IF_MAYBE(fd, shared->file->getFd()) {
+        // Purely a hint, so errors are ignored.
+        posix_fadvise(*fd, offset, size, POSIX_FADV_WILLNEED);
+      }
+#endif
+    }
+  };
+
+  struct WriteTask {
+    Own<const Shared> shared;
+    uint64_t offset;
+    Array<byte> data;
+
+    void operator()() { shared->writable->write(offset, data); }
+  };
+
+  struct SyncTask {
+    Own<const Shared> shared;
+
+    void operator()() { shared->writable->datasync(); }
+  };
+
+  Own<const Shared> shared;
+  const ThreadPool& pool;
+};
+
+const ThreadPool& getDefaultFilePool() {
+  // Intentionally leaked, so that no thread can be left using it during static destruction.
+  static const ThreadPool* pool = new ThreadPool(4);
+  return *pool;
+}
+
+}  // namespace
+
+Own<AsyncInputStream> AsyncReadableFile::newInputStream(uint64_t offset, uint64_t limit) {
+  return heap<AsyncFileReadStream>(*this, offset, limit);
+}
+
+Own<AsyncOutputStream> AsyncFile::newOutputStream(uint64_t offset) {
+  return heap<AsyncFileWriteStream>(*this, offset);
+}
+
+Own<AsyncFile> newThreadPoolAsyncFile(Own<const File> file, const ThreadPool& pool) {
+  const File* writable = file.get();
+  return heap<ThreadPoolAsyncFile>(kj::mv(file), writable, pool);
+}
+
+Own<AsyncReadableFile> newThreadPoolAsyncFile(Own<const ReadableFile> file,
+                                              const ThreadPool& pool) {
+  return heap<ThreadPoolAsyncFile>(kj::mv(file), nullptr, pool);
+}
+
+Own<AsyncReadableFile> LowLevelAsyncIoProvider::wrapReadableFile(Own<const ReadableFile> file) {
+  return newThreadPoolAsyncFile(kj::mv(file), getDefaultFilePool());
+}
+
+Own<AsyncFile> LowLevelAsyncIoProvider::wrapFile(Own<const File> file) {
+  return newThreadPoolAsyncFile(kj::mv(file), getDefaultFilePool());
+}
+
 // =======================================================================================
 // Convenience adapters.
 
+void AsyncFileInputStream::skip(uint64_t bytes) {
+  KJ_REQUIRE(bytes <= limit, "skipped past the end of the stream") { bytes = limit; break; }
+  offset += bytes;
+  limit -= bytes;
+}
+
+Promise<size_t> AsyncFileInputStream::tryRead(void* buffer, size_t minBytes, size_t maxBytes) {
+  // ReadableFile::read() only returns less than requested at EOF, so `minBytes` is satisfied
+  // automatically.
+  size_t n = file.read(offset, arrayPtr(reinterpret_cast<byte*>(buffer), kj::min(maxBytes, limit)));
+  offset += n;
+  limit -= n;
+  return n;
+}
+
+Maybe<uint64_t> AsyncFileInputStream::tryGetLength() {
+  uint64_t size = file.stat().size;
+  return size <= offset ? uint64_t(0) : kj::min(size - offset, limit);
+}
+
 Promise<Own<AsyncIoStream>> CapabilityStreamConnectionReceiver::accept() {
   return inner.receiveStream()
       .then([](Own<AsyncCapabilityStream>&& stream) -> Own<AsyncIoStream> {
@@ -43,6 +43,8 @@ class UnixEventPort;
 
 class AutoCloseFd;
 class NetworkAddress;
+class ReadableFile;
+class File;
 class AsyncOutputStream;
 class AsyncIoStream;
 
@@ -130,6 +132,11 @@ public:
   // Note that we don't provide methods that return NetworkAddress because it usually wouldn't
   // be useful. You can't connect() to or listen() on these addresses, obviously, because they are
   // ephemeral addresses for a single connection.
+
+  virtual Maybe<StringPtr> getNegotiatedProtocol();
+  // Returns the application protocol which the two ends agreed on while establishing the
+  // connection, e.g. via TLS ALPN ("h2", "http/1.1"), or null if none was negotiated. The
+  // default implementation returns null.
 };
 
 class AsyncCapabilityStream: public AsyncIoStream {
@@ -203,6 +210,11 @@ public:
   virtual void getsockopt(int level, int option, void* value, uint* length);
   virtual void setsockopt(int level, int option, const void* value, uint length);
   // Same as the methods of AsyncIoStream.
+
+  virtual Maybe<int> getFd() const;
+  // Returns the listening socket's file descriptor, if there is one.  The receiver still owns it.
+  // Other threads may wrap the same descriptor with `wrapListenSocketFd()` (without taking
+  // ownership) to accept connections from it in their own event loops.  The default returns null.
 };
 
 // =======================================================================================
@@ -251,6 +263,16 @@ public:
   // Receive a new message, overwriting this object's content.
   //
   // receive() may reuse the same buffers for content and ancillary data with each call.
+  //
+  // If the receiver was created with `Capacity::batch` greater than 1, a single system call may
+  // read several datagrams at once; receive() then completes immediately with each buffered
+  // datagram in turn before reading from the socket again.
+
+  virtual bool tryReceiveBuffered();
+  // If a datagram from the last batch read is still buffered (see `Capacity::batch`), advance to
+  // it as receive() would and return true. Otherwise, return false without touching the socket.
+  // This lets a busy receiver drain a whole batch without a trip through the event loop per
+  // datagram: call receive(), then tryReceiveBuffered() until it returns false.
 
   template <typename T>
   struct MaybeTruncated {
@@ -284,6 +306,11 @@ public:
     size_t ancillary = 0;
     // How much space to allocate for ancillary messages. As with content, if the ancillary data
     // is larger than this, it will be truncated.
+
+    uint batch = 1;
+    // How many datagrams to read per system call. Where supported (recvmmsg() on Linux), the
+    // receiver reads up to this many datagrams per wakeup and hands them out one at a time.
+    // Buffer space for `content` and `ancillary` is allocated once per datagram in the batch.
   };
 };
 
@@ -293,6 +320,13 @@ public:
   virtual Promise<size_t> send(ArrayPtr<const ArrayPtr<const byte>> pieces,
                                NetworkAddress& destination) = 0;
 
+  virtual Promise<void> sendBatch(ArrayPtr<const ArrayPtr<const byte>> datagrams,
+                                  NetworkAddress& destination);
+  // Send each element of `datagrams` as a separate datagram to `destination`. Where supported
+  // (sendmmsg() on Linux), many datagrams are handed to the kernel per system call. As with
+  // send(), a datagram too large for the transport may be truncated. The default implementation
+  // calls send() once per datagram.
+
   virtual Own<DatagramReceiver> makeReceiver(
       DatagramReceiver::Capacity capacity = DatagramReceiver::Capacity()) = 0;
   // Create a new `Receiver` that can be used to receive datagrams. `capacity` specifies how much
@@ -325,6 +359,24 @@ public:
   //
   // The address must be local.
 
+  virtual Own<ConnectionReceiver> listenReusePort(uint steeringGroupSize = 0);
+  // Like listen(), but sets SO_REUSEPORT so that several receivers can listen on the same address
+  // at once, with the kernel spreading incoming connections among them. This lets a server scale
+  // across cores by running one event loop per thread, each listening through its own receiver
+  // (created from that thread's own Network) and serving what it accepts, rather than
+  // accepting on one thread and handing connections off. If the port is zero, create the first
+  // receiver, then create the rest with its getPort().
+  //
+  // By default the kernel picks a receiver by hashing each connection's addresses. If
+  // `steeringGroupSize` is non-zero, a steering program is attached instead which hands each
+  // connection to the receiver at index `cpu % steeringGroupSize`, where `cpu` is the CPU on
+  // which the connection's packets were processed and indices follow the order in which the
+  // receivers were created. This keeps each connection on one CPU when the group's threads are
+  // pinned to CPUs 0 through `steeringGroupSize - 1`, in creation order. (If no receiver has the
+  // chosen index yet, the kernel falls back to hashing.)
+  //
+  // The default implementation throws UNIMPLEMENTED. Steering is only supported on Linux.
+
   virtual Own<DatagramPort> bindDatagramPort();
   // Open this address as a datagram (e.g. UDP) port.
   //
@@ -471,6 +523,8 @@ public:
   // - IPv6: "1234:5678::abcd", "[1234:5678::abcd]:80"
   // - Local IP wildcard (covers both v4 and v6):  "*", "*:80"
   // - Symbolic names:  "example.com", "example.com:80", "example.com:http", "1.2.3.4:http"
+  //   (On Unix, name lookups run on a shared thread pool and their results are cached briefly;
+  //   concurrent lookups of the same name are merged.)
   // - Unix domain: "unix:/path/to/socket"
 
   struct PipeThread {
@@ -503,6 +557,58 @@ public:
   // continues to count while the system is suspended.
 };
 
+// =======================================================================================
+// Asynchronous files
+
+class AsyncReadableFile {
+  // A file whose reads don't block the event loop while waiting on the disk. Get one from
+  // `LowLevelAsyncIoProvider::wrapReadableFile()`.
+  //
+  // Any buffer passed to an operation must remain valid until its promise resolves or is dropped.
+  // Operations may be in flight concurrently.
+
+public:
+  virtual ~AsyncReadableFile() noexcept(false);
+
+  virtual Promise<size_t> read(uint64_t offset, ArrayPtr<byte> buffer) = 0;
+  // Like ReadableFile::read(): fills `buffer` unless EOF comes first, and resolves to the number
+  // of bytes read.
+
+  virtual void readahead(uint64_t offset, uint64_t size) = 0;
+  // Hints that the given range will be read soon, so that the OS can start fetching it now. Does
+  // not wait, and failures are ignored.
+
+  virtual const ReadableFile& getFile() = 0;
+  // The underlying file, e.g. for stat(). Reading it directly would block.
+
+  Own<AsyncInputStream> newInputStream(uint64_t offset = 0, uint64_t limit = kj::maxValue);
+  // An AsyncInputStream which reads the file starting at `offset`, producing at most `limit` bytes
+  // (or stopping at EOF). It issues readahead() hints ahead of its position, so pumping it to a
+  // socket keeps the disk busy. The file must outlive the stream.
+};
+
+class AsyncFile: public AsyncReadableFile {
+  // A writable AsyncReadableFile. Get one from `LowLevelAsyncIoProvider::wrapFile()`.
+
+public:
+  virtual Promise<void> write(uint64_t offset, ArrayPtr<const byte> data) = 0;
+  // Like File::write().
+
+  virtual Promise<void> datasync() = 0;
+  // Like File::datasync(): resolves once the written data is durable.
+
+  Own<AsyncOutputStream> newOutputStream(uint64_t offset = 0);
+  // An AsyncOutputStream which writes the file sequentially, starting at `offset`. The file must
+  // outlive the stream.
+};
+
+Own<AsyncFile> newThreadPoolAsyncFile(Own<const File> file, const ThreadPool& pool);
+Own<AsyncReadableFile> newThreadPoolAsyncFile(Own<const ReadableFile> file, const ThreadPool& pool);
+// Makes an asynchronous file which performs each blocking operation on one of `pool`'s threads.
+// Data passes through a temporary buffer, so that an operation that is canceled while running
+// doesn't touch the caller's memory. The pool must outlive the returned object and any operations
+// in flight.
+
 class LowLevelAsyncIoProvider {
   // Similar to `AsyncIoProvider`, but represents a lower-level interface that may differ on
   // different operating systems.  You should prefer to use `AsyncIoProvider` over this interface
@@ -620,6 +726,16 @@ public:
   // This timer is not affected by changes to the system date.  It is unspecified whether the timer
   // continues to count while the system is suspended.
 
+  virtual Own<AsyncReadableFile> wrapReadableFile(Own<const ReadableFile> file);
+  virtual Own<AsyncFile> wrapFile(Own<const File> file);
+  // Wraps a file from kj/filesystem.h so that it can be read and written without blocking the
+  // event loop.
+  //
+  // On Linux, when the event port has an io_uring and the file has a file descriptor (as all
+  // files from newDiskFilesystem() do), operations are submitted to the kernel through the ring.
+  // Otherwise -- and by default -- they run on a small thread pool shared by the process; see
+  // newThreadPoolAsyncFile().
+
   Own<AsyncInputStream> wrapInputFd(OwnFd&& fd, uint flags = 0);
   Own<AsyncOutputStream> wrapOutputFd(OwnFd&& fd, uint flags = 0);
   Own<AsyncIoStream> wrapSocketFd(OwnFd&& fd, uint flags = 0);
@@ -654,12 +770,15 @@ struct AsyncIoContext {
 #endif
 };
 
-AsyncIoContext setupAsyncIo();
+AsyncIoContext setupAsyncIo(TimerStrategy timerStrategy = TimerStrategy::ORDERED_SET);
 // Convenience method which sets up the current thread with everything it needs to do async I/O.
 // The returned objects contain an `EventLoop` which is wrapping an appropriate `EventPort` for
 // doing I/O on the host system, so everything is ready for the thread to start making async calls
 // and waiting on promises.
 //
+// `timerStrategy` selects how the event port's timer tracks pending timers; see `TimerStrategy`
+// in timer.h. Servers which schedule a timeout per connection may want TIMING_WHEEL.
+//
 // You would typically call this in your main() loop or in the start function of a thread.
 // Example:
 //
@@ -685,6 +804,40 @@ AsyncIoContext setupAsyncIo();
 // =======================================================================================
 // Convenience adapters.
 
+class AsyncFileInputStream final: public AsyncInputStream {
+  // An AsyncInputStream which reads a ReadableFile, starting at `offset` and producing at most
+  // `limit` bytes (or stopping at EOF). Reads block, as is usual for disk I/O.
+  //
+  // When this stream is pumped to a socket created by the LowLevelAsyncIoProvider on Linux and
+  // the file has a file descriptor (as all files from newDiskFilesystem() do), the data is sent
+  // with sendfile() and never copied through user space. This is the fast way to serve a file as
+  // an HTTP response body.
+  //
+  // The file must outlive the stream.
+
+public:
+  explicit AsyncFileInputStream(const ReadableFile& file, uint64_t offset = 0,
+                                uint64_t limit = kj::maxValue)
+      : file(file), offset(offset), limit(limit) {}
+
+  inline const ReadableFile& getFile() const { return file; }
+  inline uint64_t getOffset() const { return offset; }
+  inline uint64_t getLimit() const { return limit; }
+  // The current read position, and the number of bytes which may still be produced.
+
+  void skip(uint64_t bytes);
+  // Advance the read position as if `bytes` bytes had been read. For use by tryPumpFrom()
+  // implementations which transfer the data directly from the file.
+
+  Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override;
+  Maybe<uint64_t> tryGetLength() override;
+
+private:
+  const ReadableFile& file;
+  uint64_t offset;
+  uint64_t limit;
+};
+
 class CapabilityStreamConnectionReceiver final: public ConnectionReceiver {
   // Trivial wrapper which allows an AsyncCapabilityStream to act as a ConnectionReceiver. accept()
   // calls receiveStream().
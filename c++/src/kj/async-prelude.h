@@ -31,9 +31,29 @@
 #include "exception.h"
 #include "tuple.h"
 
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ < 13
+// GCC 12 and earlier hit an internal compiler error on coroutines returning a type with a
+// noexcept(false) destructor, which Promise<T> is (through Own<T>).
+#define KJ_HAS_COROUTINE 0
+#elif defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L && __has_include(<coroutine>)
+#include <coroutine>
+#define KJ_HAS_COROUTINE 1
+#define KJ_COROUTINE_STD_NAMESPACE std
+#elif defined(__cpp_coroutines) && __has_include(<experimental/coroutine>)
+// Pre-standard coroutines, e.g. Clang < 14 with -fcoroutines-ts.
+#include <experimental/coroutine>
+#define KJ_HAS_COROUTINE 1
+#define KJ_COROUTINE_STD_NAMESPACE std::experimental
+#else
+#define KJ_HAS_COROUTINE 0
+#endif
+// KJ_HAS_COROUTINE is 1 when the compiler supports `co_await` and `co_return` in functions
+// returning kj::Promise<T> (see the end of async-inl.h).
+
 namespace kj {
 
 class EventLoop;
+class Executor;
 template <typename T>
 class Promise;
 class WaitScope;
@@ -45,6 +65,13 @@ Promise<void> joinPromises(Array<Promise<void>>&& promises);
 
 namespace _ {  // private
 
+#if KJ_HAS_COROUTINE
+namespace stdcoro = KJ_COROUTINE_STD_NAMESPACE;
+class CoroutineBase;
+template <typename T>
+class Coroutine;
+#endif
+
 template <typename T> struct JoinPromises_ { typedef T Type; };
 template <typename T> struct JoinPromises_<Promise<T>> { typedef T Type; };
 
@@ -173,6 +200,9 @@ template <typename T>
 class ForkHub;
 
 class Event;
+class XThreadEvent;
+class XThreadPromiseNode;
+class XThreadExecution;
 
 class PromiseBase {
 public:
@@ -190,9 +220,13 @@ private:
   template <typename>
   friend class kj::Promise;
   friend class kj::TaskSet;
+  friend class XThreadEvent;
   template <typename U>
   friend Promise<Array<U>> kj::joinPromises(Array<Promise<U>>&& promises);
   friend Promise<void> kj::joinPromises(Array<Promise<void>>&& promises);
+#if KJ_HAS_COROUTINE
+  friend class CoroutineBase;
+#endif
 };
 
 void detach(kj::Promise<void>&& promise);
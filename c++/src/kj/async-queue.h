@@ -0,0 +1,185 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#pragma once
+
+#if defined(__GNUC__) && !KJ_HEADER_WARNINGS
+#pragma GCC system_header
+#endif
+
+#include "async.h"
+#include "mutex.h"
+#include "queue.h"
+
+namespace kj {
+
+template <typename Queue>
+class AsyncQueue {
+  // Wraps one of the lock-free queues from queue.h so that its consumer -- a thread running an
+  // event loop -- can wait for items with a promise, while producers on any thread (with or
+  // without event loops) push as usual.
+  //
+  // Wakeups are batched: once the consumer is woken, further pushes don't signal it again until
+  // it has drained the queue and is waiting once more.  A push that finds the consumer busy costs
+  // only a memory fence and one load on top of the underlying queue's push.
+  //
+  //     AsyncQueue<MpscQueue<Job>> queue(1024);
+  //
+  //     // on any thread
+  //     queue.tryPush(kj::mv(job));
+  //
+  //     // on the consumer's event loop
+  //     kj::Promise<void> drain() {
+  //       return queue.whenNotEmpty().then([this]() {
+  //         KJ_IF_MAYBE(job, queue.tryPop()) { run(kj::mv(*job)); }
+  //         return drain();
+  //       });
+  //     }
+
+public:
+  template <typename... Params>
+  explicit AsyncQueue(Params&&... params): queue(kj::fwd<Params>(params)...) {}
+  KJ_DISALLOW_COPY(AsyncQueue);
+
+  template <typename U, typename Q = Queue>
+  auto tryPush(U&& value) -> decltype(kj::instance<Q&>().tryPush(kj::fwd<U>(value))) {
+    // For the ring buffers.  Returns false if the queue is full.
+    if (queue.tryPush(kj::fwd<U>(value))) {
+      notify();
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  template <typename U, typename Q = Queue>
+  auto push(U& item) -> decltype(kj::instance<Q&>().push(item)) {
+    // For MpscIntrusiveQueue.
+    queue.push(item);
+    notify();
+  }
+
+  auto tryPop() -> decltype(kj::instance<Queue&>().tryPop()) { return queue.tryPop(); }
+  // Consumer only.
+
+  Promise<void> whenNotEmpty();
+  // Consumer only.  Resolves once the queue has something in it, possibly immediately.  A wakeup
+  // may occasionally be spurious (tryPop() still returns null), so callers should loop.  Only one
+  // whenNotEmpty() promise may be outstanding at a time.
+
+  template <typename Q = Queue>
+  Promise<typename Q::Value> pop();
+  // Consumer only, for the ring buffers.  Waits for and removes the next item.
+
+  Queue& getQueue() { return queue; }
+
+private:
+  Queue queue;
+
+#if _MSC_VER
+  volatile long waiting = 0;
+#else
+  volatile uint waiting = 0;
+#endif
+  // 1 while the consumer has a fulfiller registered in `waiter` that no producer has claimed.
+
+  MutexGuarded<Maybe<Own<CrossThreadPromiseFulfiller<void>>>> waiter;
+
+  void notify();
+  bool claimWaiter();
+  Maybe<Own<CrossThreadPromiseFulfiller<void>>> takeWaiter();
+};
+
+// =======================================================================================
+// Inline implementation details
+
+template <typename Queue>
+Promise<void> AsyncQueue<Queue>::whenNotEmpty() {
+  if (!queue.isEmpty()) return kj::READY_NOW;
+
+  Maybe<Own<CrossThreadPromiseFulfiller<void>>> claimed;  // destroyed after `paf`, see below
+  auto paf = newCrossThreadPromiseAndFulfiller<void>();
+  *waiter.lockExclusive() = kj::mv(paf.fulfiller);
+
+  // Publish that we're waiting, then look again: a producer that pushed before seeing `waiting`
+  // set won't wake us, so we have to notice its item ourselves.
+#if _MSC_VER
+  _InterlockedExchange(&waiting, 1);
+#else
+  __atomic_store_n(&waiting, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+
+  if (!queue.isEmpty() && claimWaiter()) {
+    // Nobody else will fulfill it now.  Drop the promise before the fulfiller so that the
+    // fulfiller's destructor finds nobody waiting.
+    claimed = takeWaiter();
+    return kj::READY_NOW;
+  }
+
+  return kj::mv(paf.promise);
+}
+
+template <typename Queue>
+template <typename Q>
+Promise<typename Q::Value> AsyncQueue<Queue>::pop() {
+  KJ_IF_MAYBE(value, queue.tryPop()) {
+    return kj::mv(*value);
+  }
+  return whenNotEmpty().then([this]() { return pop<Q>(); });
+}
+
+template <typename Queue>
+void AsyncQueue<Queue>::notify() {
+#if _MSC_VER
+  bool isWaiting = _InterlockedOr(&waiting, 0) != 0;  // full barrier
+#else
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  bool isWaiting = __atomic_load_n(&waiting, __ATOMIC_RELAXED) != 0;
+#endif
+
+  if (isWaiting && claimWaiter()) {
+    KJ_IF_MAYBE(fulfiller, takeWaiter()) {
+      (*fulfiller)->fulfill();
+    }
+  }
+}
+
+template <typename Queue>
+bool AsyncQueue<Queue>::claimWaiter() {
+  // Exactly one of the consumer and the producers wins each registration.
+#if _MSC_VER
+  return _InterlockedExchange(&waiting, 0) != 0;
+#else
+  return __atomic_exchange_n(&waiting, 0, __ATOMIC_ACQUIRE) != 0;
+#endif
+}
+
+template <typename Queue>
+Maybe<Own<CrossThreadPromiseFulfiller<void>>> AsyncQueue<Queue>::takeWaiter() {
+  auto lock = waiter.lockExclusive();
+  auto result = kj::mv(*lock);
+  *lock = nullptr;
+  return result;
+}
+
+}  // namespace kj
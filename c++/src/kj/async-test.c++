@@ -21,7 +21,10 @@
 
 #include "async.h"
 #include "debug.h"
+#include "timer.h"
+#include "vector.h"
 #include <kj/compat/gtest.h>
+#include <string.h>
 
 namespace kj {
 namespace {
@@ -178,6 +181,46 @@ TEST(Async, Chain) {
   EXPECT_EQ(444, promise3.wait(waitScope));
 }
 
+TEST(Async, LongThenChain) {
+  // Long enough to spill over several promise arenas.
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  uint destroyed = 0;
+  struct Counter {
+    uint& count;
+    explicit Counter(uint& count): count(count) {}
+    ~Counter() { ++count; }
+    KJ_DISALLOW_COPY(Counter);
+  };
+
+  {
+    Promise<uint> promise = evalLater([]() -> uint { return 0; });
+    for (uint i = 0; i < 500; i++) {
+      promise = promise.then([](uint n) { return n + 1; });
+      if (i % 10 == 0) {
+        promise = promise.attach(kj::heap<Counter>(destroyed));
+      }
+      if (i % 7 == 0) {
+        promise = promise.then([](uint n) { return evalLater([n]() { return n; }); });
+      }
+    }
+    EXPECT_EQ(500u, promise.wait(waitScope));
+    EXPECT_EQ(50u, destroyed);
+  }
+
+  {
+    // Canceling frees everything too.
+    destroyed = 0;
+    Promise<uint> promise = evalLater([]() -> uint { return 0; });
+    for (uint i = 0; i < 500; i++) {
+      promise = promise.then([](uint n) { return n + 1; }).attach(kj::heap<Counter>(destroyed));
+    }
+    promise = nullptr;
+    EXPECT_EQ(500u, destroyed);
+  }
+}
+
 TEST(Async, DeepChain) {
   EventLoop loop;
   WaitScope waitScope(loop);
@@ -644,6 +687,50 @@ TEST(Async, TaskSetOnEmpty) {
   promise.wait(waitScope);
 }
 
+TEST(Async, TaskSetClear) {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+  ErrorHandlerImpl errorHandler;
+  TaskSet tasks(errorHandler);
+
+  // Enough tasks that recursive destruction would overflow the stack, and enough to span several
+  // slabs.
+  constexpr uint COUNT = 200000;
+  uint canceled = 0;
+  for (uint i = 0; i < COUNT; i++) {
+    tasks.add(Promise<void>(NEVER_DONE).attach(kj::defer([&canceled]() { ++canceled; })));
+  }
+  EXPECT_EQ(COUNT, tasks.size());
+
+  auto empty = tasks.onEmpty();
+  KJ_EXPECT(!empty.poll(waitScope));
+
+  tasks.clear();
+  EXPECT_EQ(COUNT, canceled);
+  EXPECT_EQ(0u, tasks.size());
+  KJ_EXPECT(tasks.isEmpty());
+  KJ_EXPECT(empty.poll(waitScope));
+
+  // Slots are reused once tasks complete.
+  for (uint round = 0; round < 3; round++) {
+    for (uint i = 0; i < 100; i++) {
+      tasks.add(evalLater([]() {}));
+    }
+    EXPECT_EQ(100u, tasks.size());
+    tasks.onEmpty().wait(waitScope);
+    EXPECT_EQ(0u, tasks.size());
+  }
+
+  // A task canceled by clear() may add more tasks, which are canceled too.
+  bool innerCanceled = false;
+  tasks.add(Promise<void>(NEVER_DONE).attach(kj::defer([&]() {
+    tasks.add(Promise<void>(NEVER_DONE).attach(kj::defer([&innerCanceled]() { innerCanceled = true; })));
+  })));
+  tasks.clear();
+  KJ_EXPECT(innerCanceled);
+  KJ_EXPECT(tasks.isEmpty());
+}
+
 class DestructorDetector {
 public:
   DestructorDetector(bool& setTrue): setTrue(setTrue) {}
@@ -783,5 +870,369 @@ TEST(Async, Poll) {
   paf.promise.wait(waitScope);
 }
 
+class CountingEventPort: public EventPort {
+public:
+  uint pollCount = 0;
+
+  bool wait() override { KJ_FAIL_ASSERT("Nothing to wait for."); }
+  bool poll() override { ++pollCount; return false; }
+};
+
+Promise<void> countDown(uint n) {
+  if (n == 0) return READY_NOW;
+  return evalLater([n]() { return countDown(n - 1); });
+}
+
+TEST(Async, IoPollLimits) {
+  CountingEventPort port;
+  EventLoop loop(port);
+  WaitScope waitScope(loop);
+
+  // By default a busy loop never polls.
+  countDown(100).wait(waitScope);
+  EXPECT_EQ(0u, port.pollCount);
+  EXPECT_EQ(0u, loop.getStats().ioPolls);
+  uint64_t fired = loop.getStats().eventsFired;
+  EXPECT_GE(fired, 100u);
+
+  loop.setIoPollLimits(10);
+  countDown(100).wait(waitScope);
+  EXPECT_GE(port.pollCount, 9u);
+  EXPECT_EQ(port.pollCount, loop.getStats().forcedIoPolls);
+  EXPECT_EQ(port.pollCount, loop.getStats().ioPolls);
+  EXPECT_GE(loop.getStats().eventsFired, fired + 100);
+
+  // A time limit of zero polls after every event.
+  port.pollCount = 0;
+  loop.setIoPollLimits(kj::maxValue, 0 * NANOSECONDS);
+  countDown(20).wait(waitScope);
+  EXPECT_GE(port.pollCount, 20u);
+
+  // Queue depth is tracked as events are armed, fired and destroyed.
+  EXPECT_EQ(0u, loop.getStats().queueDepth);
+  {
+    auto p1 = evalLater([]() {}).eagerlyEvaluate(nullptr);
+    auto p2 = evalLater([]() {}).eagerlyEvaluate(nullptr);
+    auto p3 = evalLater([]() {}).eagerlyEvaluate(nullptr);
+    EXPECT_EQ(3u, loop.getStats().queueDepth);
+    EXPECT_GE(loop.getStats().maxQueueDepth, 3u);
+  }
+  EXPECT_EQ(0u, loop.getStats().queueDepth);
+  EXPECT_TRUE(loop.getStats().runTime > 0 * NANOSECONDS);
+}
+
+Promise<void> highPriorityLoop(uint n, uint& count) {
+  if (n == 0) return READY_NOW;
+  return evalLater([&count]() { ++count; }).withPriority(EventPriority::HIGH)
+      .then([n,&count]() { return highPriorityLoop(n - 1, count); });
+}
+
+TEST(Async, Priority) {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  {
+    Vector<uint> order;
+    auto low = newPromiseAndFulfiller<void>();
+    auto normal = newPromiseAndFulfiller<void>();
+    auto high = newPromiseAndFulfiller<void>();
+
+    auto p1 = low.promise.withPriority(EventPriority::LOW)
+        .then([&]() { order.add(3); }).eagerlyEvaluate(nullptr);
+    auto p2 = normal.promise.then([&]() { order.add(2); }).eagerlyEvaluate(nullptr);
+    auto p3 = high.promise.withPriority(EventPriority::HIGH)
+        .then([&]() { order.add(1); }).eagerlyEvaluate(nullptr);
+
+    low.fulfiller->fulfill();
+    normal.fulfiller->fulfill();
+    high.fulfiller->fulfill();
+    loop.run();
+
+    KJ_EXPECT(order.size() == 3 && order[0] == 1 && order[1] == 2 && order[2] == 3, order);
+  }
+
+  // Continuations of a high-priority callback stay ahead of a low-priority event queued before
+  // them...
+  for (uint limit: {64u, 2u}) {
+    loop.setStarvationLimit(limit);
+
+    uint count = 0;
+    Maybe<uint> countWhenLowRan;
+    auto paf = newPromiseAndFulfiller<void>();
+    auto low = paf.promise.withPriority(EventPriority::LOW)
+        .then([&]() { countWhenLowRan = count; }).eagerlyEvaluate(nullptr);
+    paf.fulfiller->fulfill();
+
+    highPriorityLoop(20, count).wait(waitScope);
+    KJ_ASSERT(low.poll(waitScope));
+
+    if (limit == 64) {
+      KJ_EXPECT(KJ_ASSERT_NONNULL(countWhenLowRan) == 20);
+    } else {
+      // ... until they have starved it for too long.
+      KJ_EXPECT(KJ_ASSERT_NONNULL(countWhenLowRan) > 0);
+      KJ_EXPECT(KJ_ASSERT_NONNULL(countWhenLowRan) < 20);
+    }
+  }
+}
+
+TEST(Async, Tracer) {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  EXPECT_TRUE(AsyncTracer::current() == nullptr);
+
+  {
+    AsyncTracer tracer(loop);
+    EXPECT_TRUE(&KJ_ASSERT_NONNULL(AsyncTracer::current()) == &tracer);
+
+    // The first eagerly-evaluated event fulfills the promise the second is waiting on, so the
+    // trace should link them.
+    auto paf = newPromiseAndFulfiller<int>();
+    auto span = tracer.startSpan("test", kj::str("a \"quoted\" span"));
+    auto result = paf.promise.then([](int i) { return i + 1; })
+        .attach(kj::mv(span))
+        .eagerlyEvaluate(nullptr);
+    auto fulfiller = kj::mv(paf.fulfiller);
+    evalLater([&]() { fulfiller->fulfill(1); }).eagerlyEvaluate(nullptr).wait(waitScope);
+    EXPECT_EQ(2, result.wait(waitScope));
+
+    auto json = tracer.toChromeTraceJson();
+    EXPECT_TRUE(json.startsWith("{\"traceEvents\":["));
+    EXPECT_TRUE(json.endsWith("]}"));
+    EXPECT_TRUE(strstr(json.cStr(), "\"ph\":\"X\"") != nullptr);
+    EXPECT_TRUE(strstr(json.cStr(), "\"ph\":\"s\"") != nullptr);
+    EXPECT_TRUE(strstr(json.cStr(), "\"ph\":\"f\",\"bp\":\"e\"") != nullptr);
+    KJ_EXPECT(strstr(json.cStr(), "\"name\":\"a \\\"quoted\\\" span\"") != nullptr, json);
+#if !KJ_NO_RTTI
+    // Events are named after the continuation, whose type names the function it was written in.
+    KJ_EXPECT(strstr(json.cStr(), "::run()::{lambda()") != nullptr, json);
+#endif
+
+    tracer.clear();
+    EXPECT_EQ("{\"traceEvents\":[]}", tracer.toChromeTraceJson());
+  }
+
+  EXPECT_TRUE(AsyncTracer::current() == nullptr);
+
+  {
+    AsyncTracer tracer(loop, 2);
+    for (uint i = 0; i < 5; i++) {
+      evalLater([]() {}).wait(waitScope);
+    }
+    EXPECT_GT(tracer.getDroppedCount(), 0u);
+  }
+}
+
+TEST(Async, TimingWheel) {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  auto start = origin<TimePoint>() + 1000 * SECONDS;
+  TimerImpl timer(start, TimerStrategy::TIMING_WHEEL);
+  EXPECT_TRUE(timer.nextEvent() == nullptr);
+
+  Vector<uint> fired;
+  Vector<Promise<void>> promises;
+  auto addTimer = [&](uint id, Duration delay) {
+    promises.add(timer.atTime(start + delay).then([&fired,id]() { fired.add(id); })
+        .eagerlyEvaluate(nullptr));
+  };
+
+  addTimer(0, 5 * MILLISECONDS);
+  addTimer(1, 5 * MILLISECONDS + 1 * NANOSECONDS);
+  addTimer(2, 5 * MILLISECONDS);        // same time as 0, so fires after it
+  addTimer(3, 90 * SECONDS);            // far enough out to start on a higher level
+  addTimer(4, 3 * 365 * DAYS);          // beyond the range of the wheel
+  addTimer(5, -1 * SECONDS);            // already in the past
+  addTimer(6, 5 * MILLISECONDS + 500 * MICROSECONDS);
+
+  EXPECT_EQ(-1 * SECONDS / NANOSECONDS,
+            (KJ_ASSERT_NONNULL(timer.nextEvent()) - start) / NANOSECONDS);
+
+  timer.advanceTo(start);
+  loop.run();
+  EXPECT_EQ(1u, fired.size());
+  EXPECT_EQ(5u, fired[0]);
+  EXPECT_EQ(5 * MILLISECONDS / NANOSECONDS,
+            (KJ_ASSERT_NONNULL(timer.nextEvent()) - start) / NANOSECONDS);
+
+  // Timers fire at exactly their scheduled time, even within a tick.
+  timer.advanceTo(start + 5 * MILLISECONDS);
+  loop.run();
+  EXPECT_EQ(3u, fired.size());
+  EXPECT_EQ(0u, fired[1]);
+  EXPECT_EQ(2u, fired[2]);
+  EXPECT_EQ((5 * MILLISECONDS + 1 * NANOSECONDS) / NANOSECONDS,
+            (KJ_ASSERT_NONNULL(timer.nextEvent()) - start) / NANOSECONDS);
+
+  // Canceling the earliest timer updates nextEvent().
+  promises[1] = nullptr;
+  EXPECT_EQ((5 * MILLISECONDS + 500 * MICROSECONDS) / NANOSECONDS,
+            (KJ_ASSERT_NONNULL(timer.nextEvent()) - start) / NANOSECONDS);
+
+  timer.advanceTo(start + 60 * SECONDS);
+  loop.run();
+  EXPECT_EQ(4u, fired.size());
+  EXPECT_EQ(6u, fired[3]);
+  EXPECT_EQ(90 * SECONDS / NANOSECONDS,
+            (KJ_ASSERT_NONNULL(timer.nextEvent()) - start) / NANOSECONDS);
+
+  timer.advanceTo(start + 90 * SECONDS - 1 * NANOSECONDS);
+  loop.run();
+  EXPECT_EQ(4u, fired.size());
+  timer.advanceTo(start + 90 * SECONDS);
+  loop.run();
+  EXPECT_EQ(5u, fired.size());
+  EXPECT_EQ(3u, fired[4]);
+
+  timer.advanceTo(start + 3 * 365 * DAYS);
+  loop.run();
+  EXPECT_EQ(6u, fired.size());
+  EXPECT_EQ(4u, fired[5]);
+  EXPECT_TRUE(timer.nextEvent() == nullptr);
+}
+
+TEST(Async, TimingWheelMatchesOrderedSet) {
+  // Drive both timer strategies with the same pseudo-random schedule and check that they fire the
+  // same timers in the same order.
+
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  auto start = origin<TimePoint>();
+  TimerImpl ordered(start, TimerStrategy::ORDERED_SET);
+  TimerImpl wheel(start, TimerStrategy::TIMING_WHEEL);
+
+  Vector<uint> orderedFired, wheelFired;
+  Vector<Promise<void>> orderedPromises, wheelPromises;
+
+  uint32_t seed = 12345;
+  auto random = [&]() {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+  };
+
+  Duration now = 0 * NANOSECONDS;
+  for (uint round = 0; round < 200; round++) {
+    for (uint i = 0; i < 20; i++) {
+      Duration delay = 0 * NANOSECONDS;
+      switch (random() % 4) {
+        case 0: delay = (random() % 5000) * MICROSECONDS; break;
+        case 1: delay = (random() % 100) * MILLISECONDS; break;
+        case 2: delay = (random() % 600) * SECONDS; break;
+        default: delay = int64_t(random() % 1000) * MILLISECONDS - 100 * MILLISECONDS; break;
+      }
+      uint id = orderedPromises.size();
+      orderedPromises.add(ordered.atTime(start + now + delay)
+          .then([&orderedFired,id]() { orderedFired.add(id); }).eagerlyEvaluate(nullptr));
+      wheelPromises.add(wheel.atTime(start + now + delay)
+          .then([&wheelFired,id]() { wheelFired.add(id); }).eagerlyEvaluate(nullptr));
+    }
+
+    for (uint i = 0; i < 5; i++) {
+      uint victim = random() % orderedPromises.size();
+      orderedPromises[victim] = nullptr;
+      wheelPromises[victim] = nullptr;
+    }
+
+    KJ_IF_MAYBE(next, ordered.nextEvent()) {
+      EXPECT_TRUE(*next == KJ_ASSERT_NONNULL(wheel.nextEvent()));
+    } else {
+      EXPECT_TRUE(wheel.nextEvent() == nullptr);
+    }
+
+    if (random() % 10 == 0) {
+      now = now + (random() % 300) * SECONDS;
+    } else {
+      now = now + (random() % 20000) * MICROSECONDS;
+    }
+    ordered.advanceTo(start + now);
+    wheel.advanceTo(start + now);
+    loop.run();
+
+    KJ_ASSERT(orderedFired == wheelFired, round);
+  }
+
+  EXPECT_TRUE(orderedFired.size() > 1000);
+}
+
+#if KJ_HAS_COROUTINE
+Promise<int> coroutineAdd(Promise<int> a, Promise<int> b) {
+  int x = co_await a;
+  int y = co_await b;
+  co_return x + y;
+}
+
+Promise<void> coroutineCount(uint& count, uint n) {
+  for (uint i = 0; i < n; i++) {
+    co_await evalLater([]() {});
+    ++count;
+  }
+}
+
+Promise<int> coroutineThrow(Promise<void> before) {
+  co_await before;
+  KJ_FAIL_ASSERT("coroutine failed");
+  co_return 0;
+}
+
+Promise<int> coroutineCatch(Promise<int> inner) {
+  try {
+    co_return co_await inner;
+  } catch (const Exception& e) {
+    co_return -1;
+  }
+}
+
+TEST(Async, Coroutine) {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  EXPECT_EQ(5, coroutineAdd(evalLater([]() { return 2; }), 3).wait(waitScope));
+
+  uint count = 0;
+  auto promise = coroutineCount(count, 100);
+  EXPECT_EQ(0u, count);
+  promise.wait(waitScope);
+  EXPECT_EQ(100u, count);
+
+  // Awaiting a coroutine from a coroutine.
+  EXPECT_EQ(6, coroutineAdd(coroutineAdd(1, 2), coroutineAdd(evalLater([]() { return 1; }), 2))
+      .wait(waitScope));
+}
+
+TEST(Async, CoroutineException) {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  KJ_EXPECT_THROW_MESSAGE("coroutine failed", coroutineThrow(evalLater([]() {})).wait(waitScope));
+  KJ_EXPECT_THROW_MESSAGE("awaited failure",
+      coroutineAdd(Promise<int>(KJ_EXCEPTION(FAILED, "awaited failure")), 1).wait(waitScope));
+  EXPECT_EQ(-1, coroutineCatch(coroutineThrow(READY_NOW)).wait(waitScope));
+  EXPECT_EQ(4, coroutineCatch(4).wait(waitScope));
+}
+
+TEST(Async, CoroutineCancellation) {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  auto paf = newPromiseAndFulfiller<int>();
+  bool destroyed = false;
+  auto guard = kj::defer([&]() { destroyed = true; });
+
+  {
+    auto promise = coroutineAdd(paf.promise.attach(kj::mv(guard)), 1);
+    promise.poll(waitScope);
+    EXPECT_TRUE(paf.fulfiller->isWaiting());
+    EXPECT_FALSE(destroyed);
+  }
+
+  // Dropping the coroutine's promise destroyed the frame and the promise it was awaiting.
+  EXPECT_TRUE(destroyed);
+  EXPECT_FALSE(paf.fulfiller->isWaiting());
+}
+#endif  // KJ_HAS_COROUTINE
+
 }  // namespace
 }  // namespace kj
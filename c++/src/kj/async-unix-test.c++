@@ -22,13 +22,16 @@
 #if !_WIN32
 
 #include "async-unix.h"
+#include "async-queue.h"
 #include "thread.h"
+#include "mutex.h"
 #include "debug.h"
 #include "io.h"
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
 #include <kj/compat/gtest.h>
@@ -651,6 +654,423 @@ TEST(AsyncUnixTest, Wake) {
   EXPECT_TRUE(port.wait());
 }
 
+#if KJ_USE_IO_URING
+TEST(AsyncUnixTest, IoUring) {
+  captureSignals();
+  UnixEventPort port;
+  EventLoop loop(port);
+  WaitScope waitScope(loop);
+
+  UnixEventPort::IoUring* ring;
+  KJ_IF_MAYBE(r, port.getIoUring()) {
+    ring = r;
+  } else {
+    KJ_LOG(WARNING, "kernel doesn't support io_uring; skipping test");
+    return;
+  }
+
+  // Non-blocking, like the fds that AsyncIoProvider creates.
+  int pipefds[2];
+  KJ_SYSCALL(pipe2(pipefds, O_NONBLOCK | O_CLOEXEC));
+  KJ_DEFER({ close(pipefds[1]); close(pipefds[0]); });
+
+  // A read submitted before data is available waits for it, rather than failing with EAGAIN,
+  // until another thread writes.
+  byte buffer[16];
+  auto readPromise = ring->read(pipefds[0], buffer);
+  KJ_EXPECT(!readPromise.poll(waitScope));
+  Thread thread([&]() {
+    delay();
+    KJ_SYSCALL(write(pipefds[1], "foo", 3));
+  });
+  KJ_EXPECT(readPromise.wait(waitScope) == 3);
+  KJ_EXPECT(memcmp(buffer, "foo", 3) == 0);
+
+  // Gather-write, then read it back.
+  ArrayPtr<const byte> pieces[2] = { "bar"_kj.asBytes(), "baz"_kj.asBytes() };
+  KJ_EXPECT(ring->write(pipefds[1], pieces).wait(waitScope) == 6);
+  KJ_EXPECT(ring->read(pipefds[0], buffer).wait(waitScope) == 6);
+  KJ_EXPECT(memcmp(buffer, "barbaz", 6) == 0);
+
+  // A write to a full pipe waits for room.
+  {
+    auto chunk = kj::heapArray<byte>(4096);
+    memset(chunk.begin(), 'x', chunk.size());
+    while (write(pipefds[1], chunk.begin(), chunk.size()) > 0) {}
+
+    ArrayPtr<const byte> piece = chunk;
+    auto writePromise = ring->write(pipefds[1], arrayPtr(&piece, 1));
+    KJ_EXPECT(!writePromise.poll(waitScope));
+    while (read(pipefds[0], chunk.begin(), chunk.size()) > 0) {}
+    KJ_EXPECT(writePromise.wait(waitScope) == 4096);
+    while (read(pipefds[0], chunk.begin(), chunk.size()) > 0) {}
+  }
+
+  // Errors come back as negated errno, including those of the poll that a read waits behind.
+  KJ_EXPECT(ring->read(-1, buffer).wait(waitScope) == -EBADF);
+
+  // Canceling a pending read must leave the data for the next reader. Once the promise is gone,
+  // the kernel is done with the read buffer, so it may go away immediately.
+  {
+    auto ownBuffer = kj::heapArray<byte>(16);
+    auto canceled = ring->read(pipefds[0], ownBuffer);
+    KJ_EXPECT(!canceled.poll(waitScope));
+  }
+  KJ_SYSCALL(write(pipefds[1], "qux", 3));
+  char readBack[4];
+  KJ_EXPECT(read(pipefds[0], readBack, sizeof(readBack)) == 3);
+  KJ_EXPECT(memcmp(readBack, "qux", 3) == 0);
+
+  // An accept canceled just before the port is destroyed is cleaned up with it. (Unlike a read,
+  // canceling it doesn't wait, since the kernel only writes to memory the operation owns.)
+  int listenFd;
+  KJ_SYSCALL(listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+  KJ_DEFER(close(listenFd));
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  KJ_SYSCALL(bind(listenFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(sa_family_t)));
+  KJ_SYSCALL(listen(listenFd, 1));
+
+  struct sockaddr_storage peer;
+  uint peerLen = sizeof(peer);
+  auto abandoned = ring->accept(listenFd, reinterpret_cast<struct sockaddr*>(&peer), &peerLen);
+  KJ_EXPECT(!abandoned.poll(waitScope));
+}
+#endif
+
+class ExecutorThread {
+  // Runs an event loop in a separate thread until stop() is called.
+
+public:
+  ExecutorThread(): thread([this]() { run(); }) {
+    executor = executorSlot.when([](const Maybe<Own<const Executor>>& e) { return e != nullptr; },
+        [](Maybe<Own<const Executor>>& e) { return kj::mv(KJ_ASSERT_NONNULL(e)); });
+  }
+
+  ~ExecutorThread() noexcept(false) {
+    stop();
+  }
+
+  const Executor& get() { return *executor; }
+
+  void stop() {
+    if (!stopped) {
+      stopped = true;
+      // The loop exits as soon as the fulfiller is called, so it may fail our call rather than
+      // report that it completed.
+      executor->executeAsync([this]() { KJ_ASSERT_NONNULL(stopFulfiller)->fulfill(); })
+          .then([]() {}, [](Exception&&) {}).wait(getWaitScope());
+    }
+  }
+
+  WaitScope& getWaitScope() { return KJ_ASSERT_NONNULL(callerWaitScope); }
+  Maybe<WaitScope&> callerWaitScope;
+
+  pthread_t targetThread;
+
+private:
+  MutexGuarded<Maybe<Own<const Executor>>> executorSlot;
+  Own<const Executor> executor;
+  Maybe<Own<PromiseFulfiller<void>>> stopFulfiller;
+  bool stopped = false;
+  Thread thread;
+
+  void run() {
+    UnixEventPort port;
+    EventLoop loop(port);
+    WaitScope waitScope(loop);
+
+    targetThread = pthread_self();
+    auto paf = newPromiseAndFulfiller<void>();
+    stopFulfiller = kj::mv(paf.fulfiller);
+    *executorSlot.lockExclusive() = getCurrentThreadExecutor().addRef();
+
+    paf.promise.wait(waitScope);
+  }
+};
+
+TEST(AsyncUnixTest, Executor) {
+  captureSignals();
+  UnixEventPort port;
+  EventLoop loop(port);
+  WaitScope waitScope(loop);
+
+  ExecutorThread target;
+  target.callerWaitScope = waitScope;
+  auto& executor = target.get();
+  EXPECT_TRUE(executor.isLive());
+
+  // Plain value, computed on the other thread.
+  pthread_t caller = pthread_self();
+  EXPECT_TRUE(executor.executeAsync([&]() {
+    return pthread_equal(pthread_self(), caller) == 0 &&
+           pthread_equal(pthread_self(), target.targetThread) != 0;
+  }).wait(waitScope));
+
+  // Promise result, resolved in the other thread's loop.
+  EXPECT_EQ(123, executor.executeAsync([]() {
+    return evalLater([]() { return 123; });
+  }).wait(waitScope));
+
+  // Exceptions propagate.
+  KJ_EXPECT_THROW_MESSAGE("bad thing", executor.executeAsync([]() -> int {
+    KJ_FAIL_ASSERT("bad thing");
+  }).wait(waitScope));
+
+  // Lots of calls queued at once all complete, in order.
+  {
+    uint counter = 0;
+    auto promises = heapArrayBuilder<Promise<uint>>(100);
+    for (uint i = 0; i < 100; i++) {
+      promises.add(executor.executeAsync([&counter]() { return counter++; }));
+    }
+    auto results = joinPromises(promises.finish()).wait(waitScope);
+    for (uint i = 0; i < 100; i++) {
+      EXPECT_EQ(i, results[i]);
+    }
+  }
+}
+
+TEST(AsyncUnixTest, ExecutorCancel) {
+  captureSignals();
+  UnixEventPort port;
+  EventLoop loop(port);
+  WaitScope waitScope(loop);
+
+  ExecutorThread target;
+  target.callerWaitScope = waitScope;
+  auto& executor = target.get();
+
+  bool destroyed = false;
+  {
+    auto promise = executor.executeAsync([&destroyed]() -> Promise<void> {
+      return Promise<void>(NEVER_DONE).attach(kj::defer([&destroyed]() { destroyed = true; }));
+    });
+
+    // Requests are executed in order, so once this returns the first call is underway.
+    executor.executeAsync([]() {}).wait(waitScope);
+  }
+
+  // The cancellation is queued before this request, so it has been processed by the time this
+  // runs.
+  EXPECT_TRUE(executor.executeAsync([&destroyed]() { return destroyed; }).wait(waitScope));
+}
+
+TEST(AsyncUnixTest, ExecutorLoopExit) {
+  captureSignals();
+  UnixEventPort port;
+  EventLoop loop(port);
+  WaitScope waitScope(loop);
+
+  ExecutorThread target;
+  target.callerWaitScope = waitScope;
+  auto executor = target.get().addRef();
+
+  // A call that never completes is failed when the loop goes away.
+  auto pending = executor->executeAsync([]() -> Promise<void> { return NEVER_DONE; });
+  executor->executeAsync([]() {}).wait(waitScope);
+
+  target.stop();
+  KJ_EXPECT_THROW(DISCONNECTED, pending.wait(waitScope));
+
+  // After which no new calls are accepted.
+  EXPECT_FALSE(executor->isLive());
+  KJ_EXPECT_THROW(DISCONNECTED, executor->executeAsync([]() {}).wait(waitScope));
+}
+
+TEST(AsyncUnixTest, ThreadPool) {
+  captureSignals();
+  UnixEventPort port;
+  EventLoop loop(port);
+  WaitScope waitScope(loop);
+
+  ThreadPool pool(4);
+  EXPECT_EQ(4u, pool.getThreadCount());
+
+  pthread_t caller = pthread_self();
+  EXPECT_TRUE(pool.run([caller]() { return pthread_equal(pthread_self(), caller) == 0; })
+      .wait(waitScope));
+
+  bool ran = false;
+  pool.run([&ran]() { ran = true; }).wait(waitScope);
+  EXPECT_TRUE(ran);
+
+  KJ_EXPECT_THROW_MESSAGE("bad thing", pool.run([]() -> int {
+    KJ_FAIL_ASSERT("bad thing");
+  }).wait(waitScope));
+
+  // Results arrive in the caller's loop while it keeps running other events.
+  {
+    auto promises = heapArrayBuilder<Promise<uint64_t>>(200);
+    for (uint i = 0; i < 200; i++) {
+      promises.add(pool.run([i]() {
+        uint64_t sum = 0;
+        for (uint j = 0; j <= i * 1000; j++) sum += j;
+        return sum;
+      }).then([](uint64_t sum) { return sum; }));
+    }
+    auto results = joinPromises(promises.finish()).wait(waitScope);
+    for (uint64_t i = 0; i < 200; i++) {
+      EXPECT_EQ(i * 1000 * (i * 1000 + 1) / 2, results[i]);
+    }
+  }
+}
+
+TEST(AsyncUnixTest, ThreadPoolSteal) {
+  // A task stuck on one worker doesn't hold up tasks dealt to the same worker's queue.
+  captureSignals();
+  UnixEventPort port;
+  EventLoop loop(port);
+  WaitScope waitScope(loop);
+
+  ThreadPool pool(2);
+  MutexGuarded<bool> release(false);
+
+  auto blocked = pool.run([&release]() {
+    release.when([](const bool& b) { return b; }, [](bool&) {});
+  });
+
+  auto promises = heapArrayBuilder<Promise<uint>>(10);
+  for (uint i = 0; i < 10; i++) {
+    promises.add(pool.run([i]() { return i; }));
+  }
+  auto results = joinPromises(promises.finish()).wait(waitScope);
+  for (uint i = 0; i < 10; i++) {
+    EXPECT_EQ(i, results[i]);
+  }
+
+  *release.lockExclusive() = true;
+  blocked.wait(waitScope);
+}
+
+TEST(AsyncUnixTest, ThreadPoolCancel) {
+  captureSignals();
+  UnixEventPort port;
+  EventLoop loop(port);
+  WaitScope waitScope(loop);
+
+  ThreadPool pool(1);
+  MutexGuarded<bool> release(false);
+  bool ran = false;
+
+  auto blocked = pool.run([&release]() {
+    release.when([](const bool& b) { return b; }, [](bool&) {});
+  });
+  {
+    auto dropped = pool.run([&ran]() { ran = true; });
+  }
+
+  *release.lockExclusive() = true;
+  blocked.wait(waitScope);
+
+  // Tasks on one worker run in order, so the canceled one would have run by now.
+  pool.run([]() {}).wait(waitScope);
+  EXPECT_FALSE(ran);
+}
+
+TEST(AsyncUnixTest, CrossThreadFulfiller) {
+  captureSignals();
+  UnixEventPort port;
+  EventLoop loop(port);
+  WaitScope waitScope(loop);
+
+  {
+    auto paf = newCrossThreadPromiseAndFulfiller<uint>();
+    EXPECT_TRUE(paf.fulfiller->isWaiting());
+    Thread thread([&]() { paf.fulfiller->fulfill(123); });
+    EXPECT_EQ(123u, paf.promise.wait(waitScope));
+  }
+
+  {
+    auto paf = newCrossThreadPromiseAndFulfiller<void>();
+    Thread thread([&]() { paf.fulfiller->reject(KJ_EXCEPTION(FAILED, "nope")); });
+    KJ_EXPECT_THROW_MESSAGE("nope", paf.promise.wait(waitScope));
+  }
+
+  {
+    // Dropping the fulfiller breaks the promise.
+    auto paf = newCrossThreadPromiseAndFulfiller<void>();
+    Thread thread([fulfiller = kj::mv(paf.fulfiller)]() mutable { fulfiller = nullptr; });
+    KJ_EXPECT_THROW_MESSAGE("without fulfilling", paf.promise.wait(waitScope));
+  }
+
+  {
+    // Dropping the promise is visible to the fulfiller.
+    auto paf = newCrossThreadPromiseAndFulfiller<uint>();
+    paf.promise = nullptr;
+    EXPECT_FALSE(paf.fulfiller->isWaiting());
+    Thread thread([&]() { paf.fulfiller->fulfill(456); });
+  }
+}
+
+TEST(AsyncUnixTest, AsyncQueue) {
+  captureSignals();
+  UnixEventPort port;
+  EventLoop loop(port);
+  WaitScope waitScope(loop);
+
+  constexpr uint THREADS = 4;
+  constexpr uint COUNT = 5000;
+  AsyncQueue<MpscQueue<uint>> queue(64);
+
+  EXPECT_FALSE(queue.whenNotEmpty().poll(waitScope));
+  EXPECT_TRUE(queue.tryPush(0));
+  EXPECT_TRUE(queue.whenNotEmpty().poll(waitScope));
+  EXPECT_EQ(0u, queue.pop().wait(waitScope));
+
+  auto threads = heapArrayBuilder<Own<Thread>>(THREADS);
+  for (uint t = 0; t < THREADS; t++) {
+    threads.add(heap<Thread>([&queue,t]() {
+      for (uint i = 0; i < COUNT; i++) {
+        while (!queue.tryPush(t * COUNT + i)) { sched_yield(); }
+      }
+    }));
+  }
+
+  uint next[THREADS] = {0, 0, 0, 0};
+  for (uint received = 0; received < THREADS * COUNT; received++) {
+    uint value = queue.pop().wait(waitScope);
+    uint t = value / COUNT;
+    ASSERT_EQ(next[t]++, value % COUNT);
+  }
+}
+
+TEST(AsyncUnixTest, AsyncQueueIntrusive) {
+  captureSignals();
+  UnixEventPort port;
+  EventLoop loop(port);
+  WaitScope waitScope(loop);
+
+  struct Item {
+    uint value;
+    MpscQueueLink<Item> link;
+  };
+  AsyncQueue<MpscIntrusiveQueue<Item, &Item::link>> queue;
+
+  Item items[2];
+  items[0].value = 1;
+  items[1].value = 2;
+  auto promise = queue.whenNotEmpty();
+  EXPECT_FALSE(promise.poll(waitScope));
+
+  Thread thread([&]() {
+    queue.push(items[0]);
+    queue.push(items[1]);
+  });
+
+  promise.wait(waitScope);
+  uint sum = 0;
+  while (sum < 3) {
+    KJ_IF_MAYBE(item, queue.tryPop()) {
+      sum += item->value;
+    } else {
+      queue.whenNotEmpty().wait(waitScope);
+    }
+  }
+  EXPECT_EQ(3u, sum);
+}
+
 int exitCodeForSignal = 0;
 void exitSignalHandler(int) {
   _exit(exitCodeForSignal);
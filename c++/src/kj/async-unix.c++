@@ -38,6 +38,14 @@
 #include <sys/epoll.h>
 #include <sys/signalfd.h>
 #include <sys/eventfd.h>
+#if KJ_USE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#endif
 #else
 #include <poll.h>
 #endif
@@ -278,8 +286,14 @@ void UnixEventPort::gotSignal(const siginfo_t& siginfo) {
 // =======================================================================================
 // epoll FdObserver implementation
 
-UnixEventPort::UnixEventPort()
-    : timerImpl(readClock()),
+#if KJ_USE_IO_URING
+namespace {
+int openIoUring(struct io_uring_params& params);
+}  // namespace
+#endif
+
+UnixEventPort::UnixEventPort(TimerStrategy timerStrategy)
+    : timerImpl(readClock(), timerStrategy),
       epollFd(-1),
       signalFd(-1),
       eventFd(-1) {
@@ -304,6 +318,20 @@ UnixEventPort::UnixEventPort()
   KJ_SYSCALL(epoll_ctl(epollFd, EPOLL_CTL_ADD, signalFd, &event));
   event.data.u64 = 1;
   KJ_SYSCALL(epoll_ctl(epollFd, EPOLL_CTL_ADD, eventFd, &event));
+
+#if KJ_USE_IO_URING
+  struct io_uring_params params;
+  fd = openIoUring(params);
+  if (fd >= 0) {
+    auto ring = kj::heap<IoUring>(AutoCloseFd(fd), params);
+
+    // The ring fd becomes readable when completions are posted, so that they can wake us from
+    // epoll_wait().
+    event.data.u64 = 2;
+    KJ_SYSCALL(epoll_ctl(epollFd, EPOLL_CTL_ADD, ring->ringFd, &event));
+    ioUring = kj::mv(ring);
+  }
+#endif
 }
 
 UnixEventPort::~UnixEventPort() noexcept(false) {
@@ -519,6 +547,11 @@ static siginfo_t toRegularSiginfo(const struct signalfd_siginfo& siginfo) {
   return result;
 }
 
+void UnixEventPort::setEpollBatchSize(uint size) {
+  KJ_REQUIRE(size > 0 && size <= 65536, "bad epoll batch size");
+  epollBatchSize = size;
+}
+
 bool UnixEventPort::doEpollWait(int timeout) {
   sigset_t newMask;
   sigemptyset(&newMask);
@@ -541,11 +574,36 @@ bool UnixEventPort::doEpollWait(int timeout) {
     KJ_SYSCALL(signalfd(signalFd, &signalFdSigset, SFD_NONBLOCK | SFD_CLOEXEC));
   }
 
-  struct epoll_event events[16];
-  int n = epoll_wait(epollFd, events, kj::size(events), timeout);
+#if KJ_USE_IO_URING
+  KJ_IF_MAYBE(ring, ioUring) {
+    // Hand everything queued during this turn to the kernel. Operations that can complete
+    // immediately usually do so during submission, in which case there's no reason to sleep.
+    if (ring->get()->flush()) {
+      timeout = 0;
+    }
+  }
+#endif
+
+  KJ_STACK_ARRAY(struct epoll_event, events, epollBatchSize, 16, 256);
+  int n;
+#if KJ_USE_IO_URING
+retry:
+#endif
+  n = epoll_wait(epollFd, events.begin(), int(events.size()), timeout);
   if (n < 0) {
     int error = errno;
     if (error == EINTR) {
+#if KJ_USE_IO_URING
+      KJ_IF_MAYBE(ring, ioUring) {
+        // The kernel also interrupts us to run io_uring completion work (including teardown of
+        // rings we've closed). If that produced nothing for us and there's no timeout to
+        // recompute, there's no reason to report a spurious wakeup; go back to sleep.
+        if (timeout < 0 && !ring->get()->reap()) {
+          goto retry;
+        }
+      }
+#endif
+
       // We can't simply restart the epoll call because we need to recompute the timeout. Instead,
       // we pretend epoll_wait() returned zero events. This will cause the event loop to spin once,
       // decide it has nothing to do, recompute timeouts, then return to waiting.
@@ -556,7 +614,6 @@ bool UnixEventPort::doEpollWait(int timeout) {
   }
 
   bool woken = false;
-
   for (int i = 0; i < n; i++) {
     if (events[i].data.u64 == 0) {
       for (;;) {
@@ -578,17 +635,491 @@ bool UnixEventPort::doEpollWait(int timeout) {
 
       // We were woken. Need to return true.
       woken = true;
+    } else if (events[i].data.u64 == 2) {
+      // io_uring completions are available. We reap them below.
     } else {
       FdObserver* observer = reinterpret_cast<FdObserver*>(events[i].data.ptr);
       observer->fire(events[i].events);
     }
   }
 
+#if KJ_USE_IO_URING
+  KJ_IF_MAYBE(ring, ioUring) {
+    // Reap even if the ring fd wasn't reported: completions may have been posted while we were
+    // being interrupted out of epoll_wait().
+    ring->get()->reap();
+  }
+#endif
+
   timerImpl.advanceTo(readClock());
 
   return woken;
 }
 
+#if KJ_USE_IO_URING
+// =======================================================================================
+// io_uring submission
+
+namespace {
+
+int ioUringSetup(uint entries, struct io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int ioUringEnter(int fd, uint toSubmit, uint minComplete, uint flags) {
+  return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+int ioUringRegister(int fd, uint opcode, void* arg, uint nrArgs) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+static constexpr uint IO_URING_ENTRIES = 256;
+
+static constexpr uint64_t CANCEL_USER_DATA = 0;
+// user_data of the entries we submit to cancel other operations. Their completions are ignored.
+
+static constexpr uint64_t POLL_TAG = 1;
+// Set in the user_data of the poll which an operation is linked behind. (Ops are aligned, so the
+// low bit of their address is otherwise zero.)
+
+int openIoUring(struct io_uring_params& params) {
+  // Sets up an io_uring, returning its fd, or -1 if the kernel can't support what we need, in
+  // which case we fall back to epoll alone.
+
+  memset(&params, 0, sizeof(params));
+  int fd = ioUringSetup(IO_URING_ENTRIES, &params);
+  if (fd < 0) {
+    // ENOSYS on kernels older than 5.1, EPERM if disabled by sysctl or seccomp, etc.
+    return -1;
+  }
+  AutoCloseFd ownFd(fd);
+
+  // We need the rings to share one mapping (5.4), completions never to be dropped (5.5), and
+  // IORING_REGISTER_PROBE (5.6) to check for the operations we use.
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0 ||
+      (params.features & IORING_FEAT_NODROP) == 0) {
+    return -1;
+  }
+
+  constexpr uint PROBE_OPS = 256;
+  auto probeSpace = kj::heapArray<byte>(
+      sizeof(struct io_uring_probe) + PROBE_OPS * sizeof(struct io_uring_probe_op));
+  memset(probeSpace.begin(), 0, probeSpace.size());
+  auto probe = reinterpret_cast<struct io_uring_probe*>(probeSpace.begin());
+  if (ioUringRegister(fd, IORING_REGISTER_PROBE, probe, PROBE_OPS) < 0) {
+    return -1;
+  }
+  for (uint op: { IORING_OP_READ, IORING_OP_WRITEV, IORING_OP_ACCEPT, IORING_OP_CONNECT,
+                  IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_FSYNC,
+                  IORING_OP_FADVISE }) {
+    if (op > probe->last_op || (probe->ops[op].flags & IO_URING_OP_SUPPORTED) == 0) {
+      return -1;
+    }
+  }
+
+  return ownFd.release();
+}
+
+}  // namespace
+
+class UnixEventPort::IoUring::Op {
+  // One submitted operation, whose address is its user_data. The ring owns it until all of its
+  // completions have been reaped, even if the promise waiting for it is destroyed first, since
+  // until then the kernel may still access `storage`.
+
+public:
+  Op(IoUring& ring, Array<byte> storage, bool polled, bool borrowed)
+      : storage(kj::mv(storage)), polled(polled), borrowed(borrowed),
+        pendingCompletions(polled ? 2 : 1) {
+    next = ring.inFlight;
+    prev = &ring.inFlight;
+    if (next != nullptr) next->prev = &next;
+    ring.inFlight = this;
+  }
+
+  ~Op() noexcept(false) {
+    if (next != nullptr) next->prev = prev;
+    *prev = next;
+  }
+
+  Array<byte> storage;
+  Maybe<OpAdapter&> adapter;
+  // Null once the promise has been destroyed.
+
+  bool polled;
+  // The operation is linked behind a poll, which also posts a completion.
+
+  bool borrowed;
+  // The kernel accesses memory belonging to the caller, not just `storage`.
+
+  uint pendingCompletions;
+
+  int result = -ECANCELED;
+  int pollResult = 0;
+
+  Op* next;
+  Op** prev;
+
+  void complete(uint64_t userData, int res);
+};
+
+class UnixEventPort::IoUring::OpAdapter {
+  // Adapts an Op to a promise.
+
+public:
+  OpAdapter(PromiseFulfiller<Completion>& fulfiller, IoUring& ring, Op& op)
+      : fulfiller(fulfiller), ring(ring), op(op) {
+    op.adapter = *this;
+  }
+
+  ~OpAdapter() noexcept(false) {
+    KJ_IF_MAYBE(o, op) {
+      if (o->borrowed) {
+        // The caller's buffer goes away with us, so wait for the kernel to let go of it. For a
+        // socket or pipe op still waiting behind its poll, that's immediate.
+        canceled = true;
+        ring.cancel(*o);
+        while (op != nullptr) {
+          ring.enter(1, IORING_ENTER_GETEVENTS);
+          ring.reap();
+        }
+      } else {
+        o->adapter = nullptr;
+        ring.cancel(*o);
+      }
+    }
+  }
+
+  void complete(int result, Array<byte> storage) {
+    op = nullptr;
+    if (!canceled) {
+      fulfiller.fulfill(Completion { result, kj::mv(storage) });
+    }
+  }
+
+private:
+  PromiseFulfiller<Completion>& fulfiller;
+  IoUring& ring;
+  Maybe<Op&> op;
+  bool canceled = false;
+};
+
+void UnixEventPort::IoUring::Op::complete(uint64_t userData, int res) {
+  if (userData & POLL_TAG) {
+    pollResult = res;
+  } else {
+    result = res;
+  }
+  if (--pendingCompletions > 0) return;
+
+  if (result == -ECANCELED && pollResult < 0) {
+    // The poll failed (e.g. EBADF), so the operation behind it never ran.
+    result = pollResult;
+  }
+  KJ_IF_MAYBE(a, adapter) {
+    a->complete(result, kj::mv(storage));
+  }
+  delete this;
+}
+
+UnixEventPort::IoUring::IoUring(AutoCloseFd ringFdParam, const struct io_uring_params& params)
+    : ringFd(kj::mv(ringFdParam)) {
+  ringSize = kj::max(params.sq_off.array + params.sq_entries * sizeof(uint),
+                     params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+  ringMemory = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ringFd, IORING_OFF_SQ_RING);
+  if (ringMemory == MAP_FAILED) {
+    KJ_FAIL_SYSCALL("mmap(IORING_OFF_SQ_RING)", errno);
+  }
+
+  sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqeMemory = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ringFd, IORING_OFF_SQES);
+  if (sqeMemory == MAP_FAILED) {
+    int error = errno;
+    munmap(ringMemory, ringSize);
+    KJ_FAIL_SYSCALL("mmap(IORING_OFF_SQES)", error);
+  }
+  sqes = reinterpret_cast<struct io_uring_sqe*>(sqeMemory);
+
+  byte* base = reinterpret_cast<byte*>(ringMemory);
+  sqHead = reinterpret_cast<uint*>(base + params.sq_off.head);
+  sqTail = reinterpret_cast<uint*>(base + params.sq_off.tail);
+  sqFlags = reinterpret_cast<uint*>(base + params.sq_off.flags);
+  sqMask = *reinterpret_cast<uint*>(base + params.sq_off.ring_mask);
+  sqEntries = params.sq_entries;
+  sqLocalTail = *sqTail;
+
+  // We always fill submission entries in ring order, so the index array is the identity.
+  uint* sqArray = reinterpret_cast<uint*>(base + params.sq_off.array);
+  for (uint i = 0; i < sqEntries; i++) {
+    sqArray[i] = i;
+  }
+
+  cqHead = reinterpret_cast<uint*>(base + params.cq_off.head);
+  cqTail = reinterpret_cast<uint*>(base + params.cq_off.tail);
+  cqMask = *reinterpret_cast<uint*>(base + params.cq_off.ring_mask);
+  cqes = reinterpret_cast<struct io_uring_cqe*>(base + params.cq_off.cqes);
+}
+
+UnixEventPort::IoUring::~IoUring() noexcept(false) {
+  if (inFlight != nullptr) {
+    // Canceled operations whose completions haven't arrived yet. Closing the ring would cancel
+    // them too, but without telling us when the kernel is done with their memory, so we wait.
+    //
+    // Queuing an entry may reap completions, deleting ops, so collect their user_data first.
+    Vector<uint64_t> targets;
+    for (Op* op = inFlight; op != nullptr; op = op->next) {
+      auto userData = reinterpret_cast<uintptr_t>(op);
+      if (op->polled) targets.add(userData | POLL_TAG);
+      targets.add(userData);
+    }
+    for (uint64_t target: targets) {
+      queueCancel(target);
+    }
+    while (inFlight != nullptr) {
+      enter(1, IORING_ENTER_GETEVENTS);
+      reap();
+    }
+  }
+
+  munmap(sqes, sqesSize);
+  munmap(ringMemory, ringSize);
+}
+
+struct io_uring_sqe& UnixEventPort::IoUring::nextSqe(uint needed) {
+  while (sqEntries - (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE)) < needed) {
+    // Submission ring is full. Hand what we have to the kernel now.
+    enter(0, 0);
+  }
+
+  auto& sqe = sqes[sqLocalTail & sqMask];
+  memset(&sqe, 0, sizeof(sqe));
+  __atomic_store_n(sqTail, ++sqLocalTail, __ATOMIC_RELEASE);
+  ++unsubmitted;
+  return sqe;
+}
+
+void UnixEventPort::IoUring::enter(uint minComplete, uint flags) {
+  for (;;) {
+    int n = ioUringEnter(ringFd, unsubmitted, minComplete, flags);
+    if (n >= 0) {
+      unsubmitted -= kj::min(unsubmitted, uint(n));
+      return;
+    }
+
+    int error = errno;
+    if (error == EBUSY || error == EAGAIN) {
+      // The kernel is holding completions it couldn't fit in the completion ring. Make room.
+      reap();
+      flags |= IORING_ENTER_GETEVENTS;
+    } else if (error == EINTR) {
+      if (minComplete > 0 && unsubmitted == 0) {
+        // The caller is going to check for completions and come back if needed.
+        return;
+      }
+    } else {
+      KJ_FAIL_SYSCALL("io_uring_enter()", error);
+    }
+  }
+}
+
+bool UnixEventPort::IoUring::reap() {
+  bool reaped = false;
+
+  for (;;) {
+    uint head = *cqHead;
+    uint tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      if (__atomic_load_n(sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+        // Completions overflowed into the kernel's backlog. Ask it to move them into the ring.
+        enter(0, IORING_ENTER_GETEVENTS);
+        continue;
+      }
+      return reaped;
+    }
+
+    for (; head != tail; head++) {
+      auto& cqe = cqes[head & cqMask];
+      if (cqe.user_data != CANCEL_USER_DATA) {
+        auto op = reinterpret_cast<Op*>(static_cast<uintptr_t>(cqe.user_data & ~POLL_TAG));
+        op->complete(cqe.user_data, cqe.res);
+      }
+    }
+    __atomic_store_n(cqHead, tail, __ATOMIC_RELEASE);
+    reaped = true;
+  }
+}
+
+bool UnixEventPort::IoUring::flush() {
+  if (unsubmitted > 0) {
+    enter(0, 0);
+  }
+  return reap();
+}
+
+Promise<UnixEventPort::IoUring::Completion> UnixEventPort::IoUring::submit(
+    const struct io_uring_sqe& sqe, Array<byte> storage, short pollEvents, bool borrowed) {
+  auto op = new Op(*this, kj::mv(storage), pollEvents != 0, borrowed);
+  auto userData = reinterpret_cast<uintptr_t>(op);
+  KJ_DASSERT((userData & POLL_TAG) == 0);
+
+  if (pollEvents != 0) {
+    // A non-blocking socket or pipe would otherwise fail with EAGAIN right away.
+    auto& poll = nextSqe(2);
+    poll.opcode = IORING_OP_POLL_ADD;
+    poll.fd = sqe.fd;
+    poll.flags = IOSQE_IO_LINK;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    // Kernels which read all 32 bits expect them half-word swapped, like the 16-bit field.
+    poll.poll32_events = uint32_t(pollEvents) << 16;
+#else
+    poll.poll32_events = pollEvents;
+#endif
+    poll.user_data = userData | POLL_TAG;
+  }
+
+  auto& slot = nextSqe();
+  slot = sqe;
+  slot.user_data = userData;
+
+  return newAdaptedPromise<Completion, OpAdapter>(*this, *op);
+}
+
+void UnixEventPort::IoUring::cancel(Op& op) {
+  // The kernel may go on using the operation's storage until its completion is posted, so `op`
+  // stays in flight until then. We submit right away rather than with the next batch, so that a
+  // pending read stops waiting for data before anyone else tries to read it.
+  //
+  // Queuing may reap `op`'s completions and delete it, so don't touch it after the first entry.
+  auto userData = reinterpret_cast<uintptr_t>(&op);
+  if (op.polled) queueCancel(userData | POLL_TAG);
+  queueCancel(userData);
+  enter(0, 0);
+}
+
+void UnixEventPort::IoUring::queueCancel(uint64_t target) {
+  auto& sqe = nextSqe();
+  sqe.opcode = IORING_OP_ASYNC_CANCEL;
+  sqe.addr = target;
+  sqe.user_data = CANCEL_USER_DATA;
+}
+
+Promise<int> UnixEventPort::IoUring::read(int fd, ArrayPtr<byte> buffer, uint64_t offset) {
+  struct io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_READ;
+  sqe.fd = fd;
+  sqe.addr = reinterpret_cast<uintptr_t>(buffer.begin());
+  sqe.len = kj::min(buffer.size(), size_t(std::numeric_limits<int>::max()));
+  sqe.off = offset;  // -1 means the current file position, like read()
+  return submit(sqe, nullptr, offset == kj::maxValue ? POLLIN : 0, true)
+      .then([](Completion&& completion) { return completion.result; });
+}
+
+Promise<int> UnixEventPort::IoUring::write(int fd, ArrayPtr<const ArrayPtr<const byte>> pieces,
+                                           uint64_t offset) {
+  auto storage = kj::heapArray<byte>(pieces.size() * sizeof(struct iovec));
+  auto iov = reinterpret_cast<struct iovec*>(storage.begin());
+  size_t total = 0;
+  uint count = 0;
+  for (auto& piece: pieces) {
+    // Keep the total within what fits in the result. The caller will write the rest later.
+    size_t size = kj::min(piece.size(), size_t(std::numeric_limits<int>::max()) - total);
+    if (size == 0 && piece.size() > 0) break;
+    iov[count].iov_base = const_cast<byte*>(piece.begin());
+    iov[count].iov_len = size;
+    total += size;
+    ++count;
+  }
+
+  struct io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_WRITEV;
+  sqe.fd = fd;
+  sqe.addr = reinterpret_cast<uintptr_t>(iov);
+  sqe.len = count;
+  sqe.off = offset;  // -1 means the current file position, like write()
+  return submit(sqe, kj::mv(storage), offset == kj::maxValue ? POLLOUT : 0, true)
+      .then([](Completion&& completion) { return completion.result; });
+}
+
+Promise<int> UnixEventPort::IoUring::fsync(int fd, bool dataOnly) {
+  struct io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_FSYNC;
+  sqe.fd = fd;
+  sqe.fsync_flags = dataOnly ? IORING_FSYNC_DATASYNC : 0;
+  return submit(sqe, nullptr, 0, false)
+      .then([](Completion&& completion) { return completion.result; });
+}
+
+Promise<int> UnixEventPort::IoUring::fadvise(
+    int fd, uint64_t offset, uint64_t length, int advice) {
+  struct io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_FADVISE;
+  sqe.fd = fd;
+  sqe.off = offset;
+  sqe.len = kj::min(length, uint64_t(std::numeric_limits<uint32_t>::max()));
+  sqe.fadvise_advice = advice;
+  return submit(sqe, nullptr, 0, false)
+      .then([](Completion&& completion) { return completion.result; });
+}
+
+Promise<int> UnixEventPort::IoUring::accept(int fd, struct sockaddr* addr, uint* addrlen) {
+  static_assert(sizeof(socklen_t) == sizeof(uint), "socklen_t is not uint?");
+
+  struct PeerAddress {
+    struct sockaddr_storage addr;
+    uint addrlen;
+  };
+  auto storage = kj::heapArray<byte>(sizeof(PeerAddress));
+  auto peer = reinterpret_cast<PeerAddress*>(storage.begin());
+  peer->addrlen = kj::min(*addrlen, uint(sizeof(peer->addr)));
+
+  struct io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_ACCEPT;
+  sqe.fd = fd;
+  sqe.addr = reinterpret_cast<uintptr_t>(&peer->addr);
+  sqe.addr2 = reinterpret_cast<uintptr_t>(&peer->addrlen);
+  sqe.accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  return submit(sqe, kj::mv(storage), POLLIN, false)
+      .then([addr,addrlen](Completion&& completion) {
+    if (completion.result >= 0) {
+      auto peer = reinterpret_cast<PeerAddress*>(completion.storage.begin());
+      memcpy(addr, &peer->addr, kj::min(*addrlen, peer->addrlen));
+      *addrlen = peer->addrlen;
+    }
+    return completion.result;
+  });
+}
+
+Promise<int> UnixEventPort::IoUring::connect(int fd, const struct sockaddr* addr, uint addrlen) {
+  auto storage = kj::heapArray<byte>(reinterpret_cast<const byte*>(addr), addrlen);
+
+  struct io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_CONNECT;
+  sqe.fd = fd;
+  sqe.addr = reinterpret_cast<uintptr_t>(storage.begin());
+  sqe.off = addrlen;
+  return submit(sqe, kj::mv(storage), 0, false)
+      .then([](Completion&& completion) { return completion.result; });
+}
+
+Maybe<UnixEventPort::IoUring&> UnixEventPort::getIoUring() {
+  KJ_IF_MAYBE(ring, ioUring) {
+    return **ring;
+  } else {
+    return nullptr;
+  }
+}
+
+#endif  // KJ_USE_IO_URING
+
 #else  // KJ_USE_EPOLL
 // =======================================================================================
 // Traditional poll() FdObserver implementation.
@@ -597,8 +1128,8 @@ bool UnixEventPort::doEpollWait(int timeout) {
 #define POLLRDHUP 0
 #endif
 
-UnixEventPort::UnixEventPort()
-    : timerImpl(readClock()) {
+UnixEventPort::UnixEventPort(TimerStrategy timerStrategy)
+    : timerImpl(readClock(), timerStrategy) {
   static_assert(sizeof(threadId) >= sizeof(pthread_t),
                 "pthread_t is larger than a long long on your platform.  Please port.");
   *reinterpret_cast<pthread_t*>(&threadId) = pthread_self();
@@ -40,6 +40,20 @@
 #define KJ_USE_EPOLL 1
 #endif
 
+// Define KJ_USE_IO_URING=1 (e.g. with the WITH_IO_URING CMake option) to also submit stream and
+// file I/O through io_uring when the running kernel supports it. Otherwise, all I/O goes through
+// epoll.
+#if KJ_USE_IO_URING && !KJ_USE_EPOLL
+#error "KJ_USE_IO_URING requires KJ_USE_EPOLL"
+#endif
+
+#if KJ_USE_IO_URING
+struct io_uring_params;
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct sockaddr;
+#endif
+
 namespace kj {
 
 class UnixEventPort: public EventPort {
@@ -62,12 +76,26 @@ class UnixEventPort: public EventPort {
   //   until after daemonization to create a UnixEventPort.
 
 public:
-  UnixEventPort();
+  explicit UnixEventPort(TimerStrategy timerStrategy = TimerStrategy::ORDERED_SET);
+  // `timerStrategy` selects the data structure backing getTimer().
   ~UnixEventPort() noexcept(false);
 
   class FdObserver;
   // Class that watches an fd for readability or writability. See definition below.
 
+#if KJ_USE_IO_URING
+  class IoUring;
+  // Class that submits reads, writes, accepts, and connects to the kernel in batches. See
+  // definition below.
+
+  Maybe<IoUring&> getIoUring();
+  // Returns the io_uring through which this port submits stream I/O, or null if the kernel
+  // does not support io_uring (or lacks one of the operations we need). In the latter case, all
+  // I/O goes through epoll readiness notifications and plain read()/write() calls instead.
+  //
+  // The decision is made once, when the UnixEventPort is constructed (e.g. by `setupAsyncIo()`).
+#endif
+
   Promise<siginfo_t> onSignal(int signum);
   // When the given signal is delivered to this thread, return the corresponding siginfo_t.
   // The signal must have been captured using `captureSignal()`.
@@ -125,6 +153,13 @@ public:
   //   because the thread which used onChildExit() uses wait() to reap children, without specifying
   //   which child, and therefore it may inadvertently reap children created by other threads.
 
+#if KJ_USE_EPOLL
+  void setEpollBatchSize(uint size);
+  // Sets the most readiness events one call to epoll_wait() may return (default 16).  A larger
+  // batch means fewer system calls when many fds are busy; the rest are simply picked up by the
+  // next poll.
+#endif
+
   static void captureChildExit();
   // Arranges for child process exit to be captured and handled via UnixEventPort, so that you may
   // call `onChildExit()`. Much like `captureSignal()`, this static method must be called early on
@@ -161,8 +196,14 @@ private:
   // Signal mask as currently set on the signalFd. Tracked so we can detect whether or not it
   // needs updating.
 
+  uint epollBatchSize = 16;
+
   bool doEpollWait(int timeout);
 
+#if KJ_USE_IO_URING
+  Maybe<Own<IoUring>> ioUring;
+#endif
+
 #else
   class PollContext;
 
@@ -305,4 +346,111 @@ private:
   friend class UnixEventPort;
 };
 
+#if KJ_USE_IO_URING
+class UnixEventPort::IoUring {
+  // Submits I/O operations through a Linux io_uring. Operations requested during a turn of the
+  // event loop are queued in the submission ring and handed to the kernel together, with a single
+  // io_uring_enter() call, the next time the UnixEventPort waits or polls. Completions are then
+  // reaped from shared memory without any further system calls.
+  //
+  // Each operation resolves to its result as reported by the kernel: non-negative on success, or
+  // a negated errno on failure. There is no need to wait for readiness first: operations on
+  // sockets and pipes are linked behind a poll, so that they wait even if the fd is non-blocking.
+  //
+  // Reads and writes go directly to and from the caller's buffers, which must stay valid until the
+  // promise resolves or is destroyed. Destroying the promise cancels the operation and, if the
+  // kernel may still be using the caller's buffers, waits for it to let go of them. This is prompt
+  // for a socket or pipe operation still waiting for readiness. (Data which was read by then is
+  // lost, as with any read that is canceled after it completes.) Other operations only access
+  // memory of their own, so canceling them doesn't wait.
+
+public:
+  IoUring(AutoCloseFd ringFd, const struct io_uring_params& params);
+  // Maps the rings of an already-set-up io_uring. Normally only UnixEventPort creates these; use
+  // `UnixEventPort::getIoUring()`.
+
+  ~IoUring() noexcept(false);
+  KJ_DISALLOW_COPY(IoUring);
+
+  Promise<int> read(int fd, ArrayPtr<byte> buffer, uint64_t offset = kj::maxValue);
+  // Reads up to `buffer.size()` bytes, at `offset` or, if it is omitted, from a socket or pipe,
+  // once it becomes readable. Resolves to the number of bytes read, zero at EOF.
+
+  Promise<int> write(int fd, ArrayPtr<const ArrayPtr<const byte>> pieces,
+                     uint64_t offset = kj::maxValue);
+  // Gather-writes the pieces, at `offset` or, if it is omitted, to a socket or pipe, once it
+  // becomes writable. Resolves to the number of bytes written, which may be fewer than requested.
+  // The `pieces` array itself is copied and need not outlive the call.
+
+  Promise<int> fsync(int fd, bool dataOnly);
+  // Like fsync(), or fdatasync() if `dataOnly` is true.
+
+  Promise<int> fadvise(int fd, uint64_t offset, uint64_t length, int advice);
+  // Like posix_fadvise(), without blocking while the kernel acts on the advice.
+
+  Promise<int> accept(int fd, struct sockaddr* addr, uint* addrlen);
+  // Accepts a connection on a listen socket, once one is pending. Resolves to the new fd, which
+  // has CLOEXEC and NONBLOCK set. `addr` and `addrlen` receive the peer address as with accept().
+
+  Promise<int> connect(int fd, const struct sockaddr* addr, uint addrlen);
+  // Connects a socket, resolving to zero once the connection is established. (The address is
+  // copied and need not outlive the call.)
+
+private:
+  struct Completion {
+    int result;
+    Array<byte> storage;
+  };
+
+  class Op;
+  class OpAdapter;
+
+  AutoCloseFd ringFd;
+
+  void* ringMemory;
+  size_t ringSize;
+  struct io_uring_sqe* sqes;
+  size_t sqesSize;
+
+  uint* sqHead;
+  uint* sqTail;
+  uint* sqFlags;
+  uint sqMask;
+  uint sqEntries;
+  uint sqLocalTail;
+  uint unsubmitted = 0;
+  // Entries we have queued in the submission ring but not yet passed to io_uring_enter().
+
+  uint* cqHead;
+  uint* cqTail;
+  uint cqMask;
+  struct io_uring_cqe* cqes;
+
+  Op* inFlight = nullptr;
+  // Operations whose completions have not yet been reaped, including canceled ones.
+
+  struct io_uring_sqe& nextSqe(uint needed = 1);
+  // Returns a zeroed submission entry, submitting queued entries first if fewer than `needed`
+  // slots are free. (Linked entries must be handed to the kernel together.)
+
+  Promise<Completion> submit(const struct io_uring_sqe& sqe, Array<byte> storage,
+                             short pollEvents, bool borrowed);
+  // Queues `sqe`, whose pointers refer to `storage` or, if `borrowed` is true, also to memory of
+  // the caller's. If `pollEvents` is non-zero, the operation waits until the fd reports one of
+  // them.
+
+  void enter(uint minComplete, uint flags);
+  bool reap();
+  // Delivers all completions currently in the completion ring. Returns true if there were any.
+
+  bool flush();
+  // Submits any queued entries, then reaps. Returns true if any completions were delivered.
+
+  void cancel(Op& op);
+  void queueCancel(uint64_t target);
+
+  friend class UnixEventPort;
+};
+#endif  // KJ_USE_IO_URING
+
 }  // namespace kj
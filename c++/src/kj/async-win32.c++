@@ -37,8 +37,9 @@
 
 namespace kj {
 
-Win32IocpEventPort::Win32IocpEventPort()
-    : iocp(newIocpHandle()), thread(openCurrentThread()), timerImpl(readClock()) {}
+Win32IocpEventPort::Win32IocpEventPort(TimerStrategy timerStrategy)
+    : iocp(newIocpHandle()), thread(openCurrentThread()),
+      timerImpl(readClock(), timerStrategy) {}
 
 Win32IocpEventPort::~Win32IocpEventPort() noexcept(false) {}
 
@@ -185,24 +186,30 @@ void Win32IocpEventPort::wake() const {
   }
 }
 
+static constexpr ULONG IOCP_BATCH_SIZE = 64;
+// Max completions dequeued per GetQueuedCompletionStatusEx() call. Under load, a busy server
+// otherwise makes one system call per completed read, write, or accept.
+
 void Win32IocpEventPort::waitIocp(DWORD timeoutMs) {
-  if (isAllowApc) {
+  if (isAllowApc || canBatch) {
+    OVERLAPPED_ENTRY entries[IOCP_BATCH_SIZE];
     ULONG countReceived = 0;
-    OVERLAPPED_ENTRY entry;
-    memset(&entry, 0, sizeof(entry));
 
-    if (GetQueuedCompletionStatusEx(iocp, &entry, 1, &countReceived, timeoutMs, TRUE)) {
-      KJ_ASSERT(countReceived == 1);
+    if (GetQueuedCompletionStatusEx(iocp, entries, IOCP_BATCH_SIZE, &countReceived, timeoutMs,
+                                    isAllowApc)) {
+      KJ_ASSERT(countReceived >= 1 && countReceived <= IOCP_BATCH_SIZE);
 
-      if (entry.lpOverlapped == nullptr) {
-        // wake() called in another thread, or APC queued.
-      } else {
-        DWORD error = ERROR_SUCCESS;
-        if (entry.lpOverlapped->Internal != STATUS_SUCCESS) {
-          error = LsaNtStatusToWinError(entry.lpOverlapped->Internal);
+      for (auto& entry: kj::arrayPtr(entries, countReceived)) {
+        if (entry.lpOverlapped == nullptr) {
+          // wake() called in another thread, or APC queued.
+        } else {
+          DWORD error = ERROR_SUCCESS;
+          if (entry.lpOverlapped->Internal != STATUS_SUCCESS) {
+            error = LsaNtStatusToWinError(entry.lpOverlapped->Internal);
+          }
+          static_cast<IoPromiseAdapter*>(entry.lpOverlapped)
+              ->done(IoResult { error, entry.dwNumberOfBytesTransferred });
         }
-        static_cast<IoPromiseAdapter*>(entry.lpOverlapped)
-            ->done(IoResult { error, entry.dwNumberOfBytesTransferred });
       }
     } else {
       // Call failed.
@@ -212,8 +219,12 @@ void Win32IocpEventPort::waitIocp(DWORD timeoutMs) {
         // WAIT_IO_COMPLETION = APC queued
         // Either way, nothing to do.
         return;
+      } else if (error == ERROR_CALL_NOT_IMPLEMENTED && !isAllowApc) {
+        // Older versions of Wine don't implement GetQueuedCompletionStatusEx().
+        canBatch = false;
+        waitIocp(timeoutMs);
       } else {
-        KJ_FAIL_WIN32("GetQueuedCompletionStatusEx()", error, error, entry.lpOverlapped);
+        KJ_FAIL_WIN32("GetQueuedCompletionStatusEx()", error, error);
       }
     }
   } else {
@@ -190,7 +190,8 @@ class Win32IocpEventPort final: public Win32EventPort {
   // With this implementation, observeSignalState() requires spawning a separate thread.
 
 public:
-  Win32IocpEventPort();
+  explicit Win32IocpEventPort(TimerStrategy timerStrategy = TimerStrategy::ORDERED_SET);
+  // `timerStrategy` selects the data structure backing getTimer().
   ~Win32IocpEventPort() noexcept(false);
 
   // implements EventPort ------------------------------------------------------
@@ -215,12 +216,15 @@ private:
   TimerImpl timerImpl;
   mutable std::atomic<bool> sentWake {false};
   bool isAllowApc = false;
+  bool canBatch = true;
+  // Cleared if GetQueuedCompletionStatusEx() turns out not to be implemented (older Wine), in
+  // which case completions are dequeued one at a time with GetQueuedCompletionStatus().
 
   static TimePoint readClock();
 
   void waitIocp(DWORD timeoutMs);
-  // Wait on the I/O completion port for up to timeoutMs and pump events. Does not advance the
-  // timer; caller must do that.
+  // Wait on the I/O completion port for up to timeoutMs and pump events. Everything already
+  // queued, up to a batch, is dequeued at once. Does not advance the timer; caller must do that.
 
   bool receivedWake();
 
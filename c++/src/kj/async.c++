@@ -23,6 +23,8 @@
 #include "debug.h"
 #include "vector.h"
 #include "threadlocal.h"
+#include "mutex.h"
+#include "thread.h"
 
 #if KJ_USE_FUTEX
 #include <unistd.h>
@@ -32,6 +34,7 @@
 
 #if !KJ_NO_RTTI
 #include <typeinfo>
+#include <chrono>
 #if __GNUC__
 #include <cxxabi.h>
 #include <stdlib.h>
@@ -87,8 +90,6 @@ public:
 TaskSet::TaskSet(TaskSet::ErrorHandler& errorHandler)
   : errorHandler(errorHandler) {}
 
-TaskSet::~TaskSet() noexcept(false) {}
-
 class TaskSet::Task final: public _::Event {
 public:
   Task(TaskSet& taskSet, Own<_::PromiseNode>&& nodeParam)
@@ -127,6 +128,7 @@ protected:
     *prev = kj::mv(next);
     next = nullptr;
     prev = nullptr;
+    --taskSet.taskCount;
 
     KJ_IF_MAYBE(f, taskSet.emptyFulfiller) {
       if (taskSet.tasks == nullptr) {
@@ -147,14 +149,97 @@ private:
   Own<_::PromiseNode> node;
 };
 
+struct TaskSet::Slab {
+  // A block of Task slots.  Each slab is twice the size of the previous one, up to a limit.
+
+  Slab* next;
+  size_t slotCount;
+
+  static constexpr size_t MIN_SLOTS = 8;
+  static constexpr size_t MAX_SLOTS = 1024;
+  static constexpr size_t ALIGNMENT = alignof(void*) * 2;
+
+  static constexpr size_t alignUp(size_t n) { return (n + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT; }
+  static constexpr size_t headerSize() { return alignUp(sizeof(Slab)); }
+  static constexpr size_t slotSize() { return alignUp(sizeof(Task)); }
+
+  byte* slot(size_t i) { return reinterpret_cast<byte*>(this) + headerSize() + i * slotSize(); }
+};
+
+TaskSet::~TaskSet() noexcept(false) {
+  KJ_DEFER({
+    while (slabs != nullptr) {
+      Slab* slab = slabs;
+      slabs = slab->next;
+      operator delete(slab);
+    }
+  });
+
+  clear();
+}
+
+void* TaskSet::allocateSlot() {
+  if (freeSlots == nullptr) {
+    size_t count = slabs == nullptr ? size_t(Slab::MIN_SLOTS)
+                                    : kj::min(slabs->slotCount * 2, size_t(Slab::MAX_SLOTS));
+    static_assert(alignof(Task) <= Slab::ALIGNMENT, "Task slots are misaligned");
+    Slab* slab = reinterpret_cast<Slab*>(
+        operator new(Slab::headerSize() + count * Slab::slotSize()));
+    slab->next = slabs;
+    slab->slotCount = count;
+    slabs = slab;
+
+    for (size_t i = count; i-- > 0;) {
+      void* slot = slab->slot(i);
+      *reinterpret_cast<void**>(slot) = freeSlots;
+      freeSlots = slot;
+    }
+  }
+
+  void* result = freeSlots;
+  freeSlots = *reinterpret_cast<void**>(result);
+  return result;
+}
+
+void TaskSet::disposeImpl(void* pointer) const {
+  KJ_DEFER({
+    *reinterpret_cast<void**>(pointer) = freeSlots;
+    freeSlots = pointer;
+  });
+  static_cast<Task*>(pointer)->~Task();
+}
+
 void TaskSet::add(Promise<void>&& promise) {
-  auto task = heap<Task>(*this, kj::mv(promise.node));
+  Task* taskPtr = reinterpret_cast<Task*>(allocateSlot());
+  ctor(*taskPtr, *this, kj::mv(promise.node));
+  Own<Task> task(taskPtr, *this);
   KJ_IF_MAYBE(head, tasks) {
     head->get()->prev = &task->next;
     task->next = kj::mv(tasks);
   }
   task->prev = &tasks;
   tasks = kj::mv(task);
+  ++taskCount;
+}
+
+void TaskSet::clear() {
+  // Unlink each task before destroying it, so that whatever its cancellation does to this set
+  // sees a consistent list.
+  while (tasks != nullptr) {
+    Own<Task> task = kj::mv(KJ_ASSERT_NONNULL(tasks));
+    tasks = kj::mv(task->next);
+    task->next = nullptr;
+    task->prev = nullptr;
+    KJ_IF_MAYBE(head, tasks) {
+      head->get()->prev = &tasks;
+    }
+    --taskCount;
+  }
+
+  KJ_IF_MAYBE(f, emptyFulfiller) {
+    f->get()->fulfill();
+    emptyFulfiller = nullptr;
+  }
 }
 
 kj::String TaskSet::trace() {
@@ -237,23 +322,31 @@ EventLoop::EventLoop(EventPort& port)
       daemons(kj::heap<TaskSet>(_::LoggingErrorHandler::instance)) {}
 
 EventLoop::~EventLoop() noexcept(false) {
+  // Fail any cross-thread calls still in progress or queued, and refuse new ones.
+  KJ_IF_MAYBE(e, executor) {
+    e->get()->shutdown();
+  }
+
   // Destroy all "daemon" tasks, noting that their destructors might try to access the EventLoop
   // some more.
   daemons = nullptr;
 
   // The application _should_ destroy everything using the EventLoop before destroying the
   // EventLoop itself, so if there are events on the loop, this indicates a memory leak.
-  KJ_REQUIRE(head == nullptr, "EventLoop destroyed with events still in the queue.  Memory leak?",
-             head->trace()) {
-    // Unlink all the events and hope that no one ever fires them...
-    _::Event* event = head;
-    while (event != nullptr) {
-      _::Event* next = event->next;
-      event->next = nullptr;
-      event->prev = nullptr;
-      event = next;
+  for (auto& queue: queues) {
+    KJ_REQUIRE(queue.head == nullptr,
+               "EventLoop destroyed with events still in the queue.  Memory leak?",
+               queue.head->trace()) {
+      // Unlink all the events and hope that no one ever fires them...
+      _::Event* event = queue.head;
+      while (event != nullptr) {
+        _::Event* next = event->next;
+        event->next = nullptr;
+        event->prev = nullptr;
+        event = next;
+      }
+      break;
     }
-    break;
   }
 
   KJ_REQUIRE(threadLocalEventLoop != this,
@@ -263,9 +356,20 @@ EventLoop::~EventLoop() noexcept(false) {
   }
 }
 
+namespace {
+
+TimePoint readLoopClock() {
+  return origin<TimePoint>() + std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count() * NANOSECONDS;
+}
+
+}  // namespace
+
 void EventLoop::run(uint maxTurnCount) {
-  running = true;
-  KJ_DEFER(running = false);
+  startRunning();
+  KJ_DEFER(stopRunning());
+
+  pollExecutor();
 
   for (uint i = 0; i < maxTurnCount; i++) {
     if (!turn()) {
@@ -276,40 +380,123 @@ void EventLoop::run(uint maxTurnCount) {
   setRunnable(isRunnable());
 }
 
+EventLoop::EventQueue* EventLoop::chooseQueue() {
+  // Normally the highest-priority non-empty queue, unless a lower one has been passed over too
+  // many times in a row.
+
+  EventQueue* chosen = nullptr;
+  for (auto& queue: queues) {
+    if (queue.head == nullptr) {
+      queue.skippedTurns = 0;
+    } else if (chosen == nullptr || queue.skippedTurns >= starvationLimit) {
+      chosen = &queue;
+    }
+  }
+
+  if (chosen != nullptr) {
+    chosen->skippedTurns = 0;
+    for (auto queue = chosen + 1; queue != queues + PRIORITY_COUNT; ++queue) {
+      if (queue->head != nullptr) ++queue->skippedTurns;
+    }
+  }
+
+  return chosen;
+}
+
 bool EventLoop::turn() {
-  _::Event* event = head;
+  EventQueue* queue = chooseQueue();
 
-  if (event == nullptr) {
+  if (queue == nullptr) {
     // No events in the queue.
     return false;
   } else {
-    head = event->next;
-    if (head != nullptr) {
-      head->prev = &head;
+    _::Event* event = queue->head;
+    queue->head = event->next;
+    if (queue->head != nullptr) {
+      queue->head->prev = &queue->head;
     }
 
-    depthFirstInsertPoint = &head;
-    if (tail == &event->next) {
-      tail = &head;
+    if (queue->tail == &event->next) {
+      queue->tail = &queue->head;
+    }
+    for (auto& q: queues) {
+      q.depthFirstInsertPoint = &q.head;
     }
 
     event->next = nullptr;
     event->prev = nullptr;
+    --stats.queueDepth;
+    ++stats.eventsFired;
 
     Maybe<Own<_::Event>> eventToDestroy;
     {
       event->firing = true;
-      KJ_DEFER(event->firing = false);
-      eventToDestroy = event->fire();
+      currentPriority = static_cast<EventPriority>(queue - queues);
+      KJ_DEFER(event->firing = false; currentPriority = EventPriority::NORMAL);
+      if (tracer == nullptr) {
+        eventToDestroy = event->fire();
+      } else {
+        eventToDestroy = tracer->fire(*event);
+      }
     }
 
-    depthFirstInsertPoint = &head;
+    for (auto& q: queues) {
+      q.depthFirstInsertPoint = &q.head;
+    }
     return true;
   }
 }
 
 bool EventLoop::isRunnable() {
-  return head != nullptr;
+  for (auto& queue: queues) {
+    if (queue.head != nullptr) return true;
+  }
+  return false;
+}
+
+void EventLoop::setStarvationLimit(uint turns) {
+  starvationLimit = turns;
+}
+
+void EventLoop::setIoPollLimits(uint maxTurns, Duration maxTime) {
+  KJ_REQUIRE(maxTurns > 0, "maxTurns must be positive");
+  maxTurnsBetweenIoPolls = maxTurns;
+  maxTimeBetweenIoPolls = maxTime;
+}
+
+void EventLoop::startRunning() {
+  running = true;
+  lastIoPoll = readLoopClock();
+  turnsSinceIoPoll = 0;
+}
+
+void EventLoop::stopRunning() {
+  running = false;
+  stats.runTime += readLoopClock() - lastIoPoll;
+}
+
+bool EventLoop::ioPollDue() {
+  // Called after each turn while waiting.  Only reads the clock if a time limit is set.
+  if (++turnsSinceIoPoll >= maxTurnsBetweenIoPolls) return true;
+  return maxTimeBetweenIoPolls != Duration(kj::maxValue) &&
+         readLoopClock() - lastIoPoll >= maxTimeBetweenIoPolls;
+}
+
+void EventLoop::waitForIo(bool block) {
+  TimePoint before = readLoopClock();
+  stats.runTime += before - lastIoPoll;
+  ++stats.ioPolls;
+
+  if (block) {
+    port.wait();
+  } else {
+    port.poll();
+  }
+  pollExecutor();
+
+  lastIoPoll = readLoopClock();
+  stats.ioTime += lastIoPoll - before;
+  turnsSinceIoPoll = 0;
 }
 
 void EventLoop::setRunnable(bool runnable) {
@@ -336,18 +523,21 @@ void WaitScope::poll() {
   KJ_REQUIRE(&loop == threadLocalEventLoop, "WaitScope not valid for this thread.");
   KJ_REQUIRE(!loop.running, "poll() is not allowed from within event callbacks.");
 
-  loop.running = true;
-  KJ_DEFER(loop.running = false);
+  loop.startRunning();
+  KJ_DEFER(loop.stopRunning());
 
   for (;;) {
     if (!loop.turn()) {
       // No events in the queue.  Poll for I/O.
-      loop.port.poll();
+      loop.waitForIo(false);
 
       if (!loop.isRunnable()) {
         // Still no events in the queue. We're done.
         return;
       }
+    } else if (loop.ioPollDue()) {
+      ++loop.stats.forcedIoPolls;
+      loop.waitForIo(false);
     }
   }
 }
@@ -363,13 +553,17 @@ void waitImpl(Own<_::PromiseNode>&& node, _::ExceptionOrValue& result, WaitScope
   node->setSelfPointer(&node);
   node->onReady(&doneEvent);
 
-  loop.running = true;
-  KJ_DEFER(loop.running = false);
+  loop.startRunning();
+  KJ_DEFER(loop.stopRunning());
 
   while (!doneEvent.fired) {
     if (!loop.turn()) {
       // No events in the queue.  Wait for callback.
-      loop.port.wait();
+      loop.waitForIo(true);
+    } else if (!doneEvent.fired && loop.ioPollDue()) {
+      // Events keep coming; don't let them starve I/O.
+      ++loop.stats.forcedIoPolls;
+      loop.waitForIo(false);
     }
   }
 
@@ -391,13 +585,13 @@ bool pollImpl(_::PromiseNode& node, WaitScope& waitScope) {
   BoolEvent doneEvent;
   node.onReady(&doneEvent);
 
-  loop.running = true;
-  KJ_DEFER(loop.running = false);
+  loop.startRunning();
+  KJ_DEFER(loop.stopRunning());
 
   while (!doneEvent.fired) {
     if (!loop.turn()) {
       // No events in the queue.  Poll for I/O.
-      loop.port.poll();
+      loop.waitForIo(false);
 
       if (!doneEvent.fired && !loop.isRunnable()) {
         // No progress. Give up.
@@ -405,6 +599,9 @@ bool pollImpl(_::PromiseNode& node, WaitScope& waitScope) {
         loop.setRunnable(false);
         return false;
       }
+    } else if (!doneEvent.fired && loop.ioPollDue()) {
+      ++loop.stats.forcedIoPolls;
+      loop.waitForIo(false);
     }
   }
 
@@ -437,17 +634,19 @@ Event::Event()
 
 Event::~Event() noexcept(false) {
   if (prev != nullptr) {
-    if (loop.tail == &next) {
-      loop.tail = prev;
+    auto& armedQueue = loop.queues[queue];
+    if (armedQueue.tail == &next) {
+      armedQueue.tail = prev;
     }
-    if (loop.depthFirstInsertPoint == &next) {
-      loop.depthFirstInsertPoint = prev;
+    if (armedQueue.depthFirstInsertPoint == &next) {
+      armedQueue.depthFirstInsertPoint = prev;
     }
 
     *prev = next;
     if (next != nullptr) {
       next->prev = prev;
     }
+    --loop.stats.queueDepth;
   }
 
   KJ_REQUIRE(!firing, "Promise callback destroyed itself.");
@@ -461,19 +660,22 @@ void Event::armDepthFirst() {
              "the thread-safe work queue to queue events cross-thread.");
 
   if (prev == nullptr) {
-    next = *loop.depthFirstInsertPoint;
-    prev = loop.depthFirstInsertPoint;
+    auto& armedQueue = queueForArm();
+    next = *armedQueue.depthFirstInsertPoint;
+    prev = armedQueue.depthFirstInsertPoint;
     *prev = this;
     if (next != nullptr) {
       next->prev = &next;
     }
 
-    loop.depthFirstInsertPoint = &next;
+    armedQueue.depthFirstInsertPoint = &next;
 
-    if (loop.tail == prev) {
-      loop.tail = &next;
+    if (armedQueue.tail == prev) {
+      armedQueue.tail = &next;
     }
 
+    loop.noteArmed();
+
     loop.setRunnable(true);
   }
 }
@@ -484,14 +686,16 @@ void Event::armBreadthFirst() {
              "the thread-safe work queue to queue events cross-thread.");
 
   if (prev == nullptr) {
-    next = *loop.tail;
-    prev = loop.tail;
+    auto& armedQueue = queueForArm();
+    next = *armedQueue.tail;
+    prev = armedQueue.tail;
     *prev = this;
     if (next != nullptr) {
       next->prev = &next;
     }
 
-    loop.tail = &next;
+    armedQueue.tail = &next;
+    loop.noteArmed();
 
     loop.setRunnable(true);
   }
@@ -501,6 +705,12 @@ _::PromiseNode* Event::getInnerForTrace() {
   return nullptr;
 }
 
+EventLoop::EventQueue& Event::queueForArm() {
+  queue = priority == INHERIT_PRIORITY ? static_cast<byte>(loop.currentPriority) : priority;
+  traceParent = loop.currentTraceId;
+  return loop.queues[queue];
+}
+
 #if !KJ_NO_RTTI
 #if __GNUC__
 static kj::String demangleTypeName(const char* name) {
@@ -974,6 +1184,34 @@ namespace _ {  // (private)
 
 // -------------------------------------------------------------------
 
+PriorityPromiseNode::PriorityPromiseNode(
+    Own<PromiseNode>&& dependencyParam, EventPriority priority)
+    : dependency(kj::mv(dependencyParam)) {
+  dependency->setSelfPointer(&dependency);
+  setPriority(priority);
+  dependency->onReady(this);
+}
+
+void PriorityPromiseNode::onReady(Event* event) noexcept {
+  onReadyEvent.init(event);
+}
+
+void PriorityPromiseNode::get(ExceptionOrValue& output) noexcept {
+  dependency->get(output);
+}
+
+PromiseNode* PriorityPromiseNode::getInnerForTrace() {
+  return dependency;
+}
+
+Maybe<Own<Event>> PriorityPromiseNode::fire() {
+  // Runs at our priority, so the dependent event armed here inherits it.
+  onReadyEvent.arm();
+  return nullptr;
+}
+
+// -------------------------------------------------------------------
+
 EagerPromiseNodeBase::EagerPromiseNodeBase(
     Own<PromiseNode>&& dependencyParam, ExceptionOrValue& resultRef)
     : dependency(kj::mv(dependencyParam)), resultRef(resultRef) {
@@ -1012,4 +1250,801 @@ void AdapterPromiseNodeBase::onReady(Event* event) noexcept {
 Promise<void> IdentityFunc<Promise<void>>::operator()() const { return READY_NOW; }
 
 }  // namespace _ (private)
+// =======================================================================================
+// Cross-thread execution
+//
+// Each call to Executor::executeAsync() allocates an XThreadEvent shared by the requesting thread
+// and the target thread, and travels between the two loops' queues:
+//
+// * The requester pushes the REQUEST link onto the target's queue.
+// * The target pops it, calls the function, and waits for the resulting promise.  When that
+//   completes it stores the result in the event and pushes the REPLY link onto the requester's
+//   queue, which arms the requester's promise.
+// * If the requester drops its promise first, it either marks a queued request canceled, which
+//   the target will notice when it pops it, or pushes the CANCEL link so that the target
+//   destroys the promise it is waiting on.
+//
+// `state` arbitrates the races between completion and cancellation.  Each queue is an intrusive
+// stack updated with compare-and-swap and drained all at once by swapping in null, so no locks
+// are taken to send or receive.  A mutex is held only while calling EventPort::wake(), to make
+// sure the target loop isn't destroyed in the middle of the call.
+
+namespace _ {  // private
+
+enum XThreadState: uint {
+  QUEUED,     // REQUEST is on the target's queue.
+  EXECUTING,  // The target has started the call.
+  DONE,       // The result has been stored and REPLY sent.
+  CANCELED,   // The requester gave up while QUEUED; the target will discard the request.
+  CANCELING   // The requester gave up while EXECUTING; CANCEL has been sent.
+};
+
+#if _MSC_VER
+static bool casState(volatile long& state, uint expected, uint desired) {
+  return _InterlockedCompareExchange(&state, desired, expected) == long(expected);
+}
+#else
+static bool casState(volatile uint& state, uint expected, uint desired) {
+  return __atomic_compare_exchange_n(&state, &expected, desired, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+#endif
+
+XThreadEvent::XThreadEvent(ExceptionOrValue& result, const Executor& target)
+    : result(result), target(target.addRef()), requester(getCurrentThreadExecutor().addRef()),
+      state(QUEUED) {}
+
+XThreadEvent::XThreadEvent(ExceptionOrValue& result)
+    : result(result), requester(getCurrentThreadExecutor().addRef()), state(QUEUED) {}
+
+XThreadEvent::~XThreadEvent() noexcept(false) {}
+
+bool XThreadEvent::startFulfilling() {
+  return casState(state, QUEUED, EXECUTING);
+}
+
+bool XThreadEvent::isWaiting() const {
+#if _MSC_VER
+  return state == long(QUEUED);  // volatile reads have acquire semantics under MSVC
+#else
+  return __atomic_load_n(&state, __ATOMIC_ACQUIRE) == QUEUED;
+#endif
+}
+
+void XThreadEvent::sendReply() {
+  if (casState(state, EXECUTING, DONE)) {
+    auto& link = links[REPLY];
+    link.ref = kj::atomicAddRef(*this);
+    requester->push(*this, REPLY);
+  }
+}
+
+class XThreadPromiseNode final: public PromiseNode {
+  // The requester's end of an XThreadEvent.
+
+public:
+  explicit XThreadPromiseNode(Own<XThreadEvent>&& eventParam): event(kj::mv(eventParam)) {
+    event->promiseNode = this;
+  }
+
+  ~XThreadPromiseNode() noexcept(false) {
+    event->promiseNode = nullptr;
+
+    if (casState(event->state, QUEUED, CANCELED)) {
+      // The target will drop the request when it gets to it.
+    } else if (casState(event->state, EXECUTING, CANCELING)) {
+      if (event->target.get() != nullptr) {
+        auto& link = event->links[XThreadEvent::CANCEL];
+        link.ref = kj::atomicAddRef(*event);
+        event->target->push(*event, XThreadEvent::CANCEL);
+      } else {
+        // A ThreadPool task, which can't be interrupted.  It will find that it has been canceled
+        // when it tries to reply.
+      }
+    } else {
+      // Already DONE.  The REPLY may still be queued, but it will be ignored.
+    }
+  }
+
+  void onReady(Event* event) noexcept override {
+    onReadyEvent.init(event);
+  }
+
+  void get(ExceptionOrValue& output) noexcept override {
+    event->getResult(output);
+  }
+
+  void ready() {
+    onReadyEvent.arm();
+  }
+
+private:
+  Own<XThreadEvent> event;
+  OnReadyEvent onReadyEvent;
+};
+
+Own<PromiseNode> XThreadEvent::newPromiseNode(Own<XThreadEvent>&& event) {
+  return kj::heap<XThreadPromiseNode>(kj::mv(event));
+}
+
+class XThreadExecution final: public Event {
+  // The target's end of an XThreadEvent, waiting for the promise returned by the function.
+
+public:
+  explicit XThreadExecution(Own<XThreadEvent>&& eventParam): event(kj::mv(eventParam)) {
+    event->execution = this;
+  }
+
+  ~XThreadExecution() noexcept(false) {
+    event->execution = nullptr;
+  }
+
+  void start() {
+    // Call the function from the event loop, like any other callback.
+    armBreadthFirst();
+  }
+
+  void finish(Maybe<Exception> exception) {
+    // Deliver the result (or `exception`) to the requester, unless it has given up.
+
+    KJ_IF_MAYBE(e, exception) {
+      event->result.addException(kj::mv(*e));
+    }
+    KJ_IF_MAYBE(e, kj::runCatchingExceptions([this]() { node = nullptr; })) {
+      event->result.addException(kj::mv(*e));
+    }
+
+    event->sendReply();
+  }
+
+  Maybe<Own<XThreadExecution>> next;
+  Maybe<Own<XThreadExecution>>* prev = nullptr;
+  // Linked list of executions in progress, owned by Executor::Impl.
+
+  Own<XThreadExecution> unlink() {
+    KJ_IF_MAYBE(n, next) {
+      n->get()->prev = prev;
+    }
+    Own<XThreadExecution> self = kj::mv(KJ_ASSERT_NONNULL(*prev));
+    KJ_ASSERT(self.get() == this);
+    *prev = kj::mv(next);
+    next = nullptr;
+    prev = nullptr;
+    return self;
+  }
+
+private:
+  Own<XThreadEvent> event;
+  Own<PromiseNode> node;
+
+  friend class kj::Executor;
+
+  Maybe<Own<Event>> fire() override {
+    if (node.get() == nullptr) {
+      node = event->execute();
+      node->setSelfPointer(&node);
+      node->onReady(this);
+      return nullptr;
+    }
+
+    node->get(event->result);
+    finish(nullptr);
+    return Own<Event>(unlink());
+  }
+
+  _::PromiseNode* getInnerForTrace() override {
+    return node;
+  }
+};
+
+}  // namespace _ (private)
+
+struct Executor::Impl {
+  MutexGuarded<EventLoop*> loop;
+  // Null once the loop has been destroyed.  Locked while waking the loop.
+
+  mutable _::XThreadEvent::Link* head = nullptr;
+  // Top of the queue, a lock-free stack.  Pushed from any thread; popped by the loop's thread,
+  // or by whichever thread finds that the loop has been destroyed.
+
+  mutable Maybe<Own<_::XThreadExecution>> executions;
+  // Calls currently in progress.  Only accessed on the loop's thread.
+
+  explicit Impl(EventLoop& loop): loop(&loop) {}
+};
+
+namespace {
+
+bool pushLink(_::XThreadEvent::Link*& head, _::XThreadEvent::Link* link) {
+  // Push `link` onto the stack.  Returns true if the stack was previously empty.
+
+#if _MSC_VER
+  for (;;) {
+    auto old = head;
+    link->next = old;
+    if (_InterlockedCompareExchangePointer(
+            reinterpret_cast<void* volatile*>(&head), link, old) == old) {
+      return old == nullptr;
+    }
+  }
+#else
+  auto old = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  do {
+    link->next = old;
+  } while (!__atomic_compare_exchange_n(&head, &old, link, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  return old == nullptr;
+#endif
+}
+
+_::XThreadEvent::Link* takeLinks(_::XThreadEvent::Link*& head) {
+  // Empty the stack, returning its contents in the order they were pushed.
+
+#if _MSC_VER
+  auto link = reinterpret_cast<_::XThreadEvent::Link*>(
+      _InterlockedExchangePointer(reinterpret_cast<void* volatile*>(&head), nullptr));
+#else
+  auto link = __atomic_exchange_n(&head, nullptr, __ATOMIC_ACQUIRE);
+#endif
+
+  _::XThreadEvent::Link* reversed = nullptr;
+  while (link != nullptr) {
+    auto next = link->next;
+    link->next = reversed;
+    reversed = link;
+    link = next;
+  }
+  return reversed;
+}
+
+}  // namespace
+
+Executor::Executor(EventLoop& loop): impl(kj::heap<Impl>(loop)) {}
+
+bool Executor::isLive() const {
+  return *impl->loop.lockShared() != nullptr;
+}
+
+Own<const Executor> Executor::addRef() const {
+  return kj::atomicAddRef(*this);
+}
+
+Own<_::PromiseNode> Executor::send(Own<_::XThreadEvent>&& event) const {
+  auto& link = event->links[_::XThreadEvent::REQUEST];
+  link.ref = kj::atomicAddRef(*event);
+  auto result = kj::heap<_::XThreadPromiseNode>(kj::mv(event));
+  push(*link.ref, _::XThreadEvent::REQUEST);
+  return kj::mv(result);
+}
+
+void Executor::push(_::XThreadEvent& event, uint kind) const {
+  if (!pushLink(impl->head, &event.links[kind])) {
+    // Someone else made the queue non-empty, so they're responsible for waking the loop (or for
+    // draining the queue, if the loop is gone).
+    return;
+  }
+
+  bool live;
+  {
+    auto lock = impl->loop.lockShared();
+    live = *lock != nullptr;
+    if (live) (*lock)->port.wake();
+  }
+
+  if (!live) {
+    // The loop has been destroyed and has already drained its queue for the last time.
+    drain(false);
+  }
+}
+
+void Executor::poll() const {
+#if _MSC_VER
+  drain(true);
+#else
+  if (__atomic_load_n(&impl->head, __ATOMIC_RELAXED) != nullptr) {
+    drain(true);
+  }
+#endif
+}
+
+void Executor::drain(bool live) const {
+  // Process everything in the queue.  If `live` is true, we're on the loop's thread; otherwise the
+  // loop is gone and we may be on any thread, so we just fail requests and discard everything
+  // else.
+
+  auto link = takeLinks(impl->head);
+  while (link != nullptr) {
+    auto next = link->next;
+    Own<_::XThreadEvent> event = kj::mv(link->ref);
+    auto kind = link - event->links;
+
+    switch (kind) {
+      case _::XThreadEvent::REQUEST:
+        if (!casState(event->state, _::QUEUED, _::EXECUTING)) {
+          // Canceled before it started.
+          event->destroyFunc();
+        } else if (live) {
+          auto execution = kj::heap<_::XThreadExecution>(kj::mv(event));
+          auto& ref = *execution;
+          KJ_IF_MAYBE(head, impl->executions) {
+            head->get()->prev = &execution->next;
+            execution->next = kj::mv(impl->executions);
+          }
+          execution->prev = &impl->executions;
+          impl->executions = kj::mv(execution);
+          ref.start();
+        } else {
+          event->destroyFunc();
+          event->result.addException(KJ_EXCEPTION(DISCONNECTED,
+              "Executor's event loop no longer exists."));
+          event->sendReply();
+        }
+        break;
+
+      case _::XThreadEvent::CANCEL:
+        if (!live) break;  // All executions were destroyed with the loop.
+        KJ_IF_MAYBE(execution, event->execution) {
+          // Destroying the execution destroys the promise returned by the function.
+          execution->unlink();
+        }
+        break;
+
+      case _::XThreadEvent::REPLY:
+        if (!live) break;  // The requester's promise was necessarily destroyed with its loop.
+        KJ_IF_MAYBE(node, event->promiseNode) {
+          node->ready();
+        }
+        break;
+    }
+
+    link = next;
+  }
+}
+
+void Executor::shutdown() const {
+  // Called by ~EventLoop().  Mark the executor dead, then fail any calls in progress and
+  // everything still queued.
+
+  *impl->loop.lockExclusive() = nullptr;
+
+  for (;;) {
+    KJ_IF_MAYBE(execution, impl->executions) {
+      auto own = execution->get()->unlink();
+      own->finish(KJ_EXCEPTION(DISCONNECTED,
+          "Executor's event loop was destroyed before the call completed."));
+    } else {
+      break;
+    }
+  }
+
+  drain(false);
+}
+
+const Executor& EventLoop::getExecutor() {
+  KJ_IF_MAYBE(e, executor) {
+    return **e;
+  }
+
+  Own<Executor> result = kj::atomicRefcounted<Executor>(*this);
+  auto& ref = *result;
+  executor = kj::mv(result);
+  return ref;
+}
+
+void EventLoop::pollExecutor() {
+  KJ_IF_MAYBE(e, executor) {
+    e->get()->poll();
+  }
+}
+
+const Executor& getCurrentThreadExecutor() {
+  return currentEventLoop().getExecutor();
+}
+
+// =======================================================================================
+// ThreadPool
+//
+// A task is an XThreadEvent without a target executor.  Its REQUEST link sits in one of the
+// workers' queues; the worker calls execute(), which stores the result, and replies to the
+// requester's executor exactly as an Executor call does.
+//
+// Idle workers sleep until `control.wakeups` changes, which run() bumps only if some worker is
+// asleep.  A worker registers in `control.sleepers` before its final look at the queues, and run()
+// checks it after queueing, so at least one of them sees the other.
+
+struct ThreadPool::Impl {
+  struct Queue {
+    _::XThreadEvent::Link* head = nullptr;
+    _::XThreadEvent::Link** tail = &head;
+  };
+
+  Array<MutexGuarded<Queue>> queues;
+  // One per worker.
+
+  struct Control {
+    uint wakeups = 0;
+    uint sleepers = 0;
+    bool stopping = false;
+  };
+  MutexGuarded<Control> control;
+
+#if _MSC_VER
+  mutable volatile long nextQueue = 0;
+#else
+  mutable volatile uint nextQueue = 0;
+#endif
+  // Round-robin position for run().  Accessed atomically.
+
+  Array<Own<Thread>> threads;
+
+  explicit Impl(uint threadCount): queues(heapArray<MutexGuarded<Queue>>(threadCount)) {}
+
+  void push(_::XThreadEvent::Link& link) const {
+#if _MSC_VER
+    uint index = uint(_InterlockedIncrement(&nextQueue) - 1) % queues.size();
+#else
+    uint index = __atomic_fetch_add(&nextQueue, 1, __ATOMIC_RELAXED) % queues.size();
+#endif
+    {
+      auto queue = queues[index].lockExclusive();
+      link.next = nullptr;
+      *queue->tail = &link;
+      queue->tail = &link.next;
+    }
+
+    auto lock = control.lockExclusive();
+    if (lock->sleepers > 0) ++lock->wakeups;
+  }
+
+  Maybe<Own<_::XThreadEvent>> pop(MutexGuarded<Queue>& queueParam) {
+    auto queue = queueParam.lockExclusive();
+    auto link = queue->head;
+    if (link == nullptr) return nullptr;
+    queue->head = link->next;
+    if (queue->head == nullptr) queue->tail = &queue->head;
+    return kj::mv(link->ref);
+  }
+
+  Maybe<Own<_::XThreadEvent>> take(uint index) {
+    // Look in our own queue first, then steal from the others.
+    for (uint i = 0; i < queues.size(); i++) {
+      KJ_IF_MAYBE(event, pop(queues[(index + i) % queues.size()])) {
+        return kj::mv(*event);
+      }
+    }
+    return nullptr;
+  }
+
+  void work(uint index) {
+    while (!control.lockShared()->stopping) {
+      Maybe<Own<_::XThreadEvent>> event = take(index);
+
+      if (event == nullptr) {
+        uint wakeups;
+        {
+          auto lock = control.lockExclusive();
+          if (lock->stopping) break;
+          wakeups = lock->wakeups;
+          ++lock->sleepers;
+        }
+        event = take(index);
+        if (event == nullptr) {
+          control.when([wakeups](const Control& c) { return c.wakeups != wakeups; },
+                       [](Control& c) { --c.sleepers; });
+        } else {
+          --control.lockExclusive()->sleepers;
+        }
+      }
+
+      KJ_IF_MAYBE(e, event) {
+        auto& task = **e;
+        if (casState(task.state, _::QUEUED, _::EXECUTING)) {
+          task.execute();
+          task.sendReply();
+        } else {
+          // Canceled before it started.
+          task.destroyFunc();
+        }
+      }
+    }
+  }
+};
+
+ThreadPool::ThreadPool(uint threadCount): impl(kj::heap<Impl>(threadCount)) {
+  KJ_REQUIRE(threadCount > 0, "ThreadPool needs at least one thread.");
+
+  auto builder = heapArrayBuilder<Own<Thread>>(threadCount);
+  for (uint i = 0; i < threadCount; i++) {
+    builder.add(kj::heap<Thread>([this, i]() { impl->work(i); }));
+  }
+  impl->threads = builder.finish();
+}
+
+ThreadPool::~ThreadPool() noexcept(false) {
+  {
+    auto lock = impl->control.lockExclusive();
+    lock->stopping = true;
+    ++lock->wakeups;
+  }
+
+  // Joins the workers.
+  impl->threads = nullptr;
+
+  for (auto& queue: impl->queues) {
+    for (;;) {
+      KJ_IF_MAYBE(e, impl->pop(queue)) {
+        auto& task = **e;
+        task.destroyFunc();
+        if (casState(task.state, _::QUEUED, _::EXECUTING)) {
+          task.result.addException(KJ_EXCEPTION(DISCONNECTED,
+              "ThreadPool was destroyed before the task started."));
+          task.sendReply();
+        }
+      } else {
+        break;
+      }
+    }
+  }
+}
+
+uint ThreadPool::getThreadCount() const {
+  return impl->queues.size();
+}
+
+Own<_::PromiseNode> ThreadPool::send(Own<_::XThreadEvent>&& event) const {
+  auto& link = event->links[_::XThreadEvent::REQUEST];
+  link.ref = kj::atomicAddRef(*event);
+  auto result = kj::heap<_::XThreadPromiseNode>(kj::mv(event));
+  impl->push(link);
+  return kj::mv(result);
+}
+
+// =======================================================================================
+// AsyncTracer
+//
+// Event records are appended as events finish firing.  `turn()` never nests, so they are in ID
+// order, and since recording only ever stops at the end (when the limit is reached), the record
+// for ID `n` is at index `n - events[0].id` -- which is how the export finds an event's parent.
+
+namespace {
+
+uint64_t nextTracerId = 0;
+
+void appendJsonString(Vector<char>& out, StringPtr text) {
+  out.add('"');
+  for (char c: text) {
+    switch (c) {
+      case '"': out.addAll(StringPtr("\\\"")); break;
+      case '\\': out.addAll(StringPtr("\\\\")); break;
+      case '\n': out.addAll(StringPtr("\\n")); break;
+      default:
+        if (static_cast<byte>(c) < 0x20) {
+          out.addAll(StringPtr("\\u00"));
+          out.add("0123456789abcdef"[c >> 4]);
+          out.add("0123456789abcdef"[c & 0x0f]);
+        } else {
+          out.add(c);
+        }
+        break;
+    }
+  }
+  out.add('"');
+}
+
+void appendMicros(Vector<char>& out, Duration time) {
+  // Chrome trace timestamps are in microseconds but may be fractional.
+  int64_t ns = time / NANOSECONDS;
+  if (ns < 0) ns = 0;
+  auto frac = ns % 1000;
+  out.addAll(kj::str(ns / 1000, '.', frac < 100 ? "0" : "", frac < 10 ? "0" : "", frac));
+}
+
+String typeNameForTrace(const char* mangled) {
+#if KJ_NO_RTTI
+  return heapString("(unknown)");
+#else
+  return _::demangleTypeName(mangled);
+#endif
+}
+
+}  // namespace
+
+struct AsyncTracer::Impl {
+  uint64_t id;
+  size_t maxRecords;
+  size_t dropped = 0;
+  TimePoint startTime = origin<TimePoint>();
+  uint32_t lastEventId = 0;
+  uint64_t spanCount = 0;
+
+  struct EventRecord {
+    uint32_t id;
+    uint32_t parent;
+    const char* eventType;
+    const char* nodeType;
+    // Mangled names from `typeid`, demangled only on export.  `nodeType` is the first promise node
+    // the event continues, if any, which is more telling than the event's own type.
+
+    TimePoint start = origin<TimePoint>();
+    TimePoint end = origin<TimePoint>();
+  };
+  Vector<EventRecord> events;
+
+  struct SpanRecord {
+    uint64_t id;
+    const char* category;
+    String name;
+    TimePoint start = origin<TimePoint>();
+    TimePoint end = origin<TimePoint>();
+  };
+  Vector<SpanRecord> spans;
+
+  bool full() {
+    if (events.size() + spans.size() < maxRecords) return false;
+    ++dropped;
+    return true;
+  }
+};
+
+AsyncTracer::AsyncTracer(EventLoop& loop, size_t maxRecords)
+    : loop(loop), impl(kj::heap<Impl>()) {
+  KJ_REQUIRE(loop.tracer == nullptr, "EventLoop already has an AsyncTracer.");
+  impl->id = __atomic_add_fetch(&nextTracerId, 1, __ATOMIC_RELAXED);
+  impl->maxRecords = maxRecords;
+  impl->startTime = readLoopClock();
+  loop.tracer = this;
+}
+
+AsyncTracer::~AsyncTracer() noexcept(false) {
+  loop.tracer = nullptr;
+  loop.currentTraceId = 0;
+}
+
+Maybe<Own<_::Event>> AsyncTracer::fire(_::Event& event) {
+  // The event may delete itself while firing, so everything we want from it is read first.
+  Impl::EventRecord record;
+  record.parent = event.traceParent;
+  if (++impl->lastEventId == 0) ++impl->lastEventId;
+  record.id = impl->lastEventId;
+#if KJ_NO_RTTI
+  record.eventType = nullptr;
+  record.nodeType = nullptr;
+#else
+  record.eventType = typeid(event).name();
+  _::PromiseNode* node = event.getInnerForTrace();
+  record.nodeType = node == nullptr ? nullptr : typeid(*node).name();
+#endif
+
+  loop.currentTraceId = record.id;
+  record.start = readLoopClock();
+  KJ_DEFER({
+    record.end = readLoopClock();
+    loop.currentTraceId = 0;
+    if (!impl->full()) impl->events.add(record);
+  });
+  return event.fire();
+}
+
+AsyncTracer::Span AsyncTracer::startSpan(const char* category, String name) {
+  return Span(impl->id, category, kj::mv(name), readLoopClock());
+}
+
+Maybe<AsyncTracer&> AsyncTracer::current() {
+  EventLoop* loop = threadLocalEventLoop;
+  if (loop == nullptr || loop->tracer == nullptr) return nullptr;
+  return *loop->tracer;
+}
+
+size_t AsyncTracer::getDroppedCount() const {
+  return impl->dropped;
+}
+
+void AsyncTracer::clear() {
+  impl->events.clear();
+  impl->spans.clear();
+  impl->dropped = 0;
+}
+
+String AsyncTracer::toChromeTraceJson() const {
+  Vector<char> out;
+  out.addAll(StringPtr("{\"traceEvents\":["));
+  bool first = true;
+  auto beginEntry = [&]() {
+    if (!first) out.add(',');
+    first = false;
+  };
+
+  auto& events = impl->events;
+  for (auto& event: events) {
+    auto name = typeNameForTrace(event.nodeType == nullptr ? event.eventType : event.nodeType);
+
+    beginEntry();
+    out.addAll(StringPtr("{\"ph\":\"X\",\"cat\":\"event\",\"pid\":1,\"tid\":1,\"name\":"));
+    appendJsonString(out, name);
+    out.addAll(StringPtr(",\"ts\":"));
+    appendMicros(out, event.start - impl->startTime);
+    out.addAll(StringPtr(",\"dur\":"));
+    appendMicros(out, event.end - event.start);
+    out.addAll(kj::str(",\"args\":{\"id\":", event.id, ",\"parent\":", event.parent,
+                       ",\"event\":"));
+    appendJsonString(out, typeNameForTrace(event.eventType));
+    out.addAll(StringPtr("}}"));
+
+    if (event.parent == 0 || event.parent < events[0].id) continue;
+    size_t parentIndex = event.parent - events[0].id;
+    if (parentIndex >= events.size()) continue;
+    auto& parent = events[parentIndex];
+
+    // The flow starts inside the arming event's slice and ends at the start of the armed one.
+    beginEntry();
+    out.addAll(kj::str("{\"ph\":\"s\",\"cat\":\"arm\",\"name\":\"arm\",\"pid\":1,\"tid\":1,"
+                       "\"id\":", event.id, ",\"ts\":"));
+    appendMicros(out, parent.start - impl->startTime);
+    out.add('}');
+    beginEntry();
+    out.addAll(kj::str("{\"ph\":\"f\",\"bp\":\"e\",\"cat\":\"arm\",\"name\":\"arm\",\"pid\":1,"
+                       "\"tid\":1,\"id\":", event.id, ",\"ts\":"));
+    appendMicros(out, event.start - impl->startTime);
+    out.add('}');
+  }
+
+  for (auto& span: impl->spans) {
+    for (auto phase: {'b', 'e'}) {
+      beginEntry();
+      out.addAll(kj::str("{\"ph\":\"", phase, "\",\"pid\":1,\"tid\":1,\"id\":\"span",
+                         span.id, "\",\"cat\":"));
+      appendJsonString(out, span.category);
+      out.addAll(StringPtr(",\"name\":"));
+      appendJsonString(out, span.name);
+      out.addAll(StringPtr(",\"ts\":"));
+      appendMicros(out, (phase == 'b' ? span.start : span.end) - impl->startTime);
+      out.add('}');
+    }
+  }
+
+  out.addAll(StringPtr("]}"));
+  out.add('\0');
+  return String(out.releaseAsArray());
+}
+
+AsyncTracer::Span::Span(uint64_t tracerId, const char* category, String name, TimePoint start)
+    : tracerId(tracerId), category(category), name(kj::mv(name)), start(start) {}
+
+AsyncTracer::Span::Span(Span&& other)
+    : tracerId(other.tracerId), category(other.category), name(kj::mv(other.name)),
+      start(other.start) {
+  other.tracerId = 0;
+}
+
+AsyncTracer::Span& AsyncTracer::Span::operator=(Span&& other) {
+  end();
+  tracerId = other.tracerId;
+  category = other.category;
+  name = kj::mv(other.name);
+  start = other.start;
+  other.tracerId = 0;
+  return *this;
+}
+
+AsyncTracer::Span::~Span() noexcept(false) {
+  end();
+}
+
+void AsyncTracer::Span::end() {
+  if (tracerId == 0) return;
+  uint64_t id = tracerId;
+  tracerId = 0;
+
+  // The tracer may be gone, or this may be a different thread; only record into the tracer that
+  // started the span.
+  KJ_IF_MAYBE(tracer, AsyncTracer::current()) {
+    auto& impl = *tracer->impl;
+    if (impl.id == id && !impl.full()) {
+      impl.spans.add(Impl::SpanRecord {
+          ++impl.spanCount, category, kj::mv(name), start, readLoopClock() });
+    }
+  }
+}
+
+
 }  // namespace kj
@@ -28,6 +28,7 @@
 #include "async-prelude.h"
 #include "exception.h"
 #include "refcount.h"
+#include "time.h"
 
 namespace kj {
 
@@ -43,12 +44,23 @@ class PromiseFulfiller;
 template <typename T>
 struct PromiseFulfillerPair;
 
+template <typename T>
+struct PromiseCrossThreadFulfillerPair;
+
 template <typename Func, typename T>
 using PromiseForResult = Promise<_::JoinPromises<_::ReturnType<Func, T>>>;
 // Evaluates to the type of Promise for the result of calling functor type Func with parameter type
 // T.  If T is void, then the promise is for the result of calling Func with no arguments.  If
 // Func itself returns a promise, the promises are joined, so you never get Promise<Promise<T>>.
 
+enum class EventPriority {
+  // Scheduling classes for an EventLoop's events.  See `Promise::withPriority()`.
+
+  HIGH,
+  NORMAL,
+  LOW
+};
+
 // =======================================================================================
 // Promises
 
@@ -273,6 +285,16 @@ public:
   // pointers into some object and you want to make sure the object still exists when the callback
   // runs -- after calling then(), use attach() to add necessary objects to the result.
 
+  Promise<T> withPriority(EventPriority priority) KJ_WARN_UNUSED_RESULT;
+  // Returns a promise whose dependents are scheduled at the given priority once this one
+  // resolves.  The event loop fires higher-priority events first, except that it gives lower
+  // priorities a turn now and then (see `EventLoop::setStarvationLimit()`).  Events armed by a
+  // callback run at the priority of that callback, so the synchronous chain of continuations
+  // following the result keeps its priority until it has to wait on something else, such as I/O.
+  //
+  // Use HIGH to keep latency-sensitive work (e.g. interactive RPC replies) ahead of bulk
+  // transfers on the same loop, or LOW to push bulk work behind everything else.
+
   template <typename ErrorFunc>
   Promise<T> eagerlyEvaluate(ErrorFunc&& errorHandler) KJ_WARN_UNUSED_RESULT;
   Promise<T> eagerlyEvaluate(decltype(nullptr)) KJ_WARN_UNUSED_RESULT;
@@ -314,14 +336,24 @@ private:
   friend Promise<U> newAdaptedPromise(Params&&... adapterConstructorParams);
   template <typename U>
   friend PromiseFulfillerPair<U> newPromiseAndFulfiller();
+  template <typename U>
+  friend PromiseCrossThreadFulfillerPair<U> newCrossThreadPromiseAndFulfiller();
   template <typename>
   friend class _::ForkHub;
   friend class TaskSet;
+  friend class Executor;
+  friend class ThreadPool;
+  friend class _::XThreadEvent;
   friend Promise<void> _::yield();
   friend class _::NeverDone;
   template <typename U>
   friend Promise<Array<U>> joinPromises(Array<Promise<U>>&& promises);
   friend Promise<void> joinPromises(Array<Promise<void>>&& promises);
+#if KJ_HAS_COROUTINE
+  friend class _::CoroutineBase;
+  template <typename>
+  friend class _::Coroutine;
+#endif
 };
 
 template <typename T>
@@ -500,14 +532,52 @@ PromiseFulfillerPair<T> newPromiseAndFulfiller();
 // fulfiller will be of type `PromiseFulfiller<Promise<U>>`.  Thus you pass a `Promise<U>` to the
 // `fulfill()` callback, and the promises are chained.
 
+template <typename T>
+class CrossThreadPromiseFulfiller {
+  // Like PromiseFulfiller, but may be used (and destroyed) from any thread.  See
+  // newCrossThreadPromiseAndFulfiller().
+
+public:
+  virtual void fulfill(T&& value) const = 0;
+  virtual void reject(Exception&& exception) const = 0;
+  virtual bool isWaiting() const = 0;
+};
+
+template <>
+class CrossThreadPromiseFulfiller<void> {
+public:
+  virtual void fulfill(_::Void&& value = _::Void()) const = 0;
+  virtual void reject(Exception&& exception) const = 0;
+  virtual bool isWaiting() const = 0;
+};
+
+template <typename T>
+struct PromiseCrossThreadFulfillerPair {
+  Promise<T> promise;
+  Own<CrossThreadPromiseFulfiller<T>> fulfiller;
+};
+
+template <typename T>
+PromiseCrossThreadFulfillerPair<T> newCrossThreadPromiseAndFulfiller();
+// Like newPromiseAndFulfiller(), but the fulfiller may be passed to another thread -- one that
+// needn't have an event loop -- and called there.  The promise belongs to the calling thread's
+// event loop, whose `EventPort` must implement `wake()`.  The value is moved to the calling
+// thread.  T may not be a promise type.
+//
+// The fulfiller's isWaiting() becomes false as soon as the promise is dropped, so producers can
+// notice that nobody wants the result any more.
+
 // =======================================================================================
 // TaskSet
 
-class TaskSet {
+class TaskSet: private Disposer {
   // Holds a collection of Promise<void>s and ensures that each executes to completion.  Memory
   // associated with each promise is automatically freed when the promise completes.  Destroying
   // the TaskSet itself automatically cancels all unfinished promises.
   //
+  // Task bookkeeping is allocated from slabs owned by the TaskSet and recycled, so adding and
+  // completing tasks costs no heap allocation once the set has reached its working size.
+  //
   // This is useful for "daemon" objects that perform background tasks which aren't intended to
   // fulfill any particular external promise, but which may need to be canceled (and thus can't
   // use `Promise::detach()`).  The daemon object holds a TaskSet to collect these tasks it is
@@ -534,16 +604,33 @@ public:
   bool isEmpty() { return tasks == nullptr; }
   // Check if any tasks are running.
 
+  size_t size() { return taskCount; }
+  // Number of tasks running.
+
   Promise<void> onEmpty();
   // Returns a promise that fulfills the next time the TaskSet is empty. Only one such promise can
   // exist at a time.
 
+  void clear();
+  // Cancels all running tasks, e.g. for shutdown.  Tasks are canceled one after another without
+  // recursion, so this is fine for very large sets; tasks added by the cancellations themselves
+  // are canceled too.  Fulfills any onEmpty() promise.
+
 private:
   class Task;
+  struct Slab;
 
   TaskSet::ErrorHandler& errorHandler;
   Maybe<Own<Task>> tasks;
   Maybe<Own<PromiseFulfiller<void>>> emptyFulfiller;
+  size_t taskCount = 0;
+
+  Slab* slabs = nullptr;
+  mutable void* freeSlots = nullptr;
+  // Unused Task slots, linked through their first word.
+
+  void* allocateSlot();
+  void disposeImpl(void* pointer) const override;
 };
 
 // =======================================================================================
@@ -601,6 +688,169 @@ public:
   // The default implementation throws an UNIMPLEMENTED exception.
 };
 
+class Executor: public AtomicRefcounted {
+  // Allows other threads to schedule work on an `EventLoop`'s thread.  Obtain one from
+  // `EventLoop::getExecutor()` (or `getCurrentThreadExecutor()`) and pass it -- or a reference
+  // obtained with `addRef()` -- to other threads.
+  //
+  // Requests are queued on a lock-free stack.  Only the thread that finds the stack empty wakes
+  // the target loop, through `EventPort::wake()`, so a burst of requests costs a single wakeup.
+  // The target loop's `EventPort` must therefore implement `wake()`, as `UnixEventPort` does.
+  // The loop picks up queued requests whenever it polls or waits on its `EventPort`, and at the
+  // start of `EventLoop::run()`.
+
+public:
+  template <typename Func>
+  PromiseForResult<Func, void> executeAsync(Func&& func) const;
+  // Call `func()` on the target thread and return a promise, in the calling thread's event loop,
+  // for its result.  If `func()` returns a promise, the returned promise resolves once that
+  // promise does.  The calling thread must have an `EventLoop`.
+  //
+  // `func` is moved to the target thread and destroyed there.  Anything it captures must therefore
+  // be safe to use from that thread.  The result is moved back to the calling thread.
+  //
+  // Dropping the returned promise cancels the call: if `func()` hasn't started yet it never will,
+  // and if it returned a promise, that promise is destroyed on the target thread.  If the target
+  // loop is destroyed before the call completes, the returned promise is rejected with a
+  // DISCONNECTED exception.
+
+  bool isLive() const;
+  // Returns false once the target `EventLoop` has been destroyed.  Calls made after that point
+  // fail with a DISCONNECTED exception.
+
+  Own<const Executor> addRef() const;
+  // Get a new reference to this executor, which remains valid (though possibly not live) even
+  // after the `EventLoop` is destroyed.
+
+private:
+  struct Impl;
+  Own<Impl> impl;
+
+  explicit Executor(EventLoop& loop);
+
+  Own<_::PromiseNode> send(Own<_::XThreadEvent>&& event) const;
+  void push(_::XThreadEvent& event, uint kind) const;
+  void poll() const;
+  void shutdown() const;
+  void drain(bool live) const;
+
+  template <typename T, typename... Params>
+  friend Own<T> atomicRefcounted(Params&&... params);
+  friend class EventLoop;
+  friend class _::XThreadEvent;
+  friend class _::XThreadPromiseNode;
+  friend class _::XThreadExecution;
+};
+
+const Executor& getCurrentThreadExecutor();
+// Get the executor for the current thread's event loop.  Throws if there is none.
+
+class ThreadPool {
+  // A fixed set of worker threads for CPU-bound work -- canonicalization, compression, encoding
+  // and the like -- that would otherwise block an event loop.  Any thread with an `EventLoop` may
+  // call `run()` and gets back a promise in its own loop.
+  //
+  // Each worker has its own queue.  `run()` deals tasks out to the queues in turn, and a worker
+  // whose queue is empty steals from the others before going to sleep, so one long task doesn't
+  // hold up the tasks queued behind it.  Results are delivered through the calling loop's
+  // `Executor`, so its `EventPort` must implement `wake()`.
+
+public:
+  explicit ThreadPool(uint threadCount);
+  KJ_DISALLOW_COPY(ThreadPool);
+
+  ~ThreadPool() noexcept(false);
+  // Waits for the tasks that are running to finish.  Tasks that haven't started yet never will;
+  // their promises are rejected with a DISCONNECTED exception.
+
+  template <typename Func>
+  Promise<_::ReturnType<Func, void>> run(Func&& func) const;
+  // Call `func()` on a worker thread and return a promise, in the calling thread's event loop, for
+  // its result.  Workers have no event loop, so `func()` runs synchronously and must not return a
+  // promise.
+  //
+  // `func` is moved to the worker and destroyed there, and the result is moved back.  Dropping the
+  // returned promise before `func()` has started means it never will; once it has started it runs
+  // to completion and the result is discarded (on the worker thread).
+
+  uint getThreadCount() const;
+
+private:
+  struct Impl;
+  Own<Impl> impl;
+
+  Own<_::PromiseNode> send(Own<_::XThreadEvent>&& event) const;
+};
+
+class AsyncTracer {
+  // Records what an `EventLoop` does -- every event it fires, which event armed it, and any spans
+  // the application marks out -- for viewing as a timeline in chrome://tracing or Perfetto.
+  //
+  // Constructing an `AsyncTracer` installs it on the loop; destroying it uninstalls it.  While
+  // none is installed the loop does no tracing work beyond one branch per event.  Events are
+  // labeled with the type of the promise node they continue, which for `then()` includes the
+  // type of the continuation lambda and so names the function it was written in.
+  //
+  // Must be used only from the loop's own thread.
+
+public:
+  explicit AsyncTracer(EventLoop& loop, size_t maxRecords = 1u << 20);
+  // Records beyond the first `maxRecords` are dropped (and counted), so that a tracer left
+  // installed can't grow without bound.
+
+  ~AsyncTracer() noexcept(false);
+  KJ_DISALLOW_COPY(AsyncTracer);
+
+  class Span {
+    // A named interval, usually attached to a promise with `attach()` so that it ends when the
+    // promise completes or is canceled.  Ending a span after its tracer is gone does nothing.
+
+  public:
+    Span() = default;
+    Span(Span&& other);
+    Span& operator=(Span&& other);
+    ~Span() noexcept(false);
+    KJ_DISALLOW_COPY(Span);
+
+    void end();
+    // End the span now rather than at destruction.
+
+  private:
+    uint64_t tracerId = 0;
+    const char* category = nullptr;
+    String name;
+    TimePoint start = origin<TimePoint>();
+
+    Span(uint64_t tracerId, const char* category, String name, TimePoint start);
+    friend class AsyncTracer;
+  };
+
+  Span startSpan(const char* category, String name);
+  // `category` must be a string literal (or otherwise outlive the tracer).
+
+  static Maybe<AsyncTracer&> current();
+  // The tracer installed on the current thread's event loop, if any.  Instrumented code calls
+  // this and skips its tracing entirely when it returns null.
+
+  size_t getDroppedCount() const;
+
+  void clear();
+  // Discard everything recorded so far.
+
+  String toChromeTraceJson() const;
+  // Everything recorded so far in the Chrome trace event format: events as complete ("X")
+  // slices, arming as flow arrows from the arming event to the armed one, and spans as async
+  // ("b"/"e") slices.  Timestamps count from the tracer's construction.
+
+private:
+  struct Impl;
+  EventLoop& loop;
+  Own<Impl> impl;
+
+  Maybe<Own<_::Event>> fire(_::Event& event);
+  friend class EventLoop;
+};
+
 class EventLoop {
   // Represents a queue of events being executed in a loop.  Most code won't interact with
   // EventLoop directly, but instead use `Promise`s to interact with it indirectly.  See the
@@ -650,6 +900,41 @@ public:
   bool isRunnable();
   // Returns true if run() would currently do anything, or false if the queue is empty.
 
+  const Executor& getExecutor();
+  // Returns an `Executor` which other threads can use to schedule work on this loop.  May only be
+  // called from the loop's own thread.
+
+  void setIoPollLimits(uint maxTurns, Duration maxTime = kj::maxValue);
+  // While inside `wait()` or `WaitScope::poll()`, the loop normally asks the `EventPort` for new
+  // I/O only once the event queue has run dry, so a loop that is never idle never sees new I/O.
+  // With limits set, the loop also does a non-blocking `EventPort::poll()` after firing
+  // `maxTurns` events or spending `maxTime` firing events, whichever comes first.  Smaller limits
+  // favor I/O latency; larger ones favor throughput.  By default there are no limits.
+
+  struct Stats {
+    uint64_t eventsFired = 0;
+    uint64_t ioPolls = 0;
+    // Calls to the `EventPort`'s `wait()` or `poll()`.
+
+    uint64_t forcedIoPolls = 0;
+    // How many of `ioPolls` were made because a limit set with `setIoPollLimits()` was reached.
+
+    size_t queueDepth = 0;
+    size_t maxQueueDepth = 0;
+    // Events currently armed, and the most that have ever been armed at once.
+
+    Duration runTime = 0 * NANOSECONDS;
+    Duration ioTime = 0 * NANOSECONDS;
+    // Time spent firing events vs. inside the `EventPort`'s `wait()` or `poll()`, while the loop
+    // was running (i.e. inside `run()`, `wait()` or `WaitScope::poll()`).
+  };
+
+  const Stats& getStats() const { return stats; }
+
+  void setStarvationLimit(uint turns);
+  // A queued event of lower priority is fired after at most this many turns have gone to
+  // higher-priority events (default 64).
+
 private:
   EventPort& port;
 
@@ -659,13 +944,52 @@ private:
   bool lastRunnableState = false;
   // What did we last pass to port.setRunnable()?
 
-  _::Event* head = nullptr;
-  _::Event** tail = &head;
-  _::Event** depthFirstInsertPoint = &head;
+  struct EventQueue {
+    _::Event* head = nullptr;
+    _::Event** tail = &head;
+    _::Event** depthFirstInsertPoint = &head;
+
+    uint skippedTurns = 0;
+    // Turns given to higher-priority events while this queue was non-empty.
+  };
+
+  static constexpr uint PRIORITY_COUNT = 3;
+  EventQueue queues[PRIORITY_COUNT];
+  // Indexed by EventPriority.
+
+  EventPriority currentPriority = EventPriority::NORMAL;
+  // Priority of the event currently firing (NORMAL when none is), inherited by the events it arms.
+
+  uint starvationLimit = 64;
 
   Own<TaskSet> daemons;
 
+  Maybe<Own<Executor>> executor;
+  // Created on first call to getExecutor().
+
+  uint maxTurnsBetweenIoPolls = kj::maxValue;
+  Duration maxTimeBetweenIoPolls = kj::maxValue;
+  uint turnsSinceIoPoll = 0;
+  TimePoint lastIoPoll = origin<TimePoint>();
+  // Time the loop started running or last returned from the EventPort.
+
+  Stats stats;
+
+  AsyncTracer* tracer = nullptr;
+  uint32_t currentTraceId = 0;
+  // The installed tracer, if any, and its ID for the event currently firing (0 when none is).
+
   bool turn();
+  EventQueue* chooseQueue();
+  void pollExecutor();
+  void startRunning();
+  void stopRunning();
+  bool ioPollDue();
+  void waitForIo(bool block);
+
+  inline void noteArmed() {
+    if (++stats.queueDepth > stats.maxQueueDepth) stats.maxQueueDepth = stats.queueDepth;
+  }
   void setRunnable(bool runnable);
   void enterScope();
   void leaveScope();
@@ -676,6 +1000,8 @@ private:
   friend bool _::pollImpl(_::PromiseNode& node, WaitScope& waitScope);
   friend class _::Event;
   friend class WaitScope;
+  friend class Executor;
+  friend class AsyncTracer;
 };
 
 class WaitScope {
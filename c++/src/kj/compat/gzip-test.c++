@@ -187,6 +187,136 @@ KJ_TEST("gzip huge round trip") {
   KJ_ASSERT(memcmp(bytes.begin(), decompressed.begin(), bytes.size()) == 0);
 }
 
+KJ_TEST("gzip compression level and strategy") {
+  auto io = setupAsyncIo();
+
+  kj::Vector<byte> text;
+  for (uint i = 0; i < 1000; i++) {
+    text.addAll(kj::str("line ", i % 17, " of some repetitive text\n").asBytes());
+  }
+
+  MockOutputStream bestOutput;
+  {
+    GzipAsyncOutputStream gzip(bestOutput, Z_BEST_COMPRESSION);
+    gzip.write(text.begin(), text.size()).wait(io.waitScope);
+    gzip.end().wait(io.waitScope);
+  }
+
+  MockOutputStream huffmanOutput;
+  {
+    GzipAsyncOutputStream gzip(huffmanOutput, Z_BEST_SPEED, Z_HUFFMAN_ONLY);
+    gzip.write(text.begin(), text.size()).wait(io.waitScope);
+    gzip.end().wait(io.waitScope);
+  }
+
+  auto expected = kj::heapString(text.asPtr().asChars());
+  KJ_EXPECT(bestOutput.decompress(io.waitScope) == expected);
+  KJ_EXPECT(huffmanOutput.decompress(io.waitScope) == expected);
+
+  // Huffman-only coding can't exploit the repetition.
+  KJ_EXPECT(bestOutput.bytes.size() * 4 < huffmanOutput.bytes.size(),
+            bestOutput.bytes.size(), huffmanOutput.bytes.size());
+}
+
+KJ_TEST("gzip flush") {
+  auto io = setupAsyncIo();
+
+  MockOutputStream rawOutput;
+  GzipAsyncOutputStream gzip(rawOutput);
+  gzip.write("foo", 3).wait(io.waitScope);
+  gzip.flush().wait(io.waitScope);
+  gzip.flush().wait(io.waitScope);  // nothing new: no-op
+
+  // Everything written so far can be decompressed before the stream ends.
+  {
+    MockInputStream rawInput(rawOutput.bytes, kj::maxValue);
+    GzipAsyncInputStream gunzip(rawInput);
+    char text[16];
+    size_t n = gunzip.tryRead(text, 3, sizeof(text)).wait(io.waitScope);
+    text[n] = '\0';
+    KJ_EXPECT(StringPtr(text, n) == "foo");
+  }
+
+  gzip.write("bar", 3).wait(io.waitScope);
+  gzip.end().wait(io.waitScope);
+
+  KJ_EXPECT(rawOutput.decompress(io.waitScope) == "foobar");
+}
+
+KJ_TEST("gzip state pool") {
+  auto io = setupAsyncIo();
+
+  GzipStatePool pool(Z_BEST_SPEED, Z_DEFAULT_STRATEGY, 1);
+
+  for (auto text: { "foobar"_kj, "bazqux"_kj }) {
+    MockOutputStream rawOutput;
+    {
+      GzipAsyncOutputStream gzip(rawOutput, pool);
+      KJ_EXPECT(pool.idleDeflaters() == 0);
+      gzip.write(text.begin(), text.size()).wait(io.waitScope);
+      gzip.end().wait(io.waitScope);
+    }
+    KJ_EXPECT(pool.idleDeflaters() == 1);
+
+    {
+      MockInputStream rawInput(rawOutput.bytes, kj::maxValue);
+      GzipAsyncInputStream gunzip(rawInput, pool);
+      KJ_EXPECT(gunzip.readAllText().wait(io.waitScope) == text);
+    }
+    KJ_EXPECT(pool.idleInflaters() == 1);
+  }
+
+  // A state abandoned mid-stream is reset before reuse.
+  {
+    MockOutputStream rawOutput;
+    GzipAsyncOutputStream gzip(rawOutput, pool);
+    gzip.write("abandoned", 9).wait(io.waitScope);
+  }
+  {
+    MockOutputStream rawOutput;
+    {
+      GzipAsyncOutputStream gzip(rawOutput, pool);
+      gzip.write("fresh", 5).wait(io.waitScope);
+      gzip.end().wait(io.waitScope);
+    }
+    KJ_EXPECT(rawOutput.decompress(io.waitScope) == "fresh");
+  }
+
+  // Beyond `maxIdle`, returned states are freed.
+  {
+    MockOutputStream rawOutput1, rawOutput2;
+    GzipAsyncOutputStream gzip1(rawOutput1, pool);
+    GzipAsyncOutputStream gzip2(rawOutput2, pool);
+  }
+  KJ_EXPECT(pool.idleDeflaters() == 1);
+}
+
+KJ_TEST("gzip one-shot compression") {
+  auto io = setupAsyncIo();
+
+  auto bytes = heapArray<byte>(65536);
+  for (auto i: kj::indices(bytes)) {
+    bytes[i] = i % 7 == 0 ? rand() : i % 13;
+  }
+
+  for (int level: { Z_DEFAULT_COMPRESSION, Z_BEST_SPEED, Z_BEST_COMPRESSION }) {
+    auto compressed = gzipCompress(bytes, level);
+    KJ_EXPECT(compressed.size() < bytes.size());
+
+    MockInputStream rawInput(compressed, kj::maxValue);
+    GzipAsyncInputStream gunzip(rawInput);
+    auto decompressed = gunzip.readAllBytes().wait(io.waitScope);
+    KJ_ASSERT(decompressed == bytes);
+  }
+
+  {
+    auto compressed = gzipCompress(nullptr);
+    MockInputStream rawInput(compressed, kj::maxValue);
+    GzipAsyncInputStream gunzip(rawInput);
+    KJ_EXPECT(gunzip.readAllText().wait(io.waitScope) == "");
+  }
+}
+
 }  // namespace
 }  // namespace kj
 
@@ -24,22 +24,119 @@
 #include "gzip.h"
 #include <kj/debug.h>
 
+#if KJ_HAS_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
 namespace kj {
 
-GzipAsyncInputStream::GzipAsyncInputStream(AsyncInputStream& inner)
-    : inner(inner) {
-  memset(&ctx, 0, sizeof(ctx));
-  ctx.next_in = nullptr;
-  ctx.avail_in = 0;
-  ctx.next_out = nullptr;
-  ctx.avail_out = 0;
+namespace {
+
+class DeflaterDisposer final: public Disposer {
+public:
+  static const DeflaterDisposer instance;
+
+protected:
+  void disposeImpl(void* pointer) const override {
+    auto ctx = reinterpret_cast<z_stream*>(pointer);
+    deflateEnd(ctx);
+    delete ctx;
+  }
+};
+const DeflaterDisposer DeflaterDisposer::instance = DeflaterDisposer();
+
+class InflaterDisposer final: public Disposer {
+public:
+  static const InflaterDisposer instance;
+
+protected:
+  void disposeImpl(void* pointer) const override {
+    auto ctx = reinterpret_cast<z_stream*>(pointer);
+    inflateEnd(ctx);
+    delete ctx;
+  }
+};
+const InflaterDisposer InflaterDisposer::instance = InflaterDisposer();
+
+// zlib's state points back at its z_stream, so z_streams live on the heap where they won't move
+// while being handed between streams and pools.
+
+kj::Own<z_stream> newDeflater(int compressionLevel, int strategy) {
+  auto ctx = new z_stream;
+  memset(ctx, 0, sizeof(*ctx));
+
+  int initResult =
+      deflateInit2(ctx, kj::min(compressionLevel, 9), Z_DEFLATED,
+                   15 + 16,  // windowBits = 15 (maximum) + magic value 16 to ask for gzip.
+                   8,        // memLevel = 8 (the default)
+                   strategy);
+  if (initResult != Z_OK) {
+    delete ctx;
+    KJ_FAIL_ASSERT("deflateInit2() failed", initResult);
+  }
+  return kj::Own<z_stream>(ctx, DeflaterDisposer::instance);
+}
+
+kj::Own<z_stream> newInflater() {
+  auto ctx = new z_stream;
+  memset(ctx, 0, sizeof(*ctx));
 
   // windowBits = 15 (maximum) + magic value 16 to ask for gzip.
-  KJ_ASSERT(inflateInit2(&ctx, 15 + 16) == Z_OK);
+  int initResult = inflateInit2(ctx, 15 + 16);
+  if (initResult != Z_OK) {
+    delete ctx;
+    KJ_FAIL_ASSERT("inflateInit2() failed", initResult);
+  }
+  return kj::Own<z_stream>(ctx, InflaterDisposer::instance);
 }
 
+}  // namespace
+
+// =======================================================================================
+
+GzipStatePool::GzipStatePool(int compressionLevel, int strategy, uint maxIdle)
+    : compressionLevel(compressionLevel), strategy(strategy), maxIdle(maxIdle) {}
+GzipStatePool::~GzipStatePool() noexcept(false) {}
+
+kj::Own<z_stream> GzipStatePool::takeDeflater() {
+  if (deflaters.empty()) return newDeflater(compressionLevel, strategy);
+  auto result = kj::mv(deflaters.back());
+  deflaters.removeLast();
+  return result;
+}
+
+kj::Own<z_stream> GzipStatePool::takeInflater() {
+  if (inflaters.empty()) return newInflater();
+  auto result = kj::mv(inflaters.back());
+  inflaters.removeLast();
+  return result;
+}
+
+void GzipStatePool::releaseDeflater(kj::Own<z_stream> deflater) {
+  // deflateReset() keeps the level and strategy, and the allocations, which is the point.
+  if (deflaters.size() < maxIdle && deflateReset(deflater) == Z_OK) {
+    deflaters.add(kj::mv(deflater));
+  }
+}
+
+void GzipStatePool::releaseInflater(kj::Own<z_stream> inflater) {
+  if (inflaters.size() < maxIdle && inflateReset(inflater) == Z_OK) {
+    inflaters.add(kj::mv(inflater));
+  }
+}
+
+// =======================================================================================
+
+GzipAsyncInputStream::GzipAsyncInputStream(AsyncInputStream& inner)
+    : inner(inner), ctx(newInflater()) {}
+
+GzipAsyncInputStream::GzipAsyncInputStream(AsyncInputStream& inner, GzipStatePool& pool)
+    : inner(inner), pool(pool), ctx(pool.takeInflater()) {}
+
 GzipAsyncInputStream::~GzipAsyncInputStream() noexcept(false) {
-  inflateEnd(&ctx);
+  KJ_IF_MAYBE(p, pool) {
+    p->releaseInflater(kj::mv(ctx));
+  }
 }
 
 Promise<size_t> GzipAsyncInputStream::tryRead(void* out, size_t minBytes, size_t maxBytes) {
@@ -50,72 +147,65 @@ Promise<size_t> GzipAsyncInputStream::tryRead(void* out, size_t minBytes, size_t
 
 Promise<size_t> GzipAsyncInputStream::readImpl(
     byte* out, size_t minBytes, size_t maxBytes, size_t alreadyRead) {
-  if (ctx.avail_in == 0) {
+  if (ctx->avail_in == 0) {
     return inner.tryRead(buffer, 1, sizeof(buffer))
         .then([this,out,minBytes,maxBytes,alreadyRead](size_t amount) -> Promise<size_t> {
       if (amount == 0) {
         KJ_REQUIRE(atValidEndpoint, "gzip compressed stream ended prematurely");
         return alreadyRead;
       } else {
-        ctx.next_in = buffer;
-        ctx.avail_in = amount;
+        ctx->next_in = buffer;
+        ctx->avail_in = amount;
         return readImpl(out, minBytes, maxBytes, alreadyRead);
       }
     });
   }
 
-  ctx.next_out = reinterpret_cast<byte*>(out);
-  ctx.avail_out = maxBytes;
+  ctx->next_out = reinterpret_cast<byte*>(out);
+  ctx->avail_out = maxBytes;
 
-  auto inflateResult = inflate(&ctx, Z_NO_FLUSH);
+  auto inflateResult = inflate(ctx, Z_NO_FLUSH);
   atValidEndpoint = inflateResult == Z_STREAM_END;
   if (inflateResult == Z_OK || inflateResult == Z_STREAM_END) {
-    if (atValidEndpoint && ctx.avail_in > 0) {
+    if (atValidEndpoint && ctx->avail_in > 0) {
       // There's more data available. Assume start of new content.
-      KJ_ASSERT(inflateReset(&ctx) == Z_OK);
+      KJ_ASSERT(inflateReset(ctx) == Z_OK);
     }
 
-    size_t n = maxBytes - ctx.avail_out;
+    size_t n = maxBytes - ctx->avail_out;
     if (n >= minBytes) {
       return n + alreadyRead;
     } else {
       return readImpl(out + n, minBytes - n, maxBytes - n, alreadyRead + n);
     }
   } else {
-    if (ctx.msg == nullptr) {
+    if (ctx->msg == nullptr) {
       KJ_FAIL_REQUIRE("gzip decompression failed", inflateResult);
     } else {
-      KJ_FAIL_REQUIRE("gzip decompression failed", ctx.msg);
+      KJ_FAIL_REQUIRE("gzip decompression failed", ctx->msg);
     }
   }
 }
 
 // =======================================================================================
 
-GzipAsyncOutputStream::GzipAsyncOutputStream(AsyncOutputStream& inner, int compressionLevel)
-    : inner(inner) {
-  memset(&ctx, 0, sizeof(ctx));
-  ctx.next_in = nullptr;
-  ctx.avail_in = 0;
-  ctx.next_out = nullptr;
-  ctx.avail_out = 0;
+GzipAsyncOutputStream::GzipAsyncOutputStream(
+    AsyncOutputStream& inner, int compressionLevel, int strategy)
+    : inner(inner), ctx(newDeflater(compressionLevel, strategy)) {}
 
-  int initResult =
-      deflateInit2(&ctx, compressionLevel, Z_DEFLATED,
-                   15 + 16,  // windowBits = 15 (maximum) + magic value 16 to ask for gzip.
-                   8,        // memLevel = 8 (the default)
-                   Z_DEFAULT_STRATEGY);
-  KJ_ASSERT(initResult == Z_OK, initResult);
-}
+GzipAsyncOutputStream::GzipAsyncOutputStream(AsyncOutputStream& inner, GzipStatePool& pool)
+    : inner(inner), pool(pool), ctx(pool.takeDeflater()) {}
 
 GzipAsyncOutputStream::~GzipAsyncOutputStream() noexcept(false) {
-  deflateEnd(&ctx);
+  KJ_IF_MAYBE(p, pool) {
+    p->releaseDeflater(kj::mv(ctx));
+  }
 }
 
 Promise<void> GzipAsyncOutputStream::write(const void* in, size_t size) {
-  ctx.next_in = const_cast<byte*>(reinterpret_cast<const byte*>(in));
-  ctx.avail_in = size;
-  return pump();
+  ctx->next_in = const_cast<byte*>(reinterpret_cast<const byte*>(in));
+  ctx->avail_in = size;
+  return pump(Z_NO_FLUSH);
 }
 
 Promise<void> GzipAsyncOutputStream::write(ArrayPtr<const ArrayPtr<const byte>> pieces) {
@@ -128,15 +218,21 @@ Promise<void> GzipAsyncOutputStream::write(ArrayPtr<const ArrayPtr<const byte>>
   });
 }
 
+Promise<void> GzipAsyncOutputStream::flush() {
+  KJ_REQUIRE(!ended, "already ended");
+
+  return pump(Z_SYNC_FLUSH);
+}
+
 Promise<void> GzipAsyncOutputStream::end() {
   KJ_REQUIRE(!ended, "already ended");
 
-  ctx.next_out = buffer;
-  ctx.avail_out = sizeof(buffer);
+  ctx->next_out = buffer;
+  ctx->avail_out = sizeof(buffer);
 
-  auto deflateResult = deflate(&ctx, Z_FINISH);
+  auto deflateResult = deflate(ctx, Z_FINISH);
   if (deflateResult == Z_OK || deflateResult == Z_STREAM_END) {
-    size_t n = sizeof(buffer) - ctx.avail_out;
+    size_t n = sizeof(buffer) - ctx->avail_out;
     auto promise = inner.write(buffer, n);
     if (deflateResult == Z_OK) {
       return promise.then([this]() { return end(); });
@@ -145,36 +241,81 @@ Promise<void> GzipAsyncOutputStream::end() {
       return promise;
     }
   } else {
-    if (ctx.msg == nullptr) {
+    if (ctx->msg == nullptr) {
       KJ_FAIL_REQUIRE("gzip compression failed", deflateResult);
     } else {
-      KJ_FAIL_REQUIRE("gzip compression failed", ctx.msg);
+      KJ_FAIL_REQUIRE("gzip compression failed", ctx->msg);
     }
   }
 }
 
-kj::Promise<void> GzipAsyncOutputStream::pump() {
-  if (ctx.avail_in == 0) {
+kj::Promise<void> GzipAsyncOutputStream::pump(int flush) {
+  if (flush == Z_NO_FLUSH && ctx->avail_in == 0) {
     return kj::READY_NOW;
   }
 
-  ctx.next_out = buffer;
-  ctx.avail_out = sizeof(buffer);
+  ctx->next_out = buffer;
+  ctx->avail_out = sizeof(buffer);
+
+  auto deflateResult = deflate(ctx, flush);
+  if (deflateResult == Z_BUF_ERROR && flush == Z_SYNC_FLUSH) {
+    // No progress possible: the previous flush already emitted everything.
+    return kj::READY_NOW;
+  } else if (deflateResult == Z_OK) {
+    size_t n = sizeof(buffer) - ctx->avail_out;
+    // With Z_SYNC_FLUSH, leftover output space means deflate() has emitted everything.
+    bool done = flush == Z_SYNC_FLUSH && ctx->avail_out > 0;
 
-  auto deflateResult = deflate(&ctx, Z_NO_FLUSH);
-  if (deflateResult == Z_OK) {
-    size_t n = sizeof(buffer) - ctx.avail_out;
-    return inner.write(buffer, n)
-        .then([this]() { return pump(); });
+    if (n == 0) {
+      // deflate() buffered all the input internally; nothing to write yet.
+      return done ? kj::Promise<void>(kj::READY_NOW) : pump(flush);
+    } else if (done) {
+      return inner.write(buffer, n);
+    } else {
+      return inner.write(buffer, n)
+          .then([this,flush]() { return pump(flush); });
+    }
   } else {
-    if (ctx.msg == nullptr) {
+    if (ctx->msg == nullptr) {
       KJ_FAIL_REQUIRE("gzip compression failed", deflateResult);
     } else {
-      KJ_FAIL_REQUIRE("gzip compression failed", ctx.msg);
+      KJ_FAIL_REQUIRE("gzip compression failed", ctx->msg);
     }
   }
 }
 
+// =======================================================================================
+
+kj::Array<byte> gzipCompress(kj::ArrayPtr<const byte> data, int compressionLevel) {
+#if KJ_HAS_LIBDEFLATE
+  // libdeflate's default level, like zlib's, is 6.
+  auto compressor = libdeflate_alloc_compressor(
+      compressionLevel == Z_DEFAULT_COMPRESSION ? 6 : compressionLevel);
+  KJ_ASSERT(compressor != nullptr, "invalid compression level", compressionLevel);
+  KJ_DEFER(libdeflate_free_compressor(compressor));
+
+  auto result = kj::heapArray<byte>(libdeflate_gzip_compress_bound(compressor, data.size()));
+  size_t n = libdeflate_gzip_compress(
+      compressor, data.begin(), data.size(), result.begin(), result.size());
+  KJ_ASSERT(n > 0, "libdeflate_gzip_compress() failed");
+#else
+  auto ctx = newDeflater(compressionLevel, Z_DEFAULT_STRATEGY);
+
+  // With room for the worst case, a single Z_FINISH call does all the work.
+  auto result = kj::heapArray<byte>(deflateBound(ctx, data.size()));
+  ctx->next_in = const_cast<byte*>(data.begin());
+  ctx->avail_in = data.size();
+  ctx->next_out = result.begin();
+  ctx->avail_out = result.size();
+
+  auto deflateResult = deflate(ctx, Z_FINISH);
+  KJ_ASSERT(deflateResult == Z_STREAM_END, "gzip compression failed", deflateResult);
+  size_t n = result.size() - ctx->avail_out;
+#endif
+
+  return n == result.size() ? kj::mv(result) : kj::heapArray(result.slice(0, n));
+}
+
 }  // namespace kj
 
 #endif  // KJ_HAS_ZLIB
@@ -22,13 +22,51 @@
 #pragma once
 
 #include <kj/async-io.h>
+#include <kj/vector.h>
 #include <zlib.h>
 
 namespace kj {
 
+class GzipStatePool {
+  // Keeps the zlib state of finished gzip streams so that new streams can reset and reuse it
+  // rather than allocating and initializing a fresh one, which for a compressor means a few
+  // hundred kilobytes of window and hash tables per stream. Useful when compressing or
+  // decompressing many short HTTP bodies.
+  //
+  // All compressors from one pool use the same level and strategy. A pool is not thread-safe, and
+  // must outlive every stream created with it.
+
+public:
+  explicit GzipStatePool(int compressionLevel = Z_DEFAULT_COMPRESSION,
+                         int strategy = Z_DEFAULT_STRATEGY, uint maxIdle = 16);
+  // At most `maxIdle` states of each kind are kept; beyond that, returned states are freed.
+
+  ~GzipStatePool() noexcept(false);
+  KJ_DISALLOW_COPY(GzipStatePool);
+
+  inline size_t idleDeflaters() const { return deflaters.size(); }
+  inline size_t idleInflaters() const { return inflaters.size(); }
+
+private:
+  int compressionLevel;
+  int strategy;
+  uint maxIdle;
+  kj::Vector<kj::Own<z_stream>> deflaters;
+  kj::Vector<kj::Own<z_stream>> inflaters;
+
+  kj::Own<z_stream> takeDeflater();
+  kj::Own<z_stream> takeInflater();
+  void releaseDeflater(kj::Own<z_stream> deflater);
+  void releaseInflater(kj::Own<z_stream> inflater);
+
+  friend class GzipAsyncInputStream;
+  friend class GzipAsyncOutputStream;
+};
+
 class GzipAsyncInputStream final: public AsyncInputStream {
 public:
   GzipAsyncInputStream(AsyncInputStream& inner);
+  GzipAsyncInputStream(AsyncInputStream& inner, GzipStatePool& pool);
   ~GzipAsyncInputStream() noexcept(false);
   KJ_DISALLOW_COPY(GzipAsyncInputStream);
 
@@ -36,7 +74,8 @@ public:
 
 private:
   AsyncInputStream& inner;
-  z_stream ctx;
+  kj::Maybe<GzipStatePool&> pool;
+  kj::Own<z_stream> ctx;
   bool atValidEndpoint = false;
 
   byte buffer[4096];
@@ -46,13 +85,27 @@ private:
 
 class GzipAsyncOutputStream final: public AsyncOutputStream {
 public:
-  GzipAsyncOutputStream(AsyncOutputStream& inner, int compressionLevel = Z_DEFAULT_COMPRESSION);
+  GzipAsyncOutputStream(AsyncOutputStream& inner, int compressionLevel = Z_DEFAULT_COMPRESSION,
+                        int strategy = Z_DEFAULT_STRATEGY);
+  // `compressionLevel` and `strategy` are as for zlib's deflateInit2(). Z_FILTERED or Z_RLE can
+  // be worthwhile for data that's mostly small numbers or long runs, and Z_BEST_SPEED for
+  // on-the-fly compression of dynamic responses.
+
+  GzipAsyncOutputStream(AsyncOutputStream& inner, GzipStatePool& pool);
+  // Uses a compressor from `pool`, with the pool's level and strategy.
+
   ~GzipAsyncOutputStream() noexcept(false);
   KJ_DISALLOW_COPY(GzipAsyncOutputStream);
 
   Promise<void> write(const void* buffer, size_t size) override;
   Promise<void> write(ArrayPtr<const ArrayPtr<const byte>> pieces) override;
 
+  Promise<void> flush();
+  // Writes out everything written so far, padded to a byte boundary, so the receiver can
+  // decompress all of it without waiting for more. Each flush costs a few bytes and resets some
+  // compression state, so use it at message boundaries of latency-sensitive streams (e.g.
+  // server-sent events) rather than after every write.
+
   Promise<void> end();
   // Must call to flush the stream, since some data may be buffered.
   //
@@ -60,12 +113,20 @@ public:
 
 private:
   AsyncOutputStream& inner;
+  kj::Maybe<GzipStatePool&> pool;
   bool ended = false;
-  z_stream ctx;
+  kj::Own<z_stream> ctx;
 
   byte buffer[4096];
 
-  kj::Promise<void> pump();
+  kj::Promise<void> pump(int flush);
 };
 
+kj::Array<byte> gzipCompress(kj::ArrayPtr<const byte> data,
+                             int compressionLevel = Z_DEFAULT_COMPRESSION);
+// Compresses a complete, already-buffered body into gzip format in one call. This avoids the
+// per-write overhead of GzipAsyncOutputStream, and if built with libdeflate (KJ_HAS_LIBDEFLATE)
+// it uses that, which is typically 2-3x faster than zlib. Levels above 9 are only meaningful with
+// libdeflate (which goes up to 12); zlib treats them as 9.
+
 }  // namespace kj
@@ -25,6 +25,7 @@
 #include <kj/debug.h>
 #include <kj/test.h>
 #include <map>
+#include <algorithm>
 
 namespace kj {
 namespace {
@@ -93,6 +94,35 @@ KJ_TEST("HttpHeaderTable") {
   KJ_EXPECT(table->stringToId("barfoo") == nullptr);
 }
 
+KJ_TEST("HttpHeaderTable many headers") {
+  HttpHeaderTable::Builder builder;
+
+  kj::Vector<kj::String> names;
+  kj::Vector<HttpHeaderId> ids;
+  for (uint i = 0; i < 500; i++) {
+    names.add(kj::str("X-Custom-", i, "-Header"));
+    ids.add(builder.add(names.back()));
+  }
+
+  auto table = builder.build();
+
+  for (auto i: kj::indices(names)) {
+    KJ_EXPECT(KJ_ASSERT_NONNULL(table->stringToId(names[i])) == ids[i]);
+
+    auto upper = kj::heapString(names[i]);
+    for (char& c: upper) {
+      if ('a' <= c && c <= 'z') c -= 'a' - 'A';
+    }
+    KJ_EXPECT(KJ_ASSERT_NONNULL(table->stringToId(upper)) == ids[i]);
+  }
+
+  KJ_EXPECT(KJ_ASSERT_NONNULL(table->stringToId("content-length")) ==
+            HttpHeaderId::CONTENT_LENGTH);
+  KJ_EXPECT(table->stringToId("X-Custom-500-Header") == nullptr);
+  KJ_EXPECT(table->stringToId("X-Custom-1-Heade") == nullptr);
+  KJ_EXPECT(table->stringToId("") == nullptr);
+}
+
 KJ_TEST("HttpHeaders::parseRequest") {
   HttpHeaderTable::Builder builder;
 
@@ -194,6 +224,34 @@ KJ_TEST("HttpHeaders::parseResponse") {
       "\r\n");
 }
 
+KJ_TEST("HttpHeaders parse long lines") {
+  // Exercise line scanning across 16-byte boundaries.
+
+  HttpHeaderTable::Builder builder;
+  auto userAgent = builder.add("User-Agent");
+  auto accept = builder.add("Accept");
+  auto table = builder.build();
+
+  HttpHeaders headers(*table);
+  auto text = kj::heapString(
+      "GET /a/rather/long/path/which/spans/more/than/one/block HTTP/1.1\r\n"
+      "Host: a-very-long-host-name.subdomain.example.com\r\n"
+      "User-Agent: Some Browser/1.0 (with a long comment;\r\n"
+      "\t which continues on another line)\n"
+      "Accept: 0123456789abcdef0123456789abcdef\n"
+      "\r\n");
+  auto result = KJ_ASSERT_NONNULL(headers.tryParseRequest(text.asArray()));
+
+  KJ_EXPECT(result.method == HttpMethod::GET);
+  KJ_EXPECT(result.url == "/a/rather/long/path/which/spans/more/than/one/block");
+  KJ_EXPECT(KJ_ASSERT_NONNULL(headers.get(HttpHeaderId::HOST)) ==
+            "a-very-long-host-name.subdomain.example.com");
+  KJ_EXPECT(KJ_ASSERT_NONNULL(headers.get(userAgent)) ==
+            "Some Browser/1.0 (with a long comment;  \t which continues on another line)");
+  KJ_EXPECT(KJ_ASSERT_NONNULL(headers.get(accept)) ==
+            "0123456789abcdef0123456789abcdef");
+}
+
 KJ_TEST("HttpHeaders parse invalid") {
   auto table = HttpHeaderTable::Builder().build();
   HttpHeaders headers(*table);
@@ -258,6 +316,41 @@ KJ_TEST("HttpHeaders validation") {
   KJ_EXPECT_THROW_MESSAGE("invalid header value", headers.add("Valid-Name", "in\nvalid"));
 }
 
+KJ_TEST("HttpHeaders clone and clear") {
+  HttpHeaderTable::Builder builder;
+  auto fooId = builder.add("Foo");
+  auto table = builder.build();
+
+  kj::Maybe<HttpHeaders> clone;
+  {
+    HttpHeaders headers(*table);
+    headers.set(HttpHeaderId::HOST, kj::str("example.com"));
+    headers.add("Foo", kj::str("1"));
+    headers.add("Foo", kj::str("2"));
+    headers.add(kj::str("Bar"), kj::str("baz"));
+    headers.add("Empty", "");
+    clone = headers.clone();
+
+    headers.clear();
+    KJ_EXPECT(headers.get(fooId) == nullptr);
+    KJ_EXPECT(headers.get(HttpHeaderId::HOST) == nullptr);
+    KJ_EXPECT(headers.toString() == "\r\n");
+
+    headers.add("Foo", "3");
+    KJ_EXPECT(KJ_ASSERT_NONNULL(headers.get(fooId)) == "3");
+  }
+
+  // The clone outlives the original and everything it owned.
+  auto& copy = KJ_ASSERT_NONNULL(clone);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(copy.get(HttpHeaderId::HOST)) == "example.com");
+  KJ_EXPECT(KJ_ASSERT_NONNULL(copy.get(fooId)) == "1, 2");
+  KJ_EXPECT(copy.toString() == "Host: example.com\r\nFoo: 1, 2\r\nBar: baz\r\nEmpty: \r\n\r\n",
+            copy.toString());
+
+  // Cloning empty headers works too.
+  KJ_EXPECT(HttpHeaders(*table).clone().toString() == "\r\n");
+}
+
 // =======================================================================================
 
 class ReadFragmenter final: public kj::AsyncIoStream {
@@ -1962,6 +2055,216 @@ KJ_TEST("HttpServer WebSocket handshake error") {
   listenTask.wait(io.waitScope);
 }
 
+#if KJ_HAS_ZLIB
+
+KJ_TEST("WebSocket compression") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  WebSocketCompressionParameters params;
+  auto client = newWebSocket(kj::mv(pipe.ends[0]), nullptr, params);
+  auto server = newWebSocket(kj::mv(pipe.ends[1]), nullptr, params);
+
+  auto bigString = kj::strArray(kj::repeat(kj::StringPtr("123456789"), 10000), "");
+
+  // Send each message twice so that the second copy is compressed against the first.
+  auto clientTask = client->send(bigString)
+      .then([&]() { return client->send(bigString); })
+      .then([&]() { return client->send(kj::StringPtr("world").asBytes()); })
+      .then([&]() { return client->send(kj::StringPtr("")); })
+      .then([&]() { return client->close(1234, "bored"); });
+
+  for (auto i KJ_UNUSED: kj::range(0, 2)) {
+    auto message = server->receive().wait(io.waitScope);
+    KJ_ASSERT(message.is<kj::String>());
+    KJ_EXPECT(message.get<kj::String>() == bigString);
+  }
+
+  {
+    auto message = server->receive().wait(io.waitScope);
+    KJ_ASSERT(message.is<kj::Array<byte>>());
+    KJ_EXPECT(kj::str(message.get<kj::Array<byte>>().asChars()) == "world");
+  }
+
+  {
+    auto message = server->receive().wait(io.waitScope);
+    KJ_ASSERT(message.is<kj::String>());
+    KJ_EXPECT(message.get<kj::String>() == "");
+  }
+
+  {
+    auto message = server->receive().wait(io.waitScope);
+    KJ_ASSERT(message.is<WebSocket::Close>());
+    KJ_EXPECT(message.get<WebSocket::Close>().code == 1234);
+    KJ_EXPECT(message.get<WebSocket::Close>().reason == "bored");
+  }
+
+  clientTask.wait(io.waitScope);
+}
+
+KJ_TEST("WebSocket compression wire format") {
+  // Examples from RFC 7692 section 7.2.3.
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  WebSocketCompressionParameters params;
+  auto client = kj::mv(pipe.ends[0]);
+  auto server = newWebSocket(kj::mv(pipe.ends[1]), nullptr, params);
+
+  byte DATA[] = {
+    // "Hello", compressed.
+    0xc1, 0x07, 0xf2, 0x48, 0xcd, 0xc9, 0xc9, 0x07, 0x00,
+
+    // "Hello" again, referencing the previous message's window.
+    0xc1, 0x05, 0xf2, 0x00, 0x11, 0x00, 0x00,
+
+    // "Hello", compressed and then fragmented.
+    0x41, 0x03, 0xf2, 0x48, 0xcd,
+    0x80, 0x04, 0xc9, 0xc9, 0x07, 0x00,
+
+    // "Hello", uncompressed.
+    0x81, 0x05, 'H', 'e', 'l', 'l', 'o',
+  };
+
+  auto clientTask = client->write(DATA, sizeof(DATA));
+
+  for (auto i KJ_UNUSED: kj::range(0, 4)) {
+    auto message = server->receive().wait(io.waitScope);
+    KJ_ASSERT(message.is<kj::String>());
+    KJ_EXPECT(message.get<kj::String>() == "Hello");
+  }
+
+  clientTask.wait(io.waitScope);
+
+  // Our own output for "Hello" matches the RFC's.
+  auto serverTask = server->send(kj::StringPtr("Hello"));
+  expectRead(*client, kj::arrayPtr(DATA, 9)).wait(io.waitScope);
+  serverTask.wait(io.waitScope);
+}
+
+KJ_TEST("WebSocket compressed frame without negotiation") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  auto client = kj::mv(pipe.ends[0]);
+  auto server = newWebSocket(kj::mv(pipe.ends[1]), nullptr);
+
+  byte DATA[] = { 0xc1, 0x07, 0xf2, 0x48, 0xcd, 0xc9, 0xc9, 0x07, 0x00 };
+  auto clientTask = client->write(DATA, sizeof(DATA));
+
+  KJ_EXPECT_THROW_MESSAGE("compression wasn't negotiated", server->receive().wait(io.waitScope));
+
+  clientTask.wait(io.waitScope);
+}
+
+KJ_TEST("HttpServer WebSocket compression negotiation") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable::Builder tableBuilder;
+  HttpHeaderId hMyHeader = tableBuilder.add("My-Header");
+  auto headerTable = tableBuilder.build();
+  TestWebSocketService service(*headerTable, hMyHeader);
+
+  HttpServerSettings settings;
+  WebSocketCompressionSettings compression;
+  compression.maxWindowBits = 12;
+  settings.webSocketCompression = compression;
+  HttpServer server(io.provider->getTimer(), *headerTable, service, settings);
+
+  auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+
+  // Unknown extensions and malformed offers are skipped in favor of the first valid one.
+  auto request = kj::str(
+      "GET /ws-inline HTTP/1.1\r\n"
+      "Connection: Upgrade\r\n"
+      "Upgrade: websocket\r\n"
+      "Sec-WebSocket-Key: DCI4TgwiOE4MIjhODCI4Tg==\r\n"
+      "Sec-WebSocket-Version: 13\r\n"
+      "Sec-WebSocket-Extensions: x-foo, permessage-deflate; server_max_window_bits=99, "
+          "permessage-deflate; server_max_window_bits=\"10\"; client_max_window_bits\r\n"
+      "My-Header: foo\r\n"
+      "\r\n");
+  pipe.ends[1]->write({request.asBytes()}).wait(io.waitScope);
+  expectRead(*pipe.ends[1],
+      "HTTP/1.1 101 Switching Protocols\r\n"
+      "Connection: Upgrade\r\n"
+      "Upgrade: websocket\r\n"
+      "Sec-WebSocket-Accept: pShtIFKT0s8RYZvnWY/CrjQD8CM=\r\n"
+      "Sec-WebSocket-Extensions: permessage-deflate; server_max_window_bits=10; "
+          "client_max_window_bits=12\r\n"
+      "My-Header: respond-foo\r\n"
+      "\r\n").wait(io.waitScope);
+
+  // The greeting is now compressed (FIN | RSV1 | TEXT).
+  auto greeting = kj::heapArray<byte>(1);
+  pipe.ends[1]->read(greeting.begin(), 1).wait(io.waitScope);
+  KJ_EXPECT(greeting[0] == 0xc1);
+}
+
+KJ_TEST("HttpClient WebSocket compression with memory budget") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable::Builder tableBuilder;
+  HttpHeaderId hMyHeader = tableBuilder.add("My-Header");
+  auto headerTable = tableBuilder.build();
+  TestWebSocketService service(*headerTable, hMyHeader);
+
+  HttpServerSettings serverSettings;
+  serverSettings.webSocketCompression = WebSocketCompressionSettings();
+  HttpServer server(io.provider->getTimer(), *headerTable, service, serverSettings);
+  auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+
+  // A 32k budget only leaves room for 1k windows, and without context takeover there's no zlib
+  // state to keep between messages.
+  FakeEntropySource entropySource;
+  HttpClientSettings clientSettings;
+  clientSettings.entropySource = entropySource;
+  WebSocketCompressionSettings compression;
+  compression.contextTakeover = false;
+  compression.memoryBudget = 32 << 10;
+  clientSettings.webSocketCompression = compression;
+  auto client = newHttpClient(*headerTable, *pipe.ends[1], clientSettings);
+
+  kj::HttpHeaders headers(*headerTable);
+  auto response = client->openWebSocket("/ws-inline", headers).wait(io.waitScope);
+
+  KJ_EXPECT(response.statusCode == 101);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(response.headers->get(HttpHeaderId::SEC_WEBSOCKET_EXTENSIONS)) ==
+      "permessage-deflate; server_no_context_takeover; client_no_context_takeover; "
+      "server_max_window_bits=10; client_max_window_bits=10");
+  KJ_ASSERT(response.webSocketOrBody.is<kj::Own<WebSocket>>());
+  auto ws = kj::mv(response.webSocketOrBody.get<kj::Own<WebSocket>>());
+
+  {
+    auto message = ws->receive().wait(io.waitScope);
+    KJ_ASSERT(message.is<kj::String>());
+    KJ_EXPECT(message.get<kj::String>() == "start-inline");
+  }
+
+  auto bigString = kj::strArray(kj::repeat(kj::StringPtr("123456789"), 1000), "");
+  ws->send(bigString).wait(io.waitScope);
+  {
+    auto message = ws->receive().wait(io.waitScope);
+    KJ_ASSERT(message.is<kj::String>());
+    KJ_EXPECT(message.get<kj::String>() == kj::str("reply:", bigString));
+  }
+
+  ws->close(0x1234, "qux").wait(io.waitScope);
+  {
+    auto message = ws->receive().wait(io.waitScope);
+    KJ_ASSERT(message.is<WebSocket::Close>());
+    KJ_EXPECT(message.get<WebSocket::Close>().code == 0x1235);
+    KJ_EXPECT(message.get<WebSocket::Close>().reason == "close-reply:qux");
+  }
+
+  listenTask.wait(io.waitScope);
+}
+
+#endif  // KJ_HAS_ZLIB
+
+
 // -----------------------------------------------------------------------------
 
 KJ_TEST("HttpServer request timeout") {
@@ -2255,6 +2558,124 @@ KJ_TEST("HttpFixedLengthEntityWriter correctly implements tryPumpFrom") {
       "Hello, World!", text);
 }
 
+class PumpRequestService final: public HttpService {
+  // HttpService that pumps each request body into `sink`, then responds with the byte count.
+public:
+  PumpRequestService(kj::AsyncOutputStream& sink): sink(sink) {}
+
+  kj::Promise<void> request(
+      HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+      kj::AsyncInputStream& requestBody, Response& response) override {
+    return requestBody.pumpTo(sink).then([this,&response](uint64_t amount) {
+      auto text = kj::str(amount);
+      auto body = response.send(200, "OK", HttpHeaders(table), text.size());
+      auto promise = body->write(text.begin(), text.size());
+      return promise.attach(kj::mv(body), kj::mv(text));
+    });
+  }
+
+private:
+  kj::AsyncOutputStream& sink;
+  HttpHeaderTable table;
+};
+
+KJ_TEST("HttpServer pumps request bodies from buffer and socket") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+  auto sink = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable table;
+  PumpRequestService service(*sink.ends[0]);
+  HttpServer server(io.provider->getTimer(), table, service);
+  auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+
+  // The first two bodies arrive along with the headers, so they're pumped from the server's
+  // buffer. The third mostly comes later, straight from the socket.
+  auto big = kj::heapArray<char>(100000);
+  for (auto i: kj::indices(big)) big[i] = 'a' + i % 26;
+  auto requests = kj::str(
+      "POST /a HTTP/1.1\r\nContent-Length: 10\r\n\r\n0123456789"
+      "POST /b HTTP/1.1\r\nContent-Length: 5\r\n\r\nabcde"
+      "POST /c HTTP/1.1\r\nContent-Length: ", big.size(), "\r\n\r\n");
+  pipe.ends[1]->write(requests.begin(), requests.size()).wait(io.waitScope);
+
+  auto writeBig = pipe.ends[1]->write(big.begin(), big.size()).then([&]() {
+    pipe.ends[1]->shutdownWrite();
+  }).eagerlyEvaluate(nullptr);
+
+  auto expected = kj::str("0123456789abcde", big);
+  auto received = kj::heapArray<char>(expected.size());
+  sink.ends[1]->read(received.begin(), received.size()).wait(io.waitScope);
+  KJ_EXPECT(received == expected.asArray());
+
+  writeBig.wait(io.waitScope);
+  auto text = pipe.ends[1]->readAllText().wait(io.waitScope);
+  KJ_EXPECT(text ==
+      "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\n10"
+      "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n5"
+      "HTTP/1.1 200 OK\r\nContent-Length: 6\r\n\r\n100000", text);
+}
+
+class WriteCountingStream final: public kj::AsyncIoStream {
+  // An AsyncIoStream wrapper which counts calls to write().
+
+public:
+  WriteCountingStream(kj::AsyncIoStream& inner): inner(inner) {}
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    return inner.tryRead(buffer, minBytes, maxBytes);
+  }
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    ++writeCount;
+    return inner.write(buffer, size);
+  }
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    ++writeCount;
+    return inner.write(pieces);
+  }
+  void shutdownWrite() override {
+    inner.shutdownWrite();
+  }
+
+  uint writeCount = 0;
+
+private:
+  kj::AsyncIoStream& inner;
+};
+
+KJ_TEST("HttpChunkedEntityWriter batches writes") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+  WriteCountingStream stream(*pipe.ends[0]);
+
+  HttpHeaderTable table;
+  auto client = newHttpClient(table, stream);
+
+  {
+    auto request = client->request(HttpMethod::POST, "/", HttpHeaders(table));
+
+    // The headers and the first chunk are written together.
+    request.body->write("foo", 3).wait(io.waitScope);
+    KJ_EXPECT(stream.writeCount == 1);
+
+    // Each chunk's header, data and trailing CRLF go out in one write.
+    kj::ArrayPtr<const byte> pieces[2] = {
+      kj::StringPtr("0123456789").asBytes(), kj::StringPtr("abcdef").asBytes()
+    };
+    request.body->write(pieces).wait(io.waitScope);
+    KJ_EXPECT(stream.writeCount == 2);
+  }
+
+  expectRead(*pipe.ends[1],
+      "POST / HTTP/1.1\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "\r\n"
+      "3\r\nfoo\r\n"
+      "10\r\n0123456789abcdef\r\n"
+      "0\r\n\r\n").wait(io.waitScope);
+  KJ_EXPECT(stream.writeCount == 3);
+}
+
 // -----------------------------------------------------------------------------
 
 KJ_TEST("newHttpService from HttpClient") {
@@ -2649,49 +3070,130 @@ KJ_TEST("HttpClient connection management") {
   KJ_EXPECT(count == 1);
 }
 
-KJ_TEST("HttpClient multi host") {
+KJ_TEST("HttpClient connection limit and pre-warming") {
   auto io = kj::setupAsyncIo();
 
   kj::TimerImpl serverTimer(kj::origin<kj::TimePoint>());
   kj::TimerImpl clientTimer(kj::origin<kj::TimePoint>());
   HttpHeaderTable headerTable;
 
-  auto listener1 = io.provider->getNetwork().parseAddress("localhost", 0)
-      .wait(io.waitScope)->listen();
-  auto listener2 = io.provider->getNetwork().parseAddress("localhost", 0)
+  auto listener = io.provider->getNetwork().parseAddress("localhost", 0)
       .wait(io.waitScope)->listen();
   DummyService service(headerTable);
   HttpServer server(serverTimer, headerTable, service);
-  auto listenTask1 = server.listenHttp(*listener1);
-  auto listenTask2 = server.listenHttp(*listener2);
+  auto listenTask = server.listenHttp(*listener);
 
-  uint count = 0, addrCount = 0;
-  uint tlsCount = 0, tlsAddrCount = 0;
-  ConnectionCountingNetwork countingNetwork(io.provider->getNetwork(), count, addrCount);
-  ConnectionCountingNetwork countingTlsNetwork(io.provider->getNetwork(), tlsCount, tlsAddrCount);
+  auto addr = io.provider->getNetwork().parseAddress("localhost", listener->getPort())
+      .wait(io.waitScope);
+  uint count = 0;
+  CountingNetworkAddress countingAddr(*addr, count);
 
+  HttpClientConnectionStats stats;
   HttpClientSettings clientSettings;
-  auto client = newHttpClient(clientTimer, headerTable,
-      countingNetwork, countingTlsNetwork, clientSettings);
+  clientSettings.maxConnectionsPerHost = 2;
+  clientSettings.prewarmConnections = 1;
+  clientSettings.connectionStats = stats;
+  auto client = newHttpClient(clientTimer, headerTable, countingAddr, clientSettings);
 
-  KJ_EXPECT(count == 0);
+  // A connection is opened right away.
+  KJ_EXPECT(count == 1);
+  KJ_EXPECT(stats.newConnections == 1);
 
   uint i = 0;
-  auto doRequest = [&](bool tls, uint port) {
+  auto doRequest = [&]() {
     uint n = i++;
-    return client->request(HttpMethod::GET,
-        kj::str((tls ? "https://localhost:" : "http://localhost:"), port, '/', n),
-                HttpHeaders(headerTable)).response
+    return client->request(HttpMethod::GET, kj::str("/", n), HttpHeaders(headerTable)).response
         .then([](HttpClient::Response&& response) {
       auto promise = response.body->readAllText();
       return promise.attach(kj::mv(response.body));
-    }).then([n, port](kj::String body) {
-      KJ_EXPECT(body == kj::str("localhost:", port, ":/", n), body, port, n);
+    }).then([n](kj::String body) {
+      KJ_EXPECT(body == kj::str("null:/", n));
     });
   };
 
-  uint port1 = listener1->getPort();
-  uint port2 = listener2->getPort();
+  // The first request uses the pre-warmed connection.
+  doRequest().wait(io.waitScope);
+  KJ_EXPECT(count == 1);
+  KJ_EXPECT(stats.newConnections == 1);
+  KJ_EXPECT(stats.reusedConnections == 1);
+
+  // Four requests in parallel only get two connections; the others wait their turn. (We must
+  // evaluate eagerly, since a connection is only released once its response body is dropped.)
+  auto promises = kj::heapArrayBuilder<kj::Promise<void>>(4);
+  for (uint j = 0; j < 4; j++) {
+    promises.add(doRequest().eagerlyEvaluate(nullptr));
+  }
+  KJ_EXPECT(stats.queuedRequests == 2);
+  kj::joinPromises(promises.finish()).wait(io.waitScope);
+  KJ_EXPECT(count == 2);
+  KJ_EXPECT(stats.newConnections == 2);
+  KJ_EXPECT(stats.reusedConnections == 4);
+
+  // A canceled request which was waiting for a connection doesn't hold on to one.
+  {
+    auto req1 = doRequest();
+    auto req2 = doRequest();
+    {
+      auto req3 = doRequest();
+    }
+    auto req4 = doRequest();
+    req1.wait(io.waitScope);
+    req2.wait(io.waitScope);
+    req4.wait(io.waitScope);
+  }
+  KJ_EXPECT(count == 2);
+  KJ_EXPECT(stats.queuedRequests == 4);
+
+  // Idle connections still time out.
+  clientTimer.advanceTo(clientTimer.now() + clientSettings.idleTimout * 2);
+  io.waitScope.poll();
+  KJ_EXPECT(count == 0);
+  KJ_EXPECT(stats.idleTimeouts == 2);
+}
+
+KJ_TEST("HttpClient multi host") {
+  auto io = kj::setupAsyncIo();
+
+  kj::TimerImpl serverTimer(kj::origin<kj::TimePoint>());
+  kj::TimerImpl clientTimer(kj::origin<kj::TimePoint>());
+  HttpHeaderTable headerTable;
+
+  auto listener1 = io.provider->getNetwork().parseAddress("localhost", 0)
+      .wait(io.waitScope)->listen();
+  auto listener2 = io.provider->getNetwork().parseAddress("localhost", 0)
+      .wait(io.waitScope)->listen();
+  DummyService service(headerTable);
+  HttpServer server(serverTimer, headerTable, service);
+  auto listenTask1 = server.listenHttp(*listener1);
+  auto listenTask2 = server.listenHttp(*listener2);
+
+  uint count = 0, addrCount = 0;
+  uint tlsCount = 0, tlsAddrCount = 0;
+  ConnectionCountingNetwork countingNetwork(io.provider->getNetwork(), count, addrCount);
+  ConnectionCountingNetwork countingTlsNetwork(io.provider->getNetwork(), tlsCount, tlsAddrCount);
+
+  HttpClientSettings clientSettings;
+  auto client = newHttpClient(clientTimer, headerTable,
+      countingNetwork, countingTlsNetwork, clientSettings);
+
+  KJ_EXPECT(count == 0);
+
+  uint i = 0;
+  auto doRequest = [&](bool tls, uint port) {
+    uint n = i++;
+    return client->request(HttpMethod::GET,
+        kj::str((tls ? "https://localhost:" : "http://localhost:"), port, '/', n),
+                HttpHeaders(headerTable)).response
+        .then([](HttpClient::Response&& response) {
+      auto promise = response.body->readAllText();
+      return promise.attach(kj::mv(response.body));
+    }).then([n, port](kj::String body) {
+      KJ_EXPECT(body == kj::str("localhost:", port, ":/", n), body, port, n);
+    });
+  };
+
+  uint port1 = listener1->getPort();
+  uint port2 = listener2->getPort();
 
   // We can do several requests in a row to the same host and only have one connection.
   doRequest(false, port1).wait(io.waitScope);
@@ -2751,6 +3253,649 @@ KJ_TEST("HttpClient multi host") {
 
 // -----------------------------------------------------------------------------
 
+class PipeNetwork final: public kj::Network {
+  // A Network on which every address connects to the same stream, recording the addresses.
+
+public:
+  explicit PipeNetwork(kj::AsyncIoStream& stream): stream(stream) {}
+
+  kj::Vector<kj::String> addresses;
+
+  kj::Promise<kj::Own<kj::NetworkAddress>> parseAddress(
+      kj::StringPtr addr, uint portHint = 0) override {
+    addresses.add(kj::str(addr, ':', portHint));
+    return kj::Own<kj::NetworkAddress>(kj::heap<Address>(stream));
+  }
+  kj::Own<kj::NetworkAddress> getSockaddr(const void* sockaddr, uint len) override {
+    KJ_UNIMPLEMENTED("not used");
+  }
+  kj::Own<kj::Network> restrictPeers(
+      kj::ArrayPtr<const kj::StringPtr> allow,
+      kj::ArrayPtr<const kj::StringPtr> deny = nullptr) override {
+    KJ_UNIMPLEMENTED("not used");
+  }
+
+private:
+  kj::AsyncIoStream& stream;
+
+  class Address final: public kj::NetworkAddress {
+  public:
+    explicit Address(kj::AsyncIoStream& stream): stream(stream) {}
+
+    kj::Promise<kj::Own<kj::AsyncIoStream>> connect() override {
+      return kj::Own<kj::AsyncIoStream>(&stream, kj::NullDisposer::instance);
+    }
+    kj::Own<kj::ConnectionReceiver> listen() override { KJ_UNIMPLEMENTED("not used"); }
+    kj::Own<kj::NetworkAddress> clone() override { return kj::heap<Address>(stream); }
+    kj::String toString() override { return kj::str("pipe"); }
+
+  private:
+    kj::AsyncIoStream& stream;
+  };
+};
+
+KJ_TEST("HttpClient over Network forwards proxy-form URLs") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+  PipeNetwork network(*pipe.ends[0]);
+
+  HttpHeaderTable table;
+  auto client = newHttpClient(io.provider->getTimer(), table, network, nullptr);
+
+  auto roundTrip = [&](kj::StringPtr url, kj::StringPtr expectedRequest) {
+    auto serverTask = expectRead(*pipe.ends[1], expectedRequest).then([&]() {
+      static const char SIMPLE_RESPONSE[] =
+          "HTTP/1.1 200 OK\r\n"
+          "Content-Length: 0\r\n"
+          "\r\n";
+      return pipe.ends[1]->write(SIMPLE_RESPONSE, strlen(SIMPLE_RESPONSE));
+    });
+
+    HttpHeaders headers(table);
+    auto response = client->request(HttpMethod::GET, url, headers).response
+        .wait(io.waitScope);
+    KJ_EXPECT(response.statusCode == 200);
+    response.body->readAllText().wait(io.waitScope);
+    serverTask.wait(io.waitScope);
+  };
+
+  // Already normalized: forwarded as written.
+  roundTrip("http://example.com/foo/bar?baz=1&qux",
+      "GET /foo/bar?baz=1&qux HTTP/1.1\r\nHost: example.com\r\n\r\n");
+  roundTrip("http://example.com",
+      "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n");
+
+  // Not normalized: decoded and re-encoded, as Url does.
+  roundTrip("http://Example.COM/a/../b%7e?",
+      "GET /b~ HTTP/1.1\r\nHost: example.com\r\n\r\n");
+  roundTrip("http://example.com?x=1",
+      "GET /?x=1 HTTP/1.1\r\nHost: example.com\r\n\r\n");
+
+  // All on one connection.
+  KJ_EXPECT(network.addresses.asPtr() == kj::ArrayPtr<const kj::StringPtr>({"example.com:80"}));
+}
+
+class Http2TestService final: public HttpService {
+  // Echoes the request body, or if there is none, the host and URL. "/wait" doesn't respond until
+  // a "/release" request arrives.
+public:
+  Http2TestService(HttpHeaderTable& headerTable): headerTable(headerTable) {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    released = paf.promise.fork();
+    releaseFulfiller = kj::mv(paf.fulfiller);
+  }
+
+  kj::Promise<void> request(
+      HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+      kj::AsyncInputStream& requestBody, Response& response) override {
+    if (url == "/throw") {
+      return KJ_EXCEPTION(FAILED, "failed");
+    } else if (url == "/nocontent") {
+      response.send(204, "No Content", HttpHeaders(headerTable));
+      return kj::READY_NOW;
+    }
+
+    auto start = url == "/wait" ? released.addBranch() : kj::Promise<void>(kj::READY_NOW);
+    if (url == "/release") releaseFulfiller->fulfill();
+
+    return start.then([&requestBody]() {
+      return requestBody.readAllText();
+    }).then([this,method,url,&headers,&response](kj::String text) {
+      if (text.size() == 0) {
+        text = kj::str(headers.get(HttpHeaderId::HOST).orDefault("null"), ":", url);
+      }
+      HttpHeaders responseHeaders(headerTable);
+      responseHeaders.add("X-Method", kj::str(method));
+      auto stream = response.send(200, "OK", responseHeaders, text.size());
+      auto promise = stream->write(text.begin(), text.size());
+      return promise.attach(kj::mv(stream), kj::mv(text));
+    });
+  }
+
+private:
+  HttpHeaderTable& headerTable;
+  kj::ForkedPromise<void> released = nullptr;
+  kj::Own<kj::PromiseFulfiller<void>> releaseFulfiller;
+};
+
+KJ_TEST("HTTP/2 client and server") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable::Builder builder;
+  auto xMethod = builder.add("X-Method");
+  auto ownTable = builder.build();
+  auto& table = *ownTable;
+  Http2TestService service(table);
+  HttpServerSettings settings;
+  settings.http2PriorKnowledge = true;
+  HttpServer server(io.provider->getTimer(), table, service, settings);
+  auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+
+  auto client = newHttp2Client(table, *pipe.ends[1]);
+
+  {
+    HttpHeaders headers(table);
+    headers.set(HttpHeaderId::HOST, "example.com");
+    auto response = client->request(HttpMethod::GET, "/foo?bar", headers).response
+        .wait(io.waitScope);
+    KJ_EXPECT(response.statusCode == 200);
+    KJ_EXPECT(KJ_ASSERT_NONNULL(response.headers->get(HttpHeaderId::CONTENT_LENGTH)) == "20");
+    KJ_EXPECT(KJ_ASSERT_NONNULL(response.headers->get(xMethod)) == "GET");
+    KJ_EXPECT(response.body->readAllText().wait(io.waitScope) == "example.com:/foo?bar");
+  }
+
+  // Absolute URLs supply the authority.
+  {
+    HttpHeaders headers(table);
+    auto response = client->request(HttpMethod::GET, "http://example.org/baz", headers).response
+        .wait(io.waitScope);
+    KJ_EXPECT(response.body->readAllText().wait(io.waitScope) == "example.org:/baz");
+  }
+
+  // Requests are multiplexed: "/wait" is answered only once the later "/release" is received.
+  {
+    HttpHeaders headers(table);
+    headers.set(HttpHeaderId::HOST, "example.com");
+    auto waiting = client->request(HttpMethod::GET, "/wait", headers).response;
+    KJ_EXPECT(!waiting.poll(io.waitScope));
+
+    auto release = client->request(HttpMethod::GET, "/release", headers).response
+        .wait(io.waitScope);
+    KJ_EXPECT(release.body->readAllText().wait(io.waitScope) == "example.com:/release");
+
+    auto response = waiting.wait(io.waitScope);
+    KJ_EXPECT(response.body->readAllText().wait(io.waitScope) == "example.com:/wait");
+  }
+
+  // Bodies much larger than the flow control windows, in both directions at once.
+  {
+    auto text = kj::heapString(1 << 21);
+    for (auto i: kj::indices(text)) text[i] = 'a' + i % 26;
+
+    HttpHeaders headers(table);
+    auto request = client->request(HttpMethod::POST, "/echo", headers, text.size());
+    auto writePromise = request.body->write(text.begin(), text.size());
+    auto response = request.response.wait(io.waitScope);
+    auto echoed = response.body->readAllText().wait(io.waitScope);
+    writePromise.wait(io.waitScope);
+    KJ_EXPECT(echoed == text);
+  }
+
+  // Chunked (unknown length) request body.
+  {
+    HttpHeaders headers(table);
+    auto request = client->request(HttpMethod::PUT, "/echo", headers);
+    request.body->write("foo", 3).wait(io.waitScope);
+    request.body->write("bar", 3).wait(io.waitScope);
+    request.body = nullptr;
+    auto response = request.response.wait(io.waitScope);
+    KJ_EXPECT(response.body->readAllText().wait(io.waitScope) == "foobar");
+  }
+
+  // HEAD and 204 responses have no body.
+  {
+    HttpHeaders headers(table);
+    headers.set(HttpHeaderId::HOST, "example.com");
+    auto response = client->request(HttpMethod::HEAD, "/head", headers).response
+        .wait(io.waitScope);
+    KJ_EXPECT(response.statusCode == 200);
+    KJ_EXPECT(KJ_ASSERT_NONNULL(response.headers->get(HttpHeaderId::CONTENT_LENGTH)) == "17");
+    KJ_EXPECT(response.body->readAllText().wait(io.waitScope) == "");
+
+    response = client->request(HttpMethod::GET, "/nocontent", headers).response
+        .wait(io.waitScope);
+    KJ_EXPECT(response.statusCode == 204);
+    KJ_EXPECT(response.body->readAllText().wait(io.waitScope) == "");
+  }
+
+  // An exception only fails its own stream.
+  {
+    HttpHeaders headers(table);
+    auto response = client->request(HttpMethod::GET, "/throw", headers).response
+        .wait(io.waitScope);
+    KJ_EXPECT(response.statusCode == 500);
+    response.body->readAllText().wait(io.waitScope);
+
+    headers.set(HttpHeaderId::HOST, "example.com");
+    response = client->request(HttpMethod::GET, "/after", headers).response.wait(io.waitScope);
+    KJ_EXPECT(response.body->readAllText().wait(io.waitScope) == "example.com:/after");
+  }
+
+  // Draining the server closes the idle connection.
+  server.drain().wait(io.waitScope);
+  listenTask.wait(io.waitScope);
+}
+
+KJ_TEST("HTTP/2 server with prior knowledge") {
+  // Speaks to the server on the wire, using the request header block from RFC 7541 C.4.1, which
+  // the server must tell apart from HTTP/1.1 by its connection preface.
+
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable table;
+  Http2TestService service(table);
+  HttpServerSettings settings;
+  settings.http2PriorKnowledge = true;
+  HttpServer server(io.provider->getTimer(), table, service, settings);
+  auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+
+  static const byte REQUEST[] = {
+    'P', 'R', 'I', ' ', '*', ' ', 'H', 'T', 'T', 'P', '/', '2', '.', '0', '\r', '\n',
+    '\r', '\n', 'S', 'M', '\r', '\n', '\r', '\n',
+
+    // SETTINGS, empty.
+    0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00,
+
+    // HEADERS, END_STREAM | END_HEADERS, stream 1.
+    0x00, 0x00, 0x11, 0x01, 0x05, 0x00, 0x00, 0x00, 0x01,
+    0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a, 0x6b, 0xa0, 0xab, 0x90,
+    0xf4, 0xff,
+  };
+  pipe.ends[1]->write(REQUEST, sizeof(REQUEST)).wait(io.waitScope);
+
+  // The server starts with its SETTINGS frame.
+  byte header[9];
+  pipe.ends[1]->read(header, sizeof(header)).wait(io.waitScope);
+  KJ_EXPECT(header[3] == 0x04 && header[4] == 0x00);
+
+  // The response body arrives in a DATA frame.
+  kj::Vector<char> received;
+  for (;;) {
+    char buffer[256];
+    size_t n = pipe.ends[1]->tryRead(buffer, 1, sizeof(buffer)).wait(io.waitScope);
+    KJ_ASSERT(n > 0, "response not received");
+    received.addAll(kj::arrayPtr(buffer, n));
+    kj::StringPtr expected = "www.example.com:/";
+    if (std::search(received.begin(), received.end(), expected.begin(), expected.end()) !=
+        received.end()) {
+      break;
+    }
+  }
+}
+
+KJ_TEST("HTTP/2 prior knowledge is off by default") {
+  // Without `http2PriorKnowledge`, the HTTP/2 preface is just a malformed HTTP/1 request.
+
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable table;
+  Http2TestService service(table);
+  HttpServer server(io.provider->getTimer(), table, service);
+  auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+
+  kj::StringPtr preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+  pipe.ends[1]->write(preface.begin(), preface.size()).wait(io.waitScope);
+  pipe.ends[1]->shutdownWrite();
+
+  auto response = pipe.ends[1]->readAllText().wait(io.waitScope);
+  KJ_EXPECT(response.startsWith("HTTP/1.1 400 Bad Request"), response);
+}
+
+class HeaderSizeService final: public HttpService {
+  // Responds with the URL and the size of the X-Big header, all values combined.
+public:
+  HeaderSizeService(HttpHeaderTable& headerTable, HttpHeaderId xBig)
+      : headerTable(headerTable), xBig(xBig) {}
+
+  kj::Promise<void> request(
+      HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+      kj::AsyncInputStream& requestBody, Response& response) override {
+    auto body = kj::str(url, ":", headers.get(xBig).orDefault("").size());
+    auto stream = response.send(200, "OK", HttpHeaders(headerTable), body.size());
+    auto promise = stream->write(body.begin(), body.size());
+    return promise.attach(kj::mv(stream), kj::mv(body));
+  }
+
+private:
+  HttpHeaderTable& headerTable;
+  HttpHeaderId xBig;
+};
+
+class RawHttp2Client {
+  // Writes hand-encoded header blocks to an HTTP/2 server, to exercise its HPACK decoder.
+
+public:
+  RawHttp2Client(kj::AsyncIoStream& stream, kj::WaitScope& waitScope)
+      : stream(stream), waitScope(waitScope) {
+    static const char PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    out.addAll(kj::arrayPtr(PREFACE, strlen(PREFACE)).asBytes());
+    frame(0x04, 0x00, 0, nullptr);  // SETTINGS, empty.
+  }
+
+  void integer(byte prefix, uint bits, size_t value) {
+    size_t max = (1u << bits) - 1;
+    if (value < max) {
+      block.add(prefix | value);
+      return;
+    }
+    block.add(prefix | max);
+    value -= max;
+    while (value >= 0x80) {
+      block.add(0x80 | (value & 0x7f));
+      value >>= 7;
+    }
+    block.add(value);
+  }
+
+  void string(kj::StringPtr text) {
+    integer(0, 7, text.size());
+    block.addAll(text.asBytes());
+  }
+
+  void startRequest(kj::StringPtr path) {
+    block.add(0x82);  // :method GET
+    block.add(0x86);  // :scheme http
+    integer(0x00, 4, 4);  // :path, without indexing.
+    string(path);
+    integer(0x00, 4, 1);  // :authority, without indexing.
+    string("example.com");
+  }
+
+  void sendRequest() {
+    // HEADERS, END_STREAM | END_HEADERS.
+    frame(0x01, 0x05, nextStreamId, block);
+    nextStreamId += 2;
+    block.clear();
+    stream.write(out.begin(), out.size()).wait(waitScope);
+    out.clear();
+  }
+
+  void expectResponse(kj::StringPtr expected) {
+    for (;;) {
+      if (std::search(received.begin(), received.end(), expected.begin(), expected.end()) !=
+          received.end()) {
+        return;
+      }
+      char buffer[256];
+      size_t n = stream.tryRead(buffer, 1, sizeof(buffer)).wait(waitScope);
+      KJ_ASSERT(n > 0, "response not received", expected);
+      received.addAll(kj::arrayPtr(buffer, n));
+    }
+  }
+
+private:
+  kj::AsyncIoStream& stream;
+  kj::WaitScope& waitScope;
+  kj::Vector<byte> out;
+  kj::Vector<byte> block;
+  kj::Vector<char> received;
+  uint32_t nextStreamId = 1;
+
+  void frame(byte type, byte flags, uint32_t streamId, kj::ArrayPtr<const byte> payload) {
+    size_t size = payload.size();
+    byte header[9] = {
+      byte(size >> 16), byte(size >> 8), byte(size), type, flags,
+      byte(streamId >> 24), byte(streamId >> 16), byte(streamId >> 8), byte(streamId),
+    };
+    out.addAll(kj::arrayPtr(header, sizeof(header)));
+    out.addAll(payload);
+  }
+};
+
+KJ_TEST("HTTP/2 server decodes a literal named by a dynamic table entry") {
+  // The literal's value is decoded after its name has been copied out of the dynamic table, and
+  // the copies of the earlier fields make the decoded text outgrow its initial allocation.
+
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable::Builder builder;
+  auto xBig = builder.add("X-Big");
+  auto table = builder.build();
+  HeaderSizeService service(*table, xBig);
+  HttpServerSettings settings;
+  settings.http2PriorKnowledge = true;
+  HttpServer server(io.provider->getTimer(), *table, service, settings);
+  auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+
+  RawHttp2Client client(*pipe.ends[1], io.waitScope);
+
+  // Adds "x-big: aaa..." to the dynamic table, as index 62.
+  client.startRequest("/1");
+  client.integer(0x40, 6, 0);
+  client.string("x-big");
+  client.string(kj::strArray(kj::repeat("a", 3000), ""));
+  client.sendRequest();
+  client.expectResponse("/1:3000");
+
+  // Five references to it, then a new entry which takes its name and evicts it.
+  client.startRequest("/2");
+  for (uint i = 0; i < 5; i++) client.integer(0x80, 7, 62);
+  client.integer(0x40, 6, 62);
+  client.string(kj::strArray(kj::repeat("b", 4000), ""));
+  client.sendRequest();
+  client.expectResponse("/2:19010");
+
+  client.startRequest("/3");
+  client.integer(0x80, 7, 62);
+  client.sendRequest();
+  client.expectResponse("/3:4000");
+}
+
+KJ_TEST("HTTP/2 server limits the size of decoded header lists") {
+  // One-byte references to a large dynamic table entry mustn't be expanded past the limit.
+
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable::Builder builder;
+  auto xBig = builder.add("X-Big");
+  auto table = builder.build();
+  HeaderSizeService service(*table, xBig);
+  HttpServerSettings settings;
+  settings.http2PriorKnowledge = true;
+  KJ_ASSERT_NONNULL(settings.http2).maxHeaderListSize = 16384;
+  HttpServer server(io.provider->getTimer(), *table, service, settings);
+  auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+
+  RawHttp2Client client(*pipe.ends[1], io.waitScope);
+
+  client.startRequest("/1");
+  client.integer(0x40, 6, 0);
+  client.string("x-big");
+  client.string(kj::strArray(kj::repeat("a", 4000), ""));
+  client.sendRequest();
+  client.expectResponse("/1:4000");
+
+  // Would expand to 40MB.
+  client.startRequest("/2");
+  for (uint i = 0; i < 10000; i++) client.integer(0x80, 7, 62);
+  client.sendRequest();
+  client.expectResponse("ERROR: The headers sent by your client were too large.");
+
+  // The dynamic table is still in sync.
+  client.startRequest("/3");
+  client.integer(0x80, 7, 62);
+  client.sendRequest();
+  client.expectResponse("/3:4000");
+}
+
+// -----------------------------------------------------------------------------
+
+class HeldHttpService final: public HttpService {
+  // Responds to each request with its URL, but only once the test releases it.
+public:
+  HeldHttpService(HttpHeaderTable& headerTable): headerTable(headerTable) {}
+
+  kj::Promise<void> request(
+      HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+      kj::AsyncInputStream& requestBody, Response& response) override {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    held.add(kj::mv(paf.fulfiller));
+    return paf.promise.then([this,url,&response]() {
+      auto body = kj::str(url);
+      auto stream = response.send(200, "OK", HttpHeaders(headerTable), body.size());
+      auto promise = stream->write(body.begin(), body.size());
+      return promise.attach(kj::mv(stream), kj::mv(body));
+    });
+  }
+
+  uint received() { return held.size(); }
+  void releaseNext() { held[released++]->fulfill(); }
+
+private:
+  HttpHeaderTable& headerTable;
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> held;
+  uint released = 0;
+};
+
+KJ_TEST("HttpServer maxConcurrentRequests and maxQueueTime") {
+  auto io = kj::setupAsyncIo();
+  kj::TimerImpl timer(kj::origin<kj::TimePoint>());
+
+  HttpHeaderTable table;
+  HeldHttpService service(table);
+  HttpServerSettings settings;
+  settings.maxConcurrentRequests = 1;
+  settings.maxQueueTime = 10 * kj::SECONDS;
+  HttpServer server(timer, table, service, settings);
+
+  auto pipe1 = io.provider->newTwoWayPipe();
+  auto pipe2 = io.provider->newTwoWayPipe();
+  auto pipe3 = io.provider->newTwoWayPipe();
+  auto listen1 = server.listenHttp(kj::mv(pipe1.ends[0]));
+  auto listen2 = server.listenHttp(kj::mv(pipe2.ends[0]));
+  auto listen3 = server.listenHttp(kj::mv(pipe3.ends[0]));
+  auto client1 = newHttpClient(table, *pipe1.ends[1]);
+  auto client2 = newHttpClient(table, *pipe2.ends[1]);
+  auto client3 = newHttpClient(table, *pipe3.ends[1]);
+
+  auto response1 = client1->request(HttpMethod::GET, "/1", HttpHeaders(table)).response;
+  io.waitScope.poll();
+  KJ_EXPECT(service.received() == 1);
+
+  // The second request waits for the first.
+  auto response2 = client2->request(HttpMethod::GET, "/2", HttpHeaders(table)).response;
+  io.waitScope.poll();
+  KJ_EXPECT(service.received() == 1);
+  KJ_EXPECT(server.getLoad().activeRequests == 1);
+  KJ_EXPECT(server.getLoad().queuedRequests == 1);
+  KJ_EXPECT(server.getLoad().connections == 3);
+
+  timer.advanceTo(timer.now() + 5 * kj::SECONDS);
+  auto response3 = client3->request(HttpMethod::GET, "/3", HttpHeaders(table)).response;
+  io.waitScope.poll();
+  KJ_EXPECT(server.getLoad().queuedRequests == 2);
+
+  // The second request exceeds its queue time and is shed, but the third still has time left.
+  timer.advanceTo(timer.now() + 6 * kj::SECONDS);
+  KJ_EXPECT(response2.wait(io.waitScope).statusCode == 503);
+  listen2.wait(io.waitScope);
+  KJ_EXPECT(server.getLoad().queuedRequests == 1);
+  KJ_EXPECT(server.getLoad().shedRequests == 1);
+
+  // Finishing the first request admits the third.
+  service.releaseNext();
+  auto r1 = response1.wait(io.waitScope);
+  KJ_EXPECT(r1.statusCode == 200);
+  KJ_EXPECT(r1.body->readAllText().wait(io.waitScope) == "/1");
+  io.waitScope.poll();
+  KJ_EXPECT(service.received() == 2);
+  KJ_EXPECT(server.getLoad().queuedRequests == 0);
+
+  service.releaseNext();
+  auto r3 = response3.wait(io.waitScope);
+  KJ_EXPECT(r3.statusCode == 200);
+  KJ_EXPECT(r3.body->readAllText().wait(io.waitScope) == "/3");
+  io.waitScope.poll();
+  KJ_EXPECT(server.getLoad().activeRequests == 0);
+}
+
+KJ_TEST("HttpServer sheds HTTP/2 requests") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable table;
+  HeldHttpService service(table);
+  HttpServerSettings settings;
+  settings.maxConcurrentRequests = 1;
+  settings.maxQueueTime = 0 * kj::SECONDS;
+  settings.http2PriorKnowledge = true;
+  HttpServer server(io.provider->getTimer(), table, service, settings);
+  auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+  auto client = newHttp2Client(table, *pipe.ends[1]);
+
+  HttpHeaders headers(table);
+  headers.set(HttpHeaderId::HOST, "example.com");
+  auto response1 = client->request(HttpMethod::GET, "/1", headers).response;
+  io.waitScope.poll();
+  KJ_EXPECT(service.received() == 1);
+
+  // With no queue time, a request that can't be served at once gets a 503 immediately, and the
+  // connection stays usable.
+  auto response2 = client->request(HttpMethod::GET, "/2", headers).response.wait(io.waitScope);
+  KJ_EXPECT(response2.statusCode == 503);
+  KJ_EXPECT(server.getLoad().shedRequests == 1);
+
+  service.releaseNext();
+  auto r1 = response1.wait(io.waitScope);
+  KJ_EXPECT(r1.body->readAllText().wait(io.waitScope) == "/1");
+
+  auto response3 = client->request(HttpMethod::GET, "/3", headers).response;
+  io.waitScope.poll();
+  service.releaseNext();
+  KJ_EXPECT(response3.wait(io.waitScope).body->readAllText().wait(io.waitScope) == "/3");
+}
+
+KJ_TEST("HttpServer maxConnections pauses accept") {
+  auto io = kj::setupAsyncIo();
+
+  HttpHeaderTable table;
+  auto listener = io.provider->getNetwork().parseAddress("localhost", 0)
+      .wait(io.waitScope)->listen();
+  DummyService service(table);
+  HttpServerSettings settings;
+  settings.maxConnections = 1;
+  HttpServer server(io.provider->getTimer(), table, service, settings);
+  auto listenTask = server.listenHttp(*listener);
+
+  auto addr = io.provider->getNetwork().parseAddress("localhost", listener->getPort())
+      .wait(io.waitScope);
+
+  auto connection1 = addr->connect().wait(io.waitScope);
+  auto client1 = newHttpClient(table, *connection1);
+  auto response1 = client1->request(HttpMethod::GET, "/1", HttpHeaders(table)).response
+      .wait(io.waitScope);
+  KJ_EXPECT(response1.body->readAllText().wait(io.waitScope) == "null:/1");
+  KJ_EXPECT(server.getLoad().connections == 1);
+  KJ_EXPECT(server.getLoad().acceptPaused);
+
+  // The second connection sits in the listen backlog, unanswered.
+  auto connection2 = addr->connect().wait(io.waitScope);
+  auto client2 = newHttpClient(table, *connection2);
+  auto response2 = client2->request(HttpMethod::GET, "/2", HttpHeaders(table)).response;
+  KJ_EXPECT(!response2.poll(io.waitScope));
+
+  // Closing the first connection lets the server accept the second.
+  client1 = nullptr;
+  connection1 = nullptr;
+  KJ_EXPECT(response2.wait(io.waitScope).body->readAllText().wait(io.waitScope) == "null:/2");
+  KJ_EXPECT(server.getLoad().connections == 1);
+}
+
 KJ_TEST("HttpClient to capnproto.org") {
   auto io = kj::setupAsyncIo();
 
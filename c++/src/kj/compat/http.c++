@@ -23,11 +23,18 @@
 #include "url.h"
 #include <kj/debug.h>
 #include <kj/parse/char.h>
-#include <unordered_map>
+#include <kj/map.h>
 #include <stdlib.h>
 #include <kj/encoding.h>
 #include <deque>
 #include <map>
+#include <algorithm>
+#if KJ_HAS_ZLIB
+#include <zlib.h>
+#endif
+#if __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace kj {
 
@@ -509,9 +516,9 @@ kj::StringPtr HttpHeaderId::toString() const {
 
 namespace {
 
-struct HeaderNameHash {
-  size_t operator()(kj::StringPtr s) const {
-    size_t result = 5381;
+struct HeaderNameCallbacks {
+  uint hashCode(kj::StringPtr s) const {
+    uint result = 5381;
     for (byte b: s.asBytes()) {
       // Masking bit 0x20 makes our hash case-insensitive while conveniently avoiding any
       // collisions that would matter for header names.
@@ -520,7 +527,7 @@ struct HeaderNameHash {
     return result;
   }
 
-  bool operator()(kj::StringPtr a, kj::StringPtr b) const {
+  bool matches(kj::StringPtr a, kj::StringPtr b) const {
     // TODO(perf): I wonder if we can beat strcasecmp() by masking bit 0x20 from each byte. We'd
     //   need to prohibit one of the technically-legal characters '^' or '~' from header names
     //   since they'd otherwise be ambiguous, but otherwise there is no ambiguity.
@@ -535,41 +542,148 @@ struct HeaderNameHash {
 }  // namespace
 
 struct HttpHeaderTable::IdsByNameMap {
-  // TODO(perf): If we were cool we could maybe use a perfect hash here, since our hashtable is
-  //   static once built.
+  kj::HashMap<kj::StringPtr, uint, HeaderNameCallbacks> map;
+  // All header names. Used while the table is being built, and as a fallback in the unlikely
+  // event that we can't find a perfect hash.
+
+  // Once the table is built, it never changes, so we construct a perfect hash over it using the
+  // "hash and displace" technique: each name's 64-bit hash picks a bucket, and each bucket has a
+  // seed chosen such that mixing it with the name's hash gives every name a distinct slot. A
+  // lookup thus costs one pass over the name plus one comparison.
+  kj::Array<uint> seeds;   // one per bucket
+  kj::Array<uint> slots;   // header ID + 1, or zero if empty; size is a power of two
+  bool perfect = false;
+
+  static uint64_t hash(kj::StringPtr name) {
+    // Case-insensitive FNV-1a. See HeaderNameCallbacks for why masking 0x20 is OK.
+    uint64_t result = 0xcbf29ce484222325ull;
+    for (byte b: name.asBytes()) {
+      result = (result ^ (b & ~0x20)) * 0x100000001b3ull;
+    }
+    return result;
+  }
+
+  inline uint slotFor(uint64_t h) const {
+    uint64_t x = h ^ (seeds[h % seeds.size()] * 0x9e3779b97f4a7c15ull);
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    return x & (slots.size() - 1);
+  }
 
-  std::unordered_map<kj::StringPtr, uint, HeaderNameHash, HeaderNameHash> map;
+  void buildPerfectHash(kj::ArrayPtr<const kj::StringPtr> names);
+  kj::Maybe<uint> find(kj::StringPtr name, kj::ArrayPtr<const kj::StringPtr> names) const;
 };
 
+void HttpHeaderTable::IdsByNameMap::buildPerfectHash(kj::ArrayPtr<const kj::StringPtr> names) {
+  perfect = false;
+
+  uint slotCount = 1;
+  while (slotCount < names.size() * 2) slotCount *= 2;
+  slots = kj::heapArray<uint>(slotCount);
+  seeds = kj::heapArray<uint>((names.size() + 3) / 4 + 1);
+  for (auto& slot: slots) slot = 0;
+  for (auto& seed: seeds) seed = 0;
+
+  auto hashes = kj::heapArray<uint64_t>(names.size());
+  kj::Vector<kj::Vector<uint>> buckets(seeds.size());
+  buckets.resize(seeds.size());
+  for (auto i: kj::indices(names)) {
+    hashes[i] = hash(names[i]);
+    buckets[hashes[i] % seeds.size()].add(i);
+  }
+
+  // Place the largest buckets first, while the table is emptiest.
+  auto order = KJ_MAP(i, kj::indices(buckets)) -> uint { return i; };
+  std::sort(order.begin(), order.end(), [&](uint a, uint b) {
+    return buckets[a].size() > buckets[b].size();
+  });
+
+  kj::Vector<uint> placed;
+  for (uint bucket: order) {
+    if (buckets[bucket].size() == 0) break;
+
+    bool found = false;
+    for (uint seed = 0; seed < 65536 && !found; seed++) {
+      seeds[bucket] = seed;
+      found = true;
+      placed.clear();
+      for (uint id: buckets[bucket]) {
+        uint slot = slotFor(hashes[id]);
+        if (slots[slot] != 0) {
+          found = false;
+          break;
+        }
+        slots[slot] = id + 1;
+        placed.add(slot);
+      }
+      if (!found) {
+        for (uint slot: placed) slots[slot] = 0;
+      }
+    }
+
+    // Two names with the same 64-bit hash can never be separated. Just use the regular map.
+    if (!found) return;
+  }
+
+  perfect = true;
+}
+
+kj::Maybe<uint> HttpHeaderTable::IdsByNameMap::find(
+    kj::StringPtr name, kj::ArrayPtr<const kj::StringPtr> names) const {
+  if (!perfect) {
+    KJ_IF_MAYBE(id, map.find(name)) {
+      return *id;
+    } else {
+      return nullptr;
+    }
+  }
+
+  uint id = slots[slotFor(hash(name))];
+  if (id == 0) return nullptr;
+  kj::StringPtr candidate = names[id - 1];
+  if (candidate.size() != name.size() || !HeaderNameCallbacks().matches(candidate, name)) {
+    return nullptr;
+  }
+  return id - 1;
+}
+
 HttpHeaderTable::Builder::Builder()
     : table(kj::heap<HttpHeaderTable>()) {}
 
 HttpHeaderId HttpHeaderTable::Builder::add(kj::StringPtr name) {
   requireValidHeaderName(name);
 
-  auto insertResult = table->idsByName->map.insert(std::make_pair(name, table->namesById.size()));
-  if (insertResult.second) {
+  table->idsByName->perfect = false;
+  uint id = table->idsByName->map.findOrCreate(name, [&]() {
+    uint newId = table->namesById.size();
     table->namesById.add(name);
-  }
-  return HttpHeaderId(table, insertResult.first->second);
+    return decltype(table->idsByName->map)::Entry { name, newId };
+  });
+  return HttpHeaderId(table, id);
 }
 
 HttpHeaderTable::HttpHeaderTable()
     : idsByName(kj::heap<IdsByNameMap>()) {
 #define ADD_HEADER(id, name) \
   namesById.add(name); \
-  idsByName->map.insert(std::make_pair(name, BuiltinHeaderIndices::id));
+  idsByName->map.insert(name, BuiltinHeaderIndices::id);
   KJ_HTTP_FOR_EACH_BUILTIN_HEADER(ADD_HEADER);
 #undef ADD_HEADER
+  idsByName->buildPerfectHash(namesById);
+}
+
+kj::Own<HttpHeaderTable> HttpHeaderTable::Builder::build() {
+  table->idsByName->buildPerfectHash(table->namesById);
+  return kj::mv(table);
 }
 HttpHeaderTable::~HttpHeaderTable() noexcept(false) {}
 
 kj::Maybe<HttpHeaderId> HttpHeaderTable::stringToId(kj::StringPtr name) const {
-  auto iter = idsByName->map.find(name);
-  if (iter == idsByName->map.end()) {
-    return nullptr;
+  KJ_IF_MAYBE(id, idsByName->find(name, namesById)) {
+    return HttpHeaderId(this, *id);
   } else {
-    return HttpHeaderId(this, iter->second);
+    return nullptr;
   }
 }
 
@@ -585,23 +699,51 @@ void HttpHeaders::clear() {
   }
 
   unindexedHeaders.clear();
+
+  // Strings we own (e.g. values merged from duplicate headers) belong to the previous message.
+  // Dropping them here keeps a long-lived HttpHeaders (one per connection) from accumulating
+  // them across keep-alive requests; the vector keeps its capacity.
+  ownedStrings.clear();
 }
 
 HttpHeaders HttpHeaders::clone() const {
   HttpHeaders result(*table);
 
+  // Copy every referenced string into a single NUL-separated buffer rather than allocating each
+  // one separately.
+  size_t total = 0;
+  for (auto& header: indexedHeaders) {
+    if (header != nullptr) total += header.size() + 1;
+  }
+  for (auto& header: unindexedHeaders) {
+    total += header.name.size() + header.value.size() + 2;
+  }
+
+  auto buffer = kj::heapArray<char>(total);
+  char* pos = buffer.begin();
+  auto copy = [&](kj::StringPtr str) {
+    char* begin = pos;
+    memcpy(pos, str.begin(), str.size());
+    pos += str.size();
+    *pos++ = '\0';
+    return kj::StringPtr(begin, str.size());
+  };
+
   for (auto i: kj::indices(indexedHeaders)) {
     if (indexedHeaders[i] != nullptr) {
-      result.indexedHeaders[i] = result.cloneToOwn(indexedHeaders[i]);
+      result.indexedHeaders[i] = copy(indexedHeaders[i]);
     }
   }
 
   result.unindexedHeaders.resize(unindexedHeaders.size());
   for (auto i: kj::indices(unindexedHeaders)) {
-    result.unindexedHeaders[i].name = result.cloneToOwn(unindexedHeaders[i].name);
-    result.unindexedHeaders[i].value = result.cloneToOwn(unindexedHeaders[i].value);
+    result.unindexedHeaders[i].name = copy(unindexedHeaders[i].name);
+    result.unindexedHeaders[i].value = copy(unindexedHeaders[i].value);
   }
 
+  KJ_ASSERT(pos == buffer.end());
+  if (total > 0) result.ownedStrings.add(kj::mv(buffer));
+
   return result;
 }
 
@@ -622,13 +764,6 @@ HttpHeaders HttpHeaders::cloneShallow() const {
   return result;
 }
 
-kj::StringPtr HttpHeaders::cloneToOwn(kj::StringPtr str) {
-  auto copy = kj::heapString(str);
-  kj::StringPtr result = copy;
-  ownedStrings.add(copy.releaseArray());
-  return result;
-}
-
 void HttpHeaders::set(HttpHeaderId id, kj::StringPtr value) {
   id.requireFrom(*table);
   requireValidHeaderValue(value);
@@ -751,11 +886,35 @@ static kj::Maybe<uint> consumeNumber(char*& ptr) {
   }
 }
 
-static kj::StringPtr consumeLine(char*& ptr) {
+static inline char* findLineBreak(char* p, const char* bufferEnd) {
+  // Returns a pointer to the first '\r', '\n', or '\0' at or after `p`. `*bufferEnd` must be
+  // '\0'; it bounds the search, and lets us scan 16 bytes at a time without reading past the
+  // buffer.
+
+#if __SSE2__
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  const __m128i nul = _mm_setzero_si128();
+  while (bufferEnd + 1 - p >= 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    int mask = _mm_movemask_epi8(_mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, lf)),
+        _mm_cmpeq_epi8(chunk, nul)));
+    if (mask != 0) return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+
+  while (*p != '\0' && *p != '\r' && *p != '\n') ++p;
+  return p;
+}
+
+static kj::StringPtr consumeLine(char*& ptr, const char* bufferEnd) {
   char* start = skipSpace(ptr);
   char* p = start;
 
   for (;;) {
+    p = findLineBreak(p, bufferEnd);
     switch (*p) {
       case '\0':
         ptr = p;
@@ -798,8 +957,7 @@ static kj::StringPtr consumeLine(char*& ptr) {
       }
 
       default:
-        ++p;
-        break;
+        KJ_UNREACHABLE;
     }
   }
 }
@@ -866,7 +1024,7 @@ kj::Maybe<HttpHeaders::Request> HttpHeaders::tryParseRequest(kj::ArrayPtr<char>
   }
 
   // Ignore rest of line. Don't care about "HTTP/1.1" or whatever.
-  consumeLine(ptr);
+  consumeLine(ptr, end);
 
   if (!parseHeaders(ptr, end)) return nullptr;
 
@@ -893,7 +1051,7 @@ kj::Maybe<HttpHeaders::Response> HttpHeaders::tryParseResponse(kj::ArrayPtr<char
     return nullptr;
   }
 
-  response.statusText = consumeLine(ptr);
+  response.statusText = consumeLine(ptr, end);
 
   if (!parseHeaders(ptr, end)) return nullptr;
 
@@ -903,7 +1061,7 @@ kj::Maybe<HttpHeaders::Response> HttpHeaders::tryParseResponse(kj::ArrayPtr<char
 bool HttpHeaders::parseHeaders(char* ptr, char* end) {
   while (*ptr != '\0') {
     KJ_IF_MAYBE(name, consumeHeaderName(ptr)) {
-      kj::StringPtr line = consumeLine(ptr);
+      kj::StringPtr line = consumeLine(ptr, end);
       addNoCheck(*name, line);
     } else {
       return false;
@@ -1153,6 +1311,26 @@ public:
     }
   }
 
+  Promise<uint64_t> pumpTo(kj::AsyncOutputStream& output, uint64_t amount) {
+    // Pump message body data. Once the leftover buffer is written, this pumps straight from the
+    // underlying stream, so that e.g. a relay between two sockets can avoid copying through user
+    // space.
+
+    KJ_REQUIRE(onMessageDone != nullptr);
+
+    if (leftover == nullptr) {
+      return inner.pumpTo(output, amount);
+    }
+
+    size_t n = kj::min(amount, leftover.size());
+    auto data = leftover.slice(0, n);
+    leftover = leftover.slice(n, leftover.size());
+    return output.write(data.begin(), n).then([this,&output,amount,n]() -> Promise<uint64_t> {
+      if (n == amount) return uint64_t(n);
+      return inner.pumpTo(output, amount - n).then([n](uint64_t m) { return n + m; });
+    });
+  }
+
   enum RequestOrResponse {
     REQUEST,
     RESPONSE
@@ -1171,6 +1349,12 @@ public:
     return { headerBuffer.releaseAsBytes(), leftover.asBytes() };
   }
 
+  kj::ArrayPtr<const char> peekBuffered() {
+    // Returns what has been read from the stream but not yet consumed, e.g. after
+    // awaitNextMessage() returns true.
+    return leftover;
+  }
+
 private:
   AsyncIoStream& inner;
   kj::Array<char> headerBuffer;
@@ -1412,6 +1596,18 @@ public:
       return amount;
     });
   }
+
+  Promise<uint64_t> pumpTo(AsyncOutputStream& output, uint64_t amount) override {
+    if (alreadyDone()) return uint64_t(0);
+
+    return inner.pumpTo(output, amount)
+        .then([=](uint64_t actual) {
+      if (actual < amount) {
+        doneReading();
+      }
+      return actual;
+    });
+  }
 };
 
 class HttpFixedLengthEntityReader final: public HttpEntityBodyReader {
@@ -1443,6 +1639,23 @@ public:
     });
   }
 
+  Promise<uint64_t> pumpTo(AsyncOutputStream& output, uint64_t amount) override {
+    if (length == 0) return uint64_t(0);
+
+    uint64_t requested = kj::min(amount, length);
+    return inner.pumpTo(output, requested)
+        .then([this,requested](uint64_t actual) {
+      length -= actual;
+      if (actual < requested) {
+        kj::throwRecoverableException(KJ_EXCEPTION(DISCONNECTED,
+            "premature EOF in HTTP entity body; did not reach Content-Length"));
+      } else if (length == 0) {
+        doneReading();
+      }
+      return actual;
+    });
+  }
+
 private:
   size_t length;
 };
@@ -1596,40 +1809,51 @@ public:
     KJ_REQUIRE(!inBody, "previous HTTP message body incomplete; can't write more messages");
     inBody = true;
 
-    queueWrite(kj::mv(content));
+    getBatch().add(kj::mv(content));
   }
 
   void writeBodyData(kj::String content) {
     KJ_REQUIRE(inBody) { return; }
 
-    queueWrite(kj::mv(content));
+    getBatch().add(kj::mv(content));
   }
 
   kj::Promise<void> writeBodyData(const void* buffer, size_t size) {
     KJ_REQUIRE(inBody) { return kj::READY_NOW; }
 
-    auto fork = writeQueue.then([this,buffer,size]() {
-      return inner.write(buffer, size);
-    }).fork();
-
-    writeQueue = fork.addBranch();
-    return fork.addBranch();
+    getBatch().add(kj::arrayPtr(reinterpret_cast<const byte*>(buffer), size));
+    return batchDone();
   }
 
   kj::Promise<void> writeBodyData(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) {
     KJ_REQUIRE(inBody) { return kj::READY_NOW; }
 
-    auto fork = writeQueue.then([this,pieces]() {
-      return inner.write(pieces);
-    }).fork();
+    getBatch().pieces.addAll(pieces);
+    return batchDone();
+  }
 
-    writeQueue = fork.addBranch();
-    return fork.addBranch();
+  kj::Promise<void> writeFramedBodyData(
+      kj::String header, kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces,
+      kj::StringPtr trailer) {
+    // Writes `header`, then `pieces`, then `trailer` (which must be a constant), all in the same
+    // write. Used for chunked encoding.
+
+    KJ_REQUIRE(inBody) { return kj::READY_NOW; }
+
+    auto& batch = getBatch();
+    batch.add(kj::mv(header));
+    batch.pieces.addAll(pieces);
+    batch.pieces.add(trailer.asBytes());
+    return batchDone();
   }
 
   Promise<uint64_t> pumpBodyFrom(AsyncInputStream& input, uint64_t amount) {
     KJ_REQUIRE(inBody) { return uint64_t(0); }
 
+    // The pump must start after the current batch has been written, so nothing more may be added
+    // to that batch.
+    openBatch = nullptr;
+
     auto fork = writeQueue.then([this,&input,amount]() {
       return input.pumpTo(inner, amount);
     }).fork();
@@ -1651,6 +1875,7 @@ public:
     inBody = false;
     broken = true;
 
+    openBatch = nullptr;
     writeQueue = writeQueue.then([]() -> kj::Promise<void> {
       return KJ_EXCEPTION(FAILED,
           "previous HTTP message body incomplete; can't write more messages");
@@ -1664,16 +1889,56 @@ public:
   }
 
 private:
+  struct WriteBatch {
+    // Data queued within one event loop turn, to be written with a single `write(pieces)` call
+    // once everything previously queued has been written.
+
+    kj::SmallVector<kj::ArrayPtr<const byte>, 4> pieces;
+    kj::SmallVector<kj::String, 2> strings;
+    // `pieces` can point into `strings` or into caller-owned buffers.
+
+    void add(kj::ArrayPtr<const byte> piece) {
+      if (piece.size() > 0) pieces.add(piece);
+    }
+    void add(kj::String content) {
+      add(content.asBytes());
+      strings.add(kj::mv(content));
+    }
+  };
+
   AsyncOutputStream& inner;
   kj::Promise<void> writeQueue = kj::READY_NOW;
   bool inBody = false;
   bool broken = false;
 
-  void queueWrite(kj::String content) {
-    writeQueue = writeQueue.then(kj::mvCapture(content, [this](kj::String&& content) {
-      auto promise = inner.write(content.begin(), content.size());
-      return promise.attach(kj::mv(content));
-    }));
+  kj::Maybe<WriteBatch&> openBatch;
+  kj::Maybe<kj::ForkedPromise<void>> openBatchDone;
+  // The batch that new writes are added to, and a promise for its completion. Null once the batch
+  // has been handed to `inner`, or if something that isn't a plain write was queued after it.
+
+  WriteBatch& getBatch() {
+    KJ_IF_MAYBE(batch, openBatch) {
+      return *batch;
+    }
+
+    auto batch = kj::heap<WriteBatch>();
+    auto& result = *batch;
+    auto fork = writeQueue.then(kj::mvCapture(batch, [this](kj::Own<WriteBatch>&& batch) {
+      KJ_IF_MAYBE(b, openBatch) {
+        if (b == batch.get()) openBatch = nullptr;
+      }
+      if (batch->pieces.size() == 0) return kj::Promise<void>(kj::READY_NOW);
+      auto promise = inner.write(batch->pieces.asPtr());
+      return promise.attach(kj::mv(batch));
+    })).fork();
+    writeQueue = fork.addBranch();
+    openBatch = result;
+    openBatchDone = kj::mv(fork);
+    return result;
+  }
+
+  kj::Promise<void> batchDone() {
+    return KJ_ASSERT_NONNULL(openBatchDone).addBranch();
   }
 };
 
@@ -1800,14 +2065,9 @@ public:
   Promise<void> write(const void* buffer, size_t size) override {
     if (size == 0) return kj::READY_NOW;  // can't encode zero-size chunk since it indicates EOF.
 
-    auto header = kj::str(kj::hex(size), "\r\n");
-    auto parts = kj::heapArray<ArrayPtr<const byte>>(3);
-    parts[0] = header.asBytes();
-    parts[1] = kj::arrayPtr(reinterpret_cast<const byte*>(buffer), size);
-    parts[2] = kj::StringPtr("\r\n").asBytes();
-
-    auto promise = inner.writeBodyData(parts.asPtr());
-    return promise.attach(kj::mv(header), kj::mv(parts));
+    auto piece = kj::arrayPtr(reinterpret_cast<const byte*>(buffer), size);
+    return inner.writeFramedBodyData(kj::str(kj::hex(size), "\r\n"), kj::arrayPtr(&piece, 1),
+                                     "\r\n");
   }
 
   Promise<void> write(ArrayPtr<const ArrayPtr<const byte>> pieces) override {
@@ -1816,17 +2076,7 @@ public:
 
     if (size == 0) return kj::READY_NOW;  // can't encode zero-size chunk since it indicates EOF.
 
-    auto header = kj::str(size, "\r\n");
-    auto partsBuilder = kj::heapArrayBuilder<ArrayPtr<const byte>>(pieces.size());
-    partsBuilder.add(header.asBytes());
-    for (auto& piece: pieces) {
-      partsBuilder.add(piece);
-    }
-    partsBuilder.add(kj::StringPtr("\r\n").asBytes());
-
-    auto parts = partsBuilder.finish();
-    auto promise = inner.writeBodyData(parts.asPtr());
-    return promise.attach(kj::mv(header), kj::mv(parts));
+    return inner.writeFramedBodyData(kj::str(kj::hex(size), "\r\n"), pieces, "\r\n");
   }
 
   Maybe<Promise<uint64_t>> tryPumpFrom(AsyncInputStream& input, uint64_t amount) override {
@@ -1860,16 +2110,405 @@ private:
 
 // =======================================================================================
 
+// -----------------------------------------------------------------------------
+// permessage-deflate (RFC 7692)
+
+constexpr uint MIN_DEFLATE_WINDOW_BITS = 9;
+constexpr uint MAX_DEFLATE_WINDOW_BITS = 15;
+// RFC 7692 permits windows as small as 2^8, but zlib's raw deflate refuses windowBits = 8. We never
+// offer such windows; if the peer imposes one on us, we simply don't compress what we send (which
+// the RFC allows, since each message says whether it's compressed).
+
+constexpr size_t ZLIB_STATE_OVERHEAD = 16 << 10;
+// Approximate fixed size of a deflate state plus an inflate state, excluding the window and hash
+// tables.
+
+inline uint deflateMemLevel(uint windowBits) {
+  // Scale the hash table with the window: zlib's default memLevel of 8 goes with a 15-bit window.
+  return kj::max(windowBits, 8u) - 7;
+}
+
+inline size_t zlibMemoryUsage(uint outboundWindowBits, uint inboundWindowBits) {
+  // Per zlib.h: deflate uses (1 << (windowBits + 2)) + (1 << (memLevel + 9)) bytes and inflate
+  // uses (1 << windowBits) bytes, each plus a few kilobytes.
+  return (size_t(1) << (outboundWindowBits + 2))
+       + (size_t(1) << (deflateMemLevel(outboundWindowBits) + 9))
+       + (size_t(1) << inboundWindowBits)
+       + ZLIB_STATE_OVERHEAD;
+}
+
+kj::Maybe<uint> fitDeflateWindowBits(const WebSocketCompressionSettings& settings) {
+  // Returns the largest window, no larger than requested, that both directions can use within the
+  // memory budget, or null if compression should not be negotiated at all.
+
+#if !KJ_HAS_ZLIB
+  return nullptr;
+#endif
+
+  uint bits = kj::min(kj::max(settings.maxWindowBits, MIN_DEFLATE_WINDOW_BITS),
+                      MAX_DEFLATE_WINDOW_BITS);
+  if (settings.memoryBudget == 0) return bits;
+
+  for (; bits >= MIN_DEFLATE_WINDOW_BITS; --bits) {
+    if (zlibMemoryUsage(bits, bits) <= settings.memoryBudget) return bits;
+  }
+  return nullptr;
+}
+
+struct DeflateExtensionParams {
+  // One permessage-deflate offer or response, as it appears in a Sec-WebSocket-Extensions header.
+
+  bool serverNoContextTakeover = false;
+  bool clientNoContextTakeover = false;
+  kj::Maybe<uint> serverMaxWindowBits;
+  bool hasClientMaxWindowBits = false;
+  kj::Maybe<uint> clientMaxWindowBits;
+  // `client_max_window_bits` may appear in an offer without a value.
+};
+
+kj::ArrayPtr<const char> trimWhitespace(kj::ArrayPtr<const char> text) {
+  auto begin = text.begin();
+  auto end = text.end();
+  while (begin < end && (*begin == ' ' || *begin == '\t')) ++begin;
+  while (end > begin && (end[-1] == ' ' || end[-1] == '\t')) --end;
+  return kj::arrayPtr(begin, end);
+}
+
+kj::SmallVector<kj::ArrayPtr<const char>, 4> splitOn(
+    char delimiter, kj::ArrayPtr<const char> text) {
+  kj::SmallVector<kj::ArrayPtr<const char>, 4> result;
+  auto start = text.begin();
+  for (auto p = text.begin(); p != text.end(); ++p) {
+    if (*p == delimiter) {
+      result.add(trimWhitespace(kj::arrayPtr(start, p)));
+      start = p + 1;
+    }
+  }
+  result.add(trimWhitespace(kj::arrayPtr(start, text.end())));
+  return result;
+}
+
+kj::Maybe<uint> parseWindowBits(kj::ArrayPtr<const char> text) {
+  if (text.size() >= 2 && text.front() == '"' && text.back() == '"') {
+    text = text.slice(1, text.size() - 1);
+  }
+  if (text.size() == 0 || text.size() > 2) return nullptr;
+  uint result = 0;
+  for (char c: text) {
+    if (c < '0' || c > '9') return nullptr;
+    result = result * 10 + (c - '0');
+  }
+  if (result < 8 || result > MAX_DEFLATE_WINDOW_BITS) return nullptr;
+  return result;
+}
+
+kj::Maybe<DeflateExtensionParams> parseDeflateExtension(kj::ArrayPtr<const char> extension) {
+  // Parses one element of a Sec-WebSocket-Extensions list. Returns null if it isn't a
+  // well-formed permessage-deflate offer or response.
+
+  auto parts = splitOn(';', extension);
+  if (parts[0] != "permessage-deflate"_kj) return nullptr;
+
+  DeflateExtensionParams result;
+  bool seenServerWindow = false;
+  for (auto& part: parts.slice(1, parts.size())) {
+    kj::ArrayPtr<const char> name = part;
+    kj::Maybe<kj::ArrayPtr<const char>> value;
+    for (auto& c: part) {
+      if (c == '=') {
+        name = trimWhitespace(kj::arrayPtr(part.begin(), &c));
+        value = trimWhitespace(kj::arrayPtr(&c + 1, part.end()));
+        break;
+      }
+    }
+
+    // Each parameter may appear at most once.
+    if (name == "server_no_context_takeover"_kj) {
+      if (value != nullptr || result.serverNoContextTakeover) return nullptr;
+      result.serverNoContextTakeover = true;
+    } else if (name == "client_no_context_takeover"_kj) {
+      if (value != nullptr || result.clientNoContextTakeover) return nullptr;
+      result.clientNoContextTakeover = true;
+    } else if (name == "server_max_window_bits"_kj) {
+      if (seenServerWindow) return nullptr;
+      seenServerWindow = true;
+      KJ_IF_MAYBE(v, value) {
+        result.serverMaxWindowBits = parseWindowBits(*v);
+        if (result.serverMaxWindowBits == nullptr) return nullptr;
+      } else {
+        return nullptr;
+      }
+    } else if (name == "client_max_window_bits"_kj) {
+      if (result.hasClientMaxWindowBits) return nullptr;
+      result.hasClientMaxWindowBits = true;
+      KJ_IF_MAYBE(v, value) {
+        result.clientMaxWindowBits = parseWindowBits(*v);
+        if (result.clientMaxWindowBits == nullptr) return nullptr;
+      }
+    } else {
+      return nullptr;
+    }
+  }
+
+  return result;
+}
+
+kj::String composeDeflateOffer(const WebSocketCompressionSettings& settings, uint windowBits) {
+  // Client side: the Sec-WebSocket-Extensions header offering compression.
+
+  kj::Vector<kj::String> parts;
+  parts.add(kj::str("permessage-deflate"));
+  if (!settings.contextTakeover) {
+    parts.add(kj::str("client_no_context_takeover"));
+    parts.add(kj::str("server_no_context_takeover"));
+  }
+  if (windowBits < MAX_DEFLATE_WINDOW_BITS) {
+    parts.add(kj::str("client_max_window_bits=", windowBits));
+    parts.add(kj::str("server_max_window_bits=", windowBits));
+  } else {
+    parts.add(kj::str("client_max_window_bits"));
+  }
+  return kj::strArray(parts, "; ");
+}
+
+WebSocketCompressionParameters acceptDeflateResponse(
+    const WebSocketCompressionSettings& settings, uint windowBits, kj::StringPtr header) {
+  // Client side: checks the server's response to our offer from composeDeflateOffer().
+
+  auto extensions = splitOn(',', header);
+  KJ_REQUIRE(extensions.size() == 1,
+      "server accepted WebSocket extensions that weren't offered", header);
+  auto response = KJ_REQUIRE_NONNULL(parseDeflateExtension(extensions[0]),
+      "server returned invalid Sec-WebSocket-Extensions header", header);
+
+  WebSocketCompressionParameters result;
+  result.outboundNoContextTakeover = response.clientNoContextTakeover || !settings.contextTakeover;
+  result.inboundNoContextTakeover = response.serverNoContextTakeover;
+
+  KJ_IF_MAYBE(bits, response.clientMaxWindowBits) {
+    result.outboundMaxWindowBits = kj::min(*bits, windowBits);
+  } else {
+    KJ_REQUIRE(!response.hasClientMaxWindowBits,
+        "server returned client_max_window_bits without a value", header);
+    result.outboundMaxWindowBits = windowBits;
+  }
+
+  KJ_IF_MAYBE(bits, response.serverMaxWindowBits) {
+    result.inboundMaxWindowBits = *bits;
+  }
+  KJ_REQUIRE(result.inboundMaxWindowBits <= windowBits,
+      "server ignored our server_max_window_bits", header);
+
+  return result;
+}
+
+kj::Maybe<WebSocketCompressionParameters> acceptDeflateOffer(
+    const WebSocketCompressionSettings& settings, kj::StringPtr header,
+    kj::String& responseHeader) {
+  // Server side: picks the first acceptable permessage-deflate offer, if any, and fills in
+  // `responseHeader` with our answer.
+
+  uint windowBits;
+  KJ_IF_MAYBE(bits, fitDeflateWindowBits(settings)) {
+    windowBits = *bits;
+  } else {
+    return nullptr;
+  }
+
+  for (auto& extension: splitOn(',', header)) {
+    KJ_IF_MAYBE(offer, parseDeflateExtension(extension)) {
+      WebSocketCompressionParameters result;
+      kj::Vector<kj::String> parts;
+      parts.add(kj::str("permessage-deflate"));
+
+      result.outboundNoContextTakeover = offer->serverNoContextTakeover || !settings.contextTakeover;
+      if (result.outboundNoContextTakeover) parts.add(kj::str("server_no_context_takeover"));
+
+      result.inboundNoContextTakeover = offer->clientNoContextTakeover || !settings.contextTakeover;
+      if (result.inboundNoContextTakeover) parts.add(kj::str("client_no_context_takeover"));
+
+      result.outboundMaxWindowBits = kj::min(
+          offer->serverMaxWindowBits.orDefault(MAX_DEFLATE_WINDOW_BITS), windowBits);
+      if (offer->serverMaxWindowBits != nullptr ||
+          result.outboundMaxWindowBits < MAX_DEFLATE_WINDOW_BITS) {
+        parts.add(kj::str("server_max_window_bits=", result.outboundMaxWindowBits));
+      }
+
+      if (offer->hasClientMaxWindowBits) {
+        result.inboundMaxWindowBits = kj::min(
+            offer->clientMaxWindowBits.orDefault(MAX_DEFLATE_WINDOW_BITS), windowBits);
+        parts.add(kj::str("client_max_window_bits=", result.inboundMaxWindowBits));
+      } else {
+        // The client can't limit its window, so it may use the maximum.
+        result.inboundMaxWindowBits = MAX_DEFLATE_WINDOW_BITS;
+      }
+
+      if (settings.memoryBudget != 0 &&
+          zlibMemoryUsage(result.outboundMaxWindowBits, result.inboundMaxWindowBits) >
+              settings.memoryBudget) {
+        continue;
+      }
+
+      responseHeader = kj::strArray(parts, "; ");
+      return result;
+    }
+  }
+
+  return nullptr;
+}
+
+#if KJ_HAS_ZLIB
+
+class ZlibContext {
+  // One direction of permessage-deflate: a raw deflate compressor or decompressor. zlib state is
+  // allocated on first use; without context takeover it is freed again after every message, so
+  // idle connections hold none.
+
+public:
+  enum Mode { COMPRESS, DECOMPRESS };
+
+  ZlibContext(Mode mode, uint windowBits, bool contextTakeover)
+      : mode(mode), windowBits(windowBits), contextTakeover(contextTakeover) {}
+  ~ZlibContext() noexcept(false) { release(); }
+  KJ_DISALLOW_COPY(ZlibContext);
+
+  kj::Array<byte> processMessage(kj::ArrayPtr<const byte> message, bool addNul) {
+    // Compresses or decompresses one whole message. When compressing, the trailing empty stored
+    // block produced by Z_SYNC_FLUSH is removed as RFC 7692 requires; when decompressing it is
+    // put back. If `addNul` is true, a NUL terminator is appended to the result.
+
+    if (!initialized) init();
+
+    kj::Vector<byte> result(mode == COMPRESS ? message.size() / 2 + 16 : message.size() * 4 + 16);
+    if (mode == COMPRESS) {
+      ctx.next_in = const_cast<byte*>(message.begin());
+      ctx.avail_in = message.size();
+      do {
+        ctx.next_out = chunk;
+        ctx.avail_out = sizeof(chunk);
+        int rc = deflate(&ctx, Z_SYNC_FLUSH);
+        KJ_ASSERT(rc == Z_OK || rc == Z_BUF_ERROR, "deflate() failed", rc);
+        result.addAll(chunk, ctx.next_out);
+      } while (ctx.avail_out == 0);
+
+      if (result.size() == 0) {
+        // zlib won't flush twice in a row without new input, so an empty message following
+        // another message produces nothing. RFC 7692 section 7.2.3.6: an empty message may be
+        // sent as a single 0x00 byte, which the trailer turns into an empty stored block.
+        result.add(0);
+      } else {
+        KJ_ASSERT(result.size() >= sizeof(DEFLATE_TRAILER));
+        result.truncate(result.size() - sizeof(DEFLATE_TRAILER));
+      }
+    } else {
+      kj::ArrayPtr<const byte> inputs[2] = { message, DEFLATE_TRAILER };
+      for (auto input: inputs) {
+        ctx.next_in = const_cast<byte*>(input.begin());
+        ctx.avail_in = input.size();
+        int rc;
+        do {
+          ctx.next_out = chunk;
+          ctx.avail_out = sizeof(chunk);
+          rc = inflate(&ctx, Z_SYNC_FLUSH);
+          KJ_REQUIRE(rc == Z_OK || rc == Z_BUF_ERROR || rc == Z_STREAM_END,
+                     "invalid compressed WebSocket message", rc);
+          result.addAll(chunk, ctx.next_out);
+        } while (rc == Z_OK && (ctx.avail_in > 0 || ctx.avail_out == 0));
+
+        if (rc == Z_STREAM_END) {
+          // The sender ended the deflate stream (BFINAL) rather than just flushing it. Anything
+          // after that isn't part of it, and the next message starts a fresh stream.
+          inflateReset(&ctx);
+          break;
+        }
+      }
+    }
+
+    if (addNul) result.add('\0');
+    if (!contextTakeover) release();
+    return result.releaseAsArray();
+  }
+
+private:
+  Mode mode;
+  uint windowBits;
+  bool contextTakeover;
+  bool initialized = false;
+  z_stream ctx;
+  byte chunk[4096];
+
+  static constexpr byte DEFLATE_TRAILER[4] = { 0x00, 0x00, 0xff, 0xff };
+
+  void init() {
+    memset(&ctx, 0, sizeof(ctx));
+    // Negative windowBits ask zlib for raw deflate, without the zlib header and checksum.
+    if (mode == COMPRESS) {
+      KJ_ASSERT(deflateInit2(&ctx, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -int(windowBits),
+                             deflateMemLevel(windowBits), Z_DEFAULT_STRATEGY) == Z_OK);
+    } else {
+      KJ_ASSERT(inflateInit2(&ctx, -int(windowBits)) == Z_OK);
+    }
+    initialized = true;
+  }
+
+  void release() {
+    if (initialized) {
+      if (mode == COMPRESS) {
+        deflateEnd(&ctx);
+      } else {
+        inflateEnd(&ctx);
+      }
+      initialized = false;
+    }
+  }
+};
+
+constexpr byte ZlibContext::DEFLATE_TRAILER[4];
+
+#else  // KJ_HAS_ZLIB
+
+class ZlibContext {
+  // Stand-in when KJ is built without zlib; compression can never be enabled.
+
+public:
+  enum Mode { COMPRESS, DECOMPRESS };
+
+  ZlibContext(Mode mode, uint windowBits, bool contextTakeover) {
+    KJ_FAIL_REQUIRE("WebSocket compression requires KJ to be built with zlib (KJ_HAS_ZLIB)");
+  }
+
+  kj::Array<byte> processMessage(kj::ArrayPtr<const byte> message, bool addNul) {
+    KJ_UNREACHABLE;
+  }
+};
+
+#endif  // KJ_HAS_ZLIB, else
+
+// -----------------------------------------------------------------------------
+
 class WebSocketImpl final: public WebSocket {
 public:
   WebSocketImpl(kj::Own<kj::AsyncIoStream> stream,
                 kj::Maybe<EntropySource&> maskKeyGenerator,
                 kj::Array<byte> buffer = kj::heapArray<byte>(4096),
                 kj::ArrayPtr<byte> leftover = nullptr,
-                kj::Maybe<kj::Promise<void>> waitBeforeSend = nullptr)
+                kj::Maybe<kj::Promise<void>> waitBeforeSend = nullptr,
+                kj::Maybe<WebSocketCompressionParameters> compression = nullptr)
       : stream(kj::mv(stream)), maskKeyGenerator(maskKeyGenerator),
         sendingPong(kj::mv(waitBeforeSend)),
-        recvBuffer(kj::mv(buffer)), recvData(leftover) {}
+        recvBuffer(kj::mv(buffer)), recvData(leftover) {
+    KJ_IF_MAYBE(c, compression) {
+      KJ_REQUIRE(c->outboundMaxWindowBits >= 8 && c->outboundMaxWindowBits <= 15 &&
+                 c->inboundMaxWindowBits >= 8 && c->inboundMaxWindowBits <= 15,
+                 "invalid permessage-deflate window size");
+      if (c->outboundMaxWindowBits >= MIN_DEFLATE_WINDOW_BITS) {
+        compressor = kj::heap<ZlibContext>(ZlibContext::COMPRESS,
+            c->outboundMaxWindowBits, !c->outboundNoContextTakeover);
+      }
+      decompressor = kj::heap<ZlibContext>(ZlibContext::DECOMPRESS,
+          c->inboundMaxWindowBits, !c->inboundNoContextTakeover);
+    }
+  }
 
   kj::Promise<void> send(kj::ArrayPtr<const byte> message) override {
     return sendImpl(OPCODE_BINARY, message);
@@ -1955,10 +2594,18 @@ public:
 
     auto opcode = recvHeader.getOpcode();
     bool isData = opcode < OPCODE_FIRST_CONTROL;
+    bool isCompressed = recvHeader.isCompressed();
+    if (isCompressed) {
+      KJ_REQUIRE(isData && opcode != OPCODE_CONTINUATION,
+          "only the first frame of a WebSocket data message can be marked compressed");
+      KJ_REQUIRE(decompressor != nullptr,
+          "received compressed WebSocket message, but compression wasn't negotiated");
+    }
     if (opcode == OPCODE_CONTINUATION) {
       KJ_REQUIRE(!fragments.empty(), "unexpected continuation frame in WebSocket");
 
       opcode = fragmentOpcode;
+      isCompressed = fragmentCompressed;
     } else if (isData) {
       KJ_REQUIRE(fragments.empty(), "expected continuation frame in WebSocket");
     }
@@ -1968,8 +2615,9 @@ public:
     kj::Array<byte> message;           // space to allocate
     byte* payloadTarget;               // location into which to read payload (size is payloadLen)
     if (isFin) {
-      // Add space for NUL terminator when allocating text message.
-      size_t amountToAllocate = payloadLen + (opcode == OPCODE_TEXT && isFin);
+      // Add space for NUL terminator when allocating text message. (A compressed message gets
+      // its terminator when decompressed.)
+      size_t amountToAllocate = payloadLen + (opcode == OPCODE_TEXT && !isCompressed);
 
       if (isData && !fragments.empty()) {
         // Final frame of a fragmented message. Gather the fragments.
@@ -1986,6 +2634,7 @@ public:
 
         fragments.clear();
         fragmentOpcode = 0;
+        fragmentCompressed = false;
       } else {
         // Single-frame message.
         message = kj::heapArray<byte>(amountToAllocate);
@@ -2000,13 +2649,14 @@ public:
       if (fragments.empty()) {
         // This is the first fragment, so set the opcode.
         fragmentOpcode = opcode;
+        fragmentCompressed = isCompressed;
       }
     }
 
     Mask mask = recvHeader.getMask();
 
     auto handleMessage = kj::mvCapture(message,
-        [this,opcode,payloadTarget,payloadLen,mask,isFin]
+        [this,opcode,payloadTarget,payloadLen,mask,isFin,isCompressed]
         (kj::Array<byte>&& message) -> kj::Promise<Message> {
       if (!mask.isZero()) {
         mask.apply(kj::arrayPtr(payloadTarget, payloadLen));
@@ -2018,6 +2668,10 @@ public:
         return receive();
       }
 
+      if (isCompressed) {
+        message = KJ_ASSERT_NONNULL(decompressor)->processMessage(message, opcode == OPCODE_TEXT);
+      }
+
       switch (opcode) {
         case OPCODE_CONTINUATION:
           // Shouldn't get here; handled above.
@@ -2107,8 +2761,9 @@ private:
 
   class Header {
   public:
-    kj::ArrayPtr<const byte> compose(bool fin, byte opcode, uint64_t payloadLen, Mask mask) {
-      bytes[0] = (fin ? FIN_MASK : 0) | opcode;
+    kj::ArrayPtr<const byte> compose(bool fin, bool compressed, byte opcode, uint64_t payloadLen,
+                                     Mask mask) {
+      bytes[0] = (fin ? FIN_MASK : 0) | (compressed ? RSV1_MASK : 0) | opcode;
       bool hasMask = !mask.isZero();
 
       size_t fill;
@@ -2160,6 +2815,11 @@ private:
       return bytes[0] & RSV_MASK;
     }
 
+    bool isCompressed() const {
+      // permessage-deflate (RFC 7692) uses RSV1 to mark compressed messages.
+      return bytes[0] & RSV1_MASK;
+    }
+
     byte getOpcode() const {
       return bytes[0] & OPCODE_MASK;
     }
@@ -2222,6 +2882,7 @@ private:
 
     static constexpr byte FIN_MASK = 0x80;
     static constexpr byte RSV_MASK = 0x70;
+    static constexpr byte RSV1_MASK = 0x40;
     static constexpr byte OPCODE_MASK = 0x0f;
 
     static constexpr byte USE_MASK_MASK = 0x80;
@@ -2261,9 +2922,16 @@ private:
   // Perhaps it should be renamed to `blockSend` or `writeQueue`.
 
   uint fragmentOpcode = 0;
+  bool fragmentCompressed = false;
   kj::Vector<kj::Array<byte>> fragments;
   // If `fragments` is non-empty, we've already received some fragments of a message.
-  // `fragmentOpcode` is the original opcode.
+  // `fragmentOpcode` is the original opcode, and `fragmentCompressed` says whether the first
+  // fragment was marked compressed.
+
+  kj::Maybe<kj::Own<ZlibContext>> compressor;
+  kj::Maybe<kj::Own<ZlibContext>> decompressor;
+  // Set if permessage-deflate was negotiated. `compressor` may still be null if the peer limited
+  // our window to a size zlib can't produce, in which case we send uncompressed messages.
 
   kj::Array<byte> recvBuffer;
   kj::ArrayPtr<byte> recvData;
@@ -2286,21 +2954,32 @@ private:
 
     sendClosed = opcode == OPCODE_CLOSE;
 
+    kj::Array<byte> ownMessage;
+    bool compressed = false;
+    if (opcode < OPCODE_FIRST_CONTROL) {
+      KJ_IF_MAYBE(c, compressor) {
+        ownMessage = (*c)->processMessage(message, false);
+        message = ownMessage;
+        compressed = true;
+      }
+    }
+
     Mask mask(maskKeyGenerator);
 
-    kj::Array<byte> ownMessage;
     if (!mask.isZero()) {
-      // Sadness, we have to make a copy to apply the mask.
-      ownMessage = kj::heapArray(message);
+      if (!compressed) {
+        // Sadness, we have to make a copy to apply the mask.
+        ownMessage = kj::heapArray(message);
+      }
       mask.apply(ownMessage);
       message = ownMessage;
     }
 
-    sendParts[0] = sendHeader.compose(true, opcode, message.size(), mask);
+    sendParts[0] = sendHeader.compose(true, compressed, opcode, message.size(), mask);
     sendParts[1] = message;
 
     auto promise = stream->write(sendParts);
-    if (!mask.isZero()) {
+    if (ownMessage != nullptr) {
       promise = promise.attach(kj::mv(ownMessage));
     }
     return promise.then([this]() {
@@ -2339,7 +3018,8 @@ private:
       return kj::READY_NOW;
     }
 
-    sendParts[0] = sendHeader.compose(true, OPCODE_PONG, payload.size(), Mask(maskKeyGenerator));
+    sendParts[0] = sendHeader.compose(true, false, OPCODE_PONG, payload.size(),
+                                      Mask(maskKeyGenerator));
     sendParts[1] = payload;
     return stream->write(sendParts).attach(kj::mv(payload));
   }
@@ -2347,19 +3027,22 @@ private:
 
 kj::Own<WebSocket> upgradeToWebSocket(
     kj::Own<kj::AsyncIoStream> stream, HttpInputStream& httpInput, HttpOutputStream& httpOutput,
-    kj::Maybe<EntropySource&> maskKeyGenerator) {
+    kj::Maybe<EntropySource&> maskKeyGenerator,
+    kj::Maybe<WebSocketCompressionParameters> compression) {
   // Create a WebSocket upgraded from an HTTP stream.
   auto releasedBuffer = httpInput.releaseBuffer();
   return kj::heap<WebSocketImpl>(kj::mv(stream), maskKeyGenerator,
                                  kj::mv(releasedBuffer.buffer), releasedBuffer.leftover,
-                                 httpOutput.flush());
+                                 httpOutput.flush(), compression);
 }
 
 }  // namespace
 
 kj::Own<WebSocket> newWebSocket(kj::Own<kj::AsyncIoStream> stream,
-                                kj::Maybe<EntropySource&> maskKeyGenerator) {
-  return kj::heap<WebSocketImpl>(kj::mv(stream), maskKeyGenerator);
+                                kj::Maybe<EntropySource&> maskKeyGenerator,
+                                kj::Maybe<WebSocketCompressionParameters> compression) {
+  return kj::heap<WebSocketImpl>(kj::mv(stream), maskKeyGenerator,
+                                 kj::heapArray<byte>(4096), nullptr, nullptr, compression);
 }
 
 static kj::Promise<void> pumpWebSocketLoop(WebSocket& from, WebSocket& to) {
@@ -2398,6 +3081,2761 @@ kj::Promise<void> WebSocket::pumpTo(WebSocket& other) {
 }
 
 
+// =======================================================================================
+// HTTP/2 (RFC 7540)
+//
+// HPACK header compression (RFC 7541), framing, and a connection engine which the HTTP/2 client
+// and server each extend. Every request is a stream multiplexed over the one connection, with its
+// own flow control window. Output is batched like HttpOutputStream's: frames queued within one
+// turn of the event loop go out in one write.
+
+namespace {
+
+// -----------------------------------------------------------------------------
+// HPACK Huffman code (RFC 7541 appendix B)
+
+struct HuffmanCodeLength {
+  uint32_t firstCode;
+  // The numerically smallest code of this length. The code is canonical: codes of each length are
+  // consecutive, in the order of their symbols, and follow on from the codes one bit shorter.
+
+  uint16_t count;
+  // The number of codes of this length.
+
+  uint16_t firstSymbol;
+  // Index into HUFFMAN_SYMBOLS of the symbol for `firstCode`.
+};
+
+static const uint32_t HUFFMAN_CODES[256] = {
+  0x00001ff8, 0x007fffd8, 0x0fffffe2, 0x0fffffe3, 0x0fffffe4, 0x0fffffe5, 0x0fffffe6, 0x0fffffe7,
+  0x0fffffe8, 0x00ffffea, 0x3ffffffc, 0x0fffffe9, 0x0fffffea, 0x3ffffffd, 0x0fffffeb, 0x0fffffec,
+  0x0fffffed, 0x0fffffee, 0x0fffffef, 0x0ffffff0, 0x0ffffff1, 0x0ffffff2, 0x3ffffffe, 0x0ffffff3,
+  0x0ffffff4, 0x0ffffff5, 0x0ffffff6, 0x0ffffff7, 0x0ffffff8, 0x0ffffff9, 0x0ffffffa, 0x0ffffffb,
+  0x00000014, 0x000003f8, 0x000003f9, 0x00000ffa, 0x00001ff9, 0x00000015, 0x000000f8, 0x000007fa,
+  0x000003fa, 0x000003fb, 0x000000f9, 0x000007fb, 0x000000fa, 0x00000016, 0x00000017, 0x00000018,
+  0x00000000, 0x00000001, 0x00000002, 0x00000019, 0x0000001a, 0x0000001b, 0x0000001c, 0x0000001d,
+  0x0000001e, 0x0000001f, 0x0000005c, 0x000000fb, 0x00007ffc, 0x00000020, 0x00000ffb, 0x000003fc,
+  0x00001ffa, 0x00000021, 0x0000005d, 0x0000005e, 0x0000005f, 0x00000060, 0x00000061, 0x00000062,
+  0x00000063, 0x00000064, 0x00000065, 0x00000066, 0x00000067, 0x00000068, 0x00000069, 0x0000006a,
+  0x0000006b, 0x0000006c, 0x0000006d, 0x0000006e, 0x0000006f, 0x00000070, 0x00000071, 0x00000072,
+  0x000000fc, 0x00000073, 0x000000fd, 0x00001ffb, 0x0007fff0, 0x00001ffc, 0x00003ffc, 0x00000022,
+  0x00007ffd, 0x00000003, 0x00000023, 0x00000004, 0x00000024, 0x00000005, 0x00000025, 0x00000026,
+  0x00000027, 0x00000006, 0x00000074, 0x00000075, 0x00000028, 0x00000029, 0x0000002a, 0x00000007,
+  0x0000002b, 0x00000076, 0x0000002c, 0x00000008, 0x00000009, 0x0000002d, 0x00000077, 0x00000078,
+  0x00000079, 0x0000007a, 0x0000007b, 0x00007ffe, 0x000007fc, 0x00003ffd, 0x00001ffd, 0x0ffffffc,
+  0x000fffe6, 0x003fffd2, 0x000fffe7, 0x000fffe8, 0x003fffd3, 0x003fffd4, 0x003fffd5, 0x007fffd9,
+  0x003fffd6, 0x007fffda, 0x007fffdb, 0x007fffdc, 0x007fffdd, 0x007fffde, 0x00ffffeb, 0x007fffdf,
+  0x00ffffec, 0x00ffffed, 0x003fffd7, 0x007fffe0, 0x00ffffee, 0x007fffe1, 0x007fffe2, 0x007fffe3,
+  0x007fffe4, 0x001fffdc, 0x003fffd8, 0x007fffe5, 0x003fffd9, 0x007fffe6, 0x007fffe7, 0x00ffffef,
+  0x003fffda, 0x001fffdd, 0x000fffe9, 0x003fffdb, 0x003fffdc, 0x007fffe8, 0x007fffe9, 0x001fffde,
+  0x007fffea, 0x003fffdd, 0x003fffde, 0x00fffff0, 0x001fffdf, 0x003fffdf, 0x007fffeb, 0x007fffec,
+  0x001fffe0, 0x001fffe1, 0x003fffe0, 0x001fffe2, 0x007fffed, 0x003fffe1, 0x007fffee, 0x007fffef,
+  0x000fffea, 0x003fffe2, 0x003fffe3, 0x003fffe4, 0x007ffff0, 0x003fffe5, 0x003fffe6, 0x007ffff1,
+  0x03ffffe0, 0x03ffffe1, 0x000fffeb, 0x0007fff1, 0x003fffe7, 0x007ffff2, 0x003fffe8, 0x01ffffec,
+  0x03ffffe2, 0x03ffffe3, 0x03ffffe4, 0x07ffffde, 0x07ffffdf, 0x03ffffe5, 0x00fffff1, 0x01ffffed,
+  0x0007fff2, 0x001fffe3, 0x03ffffe6, 0x07ffffe0, 0x07ffffe1, 0x03ffffe7, 0x07ffffe2, 0x00fffff2,
+  0x001fffe4, 0x001fffe5, 0x03ffffe8, 0x03ffffe9, 0x0ffffffd, 0x07ffffe3, 0x07ffffe4, 0x07ffffe5,
+  0x000fffec, 0x00fffff3, 0x000fffed, 0x001fffe6, 0x003fffe9, 0x001fffe7, 0x001fffe8, 0x007ffff3,
+  0x003fffea, 0x003fffeb, 0x01ffffee, 0x01ffffef, 0x00fffff4, 0x00fffff5, 0x03ffffea, 0x007ffff4,
+  0x03ffffeb, 0x07ffffe6, 0x03ffffec, 0x03ffffed, 0x07ffffe7, 0x07ffffe8, 0x07ffffe9, 0x07ffffea,
+  0x07ffffeb, 0x0ffffffe, 0x07ffffec, 0x07ffffed, 0x07ffffee, 0x07ffffef, 0x07fffff0, 0x03ffffee,
+};
+
+static const byte HUFFMAN_CODE_LENGTHS[256] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+   6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+   5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+  13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+   7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+  15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+   6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+static const byte HUFFMAN_SYMBOLS[256] = {
+   48,  49,  50,  97,  99, 101, 105, 111, 115, 116,  32,  37,  45,  46,  47,  51,
+   52,  53,  54,  55,  56,  57,  61,  65,  95,  98, 100, 102, 103, 104, 108, 109,
+  110, 112, 114, 117,  58,  66,  67,  68,  69,  70,  71,  72,  73,  74,  75,  76,
+   77,  78,  79,  80,  81,  82,  83,  84,  85,  86,  87,  89, 106, 107, 113, 118,
+  119, 120, 121, 122,  38,  42,  44,  59,  88,  90,  33,  34,  40,  41,  63,  39,
+   43, 124,  35,  62,   0,  36,  64,  91,  93, 126,  94, 125,  60,  96, 123,  92,
+  195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+  179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+  163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+  233,   1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+  158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239,   9, 142,
+  144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+  200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+  212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2,   3,   4,   5,   6,   7,   8,  11,  12,  14,  15,  16,  17,  18,  19,  20,
+   21,  23,  24,  25,  26,  27,  28,  29,  30,  31, 127, 220, 249,  10,  13,  22,
+};
+
+static const HuffmanCodeLength HUFFMAN_CODE_RANGES[26] = {
+  { 0x00000000, 10,   0 },  // 5 bits
+  { 0x00000014, 26,  10 },  // 6 bits
+  { 0x0000005c, 32,  36 },  // 7 bits
+  { 0x000000f8,  6,  68 },  // 8 bits
+  { 0x00000000,  0,  74 },  // 9 bits
+  { 0x000003f8,  5,  74 },  // 10 bits
+  { 0x000007fa,  3,  79 },  // 11 bits
+  { 0x00000ffa,  2,  82 },  // 12 bits
+  { 0x00001ff8,  6,  84 },  // 13 bits
+  { 0x00003ffc,  2,  90 },  // 14 bits
+  { 0x00007ffc,  3,  92 },  // 15 bits
+  { 0x00000000,  0,  95 },  // 16 bits
+  { 0x00000000,  0,  95 },  // 17 bits
+  { 0x00000000,  0,  95 },  // 18 bits
+  { 0x0007fff0,  3,  95 },  // 19 bits
+  { 0x000fffe6,  8,  98 },  // 20 bits
+  { 0x001fffdc, 13, 106 },  // 21 bits
+  { 0x003fffd2, 26, 119 },  // 22 bits
+  { 0x007fffd8, 29, 145 },  // 23 bits
+  { 0x00ffffea, 12, 174 },  // 24 bits
+  { 0x01ffffec,  4, 186 },  // 25 bits
+  { 0x03ffffe0, 15, 190 },  // 26 bits
+  { 0x07ffffde, 19, 205 },  // 27 bits
+  { 0x0fffffe2, 29, 224 },  // 28 bits
+  { 0x00000000,  0, 253 },  // 29 bits
+  { 0x3ffffffc,  4, 253 },  // 30 bits
+};
+// HUFFMAN_SYMBOLS lists symbols in order of their codes. The last code, the 30-bit EOS ("end of
+// string"), would be index 256; it must never appear in encoded text.
+
+static size_t huffmanEncodedSize(kj::ArrayPtr<const char> text) {
+  uint64_t bits = 0;
+  for (char c: text) bits += HUFFMAN_CODE_LENGTHS[byte(c)];
+  return (bits + 7) / 8;
+}
+
+static void huffmanEncode(kj::ArrayPtr<const char> text, kj::Vector<byte>& out) {
+  uint64_t bits = 0;  // Pending output, in the low `count` bits.
+  uint count = 0;
+  for (char c: text) {
+    byte b = c;
+    bits = (bits << HUFFMAN_CODE_LENGTHS[b]) | HUFFMAN_CODES[b];
+    count += HUFFMAN_CODE_LENGTHS[b];
+    while (count >= 8) {
+      count -= 8;
+      out.add(byte(bits >> count));
+    }
+  }
+  if (count > 0) {
+    // Pad with the leading bits of EOS, which are all ones.
+    out.add(byte((bits << (8 - count)) | (0xff >> count)));
+  }
+}
+
+static bool huffmanDecode(kj::ArrayPtr<const byte> input, kj::Vector<char>& out) {
+  // Appends the decoded text to `out`. Returns false if the input is not validly encoded.
+
+  const byte* pos = input.begin();
+  uint64_t bits = 0;  // Unconsumed input, in the low `count` bits.
+  uint count = 0;
+
+  for (;;) {
+    while (count <= 56 && pos < input.end()) {
+      bits = (bits << 8) | *pos++;
+      count += 8;
+    }
+    if (count == 0) return true;
+
+    // Look at the next 32 bits (zero-filled past the end), long enough for any code. Being
+    // canonical, a code of length `len` is the top `len` bits when those fall within the range of
+    // codes of that length; try lengths shortest first.
+    uint32_t window = count >= 32 ? uint32_t(bits >> (count - 32)) : uint32_t(bits << (32 - count));
+    uint len = 5;
+    uint32_t offset;
+    for (;; len++) {
+      auto& range = HUFFMAN_CODE_RANGES[len - 5];
+      offset = (window >> (32 - len)) - range.firstCode;
+      if (offset < range.count) {
+        offset += range.firstSymbol;
+        break;
+      }
+    }
+
+    if (len > count) {
+      // We've reached the end of the input. What remains must be padding: at most 7 bits, all
+      // ones. (No code is shorter than 8 bits and all ones, so padding never decodes as a code.)
+      uint64_t mask = (uint64_t(1) << count) - 1;
+      return count <= 7 && (bits & mask) == mask;
+    }
+    if (offset == 256) return false;  // EOS
+
+    out.add(char(HUFFMAN_SYMBOLS[offset]));
+    count -= len;
+    bits &= (uint64_t(1) << count) - 1;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// HPACK header compression (RFC 7541)
+
+struct HpackStaticEntry {
+  const char* name;
+  const char* value;
+};
+
+static const HpackStaticEntry HPACK_STATIC_TABLE[] = {
+  // RFC 7541 appendix A. Index 1 is the first entry.
+  { ":authority", "" },
+  { ":method", "GET" },
+  { ":method", "POST" },
+  { ":path", "/" },
+  { ":path", "/index.html" },
+  { ":scheme", "http" },
+  { ":scheme", "https" },
+  { ":status", "200" },
+  { ":status", "204" },
+  { ":status", "206" },
+  { ":status", "304" },
+  { ":status", "400" },
+  { ":status", "404" },
+  { ":status", "500" },
+  { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" },
+  { "accept-ranges", "" },
+  { "accept", "" },
+  { "access-control-allow-origin", "" },
+  { "age", "" },
+  { "allow", "" },
+  { "authorization", "" },
+  { "cache-control", "" },
+  { "content-disposition", "" },
+  { "content-encoding", "" },
+  { "content-language", "" },
+  { "content-length", "" },
+  { "content-location", "" },
+  { "content-range", "" },
+  { "content-type", "" },
+  { "cookie", "" },
+  { "date", "" },
+  { "etag", "" },
+  { "expect", "" },
+  { "expires", "" },
+  { "from", "" },
+  { "host", "" },
+  { "if-match", "" },
+  { "if-modified-since", "" },
+  { "if-none-match", "" },
+  { "if-range", "" },
+  { "if-unmodified-since", "" },
+  { "last-modified", "" },
+  { "link", "" },
+  { "location", "" },
+  { "max-forwards", "" },
+  { "proxy-authenticate", "" },
+  { "proxy-authorization", "" },
+  { "range", "" },
+  { "referer", "" },
+  { "refresh", "" },
+  { "retry-after", "" },
+  { "server", "" },
+  { "set-cookie", "" },
+  { "strict-transport-security", "" },
+  { "transfer-encoding", "" },
+  { "user-agent", "" },
+  { "vary", "" },
+  { "via", "" },
+  { "www-authenticate", "" },
+};
+
+static constexpr size_t HPACK_ENTRY_OVERHEAD = 32;
+// An entry's size, for the purpose of table size limits, is its name and value lengths plus this.
+
+static constexpr size_t HPACK_DEFAULT_TABLE_SIZE = 4096;
+
+static void hpackEncodeInteger(kj::Vector<byte>& out, byte flags, uint prefixBits, uint64_t value) {
+  // Encodes `value` in the low `prefixBits` bits of a byte whose high bits are `flags`, continuing
+  // into further bytes if needed.
+
+  uint64_t max = (1u << prefixBits) - 1;
+  if (value < max) {
+    out.add(byte(flags | value));
+    return;
+  }
+  out.add(byte(flags | max));
+  value -= max;
+  while (value >= 0x80) {
+    out.add(byte(0x80 | (value & 0x7f)));
+    value >>= 7;
+  }
+  out.add(byte(value));
+}
+
+static bool hpackDecodeInteger(const byte*& pos, const byte* end, uint prefixBits,
+                               uint64_t& result) {
+  // Decodes an integer whose first byte is `*pos`, which must exist.
+
+  uint64_t max = (1u << prefixBits) - 1;
+  result = *pos++ & max;
+  if (result < max) return true;
+
+  // No integer we accept needs more than 32 bits.
+  for (uint shift = 0; shift < 32; shift += 7) {
+    if (pos == end) return false;
+    byte b = *pos++;
+    result += uint64_t(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+static void hpackEncodeString(kj::Vector<byte>& out, kj::ArrayPtr<const char> text) {
+  size_t huffmanSize = huffmanEncodedSize(text);
+  if (huffmanSize < text.size()) {
+    hpackEncodeInteger(out, 0x80, 7, huffmanSize);
+    huffmanEncode(text, out);
+  } else {
+    hpackEncodeInteger(out, 0, 7, text.size());
+    out.addAll(text.asBytes());
+  }
+}
+
+static bool hpackDecodeString(const byte*& pos, const byte* end, kj::Vector<char>& out) {
+  if (pos == end) return false;
+  bool huffman = *pos & 0x80;
+  uint64_t length;
+  if (!hpackDecodeInteger(pos, end, 7, length) || length > uint64_t(end - pos)) return false;
+
+  auto data = kj::arrayPtr(pos, length);
+  pos += length;
+  if (huffman) {
+    return huffmanDecode(data, out);
+  } else {
+    out.addAll(data.asChars());
+    return true;
+  }
+}
+
+class HpackDecoder {
+  // Decodes the header blocks received on a connection. They share one dynamic table, so they must
+  // all be decoded, in order, even those belonging to streams which are no longer wanted.
+
+public:
+  explicit HpackDecoder(size_t tableSizeLimit)
+      : tableSizeLimit(kj::max(tableSizeLimit, HPACK_DEFAULT_TABLE_SIZE)) {}
+  // `tableSizeLimit` is what we announced as SETTINGS_HEADER_TABLE_SIZE. The table starts at the
+  // default size regardless; the peer's encoder resizes it explicitly (section 4.2). Until the
+  // peer has seen our settings it may use the default size, even if we announced less.
+
+  struct Field {
+    kj::StringPtr name;
+    kj::StringPtr value;
+  };
+
+  struct HeaderList {
+    kj::Array<Field> fields;
+    kj::Array<char> text;
+    // The names and values of `fields` point into `text`.
+
+    bool tooLarge = false;
+    // The list exceeded the size limit passed to decode(), so `fields` is empty.
+  };
+
+  kj::Maybe<HeaderList> decode(kj::ArrayPtr<const byte> block, size_t maxListSize) {
+    // Decodes one complete header block. Returns null if the block is malformed, which is a
+    // connection error: the dynamic table can no longer be trusted to match the peer's.
+
+    struct FieldText {
+      size_t nameOffset;
+      size_t nameSize;
+      size_t valueOffset;
+      size_t valueSize;
+    };
+
+    kj::Vector<char> text(kj::min(block.size() * 2, maxListSize));
+    kj::Vector<FieldText> fields;
+    size_t listSize = 0;
+    bool sawField = false;
+
+    bool tooLarge = false;
+    // Once the list exceeds `maxListSize` we stop collecting fields, but keep decoding so that the
+    // dynamic table stays in sync. Indexed fields are then never expanded, so a block of one-byte
+    // references to a large table entry can't make us allocate more than the limit.
+
+    // `text` may be reallocated whenever it grows, so only offsets into it are kept until the
+    // block is fully decoded.
+    auto textAt = [&](size_t offset, size_t size) {
+      return kj::StringPtr(text.begin() + offset, size);
+    };
+    auto fits = [&](size_t entrySize) {
+      if (entrySize > maxListSize - listSize) tooLarge = true;
+      return !tooLarge;
+    };
+
+    const byte* pos = block.begin();
+    const byte* end = block.end();
+    while (pos < end) {
+      byte b = *pos;
+      uint64_t index;
+      size_t nameOffset = text.size();
+      size_t valueOffset;
+
+      if ((b & 0xe0) == 0x20) {
+        // Dynamic table size update (section 6.3). Allowed only before the first field.
+        if (sawField || !hpackDecodeInteger(pos, end, 5, index) || index > tableSizeLimit) {
+          return nullptr;
+        }
+        maxTableSize = index;
+        evictTo(maxTableSize);
+        continue;
+      }
+      sawField = true;
+
+      if (b & 0x80) {
+        // Indexed field (section 6.1).
+        kj::StringPtr name, value;
+        if (!hpackDecodeInteger(pos, end, 7, index) || !lookup(index, name, value)) {
+          return nullptr;
+        }
+        if (!fits(name.size() + value.size() + HPACK_ENTRY_OVERHEAD)) continue;
+        text.addAll(name);
+        text.add('\0');
+        valueOffset = text.size();
+        text.addAll(value);
+        text.add('\0');
+      } else {
+        // Literal field (section 6.2): with incremental indexing if the top bits are 01, otherwise
+        // without indexing (0000) or never indexed (0001), which to a decoder are the same. Its
+        // strings can't be larger than the block itself, so they're decoded even when the list is
+        // already too large.
+        bool indexed = (b & 0xc0) == 0x40;
+        if (!hpackDecodeInteger(pos, end, indexed ? 6 : 4, index)) return nullptr;
+        if (index == 0) {
+          if (!hpackDecodeString(pos, end, text)) return nullptr;
+        } else {
+          kj::StringPtr name, value;
+          if (!lookup(index, name, value)) return nullptr;
+          text.addAll(name);
+        }
+        text.add('\0');
+        valueOffset = text.size();
+        if (!hpackDecodeString(pos, end, text)) return nullptr;
+        text.add('\0');
+
+        size_t nameSize = valueOffset - 1 - nameOffset;
+        size_t valueSize = text.size() - 1 - valueOffset;
+        if (indexed) insert(textAt(nameOffset, nameSize), textAt(valueOffset, valueSize));
+        if (!fits(nameSize + valueSize + HPACK_ENTRY_OVERHEAD)) {
+          text.truncate(nameOffset);
+          continue;
+        }
+      }
+
+      size_t nameSize = valueOffset - 1 - nameOffset;
+      size_t valueSize = text.size() - 1 - valueOffset;
+      listSize += nameSize + valueSize + HPACK_ENTRY_OVERHEAD;
+      fields.add(FieldText { nameOffset, nameSize, valueOffset, valueSize });
+    }
+
+    HeaderList result;
+    if (tooLarge) {
+      result.tooLarge = true;
+      return kj::mv(result);
+    }
+
+    result.text = text.releaseAsArray();
+    auto builder = kj::heapArrayBuilder<Field>(fields.size());
+    for (auto& field: fields) {
+      builder.add(Field {
+        kj::StringPtr(result.text.begin() + field.nameOffset, field.nameSize),
+        kj::StringPtr(result.text.begin() + field.valueOffset, field.valueSize)
+      });
+    }
+    result.fields = builder.finish();
+    return kj::mv(result);
+  }
+
+private:
+  struct Entry {
+    kj::String name;
+    kj::String value;
+  };
+
+  std::deque<Entry> table;
+  // The dynamic table, newest entry first.
+
+  size_t tableSize = 0;
+  size_t tableSizeLimit;
+  size_t maxTableSize = HPACK_DEFAULT_TABLE_SIZE;
+
+  bool lookup(uint64_t index, kj::StringPtr& name, kj::StringPtr& value) {
+    if (index == 0) {
+      return false;
+    } else if (index <= kj::size(HPACK_STATIC_TABLE)) {
+      name = HPACK_STATIC_TABLE[index - 1].name;
+      value = HPACK_STATIC_TABLE[index - 1].value;
+      return true;
+    } else if (index - kj::size(HPACK_STATIC_TABLE) <= table.size()) {
+      auto& entry = table[index - kj::size(HPACK_STATIC_TABLE) - 1];
+      name = entry.name;
+      value = entry.value;
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  void insert(kj::StringPtr name, kj::StringPtr value) {
+    // An entry larger than the whole table empties it and is not added (section 4.4).
+    size_t size = name.size() + value.size() + HPACK_ENTRY_OVERHEAD;
+    if (size > maxTableSize) {
+      evictTo(0);
+    } else {
+      evictTo(maxTableSize - size);
+      table.push_front(Entry { kj::heapString(name), kj::heapString(value) });
+      tableSize += size;
+    }
+  }
+
+  void evictTo(size_t size) {
+    while (tableSize > size) {
+      auto& entry = table.back();
+      tableSize -= entry.name.size() + entry.value.size() + HPACK_ENTRY_OVERHEAD;
+      table.pop_back();
+    }
+  }
+};
+
+class HpackEncoder {
+  // Encodes the header blocks sent on a connection.
+
+public:
+  explicit HpackEncoder(size_t tableSizeLimit): tableSizeLimit(tableSizeLimit) {
+    // Until the peer says otherwise, its decoder's table has the default size. If we'll use less,
+    // the first block must say so.
+    setPeerTableSize(HPACK_DEFAULT_TABLE_SIZE);
+  }
+  // `tableSizeLimit` is the most memory we'll devote to the dynamic table, whatever the peer allows.
+
+  void setPeerTableSize(size_t size) {
+    // Called when the peer announces SETTINGS_HEADER_TABLE_SIZE, the most its decoder allows.
+
+    size = kj::min(size, tableSizeLimit);
+    if (size != maxTableSize) {
+      maxTableSize = size;
+      evictTo(maxTableSize);
+      smallestPendingSize = kj::min(smallestPendingSize.orDefault(size), size);
+    }
+  }
+
+  enum Indexing {
+    INDEX,
+    // Add the field to the dynamic table so that repeats can be sent as an index.
+
+    DONT_INDEX,
+    // The value is unlikely to be repeated.
+
+    NEVER_INDEX
+    // The value is sensitive: intermediaries re-encoding the field must not index it either, so
+    // that its value can't be probed for via compression.
+  };
+
+  void startBlock(kj::Vector<byte>& out) {
+    // Must be called before the first field of each header block.
+
+    KJ_IF_MAYBE(smallest, smallestPendingSize) {
+      // The decoder must see the smallest size the table had since the last block, to evict what
+      // we evicted, and then the current size (section 4.2).
+      if (*smallest < maxTableSize) hpackEncodeInteger(out, 0x20, 5, *smallest);
+      hpackEncodeInteger(out, 0x20, 5, maxTableSize);
+      smallestPendingSize = nullptr;
+    }
+  }
+
+  void encode(kj::Vector<byte>& out, kj::StringPtr name, kj::ArrayPtr<const char> value,
+              Indexing indexing = INDEX) {
+    // `name` must be lower-case.
+
+    uint nameIndex = 0;
+
+    KJ_IF_MAYBE(staticIndex, findStaticName(name)) {
+      nameIndex = *staticIndex;
+      for (uint i = *staticIndex; i <= kj::size(HPACK_STATIC_TABLE) &&
+                                  HPACK_STATIC_TABLE[i - 1].name == name; i++) {
+        if (kj::StringPtr(HPACK_STATIC_TABLE[i - 1].value).asArray() == value) {
+          hpackEncodeInteger(out, 0x80, 7, i);
+          return;
+        }
+      }
+    }
+
+    if (indexing != NEVER_INDEX) {
+      // The dynamic table is small enough (~100 entries at most with default settings, usually
+      // far fewer) to search linearly.
+      for (size_t i = 0; i < table.size(); i++) {
+        auto& entry = table[i];
+        if (entry.name == name) {
+          uint index = kj::size(HPACK_STATIC_TABLE) + 1 + i;
+          if (entry.value.asArray() == value) {
+            hpackEncodeInteger(out, 0x80, 7, index);
+            return;
+          }
+          if (nameIndex == 0) nameIndex = index;
+        }
+      }
+    }
+
+    switch (indexing) {
+      case INDEX:
+        hpackEncodeInteger(out, 0x40, 6, nameIndex);
+        break;
+      case DONT_INDEX:
+        hpackEncodeInteger(out, 0x00, 4, nameIndex);
+        break;
+      case NEVER_INDEX:
+        hpackEncodeInteger(out, 0x10, 4, nameIndex);
+        break;
+    }
+    if (nameIndex == 0) hpackEncodeString(out, name);
+    hpackEncodeString(out, value);
+
+    if (indexing == INDEX) {
+      size_t size = name.size() + value.size() + HPACK_ENTRY_OVERHEAD;
+      if (size > maxTableSize) {
+        evictTo(0);
+      } else {
+        evictTo(maxTableSize - size);
+        table.push_front(Entry { kj::heapString(name), kj::heapString(value) });
+        tableSize += size;
+      }
+    }
+  }
+
+private:
+  struct Entry {
+    kj::String name;
+    kj::String value;
+  };
+
+  std::deque<Entry> table;
+  // The dynamic table, newest entry first, mirroring the peer's decoder.
+
+  size_t tableSize = 0;
+  size_t tableSizeLimit;
+  size_t maxTableSize = HPACK_DEFAULT_TABLE_SIZE;
+
+  kj::Maybe<size_t> smallestPendingSize;
+  // If the table size changed since the last block was started, the smallest size it had.
+
+  void evictTo(size_t size) {
+    while (tableSize > size) {
+      auto& entry = table.back();
+      tableSize -= entry.name.size() + entry.value.size() + HPACK_ENTRY_OVERHEAD;
+      table.pop_back();
+    }
+  }
+
+  static kj::Maybe<uint> findStaticName(kj::StringPtr name) {
+    // Returns the index of the first static table entry with the given name.
+
+    static const kj::HashMap<kj::StringPtr, uint> index = []() {
+      kj::HashMap<kj::StringPtr, uint> result;
+      for (uint i = kj::size(HPACK_STATIC_TABLE); i > 0; i--) {
+        // Iterating backwards, so that the first of several entries with a name wins.
+        kj::StringPtr name = HPACK_STATIC_TABLE[i - 1].name;
+        KJ_IF_MAYBE(existing, result.find(name)) {
+          *existing = i;
+        } else {
+          result.insert(name, i);
+        }
+      }
+      return result;
+    }();
+
+    KJ_IF_MAYBE(i, index.find(name)) {
+      return *i;
+    } else {
+      return nullptr;
+    }
+  }
+};
+
+
+// -----------------------------------------------------------------------------
+// HTTP/2 framing and connection state
+
+static constexpr char HTTP2_PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static constexpr size_t HTTP2_PREFACE_SIZE = sizeof(HTTP2_PREFACE) - 1;
+// A client begins every connection with this, followed by a SETTINGS frame (section 3.5).
+
+static constexpr size_t HTTP2_FRAME_HEADER_SIZE = 9;
+static constexpr int64_t HTTP2_DEFAULT_WINDOW_SIZE = 65535;
+static constexpr int64_t HTTP2_MAX_WINDOW_SIZE = 0x7fffffff;
+static constexpr uint32_t HTTP2_DEFAULT_MAX_FRAME_SIZE = 16384;
+static constexpr uint32_t HTTP2_MAX_MAX_FRAME_SIZE = (1 << 24) - 1;
+static constexpr uint32_t HTTP2_MAX_STREAM_ID = 0x7fffffff;
+
+namespace Http2Frame {
+  enum Type: byte {
+    DATA = 0x0,
+    HEADERS = 0x1,
+    PRIORITY = 0x2,
+    RST_STREAM = 0x3,
+    SETTINGS = 0x4,
+    PUSH_PROMISE = 0x5,
+    PING = 0x6,
+    GOAWAY = 0x7,
+    WINDOW_UPDATE = 0x8,
+    CONTINUATION = 0x9
+  };
+
+  enum Flag: byte {
+    END_STREAM = 0x1,
+    ACK = 0x1,
+    END_HEADERS = 0x4,
+    PADDED = 0x8,
+    PRIORITY_INFO = 0x20
+  };
+};
+
+namespace Http2Setting {
+  enum Id: uint16_t {
+    HEADER_TABLE_SIZE = 0x1,
+    ENABLE_PUSH = 0x2,
+    MAX_CONCURRENT_STREAMS = 0x3,
+    INITIAL_WINDOW_SIZE = 0x4,
+    MAX_FRAME_SIZE = 0x5,
+    MAX_HEADER_LIST_SIZE = 0x6
+  };
+};
+
+namespace Http2Error {
+  enum Code: uint32_t {
+    NONE = 0x0,  // NO_ERROR in the RFC, which is a macro on Windows.
+    PROTOCOL_ERROR = 0x1,
+    INTERNAL_ERROR = 0x2,
+    FLOW_CONTROL_ERROR = 0x3,
+    SETTINGS_TIMEOUT = 0x4,
+    STREAM_CLOSED = 0x5,
+    FRAME_SIZE_ERROR = 0x6,
+    REFUSED_STREAM = 0x7,
+    CANCEL = 0x8,
+    COMPRESSION_ERROR = 0x9,
+    CONNECT_ERROR = 0xa,
+    ENHANCE_YOUR_CALM = 0xb,
+    INADEQUATE_SECURITY = 0xc,
+    HTTP_1_1_REQUIRED = 0xd
+  };
+};
+
+static inline uint32_t readUint32(const byte* p) {
+  return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+static inline void writeUint32(byte* p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+static kj::Array<byte> newHttp2Frame(byte type, byte flags, uint32_t streamId,
+                                     size_t payloadSize) {
+  // Allocates a frame and fills in its header. The caller fills in the payload.
+
+  auto frame = kj::heapArray<byte>(HTTP2_FRAME_HEADER_SIZE + payloadSize);
+  frame[0] = payloadSize >> 16;
+  frame[1] = payloadSize >> 8;
+  frame[2] = payloadSize;
+  frame[3] = type;
+  frame[4] = flags;
+  writeUint32(frame.begin() + 5, streamId);
+  return frame;
+}
+
+static bool isHttp2ConnectionSpecificHeader(kj::StringPtr name) {
+  // Headers which only make sense for a single HTTP/1.x connection, and which HTTP/2 forbids
+  // (section 8.1.2.2). `name` must be lower-case. ("te" is allowed, but only as "te: trailers".)
+
+  switch (name.size()) {
+    case 7: return name == "upgrade";
+    case 10: return name == "connection" || name == "keep-alive";
+    case 16: return name == "proxy-connection";
+    case 17: return name == "transfer-encoding";
+    default: return false;
+  }
+}
+
+class Http2Connection: private kj::TaskSet::ErrorHandler {
+  // One end of an HTTP/2 connection: frame I/O, settings, flow control, HPACK state and the stream
+  // table. Subclasses decide what received header blocks mean, which is where clients and servers
+  // differ.
+
+public:
+  class Stream;
+
+  Http2Connection(kj::Own<kj::AsyncIoStream> inner, bool isServer, const Http2Settings& settings)
+      : isServer(isServer), localSettings(settings), encoder(settings.headerTableSize),
+        nextLocalStreamId(isServer ? 2 : 1), inner(kj::mv(inner)),
+        decoder(settings.headerTableSize), receiveWindow(HTTP2_DEFAULT_WINDOW_SIZE),
+        readBuffer(kj::heapArray<byte>(
+            kj::max(HTTP2_FRAME_HEADER_SIZE + settings.maxFrameSize, MAX_BUFFER))),
+        tasks(*this) {
+    KJ_REQUIRE(settings.maxFrameSize >= HTTP2_DEFAULT_MAX_FRAME_SIZE &&
+               settings.maxFrameSize <= HTTP2_MAX_MAX_FRAME_SIZE,
+               "Http2Settings::maxFrameSize out of range", settings.maxFrameSize);
+    KJ_REQUIRE(settings.initialWindowSize <= HTTP2_MAX_WINDOW_SIZE &&
+               settings.connectionWindowSize >= HTTP2_DEFAULT_WINDOW_SIZE &&
+               settings.connectionWindowSize <= HTTP2_MAX_WINDOW_SIZE,
+               "Http2Settings window size out of range");
+  }
+
+  ~Http2Connection() noexcept(false);
+
+  KJ_DISALLOW_COPY(Http2Connection);
+
+  // ---------------------------------------------------------------------------
+  // Interface for body streams
+
+  kj::Promise<size_t> read(Stream& stream, void* buffer, size_t minBytes, size_t maxBytes);
+  kj::Promise<void> write(Stream& stream, kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces,
+                          bool endStream);
+  void finishWrite(Stream& stream, bool complete);
+  void finishRead(Stream& stream);
+
+protected:
+  const bool isServer;
+  Http2Settings localSettings;
+
+  HpackEncoder encoder;
+
+  kj::HashMap<uint32_t, kj::Own<Stream>> streams;
+  // Streams which are open or half-closed, by ID.
+
+  uint32_t highestPeerStreamId = 0;
+  uint32_t nextLocalStreamId;
+
+  uint32_t peerMaxConcurrentStreams = kj::maxValue;
+  uint32_t peerInitialWindowSize = HTTP2_DEFAULT_WINDOW_SIZE;
+  uint32_t peerMaxFrameSize = HTTP2_DEFAULT_MAX_FRAME_SIZE;
+
+  bool goAwaySent = false;
+  bool goAwayReceived = false;
+  bool closed = false;
+  // Once we've sent or received GOAWAY, no new streams can be opened. Once closed, the connection
+  // is finished with.
+
+  kj::Promise<void> run(kj::ArrayPtr<const byte> received = nullptr);
+  // Sends our settings, then reads and handles frames until the connection closes. `received` is
+  // input already read from the connection, which for a server must begin with the client's
+  // preface (or a prefix of it). Resolves when the connection closes cleanly, or after a
+  // protocol error has been reported to the peer; throws on I/O errors.
+
+  virtual void onHeaders(uint32_t streamId, bool endStream, HpackDecoder::HeaderList&& fields) = 0;
+  // Called for each complete header block received.
+
+  virtual void onStreamClosed() {}
+  // Called when a stream leaves the stream table.
+
+  virtual void onSettingsChanged() {}
+  // Called after the peer's settings have been applied.
+
+  virtual bool isQuiescent() { return streams.size() == 0; }
+  // Returns true if nothing is in progress, so that a connection which is going away can close.
+
+  kj::Maybe<Stream&> findStream(uint32_t streamId) {
+    KJ_IF_MAYBE(stream, streams.find(streamId)) {
+      return **stream;
+    } else {
+      return nullptr;
+    }
+  }
+
+  bool isIdleStreamId(uint32_t streamId) {
+    // Returns true if no stream with this ID has been opened (by either side) yet.
+
+    if ((streamId & 1) == (isServer ? 0 : 1)) {
+      return streamId >= nextLocalStreamId;
+    } else {
+      return streamId > highestPeerStreamId;
+    }
+  }
+
+  void openStream(kj::Own<Stream> stream, uint32_t streamId);
+  // Adds a stream to the stream table.
+
+  void sendHeaders(Stream& stream, kj::ArrayPtr<const byte> block, bool endStream);
+  // Sends a header block, as a HEADERS frame plus CONTINUATION frames if needed.
+
+  void encodeHeaders(kj::Vector<byte>& block, const HttpHeaders& headers);
+  // Encodes the fields of `headers`, other than those HTTP/2 forbids, into `block`.
+
+  void endOfInput(Stream& stream);
+  // The peer has finished sending on this stream.
+
+  void resetStream(Stream& stream, uint32_t errorCode);
+  void resetStream(uint32_t streamId, uint32_t errorCode);
+  // Sends RST_STREAM, failing the stream if we have it.
+
+  void goAway(uint32_t errorCode);
+  // Sends GOAWAY: no further streams from the peer will be accepted. The connection closes once
+  // the streams in progress have finished.
+
+  KJ_NORETURN(void connectionError(uint32_t errorCode, kj::StringPtr description));
+  // Throws, ending the connection. The peer is sent GOAWAY with the given error code.
+
+  void maybeClose();
+  // Closes the connection if it is going away and isQuiescent().
+
+  void failStream(Stream& stream, kj::Exception&& exception);
+  // Fails reads and writes on the stream, and removes it from the stream table.
+
+  void addTask(kj::Promise<void> promise) { tasks.add(kj::mv(promise)); }
+  // Runs `promise` until the connection is destroyed. If it throws, the connection fails.
+
+  struct PseudoHeaders {
+    kj::Maybe<kj::StringPtr> method;
+    kj::Maybe<kj::StringPtr> scheme;
+    kj::Maybe<kj::StringPtr> authority;
+    kj::Maybe<kj::StringPtr> path;
+    kj::Maybe<kj::StringPtr> status;
+  };
+
+  static bool decodeFields(HpackDecoder::HeaderList& fields, PseudoHeaders& pseudo,
+                           HttpHeaders& headers, kj::Maybe<uint64_t>& contentLength);
+  // Checks that a received header list is well-formed (section 8.1.2), and sorts it into
+  // pseudo-headers and regular headers, which point into `fields`. Cookie fields are joined into
+  // one header. Returns false if the list is malformed.
+
+private:
+  kj::Own<kj::AsyncIoStream> inner;
+  // Declared before the promises which use it, so that it outlives them.
+
+  HpackDecoder decoder;
+
+  Stream* allStreams = nullptr;
+  // All Stream objects still in existence, including those no longer in the stream table.
+
+  int64_t sendWindow = HTTP2_DEFAULT_WINDOW_SIZE;
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> windowWaiters;
+  // Connection-level flow control for sending. Writers waiting for the window to open.
+
+  int64_t receiveWindow;
+  uint32_t unacknowledgedBytes = 0;
+  // Connection-level flow control for receiving: what the peer may still send, and what it has
+  // sent that we haven't yet told it about with WINDOW_UPDATE.
+
+  // Input state.
+  kj::Array<byte> readBuffer;
+  size_t readStart = 0;
+  size_t readEnd = 0;
+  bool receivedPreface = false;
+  bool receivedSettings = false;
+
+  struct PendingHeaders {
+    uint32_t streamId;
+    bool endStream;
+    kj::Vector<byte> block;
+  };
+  kj::Maybe<PendingHeaders> pendingHeaders;
+  // A header block which is awaiting CONTINUATION frames.
+
+  kj::Maybe<uint32_t> errorCode;
+  // Set by connectionError().
+
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> closeFulfiller;
+  // Resolves or rejects the promise returned by run(), besides the read loop ending.
+
+  // Output state, as in HttpOutputStream.
+  struct WriteBatch {
+    // Frames queued within one event loop turn, to be written with a single `write(pieces)` call
+    // once everything previously queued has been written.
+
+    kj::SmallVector<kj::ArrayPtr<const byte>, 4> pieces;
+    kj::SmallVector<kj::Array<byte>, 4> frames;
+    // `pieces` point into `frames`.
+  };
+
+  kj::Promise<void> writeQueue = kj::READY_NOW;
+  kj::Maybe<WriteBatch&> openBatch;
+  kj::Maybe<kj::ForkedPromise<void>> openBatchDone;
+
+  kj::TaskSet tasks;
+  // Watches for write errors.
+
+  WriteBatch& getBatch();
+  kj::Promise<void> batchDone();
+  void queueFrame(kj::Array<byte> frame);
+  kj::Promise<void> flush();
+
+  kj::Promise<void> readLoop();
+  kj::Promise<void> finish(kj::Maybe<kj::Exception> exception);
+  void handleFrame(byte type, byte flags, uint32_t streamId, kj::ArrayPtr<const byte> payload);
+  void handleData(byte flags, uint32_t streamId, kj::ArrayPtr<const byte> payload);
+  void handleHeaders(byte flags, uint32_t streamId, kj::ArrayPtr<const byte> payload);
+  void handleHeaderBlock(uint32_t streamId, bool endStream, kj::ArrayPtr<const byte> block);
+  void handleSettings(byte flags, uint32_t streamId, kj::ArrayPtr<const byte> payload);
+  void handleGoAway(uint32_t streamId, kj::ArrayPtr<const byte> payload);
+  void handleWindowUpdate(uint32_t streamId, kj::ArrayPtr<const byte> payload);
+  kj::ArrayPtr<const byte> removePadding(byte flags, kj::ArrayPtr<const byte> payload);
+
+  kj::Promise<void> sendData(Stream& stream, kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces,
+                             size_t offset, bool endStream);
+  void sendWindowUpdate(uint32_t streamId, uint32_t increment);
+  void consumed(Stream& stream, size_t bytes);
+  void removeStream(Stream& stream);
+
+  void taskFailed(kj::Exception&& exception) override;
+};
+
+class Http2Connection::Stream: public kj::Refcounted {
+  // One stream. The connection's stream table holds a reference while the stream is open; the
+  // objects the application uses to read and write the stream's bodies hold references too.
+
+public:
+  explicit Stream(Http2Connection& connection)
+      : connection(connection),
+        receiveWindow(connection.localSettings.initialWindowSize),
+        sendWindow(connection.peerInitialWindowSize) {
+    next = connection.allStreams;
+    if (next != nullptr) next->prev = &next;
+    prev = &connection.allStreams;
+    connection.allStreams = this;
+  }
+
+  virtual ~Stream() noexcept(false) {
+    if (connection != nullptr) {
+      *prev = next;
+      if (next != nullptr) next->prev = prev;
+    }
+  }
+
+  KJ_DISALLOW_COPY(Stream);
+
+  Http2Connection& getConnection() {
+    KJ_IF_MAYBE(c, connection) {
+      return *c;
+    } else {
+      kj::throwFatalException(KJ_EXCEPTION(DISCONNECTED, "HTTP/2 connection is gone"));
+    }
+  }
+
+  uint32_t id = 0;
+  // Zero until the stream is opened.
+
+  bool open = false;
+  // In the connection's stream table.
+
+  bool localClosed = false;
+  bool remoteClosed = false;
+  // Whether END_STREAM has been sent and received.
+
+  kj::Maybe<kj::Exception> error;
+  // Set if the stream was reset, or the connection failed.
+
+  kj::Maybe<uint64_t> expectedLength;
+  // Content-length of the body being received, if known.
+
+  kj::Maybe<kj::ForkedPromise<void>> whenOpened;
+  // If the stream is waiting to be opened, resolves once it has been. Writes wait for this.
+
+protected:
+  virtual void onFailed(const kj::Exception& exception) {}
+  // Called when the stream is reset or the connection fails.
+
+private:
+  kj::Maybe<Http2Connection&> connection;
+  Stream** prev = nullptr;
+  Stream* next = nullptr;
+  // Links in the connection's `allStreams` list.
+
+  std::deque<kj::Array<byte>> received;
+  size_t receivedOffset = 0;
+  // Body data received but not yet read. Each frame's payload is one element; `receivedOffset` is
+  // how much of the first has been read.
+
+  struct PendingRead {
+    byte* buffer;
+    size_t minBytes;
+    size_t maxBytes;
+    size_t filled;
+    kj::Own<kj::PromiseFulfiller<size_t>> fulfiller;
+  };
+  kj::Maybe<PendingRead> pendingRead;
+
+  int64_t receiveWindow;
+  uint32_t unacknowledgedBytes = 0;
+  uint64_t receivedLength = 0;
+  uint64_t readLength = 0;
+  bool readerGone = false;
+  bool headersReceived = false;
+
+  int64_t sendWindow;
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> windowWaiter;
+
+  friend class Http2Connection;
+  friend class Http2BodyReader;
+  friend class Http2BodyWriter;
+};
+
+class Http2BodyReader final: public kj::AsyncInputStream {
+public:
+  explicit Http2BodyReader(kj::Own<Http2Connection::Stream> stream): stream(kj::mv(stream)) {}
+  ~Http2BodyReader() noexcept(false) {
+    KJ_IF_MAYBE(connection, stream->connection) {
+      connection->finishRead(*stream);
+    }
+  }
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    return stream->getConnection().read(*stream, buffer, minBytes, maxBytes);
+  }
+
+  kj::Maybe<uint64_t> tryGetLength() override {
+    KJ_IF_MAYBE(length, stream->expectedLength) {
+      return *length - kj::min(*length, stream->readLength);
+    } else {
+      return nullptr;
+    }
+  }
+
+private:
+  kj::Own<Http2Connection::Stream> stream;
+};
+
+class Http2BodyWriter final: public kj::AsyncOutputStream {
+  // Writes a body as DATA frames. The last frame ends the stream: with a known length, the one
+  // which completes it; otherwise an empty frame sent when the writer is dropped.
+
+public:
+  Http2BodyWriter(kj::Own<Http2Connection::Stream> stream, kj::Maybe<uint64_t> length)
+      : stream(kj::mv(stream)), length(length) {}
+  ~Http2BodyWriter() noexcept(false) {
+    if (!ended) {
+      KJ_IF_MAYBE(connection, stream->connection) {
+        // A write still in progress was canceled, so the body is incomplete, as it is if a length
+        // was given but not reached.
+        bool complete = !writing && length == nullptr && !unwindDetector.isUnwinding();
+        connection->finishWrite(*stream, complete);
+      }
+    }
+  }
+
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    piece = kj::arrayPtr(reinterpret_cast<const byte*>(buffer), size);
+    return write(kj::arrayPtr(&piece, 1));
+  }
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    uint64_t size = 0;
+    for (auto& p: pieces) size += p.size();
+    if (size == 0) return kj::READY_NOW;
+
+    bool end = false;
+    KJ_IF_MAYBE(remaining, length) {
+      KJ_REQUIRE(size <= *remaining, "overwrote Content-Length");
+      *remaining -= size;
+      end = *remaining == 0;
+    }
+
+    KJ_REQUIRE(!writing, "previous write hasn't completed");
+    writing = true;
+    ended = end;
+    return stream->getConnection().write(*stream, pieces, end).then([this]() {
+      writing = false;
+    });
+  }
+
+private:
+  kj::Own<Http2Connection::Stream> stream;
+  kj::Maybe<uint64_t> length;
+  // Bytes remaining, if the length was given.
+
+  bool writing = false;
+  bool ended = false;
+  kj::ArrayPtr<const byte> piece;
+  kj::UnwindDetector unwindDetector;
+};
+
+// -----------------------------------------------------------------------------
+
+Http2Connection::~Http2Connection() noexcept(false) {
+  // Streams may outlive us, held by body streams the application still has. Let them know that
+  // the connection is gone.
+  for (Stream* stream = allStreams; stream != nullptr; stream = stream->next) {
+    stream->connection = nullptr;
+  }
+}
+
+kj::Promise<void> Http2Connection::run(kj::ArrayPtr<const byte> received) {
+  KJ_ASSERT(received.size() <= readBuffer.size());
+  memcpy(readBuffer.begin(), received.begin(), received.size());
+  readEnd = received.size();
+  receivedPreface = !isServer;
+
+  if (!isServer) {
+    queueFrame(kj::heapArray(kj::StringPtr(HTTP2_PREFACE).asBytes()));
+  }
+
+  // Announce our settings, where they differ from the protocol defaults.
+  kj::Vector<kj::Tuple<uint16_t, uint32_t>> settings;
+  if (localSettings.headerTableSize != HPACK_DEFAULT_TABLE_SIZE) {
+    settings.add(kj::tuple(Http2Setting::HEADER_TABLE_SIZE, localSettings.headerTableSize));
+  }
+  if (!isServer) {
+    settings.add(kj::tuple(Http2Setting::ENABLE_PUSH, 0));
+  }
+  settings.add(kj::tuple(Http2Setting::MAX_CONCURRENT_STREAMS,
+                         localSettings.maxConcurrentStreams));
+  if (localSettings.initialWindowSize != HTTP2_DEFAULT_WINDOW_SIZE) {
+    settings.add(kj::tuple(Http2Setting::INITIAL_WINDOW_SIZE, localSettings.initialWindowSize));
+  }
+  if (localSettings.maxFrameSize != HTTP2_DEFAULT_MAX_FRAME_SIZE) {
+    settings.add(kj::tuple(Http2Setting::MAX_FRAME_SIZE, localSettings.maxFrameSize));
+  }
+  settings.add(kj::tuple(Http2Setting::MAX_HEADER_LIST_SIZE,
+                         uint32_t(kj::min(localSettings.maxHeaderListSize, uint32_t(kj::maxValue)))));
+
+  auto frame = newHttp2Frame(Http2Frame::SETTINGS, 0, 0, settings.size() * 6);
+  byte* pos = frame.begin() + HTTP2_FRAME_HEADER_SIZE;
+  for (auto& setting: settings) {
+    pos[0] = kj::get<0>(setting) >> 8;
+    pos[1] = kj::get<0>(setting);
+    writeUint32(pos + 2, kj::get<1>(setting));
+    pos += 6;
+  }
+  queueFrame(kj::mv(frame));
+
+  // The connection window can only be enlarged with WINDOW_UPDATE.
+  if (localSettings.connectionWindowSize > HTTP2_DEFAULT_WINDOW_SIZE) {
+    sendWindowUpdate(0, localSettings.connectionWindowSize - HTTP2_DEFAULT_WINDOW_SIZE);
+    receiveWindow = localSettings.connectionWindowSize;
+  }
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  closeFulfiller = kj::mv(paf.fulfiller);
+
+  return readLoop().exclusiveJoin(kj::mv(paf.promise))
+      .then([this]() {
+    return finish(nullptr);
+  }, [this](kj::Exception&& exception) {
+    return finish(kj::mv(exception));
+  });
+}
+
+kj::Promise<void> Http2Connection::finish(kj::Maybe<kj::Exception> exception) {
+  closed = true;
+  closeFulfiller = nullptr;
+
+  if (exception != nullptr && !goAwaySent) {
+    goAway(errorCode.orDefault(Http2Error::INTERNAL_ERROR));
+  }
+
+  // Fail whatever is still in progress.
+  kj::Exception failure = exception == nullptr
+      ? KJ_EXCEPTION(DISCONNECTED, "HTTP/2 connection closed")
+      : kj::cp(KJ_ASSERT_NONNULL(exception));
+  kj::Vector<kj::Own<Stream>> remaining(streams.size());
+  for (auto& entry: streams) {
+    remaining.add(kj::addRef(*entry.value));
+  }
+  for (auto& stream: remaining) {
+    failStream(*stream, kj::cp(failure));
+  }
+  for (auto& waiter: windowWaiters) {
+    waiter->reject(kj::cp(failure));
+  }
+  windowWaiters.clear();
+
+  return flush().then(kj::mvCapture(exception,
+      [this](kj::Maybe<kj::Exception>&& exception) -> kj::Promise<void> {
+    KJ_IF_MAYBE(e, exception) {
+      if (errorCode == nullptr) {
+        // Not a protocol error (those have been reported to the peer), so probably an I/O error.
+        return kj::mv(*e);
+      }
+    }
+    return kj::READY_NOW;
+  }), [](kj::Exception&& e) -> kj::Promise<void> {
+    // Couldn't send the final frames; the peer probably disconnected.
+    return kj::READY_NOW;
+  });
+}
+
+void Http2Connection::connectionError(uint32_t code, kj::StringPtr description) {
+  errorCode = code;
+  kj::throwFatalException(KJ_EXCEPTION(FAILED, "HTTP/2 protocol error", description));
+}
+
+void Http2Connection::taskFailed(kj::Exception&& exception) {
+  // A write failed, or a subclass's task did.
+  KJ_IF_MAYBE(fulfiller, closeFulfiller) {
+    fulfiller->get()->reject(kj::mv(exception));
+    closeFulfiller = nullptr;
+  }
+}
+
+void Http2Connection::maybeClose() {
+  if ((goAwaySent || goAwayReceived) && !closed && isQuiescent()) {
+    KJ_IF_MAYBE(fulfiller, closeFulfiller) {
+      fulfiller->get()->fulfill();
+      closeFulfiller = nullptr;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Output
+
+Http2Connection::WriteBatch& Http2Connection::getBatch() {
+  KJ_IF_MAYBE(batch, openBatch) {
+    return *batch;
+  }
+
+  auto batch = kj::heap<WriteBatch>();
+  auto& result = *batch;
+  auto fork = writeQueue.then(kj::mvCapture(batch, [this](kj::Own<WriteBatch>&& batch) {
+    // Close the batch: anything queued from now on goes in the next one.
+    KJ_IF_MAYBE(open, openBatch) {
+      if (open == batch.get()) {
+        openBatch = nullptr;
+        openBatchDone = nullptr;
+      }
+    }
+    auto promise = inner->write(batch->pieces.asPtr());
+    return promise.attach(kj::mv(batch));
+  })).fork();
+  writeQueue = fork.addBranch();
+  tasks.add(fork.addBranch());
+  openBatch = result;
+  openBatchDone = kj::mv(fork);
+  return result;
+}
+
+kj::Promise<void> Http2Connection::batchDone() {
+  // Returns a promise which resolves when the open batch has been written.
+  return KJ_ASSERT_NONNULL(openBatchDone).addBranch();
+}
+
+void Http2Connection::queueFrame(kj::Array<byte> frame) {
+  auto& batch = getBatch();
+  batch.pieces.add(frame);
+  batch.frames.add(kj::mv(frame));
+}
+
+kj::Promise<void> Http2Connection::flush() {
+  auto fork = writeQueue.fork();
+  writeQueue = fork.addBranch();
+  return fork.addBranch();
+}
+
+void Http2Connection::sendWindowUpdate(uint32_t streamId, uint32_t increment) {
+  auto frame = newHttp2Frame(Http2Frame::WINDOW_UPDATE, 0, streamId, 4);
+  writeUint32(frame.begin() + HTTP2_FRAME_HEADER_SIZE, increment);
+  queueFrame(kj::mv(frame));
+}
+
+void Http2Connection::sendHeaders(Stream& stream, kj::ArrayPtr<const byte> block,
+                                  bool endStream) {
+  byte type = Http2Frame::HEADERS;
+  byte flags = endStream ? Http2Frame::END_STREAM : 0;
+  do {
+    size_t size = kj::min(block.size(), peerMaxFrameSize);
+    if (size == block.size()) flags |= Http2Frame::END_HEADERS;
+    auto frame = newHttp2Frame(type, flags, stream.id, size);
+    memcpy(frame.begin() + HTTP2_FRAME_HEADER_SIZE, block.begin(), size);
+    queueFrame(kj::mv(frame));
+    block = block.slice(size, block.size());
+    type = Http2Frame::CONTINUATION;
+    flags = 0;
+  } while (block.size() > 0);
+
+  if (endStream) {
+    stream.localClosed = true;
+    removeStream(stream);
+  }
+}
+
+void Http2Connection::encodeHeaders(kj::Vector<byte>& block, const HttpHeaders& headers) {
+  kj::Vector<char> name;
+  headers.forEach([&](kj::StringPtr originalName, kj::StringPtr value) {
+    name.clear();
+    for (char c: originalName) {
+      name.add('A' <= c && c <= 'Z' ? c - 'A' + 'a' : c);
+    }
+    name.add('\0');
+    kj::StringPtr lowercase(name.begin(), name.size() - 1);
+
+    if (isHttp2ConnectionSpecificHeader(lowercase) || lowercase == "content-length" ||
+        lowercase == "host") {
+      // Content-Length is added where appropriate, and Host becomes :authority.
+      return;
+    }
+    if (lowercase == "te" && value != "trailers") {
+      return;
+    }
+
+    // Keep credentials out of any intermediary's compression table, where they would be exposed
+    // to guessing attacks (RFC 7541 section 7.1.3), and don't fill the table with values which are
+    // rarely repeated.
+    auto indexing = HpackEncoder::INDEX;
+    if (lowercase == "authorization" || lowercase == "proxy-authorization" ||
+        (lowercase == "cookie" && value.size() < 20)) {
+      indexing = HpackEncoder::NEVER_INDEX;
+    } else if (lowercase == "date" || lowercase == "etag" || lowercase == "last-modified" ||
+               lowercase == "if-modified-since" || lowercase == "if-none-match" ||
+               lowercase == "location" || lowercase == "age" || lowercase == "content-range" ||
+               lowercase == "set-cookie") {
+      indexing = HpackEncoder::DONT_INDEX;
+    }
+    encoder.encode(block, lowercase, value, indexing);
+  });
+}
+
+kj::Promise<void> Http2Connection::write(
+    Stream& stream, kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces, bool endStream) {
+  KJ_IF_MAYBE(opened, stream.whenOpened) {
+    return opened->addBranch().then([this, &stream, pieces, endStream]() {
+      return write(stream, pieces, endStream);
+    });
+  }
+  return sendData(stream, pieces, 0, endStream);
+}
+
+kj::Promise<void> Http2Connection::sendData(
+    Stream& stream, kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces, size_t offset,
+    bool endStream) {
+  // Sends as much of `pieces` (starting `offset` bytes in) as flow control allows, then waits for
+  // the window to open and continues. The data is copied into frames, since a canceled write must
+  // not leave the connection referring to the caller's buffers; the returned promise resolves once
+  // the frames have been written, to provide backpressure.
+
+  KJ_IF_MAYBE(e, stream.error) {
+    return kj::cp(*e);
+  }
+  KJ_REQUIRE(!stream.localClosed, "HTTP/2 stream already ended");
+
+  size_t total = 0;
+  for (auto& piece: pieces) total += piece.size();
+
+  while (offset < total) {
+    int64_t window = kj::min(stream.sendWindow, sendWindow);
+    if (window <= 0) {
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      if (stream.sendWindow <= 0) {
+        stream.windowWaiter = kj::mv(paf.fulfiller);
+      } else {
+        windowWaiters.add(kj::mv(paf.fulfiller));
+      }
+      return paf.promise.then([this, &stream, pieces, offset, endStream]() {
+        return sendData(stream, pieces, offset, endStream);
+      });
+    }
+
+    size_t size = kj::min(total - offset, kj::min(uint64_t(window), peerMaxFrameSize));
+    bool last = offset + size == total;
+    auto frame = newHttp2Frame(Http2Frame::DATA, last && endStream ? Http2Frame::END_STREAM : 0,
+                               stream.id, size);
+
+    // Copy the slices of `pieces` which make up this frame's payload.
+    byte* out = frame.begin() + HTTP2_FRAME_HEADER_SIZE;
+    size_t pos = 0;
+    for (auto& piece: pieces) {
+      size_t start = kj::max(offset, pos);
+      size_t end = kj::min(offset + size, pos + piece.size());
+      if (start < end) {
+        memcpy(out, piece.begin() + (start - pos), end - start);
+        out += end - start;
+      }
+      pos += piece.size();
+    }
+    queueFrame(kj::mv(frame));
+
+    offset += size;
+    stream.sendWindow -= size;
+    sendWindow -= size;
+  }
+
+  if (total == 0 && endStream) {
+    queueFrame(newHttp2Frame(Http2Frame::DATA, Http2Frame::END_STREAM, stream.id, 0));
+  }
+
+  auto promise = batchDone();
+  if (endStream) {
+    stream.localClosed = true;
+    removeStream(stream);
+  }
+  return kj::mv(promise);
+}
+
+void Http2Connection::finishWrite(Stream& stream, bool complete) {
+  if (stream.localClosed || stream.error != nullptr || closed) return;
+
+  KJ_IF_MAYBE(opened, stream.whenOpened) {
+    // The request is still queued. Finish once it has been sent.
+    addTask(opened->addBranch().then(kj::mvCapture(kj::addRef(stream),
+        [this,complete](kj::Own<Stream>&& stream) {
+      finishWrite(*stream, complete);
+    }), [](kj::Exception&& e) {
+      // The request failed before it was sent.
+    }));
+    return;
+  }
+
+  if (complete) {
+    queueFrame(newHttp2Frame(Http2Frame::DATA, Http2Frame::END_STREAM, stream.id, 0));
+    stream.localClosed = true;
+    removeStream(stream);
+  } else {
+    resetStream(stream, Http2Error::CANCEL);
+  }
+}
+
+void Http2Connection::resetStream(Stream& stream, uint32_t code) {
+  if (stream.error != nullptr) return;
+  if (stream.open && !closed) {
+    resetStream(stream.id, code);
+  }
+  failStream(stream, KJ_EXCEPTION(DISCONNECTED, "HTTP/2 stream reset", code));
+}
+
+void Http2Connection::resetStream(uint32_t streamId, uint32_t code) {
+  auto frame = newHttp2Frame(Http2Frame::RST_STREAM, 0, streamId, 4);
+  writeUint32(frame.begin() + HTTP2_FRAME_HEADER_SIZE, code);
+  queueFrame(kj::mv(frame));
+}
+
+void Http2Connection::goAway(uint32_t code) {
+  goAwaySent = true;
+  auto frame = newHttp2Frame(Http2Frame::GOAWAY, 0, 0, 8);
+  writeUint32(frame.begin() + HTTP2_FRAME_HEADER_SIZE, highestPeerStreamId);
+  writeUint32(frame.begin() + HTTP2_FRAME_HEADER_SIZE + 4, code);
+  queueFrame(kj::mv(frame));
+  maybeClose();
+}
+
+// -----------------------------------------------------------------------------
+// Stream bookkeeping
+
+void Http2Connection::openStream(kj::Own<Stream> stream, uint32_t streamId) {
+  stream->id = streamId;
+  stream->open = true;
+  stream->sendWindow = peerInitialWindowSize;
+  if ((streamId & 1) == (isServer ? 0 : 1)) {
+    nextLocalStreamId = streamId + 2;
+  } else {
+    highestPeerStreamId = streamId;
+  }
+  streams.insert(streamId, kj::mv(stream));
+}
+
+void Http2Connection::removeStream(Stream& stream) {
+  if (!stream.open) return;
+
+  if (stream.localClosed && !stream.remoteClosed && stream.readerGone &&
+      stream.error == nullptr) {
+    // We're done, and nobody wants the rest of what the peer is sending. A server which has
+    // responded tells the client to stop sending without error (section 8.1); a client cancels.
+    resetStream(stream, isServer ? Http2Error::NONE : Http2Error::CANCEL);
+    return;
+  }
+
+  if ((stream.localClosed && stream.remoteClosed) || stream.error != nullptr) {
+    stream.open = false;
+    auto ref = kj::addRef(stream);  // The table may hold the last reference.
+    streams.erase(stream.id);
+    onStreamClosed();
+    maybeClose();
+  }
+}
+
+void Http2Connection::failStream(Stream& stream, kj::Exception&& exception) {
+  if (stream.error == nullptr) {
+    stream.error = kj::cp(exception);
+    KJ_IF_MAYBE(read, stream.pendingRead) {
+      read->fulfiller->reject(kj::cp(exception));
+      stream.pendingRead = nullptr;
+    }
+    KJ_IF_MAYBE(waiter, stream.windowWaiter) {
+      waiter->get()->reject(kj::cp(exception));
+      stream.windowWaiter = nullptr;
+    }
+    stream.onFailed(exception);
+  }
+  removeStream(stream);
+}
+
+void Http2Connection::endOfInput(Stream& stream) {
+  KJ_IF_MAYBE(expected, stream.expectedLength) {
+    if (stream.receivedLength != *expected) {
+      resetStream(stream, Http2Error::PROTOCOL_ERROR);
+      return;
+    }
+  }
+
+  stream.remoteClosed = true;
+  KJ_IF_MAYBE(read, stream.pendingRead) {
+    read->fulfiller->fulfill(kj::cp(read->filled));
+    stream.pendingRead = nullptr;
+  }
+  removeStream(stream);
+}
+
+// -----------------------------------------------------------------------------
+// Input
+
+kj::Promise<size_t> Http2Connection::read(Stream& stream, void* buffer,
+                                          size_t minBytes, size_t maxBytes) {
+  byte* out = reinterpret_cast<byte*>(buffer);
+  size_t n = 0;
+  while (n < maxBytes && !stream.received.empty()) {
+    auto& front = stream.received.front();
+    size_t amount = kj::min(maxBytes - n, front.size() - stream.receivedOffset);
+    memcpy(out + n, front.begin() + stream.receivedOffset, amount);
+    n += amount;
+    stream.receivedOffset += amount;
+    if (stream.receivedOffset == front.size()) {
+      stream.received.pop_front();
+      stream.receivedOffset = 0;
+    }
+  }
+  consumed(stream, n);
+
+  if (n >= minBytes || stream.remoteClosed) return n;
+  KJ_IF_MAYBE(e, stream.error) {
+    if (n == 0) return kj::cp(*e);
+    return n;
+  }
+
+  auto paf = kj::newPromiseAndFulfiller<size_t>();
+  stream.pendingRead = Stream::PendingRead { out, minBytes, maxBytes, n, kj::mv(paf.fulfiller) };
+  return kj::mv(paf.promise);
+}
+
+void Http2Connection::finishRead(Stream& stream) {
+  stream.readerGone = true;
+
+  // Discard anything buffered, and give the peer credit for it.
+  size_t discarded = 0;
+  for (auto& data: stream.received) discarded += data.size();
+  discarded -= stream.receivedOffset;
+  stream.received.clear();
+  stream.receivedOffset = 0;
+  consumed(stream, discarded);
+
+  removeStream(stream);
+}
+
+void Http2Connection::consumed(Stream& stream, size_t bytes) {
+  // The application has taken (or discarded) `bytes` of the stream's data, so the peer may send
+  // more. We update the stream's window once half of it has been used, to avoid sending a
+  // WINDOW_UPDATE for every frame.
+
+  stream.readLength += bytes;
+  if (stream.remoteClosed || stream.error != nullptr || closed) return;
+
+  stream.unacknowledgedBytes += bytes;
+  if (stream.unacknowledgedBytes >= localSettings.initialWindowSize / 2 &&
+      stream.unacknowledgedBytes > 0) {
+    sendWindowUpdate(stream.id, stream.unacknowledgedBytes);
+    stream.receiveWindow += stream.unacknowledgedBytes;
+    stream.unacknowledgedBytes = 0;
+  }
+}
+
+kj::Promise<void> Http2Connection::readLoop() {
+  for (;;) {
+    auto available = readBuffer.slice(readStart, readEnd);
+
+    if (!receivedPreface) {
+      size_t n = kj::min(available.size(), HTTP2_PREFACE_SIZE);
+      if (memcmp(available.begin(), HTTP2_PREFACE, n) != 0) {
+        connectionError(Http2Error::PROTOCOL_ERROR, "invalid connection preface");
+      }
+      if (n < HTTP2_PREFACE_SIZE) break;
+      readStart += HTTP2_PREFACE_SIZE;
+      receivedPreface = true;
+      continue;
+    }
+
+    if (available.size() < HTTP2_FRAME_HEADER_SIZE) break;
+    size_t length = (size_t(available[0]) << 16) | (size_t(available[1]) << 8) | available[2];
+    byte type = available[3];
+    byte flags = available[4];
+    uint32_t streamId = readUint32(available.begin() + 5) & HTTP2_MAX_STREAM_ID;
+    if (length > localSettings.maxFrameSize) {
+      connectionError(Http2Error::FRAME_SIZE_ERROR, "frame exceeds SETTINGS_MAX_FRAME_SIZE");
+    }
+    if (available.size() < HTTP2_FRAME_HEADER_SIZE + length) break;
+
+    readStart += HTTP2_FRAME_HEADER_SIZE + length;
+    handleFrame(type, flags, streamId,
+                available.slice(HTTP2_FRAME_HEADER_SIZE, HTTP2_FRAME_HEADER_SIZE + length));
+  }
+
+  // Make room for a whole frame at the end of the buffer.
+  if (readStart == readEnd) {
+    readStart = readEnd = 0;
+  } else if (readBuffer.size() - readStart < HTTP2_FRAME_HEADER_SIZE + localSettings.maxFrameSize) {
+    memmove(readBuffer.begin(), readBuffer.begin() + readStart, readEnd - readStart);
+    readEnd -= readStart;
+    readStart = 0;
+  }
+
+  return inner->tryRead(readBuffer.begin() + readEnd, 1, readBuffer.size() - readEnd)
+      .then([this](size_t n) -> kj::Promise<void> {
+    if (n == 0) {
+      // The peer disconnected. finish() fails any streams still in progress.
+      return kj::READY_NOW;
+    }
+    readEnd += n;
+    return readLoop();
+  });
+}
+
+kj::ArrayPtr<const byte> Http2Connection::removePadding(byte flags,
+                                                        kj::ArrayPtr<const byte> payload) {
+  if (flags & Http2Frame::PADDED) {
+    if (payload.size() < 1 || payload[0] >= payload.size()) {
+      connectionError(Http2Error::PROTOCOL_ERROR, "invalid padding");
+    }
+    return payload.slice(1, payload.size() - payload[0]);
+  }
+  return payload;
+}
+
+void Http2Connection::handleFrame(byte type, byte flags, uint32_t streamId,
+                                  kj::ArrayPtr<const byte> payload) {
+  if (!receivedSettings && (type != Http2Frame::SETTINGS || (flags & Http2Frame::ACK))) {
+    connectionError(Http2Error::PROTOCOL_ERROR, "expected SETTINGS frame");
+  }
+
+  KJ_IF_MAYBE(pending, pendingHeaders) {
+    if (type != Http2Frame::CONTINUATION || streamId != pending->streamId) {
+      connectionError(Http2Error::PROTOCOL_ERROR, "expected CONTINUATION frame");
+    }
+  }
+
+  switch (type) {
+    case Http2Frame::DATA:
+      handleData(flags, streamId, payload);
+      break;
+
+    case Http2Frame::HEADERS:
+      handleHeaders(flags, streamId, payload);
+      break;
+
+    case Http2Frame::PRIORITY:
+      // We don't prioritize streams, but validate the frame anyway.
+      if (streamId == 0) {
+        connectionError(Http2Error::PROTOCOL_ERROR, "PRIORITY frame on stream 0");
+      }
+      if (payload.size() != 5) {
+        resetStream(streamId, Http2Error::FRAME_SIZE_ERROR);
+      }
+      break;
+
+    case Http2Frame::RST_STREAM: {
+      if (streamId == 0 || isIdleStreamId(streamId)) {
+        connectionError(Http2Error::PROTOCOL_ERROR, "RST_STREAM frame on idle stream");
+      }
+      if (payload.size() != 4) {
+        connectionError(Http2Error::FRAME_SIZE_ERROR, "invalid RST_STREAM frame");
+      }
+      KJ_IF_MAYBE(stream, findStream(streamId)) {
+        uint32_t code = readUint32(payload.begin());
+        // A refused stream wasn't processed, so can be retried (section 8.1.4).
+        auto exception = code == Http2Error::REFUSED_STREAM || code == Http2Error::CANCEL ||
+                         code == Http2Error::NONE
+            ? KJ_EXCEPTION(DISCONNECTED, "HTTP/2 stream reset by peer", code)
+            : KJ_EXCEPTION(FAILED, "HTTP/2 stream reset by peer", code);
+        failStream(*stream, kj::mv(exception));
+      }
+      break;
+    }
+
+    case Http2Frame::SETTINGS:
+      handleSettings(flags, streamId, payload);
+      break;
+
+    case Http2Frame::PUSH_PROMISE:
+      // Clients disable push in their settings, and clients can't push at all.
+      connectionError(Http2Error::PROTOCOL_ERROR, "unexpected PUSH_PROMISE frame");
+
+    case Http2Frame::PING:
+      if (streamId != 0) {
+        connectionError(Http2Error::PROTOCOL_ERROR, "PING frame on a stream");
+      }
+      if (payload.size() != 8) {
+        connectionError(Http2Error::FRAME_SIZE_ERROR, "invalid PING frame");
+      }
+      if (!(flags & Http2Frame::ACK)) {
+        auto frame = newHttp2Frame(Http2Frame::PING, Http2Frame::ACK, 0, 8);
+        memcpy(frame.begin() + HTTP2_FRAME_HEADER_SIZE, payload.begin(), 8);
+        queueFrame(kj::mv(frame));
+      }
+      break;
+
+    case Http2Frame::GOAWAY:
+      handleGoAway(streamId, payload);
+      break;
+
+    case Http2Frame::WINDOW_UPDATE:
+      handleWindowUpdate(streamId, payload);
+      break;
+
+    case Http2Frame::CONTINUATION: {
+      KJ_IF_MAYBE(pending, pendingHeaders) {
+        pending->block.addAll(payload);
+        if (pending->block.size() > localSettings.maxHeaderListSize * 2) {
+          connectionError(Http2Error::ENHANCE_YOUR_CALM, "header block too large");
+        }
+        if (flags & Http2Frame::END_HEADERS) {
+          auto headers = kj::mv(*pending);
+          pendingHeaders = nullptr;
+          handleHeaderBlock(headers.streamId, headers.endStream, headers.block);
+        }
+      } else {
+        connectionError(Http2Error::PROTOCOL_ERROR, "unexpected CONTINUATION frame");
+      }
+      break;
+    }
+
+    default:
+      // Unknown frame types are ignored (section 4.1).
+      break;
+  }
+}
+
+void Http2Connection::handleData(byte flags, uint32_t streamId,
+                                 kj::ArrayPtr<const byte> payload) {
+  if (streamId == 0) {
+    connectionError(Http2Error::PROTOCOL_ERROR, "DATA frame on stream 0");
+  }
+
+  // Flow control counts the whole payload, padding included. We return connection-level credit
+  // right away; stream-level credit is what limits how much is buffered.
+  if (int64_t(payload.size()) > receiveWindow) {
+    connectionError(Http2Error::FLOW_CONTROL_ERROR, "connection flow control window exceeded");
+  }
+  receiveWindow -= payload.size();
+  unacknowledgedBytes += payload.size();
+  if (unacknowledgedBytes >= localSettings.connectionWindowSize / 2) {
+    sendWindowUpdate(0, unacknowledgedBytes);
+    receiveWindow += unacknowledgedBytes;
+    unacknowledgedBytes = 0;
+  }
+
+  auto data = removePadding(flags, payload);
+
+  KJ_IF_MAYBE(stream, findStream(streamId)) {
+    if (stream->remoteClosed) {
+      resetStream(*stream, Http2Error::STREAM_CLOSED);
+      return;
+    }
+    if (!stream->headersReceived) {
+      resetStream(*stream, Http2Error::PROTOCOL_ERROR);
+      return;
+    }
+    if (int64_t(payload.size()) > stream->receiveWindow) {
+      resetStream(*stream, Http2Error::FLOW_CONTROL_ERROR);
+      return;
+    }
+    stream->receiveWindow -= payload.size();
+    stream->unacknowledgedBytes += payload.size() - data.size();
+
+    stream->receivedLength += data.size();
+    KJ_IF_MAYBE(expected, stream->expectedLength) {
+      if (stream->receivedLength > *expected) {
+        resetStream(*stream, Http2Error::PROTOCOL_ERROR);
+        return;
+      }
+    }
+
+    if (stream->readerGone) {
+      consumed(*stream, data.size());
+    } else {
+      KJ_IF_MAYBE(read, stream->pendingRead) {
+        size_t n = kj::min(data.size(), read->maxBytes - read->filled);
+        memcpy(read->buffer + read->filled, data.begin(), n);
+        read->filled += n;
+        data = data.slice(n, data.size());
+        if (read->filled >= read->minBytes) {
+          read->fulfiller->fulfill(kj::cp(read->filled));
+          stream->pendingRead = nullptr;
+        }
+        consumed(*stream, n);
+      }
+      if (data.size() > 0) {
+        stream->received.push_back(kj::heapArray(data));
+      }
+    }
+
+    if (flags & Http2Frame::END_STREAM) {
+      endOfInput(*stream);
+    }
+  } else if (isIdleStreamId(streamId)) {
+    connectionError(Http2Error::PROTOCOL_ERROR, "DATA frame on idle stream");
+  } else {
+    // The stream has closed. Perhaps we reset it and the peer hasn't seen that yet.
+  }
+}
+
+void Http2Connection::handleHeaders(byte flags, uint32_t streamId,
+                                    kj::ArrayPtr<const byte> payload) {
+  if (streamId == 0) {
+    connectionError(Http2Error::PROTOCOL_ERROR, "HEADERS frame on stream 0");
+  }
+
+  auto block = removePadding(flags, payload);
+  if (flags & Http2Frame::PRIORITY_INFO) {
+    if (block.size() < 5) {
+      connectionError(Http2Error::FRAME_SIZE_ERROR, "invalid HEADERS frame");
+    }
+    block = block.slice(5, block.size());
+  }
+
+  bool endStream = flags & Http2Frame::END_STREAM;
+  if (flags & Http2Frame::END_HEADERS) {
+    handleHeaderBlock(streamId, endStream, block);
+  } else {
+    kj::Vector<byte> copy(block.size());
+    copy.addAll(block);
+    pendingHeaders = PendingHeaders { streamId, endStream, kj::mv(copy) };
+  }
+}
+
+void Http2Connection::handleHeaderBlock(uint32_t streamId, bool endStream,
+                                        kj::ArrayPtr<const byte> block) {
+  // The block must be decoded even if we're going to ignore it, to keep the decoder's table in
+  // sync with the peer's encoder.
+  KJ_IF_MAYBE(fields, decoder.decode(block, localSettings.maxHeaderListSize)) {
+    onHeaders(streamId, endStream, kj::mv(*fields));
+    KJ_IF_MAYBE(stream, findStream(streamId)) {
+      stream->headersReceived = true;
+    }
+  } else {
+    connectionError(Http2Error::COMPRESSION_ERROR, "invalid HPACK header block");
+  }
+}
+
+void Http2Connection::handleSettings(byte flags, uint32_t streamId,
+                                     kj::ArrayPtr<const byte> payload) {
+  if (streamId != 0) {
+    connectionError(Http2Error::PROTOCOL_ERROR, "SETTINGS frame on a stream");
+  }
+  if (flags & Http2Frame::ACK) {
+    if (payload.size() != 0) {
+      connectionError(Http2Error::FRAME_SIZE_ERROR, "invalid SETTINGS acknowledgement");
+    }
+    return;
+  }
+  if (payload.size() % 6 != 0) {
+    connectionError(Http2Error::FRAME_SIZE_ERROR, "invalid SETTINGS frame");
+  }
+  receivedSettings = true;
+
+  for (size_t i = 0; i < payload.size(); i += 6) {
+    uint16_t id = (uint16_t(payload[i]) << 8) | payload[i + 1];
+    uint32_t value = readUint32(payload.begin() + i + 2);
+    switch (id) {
+      case Http2Setting::HEADER_TABLE_SIZE:
+        encoder.setPeerTableSize(value);
+        break;
+      case Http2Setting::ENABLE_PUSH:
+        // We never push, so only validate.
+        if (value > 1 || (!isServer && value != 0)) {
+          connectionError(Http2Error::PROTOCOL_ERROR, "invalid SETTINGS_ENABLE_PUSH");
+        }
+        break;
+      case Http2Setting::MAX_CONCURRENT_STREAMS:
+        peerMaxConcurrentStreams = value;
+        break;
+      case Http2Setting::INITIAL_WINDOW_SIZE: {
+        if (value > HTTP2_MAX_WINDOW_SIZE) {
+          connectionError(Http2Error::FLOW_CONTROL_ERROR, "invalid SETTINGS_INITIAL_WINDOW_SIZE");
+        }
+        // The change applies to the windows of streams already open (section 6.9.2).
+        int64_t delta = int64_t(value) - int64_t(peerInitialWindowSize);
+        peerInitialWindowSize = value;
+        for (auto& entry: streams) {
+          auto& stream = *entry.value;
+          stream.sendWindow += delta;
+          if (stream.sendWindow > HTTP2_MAX_WINDOW_SIZE) {
+            connectionError(Http2Error::FLOW_CONTROL_ERROR, "stream window overflow");
+          }
+          if (stream.sendWindow > 0) {
+            KJ_IF_MAYBE(waiter, stream.windowWaiter) {
+              waiter->get()->fulfill();
+              stream.windowWaiter = nullptr;
+            }
+          }
+        }
+        break;
+      }
+      case Http2Setting::MAX_FRAME_SIZE:
+        if (value < HTTP2_DEFAULT_MAX_FRAME_SIZE || value > HTTP2_MAX_MAX_FRAME_SIZE) {
+          connectionError(Http2Error::PROTOCOL_ERROR, "invalid SETTINGS_MAX_FRAME_SIZE");
+        }
+        peerMaxFrameSize = value;
+        break;
+      default:
+        // SETTINGS_MAX_HEADER_LIST_SIZE is advisory. Unknown settings are ignored (section 6.5.2).
+        break;
+    }
+  }
+
+  queueFrame(newHttp2Frame(Http2Frame::SETTINGS, Http2Frame::ACK, 0, 0));
+  onSettingsChanged();
+}
+
+void Http2Connection::handleGoAway(uint32_t streamId, kj::ArrayPtr<const byte> payload) {
+  if (streamId != 0) {
+    connectionError(Http2Error::PROTOCOL_ERROR, "GOAWAY frame on a stream");
+  }
+  if (payload.size() < 8) {
+    connectionError(Http2Error::FRAME_SIZE_ERROR, "invalid GOAWAY frame");
+  }
+  uint32_t lastStreamId = readUint32(payload.begin()) & HTTP2_MAX_STREAM_ID;
+  goAwayReceived = true;
+
+  // Streams we opened after the last one the peer will process were never seen, so can be
+  // retried elsewhere.
+  kj::Vector<kj::Own<Stream>> unprocessed;
+  for (auto& entry: streams) {
+    auto id = entry.key;
+    if ((id & 1) == (isServer ? 0 : 1) && id > lastStreamId) {
+      unprocessed.add(kj::addRef(*entry.value));
+    }
+  }
+  for (auto& stream: unprocessed) {
+    failStream(*stream, KJ_EXCEPTION(DISCONNECTED,
+        "HTTP/2 peer closed the connection before processing the stream"));
+  }
+
+  onSettingsChanged();
+  maybeClose();
+}
+
+void Http2Connection::handleWindowUpdate(uint32_t streamId, kj::ArrayPtr<const byte> payload) {
+  if (payload.size() != 4) {
+    connectionError(Http2Error::FRAME_SIZE_ERROR, "invalid WINDOW_UPDATE frame");
+  }
+  uint32_t increment = readUint32(payload.begin()) & HTTP2_MAX_WINDOW_SIZE;
+
+  if (streamId == 0) {
+    if (increment == 0) {
+      connectionError(Http2Error::PROTOCOL_ERROR, "zero WINDOW_UPDATE");
+    }
+    sendWindow += increment;
+    if (sendWindow > HTTP2_MAX_WINDOW_SIZE) {
+      connectionError(Http2Error::FLOW_CONTROL_ERROR, "connection window overflow");
+    }
+    for (auto& waiter: windowWaiters) {
+      waiter->fulfill();
+    }
+    windowWaiters.clear();
+  } else KJ_IF_MAYBE(stream, findStream(streamId)) {
+    if (increment == 0) {
+      resetStream(*stream, Http2Error::PROTOCOL_ERROR);
+      return;
+    }
+    stream->sendWindow += increment;
+    if (stream->sendWindow > HTTP2_MAX_WINDOW_SIZE) {
+      resetStream(*stream, Http2Error::FLOW_CONTROL_ERROR);
+      return;
+    }
+    if (stream->sendWindow > 0) {
+      KJ_IF_MAYBE(waiter, stream->windowWaiter) {
+        waiter->get()->fulfill();
+        stream->windowWaiter = nullptr;
+      }
+    }
+  } else if (isIdleStreamId(streamId)) {
+    connectionError(Http2Error::PROTOCOL_ERROR, "WINDOW_UPDATE frame on idle stream");
+  }
+}
+
+bool Http2Connection::decodeFields(HpackDecoder::HeaderList& list, PseudoHeaders& pseudo,
+                                   HttpHeaders& headers, kj::Maybe<uint64_t>& contentLength) {
+  bool regularSeen = false;
+  kj::Vector<kj::StringPtr> cookies;
+
+  for (auto& field: list.fields) {
+    auto name = field.name;
+    auto value = field.value;
+
+    for (char c: value) {
+      if (c == '\0' || c == '\r' || c == '\n') return false;
+    }
+
+    if (name.startsWith(":")) {
+      // Pseudo-headers come first, once each (section 8.1.2.1).
+      if (regularSeen) return false;
+      kj::Maybe<kj::StringPtr>* slot;
+      if (name == ":method") {
+        slot = &pseudo.method;
+      } else if (name == ":scheme") {
+        slot = &pseudo.scheme;
+      } else if (name == ":authority") {
+        slot = &pseudo.authority;
+      } else if (name == ":path") {
+        slot = &pseudo.path;
+      } else if (name == ":status") {
+        slot = &pseudo.status;
+      } else {
+        return false;
+      }
+      if (*slot != nullptr) return false;
+      *slot = value;
+      continue;
+    }
+
+    regularSeen = true;
+    if (name.size() == 0) return false;
+    for (char c: name) {
+      if (('A' <= c && c <= 'Z') || !HTTP_HEADER_NAME_CHARS.contains(c)) return false;
+    }
+    if (isHttp2ConnectionSpecificHeader(name) || (name == "te" && value != "trailers")) {
+      return false;
+    }
+
+    if (name == "cookie") {
+      // Cookies may be split into separate fields for better compression (section 8.1.2.5).
+      cookies.add(value);
+      continue;
+    }
+
+    if (name == "content-length") {
+      if (value.size() == 0 || value.size() > 19) return false;
+      uint64_t length = 0;
+      for (char c: value) {
+        if (c < '0' || c > '9') return false;
+        length = length * 10 + (c - '0');
+      }
+      KJ_IF_MAYBE(previous, contentLength) {
+        if (*previous != length) return false;
+        continue;
+      }
+      contentLength = length;
+    }
+
+    headers.add(name, value);
+  }
+
+  if (cookies.size() == 1) {
+    headers.add("cookie", cookies[0]);
+  } else if (cookies.size() > 1) {
+    headers.add("cookie", kj::strArray(cookies, "; "));
+  }
+
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// HTTP/2 server
+
+class HttpRequestSlot {
+  // Held while the HttpService handles a request, counting it toward
+  // HttpServerSettings::maxConcurrentRequests.
+public:
+  virtual ~HttpRequestSlot() noexcept(false) {}
+};
+
+class HttpRequestAdmission {
+  // Lets a connection ask its HttpServer whether a request may be served now.
+public:
+  virtual kj::Promise<kj::Maybe<kj::Own<HttpRequestSlot>>> admitRequest() = 0;
+  // Resolves to a slot once the request may be passed to the service, or to null if it should be
+  // answered with a 503 error instead.
+};
+
+class Http2ServerConnection final: public Http2Connection {
+  // Serves requests received on an HTTP/2 connection, each on its own stream, concurrently.
+
+public:
+  Http2ServerConnection(kj::Timer& timer, HttpHeaderTable& requestHeaderTable,
+                        HttpService& service, const HttpServerSettings& settings,
+                        HttpRequestAdmission& admission, kj::Own<kj::AsyncIoStream> stream)
+      : Http2Connection(kj::mv(stream), true, KJ_ASSERT_NONNULL(settings.http2)),
+        timer(timer), requestHeaderTable(requestHeaderTable), service(service),
+        serverSettings(settings), admission(admission) {}
+
+  kj::Promise<void> serve(kj::ArrayPtr<const byte> received, kj::Promise<void> onDrain) {
+    // Serves the connection until the client closes it, it is idle for too long, or the server
+    // drains.
+
+    drainTask = onDrain.then([this]() {
+      if (!goAwaySent) goAway(Http2Error::NONE);
+    }).eagerlyEvaluate(nullptr);
+    setIdleTimer(serverSettings.headerTimeout);
+    return run(received);
+  }
+
+private:
+  class RequestStream final: public Stream, public HttpService::Response {
+  public:
+    RequestStream(Http2ServerConnection& server)
+        : Stream(server), headers(server.requestHeaderTable), server(server) {}
+
+    HttpMethod method = HttpMethod::GET;
+    HttpHeaders headers;
+    HpackDecoder::HeaderList fields;
+    // `headers` point into `fields`.
+
+    bool responded = false;
+
+    kj::Own<kj::AsyncOutputStream> send(
+        uint statusCode, kj::StringPtr statusText, const HttpHeaders& headers,
+        kj::Maybe<uint64_t> expectedBodySize) override {
+      KJ_REQUIRE(!responded, "already called send()");
+      responded = true;
+      return server.sendResponse(*this, statusCode, headers, expectedBodySize);
+    }
+
+  private:
+    Http2ServerConnection& server;
+  };
+
+  kj::Timer& timer;
+  HttpHeaderTable& requestHeaderTable;
+  HttpService& service;
+  const HttpServerSettings& serverSettings;
+  HttpRequestAdmission& admission;
+
+  uint activeRequests = 0;
+  // Requests whose HttpService::request() promise hasn't completed. Its stream may have closed
+  // already.
+
+  kj::Promise<void> idleTimer = nullptr;
+  kj::Promise<void> drainTask = nullptr;
+
+  bool isQuiescent() override {
+    return Http2Connection::isQuiescent() && activeRequests == 0;
+  }
+
+  void onStreamClosed() override {
+    if (isQuiescent() && !closed) {
+      setIdleTimer(serverSettings.pipelineTimeout);
+    }
+  }
+
+  void setIdleTimer(kj::Duration timeout) {
+    // If nothing happens within the timeout, close the connection, as an HTTP/1 server closes a
+    // connection on which no request arrives.
+    idleTimer = timer.afterDelay(timeout).then([this]() {
+      if (!goAwaySent) goAway(Http2Error::NONE);
+    }).eagerlyEvaluate(nullptr);
+  }
+
+  void onHeaders(uint32_t streamId, bool endStream, HpackDecoder::HeaderList&& fields) override {
+    KJ_IF_MAYBE(stream, findStream(streamId)) {
+      // Trailers. We don't expose them, but they must end the stream.
+      if (endStream) {
+        endOfInput(*stream);
+      } else {
+        resetStream(*stream, Http2Error::PROTOCOL_ERROR);
+      }
+      return;
+    }
+
+    if ((streamId & 1) == 0) {
+      connectionError(Http2Error::PROTOCOL_ERROR, "client used a server-initiated stream ID");
+    }
+    if (!isIdleStreamId(streamId)) {
+      // The stream has closed.
+      resetStream(streamId, Http2Error::STREAM_CLOSED);
+      return;
+    }
+    if (goAwaySent) {
+      // Streams opened after our GOAWAY are ignored (section 6.8).
+      return;
+    }
+    if (streams.size() >= localSettings.maxConcurrentStreams) {
+      highestPeerStreamId = streamId;
+      resetStream(streamId, Http2Error::REFUSED_STREAM);
+      return;
+    }
+
+    auto ownStream = kj::refcounted<RequestStream>(*this);
+    auto& stream = *ownStream;
+    openStream(kj::mv(ownStream), streamId);
+    idleTimer = nullptr;
+
+    if (fields.tooLarge) {
+      stream.fields = kj::mv(fields);
+      respondWithError(stream, endStream, 431, "Request Header Fields Too Large",
+          kj::str("ERROR: The headers sent by your client were too large."));
+      return;
+    }
+
+    PseudoHeaders pseudo;
+    stream.fields = kj::mv(fields);
+    if (!decodeFields(stream.fields, pseudo, stream.headers, stream.expectedLength) ||
+        pseudo.status != nullptr) {
+      resetStream(stream, Http2Error::PROTOCOL_ERROR);
+      return;
+    }
+
+    // CONNECT is not supported, so all three of these are required (section 8.1.2.3).
+    if (pseudo.method == nullptr || pseudo.scheme == nullptr || pseudo.path == nullptr ||
+        KJ_ASSERT_NONNULL(pseudo.path).size() == 0) {
+      resetStream(stream, Http2Error::PROTOCOL_ERROR);
+      return;
+    }
+    auto methodName = KJ_ASSERT_NONNULL(pseudo.method);
+    auto path = KJ_ASSERT_NONNULL(pseudo.path);
+
+    KJ_IF_MAYBE(authority, pseudo.authority) {
+      if (stream.headers.get(HttpHeaderId::HOST) == nullptr) {
+        stream.headers.set(HttpHeaderId::HOST, *authority);
+      }
+    }
+
+    KJ_IF_MAYBE(method, tryParseHttpMethod(methodName)) {
+      stream.method = *method;
+    } else {
+      respondWithError(stream, endStream, 501, "Not Implemented",
+          kj::str("ERROR: Unrecognized request method."));
+      return;
+    }
+
+    if (endStream) {
+      endOfInput(stream);
+      if (stream.error != nullptr) return;
+    }
+
+    ++activeRequests;
+    auto body = kj::heap<Http2BodyReader>(kj::addRef(stream));
+    auto promise = admission.admitRequest().then(kj::mvCapture(body,
+        [this,&stream,path](kj::Own<Http2BodyReader>&& body,
+                            kj::Maybe<kj::Own<HttpRequestSlot>>&& slot) -> kj::Promise<void> {
+      KJ_IF_MAYBE(s, slot) {
+        auto promise = service.request(stream.method, path, stream.headers, *body, stream)
+            .attach(kj::mv(body), kj::mv(*s));
+        KJ_IF_MAYBE(tracer, kj::AsyncTracer::current()) {
+          promise = promise.attach(
+              tracer->startSpan("http", kj::str("serve ", stream.method, ' ', path)));
+        }
+        return kj::mv(promise);
+      } else {
+        body = nullptr;  // discard the request body
+        return sendError(stream, 503, "Service Unavailable", kj::str(
+            "ERROR: The server is too busy to handle your request."));
+      }
+    }));
+    addTask(promise
+        .then([this,&stream]() -> kj::Promise<void> {
+      if (!stream.responded) {
+        return sendError(stream, 500, "Internal Server Error", kj::str(
+            "ERROR: The HttpService did not generate a response."));
+      }
+      return kj::READY_NOW;
+    }, [this,&stream](kj::Exception&& e) -> kj::Promise<void> {
+      return handleException(stream, kj::mv(e));
+    }).attach(kj::addRef(stream)).then([this]() {
+      --activeRequests;
+      onStreamClosed();
+      maybeClose();
+    }, [this](kj::Exception&& e) {
+      // Probably the stream was reset, so the error couldn't be sent.
+      --activeRequests;
+      onStreamClosed();
+      maybeClose();
+      if (e.getType() != kj::Exception::Type::DISCONNECTED) {
+        KJ_LOG(ERROR, "error sending HTTP/2 response", e);
+      }
+    }));
+  }
+
+  kj::Own<kj::AsyncOutputStream> sendResponse(
+      RequestStream& stream, uint statusCode, const HttpHeaders& headers,
+      kj::Maybe<uint64_t> expectedBodySize) {
+    KJ_IF_MAYBE(e, stream.error) {
+      kj::throwFatalException(kj::cp(*e));
+    }
+    if (closed) {
+      kj::throwFatalException(KJ_EXCEPTION(DISCONNECTED, "HTTP/2 connection closed"));
+    }
+
+    bool noBody = statusCode == 204 || statusCode == 205 || statusCode == 304;
+
+    kj::Vector<byte> block(256);
+    encoder.startBlock(block);
+    auto status = kj::str(statusCode);
+    encoder.encode(block, ":status", status, HpackEncoder::INDEX);
+    encodeHeaders(block, headers);
+    kj::String length;
+    if (!noBody) {
+      KJ_IF_MAYBE(s, expectedBodySize) {
+        length = kj::str(*s);
+        encoder.encode(block, "content-length", length, HpackEncoder::DONT_INDEX);
+      }
+    }
+
+    bool endStream = noBody || stream.method == HttpMethod::HEAD ||
+                     expectedBodySize.orDefault(1) == 0;
+    sendHeaders(stream, block, endStream);
+
+    if (stream.method == HttpMethod::HEAD) {
+      // Ignore entity-body.
+      return kj::heap<HttpDiscardingEntityWriter>();
+    } else if (endStream) {
+      return kj::heap<HttpNullEntityWriter>();
+    } else {
+      return kj::heap<Http2BodyWriter>(kj::addRef(stream), expectedBodySize);
+    }
+  }
+
+  kj::Promise<void> sendError(RequestStream& stream, uint statusCode, kj::StringPtr statusText,
+                              kj::String body) {
+    HttpHeaders failed(requestHeaderTable);
+    failed.set(HttpHeaderId::CONTENT_TYPE, "text/plain");
+
+    stream.responded = true;
+    auto writer = sendResponse(stream, statusCode, failed, body.size());
+    auto promise = writer->write(body.begin(), body.size());
+    return promise.attach(kj::mv(writer), kj::mv(body));
+  }
+
+  void respondWithError(RequestStream& stream, bool endStream, uint statusCode,
+                        kj::StringPtr statusText, kj::String body) {
+    // Responds to a request which won't be passed to the service, discarding its body.
+
+    if (endStream) {
+      endOfInput(stream);
+    } else {
+      finishRead(stream);
+    }
+    addTask(sendError(stream, statusCode, statusText, kj::mv(body))
+        .attach(kj::addRef(stream))
+        .catch_([](kj::Exception&& e) {}));
+  }
+
+  kj::Promise<void> handleException(RequestStream& stream, kj::Exception&& e) {
+    // As HttpServer::Connection does for HTTP/1, but a failed request doesn't affect others on
+    // the same connection.
+
+    if (stream.responded) {
+      // Already sent a (possibly partial) response. Reset the stream so that the client knows
+      // that the response is incomplete.
+      if (e.getType() != kj::Exception::Type::DISCONNECTED) {
+        KJ_LOG(ERROR, "HttpService threw exception after generating a partial response",
+                      "too late to report error to client", e);
+      }
+      resetStream(stream, Http2Error::INTERNAL_ERROR);
+      return kj::READY_NOW;
+    }
+
+    if (e.getType() == kj::Exception::Type::OVERLOADED) {
+      return sendError(stream, 503, "Service Unavailable", kj::str(
+          "ERROR: The server is temporarily unable to handle your request. Details:\n\n", e));
+    } else if (e.getType() == kj::Exception::Type::UNIMPLEMENTED) {
+      return sendError(stream, 501, "Not Implemented", kj::str(
+          "ERROR: The server does not implement this operation. Details:\n\n", e));
+    } else if (e.getType() == kj::Exception::Type::DISCONNECTED) {
+      // The HTTP/1 server drops the connection, so that the client sees what looks like a network
+      // error. Cancel just this stream instead.
+      resetStream(stream, Http2Error::CANCEL);
+      return kj::READY_NOW;
+    } else {
+      return sendError(stream, 500, "Internal Server Error", kj::str(
+          "ERROR: The server threw an exception. Details:\n\n", e));
+    }
+  }
+};
+
+// -----------------------------------------------------------------------------
+// HTTP/2 client
+
+class Http2ClientImpl final: public HttpClient, private Http2Connection {
+  // Sends each request on its own stream of one HTTP/2 connection.
+
+public:
+  Http2ClientImpl(HttpHeaderTable& responseHeaderTable, kj::Own<kj::AsyncIoStream> stream,
+                  kj::StringPtr scheme, const Http2Settings& settings)
+      : Http2Connection(kj::mv(stream), false, settings),
+        responseHeaderTable(responseHeaderTable), scheme(scheme) {
+    runTask = run().then([this]() {
+      failQueued(KJ_EXCEPTION(DISCONNECTED, "HTTP/2 connection closed"));
+    }, [this](kj::Exception&& e) {
+      failQueued(kj::mv(e));
+    }).eagerlyEvaluate(nullptr);
+  }
+
+  bool canReuse() {
+    // Returns true if we can send another request on this connection.
+
+    return !closed && !goAwaySent && !goAwayReceived && nextLocalStreamId <= HTTP2_MAX_STREAM_ID;
+  }
+
+  Request request(HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+                  kj::Maybe<uint64_t> expectedBodySize = nullptr) override {
+    KJ_REQUIRE(canReuse(),
+        "this HttpClient's connection has been closed by the server or due to an error");
+
+    bool hasBody = method != HttpMethod::GET && method != HttpMethod::HEAD &&
+                   expectedBodySize.orDefault(1) != 0;
+
+    auto paf = kj::newPromiseAndFulfiller<Response>();
+    auto stream = kj::refcounted<ResponseStream>(*this, method, kj::mv(paf.fulfiller));
+
+    kj::Own<kj::AsyncOutputStream> body;
+    if (hasBody) {
+      body = kj::heap<Http2BodyWriter>(kj::addRef(*stream), expectedBodySize);
+    } else {
+      body = kj::heap<HttpNullEntityWriter>();
+    }
+
+    if (queue.empty() && streams.size() < peerMaxConcurrentStreams) {
+      startRequest(kj::mv(stream), url, headers, expectedBodySize, !hasBody);
+    } else {
+      // Wait until the server allows another stream. We can't encode the header block yet, since
+      // HPACK requires blocks to be encoded in the order they are sent.
+      auto opened = kj::newPromiseAndFulfiller<void>();
+      stream->whenOpened = opened.promise.fork();
+      stream->pending = PendingRequest {
+        kj::str(url), headers.clone(), expectedBodySize, !hasBody, kj::mv(opened.fulfiller)
+      };
+      queue.push_back(kj::mv(stream));
+    }
+
+    return { kj::mv(body), kj::mv(paf.promise) };
+  }
+
+private:
+  struct PendingRequest {
+    kj::String url;
+    HttpHeaders headers;
+    kj::Maybe<uint64_t> expectedBodySize;
+    bool endStream;
+    kj::Own<kj::PromiseFulfiller<void>> opened;
+  };
+
+  class ResponseStream final: public Stream {
+  public:
+    ResponseStream(Http2ClientImpl& client, HttpMethod method,
+                   kj::Own<kj::PromiseFulfiller<Response>> fulfiller)
+        : Stream(client), method(method), fulfiller(kj::mv(fulfiller)) {}
+
+    HttpMethod method;
+    kj::Own<kj::PromiseFulfiller<Response>> fulfiller;
+    kj::Maybe<PendingRequest> pending;
+    // Set while the request is queued.
+
+    kj::Maybe<HttpHeaders> headers;
+    HpackDecoder::HeaderList fields;
+    // Response headers, once received. `headers` point into `fields`.
+
+  protected:
+    void onFailed(const kj::Exception& exception) override {
+      if (fulfiller->isWaiting()) {
+        fulfiller->reject(kj::cp(exception));
+      }
+      KJ_IF_MAYBE(p, pending) {
+        p->opened->reject(kj::cp(exception));
+      }
+    }
+  };
+
+  HttpHeaderTable& responseHeaderTable;
+  kj::StringPtr scheme;
+  // Used for requests whose URL is just a path.
+
+  std::deque<kj::Own<ResponseStream>> queue;
+  // Requests waiting for the server to allow another stream.
+
+  kj::Promise<void> runTask = nullptr;
+
+  void startRequest(kj::Own<ResponseStream> ownStream, kj::StringPtr url,
+                    const HttpHeaders& headers, kj::Maybe<uint64_t> expectedBodySize,
+                    bool endStream) {
+    auto& stream = *ownStream;
+
+    kj::StringPtr requestScheme = scheme;
+    kj::StringPtr path = url;
+    kj::Maybe<kj::StringPtr> authority = headers.get(HttpHeaderId::HOST);
+    kj::String ownText;
+
+    if (!url.startsWith("/") && url != "*") {
+      // A proxy request, with an absolute URL. HTTP/2 carries its parts in pseudo-headers.
+      KJ_IF_MAYBE(view, UrlView::tryParse(url)) {
+        auto urlScheme = kj::heapString(view->scheme);
+        auto host = kj::heapString(view->host);
+        KJ_IF_MAYBE(target, view->getRequestTarget()) {
+          ownText = kj::str(urlScheme, '\0', host, '\0', *target);
+        } else {
+          ownText = kj::str(urlScheme, '\0', host, '\0',
+                            view->toUrl().toString(Url::HTTP_REQUEST));
+        }
+        requestScheme = ownText.begin();
+        authority = kj::StringPtr(ownText.begin() + urlScheme.size() + 1, host.size());
+        path = ownText.begin() + urlScheme.size() + host.size() + 2;
+      }
+    }
+    if (path.size() == 0) path = "/";
+
+    kj::Vector<byte> block(256);
+    encoder.startBlock(block);
+    encoder.encode(block, ":method", kj::toCharSequence(stream.method), HpackEncoder::INDEX);
+    encoder.encode(block, ":scheme", requestScheme, HpackEncoder::INDEX);
+    KJ_IF_MAYBE(a, authority) {
+      encoder.encode(block, ":authority", *a, HpackEncoder::INDEX);
+    }
+    encoder.encode(block, ":path", path, HpackEncoder::DONT_INDEX);
+    encodeHeaders(block, headers);
+    kj::String length;
+    if (!endStream) {
+      KJ_IF_MAYBE(s, expectedBodySize) {
+        length = kj::str(*s);
+        encoder.encode(block, "content-length", length, HpackEncoder::DONT_INDEX);
+      }
+    }
+
+    openStream(kj::mv(ownStream), nextLocalStreamId);
+    sendHeaders(stream, block, endStream);
+  }
+
+  void startQueued() {
+    while (!queue.empty() && canReuse() && streams.size() < peerMaxConcurrentStreams) {
+      auto stream = kj::mv(queue.front());
+      queue.pop_front();
+      auto pending = KJ_ASSERT_NONNULL(kj::mv(stream->pending));
+      stream->pending = nullptr;
+
+      if (!stream->fulfiller->isWaiting()) {
+        // The request was canceled while it waited.
+        pending.opened->reject(KJ_EXCEPTION(DISCONNECTED, "HTTP request canceled"));
+        continue;
+      }
+
+      auto& ref = *stream;
+      startRequest(kj::mv(stream), pending.url, pending.headers, pending.expectedBodySize,
+                   pending.endStream);
+      pending.opened->fulfill();
+      ref.whenOpened = nullptr;
+    }
+
+    if (!canReuse()) {
+      failQueued(KJ_EXCEPTION(DISCONNECTED,
+          "HTTP/2 connection closed before the request was sent; it is safe to retry"));
+    }
+  }
+
+  void failQueued(kj::Exception&& exception) {
+    auto requests = kj::mv(queue);
+    for (auto& stream: requests) {
+      failStream(*stream, kj::cp(exception));
+    }
+  }
+
+  void onStreamClosed() override {
+    startQueued();
+  }
+
+  void onSettingsChanged() override {
+    startQueued();
+  }
+
+  void onHeaders(uint32_t streamId, bool endStream, HpackDecoder::HeaderList&& fields) override {
+    ResponseStream* found = nullptr;
+    KJ_IF_MAYBE(s, findStream(streamId)) {
+      found = &static_cast<ResponseStream&>(*s);
+    } else if (isIdleStreamId(streamId)) {
+      connectionError(Http2Error::PROTOCOL_ERROR, "HEADERS frame on idle stream");
+    } else {
+      // The stream has closed, perhaps because we canceled it.
+      return;
+    }
+    auto& stream = *found;
+
+    if (stream.headers != nullptr) {
+      // Trailers. We don't expose them, but they must end the stream.
+      if (endStream) {
+        endOfInput(stream);
+      } else {
+        resetStream(stream, Http2Error::PROTOCOL_ERROR);
+      }
+      return;
+    }
+
+    if (fields.tooLarge) {
+      resetStream(stream, Http2Error::PROTOCOL_ERROR);
+      return;
+    }
+
+    PseudoHeaders pseudo;
+    HttpHeaders headers(responseHeaderTable);
+    kj::Maybe<uint64_t> contentLength;
+    if (!decodeFields(fields, pseudo, headers, contentLength) ||
+        pseudo.method != nullptr || pseudo.scheme != nullptr ||
+        pseudo.authority != nullptr || pseudo.path != nullptr) {
+      resetStream(stream, Http2Error::PROTOCOL_ERROR);
+      return;
+    }
+
+    uint statusCode = 0;
+    KJ_IF_MAYBE(status, pseudo.status) {
+      if (status->size() == 3) {
+        for (char c: *status) {
+          if (c < '0' || c > '9') {
+            statusCode = 0;
+            break;
+          }
+          statusCode = statusCode * 10 + (c - '0');
+        }
+      }
+    }
+    if (statusCode < 100) {
+      resetStream(stream, Http2Error::PROTOCOL_ERROR);
+      return;
+    }
+
+    if (statusCode < 200) {
+      // An interim response, which we skip as HttpClientImpl does. The final response follows.
+      if (endStream) resetStream(stream, Http2Error::PROTOCOL_ERROR);
+      return;
+    }
+
+    if (stream.method == HttpMethod::HEAD ||
+        statusCode == 204 || statusCode == 205 || statusCode == 304) {
+      // No entity-body, whatever Content-Length says.
+      stream.expectedLength = uint64_t(0);
+    } else {
+      stream.expectedLength = contentLength;
+    }
+
+    stream.fields = kj::mv(fields);
+    auto& responseHeaders = stream.headers.emplace(kj::mv(headers));
+
+    if (stream.fulfiller->isWaiting()) {
+      stream.fulfiller->fulfill(Response {
+        statusCode, "", &responseHeaders, kj::heap<Http2BodyReader>(kj::addRef(stream))
+      });
+    } else {
+      // Nobody wants the response.
+      finishRead(stream);
+    }
+
+    if (endStream && stream.error == nullptr) {
+      endOfInput(stream);
+    }
+  }
+};
+
+}  // namespace
+
+kj::Own<HttpClient> newHttp2Client(
+    HttpHeaderTable& responseHeaderTable, kj::AsyncIoStream& stream,
+    HttpClientSettings settings) {
+  auto scheme = stream.getNegotiatedProtocol() == nullptr ? "http" : "https";
+  return kj::heap<Http2ClientImpl>(responseHeaderTable,
+      kj::Own<kj::AsyncIoStream>(&stream, kj::NullDisposer::instance), scheme,
+      settings.http2.orDefault(Http2Settings()));
+}
+
 // =======================================================================================
 
 namespace {
@@ -2477,6 +5915,10 @@ public:
         return HttpClient::Response();
       }
     });
+    KJ_IF_MAYBE(tracer, kj::AsyncTracer::current()) {
+      responsePromise = responsePromise.attach(
+          tracer->startSpan("http", kj::str(method, ' ', url)));
+    }
 
     return { kj::mv(bodyStream), kj::mv(responsePromise) };
   }
@@ -2506,6 +5948,16 @@ public:
     connectionHeaders[BuiltinHeaderIndices::SEC_WEBSOCKET_VERSION] = "13";
     connectionHeaders[BuiltinHeaderIndices::SEC_WEBSOCKET_KEY] = keyBase64;
 
+    kj::Maybe<uint> compressionWindowBits;
+    kj::String extensionOffer;
+    KJ_IF_MAYBE(compression, settings.webSocketCompression) {
+      compressionWindowBits = fitDeflateWindowBits(*compression);
+      KJ_IF_MAYBE(bits, compressionWindowBits) {
+        extensionOffer = composeDeflateOffer(*compression, *bits);
+        connectionHeaders[BuiltinHeaderIndices::SEC_WEBSOCKET_EXTENSIONS] = extensionOffer;
+      }
+    }
+
     httpOutput.writeHeaders(headers.serializeRequest(HttpMethod::GET, url, connectionHeaders));
 
     // No entity-body.
@@ -2513,7 +5965,8 @@ public:
 
     return httpInput.readResponseHeaders()
         .then(kj::mvCapture(keyBase64,
-            [this](kj::StringPtr keyBase64, kj::Maybe<HttpHeaders::Response>&& response)
+            [this,compressionWindowBits](
+                kj::StringPtr keyBase64, kj::Maybe<HttpHeaders::Response>&& response)
             -> HttpClient::WebSocketResponse {
       KJ_IF_MAYBE(r, response) {
         auto& headers = httpInput.getHeaders();
@@ -2536,11 +5989,24 @@ public:
             return HttpClient::WebSocketResponse();
           }
 
+          kj::Maybe<WebSocketCompressionParameters> compression;
+          KJ_IF_MAYBE(extensions, headers.get(HttpHeaderId::SEC_WEBSOCKET_EXTENSIONS)) {
+            KJ_IF_MAYBE(bits, compressionWindowBits) {
+              compression = acceptDeflateResponse(
+                  KJ_ASSERT_NONNULL(settings.webSocketCompression), *bits, *extensions);
+            } else {
+              KJ_FAIL_REQUIRE("server returned Sec-WebSocket-Extensions, but we offered none",
+                              *extensions) { break; }
+              return HttpClient::WebSocketResponse();
+            }
+          }
+
           return {
             r->statusCode,
             r->statusText,
             &httpInput.getHeaders(),
-            upgradeToWebSocket(kj::mv(ownStream), httpInput, httpOutput, settings.entropySource),
+            upgradeToWebSocket(kj::mv(ownStream), httpInput, httpOutput, settings.entropySource,
+                               compression),
           };
         } else {
           upgraded = false;
@@ -2730,6 +6196,14 @@ public:
     }
   }
 
+  kj::Maybe<kj::StringPtr> getNegotiatedProtocol() override {
+    KJ_IF_MAYBE(s, stream) {
+      return s->get()->getNegotiatedProtocol();
+    } else {
+      return nullptr;
+    }
+  }
+
 public:
   kj::ForkedPromise<void> promise;
   kj::Maybe<kj::Own<AsyncIoStream>> stream;
@@ -2772,47 +6246,201 @@ public:
     }
   }
 
-  kj::Maybe<kj::Promise<uint64_t>> tryPumpFrom(
-      kj::AsyncInputStream& input, uint64_t amount = kj::maxValue) override {
-    KJ_IF_MAYBE(s, stream) {
-      return s->get()->tryPumpFrom(input, amount);
+  kj::Maybe<kj::Promise<uint64_t>> tryPumpFrom(
+      kj::AsyncInputStream& input, uint64_t amount = kj::maxValue) override {
+    KJ_IF_MAYBE(s, stream) {
+      return s->get()->tryPumpFrom(input, amount);
+    } else {
+      return promise.addBranch().then([this,&input,amount]() {
+        // Call input.pumpTo() on the resolved stream instead.
+        return input.pumpTo(*KJ_ASSERT_NONNULL(stream), amount);
+      });
+    }
+  }
+
+public:
+  kj::ForkedPromise<void> promise;
+  kj::Maybe<kj::Own<AsyncOutputStream>> stream;
+};
+
+class NetworkAddressHttpClient final: public HttpClient {
+public:
+  NetworkAddressHttpClient(kj::Timer& timer, HttpHeaderTable& responseHeaderTable,
+                           kj::Own<kj::NetworkAddress> address, HttpClientSettings settings)
+      : timer(timer),
+        responseHeaderTable(responseHeaderTable),
+        address(kj::mv(address)),
+        settings(kj::mv(settings)),
+        protocol(this->settings.http2 == nullptr ? Protocol::HTTP1 : Protocol::UNKNOWN) {
+    uint prewarm = this->settings.prewarmConnections;
+    KJ_IF_MAYBE(max, this->settings.maxConnectionsPerHost) {
+      prewarm = kj::min(prewarm, *max);
+    }
+    if (prewarm > 0 && protocol == Protocol::UNKNOWN) {
+      // Find out what the server speaks first. If it's HTTP/1, the rest are opened then.
+      prewarmRemaining = prewarm - 1;
+      probeTask = probe().eagerlyEvaluate([](kj::Exception&& e) {});
+    } else if (prewarm > 0) {
+      auto expires = timer.now() + this->settings.idleTimout;
+      for (uint i = 0; i < prewarm; i++) {
+        availableClients.push_back(AvailableClient { newConnection(), expires });
+      }
+      scheduleTimeouts();
+    }
+  }
+
+  bool isDrained() {
+    // Returns true if there are no open connections.
+    return activeConnectionCount == 0 && availableClients.empty() && !probing;
+  }
+
+  kj::Promise<void> onDrained() {
+    // Returns a promise which resolves the next time isDrained() transitions from false to true.
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    drainedFulfiller = kj::mv(paf.fulfiller);
+    return kj::mv(paf.promise);
+  }
+
+  Request request(HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+                  kj::Maybe<uint64_t> expectedBodySize = nullptr) override {
+    if (protocol == Protocol::HTTP2) {
+      KJ_IF_MAYBE(lease, tryGetHttp2Client()) {
+        return requestFromHttp2(kj::mv(*lease), method, url, headers, expectedBodySize);
+      }
+    }
+
+    if (protocol == Protocol::UNKNOWN) {
+      // Wait until we know whether the server speaks HTTP/2, then try again.
+      auto urlCopy = kj::str(url);
+      auto headersCopy = headers.clone();
+      auto combined = probe().then(kj::mvCapture(urlCopy, kj::mvCapture(headersCopy,
+          [this,method,expectedBodySize](HttpHeaders&& headers, kj::String&& url)
+          -> kj::Tuple<kj::Own<kj::AsyncOutputStream>, kj::Promise<Response>> {
+        auto req = request(method, url, headers, expectedBodySize);
+        return kj::tuple(kj::mv(req.body), kj::mv(req.response));
+      })));
+
+      auto split = combined.split();
+      return {
+        kj::heap<PromiseOutputStream>(kj::mv(kj::get<0>(split))),
+        kj::mv(kj::get<1>(split))
+      };
+    }
+
+    KJ_IF_MAYBE(refcounted, tryGetClient()) {
+      return requestFrom(kj::mv(*refcounted), method, url, headers, expectedBodySize);
+    } else {
+      // We're at maxConnectionsPerHost and all connections are busy. Wait for one to be returned.
+      auto urlCopy = kj::str(url);
+      auto headersCopy = headers.clone();
+      auto combined = waitForClient().then(kj::mvCapture(urlCopy, kj::mvCapture(headersCopy,
+          [this,method,expectedBodySize](HttpHeaders&& headers, kj::String&& url,
+                                         kj::Own<RefcountedClient>&& refcounted)
+          -> kj::Tuple<kj::Own<kj::AsyncOutputStream>, kj::Promise<Response>> {
+        auto req = requestFrom(kj::mv(refcounted), method, url, headers, expectedBodySize);
+        return kj::tuple(kj::mv(req.body), kj::mv(req.response));
+      })));
+
+      auto split = combined.split();
+      return {
+        kj::heap<PromiseOutputStream>(kj::mv(kj::get<0>(split))),
+        kj::mv(kj::get<1>(split))
+      };
+    }
+  }
+
+  kj::Promise<WebSocketResponse> openWebSocket(
+      kj::StringPtr url, const HttpHeaders& headers) override {
+    if (protocol == Protocol::UNKNOWN) {
+      auto urlCopy = kj::str(url);
+      auto headersCopy = headers.clone();
+      return probe().then(kj::mvCapture(urlCopy, kj::mvCapture(headersCopy,
+          [this](HttpHeaders&& headers, kj::String&& url) {
+        return openWebSocket(url, headers);
+      })));
+    } else if (protocol == Protocol::HTTP2) {
+      // WebSockets aren't supported over HTTP/2, so this sends a plain request, which the server
+      // will refuse.
+      return HttpClient::openWebSocket(url, headers);
+    }
+
+    KJ_IF_MAYBE(refcounted, tryGetClient()) {
+      return openWebSocketFrom(kj::mv(*refcounted), url, headers);
     } else {
-      return promise.addBranch().then([this,&input,amount]() {
-        // Call input.pumpTo() on the resolved stream instead.
-        return input.pumpTo(*KJ_ASSERT_NONNULL(stream), amount);
-      });
+      auto urlCopy = kj::str(url);
+      auto headersCopy = headers.clone();
+      return waitForClient().then(kj::mvCapture(urlCopy, kj::mvCapture(headersCopy,
+          [this](HttpHeaders&& headers, kj::String&& url, kj::Own<RefcountedClient>&& refcounted) {
+        return openWebSocketFrom(kj::mv(refcounted), url, headers);
+      })));
     }
   }
 
-public:
-  kj::ForkedPromise<void> promise;
-  kj::Maybe<kj::Own<AsyncOutputStream>> stream;
-};
+private:
+  kj::Timer& timer;
+  HttpHeaderTable& responseHeaderTable;
+  kj::Own<kj::NetworkAddress> address;
+  HttpClientSettings settings;
 
-class NetworkAddressHttpClient final: public HttpClient {
-public:
-  NetworkAddressHttpClient(kj::Timer& timer, HttpHeaderTable& responseHeaderTable,
-                           kj::Own<kj::NetworkAddress> address, HttpClientSettings settings)
-      : timer(timer),
-        responseHeaderTable(responseHeaderTable),
-        address(kj::mv(address)),
-        settings(kj::mv(settings)) {}
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> drainedFulfiller;
+  uint activeConnectionCount = 0;
 
-  bool isDrained() {
-    // Returns true if there are no open connections.
-    return activeConnectionCount == 0 && availableClients.empty();
-  }
+  bool timeoutsScheduled = false;
+  kj::Promise<void> timeoutTask = nullptr;
 
-  kj::Promise<void> onDrained() {
-    // Returns a promise which resolves the next time isDrained() transitions from false to true.
-    auto paf = kj::newPromiseAndFulfiller<void>();
-    drainedFulfiller = kj::mv(paf.fulfiller);
-    return kj::mv(paf.promise);
-  }
+  struct AvailableClient {
+    kj::Own<HttpClientImpl> client;
+    kj::TimePoint expires;
+  };
 
-  Request request(HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
-                  kj::Maybe<uint64_t> expectedBodySize = nullptr) override {
-    auto refcounted = getClient();
+  std::deque<AvailableClient> availableClients;
+  // Idle connections, least-recently-used first. We reuse from the back, so that connections
+  // at the front are more likely to reach their idle timeout and be closed.
+
+  struct RefcountedClient;
+  std::deque<kj::Own<kj::PromiseFulfiller<kj::Own<RefcountedClient>>>> waiters;
+  // Requests waiting for a connection, because maxConnectionsPerHost connections are active.
+
+  enum class Protocol {
+    UNKNOWN,
+    // HTTP/2 is enabled, but we haven't yet connected to find out whether the server speaks it.
+    HTTP1,
+    HTTP2
+  };
+  Protocol protocol;
+
+  bool probing = false;
+  kj::Maybe<kj::ForkedPromise<void>> probeDone;
+  kj::Promise<void> probeTask = nullptr;
+  uint prewarmRemaining = 0;
+
+  struct Http2Client;
+  kj::Maybe<kj::Own<Http2Client>> http2Client;
+  // The connection to use for HTTP/2 requests. All requests share it, until it closes.
+
+  kj::Promise<void> http2IdleTask = nullptr;
+
+  struct RefcountedClient final: public kj::Refcounted {
+    RefcountedClient(NetworkAddressHttpClient& parent, kj::Own<HttpClientImpl> client)
+        : parent(parent), client(kj::mv(client)) {
+      ++parent.activeConnectionCount;
+    }
+    ~RefcountedClient() noexcept(false) {
+      --parent.activeConnectionCount;
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        parent.returnClientToAvailable(kj::mv(client));
+      })) {
+        KJ_LOG(ERROR, *exception);
+      }
+    }
+
+    NetworkAddressHttpClient& parent;
+    kj::Own<HttpClientImpl> client;
+  };
+
+  Request requestFrom(kj::Own<RefcountedClient> refcounted,
+                      HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+                      kj::Maybe<uint64_t> expectedBodySize) {
     auto result = refcounted->client->request(method, url, headers, expectedBodySize);
     result.body = result.body.attach(kj::addRef(*refcounted));
     result.response = result.response.then(kj::mvCapture(refcounted,
@@ -2823,9 +6451,8 @@ public:
     return result;
   }
 
-  kj::Promise<WebSocketResponse> openWebSocket(
-      kj::StringPtr url, const HttpHeaders& headers) override {
-    auto refcounted = getClient();
+  kj::Promise<WebSocketResponse> openWebSocketFrom(
+      kj::Own<RefcountedClient> refcounted, kj::StringPtr url, const HttpHeaders& headers) {
     auto result = refcounted->client->openWebSocket(url, headers);
     return result.then(kj::mvCapture(refcounted,
         [](kj::Own<RefcountedClient>&& refcounted, WebSocketResponse&& response) {
@@ -2846,61 +6473,192 @@ public:
     }));
   }
 
-private:
-  kj::Timer& timer;
-  HttpHeaderTable& responseHeaderTable;
-  kj::Own<kj::NetworkAddress> address;
-  HttpClientSettings settings;
-
-  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> drainedFulfiller;
-  uint activeConnectionCount = 0;
+  struct Http2Client final: public kj::Refcounted {
+    // An HTTP/2 connection, shared by the requests using it. It counts as one active connection.
 
-  bool timeoutsScheduled = false;
-  kj::Promise<void> timeoutTask = nullptr;
+    Http2Client(NetworkAddressHttpClient& parent, kj::Own<Http2ClientImpl> client)
+        : parent(parent), client(kj::mv(client)) {
+      ++parent.activeConnectionCount;
+    }
+    ~Http2Client() noexcept(false) {
+      --parent.activeConnectionCount;
+      parent.scheduleTimeouts();  // signals onDrained() if appropriate
+    }
 
-  struct AvailableClient {
-    kj::Own<HttpClientImpl> client;
-    kj::TimePoint expires;
+    NetworkAddressHttpClient& parent;
+    kj::Own<Http2ClientImpl> client;
+    uint requestCount = 0;
   };
 
-  std::deque<AvailableClient> availableClients;
+  struct Http2Lease {
+    // Held by each request on an HTTP/2 connection until its response body is dropped.
 
-  struct RefcountedClient final: public kj::Refcounted {
-    RefcountedClient(NetworkAddressHttpClient& parent, kj::Own<HttpClientImpl> client)
-        : parent(parent), client(kj::mv(client)) {
-      ++parent.activeConnectionCount;
+    explicit Http2Lease(kj::Own<Http2Client> client): client(kj::mv(client)) {
+      ++this->client->requestCount;
     }
-    ~RefcountedClient() noexcept(false) {
-      --parent.activeConnectionCount;
-      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
-        parent.returnClientToAvailable(kj::mv(client));
-      })) {
-        KJ_LOG(ERROR, *exception);
+    ~Http2Lease() noexcept(false) {
+      if (--client->requestCount == 0) {
+        client->parent.http2ConnectionIdle(*client);
       }
     }
+    KJ_DISALLOW_COPY(Http2Lease);
 
-    NetworkAddressHttpClient& parent;
-    kj::Own<HttpClientImpl> client;
+    kj::Own<Http2Client> client;
   };
 
-  kj::Own<RefcountedClient> getClient() {
-    for (;;) {
-      if (availableClients.empty()) {
-        auto stream = kj::heap<PromiseIoStream>(address->connect());
-        return kj::refcounted<RefcountedClient>(*this,
-          kj::heap<HttpClientImpl>(responseHeaderTable, kj::mv(stream), settings));
-      } else {
-        auto client = kj::mv(availableClients.back().client);
-        availableClients.pop_back();
-        if (client->canReuse()) {
-          return kj::refcounted<RefcountedClient>(*this, kj::mv(client));
+  kj::Promise<void> probe() {
+    // Connects to the server to find out whether it speaks HTTP/2. Resolves once `protocol` is
+    // known, or the connection attempt fails.
+
+    if (probing) {
+      return KJ_ASSERT_NONNULL(probeDone).addBranch();
+    }
+    probing = true;
+
+    KJ_IF_MAYBE(stats, settings.connectionStats) {
+      ++stats->newConnections;
+    }
+    auto fork = address->connect().then([this](kj::Own<kj::AsyncIoStream>&& stream) {
+      probing = false;
+      KJ_IF_MAYBE(negotiated, stream->getNegotiatedProtocol()) {
+        if (*negotiated == "h2") {
+          protocol = Protocol::HTTP2;
+          http2Client = kj::refcounted<Http2Client>(*this, kj::heap<Http2ClientImpl>(
+              responseHeaderTable, kj::mv(stream), "https", KJ_ASSERT_NONNULL(settings.http2)));
+          http2ConnectionIdle(*KJ_ASSERT_NONNULL(http2Client));
+          return;
         }
-        // Whoops, this client's connection was closed by the server at some point. Discard.
       }
+
+      protocol = Protocol::HTTP1;
+      auto expires = timer.now() + settings.idleTimout;
+      availableClients.push_back(AvailableClient {
+        kj::heap<HttpClientImpl>(responseHeaderTable, kj::mv(stream), settings), expires
+      });
+      for (; prewarmRemaining > 0; prewarmRemaining--) {
+        availableClients.push_back(AvailableClient { newConnection(), expires });
+      }
+      scheduleTimeouts();
+    }, [this](kj::Exception&& e) {
+      probing = false;
+      scheduleTimeouts();
+      kj::throwFatalException(kj::mv(e));
+    }).fork();
+
+    auto result = fork.addBranch();
+    probeDone = kj::mv(fork);
+    return result;
+  }
+
+  kj::Maybe<kj::Own<Http2Lease>> tryGetHttp2Client() {
+    // Returns the HTTP/2 connection to use for a new request, or null if we no longer have a
+    // usable one, in which case we go back to finding out what the server speaks.
+
+    KJ_IF_MAYBE(client, http2Client) {
+      if (client->get()->client->canReuse()) {
+        countReuse();
+        http2IdleTask = nullptr;
+        return kj::heap<Http2Lease>(kj::addRef(**client));
+      }
+    }
+    http2Client = nullptr;
+    http2IdleTask = nullptr;
+    protocol = Protocol::UNKNOWN;
+    return nullptr;
+  }
+
+  void http2ConnectionIdle(Http2Client& client) {
+    // Closes the connection if no requests arrive within the idle timeout.
+
+    KJ_IF_MAYBE(current, http2Client) {
+      if (current->get() == &client) {
+        http2IdleTask = timer.afterDelay(settings.idleTimout).then([this]() {
+          KJ_IF_MAYBE(stats, settings.connectionStats) {
+            ++stats->idleTimeouts;
+          }
+          http2Client = nullptr;
+          protocol = Protocol::UNKNOWN;
+        }).eagerlyEvaluate(nullptr);
+      }
+    }
+  }
+
+  Request requestFromHttp2(kj::Own<Http2Lease> lease,
+                           HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+                           kj::Maybe<uint64_t> expectedBodySize) {
+    auto result = lease->client->client->request(method, url, headers, expectedBodySize);
+    result.body = result.body.attach(kj::addRef(*lease->client));
+    result.response = result.response.then(kj::mvCapture(lease,
+        [](kj::Own<Http2Lease>&& lease, Response&& response) {
+      response.body = response.body.attach(kj::mv(lease));
+      return kj::mv(response);
+    }));
+    return result;
+  }
+
+  kj::Own<HttpClientImpl> newConnection() {
+    KJ_IF_MAYBE(stats, settings.connectionStats) {
+      ++stats->newConnections;
+    }
+    auto stream = kj::heap<PromiseIoStream>(address->connect());
+    return kj::heap<HttpClientImpl>(responseHeaderTable, kj::mv(stream), settings);
+  }
+
+  void countReuse() {
+    KJ_IF_MAYBE(stats, settings.connectionStats) {
+      ++stats->reusedConnections;
+    }
+  }
+
+  kj::Maybe<kj::Own<RefcountedClient>> tryGetClient() {
+    // Returns a connection to use for a new request, or null if there are no idle connections
+    // and we're not allowed to open another one.
+
+    while (!availableClients.empty()) {
+      auto client = kj::mv(availableClients.back().client);
+      availableClients.pop_back();
+      if (client->canReuse()) {
+        countReuse();
+        return kj::refcounted<RefcountedClient>(*this, kj::mv(client));
+      }
+      // Whoops, this client's connection was closed by the server at some point. Discard.
+    }
+
+    KJ_IF_MAYBE(max, settings.maxConnectionsPerHost) {
+      if (activeConnectionCount >= *max) {
+        return nullptr;
+      }
+    }
+
+    return kj::refcounted<RefcountedClient>(*this, newConnection());
+  }
+
+  kj::Promise<kj::Own<RefcountedClient>> waitForClient() {
+    KJ_IF_MAYBE(stats, settings.connectionStats) {
+      ++stats->queuedRequests;
     }
+    auto paf = kj::newPromiseAndFulfiller<kj::Own<RefcountedClient>>();
+    waiters.push_back(kj::mv(paf.fulfiller));
+    return kj::mv(paf.promise);
   }
 
   void returnClientToAvailable(kj::Own<HttpClientImpl> client) {
+    // If a request is waiting for a connection, give it this one -- or, if this one can't be
+    // reused, the slot it occupied. Skip waiters whose requests have since been canceled.
+    while (!waiters.empty()) {
+      auto fulfiller = kj::mv(waiters.front());
+      waiters.pop_front();
+      if (fulfiller->isWaiting()) {
+        if (client->canReuse()) {
+          countReuse();
+        } else {
+          client = newConnection();
+        }
+        fulfiller->fulfill(kj::refcounted<RefcountedClient>(*this, kj::mv(client)));
+        return;
+      }
+    }
+
     // Only return the connection to the pool if it is reusable.
     if (client->canReuse()) {
       availableClients.push_back(AvailableClient {
@@ -2909,6 +6667,10 @@ private:
     }
 
     // Call this either way because it also signals onDrained().
+    scheduleTimeouts();
+  }
+
+  void scheduleTimeouts() {
     if (!timeoutsScheduled) {
       timeoutsScheduled = true;
       timeoutTask = applyTimeouts();
@@ -2918,7 +6680,7 @@ private:
   kj::Promise<void> applyTimeouts() {
     if (availableClients.empty()) {
       timeoutsScheduled = false;
-      if (activeConnectionCount == 0) {
+      if (isDrained()) {
         KJ_IF_MAYBE(f, drainedFulfiller) {
           f->get()->fulfill();
           drainedFulfiller = nullptr;
@@ -2930,6 +6692,9 @@ private:
       return timer.atTime(time).then([this,time]() {
         while (!availableClients.empty() && availableClients.front().expires <= time) {
           availableClients.pop_front();
+          KJ_IF_MAYBE(stats, settings.connectionStats) {
+            ++stats->idleTimeouts;
+          }
         }
         return applyTimeouts();
       });
@@ -3026,20 +6791,20 @@ public:
 
   Request request(HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
                   kj::Maybe<uint64_t> expectedBodySize = nullptr) override {
-    auto parsed = Url::parse(url, Url::HTTP_PROXY_REQUEST);
-    auto path = parsed.toString(Url::HTTP_REQUEST);
-    auto headersCopy = headers.clone();
-    headersCopy.set(HttpHeaderId::HOST, parsed.host);
-    return getClient(parsed).request(method, path, headersCopy, expectedBodySize);
+    auto target = parseTarget(url);
+    // `headers` only needs to outlive this call (deferred requests make their own deep copy), so
+    // a shallow copy suffices to override the Host header.
+    auto headersCopy = headers.cloneShallow();
+    headersCopy.set(HttpHeaderId::HOST, target.host);
+    return getClient(target).request(method, target.path, headersCopy, expectedBodySize);
   }
 
   kj::Promise<WebSocketResponse> openWebSocket(
       kj::StringPtr url, const HttpHeaders& headers) override {
-    auto parsed = Url::parse(url, Url::HTTP_PROXY_REQUEST);
-    auto path = parsed.toString(Url::HTTP_REQUEST);
-    auto headersCopy = headers.clone();
-    headersCopy.set(HttpHeaderId::HOST, parsed.host);
-    return getClient(parsed).openWebSocket(path, headersCopy);
+    auto target = parseTarget(url);
+    auto headersCopy = headers.cloneShallow();
+    headersCopy.set(HttpHeaderId::HOST, target.host);
+    return getClient(target).openWebSocket(target.path, headersCopy);
   }
 
 private:
@@ -3054,6 +6819,33 @@ private:
     kj::Own<PromiseNetworkAddressHttpClient> client;
   };
 
+  struct Target {
+    kj::StringPtr scheme;
+    kj::String host;
+    kj::StringPtr path;     // path and query, for the request line
+    kj::String ownPath;     // backs `path` if the URL had to be re-encoded
+  };
+
+  Target parseTarget(kj::StringPtr url) {
+    auto view = UrlView::parse(url, Url::HTTP_PROXY_REQUEST);
+    KJ_IF_MAYBE(path, view.getRequestTarget()) {
+      // The URL is already in the form Url::toString() would produce, so the request line can
+      // use it as-is, without decoding and re-encoding every component.
+      kj::StringPtr scheme =
+          UrlView::decodesTo(view.scheme, "https") ? "https" :
+          UrlView::decodesTo(view.scheme, "http") ? "http" : "";
+      return { scheme, kj::heapString(view.host), *path, nullptr };
+    } else {
+      auto parsed = view.toUrl();
+      auto ownPath = parsed.toString(Url::HTTP_REQUEST);
+      kj::StringPtr scheme =
+          parsed.scheme == "https" ? "https" :
+          parsed.scheme == "http" ? "http" : "";
+      kj::StringPtr pathRef = ownPath;
+      return { scheme, kj::mv(parsed.host), pathRef, kj::mv(ownPath) };
+    }
+  }
+
   std::map<kj::StringPtr, Host> httpHosts;
   std::map<kj::StringPtr, Host> httpsHosts;
 
@@ -3067,7 +6859,7 @@ private:
 
   kj::TaskSet tasks;
 
-  HttpClient& getClient(kj::Url& parsed) {
+  HttpClient& getClient(Target& parsed) {
     bool isHttps = parsed.scheme == "https";
     bool isHttp = parsed.scheme == "http";
     KJ_REQUIRE(isHttp || isHttps);
@@ -3248,7 +7040,66 @@ kj::Promise<kj::Own<kj::AsyncIoStream>> HttpService::connect(kj::StringPtr host)
   KJ_UNIMPLEMENTED("CONNECT is not implemented by this HttpService");
 }
 
-class HttpServer::Connection final: private HttpService::WebSocketResponse {
+class HttpServer::RequestSlot final: public HttpRequestSlot {
+public:
+  explicit RequestSlot(HttpServer& server): server(server) {
+    ++server.activeRequests;
+  }
+  ~RequestSlot() noexcept(false) {
+    --server.activeRequests;
+    server.admitNext();
+  }
+  KJ_DISALLOW_COPY(RequestSlot);
+
+private:
+  HttpServer& server;
+};
+
+class HttpServer::QueuedRequest {
+  // A request waiting for a RequestSlot. Attached to the promise returned by admitRequest(), so
+  // that a request which is cancelled (e.g. because its client went away) leaves the queue.
+
+public:
+  QueuedRequest(HttpServer& server, kj::Own<kj::PromiseFulfiller<kj::Own<RequestSlot>>> fulfiller)
+      : server(server), fulfiller(kj::mv(fulfiller)) {
+    prev = server.queueTail;
+    *prev = this;
+    server.queueTail = &next;
+    ++server.queuedRequests;
+  }
+  ~QueuedRequest() noexcept(false) {
+    unlink();
+  }
+  KJ_DISALLOW_COPY(QueuedRequest);
+
+  void admit() {
+    unlink();
+    fulfiller->fulfill(kj::heap<RequestSlot>(server));
+  }
+
+private:
+  HttpServer& server;
+  kj::Own<kj::PromiseFulfiller<kj::Own<RequestSlot>>> fulfiller;
+  QueuedRequest** prev = nullptr;
+  QueuedRequest* next = nullptr;
+
+  void unlink() {
+    if (prev == nullptr) return;
+
+    *prev = next;
+    if (next == nullptr) {
+      server.queueTail = prev;
+    } else {
+      next->prev = prev;
+    }
+    prev = nullptr;
+    next = nullptr;
+    --server.queuedRequests;
+  }
+};
+
+class HttpServer::Connection final: private HttpService::WebSocketResponse,
+                                    private HttpRequestAdmission {
 public:
   Connection(HttpServer& server, kj::Own<kj::AsyncIoStream>&& stream)
       : server(server),
@@ -3258,14 +7109,30 @@ public:
     ++server.connectionCount;
   }
   ~Connection() noexcept(false) {
+    requestSlot = nullptr;
+
     if (--server.connectionCount == 0) {
       KJ_IF_MAYBE(f, server.zeroConnectionsFulfiller) {
         f->get()->fulfill();
       }
     }
+
+    // Let listen loops paused by `maxConnections` check again.
+    for (auto& waiter: server.acceptWaiters) {
+      waiter->fulfill();
+    }
+    server.acceptWaiters.clear();
   }
 
   kj::Promise<void> loop(bool firstRequest) {
+    if (firstRequest && server.settings.http2 != nullptr) {
+      KJ_IF_MAYBE(protocol, ownStream->getNegotiatedProtocol()) {
+        if (*protocol == "h2") {
+          return serveHttp2();
+        }
+      }
+    }
+
     auto firstByte = httpInput.awaitNextMessage();
 
     if (!firstRequest) {
@@ -3283,6 +7150,13 @@ public:
     auto receivedHeaders = firstByte
         .then([this,firstRequest](bool hasData)-> kj::Promise<kj::Maybe<HttpHeaders::Request>> {
       if (hasData) {
+        if (firstRequest && server.settings.http2 != nullptr &&
+            server.settings.http2PriorKnowledge && isHttp2Preface(httpInput.peekBuffered())) {
+          // A client with prior knowledge that we speak HTTP/2.
+          http2 = true;
+          return kj::Maybe<HttpHeaders::Request>(nullptr);
+        }
+
         auto readHeaders = httpInput.readRequestHeaders();
         if (!firstRequest) {
           // On requests other than the first, the header timeout starts ticking when we receive
@@ -3314,8 +7188,26 @@ public:
       receivedHeaders = receivedHeaders.exclusiveJoin(kj::mv(timeoutPromise));
     }
 
-    return receivedHeaders
+    auto admitted = receivedHeaders.then([this](kj::Maybe<HttpHeaders::Request>&& request)
+        -> kj::Promise<kj::Maybe<HttpHeaders::Request>> {
+      if (request == nullptr) return kj::mv(request);
+
+      return admitRequest().then(
+          [this,request](kj::Maybe<kj::Own<HttpRequestSlot>>&& slot) mutable {
+        KJ_IF_MAYBE(s, slot) {
+          requestSlot = kj::mv(*s);
+        } else {
+          shed = true;
+        }
+        return kj::mv(request);
+      });
+    });
+
+    return admitted
         .then([this](kj::Maybe<HttpHeaders::Request>&& request) -> kj::Promise<void> {
+      if (http2) {
+        return serveHttp2();
+      }
       if (closed) {
         // Client closed connection. Close our end too.
         return httpOutput.flush();
@@ -3337,6 +7229,10 @@ public:
 
         return httpOutput.flush();
       }
+      if (shed) {
+        return sendError(503, "Service Unavailable", kj::str(
+            "ERROR: The server is too busy to handle your request."));
+      }
 
       KJ_IF_MAYBE(req, request) {
         kj::Promise<void> promise = nullptr;
@@ -3357,6 +7253,8 @@ public:
           KJ_IF_MAYBE(key, headers.get(HttpHeaderId::SEC_WEBSOCKET_KEY)) {
             currentMethod = HttpMethod::GET;
             websocketKey = kj::str(*key);
+            websocketExtensions = kj::str(
+                headers.get(HttpHeaderId::SEC_WEBSOCKET_EXTENSIONS).orDefault(nullptr));
             promise = server.service.openWebSocket(req->url, httpInput.getHeaders(), *this);
           } else {
             return sendError(400, "Bad Request", kj::str("ERROR: Missing Sec-WebSocket-Key"));
@@ -3375,11 +7273,16 @@ public:
           promise = server.service.request(
               req->method, req->url, headers, *body, *this);
           promise = promise.attach(kj::mv(body));
+          KJ_IF_MAYBE(tracer, kj::AsyncTracer::current()) {
+            promise = promise.attach(
+                tracer->startSpan("http", kj::str("serve ", req->method, ' ', req->url)));
+          }
         }
 
         return promise
             .then([this]() -> kj::Promise<void> {
           // Response done. Await next request.
+          requestSlot = nullptr;
 
           if (upgraded) {
             // We've upgraded to WebSocket so we can exit this listen loop. In fact, we no longer
@@ -3411,6 +7314,13 @@ public:
             "ERROR: The headers sent by your client were not valid."));
       }
     }).catch_([this](kj::Exception&& e) -> kj::Promise<void> {
+      requestSlot = nullptr;
+
+      if (http2) {
+        // The HTTP/2 connection reports errors itself; this one is an I/O error.
+        return kj::mv(e);
+      }
+
       // Exception; report 500.
 
       if (currentMethod == nullptr) {
@@ -3452,9 +7362,44 @@ private:
   kj::Own<kj::AsyncIoStream> ownStream;
   kj::Maybe<HttpMethod> currentMethod;
   kj::Maybe<kj::String> websocketKey;
+  kj::String websocketExtensions;
+  // The client's Sec-WebSocket-Extensions offer, if this is a WebSocket request.
   bool timedOut = false;
   bool closed = false;
   bool upgraded = false;
+  bool http2 = false;
+  bool shed = false;
+  kj::Maybe<kj::Own<HttpRequestSlot>> requestSlot;
+  // Held while the service handles the current request.
+
+  kj::Promise<kj::Maybe<kj::Own<HttpRequestSlot>>> admitRequest() override {
+    return server.admitRequest()
+        .then([](kj::Maybe<kj::Own<RequestSlot>>&& slot) -> kj::Maybe<kj::Own<HttpRequestSlot>> {
+      KJ_IF_MAYBE(s, slot) {
+        return kj::Own<HttpRequestSlot>(kj::mv(*s));
+      } else {
+        return nullptr;
+      }
+    });
+  }
+
+  static bool isHttp2Preface(kj::ArrayPtr<const char> data) {
+    // Checks whether the connection begins with the HTTP/2 preface, "PRI * HTTP/2.0...", rather
+    // than an HTTP/1 request. No HTTP/1 method begins with "PRI".
+    size_t n = kj::min(data.size(), HTTP2_PREFACE_SIZE);
+    return n >= 3 && memcmp(data.begin(), HTTP2_PREFACE, n) == 0;
+  }
+
+  kj::Promise<void> serveHttp2() {
+    // Hands the connection over to an HTTP/2 server, along with anything already read.
+    http2 = true;
+    auto buffered = httpInput.releaseBuffer();
+    auto connection = kj::heap<Http2ServerConnection>(
+        server.timer, server.requestHeaderTable, server.service, server.settings,
+        static_cast<HttpRequestAdmission&>(*this), kj::mv(ownStream));
+    auto promise = connection->serve(buffered.leftover, server.onDrain.addBranch());
+    return promise.attach(kj::mv(connection), kj::mv(buffered.buffer));
+  }
 
   kj::Own<kj::AsyncOutputStream> send(
       uint statusCode, kj::StringPtr statusText, const HttpHeaders& headers,
@@ -3511,10 +7456,19 @@ private:
     connectionHeaders[BuiltinHeaderIndices::UPGRADE] = "websocket";
     connectionHeaders[BuiltinHeaderIndices::CONNECTION] = "Upgrade";
 
+    kj::Maybe<WebSocketCompressionParameters> compression;
+    kj::String extensionResponse;
+    KJ_IF_MAYBE(settings, server.settings.webSocketCompression) {
+      compression = acceptDeflateOffer(*settings, websocketExtensions, extensionResponse);
+      if (compression != nullptr) {
+        connectionHeaders[BuiltinHeaderIndices::SEC_WEBSOCKET_EXTENSIONS] = extensionResponse;
+      }
+    }
+
     httpOutput.writeHeaders(headers.serializeResponse(
         101, "Switching Protocols", connectionHeaders));
 
-    return upgradeToWebSocket(kj::mv(ownStream), httpInput, httpOutput, nullptr);
+    return upgradeToWebSocket(kj::mv(ownStream), httpInput, httpOutput, nullptr, compression);
   }
 
   kj::Promise<void> sendError(uint statusCode, kj::StringPtr statusText, kj::String body) {
@@ -3561,6 +7515,17 @@ kj::Promise<void> HttpServer::listenHttp(kj::ConnectionReceiver& port) {
 }
 
 kj::Promise<void> HttpServer::listenLoop(kj::ConnectionReceiver& port) {
+  KJ_IF_MAYBE(max, settings.maxConnections) {
+    if (connectionCount >= *max) {
+      // Leave further connections in the listen backlog until one of ours closes.
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      acceptWaiters.add(kj::mv(paf.fulfiller));
+      ++pausedListeners;
+      return paf.promise.attach(kj::defer([this]() { --pausedListeners; }))
+          .then([this,&port]() { return listenLoop(port); });
+    }
+  }
+
   return port.accept()
       .then([this,&port](kj::Own<kj::AsyncIoStream>&& connection) -> kj::Promise<void> {
     if (draining) {
@@ -3582,6 +7547,50 @@ kj::Promise<void> HttpServer::listenHttp(kj::Own<kj::AsyncIoStream> connection)
   return promise.attach(kj::mv(obj)).eagerlyEvaluate(nullptr);
 }
 
+kj::Promise<kj::Maybe<kj::Own<HttpServer::RequestSlot>>> HttpServer::admitRequest() {
+  KJ_IF_MAYBE(max, settings.maxConcurrentRequests) {
+    if (activeRequests >= *max || queueHead != nullptr) {
+      KJ_IF_MAYBE(budget, settings.maxQueueTime) {
+        if (*budget <= 0 * kj::SECONDS) {
+          ++shedRequests;
+          return kj::Maybe<kj::Own<RequestSlot>>(nullptr);
+        }
+      }
+
+      auto paf = kj::newPromiseAndFulfiller<kj::Own<RequestSlot>>();
+      auto queued = kj::heap<QueuedRequest>(*this, kj::mv(paf.fulfiller));
+      kj::Promise<kj::Maybe<kj::Own<RequestSlot>>> promise = paf.promise
+          .then([](kj::Own<RequestSlot>&& slot) -> kj::Maybe<kj::Own<RequestSlot>> {
+        return kj::mv(slot);
+      });
+      KJ_IF_MAYBE(budget, settings.maxQueueTime) {
+        promise = promise.exclusiveJoin(timer.afterDelay(*budget)
+            .then([this]() -> kj::Maybe<kj::Own<RequestSlot>> {
+          ++shedRequests;
+          return nullptr;
+        }));
+      }
+      return promise.attach(kj::mv(queued));
+    }
+  }
+
+  return kj::Maybe<kj::Own<RequestSlot>>(kj::heap<RequestSlot>(*this));
+}
+
+void HttpServer::admitNext() {
+  if (queueHead == nullptr) return;
+
+  KJ_IF_MAYBE(max, settings.maxConcurrentRequests) {
+    if (activeRequests < *max) {
+      queueHead->admit();
+    }
+  }
+}
+
+HttpServer::Load HttpServer::getLoad() const {
+  return { connectionCount, activeRequests, queuedRequests, shedRequests, pausedListeners > 0 };
+}
+
 void HttpServer::taskFailed(kj::Exception&& exception) {
   KJ_LOG(ERROR, "unhandled exception in HTTP server", exception);
 }
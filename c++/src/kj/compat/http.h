@@ -250,10 +250,14 @@ public:
 
   void clear();
   // Clears all contents, as if the object was freshly-allocated. However, calling this rather
-  // than actually re-allocating the object may avoid re-allocation of internal objects.
+  // than actually re-allocating the object may avoid re-allocation of internal objects. Strings
+  // previously passed to takeOwnership() (or owned implicitly, e.g. merged duplicate values) are
+  // freed, so anything still pointing into them becomes invalid.
 
   HttpHeaders clone() const;
   // Creates a deep clone of the HttpHeaders. The returned object owns all strings it references.
+  // All strings are copied into a single allocation. Prefer cloneShallow() when the copy won't
+  // outlive the original's strings.
 
   HttpHeaders cloneShallow() const;
   // Creates a shallow clone of the HttpHeaders. The returned object references the same strings
@@ -345,14 +349,12 @@ private:
     kj::StringPtr name;
     kj::StringPtr value;
   };
-  kj::Vector<Header> unindexedHeaders;
+  kj::SmallVector<Header, 4> unindexedHeaders;
 
-  kj::Vector<kj::Array<char>> ownedStrings;
+  kj::SmallVector<kj::Array<char>, 2> ownedStrings;
 
   void addNoCheck(kj::StringPtr name, kj::StringPtr value);
 
-  kj::StringPtr cloneToOwn(kj::StringPtr str);
-
   kj::String serialize(kj::ArrayPtr<const char> word1,
                        kj::ArrayPtr<const char> word2,
                        kj::ArrayPtr<const char> word3,
@@ -424,6 +426,37 @@ public:
   // On write error, rejects with the error.
 };
 
+struct WebSocketCompressionSettings {
+  // Configures negotiation of the "permessage-deflate" WebSocket extension (RFC 7692). Only
+  // available if KJ was built with zlib (KJ_HAS_ZLIB); otherwise compression is never offered or
+  // accepted and these settings are ignored.
+
+  bool contextTakeover = true;
+  // If true, the compressor and decompressor keep their state (the LZ77 window) from one message
+  // to the next, which compresses streams of similar messages much better. If false, each message
+  // is compressed independently and we also ask the peer to do so, which means no zlib state
+  // needs to be held by an idle connection.
+
+  uint maxWindowBits = 15;
+  // Base-2 logarithm of the largest LZ77 window either side may use, from 9 to 15. Smaller windows
+  // use less memory but compress less well. The peer is asked to respect the same limit.
+
+  size_t memoryBudget = 0;
+  // If non-zero, an approximate upper bound on the bytes of zlib state allocated per connection,
+  // counting both directions. The window size and deflate memory level are reduced to fit. If the
+  // budget can't accommodate even the smallest window, compression is not negotiated.
+};
+
+struct WebSocketCompressionParameters {
+  // The permessage-deflate parameters in effect for one WebSocket, as a result of negotiation.
+  // "Outbound" refers to messages this end sends, "inbound" to messages it receives.
+
+  bool outboundNoContextTakeover = false;
+  bool inboundNoContextTakeover = false;
+  uint outboundMaxWindowBits = 15;
+  uint inboundMaxWindowBits = 15;
+};
+
 class HttpClient {
   // Interface to the client end of an HTTP connection.
   //
@@ -530,7 +563,9 @@ public:
   // Perform an HTTP request.
   //
   // `url` may be a full URL (with protocol and host) or it may be only the path part of the URL,
-  // depending on whether the service is a proxy service or a host service.
+  // depending on whether the service is a proxy service or a host service. To route on it without
+  // copying, parse it with kj::UrlView (see url.h), using the Url::HTTP_REQUEST context for a
+  // host service.
   //
   // `url` and `headers` are invalidated on the first read from `requestBody` or when the returned
   // promise resolves, whichever comes first.
@@ -555,10 +590,72 @@ public:
   // UNIMPLEMENTED.
 };
 
+struct HttpClientConnectionStats {
+  // Counters maintained by clients which automatically create new connections, if
+  // `HttpClientSettings::connectionStats` points at an instance. The client only ever increments
+  // these; reset them yourself if you want rates.
+
+  uint64_t newConnections = 0;
+  // Connections opened, including pre-warmed ones.
+
+  uint64_t reusedConnections = 0;
+  // Requests sent on an already-open connection rather than a newly-opened one.
+
+  uint64_t idleTimeouts = 0;
+  // Idle connections closed because they reached `idleTimout`.
+
+  uint64_t queuedRequests = 0;
+  // Requests which had to wait for a connection because `maxConnectionsPerHost` was reached.
+};
+
+struct Http2Settings {
+  // Parameters for HTTP/2 connections, which both clients and servers announce to their peers.
+
+  uint32_t maxConcurrentStreams = 100;
+  // The number of requests the peer may have in progress at once on one connection.
+
+  uint32_t initialWindowSize = 65535;
+  // Flow control: how much of each body the peer may send before we've read it.
+
+  uint32_t connectionWindowSize = 1 << 20;
+  // Flow control: how much body data the peer may send, across all streams, before we've
+  // received it. Must be at least 65535.
+
+  uint32_t maxFrameSize = 16384;
+  // The largest frame the peer may send. At least 16384, at most 2^24-1.
+
+  uint32_t headerTableSize = 4096;
+  // The size of the HPACK table which the peer may use to compress the headers it sends.
+
+  size_t maxHeaderListSize = 65536;
+  // The largest set of headers we'll accept in a request or response, counted as HPACK counts
+  // them (each field's name and value plus 32 bytes). A server responds 431 to larger requests.
+};
+
 struct HttpClientSettings {
   kj::Duration idleTimout = 5 * kj::SECONDS;
   // For clients which automatically create new connections, any connection idle for at least this
-  // long will be closed.
+  // long will be closed. Idle connections are reused most-recently-used first, so that surplus
+  // connections age out.
+
+  kj::Maybe<uint> maxConnectionsPerHost = nullptr;
+  // For clients which automatically create new connections, the maximum number of connections
+  // that may be in use at once for any one host. Once that many requests are in flight, further
+  // requests wait (in FIFO order) for one of the connections to become free. Null means no limit.
+
+  uint prewarmConnections = 0;
+  // For clients which automatically create new connections, the number of connections to open
+  // in advance, so that the first requests don't have to wait for a connection to be established.
+  // The connections are opened when the client is created or, for clients that connect to
+  // arbitrary hosts, when a host is first used. Like any other idle connection, pre-warmed
+  // connections are closed after `idleTimout`.
+
+  kj::Maybe<HttpClientConnectionStats&> connectionStats = nullptr;
+  // If non-null, connection reuse statistics are accumulated here. The object must outlive the
+  // client.
+
+  kj::Maybe<WebSocketCompressionSettings> webSocketCompression = nullptr;
+  // If non-null, `openWebSocket()` offers permessage-deflate compression to the server.
 
   kj::Maybe<EntropySource&> entropySource = nullptr;
   // Must be provided in order to use `openWebSocket`. If you don't need WebSockets, this can be
@@ -568,6 +665,12 @@ struct HttpClientSettings {
   // or vulnerable proxies between you and the server, you can provide a dummy entropy source that
   // doesn't generate real entropy (e.g. returning the same value every time). Otherwise, you must
   // provide a cryptographically-random entropy source.
+
+  kj::Maybe<Http2Settings> http2 = nullptr;
+  // If non-null, clients which automatically create new connections speak HTTP/2 to servers which
+  // select it ("h2") via TLS ALPN, sending all requests to a host over one connection. The
+  // TlsContext must offer "h2" in its `alpnProtocols`. Until the first connection to a host has
+  // been established, requests wait to learn which protocol it speaks.
 };
 
 kj::Own<HttpClient> newHttpClient(kj::Timer& timer, HttpHeaderTable& responseHeaderTable,
@@ -612,6 +715,17 @@ kj::Own<HttpClient> newHttpClient(HttpHeaderTable& responseHeaderTable, kj::Asyn
 // subsequent requests will fail. If a response takes a long time, it blocks subsequent responses.
 // If a WebSocket is opened successfully, all subsequent requests fail.
 
+kj::Own<HttpClient> newHttp2Client(HttpHeaderTable& responseHeaderTable,
+                                   kj::AsyncIoStream& stream,
+                                   HttpClientSettings settings = HttpClientSettings());
+// Like newHttpClient(), but speaks HTTP/2 over the given pre-established connection. The server
+// must be known to speak HTTP/2, either because it was negotiated via ALPN or by prior knowledge.
+// Requests are sent concurrently, each on its own stream, up to the server's limit; beyond that
+// they wait. `settings.http2`, or the defaults if it is null, are announced to the server.
+//
+// The request URL may be a path, with the authority taken from the Host header, or an absolute
+// URL. WebSockets and CONNECT are not supported over HTTP/2.
+
 kj::Own<HttpClient> newHttpClient(
     HttpHeaderTable& responseHeaderTable, kj::AsyncIoStream& stream,
     kj::Maybe<EntropySource&> entropySource) KJ_DEPRECATED("use HttpClientSettings");
@@ -622,8 +736,9 @@ kj::Own<HttpClient> newHttpClient(HttpService& service);
 kj::Own<HttpService> newHttpService(HttpClient& client);
 // Adapts an HttpClient to an HttpService and vice versa.
 
-kj::Own<WebSocket> newWebSocket(kj::Own<kj::AsyncIoStream> stream,
-                                kj::Maybe<EntropySource&> maskEntropySource);
+kj::Own<WebSocket> newWebSocket(
+    kj::Own<kj::AsyncIoStream> stream, kj::Maybe<EntropySource&> maskEntropySource,
+    kj::Maybe<WebSocketCompressionParameters> compression = nullptr);
 // Create a new WebSocket on top of the given stream. It is assumed that the HTTP -> WebSocket
 // upgrade handshake has already occurred (or is not needed), and messages can immediately be
 // sent and received on the stream. Normally applications would not call this directly.
@@ -635,6 +750,9 @@ kj::Own<WebSocket> newWebSocket(kj::Own<kj::AsyncIoStream> stream,
 // purpose of the mask is to prevent badly-written HTTP proxies from interpreting "things that look
 // like HTTP requests" in a message as being actual HTTP requests, which could result in cache
 // poisoning. See RFC6455 section 10.3.
+//
+// `compression`, if non-null, enables permessage-deflate with the given negotiated parameters.
+// Throws if KJ was built without zlib.
 
 struct HttpServerSettings {
   kj::Duration headerTimeout = 15 * kj::SECONDS;
@@ -644,6 +762,35 @@ struct HttpServerSettings {
   kj::Duration pipelineTimeout = 5 * kj::SECONDS;
   // After one request/response completes, we'll wait up to this long for a pipelined request to
   // arrive.
+
+  kj::Maybe<WebSocketCompressionSettings> webSocketCompression = nullptr;
+  // If non-null, a client's offer of permessage-deflate compression is accepted when the service
+  // calls `acceptWebSocket()`.
+
+  kj::Maybe<Http2Settings> http2 = Http2Settings();
+  // If non-null, connections on which TLS ALPN selected "h2" speak HTTP/2. (ALPN only offers "h2"
+  // if the TlsContext lists it in `alpnProtocols`.) Requests on an HTTP/2 connection are served
+  // concurrently. The idle and header timeouts above apply to the connection as a whole.
+  // WebSockets are not supported over HTTP/2.
+
+  bool http2PriorKnowledge = false;
+  // If true, and `http2` is non-null, connections which begin with the HTTP/2 connection preface
+  // also speak HTTP/2, for clients that know in advance that we do ("h2c"). Otherwise such a
+  // connection is treated as a malformed HTTP/1 request.
+
+  kj::Maybe<uint> maxConnections = nullptr;
+  // If non-null, listenHttp(ConnectionReceiver&) stops calling accept() while this many
+  // connections are open, leaving new connections in the listen backlog until one closes.
+  // Connections passed to listenHttp() directly are always served, but do count toward the limit.
+
+  kj::Maybe<uint> maxConcurrentRequests = nullptr;
+  // If non-null, at most this many requests, across all connections, are passed to the HttpService
+  // at once. Further requests wait, in the order their headers arrived, for one to finish.
+
+  kj::Maybe<kj::Duration> maxQueueTime = nullptr;
+  // If non-null, a request which would wait longer than this (counted from when its headers were
+  // received) because of `maxConcurrentRequests` is instead answered with a 503 error. Zero sheds
+  // every request that can't be served immediately. On HTTP/1, the connection is then closed.
 };
 
 class HttpServer: private kj::TaskSet::ErrorHandler {
@@ -669,6 +816,9 @@ public:
   // The returned promise never completes normally. It may throw if port.accept() throws. Dropping
   // the returned promise will cause the server to stop listening on the port, but already-open
   // connections will continue to be served. Destroy the whole HttpServer to cancel all I/O.
+  //
+  // To spread connections across cores, run one HttpServer per event loop thread, each listening
+  // on its own port from `kj::NetworkAddress::listenReusePort()`.
 
   kj::Promise<void> listenHttp(kj::Own<kj::AsyncIoStream> connection);
   // Reads HTTP requests from the given connection and directs them to the handler. A successful
@@ -677,8 +827,30 @@ public:
   // The promise throws if an unparseable request is received or if some I/O error occurs. Dropping
   // the returned promise will cancel all I/O on the connection and cancel any in-flight requests.
 
+  struct Load {
+    uint connections;
+    // Connections currently open.
+
+    uint activeRequests;
+    // Requests currently being handled by the HttpService.
+
+    uint queuedRequests;
+    // Requests waiting because of `maxConcurrentRequests`.
+
+    uint64_t shedRequests;
+    // Requests answered with a 503 error because of `maxQueueTime`, since the server was created.
+
+    bool acceptPaused;
+    // Whether some listenHttp(ConnectionReceiver&) is not accepting because of `maxConnections`.
+  };
+
+  Load getLoad() const;
+  // Reports how busy the server is, e.g. for a load balancer's health check.
+
 private:
   class Connection;
+  class RequestSlot;
+  class QueuedRequest;
 
   kj::Timer& timer;
   HttpHeaderTable& requestHeaderTable;
@@ -692,6 +864,17 @@ private:
   uint connectionCount = 0;
   kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> zeroConnectionsFulfiller;
 
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> acceptWaiters;
+  // Listen loops paused by `maxConnections`; fulfilled when a connection closes.
+  uint pausedListeners = 0;
+
+  uint activeRequests = 0;
+  uint queuedRequests = 0;
+  uint64_t shedRequests = 0;
+  QueuedRequest* queueHead = nullptr;
+  QueuedRequest** queueTail = &queueHead;
+  // Requests waiting for a RequestSlot, oldest first.
+
   kj::TaskSet tasks;
 
   HttpServer(kj::Timer& timer, HttpHeaderTable& requestHeaderTable, HttpService& service,
@@ -699,6 +882,12 @@ private:
 
   kj::Promise<void> listenLoop(kj::ConnectionReceiver& port);
 
+  kj::Promise<kj::Maybe<kj::Own<RequestSlot>>> admitRequest();
+  // Resolves once a request may be passed to the service, to a slot which must be held until the
+  // service is done, or to null if the request should be shed.
+
+  void admitNext();
+
   void taskFailed(kj::Exception&& exception) override;
 };
 
@@ -710,7 +899,6 @@ inline void HttpHeaderId::requireFrom(const HttpHeaderTable& table) const {
       "the provided HttpHeaderId is from the wrong HttpHeaderTable");
 }
 
-inline kj::Own<HttpHeaderTable> HttpHeaderTable::Builder::build() { return kj::mv(table); }
 inline HttpHeaderTable& HttpHeaderTable::Builder::getFutureTable() { return *table; }
 
 inline uint HttpHeaderTable::idCount() const { return namesById.size(); }
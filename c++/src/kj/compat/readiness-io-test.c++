@@ -208,5 +208,113 @@ KJ_TEST("readiness IO: read many even") {
   }
 }
 
+class CountingOutputStream final: public AsyncOutputStream {
+public:
+  kj::Vector<size_t> writes;
+  kj::Vector<byte> data;
+
+  Promise<void> write(const void* buffer, size_t size) override {
+    writes.add(size);
+    data.addAll(kj::arrayPtr(reinterpret_cast<const byte*>(buffer), size));
+    return kj::READY_NOW;
+  }
+  Promise<void> write(ArrayPtr<const ArrayPtr<const byte>> pieces) override {
+    KJ_UNIMPLEMENTED("not used");
+  }
+};
+
+KJ_TEST("readiness IO: writes in one turn are batched") {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+  CountingOutputStream counter;
+
+  ReadyOutputStreamWrapper out(counter);
+  KJ_ASSERT(KJ_ASSERT_NONNULL(out.write(kj::StringPtr("foo").asBytes())) == 3);
+  kj::ArrayPtr<const byte> pieces[] = {
+    kj::StringPtr("bar").asBytes(), nullptr, kj::StringPtr("baz").asBytes()
+  };
+  KJ_ASSERT(KJ_ASSERT_NONNULL(out.write(pieces)) == 6);
+  KJ_ASSERT(counter.writes.size() == 0);
+
+  out.flush().wait(waitScope);
+  KJ_ASSERT(counter.writes.size() == 1);
+  KJ_ASSERT(kj::heapString(counter.data.asPtr().asChars()) == "foobarbaz");
+}
+
+KJ_TEST("readiness IO: write buffer grows up to limit") {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+  CountingOutputStream counter;
+
+  ReadyOutputStreamWrapper::Options options;
+  options.initialBufferSize = 16;
+  options.maxBufferSize = 100;
+  ReadyOutputStreamWrapper out(counter, options);
+
+  auto data = kj::heapArray<byte>(250);
+  for (auto i: kj::indices(data)) data[i] = i;
+
+  KJ_ASSERT(KJ_ASSERT_NONNULL(out.write(data)) == 100);
+  KJ_ASSERT(out.write(data.slice(100, data.size())) == nullptr);
+
+  out.whenReady().wait(waitScope);
+  KJ_ASSERT(KJ_ASSERT_NONNULL(out.write(data.slice(100, data.size()))) == 100);
+  out.whenReady().wait(waitScope);
+  KJ_ASSERT(KJ_ASSERT_NONNULL(out.write(data.slice(200, data.size()))) == 50);
+  out.flush().wait(waitScope);
+
+  KJ_ASSERT(counter.writes.size() == 3);
+  KJ_ASSERT(counter.writes[0] == 100);
+  KJ_ASSERT(counter.writes[1] == 100);
+  KJ_ASSERT(counter.writes[2] == 50);
+  KJ_ASSERT(counter.data.asPtr() == data.asPtr());
+}
+
+class RecordingInputStream final: public AsyncInputStream {
+public:
+  size_t remaining;
+  kj::Vector<size_t> requests;
+
+  explicit RecordingInputStream(size_t size): remaining(size) {}
+
+  Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    requests.add(maxBytes);
+    size_t n = kj::min(maxBytes, remaining);
+    memset(buffer, 'x', n);
+    remaining -= n;
+    return n;
+  }
+};
+
+KJ_TEST("readiness IO: read buffer grows while reads fill it") {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+  RecordingInputStream input(1000);
+
+  ReadyInputStreamWrapper::Options options;
+  options.initialBufferSize = 16;
+  options.maxBufferSize = 128;
+  ReadyInputStreamWrapper in(input, options);
+
+  size_t total = 0;
+  byte buf[1000];
+  for (;;) {
+    KJ_IF_MAYBE(n, in.read(buf)) {
+      if (*n == 0) break;
+      total += *n;
+    } else {
+      in.whenReady().wait(waitScope);
+    }
+  }
+
+  KJ_ASSERT(total == 1000);
+  KJ_ASSERT(input.requests.size() >= 5);
+  KJ_ASSERT(input.requests[0] == 16);
+  KJ_ASSERT(input.requests[1] == 32);
+  KJ_ASSERT(input.requests[2] == 64);
+  KJ_ASSERT(input.requests[3] == 128);
+  KJ_ASSERT(input.requests[4] == 128);
+}
+
 }  // namespace
 }  // namespace kj
@@ -20,6 +20,7 @@
 // THE SOFTWARE.
 
 #include "readiness-io.h"
+#include <kj/debug.h>
 
 namespace kj {
 
@@ -32,7 +33,13 @@ static size_t copyInto(kj::ArrayPtr<byte> dst, kj::ArrayPtr<const byte>& src) {
 
 // =======================================================================================
 
-ReadyInputStreamWrapper::ReadyInputStreamWrapper(AsyncInputStream& input): input(input) {}
+ReadyInputStreamWrapper::ReadyInputStreamWrapper(AsyncInputStream& input)
+    : ReadyInputStreamWrapper(input, Options()) {}
+ReadyInputStreamWrapper::ReadyInputStreamWrapper(AsyncInputStream& input, Options options)
+    : input(input), options(options), nextBufferSize(options.initialBufferSize) {
+  KJ_REQUIRE(options.initialBufferSize > 0 &&
+             options.initialBufferSize <= options.maxBufferSize);
+}
 ReadyInputStreamWrapper::~ReadyInputStreamWrapper() noexcept(false) {}
 
 kj::Maybe<size_t> ReadyInputStreamWrapper::read(kj::ArrayPtr<byte> dst) {
@@ -42,14 +49,26 @@ kj::Maybe<size_t> ReadyInputStreamWrapper::read(kj::ArrayPtr<byte> dst) {
     // No data available. Try to read more.
     if (!isPumping) {
       isPumping = true;
+      if (buffer.size() != nextBufferSize) {
+        // Nothing points into the buffer while it's empty, so it can be replaced.
+        buffer = kj::heapArray<byte>(nextBufferSize);
+      }
       pumpTask = kj::evalNow([&]() {
-        return input.tryRead(buffer, 1, sizeof(buffer)).then([this](size_t n) {
+        return input.tryRead(buffer.begin(), 1, buffer.size()).then([this](size_t n) {
           if (n == 0) {
             eof = true;
           } else {
-            content = kj::arrayPtr(buffer, n);
+            content = buffer.slice(0, n);
           }
           isPumping = false;
+
+          // A read which filled the buffer suggests more is waiting, so read more at once next
+          // time; one which used little of it means a smaller buffer will do.
+          if (n == buffer.size()) {
+            nextBufferSize = kj::min(buffer.size() * 2, options.maxBufferSize);
+          } else if (n < buffer.size() / 4) {
+            nextBufferSize = kj::max(buffer.size() / 2, options.initialBufferSize);
+          }
         });
       }).fork();
     }
@@ -66,68 +85,98 @@ kj::Promise<void> ReadyInputStreamWrapper::whenReady() {
 
 // =======================================================================================
 
-ReadyOutputStreamWrapper::ReadyOutputStreamWrapper(AsyncOutputStream& output): output(output) {}
+ReadyOutputStreamWrapper::ReadyOutputStreamWrapper(AsyncOutputStream& output)
+    : ReadyOutputStreamWrapper(output, Options()) {}
+ReadyOutputStreamWrapper::ReadyOutputStreamWrapper(AsyncOutputStream& output, Options options)
+    : output(output), options(options) {
+  KJ_REQUIRE(options.initialBufferSize > 0 &&
+             options.initialBufferSize <= options.maxBufferSize);
+}
 ReadyOutputStreamWrapper::~ReadyOutputStreamWrapper() noexcept(false) {}
 
+size_t ReadyOutputStreamWrapper::append(kj::ArrayPtr<const byte> src) {
+  size_t space = filling.size() - filled;
+  if (src.size() > space && filling.size() < options.maxBufferSize) {
+    // Grow.  `filling` isn't being written, so it can be reallocated.
+    size_t newSize = kj::max(filling.size() * 2, options.initialBufferSize);
+    while (newSize < filled + src.size() && newSize < options.maxBufferSize) newSize *= 2;
+    newSize = kj::min(newSize, options.maxBufferSize);
+
+    auto newBuffer = kj::heapArray<byte>(newSize);
+    memcpy(newBuffer.begin(), filling.begin(), filled);
+    filling = kj::mv(newBuffer);
+  }
+
+  size_t n = copyInto(filling.slice(filled, filling.size()), src);
+  filled += n;
+  return n;
+}
+
 kj::Maybe<size_t> ReadyOutputStreamWrapper::write(kj::ArrayPtr<const byte> data) {
   if (data.size() == 0) return size_t(0);
 
-  if (filled == sizeof(buffer)) {
+  size_t result = append(data);
+  if (result == 0) {
     // No space.
     return nullptr;
   }
 
-  uint end = start + filled;
-  size_t result = 0;
-  if (end < sizeof(buffer)) {
-    // The filled part of the buffer is somewhere in the middle.
-
-    // Copy into space after filled space.
-    result += copyInto(kj::arrayPtr(buffer + end, buffer + sizeof(buffer)), data);
-
-    // Copy into space before filled space.
-    result += copyInto(kj::arrayPtr(buffer, buffer + start), data);
-  } else {
-    // Fill currently loops, so we only have one segment of empty space to copy into.
+  startPump();
+  return result;
+}
 
-    // Copy into the space between the fill's end and the fill's start.
-    result += copyInto(kj::arrayPtr(buffer + end % sizeof(buffer), buffer + start), data);
+kj::Maybe<size_t> ReadyOutputStreamWrapper::write(
+    kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) {
+  size_t result = 0;
+  bool any = false;
+  for (auto piece: pieces) {
+    if (piece.size() == 0) continue;
+    any = true;
+    size_t n = append(piece);
+    result += n;
+    if (n < piece.size()) break;
   }
 
-  filled += result;
+  if (!any) return size_t(0);
+  if (result == 0) return nullptr;
+
+  startPump();
+  return result;
+}
 
+void ReadyOutputStreamWrapper::startPump() {
   if (!isPumping) {
     isPumping = true;
-    pumpTask = kj::evalNow([&]() {
+    // Wait for the rest of this turn's writes before writing anything.
+    pumpTask = kj::evalLater([this]() {
       return pump();
     }).fork();
   }
-
-  return result;
 }
 
 kj::Promise<void> ReadyOutputStreamWrapper::whenReady() {
   return pumpTask.addBranch();
 }
 
+kj::Promise<void> ReadyOutputStreamWrapper::flush() {
+  // pump() keeps going until the buffer is empty, so we're done when it is.
+  if (!isPumping) return kj::READY_NOW;
+  return pumpTask.addBranch();
+}
+
 kj::Promise<void> ReadyOutputStreamWrapper::pump() {
-  uint oldFilled = filled;
-  uint end = start + filled;
-
-  kj::Promise<void> promise = nullptr;
-  if (end <= sizeof(buffer)) {
-    promise = output.write(buffer + start, filled);
-  } else {
-    end = end % sizeof(buffer);
-    segments[0] = kj::arrayPtr(buffer + start, buffer + sizeof(buffer));
-    segments[1] = kj::arrayPtr(buffer, buffer + end);
-    promise = output.write(segments);
+  // Swap buffers, so that write() can keep filling one while the other is written.  The drained
+  // buffer is reused, unless it's smaller than the limit and the filling one has grown.
+  auto drained = kj::mv(draining);
+  draining = kj::mv(filling);
+  filling = kj::mv(drained);
+  size_t size = filled;
+  filled = 0;
+  if (filling.size() < draining.size() && draining.size() <= options.maxBufferSize) {
+    filling = nullptr;
   }
 
-  return promise.then([this,oldFilled,end]() -> kj::Promise<void> {
-    filled -= oldFilled;
-    start = end;
-
+  return output.write(draining.begin(), size).then([this]() -> kj::Promise<void> {
     if (filled > 0) {
       return pump();
     } else {
@@ -138,4 +187,3 @@ kj::Promise<void> ReadyOutputStreamWrapper::pump() {
 }
 
 }  // namespace kj
-
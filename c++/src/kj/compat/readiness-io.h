@@ -29,10 +29,21 @@ class ReadyInputStreamWrapper {
   // Provides readiness-based Async I/O as a wrapper around KJ's standard completion-based API, for
   // compatibility with libraries that use readiness-based abstractions (e.g. OpenSSL).
   //
-  // Unfortunately this requires buffering, so is not very efficient.
+  // Unfortunately this requires buffering.  To keep the number of reads down on bulk transfers,
+  // the buffer grows while reads keep filling it, up to a limit, and shrinks again when they
+  // don't.
 
 public:
+  struct Options {
+    size_t initialBufferSize = 8192;
+    // Size of the buffer for the first read.
+
+    size_t maxBufferSize = 65536;
+    // The buffer doubles each time a read fills it, up to this size.
+  };
+
   ReadyInputStreamWrapper(AsyncInputStream& input);
+  ReadyInputStreamWrapper(AsyncInputStream& input, Options options);
   ~ReadyInputStreamWrapper() noexcept(false);
   KJ_DISALLOW_COPY(ReadyInputStreamWrapper);
 
@@ -45,22 +56,36 @@ public:
 
 private:
   AsyncInputStream& input;
+  Options options;
   kj::ForkedPromise<void> pumpTask = nullptr;
   bool isPumping = false;
   bool eof = false;
 
   kj::ArrayPtr<const byte> content = nullptr;  // Points to currently-valid part of `buffer`.
-  byte buffer[8192];
+  kj::Array<byte> buffer;
+  size_t nextBufferSize;  // Size of the buffer for the next read.
 };
 
 class ReadyOutputStreamWrapper {
   // Provides readiness-based Async I/O as a wrapper around KJ's standard completion-based API, for
   // compatibility with libraries that use readiness-based abstractions (e.g. OpenSSL).
   //
-  // Unfortunately this requires buffering, so is not very efficient.
+  // Unfortunately this requires buffering.  Bytes accumulate in one buffer while the previous
+  // buffer is being written, and each buffer is written with a single write() once the current
+  // turn of the event loop ends, so that several small writes -- e.g. one TLS record each -- reach
+  // the underlying stream together.  The accumulating buffer grows as needed, up to a limit.
 
 public:
+  struct Options {
+    size_t initialBufferSize = 8192;
+    // Initial size of each of the two buffers.
+
+    size_t maxBufferSize = 65536;
+    // The accumulating buffer may grow up to this size before write() reports not ready.
+  };
+
   ReadyOutputStreamWrapper(AsyncOutputStream& output);
+  ReadyOutputStreamWrapper(AsyncOutputStream& output, Options options);
   ~ReadyOutputStreamWrapper() noexcept(false);
   KJ_DISALLOW_COPY(ReadyOutputStreamWrapper);
 
@@ -68,22 +93,31 @@ public:
   // Writes bytes from `src`, returning the number of bytes written. Never returns zero. Returns
   // nullptr if not ready.
 
+  kj::Maybe<size_t> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces);
+  // Like write(), but takes bytes from several pieces in order, stopping when the buffer is full.
+
   kj::Promise<void> whenReady();
   // Returns a promise that resolves when write() will return non-null.
 
+  kj::Promise<void> flush();
+  // Returns a promise that resolves when everything passed to write() so far has been written to
+  // the underlying stream.
+
 private:
   AsyncOutputStream& output;
-  ArrayPtr<const byte> segments[2];
+  Options options;
   kj::ForkedPromise<void> pumpTask = nullptr;
   bool isPumping = false;
 
-  uint start = 0;   // index of first byte
-  uint filled = 0;  // number of bytes currently in buffer
+  kj::Array<byte> filling;   // Accumulates bytes passed to write().
+  size_t filled = 0;         // Number of bytes in `filling`.
+  kj::Array<byte> draining;  // Being written to `output`; unused space when not pumping.
 
-  byte buffer[8192];
+  size_t append(kj::ArrayPtr<const byte> src);
+  void startPump();
 
   kj::Promise<void> pump();
-  // Asyncronously push the buffer out to the underlying stream.
+  // Asyncronously push buffered bytes out to the underlying stream, until there are none.
 };
 
 } // namespace kj
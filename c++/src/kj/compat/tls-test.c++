@@ -417,13 +417,13 @@ KJ_TEST("TLS full duplex") {
   auto client = clientPromise.wait(test.io.waitScope);
   auto server = serverPromise.wait(test.io.waitScope);
 
-  auto writeUp = writeN(*client, "foo", 10000);
-  auto readDown = readN(*client, "bar", 10000);
+  auto writeUp = writeN(*client, "foo", 30000);
+  auto readDown = readN(*client, "bar", 30000);
   KJ_EXPECT(!writeUp.poll(test.io.waitScope));
   KJ_EXPECT(!readDown.poll(test.io.waitScope));
 
-  auto writeDown = writeN(*server, "bar", 10000);
-  auto readUp = readN(*server, "foo", 10000);
+  auto writeDown = writeN(*server, "bar", 30000);
+  auto readUp = readN(*server, "foo", 30000);
 
   readUp.wait(test.io.waitScope);
   readDown.wait(test.io.waitScope);
@@ -577,6 +577,221 @@ KJ_TEST("TLS client certificate verification") {
   }
 }
 
+kj::Promise<void> exchangeGreetings(kj::AsyncIoStream& client, kj::AsyncIoStream& server,
+                                    kj::WaitScope& waitScope) {
+  // Sends a message each way. Besides checking the connection works, this makes the client read,
+  // which is when it processes any TLS 1.3 session tickets.
+
+  char buf[4];
+  buf[3] = '\0';
+
+  auto writePromise = client.write("foo", 3);
+  server.read(&buf, 3).wait(waitScope);
+  KJ_ASSERT(kj::StringPtr(buf) == "foo");
+  writePromise.wait(waitScope);
+
+  writePromise = server.write("bar", 3);
+  client.read(&buf, 3).wait(waitScope);
+  KJ_ASSERT(kj::StringPtr(buf) == "bar");
+  return kj::mv(writePromise);
+}
+
+void connectAndGreet(TlsTest& test, kj::StringPtr hostname) {
+  ErrorNexus e;
+
+  auto pipe = test.io.provider->newTwoWayPipe();
+
+  auto clientPromise = e.wrap(test.tlsClient.wrapClient(kj::mv(pipe.ends[0]), hostname));
+  auto serverPromise = e.wrap(test.tlsServer.wrapServer(kj::mv(pipe.ends[1])));
+
+  auto client = clientPromise.wait(test.io.waitScope);
+  auto server = serverPromise.wait(test.io.waitScope);
+
+  exchangeGreetings(*client, *server, test.io.waitScope).wait(test.io.waitScope);
+}
+
+KJ_TEST("TLS session resumption") {
+  TlsSessionStats clientStats;
+  TlsSessionStats serverStats;
+
+  auto clientOptions = TlsTest::defaultClient();
+  clientOptions.sessionStats = clientStats;
+  auto serverOptions = TlsTest::defaultServer();
+  serverOptions.sessionStats = serverStats;
+
+  TlsTest test(clientOptions, serverOptions);
+
+  connectAndGreet(test, "example.com");
+  KJ_EXPECT(clientStats.fullHandshakes == 1);
+  KJ_EXPECT(serverStats.fullHandshakes == 1);
+
+  connectAndGreet(test, "example.com");
+  KJ_EXPECT(clientStats.fullHandshakes == 1);
+  KJ_EXPECT(clientStats.resumedHandshakes == 1);
+  KJ_EXPECT(serverStats.resumedHandshakes == 1);
+}
+
+KJ_TEST("TLS session resumption disabled") {
+  TlsSessionStats clientStats;
+
+  auto clientOptions = TlsTest::defaultClient();
+  clientOptions.sessionStats = clientStats;
+  clientOptions.clientSessionCacheSize = 0;
+
+  TlsTest test(clientOptions);
+
+  connectAndGreet(test, "example.com");
+  connectAndGreet(test, "example.com");
+  KJ_EXPECT(clientStats.fullHandshakes == 2);
+  KJ_EXPECT(clientStats.resumedHandshakes == 0);
+}
+
+KJ_TEST("TLS shared session ticket key") {
+  // Two servers sharing a ticket key resume each other's sessions without a shared cache.
+
+  byte ticketKey[80];
+  for (auto i: kj::indices(ticketKey)) ticketKey[i] = i;
+
+  TlsSessionStats clientStats;
+  auto clientOptions = TlsTest::defaultClient();
+  clientOptions.sessionStats = clientStats;
+  auto serverOptions = TlsTest::defaultServer();
+  serverOptions.sessionCacheSize = 0;
+  serverOptions.sessionTicketKey = ticketKey;
+
+  TlsTest test(clientOptions, serverOptions);
+  connectAndGreet(test, "example.com");
+
+  TlsContext otherServer(serverOptions);
+  {
+    ErrorNexus e;
+    auto pipe = test.io.provider->newTwoWayPipe();
+    auto clientPromise = e.wrap(test.tlsClient.wrapClient(kj::mv(pipe.ends[0]), "example.com"));
+    auto serverPromise = e.wrap(otherServer.wrapServer(kj::mv(pipe.ends[1])));
+    auto client = clientPromise.wait(test.io.waitScope);
+    auto server = serverPromise.wait(test.io.waitScope);
+    exchangeGreetings(*client, *server, test.io.waitScope).wait(test.io.waitScope);
+  }
+
+  KJ_EXPECT(clientStats.fullHandshakes == 1);
+  KJ_EXPECT(clientStats.resumedHandshakes == 1);
+}
+
+KJ_TEST("TLS kernel offload falls back on unsupported streams") {
+  // A socketpair can't take the kernel's TLS ULP, so the connection must stay in userspace and
+  // keep working.
+
+  TlsSessionStats clientStats;
+  TlsSessionStats serverStats;
+
+  auto clientOptions = TlsTest::defaultClient();
+  clientOptions.kernelTls = true;
+  clientOptions.sessionStats = clientStats;
+  clientOptions.minVersion = TlsVersion::TLS_1_2;
+  auto serverOptions = TlsTest::defaultServer();
+  serverOptions.kernelTls = true;
+  serverOptions.sessionStats = serverStats;
+
+  TlsTest test(clientOptions, serverOptions);
+
+  connectAndGreet(test, "example.com");
+  KJ_EXPECT(clientStats.kernelOffloads == 0);
+  KJ_EXPECT(serverStats.kernelOffloads == 0);
+}
+
+KJ_TEST("TLS private key operations on a thread pool") {
+  kj::ThreadPool pool(2);
+
+  TlsSessionStats serverStats;
+  auto serverOptions = TlsTest::defaultServer();
+  serverOptions.privateKeyThreadPool = pool;
+  serverOptions.sessionStats = serverStats;
+
+  TlsTest test(TlsTest::defaultClient(), serverOptions);
+
+  // Several handshakes at once, so that some make progress while others wait on the pool.
+  ErrorNexus e;
+  kj::Vector<kj::Promise<kj::Own<kj::AsyncIoStream>>> clientPromises;
+  kj::Vector<kj::Promise<kj::Own<kj::AsyncIoStream>>> serverPromises;
+  for (auto i KJ_UNUSED: kj::zeroTo(4)) {
+    auto pipe = test.io.provider->newTwoWayPipe();
+    clientPromises.add(e.wrap(test.tlsClient.wrapClient(kj::mv(pipe.ends[0]), "example.com")));
+    serverPromises.add(e.wrap(test.tlsServer.wrapServer(kj::mv(pipe.ends[1]))));
+  }
+  for (auto i: kj::indices(clientPromises)) {
+    auto client = clientPromises[i].wait(test.io.waitScope);
+    auto server = serverPromises[i].wait(test.io.waitScope);
+    exchangeGreetings(*client, *server, test.io.waitScope).wait(test.io.waitScope);
+  }
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_IS_BORINGSSL)
+  // Resumed handshakes don't sign anything.
+  KJ_EXPECT(serverStats.offloadedKeyOperations == serverStats.fullHandshakes);
+  KJ_EXPECT(serverStats.fullHandshakes > 0);
+#endif
+}
+
+KJ_TEST("TLS write after peer closed") {
+  TlsTest test;
+  ErrorNexus e;
+
+  auto pipe = test.io.provider->newTwoWayPipe();
+  auto clientPromise = e.wrap(test.tlsClient.wrapClient(kj::mv(pipe.ends[0]), "example.com"));
+  auto serverPromise = e.wrap(test.tlsServer.wrapServer(kj::mv(pipe.ends[1])));
+  auto client = clientPromise.wait(test.io.waitScope);
+  auto server = serverPromise.wait(test.io.waitScope);
+
+  client->shutdownWrite();
+  char c;
+  KJ_EXPECT(server->tryRead(&c, 1, 1).wait(test.io.waitScope) == 0);
+
+  KJ_EXPECT_THROW(DISCONNECTED, server->write("foo", 3).wait(test.io.waitScope));
+}
+
+KJ_TEST("TLS ALPN") {
+  auto negotiate = [](kj::ArrayPtr<const kj::StringPtr> clientProtocols,
+                      kj::ArrayPtr<const kj::StringPtr> serverProtocols)
+      -> kj::Maybe<kj::String> {
+    auto clientOptions = TlsTest::defaultClient();
+    clientOptions.alpnProtocols = clientProtocols;
+    auto serverOptions = TlsTest::defaultServer();
+    serverOptions.alpnProtocols = serverProtocols;
+    TlsTest test(clientOptions, serverOptions);
+
+    ErrorNexus e;
+    auto pipe = test.io.provider->newTwoWayPipe();
+    auto clientPromise = e.wrap(test.tlsClient.wrapClient(kj::mv(pipe.ends[0]), "example.com"));
+    auto serverPromise = e.wrap(test.tlsServer.wrapServer(kj::mv(pipe.ends[1])));
+    auto client = clientPromise.wait(test.io.waitScope);
+    auto server = serverPromise.wait(test.io.waitScope);
+    exchangeGreetings(*client, *server, test.io.waitScope).wait(test.io.waitScope);
+
+    auto serverProtocol = server->getNegotiatedProtocol();
+    KJ_IF_MAYBE(protocol, client->getNegotiatedProtocol()) {
+      KJ_EXPECT(KJ_ASSERT_NONNULL(serverProtocol) == *protocol);
+      return kj::str(*protocol);
+    } else {
+      KJ_EXPECT(serverProtocol == nullptr);
+      return nullptr;
+    }
+  };
+
+  kj::StringPtr both[] = {"h2", "http/1.1"};
+  kj::StringPtr reversed[] = {"http/1.1", "h2"};
+  kj::StringPtr h2[] = {"h2"};
+  kj::StringPtr other[] = {"spdy/3"};
+
+  // The server's preference wins.
+  KJ_EXPECT(KJ_ASSERT_NONNULL(negotiate(reversed, both)) == "h2");
+  KJ_EXPECT(KJ_ASSERT_NONNULL(negotiate(both, reversed)) == "http/1.1");
+  KJ_EXPECT(KJ_ASSERT_NONNULL(negotiate(h2, both)) == "h2");
+
+  // No protocol in common, or none offered: the handshake succeeds without one.
+  KJ_EXPECT(negotiate(other, both) == nullptr);
+  KJ_EXPECT(negotiate(nullptr, both) == nullptr);
+  KJ_EXPECT(negotiate(both, nullptr) == nullptr);
+}
+
 #ifdef KJ_EXTERNAL_TESTS
 KJ_TEST("TLS to capnproto.org") {
   kj::AsyncIoContext io = setupAsyncIo();
@@ -34,6 +34,8 @@
 #include <openssl/tls1.h>
 #include <kj/debug.h>
 #include <kj/vector.h>
+#include <kj/map.h>
+#include <kj/mutex.h>
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 #define BIO_set_init(x,v)          (x->init=v)
@@ -41,6 +43,32 @@
 #define BIO_set_data(x,v)          (x->ptr=v)
 #endif
 
+#if __linux__ && OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(OPENSSL_IS_BORINGSSL)
+// Kernel TLS offload needs the TLS 1.2 PRF from EVP and the linux/tls.h ABI.
+#define KJ_TLS_KERNEL_OFFLOAD 1
+#include <openssl/kdf.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <linux/tls.h>
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_IS_BORINGSSL) && \
+    !defined(OPENSSL_NO_ASYNC)
+// Private key operations can be paused inside an OpenSSL async job and finished elsewhere.
+#define KJ_TLS_ASYNC_KEYS 1
+#include <openssl/async.h>
+#include <openssl/rsa.h>
+#include <openssl/ec.h>
+#include <kj/threadlocal.h>
+#endif
+
 namespace kj {
 namespace {
 
@@ -90,6 +118,346 @@ void ensureOpenSslInitialized() {
   static OpenSslInit init;
 }
 
+#if KJ_TLS_KERNEL_OFFLOAD
+
+union KernelCryptoInfo {
+  tls_crypto_info info;
+  tls12_crypto_info_aes_gcm_128 aes128;
+  tls12_crypto_info_aes_gcm_256 aes256;
+};
+
+kj::Maybe<size_t> getKernelTxCryptoInfo(SSL* ssl, KernelCryptoInfo& result) {
+  // Derives the state of our outgoing direction from a TLS 1.2 handshake which has just completed,
+  // in the form the kernel's TLS_TX socket option wants. Returns the size of the struct filled in,
+  // or null if kTLS can't handle this connection's parameters. The caller should cleanse `result`.
+
+  if (SSL_version(ssl) != TLS1_2_VERSION) return nullptr;
+
+  const SSL_CIPHER* cipher = SSL_get_current_cipher(ssl);
+  if (cipher == nullptr) return nullptr;
+
+  size_t keySize;
+  switch (SSL_CIPHER_get_cipher_nid(cipher)) {
+    case NID_aes_128_gcm: keySize = TLS_CIPHER_AES_GCM_128_KEY_SIZE; break;
+    case NID_aes_256_gcm: keySize = TLS_CIPHER_AES_GCM_256_KEY_SIZE; break;
+    default: return nullptr;
+  }
+  constexpr size_t SALT_SIZE = TLS_CIPHER_AES_GCM_128_SALT_SIZE;
+
+  byte masterKey[SSL_MAX_MASTER_KEY_LENGTH];
+  KJ_DEFER(OPENSSL_cleanse(masterKey, sizeof(masterKey)));
+  size_t masterKeySize = SSL_SESSION_get_master_key(
+      SSL_get_session(ssl), masterKey, sizeof(masterKey));
+
+  byte clientRandom[SSL3_RANDOM_SIZE];
+  byte serverRandom[SSL3_RANDOM_SIZE];
+  SSL_get_client_random(ssl, clientRandom, sizeof(clientRandom));
+  SSL_get_server_random(ssl, serverRandom, sizeof(serverRandom));
+
+  // For AEAD ciphers the key block is client_write_key, server_write_key, client_write_IV,
+  // server_write_IV, with no MAC keys (RFC 5246 section 6.3, RFC 5288 section 3).
+  byte keyBlock[2 * (TLS_CIPHER_AES_GCM_256_KEY_SIZE + SALT_SIZE)];
+  KJ_DEFER(OPENSSL_cleanse(keyBlock, sizeof(keyBlock)));
+  size_t keyBlockSize = 2 * (keySize + SALT_SIZE);
+
+  EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, nullptr);
+  if (pctx == nullptr) {
+    throwOpensslError();
+  }
+  KJ_DEFER(EVP_PKEY_CTX_free(pctx));
+
+  kj::StringPtr label = "key expansion";
+  if (EVP_PKEY_derive_init(pctx) <= 0 ||
+      EVP_PKEY_CTX_set_tls1_prf_md(pctx, SSL_CIPHER_get_handshake_digest(cipher)) <= 0 ||
+      EVP_PKEY_CTX_set1_tls1_prf_secret(pctx, masterKey, masterKeySize) <= 0 ||
+      EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, label.asBytes().begin(), label.size()) <= 0 ||
+      EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, serverRandom, sizeof(serverRandom)) <= 0 ||
+      EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, clientRandom, sizeof(clientRandom)) <= 0 ||
+      EVP_PKEY_derive(pctx, keyBlock, &keyBlockSize) <= 0) {
+    throwOpensslError();
+  }
+
+  bool isServer = SSL_is_server(ssl);
+  const byte* key = keyBlock + (isServer ? keySize : 0);
+  const byte* salt = keyBlock + 2 * keySize + (isServer ? SALT_SIZE : 0);
+
+  // The only record sent under the new keys so far is our Finished message, number zero. The
+  // kernel increments the explicit nonce along with the sequence number, so starting it at the
+  // sequence number follows RFC 5288's suggestion.
+  byte sequence[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+  memset(&result, 0, sizeof(result));
+  result.info.version = TLS_1_2_VERSION;
+  if (keySize == TLS_CIPHER_AES_GCM_128_KEY_SIZE) {
+    result.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+    memcpy(result.aes128.key, key, keySize);
+    memcpy(result.aes128.salt, salt, SALT_SIZE);
+    memcpy(result.aes128.iv, sequence, sizeof(sequence));
+    memcpy(result.aes128.rec_seq, sequence, sizeof(sequence));
+    return sizeof(result.aes128);
+  } else {
+    result.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+    memcpy(result.aes256.key, key, keySize);
+    memcpy(result.aes256.salt, salt, SALT_SIZE);
+    memcpy(result.aes256.iv, sequence, sizeof(sequence));
+    memcpy(result.aes256.rec_seq, sequence, sizeof(sequence));
+    return sizeof(result.aes256);
+  }
+}
+
+#endif  // KJ_TLS_KERNEL_OFFLOAD
+
+// =======================================================================================
+// Private key operations on a thread pool
+//
+// With TlsContext::Options::privateKeyThreadPool set, the context's keys are copied into keys with
+// RSA and ECDSA methods of our own. When one of those is called from inside an async job -- which
+// is where TlsConnection runs handshakes when offloading, via SSL_MODE_ASYNC -- it copies its
+// inputs, hands the operation to the pool, and pauses the job. SSL_accept() or SSL_connect() then
+// return SSL_ERROR_WANT_ASYNC; once the pool is done, TlsConnection calls them again, which resumes
+// the job inside the method, which copies out the result. Called anywhere else, the methods do the
+// operation inline, as the default methods would.
+//
+// The operation owns everything it uses, since the connection might be destroyed (freeing the
+// job) while a worker is still busy with it.
+
+struct KeyOffload {
+  // Per-connection state. TlsConnection points `currentKeyOffload` at this while it calls into
+  // OpenSSL, which is how the methods find it.
+
+  const kj::ThreadPool& pool;
+  kj::Maybe<TlsSessionStats&> stats;
+
+  struct Result {
+    int code;
+    unsigned int length;
+    kj::Array<byte> output;
+  };
+
+  kj::Maybe<kj::Promise<void>> pending;
+  // Resolves when the operation the job is paused on is done.
+
+  kj::Maybe<Result> result;
+
+  KeyOffload(const kj::ThreadPool& pool, kj::Maybe<TlsSessionStats&> stats)
+      : pool(pool), stats(stats) {}
+};
+
+#if KJ_TLS_ASYNC_KEYS
+
+KJ_THREADLOCAL_PTR(KeyOffload) currentKeyOffload = nullptr;
+
+template <typename Op>
+int offloadKeyOp(Op&& op, byte* out, unsigned int* outLength) {
+  // `op(out, outLength)` performs the operation, writing at most `op.outputSize()` bytes to `out`,
+  // and returns OpenSSL's result code.
+
+  KeyOffload* offload = currentKeyOffload;
+  if (offload == nullptr || ASYNC_get_current_job() == nullptr) {
+    return op(out, outLength);
+  }
+
+  size_t outputSize = op.outputSize();
+  offload->result = nullptr;
+  offload->pending = offload->pool.run(kj::mvCapture(op, [outputSize](Op&& op) {
+    auto output = kj::heapArray<byte>(outputSize);
+    unsigned int length = 0;
+    int code = op(output.begin(), &length);
+    return KeyOffload::Result { code, length, kj::mv(output) };
+  })).then([offload](KeyOffload::Result&& result) {
+    KJ_IF_MAYBE(s, offload->stats) {
+      ++s->offloadedKeyOperations;
+    }
+    offload->result = kj::mv(result);
+  }, [offload](kj::Exception&& e) {
+    // Most likely the pool was destroyed. The handshake fails the same way a failed signature
+    // would.
+    KJ_LOG(ERROR, "TLS private key operation failed", e);
+    offload->result = KeyOffload::Result { -1, 0, nullptr };
+  });
+
+  while (offload->result == nullptr) {
+    if (!ASYNC_pause_job()) return -1;
+  }
+
+  auto result = kj::mv(KJ_ASSERT_NONNULL(offload->result));
+  offload->result = nullptr;
+  if (result.output.size() > 0) {
+    memcpy(out, result.output.begin(), result.output.size());
+  }
+  if (outLength != nullptr) *outLength = result.length;
+  return result.code;
+}
+
+typedef int RsaPrivateFunc(int flen, const unsigned char* from, unsigned char* to, RSA* rsa,
+                           int padding);
+
+class RsaPrivateOp {
+  // A private encryption (i.e. signature) or decryption with the default RSA implementation.
+
+public:
+  RsaPrivateOp(RsaPrivateFunc* func, RSA* rsa, const unsigned char* from, int flen, int padding)
+      : func(func), rsa(rsa), input(kj::heapArray<byte>(from, flen)), padding(padding) {
+    RSA_up_ref(rsa);
+  }
+  RsaPrivateOp(RsaPrivateOp&& other)
+      : func(other.func), rsa(other.rsa), input(kj::mv(other.input)), padding(other.padding) {
+    other.rsa = nullptr;
+  }
+  ~RsaPrivateOp() noexcept(false) {
+    if (rsa != nullptr) RSA_free(rsa);
+  }
+  KJ_DISALLOW_COPY(RsaPrivateOp);
+
+  size_t outputSize() { return RSA_size(rsa); }
+
+  int operator()(byte* out, unsigned int* outLength) {
+    return func(input.size(), input.begin(), out, rsa, padding);
+  }
+
+private:
+  RsaPrivateFunc* func;
+  RSA* rsa;
+  kj::Array<byte> input;
+  int padding;
+};
+
+int offloadedRsaPrivateEncrypt(int flen, const unsigned char* from, unsigned char* to, RSA* rsa,
+                               int padding) {
+  return offloadKeyOp(RsaPrivateOp(RSA_meth_get_priv_enc(RSA_PKCS1_OpenSSL()),
+                                   rsa, from, flen, padding), to, nullptr);
+}
+
+int offloadedRsaPrivateDecrypt(int flen, const unsigned char* from, unsigned char* to, RSA* rsa,
+                               int padding) {
+  return offloadKeyOp(RsaPrivateOp(RSA_meth_get_priv_dec(RSA_PKCS1_OpenSSL()),
+                                   rsa, from, flen, padding), to, nullptr);
+}
+
+typedef int EcSignFunc(int type, const unsigned char* dgst, int dlen, unsigned char* sig,
+                       unsigned int* siglen, const BIGNUM* kinv, const BIGNUM* r, EC_KEY* eckey);
+
+EcSignFunc* defaultEcSign() {
+  EcSignFunc* sign;
+  EC_KEY_METHOD_get_sign(EC_KEY_OpenSSL(), &sign, nullptr, nullptr);
+  return sign;
+}
+
+class EcSignOp {
+  // An ECDSA signature with the default implementation.
+
+public:
+  EcSignOp(int type, const unsigned char* dgst, int dlen, EC_KEY* key)
+      : type(type), digest(kj::heapArray<byte>(dgst, dlen)), key(key) {
+    EC_KEY_up_ref(key);
+  }
+  EcSignOp(EcSignOp&& other)
+      : type(other.type), digest(kj::mv(other.digest)), key(other.key) {
+    other.key = nullptr;
+  }
+  ~EcSignOp() noexcept(false) {
+    if (key != nullptr) EC_KEY_free(key);
+  }
+  KJ_DISALLOW_COPY(EcSignOp);
+
+  size_t outputSize() { return ECDSA_size(key); }
+
+  int operator()(byte* out, unsigned int* outLength) {
+    return defaultEcSign()(type, digest.begin(), digest.size(), out, outLength,
+                           nullptr, nullptr, key);
+  }
+
+private:
+  int type;
+  kj::Array<byte> digest;
+  EC_KEY* key;
+};
+
+int offloadedEcSign(int type, const unsigned char* dgst, int dlen, unsigned char* sig,
+                    unsigned int* siglen, const BIGNUM* kinv, const BIGNUM* r, EC_KEY* eckey) {
+  if (sig == nullptr || kinv != nullptr || r != nullptr) {
+    // A size query, or precomputed values; not something to offload.
+    return defaultEcSign()(type, dgst, dlen, sig, siglen, kinv, r, eckey);
+  }
+  return offloadKeyOp(EcSignOp(type, dgst, dlen, eckey), sig, siglen);
+}
+
+const RSA_METHOD* getOffloadedRsaMethod() {
+  static const RSA_METHOD* const method = []() {
+    RSA_METHOD* method = RSA_meth_dup(RSA_PKCS1_OpenSSL());
+    RSA_meth_set1_name(method, "KJ offloaded RSA");
+    RSA_meth_set_priv_enc(method, &offloadedRsaPrivateEncrypt);
+    RSA_meth_set_priv_dec(method, &offloadedRsaPrivateDecrypt);
+    return method;
+  }();
+  return method;
+}
+
+const EC_KEY_METHOD* getOffloadedEcMethod() {
+  static const EC_KEY_METHOD* const method = []() {
+    EC_KEY_METHOD* method = EC_KEY_METHOD_new(EC_KEY_OpenSSL());
+    int (*signSetup)(EC_KEY*, BN_CTX*, BIGNUM**, BIGNUM**);
+    ECDSA_SIG* (*signSig)(const unsigned char*, int, const BIGNUM*, const BIGNUM*, EC_KEY*);
+    EC_KEY_METHOD_get_sign(EC_KEY_OpenSSL(), nullptr, &signSetup, &signSig);
+    EC_KEY_METHOD_set_sign(method, &offloadedEcSign, signSetup, signSig);
+    return method;
+  }();
+  return method;
+}
+
+EVP_PKEY* newOffloadedKey(EVP_PKEY* pkey) {
+  // Returns a new reference to a key equivalent to `pkey` whose private key operations can be
+  // offloaded, or to `pkey` itself if it isn't a kind we handle. The copy is needed because the
+  // method must be in place before the key is wrapped in an EVP_PKEY (OpenSSL 3 only uses custom
+  // methods on "foreign" keys, which it detects at that point), and so that other users of the
+  // caller's key are unaffected.
+
+  EVP_PKEY* result = EVP_PKEY_new();
+  if (result == nullptr) throwOpensslError();
+  KJ_ON_SCOPE_FAILURE(EVP_PKEY_free(result));
+
+  switch (EVP_PKEY_base_id(pkey)) {
+    case EVP_PKEY_RSA: {
+      RSA* original = EVP_PKEY_get1_RSA(pkey);
+      if (original == nullptr) throwOpensslError();
+      RSA* rsa = RSAPrivateKey_dup(original);
+      RSA_free(original);
+      if (rsa == nullptr) throwOpensslError();
+      if (!RSA_set_method(rsa, getOffloadedRsaMethod()) || !EVP_PKEY_assign_RSA(result, rsa)) {
+        RSA_free(rsa);
+        throwOpensslError();
+      }
+      return result;
+    }
+    case EVP_PKEY_EC: {
+      EC_KEY* original = EVP_PKEY_get1_EC_KEY(pkey);
+      if (original == nullptr) throwOpensslError();
+      EC_KEY* key = EC_KEY_dup(original);
+      EC_KEY_free(original);
+      if (key == nullptr) throwOpensslError();
+      if (!EC_KEY_set_method(key, getOffloadedEcMethod()) ||
+          !EVP_PKEY_assign_EC_KEY(result, key)) {
+        EC_KEY_free(key);
+        throwOpensslError();
+      }
+      return result;
+    }
+    default:
+      EVP_PKEY_free(result);
+      EVP_PKEY_up_ref(pkey);
+      return pkey;
+  }
+}
+
+#else  // KJ_TLS_ASYNC_KEYS
+
+EVP_PKEY* newOffloadedKey(EVP_PKEY* pkey) {
+  EVP_PKEY_up_ref(pkey);
+  return pkey;
+}
+
+#endif  // KJ_TLS_ASYNC_KEYS, else
+
 // =======================================================================================
 // Implementation of kj::AsyncIoStream that applies TLS on top of some other AsyncIoStream.
 //
@@ -158,7 +526,80 @@ public:
     return sslCall([this]() { return SSL_accept(ssl); }).ignoreResult();
   }
 
+  SSL* getSsl() { return ssl; }
+
+  void offloadKeyOperations(const kj::ThreadPool& pool, kj::Maybe<TlsSessionStats&> stats) {
+    // Run the handshake in OpenSSL async jobs, so that our key's methods can hand its private key
+    // operations to `pool`. See newOffloadedKey().
+
+#if KJ_TLS_ASYNC_KEYS
+    if (ASYNC_is_capable()) {
+      keyOffload.emplace(pool, stats);
+      SSL_set_mode(ssl, SSL_MODE_ASYNC);
+    }
+#endif
+  }
+
+  void finishKeyOffload() {
+    // Called once the handshake has completed. Async jobs cost a context switch per call, so
+    // reads and writes shouldn't use them.
+
+#if KJ_TLS_ASYNC_KEYS
+    if (keyOffload != nullptr) {
+      SSL_clear_mode(ssl, SSL_MODE_ASYNC);
+      keyOffload = nullptr;
+    }
+#endif
+  }
+
+  kj::Promise<bool> tryOffloadWritesToKernel() {
+    // Called once the handshake has completed, before anything else uses the connection. Hands
+    // encryption of outgoing records to the kernel if possible, returning whether it did.
+
+#if KJ_TLS_KERNEL_OFFLOAD
+    // The tail of our handshake may still be sitting in the write buffer. It must reach the
+    // socket before the kernel starts framing records.
+    return writeBuffer.flush().then([this]() {
+      KernelCryptoInfo info;
+      KJ_DEFER(OPENSSL_cleanse(&info, sizeof(info)));
+
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        KJ_IF_MAYBE(size, getKernelTxCryptoInfo(ssl, info)) {
+          // Either call fails harmlessly if the stream isn't a TCP socket or the kernel lacks
+          // kTLS: a socket with the TLS ULP but no keys installed still behaves like plain TCP.
+          inner.setsockopt(IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls"));
+          inner.setsockopt(SOL_TLS, TLS_TX, &info, *size);
+          writesOffloaded = true;
+        }
+      })) {
+        // Stay in userspace.
+      }
+
+#ifdef SSL_OP_NO_RENEGOTIATION
+      if (writesOffloaded) {
+        // OpenSSL no longer knows our write sequence number, so it must never write a record
+        // again. Renegotiation is the only thing that would make it want to mid-stream.
+        SSL_set_options(ssl, SSL_OP_NO_RENEGOTIATION);
+      }
+#endif
+      return writesOffloaded;
+    });
+#else
+    return false;
+#endif
+  }
+
   ~TlsConnection() noexcept(false) {
+    // SSL_free() frees any job paused on a key operation. The operation owns its inputs, so it
+    // can finish on its worker; its result is discarded.
+    keyOffload = nullptr;
+
+    if (!broken) {
+      // OpenSSL assumes a connection dropped without a close_notify went wrong and makes its
+      // session unresumable. Dropping a healthy connection is normal for us (and close_notify
+      // can't be sent at all once writes are offloaded), so only do that after actual errors.
+      SSL_set_shutdown(ssl, SSL_get_shutdown(ssl) | SSL_SENT_SHUTDOWN);
+    }
     SSL_free(ssl);
   }
 
@@ -167,16 +608,33 @@ public:
   }
 
   Promise<void> write(const void* buffer, size_t size) override {
+    if (writesOffloaded) return inner.write(buffer, size);
     return writeInternal(kj::arrayPtr(reinterpret_cast<const byte*>(buffer), size), nullptr);
   }
 
   Promise<void> write(ArrayPtr<const ArrayPtr<const byte>> pieces) override {
+    if (writesOffloaded) return inner.write(pieces);
     return writeInternal(pieces[0], pieces.slice(1, pieces.size()));
   }
 
+  Maybe<Promise<uint64_t>> tryPumpFrom(
+      AsyncInputStream& input, uint64_t amount = kj::maxValue) override {
+    // With the kernel doing the encryption, the socket's own optimized pumps (e.g. sendfile())
+    // produce correct records.
+    if (writesOffloaded) return inner.tryPumpFrom(input, amount);
+    return nullptr;
+  }
+
   void shutdownWrite() override {
     KJ_REQUIRE(shutdownTask == nullptr, "already called shutdownWrite()");
 
+    if (writesOffloaded) {
+      // We can't produce a close_notify alert without the kernel's sequence number.
+      shutdownTask = kj::Promise<void>(kj::READY_NOW);
+      inner.shutdownWrite();
+      return;
+    }
+
     // TODO(soon): shutdownWrite() is problematic because it doesn't return a promise. It was
     //   designed to assume that it would only be called after all writes are finished and that
     //   there was no reason to block at that point, but SSL sessions don't fit this since they
@@ -208,53 +666,126 @@ public:
     inner.getpeername(addr, length);
   }
 
+  kj::Maybe<kj::StringPtr> getNegotiatedProtocol() override {
+    if (negotiatedProtocol == nullptr) {
+      const byte* data;
+      uint size;
+      SSL_get0_alpn_selected(ssl, &data, &size);
+      if (size == 0) return nullptr;
+      negotiatedProtocol = kj::heapString(reinterpret_cast<const char*>(data), size);
+    }
+    return kj::StringPtr(negotiatedProtocol);
+  }
+
 private:
   SSL* ssl;
   kj::AsyncIoStream& inner;
   kj::Own<kj::AsyncIoStream> ownInner;
 
   bool disconnected = false;
+  bool broken = false;
+  bool writesOffloaded = false;
+  kj::String negotiatedProtocol;
+  // Filled in on the first call to getNegotiatedProtocol(), once the handshake has finished.
   kj::Maybe<kj::Promise<void>> shutdownTask;
+  kj::Maybe<KeyOffload> keyOffload;
 
   ReadyInputStreamWrapper readBuffer;
   ReadyOutputStreamWrapper writeBuffer;
 
   kj::Promise<size_t> tryReadInternal(
       void* buffer, size_t minBytes, size_t maxBytes, size_t alreadyDone) {
-    if (disconnected) return alreadyDone;
-
-    return sslCall([this,buffer,maxBytes]() { return SSL_read(ssl, buffer, maxBytes); })
-        .then([this,buffer,minBytes,maxBytes,alreadyDone](size_t n) -> kj::Promise<size_t> {
-      if (n >= minBytes) {
-        return alreadyDone + n;
-      } else {
-        return tryReadInternal(reinterpret_cast<byte*>(buffer) + n,
-                               minBytes - n, maxBytes - n, alreadyDone + n);
+    // Decrypt whatever is already buffered without going back to the event loop between records.
+    byte* pos = reinterpret_cast<byte*>(buffer);
+    do {
+      if (disconnected) return alreadyDone;
+
+      ssize_t n = SSL_read(ssl, pos, maxBytes);
+      if (n <= 0) {
+        return sslResult(n, [this,pos,maxBytes]() { return SSL_read(ssl, pos, maxBytes); })
+            .then([this,pos,minBytes,maxBytes,alreadyDone](size_t n) -> kj::Promise<size_t> {
+          if (n >= minBytes) {
+            return alreadyDone + n;
+          } else {
+            return tryReadInternal(pos + n, minBytes - n, maxBytes - n, alreadyDone + n);
+          }
+        });
       }
-    });
+
+      pos += n;
+      alreadyDone += n;
+      maxBytes -= n;
+      minBytes -= kj::min(minBytes, size_t(n));
+    } while (maxBytes > 0 && (minBytes > 0 || SSL_pending(ssl) > 0));
+
+    return alreadyDone;
   }
 
   Promise<void> writeInternal(kj::ArrayPtr<const byte> first,
                               kj::ArrayPtr<const kj::ArrayPtr<const byte>> rest) {
     KJ_REQUIRE(shutdownTask == nullptr, "already called shutdownWrite()");
 
-    return sslCall([this,first]() { return SSL_write(ssl, first.begin(), first.size()); })
-        .then([this,first,rest](size_t n) -> kj::Promise<void> {
-      if (n < first.size()) {
-        return writeInternal(first.slice(n, first.size()), rest);
-      } else if (rest.size() > 0) {
-        return writeInternal(rest[0], rest.slice(1, rest.size()));
-      } else {
-        return kj::READY_NOW;
+    // Encrypt as much as the write buffer will take right away, so that the records for all of the
+    // pieces reach the underlying stream in one write.
+    for (;;) {
+      if (first.size() == 0) {
+        if (rest.size() == 0) return kj::READY_NOW;
+        first = rest[0];
+        rest = rest.slice(1, rest.size());
+        continue;
+      }
+
+      if (disconnected) break;
+
+      ssize_t n = SSL_write(ssl, first.begin(), first.size());
+      if (n <= 0) {
+        return sslResult(n, [this,first]() { return SSL_write(ssl, first.begin(), first.size()); })
+            .then([this,first,rest](size_t n) {
+          return continueWrite(n, first, rest);
+        });
       }
+
+      first = first.slice(n, first.size());
+    }
+
+    return sslCall([this,first]() { return SSL_write(ssl, first.begin(), first.size()); })
+        .then([this,first,rest](size_t n) {
+      return continueWrite(n, first, rest);
     });
   }
 
+  Promise<void> continueWrite(size_t n, kj::ArrayPtr<const byte> first,
+                              kj::ArrayPtr<const kj::ArrayPtr<const byte>> rest) {
+    if (n == 0) {
+      // The peer has closed the connection (sslCall() returned 0). Retrying would spin forever.
+      return KJ_EXCEPTION(DISCONNECTED, "TLS connection closed by peer during write");
+    }
+    return writeInternal(first.slice(n, first.size()), rest);
+  }
+
   template <typename Func>
   kj::Promise<size_t> sslCall(Func&& func) {
     if (disconnected) return size_t(0);
 
-    ssize_t result = func();
+#if KJ_TLS_ASYNC_KEYS
+    KJ_IF_MAYBE(offload, keyOffload) {
+      ssize_t result;
+      {
+        currentKeyOffload = offload;
+        KJ_DEFER(currentKeyOffload = nullptr);
+        result = func();
+      }
+      return sslResult(result, kj::fwd<Func>(func));
+    }
+#endif
+
+    return sslResult(func(), kj::fwd<Func>(func));
+  }
+
+  template <typename Func>
+  kj::Promise<size_t> sslResult(ssize_t result, Func&& func) {
+    // Handles the result of an OpenSSL call which has just been made; `func` repeats the call if
+    // it must be retried once the underlying stream is ready.
 
     if (result > 0) {
       return result;
@@ -270,7 +801,25 @@ private:
         case SSL_ERROR_WANT_WRITE:
           return writeBuffer.whenReady().then(kj::mvCapture(func,
               [this](Func&& func) mutable { return sslCall(kj::fwd<Func>(func)); }));
+#if KJ_TLS_ASYNC_KEYS
+        case SSL_ERROR_WANT_ASYNC:
+          // The job is paused on a private key operation; carry on once it's done.
+          KJ_IF_MAYBE(offload, keyOffload) {
+            KJ_IF_MAYBE(pending, offload->pending) {
+              auto promise = kj::mv(*pending);
+              offload->pending = nullptr;
+              return promise.then(kj::mvCapture(func,
+                  [this](Func&& func) mutable { return sslCall(kj::fwd<Func>(func)); }));
+            }
+          }
+          KJ_FAIL_ASSERT("TLS handshake paused by something other than a key operation");
+        case SSL_ERROR_WANT_ASYNC_JOB:
+          // OpenSSL's pool of jobs is exhausted; try again after other connections have had a go.
+          return kj::evalLater(kj::mvCapture(func,
+              [this](Func&& func) mutable { return sslCall(kj::fwd<Func>(func)); }));
+#endif
         case SSL_ERROR_SSL:
+          broken = true;
           throwOpensslError();
         case SSL_ERROR_SYSCALL:
           if (result == 0) {
@@ -280,9 +829,11 @@ private:
             // According to documentation we shouldn't get here, because our BIO never returns an
             // "error". But in practice we do get here sometimes when the peer disconnects
             // prematurely.
+            broken = true;
             KJ_FAIL_ASSERT("TLS protocol error");
           }
         default:
+          broken = true;
           KJ_FAIL_ASSERT("unexpected SSL error code", error);
       }
     }
@@ -301,8 +852,13 @@ private:
 
   static int bioWrite(BIO* b, const char* in, int inl) {
     BIO_clear_retry_flags(b);
-    KJ_IF_MAYBE(n, reinterpret_cast<TlsConnection*>(BIO_get_data(b))->writeBuffer
-        .write(kj::arrayPtr(in, inl).asBytes())) {
+    auto& self = *reinterpret_cast<TlsConnection*>(BIO_get_data(b));
+    if (self.writesOffloaded) {
+      // Anything OpenSSL writes now (e.g. an alert while failing a read) would be encrypted with
+      // stale state and corrupt the kernel's stream, so drop it.
+      return inl;
+    }
+    KJ_IF_MAYBE(n, self.writeBuffer.write(kj::arrayPtr(in, inl).asBytes())) {
       return *n;
     } else {
       BIO_set_retry_write(b);
@@ -419,6 +975,10 @@ public:
     return tls.wrapPort(inner->listen());
   }
 
+  Own<ConnectionReceiver> listenReusePort(uint steeringGroupSize) override {
+    return tls.wrapPort(inner->listenReusePort(steeringGroupSize));
+  }
+
   Own<NetworkAddress> clone() override {
     return kj::heap<TlsNetworkAddress>(tls, kj::str(hostname), inner->clone());
   }
@@ -473,6 +1033,32 @@ private:
   kj::Own<kj::Network> ownInner;
 };
 
+kj::Promise<kj::Own<kj::AsyncIoStream>> finishHandshake(
+    kj::Promise<void> handshake, kj::Own<TlsConnection> conn,
+    bool kernelTls, kj::Maybe<TlsSessionStats&> stats) {
+  auto& connRef = *conn;
+  return handshake.then([&connRef,kernelTls,stats]() -> kj::Promise<void> {
+    connRef.finishKeyOffload();
+
+    KJ_IF_MAYBE(s, stats) {
+      if (SSL_session_reused(connRef.getSsl())) {
+        ++s->resumedHandshakes;
+      } else {
+        ++s->fullHandshakes;
+      }
+    }
+
+    if (!kernelTls) return kj::READY_NOW;
+    return connRef.tryOffloadWritesToKernel().then([stats](bool offloaded) {
+      KJ_IF_MAYBE(s, stats) {
+        if (offloaded) ++s->kernelOffloads;
+      }
+    });
+  }).then(kj::mvCapture(conn, [](kj::Own<TlsConnection> conn) -> kj::Own<kj::AsyncIoStream> {
+    return kj::mv(conn);
+  }));
+}
+
 }  // namespace
 
 // =======================================================================================
@@ -482,7 +1068,12 @@ TlsContext::Options::Options()
     : useSystemTrustStore(true),
       verifyClients(false),
       minVersion(TlsVersion::TLS_1_0),
-      cipherList("ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-AES128-SHA256:ECDHE-RSA-AES128-SHA256:ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES256-SHA384:ECDHE-RSA-AES128-SHA:ECDHE-ECDSA-AES256-SHA384:ECDHE-ECDSA-AES256-SHA:ECDHE-RSA-AES256-SHA:ECDHE-ECDSA-DES-CBC3-SHA:ECDHE-RSA-DES-CBC3-SHA:AES128-GCM-SHA256:AES256-GCM-SHA384:AES128-SHA256:AES256-SHA256:AES128-SHA:AES256-SHA:DES-CBC3-SHA:!DSS") {}
+      cipherList("ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-AES128-SHA256:ECDHE-RSA-AES128-SHA256:ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES256-SHA384:ECDHE-RSA-AES128-SHA:ECDHE-ECDSA-AES256-SHA384:ECDHE-ECDSA-AES256-SHA:ECDHE-RSA-AES256-SHA:ECDHE-ECDSA-DES-CBC3-SHA:ECDHE-RSA-DES-CBC3-SHA:AES128-GCM-SHA256:AES256-GCM-SHA384:AES128-SHA256:AES256-SHA256:AES128-SHA:AES256-SHA:DES-CBC3-SHA:!DSS"),
+      sessionCacheSize(SSL_SESSION_CACHE_MAX_SIZE_DEFAULT),
+      sessionTimeout(5 * kj::MINUTES),
+      useSessionTickets(true),
+      clientSessionCacheSize(256),
+      kernelTls(false) {}
 // Cipher list is Mozilla's "intermediate" list, except with classic DH removed since we don't
 // currently support setting dhparams. See:
 //     https://mozilla.github.io/server-side-tls/ssl-config-generator/
@@ -497,7 +1088,103 @@ struct TlsContext::SniCallback {
   static int callback(SSL* ssl, int* ad, void* arg);
 };
 
-TlsContext::TlsContext(Options options) {
+struct TlsContext::ClientSessionCache {
+  // The most recent session negotiated with each server hostname, so that wrapClient() can offer
+  // it again. OpenSSL's own cache is keyed by session ID, which a client doesn't know until the
+  // server has answered, so we keep our own. Sessions arrive through newSessionCallback() on
+  // whichever thread is driving the connection, hence the lock.
+
+  struct Entry {
+    SSL_SESSION* session;
+    uint64_t lastUsed;
+  };
+
+  struct State {
+    kj::HashMap<kj::String, Entry> sessions;
+    uint64_t clock = 0;
+  };
+
+  uint maxSize;
+  kj::MutexGuarded<State> state;
+
+  explicit ClientSessionCache(uint maxSize): maxSize(maxSize) {}
+  ~ClientSessionCache() noexcept(false) {
+    for (auto& entry: state.getWithoutLock().sessions) {
+      SSL_SESSION_free(entry.value.session);
+    }
+  }
+
+  void resume(SSL* ssl, kj::StringPtr hostname) {
+    // Offer the cached session for `hostname`, if any, on the not-yet-connected `ssl`.
+
+    auto lock = state.lockExclusive();
+    KJ_IF_MAYBE(entry, lock->sessions.find(hostname)) {
+      entry->lastUsed = ++lock->clock;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(OPENSSL_IS_BORINGSSL)
+      // A connection using the session failed since we cached it.
+      if (!SSL_SESSION_is_resumable(entry->session)) return;
+#endif
+      if (!SSL_set_session(ssl, entry->session)) {
+        throwOpensslError();
+      }
+    }
+  }
+
+  void add(kj::StringPtr hostname, SSL_SESSION* session) {
+    // Takes ownership of `session`.
+
+    auto lock = state.lockExclusive();
+    uint64_t now = ++lock->clock;
+    KJ_IF_MAYBE(entry, lock->sessions.find(hostname)) {
+      SSL_SESSION_free(entry->session);
+      entry->session = session;
+      entry->lastUsed = now;
+      return;
+    }
+
+    if (lock->sessions.size() >= maxSize) {
+      // Evict the least-recently-used host. A linear scan is fine: this only happens when a new
+      // host shows up while the cache is full, which is dwarfed by the handshake itself.
+      kj::StringPtr oldest;
+      uint64_t oldestTime = kj::maxValue;
+      for (auto& entry: lock->sessions) {
+        if (entry.value.lastUsed < oldestTime) {
+          oldest = entry.key;
+          oldestTime = entry.value.lastUsed;
+        }
+      }
+      KJ_IF_MAYBE(entry, lock->sessions.find(oldest)) {
+        SSL_SESSION_free(entry->session);
+      }
+      lock->sessions.erase(oldest);
+    }
+
+    lock->sessions.insert(kj::heapString(hostname), Entry { session, now });
+  }
+
+  static int newSessionCallback(SSL* ssl, SSL_SESSION* session) {
+    // Installed with SSL_CTX_sess_set_new_cb(). Returning 1 tells OpenSSL we kept the reference.
+
+    if (SSL_is_server(ssl)) return 0;
+
+    const char* hostname = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (hostname == nullptr) return 0;
+
+    auto& cache = *reinterpret_cast<ClientSessionCache*>(
+        SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      cache.add(hostname, session);
+    })) {
+      KJ_LOG(ERROR, "exception when caching TLS session", *exception);
+      return 0;
+    }
+    return 1;
+  }
+};
+
+TlsContext::TlsContext(Options options)
+    : kernelTls(options.kernelTls), sessionStats(options.sessionStats),
+      privateKeyThreadPool(options.privateKeyThreadPool) {
   ensureOpenSslInitialized();
 
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L || defined(OPENSSL_IS_BORINGSSL)
@@ -549,8 +1236,56 @@ TlsContext::TlsContext(Options options) {
   if (options.minVersion > TlsVersion::TLS_1_2) {
     optionFlags |= SSL_OP_NO_TLSv1_2;
   }
+  // honor options.useSessionTickets
+  if (!options.useSessionTickets) {
+    optionFlags |= SSL_OP_NO_TICKET;
+  }
   SSL_CTX_set_options(ctx, optionFlags);  // note: never fails; returns new options bitmask
 
+  // Resumed sessions skip certificate verification, so OpenSSL refuses to resume when verifying
+  // peers unless sessions are tagged with the context that verified them.
+  static const char SESSION_ID_CONTEXT[] = "kj::TlsContext";
+  if (!SSL_CTX_set_session_id_context(ctx,
+      reinterpret_cast<const byte*>(SESSION_ID_CONTEXT), sizeof(SESSION_ID_CONTEXT) - 1)) {
+    throwOpensslError();
+  }
+
+  // honor options.sessionCacheSize and options.clientSessionCacheSize
+  long cacheMode = SSL_SESS_CACHE_OFF;
+  if (options.sessionCacheSize > 0) {
+    cacheMode |= SSL_SESS_CACHE_SERVER;
+    SSL_CTX_sess_set_cache_size(ctx, options.sessionCacheSize);
+  } else {
+    // Still let the new-session callback below see client sessions.
+    cacheMode |= SSL_SESS_CACHE_NO_INTERNAL_STORE;
+  }
+  if (options.clientSessionCacheSize > 0) {
+    cacheMode |= SSL_SESS_CACHE_CLIENT;
+    clientSessions = kj::heap<ClientSessionCache>(options.clientSessionCacheSize);
+    SSL_CTX_set_app_data(ctx, clientSessions.get());
+    SSL_CTX_sess_set_new_cb(ctx, &ClientSessionCache::newSessionCallback);
+  }
+  SSL_CTX_set_session_cache_mode(ctx, cacheMode);
+
+  // honor options.sessionTimeout
+  SSL_CTX_set_timeout(ctx, options.sessionTimeout / kj::SECONDS);
+
+  // honor options.sessionTicketKey
+  if (options.sessionTicketKey.size() > 0) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    constexpr size_t TICKET_KEY_SIZE = 80;
+#else
+    constexpr size_t TICKET_KEY_SIZE = 48;
+#endif
+    KJ_REQUIRE(options.sessionTicketKey.size() == TICKET_KEY_SIZE,
+        "sessionTicketKey has the wrong size", TICKET_KEY_SIZE);
+    if (SSL_CTX_set_tlsext_ticket_keys(ctx,
+        const_cast<byte*>(options.sessionTicketKey.begin()),
+        options.sessionTicketKey.size()) <= 0) {
+      throwOpensslError();
+    }
+  }
+
   // honor options.cipherList
   if (!SSL_CTX_set_cipher_list(ctx, options.cipherList.cStr())) {
     throwOpensslError();
@@ -558,7 +1293,15 @@ TlsContext::TlsContext(Options options) {
 
   // honor options.defaultKeypair
   KJ_IF_MAYBE(kp, options.defaultKeypair) {
-    if (!SSL_CTX_use_PrivateKey(ctx, reinterpret_cast<EVP_PKEY*>(kp->privateKey.pkey))) {
+    EVP_PKEY* pkey = reinterpret_cast<EVP_PKEY*>(kp->privateKey.pkey);
+    if (options.privateKeyThreadPool != nullptr) {
+      pkey = newOffloadedKey(pkey);
+    } else {
+      EVP_PKEY_up_ref(pkey);
+    }
+    KJ_DEFER(EVP_PKEY_free(pkey));
+
+    if (!SSL_CTX_use_PrivateKey(ctx, pkey)) {
       throwOpensslError();
     }
 
@@ -585,9 +1328,48 @@ TlsContext::TlsContext(Options options) {
     SSL_CTX_set_tlsext_servername_arg(ctx, sni);
   }
 
+  // honor options.alpnProtocols
+  if (options.alpnProtocols.size() > 0) {
+    kj::Vector<byte> wire;
+    for (auto& protocol: options.alpnProtocols) {
+      KJ_REQUIRE(protocol.size() > 0 && protocol.size() < 256,
+          "invalid ALPN protocol name", protocol);
+      wire.add(protocol.size());
+      wire.addAll(protocol.asBytes());
+    }
+    alpnProtocols = wire.releaseAsArray();
+
+    // Offered when acting as a client. (Unusually, this returns zero on success.)
+    if (SSL_CTX_set_alpn_protos(ctx, alpnProtocols.begin(), alpnProtocols.size()) != 0) {
+      throwOpensslError();
+    }
+
+    // Selected from when acting as a server.
+    SSL_CTX_set_alpn_select_cb(ctx, reinterpret_cast<SSL_CTX_alpn_select_cb_func>(
+        &alpnSelectCallback), this);
+  }
+
   this->ctx = ctx;
 }
 
+int TlsContext::alpnSelectCallback(void* ssl, const byte** out, byte* outlen,
+                                   const byte* in, uint inlen, void* arg) {
+  auto& context = *reinterpret_cast<TlsContext*>(arg);
+
+  // SSL_select_next_proto() takes the first protocol in its first list which is also in the
+  // second, so passing ours first gives our preference priority.
+  byte* selected;
+  if (SSL_select_next_proto(&selected, outlen,
+          context.alpnProtocols.begin(), context.alpnProtocols.size(), in, inlen) ==
+      OPENSSL_NPN_NEGOTIATED) {
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+  } else {
+    // No protocol in common. Carry on without one, as if the client hadn't offered any.
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+}
+
 int TlsContext::SniCallback::callback(SSL* ssl, int* ad, void* arg) {
   // The third parameter is actually type TlsSniCallback*.
 
@@ -597,7 +1379,19 @@ int TlsContext::SniCallback::callback(SSL* ssl, int* ad, void* arg) {
     const char* name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
     if (name != nullptr) {
       KJ_IF_MAYBE(kp, sni.getKey(name)) {
-        if (!SSL_use_PrivateKey(ssl, reinterpret_cast<EVP_PKEY*>(kp->privateKey.pkey))) {
+        EVP_PKEY* pkey = reinterpret_cast<EVP_PKEY*>(kp->privateKey.pkey);
+#if KJ_TLS_ASYNC_KEYS
+        if (SSL_get_mode(ssl) & SSL_MODE_ASYNC) {
+          pkey = newOffloadedKey(pkey);
+        } else {
+          EVP_PKEY_up_ref(pkey);
+        }
+#else
+        EVP_PKEY_up_ref(pkey);
+#endif
+        KJ_DEFER(EVP_PKEY_free(pkey));
+
+        if (!SSL_use_PrivateKey(ssl, pkey)) {
           throwOpensslError();
         }
 
@@ -632,26 +1426,32 @@ int TlsContext::SniCallback::callback(SSL* ssl, int* ad, void* arg) {
 }
 
 TlsContext::~TlsContext() noexcept(false) {
+  // Connections hold their own reference to the SSL_CTX and may outlive us, so make sure they
+  // stop feeding the client session cache we're about to destroy.
+  SSL_CTX_sess_set_new_cb(reinterpret_cast<SSL_CTX*>(ctx), nullptr);
   SSL_CTX_free(reinterpret_cast<SSL_CTX*>(ctx));
 }
 
 kj::Promise<kj::Own<kj::AsyncIoStream>> TlsContext::wrapClient(
     kj::Own<kj::AsyncIoStream> stream, kj::StringPtr expectedServerHostname) {
   auto conn = kj::heap<TlsConnection>(kj::mv(stream), reinterpret_cast<SSL_CTX*>(ctx));
+  KJ_IF_MAYBE(pool, privateKeyThreadPool) {
+    conn->offloadKeyOperations(*pool, sessionStats);
+  }
+  if (clientSessions.get() != nullptr) {
+    clientSessions->resume(conn->getSsl(), expectedServerHostname);
+  }
   auto promise = conn->connect(expectedServerHostname);
-  return promise.then(kj::mvCapture(conn, [](kj::Own<TlsConnection> conn)
-      -> kj::Own<kj::AsyncIoStream> {
-    return kj::mv(conn);
-  }));
+  return finishHandshake(kj::mv(promise), kj::mv(conn), kernelTls, sessionStats);
 }
 
 kj::Promise<kj::Own<kj::AsyncIoStream>> TlsContext::wrapServer(kj::Own<kj::AsyncIoStream> stream) {
   auto conn = kj::heap<TlsConnection>(kj::mv(stream), reinterpret_cast<SSL_CTX*>(ctx));
+  KJ_IF_MAYBE(pool, privateKeyThreadPool) {
+    conn->offloadKeyOperations(*pool, sessionStats);
+  }
   auto promise = conn->accept();
-  return promise.then(kj::mvCapture(conn, [](kj::Own<TlsConnection> conn)
-      -> kj::Own<kj::AsyncIoStream> {
-    return kj::mv(conn);
-  }));
+  return finishHandshake(kj::mv(promise), kj::mv(conn), kernelTls, sessionStats);
 }
 
 kj::Own<kj::ConnectionReceiver> TlsContext::wrapPort(kj::Own<kj::ConnectionReceiver> port) {
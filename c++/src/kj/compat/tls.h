@@ -37,6 +37,25 @@ class TlsCertificate;
 struct TlsKeypair;
 class TlsSniCallback;
 
+struct TlsSessionStats {
+  // Counters maintained by a TlsContext, if `TlsContext::Options::sessionStats` points at an
+  // instance. The context only ever increments these. They are not synchronized, so only use this
+  // if the context's connections all live on one thread.
+
+  uint64_t fullHandshakes = 0;
+  // Handshakes which negotiated a new session.
+
+  uint64_t resumedHandshakes = 0;
+  // Handshakes which resumed a previous session, either from the server's session cache, from a
+  // session ticket, or (as a client) from the client session cache.
+
+  uint64_t kernelOffloads = 0;
+  // Connections whose outgoing records are encrypted by the kernel (see `Options::kernelTls`).
+
+  uint64_t offloadedKeyOperations = 0;
+  // Private key operations run on `Options::privateKeyThreadPool`.
+};
+
 enum class TlsVersion {
   SSL_3,     // avoid; cryptographically broken
   TLS_1_0,
@@ -90,6 +109,57 @@ public:
     kj::Maybe<TlsSniCallback&> sniCallback;
     // Callback that can be used to choose a different key/certificate based on the specific
     // hostname requested by the client.
+
+    uint sessionCacheSize;
+    // Maximum number of sessions the server side remembers so that clients can resume them with
+    // an abbreviated handshake. Zero disables the server-side cache (session tickets, if enabled,
+    // still allow resumption). Default: 20480.
+
+    kj::Duration sessionTimeout;
+    // How long a session (cached or ticketed) may be resumed after it was established.
+    // Default: 5 minutes.
+
+    bool useSessionTickets;
+    // Whether the server issues RFC 5077 session tickets, which let clients resume without the
+    // server keeping any state. Default: true.
+
+    kj::ArrayPtr<const byte> sessionTicketKey;
+    // Key material used to encrypt session tickets. Must be exactly 80 bytes if non-empty. By
+    // default each TlsContext generates a random key, so tickets are only honored by the context
+    // which issued them; configure the same key on every server in a fleet to let tickets work
+    // across them, and rotate it regularly. Default: none (random).
+
+    uint clientSessionCacheSize;
+    // Maximum number of server hostnames for which the client side remembers the most recent
+    // session, offering it again the next time `wrapClient()` is called with the same hostname.
+    // Zero disables client-side resumption. Default: 256.
+
+    bool kernelTls;
+    // If true, after a handshake completes, try to hand encryption of outgoing records to the
+    // kernel (Linux kTLS). This is best-effort: it only happens when the underlying stream is a
+    // socket, the kernel has the `tls` module, and the connection negotiated TLS 1.2 with an
+    // AES-GCM cipher; otherwise the connection silently stays in userspace. Offloaded writes go
+    // straight to the socket, so pumping a file into the connection can use sendfile(). Reads,
+    // alerts, and shutdown stay in OpenSSL. Since the kernel owns the write sequence numbers, no
+    // close_notify alert is sent on shutdownWrite(); the peer just sees EOF. Default: false.
+
+    kj::Maybe<TlsSessionStats&> sessionStats;
+    // If non-null, handshake statistics are accumulated here. The object must outlive the
+    // context. Default: null.
+
+    kj::ArrayPtr<const kj::StringPtr> alpnProtocols;
+    // Application protocols to negotiate via ALPN (RFC 7301), e.g. {"h2", "http/1.1"}, most
+    // preferred first. A client offers them; a server picks the first of its own that the client
+    // offered, and if there is none, carries on without one. The result is available from the
+    // stream's getNegotiatedProtocol(). The strings need only remain valid until the TlsContext
+    // has been constructed. Default: none (no ALPN).
+
+    kj::Maybe<const kj::ThreadPool&> privateKeyThreadPool;
+    // If non-null, operations with our own private key during a handshake (signing, and RSA key
+    // exchange decryption) run on this pool, and the event loop serves other connections in the
+    // meantime. This uses OpenSSL's async jobs (SSL_MODE_ASYNC) and covers RSA and ECDSA keys,
+    // including those chosen by `sniCallback`; other keys, and builds of OpenSSL without async
+    // job support, are handled inline as usual. The pool must outlive the context. Default: null.
   };
 
   TlsContext(Options options = Options());
@@ -125,6 +195,18 @@ private:
   void* ctx;  // actually type SSL_CTX, but we don't want to #include the OpenSSL headers here
 
   struct SniCallback;
+  struct ClientSessionCache;
+  kj::Own<ClientSessionCache> clientSessions;
+
+  kj::Array<byte> alpnProtocols;
+  // Options::alpnProtocols in wire format: each name preceded by its length.
+
+  static int alpnSelectCallback(void* ssl, const byte** out, byte* outlen,
+                                const byte* in, uint inlen, void* arg);
+
+  bool kernelTls;
+  kj::Maybe<TlsSessionStats&> sessionStats;
+  kj::Maybe<const kj::ThreadPool&> privateKeyThreadPool;
 };
 
 class TlsPrivateKey {
@@ -40,6 +40,12 @@ constexpr auto NOT_SCHEME_CHARS = SCHEME_CHARS.invert();
 
 constexpr auto HOST_CHARS = ALPHAS.orGroup(DIGITS).orAny(".-:[]");  // [] is for ipv6 literals
 
+constexpr auto END_PATH = parse::anyOfChars("?#");
+constexpr auto END_QUERY = parse::anyOfChars("#");
+
+constexpr auto UNRESERVED_CHARS = ALPHAS.orGroup(DIGITS).orAny("-_.!~*'()");
+// Characters which encodeUriComponent() leaves alone.
+
 void toLower(String& text) {
   for (char& c: text) {
     if ('A' <= c && c <= 'Z') {
@@ -82,6 +88,89 @@ ArrayPtr<const char> split(StringPtr& text, const parse::CharGroup_& chars) {
   return result;
 }
 
+void addUriComponent(Vector<char>& chars, StringPtr text) {
+  // Same as chars.addAll(encodeUriComponent(text)), but encodes in place.
+  size_t start = chars.size();
+  chars.resize(start + text.size() * 3);
+  chars.truncate(start + encodeUriComponent(text.asBytes(), chars.slice(start, chars.size())));
+}
+
+Maybe<byte> tryFromHex(char c) {
+  if ('0' <= c && c <= '9') return byte(c - '0');
+  if ('a' <= c && c <= 'f') return byte(c - 'a' + 10);
+  if ('A' <= c && c <= 'F') return byte(c - 'A' + 10);
+  return nullptr;
+}
+
+template <typename Func>
+bool forEachDecoded(ArrayPtr<const char> text, Func&& func) {
+  // Calls func(byte) for each byte of the percent-decoded text, stopping early if it returns false.
+  // Returns false if it did, or if the text has a malformed escape.
+
+  for (size_t i = 0; i < text.size(); i++) {
+    byte b = text[i];
+    if (b == '%') {
+      if (text.size() - i < 3) return false;
+      KJ_IF_MAYBE(high, tryFromHex(text[i + 1])) {
+        KJ_IF_MAYBE(low, tryFromHex(text[i + 2])) {
+          b = (*high << 4) | *low;
+          i += 2;
+        } else {
+          return false;
+        }
+      } else {
+        return false;
+      }
+    }
+    if (!func(b)) return false;
+  }
+  return true;
+}
+
+bool isValidEncoding(ArrayPtr<const char> text) {
+  return forEachDecoded(text, [](byte) { return true; });
+}
+
+bool isCanonicalEncoding(ArrayPtr<const char> text) {
+  // Returns true if `text` is what encodeUriComponent() would make of its decoded form.
+
+  for (size_t i = 0; i < text.size(); i++) {
+    char c = text[i];
+    if (c == '%') {
+      // Only bytes which must be escaped are, and with upper-case hex digits.
+      if (text.size() - i < 3) return false;
+      char high = text[i + 1];
+      char low = text[i + 2];
+      if ('a' <= high || 'a' <= low) return false;
+      KJ_IF_MAYBE(h, tryFromHex(high)) {
+        KJ_IF_MAYBE(l, tryFromHex(low)) {
+          if (UNRESERVED_CHARS.contains((*h << 4) | *l)) return false;
+        } else {
+          return false;
+        }
+      } else {
+        return false;
+      }
+      i += 2;
+    } else if (!UNRESERVED_CHARS.contains(c)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool hasUpperCase(ArrayPtr<const char> text) {
+  for (char c: text) {
+    if ('A' <= c && c <= 'Z') return true;
+  }
+  return false;
+}
+
+bool isDotComponent(ArrayPtr<const char> part) {
+  return (part.size() == 1 && part[0] == '.') ||
+         (part.size() == 2 && part[0] == '.' && part[1] == '.');
+}
+
 String percentDecode(ArrayPtr<const char> text, bool& hadErrors) {
   auto result = decodeUriComponent(text);
   if (result.hadErrors) hadErrors = true;
@@ -365,10 +454,10 @@ String Url::toString(Context context) const {
 
     if (context == REMOTE_HREF) {
       KJ_IF_MAYBE(user, userInfo) {
-        chars.addAll(encodeUriComponent(user->username));
+        addUriComponent(chars, user->username);
         KJ_IF_MAYBE(pass, user->password) {
           chars.add(':');
-          chars.addAll(encodeUriComponent(*pass));
+          addUriComponent(chars, *pass);
         }
         chars.add('@');
       }
@@ -397,7 +486,7 @@ String Url::toString(Context context) const {
       continue;
     }
     chars.add('/');
-    chars.addAll(encodeUriComponent(pathPart));
+    addUriComponent(chars, pathPart);
   }
   if (hasTrailingSlash || (path.size() == 0 && context == HTTP_REQUEST)) {
     chars.add('/');
@@ -407,17 +496,17 @@ String Url::toString(Context context) const {
   for (auto& param: query) {
     chars.add(first ? '?' : '&');
     first = false;
-    chars.addAll(encodeUriComponent(param.name));
+    addUriComponent(chars, param.name);
     if (param.value.size() > 0) {
       chars.add('=');
-      chars.addAll(encodeUriComponent(param.value));
+      addUriComponent(chars, param.value);
     }
   }
 
   if (context == REMOTE_HREF) {
     KJ_IF_MAYBE(f, fragment) {
       chars.add('#');
-      chars.addAll(encodeUriComponent(*f));
+      addUriComponent(chars, *f);
     }
   }
 
@@ -425,4 +514,243 @@ String Url::toString(Context context) const {
   return String(chars.releaseAsArray());
 }
 
+// =======================================================================================
+
+UrlView UrlView::parse(StringPtr text, Url::Context context) {
+  return KJ_REQUIRE_NONNULL(tryParse(text, context), "invalid URL", text);
+}
+
+Maybe<UrlView> UrlView::tryParse(StringPtr text, Url::Context context) {
+  // Follows Url::tryParse(), minus the copying and decoding.
+
+  UrlView result;
+  result.text = text;
+  result.context = context;
+
+  if (context == Url::HTTP_REQUEST) {
+    if (!text.startsWith("/")) {
+      return nullptr;
+    }
+  } else {
+    KJ_IF_MAYBE(scheme, trySplit(text, ':')) {
+      result.scheme = *scheme;
+    } else {
+      // missing scheme
+      return nullptr;
+    }
+    if (result.scheme.size() == 0 ||
+        !ALPHAS.contains(result.scheme[0]) ||
+        !SCHEME_CHARS.containsAll(result.scheme.slice(1, result.scheme.size()))) {
+      // bad scheme
+      return nullptr;
+    }
+
+    if (!text.startsWith("//")) {
+      // We require an authority (hostname) part.
+      return nullptr;
+    }
+    text = text.slice(2);
+
+    auto authority = split(text, END_AUTHORITY);
+
+    KJ_IF_MAYBE(userpass, trySplit(authority, '@')) {
+      if (context != Url::REMOTE_HREF) {
+        // No user/pass allowed here.
+        return nullptr;
+      }
+      if (!isValidEncoding(*userpass)) return nullptr;
+      result.userInfo = *userpass;
+    }
+
+    if (!forEachDecoded(authority, [](byte b) { return HOST_CHARS.contains(b); })) {
+      return nullptr;
+    }
+    result.host = authority;
+  }
+
+  result.path = split(text, END_PATH);
+  if (!isValidEncoding(result.path)) return nullptr;
+
+  if (text.startsWith("?")) {
+    text = text.slice(1);
+    auto query = split(text, END_QUERY);
+    if (!isValidEncoding(query)) return nullptr;
+    result.query = query;
+  }
+
+  if (text.startsWith("#")) {
+    if (context != Url::REMOTE_HREF) {
+      // No fragment allowed here.
+      return nullptr;
+    }
+    auto fragment = text.slice(1);
+    if (!isValidEncoding(fragment)) return nullptr;
+    result.fragment = fragment.asArray();
+  } else {
+    // We should have consumed everything.
+    KJ_ASSERT(text.size() == 0);
+  }
+
+  return result;
+}
+
+Url UrlView::toUrl() const {
+  return Url::parse(text, context);
+}
+
+UrlView::Range<UrlView::PathIterator> UrlView::getPath() const {
+  return { PathIterator(path.begin(), path.end()), PathIterator(path.end(), path.end()) };
+}
+
+UrlView::Range<UrlView::QueryIterator> UrlView::getQuery() const {
+  KJ_IF_MAYBE(q, query) {
+    return { QueryIterator(q->begin(), q->end()), QueryIterator(q->end(), q->end()) };
+  } else {
+    return { QueryIterator(nullptr, nullptr), QueryIterator(nullptr, nullptr) };
+  }
+}
+
+void UrlView::PathIterator::next() {
+  for (;;) {
+    while (pos < end && *pos == '/') ++pos;
+    const char* start = pos;
+    while (pos < end && *pos != '/') ++pos;
+
+    if (pos == start) {
+      current = arrayPtr(end, end);
+      return;
+    } else if (pos - start == 1 && *start == '.') {
+      // Skip "/./", as Url does.
+      continue;
+    }
+
+    current = arrayPtr(start, pos);
+    return;
+  }
+}
+
+void UrlView::QueryIterator::next() {
+  for (;;) {
+    if (pos == end) {
+      current = { arrayPtr(end, end), arrayPtr(end, end) };
+      return;
+    }
+
+    const char* start = pos;
+    const char* equals = nullptr;
+    while (pos < end && *pos != '&') {
+      if (*pos == '=' && equals == nullptr) equals = pos;
+      ++pos;
+    }
+    const char* partEnd = pos;
+    if (pos < end) ++pos;  // skip '&'
+
+    if (partEnd == start) {
+      // Skip empty parameters, as Url does.
+      continue;
+    }
+
+    if (equals == nullptr) {
+      current = { arrayPtr(start, partEnd), arrayPtr(partEnd, partEnd) };
+    } else {
+      current = { arrayPtr(start, equals), arrayPtr(equals + 1, partEnd) };
+    }
+    return;
+  }
+}
+
+bool UrlView::isNormalized() const {
+  if (context != Url::HTTP_REQUEST) {
+    if (hasUpperCase(scheme)) return false;
+    KJ_IF_MAYBE(ui, userInfo) {
+      auto password = *ui;
+      KJ_IF_MAYBE(username, trySplit(password, ':')) {
+        if (!isCanonicalEncoding(*username) || !isCanonicalEncoding(password)) return false;
+      } else {
+        if (!isCanonicalEncoding(password)) return false;
+      }
+    }
+    for (char c: host) {
+      if (c == '%' || ('A' <= c && c <= 'Z')) return false;
+    }
+  }
+
+  if (path.size() > 0) {
+    // Every component must be a name that survives Url's parsing unchanged, except that the last
+    // is empty when there's a trailing slash.
+    auto rest = path.slice(1, path.size());
+    for (;;) {
+      KJ_IF_MAYBE(part, trySplit(rest, '/')) {
+        if (part->size() == 0 || isDotComponent(*part) || !isCanonicalEncoding(*part)) {
+          return false;
+        }
+      } else {
+        if (isDotComponent(rest) || !isCanonicalEncoding(rest)) return false;
+        break;
+      }
+    }
+  }
+
+  KJ_IF_MAYBE(q, query) {
+    // Url drops empty parameters (including a lone '?'), and leaves out the '=' when a value is
+    // empty.
+    if (q->size() == 0) return false;
+    auto rest = *q;
+    for (;;) {
+      ArrayPtr<const char> part;
+      bool last = false;
+      KJ_IF_MAYBE(p, trySplit(rest, '&')) {
+        part = *p;
+      } else {
+        part = rest;
+        last = true;
+      }
+
+      if (part.size() == 0) return false;
+      KJ_IF_MAYBE(name, trySplit(part, '=')) {
+        if (part.size() == 0 || !isCanonicalEncoding(*name) || !isCanonicalEncoding(part)) {
+          return false;
+        }
+      } else {
+        if (!isCanonicalEncoding(part)) return false;
+      }
+
+      if (last) break;
+    }
+  }
+
+  KJ_IF_MAYBE(f, fragment) {
+    if (!isCanonicalEncoding(*f)) return false;
+  }
+
+  return true;
+}
+
+Maybe<StringPtr> UrlView::getRequestTarget() const {
+  if (fragment != nullptr || !isNormalized()) return nullptr;
+
+  if (path.size() == 0) {
+    // Url writes an empty path as "/", which is only in the text if nothing else follows.
+    if (query == nullptr) {
+      return StringPtr("/");
+    } else {
+      return nullptr;
+    }
+  }
+
+  // Without a fragment, the path and query run to the end of the text.
+  return StringPtr(path.begin(), text.end() - path.begin());
+}
+
+String UrlView::decode(ArrayPtr<const char> component) {
+  return decodeUriComponent(component);
+}
+
+bool UrlView::decodesTo(ArrayPtr<const char> component, StringPtr value) {
+  size_t i = 0;
+  return forEachDecoded(component, [&](byte b) {
+    return i < value.size() && byte(value[i++]) == b;
+  }) && i == value.size();
+}
+
 } // namespace kj
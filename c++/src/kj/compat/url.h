@@ -116,4 +116,136 @@ struct Url {
   // Parse a relative URL string with this URL as the base.
 };
 
+struct UrlView {
+  // A URL parsed in place: each component is a slice of the text it was parsed from, still
+  // percent-encoded, so parsing allocates nothing. Decode a component only if and when you need
+  // it. Parsing accepts exactly the URLs that Url::tryParse() accepts, in the same contexts.
+  //
+  // Since the slices are not NUL-terminated, they are ArrayPtrs rather than StringPtrs. Unlike Url,
+  // the scheme and host are not lower-cased, and the path is not resolved.
+  //
+  // This suits code that parses URLs often and mostly looks at them, e.g. an HTTP proxy forwarding
+  // requests or an HttpService routing on the path. Use toUrl() to get a full Url when needed.
+
+  StringPtr text;
+  // The text parsed. Everything below points into it.
+
+  Url::Context context;
+
+  ArrayPtr<const char> scheme;
+  // As written. Empty in the HTTP_REQUEST context.
+
+  Maybe<ArrayPtr<const char>> userInfo;
+  // "username" or "username:password", if present.
+
+  ArrayPtr<const char> host;
+  // Including port, if specified. Empty in the HTTP_REQUEST context.
+
+  ArrayPtr<const char> path;
+  // Everything from the first '/' up to the query or fragment, or empty if there is no path. Use
+  // getPath() to iterate over its components.
+
+  Maybe<ArrayPtr<const char>> query;
+  // The text after '?', up to the fragment, if there is a '?'. Use getQuery() to iterate over its
+  // parameters.
+
+  Maybe<ArrayPtr<const char>> fragment;
+  // The text after '#', if present.
+
+  // ---------------------------------------------------------------------------
+
+  static UrlView parse(StringPtr text, Url::Context context = Url::REMOTE_HREF);
+  static Maybe<UrlView> tryParse(StringPtr text, Url::Context context = Url::REMOTE_HREF);
+  // Parse an absolute URL. `text` must outlive the UrlView.
+
+  Url toUrl() const;
+  // Parses the text again into a Url, which decodes everything and resolves the path.
+
+  class PathIterator;
+  class QueryIterator;
+
+  struct QueryParam {
+    ArrayPtr<const char> name;
+    ArrayPtr<const char> value;
+  };
+
+  template <typename Iterator>
+  class Range {
+  public:
+    inline Range(Iterator begin, Iterator end): b(begin), e(end) {}
+    inline Iterator begin() const { return b; }
+    inline Iterator end() const { return e; }
+
+  private:
+    Iterator b;
+    Iterator e;
+  };
+
+  Range<PathIterator> getPath() const;
+  // Iterates over the components of the path, still percent-encoded. Empty and "." components are
+  // skipped as Url would skip them, but ".." components are returned as they are: they can only
+  // be resolved by looking ahead. A normalized URL (see isNormalized()) has none.
+
+  Range<QueryIterator> getQuery() const;
+  // Iterates over the query parameters, still percent-encoded, skipping empty ones as Url would.
+  // A parameter without '=' has an empty value.
+
+  bool isNormalized() const;
+  // Returns true if the text is exactly what Url::parse(text, context).toString(context) would
+  // produce: the scheme and host are lower-case, the path has no empty, "." or ".." components,
+  // and everything is percent-encoded the way Url encodes it. Such a URL can be forwarded without
+  // re-encoding.
+
+  Maybe<StringPtr> getRequestTarget() const;
+  // If the URL is normalized and has no fragment, returns the part of `text` that
+  // Url::toString(Url::HTTP_REQUEST) would produce, i.e. the path and query, without copying.
+  // Otherwise returns null, and you'll need toUrl().
+
+  static String decode(ArrayPtr<const char> component);
+  // Percent-decodes a component of a UrlView. (The view's escapes were validated by parsing.)
+
+  static bool decodesTo(ArrayPtr<const char> component, StringPtr value);
+  // Returns true if `component` percent-decodes to `value`. Doesn't allocate.
+};
+
+class UrlView::PathIterator {
+public:
+  inline PathIterator(const char* pos, const char* end): pos(pos), end(end) { next(); }
+
+  inline ArrayPtr<const char> operator*() const { return current; }
+  inline PathIterator& operator++() { next(); return *this; }
+  inline bool operator==(const PathIterator& other) const {
+    return current.begin() == other.current.begin();
+  }
+  inline bool operator!=(const PathIterator& other) const { return !(*this == other); }
+
+private:
+  const char* pos;
+  const char* end;
+  ArrayPtr<const char> current;
+
+  void next();
+};
+
+class UrlView::QueryIterator {
+public:
+  inline QueryIterator(const char* pos, const char* end): pos(pos), end(end) { next(); }
+
+  inline const QueryParam& operator*() const { return current; }
+  inline const QueryParam* operator->() const { return &current; }
+  inline QueryIterator& operator++() { next(); return *this; }
+  inline bool operator==(const QueryIterator& other) const {
+    return current.name.begin() == other.current.name.begin();
+  }
+  inline bool operator!=(const QueryIterator& other) const { return !(*this == other); }
+
+private:
+  const char* pos;
+  const char* end;
+  QueryParam current;
+
+  void next();
+};
+
+
 } // namespace kj
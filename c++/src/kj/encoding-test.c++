@@ -22,6 +22,7 @@
 #include "encoding.h"
 #include <kj/test.h>
 #include <stdint.h>
+#include "vector.h"
 
 namespace kj {
 namespace {
@@ -227,6 +228,70 @@ KJ_TEST("round-trip invalid UTF-16") {
   expectRes(encodeUtf16(decodeUtf32(encodeUtf32(decodeUtf16(INVALID)))), INVALID, true);
 }
 
+KJ_TEST("isValidUtf8()") {
+  KJ_EXPECT(isValidUtf8(""));
+  KJ_EXPECT(isValidUtf8(u8"foo"));
+  KJ_EXPECT(isValidUtf8(u8"Здравствуйте"));
+  KJ_EXPECT(isValidUtf8(u8"😺☁☄🐵"));
+  KJ_EXPECT(isValidUtf8("\xc2\x80\xdf\xbf\xe0\xa0\x80\xef\xbf\xbe\xf0\x90\x80\x80\xf4\x8f\xbf\xbf"));
+
+  KJ_EXPECT(!isValidUtf8("f\xbfo"));
+  KJ_EXPECT(!isValidUtf8("\xc2x"));
+  KJ_EXPECT(!isValidUtf8("\xe0\xa0"));
+  KJ_EXPECT(!isValidUtf8("\xf0\x90\x80"));
+  KJ_EXPECT(!isValidUtf8("\xc1\xbf"));
+  KJ_EXPECT(!isValidUtf8("\xe0\x9f\xbf"));
+  KJ_EXPECT(!isValidUtf8("\xf0\x8f\xbf\xbf"));
+  KJ_EXPECT(!isValidUtf8("\xf4\x90\x80\x80"));
+  KJ_EXPECT(!isValidUtf8("\xf5\x80\x80\x80"));
+  KJ_EXPECT(!isValidUtf8("f\xed\xa0\x80"));
+
+  // An error after a long ASCII run, at every offset within a vector.
+  for (size_t i = 0; i < 40; i++) {
+    auto text = heapArray<char>(40);
+    memset(text.begin(), 'a', text.size());
+    KJ_EXPECT(isValidUtf8(text));
+    text[i] = '\xbf';
+    KJ_EXPECT(!isValidUtf8(text), i);
+    KJ_EXPECT(encodeUtf16(text).hadErrors);
+  }
+}
+
+KJ_TEST("Unicode conversions of long text with ASCII runs") {
+  // Long enough to take the bulk ASCII paths, with non-ASCII characters at every offset.
+  auto run = [](char c, size_t n) {
+    auto result = heapString(n);
+    memset(result.begin(), c, n);
+    return result;
+  };
+
+  for (size_t i = 0; i < 40; i++) {
+    auto prefix = run('x', i);
+    auto suffix = run('y', 40 - i);
+    auto text = str(prefix, u8"中", suffix, u8"😺", prefix);
+    KJ_EXPECT(isValidUtf8(text));
+
+    auto utf16 = encodeUtf16(text);
+    KJ_EXPECT(!utf16.hadErrors);
+    KJ_ASSERT(utf16.size() == i + 43);
+    KJ_EXPECT(utf16[i] == u'中');
+    KJ_EXPECT(utf16[41] == 0xd83d);
+    KJ_EXPECT(utf16.back() == (i == 0 ? 0xde3a : u'x'));
+
+    auto utf32 = encodeUtf32(text);
+    KJ_EXPECT(!utf32.hadErrors);
+    KJ_ASSERT(utf32.size() == i + 42);
+    KJ_EXPECT(utf32[41] == U'😺');
+
+    auto back16 = decodeUtf16(utf16);
+    KJ_EXPECT(!back16.hadErrors);
+    KJ_EXPECT(back16 == text);
+    auto back32 = decodeUtf32(utf32);
+    KJ_EXPECT(!back32.hadErrors);
+    KJ_EXPECT(back32 == text);
+  }
+}
+
 KJ_TEST("EncodingResult as a Maybe") {
   KJ_IF_MAYBE(result, encodeUtf16("\x80")) {
     KJ_FAIL_EXPECT("expected failure");
@@ -405,5 +470,122 @@ KJ_TEST("base64 encoding/decoding") {
   }
 }
 
+// =======================================================================================
+// The vectorized encoders against straightforward byte-at-a-time versions, on inputs long enough
+// to take the vector paths and with every length of leftover tail.
+
+String referenceHex(ArrayPtr<const byte> bytes) {
+  static const char DIGITS[] = "0123456789abcdef";
+  Vector<char> result;
+  for (byte b: bytes) {
+    result.add(DIGITS[b / 16]);
+    result.add(DIGITS[b % 16]);
+  }
+  return heapString(result);
+}
+
+String referenceUriComponent(ArrayPtr<const byte> bytes) {
+  static const char DIGITS[] = "0123456789ABCDEF";
+  Vector<char> result;
+  for (byte b: bytes) {
+    if (('A' <= b && b <= 'Z') || ('a' <= b && b <= 'z') || ('0' <= b && b <= '9') ||
+        (strchr("-_.!~*'()", b) != nullptr && b != 0)) {
+      result.add(b);
+    } else {
+      result.add('%');
+      result.add(DIGITS[b / 16]);
+      result.add(DIGITS[b % 16]);
+    }
+  }
+  return heapString(result);
+}
+
+String referenceBase64(ArrayPtr<const byte> bytes, bool breakLines) {
+  static const char CHARS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  Vector<char> chars;
+  for (size_t i = 0; i < bytes.size(); i += 3) {
+    uint bits = bytes[i] << 16;
+    if (i + 1 < bytes.size()) bits |= bytes[i + 1] << 8;
+    if (i + 2 < bytes.size()) bits |= bytes[i + 2];
+    chars.add(CHARS[bits >> 18]);
+    chars.add(CHARS[(bits >> 12) & 63]);
+    chars.add(i + 1 < bytes.size() ? CHARS[(bits >> 6) & 63] : '=');
+    chars.add(i + 2 < bytes.size() ? CHARS[bits & 63] : '=');
+  }
+  if (!breakLines) return heapString(chars);
+
+  Vector<char> result;
+  for (size_t i = 0; i < chars.size(); i += 72) {
+    result.addAll(chars.slice(i, kj::min(i + 72, chars.size())));
+    result.add('\n');
+  }
+  return heapString(result);
+}
+
+KJ_TEST("vectorized encoders match byte-at-a-time encoding") {
+  uint32_t state = 12345;
+  auto random = [&]() {
+    state = state * 1103515245 + 12345;
+    return static_cast<byte>(state >> 16);
+  };
+
+  auto buffer = heapArray<char>(1024);
+  for (size_t size = 0; size < 200; size++) {
+    auto bytes = heapArray<byte>(size);
+    for (auto& b: bytes) b = random();
+    auto mostlySafe = heapArray<byte>(size);
+    for (auto& b: mostlySafe) {
+      b = random() % 64 == 0 ? ' ' : "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ-_.~"[random() % 56];
+    }
+
+    KJ_ASSERT(encodeHex(bytes) == referenceHex(bytes), size);
+    KJ_ASSERT(encodeHex(bytes, buffer) == size * 2);
+    KJ_ASSERT(buffer.slice(0, size * 2) == referenceHex(bytes).asArray());
+
+    for (auto input: { bytes.asPtr(), mostlySafe.asPtr() }) {
+      auto expected = referenceUriComponent(input);
+      KJ_ASSERT(encodeUriComponent(input) == expected, size);
+      KJ_ASSERT(encodeUriComponent(input, buffer) == expected.size());
+      KJ_ASSERT(buffer.slice(0, expected.size()) == expected.asArray());
+      KJ_ASSERT(decodeBinaryUriComponent(expected).asPtr() == input);
+    }
+
+    for (bool breakLines: { false, true }) {
+      auto expected = referenceBase64(bytes, breakLines);
+      KJ_ASSERT(base64EncodedSize(size, breakLines) == expected.size());
+      KJ_ASSERT(encodeBase64(bytes, breakLines) == expected, size, breakLines);
+      KJ_ASSERT(encodeBase64(bytes, buffer, breakLines) == expected.size());
+      KJ_ASSERT(buffer.slice(0, expected.size()) == expected.asArray());
+
+      auto decoded = decodeBase64(expected);
+      KJ_ASSERT(!decoded.hadErrors);
+      KJ_ASSERT(decoded.asPtr() == bytes, size, breakLines);
+    }
+  }
+
+  byte bytes[4] = { 1, 2, 3, 4 };
+  KJ_EXPECT_THROW_MESSAGE("too small", encodeHex(bytes, buffer.slice(0, 7)));
+  KJ_EXPECT_THROW_MESSAGE("too small", encodeBase64(bytes, buffer.slice(0, 7)));
+}
+
+KJ_TEST("base64 decoding falls back to the state machine mid-input") {
+  // The fast path stops at the first group with whitespace or padding; what follows must decode
+  // exactly as before.
+  {
+    auto decoded = decodeBase64("Zm9vYmFy\nYmF6cXV4");
+    KJ_EXPECT(!decoded.hadErrors);
+    KJ_EXPECT(heapString(decoded.asChars()) == "foobarbazqux");
+  }
+  {
+    auto decoded = decodeBase64("Zm9vYmFyYg==");
+    KJ_EXPECT(!decoded.hadErrors);
+    KJ_EXPECT(heapString(decoded.asChars()) == "foobarb");
+  }
+  {
+    auto decoded = decodeBase64("Zm9vYm@yYmF6");
+    KJ_EXPECT(decoded.hadErrors);
+  }
+}
+
 }  // namespace
 }  // namespace kj
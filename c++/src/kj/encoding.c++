@@ -23,6 +23,14 @@
 #include "vector.h"
 #include "debug.h"
 
+#if __SSSE3__
+#include <tmmintrin.h>
+#elif __SSE2__
+#include <emmintrin.h>
+#elif __ARM_NEON && __aarch64__
+#include <arm_neon.h>
+#endif
+
 namespace kj {
 
 namespace {
@@ -40,17 +48,155 @@ inline void addChar32(Vector<char32_t>& vec, char32_t u) {
   vec.add(u);
 }
 
+size_t asciiPrefixLength(const byte* begin, const byte* end) {
+  // Returns the number of bytes at the start of [begin, end) that are plain ASCII. Most text is
+  // mostly ASCII, so the Unicode converters use this to skip ahead in bulk.
+
+  const byte* p = begin;
+#if __SSE2__
+  for (; end - p >= 16; p += 16) {
+    uint mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+    if (mask != 0) return p - begin + __builtin_ctz(mask);
+  }
+#elif __ARM_NEON && __aarch64__
+  for (; end - p >= 16; p += 16) {
+    if (vmaxvq_u8(vld1q_u8(p)) >= 0x80) break;
+  }
+#endif
+  while (p < end && *p < 0x80) ++p;
+  return p - begin;
+}
+
+void widenAscii(const byte* in, size_t n, char16_t* out) {
+  size_t i = 0;
+#if __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  for (; n - i >= 16; i += 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi8(bytes, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 8), _mm_unpackhi_epi8(bytes, zero));
+  }
+#elif __ARM_NEON && __aarch64__
+  for (; n - i >= 16; i += 16) {
+    uint8x16_t bytes = vld1q_u8(in + i);
+    vst1q_u16(reinterpret_cast<uint16_t*>(out + i), vmovl_u8(vget_low_u8(bytes)));
+    vst1q_u16(reinterpret_cast<uint16_t*>(out + i + 8), vmovl_high_u8(bytes));
+  }
+#endif
+  for (; i < n; i++) out[i] = in[i];
+}
+
+void widenAscii(const byte* in, size_t n, char32_t* out) {
+  size_t i = 0;
+#if __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  for (; n - i >= 16; i += 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    __m128i low = _mm_unpacklo_epi8(bytes, zero);
+    __m128i high = _mm_unpackhi_epi8(bytes, zero);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi16(low, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 4), _mm_unpackhi_epi16(low, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 8), _mm_unpacklo_epi16(high, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 12), _mm_unpackhi_epi16(high, zero));
+  }
+#elif __ARM_NEON && __aarch64__
+  for (; n - i >= 16; i += 16) {
+    uint8x16_t bytes = vld1q_u8(in + i);
+    uint16x8_t low = vmovl_u8(vget_low_u8(bytes));
+    uint16x8_t high = vmovl_high_u8(bytes);
+    uint32_t* out32 = reinterpret_cast<uint32_t*>(out + i);
+    vst1q_u32(out32, vmovl_u16(vget_low_u16(low)));
+    vst1q_u32(out32 + 4, vmovl_high_u16(low));
+    vst1q_u32(out32 + 8, vmovl_u16(vget_low_u16(high)));
+    vst1q_u32(out32 + 12, vmovl_high_u16(high));
+  }
+#endif
+  for (; i < n; i++) out[i] = in[i];
+}
+
+size_t narrowAscii(const char16_t* in, size_t n, char* out) {
+  // Copies code units to `out` for as long as they are ASCII. Returns the number copied.
+
+  size_t i = 0;
+#if __SSE2__
+  const __m128i nonAscii = _mm_set1_epi16(static_cast<short>(0xff80));
+  for (; n - i >= 16; i += 16) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 8));
+    __m128i high = _mm_and_si128(_mm_or_si128(a, b), nonAscii);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xffff) break;
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(a, b));
+  }
+#elif __ARM_NEON && __aarch64__
+  for (; n - i >= 16; i += 16) {
+    uint16x8_t a = vld1q_u16(reinterpret_cast<const uint16_t*>(in + i));
+    uint16x8_t b = vld1q_u16(reinterpret_cast<const uint16_t*>(in + i + 8));
+    if (vmaxvq_u16(vorrq_u16(a, b)) >= 0x80) break;
+    vst1q_u8(reinterpret_cast<uint8_t*>(out + i), vcombine_u8(vmovn_u16(a), vmovn_u16(b)));
+  }
+#endif
+  for (; i < n && in[i] < 0x80; i++) out[i] = in[i];
+  return i;
+}
+
+size_t narrowAscii(const char32_t* in, size_t n, char* out) {
+  size_t i = 0;
+#if __SSE2__
+  const __m128i nonAscii = _mm_set1_epi32(static_cast<int>(0xffffff80));
+  for (; n - i >= 16; i += 16) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 4));
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 8));
+    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 12));
+    __m128i high = _mm_and_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)), nonAscii);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(high, _mm_setzero_si128())) != 0xffff) break;
+    // All values are below 0x80 here, so the signed saturation in packs is a no-op.
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+        _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+  }
+#elif __ARM_NEON && __aarch64__
+  for (; n - i >= 16; i += 16) {
+    const uint32_t* in32 = reinterpret_cast<const uint32_t*>(in + i);
+    uint32x4_t a = vld1q_u32(in32);
+    uint32x4_t b = vld1q_u32(in32 + 4);
+    uint32x4_t c = vld1q_u32(in32 + 8);
+    uint32x4_t d = vld1q_u32(in32 + 12);
+    if (vmaxvq_u32(vorrq_u32(vorrq_u32(a, b), vorrq_u32(c, d))) >= 0x80) break;
+    uint16x8_t low = vcombine_u16(vmovn_u32(a), vmovn_u32(b));
+    uint16x8_t high = vcombine_u16(vmovn_u32(c), vmovn_u32(d));
+    vst1q_u8(reinterpret_cast<uint8_t*>(out + i), vcombine_u8(vmovn_u16(low), vmovn_u16(high)));
+  }
+#endif
+  for (; i < n && in[i] < 0x80; i++) out[i] = in[i];
+  return i;
+}
+
+template <typename T>
+inline void addAsciiRun(Vector<char>& result, const T* in, size_t n, size_t& i) {
+  // Appends the run of ASCII code units starting at in[i], advancing `i` past it.
+  size_t pos = result.size();
+  result.resize(pos + (n - i));
+  size_t count = narrowAscii(in + i, n - i, result.begin() + pos);
+  result.truncate(pos + count);
+  i += count;
+}
+
 template <typename T>
 EncodingResult<Array<T>> encodeUtf(ArrayPtr<const char> text, bool nulTerminate) {
   Vector<T> result(text.size() + nulTerminate);
   bool hadErrors = false;
 
+  const byte* bytes = text.asBytes().begin();
   size_t i = 0;
   while (i < text.size()) {
     byte c = text[i++];
     if (c < 0x80) {
-      // 0xxxxxxx -- ASCII
-      result.add(c);
+      // 0xxxxxxx -- ASCII. Copy the whole run at once.
+      size_t n = 1 + asciiPrefixLength(bytes + i, bytes + text.size());
+      size_t pos = result.size();
+      result.resize(pos + n);
+      widenAscii(bytes + i - 1, n, result.begin() + pos);
+      i += n - 1;
       continue;
     } else if (KJ_UNLIKELY(c < 0xc0)) {
       // 10xxxxxx -- malformed continuation byte
@@ -154,12 +300,14 @@ EncodingResult<String> decodeUtf16(ArrayPtr<const char16_t> utf16) {
 
   size_t i = 0;
   while (i < utf16.size()) {
+    if (utf16[i] < 0x80) {
+      addAsciiRun(result, utf16.begin(), utf16.size(), i);
+      continue;
+    }
+
     char16_t u = utf16[i++];
 
-    if (u < 0x80) {
-      result.add(u);
-      continue;
-    } else if (u < 0x0800) {
+    if (u < 0x0800) {
       result.addAll<std::initializer_list<char>>({
         static_cast<char>(((u >>  6)       ) | 0xc0),
         static_cast<char>(((u      ) & 0x3f) | 0x80)
@@ -205,12 +353,14 @@ EncodingResult<String> decodeUtf32(ArrayPtr<const char32_t> utf16) {
 
   size_t i = 0;
   while (i < utf16.size()) {
+    if (utf16[i] < 0x80) {
+      addAsciiRun(result, utf16.begin(), utf16.size(), i);
+      continue;
+    }
+
     char32_t u = utf16[i++];
 
-    if (u < 0x80) {
-      result.add(u);
-      continue;
-    } else if (u < 0x0800) {
+    if (u < 0x0800) {
       result.addAll<std::initializer_list<char>>({
         static_cast<char>(((u >>  6)       ) | 0xc0),
         static_cast<char>(((u      ) & 0x3f) | 0x80)
@@ -247,6 +397,39 @@ EncodingResult<String> decodeUtf32(ArrayPtr<const char32_t> utf16) {
   return { String(result.releaseAsArray()), hadErrors };
 }
 
+bool isValidUtf8(ArrayPtr<const char> text) {
+  const byte* p = text.asBytes().begin();
+  const byte* end = text.asBytes().end();
+
+  while (p < end) {
+    byte c = *p;
+    if (c < 0x80) {
+      p += asciiPrefixLength(p, end);
+    } else if (c < 0xc2) {
+      // Continuation byte without a lead, or overlong 2-byte sequence.
+      return false;
+    } else if (c < 0xe0) {
+      if (end - p < 2 || (p[1] & 0xc0) != 0x80) return false;
+      p += 2;
+    } else if (c < 0xf0) {
+      if (end - p < 3 || (p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80) return false;
+      if (c == 0xe0 && p[1] < 0xa0) return false;   // overlong
+      if (c == 0xed && p[1] >= 0xa0) return false;  // surrogate
+      p += 3;
+    } else if (c < 0xf5) {
+      if (end - p < 4 || (p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80 ||
+          (p[3] & 0xc0) != 0x80) return false;
+      if (c == 0xf0 && p[1] < 0x90) return false;   // overlong
+      if (c == 0xf4 && p[1] >= 0x90) return false;  // beyond U+10FFFF
+      p += 4;
+    } else {
+      return false;
+    }
+  }
+
+  return true;
+}
+
 namespace {
 
 template <typename To, typename From>
@@ -359,10 +542,61 @@ static Maybe<uint> tryFromOctDigit(char c) {
 
 }  // namespace
 
+namespace {
+
+#if __SSE2__
+inline __m128i hexDigits(__m128i nibbles) {
+  __m128i aboveNine = _mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9));
+  return _mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')),
+                      _mm_and_si128(aboveNine, _mm_set1_epi8('a' - '0' - 10)));
+}
+#elif __ARM_NEON && __aarch64__
+inline uint8x16_t hexDigits(uint8x16_t nibbles) {
+  uint8x16_t aboveNine = vcgtq_u8(nibbles, vdupq_n_u8(9));
+  return vaddq_u8(vaddq_u8(nibbles, vdupq_n_u8('0')),
+                  vandq_u8(aboveNine, vdupq_n_u8('a' - '0' - 10)));
+}
+#endif
+
+}  // namespace
+
+size_t encodeHex(ArrayPtr<const byte> input, ArrayPtr<char> output) {
+  KJ_REQUIRE(output.size() >= input.size() * 2, "output buffer too small for hex encoding");
+
+  const byte* in = input.begin();
+  const byte* end = input.end();
+  char* out = output.begin();
+
+#if __SSE2__
+  const __m128i lowNibble = _mm_set1_epi8(0x0f);
+  for (; end - in >= 16; in += 16, out += 32) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+    __m128i high = hexDigits(_mm_and_si128(_mm_srli_epi16(bytes, 4), lowNibble));
+    __m128i low = hexDigits(_mm_and_si128(bytes, lowNibble));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_unpacklo_epi8(high, low));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 16), _mm_unpackhi_epi8(high, low));
+  }
+#elif __ARM_NEON && __aarch64__
+  for (; end - in >= 16; in += 16, out += 32) {
+    uint8x16_t bytes = vld1q_u8(in);
+    uint8x16x2_t digits;
+    digits.val[0] = hexDigits(vshrq_n_u8(bytes, 4));
+    digits.val[1] = hexDigits(vandq_u8(bytes, vdupq_n_u8(0x0f)));
+    vst2q_u8(reinterpret_cast<uint8_t*>(out), digits);
+  }
+#endif
+
+  for (; in < end; ++in) {
+    *out++ = HEX_DIGITS[*in / 16];
+    *out++ = HEX_DIGITS[*in % 16];
+  }
+  return out - output.begin();
+}
+
 String encodeHex(ArrayPtr<const byte> input) {
-  return strArray(KJ_MAP(b, input) {
-    return heapArray<char>({HEX_DIGITS[b/16], HEX_DIGITS[b%16]});
-  }, "");
+  auto result = heapString(input.size() * 2);
+  encodeHex(input, result);
+  return result;
 }
 
 EncodingResult<Array<byte>> decodeHex(ArrayPtr<const char> text) {
@@ -387,21 +621,103 @@ EncodingResult<Array<byte>> decodeHex(ArrayPtr<const char> text) {
   return { kj::mv(result), hadErrors };
 }
 
-String encodeUriComponent(ArrayPtr<const byte> bytes) {
-  Vector<char> result(bytes.size() + 1);
-  for (byte b: bytes) {
-    if (('A' <= b && b <= 'Z') || ('a' <= b && b <= 'z') || ('0' <= b && b <= '9') ||
-        b == '-' || b == '_' || b == '.' || b == '!' || b == '~' || b == '*' || b == '\'' ||
-        b == '(' || b == ')') {
-      result.add(b);
-    } else {
-      result.add('%');
-      result.add(HEX_DIGITS_URI[b/16]);
-      result.add(HEX_DIGITS_URI[b%16]);
+namespace {
+
+inline bool isUriUnreserved(byte b) {
+  return ('A' <= b && b <= 'Z') || ('a' <= b && b <= 'z') || ('0' <= b && b <= '9') ||
+         b == '-' || b == '_' || b == '.' || b == '!' || b == '~' || b == '*' || b == '\'' ||
+         b == '(' || b == ')';
+}
+
+#if __SSE2__
+inline __m128i inRange(__m128i v, char low, char high) {
+  // 0xff for each byte of `v` in [low, high], 0 otherwise. The subtraction wraps, so bytes below
+  // `low` end up above `high - low` just like bytes above `high` do.
+  __m128i offset = _mm_sub_epi8(v, _mm_set1_epi8(low));
+  return _mm_cmpeq_epi8(_mm_subs_epu8(offset, _mm_set1_epi8(high - low)), _mm_setzero_si128());
+}
+
+inline uint uriUnreservedMask(const byte* bytes) {
+  // Vector version of isUriUnreserved() for 16 bytes at once: bit i is set if bytes[i] is
+  // unreserved.
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes));
+  __m128i letters = inRange(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z');
+  __m128i digits = inRange(v, '0', '9');
+  __m128i punctuation = _mm_or_si128(
+      _mm_or_si128(inRange(v, '\'', '*'), inRange(v, '-', '.')),
+      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('!')),
+                                _mm_cmpeq_epi8(v, _mm_set1_epi8('_'))),
+                   _mm_cmpeq_epi8(v, _mm_set1_epi8('~'))));
+  __m128i ok = _mm_or_si128(_mm_or_si128(letters, digits), punctuation);
+  return _mm_movemask_epi8(ok);
+}
+#elif __ARM_NEON && __aarch64__
+inline uint8x16_t inRange(uint8x16_t v, char low, char high) {
+  return vandq_u8(vcgeq_u8(v, vdupq_n_u8(low)), vcleq_u8(v, vdupq_n_u8(high)));
+}
+
+inline bool allUriUnreserved(const byte* bytes) {
+  uint8x16_t v = vld1q_u8(bytes);
+  uint8x16_t letters = inRange(vorrq_u8(v, vdupq_n_u8(0x20)), 'a', 'z');
+  uint8x16_t digits = inRange(v, '0', '9');
+  uint8x16_t punctuation = vorrq_u8(
+      vorrq_u8(inRange(v, '\'', '*'), inRange(v, '-', '.')),
+      vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('!')), vceqq_u8(v, vdupq_n_u8('_'))),
+               vceqq_u8(v, vdupq_n_u8('~'))));
+  uint8x16_t ok = vorrq_u8(vorrq_u8(letters, digits), punctuation);
+  return vminvq_u8(ok) == 0xff;
+}
+#endif
+
+}  // namespace
+
+size_t encodeUriComponent(ArrayPtr<const byte> bytes, ArrayPtr<char> output) {
+  KJ_REQUIRE(output.size() >= bytes.size() * 3, "output buffer too small for URI encoding");
+
+  const byte* in = bytes.begin();
+  const byte* end = bytes.end();
+  char* out = output.begin();
+
+  while (in < end) {
+    const byte* chunkEnd = end - in > 16 ? in + 16 : end;
+    // Runs of characters that need no escaping -- most of a typical URI -- are copied 16 at a time.
+#if __SSE2__
+    if (chunkEnd - in == 16) {
+      // Copy up to the first byte that needs escaping, and leave the rest of the chunk to the loop
+      // below.
+      uint unreserved = uriUnreservedMask(in);
+      uint run = unreserved == 0xffff ? 16 : __builtin_ctz(~unreserved);
+      memcpy(out, in, run);
+      in += run;
+      out += run;
+      if (run == 16) continue;
+    }
+#elif __ARM_NEON && __aarch64__
+    if (chunkEnd - in == 16 && allUriUnreserved(in)) {
+      memcpy(out, in, 16);
+      in += 16;
+      out += 16;
+      continue;
+    }
+#endif
+    for (; in < chunkEnd; ++in) {
+      byte b = *in;
+      if (isUriUnreserved(b)) {
+        *out++ = b;
+      } else {
+        *out++ = '%';
+        *out++ = HEX_DIGITS_URI[b/16];
+        *out++ = HEX_DIGITS_URI[b%16];
+      }
     }
   }
-  result.add('\0');
-  return String(result.releaseAsArray());
+
+  return out - output.begin();
+}
+
+String encodeUriComponent(ArrayPtr<const byte> bytes) {
+  KJ_STACK_ARRAY(char, buffer, bytes.size() * 3, 256, 4096);
+  return heapString(buffer.begin(), encodeUriComponent(bytes, buffer));
 }
 
 EncodingResult<Array<byte>> decodeBinaryUriComponent(
@@ -592,7 +908,7 @@ EncodingResult<Array<byte>> decodeBinaryCEscape(ArrayPtr<const char> text, bool
 }
 
 // =======================================================================================
-// This code is derived from libb64 which has been placed in the public domain.
+// Base64. The decoder is derived from libb64 which has been placed in the public domain.
 // For details, see http://sourceforge.net/projects/libb64
 
 // -------------------------------------------------------------------
@@ -600,151 +916,137 @@ EncodingResult<Array<byte>> decodeBinaryCEscape(ArrayPtr<const char> text, bool
 
 namespace {
 
-typedef enum {
-  step_A, step_B, step_C
-} base64_encodestep;
-
-typedef struct {
-  base64_encodestep step;
-  char result;
-  int stepcount;
-} base64_encodestate;
-
 const int CHARS_PER_LINE = 72;
 
-void base64_init_encodestate(base64_encodestate* state_in) {
-  state_in->step = step_A;
-  state_in->result = 0;
-  state_in->stepcount = 0;
+const char BASE64_CHARS[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#if __SSSE3__
+inline __m128i base64Encode12(const byte* in) {
+  // Encodes the first 12 of the 16 bytes at `in` as 16 chars. This is Wojciech Muła's SSSE3
+  // algorithm (http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html).
+
+  // Spread each 3-byte group over a 32-bit lane, as bytes 1, 0, 2, 1.
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+  v = _mm_shuffle_epi8(v, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+  // Move the four 6-bit fields of each lane into their own bytes.
+  __m128i t0 = _mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00));
+  __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  __m128i t2 = _mm_and_si128(v, _mm_set1_epi32(0x003f03f0));
+  __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  __m128i indices = _mm_or_si128(t1, t3);
+
+  // Map 0..63 to the alphabet by adding a per-range offset, looked up by range:
+  // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12.
+  __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+  __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+  range = _mm_or_si128(range, _mm_and_si128(upper, _mm_set1_epi8(13)));
+  const __m128i offsets = _mm_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  return _mm_add_epi8(_mm_shuffle_epi8(offsets, range), indices);
 }
+#endif
 
-char base64_encode_value(char value_in) {
-  static const char* encoding = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-  if (value_in > 63) return '=';
-  return encoding[(int)value_in];
-}
-
-int base64_encode_block(const char* plaintext_in, int length_in,
-                        char* code_out, base64_encodestate* state_in, bool breakLines) {
-  const char* plainchar = plaintext_in;
-  const char* const plaintextend = plaintext_in + length_in;
-  char* codechar = code_out;
-  char result;
-  char fragment;
-
-  result = state_in->result;
+char* encodeBase64Groups(const byte* in, size_t groups, char* out) {
+  // Encodes `groups` complete 3-byte groups, with no padding or line breaks.
 
-  switch (state_in->step) {
-    while (1) {
-  case step_A:
-      if (plainchar == plaintextend) {
-        state_in->result = result;
-        state_in->step = step_A;
-        return codechar - code_out;
-      }
-      fragment = *plainchar++;
-      result = (fragment & 0x0fc) >> 2;
-      *codechar++ = base64_encode_value(result);
-      result = (fragment & 0x003) << 4;
-  case step_B:
-      if (plainchar == plaintextend) {
-        state_in->result = result;
-        state_in->step = step_B;
-        return codechar - code_out;
-      }
-      fragment = *plainchar++;
-      result |= (fragment & 0x0f0) >> 4;
-      *codechar++ = base64_encode_value(result);
-      result = (fragment & 0x00f) << 2;
-  case step_C:
-      if (plainchar == plaintextend) {
-        state_in->result = result;
-        state_in->step = step_C;
-        return codechar - code_out;
-      }
-      fragment = *plainchar++;
-      result |= (fragment & 0x0c0) >> 6;
-      *codechar++ = base64_encode_value(result);
-      result  = (fragment & 0x03f) >> 0;
-      *codechar++ = base64_encode_value(result);
-
-      ++(state_in->stepcount);
-      if (breakLines && state_in->stepcount == CHARS_PER_LINE/4) {
-        *codechar++ = '\n';
-        state_in->stepcount = 0;
+#if __SSSE3__
+  // Each step reads 16 bytes but consumes only 12, so stop while the read would still be in bounds.
+  for (; groups >= 6; groups -= 4, in += 12, out += 16) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), base64Encode12(in));
+  }
+#elif __ARM_NEON && __aarch64__
+  if (groups >= 16) {
+    uint8x16x4_t table;
+    for (uint i = 0; i < 4; i++) {
+      table.val[i] = vld1q_u8(reinterpret_cast<const uint8_t*>(BASE64_CHARS) + i * 16);
+    }
+    const uint8x16_t sixBits = vdupq_n_u8(0x3f);
+    for (; groups >= 16; groups -= 16, in += 48, out += 64) {
+      // vld3q/vst4q (de)interleave, so this is the scalar algorithm 16 groups wide.
+      uint8x16x3_t bytes = vld3q_u8(in);
+      uint8x16x4_t chars;
+      chars.val[0] = vshrq_n_u8(bytes.val[0], 2);
+      chars.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(bytes.val[0], 4), vshrq_n_u8(bytes.val[1], 4)),
+                              sixBits);
+      chars.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(bytes.val[1], 2), vshrq_n_u8(bytes.val[2], 6)),
+                              sixBits);
+      chars.val[3] = vandq_u8(bytes.val[2], sixBits);
+      for (uint i = 0; i < 4; i++) {
+        chars.val[i] = vqtbl4q_u8(table, chars.val[i]);
       }
+      vst4q_u8(reinterpret_cast<uint8_t*>(out), chars);
     }
   }
-  /* control should not reach here */
-  return codechar - code_out;
+#endif
+
+  for (; groups > 0; --groups, in += 3) {
+    uint bits = (uint(in[0]) << 16) | (uint(in[1]) << 8) | in[2];
+    *out++ = BASE64_CHARS[bits >> 18];
+    *out++ = BASE64_CHARS[(bits >> 12) & 0x3f];
+    *out++ = BASE64_CHARS[(bits >> 6) & 0x3f];
+    *out++ = BASE64_CHARS[bits & 0x3f];
+  }
+  return out;
 }
 
-int base64_encode_blockend(char* code_out, base64_encodestate* state_in, bool breakLines) {
-  char* codechar = code_out;
+}  // namespace
 
-  switch (state_in->step) {
-  case step_B:
-    *codechar++ = base64_encode_value(state_in->result);
-    *codechar++ = '=';
-    *codechar++ = '=';
-    ++state_in->stepcount;
-    break;
-  case step_C:
-    *codechar++ = base64_encode_value(state_in->result);
-    *codechar++ = '=';
-    ++state_in->stepcount;
-    break;
-  case step_A:
-    break;
+size_t base64EncodedSize(size_t size, bool breakLines) {
+  // equivalent to ceil(size / 3) * 4
+  size_t numChars = (size + 2) / 3 * 4;
+  if (breakLines) {
+    // Add space for newline characters, including one after a partial last line.
+    numChars += (numChars + CHARS_PER_LINE - 1) / CHARS_PER_LINE;
   }
-  if (breakLines && state_in->stepcount > 0) {
-    *codechar++ = '\n';
+  return numChars;
+}
+
+size_t encodeBase64(ArrayPtr<const byte> input, ArrayPtr<char> output, bool breakLines) {
+  KJ_REQUIRE(output.size() >= base64EncodedSize(input.size(), breakLines),
+             "output buffer too small for base64 encoding");
+
+  const byte* in = input.begin();
+  char* out = output.begin();
+
+  size_t fullGroups = input.size() / 3;
+  size_t groupsPerLine = breakLines ? CHARS_PER_LINE / 4 : fullGroups;
+  size_t groupsInLine = 0;
+  while (fullGroups > 0) {
+    size_t n = kj::min(fullGroups, groupsPerLine - groupsInLine);
+    out = encodeBase64Groups(in, n, out);
+    in += n * 3;
+    fullGroups -= n;
+    groupsInLine += n;
+    if (breakLines && groupsInLine == groupsPerLine) {
+      *out++ = '\n';
+      groupsInLine = 0;
+    }
   }
 
-  return codechar - code_out;
-}
+  size_t remaining = input.end() - in;
+  if (remaining > 0) {
+    uint b0 = in[0];
+    uint b1 = remaining > 1 ? in[1] : 0;
+    *out++ = BASE64_CHARS[b0 >> 2];
+    *out++ = BASE64_CHARS[((b0 & 0x03) << 4) | (b1 >> 4)];
+    *out++ = remaining > 1 ? BASE64_CHARS[(b1 & 0x0f) << 2] : '=';
+    *out++ = '=';
+    ++groupsInLine;
+  }
+  if (breakLines && groupsInLine > 0) {
+    *out++ = '\n';
+  }
 
-}  // namespace
+  return out - output.begin();
+}
 
 String encodeBase64(ArrayPtr<const byte> input, bool breakLines) {
-  /* set up a destination buffer large enough to hold the encoded data */
-  // equivalent to ceil(input.size() / 3) * 4
-  auto numChars = (input.size() + 2) / 3 * 4;
-  if (breakLines) {
-    // Add space for newline characters.
-    uint lineCount = numChars / CHARS_PER_LINE;
-    if (numChars % CHARS_PER_LINE > 0) {
-      // Partial line.
-      ++lineCount;
-    }
-    numChars = numChars + lineCount;
-  }
-  auto output = heapString(numChars);
-  /* keep track of our encoded position */
-  char* c = output.begin();
-  /* store the number of bytes encoded by a single call */
-  int cnt = 0;
-  size_t total = 0;
-  /* we need an encoder state */
-  base64_encodestate s;
-
-  /*---------- START ENCODING ----------*/
-  /* initialise the encoder state */
-  base64_init_encodestate(&s);
-  /* gather data from the input and send it to the output */
-  cnt = base64_encode_block((const char *)input.begin(), input.size(), c, &s, breakLines);
-  c += cnt;
-  total += cnt;
-
-  /* since we have encoded the entire input string, we know that
-     there is no more input data; finalise the encoding */
-  cnt = base64_encode_blockend(c, &s, breakLines);
-  c += cnt;
-  total += cnt;
-  /*---------- STOP ENCODING  ----------*/
-
-  KJ_ASSERT(total == output.size(), total, output.size());
-
+  auto output = heapString(base64EncodedSize(input.size(), breakLines));
+  size_t n = encodeBase64(input, output, breakLines);
+  KJ_ASSERT(n == output.size(), n, output.size());
   return output;
 }
 
@@ -891,8 +1193,28 @@ EncodingResult<Array<byte>> decodeBase64(ArrayPtr<const char> input) {
 
   auto output = heapArray<byte>((input.size() * 6 + 7) / 8);
 
-  size_t n = base64_decode_block(input.begin(), input.size(),
-      reinterpret_cast<char*>(output.begin()), &state);
+  // Decode whole 4-char groups directly while they contain nothing but alphabet characters. The
+  // state machine picks up at the first whitespace, padding, or invalid character; since it
+  // starts between groups, that's the same as if it had done everything.
+  const char* in = input.begin();
+  const char* end = input.end();
+  byte* out = output.begin();
+  while (end - in >= 4) {
+    int a = base64_decode_value(in[0]);
+    int b = base64_decode_value(in[1]);
+    int c = base64_decode_value(in[2]);
+    int d = base64_decode_value(in[3]);
+    if ((a | b | c | d) < 0) break;
+    uint bits = (uint(a) << 18) | (uint(b) << 12) | (uint(c) << 6) | uint(d);
+    out[0] = bits >> 16;
+    out[1] = bits >> 8;
+    out[2] = bits;
+    in += 4;
+    out += 3;
+  }
+
+  size_t n = (out - output.begin()) +
+      base64_decode_block(in, end - in, reinterpret_cast<char*>(out), &state);
 
   if (n < output.size()) {
     auto copy = heapArray<byte>(n);
@@ -106,6 +106,12 @@ EncodingResult<String> decodeUtf32(ArrayPtr<const char32_t> utf32);
 //   raised on subsequent legs unless all invalid sequences were replaced with U+FFFD (which, after
 //   all, is a valid code point).
 
+bool isValidUtf8(ArrayPtr<const char> text);
+// Returns true if `text` is well-formed UTF-8, i.e. exactly when encodeUtf16(text) would not set
+// `hadErrors`. Unlike the conversions above, this rejects encoded surrogate code points (WTF-8)
+// outright. Runs of ASCII are checked 16 bytes at a time, so this is much cheaper than a
+// conversion when all you need is a yes/no answer.
+
 EncodingResult<Array<wchar_t>> encodeWideString(
     ArrayPtr<const char> text, bool nulTerminate = false);
 EncodingResult<String> decodeWideString(ArrayPtr<const wchar_t> wide);
@@ -122,6 +128,10 @@ String encodeHex(ArrayPtr<const byte> bytes);
 EncodingResult<Array<byte>> decodeHex(ArrayPtr<const char> text);
 // Encode/decode bytes as hex strings.
 
+size_t encodeHex(ArrayPtr<const byte> bytes, ArrayPtr<char> out);
+// Like encodeHex(bytes), but writes into `out` instead of allocating a String. `out` must have room
+// for 2 * bytes.size() chars. Returns the number of chars written; no NUL terminator is added.
+
 String encodeUriComponent(ArrayPtr<const byte> bytes);
 String encodeUriComponent(ArrayPtr<const char> bytes);
 EncodingResult<Array<byte>> decodeBinaryUriComponent(
@@ -129,6 +139,11 @@ EncodingResult<Array<byte>> decodeBinaryUriComponent(
 EncodingResult<String> decodeUriComponent(ArrayPtr<const char> text);
 // Encode/decode URI components using % escapes. See Javascript's encodeURIComponent().
 
+size_t encodeUriComponent(ArrayPtr<const byte> bytes, ArrayPtr<char> out);
+// Like encodeUriComponent(bytes), but writes into `out` instead of allocating a String. `out` must
+// have room for 3 * bytes.size() chars, the most escaping can need. Returns the number of chars
+// written; no NUL terminator is added.
+
 String encodeCEscape(ArrayPtr<const byte> bytes);
 String encodeCEscape(ArrayPtr<const char> bytes);
 EncodingResult<Array<byte>> decodeBinaryCEscape(
@@ -139,6 +154,12 @@ String encodeBase64(ArrayPtr<const byte> bytes, bool breakLines = false);
 // Encode the given bytes as base64 text. If `breakLines` is true, line breaks will be inserted
 // into the output every 72 characters (e.g. for encoding e-mail bodies).
 
+size_t base64EncodedSize(size_t size, bool breakLines = false);
+size_t encodeBase64(ArrayPtr<const byte> bytes, ArrayPtr<char> out, bool breakLines = false);
+// Like encodeBase64(bytes, breakLines), but writes into `out` instead of allocating a String. `out`
+// must have room for base64EncodedSize(bytes.size(), breakLines) chars, which is also the number
+// written; no NUL terminator is added.
+
 EncodingResult<Array<byte>> decodeBase64(ArrayPtr<const char> text);
 // Decode base64 text. This function reports errors required by the WHATWG HTML/Infra specs: see
 // https://html.spec.whatwg.org/multipage/webappapis.html#atob for details.
@@ -219,6 +240,10 @@ inline EncodingResult<String> decodeUtf32(const char32_t (&utf32)[s]) {
   return decodeUtf32(arrayPtr(utf32, s - 1));
 }
 template <size_t s>
+inline bool isValidUtf8(const char (&text)[s]) {
+  return isValidUtf8(arrayPtr(text, s - 1));
+}
+template <size_t s>
 inline EncodingResult<String> decodeWideString(const wchar_t (&utf32)[s]) {
   return decodeWideString(arrayPtr(utf32, s - 1));
 }
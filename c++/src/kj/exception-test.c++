@@ -21,7 +21,12 @@
 
 #include "exception.h"
 #include "debug.h"
+#include "thread.h"
+#include "vector.h"
 #include <kj/compat/gtest.h>
+#if !_WIN32
+#include <unistd.h>
+#endif
 
 namespace kj {
 namespace _ {  // private
@@ -174,6 +179,123 @@ KJ_TEST("getStackTrace() returns correct line number, not line + 1") {
   KJ_ASSERT(strstr(trace.cStr(), wrong.cStr()) == nullptr, trace, wrong);
 }
 
+class SampledTraceCallback final: public ExceptionCallback {
+public:
+  SampledTraceCallback(uint interval): interval(interval) {}
+
+  StackTraceMode stackTraceMode() override { return StackTraceMode::FULL; }
+  uint stackTraceSampleInterval() override { return interval; }
+
+private:
+  uint interval;
+};
+
+KJ_TEST("stack traces can be sampled") {
+  void* space[8];
+  bool haveTraces = kj::getStackTrace(space, 0).size() > 0;
+
+  SampledTraceCallback callback(5);
+  uint traced = 0;
+  for (uint i = 0; i < 10; i++) {
+    KJ_IF_MAYBE(e, kj::runCatchingExceptions([]() {
+      kj::throwRecoverableException(KJ_EXCEPTION(FAILED, "sampled"));
+    })) {
+      if (e->getStackTrace().size() > 0) ++traced;
+    } else {
+      KJ_FAIL_EXPECT("should have thrown");
+    }
+  }
+  KJ_EXPECT(traced == (haveTraces ? 2 : 0), traced);
+}
+
+KJ_TEST("stack trace symbolization is cached") {
+  SampledTraceCallback callback(1);
+  void* space[32];
+  auto trace = kj::getStackTrace(space, 0);
+
+  // The second call is answered entirely from the cache, and must agree with the first.
+  auto first = stringifyStackTrace(trace);
+  auto second = stringifyStackTrace(trace);
+  KJ_EXPECT(first == second, first, second);
+}
+
+#if !_WIN32
+String readAvailable(int fd) {
+  Vector<char> result;
+  char buffer[4096];
+  for (;;) {
+    ssize_t n;
+    KJ_SYSCALL(n = read(fd, buffer, sizeof(buffer)));
+    result.addAll(buffer, buffer + n);
+    if (n < sizeof(buffer)) break;
+  }
+  result.add('\0');
+  return String(result.releaseAsArray());
+}
+
+KJ_TEST("BufferedLogCallback") {
+  int fds[2];
+  KJ_SYSCALL(pipe(fds));
+  KJ_DEFER(close(fds[0]); close(fds[1]));
+
+  BufferedLogCallback::Options options;
+  options.fd = fds[1];
+  options.maxPerSitePerSecond = 3;
+  BufferedLogCallback callback(options);
+
+  KJ_LOG(WARNING, "hello from the main thread");
+  Thread([]() {
+    KJ_LOG(WARNING, "hello from another thread");
+  });
+
+  for (uint i = 0; i < 10; i++) {
+    KJ_LOG(WARNING, "repeated", i);
+  }
+
+  callback.flush();
+  auto text = readAvailable(fds[0]);
+  KJ_EXPECT(strstr(text.cStr(), "hello from the main thread") != nullptr, text);
+  KJ_EXPECT(strstr(text.cStr(), "hello from another thread") != nullptr, text);
+  KJ_EXPECT(strstr(text.cStr(), "repeated; i = 2") != nullptr, text);
+  KJ_EXPECT(strstr(text.cStr(), "repeated; i = 3") == nullptr, text);
+
+  auto stats = callback.getStats();
+  KJ_EXPECT(stats.written == 5, stats.written);
+  KJ_EXPECT(stats.rateLimited == 7, stats.rateLimited);
+  KJ_EXPECT(stats.dropped == 0, stats.dropped);
+}
+
+KJ_TEST("BufferedLogCallback drops messages when its buffer is full") {
+  int fds[2];
+  KJ_SYSCALL(pipe(fds));
+  KJ_DEFER(close(fds[0]); close(fds[1]));
+
+  BufferedLogCallback::Options options;
+  options.fd = fds[1];
+  options.bufferSize = 4096;
+  options.maxPerSitePerSecond = 0;
+  options.flushIntervalMs = 1000000;  // effectively never, once the flusher has gone to sleep
+  BufferedLogCallback callback(options);
+
+  // Give the flusher time to find nothing and go to sleep.
+  usleep(10000);
+
+  auto big = kj::heapString(1000);
+  memset(big.begin(), 'x', big.size());
+  for (uint i = 0; i < 10; i++) {
+    KJ_LOG(WARNING, big);
+  }
+
+  auto stats = callback.getStats();
+  KJ_EXPECT(stats.dropped > 0);
+  KJ_EXPECT(stats.dropped < 10);
+
+  callback.flush();
+  KJ_EXPECT(callback.getStats().written == 10 - stats.dropped);
+  readAvailable(fds[0]);
+}
+#endif
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace kj
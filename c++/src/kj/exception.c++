@@ -25,6 +25,11 @@
 #include "threadlocal.h"
 #include "miniposix.h"
 #include "function.h"
+#include "map.h"
+#include "mutex.h"
+#include "thread.h"
+#include "vector.h"
+#include <chrono>
 #include <stdlib.h>
 #include <exception>
 #include <new>
@@ -40,6 +45,10 @@
 #include <execinfo.h>
 #endif
 
+#if KJ_STACK_TRACE_FRAME_POINTERS && __linux__ && __GLIBC__ && (__x86_64__ || __aarch64__)
+#define KJ_HAS_FRAME_POINTER_UNWINDER 1
+#endif
+
 #if _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -163,6 +172,60 @@ ArrayPtr<void* const> getStackTrace(ArrayPtr<void*> space, uint ignoreCount,
 }  // namespace
 #endif
 
+#if KJ_HAS_FRAME_POINTER_UNWINDER
+namespace {
+
+struct StackBounds {
+  uintptr_t low = 0;
+  uintptr_t high = 0;
+};
+
+thread_local StackBounds threadStackBounds;
+
+const StackBounds& getStackBounds() {
+  StackBounds& bounds = threadStackBounds;
+  if (bounds.high == 0) {
+    // pthread_getattr_np() is slow for the main thread (it reads /proc/self/maps), so ask once.
+    pthread_attr_t attr;
+    void* addr;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+      if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+        bounds.low = reinterpret_cast<uintptr_t>(addr);
+        bounds.high = bounds.low + size;
+      }
+      pthread_attr_destroy(&attr);
+    }
+    if (bounds.high == 0) {
+      // Unknown; an empty range makes every walk stop immediately.
+      bounds.low = bounds.high = 1;
+    }
+  }
+  return bounds;
+}
+
+KJ_NOINLINE size_t walkFramePointers(ArrayPtr<void*> space) {
+  // On both x86-64 and ARM64, a frame pointer points at a pair of words: the caller's frame
+  // pointer, then the return address. Callers' frames are always higher up the stack, so each
+  // step must move strictly upward, and we stop as soon as a pointer looks wrong.
+
+  const StackBounds& bounds = getStackBounds();
+  uintptr_t fp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+  size_t count = 0;
+  while (count < space.size() &&
+         fp >= bounds.low && fp <= bounds.high - 2 * sizeof(void*) && fp % sizeof(void*) == 0) {
+    auto frame = reinterpret_cast<const uintptr_t*>(fp);
+    if (frame[1] == 0) break;
+    space[count++] = reinterpret_cast<void*>(frame[1]);
+    if (frame[0] <= fp) break;
+    fp = frame[0];
+  }
+  return count;
+}
+
+}  // namespace
+#endif  // KJ_HAS_FRAME_POINTER_UNWINDER
+
 ArrayPtr<void* const> getStackTrace(ArrayPtr<void*> space, uint ignoreCount) {
   if (getExceptionCallback().stackTraceMode() == ExceptionCallback::StackTraceMode::NONE) {
     return nullptr;
@@ -172,8 +235,13 @@ ArrayPtr<void* const> getStackTrace(ArrayPtr<void*> space, uint ignoreCount) {
   CONTEXT context;
   RtlCaptureContext(&context);
   return getStackTrace(space, ignoreCount, GetCurrentThread(), context);
-#elif KJ_HAS_BACKTRACE
+#elif KJ_HAS_FRAME_POINTER_UNWINDER || KJ_HAS_BACKTRACE
+#if KJ_HAS_FRAME_POINTER_UNWINDER
+  // Like backtrace(), the walk starts with a frame in this function, hence the +1 below.
+  size_t size = walkFramePointers(space);
+#else
   size_t size = backtrace(space.begin(), space.size());
+#endif
   for (auto& addr: space.slice(0, size)) {
     // The addresses produced by backtrace() are return addresses, which means they point to the
     // instruction immediately after the call. Invoking addr2line on these can be confusing because
@@ -228,72 +296,107 @@ String stringifyStackTrace(ArrayPtr<void* const> trace) {
   //   and do this all in-process, but that may involve onerous requirements like large library
   //   dependencies or using -rdynamic.
 
-  // The environment manipulation is not thread-safe, so lock a mutex.  This could still be
-  // problematic if another thread is manipulating the environment in unrelated code, but there's
-  // not much we can do about that.  This is debug-only anyway and only an issue when LD_PRELOAD
-  // is in use.
+  // Symbolizing an address means running a subprocess, so each answer is kept for the life of the
+  // process. An entry is null if the frame is in infrastructure that we leave out of traces. The
+  // cache is intentionally leaked, since exceptions may be stringified during static destruction.
+  //
+  // The mutex also covers the environment manipulation below, which is not thread-safe. This could
+  // still be problematic if another thread is manipulating the environment in unrelated code, but
+  // there's not much we can do about that.  This is debug-only anyway and only an issue when
+  // LD_PRELOAD is in use.
   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  static HashMap<void*, String>* cache = new HashMap<void*, String>();
+  static constexpr size_t MAX_CACHED_ADDRESSES = 4096;
   pthread_mutex_lock(&mutex);
   KJ_DEFER(pthread_mutex_unlock(&mutex));
 
-  // Don't heapcheck / intercept syscalls.
-  const char* preload = getenv("LD_PRELOAD");
-  String oldPreload;
-  if (preload != nullptr) {
-    oldPreload = heapString(preload);
-    unsetenv("LD_PRELOAD");
+  Vector<void*> missing;
+  for (void* addr: trace) {
+    if (cache->find(addr) != nullptr) continue;
+    bool duplicate = false;
+    for (void* other: missing) {
+      if (other == addr) { duplicate = true; break; }
+    }
+    if (!duplicate) missing.add(addr);
   }
-  KJ_DEFER(if (oldPreload != nullptr) { setenv("LD_PRELOAD", oldPreload.cStr(), true); });
 
-  String lines[32];
-  FILE* p = nullptr;
-  auto strTrace = strArray(trace, " ");
+  if (missing.size() > 0) {
+    if (cache->size() + missing.size() > MAX_CACHED_ADDRESSES) {
+      cache->clear();
+    }
+
+    // Don't heapcheck / intercept syscalls.
+    const char* preload = getenv("LD_PRELOAD");
+    String oldPreload;
+    if (preload != nullptr) {
+      oldPreload = heapString(preload);
+      unsetenv("LD_PRELOAD");
+    }
+    KJ_DEFER(if (oldPreload != nullptr) { setenv("LD_PRELOAD", oldPreload.cStr(), true); });
+
+    FILE* p = nullptr;
+    auto strTrace = strArray(missing, " ");
 
 #if __linux__
-  if (access("/proc/self/exe", R_OK) < 0) {
-    // Apparently /proc is not available?
-    return nullptr;
-  }
+    if (access("/proc/self/exe", R_OK) < 0) {
+      // Apparently /proc is not available?
+      return nullptr;
+    }
 
-  // Obtain symbolic stack trace using addr2line.
-  // TODO(cleanup): Use fork() and exec() or maybe our own Subprocess API (once it exists), to
-  //   avoid depending on a shell.
-  p = popen(str("addr2line -e /proc/", getpid(), "/exe ", strTrace).cStr(), "r");
+    // Obtain symbolic stack trace using addr2line.
+    // TODO(cleanup): Use fork() and exec() or maybe our own Subprocess API (once it exists), to
+    //   avoid depending on a shell.
+    p = popen(str("addr2line -e /proc/", getpid(), "/exe ", strTrace).cStr(), "r");
 #elif __APPLE__
-  // The Mac OS X equivalent of addr2line is atos.
-  // (Internally, it uses the private CoreSymbolication.framework library.)
-  p = popen(str("xcrun atos -p ", getpid(), ' ', strTrace).cStr(), "r");
+    // The Mac OS X equivalent of addr2line is atos.
+    // (Internally, it uses the private CoreSymbolication.framework library.)
+    p = popen(str("xcrun atos -p ", getpid(), ' ', strTrace).cStr(), "r");
 #endif
 
-  if (p == nullptr) {
-    return nullptr;
-  }
+    if (p == nullptr) {
+      return nullptr;
+    }
 
-  char line[512];
-  size_t i = 0;
-  while (i < kj::size(lines) && fgets(line, sizeof(line), p) != nullptr) {
-    // Don't include exception-handling infrastructure or promise infrastructure in stack trace.
-    // addr2line output matches file names; atos output matches symbol names.
-    if (strstr(line, "kj/common.c++") != nullptr ||
-        strstr(line, "kj/exception.") != nullptr ||
-        strstr(line, "kj/debug.") != nullptr ||
-        strstr(line, "kj/async.") != nullptr ||
-        strstr(line, "kj/async-prelude.h") != nullptr ||
-        strstr(line, "kj/async-inl.h") != nullptr ||
-        strstr(line, "kj::Exception") != nullptr ||
-        strstr(line, "kj::_::Debug") != nullptr) {
-      continue;
+    // Both tools print exactly one line per address, in order.
+    char line[512];
+    size_t i = 0;
+    while (i < missing.size() && fgets(line, sizeof(line), p) != nullptr) {
+      String entry;
+
+      // Don't include exception-handling infrastructure or promise infrastructure in stack trace.
+      // addr2line output matches file names; atos output matches symbol names.
+      if (strstr(line, "kj/common.c++") == nullptr &&
+          strstr(line, "kj/exception.") == nullptr &&
+          strstr(line, "kj/debug.") == nullptr &&
+          strstr(line, "kj/async.") == nullptr &&
+          strstr(line, "kj/async-prelude.h") == nullptr &&
+          strstr(line, "kj/async-inl.h") == nullptr &&
+          strstr(line, "kj::Exception") == nullptr &&
+          strstr(line, "kj::_::Debug") == nullptr) {
+        size_t len = strlen(line);
+        if (len > 0 && line[len-1] == '\n') line[len-1] = '\0';
+        entry = str("\n    ", trimSourceFilename(line), ": returning here");
+      }
+
+      cache->insert(missing[i++], kj::mv(entry));
     }
 
-    size_t len = strlen(line);
-    if (len > 0 && line[len-1] == '\n') line[len-1] = '\0';
-    lines[i++] = str("\n    ", trimSourceFilename(line), ": returning here");
-  }
+    // Skip remaining input.
+    while (fgets(line, sizeof(line), p) != nullptr) {}
 
-  // Skip remaining input.
-  while (fgets(line, sizeof(line), p) != nullptr) {}
+    pclose(p);
+  }
 
-  pclose(p);
+  String lines[32];
+  size_t i = 0;
+  for (void* addr: trace) {
+    if (i == kj::size(lines)) break;
+    KJ_IF_MAYBE(entry, cache->find(addr)) {
+      if (*entry != nullptr) {
+        lines[i++] = heapString(*entry);
+      }
+    }
+  }
 
   return strArray(arrayPtr(lines, i), "");
 
@@ -732,6 +835,10 @@ ExceptionCallback::StackTraceMode ExceptionCallback::stackTraceMode() {
   return next.stackTraceMode();
 }
 
+uint ExceptionCallback::stackTraceSampleInterval() {
+  return next.stackTraceSampleInterval();
+}
+
 Function<void(Function<void()>)> ExceptionCallback::getThreadInitializer() {
   return next.getThreadInitializer();
 }
@@ -790,6 +897,10 @@ public:
 #endif
   }
 
+  uint stackTraceSampleInterval() override {
+    return 1;
+  }
+
   Function<void(Function<void()>)> getThreadInitializer() override {
     return [](Function<void()> func) {
       // No initialization needed since RootExceptionCallback is automatically the root callback
@@ -825,13 +936,298 @@ void throwFatalException(kj::Exception&& exception, uint ignoreCount) {
   abort();
 }
 
+namespace {
+
+thread_local uint throwsSinceLastTrace = 0;
+
+}  // namespace
+
 void throwRecoverableException(kj::Exception&& exception, uint ignoreCount) {
-  exception.extendTrace(ignoreCount + 1);
+  uint interval = getExceptionCallback().stackTraceSampleInterval();
+  if (interval <= 1 || throwsSinceLastTrace++ % interval == 0) {
+    exception.extendTrace(ignoreCount + 1);
+  }
   getExceptionCallback().onRecoverableException(kj::mv(exception));
 }
 
 // =======================================================================================
 
+struct BufferedLogCallback::ThreadBuffer {
+  // A single-producer, single-consumer ring of length-prefixed messages.  The owning thread
+  // pushes; the consumer (the flusher thread, or whoever calls flush()) drains while holding
+  // Shared::buffers' lock.
+
+  explicit ThreadBuffer(size_t capacity)
+      : data(heapArray<byte>(capacity)), mask(capacity - 1) {}
+
+  Array<byte> data;
+  size_t mask;
+  size_t head = 0;  // total bytes pushed; written by the producer
+  size_t tail = 0;  // total bytes consumed; written by the consumer
+  bool retired = false;  // set once the owning thread will push no more
+
+  struct SiteKey {
+    const char* file;
+    int line;
+
+    inline bool operator==(const SiteKey& other) const {
+      return file == other.file && line == other.line;
+    }
+    inline uint hashCode() const { return kj::hashCode(reinterpret_cast<uintptr_t>(file), line); }
+  };
+  struct Site {
+    int64_t second;
+    uint count;
+    uint suppressed;
+  };
+  HashMap<SiteKey, Site> sites;
+  // Rate-limiting state.  Only the owning thread touches this.
+
+  bool tryPush(ArrayPtr<const char> text) {
+    size_t needed = sizeof(uint32_t) + text.size();
+    size_t h = head;
+    size_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    if (needed > data.size() - (h - t)) return false;
+
+    uint32_t length = text.size();
+    copyIn(h, &length, sizeof(length));
+    copyIn(h + sizeof(length), text.begin(), text.size());
+    __atomic_store_n(&head, h + needed, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  uint drainInto(Vector<char>& out) {
+    size_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    size_t t = tail;
+    uint count = 0;
+    while (t != h) {
+      uint32_t length;
+      copyOut(t, &length, sizeof(length));
+      t += sizeof(length);
+      size_t start = out.size();
+      out.resize(start + length);
+      copyOut(t, out.begin() + start, length);
+      t += length;
+      ++count;
+    }
+    __atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+    return count;
+  }
+
+private:
+  void copyIn(size_t pos, const void* src, size_t size) {
+    size_t offset = pos & mask;
+    size_t first = kj::min(size, data.size() - offset);
+    memcpy(data.begin() + offset, src, first);
+    memcpy(data.begin(), reinterpret_cast<const byte*>(src) + first, size - first);
+  }
+
+  void copyOut(size_t pos, void* dst, size_t size) {
+    size_t offset = pos & mask;
+    size_t first = kj::min(size, data.size() - offset);
+    memcpy(dst, data.begin() + offset, first);
+    memcpy(reinterpret_cast<byte*>(dst) + first, data.begin(), size - first);
+  }
+};
+
+class BufferedLogCallback::ThreadCallback final: public ExceptionCallback {
+  // Installed by getThreadInitializer() in each new thread, giving it its own buffer.
+
+public:
+  ThreadCallback(Shared& shared);
+  ~ThreadCallback() noexcept(false);
+
+  void logMessage(LogSeverity severity, const char* file, int line, int contextDepth,
+                  String&& text) override;
+  Function<void(Function<void()>)> getThreadInitializer() override;
+
+private:
+  Shared& shared;
+  ThreadBuffer& buffer;
+};
+
+struct BufferedLogCallback::Shared {
+  Options options;
+
+  MutexGuarded<Vector<Own<ThreadBuffer>>> buffers;
+  // Every thread's buffer.  The lock also makes its holder the one consumer of all of them.
+
+  uint64_t written = 0;
+  uint64_t dropped = 0;
+  uint64_t rateLimited = 0;
+  bool stopping = false;
+  // Updated atomically.
+
+  Maybe<Own<Thread>> flusher;
+
+  explicit Shared(Options options): options(options) {
+    size_t capacity = 4096;
+    while (capacity < options.bufferSize) capacity *= 2;
+    this->options.bufferSize = capacity;
+  }
+
+  ThreadBuffer& addBuffer() {
+    auto newBuffer = heap<ThreadBuffer>(options.bufferSize);
+    auto& result = *newBuffer;
+    buffers.lockExclusive()->add(mv(newBuffer));
+    return result;
+  }
+
+  void startFlusher() {
+    flusher = heap<Thread>([this]() {
+      while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        if (!drain()) {
+          // Sleep in short steps so that stop() doesn't wait out a long interval.
+          for (uint slept = 0; slept < options.flushIntervalMs &&
+                               !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE); slept += 10) {
+            uint ms = kj::min(options.flushIntervalMs - slept, 10u);
+#if _WIN32
+            Sleep(ms);
+#else
+            usleep(ms * 1000);
+#endif
+          }
+        }
+      }
+    });
+  }
+
+  void stop() {
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    flusher = nullptr;  // joins
+    drain();
+  }
+
+  bool drain() {
+    // Write out everything buffered so far.  Returns false if there was nothing.
+    auto lock = buffers.lockExclusive();
+    Vector<char> out;
+    uint count = 0;
+    for (size_t i = 0; i < lock->size();) {
+      auto& buffer = *(*lock)[i];
+      // Check before draining, so that a retired buffer is known to be empty afterwards.
+      bool retired = __atomic_load_n(&buffer.retired, __ATOMIC_ACQUIRE);
+      count += buffer.drainInto(out);
+      if (retired) {
+        (*lock)[i] = mv(lock->back());
+        lock->removeLast();
+      } else {
+        ++i;
+      }
+    }
+    if (count == 0) return false;
+
+    write(out);
+    __atomic_add_fetch(&written, count, __ATOMIC_RELAXED);
+    return true;
+  }
+
+  void write(ArrayPtr<const char> text) {
+    while (text != nullptr) {
+      miniposix::ssize_t n = miniposix::write(options.fd, text.begin(), text.size());
+      if (n <= 0) {
+        // The destination is broken.  Give up, like the default callback does.
+        return;
+      }
+      text = text.slice(n, text.size());
+    }
+  }
+
+  void log(ThreadBuffer& buffer, LogSeverity severity, const char* file, int line,
+           int contextDepth, String&& text) {
+    uint suppressed = 0;
+    if (options.maxPerSitePerSecond > 0 && severity != LogSeverity::FATAL) {
+      int64_t second = std::chrono::duration_cast<std::chrono::seconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+      ThreadBuffer::SiteKey key { file, line };
+      auto& site = buffer.sites.findOrCreate(key, [&]() {
+        return HashMap<ThreadBuffer::SiteKey, ThreadBuffer::Site>::Entry {
+            key, ThreadBuffer::Site { second, 0, 0 } };
+      });
+      if (site.second != second) {
+        suppressed = site.suppressed;
+        site = ThreadBuffer::Site { second, 0, 0 };
+      }
+      if (++site.count > options.maxPerSitePerSecond) {
+        ++site.suppressed;
+        __atomic_add_fetch(&rateLimited, 1, __ATOMIC_RELAXED);
+        return;
+      }
+    }
+
+    auto formatted = str(
+        suppressed == 0 ? String() :
+            str(file, ":", line, ": ", suppressed, " messages from here were suppressed\n"),
+        repeat('_', contextDepth), file, ":", line, ": ", severity, ": ", mv(text), '\n');
+
+    if (severity == LogSeverity::FATAL) {
+      // The process may be about to die, so get everything out now, in order.
+      drain();
+      write(formatted);
+      __atomic_add_fetch(&written, 1, __ATOMIC_RELAXED);
+    } else if (!buffer.tryPush(formatted)) {
+      __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  Function<void(Function<void()>)> getThreadInitializer() {
+    return [this](Function<void()> func) {
+      ThreadCallback callback(*this);
+      func();
+    };
+  }
+};
+
+BufferedLogCallback::ThreadCallback::ThreadCallback(Shared& shared)
+    : shared(shared), buffer(shared.addBuffer()) {}
+
+BufferedLogCallback::ThreadCallback::~ThreadCallback() noexcept(false) {
+  __atomic_store_n(&buffer.retired, true, __ATOMIC_RELEASE);
+}
+
+void BufferedLogCallback::ThreadCallback::logMessage(
+    LogSeverity severity, const char* file, int line, int contextDepth, String&& text) {
+  shared.log(buffer, severity, file, line, contextDepth, mv(text));
+}
+
+Function<void(Function<void()>)> BufferedLogCallback::ThreadCallback::getThreadInitializer() {
+  return shared.getThreadInitializer();
+}
+
+BufferedLogCallback::BufferedLogCallback(): BufferedLogCallback(Options()) {}
+
+BufferedLogCallback::BufferedLogCallback(Options options)
+    : shared(heap<Shared>(options)), buffer(shared->addBuffer()) {
+  shared->startFlusher();
+}
+
+BufferedLogCallback::~BufferedLogCallback() noexcept(false) {
+  shared->stop();
+}
+
+void BufferedLogCallback::logMessage(
+    LogSeverity severity, const char* file, int line, int contextDepth, String&& text) {
+  shared->log(buffer, severity, file, line, contextDepth, mv(text));
+}
+
+Function<void(Function<void()>)> BufferedLogCallback::getThreadInitializer() {
+  return shared->getThreadInitializer();
+}
+
+BufferedLogCallback::Stats BufferedLogCallback::getStats() const {
+  Stats result;
+  result.written = __atomic_load_n(&shared->written, __ATOMIC_RELAXED);
+  result.dropped = __atomic_load_n(&shared->dropped, __ATOMIC_RELAXED);
+  result.rateLimited = __atomic_load_n(&shared->rateLimited, __ATOMIC_RELAXED);
+  return result;
+}
+
+void BufferedLogCallback::flush() {
+  shared->drain();
+}
+
+// =======================================================================================
+
 namespace _ {  // private
 
 #if __GNUC__
@@ -28,6 +28,7 @@
 #include "memory.h"
 #include "array.h"
 #include "string.h"
+#include <stdint.h>
 
 namespace kj {
 
@@ -196,7 +197,8 @@ public:
   enum class StackTraceMode {
     FULL,
     // Stringifying a stack trace will attempt to determine source file and line numbers. This may
-    // be expensive. For example, on Linux, this shells out to `addr2line`.
+    // be expensive. For example, on Linux, this shells out to `addr2line`. Results are cached for
+    // the life of the process, so each code address is only looked up once.
     //
     // This is the default in debug builds.
 
@@ -216,6 +218,14 @@ public:
   virtual StackTraceMode stackTraceMode();
   // Returns the current preferred stack trace mode.
 
+  virtual uint stackTraceSampleInterval();
+  // When stack traces are enabled, a recoverable exception thrown on this thread captures one only
+  // if it is the first of every N, where N is the value returned here. The others carry no trace,
+  // which makes throwing much cheaper in code that throws a lot -- e.g. when many connections are
+  // dropped at once. Fatal exceptions always capture a trace.
+  //
+  // The default is 1: every exception gets a trace.
+
   virtual Function<void(Function<void()>)> getThreadInitializer();
   // Called just before a new thread is spawned using kj::Thread. Returns a function which should
   // be invoked inside the new thread to initialize the thread's ExceptionCallback. The initializer
@@ -244,6 +254,72 @@ KJ_NOINLINE void throwRecoverableException(kj::Exception&& exception, uint ignor
 // Invoke the exception callback to throw the given recoverable exception.  If the exception
 // callback returns, return normally.
 
+class BufferedLogCallback final: public ExceptionCallback {
+  // An ExceptionCallback that takes log output -- KJ_LOG and exceptions that get logged rather than
+  // thrown -- off the logging thread.  The default callback write()s every message to stderr
+  // synchronously, so when stderr is a slow pipe an event loop stalls on its logging, typically
+  // during an incident when it's logging the most.
+  //
+  // Instead, each thread formats its messages into its own lock-free ring buffer and a background
+  // thread writes them out in batches.  A thread whose buffer is full drops the message (and
+  // counts it) rather than waiting.  Each call site (file and line) is also limited to a number of
+  // messages per second per thread; when a site is allowed to log again, its next message says how
+  // many were suppressed.  FATAL messages flush everything and are written synchronously, since
+  // the process may be about to die.
+  //
+  // Like any ExceptionCallback, this must be allocated on the stack, and covers the thread that
+  // created it.  Threads started with kj::Thread while it is in effect log through it too, so it
+  // must outlive them.  The destructor writes out whatever is still buffered.
+
+public:
+  struct Options {
+    int fd = 2;
+    // Where the messages go.  Defaults to stderr.
+
+    size_t bufferSize = 256 * 1024;
+    // Size of each thread's buffer, in bytes.  Rounded up to a power of two.
+
+    uint maxPerSitePerSecond = 100;
+    // Messages allowed per call site per thread per second.  Zero means no limit.
+
+    uint flushIntervalMs = 10;
+    // How long the background thread sleeps when it finds nothing to write.
+  };
+
+  BufferedLogCallback();
+  explicit BufferedLogCallback(Options options);
+  ~BufferedLogCallback() noexcept(false);
+
+  void logMessage(LogSeverity severity, const char* file, int line, int contextDepth,
+                  String&& text) override;
+  Function<void(Function<void()>)> getThreadInitializer() override;
+
+  struct Stats {
+    uint64_t written = 0;
+    // Messages written to the destination.
+
+    uint64_t dropped = 0;
+    // Messages lost because the logging thread's buffer was full (or the message was larger than
+    // the whole buffer).
+
+    uint64_t rateLimited = 0;
+    // Messages suppressed by `maxPerSitePerSecond`.
+  };
+
+  Stats getStats() const;
+
+  void flush();
+  // Writes out everything logged so far, by any thread, before returning.
+
+private:
+  struct ThreadBuffer;
+  struct Shared;
+  class ThreadCallback;
+
+  Own<Shared> shared;
+  ThreadBuffer& buffer;
+};
+
 // =======================================================================================
 
 namespace _ { class Runnable; }
@@ -348,6 +424,12 @@ KJ_NOINLINE ArrayPtr<void* const> getStackTrace(ArrayPtr<void*> space, uint igno
 // ignored entries will still waste space in the `space` array (and the returned array's `begin()`
 // is never exactly equal to `space.begin()` due to this effect, even if `ignoreCount` is zero
 // since `getStackTrace()` needs to ignore its own internal frames).
+//
+// On x86-64 and ARM64 Linux, defining KJ_STACK_TRACE_FRAME_POINTERS when building KJ makes this
+// walk the chain of frame pointers instead of calling glibc's backtrace(), which consults the
+// unwind tables and is several times slower. Only do this if the whole program is compiled with
+// -fno-omit-frame-pointer; otherwise traces will be cut short at the first function that doesn't
+// keep one. (The walk never leaves the thread's stack, so it can't crash either way.)
 
 String stringifyStackTrace(ArrayPtr<void* const>);
 // Convert the stack trace to a string with file names and line numbers. This may involve executing
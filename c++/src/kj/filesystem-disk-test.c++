@@ -441,6 +441,16 @@ KJ_TEST("DiskDirectory") {
     KJ_EXPECT(list[1].type == FsNode::Type::FILE);
   }
 
+  {
+    auto list = dir->listEntriesWithMetadata();
+    KJ_ASSERT(list.size() == 2);
+    KJ_EXPECT(list[0].name == "bar");
+    KJ_EXPECT(list[0].metadata.type == FsNode::Type::DIRECTORY);
+    KJ_EXPECT(list[1].name == "foo");
+    KJ_EXPECT(list[1].metadata.type == FsNode::Type::FILE);
+    KJ_EXPECT(list[1].metadata.size == dir->lstat(Path("foo")).size);
+  }
+
   {
     auto subdir = dir->openSubdir(Path("bar"));
 
@@ -632,8 +632,9 @@ public:
   // ReadableDirectory ---------------------------------------------------------
 
   template <typename Func>
-  auto list(bool needTypes, Func&& func) const
-      -> Array<Decay<decltype(func(instance<StringPtr>(), instance<FsNode::Type>()))>> {
+  void forEachEntry(Func&& func) const {
+    // Calls `func(const struct dirent&)` for each entry except ".", "..", and our own temporaries.
+
     // Seek to start of directory.
     KJ_SYSCALL(lseek(fd, 0, SEEK_SET));
 
@@ -648,8 +649,6 @@ public:
     }
 
     KJ_DEFER(closedir(dir));
-    typedef Decay<decltype(func(instance<StringPtr>(), instance<FsNode::Type>()))> Entry;
-    kj::Vector<Entry> entries;
 
     for (;;) {
       errno = 0;
@@ -665,24 +664,36 @@ public:
 
       kj::StringPtr name = entry->d_name;
       if (name != "." && name != ".." && !name.startsWith(HIDDEN_PREFIX)) {
+        func(*entry);
+      }
+    }
+  }
+
+  template <typename Func>
+  auto list(bool needTypes, Func&& func) const
+      -> Array<Decay<decltype(func(instance<StringPtr>(), instance<FsNode::Type>()))>> {
+    typedef Decay<decltype(func(instance<StringPtr>(), instance<FsNode::Type>()))> Entry;
+    kj::Vector<Entry> entries;
+
+    forEachEntry([&](const struct dirent& entry) {
+      kj::StringPtr name = entry.d_name;
 #ifdef DT_UNKNOWN    // d_type is not available on all platforms.
-        if (entry->d_type != DT_UNKNOWN) {
-          entries.add(func(name, modeToType(DTTOIF(entry->d_type))));
-        } else {
+      if (entry.d_type != DT_UNKNOWN) {
+        entries.add(func(name, modeToType(DTTOIF(entry.d_type))));
+      } else {
 #endif
-          if (needTypes) {
-            // Unknown type. Fall back to stat.
-            struct stat stats;
-            KJ_SYSCALL(fstatat(fd, name.cStr(), &stats, AT_SYMLINK_NOFOLLOW));
-            entries.add(func(name, modeToType(stats.st_mode)));
-          } else {
-            entries.add(func(name, FsNode::Type::OTHER));
-          }
-#ifdef DT_UNKNOWN
+        if (needTypes) {
+          // Unknown type. Fall back to stat.
+          struct stat stats;
+          KJ_SYSCALL(fstatat(fd, name.cStr(), &stats, AT_SYMLINK_NOFOLLOW));
+          entries.add(func(name, modeToType(stats.st_mode)));
+        } else {
+          entries.add(func(name, FsNode::Type::OTHER));
         }
-#endif
+#ifdef DT_UNKNOWN
       }
-    }
+#endif
+    });
 
     auto result = entries.releaseAsArray();
     std::sort(result.begin(), result.end());
@@ -699,6 +710,28 @@ public:
     });
   }
 
+  Array<ReadableDirectory::EntryWithMetadata> listEntriesWithMetadata() const {
+    // One pass: each entry is stat()ed by name relative to `fd` as soon as it is read.
+    kj::Vector<ReadableDirectory::EntryWithMetadata> entries;
+
+    forEachEntry([&](const struct dirent& entry) {
+      struct stat stats;
+      KJ_SYSCALL_HANDLE_ERRORS(fstatat(fd, entry.d_name, &stats, AT_SYMLINK_NOFOLLOW)) {
+        case ENOENT:
+          // Removed since we read the directory.
+          return;
+        default:
+          KJ_FAIL_SYSCALL("fstatat(fd, name)", error, entry.d_name) { return; }
+      }
+      entries.add(ReadableDirectory::EntryWithMetadata {
+          heapString(entry.d_name), statToMetadata(stats) });
+    });
+
+    auto result = entries.releaseAsArray();
+    std::sort(result.begin(), result.end());
+    return result;
+  }
+
   bool exists(PathPtr path) const {
     KJ_SYSCALL_HANDLE_ERRORS(faccessat(fd, path.toString().cStr(), F_OK, 0)) {
       case ENOENT:
@@ -1545,6 +1578,9 @@ public:
 
   Array<String> listNames() const override { return DiskHandle::listNames(); }
   Array<Entry> listEntries() const override { return DiskHandle::listEntries(); }
+  Array<EntryWithMetadata> listEntriesWithMetadata() const override {
+    return DiskHandle::listEntriesWithMetadata();
+  }
   bool exists(PathPtr path) const override { return DiskHandle::exists(path); }
   Maybe<FsNode::Metadata> tryLstat(PathPtr path) const override {
     return DiskHandle::tryLstat(path);
@@ -1566,6 +1602,9 @@ public:
 
   Array<String> listNames() const override { return DiskHandle::listNames(); }
   Array<Entry> listEntries() const override { return DiskHandle::listEntries(); }
+  Array<EntryWithMetadata> listEntriesWithMetadata() const override {
+    return DiskHandle::listEntriesWithMetadata();
+  }
   bool exists(PathPtr path) const override { return DiskHandle::exists(path); }
   Maybe<FsNode::Metadata> tryLstat(PathPtr path) const override {
     return DiskHandle::tryLstat(path);
@@ -399,6 +399,44 @@ KJ_TEST("InMemoryFile::copy()") {
   KJ_EXPECT(dest->readAllText().slice(321) == bigString);
 }
 
+KJ_TEST("InMemoryFile::copy() shares contents until modified") {
+  TestClock clock;
+
+  auto source = newInMemoryFile(clock);
+  source->writeAll("foobarbaz");
+
+  // Whole-file copies into empty files share the source's buffer.
+  auto copy1 = newInMemoryFile(clock);
+  auto copy2 = newInMemoryFile(clock);
+  KJ_EXPECT(copy1->copy(0, *source, 0, kj::maxValue) == 9);
+  clock.expectChanged(*copy1);
+  KJ_EXPECT(copy2->copy(0, *copy1, 0, kj::maxValue) == 9);
+  KJ_EXPECT(copy1->readAllText() == "foobarbaz");
+  KJ_EXPECT(copy2->readAllText() == "foobarbaz");
+
+  // Modifying any of them leaves the others alone.
+  source->write(0, StringPtr("qux").asBytes());
+  copy1->truncate(3);
+  KJ_EXPECT(source->readAllText() == "quxbarbaz");
+  KJ_EXPECT(copy1->readAllText() == "foo");
+  KJ_EXPECT(copy2->readAllText() == "foobarbaz");
+
+  // A mapping still sees later writes to a file whose buffer was shared.
+  auto copy3 = newInMemoryFile(clock);
+  copy3->copy(0, *copy2, 0, kj::maxValue);
+  auto mapping = copy3->mmap(0, 9);
+  copy3->write(3, StringPtr("BAR").asBytes());
+  KJ_EXPECT(kj::str(mapping.asChars()) == "fooBARbaz");
+  KJ_EXPECT(copy2->readAllText() == "foobarbaz");
+
+  // A file with a mapping can't share its buffer, so copying it copies the bytes.
+  auto copy4 = newInMemoryFile(clock);
+  copy4->copy(0, *copy3, 0, kj::maxValue);
+  copy3->write(0, StringPtr("FOO").asBytes());
+  KJ_EXPECT(copy4->readAllText() == "fooBARbaz");
+  KJ_EXPECT(kj::str(mapping.asChars()) == "FOOBARbaz");
+}
+
 KJ_TEST("File::copy()") {
   TestClock clock;
 
@@ -749,5 +787,68 @@ KJ_TEST("InMemoryDirectory createTemporary") {
   KJ_EXPECT(dir->listNames() == nullptr);
 }
 
+KJ_TEST("newCachingDirectory()") {
+  TestClock clock;
+
+  auto dir = newInMemoryDirectory(clock);
+  dir->openFile(Path("foo"), WriteMode::CREATE)->writeAll("foo");
+  dir->openFile(Path("bar"), WriteMode::CREATE)->writeAll("bar");
+
+  auto cached = newCachingDirectory(dir->clone(), clock);
+
+  // The directory changed within the current tick, so its listing can't be trusted yet.
+  KJ_EXPECT(cached->listNames().size() == 2);
+  dir->openFile(Path("baz"), WriteMode::CREATE)->writeAll("baz");
+  KJ_EXPECT(cached->exists(Path("baz")));
+
+  clock.tick();
+  {
+    auto list = cached->listEntries();
+    KJ_ASSERT(list.size() == 3);
+    KJ_EXPECT(list[0].name == "bar");
+    KJ_EXPECT(list[1].name == "baz");
+    KJ_EXPECT(list[2].name == "foo");
+  }
+  KJ_EXPECT(cached->tryOpenFile(Path("qux")) == nullptr);
+  KJ_EXPECT(cached->tryOpenSubdir(Path({"qux", "corge"})) == nullptr);
+  KJ_EXPECT(cached->tryLstat(Path("qux")) == nullptr);
+  KJ_EXPECT(cached->openFile(Path("foo"))->readAllText() == "foo");
+
+  // Any change to the directory invalidates the listing.
+  dir->openFile(Path("qux"), WriteMode::CREATE)->writeAll("qux");
+  KJ_EXPECT(cached->openFile(Path("qux"))->readAllText() == "qux");
+  clock.tick();
+  KJ_EXPECT(cached->listNames().size() == 4);
+  dir->remove(Path("qux"));
+  KJ_EXPECT(!cached->exists(Path("qux")));
+  KJ_EXPECT(cached->listNames().size() == 3);
+
+  {
+    auto list = cached->listEntriesWithMetadata();
+    KJ_ASSERT(list.size() == 3);
+    KJ_EXPECT(list[0].name == "bar");
+    KJ_EXPECT(list[0].metadata.type == FsNode::Type::FILE);
+    KJ_EXPECT(list[0].metadata.size == 3);
+  }
+}
+
+KJ_TEST("newCachingDirectory() trusts an unchanged stat()") {
+  // A directory whose timestamps never move hides additions from the cache. This is the case
+  // the one-tick guard exists for; here it demonstrates that listings really are reused.
+  TestClock clock;
+  clock.tick();
+
+  auto dir = newInMemoryDirectory(nullClock());
+  dir->openFile(Path("foo"), WriteMode::CREATE)->writeAll("foo");
+
+  auto cached = newCachingDirectory(dir->clone(), clock);
+  KJ_EXPECT(cached->listNames().size() == 1);
+
+  dir->openFile(Path("bar"), WriteMode::CREATE)->writeAll("bar");
+  KJ_EXPECT(dir->exists(Path("bar")));
+  KJ_EXPECT(!cached->exists(Path("bar")));
+  KJ_EXPECT(cached->listNames().size() == 1);
+}
+
 }  // namespace
 }  // namespace kj
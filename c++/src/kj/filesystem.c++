@@ -26,7 +26,8 @@
 #include "encoding.h"
 #include "refcount.h"
 #include "mutex.h"
-#include <map>
+#include "map.h"
+#include <algorithm>
 
 namespace kj {
 
@@ -560,6 +561,17 @@ Own<const ReadableDirectory> ReadableDirectory::openSubdir(PathPtr path) const {
   }
 }
 
+Array<ReadableDirectory::EntryWithMetadata> ReadableDirectory::listEntriesWithMetadata() const {
+  auto names = listNames();
+  auto result = heapArrayBuilder<EntryWithMetadata>(names.size());
+  for (auto& name: names) {
+    KJ_IF_MAYBE(metadata, tryLstat(Path(heapString(name)))) {
+      result.add(EntryWithMetadata { kj::mv(name), *metadata });
+    }
+  }
+  return result.finish();
+}
+
 String ReadableDirectory::readlink(PathPtr path) const {
   KJ_IF_MAYBE(p, tryReadlink(path)) {
     return kj::mv(*p);
@@ -798,17 +810,18 @@ public:
     }
 
     size_t readSize = kj::min(buffer.size(), lock->size - offset);
-    memcpy(buffer.begin(), lock->bytes.begin() + offset, readSize);
+    memcpy(buffer.begin(), lock->contents().begin() + offset, readSize);
     return readSize;
   }
 
   Array<const byte> mmap(uint64_t offset, uint64_t size) const override {
     KJ_REQUIRE(offset + size >= offset, "mmap() request overflows uint64");
     auto lock = impl.lockExclusive();
-    lock->ensureCapacity(offset + size);
+    // The mapping must see later writes, so it can't share a buffer with a copy of this file.
+    auto bytes = lock->ensureWritable(offset + size);
 
     ArrayDisposer* disposer = new MmapDisposer(atomicAddRef(*this));
-    return Array<const byte>(lock->bytes.begin() + offset, size, *disposer);
+    return Array<const byte>(bytes.begin() + offset, size, *disposer);
   }
 
   Array<byte> mmapPrivate(uint64_t offset, uint64_t size) const override {
@@ -834,9 +847,9 @@ public:
     lock->modified();
     uint64_t end = offset + data.size();
     KJ_REQUIRE(end >= offset, "write() request overflows uint64");
-    lock->ensureCapacity(end);
+    auto bytes = lock->ensureWritable(end);
     lock->size = kj::max(lock->size, end);
-    memcpy(lock->bytes.begin() + offset, data.begin(), data.size());
+    memcpy(bytes.begin() + offset, data.begin(), data.size());
   }
 
   void zero(uint64_t offset, uint64_t zeroSize) const override {
@@ -845,20 +858,21 @@ public:
     lock->modified();
     uint64_t end = offset + zeroSize;
     KJ_REQUIRE(end >= offset, "zero() request overflows uint64");
-    lock->ensureCapacity(end);
+    auto bytes = lock->ensureWritable(end);
     lock->size = kj::max(lock->size, end);
-    memset(lock->bytes.begin() + offset, 0, zeroSize);
+    memset(bytes.begin() + offset, 0, zeroSize);
   }
 
   void truncate(uint64_t newSize) const override {
     auto lock = impl.lockExclusive();
     if (newSize < lock->size) {
       lock->modified();
-      memset(lock->bytes.begin() + newSize, 0, lock->size - newSize);
+      auto bytes = lock->ensureWritable(lock->size);
+      memset(bytes.begin() + newSize, 0, lock->size - newSize);
       lock->size = newSize;
     } else if (newSize > lock->size) {
       lock->modified();
-      lock->ensureCapacity(newSize);
+      lock->ensureWritable(newSize);
       lock->size = newSize;
     }
   }
@@ -867,8 +881,8 @@ public:
     uint64_t end = offset + size;
     KJ_REQUIRE(end >= offset, "mmapWritable() request overflows uint64");
     auto lock = impl.lockExclusive();
-    lock->ensureCapacity(end);
-    return heap<WritableFileMappingImpl>(atomicAddRef(*this), lock->bytes.slice(offset, end));
+    auto bytes = lock->ensureWritable(end);
+    return heap<WritableFileMappingImpl>(atomicAddRef(*this), bytes.slice(offset, end));
   }
 
   size_t copy(uint64_t offset, const ReadableFile& from,
@@ -882,12 +896,27 @@ public:
 
     auto lock = impl.lockExclusive();
 
+    if (offset == 0 && fromOffset == 0 && lock->size == 0 && lock->mmapCount == 0) {
+      KJ_IF_MAYBE(source, dynamicDowncastIfAvailable<const InMemoryFile>(from)) {
+        // Copying the whole of another in-memory file into an empty one: just share its buffer.
+        // Whichever file is modified first will make its own copy.
+        auto fromLock = source->impl.lockShared();
+        if (fromLock->mmapCount == 0 && fromLock->buffer.get() != nullptr &&
+            fromLock->size <= copySize) {
+          lock->buffer = atomicAddRef(*fromLock->buffer);
+          lock->size = fromLock->size;
+          lock->modified();
+          return lock->size;
+        }
+      }
+    }
+
     // Allocate space for the copy.
     uint64_t end = offset + copySize;
-    lock->ensureCapacity(end);
+    auto bytes = lock->ensureWritable(end);
 
     // Read directly into our backing store.
-    size_t n = from.read(fromOffset, lock->bytes.slice(offset, end));
+    size_t n = from.read(fromOffset, bytes.slice(offset, end));
     lock->size = kj::max(lock->size, offset + n);
 
     lock->modified();
@@ -895,25 +924,47 @@ public:
   }
 
 private:
+  struct Buffer: public AtomicRefcounted {
+    // A file's contents. Copying a whole file shares the buffer, so it may belong to several files
+    // at once, in which case none of them may modify it.
+
+    Array<byte> bytes;
+
+    explicit Buffer(Array<byte> bytes): bytes(kj::mv(bytes)) {}
+  };
+
   struct Impl {
     const Clock& clock;
-    Array<byte> bytes;
-    size_t size = 0;     // bytes may be larger than this to accommodate mmaps
+    Own<const Buffer> buffer;  // null if the file has never had any content
+    size_t size = 0;           // the buffer may be larger than this to accommodate mmaps
     Date lastModified;
-    uint mmapCount = 0;  // number of mappings outstanding
+    uint mmapCount = 0;        // number of mappings outstanding; while nonzero, not shared
 
     Impl(const Clock& clock): clock(clock), lastModified(clock.now()) {}
 
-    void ensureCapacity(size_t capacity) {
-      if (bytes.size() < capacity) {
+    ArrayPtr<const byte> contents() const {
+      return buffer.get() == nullptr ? nullptr : buffer->bytes.asPtr();
+    }
+
+    ArrayPtr<byte> ensureWritable(size_t capacity) {
+      // Make sure the buffer holds at least `capacity` bytes and belongs to this file alone, then
+      // return it for modification. Bytes past `size` are always zero.
+
+      size_t current = buffer.get() == nullptr ? 0 : buffer->bytes.size();
+      if (current < capacity || (buffer.get() != nullptr && buffer->isShared())) {
         KJ_ASSERT(mmapCount == 0,
             "InMemoryFile cannot resize the file backing store while memory mappings exist.");
 
-        auto newBytes = heapArray<byte>(kj::max(capacity, bytes.size() * 2));
-        memcpy(newBytes.begin(), bytes.begin(), size);
+        auto newBytes = heapArray<byte>(current < capacity ? kj::max(capacity, current * 2)
+                                                           : current);
+        if (size > 0) memcpy(newBytes.begin(), buffer->bytes.begin(), size);
         memset(newBytes.begin() + size, 0, newBytes.size() - size);
-        bytes = kj::mv(newBytes);
+        buffer = atomicRefcounted<Buffer>(kj::mv(newBytes));
       }
+      if (buffer.get() == nullptr) return nullptr;
+
+      // const_cast OK because no other file holds this buffer.
+      return arrayPtr(const_cast<byte*>(buffer->bytes.begin()), buffer->bytes.size());
     }
 
     void modified() {
@@ -996,24 +1047,28 @@ public:
 
   Array<String> listNames() const override {
     auto lock = impl.lockShared();
-    return KJ_MAP(e, lock->entries) { return heapString(e.first); };
+    auto result = KJ_MAP(e, lock->entries) { return heapString(e.key); };
+    std::sort(result.begin(), result.end());
+    return result;
   }
 
   Array<Entry> listEntries() const override {
     auto lock = impl.lockShared();
-    return KJ_MAP(e, lock->entries) {
+    auto result = KJ_MAP(e, lock->entries) {
       FsNode::Type type;
-      if (e.second.node.is<SymlinkNode>()) {
+      if (e.value.node.is<SymlinkNode>()) {
         type = FsNode::Type::SYMLINK;
-      } else if (e.second.node.is<FileNode>()) {
+      } else if (e.value.node.is<FileNode>()) {
         type = FsNode::Type::FILE;
       } else {
-        KJ_ASSERT(e.second.node.is<DirectoryNode>());
+        KJ_ASSERT(e.value.node.is<DirectoryNode>());
         type = FsNode::Type::DIRECTORY;
       }
 
-      return Entry { type, heapString(e.first) };
+      return Entry { type, heapString(e.key) };
     };
+    std::sort(result.begin(), result.end());
+    return result;
   }
 
   bool exists(PathPtr path) const override {
@@ -1330,13 +1385,11 @@ public:
       KJ_FAIL_REQUIRE("can't remove self from self") { return false; }
     } else if (path.size() == 1) {
       auto lock = impl.lockExclusive();
-      auto iter = lock->entries.find(path[0]);
-      if (iter == lock->entries.end()) {
-        return false;
-      } else {
-        lock->entries.erase(iter);
+      if (lock->entries.erase(path[0])) {
         lock->modified();
         return true;
+      } else {
+        return false;
       }
     } else {
       KJ_IF_MAYBE(child, tryGetParent(path[0], WriteMode::MODIFY)) {
@@ -1441,32 +1494,28 @@ private:
   struct Impl {
     const Clock& clock;
 
-    std::map<StringPtr, EntryImpl> entries;
-    // Note: If this changes to a non-sorted map, listNames() and listEntries() must be updated to
-    //   sort their results.
+    HashMap<StringPtr, EntryImpl> entries;
+    // Keys point into each entry's `name`, which stays put when the entry is moved. The map is
+    // unordered, so listNames() and listEntries() sort their results.
 
     Date lastModified;
 
     Impl(const Clock& clock): clock(clock), lastModified(clock.now()) {}
 
     Maybe<EntryImpl&> openEntry(kj::StringPtr name, WriteMode mode) {
-      // TODO(perf): We could avoid a copy if the entry exists, at the expense of a double-lookup
-      //   if it doesn't. Maybe a better map implementation will solve everything?
-      return openEntry(heapString(name), mode);
-    }
-
-    Maybe<EntryImpl&> openEntry(String&& name, WriteMode mode) {
       if (has(mode, WriteMode::CREATE)) {
-        EntryImpl entry(kj::mv(name));
-        StringPtr nameRef = entry.name;
-        auto insertResult = entries.insert(std::make_pair(nameRef, kj::mv(entry)));
+        bool created = false;
+        auto& entry = entries.findOrCreate(name, [&]() {
+          created = true;
+          return makeEntry(heapString(name));
+        });
 
-        if (!insertResult.second && !has(mode, WriteMode::MODIFY)) {
+        if (!created && !has(mode, WriteMode::MODIFY)) {
           // Entry already existed and MODIFY not specified.
           return nullptr;
         }
 
-        return insertResult.first->second;
+        return entry;
       } else if (has(mode, WriteMode::MODIFY)) {
         return tryGetEntry(name);
       } else {
@@ -1475,22 +1524,18 @@ private:
       }
     }
 
+    static HashMap<StringPtr, EntryImpl>::Entry makeEntry(String&& name) {
+      EntryImpl entry(kj::mv(name));
+      StringPtr nameRef = entry.name;
+      return { nameRef, kj::mv(entry) };
+    }
+
     kj::Maybe<const EntryImpl&> tryGetEntry(kj::StringPtr name) const {
-      auto iter = entries.find(name);
-      if (iter == entries.end()) {
-        return nullptr;
-      } else {
-        return iter->second;
-      }
+      return entries.find(name);
     }
 
     kj::Maybe<EntryImpl&> tryGetEntry(kj::StringPtr name) {
-      auto iter = entries.find(name);
-      if (iter == entries.end()) {
-        return nullptr;
-      } else {
-        return iter->second;
-      }
+      return entries.find(name);
     }
 
     void modified() {
@@ -1535,7 +1580,7 @@ private:
                          filename);
                 } else {
                   StringPtr nameRef = newEntry.name;
-                  cpim.entries.insert(std::make_pair(nameRef, kj::mv(newEntry)));
+                  cpim.entries.insert(nameRef, kj::mv(newEntry));
                 }
               }
               entry.set(kj::mv(copy));
@@ -1722,6 +1767,112 @@ private:
   Own<const File> file;
 };
 
+// -----------------------------------------------------------------------------
+
+class CachingDirectory final: public ReadableDirectory, public AtomicRefcounted {
+public:
+  CachingDirectory(Own<const ReadableDirectory> inner, const Clock& clock)
+      : inner(kj::mv(inner)), clock(clock) {}
+
+  Own<const FsNode> cloneFsNode() const override { return atomicAddRef(*this); }
+  Maybe<int> getFd() const override { return inner->getFd(); }
+  Metadata stat() const override { return inner->stat(); }
+  void sync() const override { inner->sync(); }
+  void datasync() const override { inner->datasync(); }
+
+  Array<String> listNames() const override {
+    auto lock = cache.lockExclusive();
+    return KJ_MAP(entry, refresh(*lock)) { return heapString(entry.name); };
+  }
+
+  Array<Entry> listEntries() const override {
+    auto lock = cache.lockExclusive();
+    return KJ_MAP(entry, refresh(*lock)) { return Entry { entry.type, heapString(entry.name) }; };
+  }
+
+  Array<EntryWithMetadata> listEntriesWithMetadata() const override {
+    // Entries' metadata can change without the directory changing, so this isn't cached.
+    return inner->listEntriesWithMetadata();
+  }
+
+  bool exists(PathPtr path) const override {
+    return mightExist(path) && inner->exists(path);
+  }
+
+  Maybe<FsNode::Metadata> tryLstat(PathPtr path) const override {
+    if (!mightExist(path)) return nullptr;
+    return inner->tryLstat(path);
+  }
+
+  Maybe<Own<const ReadableFile>> tryOpenFile(PathPtr path) const override {
+    if (!mightExist(path)) return nullptr;
+    return inner->tryOpenFile(path);
+  }
+
+  Maybe<Own<const ReadableDirectory>> tryOpenSubdir(PathPtr path) const override {
+    if (!mightExist(path)) return nullptr;
+    return inner->tryOpenSubdir(path);
+  }
+
+  Maybe<String> tryReadlink(PathPtr path) const override {
+    if (!mightExist(path)) return nullptr;
+    return inner->tryReadlink(path);
+  }
+
+private:
+  struct Cache {
+    Array<Entry> entries;  // sorted by name
+    Maybe<Metadata> validFor;
+    // The directory's stat() when `entries` was read, or null if `entries` must be re-read.
+  };
+
+  Own<const ReadableDirectory> inner;
+  const Clock& clock;
+  MutexGuarded<Cache> cache;
+
+  static bool sameNode(const Metadata& a, const Metadata& b) {
+    return a.type == b.type && a.size == b.size && a.lastModified == b.lastModified &&
+           a.linkCount == b.linkCount && a.hashCode == b.hashCode;
+  }
+
+  ArrayPtr<const Entry> refresh(Cache& cache) const {
+    auto metadata = inner->stat();
+    KJ_IF_MAYBE(valid, cache.validFor) {
+      if (sameNode(*valid, metadata)) return cache.entries;
+    }
+
+    cache.entries = inner->listEntries();
+    if (clock.now() - metadata.lastModified >= 1 * SECONDS) {
+      cache.validFor = metadata;
+    } else {
+      cache.validFor = nullptr;
+    }
+    return cache.entries;
+  }
+
+  bool mightExist(PathPtr path) const {
+    // False if the first component of `path` definitely isn't in this directory.
+
+    if (path.size() == 0) return true;
+
+    auto lock = cache.lockExclusive();
+    auto entries = refresh(*lock);
+    StringPtr name = path[0];
+    size_t begin = 0, end = entries.size();
+    while (begin < end) {
+      size_t mid = (begin + end) / 2;
+      if (entries[mid].name < name) {
+        begin = mid + 1;
+      } else if (entries[mid].name == name) {
+        return true;
+      } else {
+        end = mid;
+      }
+    }
+    return false;
+  }
+};
+
 }  // namespace
 
 // -----------------------------------------------------------------------------
@@ -1735,5 +1886,9 @@ Own<Directory> newInMemoryDirectory(const Clock& clock) {
 Own<AppendableFile> newFileAppender(Own<const File> inner) {
   return heap<AppendableFileImpl>(kj::mv(inner));
 }
+Own<const ReadableDirectory> newCachingDirectory(Own<const ReadableDirectory> inner,
+                                                 const Clock& clock) {
+  return atomicRefcounted<CachingDirectory>(kj::mv(inner), clock);
+}
 
 } // namespace kj
@@ -535,6 +535,23 @@ public:
   // filesystems, this is just as fast as listNames(), but on others it may require stat()ing each
   // file.
 
+  struct EntryWithMetadata {
+    String name;
+    FsNode::Metadata metadata;
+
+    inline bool operator< (const EntryWithMetadata& other) const { return name <  other.name; }
+    inline bool operator> (const EntryWithMetadata& other) const { return name >  other.name; }
+    inline bool operator<=(const EntryWithMetadata& other) const { return name <= other.name; }
+    inline bool operator>=(const EntryWithMetadata& other) const { return name >= other.name; }
+  };
+
+  virtual Array<EntryWithMetadata> listEntriesWithMetadata() const;
+  // List the contents of the directory along with what lstat() would report for each entry,
+  // sorted by name. Entries which disappear while the directory is being read are left out.
+  //
+  // The default implementation calls tryLstat() on each of listNames(). Disk directories stat
+  // each entry relative to the open directory as it is read.
+
   virtual bool exists(PathPtr path) const = 0;
   // Does the specified path exist?
   //
@@ -929,6 +946,19 @@ Own<Directory> newInMemoryDirectory(const Clock& clock);
 // - link() and rename() accept any kind of Directory as `fromDirectory` -- it doesn't need to be
 //   another InMemoryDirectory. However, for rename(), the from path must be a directory.
 
+Own<const ReadableDirectory> newCachingDirectory(Own<const ReadableDirectory> inner,
+                                                 const Clock& clock);
+// Wraps `inner` so that its listing is read once and then reused for as long as the directory's
+// own stat() stays the same -- that is, until an entry is added, removed, or renamed. Besides
+// listNames() and listEntries(), lookups of any path whose first component isn't listed are
+// answered from the cache, so probing a list of search directories for a file costs one stat()
+// per directory rather than a failed open(). Lookups of paths that do exist, and everything about
+// files themselves, still go to `inner`.
+//
+// `clock` must agree with the directory's timestamps (use systemCalendarClock() for disk
+// directories). A listing read less than a second after the directory last changed isn't reused,
+// since another change within the same timestamp tick would go unnoticed.
+
 Own<AppendableFile> newFileAppender(Own<const File> inner);
 // Creates an AppendableFile by wrapping a File. Note that this implementation assumes it is the
 // only writer. A correct implementation should always append to the file even if other writes
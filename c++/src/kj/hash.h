@@ -0,0 +1,134 @@
+// Copyright (c) 2018 Kenton Varda and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#pragma once
+
+#if defined(__GNUC__) && !KJ_HEADER_WARNINGS
+#pragma GCC system_header
+#endif
+
+#include "string.h"
+#include <stdint.h>
+
+namespace kj {
+namespace _ {  // private
+
+struct HashCoder {
+  // This is a dummy type with only one instance: HASHCODER (below).  To make an arbitrary type
+  // hashable, define `operator*(HashCoder, T)` to return any other type that is already hashable.
+  // Be sure to declare the operator in the same namespace as `T` **or** in the global scope.
+  // You can use the KJ_HASHCODE() macro as syntax sugar for this.
+  //
+  // A more usual way to accomplish what we're doing here would be to require that you define
+  // a function like `hashCode(T)` and then rely on argument-dependent lookup.  However, this has
+  // the problem that it pollutes other people's namespaces and even the global namespace.  For
+  // example, some other project may already have functions called `hashCode` which do something
+  // different.  Declaring `operator*` with `HashCoder` as the left operand cannot conflict with
+  // anything.
+  //
+  // Alternatively, a type may simply define a `hashCode()` const method.
+
+  uint operator*(ArrayPtr<const byte> s) const;
+  inline uint operator*(ArrayPtr<byte> s) const { return operator*(s.asConst()); }
+  inline uint operator*(ArrayPtr<const char> s) const { return operator*(s.asBytes()); }
+  inline uint operator*(ArrayPtr<char> s) const { return operator*(s.asBytes().asConst()); }
+  inline uint operator*(StringPtr s) const { return operator*(s.asBytes()); }
+  inline uint operator*(const String& s) const { return operator*(s.asBytes()); }
+  // Strings and byte arrays are hashed by content.
+
+  inline uint operator*(char i) const { return i; }
+  inline uint operator*(signed char i) const { return i; }
+  inline uint operator*(unsigned char i) const { return i; }
+  inline uint operator*(signed short i) const { return i; }
+  inline uint operator*(unsigned short i) const { return i; }
+  inline uint operator*(signed int i) const { return i; }
+  inline uint operator*(unsigned int i) const { return i; }
+  inline uint operator*(signed long i) const {
+    return operator*(static_cast<unsigned long long>(i));
+  }
+  inline uint operator*(unsigned long i) const {
+    return operator*(static_cast<unsigned long long>(i));
+  }
+  inline uint operator*(signed long long i) const {
+    return operator*(static_cast<unsigned long long>(i));
+  }
+  inline uint operator*(unsigned long long i) const {
+    return static_cast<uint>(i) ^ static_cast<uint>(i >> 32);
+  }
+  // Integers hash to themselves (folded to 32 bits).  Tables are expected to mix the bits, e.g.
+  // using kj::_::mixHash(), rather than rely on the low bits being well-distributed.
+
+  template <typename T>
+  inline uint operator*(T* ptr) const {
+    return operator*(static_cast<unsigned long long>(reinterpret_cast<uintptr_t>(ptr)));
+  }
+  // Pointers hash by identity.
+
+  template <typename T>
+  inline auto operator*(const T& value) const -> decltype(value.hashCode()) {
+    return value.hashCode();
+  }
+};
+static KJ_CONSTEXPR(const) HashCoder HASHCODER = HashCoder();
+
+inline uint mixHash(uint h) {
+  // Finalizer from MurmurHash3. Hash tables indexed by the low bits of hashCode() apply this so
+  // that keys like pointers or round numbers, whose low bits are all alike, still spread out.
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+inline uint HashCoder::operator*(ArrayPtr<const byte> s) const {
+  // 32-bit FNV-1a.
+  uint result = 2166136261u;
+  for (byte b: s) {
+    result = (result ^ b) * 16777619u;
+  }
+  return result;
+}
+
+}  // namespace _ (private)
+
+#define KJ_HASHCODE(...) operator*(::kj::_::HashCoder, __VA_ARGS__)
+// Defines a hash function for a custom type.  Example:
+//
+//    class Foo {...};
+//    inline uint KJ_HASHCODE(const Foo& foo) { return kj::hashCode(foo.x, foo.y); }
+//
+// This allows Foo to be passed to hashCode() and used as a key in kj::HashMap.
+
+template <typename T>
+inline uint hashCode(T&& value) { return _::HASHCODER * kj::fwd<T>(value); }
+// Returns a hash code for `value`.  Integers, pointers, and strings are supported out of the box;
+// other types can define a `hashCode()` method or use KJ_HASHCODE().
+
+template <typename T, typename... Rest>
+inline uint hashCode(T&& first, Rest&&... rest) {
+  // Combines the hash codes of several values, e.g. the members of a struct.
+  return hashCode(kj::fwd<T>(first)) * 31 + hashCode(kj::fwd<Rest>(rest)...);
+}
+
+}  // namespace kj
@@ -0,0 +1,198 @@
+// Copyright (c) 2018 Kenton Varda and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include "map.h"
+#include "test.h"
+
+namespace kj {
+namespace {
+
+KJ_TEST("HashMap") {
+  HashMap<String, int> map;
+  KJ_EXPECT(map.empty());
+  KJ_EXPECT(map.find("foo"_kj) == nullptr);
+  KJ_EXPECT(!map.erase("foo"_kj));
+
+  map.insert(kj::str("foo"), 123);
+  map.insert(kj::str("bar"), 456);
+  KJ_EXPECT(map.size() == 2);
+
+  // Looked up by StringPtr, not String.
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find("foo"_kj)) == 123);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find("bar"_kj)) == 456);
+  KJ_EXPECT(map.find("baz"_kj) == nullptr);
+
+  KJ_EXPECT_THROW_MESSAGE("already contains", map.insert(kj::str("foo"), 789));
+
+  KJ_EXPECT(map.findOrCreate("foo"_kj, []() -> HashMap<String, int>::Entry {
+    KJ_FAIL_EXPECT("shouldn't be called");
+    return { kj::str("foo"), 0 };
+  }) == 123);
+  KJ_EXPECT(map.findOrCreate("baz"_kj, []() -> HashMap<String, int>::Entry {
+    return { kj::str("baz"), 789 };
+  }) == 789);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find("baz"_kj)) == 789);
+
+  // Iteration is in insertion order.
+  {
+    auto iter = map.begin();
+    KJ_EXPECT(iter->key == "foo");
+    KJ_EXPECT((++iter)->key == "bar");
+    KJ_EXPECT((++iter)->key == "baz");
+    KJ_EXPECT(++iter == map.end());
+  }
+
+  KJ_EXPECT(map.erase("foo"_kj));
+  KJ_EXPECT(!map.erase("foo"_kj));
+  KJ_EXPECT(map.size() == 2);
+  KJ_EXPECT(map.find("foo"_kj) == nullptr);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find("bar"_kj)) == 456);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find("baz"_kj)) == 789);
+
+  // Clearing keeps the storage for reuse.
+  size_t heapSize = map.heapSize();
+  KJ_EXPECT(heapSize >= 2 * sizeof(HashMap<String, int>::Entry));
+
+  map.clear();
+  KJ_EXPECT(map.empty());
+  KJ_EXPECT(map.find("bar"_kj) == nullptr);
+  KJ_EXPECT(map.heapSize() == heapSize);
+}
+
+KJ_TEST("HashMap many entries") {
+  // Exercise growth, erasure, and reuse of erased buckets against a simple model.
+  HashMap<uint64_t, uint64_t> map;
+  constexpr uint64_t COUNT = 10000;
+
+  for (uint64_t i = 0; i < COUNT; i++) {
+    // Keys with identical low bits, like pointers, must still spread out.
+    map.insert(i << 12, i);
+  }
+  KJ_EXPECT(map.size() == COUNT);
+
+  for (uint64_t i = 0; i < COUNT; i += 2) {
+    KJ_EXPECT(map.erase(i << 12));
+  }
+  KJ_EXPECT(map.size() == COUNT / 2);
+
+  for (uint round = 0; round < 4; round++) {
+    for (uint64_t i = 0; i < COUNT; i += 2) {
+      map.insert(i << 12, i + round);
+    }
+    for (uint64_t i = 0; i < COUNT; i++) {
+      auto value = KJ_ASSERT_NONNULL(map.find(i << 12));
+      KJ_EXPECT(value == (i % 2 == 0 ? i + round : i), i, value);
+    }
+    for (uint64_t i = 0; i < COUNT; i += 2) {
+      KJ_EXPECT(map.erase(i << 12));
+    }
+  }
+
+  uint64_t sum = 0;
+  for (auto& entry: map) {
+    KJ_EXPECT(entry.key == entry.value << 12);
+    sum += entry.value;
+  }
+  KJ_EXPECT(sum == (COUNT / 2) * (COUNT / 2));  // sum of odd numbers below COUNT
+}
+
+struct CaseInsensitiveCallbacks {
+  uint hashCode(StringPtr s) const {
+    uint result = 0;
+    for (char c: s) result = result * 31 + (c | 0x20);
+    return result;
+  }
+  bool matches(StringPtr a, StringPtr b) const {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+      if ((a[i] | 0x20) != (b[i] | 0x20)) return false;
+    }
+    return true;
+  }
+};
+
+KJ_TEST("HashMap custom callbacks") {
+  HashMap<StringPtr, uint, CaseInsensitiveCallbacks> map;
+  map.insert("Content-Type", 1);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find("content-type"_kj)) == 1);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find("CONTENT-TYPE"_kj)) == 1);
+  KJ_EXPECT(map.find("Content-Length"_kj) == nullptr);
+}
+
+struct ThrowOnMove {
+  // A value whose move constructor throws while `armed` is set.
+
+  static bool armed;
+
+  int value;
+  ThrowOnMove(int value): value(value) {}
+  ThrowOnMove(ThrowOnMove&& other): value(other.value) {
+    if (armed) KJ_FAIL_ASSERT("move failed");
+  }
+};
+bool ThrowOnMove::armed = false;
+
+KJ_TEST("HashMap insert that throws leaves the map unchanged") {
+  HashMap<uint, ThrowOnMove> map;
+  map.reserve(8);
+  map.insert(1, 10);
+  map.insert(2, 20);
+
+  ThrowOnMove::armed = true;
+  KJ_EXPECT_THROW_MESSAGE("move failed", map.findOrCreate(3u, []() {
+    return HashMap<uint, ThrowOnMove>::Entry { 3, 30 };
+  }));
+  ThrowOnMove::armed = false;
+
+  KJ_EXPECT(map.size() == 2);
+  KJ_EXPECT(map.find(3u) == nullptr);
+
+  // The row that failed to insert must not be reachable through a stale bucket.
+  map.insert(4, 40);
+  map.insert(3, 30);
+  KJ_EXPECT(map.size() == 4);
+  for (uint i = 1; i <= 4; i++) {
+    KJ_EXPECT(KJ_ASSERT_NONNULL(map.find(i)).value == i * 10);
+  }
+}
+
+struct Point {
+  int x, y;
+  bool operator==(const Point& other) const { return x == other.x && y == other.y; }
+  uint hashCode() const { return kj::hashCode(x, y); }
+};
+
+KJ_TEST("hashCode") {
+  KJ_EXPECT(hashCode("foo"_kj) == hashCode(kj::str("foo")));
+  KJ_EXPECT(hashCode("foo"_kj) != hashCode("bar"_kj));
+  KJ_EXPECT(hashCode(123) == hashCode(123u));
+  KJ_EXPECT(hashCode(Point { 1, 2 }) == hashCode(1, 2));
+  KJ_EXPECT(hashCode(Point { 1, 2 }) != hashCode(Point { 2, 1 }));
+
+  HashMap<Point, int> map;
+  map.insert(Point { 1, 2 }, 3);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find(Point { 1, 2 })) == 3);
+  KJ_EXPECT(map.find(Point { 2, 1 }) == nullptr);
+}
+
+}  // namespace
+}  // namespace kj
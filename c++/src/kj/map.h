@@ -0,0 +1,280 @@
+// Copyright (c) 2018 Kenton Varda and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#pragma once
+
+#if defined(__GNUC__) && !KJ_HEADER_WARNINGS
+#pragma GCC system_header
+#endif
+
+#include "hash.h"
+#include "vector.h"
+#include "debug.h"
+
+namespace kj {
+
+struct HashMapDefaultCallbacks {
+  // Callbacks telling a HashMap how to hash and compare keys.  The default uses kj::hashCode()
+  // and operator==.  A custom callbacks type -- e.g. one implementing case-insensitive string
+  // matching -- must provide the same two methods, for every key type the map will be queried
+  // with.
+
+  template <typename KeyLike>
+  inline uint hashCode(const KeyLike& key) const { return kj::hashCode(key); }
+
+  template <typename Key, typename KeyLike>
+  inline bool matches(const Key& key, const KeyLike& other) const { return key == other; }
+};
+
+template <typename Key, typename Value, typename Callbacks = HashMapDefaultCallbacks>
+class HashMap {
+  // A hash map using open addressing.
+  //
+  // Entries are stored contiguously in a Vector, in insertion order, and iterating the map walks
+  // that Vector.  A separate array of buckets, each holding a hash code and an index into the
+  // Vector, is probed linearly to find entries.  Compared to a node-based map like
+  // std::unordered_map, inserting an entry does not allocate (except when the map grows), and
+  // a lookup touches one bucket array and one entry array rather than chasing a linked list.
+  //
+  // Erasing an entry moves the last entry into its place, so iteration order is insertion order
+  // only as long as nothing has been erased.  Also unlike std::unordered_map, inserting or
+  // erasing any entry may move the others, so references to values are invalidated by any
+  // modification of the map.
+  //
+  // Lookup methods are templated so that a map may be queried with any type that can be hashed
+  // and compared to its keys, e.g. a HashMap<String, T> can be searched with a StringPtr.
+
+public:
+  struct Entry {
+    Key key;
+    Value value;
+  };
+
+  HashMap() = default;
+  explicit HashMap(Callbacks callbacks): callbacks(kj::mv(callbacks)) {}
+  HashMap(HashMap&& other) = default;
+  HashMap& operator=(HashMap&& other) = default;
+  KJ_DISALLOW_COPY(HashMap);
+
+  inline size_t size() const { return rows.size(); }
+  inline bool empty() const { return rows.size() == 0; }
+
+  inline Entry* begin() { return rows.begin(); }
+  inline Entry* end() { return rows.end(); }
+  inline const Entry* begin() const { return rows.begin(); }
+  inline const Entry* end() const { return rows.end(); }
+
+  size_t heapSize() const {
+    // Bytes of heap memory held by the map itself -- entry storage, including spare capacity, and
+    // buckets.  Anything the keys and values point to is not counted.
+    return rows.capacity() * sizeof(Entry) + buckets.size() * sizeof(Bucket);
+  }
+
+  void reserve(size_t size) {
+    // Make room for at least `size` entries without further allocation.
+    rows.reserve(size);
+    if (needsRehash(size)) rehash(size);
+  }
+
+  void clear() {
+    rows.clear();
+    for (auto& bucket: buckets) bucket = Bucket();
+    erasedCount = 0;
+  }
+
+  Value& insert(Key key, Value value) {
+    // Insert a new entry.  Throws if an entry with the same key is already present.
+
+    uint hash = hashOf(key);
+    KJ_REQUIRE(findRow(key, hash) == nullptr, "HashMap already contains this key") { break; }
+    return insertRow(hash, Entry { kj::mv(key), kj::mv(value) }).value;
+  }
+
+  template <typename KeyLike>
+  Maybe<Value&> find(const KeyLike& key) {
+    KJ_IF_MAYBE(row, findRow(key, hashOf(key))) {
+      return rows[*row].value;
+    } else {
+      return nullptr;
+    }
+  }
+  template <typename KeyLike>
+  Maybe<const Value&> find(const KeyLike& key) const {
+    KJ_IF_MAYBE(row, findRow(key, hashOf(key))) {
+      return rows[*row].value;
+    } else {
+      return nullptr;
+    }
+  }
+  // Search for a matching key.
+
+  template <typename KeyLike, typename Func>
+  Value& findOrCreate(const KeyLike& key, Func&& createEntry) {
+    // Search for a matching key.  If none is found, call `createEntry()`, which must return an
+    // Entry whose key matches `key`, and insert it.
+    //
+    // This avoids hashing the key twice, as a find() followed by an insert() would do.
+
+    uint hash = hashOf(key);
+    KJ_IF_MAYBE(row, findRow(key, hash)) {
+      return rows[*row].value;
+    } else {
+      return insertRow(hash, createEntry()).value;
+    }
+  }
+
+  template <typename KeyLike>
+  bool erase(const KeyLike& key) {
+    // Remove the entry matching `key`, if any.  Returns whether an entry was removed.
+
+    if (buckets.size() == 0) return false;
+
+    uint hash = hashOf(key);
+    for (uint i = hash & mask();; i = (i + 1) & mask()) {
+      auto& bucket = buckets[i];
+      if (bucket.isEmpty()) {
+        return false;
+      } else if (bucket.hash == hash && bucket.isRow() &&
+                 callbacks.matches(rows[bucket.row()].key, key)) {
+        uint row = bucket.row();
+        bucket.setErased();
+        ++erasedCount;
+        eraseRow(row);
+        return true;
+      }
+    }
+  }
+
+private:
+  struct Bucket {
+    uint hash = 0;
+    uint value = 0;
+    // 0 = empty, 1 = erased, otherwise (index into `rows`) + 2.
+
+    inline bool isEmpty() const { return value == 0; }
+    inline bool isRow() const { return value >= 2; }
+    inline uint row() const { return value - 2; }
+    inline void setRow(uint hash, uint row) { this->hash = hash; value = row + 2; }
+    inline void setErased() { value = 1; }
+  };
+
+  Callbacks callbacks;
+  Vector<Entry> rows;
+  Array<Bucket> buckets;
+  // Size is zero or a power of two.
+
+  size_t erasedCount = 0;
+  // Buckets marked erased.  These still lengthen probe sequences, so they count toward the load
+  // factor until the next rehash clears them.
+
+  inline uint mask() const { return buckets.size() - 1; }
+
+  template <typename KeyLike>
+  inline uint hashOf(const KeyLike& key) const { return _::mixHash(callbacks.hashCode(key)); }
+
+  template <typename KeyLike>
+  Maybe<uint> findRow(const KeyLike& key, uint hash) const {
+    if (buckets.size() == 0) return nullptr;
+
+    for (uint i = hash & mask();; i = (i + 1) & mask()) {
+      auto& bucket = buckets[i];
+      if (bucket.isEmpty()) {
+        return nullptr;
+      } else if (bucket.hash == hash && bucket.isRow() &&
+                 callbacks.matches(rows[bucket.row()].key, key)) {
+        return bucket.row();
+      }
+    }
+  }
+
+  inline bool needsRehash(size_t rowCount) const {
+    // Keep the load factor, counting erased buckets, at or below 2/3.
+    return (rowCount + erasedCount) * 3 > buckets.size() * 2;
+  }
+
+  void rehash(size_t targetRows) {
+    size_t newSize = 16;
+    while (newSize * 2 < targetRows * 3) newSize *= 2;
+
+    KJ_REQUIRE(newSize <= (1ull << 31), "HashMap too big");
+
+    auto newBuckets = heapArray<Bucket>(newSize);
+    for (auto& bucket: newBuckets) bucket = Bucket();
+    uint newMask = newSize - 1;
+
+    for (auto& bucket: buckets) {
+      if (bucket.isRow()) {
+        uint i = bucket.hash & newMask;
+        while (!newBuckets[i].isEmpty()) i = (i + 1) & newMask;
+        newBuckets[i] = bucket;
+      }
+    }
+
+    buckets = kj::mv(newBuckets);
+    erasedCount = 0;
+  }
+
+  Entry& insertRow(uint hash, Entry&& entry) {
+    if (needsRehash(rows.size() + 1)) {
+      // Size the new table for twice the current entries, so that it's a third full.  If erased
+      // buckets are what filled the old table, this may not grow it at all, just sweep them out.
+      rehash((rows.size() + 1) * 2);
+    }
+
+    // Add the row before pointing a bucket at it, so that if the add throws, the table is left as
+    // it was.
+    uint row = rows.size();
+    Entry& result = rows.add(kj::mv(entry));
+
+    for (uint i = hash & mask();; i = (i + 1) & mask()) {
+      auto& bucket = buckets[i];
+      if (!bucket.isRow()) {
+        if (!bucket.isEmpty()) --erasedCount;
+        bucket.setRow(hash, row);
+        break;
+      }
+    }
+
+    return result;
+  }
+
+  void eraseRow(uint row) {
+    // The bucket for `row` has already been cleared.  Fill the hole by moving the last row into
+    // it, and repoint the last row's bucket.
+
+    uint last = rows.size() - 1;
+    if (row != last) {
+      uint hash = hashOf(rows[last].key);
+      for (uint i = hash & mask();; i = (i + 1) & mask()) {
+        auto& bucket = buckets[i];
+        if (bucket.isRow() && bucket.row() == last) {
+          bucket.value = row + 2;
+          break;
+        }
+      }
+      rows[row] = kj::mv(rows[last]);
+    }
+    rows.removeLast();
+  }
+};
+
+}  // namespace kj
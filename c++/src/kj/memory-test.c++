@@ -22,6 +22,7 @@
 #include "memory.h"
 #include <kj/compat/gtest.h>
 #include "debug.h"
+#include "threadlocal.h"
 
 namespace kj {
 namespace {
@@ -289,6 +290,55 @@ TEST(Memory, OwnConstVoid) {
   }
 }
 
+struct PooledType {
+  PooledType(int i, bool& destroyed): i(i), destroyed(destroyed) {}
+  ~PooledType() { destroyed = true; }
+
+  int i;
+  bool& destroyed;
+
+  KJ_POOLED_ALLOCATION(PooledType)
+};
+
+struct ThrowingPooledType {
+  ThrowingPooledType() { KJ_FAIL_ASSERT("constructor failed"); }
+
+  KJ_POOLED_ALLOCATION(ThrowingPooledType)
+};
+
+TEST(Memory, PooledAllocation) {
+  auto before = getPooledAllocationStats();
+
+  for (int i = 0; i < 100; i++) {
+    bool destroyed = false;
+    Own<PooledType> ptr = heap<PooledType>(i, destroyed);
+    KJ_EXPECT(ptr->i == i);
+    KJ_EXPECT(reinterpret_cast<size_t>(ptr.get()) % alignof(PooledType) == 0);
+    ptr = nullptr;
+    KJ_EXPECT(destroyed);
+  }
+
+  // Non-pooled types still go to operator new and don't touch the pool.
+  auto mid = getPooledAllocationStats();
+  heap<int>(123);
+  KJ_EXPECT(getPooledAllocationStats().allocations == mid.allocations);
+
+#if !KJ_USE_PTHREAD_TLS
+  auto after = getPooledAllocationStats();
+  KJ_EXPECT(after.allocations - before.allocations == 100);
+  KJ_EXPECT(after.frees - before.frees == 100);
+  KJ_EXPECT(after.reused - before.reused >= 99);
+  KJ_EXPECT(after.cachedBytes > 0);
+#endif
+
+  // The memory goes back to the pool if the constructor throws.
+  KJ_EXPECT_THROW_MESSAGE("constructor failed", heap<ThrowingPooledType>());
+#if !KJ_USE_PTHREAD_TLS
+  auto afterThrow = getPooledAllocationStats();
+  KJ_EXPECT(afterThrow.allocations - afterThrow.frees == after.allocations - after.frees);
+#endif
+}
+
 // TODO(test):  More tests.
 
 }  // namespace
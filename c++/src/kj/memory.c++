@@ -20,9 +20,129 @@
 // THE SOFTWARE.
 
 #include "memory.h"
+#include "threadlocal.h"
 
 namespace kj {
 
 const NullDisposer NullDisposer::instance = NullDisposer();
 
+// =======================================================================================
+// Pooled allocation
+
+namespace {
+
+constexpr size_t POOL_GRANULARITY = alignof(void*) * 2;
+constexpr size_t POOL_CLASS_COUNT = 32;
+constexpr size_t POOL_MAX_SIZE = POOL_GRANULARITY * POOL_CLASS_COUNT;
+// Objects up to this size are pooled, in size classes POOL_GRANULARITY apart.  Anything bigger
+// goes straight to operator new.
+
+constexpr size_t POOL_MAX_CACHED_BYTES = 16384;
+// Per size class and thread.  Beyond this, freed memory goes back to operator delete.
+
+inline size_t poolClass(size_t size) {
+  return (size - 1) / POOL_GRANULARITY;
+}
+
+#if !KJ_USE_PTHREAD_TLS
+
+struct FreeBlock {
+  FreeBlock* next;
+};
+
+struct ThreadPoolCache {
+  // Each free list caches whole blocks obtained from operator new, so a block may be freed to
+  // any thread's cache, or to operator delete.
+
+  FreeBlock* freeLists[POOL_CLASS_COUNT] = {};
+  uint freeCounts[POOL_CLASS_COUNT] = {};
+  PooledAllocationStats stats;
+
+  ~ThreadPoolCache() noexcept(false);
+};
+
+thread_local bool threadPoolCacheDestroyed = false;
+thread_local ThreadPoolCache threadPoolCache;
+
+ThreadPoolCache::~ThreadPoolCache() noexcept(false) {
+  threadPoolCacheDestroyed = true;
+  for (FreeBlock*& list: freeLists) {
+    while (list != nullptr) {
+      FreeBlock* block = list;
+      list = block->next;
+      operator delete(block);
+    }
+  }
+}
+
+ThreadPoolCache* getThreadPoolCache() {
+  // Null once the thread has started exiting, after which its pooled objects are simply freed.
+  return threadPoolCacheDestroyed ? nullptr : &threadPoolCache;
+}
+
+#endif  // !KJ_USE_PTHREAD_TLS
+
+}  // namespace
+
+namespace _ {  // private
+
+void* allocatePooled(size_t size) {
+#if !KJ_USE_PTHREAD_TLS
+  if (size <= POOL_MAX_SIZE) {
+    ThreadPoolCache* cache = getThreadPoolCache();
+    if (cache != nullptr) {
+      size_t c = poolClass(size);
+      ++cache->stats.allocations;
+      FreeBlock* block = cache->freeLists[c];
+      if (block != nullptr) {
+        cache->freeLists[c] = block->next;
+        --cache->freeCounts[c];
+        ++cache->stats.reused;
+        cache->stats.cachedBytes -= (c + 1) * POOL_GRANULARITY;
+        return block;
+      }
+    }
+    return operator new((poolClass(size) + 1) * POOL_GRANULARITY);
+  }
+#endif
+
+  return operator new(size);
+}
+
+void freePooled(void* pointer, size_t size) {
+#if !KJ_USE_PTHREAD_TLS
+  if (size <= POOL_MAX_SIZE) {
+    ThreadPoolCache* cache = getThreadPoolCache();
+    if (cache != nullptr) {
+      size_t c = poolClass(size);
+      size_t blockSize = (c + 1) * POOL_GRANULARITY;
+      ++cache->stats.frees;
+
+      if (cache->freeCounts[c] * blockSize < POOL_MAX_CACHED_BYTES) {
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(pointer);
+        block->next = cache->freeLists[c];
+        cache->freeLists[c] = block;
+        ++cache->freeCounts[c];
+        cache->stats.cachedBytes += blockSize;
+        return;
+      }
+    }
+  }
+#endif
+
+  operator delete(pointer);
+}
+
+}  // namespace _ (private)
+
+PooledAllocationStats getPooledAllocationStats() {
+#if !KJ_USE_PTHREAD_TLS
+  ThreadPoolCache* cache = getThreadPoolCache();
+  if (cache != nullptr) {
+    return cache->stats;
+  }
+#endif
+  return PooledAllocationStats();
+}
+
 }  // namespace kj
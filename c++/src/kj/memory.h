@@ -390,6 +390,46 @@ private:
   friend const Own<U>* _::readMaybe(const Maybe<Own<U>>& maybe);
 };
 
+// =======================================================================================
+// Pooled allocation
+
+#define KJ_POOLED_ALLOCATION(type) \
+  static void* operator new(size_t size) { \
+    static_assert(alignof(type) <= alignof(void*) * 2, "over-aligned types can't be pooled"); \
+    return ::kj::_::allocatePooled(size); \
+  } \
+  static void operator delete(void* pointer, size_t size) { \
+    ::kj::_::freePooled(pointer, size); \
+  }
+// Place in the public section of a class's body to make `new type` -- and so kj::heap<type>(),
+// kj::refcounted<type>(), etc. -- take memory from per-thread free lists rather than going to
+// the global operator new and delete every time.  Worthwhile for small objects that are created
+// and destroyed at a high rate.  Subclasses inherit the pooling; since the deallocation is sized,
+// this works as long as the class hierarchy has a virtual destructor.
+
+namespace _ {  // private
+
+void* allocatePooled(size_t size);
+void freePooled(void* pointer, size_t size);
+// Memory for one object of the given size.  Objects allocated by one thread may be freed by
+// another, which then keeps the memory for its own use.
+
+}  // namespace _ (private)
+
+struct PooledAllocationStats {
+  // Counters for the calling thread's pool.
+
+  size_t allocations = 0;
+  size_t reused = 0;
+  // Allocations made, and how many of them were served from the free lists.
+
+  size_t frees = 0;
+  size_t cachedBytes = 0;
+  // Memory currently held in the free lists.
+};
+
+PooledAllocationStats getPooledAllocationStats();
+
 namespace _ {  // private
 
 template <typename T>
@@ -408,9 +448,8 @@ const HeapDisposer<T> HeapDisposer<T>::instance = HeapDisposer<T>();
 template <typename T, typename... Params>
 Own<T> heap(Params&&... params) {
   // heap<T>(...) allocates a T on the heap, forwarding the parameters to its constructor.  The
-  // exact heap implementation is unspecified -- for now it is operator new, but you should not
-  // assume this.  (Since we know the object size at delete time, we could actually implement an
-  // allocator that is more efficient than operator new.)
+  // exact heap implementation is unspecified -- for now it is operator new (which T may override,
+  // e.g. with KJ_POOLED_ALLOCATION), but you should not assume this.
 
   return Own<T>(new T(kj::fwd<Params>(params)...), _::HeapDisposer<T>::instance);
 }
@@ -84,13 +84,14 @@ TEST(Mutex, MutexGuarded) {
       *threadLock = 321;
     });
 
-#if KJ_USE_FUTEX
+#if !_WIN32
     // So, it turns out that pthread_rwlock on BSD "prioritizes" readers over writers.  The result
     // is that if one thread tries to take multiple read locks, but another thread happens to
     // request a write lock it between, you get a deadlock.  This seems to contradict the man pages
-    // and common sense, but this is how it is.  The futex-based implementation doesn't currently
-    // have this problem because it does not prioritize writers.  Perhaps it will in the future,
-    // but we'll leave this test here until then to make sure we notice the change.
+    // and common sense, but this is how it is.  Our own implementation (used everywhere but
+    // Windows) doesn't currently have this problem because it does not prioritize writers.
+    // Perhaps it will in the future, but we'll leave this test here until then to make sure we
+    // notice the change.
 
     delay();
     EXPECT_EQ(789u, *rlock1);
@@ -119,7 +120,6 @@ TEST(Mutex, MutexGuarded) {
   EXPECT_EQ(321u, value.getWithoutLock());
 }
 
-#if KJ_USE_FUTEX    // TODO(soon): Implement on pthread & win32
 TEST(Mutex, When) {
   MutexGuarded<uint> value(123);
 
@@ -170,7 +170,29 @@ TEST(Mutex, When) {
     KJ_EXPECT(*value.lockShared() == 101);
   }
 }
-#endif
+
+TEST(Mutex, Contended) {
+  // Lots of short critical sections, most of which should be acquired by spinning rather than by
+  // parking the thread.
+  MutexGuarded<uint> value(0);
+
+  {
+    auto threads = kj::heapArrayBuilder<kj::Own<kj::Thread>>(8);
+    for (auto i KJ_UNUSED: kj::zeroTo(8)) {
+      threads.add(kj::heap<kj::Thread>([&value]() {
+        for (uint j = 0; j < 10000; j++) {
+          if (j % 4 == 0) {
+            KJ_ASSERT(*value.lockShared() <= 8 * 7500);
+          } else {
+            ++*value.lockExclusive();
+          }
+        }
+      }));
+    }
+  }
+
+  KJ_EXPECT(*value.lockShared() == 8 * 7500);
+}
 
 TEST(Mutex, Lazy) {
   Lazy<uint> lazy;
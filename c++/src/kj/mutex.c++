@@ -47,14 +47,83 @@
 
 #elif _WIN32
 #include <windows.h>
+
+#else
+#include <pthread.h>
+#include <stdint.h>
 #endif
 
 namespace kj {
 namespace _ {  // private
 
+#if !_WIN32
+// =======================================================================================
+// Parking
+//
+// A thread that must wait for a lock sleeps until the lock's state word changes.  On Linux that's
+// exactly what futex() does.  Elsewhere we hash the word's address into a fixed table of condition
+// variables.  Unrelated words may share a slot, but callers always re-check the word after waking,
+// so that only costs a spurious wakeup.
+
 #if KJ_USE_FUTEX
+
+static inline void parkWhile(uint* word, uint expected) {
+  // Sleep while *word == expected (or until a spurious wakeup).
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static inline void unparkAll(uint* word) {
+  // Wake all threads parked on `word`.  `word` is only used as a key, so it need not still exist.
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+#else
+
+namespace {
+
+struct ParkingSlot {
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+};
+
+ParkingSlot parkingLot[64];
+
+ParkingSlot& parkingSlotFor(uint* word) {
+  return parkingLot[(reinterpret_cast<uintptr_t>(word) / sizeof(uint)) % kj::size(parkingLot)];
+}
+
+}  // namespace
+
+static void parkWhile(uint* word, uint expected) {
+  // Checking the word under the slot's mutex means a concurrent unparkAll() can't be missed: the
+  // waker changes the word before it takes the mutex.
+  auto& slot = parkingSlotFor(word);
+  pthread_mutex_lock(&slot.mutex);
+  if (__atomic_load_n(word, __ATOMIC_RELAXED) == expected) {
+    pthread_cond_wait(&slot.cond, &slot.mutex);
+  }
+  pthread_mutex_unlock(&slot.mutex);
+}
+
+static void unparkAll(uint* word) {
+  auto& slot = parkingSlotFor(word);
+  pthread_mutex_lock(&slot.mutex);
+  pthread_cond_broadcast(&slot.cond);
+  pthread_mutex_unlock(&slot.mutex);
+}
+
+#endif
+
+static inline void spinPause() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
 // =======================================================================================
-// Futex-based implementation (Linux-only)
+// Atomics-based implementation (all but Windows)
 
 Mutex::Mutex(): futex(0) {}
 Mutex::~Mutex() {
@@ -64,7 +133,8 @@ Mutex::~Mutex() {
 
 void Mutex::lock(Exclusivity exclusivity) {
   switch (exclusivity) {
-    case EXCLUSIVE:
+    case EXCLUSIVE: {
+      bool spun = false;
       for (;;) {
         uint state = 0;
         if (KJ_LIKELY(__atomic_compare_exchange_n(&futex, &state, EXCLUSIVE_HELD, false,
@@ -73,7 +143,15 @@ void Mutex::lock(Exclusivity exclusivity) {
           break;
         }
 
-        // The mutex is contended.  Set the exclusive-requested bit and wait.
+        // The mutex is contended.  Spin a little in case it's released soon -- but only the first
+        // time around, as a thread that has been woken is likely competing with others.
+        if (!spun) {
+          spun = true;
+          if (spinLock(EXCLUSIVE)) break;
+          continue;
+        }
+
+        // Set the exclusive-requested bit and wait.
         if ((state & EXCLUSIVE_REQUESTED) == 0) {
           if (!__atomic_compare_exchange_n(&futex, &state, state | EXCLUSIVE_REQUESTED, false,
                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
@@ -84,27 +162,73 @@ void Mutex::lock(Exclusivity exclusivity) {
           state |= EXCLUSIVE_REQUESTED;
         }
 
-        syscall(SYS_futex, &futex, FUTEX_WAIT_PRIVATE, state, NULL, NULL, 0);
+        parkWhile(&futex, state);
       }
       break;
+    }
     case SHARED: {
       uint state = __atomic_add_fetch(&futex, 1, __ATOMIC_ACQUIRE);
+      if (KJ_LIKELY((state & EXCLUSIVE_HELD) == 0)) {
+        // Acquired.
+        break;
+      }
+
+      // The mutex is exclusively locked by another thread.  Since we incremented the counter
+      // already, we just have to wait for it to be unlocked.
+      if (spinLock(SHARED)) break;
+
       for (;;) {
-        if (KJ_LIKELY((state & EXCLUSIVE_HELD) == 0)) {
+        state = __atomic_load_n(&futex, __ATOMIC_ACQUIRE);
+        if ((state & EXCLUSIVE_HELD) == 0) {
           // Acquired.
           break;
         }
-
-        // The mutex is exclusively locked by another thread.  Since we incremented the counter
-        // already, we just have to wait for it to be unlocked.
-        syscall(SYS_futex, &futex, FUTEX_WAIT_PRIVATE, state, NULL, NULL, 0);
-        state = __atomic_load_n(&futex, __ATOMIC_ACQUIRE);
+        parkWhile(&futex, state);
       }
       break;
     }
   }
 }
 
+bool Mutex::spinLock(Exclusivity exclusivity) {
+  // Spin for a while in the hope that the lock is released, because parking and waking a thread
+  // costs far more than a short critical section.  How long we spin adapts to how long it has
+  // taken to succeed in the past, in the manner of glibc's PTHREAD_MUTEX_ADAPTIVE_NP.  For a
+  // SHARED lock, the caller has already registered as a reader.  Returns true if the lock was
+  // acquired.
+
+  static constexpr int MIN_SPINS = 10;
+  static constexpr int MAX_SPINS = 100;
+
+  int estimate = __atomic_load_n(&spinEstimate, __ATOMIC_RELAXED);
+  int limit = kj::min(MAX_SPINS, estimate * 2 + MIN_SPINS);
+
+  for (int i = 0; i < limit; i++) {
+    spinPause();
+
+    uint state = __atomic_load_n(&futex, __ATOMIC_ACQUIRE);
+    bool acquired = false;
+    switch (exclusivity) {
+      case EXCLUSIVE:
+        acquired = state == 0 &&
+            __atomic_compare_exchange_n(&futex, &state, EXCLUSIVE_HELD, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+        break;
+      case SHARED:
+        acquired = (state & EXCLUSIVE_HELD) == 0;
+        break;
+    }
+
+    if (acquired) {
+      __atomic_store_n(&spinEstimate, uint(estimate + (i - estimate) / 8), __ATOMIC_RELAXED);
+      return true;
+    }
+  }
+
+  __atomic_store_n(&spinEstimate, uint(estimate + (limit - estimate) / 8), __ATOMIC_RELAXED);
+  return false;
+}
+
 struct Mutex::Waiter {
   kj::Maybe<Waiter&> next;
   kj::Maybe<Waiter&>* prev;
@@ -127,7 +251,7 @@ void Mutex::unlock(Exclusivity exclusivity) {
           if (waiter->predicate.check()) {
             // This waiter's predicate now evaluates true, so wake it up.
             __atomic_store_n(&waiter->futex, 1, __ATOMIC_RELEASE);
-            syscall(SYS_futex, &waiter->futex, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+            unparkAll(&waiter->futex);
 
             // We transferred ownership of the lock to this waiter, so we're done now.
             return;
@@ -147,7 +271,7 @@ void Mutex::unlock(Exclusivity exclusivity) {
         // the lock, and we must wake them up.  If there are any exclusive waiters, we must wake
         // them up even if readers are waiting so that at the very least they may re-establish the
         // EXCLUSIVE_REQUESTED bit that we just removed.
-        syscall(SYS_futex, &futex, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+        unparkAll(&futex);
       }
       break;
     }
@@ -163,7 +287,7 @@ void Mutex::unlock(Exclusivity exclusivity) {
             &futex, &state, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
           // Wake all exclusive waiters.  We have to wake all of them because one of them will
           // grab the lock while the others will re-establish the exclusive-requested bit.
-          syscall(SYS_futex, &futex, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+          unparkAll(&futex);
         }
       }
       break;
@@ -208,7 +332,7 @@ void Mutex::lockWhen(Predicate& predicate) {
 
     // Wait for someone to set out futex to 1.
     while (__atomic_load_n(&waiter.futex, __ATOMIC_ACQUIRE) == 0) {
-      syscall(SYS_futex, &waiter.futex, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+      parkWhile(&waiter.futex, 0);
     }
 
     // Ownership of an exclusive lock was transferred to us. We can continue.
@@ -230,7 +354,7 @@ startOver:
         if (__atomic_exchange_n(&futex, UNINITIALIZED, __ATOMIC_RELEASE) ==
             INITIALIZING_WITH_WAITERS) {
           // Someone was waiting for us to finish.
-          syscall(SYS_futex, &futex, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+          unparkAll(&futex);
         }
       });
 
@@ -239,7 +363,7 @@ startOver:
     if (__atomic_exchange_n(&futex, INITIALIZED, __ATOMIC_RELEASE) ==
         INITIALIZING_WITH_WAITERS) {
       // Someone was waiting for us to finish.
-      syscall(SYS_futex, &futex, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+      unparkAll(&futex);
     }
   } else {
     for (;;) {
@@ -257,7 +381,7 @@ startOver:
       }
 
       // Wait for initialization.
-      syscall(SYS_futex, &futex, FUTEX_WAIT_PRIVATE, INITIALIZING_WITH_WAITERS, NULL, NULL, 0);
+      parkWhile(&futex, INITIALIZING_WITH_WAITERS);
       state = __atomic_load_n(&futex, __ATOMIC_ACQUIRE);
 
       if (state == UNINITIALIZED) {
@@ -277,7 +401,7 @@ void Once::reset() {
   }
 }
 
-#elif _WIN32
+#else
 // =======================================================================================
 // Win32 implementation
 
@@ -301,11 +425,37 @@ void Mutex::lock(Exclusivity exclusivity) {
   }
 }
 
+struct Mutex::Waiter {
+  kj::Maybe<Waiter&> next;
+  kj::Maybe<Waiter&>* prev;
+  Predicate& predicate;
+  CONDITION_VARIABLE condvar;
+};
+
 void Mutex::unlock(Exclusivity exclusivity) {
   switch (exclusivity) {
-    case EXCLUSIVE:
+    case EXCLUSIVE: {
+      // Wake the first conditional waiter whose predicate now evaluates true.  SRW locks can't be
+      // handed to another thread, so the waiter re-acquires the lock itself and checks again; if
+      // someone else got in first and changed the state, their unlock will look at it again.
+      auto nextWaiter = waitersHead;
+      for (;;) {
+        KJ_IF_MAYBE(waiter, nextWaiter) {
+          nextWaiter = waiter->next;
+
+          if (waiter->predicate.check()) {
+            WakeConditionVariable(&waiter->condvar);
+            break;
+          }
+        } else {
+          // No more waiters.
+          break;
+        }
+      }
+
       ReleaseSRWLockExclusive(&coercedSrwLock);
       break;
+    }
     case SHARED:
       ReleaseSRWLockShared(&coercedSrwLock);
       break;
@@ -319,6 +469,31 @@ void Mutex::assertLockedByCaller(Exclusivity exclusivity) {
   // held for debug purposes anyway, we just don't bother.
 }
 
+void Mutex::lockWhen(Predicate& predicate) {
+  lock(EXCLUSIVE);
+
+  // Add waiter to list.
+  Waiter waiter { nullptr, waitersTail, predicate, CONDITION_VARIABLE_INIT };
+  *waitersTail = waiter;
+  waitersTail = &waiter.next;
+
+  KJ_DEFER({
+    // Remove from list.
+    *waiter.prev = waiter.next;
+    KJ_IF_MAYBE(next, waiter.next) {
+      next->prev = waiter.prev;
+    } else {
+      KJ_DASSERT(waitersTail == &waiter.next);
+      waitersTail = waiter.prev;
+    }
+  });
+
+  while (!predicate.check()) {
+    // Releases the lock while sleeping and re-acquires it exclusively before returning.
+    SleepConditionVariableSRW(&waiter.condvar, &coercedSrwLock, INFINITE, 0);
+  }
+}
+
 static BOOL WINAPI nullInitializer(PINIT_ONCE initOnce, PVOID parameter, PVOID* context) {
   return true;
 }
@@ -357,96 +532,6 @@ void Once::reset() {
   InitOnceInitialize(&coercedInitOnce);
 }
 
-#else
-// =======================================================================================
-// Generic pthreads-based implementation
-
-#define KJ_PTHREAD_CALL(code) \
-  { \
-    int pthreadError = code; \
-    if (pthreadError != 0) { \
-      KJ_FAIL_SYSCALL(#code, pthreadError); \
-    } \
-  }
-
-#define KJ_PTHREAD_CLEANUP(code) \
-  { \
-    int pthreadError = code; \
-    if (pthreadError != 0) { \
-      KJ_LOG(ERROR, #code, strerror(pthreadError)); \
-    } \
-  }
-
-Mutex::Mutex() {
-  KJ_PTHREAD_CALL(pthread_rwlock_init(&mutex, nullptr));
-}
-Mutex::~Mutex() {
-  KJ_PTHREAD_CLEANUP(pthread_rwlock_destroy(&mutex));
-}
-
-void Mutex::lock(Exclusivity exclusivity) {
-  switch (exclusivity) {
-    case EXCLUSIVE:
-      KJ_PTHREAD_CALL(pthread_rwlock_wrlock(&mutex));
-      break;
-    case SHARED:
-      KJ_PTHREAD_CALL(pthread_rwlock_rdlock(&mutex));
-      break;
-  }
-}
-
-void Mutex::unlock(Exclusivity exclusivity) {
-  KJ_PTHREAD_CALL(pthread_rwlock_unlock(&mutex));
-}
-
-void Mutex::assertLockedByCaller(Exclusivity exclusivity) {
-  switch (exclusivity) {
-    case EXCLUSIVE:
-      // A read lock should fail if the mutex is already held for writing.
-      if (pthread_rwlock_tryrdlock(&mutex) == 0) {
-        pthread_rwlock_unlock(&mutex);
-        KJ_FAIL_ASSERT("Tried to call getAlreadyLocked*() but lock is not held.");
-      }
-      break;
-    case SHARED:
-      // A write lock should fail if the mutex is already held for reading or writing.  We don't
-      // have any way to prove that the lock is held only for reading.
-      if (pthread_rwlock_trywrlock(&mutex) == 0) {
-        pthread_rwlock_unlock(&mutex);
-        KJ_FAIL_ASSERT("Tried to call getAlreadyLocked*() but lock is not held.");
-      }
-      break;
-  }
-}
-
-Once::Once(bool startInitialized): state(startInitialized ? INITIALIZED : UNINITIALIZED) {
-  KJ_PTHREAD_CALL(pthread_mutex_init(&mutex, nullptr));
-}
-Once::~Once() {
-  KJ_PTHREAD_CLEANUP(pthread_mutex_destroy(&mutex));
-}
-
-void Once::runOnce(Initializer& init) {
-  KJ_PTHREAD_CALL(pthread_mutex_lock(&mutex));
-  KJ_DEFER(KJ_PTHREAD_CALL(pthread_mutex_unlock(&mutex)));
-
-  if (state != UNINITIALIZED) {
-    return;
-  }
-
-  init.run();
-
-  __atomic_store_n(&state, INITIALIZED, __ATOMIC_RELEASE);
-}
-
-void Once::reset() {
-  State oldState = INITIALIZED;
-  if (!__atomic_compare_exchange_n(&state, &oldState, UNINITIALIZED,
-                                   false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
-    KJ_FAIL_REQUIRE("reset() called while not initialized.");
-  }
-}
-
 #endif
 
 }  // namespace _ (private)
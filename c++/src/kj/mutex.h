@@ -32,11 +32,9 @@
 #define KJ_USE_FUTEX 1
 #endif
 
-#if !KJ_USE_FUTEX && !_WIN32
-// On Linux we use futex.  On other platforms we wrap pthreads.
-// TODO(someday):  Write efficient low-level locking primitives for other platforms.
-#include <pthread.h>
-#endif
+// Except on Windows, locks are implemented with atomics that park waiting threads with futex() on
+// Linux, or on a small table of pthread condition variables elsewhere (see mutex.c++).  On Windows
+// we wrap SRW locks.
 
 namespace kj {
 
@@ -66,7 +64,6 @@ public:
   // non-trivial, assert that the mutex is locked (which should be good enough to catch problems
   // in unit tests).  In non-debug builds, do nothing.
 
-#if KJ_USE_FUTEX    // TODO(soon): Implement on pthread & win32
   class Predicate {
   public:
     virtual bool check() = 0;
@@ -74,10 +71,14 @@ public:
 
   void lockWhen(Predicate& predicate);
   // Lock (exclusively) when predicate.check() returns true.
-#endif
 
 private:
-#if KJ_USE_FUTEX
+  struct Waiter;
+  kj::Maybe<Waiter&> waitersHead = nullptr;
+  kj::Maybe<Waiter&>* waitersTail = &waitersHead;
+  // linked list of waitUntil()s; can only modify under lock
+
+#if !_WIN32
   uint futex;
   // bit 31 (msb) = set if exclusive lock held
   // bit 30 (msb) = set if threads are waiting for exclusive lock
@@ -89,16 +90,14 @@ private:
   static constexpr uint EXCLUSIVE_REQUESTED = 1u << 30;
   static constexpr uint SHARED_COUNT_MASK = EXCLUSIVE_REQUESTED - 1;
 
-  struct Waiter;
-  kj::Maybe<Waiter&> waitersHead = nullptr;
-  kj::Maybe<Waiter&>* waitersTail = &waitersHead;
-  // linked list of waitUntil()s; can only modify under lock
+  uint spinEstimate = 0;
+  // Running average of how many spins it took to take a contended lock, so that we know how long
+  // to spin before parking the thread.  Accessed atomically.
 
-#elif _WIN32
-  uintptr_t srwLock;  // Actually an SRWLOCK, but don't want to #include <windows.h> in header.
+  bool spinLock(Exclusivity exclusivity);
 
 #else
-  mutable pthread_rwlock_t mutex;
+  uintptr_t srwLock;  // Actually an SRWLOCK, but don't want to #include <windows.h> in header.
 #endif
 };
 
@@ -106,12 +105,12 @@ class Once {
   // Internal implementation details.  See `Lazy<T>`.
 
 public:
-#if KJ_USE_FUTEX
-  inline Once(bool startInitialized = false)
-      : futex(startInitialized ? INITIALIZED : UNINITIALIZED) {}
-#else
+#if _WIN32
   Once(bool startInitialized = false);
   ~Once();
+#else
+  inline Once(bool startInitialized = false)
+      : futex(startInitialized ? INITIALIZED : UNINITIALIZED) {}
 #endif
   KJ_DISALLOW_COPY(Once);
 
@@ -128,11 +127,7 @@ public:
 #else
   inline bool isInitialized() noexcept {
     // Fast path check to see if runOnce() would simply return immediately.
-#if KJ_USE_FUTEX
     return __atomic_load_n(&futex, __ATOMIC_ACQUIRE) == INITIALIZED;
-#else
-    return __atomic_load_n(&state, __ATOMIC_ACQUIRE) == INITIALIZED;
-#endif
   }
 #endif
 
@@ -142,7 +137,10 @@ public:
   // another thread.
 
 private:
-#if KJ_USE_FUTEX
+#if _WIN32
+  uintptr_t initOnce;  // Actually an INIT_ONCE, but don't want to #include <windows.h> in header.
+
+#else
   uint futex;
 
   enum State {
@@ -151,17 +149,6 @@ private:
     INITIALIZING_WITH_WAITERS,
     INITIALIZED
   };
-
-#elif _WIN32
-  uintptr_t initOnce;  // Actually an INIT_ONCE, but don't want to #include <windows.h> in header.
-
-#else
-  enum State {
-    UNINITIALIZED,
-    INITIALIZED
-  };
-  State state;
-  pthread_mutex_t mutex;
 #endif
 };
 
@@ -263,7 +250,6 @@ public:
   inline T& getAlreadyLockedExclusive() const;
   // Like `getWithoutLock()`, but asserts that the lock is already held by the calling thread.
 
-#if KJ_USE_FUTEX    // TODO(soon): Implement on pthread & win32
   template <typename Cond, typename Func>
   auto when(Cond&& condition, Func&& callback) const -> decltype(callback(instance<T&>())) {
     // Waits until condition(state) returns true, then calls callback(state) under lock.
@@ -294,7 +280,6 @@ public:
     KJ_DEFER(mutex.unlock(_::Mutex::EXCLUSIVE));
     return callback(value);
   }
-#endif
 
 private:
   mutable _::Mutex mutex;
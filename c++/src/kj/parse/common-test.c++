@@ -515,6 +515,66 @@ TEST(CommonParsers, EndOfInput) {
   }
 }
 
+TEST(CommonParsers, Memoize) {
+  // Two alternatives share the prefix `word`.  Without memoization the second alternative
+  // re-parses it.
+  uint calls = 0;
+  auto letter = transformOrReject(any, [](char c) -> Maybe<char> {
+    if (c >= 'a' && c <= 'c') return c; else return nullptr;
+  });
+  auto word = transform(many(letter), [&calls](Array<char>&& chars) {
+    ++calls;
+    return chars.size();
+  });
+
+  MemoTable<const char*, size_t> table;
+  auto memoWord = memoize(word, table);
+  auto parser = oneOf(
+      transform(sequence(memoWord, exactly('!')), [](size_t n) { return str(n, " shouted"); }),
+      transform(sequence(memoWord, exactly('?')), [](size_t n) { return str(n, " asked"); }));
+
+  {
+    StringPtr text = "abcab?";
+    Input input(text.begin(), text.end());
+    KJ_IF_MAYBE(result, parser(input)) {
+      EXPECT_EQ("5 asked", *result);
+    } else {
+      ADD_FAILURE() << "Expected match.";
+    }
+    EXPECT_TRUE(input.atEnd());
+    EXPECT_EQ(1u, calls);
+    EXPECT_EQ(1u, table.size());
+  }
+
+  // A failed attempt is remembered too, along with how far it got.
+  table.clear();
+  calls = 0;
+  {
+    StringPtr text = "abcab.";
+    Input input(text.begin(), text.end());
+    EXPECT_TRUE(parser(input) == nullptr);
+    EXPECT_EQ(1u, calls);
+
+    // Error reporting sees the same furthest position as it would without memoization.
+    auto plainParser = oneOf(sequence(word, exactly('!')), sequence(word, exactly('?')));
+    Input plainInput(text.begin(), text.end());
+    EXPECT_TRUE(plainParser(plainInput) == nullptr);
+    EXPECT_EQ(plainInput.getBest(), input.getBest());
+  }
+
+  auto failing = sequence(exactly('a'), exactly('b'), exactly('x'));
+  MemoTable<const char*, Tuple<>> failTable;
+  auto memoFailing = memoize(failing, failTable);
+  {
+    StringPtr text = "abc";
+    Input input(text.begin(), text.end());
+    EXPECT_TRUE(memoFailing(input) == nullptr);
+    Input input2(text.begin(), text.end());
+    EXPECT_TRUE(memoFailing(input2) == nullptr);
+    EXPECT_EQ(text.begin() + 2, input2.getBest());
+  }
+}
+
 }  // namespace
 }  // namespace parse
 }  // namespace kj
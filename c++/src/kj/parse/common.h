@@ -44,6 +44,7 @@
 #include "../array.h"
 #include "../tuple.h"
 #include "../vector.h"
+#include "../map.h"
 #if _MSC_VER && !__clang__
 #include <type_traits>  // result_of_t
 #endif
@@ -766,6 +767,90 @@ constexpr TransformWithLocation_<SubParser, TransformFunc> transformWithLocation
       kj::fwd<SubParser>(subParser), kj::fwd<TransformFunc>(functor));
 }
 
+// -------------------------------------------------------------------
+// memoize()
+// Output = same as sub-parser, which must be copyable.
+
+template <typename Position, typename Output>
+class MemoTable {
+  // Remembers, for each input position at which a memoized parser has been tried, whether it
+  // matched, what it returned, and how far it got.  A grammar that backtracks heavily -- trying
+  // several alternatives that each start by parsing the same rule -- re-parses that rule once per
+  // alternative; memoizing the shared rule makes each (rule, position) pair parse at most once,
+  // i.e. a "packrat" parser.
+  //
+  // A MemoTable describes one input.  Use a fresh table, or clear() this one, before parsing
+  // anything else.  `Position` is the type returned by the input's getPosition(), and must be
+  // hashable with kj::hashCode() and ordered by `<`.
+
+public:
+  void clear() { entries.clear(); }
+  size_t size() const { return entries.size(); }
+
+private:
+  struct Entry {
+    Position end;
+    Position best;
+    Maybe<Output> result;
+  };
+  HashMap<Position, Entry> entries;
+
+  template <typename, typename, typename>
+  friend class Memoize_;
+};
+
+template <typename SubParser, typename Position, typename Output>
+class Memoize_ {
+public:
+  explicit constexpr Memoize_(SubParser&& subParser, MemoTable<Position, Output>& table)
+      : subParser(kj::fwd<SubParser>(subParser)), table(table) {}
+
+  template <typename Input>
+  Maybe<Output> operator()(Input& input) const {
+    auto start = input.getPosition();
+    KJ_IF_MAYBE(entry, table.entries.find(start)) {
+      // Replay the earlier attempt: report the same furthest position for error messages, and on
+      // success leave the input where the sub-parser left it.
+      {
+        Input subInput(input);
+        while (subInput.getPosition() < entry->best) subInput.next();
+      }
+      KJ_IF_MAYBE(result, entry->result) {
+        while (input.getPosition() < entry->end) input.next();
+        return *result;
+      } else {
+        return nullptr;
+      }
+    }
+
+    Input subInput(input);
+    Maybe<Output> result = subParser(subInput);
+    auto best = subInput.getBest();
+    auto end = subInput.getPosition();
+    if (result != nullptr) subInput.advanceParent();
+    table.entries.insert(kj::mv(start), { kj::mv(end), kj::mv(best), result });
+    return result;
+  }
+
+private:
+  SubParser subParser;
+  MemoTable<Position, Output>& table;
+};
+
+template <typename SubParser, typename Position, typename Output>
+constexpr Memoize_<SubParser, Position, Output> memoize(
+    SubParser&& subParser, MemoTable<Position, Output>& table) {
+  // Constructs a parser that behaves exactly like `subParser`, but records its outcome at each
+  // position in `table` and answers later attempts at the same position from there.  The
+  // sub-parser's result must depend only on the input -- not on any other state -- and is copied
+  // out of the table on each repeat, so prefer cheap-to-copy outputs.
+  //
+  // A repeat skips the parsing work but still steps the input forward over what was matched, so
+  // memoize rules whose cost is in parsing (sub-rules, transforms, allocation) rather than ones
+  // that match a single token.
+  return Memoize_<SubParser, Position, Output>(kj::fwd<SubParser>(subParser), table);
+}
+
 // -------------------------------------------------------------------
 // notLookingAt()
 // Fails if the given parser succeeds at the current location.
@@ -0,0 +1,183 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "queue.h"
+#include "thread.h"
+#include "string.h"
+#include "test.h"
+
+namespace kj {
+namespace {
+
+KJ_TEST("SpscQueue") {
+  SpscQueue<String> queue(3);
+  KJ_EXPECT(queue.capacity() == 4);
+  KJ_EXPECT(queue.isEmpty());
+  KJ_EXPECT(queue.tryPop() == nullptr);
+
+  // Go around the ring a few times.
+  for (uint round = 0; round < 3; round++) {
+    for (uint i = 0; i < 4; i++) {
+      KJ_EXPECT(queue.tryPush(kj::str(round, ':', i)));
+    }
+    String extra = kj::str("extra");
+    KJ_EXPECT(!queue.tryPush(kj::mv(extra)));
+    KJ_EXPECT(extra == "extra");
+
+    for (uint i = 0; i < 4; i++) {
+      KJ_IF_MAYBE(s, queue.tryPop()) {
+        KJ_EXPECT(*s == kj::str(round, ':', i));
+      } else {
+        KJ_FAIL_EXPECT("queue empty too soon");
+      }
+    }
+    KJ_EXPECT(queue.isEmpty());
+  }
+
+  // Leftovers are destroyed with the queue.
+  KJ_EXPECT(queue.tryPush(kj::str("leftover")));
+}
+
+KJ_TEST("SpscQueue across threads") {
+  SpscQueue<uint> queue(64);
+  constexpr uint COUNT = 100000;
+
+  Thread producer([&]() {
+    for (uint i = 0; i < COUNT; i++) {
+      while (!queue.tryPush(i)) {}
+    }
+  });
+
+  for (uint i = 0; i < COUNT;) {
+    KJ_IF_MAYBE(value, queue.tryPop()) {
+      KJ_ASSERT(*value == i);
+      i++;
+    }
+  }
+}
+
+KJ_TEST("MpscQueue") {
+  MpscQueue<Own<uint>> queue(2);
+  KJ_EXPECT(queue.isEmpty());
+  KJ_EXPECT(queue.tryPush(kj::heap(1u)));
+  KJ_EXPECT(queue.tryPush(kj::heap(2u)));
+  KJ_EXPECT(!queue.tryPush(kj::heap(3u)));
+
+  KJ_EXPECT(*KJ_ASSERT_NONNULL(queue.tryPop()) == 1);
+  KJ_EXPECT(queue.tryPush(kj::heap(4u)));
+  KJ_EXPECT(*KJ_ASSERT_NONNULL(queue.tryPop()) == 2);
+  KJ_EXPECT(*KJ_ASSERT_NONNULL(queue.tryPop()) == 4);
+  KJ_EXPECT(queue.tryPop() == nullptr);
+  KJ_EXPECT(queue.isEmpty());
+
+  KJ_EXPECT(queue.tryPush(kj::heap(5u)));
+}
+
+KJ_TEST("MpscQueue across threads") {
+  MpscQueue<uint> queue(16);
+  constexpr uint THREADS = 4;
+  constexpr uint COUNT = 20000;
+
+  {
+    auto threads = kj::heapArrayBuilder<Own<Thread>>(THREADS);
+    for (uint t = 0; t < THREADS; t++) {
+      threads.add(kj::heap<Thread>([&queue,t]() {
+        for (uint i = 0; i < COUNT; i++) {
+          while (!queue.tryPush(t * COUNT + i)) {}
+        }
+      }));
+    }
+
+    // Items from any one producer arrive in order.
+    uint next[THREADS] = {0, 0, 0, 0};
+    for (uint received = 0; received < THREADS * COUNT;) {
+      KJ_IF_MAYBE(value, queue.tryPop()) {
+        uint t = *value / COUNT;
+        KJ_ASSERT(*value % COUNT == next[t]++);
+        received++;
+      }
+    }
+  }
+
+  KJ_EXPECT(queue.isEmpty());
+}
+
+struct Node {
+  uint value;
+  MpscQueueLink<Node> link;
+};
+
+KJ_TEST("MpscIntrusiveQueue") {
+  MpscIntrusiveQueue<Node, &Node::link> queue;
+  KJ_EXPECT(queue.isEmpty());
+  KJ_EXPECT(queue.tryPop() == nullptr);
+
+  Node nodes[3];
+  for (uint i = 0; i < 3; i++) nodes[i].value = i + 1;
+  queue.push(nodes[0]);
+  queue.push(nodes[1]);
+  KJ_EXPECT(!queue.isEmpty());
+  KJ_EXPECT(KJ_ASSERT_NONNULL(queue.tryPop()).value == 1);
+  queue.push(nodes[2]);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(queue.tryPop()).value == 2);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(queue.tryPop()).value == 3);
+  KJ_EXPECT(queue.tryPop() == nullptr);
+  KJ_EXPECT(queue.isEmpty());
+
+  // Popped nodes can be pushed again.
+  queue.push(nodes[0]);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(queue.tryPop()).value == 1);
+  KJ_EXPECT(queue.isEmpty());
+}
+
+KJ_TEST("MpscIntrusiveQueue across threads") {
+  MpscIntrusiveQueue<Node, &Node::link> queue;
+  constexpr uint THREADS = 4;
+  constexpr uint COUNT = 10000;
+  auto nodes = kj::heapArray<Node>(THREADS * COUNT);
+
+  {
+    auto threads = kj::heapArrayBuilder<Own<Thread>>(THREADS);
+    for (uint t = 0; t < THREADS; t++) {
+      threads.add(kj::heap<Thread>([&queue,&nodes,t]() {
+        for (uint i = 0; i < COUNT; i++) {
+          auto& node = nodes[t * COUNT + i];
+          node.value = t * COUNT + i;
+          queue.push(node);
+        }
+      }));
+    }
+
+    uint next[THREADS] = {0, 0, 0, 0};
+    for (uint received = 0; received < THREADS * COUNT;) {
+      KJ_IF_MAYBE(node, queue.tryPop()) {
+        uint t = node->value / COUNT;
+        KJ_ASSERT(node->value % COUNT == next[t]++);
+        received++;
+      }
+    }
+  }
+
+  KJ_EXPECT(queue.isEmpty());
+}
+
+}  // namespace
+}  // namespace kj
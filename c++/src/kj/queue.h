@@ -0,0 +1,404 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#pragma once
+
+#if defined(__GNUC__) && !KJ_HEADER_WARNINGS
+#pragma GCC system_header
+#endif
+
+#include "array.h"
+
+#if _MSC_VER
+#if _MSC_VER < 1910
+#include <intrin.h>
+#else
+#include <intrin0.h>
+#endif
+#endif
+
+// Fixed-capacity lock-free queues for handing items between threads.  Nothing here blocks: a
+// push into a full queue or a pop from an empty one simply fails.  To let a thread with an event
+// loop wait for items, wrap the queue in kj::AsyncQueue (see async-queue.h).
+
+namespace kj {
+
+// =======================================================================================
+// Private details -- public interfaces follow below.
+
+namespace _ {  // private
+
+static constexpr size_t QUEUE_CACHE_LINE_SIZE = 64;
+// Producer-owned and consumer-owned fields are kept this far apart so that the two threads don't
+// fight over a cache line.
+
+typedef uint QueueIndex;
+// Indices only ever increase and are reduced modulo the (power-of-two) capacity, so wrapping
+// around is harmless.
+
+#if _MSC_VER
+inline QueueIndex queueLoad(const volatile QueueIndex& index) {
+  return index;  // volatile reads have acquire semantics under MSVC
+}
+inline void queueStore(volatile QueueIndex& index, QueueIndex value) {
+  index = value;  // volatile writes have release semantics under MSVC
+}
+inline bool queueCas(volatile QueueIndex& index, QueueIndex expected, QueueIndex desired) {
+  return _InterlockedCompareExchange(reinterpret_cast<volatile long*>(&index),
+                                     long(desired), long(expected)) == long(expected);
+}
+inline void* queueExchangePointer(void* volatile& pointer, void* value) {
+  return _InterlockedExchangePointer(&pointer, value);
+}
+inline void* queueLoadPointer(void* const volatile& pointer) { return pointer; }
+inline void queueStorePointer(void* volatile& pointer, void* value) { pointer = value; }
+#else
+inline QueueIndex queueLoad(const volatile QueueIndex& index) {
+  return __atomic_load_n(&index, __ATOMIC_ACQUIRE);
+}
+inline void queueStore(volatile QueueIndex& index, QueueIndex value) {
+  __atomic_store_n(&index, value, __ATOMIC_RELEASE);
+}
+inline bool queueCas(volatile QueueIndex& index, QueueIndex expected, QueueIndex desired) {
+  return __atomic_compare_exchange_n(&index, &expected, desired, true,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+inline void* queueExchangePointer(void* volatile& pointer, void* value) {
+  return __atomic_exchange_n(&pointer, value, __ATOMIC_ACQ_REL);
+}
+inline void* queueLoadPointer(void* const volatile& pointer) {
+  return __atomic_load_n(&pointer, __ATOMIC_ACQUIRE);
+}
+inline void queueStorePointer(void* volatile& pointer, void* value) {
+  __atomic_store_n(&pointer, value, __ATOMIC_RELEASE);
+}
+#endif
+
+inline QueueIndex queueCapacity(size_t minCapacity) {
+  KJ_IREQUIRE(minCapacity > 0 && minCapacity <= (QueueIndex(1) << (sizeof(QueueIndex) * 8 - 2)),
+              "bad queue capacity");
+  QueueIndex result = 1;
+  while (result < minCapacity) result <<= 1;
+  return result;
+}
+
+template <typename T>
+union QueueSlot {
+  // Uninitialized storage for one item.
+
+  QueueSlot() {}
+  ~QueueSlot() {}
+  T value;
+};
+
+}  // namespace _ (private)
+
+// =======================================================================================
+
+template <typename T>
+class SpscQueue {
+  // A bounded ring buffer with exactly one producer thread and one consumer thread.  Each side
+  // only writes its own index and caches the other's, so a push or pop that finds room touches no
+  // shared cache line at all until the cached index runs out.
+
+public:
+  typedef T Value;
+
+  explicit SpscQueue(size_t minCapacity);
+  // The capacity is rounded up to a power of two.
+
+  ~SpscQueue() noexcept(false);
+  // Destroys any items still queued.  Neither side may be using the queue.
+
+  KJ_DISALLOW_COPY(SpscQueue);
+
+  template <typename U>
+  bool tryPush(U&& value);
+  // Producer only.  Returns false (and leaves `value` alone) if the queue is full.
+
+  Maybe<T> tryPop();
+  // Consumer only.  Returns null if the queue is empty.
+
+  bool isEmpty() const;
+  // Consumer only.  (Called anywhere else, the answer may already be stale.)
+
+  size_t capacity() const { return mask + 1; }
+
+private:
+  Array<_::QueueSlot<T>> slots;
+  _::QueueIndex mask;
+
+  byte pad0[_::QUEUE_CACHE_LINE_SIZE];
+
+  volatile _::QueueIndex head = 0;   // next slot to pop; written by the consumer
+  _::QueueIndex cachedTail = 0;      // consumer's last look at `tail`
+
+  byte pad1[_::QUEUE_CACHE_LINE_SIZE];
+
+  volatile _::QueueIndex tail = 0;   // next slot to fill; written by the producer
+  _::QueueIndex cachedHead = 0;      // producer's last look at `head`
+
+  byte pad2[_::QUEUE_CACHE_LINE_SIZE];
+};
+
+template <typename T>
+class MpscQueue {
+  // A bounded ring buffer that any number of threads may push into, drained by a single consumer
+  // thread.  Each slot carries a sequence number that tells producers whether the consumer is
+  // done with it and tells the consumer whether the producer has finished writing it, so
+  // producers only contend on one compare-and-swap of the tail index.
+
+public:
+  typedef T Value;
+
+  explicit MpscQueue(size_t minCapacity);
+  // The capacity is rounded up to a power of two.
+
+  ~MpscQueue() noexcept(false);
+  // Destroys any items still queued.  No thread may be using the queue.
+
+  KJ_DISALLOW_COPY(MpscQueue);
+
+  template <typename U>
+  bool tryPush(U&& value);
+  // Any thread.  Returns false (and leaves `value` alone) if the queue is full.
+
+  Maybe<T> tryPop();
+  // Consumer only.  Returns null if the queue is empty, or if the oldest push hasn't finished
+  // writing its slot yet.
+
+  bool isEmpty() const;
+  // Consumer only.
+
+  size_t capacity() const { return mask + 1; }
+
+private:
+  struct Slot {
+    volatile _::QueueIndex sequence;
+    _::QueueSlot<T> storage;
+  };
+
+  Array<Slot> slots;
+  _::QueueIndex mask;
+
+  byte pad0[_::QUEUE_CACHE_LINE_SIZE];
+
+  _::QueueIndex head = 0;            // consumer only
+
+  byte pad1[_::QUEUE_CACHE_LINE_SIZE];
+
+  volatile _::QueueIndex tail = 0;   // claimed by producers
+
+  byte pad2[_::QUEUE_CACHE_LINE_SIZE];
+};
+
+template <typename T>
+struct MpscQueueLink {
+  // Embed one of these in each object that will be pushed into an MpscIntrusiveQueue.
+
+  void* volatile next = nullptr;
+  T* item = nullptr;
+};
+
+template <typename T, MpscQueueLink<T> T::*link>
+class MpscIntrusiveQueue {
+  // An unbounded queue of objects linked through an embedded MpscQueueLink, which any number of
+  // threads may push into and a single consumer thread drains.  Pushing is a single atomic
+  // exchange and never fails.  The queue does not own its items: each must stay alive, and must
+  // not be pushed again, until it has been popped.
+
+public:
+  MpscIntrusiveQueue(): head(&stub), tail(&stub) {}
+  KJ_DISALLOW_COPY(MpscIntrusiveQueue);
+
+  void push(T& item);
+  // Any thread.
+
+  Maybe<T&> tryPop();
+  // Consumer only.  Returns null if the queue is empty, or if the next item's push is still in
+  // progress on another thread.
+
+  bool isEmpty() const;
+  // Consumer only.
+
+private:
+  typedef MpscQueueLink<T> Link;
+
+  Link stub;
+  void* volatile head;  // most recently pushed link; exchanged by producers
+  Link* tail;           // oldest link; consumer only
+
+  void pushLink(Link& newLink);
+};
+
+// =======================================================================================
+// Inline implementation details
+
+template <typename T>
+SpscQueue<T>::SpscQueue(size_t minCapacity)
+    : mask(_::queueCapacity(minCapacity) - 1) {
+  slots = heapArray<_::QueueSlot<T>>(mask + 1);
+}
+
+template <typename T>
+SpscQueue<T>::~SpscQueue() noexcept(false) {
+  for (_::QueueIndex i = head; i != tail; i++) {
+    dtor(slots[i & mask].value);
+  }
+}
+
+template <typename T>
+template <typename U>
+bool SpscQueue<T>::tryPush(U&& value) {
+  _::QueueIndex pos = tail;
+  if (pos - cachedHead > mask) {
+    cachedHead = _::queueLoad(head);
+    if (pos - cachedHead > mask) return false;
+  }
+  ctor(slots[pos & mask].value, kj::fwd<U>(value));
+  _::queueStore(tail, pos + 1);
+  return true;
+}
+
+template <typename T>
+Maybe<T> SpscQueue<T>::tryPop() {
+  _::QueueIndex pos = head;
+  if (pos == cachedTail) {
+    cachedTail = _::queueLoad(tail);
+    if (pos == cachedTail) return nullptr;
+  }
+  T& slot = slots[pos & mask].value;
+  Maybe<T> result = kj::mv(slot);
+  dtor(slot);
+  _::queueStore(head, pos + 1);
+  return result;
+}
+
+template <typename T>
+bool SpscQueue<T>::isEmpty() const {
+  return head == _::queueLoad(tail);
+}
+
+template <typename T>
+MpscQueue<T>::MpscQueue(size_t minCapacity)
+    : mask(_::queueCapacity(minCapacity) - 1) {
+  slots = heapArray<Slot>(mask + 1);
+  for (_::QueueIndex i = 0; i <= mask; i++) {
+    slots[i].sequence = i;
+  }
+}
+
+template <typename T>
+MpscQueue<T>::~MpscQueue() noexcept(false) {
+  while (tryPop() != nullptr) {}
+}
+
+template <typename T>
+template <typename U>
+bool MpscQueue<T>::tryPush(U&& value) {
+  // A slot whose sequence equals the position we want is free for that position; one whose
+  // sequence is a lap behind still holds an item the consumer hasn't taken.
+  _::QueueIndex pos = _::queueLoad(tail);
+  for (;;) {
+    Slot& slot = slots[pos & mask];
+    int diff = static_cast<int>(_::queueLoad(slot.sequence) - pos);
+    if (diff == 0) {
+      if (_::queueCas(tail, pos, pos + 1)) {
+        ctor(slot.storage.value, kj::fwd<U>(value));
+        _::queueStore(slot.sequence, pos + 1);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false;
+    }
+    pos = _::queueLoad(tail);
+  }
+}
+
+template <typename T>
+Maybe<T> MpscQueue<T>::tryPop() {
+  Slot& slot = slots[head & mask];
+  if (_::queueLoad(slot.sequence) != head + 1) return nullptr;
+  Maybe<T> result = kj::mv(slot.storage.value);
+  dtor(slot.storage.value);
+  _::queueStore(slot.sequence, head + mask + 1);
+  ++head;
+  return result;
+}
+
+template <typename T>
+bool MpscQueue<T>::isEmpty() const {
+  return _::queueLoad(slots[head & mask].sequence) != head + 1;
+}
+
+template <typename T, MpscQueueLink<T> T::*link>
+void MpscIntrusiveQueue<T, link>::push(T& item) {
+  Link& newLink = item.*link;
+  newLink.item = &item;
+  pushLink(newLink);
+}
+
+template <typename T, MpscQueueLink<T> T::*link>
+void MpscIntrusiveQueue<T, link>::pushLink(Link& newLink) {
+  // Between the exchange and the store the new link is unreachable from `tail`; the consumer
+  // treats that window as "empty for now".
+  _::queueStorePointer(newLink.next, nullptr);
+  auto prev = reinterpret_cast<Link*>(_::queueExchangePointer(head, &newLink));
+  _::queueStorePointer(prev->next, &newLink);
+}
+
+template <typename T, MpscQueueLink<T> T::*link>
+Maybe<T&> MpscIntrusiveQueue<T, link>::tryPop() {
+  Link* first = tail;
+  Link* next = reinterpret_cast<Link*>(_::queueLoadPointer(first->next));
+
+  if (first == &stub) {
+    if (next == nullptr) return nullptr;
+    tail = next;
+    first = next;
+    next = reinterpret_cast<Link*>(_::queueLoadPointer(next->next));
+  }
+
+  if (next != nullptr) {
+    tail = next;
+    return *first->item;
+  }
+
+  // `first` is the last link we can see.  We can only hand it out once something follows it, so
+  // push the stub behind it -- unless another producer is already mid-push.
+  if (first != _::queueLoadPointer(head)) return nullptr;
+  pushLink(stub);
+
+  next = reinterpret_cast<Link*>(_::queueLoadPointer(first->next));
+  if (next != nullptr) {
+    tail = next;
+    return *first->item;
+  }
+  return nullptr;
+}
+
+template <typename T, MpscQueueLink<T> T::*link>
+bool MpscIntrusiveQueue<T, link>::isEmpty() const {
+  return tail == &stub && _::queueLoadPointer(stub.next) == nullptr;
+}
+
+}  // namespace kj
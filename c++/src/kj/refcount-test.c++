@@ -21,8 +21,10 @@
 
 #include "refcount.h"
 #include <kj/compat/gtest.h>
+#include "thread.h"
 
 namespace kj {
+namespace {
 
 struct SetTrueInDestructor: public Refcounted {
   SetTrueInDestructor(bool* ptr): ptr(ptr) {}
@@ -57,4 +59,114 @@ TEST(Refcount, Basic) {
 #endif
 }
 
+struct PooledRefcounted: public Refcounted {
+  PooledRefcounted(bool* ptr): ptr(ptr) {}
+  ~PooledRefcounted() { *ptr = true; }
+
+  bool* ptr;
+
+  KJ_POOLED_ALLOCATION(PooledRefcounted)
+};
+
+struct PooledAtomicRefcounted: public AtomicRefcounted {
+  PooledAtomicRefcounted(bool* ptr): ptr(ptr) {}
+  ~PooledAtomicRefcounted() { *ptr = true; }
+
+  bool* ptr;
+
+  KJ_POOLED_ALLOCATION(PooledAtomicRefcounted)
+};
+
+TEST(Refcount, Pooled) {
+  auto before = getPooledAllocationStats();
+
+  for (int i = 0; i < 10; i++) {
+    bool b = false;
+    Own<PooledRefcounted> ref1 = kj::refcounted<PooledRefcounted>(&b);
+    Own<PooledRefcounted> ref2 = kj::addRef(*ref1);
+    ref1 = nullptr;
+    EXPECT_FALSE(b);
+    ref2 = nullptr;
+    EXPECT_TRUE(b);
+  }
+
+  for (int i = 0; i < 10; i++) {
+    bool b = false;
+    Own<const PooledAtomicRefcounted> ref1 = kj::atomicRefcounted<PooledAtomicRefcounted>(&b);
+    Own<const PooledAtomicRefcounted> ref2 = kj::atomicAddRef(*ref1);
+    ref1 = nullptr;
+    EXPECT_FALSE(b);
+    ref2 = nullptr;
+    EXPECT_TRUE(b);
+  }
+
+  auto after = getPooledAllocationStats();
+  EXPECT_EQ(after.allocations - before.allocations, after.frees - before.frees);
+}
+
+struct BiasedSetTrueInDestructor: public BiasedRefcounted {
+  BiasedSetTrueInDestructor(bool* ptr): ptr(ptr) {}
+  ~BiasedSetTrueInDestructor() { *ptr = true; }
+
+  bool* ptr;
+};
+
+TEST(Refcount, Biased) {
+  bool b = false;
+  Own<BiasedSetTrueInDestructor> ref1 = kj::biasedRefcounted<BiasedSetTrueInDestructor>(&b);
+  EXPECT_TRUE(ref1->isOwnerThread());
+  Own<BiasedSetTrueInDestructor> ref2 = kj::biasedAddRef(*ref1);
+  Own<const BiasedSetTrueInDestructor> shared = kj::biasedAddRefShared(*ref1);
+
+  // Dropping all of the owner thread's references leaves the shared one.
+  ref1 = nullptr;
+  ref2 = nullptr;
+  EXPECT_FALSE(b);
+
+  // The owner thread can pick up new local references from a shared one.
+  Own<const BiasedSetTrueInDestructor> ref3 = kj::biasedAddRef(*shared);
+  shared = nullptr;
+  EXPECT_FALSE(b);
+  ref3 = nullptr;
+  EXPECT_TRUE(b);
+}
+
+TEST(Refcount, BiasedCrossThread) {
+  bool b = false;
+  Own<BiasedSetTrueInDestructor> ref = kj::biasedRefcounted<BiasedSetTrueInDestructor>(&b);
+
+  {
+    Own<const BiasedSetTrueInDestructor> shared = kj::biasedAddRefShared(*ref);
+    auto sharedPtr = shared.get();
+    kj::Thread thread([&]() {
+      EXPECT_FALSE(sharedPtr->isOwnerThread());
+      for (uint i = 0; i < 10000; i++) {
+        // On other threads, biasedAddRef() returns shared references.
+        auto extra = kj::biasedAddRef(*sharedPtr);
+      }
+      shared = nullptr;
+    });
+
+    for (uint i = 0; i < 10000; i++) {
+      auto extra = kj::biasedAddRef(*ref);
+    }
+  }
+
+  EXPECT_FALSE(b);
+  ref = nullptr;
+  EXPECT_TRUE(b);
+
+  // Last reference dropped on another thread.
+  b = false;
+  ref = kj::biasedRefcounted<BiasedSetTrueInDestructor>(&b);
+  {
+    Own<const BiasedSetTrueInDestructor> shared = kj::biasedAddRefShared(*ref);
+    ref = nullptr;
+    EXPECT_FALSE(b);
+    kj::Thread thread([&]() { shared = nullptr; });
+  }
+  EXPECT_TRUE(b);
+}
+
+}  // namespace
 }  // namespace kj
@@ -21,6 +21,7 @@
 
 #include "refcount.h"
 #include "debug.h"
+#include "threadlocal.h"
 
 #if _MSC_VER
 // Annoyingly, MSVC only implements the C++ atomic libs, not the C libs, so the only useful
@@ -99,4 +100,59 @@ bool AtomicRefcounted::addRefWeakInternal() const {
 #endif
 }
 
+// =======================================================================================
+// Biased refcounting
+
+namespace {
+
+#if KJ_USE_PTHREAD_TLS
+// pthread_t is a pointer on the platforms that need this.
+#else
+thread_local char threadIdentity;
+// Only the address is used.
+#endif
+
+}  // namespace
+
+const void* BiasedRefcounted::currentThread() {
+#if KJ_USE_PTHREAD_TLS
+  return reinterpret_cast<const void*>(pthread_self());
+#else
+  return &threadIdentity;
+#endif
+}
+
+BiasedRefcounted::BiasedRefcounted()
+    : ownerThread(currentThread()), localDisposer(*this) {}
+
+BiasedRefcounted::~BiasedRefcounted() noexcept(false) {
+  KJ_ASSERT(sharedRefcount == 0 && localRefcount == 0,
+            "Refcounted object deleted with non-zero refcount.");
+}
+
+void BiasedRefcounted::disposeImpl(void* pointer) const {
+#if _MSC_VER
+  if (KJ_MSVC_INTERLOCKED(Decrement, rel)(&sharedRefcount) == 0) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    delete this;
+  }
+#else
+  if (__atomic_sub_fetch(&sharedRefcount, 1, __ATOMIC_RELEASE) == 0) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    delete this;
+  }
+#endif
+}
+
+void BiasedRefcounted::LocalDisposer::disposeImpl(void* pointer) const {
+  KJ_IREQUIRE(object.isOwnerThread(),
+      "Owner-thread reference to BiasedRefcounted object dropped on another thread; use "
+      "kj::biasedAddRefShared() to obtain references that can cross threads.");
+
+  if (--object.localRefcount == 0) {
+    // Release the shared reference held on behalf of the owner thread.
+    object.disposeImpl(pointer);
+  }
+}
+
 }  // namespace kj
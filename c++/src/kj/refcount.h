@@ -218,4 +218,138 @@ kj::Own<const T> AtomicRefcounted::addRefInternal(const T* object) {
   return kj::Own<const T>(object, *refcounted);
 }
 
+// =======================================================================================
+// Biased refcounting
+//
+// For objects that are shared across threads but are mostly passed around by one thread.
+
+class BiasedRefcounted: private kj::Disposer {
+  // Like AtomicRefcounted, but "biased" toward the thread that created the object (the owner
+  // thread): references held by the owner thread are counted with plain non-atomic arithmetic, and
+  // together hold a single reference on an atomic counter which other threads' references use.
+  // So as long as an object mostly stays on its owner thread, its refcount doesn't bounce between
+  // CPUs' caches, and no atomic instructions are needed at all.
+  //
+  // A reference obtained on the owner thread must therefore stay on that thread.  Use
+  // `kj::biasedAddRefShared()` to obtain a reference that can be passed to other threads; it
+  // always counts using the atomic counter.  (Debug builds check that owner-thread references are
+  // dropped on the owner thread.)
+
+public:
+  BiasedRefcounted();
+  virtual ~BiasedRefcounted() noexcept(false);
+  KJ_DISALLOW_COPY(BiasedRefcounted);
+
+  inline bool isOwnerThread() const { return ownerThread == currentThread(); }
+  // True if called on the thread that created the object.
+
+private:
+  class LocalDisposer final: public kj::Disposer {
+  public:
+    inline explicit LocalDisposer(const BiasedRefcounted& object): object(object) {}
+    void disposeImpl(void* pointer) const override;
+
+  private:
+    const BiasedRefcounted& object;
+  };
+
+  const void* ownerThread;
+
+  mutable uint localRefcount = 0;
+  // Number of references held by the owner thread.  Only ever touched by that thread.
+
+#if _MSC_VER
+  mutable volatile long sharedRefcount = 0;
+#else
+  mutable volatile uint sharedRefcount = 0;
+#endif
+  // Number of references held by other threads (or obtained by biasedAddRefShared()), plus one if
+  // localRefcount is non-zero.
+
+  LocalDisposer localDisposer;
+  // Disposer for the owner thread's references.  (The object itself is the disposer for shared
+  // references.)
+
+  static const void* currentThread();
+
+  void addSharedRef() const;
+  void disposeImpl(void* pointer) const override;
+
+  template <typename T>
+  static kj::Own<T> addRefInternal(T* object);
+  template <typename T>
+  static kj::Own<T> addSharedRefInternal(T* object);
+
+  template <typename T>
+  friend kj::Own<T> biasedAddRef(T& object);
+  template <typename T>
+  friend kj::Own<const T> biasedAddRef(const T& object);
+  template <typename T>
+  friend kj::Own<const T> biasedAddRefShared(const T& object);
+  template <typename T, typename... Params>
+  friend kj::Own<T> biasedRefcounted(Params&&... params);
+};
+
+template <typename T, typename... Params>
+inline kj::Own<T> biasedRefcounted(Params&&... params) {
+  // Allocate a new biased-refcounted instance of T, owned by the calling thread.
+
+  return BiasedRefcounted::addRefInternal(new T(kj::fwd<Params>(params)...));
+}
+
+template <typename T>
+kj::Own<T> biasedAddRef(T& object) {
+  // Return a new reference to `object` for use on the calling thread only.
+
+  KJ_IREQUIRE(object.BiasedRefcounted::sharedRefcount > 0,
+      "Object not allocated with kj::biasedRefcounted().");
+  return BiasedRefcounted::addRefInternal(&object);
+}
+
+template <typename T>
+kj::Own<const T> biasedAddRef(const T& object) {
+  KJ_IREQUIRE(object.BiasedRefcounted::sharedRefcount > 0,
+      "Object not allocated with kj::biasedRefcounted().");
+  return BiasedRefcounted::addRefInternal(&object);
+}
+
+template <typename T>
+kj::Own<const T> biasedAddRefShared(const T& object) {
+  // Return a new reference to `object` which may be passed to, and dropped on, any thread.
+
+  KJ_IREQUIRE(object.BiasedRefcounted::sharedRefcount > 0,
+      "Object not allocated with kj::biasedRefcounted().");
+  return BiasedRefcounted::addSharedRefInternal(&object);
+}
+
+template <typename T>
+kj::Own<T> BiasedRefcounted::addRefInternal(T* object) {
+  const BiasedRefcounted* refcounted = object;
+  if (refcounted->isOwnerThread()) {
+    if (refcounted->localRefcount++ == 0) {
+      // First owner-thread reference; it holds a shared reference on behalf of all of them.
+      refcounted->addSharedRef();
+    }
+    return kj::Own<T>(object, refcounted->localDisposer);
+  } else {
+    refcounted->addSharedRef();
+    return kj::Own<T>(object, *refcounted);
+  }
+}
+
+template <typename T>
+kj::Own<T> BiasedRefcounted::addSharedRefInternal(T* object) {
+  const BiasedRefcounted* refcounted = object;
+  refcounted->addSharedRef();
+  return kj::Own<T>(object, *refcounted);
+}
+
+inline void BiasedRefcounted::addSharedRef() const {
+#if _MSC_VER
+  KJ_MSVC_INTERLOCKED(Increment, nf)(&sharedRefcount);
+#else
+  __atomic_add_fetch(&sharedRefcount, 1, __ATOMIC_RELAXED);
+#endif
+}
+
 }  // namespace kj
@@ -22,6 +22,8 @@
 #include "string.h"
 #include <kj/compat/gtest.h>
 #include <string>
+#include <float.h>
+#include <stdlib.h>
 #include "vector.h"
 
 namespace kj {
@@ -191,6 +193,149 @@ KJ_TEST("string literals with _kj suffix") {
   KJ_EXPECT(kj::str(ARR) == "foo");
 }
 
+KJ_TEST("StringBuilder") {
+  StringBuilder<8> builder;
+  KJ_EXPECT(builder.empty());
+  KJ_EXPECT(builder.asPtr() == "");
+  KJ_EXPECT(builder.capacity() == 8);
+
+  builder.append("foo", 123, ' ', 1.5);
+  KJ_EXPECT(builder.asPtr() == "foo123 1.5");
+  KJ_EXPECT(builder.cStr()[builder.size()] == '\0');
+  KJ_EXPECT(builder.capacity() >= 10);
+
+  builder.append(ArrayPtr<const int>({1, 2, 3}), StringPtr("!"));
+  KJ_EXPECT(builder.asPtr() == "foo123 1.51, 2, 3!", builder.asPtr());
+
+  // clear() keeps the heap buffer for reuse.
+  const char* before = builder.begin();
+  size_t capacity = builder.capacity();
+  builder.clear();
+  KJ_EXPECT(builder.asPtr() == "");
+  builder.append("bar");
+  KJ_EXPECT(builder.begin() == before);
+  KJ_EXPECT(builder.capacity() == capacity);
+
+  String copy = builder.toString();
+  builder.append("baz");
+  KJ_EXPECT(copy == "bar");
+  KJ_EXPECT(kj::str(builder) == "barbaz");
+}
+
+KJ_TEST("StringBuilder stays inline until it outgrows its buffer") {
+  StringBuilder<16> builder;
+  const char* inlineBuffer = builder.begin();
+  builder.append("0123456789", "abcdef");
+  KJ_EXPECT(builder.begin() == inlineBuffer);
+  KJ_EXPECT(builder.asPtr() == "0123456789abcdef");
+  builder.append('g');
+  KJ_EXPECT(builder.begin() != inlineBuffer);
+  KJ_EXPECT(builder.asPtr() == "0123456789abcdefg");
+
+  StringBuilder<> reserved;
+  reserved.reserve(1000);
+  KJ_EXPECT(reserved.capacity() >= 1000);
+  const char* buffer = reserved.begin();
+  for (int i = 0; i < 100; i++) reserved.append(i % 10, "abcdefghi");
+  KJ_EXPECT(reserved.size() == 1000);
+  KJ_EXPECT(reserved.begin() == buffer);
+}
+
+KJ_TEST("integer stringification") {
+  KJ_EXPECT(str(0) == "0");
+  KJ_EXPECT(str(9, ' ', 10, ' ', 99, ' ', 100, ' ', 101) == "9 10 99 100 101");
+  KJ_EXPECT(str((int8_t)-128, ' ', (uint8_t)255) == "-128 255");
+  KJ_EXPECT(str((int16_t)-32768, ' ', (uint16_t)65535) == "-32768 65535");
+  KJ_EXPECT(str(kj::minValue.operator int32_t()) == "-2147483648");
+  KJ_EXPECT(str(kj::minValue.operator int64_t()) == "-9223372036854775808");
+  KJ_EXPECT(str(kj::maxValue.operator int64_t()) == "9223372036854775807");
+  KJ_EXPECT(str(kj::maxValue.operator uint64_t()) == "18446744073709551615");
+}
+
+KJ_TEST("floating-point stringification") {
+  KJ_EXPECT(str(0.0) == "0");
+  KJ_EXPECT(str(-0.0) == "-0");
+  KJ_EXPECT(str(1.0) == "1");
+  KJ_EXPECT(str(-2.5) == "-2.5");
+  KJ_EXPECT(str(0.1) == "0.1");
+  KJ_EXPECT(str(0.1 + 0.2) == "0.30000000000000004");
+  KJ_EXPECT(str(0.0001) == "0.0001");
+  KJ_EXPECT(str(0.00001) == "1e-5");
+  KJ_EXPECT(str(1e15) == "1e15");
+  KJ_EXPECT(str(123456789012345.0) == "123456789012345");
+  KJ_EXPECT(str(1234567890123456.0) == "1234567890123456");
+  KJ_EXPECT(str(12345678901234567.0) == "12345678901234568");
+  KJ_EXPECT(str(123456789012345678.0) == "1.2345678901234568e17");
+  KJ_EXPECT(str(-1.23e47) == "-1.23e47");
+  KJ_EXPECT(str(1e-306) == "1e-306");
+  KJ_EXPECT(str(DBL_MAX) == "1.7976931348623157e308");
+  KJ_EXPECT(str(inf()) == "inf");
+  KJ_EXPECT(str(-inf()) == "-inf");
+  KJ_EXPECT(str(nan()) == "nan");
+
+  KJ_EXPECT(str(0.1f) == "0.1");
+  KJ_EXPECT(str(1.5f) == "1.5");
+  KJ_EXPECT(str(1234567.0f) == "1234567");
+  KJ_EXPECT(str(-1.25e-10f) == "-1.25e-10");
+  KJ_EXPECT(str(1e37f) == "1e37");
+  KJ_EXPECT(str(FLT_MAX) == "3.4028235e38");
+}
+
+KJ_TEST("floating-point stringification round-trips") {
+  uint64_t state = 0x2545f4914f6cdd1dull;
+  auto next = [&]() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  };
+
+  for (uint i = 0; i < 20000; i++) {
+    uint64_t bits = next();
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    if (value != value) continue;
+    auto text = str(value);
+    KJ_ASSERT(strtod(text.cStr(), nullptr) == value, text);
+    KJ_ASSERT(text.size() <= 24, text);
+  }
+
+  for (uint i = 0; i < 20000; i++) {
+    uint32_t bits = static_cast<uint32_t>(next());
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    if (value != value) continue;
+    auto text = str(value);
+    KJ_ASSERT(strtof(text.cStr(), nullptr) == value, text);
+  }
+}
+
+KJ_TEST("tryParseDoubleExactly()") {
+  auto parse = [](StringPtr text) { return tryParseDoubleExactly(text); };
+
+  KJ_EXPECT(KJ_ASSERT_NONNULL(parse("0")) == 0.0);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(parse("-12.5")) == -12.5);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(parse(".5")) == 0.5);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(parse("1.")) == 1.0);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(parse("1.25E+2")) == 125.0);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(parse("0.1")) == 0.1);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(parse("9007199254740992e22")) == 9007199254740992e22);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(parse("123e-22")) == 123e-22);
+
+  // Out of the exact range, or not plain decimal: left for strtod().
+  KJ_EXPECT(parse("9007199254740993") == nullptr);
+  KJ_EXPECT(parse("1e23") == nullptr);
+  KJ_EXPECT(parse("1e-23") == nullptr);
+  KJ_EXPECT(parse("") == nullptr);
+  KJ_EXPECT(parse("-") == nullptr);
+  KJ_EXPECT(parse(".") == nullptr);
+  KJ_EXPECT(parse("1e") == nullptr);
+  KJ_EXPECT(parse("+1") == nullptr);
+  KJ_EXPECT(parse(" 1") == nullptr);
+  KJ_EXPECT(parse("0x10") == nullptr);
+  KJ_EXPECT(parse("inf") == nullptr);
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace kj
@@ -25,6 +25,7 @@
 #include <float.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 namespace kj {
 
@@ -39,7 +40,42 @@ bool isHex(const char *s) {
   return s[0] == '0' && (s[1] == 'x' || s[1] == 'X');
 }
 
+bool tryParseDecimal(const StringPtr& s, bool& negative, unsigned long long& magnitude) {
+  // Fast path for plain decimal integers of up to 19 digits, which can't overflow. Anything else
+  // (hex, a '+' sign, whitespace, garbage, longer numbers) is left to strtoll()/strtoull() so that
+  // they decide what's valid and how it's reported.
+
+  const char* pos = s.begin();
+  const char* end = s.end();
+  negative = pos < end && *pos == '-';
+  if (negative) ++pos;
+  if (pos == end || end - pos > 19) return false;
+  if (end - pos > 1 && pos[0] == '0' && (pos[1] == 'x' || pos[1] == 'X')) return false;
+
+  magnitude = 0;
+  for (; pos < end; ++pos) {
+    uint digit = static_cast<uint>(*pos - '0');
+    if (digit > 9) return false;
+    magnitude = magnitude * 10 + digit;
+  }
+  return true;
+}
+
 long long parseSigned(const StringPtr& s, long long min, long long max) {
+  bool negative;
+  unsigned long long magnitude;
+  if (tryParseDecimal(s, negative, magnitude)) {
+    if (negative) {
+      KJ_REQUIRE(magnitude <= 0ull - static_cast<unsigned long long>(min),
+                 "Value out-of-range", s) { return 0; }
+      return static_cast<long long>(0ull - magnitude);
+    } else {
+      KJ_REQUIRE(magnitude <= static_cast<unsigned long long>(max),
+                 "Value out-of-range", s) { return 0; }
+      return static_cast<long long>(magnitude);
+    }
+  }
+
   KJ_REQUIRE(s != nullptr, "String does not contain valid number", s) { return 0; }
   char *endPtr;
   errno = 0;
@@ -51,6 +87,13 @@ long long parseSigned(const StringPtr& s, long long min, long long max) {
 }
 
 unsigned long long parseUnsigned(const StringPtr& s, unsigned long long max) {
+  bool negative;
+  unsigned long long magnitude;
+  if (tryParseDecimal(s, negative, magnitude) && !negative) {
+    KJ_REQUIRE(magnitude <= max, "Value out-of-range", magnitude, max) { return 0; }
+    return magnitude;
+  }
+
   KJ_REQUIRE(s != nullptr, "String does not contain valid number", s) { return 0; }
   char *endPtr;
   errno = 0;
@@ -76,6 +119,10 @@ T parseInteger(const StringPtr& s) {
 }
 
 double parseDouble(const StringPtr& s) {
+  KJ_IF_MAYBE(value, tryParseDoubleExactly(s)) {
+    return *value;
+  }
+
   KJ_REQUIRE(s != nullptr, "String does not contain valid number", s) { return 0; }
   char *endPtr;
   errno = 0;
@@ -86,6 +133,72 @@ double parseDouble(const StringPtr& s) {
 
 } // namespace
 
+Maybe<double> tryParseDoubleExactly(ArrayPtr<const char> text) {
+#if FLT_EVAL_METHOD == 0
+  static const double POWERS_OF_TEN[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  constexpr int MAX_EXACT_POWER = 22;
+  constexpr int MAX_DIGITS = 19;  // Can't overflow uint64_t.
+
+  const char* pos = text.begin();
+  const char* end = text.end();
+  auto isDigit = [&]() { return pos < end && '0' <= *pos && *pos <= '9'; };
+
+  bool negative = pos < end && *pos == '-';
+  if (negative) ++pos;
+
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  for (; isDigit(); ++pos) {
+    if (++digits > MAX_DIGITS) return nullptr;
+    mantissa = mantissa * 10 + (*pos - '0');
+  }
+  if (pos < end && *pos == '.') {
+    for (++pos; isDigit(); ++pos) {
+      if (++digits > MAX_DIGITS) return nullptr;
+      mantissa = mantissa * 10 + (*pos - '0');
+      --exponent;
+    }
+  }
+  if (digits == 0) return nullptr;
+
+  if (pos < end && (*pos == 'e' || *pos == 'E')) {
+    ++pos;
+    bool negativeExponent = false;
+    if (pos < end && (*pos == '+' || *pos == '-')) {
+      negativeExponent = *pos++ == '-';
+    }
+    if (!isDigit()) return nullptr;
+    int explicitExponent = 0;
+    for (; isDigit(); ++pos) {
+      explicitExponent = explicitExponent * 10 + (*pos - '0');
+      if (explicitExponent > MAX_EXACT_POWER * 2) return nullptr;
+    }
+    exponent += negativeExponent ? -explicitExponent : explicitExponent;
+  }
+
+  if (pos != end ||
+      mantissa > (uint64_t(1) << 53) ||
+      exponent < -MAX_EXACT_POWER || exponent > MAX_EXACT_POWER) {
+    return nullptr;
+  }
+
+  double value = static_cast<double>(mantissa);
+  if (exponent < 0) {
+    value /= POWERS_OF_TEN[-exponent];
+  } else {
+    value *= POWERS_OF_TEN[exponent];
+  }
+  return negative ? -value : value;
+#else
+  // Intermediate results may carry extra precision, which breaks the exactness argument.
+  return nullptr;
+#endif
+}
+
 #define PARSE_AS_INTEGER(T) \
     template <> T StringPtr::parseAs<T>() const { return parseInteger<T>(*this); }
 PARSE_AS_INTEGER(char);
@@ -118,6 +231,23 @@ String heapString(const char* value, size_t size) {
   return String(buffer, size, _::HeapArrayDisposer::instance);
 }
 
+namespace _ {  // private
+
+void StringBuilderBase::reserve(size_t capacity) {
+  if (capacity >= capacity_) grow(capacity + 1);
+}
+
+void StringBuilderBase::grow(size_t minCapacity) {
+  size_t newCapacity = kj::max(minCapacity, capacity_ * 2);
+  auto newBuffer = heapArray<char>(newCapacity);
+  memcpy(newBuffer.begin(), buffer, size_ + 1);
+  heapBuffer = kj::mv(newBuffer);
+  buffer = heapBuffer.begin();
+  capacity_ = newCapacity;
+}
+
+}  // namespace _ (private)
+
 #define HEXIFY_INT(type, format) \
 CappedArray<char, sizeof(type) * 2 + 1> hex(type i) { \
   CappedArray<char, sizeof(type) * 2 + 1> result; \
@@ -143,293 +273,385 @@ StringPtr Stringifier::operator*(bool b) const {
   return b ? StringPtr("true") : StringPtr("false");
 }
 
-#define STRINGIFY_INT(type, format) \
-CappedArray<char, sizeof(type) * 3 + 2> Stringifier::operator*(type i) const { \
-  CappedArray<char, sizeof(type) * 3 + 2> result; \
-  result.setSize(sprintf(result.begin(), format, i)); \
-  return result; \
+namespace {
+
+const char DIGIT_PAIRS[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+char* formatDecimal(unsigned long long value, char* end) {
+  // Writes the decimal digits of `value` so that they end just before `end` and returns a pointer
+  // to the first one. Digits are produced two at a time, which halves the number of divisions
+  // compared to the obvious loop.
+
+  while (value >= 100) {
+    uint index = static_cast<uint>(value % 100) * 2;
+    value /= 100;
+    *--end = DIGIT_PAIRS[index + 1];
+    *--end = DIGIT_PAIRS[index];
+  }
+  if (value >= 10) {
+    uint index = static_cast<uint>(value) * 2;
+    *--end = DIGIT_PAIRS[index + 1];
+    *--end = DIGIT_PAIRS[index];
+  } else {
+    *--end = static_cast<char>('0' + value);
+  }
+  return end;
+}
+
+template <size_t size>
+CappedArray<char, size> formatInteger(unsigned long long magnitude, bool negative) {
+  char buffer[size];
+  char* end = buffer + size;
+  char* begin = formatDecimal(magnitude, end);
+  if (negative) *--begin = '-';
+
+  CappedArray<char, size> result;
+  result.setSize(end - begin);
+  memcpy(result.begin(), begin, end - begin);
+  return result;
 }
 
-STRINGIFY_INT(signed char, "%d");
-STRINGIFY_INT(unsigned char, "%u");
-STRINGIFY_INT(short, "%d");
-STRINGIFY_INT(unsigned short, "%u");
-STRINGIFY_INT(int, "%d");
-STRINGIFY_INT(unsigned int, "%u");
-STRINGIFY_INT(long, "%ld");
-STRINGIFY_INT(unsigned long, "%lu");
-STRINGIFY_INT(long long, "%lld");
-STRINGIFY_INT(unsigned long long, "%llu");
-STRINGIFY_INT(const void*, "%p");
+}  // namespace
+
+#define STRINGIFY_SIGNED(type) \
+CappedArray<char, sizeof(type) * 3 + 2> Stringifier::operator*(type i) const { \
+  /* Negate as unsigned so that the minimum value doesn't overflow. */ \
+  unsigned long long magnitude = static_cast<unsigned long long>(i); \
+  return formatInteger<sizeof(type) * 3 + 2>(i < 0 ? 0ull - magnitude : magnitude, i < 0); \
+}
+#define STRINGIFY_UNSIGNED(type) \
+CappedArray<char, sizeof(type) * 3 + 2> Stringifier::operator*(type i) const { \
+  return formatInteger<sizeof(type) * 3 + 2>(i, false); \
+}
 
-#undef STRINGIFY_INT
+STRINGIFY_SIGNED(signed char);
+STRINGIFY_UNSIGNED(unsigned char);
+STRINGIFY_SIGNED(short);
+STRINGIFY_UNSIGNED(unsigned short);
+STRINGIFY_SIGNED(int);
+STRINGIFY_UNSIGNED(unsigned int);
+STRINGIFY_SIGNED(long);
+STRINGIFY_UNSIGNED(unsigned long);
+STRINGIFY_SIGNED(long long);
+STRINGIFY_UNSIGNED(unsigned long long);
+
+#undef STRINGIFY_SIGNED
+#undef STRINGIFY_UNSIGNED
+
+CappedArray<char, sizeof(const void*) * 3 + 2> Stringifier::operator*(const void* i) const {
+  CappedArray<char, sizeof(const void*) * 3 + 2> result;
+  result.setSize(sprintf(result.begin(), "%p", i));
+  return result;
+}
 
 namespace {
 
 // ----------------------------------------------------------------------
-// DoubleToBuffer()
-// FloatToBuffer()
-//    Copied from Protocol Buffers, (C) Google, BSD license.
-//    Kenton wrote this code originally.  The following commentary is
-//    from the original.
-//
-//    Description: converts a double or float to a string which, if
-//    passed to NoLocaleStrtod(), will produce the exact same original double
-//    (except in case of NaN; all NaNs are considered the same value).
-//    We try to keep the string short but it's not guaranteed to be as
-//    short as possible.
-//
-//    DoubleToBuffer() and FloatToBuffer() write the text to the given
-//    buffer and return it.  The buffer must be at least
-//    kDoubleToBufferSize bytes for doubles and kFloatToBufferSize
-//    bytes for floats.  kFastToBufferSize is also guaranteed to be large
-//    enough to hold either.
-//
-//    We want to print the value without losing precision, but we also do
-//    not want to print more digits than necessary.  This turns out to be
-//    trickier than it sounds.  Numbers like 0.2 cannot be represented
-//    exactly in binary.  If we print 0.2 with a very large precision,
-//    e.g. "%.50g", we get "0.2000000000000000111022302462515654042363167".
-//    On the other hand, if we set the precision too low, we lose
-//    significant digits when printing numbers that actually need them.
-//    It turns out there is no precision value that does the right thing
-//    for all numbers.
+// Floating-point formatting
 //
-//    Our strategy is to first try printing with a precision that is never
-//    over-precise, then parse the result with strtod() to see if it
-//    matches.  If not, we print again with a precision that will always
-//    give a precise result, but may use more digits than necessary.
+// Digits are generated with Grisu2 (Florian Loitsch, "Printing Floating-Point Numbers Quickly and
+// Accurately with Integers", PLDI 2010), laid out along the lines of Milo Yip's implementation.
+// Grisu2 uses only 64-bit integer arithmetic and a table of cached powers of ten. Its output
+// always parses back to exactly the same value, and is the shortest such string for all but a
+// small fraction of inputs, where it may have one digit more than necessary.
 //
-//    An arguably better strategy would be to use the algorithm described
-//    in "How to Print Floating-Point Numbers Accurately" by Steele &
-//    White, e.g. as implemented by David M. Gay's dtoa().  It turns out,
-//    however, that the following implementation is about as fast as
-//    DMG's code.  Furthermore, DMG's code locks mutexes, which means it
-//    will not scale well on multi-core machines.  DMG's code is slightly
-//    more accurate (in that it will never use more digits than
-//    necessary), but this is probably irrelevant for most users.
-//
-//    Rob Pike and Ken Thompson also have an implementation of dtoa() in
-//    third_party/fmt/fltfmt.cc.  Their implementation is similar to this
-//    one in that it makes guesses and then uses strtod() to check them.
-//    Their implementation is faster because they use their own code to
-//    generate the digits in the first place rather than use snprintf(),
-//    thus avoiding format string parsing overhead.  However, this makes
-//    it considerably more complicated than the following implementation,
-//    and it is embedded in a larger library.  If speed turns out to be
-//    an issue, we could re-implement this in terms of their
-//    implementation.
-// ----------------------------------------------------------------------
-
-#ifdef _WIN32
-// MSVC has only _snprintf, not snprintf.
-//
-// MinGW has both snprintf and _snprintf, but they appear to be different
-// functions.  The former is buggy.  When invoked like so:
-//   char buffer[32];
-//   snprintf(buffer, 32, "%.*g\n", FLT_DIG, 1.23e10f);
-// it prints "1.23000e+10".  This is plainly wrong:  %g should never print
-// trailing zeros after the decimal point.  For some reason this bug only
-// occurs with some input values, not all.  In any case, _snprintf does the
-// right thing, so we use it.
-#define snprintf _snprintf
-#endif
+// The digits are then written out the way printf("%g") would, with the precision widened to the
+// number of digits produced, so that output keeps its familiar shape: "1.5", "1e15",
+// "123456789012345". Unlike printf, the exponent isn't padded to two digits ("1e-5", not
+// "1e-05"), and the result doesn't depend on the locale.
 
-inline bool IsNaN(double value) {
-  // NaN is never equal to anything, even itself.
-  return value != value;
-}
-
-// In practice, doubles should never need more than 24 bytes and floats
-// should never need more than 14 (including null terminators), but we
-// overestimate to be safe.
 static const int kDoubleToBufferSize = 32;
 static const int kFloatToBufferSize = 24;
 
-static inline bool IsValidFloatChar(char c) {
-  return ('0' <= c && c <= '9') ||
-         c == 'e' || c == 'E' ||
-         c == '+' || c == '-';
-}
-
-void DelocalizeRadix(char* buffer) {
-  // Fast check:  if the buffer has a normal decimal point, assume no
-  // translation is needed.
-  if (strchr(buffer, '.') != NULL) return;
+struct DiyFp {
+  // f * 2^e, with a 64-bit significand.
 
-  // Find the first unknown character.
-  while (IsValidFloatChar(*buffer)) ++buffer;
+  uint64_t f;
+  int e;
+};
 
-  if (*buffer == '\0') {
-    // No radix character found.
-    return;
-  }
+inline DiyFp operator-(DiyFp a, DiyFp b) { return { a.f - b.f, a.e }; }
 
-  // We are now pointing at the locale-specific radix character.  Replace it
-  // with '.'.
-  *buffer = '.';
-  ++buffer;
-
-  if (!IsValidFloatChar(*buffer) && *buffer != '\0') {
-    // It appears the radix was a multi-byte character.  We need to remove the
-    // extra bytes.
-    char* target = buffer;
-    do { ++buffer; } while (!IsValidFloatChar(*buffer) && *buffer != '\0');
-    memmove(target, buffer, strlen(buffer) + 1);
-  }
+inline DiyFp operator*(DiyFp a, DiyFp b) {
+  // Keeps the upper half of the 128-bit product, rounded.
+  const uint64_t M32 = 0xffffffffu;
+  uint64_t ah = a.f >> 32, al = a.f & M32, bh = b.f >> 32, bl = b.f & M32;
+  uint64_t hh = ah * bh, hl = ah * bl, lh = al * bh, ll = al * bl;
+  uint64_t mid = (ll >> 32) + (hl & M32) + (lh & M32) + (uint64_t(1) << 31);
+  return { hh + (hl >> 32) + (lh >> 32) + (mid >> 32), a.e + b.e + 64 };
 }
 
-void RemovePlus(char* buffer) {
-  // Remove any + characters because they are redundant and ugly.
-
-  for (;;) {
-    buffer = strchr(buffer, '+');
-    if (buffer == NULL) {
-      return;
-    }
-    memmove(buffer, buffer + 1, strlen(buffer + 1) + 1);
+inline DiyFp normalize(DiyFp x) {
+#if __GNUC__
+  int shift = __builtin_clzll(x.f);
+  return { x.f << shift, x.e - shift };
+#else
+  while ((x.f & (uint64_t(1) << 63)) == 0) {
+    x.f <<= 1;
+    --x.e;
   }
+  return x;
+#endif
 }
 
-#if _WIN32
-void RemoveE0(char* buffer) {
-  // Remove redundant leading 0's after an e, e.g. 1e012. Seems to appear on
-  // Windows.
-
-  // Find and skip 'e'.
-  char* ptr = strchr(buffer, 'e');
-  if (ptr == nullptr) return;
-  ++ptr;
+const DiyFp CACHED_POWERS[] = {
+  // Normalized approximations of 10^-348, 10^-340, ..., 10^340.
+  {0xfa8fd5a0081c0288ull, -1220}, {0xbaaee17fa23ebf76ull, -1193}, {0x8b16fb203055ac76ull, -1166},
+  {0xcf42894a5dce35eaull, -1140}, {0x9a6bb0aa55653b2dull, -1113}, {0xe61acf033d1a45dfull, -1087},
+  {0xab70fe17c79ac6caull, -1060}, {0xff77b1fcbebcdc4full, -1034}, {0xbe5691ef416bd60cull, -1007},
+  {0x8dd01fad907ffc3cull, -980}, {0xd3515c2831559a83ull, -954}, {0x9d71ac8fada6c9b5ull, -927},
+  {0xea9c227723ee8bcbull, -901}, {0xaecc49914078536dull, -874}, {0x823c12795db6ce57ull, -847},
+  {0xc21094364dfb5637ull, -821}, {0x9096ea6f3848984full, -794}, {0xd77485cb25823ac7ull, -768},
+  {0xa086cfcd97bf97f4ull, -741}, {0xef340a98172aace5ull, -715}, {0xb23867fb2a35b28eull, -688},
+  {0x84c8d4dfd2c63f3bull, -661}, {0xc5dd44271ad3cdbaull, -635}, {0x936b9fcebb25c996ull, -608},
+  {0xdbac6c247d62a584ull, -582}, {0xa3ab66580d5fdaf6ull, -555}, {0xf3e2f893dec3f126ull, -529},
+  {0xb5b5ada8aaff80b8ull, -502}, {0x87625f056c7c4a8bull, -475}, {0xc9bcff6034c13053ull, -449},
+  {0x964e858c91ba2655ull, -422}, {0xdff9772470297ebdull, -396}, {0xa6dfbd9fb8e5b88full, -369},
+  {0xf8a95fcf88747d94ull, -343}, {0xb94470938fa89bcfull, -316}, {0x8a08f0f8bf0f156bull, -289},
+  {0xcdb02555653131b6ull, -263}, {0x993fe2c6d07b7facull, -236}, {0xe45c10c42a2b3b06ull, -210},
+  {0xaa242499697392d3ull, -183}, {0xfd87b5f28300ca0eull, -157}, {0xbce5086492111aebull, -130},
+  {0x8cbccc096f5088ccull, -103}, {0xd1b71758e219652cull, -77}, {0x9c40000000000000ull, -50},
+  {0xe8d4a51000000000ull, -24}, {0xad78ebc5ac620000ull, 3}, {0x813f3978f8940984ull, 30},
+  {0xc097ce7bc90715b3ull, 56}, {0x8f7e32ce7bea5c70ull, 83}, {0xd5d238a4abe98068ull, 109},
+  {0x9f4f2726179a2245ull, 136}, {0xed63a231d4c4fb27ull, 162}, {0xb0de65388cc8ada8ull, 189},
+  {0x83c7088e1aab65dbull, 216}, {0xc45d1df942711d9aull, 242}, {0x924d692ca61be758ull, 269},
+  {0xda01ee641a708deaull, 295}, {0xa26da3999aef774aull, 322}, {0xf209787bb47d6b85ull, 348},
+  {0xb454e4a179dd1877ull, 375}, {0x865b86925b9bc5c2ull, 402}, {0xc83553c5c8965d3dull, 428},
+  {0x952ab45cfa97a0b3ull, 455}, {0xde469fbd99a05fe3ull, 481}, {0xa59bc234db398c25ull, 508},
+  {0xf6c69a72a3989f5cull, 534}, {0xb7dcbf5354e9beceull, 561}, {0x88fcf317f22241e2ull, 588},
+  {0xcc20ce9bd35c78a5ull, 614}, {0x98165af37b2153dfull, 641}, {0xe2a0b5dc971f303aull, 667},
+  {0xa8d9d1535ce3b396ull, 694}, {0xfb9b7cd9a4a7443cull, 720}, {0xbb764c4ca7a44410ull, 747},
+  {0x8bab8eefb6409c1aull, 774}, {0xd01fef10a657842cull, 800}, {0x9b10a4e5e9913129ull, 827},
+  {0xe7109bfba19c0c9dull, 853}, {0xac2820d9623bf429ull, 880}, {0x80444b5e7aa7cf85ull, 907},
+  {0xbf21e44003acdd2dull, 933}, {0x8e679c2f5e44ff8full, 960}, {0xd433179d9c8cb841ull, 986},
+  {0x9e19db92b4e31ba9ull, 1013}, {0xeb96bf6ebadf77d9ull, 1039}, {0xaf87023b9bf0ee6bull, 1066},
+};
+
+DiyFp cachedPower(int e, int& k) {
+  // Returns an approximation of 10^-k chosen so that multiplying a normalized number with
+  // exponent `e` by it yields an exponent in [-60, -32].
+
+  double dk = (-61 - e) * 0.30102999566398114 + 347;  // log10(2)
+  int ik = static_cast<int>(dk);
+  if (dk - ik > 0.0) ++ik;
+  uint index = static_cast<uint>((ik >> 3) + 1);
+  k = -(-348 + static_cast<int>(index << 3));
+  return CACHED_POWERS[index];
+}
 
-  // Skip '-'.
-  if (*ptr == '-') ++ptr;
+const uint32_t POWERS_OF_TEN_32[] = {
+  1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
 
-  // Skip '0's.
-  char* ptr2 = ptr;
-  while (*ptr2 == '0') ++ptr2;
+const uint64_t POWERS_OF_TEN_64[] = {
+  1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+  1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull,
+  100000000000000ull, 1000000000000000ull, 10000000000000000ull, 100000000000000000ull,
+  1000000000000000000ull, 10000000000000000000ull
+};
 
-  // If we went past the last digit, back up one.
-  if (*ptr2 < '0' || *ptr2 > '9') --ptr2;
+inline int countDigits(uint32_t n) {
+  int result = 1;
+  while (result < 10 && n >= POWERS_OF_TEN_32[result]) ++result;
+  return result;
+}
 
-  // Move bytes backwards.
-  if (ptr2 > ptr) {
-    memmove(ptr, ptr2, strlen(ptr2) + 1);
+void roundWeed(char* digits, int length, uint64_t delta, uint64_t rest, uint64_t tenKappa,
+               uint64_t distance) {
+  // Nudges the last digit down while that moves the result closer to the true value without
+  // leaving the safe interval.
+  while (rest < distance && delta - rest >= tenKappa &&
+         (rest + tenKappa < distance || distance - rest > rest + tenKappa - distance)) {
+    --digits[length - 1];
+    rest += tenKappa;
   }
 }
-#endif
 
-char* DoubleToBuffer(double value, char* buffer) {
-  // DBL_DIG is 15 for IEEE-754 doubles, which are used on almost all
-  // platforms these days.  Just in case some system exists where DBL_DIG
-  // is significantly larger -- and risks overflowing our buffer -- we have
-  // this assert.
-  static_assert(DBL_DIG < 20, "DBL_DIG is too big.");
-
-  if (value == inf()) {
-    strcpy(buffer, "inf");
-    return buffer;
-  } else if (value == -inf()) {
-    strcpy(buffer, "-inf");
-    return buffer;
-  } else if (IsNaN(value)) {
-    strcpy(buffer, "nan");
-    return buffer;
+void generateDigits(DiyFp w, DiyFp high, uint64_t delta, char* digits, int& length, int& k) {
+  const DiyFp one = { uint64_t(1) << -high.e, high.e };
+  const uint64_t distance = (high - w).f;
+  uint32_t integral = static_cast<uint32_t>(high.f >> -one.e);
+  uint64_t fractional = high.f & (one.f - 1);
+  int kappa = countDigits(integral);
+  length = 0;
+
+  while (kappa > 0) {
+    uint32_t power = POWERS_OF_TEN_32[kappa - 1];
+    uint32_t d = integral / power;
+    integral %= power;
+    if (d != 0 || length != 0) digits[length++] = static_cast<char>('0' + d);
+    --kappa;
+    uint64_t rest = (static_cast<uint64_t>(integral) << -one.e) + fractional;
+    if (rest <= delta) {
+      k += kappa;
+      roundWeed(digits, length, delta, rest,
+                static_cast<uint64_t>(POWERS_OF_TEN_32[kappa]) << -one.e, distance);
+      return;
+    }
   }
 
-  int snprintf_result KJ_UNUSED =
-    snprintf(buffer, kDoubleToBufferSize, "%.*g", DBL_DIG, value);
-
-  // The snprintf should never overflow because the buffer is significantly
-  // larger than the precision we asked for.
-  KJ_DASSERT(snprintf_result > 0 && snprintf_result < kDoubleToBufferSize);
-
-  // We need to make parsed_value volatile in order to force the compiler to
-  // write it out to the stack.  Otherwise, it may keep the value in a
-  // register, and if it does that, it may keep it as a long double instead
-  // of a double.  This long double may have extra bits that make it compare
-  // unequal to "value" even though it would be exactly equal if it were
-  // truncated to a double.
-  volatile double parsed_value = strtod(buffer, NULL);
-  if (parsed_value != value) {
-    int snprintf_result2 KJ_UNUSED =
-      snprintf(buffer, kDoubleToBufferSize, "%.*g", DBL_DIG+2, value);
-
-    // Should never overflow; see above.
-    KJ_DASSERT(snprintf_result2 > 0 && snprintf_result2 < kDoubleToBufferSize);
+  for (;;) {
+    fractional *= 10;
+    delta *= 10;
+    char d = static_cast<char>(fractional >> -one.e);
+    if (d != 0 || length != 0) digits[length++] = static_cast<char>('0' + d);
+    fractional &= one.f - 1;
+    --kappa;
+    if (fractional < delta) {
+      k += kappa;
+      int index = -kappa;
+      roundWeed(digits, length, delta, fractional, one.f,
+                index < 20 ? distance * POWERS_OF_TEN_64[index] : 0);
+      return;
+    }
   }
-
-  DelocalizeRadix(buffer);
-  RemovePlus(buffer);
-#if _WIN32
-  RemoveE0(buffer);
-#endif // _WIN32
-  return buffer;
 }
 
-bool safe_strtof(const char* str, float* value) {
-  char* endptr;
-  errno = 0;  // errno only gets set on errors
-#if defined(_WIN32) || defined (__hpux)  // has no strtof()
-  *value = static_cast<float>(strtod(str, &endptr));
-#else
-  *value = strtof(str, &endptr);
-#endif
-  return *str != 0 && *endptr == 0 && errno == 0;
-}
+template <typename T> struct FloatTraits;
+template <> struct FloatTraits<double> {
+  typedef uint64_t Bits;
+  static constexpr int SIGNIFICAND_BITS = 52;
+  static constexpr int EXPONENT_BIAS = 1023 + SIGNIFICAND_BITS;
+  static constexpr uint EXPONENT_MASK = 0x7ff;
+  static constexpr int PRECISION = DBL_DIG;
+};
+template <> struct FloatTraits<float> {
+  typedef uint32_t Bits;
+  static constexpr int SIGNIFICAND_BITS = 23;
+  static constexpr int EXPONENT_BIAS = 127 + SIGNIFICAND_BITS;
+  static constexpr uint EXPONENT_MASK = 0xff;
+  static constexpr int PRECISION = FLT_DIG;
+};
 
-char* FloatToBuffer(float value, char* buffer) {
-  // FLT_DIG is 6 for IEEE-754 floats, which are used on almost all
-  // platforms these days.  Just in case some system exists where FLT_DIG
-  // is significantly larger -- and risks overflowing our buffer -- we have
-  // this assert.
-  static_assert(FLT_DIG < 10, "FLT_DIG is too big");
-
-  if (value == inf()) {
-    strcpy(buffer, "inf");
-    return buffer;
-  } else if (value == -inf()) {
-    strcpy(buffer, "-inf");
-    return buffer;
-  } else if (IsNaN(value)) {
-    strcpy(buffer, "nan");
-    return buffer;
+template <typename T>
+void grisu2(typename FloatTraits<T>::Bits bits, char* digits, int& length, int& k) {
+  // Writes the digits of the positive, finite, non-zero value `bits` to `digits`, such that the
+  // value is digits * 10^k.
+
+  typedef FloatTraits<T> Traits;
+  const uint64_t hiddenBit = uint64_t(1) << Traits::SIGNIFICAND_BITS;
+  uint64_t significand = bits & (hiddenBit - 1);
+  int biasedExponent = static_cast<int>((bits >> Traits::SIGNIFICAND_BITS) & Traits::EXPONENT_MASK);
+  DiyFp v = biasedExponent == 0
+      ? DiyFp { significand, 1 - Traits::EXPONENT_BIAS }
+      : DiyFp { significand + hiddenBit, biasedExponent - Traits::EXPONENT_BIAS };
+
+  // The halfway points to the neighboring values. Every number strictly between them rounds to v.
+  DiyFp plus = normalize({ (v.f << 1) + 1, v.e - 1 });
+  DiyFp minus = v.f == hiddenBit ? DiyFp { (v.f << 2) - 1, v.e - 2 }
+                                 : DiyFp { (v.f << 1) - 1, v.e - 1 };
+  minus.f <<= minus.e - plus.e;
+  minus.e = plus.e;
+
+  DiyFp power = cachedPower(plus.e, k);
+  DiyFp w = normalize(v) * power;
+  DiyFp high = plus * power;
+  DiyFp low = minus * power;
+  // The products may each be off by one unit; shrink the interval to stay on the safe side.
+  ++low.f;
+  --high.f;
+  generateDigits(w, high, high.f - low.f, digits, length, k);
+
+  while (length > 1 && digits[length - 1] == '0') {
+    --length;
+    ++k;
   }
+}
 
-  int snprintf_result KJ_UNUSED =
-    snprintf(buffer, kFloatToBufferSize, "%.*g", FLT_DIG, value);
-
-  // The snprintf should never overflow because the buffer is significantly
-  // larger than the precision we asked for.
-  KJ_DASSERT(snprintf_result > 0 && snprintf_result < kFloatToBufferSize);
-
-  float parsed_value;
-  if (!safe_strtof(buffer, &parsed_value) || parsed_value != value) {
-    int snprintf_result2 KJ_UNUSED =
-      snprintf(buffer, kFloatToBufferSize, "%.*g", FLT_DIG+2, value);
+template <typename T>
+size_t formatFloat(T value, char* out) {
+  typedef FloatTraits<T> Traits;
+
+  char* pos = out;
+  typename Traits::Bits bits;
+  memcpy(&bits, &value, sizeof(bits));
+  bool negative = bits >> (sizeof(bits) * 8 - 1);
+  bits &= ~(typename Traits::Bits(1) << (sizeof(bits) * 8 - 1));
+
+  if (value != value) {
+    memcpy(pos, "nan", 3);
+    return 3;
+  }
+  if (negative) *pos++ = '-';
+  if (value == inf() || value == -inf()) {
+    memcpy(pos, "inf", 3);
+    return pos + 3 - out;
+  }
+  if (bits == 0) {
+    *pos++ = '0';
+    return pos - out;
+  }
 
-    // Should never overflow; see above.
-    KJ_DASSERT(snprintf_result2 > 0 && snprintf_result2 < kFloatToBufferSize);
+  char digits[20];
+  int length, k;
+  grisu2<T>(bits, digits, length, k);
+
+  int exponent = length + k - 1;
+  int precision = length > Traits::PRECISION ? length : Traits::PRECISION;
+  if (exponent < -4 || exponent >= precision) {
+    *pos++ = digits[0];
+    if (length > 1) {
+      *pos++ = '.';
+      memcpy(pos, digits + 1, length - 1);
+      pos += length - 1;
+    }
+    *pos++ = 'e';
+    unsigned long long magnitude = exponent;
+    if (exponent < 0) {
+      *pos++ = '-';
+      magnitude = -exponent;
+    }
+    char exponentDigits[4];
+    char* end = exponentDigits + sizeof(exponentDigits);
+    char* begin = formatDecimal(magnitude, end);
+    memcpy(pos, begin, end - begin);
+    pos += end - begin;
+  } else if (exponent >= 0) {
+    if (length <= exponent + 1) {
+      memcpy(pos, digits, length);
+      pos += length;
+      memset(pos, '0', exponent + 1 - length);
+      pos += exponent + 1 - length;
+    } else {
+      memcpy(pos, digits, exponent + 1);
+      pos += exponent + 1;
+      *pos++ = '.';
+      memcpy(pos, digits + exponent + 1, length - exponent - 1);
+      pos += length - exponent - 1;
+    }
+  } else {
+    *pos++ = '0';
+    *pos++ = '.';
+    memset(pos, '0', -exponent - 1);
+    pos += -exponent - 1;
+    memcpy(pos, digits, length);
+    pos += length;
   }
 
-  DelocalizeRadix(buffer);
-  RemovePlus(buffer);
-#if _WIN32
-  RemoveE0(buffer);
-#endif // _WIN32
-  return buffer;
+  return pos - out;
 }
 
 }  // namespace
 
 CappedArray<char, kFloatToBufferSize> Stringifier::operator*(float f) const {
   CappedArray<char, kFloatToBufferSize> result;
-  result.setSize(strlen(FloatToBuffer(f, result.begin())));
+  result.setSize(formatFloat(f, result.begin()));
   return result;
 }
 
 CappedArray<char, kDoubleToBufferSize> Stringifier::operator*(double f) const {
   CappedArray<char, kDoubleToBufferSize> result;
-  result.setSize(strlen(DoubleToBuffer(f, result.begin())));
+  result.setSize(formatFloat(f, result.begin()));
   return result;
 }
 
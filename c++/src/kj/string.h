@@ -162,6 +162,14 @@ template <> unsigned long long StringPtr::parseAs<unsigned long long>() const;
 template <> float StringPtr::parseAs<float>() const;
 template <> double StringPtr::parseAs<double>() const;
 
+Maybe<double> tryParseDoubleExactly(ArrayPtr<const char> text);
+// Parses a plain decimal number -- `-?[0-9]*(\.[0-9]*)?([eE][+-]?[0-9]+)?` with at least one
+// digit -- if its significand fits exactly in a double and its power of ten is at most 22, in
+// which case a single multiplication or division gives the correctly rounded result, i.e. exactly
+// what strtod() would return, without strtod()'s locale handling and general-case machinery.
+// Returns null for anything else, including text strtod() would accept; callers should fall back
+// to it. parseAs<double>() does this, as does the JSON decoder.
+
 // =======================================================================================
 // String -- A NUL-terminated Array<char> containing UTF-8 text.
 //
@@ -441,6 +449,100 @@ inline String Stringifier::operator*(const Array<T>& arr) const {
 // The function should be declared either in the same namespace as the target type or in the global
 // namespace.  It can return any type which is an iterable container of chars.
 
+// =======================================================================================
+// StringBuilder
+
+namespace _ {  // private
+
+class StringBuilderBase {
+  // The non-template part of StringBuilder<n>. Accept `_::StringBuilderBase&` to write a function
+  // which appends to a builder of any inline size.
+
+public:
+  KJ_DISALLOW_COPY(StringBuilderBase);
+
+  template <typename... Params>
+  void append(Params&&... params) {
+    // Appends str(params...) to the builder. Accepts everything str() accepts. No allocation
+    // happens unless the result outgrows the current capacity.
+    //
+    // The parameters must not point into the builder itself.
+    appendPieces(toCharSequence(kj::fwd<Params>(params))...);
+  }
+
+  inline void clear() { size_ = 0; buffer[0] = '\0'; }
+  // Empties the builder without giving back its capacity, so that it can be reused.
+
+  void reserve(size_t capacity);
+  // Makes sure the builder can hold `capacity` chars without reallocating.
+
+  inline size_t size() const { return size_; }
+  inline size_t capacity() const { return capacity_ - 1; }
+  inline bool empty() const { return size_ == 0; }
+
+  inline const char* begin() const { return buffer; }
+  inline const char* end() const { return buffer + size_; }
+  inline const char* cStr() const { return buffer; }
+
+  inline StringPtr asPtr() const { return StringPtr(buffer, size_); }
+  inline ArrayPtr<const char> asArray() const { return arrayPtr(buffer, size_); }
+  inline operator StringPtr() const { return asPtr(); }
+  inline operator ArrayPtr<const char>() const { return asArray(); }
+  // The returned pointers are invalidated by the next append(), clear(), or reserve().
+
+  inline String toString() const { return heapString(buffer, size_); }
+  // Copies the contents out into a new String.
+
+protected:
+  inline StringBuilderBase(char* inlineBuffer, size_t inlineSize)
+      : buffer(inlineBuffer), size_(0), capacity_(inlineSize) {
+    buffer[0] = '\0';
+  }
+
+private:
+  char* buffer;
+  size_t size_;
+  size_t capacity_;  // including room for the NUL terminator
+  Array<char> heapBuffer;
+
+  template <typename... Pieces>
+  void appendPieces(Pieces&&... pieces) {
+    size_t added = sum({pieces.size()...});
+    if (size_ + added >= capacity_) grow(size_ + added + 1);
+    char* pos = fill(buffer + size_, kj::fwd<Pieces>(pieces)...);
+    *pos = '\0';
+    size_ += added;
+  }
+
+  void grow(size_t minCapacity);
+};
+
+}  // namespace _ (private)
+
+template <size_t inlineSize = 128>
+class StringBuilder: public _::StringBuilderBase {
+  // A growable, NUL-terminated character buffer which formats values the same way str() does,
+  // but appends to itself instead of allocating a fresh String for every call. The first
+  // `inlineSize` chars live inside the object; beyond that the buffer moves to the heap and keeps
+  // that allocation across clear(), so a long-lived builder stops allocating once it has seen
+  // its largest output.
+  //
+  //     kj::StringBuilder<> line;
+  //     for (auto& header: headers) {
+  //       line.clear();
+  //       line.append(header.name, ": ", header.value, "\r\n");
+  //       out.write(line.begin(), line.size());
+  //     }
+  //
+  // StringBuilder is neither copyable nor movable. Use toString() to get an independent String.
+
+public:
+  inline StringBuilder(): StringBuilderBase(inlineBuffer, sizeof(inlineBuffer)) {}
+
+private:
+  char inlineBuffer[inlineSize + 1];
+};
+
 // =======================================================================================
 // Inline implementation details.
 
@@ -120,5 +120,27 @@ KJ_TEST("threads pick up exception callback initializer") {
   KJ_EXPECT(context.captured == "foobar", context.captured);
 }
 
+#if __linux__
+KJ_TEST("thread affinity") {
+  auto cpus = getAvailableCpus();
+  KJ_ASSERT(cpus.size() > 0);
+  uint cpu = cpus.back();
+
+  Array<uint> seen;
+  Thread([&]() {
+    setCurrentThreadAffinity(arrayPtr(&cpu, 1));
+    seen = getAvailableCpus();
+  });
+  KJ_ASSERT(seen.size() == 1);
+  KJ_EXPECT(seen[0] == cpu);
+
+  // Pinning one thread doesn't affect others.
+  KJ_EXPECT(getAvailableCpus().size() == cpus.size());
+
+  // getNumaNode() always returns something, even when sysfs is missing.
+  getNumaNode(cpu);
+}
+#endif
+
 }  // namespace
 }  // namespace kj
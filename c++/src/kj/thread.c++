@@ -21,6 +21,7 @@
 
 #include "thread.h"
 #include "debug.h"
+#include "vector.h"
 
 #if _WIN32
 #include <windows.h>
@@ -30,6 +31,13 @@
 #include <signal.h>
 #endif
 
+#if __linux__
+#include <sched.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+
 namespace kj {
 
 #if _WIN32
@@ -110,6 +118,74 @@ void Thread::detach() {
 
 #endif  // _WIN32, else
 
+#if __linux__
+
+namespace {
+
+cpu_set_t toCpuSet(ArrayPtr<const uint> cpus) {
+  KJ_REQUIRE(cpus.size() > 0, "can't restrict a thread to no CPUs");
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (uint cpu: cpus) {
+    KJ_REQUIRE(cpu < CPU_SETSIZE, "CPU number out of range", cpu);
+    CPU_SET(cpu, &set);
+  }
+  return set;
+}
+
+}  // namespace
+
+void Thread::setAffinity(ArrayPtr<const uint> cpus) {
+  cpu_set_t set = toCpuSet(cpus);
+  int pthreadResult = pthread_setaffinity_np(
+      *reinterpret_cast<pthread_t*>(&threadId), sizeof(set), &set);
+  if (pthreadResult != 0) {
+    KJ_FAIL_SYSCALL("pthread_setaffinity_np", pthreadResult);
+  }
+}
+
+void setCurrentThreadAffinity(ArrayPtr<const uint> cpus) {
+  cpu_set_t set = toCpuSet(cpus);
+  int pthreadResult = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (pthreadResult != 0) {
+    KJ_FAIL_SYSCALL("pthread_setaffinity_np", pthreadResult);
+  }
+}
+
+Array<uint> getAvailableCpus() {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  int pthreadResult = pthread_getaffinity_np(pthread_self(), sizeof(set), &set);
+  if (pthreadResult != 0) {
+    KJ_FAIL_SYSCALL("pthread_getaffinity_np", pthreadResult);
+  }
+
+  Vector<uint> result(CPU_COUNT(&set));
+  for (uint cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &set)) result.add(cpu);
+  }
+  return result.releaseAsArray();
+}
+
+uint getNumaNode(uint cpu) {
+  // The kernel links each CPU's sysfs directory to its node as "node<N>".  Non-NUMA kernels may
+  // omit the link entirely.
+  auto path = kj::str("/sys/devices/system/cpu/cpu", cpu);
+  DIR* dir = opendir(path.cStr());
+  if (dir == nullptr) return 0;
+  KJ_DEFER(closedir(dir));
+
+  while (struct dirent* entry = readdir(dir)) {
+    if (strncmp(entry->d_name, "node", 4) == 0 &&
+        entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+      return strtoul(entry->d_name + 4, nullptr, 10);
+    }
+  }
+  return 0;
+}
+
+#endif  // __linux__
+
 Thread::ThreadState::ThreadState(Function<void()> func)
     : func(kj::mv(func)),
       initializer(getExceptionCallback().getThreadInitializer()),
@@ -23,6 +23,7 @@
 #include "time.h"
 #include "debug.h"
 #include <set>
+#include <chrono>
 
 namespace kj {
 
@@ -35,4 +36,17 @@ const Clock& nullClock() {
   return NULL_CLOCK;
 }
 
+const Clock& systemCalendarClock() {
+  class SystemCalendarClock final: public Clock {
+  public:
+    Date now() const override {
+      auto sinceEpoch = std::chrono::system_clock::now().time_since_epoch();
+      return UNIX_EPOCH +
+          std::chrono::duration_cast<std::chrono::nanoseconds>(sinceEpoch).count() * NANOSECONDS;
+    }
+  };
+  static KJ_CONSTEXPR(const) SystemCalendarClock SYSTEM_CALENDAR_CLOCK;
+  return SYSTEM_CALENDAR_CLOCK;
+}
+
 }  // namespace kj
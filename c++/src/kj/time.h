@@ -69,4 +69,7 @@ const Clock& nullClock();
 // A clock which always returns UNIX_EPOCH as the current time. Useful when you don't care about
 // time.
 
+const Clock& systemCalendarClock();
+// The operating system's real-time clock, i.e. the one files' modification times come from.
+
 }  // namespace kj
@@ -22,7 +22,12 @@
 
 #include "timer.h"
 #include "debug.h"
+#include "vector.h"
 #include <set>
+#include <algorithm>
+#if _MSC_VER
+#include <intrin.h>
+#endif
 
 namespace kj {
 
@@ -31,6 +36,25 @@ kj::Exception Timer::makeTimeoutException() {
 }
 
 struct TimerImpl::Impl {
+  virtual ~Impl() noexcept(false) {}
+
+  virtual Promise<void> atTime(TimePoint time) = 0;
+  virtual Maybe<TimePoint> nextEvent() = 0;
+  virtual void advanceTo(TimePoint newTime) = 0;
+  // `TimerImpl::advanceTo()` updates `TimerImpl::time` before calling this.
+};
+
+// =======================================================================================
+// TimerStrategy::ORDERED_SET
+
+class TimerImpl::OrderedImpl final: public TimerImpl::Impl {
+public:
+  Promise<void> atTime(TimePoint time) override;
+  Maybe<TimePoint> nextEvent() override;
+  void advanceTo(TimePoint newTime) override;
+
+private:
+  class TimerPromiseAdapter;
   struct TimerBefore {
     bool operator()(TimerPromiseAdapter* lhs, TimerPromiseAdapter* rhs);
   };
@@ -38,9 +62,9 @@ struct TimerImpl::Impl {
   Timers timers;
 };
 
-class TimerImpl::TimerPromiseAdapter {
+class TimerImpl::OrderedImpl::TimerPromiseAdapter {
 public:
-  TimerPromiseAdapter(PromiseFulfiller<void>& fulfiller, TimerImpl::Impl& impl, TimePoint time)
+  TimerPromiseAdapter(PromiseFulfiller<void>& fulfiller, OrderedImpl& impl, TimePoint time)
       : time(time), fulfiller(fulfiller), impl(impl) {
     pos = impl.timers.insert(this);
   }
@@ -61,35 +85,368 @@ public:
 
 private:
   PromiseFulfiller<void>& fulfiller;
-  TimerImpl::Impl& impl;
-  Impl::Timers::const_iterator pos;
+  OrderedImpl& impl;
+  Timers::const_iterator pos;
 };
 
-inline bool TimerImpl::Impl::TimerBefore::operator()(
+inline bool TimerImpl::OrderedImpl::TimerBefore::operator()(
     TimerPromiseAdapter* lhs, TimerPromiseAdapter* rhs) {
   return lhs->time < rhs->time;
 }
 
+Promise<void> TimerImpl::OrderedImpl::atTime(TimePoint time) {
+  return newAdaptedPromise<void, TimerPromiseAdapter>(*this, time);
+}
+
+Maybe<TimePoint> TimerImpl::OrderedImpl::nextEvent() {
+  auto iter = timers.begin();
+  if (iter == timers.end()) {
+    return nullptr;
+  } else {
+    return (*iter)->time;
+  }
+}
+
+void TimerImpl::OrderedImpl::advanceTo(TimePoint newTime) {
+  for (;;) {
+    auto front = timers.begin();
+    if (front == timers.end() || (*front)->time > newTime) {
+      break;
+    }
+    (*front)->fulfill();
+  }
+}
+
+// =======================================================================================
+// TimerStrategy::TIMING_WHEEL
+//
+// Time is divided into ticks of 2^TICK_SHIFT nanoseconds (about a millisecond), counted from the
+// timer's start time. The wheel has LEVEL_COUNT levels of SLOT_COUNT slots each; a slot on level
+// k spans SLOT_COUNT^k ticks. `currentTick` is the tick the wheel has been advanced to. A timer
+// expiring at tick `e` lives on the lowest level k at which `e` and `currentTick` agree on all
+// bits above that level's slot index, in the slot named by `e`'s bits at that level. Hence level
+// 0 only ever holds timers expiring on exactly the tick selected by the slot (or, in the current
+// slot, timers that are already due), and a slot on a higher level is redistributed ("cascaded")
+// to lower levels once `currentTick` enters the range it spans. Timers beyond the range of the
+// top level wait on an overflow list.
+//
+// Each slot is an intrusive list, so scheduling and canceling are O(1) and allocate nothing
+// beyond the promise itself. A bitmap per level lets advanceTo() skip directly to the next
+// non-empty slot rather than visiting every tick.
+
+namespace {
+
+inline uint countTrailingZeros(uint64_t value) {
+#if _MSC_VER
+  unsigned long result;
+  _BitScanForward64(&result, value);
+  return result;
+#else
+  return __builtin_ctzll(value);
+#endif
+}
+
+}  // namespace
+
+class TimerImpl::WheelImpl final: public TimerImpl::Impl {
+public:
+  explicit WheelImpl(TimePoint startTime): origin(startTime) {}
+  ~WheelImpl() noexcept(false);
+
+  Promise<void> atTime(TimePoint time) override;
+  Maybe<TimePoint> nextEvent() override;
+  void advanceTo(TimePoint newTime) override;
+
+private:
+  class TimerPromiseAdapter;
+
+  static constexpr uint TICK_SHIFT = 20;
+  static constexpr uint SLOT_BITS = 6;
+  static constexpr uint SLOT_COUNT = 1u << SLOT_BITS;
+  static constexpr uint LEVEL_COUNT = 6;
+  static constexpr uint OVERFLOW_SLOT = LEVEL_COUNT * SLOT_COUNT;
+  // With these parameters the levels cover 2^56 ns, a little over two years.
+
+  TimePoint origin;
+  uint64_t currentTick = 0;
+  uint64_t nextSequence = 0;
+  // Timers that expire at the same time fire in the order in which they were scheduled, like
+  // with ORDERED_SET. Cascading does not preserve list order, so we number timers instead.
+
+  TimerPromiseAdapter* slots[OVERFLOW_SLOT + 1] = {};
+  uint64_t occupied[LEVEL_COUNT] = {};
+  // Bit i of occupied[k] is set if slot i of level k is non-empty.
+
+  Maybe<TimePoint> earliest;
+  bool earliestValid = true;
+  // Cached result of nextEvent(), since scanning for it is not constant-time. Invalidated when the
+  // earliest timer is removed.
+
+  Vector<TimerPromiseAdapter*> firing;
+  // Scratch space for advanceTo().
+
+  uint64_t tickFor(TimePoint time) const;
+  uint slotFor(uint64_t tick) const;
+  void link(TimerPromiseAdapter& timer);
+  void unlink(TimerPromiseAdapter& timer);
+  void redistribute(uint slot);
+  bool findNextSlot(uint& slot, uint64_t& slotStart) const;
+  Maybe<TimePoint> earliestIn(uint slot) const;
+  void fireDue(TimePoint now);
+};
+
+class TimerImpl::WheelImpl::TimerPromiseAdapter {
+public:
+  TimerPromiseAdapter(PromiseFulfiller<void>& fulfiller, WheelImpl& impl, TimePoint time)
+      : time(time), tick(impl.tickFor(time)), sequence(impl.nextSequence++),
+        fulfiller(fulfiller), impl(impl) {
+    impl.link(*this);
+
+    if (impl.earliestValid) {
+      KJ_IF_MAYBE(e, impl.earliest) {
+        if (time < *e) impl.earliest = time;
+      } else {
+        impl.earliest = time;
+      }
+    }
+  }
+
+  ~TimerPromiseAdapter() {
+    if (prev != nullptr) {
+      impl.unlink(*this);
+    }
+  }
+
+  void fulfill() {
+    fulfiller.fulfill();
+    impl.unlink(*this);
+  }
+
+  const TimePoint time;
+  const uint64_t tick;
+  const uint64_t sequence;
+
+private:
+  PromiseFulfiller<void>& fulfiller;
+  WheelImpl& impl;
+
+  uint slot = 0;
+  TimerPromiseAdapter* next = nullptr;
+  TimerPromiseAdapter** prev = nullptr;
+  // Position in `impl.slots`. `prev` is null once the timer has been removed.
+
+  friend class WheelImpl;
+};
+
+TimerImpl::WheelImpl::~WheelImpl() noexcept(false) {
+  // Any remaining timers belong to promises that outlive us; make sure they don't try to unlink
+  // themselves later.
+  for (auto head: slots) {
+    for (auto timer = head; timer != nullptr; timer = timer->next) {
+      timer->prev = nullptr;
+    }
+  }
+}
+
+inline uint64_t TimerImpl::WheelImpl::tickFor(TimePoint time) const {
+  if (time <= origin) return 0;
+  return uint64_t((time - origin) / NANOSECONDS) >> TICK_SHIFT;
+}
+
+uint TimerImpl::WheelImpl::slotFor(uint64_t tick) const {
+  if (tick <= currentTick) {
+    // Already due; goes in the current level 0 slot.
+    return currentTick & (SLOT_COUNT - 1);
+  }
+
+  for (uint level = 0; level < LEVEL_COUNT; level++) {
+    uint shift = SLOT_BITS * (level + 1);
+    if ((tick >> shift) == (currentTick >> shift)) {
+      return level * SLOT_COUNT + ((tick >> (SLOT_BITS * level)) & (SLOT_COUNT - 1));
+    }
+  }
+
+  return OVERFLOW_SLOT;
+}
+
+void TimerImpl::WheelImpl::link(TimerPromiseAdapter& timer) {
+  uint slot = slotFor(timer.tick);
+  timer.slot = slot;
+  timer.next = slots[slot];
+  if (timer.next != nullptr) timer.next->prev = &timer.next;
+  timer.prev = &slots[slot];
+  slots[slot] = &timer;
+
+  if (slot < OVERFLOW_SLOT) {
+    occupied[slot / SLOT_COUNT] |= uint64_t(1) << (slot % SLOT_COUNT);
+  }
+}
+
+void TimerImpl::WheelImpl::unlink(TimerPromiseAdapter& timer) {
+  *timer.prev = timer.next;
+  if (timer.next != nullptr) timer.next->prev = timer.prev;
+  timer.next = nullptr;
+  timer.prev = nullptr;
+
+  uint slot = timer.slot;
+  if (slot < OVERFLOW_SLOT && slots[slot] == nullptr) {
+    occupied[slot / SLOT_COUNT] &= ~(uint64_t(1) << (slot % SLOT_COUNT));
+  }
+
+  KJ_IF_MAYBE(e, earliest) {
+    if (timer.time == *e) earliestValid = false;
+  }
+}
+
+void TimerImpl::WheelImpl::redistribute(uint slot) {
+  // Re-link every timer in the slot relative to the (new) current tick.
+
+  TimerPromiseAdapter* timer = slots[slot];
+  slots[slot] = nullptr;
+  if (slot < OVERFLOW_SLOT) {
+    occupied[slot / SLOT_COUNT] &= ~(uint64_t(1) << (slot % SLOT_COUNT));
+  }
+
+  while (timer != nullptr) {
+    TimerPromiseAdapter* next = timer->next;
+    link(*timer);
+    timer = next;
+  }
+}
+
+bool TimerImpl::WheelImpl::findNextSlot(uint& slot, uint64_t& slotStart) const {
+  // Find the earliest non-empty slot that starts after the current tick. Because timers on level
+  // k always agree with the current tick above level k, the first hit on the lowest level is the
+  // earliest.
+
+  for (uint level = 0; level < LEVEL_COUNT; level++) {
+    uint shift = SLOT_BITS * level;
+    uint index = (currentTick >> shift) & (SLOT_COUNT - 1);
+    uint64_t mask = index + 1 < SLOT_COUNT ? occupied[level] & (~uint64_t(0) << (index + 1)) : 0;
+    if (mask != 0) {
+      uint next = countTrailingZeros(mask);
+      slot = level * SLOT_COUNT + next;
+      slotStart = ((currentTick >> (shift + SLOT_BITS)) << (shift + SLOT_BITS)) |
+                  (uint64_t(next) << shift);
+      return true;
+    }
+  }
+
+  if (slots[OVERFLOW_SLOT] != nullptr) {
+    uint shift = SLOT_BITS * LEVEL_COUNT;
+    slot = OVERFLOW_SLOT;
+    slotStart = ((currentTick >> shift) + 1) << shift;
+    return true;
+  }
+
+  return false;
+}
+
+Maybe<TimePoint> TimerImpl::WheelImpl::earliestIn(uint slot) const {
+  Maybe<TimePoint> result;
+  for (auto timer = slots[slot]; timer != nullptr; timer = timer->next) {
+    KJ_IF_MAYBE(r, result) {
+      if (timer->time < *r) *r = timer->time;
+    } else {
+      result = timer->time;
+    }
+  }
+  return result;
+}
+
+void TimerImpl::WheelImpl::fireDue(TimePoint now) {
+  // Fire all timers in the current level 0 slot which have expired.
+
+  uint slot = currentTick & (SLOT_COUNT - 1);
+  for (auto timer = slots[slot]; timer != nullptr; timer = timer->next) {
+    if (timer->time <= now) firing.add(timer);
+  }
+  if (firing.size() == 0) return;
+
+  std::sort(firing.begin(), firing.end(), [](TimerPromiseAdapter* a, TimerPromiseAdapter* b) {
+    return a->time < b->time || (a->time == b->time && a->sequence < b->sequence);
+  });
+  for (auto timer: firing) {
+    timer->fulfill();
+  }
+  firing.clear();
+}
+
+Promise<void> TimerImpl::WheelImpl::atTime(TimePoint time) {
+  return newAdaptedPromise<void, TimerPromiseAdapter>(*this, time);
+}
+
+Maybe<TimePoint> TimerImpl::WheelImpl::nextEvent() {
+  if (!earliestValid) {
+    // Timers in the current slot are due before all others. Otherwise, the next event is in the
+    // next non-empty slot, though not necessarily at its start.
+    earliest = earliestIn(currentTick & (SLOT_COUNT - 1));
+    uint slot;
+    uint64_t slotStart;
+    if (earliest == nullptr && findNextSlot(slot, slotStart)) {
+      earliest = earliestIn(slot);
+    }
+    earliestValid = true;
+  }
+  return earliest;
+}
+
+void TimerImpl::WheelImpl::advanceTo(TimePoint newTime) {
+  uint64_t targetTick = tickFor(newTime);
+
+  for (;;) {
+    fireDue(newTime);
+    if (currentTick >= targetTick) break;
+
+    uint slot;
+    uint64_t slotStart;
+    uint64_t nextTick = findNextSlot(slot, slotStart) ? slotStart : targetTick;
+    if (nextTick > targetTick) nextTick = targetTick;
+
+    // Move the wheel forward. Every higher-level slot (and the overflow list) whose range we
+    // have just entered must be cascaded down. There is at most one such slot per level, and
+    // the ones we skipped over without entering were empty.
+    uint64_t oldTick = currentTick;
+    currentTick = nextTick;
+    if ((oldTick >> (SLOT_BITS * LEVEL_COUNT)) != (currentTick >> (SLOT_BITS * LEVEL_COUNT))) {
+      redistribute(OVERFLOW_SLOT);
+    }
+    for (uint level = LEVEL_COUNT - 1; level > 0; level--) {
+      uint shift = SLOT_BITS * level;
+      if ((oldTick >> shift) != (currentTick >> shift)) {
+        redistribute(level * SLOT_COUNT + ((currentTick >> shift) & (SLOT_COUNT - 1)));
+      }
+    }
+  }
+}
+
+// =======================================================================================
+
 Promise<void> TimerImpl::atTime(TimePoint time) {
-  return newAdaptedPromise<void, TimerPromiseAdapter>(*impl, time);
+  return impl->atTime(time);
 }
 
 Promise<void> TimerImpl::afterDelay(Duration delay) {
-  return newAdaptedPromise<void, TimerPromiseAdapter>(*impl, time + delay);
+  return impl->atTime(time + delay);
 }
 
-TimerImpl::TimerImpl(TimePoint startTime)
-    : time(startTime), impl(heap<Impl>()) {}
+TimerImpl::TimerImpl(TimePoint startTime, TimerStrategy strategy)
+    : time(startTime) {
+  switch (strategy) {
+    case TimerStrategy::ORDERED_SET:
+      impl = heap<OrderedImpl>();
+      return;
+    case TimerStrategy::TIMING_WHEEL:
+      impl = heap<WheelImpl>(startTime);
+      return;
+  }
+  KJ_UNREACHABLE;
+}
 
 TimerImpl::~TimerImpl() noexcept(false) {}
 
 Maybe<TimePoint> TimerImpl::nextEvent() {
-  auto iter = impl->timers.begin();
-  if (iter == impl->timers.end()) {
-    return nullptr;
-  } else {
-    return (*iter)->time;
-  }
+  return impl->nextEvent();
 }
 
 Maybe<uint64_t> TimerImpl::timeoutToNextEvent(TimePoint start, Duration unit, uint64_t max) {
@@ -113,13 +470,7 @@ void TimerImpl::advanceTo(TimePoint newTime) {
   KJ_REQUIRE(newTime >= time, "can't advance backwards in time") { return; }
 
   time = newTime;
-  for (;;) {
-    auto front = impl->timers.begin();
-    if (front == impl->timers.end() || (*front)->time > time) {
-      break;
-    }
-    (*front)->fulfill();
-  }
+  impl->advanceTo(newTime);
 }
 
 }  // namespace kj
@@ -67,12 +67,28 @@ private:
   static kj::Exception makeTimeoutException();
 };
 
+enum class TimerStrategy {
+  // Data structure a TimerImpl uses to keep track of pending timers.
+
+  ORDERED_SET,
+  // A balanced tree ordered by expiration time. Scheduling or canceling a timer costs O(log n)
+  // time plus a node allocation. This is the default.
+
+  TIMING_WHEEL
+  // A hierarchical timing wheel with a resolution of about a millisecond. Scheduling and canceling
+  // a timer are O(1) and allocate nothing besides the promise itself, and advancing time costs
+  // O(1) per fired timer plus occasional redistribution of far-future timers. Timers still fire
+  // at exactly their scheduled time, in the same order as ORDERED_SET. Prefer this when a very
+  // large number of timers are scheduled and canceled, e.g. a timeout per connection on a busy
+  // server.
+};
+
 class TimerImpl final: public Timer {
   // Implementation of Timer that expects an external caller -- usually, the EventPort
   // implementation -- to tell it when time has advanced.
 
 public:
-  TimerImpl(TimePoint startTime);
+  TimerImpl(TimePoint startTime, TimerStrategy strategy = TimerStrategy::ORDERED_SET);
   ~TimerImpl() noexcept(false);
 
   Maybe<TimePoint> nextEvent();
@@ -105,7 +121,8 @@ public:
 
 private:
   struct Impl;
-  class TimerPromiseAdapter;
+  class OrderedImpl;
+  class WheelImpl;
   TimePoint time;
   Own<Impl> impl;
 };
@@ -149,4 +149,168 @@ inline auto KJ_STRINGIFY(const Vector<T>& v) -> decltype(toCharSequence(v.asPtr(
   return toCharSequence(v.asPtr());
 }
 
+template <typename T, size_t inlineCapacity>
+class SmallVector {
+  // Like Vector, but stores up to `inlineCapacity` elements inside the object itself, only
+  // allocating from the heap once it grows beyond that. Use for vectors that are usually tiny and
+  // are created and destroyed often, so that the common case makes no allocation at all.
+  //
+  // Moving a SmallVector whose elements are stored inline moves the elements one at a time, so
+  // unlike Vector, pointers into a moved-from SmallVector do not remain valid.
+
+  static_assert(inlineCapacity > 0, "use Vector if you don't want inline storage");
+
+public:
+  inline SmallVector(): builder(inlineBuilder()) {}
+  inline explicit SmallVector(size_t capacity)
+      : builder(capacity <= inlineCapacity ? inlineBuilder() : heapArrayBuilder<T>(capacity)) {}
+  inline SmallVector(Array<T>&& array)
+      : builder(array.size() == 0 ? inlineBuilder() : ArrayBuilder<T>(kj::mv(array))) {}
+
+  inline SmallVector(SmallVector&& other): builder(inlineBuilder()) {
+    takeFrom(other);
+  }
+  inline SmallVector& operator=(SmallVector&& other) {
+    if (this != &other) {
+      builder = inlineBuilder();
+      takeFrom(other);
+    }
+    return *this;
+  }
+  KJ_DISALLOW_COPY(SmallVector);
+
+  inline operator ArrayPtr<T>() { return builder; }
+  inline operator ArrayPtr<const T>() const { return builder; }
+  inline ArrayPtr<T> asPtr() { return builder.asPtr(); }
+  inline ArrayPtr<const T> asPtr() const { return builder.asPtr(); }
+
+  inline size_t size() const { return builder.size(); }
+  inline bool empty() const { return size() == 0; }
+  inline size_t capacity() const { return builder.capacity(); }
+  inline T& operator[](size_t index) const { return builder[index]; }
+
+  inline const T* begin() const { return builder.begin(); }
+  inline const T* end() const { return builder.end(); }
+  inline const T& front() const { return builder.front(); }
+  inline const T& back() const { return builder.back(); }
+  inline T* begin() { return builder.begin(); }
+  inline T* end() { return builder.end(); }
+  inline T& front() { return builder.front(); }
+  inline T& back() { return builder.back(); }
+
+  inline bool isInline() const {
+    // True if the elements currently live inside this object rather than on the heap.
+    return builder.begin() == inlinePtr();
+  }
+
+  inline Array<T> releaseAsArray() {
+    if (isInline() || !builder.isFull()) {
+      // Inline storage can't be handed out, so this always moves into a right-sized heap array.
+      setCapacity(size());
+    }
+    Array<T> result = builder.finish();
+    builder = inlineBuilder();
+    return result;
+  }
+
+  template <typename U>
+  inline bool operator==(const U& other) const { return asPtr() == other; }
+  template <typename U>
+  inline bool operator!=(const U& other) const { return asPtr() != other; }
+
+  inline ArrayPtr<T> slice(size_t start, size_t end) {
+    return asPtr().slice(start, end);
+  }
+  inline ArrayPtr<const T> slice(size_t start, size_t end) const {
+    return asPtr().slice(start, end);
+  }
+
+  template <typename... Params>
+  inline T& add(Params&&... params) {
+    if (builder.isFull()) grow();
+    return builder.add(kj::fwd<Params>(params)...);
+  }
+
+  template <typename Iterator>
+  inline void addAll(Iterator begin, Iterator end) {
+    size_t needed = builder.size() + (end - begin);
+    if (needed > builder.capacity()) grow(needed);
+    builder.addAll(begin, end);
+  }
+
+  template <typename Container>
+  inline void addAll(Container&& container) {
+    addAll(container.begin(), container.end());
+  }
+
+  inline void removeLast() {
+    builder.removeLast();
+  }
+
+  inline void resize(size_t size) {
+    if (size > builder.capacity()) grow(size);
+    builder.resize(size);
+  }
+
+  inline void operator=(decltype(nullptr)) {
+    builder = inlineBuilder();
+  }
+
+  inline void clear() {
+    builder.resize(0);
+  }
+
+  inline void truncate(size_t size) {
+    builder.truncate(size);
+  }
+
+  inline void reserve(size_t size) {
+    if (size > builder.capacity()) {
+      setCapacity(size);
+    }
+  }
+
+private:
+  alignas(T) byte space[sizeof(T) * inlineCapacity];
+  ArrayBuilder<T> builder;
+  // Declared after `space` so that it destroys the inline elements before `space` goes away.
+
+  inline T* inlinePtr() { return reinterpret_cast<T*>(space); }
+  inline const T* inlinePtr() const { return reinterpret_cast<const T*>(space); }
+
+  inline ArrayBuilder<T> inlineBuilder() {
+    // DestructorOnlyArrayDisposer destroys the elements but doesn't try to free the space.
+    return ArrayBuilder<T>(inlinePtr(), inlineCapacity, DestructorOnlyArrayDisposer::instance);
+  }
+
+  void takeFrom(SmallVector& other) {
+    // Expects `builder` to be empty and inline.
+    if (other.isInline()) {
+      builder.addAll(kj::mv(other.builder));
+      other.builder.truncate(0);
+    } else {
+      builder = kj::mv(other.builder);
+      other.builder = other.inlineBuilder();
+    }
+  }
+
+  void grow(size_t minCapacity = 0) {
+    setCapacity(kj::max(minCapacity, capacity() * 2));
+  }
+  void setCapacity(size_t newSize) {
+    if (builder.size() > newSize) {
+      builder.truncate(newSize);
+    }
+    ArrayBuilder<T> newBuilder = heapArrayBuilder<T>(newSize);
+    newBuilder.addAll(kj::mv(builder));
+    builder = kj::mv(newBuilder);
+  }
+};
+
+template <typename T, size_t inlineCapacity>
+inline auto KJ_STRINGIFY(const SmallVector<T, inlineCapacity>& v)
+    -> decltype(toCharSequence(v.asPtr())) {
+  return toCharSequence(v.asPtr());
+}
+
 }  // namespace kj